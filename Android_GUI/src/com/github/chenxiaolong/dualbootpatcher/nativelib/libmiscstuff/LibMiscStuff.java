@@ -21,11 +21,30 @@ import java.io.IOException;
 
 @SuppressWarnings("JniMissingFunction")
 public final class LibMiscStuff {
+    // Indexes into the array returned by extractArchiveProgress()
+    public static final int EXTRACT_PROGRESS_BYTES_READ = 0;
+    public static final int EXTRACT_PROGRESS_BYTES_TOTAL = 1;
+    public static final int EXTRACT_PROGRESS_BYTES_WRITTEN = 2;
+    public static final int EXTRACT_PROGRESS_ENTRIES_WRITTEN = 3;
+    public static final int EXTRACT_PROGRESS_DONE = 4;
+
     private LibMiscStuff() {
     }
 
     public static native void extractArchive(String filename, String target) throws IOException;
 
+    // Extraction job API. Every job returned by extractArchiveStart() must be passed to
+    // extractArchiveFinish(), which returns false if the job was cancelled. Passing null for
+    // entries extracts the whole archive.
+    public static native long extractArchiveStart(String filename, String target,
+                                                  String[] entries) throws IOException;
+
+    public static native long[] extractArchiveProgress(long job);
+
+    public static native void extractArchiveCancel(long job);
+
+    public static native boolean extractArchiveFinish(long job) throws IOException;
+
     public static native void mblogSetLogcat();
 
     public static native String getBootImageRomId(String filename) throws IOException;
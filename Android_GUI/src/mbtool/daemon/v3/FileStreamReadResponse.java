@@ -0,0 +1,42 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class FileStreamReadResponse extends Table {
+  public static FileStreamReadResponse getRootAsFileStreamReadResponse(ByteBuffer _bb) { return getRootAsFileStreamReadResponse(_bb, new FileStreamReadResponse()); }
+  public static FileStreamReadResponse getRootAsFileStreamReadResponse(ByteBuffer _bb, FileStreamReadResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public FileStreamReadResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public boolean success() { int o = __offset(4); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public long bytesRead() { int o = __offset(6); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public FileStreamReadError error() { return error(new FileStreamReadError()); }
+  public FileStreamReadError error(FileStreamReadError obj) { int o = __offset(8); return o != 0 ? obj.__assign(__indirect(o + bb_pos), bb) : null; }
+
+  public static int createFileStreamReadResponse(FlatBufferBuilder builder,
+      boolean success,
+      long bytes_read,
+      int errorOffset) {
+    builder.startObject(3);
+    FileStreamReadResponse.addBytesRead(builder, bytes_read);
+    FileStreamReadResponse.addError(builder, errorOffset);
+    FileStreamReadResponse.addSuccess(builder, success);
+    return FileStreamReadResponse.endFileStreamReadResponse(builder);
+  }
+
+  public static void startFileStreamReadResponse(FlatBufferBuilder builder) { builder.startObject(3); }
+  public static void addSuccess(FlatBufferBuilder builder, boolean success) { builder.addBoolean(0, success, false); }
+  public static void addBytesRead(FlatBufferBuilder builder, long bytesRead) { builder.addLong(1, bytesRead, 0L); }
+  public static void addError(FlatBufferBuilder builder, int errorOffset) { builder.addOffset(2, errorOffset, 0); }
+  public static int endFileStreamReadResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
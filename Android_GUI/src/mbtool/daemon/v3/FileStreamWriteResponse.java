@@ -0,0 +1,42 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class FileStreamWriteResponse extends Table {
+  public static FileStreamWriteResponse getRootAsFileStreamWriteResponse(ByteBuffer _bb) { return getRootAsFileStreamWriteResponse(_bb, new FileStreamWriteResponse()); }
+  public static FileStreamWriteResponse getRootAsFileStreamWriteResponse(ByteBuffer _bb, FileStreamWriteResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public FileStreamWriteResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public boolean success() { int o = __offset(4); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public long bytesWritten() { int o = __offset(6); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public FileStreamWriteError error() { return error(new FileStreamWriteError()); }
+  public FileStreamWriteError error(FileStreamWriteError obj) { int o = __offset(8); return o != 0 ? obj.__assign(__indirect(o + bb_pos), bb) : null; }
+
+  public static int createFileStreamWriteResponse(FlatBufferBuilder builder,
+      boolean success,
+      long bytes_written,
+      int errorOffset) {
+    builder.startObject(3);
+    FileStreamWriteResponse.addBytesWritten(builder, bytes_written);
+    FileStreamWriteResponse.addError(builder, errorOffset);
+    FileStreamWriteResponse.addSuccess(builder, success);
+    return FileStreamWriteResponse.endFileStreamWriteResponse(builder);
+  }
+
+  public static void startFileStreamWriteResponse(FlatBufferBuilder builder) { builder.startObject(3); }
+  public static void addSuccess(FlatBufferBuilder builder, boolean success) { builder.addBoolean(0, success, false); }
+  public static void addBytesWritten(FlatBufferBuilder builder, long bytesWritten) { builder.addLong(1, bytesWritten, 0L); }
+  public static void addError(FlatBufferBuilder builder, int errorOffset) { builder.addOffset(2, errorOffset, 0); }
+  public static int endFileStreamWriteResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
@@ -0,0 +1,34 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class JobError extends Table {
+  public static JobError getRootAsJobError(ByteBuffer _bb) { return getRootAsJobError(_bb, new JobError()); }
+  public static JobError getRootAsJobError(ByteBuffer _bb, JobError obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public JobError __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public String msg() { int o = __offset(4); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer msgAsByteBuffer() { return __vector_as_bytebuffer(4, 1); }
+
+  public static int createJobError(FlatBufferBuilder builder,
+      int msgOffset) {
+    builder.startObject(1);
+    JobError.addMsg(builder, msgOffset);
+    return JobError.endJobError(builder);
+  }
+
+  public static void startJobError(FlatBufferBuilder builder) { builder.startObject(1); }
+  public static void addMsg(FlatBufferBuilder builder, int msgOffset) { builder.addOffset(0, msgOffset, 0); }
+  public static int endJobError(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
@@ -0,0 +1,41 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class JobEventResponse extends Table {
+  public static JobEventResponse getRootAsJobEventResponse(ByteBuffer _bb) { return getRootAsJobEventResponse(_bb, new JobEventResponse()); }
+  public static JobEventResponse getRootAsJobEventResponse(ByteBuffer _bb, JobEventResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public JobEventResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public JobProgress progress() { return progress(new JobProgress()); }
+  public JobProgress progress(JobProgress obj) { int o = __offset(4); return o != 0 ? obj.__assign(__indirect(o + bb_pos), bb) : null; }
+  public String outputLines(int j) { int o = __offset(6); return o != 0 ? __string(__vector(o) + j * 4) : null; }
+  public int outputLinesLength() { int o = __offset(6); return o != 0 ? __vector_len(o) : 0; }
+
+  public static int createJobEventResponse(FlatBufferBuilder builder,
+      int progressOffset,
+      int output_linesOffset) {
+    builder.startObject(2);
+    JobEventResponse.addOutputLines(builder, output_linesOffset);
+    JobEventResponse.addProgress(builder, progressOffset);
+    return JobEventResponse.endJobEventResponse(builder);
+  }
+
+  public static void startJobEventResponse(FlatBufferBuilder builder) { builder.startObject(2); }
+  public static void addProgress(FlatBufferBuilder builder, int progressOffset) { builder.addOffset(0, progressOffset, 0); }
+  public static void addOutputLines(FlatBufferBuilder builder, int outputLinesOffset) { builder.addOffset(1, outputLinesOffset, 0); }
+  public static int createOutputLinesVector(FlatBufferBuilder builder, int[] data) { builder.startVector(4, data.length, 4); for (int i = data.length - 1; i >= 0; i--) builder.addOffset(data[i]); return builder.endVector(); }
+  public static void startOutputLinesVector(FlatBufferBuilder builder, int numElems) { builder.startVector(4, numElems, 4); }
+  public static int endJobEventResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
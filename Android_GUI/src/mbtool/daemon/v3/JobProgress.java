@@ -0,0 +1,54 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class JobProgress extends Table {
+  public static JobProgress getRootAsJobProgress(ByteBuffer _bb) { return getRootAsJobProgress(_bb, new JobProgress()); }
+  public static JobProgress getRootAsJobProgress(ByteBuffer _bb, JobProgress obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public JobProgress __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public short state() { int o = __offset(4); return o != 0 ? bb.getShort(o + bb_pos) : 0; }
+  public String stage() { int o = __offset(6); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer stageAsByteBuffer() { return __vector_as_bytebuffer(6, 1); }
+  public long bytesDone() { int o = __offset(8); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long bytesTotal() { int o = __offset(10); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long filesDone() { int o = __offset(12); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long filesTotal() { int o = __offset(14); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+
+  public static int createJobProgress(FlatBufferBuilder builder,
+      short state,
+      int stageOffset,
+      long bytes_done,
+      long bytes_total,
+      long files_done,
+      long files_total) {
+    builder.startObject(6);
+    JobProgress.addFilesTotal(builder, files_total);
+    JobProgress.addFilesDone(builder, files_done);
+    JobProgress.addBytesTotal(builder, bytes_total);
+    JobProgress.addBytesDone(builder, bytes_done);
+    JobProgress.addStage(builder, stageOffset);
+    JobProgress.addState(builder, state);
+    return JobProgress.endJobProgress(builder);
+  }
+
+  public static void startJobProgress(FlatBufferBuilder builder) { builder.startObject(6); }
+  public static void addState(FlatBufferBuilder builder, short state) { builder.addShort(0, state, 0); }
+  public static void addStage(FlatBufferBuilder builder, int stageOffset) { builder.addOffset(1, stageOffset, 0); }
+  public static void addBytesDone(FlatBufferBuilder builder, long bytesDone) { builder.addLong(2, bytesDone, 0L); }
+  public static void addBytesTotal(FlatBufferBuilder builder, long bytesTotal) { builder.addLong(3, bytesTotal, 0L); }
+  public static void addFilesDone(FlatBufferBuilder builder, long filesDone) { builder.addLong(4, filesDone, 0L); }
+  public static void addFilesTotal(FlatBufferBuilder builder, long filesTotal) { builder.addLong(5, filesTotal, 0L); }
+  public static int endJobProgress(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
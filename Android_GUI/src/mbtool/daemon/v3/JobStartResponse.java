@@ -0,0 +1,42 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class JobStartResponse extends Table {
+  public static JobStartResponse getRootAsJobStartResponse(ByteBuffer _bb) { return getRootAsJobStartResponse(_bb, new JobStartResponse()); }
+  public static JobStartResponse getRootAsJobStartResponse(ByteBuffer _bb, JobStartResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public JobStartResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public boolean success() { int o = __offset(4); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public long id() { int o = __offset(6); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public JobError error() { return error(new JobError()); }
+  public JobError error(JobError obj) { int o = __offset(8); return o != 0 ? obj.__assign(__indirect(o + bb_pos), bb) : null; }
+
+  public static int createJobStartResponse(FlatBufferBuilder builder,
+      boolean success,
+      long id,
+      int errorOffset) {
+    builder.startObject(3);
+    JobStartResponse.addId(builder, id);
+    JobStartResponse.addError(builder, errorOffset);
+    JobStartResponse.addSuccess(builder, success);
+    return JobStartResponse.endJobStartResponse(builder);
+  }
+
+  public static void startJobStartResponse(FlatBufferBuilder builder) { builder.startObject(3); }
+  public static void addSuccess(FlatBufferBuilder builder, boolean success) { builder.addBoolean(0, success, false); }
+  public static void addId(FlatBufferBuilder builder, long id) { builder.addLong(1, id, 0L); }
+  public static void addError(FlatBufferBuilder builder, int errorOffset) { builder.addOffset(2, errorOffset, 0); }
+  public static int endJobStartResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
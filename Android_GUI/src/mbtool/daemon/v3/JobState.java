@@ -0,0 +1,17 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+public final class JobState {
+  private JobState() { }
+  public static final short QUEUED = 0;
+  public static final short RUNNING = 1;
+  public static final short FINISHED = 2;
+  public static final short FAILED = 3;
+  public static final short CANCELLED = 4;
+
+  public static final String[] names = { "QUEUED", "RUNNING", "FINISHED", "FAILED", "CANCELLED", };
+
+  public static String name(int e) { return names[e]; }
+}
+
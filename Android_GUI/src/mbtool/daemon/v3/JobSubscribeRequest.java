@@ -0,0 +1,33 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class JobSubscribeRequest extends Table {
+  public static JobSubscribeRequest getRootAsJobSubscribeRequest(ByteBuffer _bb) { return getRootAsJobSubscribeRequest(_bb, new JobSubscribeRequest()); }
+  public static JobSubscribeRequest getRootAsJobSubscribeRequest(ByteBuffer _bb, JobSubscribeRequest obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public JobSubscribeRequest __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public long id() { int o = __offset(4); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+
+  public static int createJobSubscribeRequest(FlatBufferBuilder builder,
+      long id) {
+    builder.startObject(1);
+    JobSubscribeRequest.addId(builder, id);
+    return JobSubscribeRequest.endJobSubscribeRequest(builder);
+  }
+
+  public static void startJobSubscribeRequest(FlatBufferBuilder builder) { builder.startObject(1); }
+  public static void addId(FlatBufferBuilder builder, long id) { builder.addLong(0, id, 0L); }
+  public static int endJobSubscribeRequest(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
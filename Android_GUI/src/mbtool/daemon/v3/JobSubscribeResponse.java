@@ -0,0 +1,51 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class JobSubscribeResponse extends Table {
+  public static JobSubscribeResponse getRootAsJobSubscribeResponse(ByteBuffer _bb) { return getRootAsJobSubscribeResponse(_bb, new JobSubscribeResponse()); }
+  public static JobSubscribeResponse getRootAsJobSubscribeResponse(ByteBuffer _bb, JobSubscribeResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public JobSubscribeResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public boolean success() { int o = __offset(4); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public JobProgress progress() { return progress(new JobProgress()); }
+  public JobProgress progress(JobProgress obj) { int o = __offset(6); return o != 0 ? obj.__assign(__indirect(o + bb_pos), bb) : null; }
+  public int response(int j) { int o = __offset(8); return o != 0 ? bb.get(__vector(o) + j * 1) & 0xFF : 0; }
+  public int responseLength() { int o = __offset(8); return o != 0 ? __vector_len(o) : 0; }
+  public ByteBuffer responseAsByteBuffer() { return __vector_as_bytebuffer(8, 1); }
+  public JobError error() { return error(new JobError()); }
+  public JobError error(JobError obj) { int o = __offset(10); return o != 0 ? obj.__assign(__indirect(o + bb_pos), bb) : null; }
+
+  public static int createJobSubscribeResponse(FlatBufferBuilder builder,
+      boolean success,
+      int progressOffset,
+      int responseOffset,
+      int errorOffset) {
+    builder.startObject(4);
+    JobSubscribeResponse.addError(builder, errorOffset);
+    JobSubscribeResponse.addResponse(builder, responseOffset);
+    JobSubscribeResponse.addProgress(builder, progressOffset);
+    JobSubscribeResponse.addSuccess(builder, success);
+    return JobSubscribeResponse.endJobSubscribeResponse(builder);
+  }
+
+  public static void startJobSubscribeResponse(FlatBufferBuilder builder) { builder.startObject(4); }
+  public static void addSuccess(FlatBufferBuilder builder, boolean success) { builder.addBoolean(0, success, false); }
+  public static void addProgress(FlatBufferBuilder builder, int progressOffset) { builder.addOffset(1, progressOffset, 0); }
+  public static void addResponse(FlatBufferBuilder builder, int responseOffset) { builder.addOffset(2, responseOffset, 0); }
+  public static int createResponseVector(FlatBufferBuilder builder, byte[] data) { builder.startVector(1, data.length, 1); for (int i = data.length - 1; i >= 0; i--) builder.addByte(data[i]); return builder.endVector(); }
+  public static void startResponseVector(FlatBufferBuilder builder, int numElems) { builder.startVector(1, numElems, 1); }
+  public static void addError(FlatBufferBuilder builder, int errorOffset) { builder.addOffset(3, errorOffset, 0); }
+  public static int endJobSubscribeResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
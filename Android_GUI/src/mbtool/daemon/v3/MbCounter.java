@@ -0,0 +1,38 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class MbCounter extends Table {
+  public static MbCounter getRootAsMbCounter(ByteBuffer _bb) { return getRootAsMbCounter(_bb, new MbCounter()); }
+  public static MbCounter getRootAsMbCounter(ByteBuffer _bb, MbCounter obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public MbCounter __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public String name() { int o = __offset(4); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer nameAsByteBuffer() { return __vector_as_bytebuffer(4, 1); }
+  public long value() { int o = __offset(6); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+
+  public static int createMbCounter(FlatBufferBuilder builder,
+      int nameOffset,
+      long value) {
+    builder.startObject(2);
+    MbCounter.addValue(builder, value);
+    MbCounter.addName(builder, nameOffset);
+    return MbCounter.endMbCounter(builder);
+  }
+
+  public static void startMbCounter(FlatBufferBuilder builder) { builder.startObject(2); }
+  public static void addName(FlatBufferBuilder builder, int nameOffset) { builder.addOffset(0, nameOffset, 0); }
+  public static void addValue(FlatBufferBuilder builder, long value) { builder.addLong(1, value, 0L); }
+  public static int endMbCounter(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
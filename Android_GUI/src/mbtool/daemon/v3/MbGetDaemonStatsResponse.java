@@ -0,0 +1,45 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class MbGetDaemonStatsResponse extends Table {
+  public static MbGetDaemonStatsResponse getRootAsMbGetDaemonStatsResponse(ByteBuffer _bb) { return getRootAsMbGetDaemonStatsResponse(_bb, new MbGetDaemonStatsResponse()); }
+  public static MbGetDaemonStatsResponse getRootAsMbGetDaemonStatsResponse(ByteBuffer _bb, MbGetDaemonStatsResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public MbGetDaemonStatsResponse __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public MbRequestStats stats(int j) { return stats(new MbRequestStats(), j); }
+  public MbRequestStats stats(MbRequestStats obj, int j) { int o = __offset(4); return o != 0 ? obj.__assign(__indirect(__vector(o) + j * 4), bb) : null; }
+  public int statsLength() { int o = __offset(4); return o != 0 ? __vector_len(o) : 0; }
+  public MbCounter counters(int j) { return counters(new MbCounter(), j); }
+  public MbCounter counters(MbCounter obj, int j) { int o = __offset(6); return o != 0 ? obj.__assign(__indirect(__vector(o) + j * 4), bb) : null; }
+  public int countersLength() { int o = __offset(6); return o != 0 ? __vector_len(o) : 0; }
+
+  public static int createMbGetDaemonStatsResponse(FlatBufferBuilder builder,
+      int statsOffset,
+      int countersOffset) {
+    builder.startObject(2);
+    MbGetDaemonStatsResponse.addCounters(builder, countersOffset);
+    MbGetDaemonStatsResponse.addStats(builder, statsOffset);
+    return MbGetDaemonStatsResponse.endMbGetDaemonStatsResponse(builder);
+  }
+
+  public static void startMbGetDaemonStatsResponse(FlatBufferBuilder builder) { builder.startObject(2); }
+  public static void addStats(FlatBufferBuilder builder, int statsOffset) { builder.addOffset(0, statsOffset, 0); }
+  public static int createStatsVector(FlatBufferBuilder builder, int[] data) { builder.startVector(4, data.length, 4); for (int i = data.length - 1; i >= 0; i--) builder.addOffset(data[i]); return builder.endVector(); }
+  public static void startStatsVector(FlatBufferBuilder builder, int numElems) { builder.startVector(4, numElems, 4); }
+  public static void addCounters(FlatBufferBuilder builder, int countersOffset) { builder.addOffset(1, countersOffset, 0); }
+  public static int createCountersVector(FlatBufferBuilder builder, int[] data) { builder.startVector(4, data.length, 4); for (int i = data.length - 1; i >= 0; i--) builder.addOffset(data[i]); return builder.endVector(); }
+  public static void startCountersVector(FlatBufferBuilder builder, int numElems) { builder.startVector(4, numElems, 4); }
+  public static int endMbGetDaemonStatsResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
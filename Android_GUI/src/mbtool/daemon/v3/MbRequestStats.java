@@ -0,0 +1,46 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class MbRequestStats extends Table {
+  public static MbRequestStats getRootAsMbRequestStats(ByteBuffer _bb) { return getRootAsMbRequestStats(_bb, new MbRequestStats()); }
+  public static MbRequestStats getRootAsMbRequestStats(ByteBuffer _bb, MbRequestStats obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public MbRequestStats __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public String name() { int o = __offset(4); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer nameAsByteBuffer() { return __vector_as_bytebuffer(4, 1); }
+  public long count() { int o = __offset(6); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long errors() { int o = __offset(8); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long totalTimeNs() { int o = __offset(10); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+
+  public static int createMbRequestStats(FlatBufferBuilder builder,
+      int nameOffset,
+      long count,
+      long errors,
+      long total_time_ns) {
+    builder.startObject(4);
+    MbRequestStats.addTotalTimeNs(builder, total_time_ns);
+    MbRequestStats.addErrors(builder, errors);
+    MbRequestStats.addCount(builder, count);
+    MbRequestStats.addName(builder, nameOffset);
+    return MbRequestStats.endMbRequestStats(builder);
+  }
+
+  public static void startMbRequestStats(FlatBufferBuilder builder) { builder.startObject(4); }
+  public static void addName(FlatBufferBuilder builder, int nameOffset) { builder.addOffset(0, nameOffset, 0); }
+  public static void addCount(FlatBufferBuilder builder, long count) { builder.addLong(1, count, 0L); }
+  public static void addErrors(FlatBufferBuilder builder, long errors) { builder.addLong(2, errors, 0L); }
+  public static void addTotalTimeNs(FlatBufferBuilder builder, long totalTimeNs) { builder.addLong(3, totalTimeNs, 0L); }
+  public static int endMbRequestStats(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
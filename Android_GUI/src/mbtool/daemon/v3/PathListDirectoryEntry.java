@@ -0,0 +1,53 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class PathListDirectoryEntry extends Table {
+  public static PathListDirectoryEntry getRootAsPathListDirectoryEntry(ByteBuffer _bb) { return getRootAsPathListDirectoryEntry(_bb, new PathListDirectoryEntry()); }
+  public static PathListDirectoryEntry getRootAsPathListDirectoryEntry(ByteBuffer _bb, PathListDirectoryEntry obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public PathListDirectoryEntry __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public String name() { int o = __offset(4); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer nameAsByteBuffer() { return __vector_as_bytebuffer(4, 1); }
+  public long type() { int o = __offset(6); return o != 0 ? (long)bb.getInt(o + bb_pos) & 0xFFFFFFFFL : 0L; }
+  public mbtool.daemon.v3.StructStat stat() { return stat(new mbtool.daemon.v3.StructStat()); }
+  public mbtool.daemon.v3.StructStat stat(mbtool.daemon.v3.StructStat obj) { int o = __offset(8); return o != 0 ? obj.__assign(__indirect(o + bb_pos), bb) : null; }
+  public String symlinkTarget() { int o = __offset(10); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer symlinkTargetAsByteBuffer() { return __vector_as_bytebuffer(10, 1); }
+  public String selinuxLabel() { int o = __offset(12); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer selinuxLabelAsByteBuffer() { return __vector_as_bytebuffer(12, 1); }
+
+  public static int createPathListDirectoryEntry(FlatBufferBuilder builder,
+      int nameOffset,
+      long type,
+      int statOffset,
+      int symlink_targetOffset,
+      int selinux_labelOffset) {
+    builder.startObject(5);
+    PathListDirectoryEntry.addSelinuxLabel(builder, selinux_labelOffset);
+    PathListDirectoryEntry.addSymlinkTarget(builder, symlink_targetOffset);
+    PathListDirectoryEntry.addStat(builder, statOffset);
+    PathListDirectoryEntry.addType(builder, type);
+    PathListDirectoryEntry.addName(builder, nameOffset);
+    return PathListDirectoryEntry.endPathListDirectoryEntry(builder);
+  }
+
+  public static void startPathListDirectoryEntry(FlatBufferBuilder builder) { builder.startObject(5); }
+  public static void addName(FlatBufferBuilder builder, int nameOffset) { builder.addOffset(0, nameOffset, 0); }
+  public static void addType(FlatBufferBuilder builder, long type) { builder.addInt(1, (int)type, (int)0L); }
+  public static void addStat(FlatBufferBuilder builder, int statOffset) { builder.addOffset(2, statOffset, 0); }
+  public static void addSymlinkTarget(FlatBufferBuilder builder, int symlinkTargetOffset) { builder.addOffset(3, symlinkTargetOffset, 0); }
+  public static void addSelinuxLabel(FlatBufferBuilder builder, int selinuxLabelOffset) { builder.addOffset(4, selinuxLabelOffset, 0); }
+  public static int endPathListDirectoryEntry(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
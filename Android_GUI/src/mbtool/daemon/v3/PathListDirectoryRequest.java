@@ -0,0 +1,54 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+package mbtool.daemon.v3;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+@SuppressWarnings("unused")
+public final class PathListDirectoryRequest extends Table {
+  public static PathListDirectoryRequest getRootAsPathListDirectoryRequest(ByteBuffer _bb) { return getRootAsPathListDirectoryRequest(_bb, new PathListDirectoryRequest()); }
+  public static PathListDirectoryRequest getRootAsPathListDirectoryRequest(ByteBuffer _bb, PathListDirectoryRequest obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__assign(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public void __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; }
+  public PathListDirectoryRequest __assign(int _i, ByteBuffer _bb) { __init(_i, _bb); return this; }
+
+  public String path() { int o = __offset(4); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer pathAsByteBuffer() { return __vector_as_bytebuffer(4, 1); }
+  public boolean stat() { int o = __offset(6); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public boolean symlinkTarget() { int o = __offset(8); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public boolean selinuxLabel() { int o = __offset(10); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public long cookie() { int o = __offset(12); return o != 0 ? bb.getLong(o + bb_pos) : 0L; }
+  public long maxEntries() { int o = __offset(14); return o != 0 ? (long)bb.getInt(o + bb_pos) & 0xFFFFFFFFL : 0L; }
+
+  public static int createPathListDirectoryRequest(FlatBufferBuilder builder,
+      int pathOffset,
+      boolean stat,
+      boolean symlink_target,
+      boolean selinux_label,
+      long cookie,
+      long max_entries) {
+    builder.startObject(6);
+    PathListDirectoryRequest.addCookie(builder, cookie);
+    PathListDirectoryRequest.addMaxEntries(builder, max_entries);
+    PathListDirectoryRequest.addPath(builder, pathOffset);
+    PathListDirectoryRequest.addSelinuxLabel(builder, selinux_label);
+    PathListDirectoryRequest.addSymlinkTarget(builder, symlink_target);
+    PathListDirectoryRequest.addStat(builder, stat);
+    return PathListDirectoryRequest.endPathListDirectoryRequest(builder);
+  }
+
+  public static void startPathListDirectoryRequest(FlatBufferBuilder builder) { builder.startObject(6); }
+  public static void addPath(FlatBufferBuilder builder, int pathOffset) { builder.addOffset(0, pathOffset, 0); }
+  public static void addStat(FlatBufferBuilder builder, boolean stat) { builder.addBoolean(1, stat, false); }
+  public static void addSymlinkTarget(FlatBufferBuilder builder, boolean symlinkTarget) { builder.addBoolean(2, symlinkTarget, false); }
+  public static void addSelinuxLabel(FlatBufferBuilder builder, boolean selinuxLabel) { builder.addBoolean(3, selinuxLabel, false); }
+  public static void addCookie(FlatBufferBuilder builder, long cookie) { builder.addLong(4, cookie, 0L); }
+  public static void addMaxEntries(FlatBufferBuilder builder, long maxEntries) { builder.addInt(5, (int)maxEntries, (int)0L); }
+  public static int endPathListDirectoryRequest(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+}
+
@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks for tar archive creation in libmbutil.
+ *
+ * A directory tree with a mix of compressible and incompressible files is
+ * archived with libarchive_tar_create() once per compression type, which is
+ * what mbtool's backup code does for each partition. gzip and LZ4 compression
+ * run on a thread pool, so wall clock time is reported.
+ */
+
+#include <string>
+#include <vector>
+
+#include <cstdio>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+#include "mblog/logging.h"
+#include "mbutil/archive.h"
+#include "mbutil/delete.h"
+#include "mbutil/directory.h"
+
+#include "bench_common.h"
+
+#define BENCH_DIR_COUNT                 8
+#define BENCH_FILE_COUNT                64
+#define BENCH_FILE_SIZE                 (256 * 1024)
+
+using namespace mb::util;
+
+static const std::string & source_dir()
+{
+    static std::string dir;
+
+    if (dir.empty()) {
+        std::string data;
+
+        // Every archived path is logged at the verbose level
+        mb::log::log_set_level(mb::log::LogLevel::Warning);
+
+        dir = bench::temp_path("archive.src");
+        delete_recursive(dir);
+
+        for (int i = 0; i < BENCH_FILE_COUNT; ++i) {
+            std::string subdir = dir + "/dir"
+                    + std::to_string(i % BENCH_DIR_COUNT);
+            std::string path = subdir + "/file" + std::to_string(i);
+
+            // Half of the files compress well
+            if (i % 2 == 0) {
+                bench::fill_text(data, BENCH_FILE_SIZE,
+                                 static_cast<uint32_t>(i));
+            } else {
+                bench::fill_random(data, BENCH_FILE_SIZE,
+                                   static_cast<uint32_t>(i));
+            }
+
+            if (!mkdir_recursive(subdir, 0755)
+                    || !bench::write_file(path, data)) {
+                fprintf(stderr, "%s: Failed to write file\n", path.c_str());
+            }
+        }
+    }
+
+    return dir;
+}
+
+template<compression_type C>
+static void BM_TarCreate(benchmark::State &state)
+{
+    const std::string &dir = source_dir();
+    std::string output = bench::temp_path("archive.tar");
+    std::vector<std::string> paths;
+    struct stat sb = {};
+
+    for (int i = 0; i < BENCH_DIR_COUNT; ++i) {
+        paths.push_back("dir" + std::to_string(i));
+    }
+
+    for (auto _ : state) {
+        if (!libarchive_tar_create(output, dir, paths, C)) {
+            state.SkipWithError("Failed to create archive");
+            break;
+        }
+    }
+
+    if (stat(output.c_str(), &sb) == 0) {
+        state.counters["ratio"] = static_cast<double>(sb.st_size)
+                / (BENCH_FILE_COUNT * BENCH_FILE_SIZE);
+    }
+
+    unlink(output.c_str());
+
+    state.SetBytesProcessed(state.iterations()
+            * BENCH_FILE_COUNT * BENCH_FILE_SIZE);
+}
+
+BENCHMARK_TEMPLATE(BM_TarCreate, compression_type::NONE)
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_TarCreate, compression_type::LZ4)
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_TarCreate, compression_type::GZIP)
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_TarCreate, compression_type::XZ)
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks for the libmbbootimg readers and writers.
+ *
+ * Images are packed into and unpacked from memory so that only the format
+ * code is measured. Loki and MTK images need extra payloads; they are covered
+ * by libmbbootimg/benchmarks/bench_main.cpp, which also reports syscall
+ * counts for file-backed images.
+ */
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdlib>
+
+#include <benchmark/benchmark.h>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+#include "bench_common.h"
+
+#define BENCH_READ_BUF_SIZE             (1024 * 1024)
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+struct BenchFormat
+{
+    const char *name;
+    int code;
+};
+
+static BenchFormat formats[] = {
+    { "android",  MB_BI_FORMAT_ANDROID  },
+    { "bump",     MB_BI_FORMAT_BUMP     },
+    { "sony_elf", MB_BI_FORMAT_SONY_ELF },
+};
+
+struct BenchPayloads
+{
+    std::string kernel;
+    std::string ramdisk;
+};
+
+static const BenchPayloads & payloads(size_t size)
+{
+    static BenchPayloads cached;
+
+    if (cached.kernel.size() != size) {
+        bench::fill_random(cached.kernel, size, 1);
+        bench::fill_random(cached.ramdisk, size, 2);
+    }
+
+    return cached;
+}
+
+static void set_header_fields(MbBiHeader *header)
+{
+    uint64_t fields = mb_bi_header_supported_fields(header);
+
+    if (fields & MB_BI_HEADER_FIELD_KERNEL_CMDLINE) {
+        mb_bi_header_set_kernel_cmdline(header, "console=null");
+    }
+    if (fields & MB_BI_HEADER_FIELD_PAGE_SIZE) {
+        mb_bi_header_set_page_size(header, 2048);
+    }
+    if (fields & MB_BI_HEADER_FIELD_KERNEL_ADDRESS) {
+        mb_bi_header_set_kernel_address(header, 0x10008000);
+    }
+    if (fields & MB_BI_HEADER_FIELD_RAMDISK_ADDRESS) {
+        mb_bi_header_set_ramdisk_address(header, 0x11000000);
+    }
+    if (fields & MB_BI_HEADER_FIELD_SECONDBOOT_ADDRESS) {
+        mb_bi_header_set_secondboot_address(header, 0x10f00000);
+    }
+    if (fields & MB_BI_HEADER_FIELD_KERNEL_TAGS_ADDRESS) {
+        mb_bi_header_set_kernel_tags_address(header, 0x10000100);
+    }
+    if (fields & MB_BI_HEADER_FIELD_ENTRYPOINT) {
+        mb_bi_header_set_entrypoint_address(header, 0x10008000);
+    }
+}
+
+/*!
+ * \brief Pack an image into a memory buffer
+ *
+ * \return Error message or nullptr if successful
+ */
+static const char * pack_image(const BenchFormat &format,
+                               const BenchPayloads &data,
+                               void **buf, size_t *size)
+{
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!biw) {
+        return "Failed to allocate writer";
+    }
+
+    if (mb_bi_writer_set_format_by_code(biw.get(), format.code) != MB_BI_OK
+            || mb_bi_writer_open(biw.get(), new mb::MemoryFile(buf, size),
+                                 true) != MB_BI_OK
+            || mb_bi_writer_get_header(biw.get(), &header) != MB_BI_OK) {
+        return mb_bi_writer_error_string(biw.get());
+    }
+
+    set_header_fields(header);
+
+    if (mb_bi_writer_write_header(biw.get(), header) != MB_BI_OK) {
+        return mb_bi_writer_error_string(biw.get());
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        const std::string *payload = nullptr;
+        size_t n;
+
+        switch (mb_bi_entry_type(entry)) {
+        case MB_BI_ENTRY_KERNEL:
+            payload = &data.kernel;
+            break;
+        case MB_BI_ENTRY_RAMDISK:
+            payload = &data.ramdisk;
+            break;
+        }
+
+        if (mb_bi_writer_write_entry(biw.get(), entry) != MB_BI_OK) {
+            return mb_bi_writer_error_string(biw.get());
+        }
+
+        if (payload && (mb_bi_writer_write_data(
+                biw.get(), payload->data(), payload->size(), &n) != MB_BI_OK
+                || n != payload->size())) {
+            return mb_bi_writer_error_string(biw.get());
+        }
+    }
+
+    if (ret != MB_BI_EOF || mb_bi_writer_close(biw.get()) != MB_BI_OK) {
+        return mb_bi_writer_error_string(biw.get());
+    }
+
+    return nullptr;
+}
+
+/*!
+ * \brief Open image from memory and read its header
+ *
+ * \return Error message or nullptr if successful
+ */
+static const char * open_image(const BenchFormat &format,
+                               const std::string &image, bool bid,
+                               ScopedReader &bir)
+{
+    MbBiHeader *header;
+    int ret;
+
+    bir.reset(mb_bi_reader_new());
+    if (!bir) {
+        return "Failed to allocate reader";
+    }
+
+    if (bid) {
+        ret = mb_bi_reader_enable_format_all(bir.get());
+    } else {
+        ret = mb_bi_reader_set_format_by_code(bir.get(), format.code);
+    }
+
+    if (ret != MB_BI_OK
+            || mb_bi_reader_open(bir.get(), new mb::MemoryFile(
+                    image.data(), image.size()), true) != MB_BI_OK
+            || mb_bi_reader_read_header(bir.get(), &header) != MB_BI_OK) {
+        return mb_bi_reader_error_string(bir.get());
+    }
+
+    if (mb_bi_reader_format_code(bir.get()) != format.code) {
+        return "Image was detected as the wrong format";
+    }
+
+    return nullptr;
+}
+
+static bool make_image(benchmark::State &state, const BenchFormat &format,
+                       std::string &image)
+{
+    void *buf = nullptr;
+    size_t size = 0;
+
+    const char *error = pack_image(
+            format, payloads(static_cast<size_t>(state.range(1)) << 20),
+            &buf, &size);
+    if (error) {
+        state.SkipWithError(error);
+    } else {
+        image.assign(static_cast<char *>(buf), size);
+    }
+
+    free(buf);
+    return !error;
+}
+
+static void BM_BootImagePack(benchmark::State &state)
+{
+    const BenchFormat &format = formats[state.range(0)];
+    const BenchPayloads &data =
+            payloads(static_cast<size_t>(state.range(1)) << 20);
+
+    state.SetLabel(format.name);
+
+    for (auto _ : state) {
+        void *buf = nullptr;
+        size_t size = 0;
+
+        const char *error = pack_image(format, data, &buf, &size);
+        free(buf);
+
+        if (error) {
+            state.SkipWithError(error);
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations()
+            * (data.kernel.size() + data.ramdisk.size()));
+}
+
+// Open and read the header with all formats enabled
+static void BM_BootImageBid(benchmark::State &state)
+{
+    const BenchFormat &format = formats[state.range(0)];
+    std::string image;
+
+    state.SetLabel(format.name);
+
+    if (!make_image(state, format, image)) {
+        return;
+    }
+
+    for (auto _ : state) {
+        ScopedReader bir(nullptr, mb_bi_reader_free);
+
+        const char *error = open_image(format, image, true, bir);
+        if (error) {
+            state.SkipWithError(error);
+            break;
+        }
+    }
+}
+
+// Read the header and the data of every entry with the format forced
+static void BM_BootImageUnpack(benchmark::State &state)
+{
+    const BenchFormat &format = formats[state.range(0)];
+    std::vector<char> buf(BENCH_READ_BUF_SIZE);
+    std::string image;
+    uint64_t bytes = 0;
+
+    state.SetLabel(format.name);
+
+    if (!make_image(state, format, image)) {
+        return;
+    }
+
+    for (auto _ : state) {
+        ScopedReader bir(nullptr, mb_bi_reader_free);
+        MbBiEntry *entry;
+        size_t n;
+        int ret;
+
+        const char *error = open_image(format, image, false, bir);
+        if (error) {
+            state.SkipWithError(error);
+            break;
+        }
+
+        while ((ret = mb_bi_reader_read_entry(bir.get(), &entry))
+                == MB_BI_OK) {
+            while ((ret = mb_bi_reader_read_data(bir.get(), buf.data(),
+                                                 buf.size(), &n))
+                    == MB_BI_OK) {
+                bytes += n;
+            }
+
+            if (ret != MB_BI_EOF) {
+                break;
+            }
+        }
+
+        if (ret != MB_BI_EOF) {
+            state.SkipWithError(mb_bi_reader_error_string(bir.get()));
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(static_cast<int64_t>(bytes));
+}
+
+// Arguments: index into formats[] and kernel/ramdisk size in MiB
+static void format_args(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({ "format", "MiB" });
+
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i) {
+        b->Args({ static_cast<int64_t>(i), 1 });
+        b->Args({ static_cast<int64_t>(i), 16 });
+    }
+}
+
+BENCHMARK(BM_BootImagePack)->Apply(format_args);
+BENCHMARK(BM_BootImageBid)->Apply(format_args);
+BENCHMARK(BM_BootImageUnpack)->Apply(format_args);
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench_common.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace bench
+{
+
+void fill_random(std::string &buf, size_t size, uint32_t seed)
+{
+    buf.resize(size);
+
+    uint32_t state = seed;
+    for (size_t i = 0; i < size; ++i) {
+        state = state * 1103515245 + 12345;
+        buf[i] = static_cast<char>(state >> 16);
+    }
+}
+
+void fill_text(std::string &buf, size_t size, uint32_t seed)
+{
+    static const char *words[] = {
+        "mount", "system", "data", "cache", "boot", "recovery", "package",
+        "extract", "symlink", "set_perm", "format", "ui_print", "\n",
+    };
+
+    buf.clear();
+    buf.reserve(size);
+
+    uint32_t state = seed;
+    while (buf.size() < size) {
+        state = state * 1103515245 + 12345;
+        buf += words[(state >> 16) % (sizeof(words) / sizeof(words[0]))];
+        buf += ' ';
+    }
+
+    buf.resize(size);
+}
+
+std::string temp_path(const char *name)
+{
+    std::string path;
+
+    const char *tmpdir = getenv("TMPDIR");
+    if (tmpdir && *tmpdir) {
+        path = tmpdir;
+    } else {
+#ifdef __ANDROID__
+        path = "/data/local/tmp";
+#else
+        path = "/tmp";
+#endif
+    }
+
+    path += "/mb_bench.";
+    path += name;
+    return path;
+}
+
+bool write_file(const std::string &path, const std::string &data)
+{
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+
+    bool ret = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    return fclose(fp) == 0 && ret;
+}
+
+}
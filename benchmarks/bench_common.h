@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace bench
+{
+
+// Fill buffer with deterministic, poorly compressible data
+void fill_random(std::string &buf, size_t size, uint32_t seed);
+
+// Fill buffer with data resembling text (compressible)
+void fill_text(std::string &buf, size_t size, uint32_t seed);
+
+// Path for a temporary file in $TMPDIR (or the platform default)
+std::string temp_path(const char *name);
+
+// Write buffer to a file, replacing it if it exists
+bool write_file(const std::string &path, const std::string &data);
+
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks for the libmbdevice JSON parser.
+ *
+ * The input is a list of complete device definitions, similar to the
+ * devices.json file that is generated from data/devices.
+ */
+
+#include <string>
+#include <vector>
+
+#include <cstdio>
+
+#include <benchmark/benchmark.h>
+
+#include "mbdevice/device.h"
+#include "mbdevice/json.h"
+
+using namespace mb::device;
+
+static const char device_template[] = R"json(
+    {
+        "name": "Test Device %d",
+        "id": "test%d",
+        "codenames": [
+            "test%da",
+            "test%db"
+        ],
+        "architecture": "armeabi-v7a",
+        "block_devs": {
+            "base_dirs": [
+                "/dev/block/bootdevice/by-name"
+            ],
+            "system": [
+                "/dev/block/bootdevice/by-name/system",
+                "/dev/block/mmcblk0p14"
+            ],
+            "cache": [
+                "/dev/block/bootdevice/by-name/cache",
+                "/dev/block/mmcblk0p15"
+            ],
+            "data": [
+                "/dev/block/bootdevice/by-name/userdata",
+                "/dev/block/mmcblk0p16"
+            ],
+            "boot": [
+                "/dev/block/bootdevice/by-name/boot",
+                "/dev/block/mmcblk0p7"
+            ],
+            "recovery": [
+                "/dev/block/bootdevice/by-name/recovery",
+                "/dev/block/mmcblk0p8"
+            ]
+        },
+        "boot_ui": {
+            "supported": true,
+            "flags": [
+                "TW_QCOM_RTC_FIX",
+                "TW_NEW_ION_HEAP"
+            ],
+            "pixel_format": "RGBA_8888",
+            "brightness_path": "/sys/class/leds/lcd-backlight/brightness",
+            "max_brightness": 255,
+            "default_brightness": 162,
+            "graphics_backends": [
+                "fbdev"
+            ],
+            "theme": "portrait_hdpi"
+        }
+    })json";
+
+static std::string make_device_list(int count)
+{
+    std::string json("[");
+    std::vector<char> buf(sizeof(device_template) + 64);
+
+    for (int i = 0; i < count; ++i) {
+        snprintf(buf.data(), buf.size(), device_template, i, i, i, i);
+        if (i > 0) {
+            json += ',';
+        }
+        json += buf.data();
+    }
+
+    json += "\n]\n";
+    return json;
+}
+
+static void BM_DeviceListFromJson(benchmark::State &state)
+{
+    int count = static_cast<int>(state.range(0));
+    std::string json = make_device_list(count);
+    std::vector<Device> devices;
+    JsonError error;
+
+    for (auto _ : state) {
+        if (!device_list_from_json(json, devices, error)
+                || devices.size() != static_cast<size_t>(count)) {
+            state.SkipWithError("Failed to parse device list");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * json.size());
+    state.SetItemsProcessed(state.iterations() * count);
+}
+
+static void BM_DeviceToJson(benchmark::State &state)
+{
+    std::vector<Device> devices;
+    JsonError error;
+    std::string json;
+
+    if (!device_list_from_json(make_device_list(1), devices, error)) {
+        state.SkipWithError("Failed to parse device");
+        return;
+    }
+
+    for (auto _ : state) {
+        if (!device_to_json(devices[0], json)) {
+            state.SkipWithError("Failed to create JSON");
+            break;
+        }
+    }
+}
+
+BENCHMARK(BM_DeviceListFromJson)->Arg(1)->Arg(100)->Arg(1000);
+BENCHMARK(BM_DeviceToJson);
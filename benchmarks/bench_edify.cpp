@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks for the edify tokenizer in libmbpatcher.
+ *
+ * The input is a synthetic updater-script with the kinds of statements found
+ * in ROM zips. Both the token object and token span interfaces are measured.
+ */
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "mbpatcher/edify/tokenizer.h"
+
+using namespace mb::patcher;
+
+static const char script_block[] =
+    "# Mount partitions\n"
+    "ifelse(is_mounted(\"/system\"), unmount(\"/system\"));\n"
+    "mount(\"ext4\", \"EMMC\", \"/dev/block/platform/msm_sdcc.1/by-name/system\", \"/system\");\n"
+    "if getprop(\"ro.product.device\") == \"hammerhead\" || getprop(\"ro.build.product\") == \"hammerhead\" then\n"
+    "    ui_print(\"Target: \" + getprop(\"ro.build.fingerprint\"));\n"
+    "else\n"
+    "    abort(\"This package is for \\\"hammerhead\\\" devices\\n\");\n"
+    "endif;\n"
+    "package_extract_dir(\"system\", \"/system\");\n"
+    "symlink(\"toolbox\", \"/system/bin/cat\", \"/system/bin/chmod\", \"/system/bin/ls\");\n"
+    "set_metadata_recursive(\"/system\", \"uid\", 0, \"gid\", 0, \"dmode\", 0755, \"fmode\", 0644, \"capabilities\", 0x0, \"selabel\", \"u:object_r:system_file:s0\");\n"
+    "package_extract_file(\"boot.img\", \"/dev/block/platform/msm_sdcc.1/by-name/boot\");\n"
+    "unmount(\"/system\");\n"
+    "\n";
+
+// Script of roughly the requested size made of repeated blocks
+static std::string make_script(size_t size)
+{
+    std::string script;
+
+    script.reserve(size + sizeof(script_block));
+    while (script.size() < size) {
+        script += script_block;
+    }
+
+    return script;
+}
+
+static void BM_EdifyTokenize(benchmark::State &state)
+{
+    std::string script = make_script(static_cast<size_t>(state.range(0)));
+    std::vector<EdifyToken *> tokens;
+
+    for (auto _ : state) {
+        if (!EdifyTokenizer::tokenize(script.data(), script.size(),
+                                      &tokens)) {
+            state.SkipWithError("Failed to tokenize script");
+            break;
+        }
+
+        state.PauseTiming();
+        for (EdifyToken *t : tokens) {
+            delete t;
+        }
+        tokens.clear();
+        state.ResumeTiming();
+    }
+
+    state.SetBytesProcessed(state.iterations() * script.size());
+}
+
+static void BM_EdifyTokenizeSpans(benchmark::State &state)
+{
+    std::string script = make_script(static_cast<size_t>(state.range(0)));
+    std::vector<EdifyTokenSpan> tokens;
+
+    for (auto _ : state) {
+        tokens.clear();
+
+        if (!EdifyTokenizer::tokenize(script.data(), script.size(),
+                                      &tokens)) {
+            state.SkipWithError("Failed to tokenize script");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * script.size());
+    state.counters["tokens"] = static_cast<double>(tokens.size());
+}
+
+static void BM_EdifyUntokenize(benchmark::State &state)
+{
+    std::string script = make_script(static_cast<size_t>(state.range(0)));
+    std::vector<EdifyToken *> tokens;
+
+    if (!EdifyTokenizer::tokenize(script.data(), script.size(), &tokens)) {
+        state.SkipWithError("Failed to tokenize script");
+        return;
+    }
+
+    for (auto _ : state) {
+        std::string result = EdifyTokenizer::untokenize(tokens);
+
+        if (result.size() != script.size()) {
+            state.SkipWithError("Untokenized script differs");
+            break;
+        }
+    }
+
+    for (EdifyToken *t : tokens) {
+        delete t;
+    }
+
+    state.SetBytesProcessed(state.iterations() * script.size());
+}
+
+BENCHMARK(BM_EdifyTokenize)->Arg(16 * 1024)->Arg(1024 * 1024);
+BENCHMARK(BM_EdifyTokenizeSpans)->Arg(16 * 1024)->Arg(1024 * 1024);
+BENCHMARK(BM_EdifyUntokenize)->Arg(16 * 1024)->Arg(1024 * 1024);
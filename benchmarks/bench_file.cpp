@@ -0,0 +1,352 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks for the libmbcommon File backends and file utilities.
+ *
+ * Each backend is read and written sequentially with several buffer sizes and
+ * read at random block-aligned offsets. file_search() and file_move() are run
+ * on a memory-backed and a descriptor-backed file to show the cost of the
+ * underlying I/O.
+ */
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <benchmark/benchmark.h>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/fd.h"
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file/posix.h"
+#include "mbcommon/file_util.h"
+
+#include "bench_common.h"
+
+#define BENCH_FILE_SIZE                 (16 * 1024 * 1024)
+#define BENCH_RANDOM_READ_SIZE          4096
+#define BENCH_RANDOM_READ_COUNT         256
+#define BENCH_MOVE_OFFSET               (1024 * 1024)
+
+enum class Backend
+{
+    Memory,
+    Fd,
+    Posix,
+};
+
+static const std::string & bench_data()
+{
+    static std::string data;
+
+    if (data.empty()) {
+        bench::fill_random(data, BENCH_FILE_SIZE, 1);
+    }
+
+    return data;
+}
+
+static const std::string & bench_read_path()
+{
+    static std::string path;
+
+    if (path.empty()) {
+        path = bench::temp_path("file.read");
+        if (!bench::write_file(path, bench_data())) {
+            fprintf(stderr, "%s: Failed to write file\n", path.c_str());
+        }
+    }
+
+    return path;
+}
+
+/*!
+ * \brief File being benchmarked along with its memory buffer if needed
+ */
+struct BenchFile
+{
+    std::unique_ptr<mb::File> file;
+    // Backing storage for writable memory files
+    void *buf = nullptr;
+    size_t size = 0;
+    // Copy of the data for memory files that are modified
+    std::string data;
+
+    BenchFile() = default;
+    BenchFile(const BenchFile &) = delete;
+    BenchFile & operator=(const BenchFile &) = delete;
+
+    ~BenchFile()
+    {
+        file.reset();
+        free(buf);
+    }
+};
+
+static bool open_read(Backend backend, BenchFile &bf)
+{
+    switch (backend) {
+    case Backend::Memory:
+        bf.file.reset(new mb::MemoryFile(bench_data().data(),
+                                         bench_data().size()));
+        break;
+    case Backend::Fd:
+        bf.file.reset(new mb::FdFile(bench_read_path(),
+                                     mb::FileOpenMode::READ_ONLY));
+        break;
+    case Backend::Posix:
+        bf.file.reset(new mb::PosixFile(bench_read_path(),
+                                        mb::FileOpenMode::READ_ONLY));
+        break;
+    }
+
+    return bf.file->is_open();
+}
+
+static bool open_write(Backend backend, const char *name, BenchFile &bf)
+{
+    switch (backend) {
+    case Backend::Memory:
+        bf.file.reset(new mb::MemoryFile(&bf.buf, &bf.size));
+        break;
+    case Backend::Fd:
+        bf.file.reset(new mb::FdFile(bench::temp_path(name),
+                                     mb::FileOpenMode::READ_WRITE_TRUNC));
+        break;
+    case Backend::Posix:
+        bf.file.reset(new mb::PosixFile(bench::temp_path(name),
+                                        mb::FileOpenMode::READ_WRITE_TRUNC));
+        break;
+    }
+
+    return bf.file->is_open();
+}
+
+// Open a writable file that already contains the benchmark data
+static bool open_modify(Backend backend, const char *name, BenchFile &bf)
+{
+    size_t n;
+
+    if (backend == Backend::Memory) {
+        bf.data = bench_data();
+        bf.file.reset(new mb::MemoryFile(&bf.data[0], bf.data.size()));
+        return bf.file->is_open();
+    }
+
+    return open_write(backend, name, bf)
+            && mb::file_write_fully(*bf.file, bench_data().data(),
+                                    bench_data().size(), n)
+            && n == bench_data().size();
+}
+
+template<Backend B>
+static void BM_FileSequentialRead(benchmark::State &state)
+{
+    BenchFile bf;
+    std::vector<char> buf(static_cast<size_t>(state.range(0)));
+
+    if (!open_read(B, bf)) {
+        state.SkipWithError(bf.file->error_string().c_str());
+        return;
+    }
+
+    for (auto _ : state) {
+        uint64_t total = 0;
+        size_t n;
+
+        if (!bf.file->seek(0, SEEK_SET, nullptr)) {
+            state.SkipWithError(bf.file->error_string().c_str());
+            break;
+        }
+
+        while (bf.file->read(buf.data(), buf.size(), n) && n > 0) {
+            total += n;
+        }
+
+        if (total != BENCH_FILE_SIZE) {
+            state.SkipWithError("Short read");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * BENCH_FILE_SIZE);
+}
+
+template<Backend B>
+static void BM_FileRandomRead(benchmark::State &state)
+{
+    BenchFile bf;
+    std::vector<char> buf(BENCH_RANDOM_READ_SIZE);
+    uint32_t seed = 1;
+
+    if (!open_read(B, bf)) {
+        state.SkipWithError(bf.file->error_string().c_str());
+        return;
+    }
+
+    for (auto _ : state) {
+        for (int i = 0; i < BENCH_RANDOM_READ_COUNT; ++i) {
+            seed = seed * 1103515245 + 12345;
+            uint64_t offset = (seed >> 8)
+                    % (BENCH_FILE_SIZE / BENCH_RANDOM_READ_SIZE)
+                    * BENCH_RANDOM_READ_SIZE;
+            size_t n;
+
+            if (!bf.file->read_at(offset, buf.data(), buf.size(), n)
+                    || n != buf.size()) {
+                state.SkipWithError("Short read");
+                return;
+            }
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * BENCH_RANDOM_READ_COUNT);
+    state.SetBytesProcessed(state.iterations() * BENCH_RANDOM_READ_COUNT
+            * BENCH_RANDOM_READ_SIZE);
+}
+
+template<Backend B>
+static void BM_FileSequentialWrite(benchmark::State &state)
+{
+    BenchFile bf;
+    const std::string &data = bench_data();
+    size_t chunk = static_cast<size_t>(state.range(0));
+
+    if (!open_write(B, "file.write", bf)) {
+        state.SkipWithError(bf.file->error_string().c_str());
+        return;
+    }
+
+    for (auto _ : state) {
+        if (!bf.file->seek(0, SEEK_SET, nullptr)) {
+            state.SkipWithError(bf.file->error_string().c_str());
+            break;
+        }
+
+        for (size_t offset = 0; offset < data.size(); offset += chunk) {
+            size_t n;
+
+            if (!mb::file_write_fully(*bf.file, data.data() + offset,
+                                      std::min(chunk, data.size() - offset),
+                                      n)) {
+                state.SkipWithError(bf.file->error_string().c_str());
+                return;
+            }
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * BENCH_FILE_SIZE);
+
+    if (B != Backend::Memory) {
+        remove(bench::temp_path("file.write").c_str());
+    }
+}
+
+static mb::FileSearchAction search_cb(mb::File &file, void *userdata,
+                                      uint64_t offset)
+{
+    (void) file;
+    (void) offset;
+    ++*static_cast<uint64_t *>(userdata);
+    return mb::FileSearchAction::Continue;
+}
+
+// Searches for a pattern that does not occur, so every byte is scanned
+template<Backend B>
+static void BM_FileSearch(benchmark::State &state)
+{
+    BenchFile bf;
+    std::string pattern(static_cast<size_t>(state.range(0)), '\xa5');
+
+    if (!open_read(B, bf)) {
+        state.SkipWithError(bf.file->error_string().c_str());
+        return;
+    }
+
+    for (auto _ : state) {
+        uint64_t matches = 0;
+
+        if (!mb::file_search(*bf.file, -1, -1, 0, pattern.data(),
+                             pattern.size(), -1, &search_cb, &matches)) {
+            state.SkipWithError(bf.file->error_string().c_str());
+            break;
+        }
+
+        benchmark::DoNotOptimize(matches);
+    }
+
+    state.SetBytesProcessed(state.iterations() * BENCH_FILE_SIZE);
+}
+
+// Moves the data down and back up, so both copy directions are measured
+template<Backend B>
+static void BM_FileMove(benchmark::State &state)
+{
+    BenchFile bf;
+    uint64_t size = BENCH_FILE_SIZE - BENCH_MOVE_OFFSET;
+
+    if (!open_modify(B, "file.move", bf)) {
+        state.SkipWithError(bf.file->error_string().c_str());
+        return;
+    }
+
+    for (auto _ : state) {
+        uint64_t n;
+
+        if (!mb::file_move(*bf.file, BENCH_MOVE_OFFSET, 0, size, n)
+                || n != size
+                || !mb::file_move(*bf.file, 0, BENCH_MOVE_OFFSET, size, n)
+                || n != size) {
+            state.SkipWithError(bf.file->error_string().c_str());
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * 2 * size);
+
+    if (B != Backend::Memory) {
+        remove(bench::temp_path("file.move").c_str());
+    }
+}
+
+#define BENCH_BUFFER_SIZES \
+    Arg(4096)->Arg(64 * 1024)->Arg(1024 * 1024)
+
+BENCHMARK_TEMPLATE(BM_FileSequentialRead, Backend::Memory)->BENCH_BUFFER_SIZES;
+BENCHMARK_TEMPLATE(BM_FileSequentialRead, Backend::Fd)->BENCH_BUFFER_SIZES;
+BENCHMARK_TEMPLATE(BM_FileSequentialRead, Backend::Posix)->BENCH_BUFFER_SIZES;
+
+BENCHMARK_TEMPLATE(BM_FileRandomRead, Backend::Memory);
+BENCHMARK_TEMPLATE(BM_FileRandomRead, Backend::Fd);
+BENCHMARK_TEMPLATE(BM_FileRandomRead, Backend::Posix);
+
+BENCHMARK_TEMPLATE(BM_FileSequentialWrite, Backend::Memory)->BENCH_BUFFER_SIZES;
+BENCHMARK_TEMPLATE(BM_FileSequentialWrite, Backend::Fd)->BENCH_BUFFER_SIZES;
+BENCHMARK_TEMPLATE(BM_FileSequentialWrite, Backend::Posix)->BENCH_BUFFER_SIZES;
+
+BENCHMARK_TEMPLATE(BM_FileSearch, Backend::Memory)->Arg(4)->Arg(64);
+BENCHMARK_TEMPLATE(BM_FileSearch, Backend::Fd)->Arg(4)->Arg(64);
+
+BENCHMARK_TEMPLATE(BM_FileMove, Backend::Memory);
+BENCHMARK_TEMPLATE(BM_FileMove, Backend::Fd);
@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks for libmbsparse.
+ *
+ * A sparse image with a mix of raw, fill, and DONT_CARE chunks is created in
+ * memory. Writing it, building its chunk index, and reading it sequentially
+ * and at random offsets are timed.
+ */
+
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <benchmark/benchmark.h>
+
+#include "mbcommon/file/memory.h"
+#include "mbcommon/file_util.h"
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_writer.h"
+
+#include "bench_common.h"
+
+#define BENCH_BLOCK_SIZE                4096
+#define BENCH_REGION_SIZE               (1024 * 1024)
+#define BENCH_REGION_COUNT              32
+#define BENCH_IMAGE_SIZE                (BENCH_REGION_SIZE * BENCH_REGION_COUNT)
+#define BENCH_RANDOM_READ_SIZE          4096
+#define BENCH_RANDOM_READ_COUNT         256
+
+using namespace mb::sparse;
+
+/*!
+ * \brief Write the raw image as a sparse file
+ *
+ * Every third region is random data, every third region repeats a 32-bit fill
+ * value, and the remaining regions are skipped with a forward seek so they
+ * become DONT_CARE chunks.
+ */
+static bool write_sparse(const std::string &raw, void **buf, size_t *size)
+{
+    mb::MemoryFile output(buf, size);
+    SparseWriter writer(&output, BENCH_BLOCK_SIZE, false);
+    size_t n;
+
+    if (!writer.is_open()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < BENCH_REGION_COUNT; ++i) {
+        if (i % 3 == 2) {
+            if (!writer.seek(BENCH_REGION_SIZE, SEEK_CUR, nullptr)) {
+                return false;
+            }
+        } else if (!mb::file_write_fully(writer, raw.data()
+                                                 + i * BENCH_REGION_SIZE,
+                                         BENCH_REGION_SIZE, n)) {
+            return false;
+        }
+    }
+
+    return writer.close() && output.close();
+}
+
+static const std::string & raw_image()
+{
+    static std::string raw;
+
+    if (raw.empty()) {
+        std::string region;
+
+        raw.resize(BENCH_IMAGE_SIZE);
+
+        for (size_t i = 0; i < BENCH_REGION_COUNT; ++i) {
+            char *ptr = &raw[i * BENCH_REGION_SIZE];
+
+            if (i % 3 == 0) {
+                bench::fill_random(region, BENCH_REGION_SIZE,
+                                   static_cast<uint32_t>(i));
+                memcpy(ptr, region.data(), region.size());
+            } else if (i % 3 == 1) {
+                for (size_t j = 0; j < BENCH_REGION_SIZE; j += 4) {
+                    memcpy(ptr + j, "\x44\x33\x22\x11", 4);
+                }
+            }
+        }
+    }
+
+    return raw;
+}
+
+static const std::string & sparse_image()
+{
+    static std::string image;
+
+    if (image.empty()) {
+        void *buf = nullptr;
+        size_t size = 0;
+
+        if (write_sparse(raw_image(), &buf, &size)) {
+            image.assign(static_cast<char *>(buf), size);
+        } else {
+            fprintf(stderr, "Failed to create sparse image\n");
+        }
+
+        free(buf);
+    }
+
+    return image;
+}
+
+static void BM_SparseWrite(benchmark::State &state)
+{
+    const std::string &raw = raw_image();
+
+    for (auto _ : state) {
+        void *buf = nullptr;
+        size_t size = 0;
+
+        bool ret = write_sparse(raw, &buf, &size);
+        free(buf);
+
+        if (!ret) {
+            state.SkipWithError("Failed to write sparse image");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * BENCH_IMAGE_SIZE);
+}
+
+static void BM_SparseBuildIndex(benchmark::State &state)
+{
+    const std::string &image = sparse_image();
+    std::vector<SparseChunk> chunks;
+
+    for (auto _ : state) {
+        mb::MemoryFile input(image.data(), image.size());
+        SparseFile file(&input);
+
+        if (!file.is_open() || !file.chunks(chunks)) {
+            state.SkipWithError(file.error_string().c_str());
+            break;
+        }
+    }
+
+    state.counters["chunks"] = static_cast<double>(chunks.size());
+}
+
+static void BM_SparseSequentialRead(benchmark::State &state)
+{
+    const std::string &image = sparse_image();
+    std::vector<char> buf(static_cast<size_t>(state.range(0)));
+
+    mb::MemoryFile input(image.data(), image.size());
+    SparseFile file(&input);
+
+    if (!file.is_open()) {
+        state.SkipWithError(file.error_string().c_str());
+        return;
+    }
+
+    for (auto _ : state) {
+        uint64_t total = 0;
+        size_t n;
+
+        if (!file.seek(0, SEEK_SET, nullptr)) {
+            state.SkipWithError(file.error_string().c_str());
+            break;
+        }
+
+        while (file.read(buf.data(), buf.size(), n) && n > 0) {
+            total += n;
+        }
+
+        if (total != BENCH_IMAGE_SIZE) {
+            state.SkipWithError("Short read");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * BENCH_IMAGE_SIZE);
+}
+
+static void BM_SparseRandomRead(benchmark::State &state)
+{
+    const std::string &image = sparse_image();
+    std::vector<char> buf(BENCH_RANDOM_READ_SIZE);
+    uint32_t seed = 1;
+
+    mb::MemoryFile input(image.data(), image.size());
+    SparseFile file(&input);
+
+    if (!file.is_open() || !file.build_index()) {
+        state.SkipWithError(file.error_string().c_str());
+        return;
+    }
+
+    for (auto _ : state) {
+        for (int i = 0; i < BENCH_RANDOM_READ_COUNT; ++i) {
+            seed = seed * 1103515245 + 12345;
+            uint64_t offset = (seed >> 8)
+                    % (BENCH_IMAGE_SIZE / BENCH_RANDOM_READ_SIZE)
+                    * BENCH_RANDOM_READ_SIZE;
+            size_t n;
+
+            if (!file.read_at(offset, buf.data(), buf.size(), n)
+                    || n != buf.size()) {
+                state.SkipWithError("Short read");
+                return;
+            }
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * BENCH_RANDOM_READ_COUNT);
+    state.SetBytesProcessed(state.iterations() * BENCH_RANDOM_READ_COUNT
+            * BENCH_RANDOM_READ_SIZE);
+}
+
+BENCHMARK(BM_SparseWrite);
+BENCHMARK(BM_SparseBuildIndex);
+BENCHMARK(BM_SparseSequentialRead)->Arg(4096)->Arg(64 * 1024)->Arg(1024 * 1024);
+BENCHMARK(BM_SparseRandomRead);
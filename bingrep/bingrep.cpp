@@ -0,0 +1,775 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/file_util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include "mbcommon/file/fd.h"
+#include "mbcommon/file/posix.h"
+#include "mbcommon/file/standard.h"
+#ifndef _WIN32
+#include "mbcommon/file/mmap.h"
+#endif
+
+// Default size of the ranges that large files are split into for parallel
+// scanning
+#define DEFAULT_SHARD_SIZE      (64 * 1024 * 1024)
+
+enum class Backend
+{
+    Standard,
+    Posix,
+    Fd,
+#ifndef _WIN32
+    Mmap,
+#endif
+};
+
+struct Options
+{
+    int64_t start = -1;
+    int64_t end = -1;
+    size_t bsize = 0;
+    int64_t max_matches = -1;
+    unsigned int jobs = 0;
+    uint64_t shard_size = DEFAULT_SHARD_SIZE;
+    Backend backend = Backend::Standard;
+    bool stats = false;
+};
+
+struct Patterns
+{
+    std::vector<std::string> data;
+    std::vector<const void *> ptrs;
+    std::vector<size_t> sizes;
+    size_t max_size = 0;
+};
+
+struct Match
+{
+    uint64_t offset;
+    size_t pattern;
+
+    bool operator<(const Match &other) const
+    {
+        return offset < other.offset
+                || (offset == other.offset && pattern < other.pattern);
+    }
+};
+
+// Range of a file that is scanned by one task. Only matches starting in
+// [start, end) belong to the shard, but the scan continues up to
+// (max pattern size - 1) bytes past the end to find matches crossing the
+// boundary.
+struct Shard
+{
+    size_t input;
+    int64_t start;
+    int64_t end;
+    int64_t scan_end;
+    std::vector<Match> matches;
+    uint64_t bytes;
+    bool ok;
+    std::string error;
+};
+
+struct Input
+{
+    const char *name;
+    // Null for stdin
+    const char *path;
+    bool ok;
+    std::string error;
+    // End of the searched range or -1 if unknown
+    int64_t end;
+    std::vector<size_t> shards;
+};
+
+static void usage(FILE *stream, const char *prog_name)
+{
+    fprintf(stream, "Usage: %s {-p <hex> | -t <text>}... [option...] [<file>...]\n"
+                    "\n"
+                    "Searches each file (or stdin if no files are given) for all of the\n"
+                    "patterns in a single pass. Large files are split into shards that are\n"
+                    "scanned in parallel.\n"
+                    "\n"
+                    "Options:\n"
+                    "  -p, --hex <hex pattern>\n"
+                    "                  Search file for hex pattern\n"
+                    "  -t, --text <text pattern>\n"
+                    "                  Search file for text pattern\n"
+                    "  -n, --num-matches\n"
+                    "                  Maximum number of matches per file (disables\n"
+                    "                  sharding)\n"
+                    "  -j, --jobs <count>\n"
+                    "                  Number of threads (default: number of CPUs)\n"
+                    "  -b, --backend <standard|posix|fd|mmap>\n"
+                    "                  File backend to read with (default: standard)\n"
+                    "  -s, --stats     Report throughput to stderr\n"
+                    "  --start-offset  Starting boundary offset for search\n"
+                    "  --end-offset    Ending boundary offset for search\n"
+                    "  --buffer-size   Buffer size\n"
+                    "  --shard-size    Size of ranges scanned in parallel (default: %d MiB)\n"
+                    "\n"
+                    "Matches of the same pattern do not overlap. If more than one pattern is\n"
+                    "given, the index of the matching pattern is printed after each offset.\n",
+                    prog_name, DEFAULT_SHARD_SIZE / 1024 / 1024);
+}
+
+template<typename SIntType>
+static inline bool str_to_snum(const char *str, int base, SIntType *out)
+{
+    static_assert(std::is_signed<SIntType>::value,
+                  "Integer type is not signed");
+    static_assert(std::numeric_limits<SIntType>::min() >= LLONG_MIN
+                  && std::numeric_limits<SIntType>::max() <= LLONG_MAX,
+                  "Integer type to too large to handle");
+
+    char *end;
+    errno = 0;
+    auto num = strtoll(str, &end, base);
+    if (errno == ERANGE
+            || num < std::numeric_limits<SIntType>::min()
+            || num > std::numeric_limits<SIntType>::max()) {
+        errno = ERANGE;
+        return false;
+    } else if (*str == '\0' || *end != '\0') {
+        errno = EINVAL;
+        return false;
+    }
+    *out = static_cast<SIntType>(num);
+    return true;
+}
+
+template<typename UIntType>
+static inline bool str_to_unum(const char *str, int base, UIntType *out)
+{
+    static_assert(!std::is_signed<UIntType>::value,
+                  "Integer type is not unsigned");
+    static_assert(std::numeric_limits<UIntType>::max() <= ULLONG_MAX,
+                  "Integer type to too large to handle");
+
+    char *end;
+    errno = 0;
+    auto num = strtoull(str, &end, base);
+    if (errno == ERANGE
+            || num > std::numeric_limits<UIntType>::max()) {
+        errno = ERANGE;
+        return false;
+    } else if (*str == '\0' || *end != '\0') {
+        errno = EINVAL;
+        return false;
+    }
+    *out = static_cast<UIntType>(num);
+    return true;
+}
+
+static int ascii_to_hex(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else {
+        return -1;
+    }
+}
+
+static bool hex_to_binary(const char *hex, void **data, size_t *data_size)
+{
+    size_t size = strlen(hex);
+    unsigned char *buf;
+
+    if (size & 1) {
+        errno = EINVAL;
+        return false;
+    }
+
+    buf = static_cast<unsigned char *>(malloc(size / 2));
+    if (!buf) {
+        return false;
+    }
+
+    for (size_t i = 0; i < size; i += 2) {
+        int hi = ascii_to_hex(hex[i]);
+        int lo = ascii_to_hex(hex[i + 1]);
+
+        if (hi < 0 || lo < 0) {
+            free(buf);
+            errno = EINVAL;
+            return false;
+        }
+
+        buf[i / 2] = (hi << 4) | lo;
+    }
+
+    *data = buf;
+    *data_size = size / 2;
+
+    return true;
+}
+
+static std::unique_ptr<mb::File> open_file(const char *path, Backend backend)
+{
+    std::unique_ptr<mb::File> file;
+
+    switch (backend) {
+    case Backend::Standard:
+        file.reset(new mb::StandardFile(path, mb::FileOpenMode::READ_ONLY));
+        break;
+    case Backend::Posix:
+        file.reset(new mb::PosixFile(path, mb::FileOpenMode::READ_ONLY));
+        break;
+    case Backend::Fd:
+        file.reset(new mb::FdFile(path, mb::FileOpenMode::READ_ONLY));
+        break;
+#ifndef _WIN32
+    case Backend::Mmap:
+        file.reset(new mb::MmapFile(path));
+        break;
+#endif
+    }
+
+    return file;
+}
+
+static mb::FileSearchAction shard_result_cb(mb::File &file, void *userdata,
+                                            size_t pattern_index,
+                                            uint64_t offset)
+{
+    (void) file;
+    Shard *shard = static_cast<Shard *>(userdata);
+
+    // Belongs to the next shard
+    if (shard->end >= 0 && offset >= static_cast<uint64_t>(shard->end)) {
+        return mb::FileSearchAction::Continue;
+    }
+
+    shard->matches.push_back({ offset, pattern_index });
+    return mb::FileSearchAction::Continue;
+}
+
+static void scan_shard(const Options &opts, const Patterns &patterns,
+                       const Input &input, Shard &shard)
+{
+    std::unique_ptr<mb::File> file;
+
+    if (input.path) {
+        file = open_file(input.path, opts.backend);
+    } else {
+        file.reset(new mb::PosixFile(stdin, false));
+    }
+
+    if (!file->is_open()) {
+        shard.ok = false;
+        shard.error = file->error_string();
+        return;
+    }
+
+    file->set_stats_enabled(true);
+
+    shard.ok = mb::file_search_multi(
+            *file, shard.start, shard.scan_end, opts.bsize,
+            patterns.ptrs.data(), patterns.sizes.data(), patterns.ptrs.size(),
+            input.shards.size() == 1 ? opts.max_matches : -1,
+            &shard_result_cb, &shard);
+    if (!shard.ok) {
+        shard.error = "Search failed: " + file->error_string();
+    }
+
+    // Memory mapped backends don't go through read()
+    shard.bytes = file->stats().bytes_read;
+    if (shard.bytes == 0 && shard.scan_end >= 0) {
+        shard.bytes = static_cast<uint64_t>(
+                shard.scan_end - std::max<int64_t>(shard.start, 0));
+    }
+}
+
+static bool plan_input(const Options &opts, const Patterns &patterns,
+                       Input &input, std::vector<Shard> &shards)
+{
+    int64_t start = opts.start;
+    int64_t end = opts.end;
+    uint64_t size;
+
+    input.ok = true;
+    input.end = end;
+
+    // Files are only split if their size is known and all matches are wanted
+    if (input.path && opts.max_matches < 0) {
+        auto file = open_file(input.path, opts.backend);
+
+        if (!file->is_open()) {
+            input.ok = false;
+            input.error = file->error_string();
+            return false;
+        }
+
+        if (file->seek(0, SEEK_END, &size)
+                && size <= static_cast<uint64_t>(INT64_MAX)) {
+            int64_t ssize = static_cast<int64_t>(size);
+
+            start = std::max<int64_t>(start, 0);
+            end = end >= 0 ? std::min(end, ssize) : ssize;
+            input.end = end;
+        }
+    }
+
+    if (start < 0 || end < 0 || end - start <= static_cast<int64_t>(
+            std::max<uint64_t>(opts.shard_size, patterns.max_size))) {
+        Shard shard{};
+        shard.start = opts.start;
+        shard.end = -1;
+        shard.scan_end = opts.end;
+        input.shards.push_back(shards.size());
+        shards.push_back(std::move(shard));
+        return true;
+    }
+
+    // Each shard must be at least as large as the longest pattern so that
+    // a match can only cross into the next shard
+    uint64_t step = std::max<uint64_t>(opts.shard_size, patterns.max_size);
+
+    for (int64_t offset = start; offset < end;
+            offset += static_cast<int64_t>(step)) {
+        Shard shard{};
+        shard.start = offset;
+        shard.end = std::min(end, offset + static_cast<int64_t>(step));
+        shard.scan_end = std::min(
+                end, shard.end + static_cast<int64_t>(patterns.max_size) - 1);
+        input.shards.push_back(shards.size());
+        shards.push_back(std::move(shard));
+    }
+
+    return true;
+}
+
+struct RescanCtx
+{
+    uint64_t limit;
+    const std::vector<uint64_t> *expected;
+    std::vector<uint64_t> found;
+    bool synced;
+    uint64_t sync_offset;
+};
+
+static mb::FileSearchAction rescan_result_cb(mb::File &file, void *userdata,
+                                             size_t pattern_index,
+                                             uint64_t offset)
+{
+    (void) file;
+    (void) pattern_index;
+    RescanCtx *ctx = static_cast<RescanCtx *>(userdata);
+
+    if (offset >= ctx->limit) {
+        return mb::FileSearchAction::Stop;
+    }
+
+    // Once the sequential scan agrees with the shard's result, the rest of
+    // the shard's results are also the same
+    if (std::binary_search(ctx->expected->begin(), ctx->expected->end(),
+                           offset)) {
+        ctx->synced = true;
+        ctx->sync_offset = offset;
+        return mb::FileSearchAction::Stop;
+    }
+
+    ctx->found.push_back(offset);
+    return mb::FileSearchAction::Continue;
+}
+
+/*!
+ * \brief Combine the results of a file's shards
+ *
+ * Each shard is scanned as if no match precedes it. If a match from an
+ * earlier shard extends past the start of a shard, the shard may report
+ * matches that overlap it (or miss matches that come after it). For those
+ * patterns, the start of the shard is rescanned from the end of the earlier
+ * match until the results agree again. This only happens for self-overlapping
+ * patterns and keeps the results identical to a sequential search.
+ */
+static bool merge_shards(const Options &opts, const Patterns &patterns,
+                         Input &input, std::vector<Shard> &shards,
+                         std::vector<Match> &results)
+{
+    size_t count = patterns.ptrs.size();
+    std::vector<uint64_t> carry(count, 0);
+    std::vector<std::vector<uint64_t>> per_pattern(count);
+    std::unique_ptr<mb::File> file;
+
+    for (size_t index : input.shards) {
+        Shard &shard = shards[index];
+
+        if (!shard.ok) {
+            input.ok = false;
+            input.error = shard.error;
+            return false;
+        }
+
+        if (input.shards.size() == 1) {
+            results = std::move(shard.matches);
+            break;
+        }
+
+        for (auto &list : per_pattern) {
+            list.clear();
+        }
+        for (const Match &m : shard.matches) {
+            per_pattern[m.pattern].push_back(m.offset);
+        }
+
+        for (size_t p = 0; p < count; ++p) {
+            auto &list = per_pattern[p];
+            auto from = list.cbegin();
+
+            std::sort(list.begin(), list.end());
+
+            if (carry[p] > static_cast<uint64_t>(shard.start)) {
+                if (!file) {
+                    file = open_file(input.path, opts.backend);
+                    if (!file->is_open()) {
+                        input.ok = false;
+                        input.error = file->error_string();
+                        return false;
+                    }
+                }
+
+                RescanCtx ctx{};
+                ctx.limit = static_cast<uint64_t>(shard.end);
+                ctx.expected = &list;
+
+                int64_t scan_end = std::min<int64_t>(
+                        input.end, shard.end
+                                + static_cast<int64_t>(patterns.sizes[p]) - 1);
+
+                if (!mb::file_search_multi(
+                        *file, static_cast<int64_t>(carry[p]), scan_end,
+                        opts.bsize, &patterns.ptrs[p], &patterns.sizes[p], 1,
+                        -1, &rescan_result_cb, &ctx)) {
+                    input.ok = false;
+                    input.error = "Search failed: " + file->error_string();
+                    return false;
+                }
+
+                for (uint64_t offset : ctx.found) {
+                    results.push_back({ offset, p });
+                    carry[p] = offset + patterns.sizes[p];
+                }
+
+                from = ctx.synced
+                        ? std::lower_bound(list.cbegin(), list.cend(),
+                                           ctx.sync_offset)
+                        : list.cend();
+            }
+
+            for (auto it = from; it != list.cend(); ++it) {
+                results.push_back({ *it, p });
+                carry[p] = *it + patterns.sizes[p];
+            }
+        }
+    }
+
+    std::sort(results.begin(), results.end());
+
+    return true;
+}
+
+static bool add_pattern(Patterns &patterns, std::string data)
+{
+    if (data.empty()) {
+        fprintf(stderr, "Patterns cannot be empty\n");
+        return false;
+    }
+
+    patterns.max_size = std::max(patterns.max_size, data.size());
+    patterns.data.push_back(std::move(data));
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    Patterns patterns;
+
+    int opt;
+
+    // Arguments with no short options
+    enum : int
+    {
+        OPT_START_OFFSET         = CHAR_MAX + 1,
+        OPT_END_OFFSET           = CHAR_MAX + 2,
+        OPT_BUFFER_SIZE          = CHAR_MAX + 3,
+        OPT_SHARD_SIZE           = CHAR_MAX + 4,
+    };
+
+    static const char short_options[] = "b:hj:n:p:st:";
+
+    static struct option long_options[] = {
+        // Arguments with short versions
+        {"backend",      required_argument, 0, 'b'},
+        {"help",         no_argument,       0, 'h'},
+        {"jobs",         required_argument, 0, 'j'},
+        {"num-matches",  required_argument, 0, 'n'},
+        {"hex",          required_argument, 0, 'p'},
+        {"stats",        no_argument,       0, 's'},
+        {"text",         required_argument, 0, 't'},
+        // Arguments without short versions
+        {"start-offset", required_argument, 0, OPT_START_OFFSET},
+        {"end-offset",   required_argument, 0, OPT_END_OFFSET},
+        {"buffer-size",  required_argument, 0, OPT_BUFFER_SIZE},
+        {"shard-size",   required_argument, 0, OPT_SHARD_SIZE},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'b':
+            if (strcmp(optarg, "standard") == 0) {
+                opts.backend = Backend::Standard;
+            } else if (strcmp(optarg, "posix") == 0) {
+                opts.backend = Backend::Posix;
+            } else if (strcmp(optarg, "fd") == 0) {
+                opts.backend = Backend::Fd;
+#ifndef _WIN32
+            } else if (strcmp(optarg, "mmap") == 0) {
+                opts.backend = Backend::Mmap;
+#endif
+            } else {
+                fprintf(stderr, "Invalid value for -b/--backend: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'j':
+            if (!str_to_unum(optarg, 10, &opts.jobs) || opts.jobs == 0) {
+                fprintf(stderr, "Invalid value for -j/--jobs: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'n':
+            if (!str_to_snum(optarg, 10, &opts.max_matches)) {
+                fprintf(stderr, "Invalid value for -n/--num-matches: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'p': {
+            void *data;
+            size_t size;
+
+            if (!hex_to_binary(optarg, &data, &size)) {
+                fprintf(stderr, "Invalid hex pattern: %s\n", strerror(errno));
+                return EXIT_FAILURE;
+            }
+
+            std::string pattern(static_cast<char *>(data), size);
+            free(data);
+
+            if (!add_pattern(patterns, std::move(pattern))) {
+                return EXIT_FAILURE;
+            }
+            break;
+        }
+
+        case 's':
+            opts.stats = true;
+            break;
+
+        case 't':
+            if (!add_pattern(patterns, optarg)) {
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case OPT_START_OFFSET:
+            if (!str_to_snum(optarg, 0, &opts.start)) {
+                fprintf(stderr, "Invalid value for --start-offset: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case OPT_END_OFFSET:
+            if (!str_to_snum(optarg, 0, &opts.end)) {
+                fprintf(stderr, "Invalid value for --end-offset: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case OPT_BUFFER_SIZE:
+            if (!str_to_unum(optarg, 10, &opts.bsize)) {
+                fprintf(stderr, "Invalid value for --buffer-size: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case OPT_SHARD_SIZE:
+            if (!str_to_unum(optarg, 0, &opts.shard_size)
+                    || opts.shard_size == 0) {
+                fprintf(stderr, "Invalid value for --shard-size: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (patterns.data.empty()) {
+        fprintf(stderr, "No pattern provided\n");
+        return EXIT_FAILURE;
+    }
+
+    for (auto const &pattern : patterns.data) {
+        patterns.ptrs.push_back(pattern.data());
+        patterns.sizes.push_back(pattern.size());
+    }
+
+    if (opts.jobs == 0) {
+        opts.jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    std::vector<Input> inputs;
+    std::vector<Shard> shards;
+
+    if (optind == argc) {
+        inputs.push_back({ "stdin", nullptr, true, {}, -1, {} });
+    } else {
+        for (int i = optind; i < argc; ++i) {
+            inputs.push_back({ argv[i], argv[i], true, {}, -1, {} });
+        }
+    }
+
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        size_t first = shards.size();
+
+        plan_input(opts, patterns, inputs[i], shards);
+
+        for (size_t j = first; j < shards.size(); ++j) {
+            shards[j].input = i;
+        }
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    // Shards are handed out in order, so the results for the first files
+    // become available first
+    std::atomic<size_t> next_shard(0);
+    auto worker = [&] {
+        size_t index;
+        while ((index = next_shard++) < shards.size()) {
+            Shard &shard = shards[index];
+            scan_shard(opts, patterns, inputs[shard.input], shard);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    unsigned int n_threads = static_cast<unsigned int>(
+            std::min<size_t>(opts.jobs, shards.size()));
+
+    for (unsigned int i = 1; i < n_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    bool ret = true;
+    uint64_t total_bytes = 0;
+    uint64_t total_matches = 0;
+
+    for (auto &input : inputs) {
+        std::vector<Match> results;
+
+        for (size_t index : input.shards) {
+            total_bytes += shards[index].bytes;
+        }
+
+        if (input.ok) {
+            merge_shards(opts, patterns, input, shards, results);
+        }
+
+        if (!input.ok) {
+            fprintf(stderr, "%s: %s\n", input.name, input.error.c_str());
+            ret = false;
+            continue;
+        }
+
+        for (const Match &m : results) {
+            if (patterns.ptrs.size() == 1) {
+                printf("%s: 0x%016" PRIx64 "\n", input.name, m.offset);
+            } else {
+                printf("%s: 0x%016" PRIx64 " %zu\n",
+                       input.name, m.offset, m.pattern);
+            }
+        }
+
+        total_matches += results.size();
+    }
+
+    if (opts.stats) {
+        double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start_time).count();
+
+        fprintf(stderr, "Scanned %" PRIu64 " bytes in %.3f seconds "
+                        "(%.1f MiB/s) with %u threads and %zu shards; "
+                        "%" PRIu64 " matches\n",
+                total_bytes, seconds,
+                seconds > 0 ? total_bytes / seconds / 1024 / 1024 : 0.0,
+                n_threads, shards.size(), total_matches);
+    }
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -22,6 +22,7 @@
 #include <string>
 #include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 #include <cassert>
 #include <climits>
@@ -35,8 +36,11 @@
 // libmbcommon
 #include <mbcommon/common.h>
 #include <mbcommon/libc/stdio.h>
+#include <mbcommon/string.h>
 
 // libmbbootimg
+#include <mbbootimg/convert.h>
+#include <mbbootimg/diff.h>
 #include <mbbootimg/entry.h>
 #include <mbbootimg/format/android_defs.h>
 #include <mbbootimg/header.h>
@@ -119,6 +123,9 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "Available commands:\n" \
     "  unpack         Unpack a boot image\n" \
     "  pack           Assemble boot image from unpacked files\n" \
+    "  convert        Convert boot images to another format\n" \
+    "  diff           Create a delta between two boot images\n" \
+    "  patch          Apply a delta to a boot image\n" \
     "\n" \
     "Pass -h/--help as a argument to a command to see it's available options.\n"
 
@@ -227,6 +234,67 @@ typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
     "        bootimgtool pack boot.img -i /tmp/android --input-kernel /tmp/newkernel\n" \
     "\n"
 
+#define HELP_CONVERT_USAGE \
+    "Usage: bootimgtool convert [<option>...] [<input file> <output file>...]\n" \
+    "\n" \
+    "Options:\n" \
+    "  -t, --type <type>\n" \
+    "                  Output type of the boot images (input type if unspecified)\n" \
+    "                  (one of: android, bump, loki, mtk, sony_elf)\n" \
+    "  -j, --jobs <count>\n" \
+    "                  Number of boot images to convert in parallel\n" \
+    "                  (number of CPUs if unspecified)\n" \
+    "  -b, --batch <file>\n" \
+    "                  Load additional conversion jobs from <file>\n" \
+    "  --aboot <aboot image>\n" \
+    "                  aboot image to use when converting to a Loki image\n" \
+    "\n" \
+    "Each pair of positional arguments is an input boot image and the path to\n" \
+    "write the converted boot image to. The boot image header and all images that\n" \
+    "are supported by the output type are copied to the output boot image.\n" \
+    "\n" \
+    "Batch file:\n" \
+    "\n" \
+    "The batch file is a list of newline-separated \"<input> <output> [<type>]\"\n" \
+    "entries where lines containing only whitespace and lines that begin with '#'\n" \
+    "following any leading whitespace are ignored. If <type> is not specified,\n" \
+    "the type from -t/--type is used.\n" \
+    "\n" \
+    "Examples:\n" \
+    "\n" \
+    "1. Convert a boot image to a bump'd boot image\n" \
+    "\n" \
+    "        bootimgtool convert -t bump boot.img boot-bump.img\n" \
+    "\n" \
+    "2. Convert all of the boot images listed in jobs.txt using 8 threads\n" \
+    "\n" \
+    "        bootimgtool convert -j 8 -b jobs.txt\n" \
+    "\n"
+
+#define HELP_DIFF_USAGE \
+    "Usage: bootimgtool diff <source file> <target file> <delta file>\n" \
+    "\n" \
+    "Create a delta that transforms <source file> into <target file>. The delta\n" \
+    "contains the header fields that changed and the data of each image that is\n" \
+    "not present anywhere in <source file>.\n" \
+    "\n" \
+    "Example:\n" \
+    "\n" \
+    "        bootimgtool diff boot.img boot-rom2.img boot-rom2.delta\n" \
+    "\n"
+
+#define HELP_PATCH_USAGE \
+    "Usage: bootimgtool patch <source file> <delta file> <output file>\n" \
+    "\n" \
+    "Apply a delta created by \"bootimgtool diff\" to <source file> and write the\n" \
+    "resulting boot image to <output file>. The delta is rejected if\n" \
+    "<source file> is not the boot image it was created from.\n" \
+    "\n" \
+    "Example:\n" \
+    "\n" \
+    "        bootimgtool patch boot.img boot-rom2.delta boot-rom2.img\n" \
+    "\n"
+
 template <typename F>
 class Finally {
 public:
@@ -1212,6 +1280,291 @@ bool pack_main(int argc, char *argv[])
     return true;
 }
 
+static bool format_code_from_name(const char *name, int *code_out)
+{
+    static const struct {
+        const char *name;
+        int code;
+    } formats[] = {
+        { MB_BI_FORMAT_NAME_ANDROID,  MB_BI_FORMAT_ANDROID  },
+        { MB_BI_FORMAT_NAME_BUMP,     MB_BI_FORMAT_BUMP     },
+        { MB_BI_FORMAT_NAME_LOKI,     MB_BI_FORMAT_LOKI     },
+        { MB_BI_FORMAT_NAME_MTK,      MB_BI_FORMAT_MTK      },
+        { MB_BI_FORMAT_NAME_SONY_ELF, MB_BI_FORMAT_SONY_ELF },
+    };
+
+    for (auto const &f : formats) {
+        if (strcmp(name, f.name) == 0) {
+            *code_out = f.code;
+            return true;
+        }
+    }
+
+    fprintf(stderr, "Invalid boot image type: %s\n", name);
+    return false;
+}
+
+struct ConvertSpec
+{
+    std::string input;
+    std::string output;
+    int format;
+};
+
+static bool read_batch_file(const std::string &path, int default_format,
+                            std::vector<ConvertSpec> &specs)
+{
+    ScopedFILE fp(fopen(path.c_str(), "rb"), fclose);
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                path.c_str(), strerror(errno));
+        return false;
+    }
+
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t read;
+    size_t line_num = 0;
+
+    auto free_line = finally([&]{
+        free(line);
+    });
+
+    while ((read = mb_getline(&line, &len, fp.get())) >= 0) {
+        std::vector<std::string> fields;
+        char *ptr = line;
+
+        ++line_num;
+
+        while (true) {
+            // Skip whitespace
+            while (*ptr && isspace(*ptr)) {
+                ++ptr;
+            }
+
+            // Skip empty and commented lines
+            if (!*ptr || (fields.empty() && *ptr == '#')) {
+                break;
+            }
+
+            char *begin = ptr;
+            while (*ptr && !isspace(*ptr)) {
+                ++ptr;
+            }
+            fields.emplace_back(begin, ptr);
+        }
+
+        if (fields.empty()) {
+            continue;
+        } else if (fields.size() < 2 || fields.size() > 3) {
+            fprintf(stderr, "%s:%" MB_PRIzu ": Invalid job: expected "
+                    "\"<input> <output> [<type>]\"\n", path.c_str(), line_num);
+            return false;
+        }
+
+        ConvertSpec spec;
+        spec.input = std::move(fields[0]);
+        spec.output = std::move(fields[1]);
+        spec.format = default_format;
+
+        if (fields.size() == 3
+                && !format_code_from_name(fields[2].c_str(), &spec.format)) {
+            return false;
+        }
+
+        specs.push_back(std::move(spec));
+    }
+
+    return true;
+}
+
+bool convert_main(int argc, char *argv[])
+{
+    int opt;
+    int format = 0;
+    unsigned int jobs = 0;
+    std::string aboot_file;
+    std::vector<std::string> batch_files;
+    std::vector<ConvertSpec> specs;
+
+    // Arguments with no short options
+    enum convert_options : int
+    {
+        OPT_ABOOT                = 10000 + 1,
+    };
+
+    static const char short_options[] = "t:j:b:" "h";
+
+    static struct option long_options[] = {
+        // Arguments with short versions
+        {"type",                 required_argument, 0, 't'},
+        {"jobs",                 required_argument, 0, 'j'},
+        {"batch",                required_argument, 0, 'b'},
+        // Arguments without short versions
+        {"aboot",                required_argument, 0, OPT_ABOOT},
+        // Misc
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 't':
+            if (!format_code_from_name(optarg, &format)) {
+                return false;
+            }
+            break;
+
+        case 'j':
+            if (!str_to_unum(optarg, 10, &jobs) || jobs == 0) {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                return false;
+            }
+            break;
+
+        case 'b':                      batch_files.push_back(optarg); break;
+        case OPT_ABOOT:                aboot_file = optarg;           break;
+
+        case 'h':
+            fputs(HELP_CONVERT_USAGE, stdout);
+            return true;
+
+        default:
+            fputs(HELP_CONVERT_USAGE, stderr);
+            return false;
+        }
+    }
+
+    // Positional arguments are pairs of input and output files
+    if ((argc - optind) % 2 != 0
+            || (argc - optind == 0 && batch_files.empty())) {
+        fputs(HELP_CONVERT_USAGE, stderr);
+        return false;
+    }
+
+    for (int i = optind; i < argc; i += 2) {
+        specs.push_back({ argv[i], argv[i + 1], format });
+    }
+
+    for (auto const &path : batch_files) {
+        if (!read_batch_file(path, format, specs)) {
+            return false;
+        }
+    }
+
+    std::vector<MbBiConvertJob> convert_jobs(specs.size());
+
+    for (size_t i = 0; i < specs.size(); ++i) {
+        convert_jobs[i].input_path = specs[i].input.c_str();
+        convert_jobs[i].output_path = specs[i].output.c_str();
+        convert_jobs[i].output_format = specs[i].format;
+        convert_jobs[i].aboot_path =
+                aboot_file.empty() ? nullptr : aboot_file.c_str();
+    }
+
+    mb_bi_convert_batch(convert_jobs.data(), convert_jobs.size(), jobs);
+
+    size_t failed = 0;
+
+    for (auto const &job : convert_jobs) {
+        if (job.ret != MB_BI_OK) {
+            fprintf(stderr, "%s\n", job.error_string);
+            ++failed;
+        }
+    }
+
+    if (failed > 0) {
+        fprintf(stderr, "Failed to convert %" MB_PRIzu " of %" MB_PRIzu
+                " boot images\n", failed, convert_jobs.size());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Parse arguments for commands that only take three positional arguments
+ *
+ * \return Whether the command should run. If false, \p ret is set to the
+ *         command's return value.
+ */
+static bool parse_three_args(int argc, char *argv[], const char *usage,
+                             bool &ret)
+{
+    int opt;
+
+    static const char short_options[] = "h";
+
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'h':
+            fputs(usage, stdout);
+            ret = true;
+            return false;
+
+        default:
+            fputs(usage, stderr);
+            ret = false;
+            return false;
+        }
+    }
+
+    if (argc - optind != 3) {
+        fputs(usage, stderr);
+        ret = false;
+        return false;
+    }
+
+    return true;
+}
+
+bool diff_main(int argc, char *argv[])
+{
+    char error[256];
+    bool ret;
+
+    if (!parse_three_args(argc, argv, HELP_DIFF_USAGE, ret)) {
+        return ret;
+    }
+
+    if (mb_bi_diff(argv[optind], argv[optind + 1], argv[optind + 2],
+                   error, sizeof(error)) != MB_BI_OK) {
+        fprintf(stderr, "%s\n", error);
+        return false;
+    }
+
+    return true;
+}
+
+bool patch_main(int argc, char *argv[])
+{
+    char error[256];
+    bool ret;
+
+    if (!parse_three_args(argc, argv, HELP_PATCH_USAGE, ret)) {
+        return ret;
+    }
+
+    if (mb_bi_patch(argv[optind], argv[optind + 1], argv[optind + 2],
+                    error, sizeof(error)) != MB_BI_OK) {
+        fprintf(stderr, "%s\n", error);
+        return false;
+    }
+
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 2) {
@@ -1226,6 +1579,12 @@ int main(int argc, char *argv[])
         ret = unpack_main(--argc, ++argv);
     } else if (command == "pack") {
         ret = pack_main(--argc, ++argv);
+    } else if (command == "convert") {
+        ret = convert_main(--argc, ++argv);
+    } else if (command == "diff") {
+        ret = diff_main(--argc, ++argv);
+    } else if (command == "patch") {
+        ret = patch_main(--argc, ++argv);
     } else {
         fputs(HELP_MAIN_USAGE, stderr);
         return EXIT_FAILURE;
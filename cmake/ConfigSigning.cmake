@@ -134,6 +134,44 @@ file(
     HEX
 )
 
+# Optional Ed25519 key for signing mbtool's binaries. Its signatures are much
+# cheaper to verify on the device than ones made with the RSA key from the
+# keystore. It must be an unencrypted PEM private key.
+set(MBP_SIGN_ED25519_KEY_PATH "" CACHE FILEPATH
+    "Ed25519 private key (PEM) for signing binaries instead of the keystore")
+
+set(MBP_SIGN_ED25519_PUBKEY_HEX "")
+
+if(MBP_SIGN_ED25519_KEY_PATH)
+    find_program(OPENSSL_COMMAND NAMES openssl)
+    if(NOT OPENSSL_COMMAND)
+        message(FATAL_ERROR "The 'openssl' program was not found")
+    endif()
+
+    # Export DER-encoded public key to file
+    execute_process(
+        COMMAND
+        "${OPENSSL_COMMAND}"
+        pkey
+        -in "${MBP_SIGN_ED25519_KEY_PATH}"
+        -pubout
+        -outform DER
+        -out "${CMAKE_BINARY_DIR}/ed25519_pubkey.der"
+        RESULT_VARIABLE ret
+    )
+    if(NOT ret EQUAL 0)
+        message(FATAL_ERROR "Failed to extract public key from Ed25519 key")
+    endif()
+
+    # Read DER public key as hex
+    file(
+        READ
+        ${CMAKE_BINARY_DIR}/ed25519_pubkey.der
+        MBP_SIGN_ED25519_PUBKEY_HEX
+        HEX
+    )
+endif()
+
 function(add_sign_files_target name)
     set(files)
     foreach(file ${ARGN})
@@ -19,6 +19,7 @@ if(${MBP_BUILD_TARGET} STREQUAL android)
 endif()
 
 if(${MBP_BUILD_TARGET} STREQUAL desktop)
+    include(cmake/dependencies/benchmark.cmake)
     include(cmake/dependencies/googletest.cmake)
     include(cmake/dependencies/libarchive.cmake)
     include(cmake/dependencies/liblzma.cmake)
@@ -39,6 +40,7 @@ elseif(${MBP_BUILD_TARGET} STREQUAL android-system)
     set(CMAKE_FIND_LIBRARY_SUFFIXES .a)
 
     include(cmake/dependencies/android-system-core.cmake)
+    include(cmake/dependencies/benchmark.cmake)
     include(cmake/dependencies/freetype2.cmake)
     include(cmake/dependencies/fuse.cmake)
     include(cmake/dependencies/iconv.cmake)
@@ -57,6 +59,7 @@ elseif(${MBP_BUILD_TARGET} STREQUAL android-system)
     unset(CMAKE_FIND_LIBRARY_SUFFIXES_OLD)
 elseif(${MBP_BUILD_TARGET} STREQUAL hosttools)
     include(cmake/dependencies/yaml-cpp.cmake)
+    include(cmake/dependencies/zlib.cmake)
 endif()
 
 # Needed for every target
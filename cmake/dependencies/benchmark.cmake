@@ -0,0 +1,5 @@
+if(MBP_ENABLE_BENCHMARKS)
+    # Google Benchmark must be installed (or benchmark_DIR must point to its
+    # CMake package) for the target being built
+    find_package(benchmark REQUIRED)
+endif()
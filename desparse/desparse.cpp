@@ -0,0 +1,474 @@
+/*
+ * Copyright (C) 2016-2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/file/fd.h"
+#include "mbsparse/sparse.h"
+
+// Raw and fill chunks are split into tasks of at most this size so that large
+// chunks are spread across threads
+#define MAX_TASK_SIZE           (8 * 1024 * 1024)
+// Per-thread copy buffer
+#define COPY_BUFFER_SIZE        (1024 * 1024)
+
+using namespace mb::sparse;
+
+struct Options
+{
+    unsigned int jobs = 0;
+    bool holes = true;
+    bool stats = false;
+};
+
+// Piece of the output file that a worker thread writes
+struct Task
+{
+    SparseChunkType type;
+    uint64_t offset;
+    uint64_t size;
+    // Offset of the data in the sparse image for raw chunks
+    uint64_t src_offset;
+    uint32_t fill_val;
+};
+
+struct ChunkStats
+{
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+};
+
+struct Context
+{
+    int input_fd;
+    int output_fd;
+    const char *input_path;
+    const char *output_path;
+    std::vector<Task> tasks;
+    std::atomic<size_t> next_task;
+    std::atomic<uint64_t> bytes_written;
+    std::atomic<bool> failed;
+    std::mutex error_lock;
+    std::string error;
+};
+
+static void usage(FILE *stream, const char *prog_name)
+{
+    fprintf(stream, "Usage: %s [option...] <input file> <output file>\n"
+                    "\n"
+                    "Converts an Android sparse image to a raw image. Chunks are written\n"
+                    "in parallel and DONT_CARE and zero fill chunks are left as holes in\n"
+                    "the output file.\n"
+                    "\n"
+                    "Options:\n"
+                    "  -j, --jobs <count>\n"
+                    "                  Number of threads (default: number of CPUs)\n"
+                    "  -s, --stats     Print throughput and chunk statistics\n"
+                    "  --no-holes      Write zeros instead of leaving holes\n"
+                    "  -h, --help      Display this help message\n",
+                    prog_name);
+}
+
+template<typename UIntType>
+static inline bool str_to_unum(const char *str, int base, UIntType *out)
+{
+    static_assert(!std::is_signed<UIntType>::value,
+                  "Integer type is not unsigned");
+    static_assert(std::numeric_limits<UIntType>::max() <= ULLONG_MAX,
+                  "Integer type to too large to handle");
+
+    char *end;
+    errno = 0;
+    auto num = strtoull(str, &end, base);
+    if (errno == ERANGE
+            || num > std::numeric_limits<UIntType>::max()) {
+        errno = ERANGE;
+        return false;
+    } else if (*str == '\0' || *end != '\0') {
+        errno = EINVAL;
+        return false;
+    }
+    *out = static_cast<UIntType>(num);
+    return true;
+}
+
+static void set_error(Context &ctx, const char *path, const char *action,
+                      int error)
+{
+    std::lock_guard<std::mutex> lock(ctx.error_lock);
+
+    if (!ctx.failed.exchange(true)) {
+        ctx.error = std::string(path) + ": " + action + ": " + strerror(error);
+    }
+}
+
+static bool pread_fully(int fd, void *buf, size_t size, uint64_t offset)
+{
+    char *ptr = static_cast<char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = pread(fd, ptr, size, static_cast<off_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+
+        ptr += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+
+    return true;
+}
+
+static bool pwrite_fully(int fd, const void *buf, size_t size, uint64_t offset)
+{
+    const char *ptr = static_cast<const char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = pwrite(fd, ptr, size, static_cast<off_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+
+        ptr += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+
+    return true;
+}
+
+static bool run_task(Context &ctx, const Task &task, std::vector<char> &buf)
+{
+    uint64_t done = 0;
+
+    if (task.type == SparseChunkType::Fill
+            || task.type == SparseChunkType::DontCare) {
+        // Fill buffer with the 32-bit pattern. Fill chunks are always a
+        // multiple of the 4-byte block size
+        for (size_t i = 0; i + sizeof(task.fill_val) <= buf.size();
+                i += sizeof(task.fill_val)) {
+            memcpy(buf.data() + i, &task.fill_val, sizeof(task.fill_val));
+        }
+    }
+
+    while (done < task.size) {
+        size_t n = static_cast<size_t>(
+                std::min<uint64_t>(task.size - done, buf.size()));
+
+        if (task.type == SparseChunkType::Raw
+                && !pread_fully(ctx.input_fd, buf.data(), n,
+                                task.src_offset + done)) {
+            set_error(ctx, ctx.input_path, "Failed to read file", errno);
+            return false;
+        }
+
+        if (!pwrite_fully(ctx.output_fd, buf.data(), n, task.offset + done)) {
+            set_error(ctx, ctx.output_path, "Failed to write file", errno);
+            return false;
+        }
+
+        done += n;
+        ctx.bytes_written += n;
+    }
+
+    return true;
+}
+
+static void worker(Context &ctx)
+{
+    std::vector<char> buf(COPY_BUFFER_SIZE);
+    size_t index;
+
+    while (!ctx.failed && (index = ctx.next_task++) < ctx.tasks.size()) {
+        if (!run_task(ctx, ctx.tasks[index], buf)) {
+            break;
+        }
+    }
+}
+
+static void add_tasks(std::vector<Task> &tasks, const SparseChunk &chunk)
+{
+    for (uint64_t offset = chunk.begin; offset < chunk.end;
+            offset += MAX_TASK_SIZE) {
+        Task task;
+        task.type = chunk.type;
+        task.offset = offset;
+        task.size = std::min<uint64_t>(chunk.end - offset, MAX_TASK_SIZE);
+        task.src_offset = chunk.src_begin + (offset - chunk.begin);
+        task.fill_val = chunk.type == SparseChunkType::Fill
+                ? chunk.fill_val : 0;
+        tasks.push_back(task);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+
+    int opt;
+
+    // Arguments with no short options
+    enum : int
+    {
+        OPT_NO_HOLES             = CHAR_MAX + 1,
+    };
+
+    static const char short_options[] = "hj:s";
+
+    static struct option long_options[] = {
+        // Arguments with short versions
+        {"help",         no_argument,       0, 'h'},
+        {"jobs",         required_argument, 0, 'j'},
+        {"stats",        no_argument,       0, 's'},
+        // Arguments without short versions
+        {"no-holes",     no_argument,       0, OPT_NO_HOLES},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'j':
+            if (!str_to_unum(optarg, 10, &opts.jobs) || opts.jobs == 0) {
+                fprintf(stderr, "Invalid value for -j/--jobs: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 's':
+            opts.stats = true;
+            break;
+
+        case OPT_NO_HOLES:
+            opts.holes = false;
+            break;
+
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (opts.jobs == 0) {
+        opts.jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    const char *input_path = argv[optind];
+    const char *output_path = argv[optind + 1];
+
+    Context ctx;
+    ctx.input_path = input_path;
+    ctx.output_path = output_path;
+    ctx.next_task = 0;
+    ctx.bytes_written = 0;
+    ctx.failed = false;
+
+    mb::FdFile input_file;
+    SparseFile sparse_file;
+    std::vector<SparseChunk> chunks;
+
+    if (!input_file.open(input_path, mb::FileOpenMode::READ_ONLY)) {
+        fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                input_path, input_file.error_string().c_str());
+        return EXIT_FAILURE;
+    }
+
+    if (!sparse_file.open(&input_file)) {
+        fprintf(stderr, "%s: %s\n",
+                input_path, sparse_file.error_string().c_str());
+        return EXIT_FAILURE;
+    }
+
+    // Only the chunk headers are read here. The chunk data is read directly
+    // by the worker threads.
+    if (!sparse_file.chunks(chunks)) {
+        fprintf(stderr, "%s: Failed to read chunks: %s\n",
+                input_path, sparse_file.error_string().c_str());
+        return EXIT_FAILURE;
+    }
+
+    uint64_t size = sparse_file.size();
+
+    ctx.input_fd = open(input_path, O_RDONLY | O_CLOEXEC);
+    if (ctx.input_fd < 0) {
+        fprintf(stderr, "%s: Failed to open for reading: %s\n",
+                input_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    ctx.output_fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                         0666);
+    if (ctx.output_fd < 0) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                output_path, strerror(errno));
+        close(ctx.input_fd);
+        return EXIT_FAILURE;
+    }
+
+    // Holes only read back as zeros in a regular file that was just
+    // truncated. For anything else (eg. block devices), zero fill chunks must
+    // be written. DONT_CARE regions can still be skipped.
+    struct stat sb;
+    bool regular = fstat(ctx.output_fd, &sb) == 0 && S_ISREG(sb.st_mode);
+    bool holes = opts.holes && regular;
+
+    if (regular) {
+        int error = 0;
+
+        if (size > static_cast<uint64_t>(std::numeric_limits<off_t>::max())) {
+            error = EFBIG;
+        } else if (ftruncate(ctx.output_fd, static_cast<off_t>(size)) < 0) {
+            error = errno;
+        }
+
+        if (error != 0) {
+            fprintf(stderr, "%s: Failed to set file size: %s\n",
+                    output_path, strerror(error));
+            close(ctx.input_fd);
+            close(ctx.output_fd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    ChunkStats raw_stats;
+    ChunkStats fill_stats;
+    ChunkStats dont_care_stats;
+    uint64_t skipped = 0;
+
+    for (auto const &chunk : chunks) {
+        uint64_t chunk_size = chunk.end - chunk.begin;
+        bool skip = false;
+
+        switch (chunk.type) {
+        case SparseChunkType::Raw:
+            ++raw_stats.count;
+            raw_stats.bytes += chunk_size;
+            break;
+        case SparseChunkType::Fill:
+            ++fill_stats.count;
+            fill_stats.bytes += chunk_size;
+            skip = holes && chunk.fill_val == 0;
+            break;
+        case SparseChunkType::DontCare:
+            ++dont_care_stats.count;
+            dont_care_stats.bytes += chunk_size;
+            skip = opts.holes;
+            break;
+        }
+
+        if (skip) {
+            skipped += chunk_size;
+        } else {
+            add_tasks(ctx.tasks, chunk);
+        }
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    unsigned int n_threads = static_cast<unsigned int>(
+            std::max<size_t>(1, std::min<size_t>(opts.jobs, ctx.tasks.size())));
+
+    for (unsigned int i = 1; i < n_threads; ++i) {
+        threads.emplace_back(worker, std::ref(ctx));
+    }
+    worker(ctx);
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    close(ctx.input_fd);
+
+    if (close(ctx.output_fd) < 0 && !ctx.failed) {
+        set_error(ctx, output_path, "Failed to close file", errno);
+    }
+
+    if (ctx.failed) {
+        fprintf(stderr, "%s\n", ctx.error.c_str());
+        return EXIT_FAILURE;
+    }
+
+    if (opts.stats) {
+        double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start_time).count();
+        uint64_t written = ctx.bytes_written;
+
+        printf("Output size:   %" PRIu64 " bytes\n", size);
+        printf("Bytes written: %" PRIu64 " bytes\n", written);
+        printf("Skipped:       %" PRIu64 " bytes\n", skipped);
+        printf("Raw:           %" PRIu64 " chunks (%" PRIu64 " bytes)\n",
+               raw_stats.count, raw_stats.bytes);
+        printf("Fill:          %" PRIu64 " chunks (%" PRIu64 " bytes)\n",
+               fill_stats.count, fill_stats.bytes);
+        printf("Don't care:    %" PRIu64 " chunks (%" PRIu64 " bytes)\n",
+               dont_care_stats.count, dont_care_stats.bytes);
+        printf("Elapsed:       %.3f seconds with %u threads\n",
+               seconds, n_threads);
+        printf("Throughput:    %.1f MiB/s written, %.1f MiB/s output\n",
+               seconds > 0 ? written / seconds / 1024 / 1024 : 0.0,
+               seconds > 0 ? size / seconds / 1024 / 1024 : 0.0);
+    }
+
+    return EXIT_SUCCESS;
+}
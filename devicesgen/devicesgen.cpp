@@ -26,6 +26,7 @@
 #include <jansson.h>
 #include <yaml-cpp/yaml.h>
 
+#include "mbdevice/database.h"
 #include "mbdevice/json.h"
 
 
@@ -202,6 +203,46 @@ static bool validate(const std::string &path, const std::string &json,
     return true;
 }
 
+static bool write_database(const char *path, json_t *json_root)
+{
+    ScopedCharArray json(json_dumps(json_root, JSON_COMPACT), &free);
+    std::vector<Device> devices;
+    JsonError error;
+    std::string data;
+
+    if (!device_list_from_json(json.get(), devices, error)) {
+        print_json_error(path, error);
+        return false;
+    }
+
+    if (!device_list_to_database(devices, data)) {
+        fprintf(stderr, "%s: Failed to build device database\n", path);
+        return false;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open file: %s\n",
+                path, strerror(errno));
+        return false;
+    }
+
+    if (fwrite(data.data(), 1, data.size(), fp) != data.size()) {
+        fprintf(stderr, "%s: Failed to write file: %s\n",
+                path, strerror(errno));
+        fclose(fp);
+        return false;
+    }
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "%s: Failed to close file: %s\n",
+                path, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
 static void usage(FILE *stream)
 {
     fprintf(stream,
@@ -210,6 +251,8 @@ static void usage(FILE *stream)
             "Options:\n"
             "  -o, --output <file>\n"
             "                   Output file (outputs to stdout if omitted)\n"
+            "  -b, --binary <file>\n"
+            "                   Also write a binary device database\n"
             "  -h, --help       Display this help message\n"
             "  --styled         Output in human-readable format\n");
 }
@@ -222,11 +265,12 @@ int main(int argc, char *argv[])
         OPT_STYLED             = 1000,
     };
 
-    static const char short_options[] = "o:h";
+    static const char short_options[] = "o:b:h";
 
     static struct option long_options[] = {
         {"styled", no_argument, 0, OPT_STYLED},
         {"output", required_argument, 0, 'o'},
+        {"binary", required_argument, 0, 'b'},
         {"help", no_argument, 0, 'h'},
         {0, 0, 0, 0}
     };
@@ -234,6 +278,7 @@ int main(int argc, char *argv[])
     int long_index = 0;
 
     const char *output_file = nullptr;
+    const char *binary_file = nullptr;
     bool styled = false;
 
     while ((opt = getopt_long(argc, argv, short_options,
@@ -247,6 +292,10 @@ int main(int argc, char *argv[])
             output_file = optarg;
             break;
 
+        case 'b':
+            binary_file = optarg;
+            break;
+
         case 'h':
             usage(stdout);
             return EXIT_SUCCESS;
@@ -289,6 +338,10 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (binary_file && !write_database(binary_file, json_root.get())) {
+        return EXIT_FAILURE;
+    }
+
     FILE *fp = stdout;
 
     if (output_file) {
@@ -25,6 +25,7 @@
 #include <mbdevice/json.h>
 #include <mbpatcher/errors.h>
 
+#include <QtCore/QMutexLocker>
 #include <QtCore/QStringBuilder>
 #include <QtWidgets/QApplication>
 #include <QtWidgets/QFrame>
@@ -33,9 +34,14 @@
 #include <QtWidgets/QGroupBox>
 
 
-const int patcherPtrTypeId = qRegisterMetaType<PatcherPtr>("PatcherPtr");
 const int fileInfoPtrTypeId = qRegisterMetaType<FileInfoPtr>("FileInfoPtr");
-const int uint64TypeId = qRegisterMetaType<uint64_t>("uint64_t");
+const int fileInfoPtrVectorTypeId =
+        qRegisterMetaType<QVector<FileInfoPtr>>("QVector<FileInfoPtr>");
+
+// Refresh the progress at about the display's frame rate
+static const int progressUpdateIntervalMs = 16;
+
+static QString errorToString(const mb::patcher::ErrorCode &error);
 
 MainWindowPrivate::MainWindowPrivate()
     : settings(qApp->applicationDirPath() % QStringLiteral("/settings.ini"),
@@ -54,10 +60,10 @@ MainWindow::MainWindow(mb::patcher::PatcherConfig *pc, QWidget *parent)
     // If we're passed an argument, switch to automatic mode
     if (qApp->arguments().size() > 2) {
         d->autoMode = true;
-        d->fileName = qApp->arguments().at(1);
+        d->fileNames << qApp->arguments().at(1);
     } else {
         d->autoMode = false;
-        d->fileName.clear();
+        d->fileNames.clear();
     }
 
     d->pc = pc;
@@ -79,7 +85,7 @@ MainWindow::MainWindow(mb::patcher::PatcherConfig *pc, QWidget *parent)
 
     // Create thread
     d->thread = new QThread(this);
-    d->task = new PatcherTask();
+    d->task = new PatcherTask(pc);
     d->task->moveToThread(d->thread);
 
     connect(d->thread, &QThread::finished,
@@ -88,24 +94,21 @@ MainWindow::MainWindow(mb::patcher::PatcherConfig *pc, QWidget *parent)
             d->task, &PatcherTask::patch);
     connect(d->task, &PatcherTask::finished,
             this, &MainWindow::onPatchingFinished);
-    connect(d->task, &PatcherTask::progressUpdated,
-            this, &MainWindow::onProgressUpdated);
-    connect(d->task, &PatcherTask::filesUpdated,
-            this, &MainWindow::onFilesUpdated);
-    connect(d->task, &PatcherTask::detailsUpdated,
-            this, &MainWindow::onDetailsUpdated);
 
     d->thread->start();
+
+    d->progressTimer = new QTimer(this);
+    d->progressTimer->setInterval(progressUpdateIntervalMs);
+    connect(d->progressTimer, &QTimer::timeout,
+            this, &MainWindow::onProgressTimer);
 }
 
 MainWindow::~MainWindow()
 {
     Q_D(MainWindow);
 
-    if (d->patcher) {
-        d->patcher->cancel_patching();
-        d->pc->destroy_patcher(d->patcher);
-        d->patcher = nullptr;
+    if (d->state == MainWindowPrivate::Patching) {
+        d->task->cancel();
     }
 
     if (d->thread != nullptr) {
@@ -204,66 +207,70 @@ void MainWindow::onChooseFileItemClicked(QAction *action)
 
     if (action == d->chooseFlashableZip) {
         d->patcherId = QStringLiteral("ZipPatcher");
-        chooseFile(tr("Flashable zips (*.zip)"));
+        chooseFiles(tr("Flashable zips (*.zip)"));
     } else if (action == d->chooseOdinImage) {
         d->patcherId = QStringLiteral("OdinPatcher");
-        chooseFile(tr("Odin images (*.zip *.tar.md5 *.tar.md5.gz *.tar.md5.xz)"));
+        chooseFiles(tr("Odin images (*.zip *.tar.md5 *.tar.md5.gz *.tar.md5.xz)"));
     }
 }
 
-void MainWindow::onProgressUpdated(uint64_t bytes, uint64_t maxBytes)
+void MainWindow::onProgressTimer()
 {
     Q_D(MainWindow);
 
+    if (!d->task->takeStatus(&d->jobs)) {
+        return;
+    }
+
     // Normalize values to 1000000
     static const int normalize = 1000000;
 
+    double sum = 0.0;
+    int files = 0;
+    QStringList details;
+
+    for (const PatcherTask::JobStatus &job : d->jobs) {
+        if (job.finished) {
+            sum += 1.0;
+            ++files;
+        } else if (job.started) {
+            if (job.maxBytes != 0) {
+                sum += (double) job.bytes / job.maxBytes;
+            }
+            details << QStringLiteral("%1: %2")
+                    .arg(QFileInfo(job.inputFile).fileName())
+                    .arg(job.details);
+        }
+    }
+
     int value;
     int max;
-    if (maxBytes == 0) {
+    if (d->jobs.isEmpty() || (files == 0 && sum == 0.0)) {
         value = 0;
         max = 0;
     } else {
-        value = (double) bytes / maxBytes * normalize;
+        value = sum / d->jobs.size() * normalize;
         max = normalize;
     }
 
     d->progressBar->setMaximum(max);
     d->progressBar->setValue(value);
-    d->bytes = bytes;
-    d->maxBytes = maxBytes;
-
-    updateProgressText();
-}
-
-void MainWindow::onFilesUpdated(uint64_t files, uint64_t maxFiles)
-{
-    Q_D(MainWindow);
-
+    d->progress = value;
+    d->maxProgress = max;
     d->files = files;
-    d->maxFiles = maxFiles;
+    d->maxFiles = d->jobs.size();
 
-    updateProgressText();
-}
+    d->detailsLbl->setText(details.join(QLatin1Char('\n')));
 
-void MainWindow::onDetailsUpdated(const QString &text)
-{
-    Q_D(MainWindow);
-
-    d->detailsLbl->setText(text);
+    updateProgressText();
 }
 
-void MainWindow::onPatchingFinished(const QString &newFile, bool failed,
-                                    const QString &errorMessage)
+void MainWindow::onPatchingFinished()
 {
     Q_D(MainWindow);
 
-    d->pc->destroy_patcher(d->patcher);
-    d->patcher = nullptr;
-
-    d->patcherNewFile = newFile;
-    d->patcherFailed = failed;
-    d->patcherError = errorMessage;
+    d->progressTimer->stop();
+    onProgressTimer();
 
     d->state = MainWindowPrivate::FinishedPatching;
     updateWidgetsVisibility();
@@ -274,8 +281,8 @@ void MainWindow::updateProgressText()
     Q_D(MainWindow);
 
     double percentage = 0.0;
-    if (d->maxBytes != 0) {
-        percentage = 100.0 * d->bytes / d->maxBytes;
+    if (d->maxProgress != 0) {
+        percentage = 100.0 * d->progress / d->maxProgress;
     }
 
     d->progressBar->setFormat(tr("%1% - %2 / %3 files")
@@ -494,23 +501,23 @@ void MainWindow::populateInstallationLocations()
     d->instLocSel->addItem(tr("Extsd-slot"));
 }
 
-void MainWindow::chooseFile(const QString &patterns)
+void MainWindow::chooseFiles(const QString &patterns)
 {
     Q_D(MainWindow);
 
-    QString fileName = QFileDialog::getOpenFileName(this, QString(),
+    QStringList fileNames = QFileDialog::getOpenFileNames(this, QString(),
             d->settings.value(QStringLiteral("last_dir")).toString(),
             patterns);
-    if (fileName.isNull()) {
+    if (fileNames.isEmpty()) {
         return;
     }
 
     d->settings.setValue(QStringLiteral("last_dir"),
-                         QFileInfo(fileName).dir().absolutePath());
+                         QFileInfo(fileNames.first()).dir().absolutePath());
 
     d->state = MainWindowPrivate::ChoseFile;
 
-    d->fileName = fileName;
+    d->fileNames = fileNames;
 
     updateWidgetsVisibility();
 }
@@ -537,34 +544,95 @@ void MainWindow::updateWidgetsVisibility()
     }
 
     if (d->state == MainWindowPrivate::ChoseFile) {
-        d->messageLbl->setText(tr("File: %1").arg(d->fileName));
+        if (d->fileNames.size() == 1) {
+            d->messageLbl->setText(tr("File: %1").arg(d->fileNames.first()));
+        } else {
+            d->messageLbl->setText(tr("Files:\n%1").arg(
+                    d->fileNames.join(QLatin1Char('\n'))));
+        }
     } else if (d->state == MainWindowPrivate::FinishedPatching) {
         QString message;
+        int failed = 0;
+
+        for (const PatcherTask::JobStatus &job : d->jobs) {
+            if (job.error != mb::patcher::ErrorCode::NoError) {
+                message.append(tr("Failed to patch file: %1\n\n")
+                        .arg(job.inputFile));
+                message.append(errorToString(job.error));
+                message.append(QStringLiteral("\n\n"));
+                ++failed;
+            } else {
+                message.append(tr("New file: %1\n\n").arg(job.outputFile));
+            }
+        }
 
-        if (d->patcherFailed) {
-            message.append(tr("Failed to patch file: %1\n\n").arg(d->fileName));
-            message.append(d->patcherError);
+        if (d->jobs.size() == 1) {
+            if (failed == 0) {
+                message.append(tr("Successfully patched file"));
+            }
+        } else if (failed == 0) {
+            message.append(tr("Successfully patched %1 files")
+                    .arg(d->jobs.size()));
         } else {
-            message.append(tr("New file: %1\n\n").arg(d->patcherNewFile));
-            message.append(tr("Successfully patched file"));
+            message.append(tr("Failed to patch %1 of %2 files")
+                    .arg(failed).arg(d->jobs.size()));
         }
 
-        d->messageLbl->setText(message);
+        d->messageLbl->setText(message.trimmed());
+    }
+}
+
+/*!
+ * \brief Get the path of the patched file
+ *
+ * Input name: <parent path>/<base name>.<suffix>
+ * Output name: <parent path>/<base name>_<rom id>.zip
+ */
+static QString outputPathForFile(const QString &fileName, const QString &romId)
+{
+    QStringList suffixes;
+    suffixes << QStringLiteral(".tar.md5");
+    suffixes << QStringLiteral(".tar.md5.gz");
+    suffixes << QStringLiteral(".tar.md5.xz");
+    suffixes << QStringLiteral(".zip");
+
+    QFileInfo qFileInfo(fileName);
+    QString outputName;
+
+    for (const QString &suffix : suffixes) {
+        if (fileName.endsWith(suffix)) {
+            outputName = fileName.left(fileName.size() - suffix.size())
+                    % QStringLiteral("_")
+                    % romId
+                    % QStringLiteral(".zip");
+            break;
+        }
+    }
+    if (outputName.isEmpty()) {
+        outputName = qFileInfo.completeBaseName()
+                % QStringLiteral("_")
+                % romId
+                % QStringLiteral(".")
+                % qFileInfo.suffix();
     }
+
+    return QDir::toNativeSeparators(qFileInfo.dir().filePath(outputName));
 }
 
 void MainWindow::startPatching()
 {
     Q_D(MainWindow);
 
-    d->bytes = 0;
-    d->maxBytes = 0;
+    d->progress = 0;
+    d->maxProgress = 0;
     d->files = 0;
-    d->maxFiles = 0;
+    d->maxFiles = d->fileNames.size();
+    d->jobs.clear();
 
     d->progressBar->setMaximum(0);
     d->progressBar->setValue(0);
     d->detailsLbl->clear();
+    updateProgressText();
 
     d->state = MainWindowPrivate::Patching;
     updateWidgetsVisibility();
@@ -578,49 +646,25 @@ void MainWindow::startPatching()
         romId = d->instLocs[d->instLocSel->currentIndex()].id;
     }
 
+    QVector<FileInfoPtr> infos;
 
-    QStringList suffixes;
-    suffixes << QStringLiteral(".tar.md5");
-    suffixes << QStringLiteral(".tar.md5.gz");
-    suffixes << QStringLiteral(".tar.md5.xz");
-    suffixes << QStringLiteral(".zip");
+    for (const QString &fileName : d->fileNames) {
+        QString inputPath(QDir::toNativeSeparators(
+                QFileInfo(fileName).filePath()));
+        QString outputPath(outputPathForFile(fileName, romId));
 
-    QFileInfo qFileInfo(d->fileName);
-    QString suffix;
-    QString outputName;
+        FileInfoPtr fileInfo = new mb::patcher::FileInfo();
+        fileInfo->set_input_path(inputPath.toUtf8().constData());
+        fileInfo->set_output_path(outputPath.toUtf8().constData());
+        fileInfo->set_device(*d->device);
+        fileInfo->set_rom_id(romId.toUtf8().constData());
 
-    for (const QString &suffix : suffixes) {
-        if (d->fileName.endsWith(suffix)) {
-            // Input name: <parent path>/<base name>.<suffix>
-            // Output name: <parent path>/<base name>_<rom id>.zip
-            outputName = d->fileName.left(d->fileName.size() - suffix.size())
-                    % QStringLiteral("_")
-                    % romId
-                    % QStringLiteral(".zip");
-            break;
-        }
-    }
-    if (outputName.isEmpty()) {
-        outputName = qFileInfo.completeBaseName()
-                % QStringLiteral("_")
-                % romId
-                % QStringLiteral(".")
-                % qFileInfo.suffix();
+        infos << fileInfo;
     }
 
-    QString inputPath(QDir::toNativeSeparators(qFileInfo.filePath()));
-    QString outputPath(QDir::toNativeSeparators(
-            qFileInfo.dir().filePath(outputName)));
+    d->progressTimer->start();
 
-    FileInfoPtr fileInfo = new mb::patcher::FileInfo();
-    fileInfo->set_input_path(inputPath.toUtf8().constData());
-    fileInfo->set_output_path(outputPath.toUtf8().constData());
-    fileInfo->set_device(*d->device);
-    fileInfo->set_rom_id(romId.toUtf8().constData());
-
-    d->patcher = d->pc->create_patcher(d->patcherId.toStdString());
-
-    emit runThread(d->patcher, fileInfo);
+    emit runThread(d->patcherId, infos);
 }
 
 QWidget * MainWindow::newHorizLine(QWidget *parent)
@@ -681,63 +725,132 @@ static QString errorToString(const mb::patcher::ErrorCode &error) {
 }
 
 
-PatcherTask::PatcherTask(QWidget *parent)
-    : QObject(parent)
+PatcherTask::PatcherTask(mb::patcher::PatcherConfig *pc, QWidget *parent)
+    : QObject(parent), _pc(pc)
 {
 }
 
-static void progressUpdatedCbWrapper(uint64_t bytes, uint64_t maxBytes,
-                                     void *userData)
+static void progressUpdatedCbWrapper(size_t index, uint64_t bytes,
+                                     uint64_t maxBytes, void *userData)
 {
     PatcherTask *task = static_cast<PatcherTask *>(userData);
-    task->progressUpdatedCb(bytes, maxBytes);
+    task->progressUpdatedCb(index, bytes, maxBytes);
 }
 
-static void filesUpdatedCbWrapper(uint64_t files, uint64_t maxFiles,
-                                  void *userData)
+static void detailsUpdatedCbWrapper(size_t index, const std::string &text,
+                                    void *userData)
 {
     PatcherTask *task = static_cast<PatcherTask *>(userData);
-    task->filesUpdatedCb(files, maxFiles);
+    task->detailsUpdatedCb(index, text);
 }
 
-static void detailsUpdatedCbWrapper(const std::string &text, void *userData)
+static void jobFinishedCbWrapper(size_t index, mb::patcher::ErrorCode error,
+                                 void *userData)
 {
     PatcherTask *task = static_cast<PatcherTask *>(userData);
-    task->detailsUpdatedCb(text);
+    task->jobFinishedCb(index, error);
 }
 
-void PatcherTask::patch(PatcherPtr patcher, FileInfoPtr info)
+/*!
+ * \brief Patch files with a pool of worker threads
+ *
+ * This runs in the task's thread and returns once all files have been patched.
+ * libmbpatcher runs one job per CPU and limits the deflate threads of each job
+ * so that the whole batch uses about one thread per CPU.
+ */
+void PatcherTask::patch(const QString &patcherId, QVector<FileInfoPtr> infos)
 {
-    patcher->set_file_info(info);
+    std::vector<mb::patcher::PatcherConfig::BatchJob> jobs;
+    std::string id = patcherId.toStdString();
 
-    bool ret = patcher->patch_file(&progressUpdatedCbWrapper,
-                                   &filesUpdatedCbWrapper,
-                                   &detailsUpdatedCbWrapper,
-                                   this);
+    {
+        QMutexLocker locker(&_mutex);
 
-    QString newFile(QString::fromStdString(info->output_path()));
+        _status.clear();
+        _status.resize(infos.size());
 
-    patcher->set_file_info(nullptr);
-    delete info;
+        for (int i = 0; i < infos.size(); ++i) {
+            _status[i].inputFile =
+                    QString::fromStdString(infos[i]->input_path());
+            _status[i].outputFile =
+                    QString::fromStdString(infos[i]->output_path());
+        }
 
-    if (!ret) {
-        emit finished(QString(), true, errorToString(patcher->error()));
-    } else {
-        emit finished(newFile, false, QString());
+        _changed = true;
+    }
+
+    for (FileInfoPtr info : infos) {
+        jobs.push_back({ id, info });
+    }
+
+    _pc->patch_batch(jobs, 0, &progressUpdatedCbWrapper,
+                     &detailsUpdatedCbWrapper, &jobFinishedCbWrapper, this);
+
+    qDeleteAll(infos);
+
+    emit finished();
+}
+
+/*!
+ * \brief Cancel all files that are being or have yet to be patched
+ *
+ * This can be called from any thread.
+ */
+void PatcherTask::cancel()
+{
+    _pc->cancel_batch();
+}
+
+/*!
+ * \brief Get the status of the batch if it changed since the last call
+ *
+ * This can be called from any thread.
+ *
+ * \return Whether \p status was updated
+ */
+bool PatcherTask::takeStatus(QVector<JobStatus> *status)
+{
+    QMutexLocker locker(&_mutex);
+
+    if (!_changed) {
+        return false;
     }
+
+    *status = _status;
+    _changed = false;
+    return true;
 }
 
-void PatcherTask::progressUpdatedCb(uint64_t bytes, uint64_t maxBytes)
+void PatcherTask::progressUpdatedCb(size_t index, uint64_t bytes,
+                                    uint64_t maxBytes)
 {
-    emit progressUpdated(bytes, maxBytes);
+    QMutexLocker locker(&_mutex);
+
+    JobStatus &job = _status[index];
+    job.started = true;
+    job.bytes = bytes;
+    job.maxBytes = maxBytes;
+    _changed = true;
 }
 
-void PatcherTask::filesUpdatedCb(uint64_t files, uint64_t maxFiles)
+void PatcherTask::detailsUpdatedCb(size_t index, const std::string &text)
 {
-    emit filesUpdated(files, maxFiles);
+    QString details(QString::fromStdString(text));
+
+    QMutexLocker locker(&_mutex);
+
+    JobStatus &job = _status[index];
+    job.started = true;
+    job.details = details;
+    _changed = true;
 }
 
-void PatcherTask::detailsUpdatedCb(const std::string &text)
+void PatcherTask::jobFinishedCb(size_t index, mb::patcher::ErrorCode error)
 {
-    emit detailsUpdated(QString::fromStdString(text));
+    QMutexLocker locker(&_mutex);
+
+    JobStatus &job = _status[index];
+    job.finished = true;
+    job.error = error;
+    _changed = true;
 }
@@ -25,12 +25,12 @@
 #include <mbpatcher/patcherinterface.h>
 
 #include <QtCore/QMetaType>
+#include <QtCore/QMutex>
+#include <QtCore/QVector>
 #include <QtWidgets/QAbstractButton>
 #include <QtWidgets/QWidget>
 
 
-typedef mb::patcher::Patcher * PatcherPtr;
-Q_DECLARE_METATYPE(PatcherPtr)
 typedef mb::patcher::FileInfo * FileInfoPtr;
 Q_DECLARE_METATYPE(FileInfoPtr)
 
@@ -45,7 +45,7 @@ public:
     ~MainWindow();
 
 signals:
-    void runThread(PatcherPtr patcher, FileInfoPtr info);
+    void runThread(const QString &patcherId, QVector<FileInfoPtr> infos);
 
 private slots:
     void onDeviceSelected(int index);
@@ -55,12 +55,9 @@ private slots:
     void onChooseFileItemClicked(QAction *action);
 
     // Progress
-    void onProgressUpdated(uint64_t bytes, uint64_t maxBytes);
-    void onFilesUpdated(uint64_t files, uint64_t maxFiles);
-    void onDetailsUpdated(const QString &text);
+    void onProgressTimer();
 
-    void onPatchingFinished(const QString &newFile, bool failed,
-                            const QString &errorMessage);
+    void onPatchingFinished();
 
 private:
     virtual void closeEvent(QCloseEvent *event) override;
@@ -73,7 +70,7 @@ private:
     void populateDevices();
     void populateInstallationLocations();
 
-    void chooseFile(const QString &patterns);
+    void chooseFiles(const QString &patterns);
     void startPatching();
 
     void updateWidgetsVisibility();
@@ -84,27 +81,45 @@ private:
     Q_DECLARE_PRIVATE(MainWindow)
 };
 
-class PatcherTaskPrivate;
-
 class PatcherTask : public QObject
 {
     Q_OBJECT
 
 public:
-    PatcherTask(QWidget *parent = 0);
+    struct JobStatus
+    {
+        QString inputFile;
+        QString outputFile;
+        uint64_t bytes = 0;
+        uint64_t maxBytes = 0;
+        QString details;
+        bool started = false;
+        bool finished = false;
+        mb::patcher::ErrorCode error = mb::patcher::ErrorCode::NoError;
+    };
+
+    PatcherTask(mb::patcher::PatcherConfig *pc, QWidget *parent = 0);
+
+    void patch(const QString &patcherId, QVector<FileInfoPtr> infos);
+    void cancel();
 
-    void patch(PatcherPtr patcher, FileInfoPtr info);
+    bool takeStatus(QVector<JobStatus> *status);
 
-    void progressUpdatedCb(uint64_t bytes, uint64_t maxBytes);
-    void filesUpdatedCb(uint64_t files, uint64_t maxFiles);
-    void detailsUpdatedCb(const std::string &text);
+    void progressUpdatedCb(size_t index, uint64_t bytes, uint64_t maxBytes);
+    void detailsUpdatedCb(size_t index, const std::string &text);
+    void jobFinishedCb(size_t index, mb::patcher::ErrorCode error);
 
 signals:
-    void finished(const QString &newFile, bool failed,
-                  const QString &errorMessage);
-    void progressUpdated(uint64_t bytes, uint64_t maxBytes);
-    void filesUpdated(uint64_t files, uint64_t maxFiles);
-    void detailsUpdated(const QString &text);
+    void finished();
+
+private:
+    mb::patcher::PatcherConfig *_pc;
+
+    // Written by the batch's worker threads and polled by the UI thread at
+    // its frame rate, so progress updates never queue up in the event loop
+    QMutex _mutex;
+    QVector<JobStatus> _status;
+    bool _changed = false;
 };
 
 #endif // MAINWINDOW_H
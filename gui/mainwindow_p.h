@@ -31,6 +31,7 @@
 
 #include <QtCore/QSettings>
 #include <QtCore/QThread>
+#include <QtCore/QTimer>
 #include <QtWidgets/QCheckBox>
 #include <QtWidgets/QComboBox>
 #include <QtWidgets/QDialogButtonBox>
@@ -62,36 +63,36 @@ public:
 
     MainWindowPrivate();
 
-    uint64_t bytes;
-    uint64_t maxBytes;
-    uint64_t files;
-    uint64_t maxFiles;
+    // Overall progress (the average of each file's progress)
+    int progress;
+    int maxProgress;
+    // Number of files that have been patched
+    int files;
+    int maxFiles;
 
     QSettings settings;
 
     // Current state of the patcher
     State state = FirstRun;
 
-    // Selected file
+    // Selected files
     QString patcherId;
-    QString fileName;
+    QStringList fileNames;
     bool autoMode;
 
     mb::patcher::PatcherConfig *pc = nullptr;
     std::vector<mb::device::Device> devices;
 
-    // Selected patcher
-    mb::patcher::Patcher *patcher = nullptr;
-
-    // Patcher finish status and error message
-    QString patcherNewFile;
-    bool patcherFailed;
-    QString patcherError;
+    // Status of each file of the last batch
+    QVector<PatcherTask::JobStatus> jobs;
 
     // Threads
     QThread *thread;
     PatcherTask *task;
 
+    // Refreshes the progress widgets while patching
+    QTimer *progressTimer;
+
     // Selected device
     mb::device::Device *device = nullptr;
 
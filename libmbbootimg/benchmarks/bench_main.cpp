@@ -0,0 +1,686 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark harness for the libmbbootimg readers and writers.
+ *
+ * For each format, a synthetic image with kernel and ramdisk payloads of the
+ * requested size is written and then read back. The following operations are
+ * timed:
+ *
+ *   * write:  writing the complete image
+ *   * open:   opening the image with all formats enabled
+ *   * bid:    reading the header with all formats enabled (includes bidding)
+ *   * header: reading the header with the format forced (parsing only)
+ *   * read:   sequentially reading the data of every entry
+ *
+ * The number of read/write syscalls per operation is taken from /proc/self/io
+ * where it is available.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include "mbcommon/common.h"
+#include "mbcommon/endian.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/format/mtk_defs.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+#define BENCH_READ_BUF_SIZE             (1024 * 1024)
+
+// Must match a target in src/format/loki.cpp
+#define BENCH_LOKI_ABOOT_BASE           0x88e00000
+#define BENCH_LOKI_CHECK_SIGS           0x88e0ff98
+#define BENCH_LOKI_ABOOT_SIZE           0x20000
+#define BENCH_LOKI_PATTERN              "\xf0\xb5\x8f\xb0\x06\x46\xf0\xf7"
+
+#define BENCH_MTK_HEADER_SIZE \
+        (MTK_MAGIC_SIZE + 4 + MTK_TYPE_SIZE + MTK_UNUSED_SIZE)
+
+static const char HELP_USAGE[] =
+    "Usage: mbbootimg_bench [option...]\n"
+    "\n"
+    "Options:\n"
+    "  -s, --size <MiB>     Size of the kernel and ramdisk payloads [Default: 16]\n"
+    "  -n, --iterations <n> Number of iterations per operation [Default: 5]\n"
+    "  -f, --format <name>  Format to benchmark (can be repeated) [Default: all]\n"
+    "  -d, --dir <dir>      Directory for temporary images [Default: $TMPDIR]\n"
+    "  -h, --help           Display this help message\n"
+    "\n"
+    "Supported formats: android, bump, loki, mtk, sony_elf\n";
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+struct BenchFormat
+{
+    const char *name;
+    int code;
+};
+
+static BenchFormat formats[] = {
+    { "android",  MB_BI_FORMAT_ANDROID  },
+    { "bump",     MB_BI_FORMAT_BUMP     },
+    { "loki",     MB_BI_FORMAT_LOKI     },
+    { "mtk",      MB_BI_FORMAT_MTK      },
+    { "sony_elf", MB_BI_FORMAT_SONY_ELF },
+};
+
+struct BenchPayloads
+{
+    std::string kernel;
+    std::string ramdisk;
+    std::string aboot;
+    std::string mtk_kernel_header;
+    std::string mtk_ramdisk_header;
+};
+
+struct BenchResult
+{
+    double total_seconds = 0;
+    uint64_t total_bytes = 0;
+    uint64_t total_syscalls = 0;
+    bool have_syscalls = true;
+};
+
+/*!
+ * \brief Get the number of read and write syscalls made by this process
+ *
+ * \return Whether the counters could be read from /proc/self/io
+ */
+static bool get_syscall_count(uint64_t &count)
+{
+    FILE *fp = fopen("/proc/self/io", "r");
+    if (!fp) {
+        return false;
+    }
+
+    char line[128];
+    uint64_t syscr = 0;
+    uint64_t syscw = 0;
+    int found = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "syscr: %" SCNu64, &syscr) == 1
+                || sscanf(line, "syscw: %" SCNu64, &syscw) == 1) {
+            ++found;
+        }
+    }
+
+    fclose(fp);
+
+    count = syscr + syscw;
+    return found == 2;
+}
+
+/*!
+ * \brief Fill buffer with deterministic, poorly compressible data
+ */
+static void fill_payload(std::string &buf, size_t size, uint32_t seed)
+{
+    buf.resize(size);
+
+    uint32_t state = seed;
+    for (size_t i = 0; i < size; ++i) {
+        state = state * 1103515245 + 12345;
+        buf[i] = static_cast<char>(state >> 16);
+    }
+}
+
+/*!
+ * \brief Create fake aboot image that the Loki patcher recognizes
+ */
+static void make_loki_aboot(std::string &buf)
+{
+    buf.assign(BENCH_LOKI_ABOOT_SIZE, '\0');
+
+    uint32_t base = mb_htole32(BENCH_LOKI_ABOOT_BASE + 0x28);
+    memcpy(&buf[12], &base, sizeof(base));
+    memcpy(&buf[BENCH_LOKI_CHECK_SIGS - BENCH_LOKI_ABOOT_BASE],
+           BENCH_LOKI_PATTERN, sizeof(BENCH_LOKI_PATTERN) - 1);
+}
+
+/*!
+ * \brief Create MTK header with the specified type
+ *
+ * The size field is left as 0 since the writer fills it in.
+ */
+static void make_mtk_header(std::string &buf, const char *type)
+{
+    buf.assign(BENCH_MTK_HEADER_SIZE, '\xff');
+
+    memcpy(&buf[0], MTK_MAGIC, MTK_MAGIC_SIZE);
+    memset(&buf[MTK_MAGIC_SIZE], 0, 4 + MTK_TYPE_SIZE);
+    memcpy(&buf[MTK_MAGIC_SIZE + 4], type, strlen(type));
+}
+
+static void set_header_fields(MbBiHeader *header)
+{
+    uint64_t fields = mb_bi_header_supported_fields(header);
+
+    if (fields & MB_BI_HEADER_FIELD_KERNEL_CMDLINE) {
+        mb_bi_header_set_kernel_cmdline(header, "console=null");
+    }
+    if (fields & MB_BI_HEADER_FIELD_PAGE_SIZE) {
+        mb_bi_header_set_page_size(header, 2048);
+    }
+    if (fields & MB_BI_HEADER_FIELD_KERNEL_ADDRESS) {
+        mb_bi_header_set_kernel_address(header, 0x10008000);
+    }
+    if (fields & MB_BI_HEADER_FIELD_RAMDISK_ADDRESS) {
+        mb_bi_header_set_ramdisk_address(header, 0x11000000);
+    }
+    if (fields & MB_BI_HEADER_FIELD_SECONDBOOT_ADDRESS) {
+        mb_bi_header_set_secondboot_address(header, 0x10f00000);
+    }
+    if (fields & MB_BI_HEADER_FIELD_KERNEL_TAGS_ADDRESS) {
+        mb_bi_header_set_kernel_tags_address(header, 0x10000100);
+    }
+    if (fields & MB_BI_HEADER_FIELD_ENTRYPOINT) {
+        mb_bi_header_set_entrypoint_address(header, 0x10008000);
+    }
+}
+
+static bool write_image(const BenchFormat &format, const std::string &path,
+                        const BenchPayloads &payloads, uint64_t &bytes)
+{
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!biw) {
+        fprintf(stderr, "Failed to allocate writer\n");
+        return false;
+    }
+
+    bytes = 0;
+
+    ret = mb_bi_writer_set_format_by_code(biw.get(), format.code);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to set format: %s\n",
+                format.name, mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    ret = mb_bi_writer_open_filename(biw.get(), path.c_str());
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to open %s: %s\n",
+                format.name, path.c_str(),
+                mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    ret = mb_bi_writer_get_header(biw.get(), &header);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to get header: %s\n",
+                format.name, mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    set_header_fields(header);
+
+    ret = mb_bi_writer_write_header(biw.get(), header);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to write header: %s\n",
+                format.name, mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        const std::string *data;
+
+        switch (mb_bi_entry_type(entry)) {
+        case MB_BI_ENTRY_KERNEL:
+            data = &payloads.kernel;
+            break;
+        case MB_BI_ENTRY_RAMDISK:
+            data = &payloads.ramdisk;
+            break;
+        case MB_BI_ENTRY_ABOOT:
+            data = &payloads.aboot;
+            break;
+        case MB_BI_ENTRY_MTK_KERNEL_HEADER:
+            data = &payloads.mtk_kernel_header;
+            break;
+        case MB_BI_ENTRY_MTK_RAMDISK_HEADER:
+            data = &payloads.mtk_ramdisk_header;
+            break;
+        default:
+            data = nullptr;
+            break;
+        }
+
+        ret = mb_bi_writer_write_entry(biw.get(), entry);
+        if (ret != MB_BI_OK) {
+            fprintf(stderr, "%s: Failed to write entry: %s\n",
+                    format.name, mb_bi_writer_error_string(biw.get()));
+            return false;
+        }
+
+        if (data && !data->empty()) {
+            size_t n;
+
+            ret = mb_bi_writer_write_data(biw.get(), data->data(),
+                                          data->size(), &n);
+            if (ret != MB_BI_OK || n != data->size()) {
+                fprintf(stderr, "%s: Failed to write data: %s\n",
+                        format.name, mb_bi_writer_error_string(biw.get()));
+                return false;
+            }
+
+            bytes += n;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        fprintf(stderr, "%s: Failed to get entry: %s\n",
+                format.name, mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    ret = mb_bi_writer_close(biw.get());
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to close writer: %s\n",
+                format.name, mb_bi_writer_error_string(biw.get()));
+        return false;
+    }
+
+    return true;
+}
+
+static bool open_image(const BenchFormat &format, const std::string &path,
+                       bool force_format, ScopedReader &bir)
+{
+    int ret;
+
+    bir.reset(mb_bi_reader_new());
+    if (!bir) {
+        fprintf(stderr, "Failed to allocate reader\n");
+        return false;
+    }
+
+    if (force_format) {
+        ret = mb_bi_reader_set_format_by_code(bir.get(), format.code);
+    } else {
+        ret = mb_bi_reader_enable_format_all(bir.get());
+    }
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to set formats: %s\n",
+                format.name, mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
+
+    ret = mb_bi_reader_open_filename(bir.get(), path.c_str());
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to open %s: %s\n",
+                format.name, path.c_str(),
+                mb_bi_reader_error_string(bir.get()));
+        return false;
+    }
+
+    return true;
+}
+
+static bool read_header(const BenchFormat &format, MbBiReader *bir)
+{
+    MbBiHeader *header;
+
+    int ret = mb_bi_reader_read_header(bir, &header);
+    if (ret != MB_BI_OK) {
+        fprintf(stderr, "%s: Failed to read header: %s\n",
+                format.name, mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    if (mb_bi_reader_format_code(bir) != format.code) {
+        fprintf(stderr, "%s: Image was detected as %s\n",
+                format.name, mb_bi_reader_format_name(bir));
+        return false;
+    }
+
+    return true;
+}
+
+static bool read_entries(const BenchFormat &format, MbBiReader *bir,
+                         std::vector<char> &buf, uint64_t &bytes)
+{
+    MbBiEntry *entry;
+    size_t n;
+    int ret;
+
+    bytes = 0;
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        while ((ret = mb_bi_reader_read_data(bir, buf.data(), buf.size(),
+                                             &n)) == MB_BI_OK) {
+            bytes += n;
+        }
+
+        if (ret != MB_BI_EOF) {
+            fprintf(stderr, "%s: Failed to read data: %s\n",
+                    format.name, mb_bi_reader_error_string(bir));
+            return false;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        fprintf(stderr, "%s: Failed to read entry: %s\n",
+                format.name, mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    return true;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+// Syscalls made by reading /proc/self/io itself
+static uint64_t syscall_overhead = 0;
+
+static void calibrate_syscall_count()
+{
+    uint64_t before;
+    uint64_t after;
+
+    if (get_syscall_count(before) && get_syscall_count(after)) {
+        syscall_overhead = after - before;
+    }
+}
+
+/*!
+ * \brief Helper for timing a single operation
+ */
+class BenchTimer
+{
+public:
+    explicit BenchTimer(BenchResult &result)
+        : _result(result)
+    {
+        _have_syscalls = get_syscall_count(_syscalls);
+        _start = Clock::now();
+    }
+
+    void stop(uint64_t bytes)
+    {
+        auto end = Clock::now();
+        uint64_t syscalls;
+
+        _result.total_seconds +=
+                std::chrono::duration<double>(end - _start).count();
+        _result.total_bytes += bytes;
+
+        if (_have_syscalls && get_syscall_count(syscalls)) {
+            uint64_t delta = syscalls - _syscalls;
+            _result.total_syscalls += delta > syscall_overhead
+                    ? delta - syscall_overhead : 0;
+        } else {
+            _result.have_syscalls = false;
+        }
+    }
+
+private:
+    BenchResult &_result;
+    Clock::time_point _start;
+    uint64_t _syscalls;
+    bool _have_syscalls;
+};
+
+static void print_result(const char *format, const char *op,
+                         const BenchResult &result, unsigned int iterations)
+{
+    double us_per_op = result.total_seconds * 1e6 / iterations;
+
+    printf("%-10s %-8s %14.1f", format, op, us_per_op);
+
+    if (result.total_bytes > 0 && result.total_seconds > 0) {
+        printf(" %14.0f", result.total_bytes / result.total_seconds);
+    } else {
+        printf(" %14s", "-");
+    }
+
+    if (result.have_syscalls) {
+        printf(" %12.1f\n",
+               static_cast<double>(result.total_syscalls) / iterations);
+    } else {
+        printf(" %12s\n", "-");
+    }
+}
+
+static bool run_format(const BenchFormat &format, const std::string &dir,
+                       const BenchPayloads &payloads, unsigned int iterations)
+{
+    std::string path(dir);
+    path += "/mbbootimg_bench.";
+    path += format.name;
+    path += ".img";
+
+    BenchResult write_result;
+    BenchResult open_result;
+    BenchResult bid_result;
+    BenchResult header_result;
+    BenchResult read_result;
+    std::vector<char> buf(BENCH_READ_BUF_SIZE);
+    uint64_t bytes;
+    bool ret = false;
+
+    for (unsigned int i = 0; i < iterations; ++i) {
+        BenchTimer timer(write_result);
+        if (!write_image(format, path, payloads, bytes)) {
+            goto done;
+        }
+        timer.stop(bytes);
+    }
+
+    for (unsigned int i = 0; i < iterations; ++i) {
+        ScopedReader bir(nullptr, mb_bi_reader_free);
+
+        {
+            BenchTimer timer(open_result);
+            if (!open_image(format, path, false, bir)) {
+                goto done;
+            }
+            timer.stop(0);
+        }
+
+        {
+            BenchTimer timer(bid_result);
+            if (!read_header(format, bir.get())) {
+                goto done;
+            }
+            timer.stop(0);
+        }
+
+        {
+            BenchTimer timer(read_result);
+            if (!read_entries(format, bir.get(), buf, bytes)) {
+                goto done;
+            }
+            timer.stop(bytes);
+        }
+    }
+
+    for (unsigned int i = 0; i < iterations; ++i) {
+        ScopedReader bir(nullptr, mb_bi_reader_free);
+
+        if (!open_image(format, path, true, bir)) {
+            goto done;
+        }
+
+        BenchTimer timer(header_result);
+        if (!read_header(format, bir.get())) {
+            goto done;
+        }
+        timer.stop(0);
+    }
+
+    print_result(format.name, "write", write_result, iterations);
+    print_result(format.name, "open", open_result, iterations);
+    print_result(format.name, "bid", bid_result, iterations);
+    print_result(format.name, "header", header_result, iterations);
+    print_result(format.name, "read", read_result, iterations);
+
+    ret = true;
+
+done:
+    unlink(path.c_str());
+    return ret;
+}
+
+static bool parse_uint(const char *str, unsigned long &value)
+{
+    char *end;
+
+    errno = 0;
+    value = strtoul(str, &end, 10);
+
+    return errno == 0 && *str && !*end && value > 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long size_mib = 16;
+    unsigned long iterations = 5;
+    std::vector<const BenchFormat *> selected;
+    std::string dir;
+
+    int opt;
+
+    static const char short_options[] = "s:n:f:d:h";
+
+    static struct option long_options[] = {
+        {"size",       required_argument, 0, 's'},
+        {"iterations", required_argument, 0, 'n'},
+        {"format",     required_argument, 0, 'f'},
+        {"dir",        required_argument, 0, 'd'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 's':
+            if (!parse_uint(optarg, size_mib) || size_mib > 1024) {
+                fprintf(stderr, "Invalid size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'n':
+            if (!parse_uint(optarg, iterations)) {
+                fprintf(stderr, "Invalid iteration count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'f': {
+            auto it = std::find_if(std::begin(formats), std::end(formats),
+                                   [](const BenchFormat &f) {
+                return strcmp(f.name, optarg) == 0;
+            });
+            if (it == std::end(formats)) {
+                fprintf(stderr, "Unknown format: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            selected.push_back(&*it);
+            break;
+        }
+
+        case 'd':
+            dir = optarg;
+            break;
+
+        case 'h':
+            fputs(HELP_USAGE, stdout);
+            return EXIT_SUCCESS;
+
+        default:
+            fputs(HELP_USAGE, stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 0) {
+        fputs(HELP_USAGE, stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (selected.empty()) {
+        for (auto const &f : formats) {
+            selected.push_back(&f);
+        }
+    }
+
+    if (dir.empty()) {
+        const char *tmpdir = getenv("TMPDIR");
+        if (tmpdir && *tmpdir) {
+            dir = tmpdir;
+        } else {
+#ifdef __ANDROID__
+            dir = "/data/local/tmp";
+#else
+            dir = "/tmp";
+#endif
+        }
+    }
+
+    calibrate_syscall_count();
+
+    BenchPayloads payloads;
+    fill_payload(payloads.kernel, size_mib * 1024 * 1024, 1);
+    fill_payload(payloads.ramdisk, size_mib * 1024 * 1024, 2);
+    make_loki_aboot(payloads.aboot);
+    make_mtk_header(payloads.mtk_kernel_header, "KERNEL");
+    make_mtk_header(payloads.mtk_ramdisk_header, "ROOTFS");
+
+    printf("Payload size: %lu MiB per entry, %lu iterations\n\n",
+           size_mib, iterations);
+    printf("%-10s %-8s %14s %14s %12s\n",
+           "format", "op", "time/op (us)", "bytes/s", "syscalls/op");
+
+    bool ret = true;
+
+    for (auto const *f : selected) {
+        if (!run_format(*f, dir, payloads,
+                        static_cast<unsigned int>(iterations))) {
+            ret = false;
+        }
+    }
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
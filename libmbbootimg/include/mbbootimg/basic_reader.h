@@ -0,0 +1,512 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+
+#include "mbcommon/common.h"
+
+#include "mbbootimg/format_tags.h"
+#include "mbbootimg/reader.h"
+
+MB_BEGIN_C_DECLS
+
+/*!
+ * \brief Reader operations shared between the C API and BasicReader
+ */
+enum MbBiReaderOp
+{
+    MB_BI_READER_OP_SET_FORMAT,
+    MB_BI_READER_OP_READ_HEADER,
+    MB_BI_READER_OP_READ_ENTRY,
+    MB_BI_READER_OP_GO_TO_ENTRY,
+    MB_BI_READER_OP_READ_DATA,
+    MB_BI_READER_OP_READ_DATA_VIEW,
+};
+
+// State management hooks for BasicReader. These are not meant to be used
+// directly.
+MB_EXPORT int _mb_bi_reader_open_file(struct MbBiReader *bir,
+                                      const char *filename,
+                                      mb::File **file_out, const char *func);
+MB_EXPORT int _mb_bi_reader_open_begin(struct MbBiReader *bir, mb::File *file,
+                                       bool owned, const char *func);
+MB_EXPORT int _mb_bi_reader_read_probe(struct MbBiReader *bir);
+MB_EXPORT bool _mb_bi_reader_probe_matches(struct MbBiReader *bir, int type,
+                                           int *max_bid);
+MB_EXPORT int _mb_bi_reader_open_end(struct MbBiReader *bir, int ret);
+MB_EXPORT int _mb_bi_reader_begin_op(struct MbBiReader *bir, int op,
+                                     void *arg, const char *func);
+MB_EXPORT int _mb_bi_reader_end_op(struct MbBiReader *bir, int op, int ret);
+
+MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+namespace detail
+{
+
+struct ReaderFreeOp
+{
+    MbBiReader *bir;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::reader_free(bir, ctx);
+    }
+};
+
+struct ReaderBidOp
+{
+    MbBiReader *bir;
+    int best_bid;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::reader_bid(bir, ctx, best_bid);
+    }
+};
+
+struct ReaderReadHeaderOp
+{
+    MbBiReader *bir;
+    MbBiHeader *header;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::reader_read_header(bir, ctx, header);
+    }
+};
+
+struct ReaderReadEntryOp
+{
+    MbBiReader *bir;
+    MbBiEntry *entry;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::reader_read_entry(bir, ctx, entry);
+    }
+};
+
+struct ReaderGoToEntryOp
+{
+    MbBiReader *bir;
+    MbBiEntry *entry;
+    int entry_type;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::reader_go_to_entry(bir, ctx, entry, entry_type);
+    }
+};
+
+struct ReaderReadDataOp
+{
+    MbBiReader *bir;
+    void *buf;
+    size_t size;
+    size_t *bytes_read;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::reader_read_data(bir, ctx, buf, size, *bytes_read);
+    }
+};
+
+struct ReaderReadDataViewOp
+{
+    MbBiReader *bir;
+    const void **data;
+    size_t *size;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::reader_read_data_view(bir, ctx, *data, *size);
+    }
+};
+
+}
+
+/*!
+ * \brief Boot image reader for a fixed set of formats
+ *
+ * BasicReader behaves like MbBiReader, except that the set of supported formats
+ * is chosen at compile time. Format callbacks are called directly instead of
+ * through the function pointers registered with the
+ * `mb_bi_reader_enable_format_*()` functions and only the formats named in
+ * \p Formats are linked into the program.
+ *
+ * \code{.cpp}
+ * mb::bootimg::BasicReader<mb::bootimg::AndroidFormat,
+ *                          mb::bootimg::LokiFormat> reader;
+ * if (!reader.is_valid()
+ *         || reader.open_filename("boot.img") != MB_BI_OK) {
+ *     ...
+ * }
+ * \endcode
+ *
+ * The return values and state transitions of each function are the same as
+ * those of the corresponding `mb_bi_reader_*()` function.
+ */
+template<typename... Formats>
+class BasicReader
+{
+    static_assert(sizeof...(Formats) > 0, "No formats specified");
+
+    static constexpr size_t format_count = sizeof...(Formats);
+    static constexpr size_t no_format = static_cast<size_t>(-1);
+
+    using Dispatch = detail::FormatDispatch<0, Formats...>;
+
+public:
+    BasicReader() : _bir(mb_bi_reader_new()), _ctxs(), _format(no_format),
+        _forced_format(false)
+    {
+        void *(*new_fns[])(MbBiReader *) = { &Formats::reader_new... };
+
+        if (!_bir) {
+            return;
+        }
+
+        for (size_t i = 0; i < format_count; ++i) {
+            _ctxs[i] = new_fns[i](_bir);
+            if (!_ctxs[i]) {
+                free_ctxs();
+                break;
+            }
+        }
+    }
+
+    ~BasicReader()
+    {
+        if (_bir) {
+            mb_bi_reader_close(_bir);
+            free_ctxs();
+            mb_bi_reader_free(_bir);
+        }
+    }
+
+    BasicReader(const BasicReader &) = delete;
+    BasicReader & operator=(const BasicReader &) = delete;
+
+    /*!
+     * \brief Check if the reader and all format contexts were allocated
+     */
+    bool is_valid() const
+    {
+        return _bir && _ctxs[0];
+    }
+
+    /*!
+     * \brief Get underlying MbBiReader handle
+     *
+     * The handle may be passed to functions that take an MbBiReader for error
+     * reporting, but must not be used to read the boot image.
+     */
+    MbBiReader * handle()
+    {
+        return _bir;
+    }
+
+    /*!
+     * \brief Force the use of format \p F
+     *
+     * \sa mb_bi_reader_set_format_by_code()
+     */
+    template<typename F>
+    int set_format()
+    {
+        int ret = _mb_bi_reader_begin_op(
+                _bir, MB_BI_READER_OP_SET_FORMAT, nullptr, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        _format = detail::FormatIndex<F, Formats...>::value;
+        _forced_format = true;
+        return MB_BI_OK;
+    }
+
+    /*!
+     * \sa mb_bi_reader_open_filename()
+     */
+    int open_filename(const char *filename)
+    {
+        mb::File *file;
+
+        int ret = _mb_bi_reader_open_file(_bir, filename, &file, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        return open(file, true);
+    }
+
+    /*!
+     * \sa mb_bi_reader_open()
+     */
+    int open(mb::File *file, bool owned)
+    {
+        int ret = _mb_bi_reader_open_begin(_bir, file, owned, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        if (!_forced_format) {
+            ret = bid();
+        }
+
+        ret = _mb_bi_reader_open_end(_bir, ret);
+
+        if (ret != MB_BI_OK && !_forced_format) {
+            _format = no_format;
+        }
+        return ret;
+    }
+
+    /*!
+     * \sa mb_bi_reader_close()
+     */
+    int close()
+    {
+        return mb_bi_reader_close(_bir);
+    }
+
+    /*!
+     * \sa mb_bi_reader_read_header2()
+     */
+    int read_header(MbBiHeader *header)
+    {
+        int ret = _mb_bi_reader_begin_op(
+                _bir, MB_BI_READER_OP_READ_HEADER, header, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        detail::ReaderReadHeaderOp op{_bir, header};
+        ret = Dispatch::call(_format, _ctxs, op);
+        return _mb_bi_reader_end_op(_bir, MB_BI_READER_OP_READ_HEADER, ret);
+    }
+
+    /*!
+     * \sa mb_bi_reader_read_entry2()
+     */
+    int read_entry(MbBiEntry *entry)
+    {
+        int ret = _mb_bi_reader_begin_op(
+                _bir, MB_BI_READER_OP_READ_ENTRY, entry, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        detail::ReaderReadEntryOp op{_bir, entry};
+        ret = Dispatch::call(_format, _ctxs, op);
+        return _mb_bi_reader_end_op(_bir, MB_BI_READER_OP_READ_ENTRY, ret);
+    }
+
+    /*!
+     * \sa mb_bi_reader_go_to_entry2()
+     */
+    int go_to_entry(MbBiEntry *entry, int entry_type)
+    {
+        int ret = _mb_bi_reader_begin_op(
+                _bir, MB_BI_READER_OP_GO_TO_ENTRY, entry, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        detail::ReaderGoToEntryOp op{_bir, entry, entry_type};
+        ret = Dispatch::call(_format, _ctxs, op);
+        return _mb_bi_reader_end_op(_bir, MB_BI_READER_OP_GO_TO_ENTRY, ret);
+    }
+
+    /*!
+     * \sa mb_bi_reader_read_data()
+     */
+    int read_data(void *buf, size_t size, size_t *bytes_read)
+    {
+        int ret = _mb_bi_reader_begin_op(
+                _bir, MB_BI_READER_OP_READ_DATA, nullptr, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        detail::ReaderReadDataOp op{_bir, buf, size, bytes_read};
+        ret = Dispatch::call(_format, _ctxs, op);
+        return _mb_bi_reader_end_op(_bir, MB_BI_READER_OP_READ_DATA, ret);
+    }
+
+    /*!
+     * \sa mb_bi_reader_read_data_view()
+     */
+    int read_data_view(const void **data, size_t *size)
+    {
+        int ret = _mb_bi_reader_begin_op(
+                _bir, MB_BI_READER_OP_READ_DATA_VIEW, nullptr, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        detail::ReaderReadDataViewOp op{_bir, data, size};
+        ret = Dispatch::call(_format, _ctxs, op);
+        return _mb_bi_reader_end_op(_bir, MB_BI_READER_OP_READ_DATA_VIEW, ret);
+    }
+
+    /*!
+     * \sa mb_bi_reader_format_code()
+     */
+    int format_code()
+    {
+        if (_format == no_format) {
+            mb_bi_reader_set_error(_bir, MB_BI_ERROR_PROGRAMMER_ERROR,
+                                   "No format selected");
+            return -1;
+        }
+
+        detail::FormatCodeOp op;
+        return Dispatch::call(_format, _ctxs, op);
+    }
+
+    /*!
+     * \sa mb_bi_reader_format_name()
+     */
+    const char * format_name()
+    {
+        if (_format == no_format) {
+            mb_bi_reader_set_error(_bir, MB_BI_ERROR_PROGRAMMER_ERROR,
+                                   "No format selected");
+            return nullptr;
+        }
+
+        detail::FormatNameOp op{nullptr};
+        Dispatch::call(_format, _ctxs, op);
+        return op.name;
+    }
+
+    /*!
+     * \sa mb_bi_reader_error()
+     */
+    int error()
+    {
+        return mb_bi_reader_error(_bir);
+    }
+
+    /*!
+     * \sa mb_bi_reader_error_string()
+     */
+    const char * error_string()
+    {
+        return mb_bi_reader_error_string(_bir);
+    }
+
+private:
+    struct BidCandidate
+    {
+        size_t index;
+        int max_bid;
+    };
+
+    int bid()
+    {
+        const int codes[] = { Formats::code... };
+        BidCandidate candidates[format_count];
+        size_t candidates_len = 0;
+        size_t format = no_format;
+        int best_bid = 0;
+        int ret;
+
+        // Read the beginning of the file once for all of the bidders
+        ret = _mb_bi_reader_read_probe(_bir);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        // Only run bidders whose magic is present
+        for (size_t i = 0; i < format_count; ++i) {
+            int max_bid;
+
+            if (_mb_bi_reader_probe_matches(_bir, codes[i], &max_bid)) {
+                candidates[candidates_len].index = i;
+                candidates[candidates_len].max_bid = max_bid;
+                ++candidates_len;
+            }
+        }
+
+        // Try the formats with the highest possible bids first
+        std::stable_sort(candidates, candidates + candidates_len,
+                         [](const BidCandidate &a, const BidCandidate &b) {
+            return a.max_bid > b.max_bid;
+        });
+
+        for (size_t i = 0; i < candidates_len; ++i) {
+            detail::ReaderBidOp op{_bir, best_bid};
+
+            ret = Dispatch::call(candidates[i].index, _ctxs, op);
+            if (ret > best_bid) {
+                best_bid = ret;
+                format = candidates[i].index;
+            } else if (ret == MB_BI_WARN) {
+                continue;
+            } else if (ret < 0) {
+                return ret;
+            }
+        }
+
+        if (format == no_format) {
+            mb_bi_reader_set_error(_bir, MB_BI_ERROR_FILE_FORMAT,
+                                   "Failed to determine boot image format");
+            return MB_BI_FAILED;
+        }
+
+        _format = format;
+        return MB_BI_OK;
+    }
+
+    void free_ctxs()
+    {
+        for (size_t i = 0; i < format_count; ++i) {
+            if (_ctxs[i]) {
+                detail::ReaderFreeOp op{_bir};
+                Dispatch::call(i, _ctxs, op);
+                _ctxs[i] = nullptr;
+            }
+        }
+    }
+
+    MbBiReader *_bir;
+    void *_ctxs[format_count];
+    size_t _format;
+    bool _forced_format;
+};
+
+}
+}
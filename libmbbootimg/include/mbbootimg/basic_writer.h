@@ -0,0 +1,516 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include "mbcommon/common.h"
+
+#include "mbbootimg/format_tags.h"
+#include "mbbootimg/writer.h"
+
+MB_BEGIN_C_DECLS
+
+/*!
+ * \brief Writer operations shared between the C API and BasicWriter
+ */
+enum MbBiWriterOp
+{
+    MB_BI_WRITER_OP_SET_FORMAT,
+    MB_BI_WRITER_OP_SET_OPTION,
+    MB_BI_WRITER_OP_GET_HEADER,
+    MB_BI_WRITER_OP_WRITE_HEADER,
+    MB_BI_WRITER_OP_FINISH_ENTRY,
+    MB_BI_WRITER_OP_GET_ENTRY,
+    MB_BI_WRITER_OP_WRITE_ENTRY,
+    MB_BI_WRITER_OP_WRITE_DATA,
+};
+
+// State management hooks for BasicWriter. These are not meant to be used
+// directly.
+MB_EXPORT int _mb_bi_writer_open_file(struct MbBiWriter *biw,
+                                      const char *filename,
+                                      mb::File **file_out, const char *func);
+MB_EXPORT int _mb_bi_writer_open_begin(struct MbBiWriter *biw, mb::File *file,
+                                       bool owned, bool format_set,
+                                       const char *func);
+MB_EXPORT bool _mb_bi_writer_close_begin(struct MbBiWriter *biw);
+MB_EXPORT int _mb_bi_writer_close_end(struct MbBiWriter *biw, int ret);
+MB_EXPORT int _mb_bi_writer_begin_op(struct MbBiWriter *biw, int op,
+                                     void *arg, const char *func);
+MB_EXPORT int _mb_bi_writer_end_op(struct MbBiWriter *biw, int op, int ret);
+
+MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+namespace detail
+{
+
+struct WriterNewOp
+{
+    MbBiWriter *biw;
+    void *ctx;
+
+    template<typename F>
+    int run(void *)
+    {
+        ctx = F::writer_new(biw);
+        return ctx ? MB_BI_OK : MB_BI_FAILED;
+    }
+};
+
+struct WriterFreeOp
+{
+    MbBiWriter *biw;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::writer_free(biw, ctx);
+    }
+};
+
+struct WriterSetOptionOp
+{
+    MbBiWriter *biw;
+    const char *key;
+    const char *value;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::writer_set_option(biw, ctx, key, value);
+    }
+};
+
+struct WriterGetHeaderOp
+{
+    MbBiWriter *biw;
+    MbBiHeader *header;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::writer_get_header(biw, ctx, header);
+    }
+};
+
+struct WriterWriteHeaderOp
+{
+    MbBiWriter *biw;
+    MbBiHeader *header;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::writer_write_header(biw, ctx, header);
+    }
+};
+
+struct WriterFinishEntryOp
+{
+    MbBiWriter *biw;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::writer_finish_entry(biw, ctx);
+    }
+};
+
+struct WriterGetEntryOp
+{
+    MbBiWriter *biw;
+    MbBiEntry *entry;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::writer_get_entry(biw, ctx, entry);
+    }
+};
+
+struct WriterWriteEntryOp
+{
+    MbBiWriter *biw;
+    MbBiEntry *entry;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::writer_write_entry(biw, ctx, entry);
+    }
+};
+
+struct WriterWriteDataOp
+{
+    MbBiWriter *biw;
+    const void *buf;
+    size_t size;
+    size_t *bytes_written;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::writer_write_data(biw, ctx, buf, size, *bytes_written);
+    }
+};
+
+struct WriterCloseOp
+{
+    MbBiWriter *biw;
+
+    template<typename F>
+    int run(void *ctx)
+    {
+        return F::writer_close(biw, ctx);
+    }
+};
+
+}
+
+/*!
+ * \brief Boot image writer for a fixed set of formats
+ *
+ * BasicWriter behaves like MbBiWriter, except that the set of supported formats
+ * is chosen at compile time. Format callbacks are called directly and only the
+ * formats named in \p Formats are linked into the program. If only one format
+ * is specified, it is selected automatically.
+ *
+ * \code{.cpp}
+ * mb::bootimg::BasicWriter<mb::bootimg::AndroidFormat> writer;
+ * if (!writer.is_valid()
+ *         || writer.open_filename("boot.img") != MB_BI_OK) {
+ *     ...
+ * }
+ * \endcode
+ *
+ * The return values and state transitions of each function are the same as
+ * those of the corresponding `mb_bi_writer_*()` function.
+ */
+template<typename... Formats>
+class BasicWriter
+{
+    static_assert(sizeof...(Formats) > 0, "No formats specified");
+
+    static constexpr size_t format_count = sizeof...(Formats);
+    static constexpr size_t no_format = static_cast<size_t>(-1);
+
+    using Dispatch = detail::FormatDispatch<0, Formats...>;
+
+public:
+    BasicWriter() : _biw(mb_bi_writer_new()), _ctxs(), _format(no_format)
+    {
+        if (_biw && format_count == 1) {
+            select_format(0);
+        }
+    }
+
+    ~BasicWriter()
+    {
+        if (_biw) {
+            close();
+            free_ctx();
+            mb_bi_writer_free(_biw);
+        }
+    }
+
+    BasicWriter(const BasicWriter &) = delete;
+    BasicWriter & operator=(const BasicWriter &) = delete;
+
+    /*!
+     * \brief Check if the writer was allocated
+     *
+     * If only one format is specified, this also checks that the format
+     * context was allocated.
+     */
+    bool is_valid() const
+    {
+        return _biw && (format_count > 1 || _format != no_format);
+    }
+
+    /*!
+     * \brief Get underlying MbBiWriter handle
+     *
+     * The handle may be passed to functions that take an MbBiWriter for error
+     * reporting, but must not be used to write the boot image.
+     */
+    MbBiWriter * handle()
+    {
+        return _biw;
+    }
+
+    /*!
+     * \brief Set output format to \p F
+     *
+     * \sa mb_bi_writer_set_format_by_code()
+     */
+    template<typename F>
+    int set_format()
+    {
+        int ret = _mb_bi_writer_begin_op(
+                _biw, MB_BI_WRITER_OP_SET_FORMAT, nullptr, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        return select_format(detail::FormatIndex<F, Formats...>::value);
+    }
+
+    /*!
+     * \sa mb_bi_writer_set_option()
+     */
+    int set_option(const char *key, const char *value)
+    {
+        int ret = _mb_bi_writer_begin_op(
+                _biw, MB_BI_WRITER_OP_SET_OPTION, nullptr, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        if (_format == no_format) {
+            mb_bi_writer_set_error(_biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                                   "No format selected");
+            return MB_BI_FAILED;
+        }
+
+        detail::WriterSetOptionOp op{_biw, key, value};
+        return Dispatch::call(_format, _ctxs, op);
+    }
+
+    /*!
+     * \sa mb_bi_writer_open_filename()
+     */
+    int open_filename(const char *filename)
+    {
+        mb::File *file;
+
+        int ret = _mb_bi_writer_open_file(_biw, filename, &file, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        return open(file, true);
+    }
+
+    /*!
+     * \sa mb_bi_writer_open()
+     */
+    int open(mb::File *file, bool owned)
+    {
+        return _mb_bi_writer_open_begin(_biw, file, owned,
+                                        _format != no_format, __func__);
+    }
+
+    /*!
+     * \sa mb_bi_writer_close()
+     */
+    int close()
+    {
+        int ret = MB_BI_OK;
+
+        if (_mb_bi_writer_close_begin(_biw) && _format != no_format) {
+            detail::WriterCloseOp op{_biw};
+            ret = Dispatch::call(_format, _ctxs, op);
+        }
+
+        return _mb_bi_writer_close_end(_biw, ret);
+    }
+
+    /*!
+     * \sa mb_bi_writer_get_header2()
+     */
+    int get_header(MbBiHeader *header)
+    {
+        int ret = _mb_bi_writer_begin_op(
+                _biw, MB_BI_WRITER_OP_GET_HEADER, header, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        detail::WriterGetHeaderOp op{_biw, header};
+        ret = Dispatch::call(_format, _ctxs, op);
+        return _mb_bi_writer_end_op(_biw, MB_BI_WRITER_OP_GET_HEADER, ret);
+    }
+
+    /*!
+     * \sa mb_bi_writer_write_header()
+     */
+    int write_header(MbBiHeader *header)
+    {
+        int ret = _mb_bi_writer_begin_op(
+                _biw, MB_BI_WRITER_OP_WRITE_HEADER, header, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        detail::WriterWriteHeaderOp op{_biw, header};
+        ret = Dispatch::call(_format, _ctxs, op);
+        return _mb_bi_writer_end_op(_biw, MB_BI_WRITER_OP_WRITE_HEADER, ret);
+    }
+
+    /*!
+     * \sa mb_bi_writer_get_entry2()
+     */
+    int get_entry(MbBiEntry *entry)
+    {
+        // Finish current entry
+        int ret = _mb_bi_writer_begin_op(
+                _biw, MB_BI_WRITER_OP_FINISH_ENTRY, nullptr, __func__);
+        if (ret == MB_BI_OK) {
+            detail::WriterFinishEntryOp op{_biw};
+            ret = Dispatch::call(_format, _ctxs, op);
+            ret = _mb_bi_writer_end_op(
+                    _biw, MB_BI_WRITER_OP_FINISH_ENTRY, ret);
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+        } else if (ret != MB_BI_EOF) {
+            return ret;
+        }
+
+        ret = _mb_bi_writer_begin_op(
+                _biw, MB_BI_WRITER_OP_GET_ENTRY, entry, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        detail::WriterGetEntryOp op{_biw, entry};
+        ret = Dispatch::call(_format, _ctxs, op);
+        return _mb_bi_writer_end_op(_biw, MB_BI_WRITER_OP_GET_ENTRY, ret);
+    }
+
+    /*!
+     * \sa mb_bi_writer_write_entry()
+     */
+    int write_entry(MbBiEntry *entry)
+    {
+        int ret = _mb_bi_writer_begin_op(
+                _biw, MB_BI_WRITER_OP_WRITE_ENTRY, entry, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        detail::WriterWriteEntryOp op{_biw, entry};
+        ret = Dispatch::call(_format, _ctxs, op);
+        return _mb_bi_writer_end_op(_biw, MB_BI_WRITER_OP_WRITE_ENTRY, ret);
+    }
+
+    /*!
+     * \sa mb_bi_writer_write_data()
+     */
+    int write_data(const void *buf, size_t size, size_t *bytes_written)
+    {
+        int ret = _mb_bi_writer_begin_op(
+                _biw, MB_BI_WRITER_OP_WRITE_DATA, nullptr, __func__);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        detail::WriterWriteDataOp op{_biw, buf, size, bytes_written};
+        ret = Dispatch::call(_format, _ctxs, op);
+        return _mb_bi_writer_end_op(_biw, MB_BI_WRITER_OP_WRITE_DATA, ret);
+    }
+
+    /*!
+     * \sa mb_bi_writer_format_code()
+     */
+    int format_code()
+    {
+        if (_format == no_format) {
+            mb_bi_writer_set_error(_biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                                   "No format selected");
+            return -1;
+        }
+
+        detail::FormatCodeOp op;
+        return Dispatch::call(_format, _ctxs, op);
+    }
+
+    /*!
+     * \sa mb_bi_writer_format_name()
+     */
+    const char * format_name()
+    {
+        if (_format == no_format) {
+            mb_bi_writer_set_error(_biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                                   "No format selected");
+            return nullptr;
+        }
+
+        detail::FormatNameOp op{nullptr};
+        Dispatch::call(_format, _ctxs, op);
+        return op.name;
+    }
+
+    /*!
+     * \sa mb_bi_writer_error()
+     */
+    int error()
+    {
+        return mb_bi_writer_error(_biw);
+    }
+
+    /*!
+     * \sa mb_bi_writer_error_string()
+     */
+    const char * error_string()
+    {
+        return mb_bi_writer_error_string(_biw);
+    }
+
+private:
+    int select_format(size_t index)
+    {
+        detail::WriterNewOp op{_biw, nullptr};
+
+        free_ctx();
+
+        int ret = Dispatch::call(index, _ctxs, op);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        _ctxs[index] = op.ctx;
+        _format = index;
+        return MB_BI_OK;
+    }
+
+    void free_ctx()
+    {
+        if (_format != no_format) {
+            detail::WriterFreeOp op{_biw};
+            Dispatch::call(_format, _ctxs, op);
+            _ctxs[_format] = nullptr;
+            _format = no_format;
+        }
+    }
+
+    MbBiWriter *_biw;
+    void *_ctxs[format_count];
+    size_t _format;
+};
+
+}
+}
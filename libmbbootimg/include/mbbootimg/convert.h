@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+#  include <cstddef>
+#else
+#  include <stddef.h>
+#endif
+
+#include "mbcommon/common.h"
+
+#include "mbbootimg/defs.h"
+
+#define MB_BI_CONVERT_ERROR_SIZE        256
+
+MB_BEGIN_C_DECLS
+
+struct MbBiConvertJob
+{
+    // Input boot image (format is autodetected)
+    const char *input_path;
+    // Output boot image
+    const char *output_path;
+    // Output format code or 0 to use the input format
+    int output_format;
+    // aboot image for Loki output (optional otherwise)
+    const char *aboot_path;
+
+    // Result of the conversion (set by mb_bi_convert())
+    int ret;
+    char error_string[MB_BI_CONVERT_ERROR_SIZE];
+};
+
+MB_EXPORT int mb_bi_convert(struct MbBiConvertJob *job);
+MB_EXPORT int mb_bi_convert_batch(struct MbBiConvertJob *jobs, size_t jobs_len,
+                                  unsigned int threads);
+
+MB_END_C_DECLS
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#ifdef __cplusplus
+#  include <cstddef>
+#else
+#  include <stddef.h>
+#endif
+
+#include "mbcommon/common.h"
+
+#include "mbbootimg/defs.h"
+
+#define MB_BI_DIFF_BLOCK_SIZE           4096
+
+MB_BEGIN_C_DECLS
+
+MB_EXPORT int mb_bi_diff(const char *source_path, const char *target_path,
+                         const char *delta_path,
+                         char *error_buf, size_t error_size);
+MB_EXPORT int mb_bi_patch(const char *source_path, const char *delta_path,
+                          const char *output_path,
+                          char *error_buf, size_t error_size);
+
+MB_END_C_DECLS
@@ -27,6 +27,9 @@
 #define MB_BI_ENTRY_FIELD_NAME      (1U << 1)
 #define MB_BI_ENTRY_FIELD_SIZE      (1U << 2)
 
+// Names up to this length (including the NULL terminator) are stored inline
+#define MB_BI_ENTRY_NAME_INLINE_SIZE    32
+
 struct MbBiEntry
 {
     // Bitmap of fields that are set
@@ -40,4 +43,9 @@ struct MbBiEntry
         // Entry size
         uint64_t size;
     } field;
+
+    // Inline storage for string fields
+    struct {
+        char name[MB_BI_ENTRY_NAME_INLINE_SIZE];
+    } storage;
 };
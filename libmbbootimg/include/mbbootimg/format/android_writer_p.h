@@ -23,9 +23,12 @@
 
 #include <openssl/sha.h>
 
+#include "mbcommon/file.h"
+
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/android_p.h"
 #include "mbbootimg/format/segment_writer_p.h"
+#include "mbbootimg/format/sha1_pipeline_p.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/writer.h"
 
@@ -44,9 +47,23 @@ struct AndroidWriterCtx
 
     SHA_CTX sha_ctx;
 
+    // If enabled, the SHA1 hash is computed on a separate thread
+    bool parallel_hash;
+    Sha1Pipeline *sha_pipeline;
+
+    // In streaming mode, the image is assembled in memory and written to the
+    // output file sequentially when closed. The header's SHA1 ID covers all of
+    // the entries, so it is not known until every entry has been written.
+    bool streaming;
+    mb::File *spool;
+    void *spool_buf;
+    size_t spool_size;
+
     struct SegmentWriterCtx segctx;
 };
 
+int android_writer_set_option(struct MbBiWriter *biw, void *userdata,
+                              const char *key, const char *value);
 int android_writer_get_header(struct MbBiWriter *biw, void *userdata,
                               struct MbBiHeader *header);
 int android_writer_write_header(struct MbBiWriter *biw, void *userdata,
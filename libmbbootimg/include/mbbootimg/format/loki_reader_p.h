@@ -84,6 +84,8 @@ int loki_reader_go_to_entry(struct MbBiReader *bir, void *userdata,
 int loki_reader_read_data(struct MbBiReader *bir, void *userdata,
                           void *buf, size_t buf_size,
                           size_t &bytes_read);
+int loki_reader_read_data_view(struct MbBiReader *bir, void *userdata,
+                               const void *&data, size_t &data_size);
 int loki_reader_free(struct MbBiReader *bir, void *userdata);
 
 MB_END_C_DECLS
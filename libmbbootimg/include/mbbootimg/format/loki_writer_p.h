@@ -26,6 +26,7 @@
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/android_p.h"
 #include "mbbootimg/format/segment_writer_p.h"
+#include "mbbootimg/format/sha1_pipeline_p.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/writer.h"
 
@@ -45,9 +46,15 @@ struct LokiWriterCtx
 
     SHA_CTX sha_ctx;
 
+    // If enabled, the SHA1 hash is computed on a separate thread
+    bool parallel_hash;
+    Sha1Pipeline *sha_pipeline;
+
     struct SegmentWriterCtx segctx;
 };
 
+int loki_writer_set_option(struct MbBiWriter *biw, void *userdata,
+                           const char *key, const char *value);
 int loki_writer_get_header(struct MbBiWriter *biw, void *userdata,
                            struct MbBiHeader *header);
 int loki_writer_write_header(struct MbBiWriter *biw, void *userdata,
@@ -31,6 +31,9 @@
 
 #define SEGMENT_READER_MAX_ENTRIES      10
 
+// Size and alignment of the blocks fetched when reading ahead
+#define SEGMENT_READER_READ_AHEAD_SIZE  (1024 * 1024)
+
 enum
 #ifdef __cplusplus
 class
@@ -61,6 +64,16 @@ struct SegmentReaderCtx
     uint64_t read_start_offset;
     uint64_t read_end_offset;
     uint64_t read_cur_offset;
+
+    // Read-ahead buffer for the current entry. The unconsumed data in
+    // [ra_pos, ra_len) immediately follows read_cur_offset in the file.
+    unsigned char *ra_buf;
+    size_t ra_pos;
+    size_t ra_len;
+
+    // File descriptor for posix_fadvise() (-1 if unavailable)
+    bool fd_checked;
+    int fd;
 };
 
 int _segment_reader_init(struct SegmentReaderCtx *ctx);
@@ -90,3 +103,6 @@ int _segment_reader_go_to_entry(struct SegmentReaderCtx *ctx, mb::File *file,
 int _segment_reader_read_data(struct SegmentReaderCtx *ctx, mb::File *file,
                               void *buf, size_t buf_size, size_t &bytes_read,
                               struct MbBiReader *bir);
+int _segment_reader_read_data_view(struct SegmentReaderCtx *ctx, mb::File *file,
+                                   const void *&data, size_t &data_size,
+                                   struct MbBiReader *bir);
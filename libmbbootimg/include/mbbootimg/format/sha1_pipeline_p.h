@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbbootimg/guard_p.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <openssl/sha.h>
+
+// Size of the ring buffer holding data that has not been hashed yet
+#define SHA1_PIPELINE_BUFFER_SIZE       (1024 * 1024)
+
+/*!
+ * \brief Compute a SHA1 digest on a separate thread
+ *
+ * Data passed to update() is copied into a bounded ring buffer and hashed by a
+ * worker thread in the order it was submitted, so the caller can continue
+ * writing while the previous blocks are being hashed. If the buffer is full,
+ * update() blocks until the worker thread catches up.
+ */
+class Sha1Pipeline
+{
+public:
+    Sha1Pipeline(SHA_CTX *ctx, size_t buffer_size = SHA1_PIPELINE_BUFFER_SIZE);
+    ~Sha1Pipeline();
+
+    Sha1Pipeline(const Sha1Pipeline &) = delete;
+    Sha1Pipeline & operator=(const Sha1Pipeline &) = delete;
+
+    bool update(const void *data, size_t size);
+    bool finish();
+
+private:
+    void run();
+
+    SHA_CTX *_ctx;
+    std::vector<unsigned char> _buf;
+    // Total number of bytes submitted and hashed
+    uint64_t _head;
+    uint64_t _tail;
+    bool _done;
+    bool _failed;
+
+    std::mutex _mutex;
+    std::condition_variable _cv_data;
+    std::condition_variable _cv_space;
+    std::thread _thread;
+};
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include "mbcommon/common.h"
+
+#include "mbbootimg/defs.h"
+
+struct MbBiEntry;
+struct MbBiHeader;
+struct MbBiReader;
+struct MbBiWriter;
+
+namespace mb
+{
+namespace bootimg
+{
+
+#define MB_BI_DECLARE_FORMAT(TAG, CODE, NAME) \
+    struct MB_EXPORT TAG \
+    { \
+        static constexpr int code = CODE; \
+        static const char * name() { return NAME; } \
+        \
+        /* Reader */ \
+        static void * reader_new(MbBiReader *bir); \
+        static int reader_free(MbBiReader *bir, void *ctx); \
+        static int reader_bid(MbBiReader *bir, void *ctx, int best_bid); \
+        static int reader_read_header(MbBiReader *bir, void *ctx, \
+                                      MbBiHeader *header); \
+        static int reader_read_entry(MbBiReader *bir, void *ctx, \
+                                     MbBiEntry *entry); \
+        static int reader_go_to_entry(MbBiReader *bir, void *ctx, \
+                                      MbBiEntry *entry, int entry_type); \
+        static int reader_read_data(MbBiReader *bir, void *ctx, \
+                                    void *buf, size_t buf_size, \
+                                    size_t &bytes_read); \
+        static int reader_read_data_view(MbBiReader *bir, void *ctx, \
+                                         const void *&data, \
+                                         size_t &data_size); \
+        \
+        /* Writer */ \
+        static void * writer_new(MbBiWriter *biw); \
+        static int writer_free(MbBiWriter *biw, void *ctx); \
+        static int writer_set_option(MbBiWriter *biw, void *ctx, \
+                                     const char *key, const char *value); \
+        static int writer_get_header(MbBiWriter *biw, void *ctx, \
+                                     MbBiHeader *header); \
+        static int writer_write_header(MbBiWriter *biw, void *ctx, \
+                                       MbBiHeader *header); \
+        static int writer_get_entry(MbBiWriter *biw, void *ctx, \
+                                    MbBiEntry *entry); \
+        static int writer_write_entry(MbBiWriter *biw, void *ctx, \
+                                      MbBiEntry *entry); \
+        static int writer_write_data(MbBiWriter *biw, void *ctx, \
+                                     const void *buf, size_t buf_size, \
+                                     size_t &bytes_written); \
+        static int writer_finish_entry(MbBiWriter *biw, void *ctx); \
+        static int writer_close(MbBiWriter *biw, void *ctx); \
+    }
+
+MB_BI_DECLARE_FORMAT(AndroidFormat, MB_BI_FORMAT_ANDROID,
+                     MB_BI_FORMAT_NAME_ANDROID);
+MB_BI_DECLARE_FORMAT(BumpFormat, MB_BI_FORMAT_BUMP,
+                     MB_BI_FORMAT_NAME_BUMP);
+MB_BI_DECLARE_FORMAT(LokiFormat, MB_BI_FORMAT_LOKI,
+                     MB_BI_FORMAT_NAME_LOKI);
+MB_BI_DECLARE_FORMAT(MtkFormat, MB_BI_FORMAT_MTK,
+                     MB_BI_FORMAT_NAME_MTK);
+MB_BI_DECLARE_FORMAT(SonyElfFormat, MB_BI_FORMAT_SONY_ELF,
+                     MB_BI_FORMAT_NAME_SONY_ELF);
+
+#undef MB_BI_DECLARE_FORMAT
+
+namespace detail
+{
+
+/*!
+ * \brief Call `op.run<F>(ctxs[index])` for the \p index'th format in a pack
+ *
+ * The comparisons are resolved at compile time into a chain of direct calls.
+ */
+template<size_t I, typename... Formats>
+struct FormatDispatch;
+
+template<size_t I>
+struct FormatDispatch<I>
+{
+    template<typename Op>
+    static int call(size_t index, void * const *ctxs, Op &op)
+    {
+        (void) index;
+        (void) ctxs;
+        (void) op;
+        return MB_BI_FATAL;
+    }
+};
+
+template<size_t I, typename F, typename... Rest>
+struct FormatDispatch<I, F, Rest...>
+{
+    template<typename Op>
+    static int call(size_t index, void * const *ctxs, Op &op)
+    {
+        if (index == I) {
+            return op.template run<F>(ctxs[I]);
+        }
+        return FormatDispatch<I + 1, Rest...>::call(index, ctxs, op);
+    }
+};
+
+template<typename T, typename... Formats>
+struct FormatIndex;
+
+template<typename T, typename... Rest>
+struct FormatIndex<T, T, Rest...>
+{
+    static constexpr size_t value = 0;
+};
+
+template<typename T, typename F, typename... Rest>
+struct FormatIndex<T, F, Rest...>
+{
+    static constexpr size_t value = 1 + FormatIndex<T, Rest...>::value;
+};
+
+struct FormatCodeOp
+{
+    template<typename F>
+    int run(void *)
+    {
+        return F::code;
+    }
+};
+
+struct FormatNameOp
+{
+    const char *name;
+
+    template<typename F>
+    int run(void *)
+    {
+        name = F::name();
+        return MB_BI_OK;
+    }
+};
+
+}
+
+}
+}
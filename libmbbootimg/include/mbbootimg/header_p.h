@@ -23,6 +23,11 @@
 
 #include <cstdint>
 
+// Strings up to these lengths (including the NULL terminator) are stored inline
+// in the header. They cover the fixed-size fields of all supported formats.
+#define MB_BI_HEADER_BOARD_NAME_INLINE_SIZE     32
+#define MB_BI_HEADER_CMDLINE_INLINE_SIZE        1024
+
 struct MbBiHeader
 {
     // Bitmap of fields that are supported
@@ -55,4 +60,10 @@ struct MbBiHeader
         uint32_t hdr_entrypoint;    // |         |      |      |     | X    |
         // TODO TODO TODO
     } field;
+
+    // Inline storage for string fields
+    struct {
+        char board_name[MB_BI_HEADER_BOARD_NAME_INLINE_SIZE];
+        char cmdline[MB_BI_HEADER_CMDLINE_INLINE_SIZE];
+    } storage;
 };
@@ -21,6 +21,9 @@
 
 #include "mbbootimg/guard_p.h"
 
+#include <cstdlib>
+#include <cstring>
+
 #define IS_SUPPORTED(STRUCT, FLAG) \
     ((STRUCT)->fields_supported & (FLAG))
 
@@ -48,14 +51,62 @@
 
 #define SET_STRING_FIELD(STRUCT, FLAG, FIELD, VALUE) \
     do { \
-        free((STRUCT)->field.FIELD); \
         if (VALUE) { \
-            char *dup = strdup(VALUE); \
-            if (!dup) { \
+            if (!mb::bootimg::string_field_set( \
+                    &(STRUCT)->field.FIELD, (STRUCT)->storage.FIELD, \
+                    sizeof((STRUCT)->storage.FIELD), (VALUE))) { \
                 return MB_BI_FAILED; \
             } \
-            SET_FIELD(STRUCT, FLAG, FIELD, dup); \
+            (STRUCT)->fields_set |= (FLAG); \
         } else { \
-            UNSET_FIELD(STRUCT, FLAG, FIELD, nullptr); \
+            mb::bootimg::string_field_free( \
+                    &(STRUCT)->field.FIELD, (STRUCT)->storage.FIELD); \
+            (STRUCT)->fields_set &= ~(FLAG); \
         } \
     } while (0)
+
+namespace mb
+{
+namespace bootimg
+{
+
+// String fields point either to their inline storage buffer or, if the value
+// does not fit, to a heap allocation. This keeps the reader from allocating
+// for every header/entry it parses.
+
+inline void string_field_free(char **field, char *storage)
+{
+    if (*field != storage) {
+        free(*field);
+    }
+    *field = nullptr;
+}
+
+// `value` may point to the current value of the field
+inline bool string_field_set(char **field, char *storage, size_t storage_size,
+                             const char *value)
+{
+    size_t len = strlen(value);
+    char *ptr;
+
+    if (len < storage_size) {
+        ptr = storage;
+    } else {
+        ptr = static_cast<char *>(malloc(len + 1));
+        if (!ptr) {
+            return false;
+        }
+    }
+
+    memmove(ptr, value, len + 1);
+
+    if (*field != storage && *field != ptr) {
+        free(*field);
+    }
+    *field = ptr;
+
+    return true;
+}
+
+}
+}
@@ -74,6 +74,8 @@ MB_EXPORT int mb_bi_reader_go_to_entry2(struct MbBiReader *bir,
                                         int entry_type);
 MB_EXPORT int mb_bi_reader_read_data(struct MbBiReader *bir, void *buf,
                                      size_t size, size_t *bytes_read);
+MB_EXPORT int mb_bi_reader_read_data_view(struct MbBiReader *bir,
+                                          const void **data, size_t *size);
 
 // Format operations
 MB_EXPORT int mb_bi_reader_format_code(struct MbBiReader *bir);
@@ -23,6 +23,7 @@
 
 #ifdef __cplusplus
 #  include <string>
+#  include <vector>
 
 #  include <cstddef>
 #else
@@ -32,6 +33,8 @@
 #include "mbcommon/common.h"
 #include "mbcommon/file.h"
 
+#include "mbbootimg/format/android_p.h"
+
 #define READER_ENSURE_STATE(INSTANCE, STATES) \
     do { \
         if (!((INSTANCE)->state & (STATES))) { \
@@ -61,6 +64,10 @@
 
 #define MAX_FORMATS     10
 
+// Number of bytes at the beginning of the file that are read once and shared
+// by all of the bidders
+#define READER_PROBE_SIZE   (16 * 1024)
+
 MB_BEGIN_C_DECLS
 
 struct MbBiReader;
@@ -80,6 +87,8 @@ typedef int (*FormatReaderGoToEntry)(struct MbBiReader *bir, void *userdata,
 typedef int (*FormatReaderReadData)(struct MbBiReader *bir, void *userdata,
                                     void *buf, size_t buf_size,
                                     size_t &bytes_read);
+typedef int (*FormatReaderReadDataView)(struct MbBiReader *bir, void *userdata,
+                                        const void *&data, size_t &data_size);
 typedef int (*FormatReaderFree)(struct MbBiReader *bir, void *userdata);
 
 struct FormatReader
@@ -94,6 +103,7 @@ struct FormatReader
     FormatReaderReadEntry read_entry_cb;
     FormatReaderGoToEntry go_to_entry_cb;
     FormatReaderReadData read_data_cb;
+    FormatReaderReadDataView read_data_view_cb;
     FormatReaderFree free_cb;
     void *userdata;
 };
@@ -130,6 +140,18 @@ struct MbBiReader
 
     struct MbBiHeader *header;
     struct MbBiEntry *entry;
+
+    // Beginning of the file, read once for format detection
+    std::vector<unsigned char> probe;
+    bool probe_valid;
+
+    // Android header found during bidding, shared by the Android-based formats
+    // (android, bump, loki, mtk). Only valid while the probe buffer is valid.
+    bool android_hdr_searched;
+    bool android_hdr_found;
+    uint64_t android_hdr_max_offset;
+    uint64_t android_hdr_offset;
+    AndroidHeader android_hdr;
 };
 
 int _mb_bi_reader_register_format(struct MbBiReader *bir,
@@ -142,9 +164,14 @@ int _mb_bi_reader_register_format(struct MbBiReader *bir,
                                   FormatReaderReadEntry read_entry_cb,
                                   FormatReaderGoToEntry go_to_entry_cb,
                                   FormatReaderReadData read_data_cb,
+                                  FormatReaderReadDataView read_data_view_cb,
                                   FormatReaderFree free_cb);
 
 int _mb_bi_reader_free_format(struct MbBiReader *bir,
                               struct FormatReader *format);
 
+bool _mb_bi_reader_read_at(struct MbBiReader *bir, mb::File *file,
+                           uint64_t offset, void *buf, size_t size,
+                           size_t &bytes_read);
+
 MB_END_C_DECLS
@@ -80,6 +80,8 @@ MB_EXPORT int mb_bi_writer_set_format_by_code(struct MbBiWriter *biw,
                                               int code);
 MB_EXPORT int mb_bi_writer_set_format_by_name(struct MbBiWriter *biw,
                                               const char *name);
+MB_EXPORT int mb_bi_writer_set_option(struct MbBiWriter *biw, const char *key,
+                                      const char *value);
 
 // Specific formats
 MB_EXPORT int mb_bi_writer_set_format_android(struct MbBiWriter *biw);
@@ -97,8 +99,4 @@ MB_EXPORT int mb_bi_writer_set_error(struct MbBiWriter *biw, int error_code,
 MB_EXPORT int mb_bi_writer_set_error_v(struct MbBiWriter *biw, int error_code,
                                        const char *fmt, va_list ap);
 
-// TODO TODO TODO
-// SET OPTIONS FUNCTION
-// TODO TODO TODO
-
 MB_END_C_DECLS
@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/convert.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/standard.h"
+#include "mbcommon/thread_pool.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+// Size of the per-thread buffer used when the input cannot be memory mapped
+#define CONVERT_BUF_SIZE                (256 * 1024)
+
+/*!
+ * \file mbbootimg/convert.h
+ * \brief Boot image conversion API
+ */
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+MB_PRINTF(3, 4)
+static int set_job_error(MbBiConvertJob *job, int ret, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(job->error_string, sizeof(job->error_string), fmt, ap);
+    va_end(ap);
+
+    job->ret = ret;
+    return ret;
+}
+
+static int write_all(MbBiConvertJob *job, MbBiWriter *biw,
+                     const void *data, size_t size)
+{
+    auto const *ptr = static_cast<const unsigned char *>(data);
+    size_t n;
+    int ret;
+
+    while (size > 0) {
+        ret = mb_bi_writer_write_data(biw, ptr, size, &n);
+        if (ret != MB_BI_OK) {
+            return set_job_error(job, ret, "%s: Failed to write entry data: %s",
+                                 job->output_path,
+                                 mb_bi_writer_error_string(biw));
+        }
+
+        ptr += n;
+        size -= n;
+    }
+
+    return MB_BI_OK;
+}
+
+static int copy_entry_data(MbBiConvertJob *job, MbBiReader *bir,
+                           MbBiWriter *biw, std::vector<unsigned char> &buf)
+{
+    const void *data;
+    size_t size;
+    int ret;
+
+    // Write directly from the mapped input if possible
+    ret = mb_bi_reader_read_data_view(bir, &data, &size);
+    if (ret == MB_BI_OK) {
+        return write_all(job, biw, data, size);
+    } else if (ret == MB_BI_EOF) {
+        return MB_BI_OK;
+    } else if (ret != MB_BI_UNSUPPORTED) {
+        return set_job_error(job, ret, "%s: Failed to read entry data: %s",
+                             job->input_path, mb_bi_reader_error_string(bir));
+    }
+
+    if (buf.empty()) {
+        buf.resize(CONVERT_BUF_SIZE);
+    }
+
+    while ((ret = mb_bi_reader_read_data(bir, buf.data(), buf.size(),
+                                         &size)) == MB_BI_OK) {
+        ret = write_all(job, biw, buf.data(), size);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        return set_job_error(job, ret, "%s: Failed to read entry data: %s",
+                             job->input_path, mb_bi_reader_error_string(bir));
+    }
+
+    return MB_BI_OK;
+}
+
+static int copy_file_data(MbBiConvertJob *job, const char *path,
+                          MbBiWriter *biw, std::vector<unsigned char> &buf)
+{
+    mb::StandardFile file(path, mb::FileOpenMode::READ_ONLY);
+    size_t n;
+    int ret;
+
+    if (!file.is_open()) {
+        return set_job_error(job, MB_BI_FAILED,
+                             "%s: Failed to open for reading: %s",
+                             path, file.error_string().c_str());
+    }
+
+    if (buf.empty()) {
+        buf.resize(CONVERT_BUF_SIZE);
+    }
+
+    while (true) {
+        if (!file.read(buf.data(), buf.size(), n)) {
+            return set_job_error(job, MB_BI_FAILED,
+                                 "%s: Failed to read file: %s",
+                                 path, file.error_string().c_str());
+        } else if (n == 0) {
+            break;
+        }
+
+        ret = write_all(job, biw, buf.data(), n);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+    }
+
+    return MB_BI_OK;
+}
+
+static int convert(MbBiConvertJob *job, std::vector<unsigned char> &buf)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    MbBiHeader *header;
+    MbBiEntry *in_entry;
+    MbBiEntry *out_entry;
+    int ret;
+
+    if (!bir || !biw) {
+        return set_job_error(job, MB_BI_FAILED,
+                             "Failed to allocate reader or writer");
+    }
+
+    // Open input boot image
+    ret = mb_bi_reader_enable_format_all(bir.get());
+    if (ret != MB_BI_OK) {
+        return set_job_error(job, ret, "Failed to enable input formats: %s",
+                             mb_bi_reader_error_string(bir.get()));
+    }
+
+    ret = mb_bi_reader_open_filename(bir.get(), job->input_path);
+    if (ret != MB_BI_OK) {
+        return set_job_error(job, ret, "%s: %s", job->input_path,
+                             mb_bi_reader_error_string(bir.get()));
+    }
+
+    // Open output boot image
+    ret = mb_bi_writer_set_format_by_code(
+            biw.get(), job->output_format != 0 ? job->output_format
+                    : mb_bi_reader_format_code(bir.get()));
+    if (ret != MB_BI_OK) {
+        return set_job_error(job, ret, "Failed to set output format: %s",
+                             mb_bi_writer_error_string(biw.get()));
+    }
+
+    ret = mb_bi_writer_open_filename(biw.get(), job->output_path);
+    if (ret != MB_BI_OK) {
+        return set_job_error(job, ret, "%s: %s", job->output_path,
+                             mb_bi_writer_error_string(biw.get()));
+    }
+
+    // Copy header. Fields not supported by the output format are ignored.
+    ret = mb_bi_reader_read_header(bir.get(), &header);
+    if (ret != MB_BI_OK) {
+        return set_job_error(job, ret, "%s: Failed to read header: %s",
+                             job->input_path,
+                             mb_bi_reader_error_string(bir.get()));
+    }
+
+    ret = mb_bi_writer_write_header(biw.get(), header);
+    if (ret != MB_BI_OK) {
+        return set_job_error(job, ret, "%s: Failed to write header: %s",
+                             job->output_path,
+                             mb_bi_writer_error_string(biw.get()));
+    }
+
+    // Copy entries that exist in both formats
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &out_entry)) == MB_BI_OK) {
+        int type = mb_bi_entry_type(out_entry);
+
+        ret = mb_bi_writer_write_entry(biw.get(), out_entry);
+        if (ret != MB_BI_OK) {
+            return set_job_error(job, ret, "%s: Failed to write entry: %s",
+                                 job->output_path,
+                                 mb_bi_writer_error_string(biw.get()));
+        }
+
+        if (type == MB_BI_ENTRY_ABOOT && job->aboot_path) {
+            ret = copy_file_data(job, job->aboot_path, biw.get(), buf);
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+            continue;
+        }
+
+        ret = mb_bi_reader_go_to_entry(bir.get(), &in_entry, type);
+        if (ret == MB_BI_EOF) {
+            continue;
+        } else if (ret != MB_BI_OK) {
+            return set_job_error(job, ret, "%s: Failed to go to entry %d: %s",
+                                 job->input_path, type,
+                                 mb_bi_reader_error_string(bir.get()));
+        }
+
+        ret = copy_entry_data(job, bir.get(), biw.get(), buf);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        return set_job_error(job, ret, "%s: Failed to get next entry: %s",
+                             job->output_path,
+                             mb_bi_writer_error_string(biw.get()));
+    }
+
+    ret = mb_bi_writer_close(biw.get());
+    if (ret != MB_BI_OK) {
+        return set_job_error(job, ret, "%s: Failed to close boot image: %s",
+                             job->output_path,
+                             mb_bi_writer_error_string(biw.get()));
+    }
+
+    job->ret = MB_BI_OK;
+    job->error_string[0] = '\0';
+    return MB_BI_OK;
+}
+
+MB_BEGIN_C_DECLS
+
+/*!
+ * \brief Convert a boot image to another format.
+ *
+ * The header fields and every entry supported by the output format are copied
+ * from the input boot image. Fields and entries not supported by the output
+ * format are dropped. If the output format is Loki, the aboot image is read
+ * from \p job->aboot_path.
+ *
+ * \param job Conversion parameters. The result is stored in \p job->ret and
+ *            \p job->error_string.
+ *
+ * \return
+ *   * #MB_BI_OK if the boot image is successfully converted
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_convert(MbBiConvertJob *job)
+{
+    std::vector<unsigned char> buf;
+    return convert(job, buf);
+}
+
+/*!
+ * \brief Convert multiple boot images in parallel.
+ *
+ * Each job is processed as if with mb_bi_convert(). Jobs are distributed
+ * between up to \p threads tasks on the shared thread pool, each of which
+ * reuses a single I/O buffer for all of its jobs. A failure in one job does not stop the other jobs from
+ * being processed.
+ *
+ * \note Jobs should not write to the same output file.
+ *
+ * \param jobs Array of conversion jobs
+ * \param jobs_len Number of jobs in \p jobs
+ * \param threads Maximum number of concurrent jobs (or 0 to use the number of
+ *                CPUs)
+ *
+ * \return
+ *   * #MB_BI_OK if every job succeeded
+ *   * Otherwise, the lowest (most severe) return value of the failed jobs
+ */
+int mb_bi_convert_batch(MbBiConvertJob *jobs, size_t jobs_len,
+                        unsigned int threads)
+{
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]{
+        std::vector<unsigned char> buf;
+
+        for (size_t i; (i = next++) < jobs_len;) {
+            convert(&jobs[i], buf);
+        }
+    };
+
+    if (threads == 0) {
+        threads = mb::ThreadPool::shared().size();
+    }
+    threads = static_cast<unsigned int>(
+            std::min<size_t>(threads, jobs_len));
+
+    if (threads <= 1) {
+        worker();
+    } else {
+        mb::TaskGroup group;
+
+        for (unsigned int i = 0; i < threads; ++i) {
+            group.run(worker);
+        }
+        group.wait();
+    }
+
+    int ret = MB_BI_OK;
+
+    for (size_t i = 0; i < jobs_len; ++i) {
+        ret = std::min(ret, jobs[i].ret);
+    }
+
+    return ret;
+}
+
+MB_END_C_DECLS
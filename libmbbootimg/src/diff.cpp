@@ -0,0 +1,986 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/diff.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+#include <openssl/sha.h>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file_util.h"
+#include "mbcommon/file/standard.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+#define DELTA_MAGIC             "MBBIDLTA"
+#define DELTA_MAGIC_SIZE        8
+#define DELTA_VERSION           1
+
+#define DELTA_OP_END            0
+#define DELTA_OP_COPY           1
+#define DELTA_OP_LITERAL        2
+
+/*!
+ * \file mbbootimg/diff.h
+ * \brief Boot image delta API
+ *
+ * A delta describes a target boot image in terms of a source boot image. It
+ * contains:
+ *
+ *   * The target format code
+ *   * The type, size, and SHA1 digest of every source entry so that the delta
+ *     is never applied to the wrong source image
+ *   * The header fields that differ between the two images
+ *   * For every target entry, a list of operations that either copy a range
+ *     from a source entry or insert literal data
+ *
+ * Every #MB_BI_DIFF_BLOCK_SIZE block of the source entries is indexed by a
+ * rolling checksum. A window of the same size is slid over each target entry
+ * and matching blocks are encoded as copies, so data that moved (e.g. a
+ * ramdisk that grew) or that was copied between entries is still found. All integers are stored in little-endian byte order.
+ */
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+typedef std::unique_ptr<MbBiHeader, decltype(mb_bi_header_free) *> ScopedHeader;
+
+struct ErrorBuf
+{
+    char *buf;
+    size_t size;
+};
+
+struct ImageEntry
+{
+    int type;
+    std::vector<unsigned char> data;
+};
+
+struct Image
+{
+    int format;
+    ScopedHeader header;
+    std::vector<ImageEntry> entries;
+
+    Image() : format(0), header(nullptr, mb_bi_header_free)
+    {
+    }
+};
+
+struct DeltaOp
+{
+    uint8_t op;
+    uint32_t source;
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct BlockRef
+{
+    uint32_t source;
+    uint64_t offset;
+};
+
+struct U32Field
+{
+    uint64_t field;
+    int (*is_set)(MbBiHeader *);
+    uint32_t (*get)(MbBiHeader *);
+    int (*set)(MbBiHeader *, uint32_t);
+    int (*unset)(MbBiHeader *);
+};
+
+struct StringField
+{
+    uint64_t field;
+    const char * (*get)(MbBiHeader *);
+    int (*set)(MbBiHeader *, const char *);
+};
+
+static const U32Field u32_fields[] = {
+    { MB_BI_HEADER_FIELD_KERNEL_ADDRESS,
+      mb_bi_header_kernel_address_is_set,
+      mb_bi_header_kernel_address,
+      mb_bi_header_set_kernel_address,
+      mb_bi_header_unset_kernel_address },
+    { MB_BI_HEADER_FIELD_RAMDISK_ADDRESS,
+      mb_bi_header_ramdisk_address_is_set,
+      mb_bi_header_ramdisk_address,
+      mb_bi_header_set_ramdisk_address,
+      mb_bi_header_unset_ramdisk_address },
+    { MB_BI_HEADER_FIELD_SECONDBOOT_ADDRESS,
+      mb_bi_header_secondboot_address_is_set,
+      mb_bi_header_secondboot_address,
+      mb_bi_header_set_secondboot_address,
+      mb_bi_header_unset_secondboot_address },
+    { MB_BI_HEADER_FIELD_KERNEL_TAGS_ADDRESS,
+      mb_bi_header_kernel_tags_address_is_set,
+      mb_bi_header_kernel_tags_address,
+      mb_bi_header_set_kernel_tags_address,
+      mb_bi_header_unset_kernel_tags_address },
+    { MB_BI_HEADER_FIELD_SONY_IPL_ADDRESS,
+      mb_bi_header_sony_ipl_address_is_set,
+      mb_bi_header_sony_ipl_address,
+      mb_bi_header_set_sony_ipl_address,
+      mb_bi_header_unset_sony_ipl_address },
+    { MB_BI_HEADER_FIELD_SONY_RPM_ADDRESS,
+      mb_bi_header_sony_rpm_address_is_set,
+      mb_bi_header_sony_rpm_address,
+      mb_bi_header_set_sony_rpm_address,
+      mb_bi_header_unset_sony_rpm_address },
+    { MB_BI_HEADER_FIELD_SONY_APPSBL_ADDRESS,
+      mb_bi_header_sony_appsbl_address_is_set,
+      mb_bi_header_sony_appsbl_address,
+      mb_bi_header_set_sony_appsbl_address,
+      mb_bi_header_unset_sony_appsbl_address },
+    { MB_BI_HEADER_FIELD_PAGE_SIZE,
+      mb_bi_header_page_size_is_set,
+      mb_bi_header_page_size,
+      mb_bi_header_set_page_size,
+      mb_bi_header_unset_page_size },
+    { MB_BI_HEADER_FIELD_ENTRYPOINT,
+      mb_bi_header_entrypoint_address_is_set,
+      mb_bi_header_entrypoint_address,
+      mb_bi_header_set_entrypoint_address,
+      mb_bi_header_unset_entrypoint_address },
+};
+
+static const StringField string_fields[] = {
+    { MB_BI_HEADER_FIELD_BOARD_NAME,
+      mb_bi_header_board_name,
+      mb_bi_header_set_board_name },
+    { MB_BI_HEADER_FIELD_KERNEL_CMDLINE,
+      mb_bi_header_kernel_cmdline,
+      mb_bi_header_set_kernel_cmdline },
+};
+
+MB_PRINTF(3, 4)
+static int set_error(ErrorBuf &error, int ret, const char *fmt, ...)
+{
+    if (error.buf && error.size > 0) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(error.buf, error.size, fmt, ap);
+        va_end(ap);
+    }
+
+    return ret;
+}
+
+class ByteWriter
+{
+public:
+    std::vector<unsigned char> data;
+
+    void put_u8(uint8_t value)
+    {
+        data.push_back(value);
+    }
+
+    void put_u32(uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i) {
+            data.push_back(static_cast<unsigned char>(value >> (i * 8)));
+        }
+    }
+
+    void put_u64(uint64_t value)
+    {
+        for (int i = 0; i < 8; ++i) {
+            data.push_back(static_cast<unsigned char>(value >> (i * 8)));
+        }
+    }
+
+    void put_bytes(const void *buf, size_t size)
+    {
+        auto const *ptr = static_cast<const unsigned char *>(buf);
+        data.insert(data.end(), ptr, ptr + size);
+    }
+};
+
+class ByteReader
+{
+public:
+    ByteReader(const std::vector<unsigned char> &data)
+        : _data(data), _pos(0)
+    {
+    }
+
+    bool get_u8(uint8_t &value)
+    {
+        if (remaining() < 1) {
+            return false;
+        }
+        value = _data[_pos++];
+        return true;
+    }
+
+    bool get_u32(uint32_t &value)
+    {
+        if (remaining() < 4) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; ++i) {
+            value |= static_cast<uint32_t>(_data[_pos++]) << (i * 8);
+        }
+        return true;
+    }
+
+    bool get_u64(uint64_t &value)
+    {
+        if (remaining() < 8) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 8; ++i) {
+            value |= static_cast<uint64_t>(_data[_pos++]) << (i * 8);
+        }
+        return true;
+    }
+
+    bool get_bytes(const unsigned char *&ptr, uint64_t size)
+    {
+        if (remaining() < size) {
+            return false;
+        }
+        ptr = _data.data() + _pos;
+        _pos += static_cast<size_t>(size);
+        return true;
+    }
+
+    size_t remaining() const
+    {
+        return _data.size() - _pos;
+    }
+
+private:
+    const std::vector<unsigned char> &_data;
+    size_t _pos;
+};
+
+/*!
+ * \brief Rolling checksum of a block (similar to rsync's weak checksum)
+ */
+class RollingHash
+{
+public:
+    RollingHash() : _a(0), _b(0)
+    {
+    }
+
+    void init(const unsigned char *data, size_t size)
+    {
+        _a = 0;
+        _b = 0;
+        for (size_t i = 0; i < size; ++i) {
+            _a += data[i];
+            _b += static_cast<uint32_t>(size - i) * data[i];
+        }
+    }
+
+    // Slide the window one byte forward
+    void roll(unsigned char out, unsigned char in, size_t size)
+    {
+        _a = _a - out + in;
+        _b = _b - static_cast<uint32_t>(size) * out + _a;
+    }
+
+    uint64_t value() const
+    {
+        return (static_cast<uint64_t>(_b) << 32) | _a;
+    }
+
+private:
+    uint32_t _a;
+    uint32_t _b;
+};
+
+static int read_entry_data(ErrorBuf &error, const char *path, MbBiReader *bir,
+                           std::vector<unsigned char> &data)
+{
+    const void *view;
+    size_t size;
+    int ret;
+
+    data.clear();
+
+    ret = mb_bi_reader_read_data_view(bir, &view, &size);
+    if (ret == MB_BI_OK) {
+        auto const *ptr = static_cast<const unsigned char *>(view);
+        data.assign(ptr, ptr + size);
+        return MB_BI_OK;
+    } else if (ret == MB_BI_EOF) {
+        return MB_BI_OK;
+    } else if (ret != MB_BI_UNSUPPORTED) {
+        return set_error(error, ret, "%s: Failed to read entry data: %s",
+                         path, mb_bi_reader_error_string(bir));
+    }
+
+    unsigned char buf[10240];
+
+    while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &size))
+            == MB_BI_OK) {
+        data.insert(data.end(), buf, buf + size);
+    }
+
+    if (ret != MB_BI_EOF) {
+        return set_error(error, ret, "%s: Failed to read entry data: %s",
+                         path, mb_bi_reader_error_string(bir));
+    }
+
+    return MB_BI_OK;
+}
+
+static int load_image(ErrorBuf &error, const char *path, Image &image)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+
+    if (!bir) {
+        return set_error(error, MB_BI_FAILED, "Failed to allocate reader");
+    }
+
+    ret = mb_bi_reader_enable_format_all(bir.get());
+    if (ret != MB_BI_OK) {
+        return set_error(error, ret, "Failed to enable input formats: %s",
+                         mb_bi_reader_error_string(bir.get()));
+    }
+
+    ret = mb_bi_reader_open_filename(bir.get(), path);
+    if (ret != MB_BI_OK) {
+        return set_error(error, ret, "%s: %s",
+                         path, mb_bi_reader_error_string(bir.get()));
+    }
+
+    image.format = mb_bi_reader_format_code(bir.get());
+
+    ret = mb_bi_reader_read_header(bir.get(), &header);
+    if (ret != MB_BI_OK) {
+        return set_error(error, ret, "%s: Failed to read header: %s",
+                         path, mb_bi_reader_error_string(bir.get()));
+    }
+
+    image.header.reset(mb_bi_header_clone(header));
+    if (!image.header) {
+        return set_error(error, MB_BI_FAILED, "Failed to allocate header");
+    }
+
+    while ((ret = mb_bi_reader_read_entry(bir.get(), &entry)) == MB_BI_OK) {
+        image.entries.emplace_back();
+        image.entries.back().type = mb_bi_entry_type(entry);
+
+        ret = read_entry_data(error, path, bir.get(),
+                              image.entries.back().data);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        return set_error(error, ret, "%s: Failed to read entry: %s",
+                         path, mb_bi_reader_error_string(bir.get()));
+    }
+
+    return MB_BI_OK;
+}
+
+static void write_header_changes(ByteWriter &out, MbBiHeader *source,
+                                 MbBiHeader *target)
+{
+    uint64_t changed = 0;
+
+    for (auto const &f : u32_fields) {
+        bool source_set = f.is_set(source);
+        bool target_set = f.is_set(target);
+
+        if (source_set != target_set
+                || (target_set && f.get(source) != f.get(target))) {
+            changed |= f.field;
+        }
+    }
+    for (auto const &f : string_fields) {
+        const char *source_value = f.get(source);
+        const char *target_value = f.get(target);
+
+        if (!source_value != !target_value || (target_value
+                && strcmp(source_value, target_value) != 0)) {
+            changed |= f.field;
+        }
+    }
+
+    out.put_u64(changed);
+
+    for (auto const &f : u32_fields) {
+        if (changed & f.field) {
+            bool set = f.is_set(target);
+            out.put_u8(set);
+            if (set) {
+                out.put_u32(f.get(target));
+            }
+        }
+    }
+    for (auto const &f : string_fields) {
+        if (changed & f.field) {
+            const char *value = f.get(target);
+            out.put_u8(value != nullptr);
+            if (value) {
+                size_t len = strlen(value);
+                out.put_u32(static_cast<uint32_t>(len));
+                out.put_bytes(value, len);
+            }
+        }
+    }
+}
+
+static void add_op(std::vector<DeltaOp> &ops, uint8_t op, uint32_t source,
+                   uint64_t offset, uint64_t length)
+{
+    if (!ops.empty()) {
+        DeltaOp &last = ops.back();
+
+        if (last.op == op && op == DELTA_OP_COPY && last.source == source
+                && last.offset + last.length == offset) {
+            last.length += length;
+            return;
+        } else if (last.op == op && op == DELTA_OP_LITERAL
+                && last.offset + last.length == offset) {
+            last.length += length;
+            return;
+        }
+    }
+
+    ops.push_back({ op, source, offset, length });
+}
+
+static void diff_entry(ByteWriter &out, const Image &source,
+                       const std::unordered_map<uint64_t, BlockRef> &index,
+                       const ImageEntry &target)
+{
+    const unsigned char *data = target.data.data();
+    size_t size = target.data.size();
+    std::vector<DeltaOp> ops;
+    RollingHash hash;
+    bool hash_valid = false;
+    size_t pos = 0;
+
+    // Find source blocks at any offset in the target entry by sliding a
+    // block-sized window over it one byte at a time
+    while (pos + MB_BI_DIFF_BLOCK_SIZE <= size) {
+        if (!hash_valid) {
+            hash.init(data + pos, MB_BI_DIFF_BLOCK_SIZE);
+            hash_valid = true;
+        }
+
+        auto it = index.find(hash.value());
+        if (it != index.end()) {
+            auto const &ref = source.entries[it->second.source].data;
+            size_t offset = static_cast<size_t>(it->second.offset);
+
+            if (memcmp(ref.data() + offset, data + pos,
+                       MB_BI_DIFF_BLOCK_SIZE) == 0) {
+                // Extend the match as far as the data is identical
+                size_t len = MB_BI_DIFF_BLOCK_SIZE;
+                while (pos + len < size && offset + len < ref.size()
+                        && data[pos + len] == ref[offset + len]) {
+                    ++len;
+                }
+
+                add_op(ops, DELTA_OP_COPY, it->second.source, offset, len);
+                pos += len;
+                hash_valid = false;
+                continue;
+            }
+        }
+
+        add_op(ops, DELTA_OP_LITERAL, 0, pos, 1);
+
+        if (pos + MB_BI_DIFF_BLOCK_SIZE < size) {
+            hash.roll(data[pos], data[pos + MB_BI_DIFF_BLOCK_SIZE],
+                      MB_BI_DIFF_BLOCK_SIZE);
+        }
+        ++pos;
+    }
+
+    if (pos < size) {
+        add_op(ops, DELTA_OP_LITERAL, 0, pos, size - pos);
+    }
+
+    out.put_u32(static_cast<uint32_t>(target.type));
+    out.put_u64(size);
+
+    for (auto const &op : ops) {
+        out.put_u8(op.op);
+        if (op.op == DELTA_OP_COPY) {
+            out.put_u32(op.source);
+            out.put_u64(op.offset);
+            out.put_u64(op.length);
+        } else {
+            out.put_u64(op.length);
+            out.put_bytes(data + op.offset, static_cast<size_t>(op.length));
+        }
+    }
+
+    out.put_u8(DELTA_OP_END);
+}
+
+static int write_file(ErrorBuf &error, const char *path,
+                      const std::vector<unsigned char> &data)
+{
+    mb::StandardFile file(path, mb::FileOpenMode::WRITE_ONLY);
+    size_t n;
+
+    if (!file.is_open()) {
+        return set_error(error, MB_BI_FAILED,
+                         "%s: Failed to open for writing: %s",
+                         path, file.error_string().c_str());
+    }
+
+    if (!mb::file_write_fully(file, data.data(), data.size(), n)
+            || n != data.size()) {
+        return set_error(error, MB_BI_FAILED, "%s: Failed to write file: %s",
+                         path, file.error_string().c_str());
+    }
+
+    if (!file.close()) {
+        return set_error(error, MB_BI_FAILED, "%s: Failed to close file: %s",
+                         path, file.error_string().c_str());
+    }
+
+    return MB_BI_OK;
+}
+
+static int read_file(ErrorBuf &error, const char *path,
+                     std::vector<unsigned char> &data)
+{
+    mb::StandardFile file(path, mb::FileOpenMode::READ_ONLY);
+    unsigned char buf[10240];
+    size_t n;
+
+    if (!file.is_open()) {
+        return set_error(error, MB_BI_FAILED,
+                         "%s: Failed to open for reading: %s",
+                         path, file.error_string().c_str());
+    }
+
+    data.clear();
+
+    while (true) {
+        if (!file.read(buf, sizeof(buf), n)) {
+            return set_error(error, MB_BI_FAILED,
+                             "%s: Failed to read file: %s",
+                             path, file.error_string().c_str());
+        } else if (n == 0) {
+            break;
+        }
+
+        data.insert(data.end(), buf, buf + n);
+    }
+
+    return MB_BI_OK;
+}
+
+static int write_all(ErrorBuf &error, const char *path, MbBiWriter *biw,
+                     const unsigned char *data, uint64_t size)
+{
+    size_t n;
+    int ret;
+
+    while (size > 0) {
+        ret = mb_bi_writer_write_data(biw, data, static_cast<size_t>(size), &n);
+        if (ret != MB_BI_OK) {
+            return set_error(error, ret, "%s: Failed to write entry data: %s",
+                             path, mb_bi_writer_error_string(biw));
+        }
+
+        data += n;
+        size -= n;
+    }
+
+    return MB_BI_OK;
+}
+
+static int read_header_changes(ErrorBuf &error, ByteReader &in,
+                               MbBiHeader *header)
+{
+    uint64_t changed;
+    uint8_t set;
+    uint32_t value;
+    const unsigned char *ptr;
+
+    if (!in.get_u64(changed)) {
+        return set_error(error, MB_BI_FAILED, "Delta is truncated");
+    }
+
+    for (auto const &f : u32_fields) {
+        if (!(changed & f.field)) {
+            continue;
+        }
+
+        if (!in.get_u8(set) || (set && !in.get_u32(value))) {
+            return set_error(error, MB_BI_FAILED, "Delta is truncated");
+        }
+
+        if ((set ? f.set(header, value) : f.unset(header)) != MB_BI_OK) {
+            return set_error(error, MB_BI_FAILED,
+                             "Failed to set header field");
+        }
+    }
+    for (auto const &f : string_fields) {
+        if (!(changed & f.field)) {
+            continue;
+        }
+
+        if (!in.get_u8(set)) {
+            return set_error(error, MB_BI_FAILED, "Delta is truncated");
+        }
+
+        std::string str;
+        if (set) {
+            if (!in.get_u32(value) || !in.get_bytes(ptr, value)) {
+                return set_error(error, MB_BI_FAILED, "Delta is truncated");
+            }
+            str.assign(reinterpret_cast<const char *>(ptr), value);
+        }
+
+        if (f.set(header, set ? str.c_str() : nullptr) != MB_BI_OK) {
+            return set_error(error, MB_BI_FAILED,
+                             "Failed to set header field");
+        }
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Write the operations for one target entry to the writer
+ *
+ * If \p biw is NULL, the operations are only validated and skipped.
+ */
+static int apply_entry(ErrorBuf &error, const char *output_path,
+                       const Image &source, ByteReader &in, MbBiWriter *biw)
+{
+    uint8_t op;
+    uint32_t index;
+    uint64_t offset;
+    uint64_t length;
+    const unsigned char *ptr;
+    int ret;
+
+    while (true) {
+        if (!in.get_u8(op)) {
+            return set_error(error, MB_BI_FAILED, "Delta is truncated");
+        }
+
+        if (op == DELTA_OP_END) {
+            return MB_BI_OK;
+        } else if (op == DELTA_OP_COPY) {
+            if (!in.get_u32(index) || !in.get_u64(offset)
+                    || !in.get_u64(length)) {
+                return set_error(error, MB_BI_FAILED, "Delta is truncated");
+            }
+
+            if (index >= source.entries.size()
+                    || offset > source.entries[index].data.size()
+                    || length > source.entries[index].data.size() - offset) {
+                return set_error(error, MB_BI_FAILED,
+                                 "Delta copies out of bounds source data");
+            }
+
+            ptr = source.entries[index].data.data() + offset;
+        } else if (op == DELTA_OP_LITERAL) {
+            if (!in.get_u64(length) || !in.get_bytes(ptr, length)) {
+                return set_error(error, MB_BI_FAILED, "Delta is truncated");
+            }
+        } else {
+            return set_error(error, MB_BI_FAILED,
+                             "Invalid delta operation: %d", op);
+        }
+
+        if (biw) {
+            ret = write_all(error, output_path, biw, ptr, length);
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+        }
+    }
+}
+
+MB_BEGIN_C_DECLS
+
+/*!
+ * \brief Create a delta between two boot images.
+ *
+ * \param source_path Source boot image
+ * \param target_path Target boot image
+ * \param delta_path Output delta file
+ * \param[out] error_buf Buffer for the error message (may be NULL)
+ * \param error_size Size of \p error_buf
+ *
+ * \return
+ *   * #MB_BI_OK if the delta is successfully written
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_diff(const char *source_path, const char *target_path,
+               const char *delta_path, char *error_buf, size_t error_size)
+{
+    ErrorBuf error{error_buf, error_size};
+    Image source;
+    Image target;
+    ByteWriter out;
+    int ret;
+
+    ret = load_image(error, source_path, source);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    ret = load_image(error, target_path, target);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    out.put_bytes(DELTA_MAGIC, DELTA_MAGIC_SIZE);
+    out.put_u32(DELTA_VERSION);
+    out.put_u32(static_cast<uint32_t>(target.format));
+
+    // Source image fingerprint
+    out.put_u32(static_cast<uint32_t>(source.entries.size()));
+    for (auto const &entry : source.entries) {
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        SHA1(entry.data.data(), entry.data.size(), digest);
+
+        out.put_u32(static_cast<uint32_t>(entry.type));
+        out.put_u64(entry.data.size());
+        out.put_bytes(digest, sizeof(digest));
+    }
+
+    write_header_changes(out, source.header.get(), target.header.get());
+
+    // Index every full block of the source image by its contents
+    std::unordered_map<uint64_t, BlockRef> index;
+    for (size_t i = 0; i < source.entries.size(); ++i) {
+        auto const &data = source.entries[i].data;
+
+        for (uint64_t offset = 0; offset + MB_BI_DIFF_BLOCK_SIZE <= data.size();
+                offset += MB_BI_DIFF_BLOCK_SIZE) {
+            RollingHash hash;
+            hash.init(data.data() + offset, MB_BI_DIFF_BLOCK_SIZE);
+
+            index.emplace(hash.value(),
+                          BlockRef{ static_cast<uint32_t>(i), offset });
+        }
+    }
+
+    out.put_u32(static_cast<uint32_t>(target.entries.size()));
+    for (auto const &entry : target.entries) {
+        diff_entry(out, source, index, entry);
+    }
+
+    return write_file(error, delta_path, out.data);
+}
+
+/*!
+ * \brief Apply a delta created by mb_bi_diff() to a boot image.
+ *
+ * \param source_path Source boot image. The delta is rejected if the image's
+ *                    entries do not match the ones the delta was created from.
+ * \param delta_path Delta file
+ * \param output_path Output boot image
+ * \param[out] error_buf Buffer for the error message (may be NULL)
+ * \param error_size Size of \p error_buf
+ *
+ * \return
+ *   * #MB_BI_OK if the boot image is successfully written
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_patch(const char *source_path, const char *delta_path,
+                const char *output_path, char *error_buf, size_t error_size)
+{
+    ErrorBuf error{error_buf, error_size};
+    Image source;
+    std::vector<unsigned char> delta;
+    const unsigned char *ptr;
+    uint32_t version;
+    uint32_t format;
+    uint32_t count;
+    MbBiEntry *entry;
+    int ret;
+
+    ret = read_file(error, delta_path, delta);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    ByteReader in(delta);
+
+    if (!in.get_bytes(ptr, DELTA_MAGIC_SIZE)
+            || memcmp(ptr, DELTA_MAGIC, DELTA_MAGIC_SIZE) != 0) {
+        return set_error(error, MB_BI_FAILED,
+                         "%s: Not a boot image delta", delta_path);
+    }
+    if (!in.get_u32(version) || version != DELTA_VERSION) {
+        return set_error(error, MB_BI_UNSUPPORTED,
+                         "%s: Unsupported delta version", delta_path);
+    }
+    if (!in.get_u32(format) || !in.get_u32(count)) {
+        return set_error(error, MB_BI_FAILED, "Delta is truncated");
+    }
+
+    ret = load_image(error, source_path, source);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    // Verify source image
+    if (count != source.entries.size()) {
+        return set_error(error, MB_BI_FAILED,
+                         "%s: Delta does not match source image", source_path);
+    }
+    for (auto const &e : source.entries) {
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        uint32_t type;
+        uint64_t size;
+
+        if (!in.get_u32(type) || !in.get_u64(size)
+                || !in.get_bytes(ptr, sizeof(digest))) {
+            return set_error(error, MB_BI_FAILED, "Delta is truncated");
+        }
+
+        SHA1(e.data.data(), e.data.size(), digest);
+
+        if (type != static_cast<uint32_t>(e.type) || size != e.data.size()
+                || memcmp(ptr, digest, sizeof(digest)) != 0) {
+            return set_error(error, MB_BI_FAILED,
+                             "%s: Delta does not match source image",
+                             source_path);
+        }
+    }
+
+    // Apply header changes on top of the source header
+    ScopedHeader header(mb_bi_header_clone(source.header.get()),
+                        mb_bi_header_free);
+    if (!header) {
+        return set_error(error, MB_BI_FAILED, "Failed to allocate header");
+    }
+    mb_bi_header_set_supported_fields(header.get(), MB_BI_HEADER_ALL_FIELDS);
+
+    ret = read_header_changes(error, in, header.get());
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    // Locate the operations for each target entry
+    std::unordered_map<int, size_t> entry_offsets;
+    if (!in.get_u32(count)) {
+        return set_error(error, MB_BI_FAILED, "Delta is truncated");
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t type;
+        uint64_t size;
+
+        if (!in.get_u32(type) || !in.get_u64(size)) {
+            return set_error(error, MB_BI_FAILED, "Delta is truncated");
+        }
+
+        entry_offsets[static_cast<int>(type)] = delta.size() - in.remaining();
+
+        // Validate and skip operations
+        ret = apply_entry(error, output_path, source, in, nullptr);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+    }
+
+    // Write target image
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    if (!biw) {
+        return set_error(error, MB_BI_FAILED, "Failed to allocate writer");
+    }
+
+    ret = mb_bi_writer_set_format_by_code(biw.get(), static_cast<int>(format));
+    if (ret != MB_BI_OK) {
+        return set_error(error, ret, "Failed to set output format: %s",
+                         mb_bi_writer_error_string(biw.get()));
+    }
+
+    ret = mb_bi_writer_open_filename(biw.get(), output_path);
+    if (ret != MB_BI_OK) {
+        return set_error(error, ret, "%s: %s", output_path,
+                         mb_bi_writer_error_string(biw.get()));
+    }
+
+    ret = mb_bi_writer_write_header(biw.get(), header.get());
+    if (ret != MB_BI_OK) {
+        return set_error(error, ret, "%s: Failed to write header: %s",
+                         output_path, mb_bi_writer_error_string(biw.get()));
+    }
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+        int type = mb_bi_entry_type(entry);
+
+        ret = mb_bi_writer_write_entry(biw.get(), entry);
+        if (ret != MB_BI_OK) {
+            return set_error(error, ret, "%s: Failed to write entry: %s",
+                             output_path, mb_bi_writer_error_string(biw.get()));
+        }
+
+        auto it = entry_offsets.find(type);
+        if (it == entry_offsets.end()) {
+            continue;
+        }
+
+        ByteReader ops(delta);
+        ops.get_bytes(ptr, it->second);
+
+        ret = apply_entry(error, output_path, source, ops, biw.get());
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+    }
+
+    if (ret != MB_BI_EOF) {
+        return set_error(error, ret, "%s: Failed to get next entry: %s",
+                         output_path, mb_bi_writer_error_string(biw.get()));
+    }
+
+    ret = mb_bi_writer_close(biw.get());
+    if (ret != MB_BI_OK) {
+        return set_error(error, ret, "%s: Failed to close boot image: %s",
+                         output_path, mb_bi_writer_error_string(biw.get()));
+    }
+
+    return MB_BI_OK;
+}
+
+MB_END_C_DECLS
@@ -27,6 +27,8 @@
 #include "mbbootimg/entry_p.h"
 #include "mbbootimg/macros_p.h"
 
+using namespace mb::bootimg;
+
 
 MB_BEGIN_C_DECLS
 
@@ -46,7 +48,7 @@ void mb_bi_entry_free(MbBiEntry *entry)
 void mb_bi_entry_clear(MbBiEntry *entry)
 {
     if (entry) {
-        free(entry->field.name);
+        string_field_free(&entry->field.name, entry->storage.name);
         memset(entry, 0, sizeof(*entry));
     }
 }
@@ -70,7 +72,9 @@ MbBiEntry * mb_bi_entry_clone(MbBiEntry *entry)
     // Deep copy strings
     bool deep_copy_error =
             (entry->field.name
-                    && !(dup->field.name = strdup(entry->field.name)));
+                    && !string_field_set(&dup->field.name, dup->storage.name,
+                                         sizeof(dup->storage.name),
+                                         entry->field.name));
 
     if (deep_copy_error) {
         mb_bi_entry_free(dup);
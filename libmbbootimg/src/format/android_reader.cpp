@@ -36,6 +36,7 @@
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/align_p.h"
 #include "mbbootimg/format/bump_defs.h"
+#include "mbbootimg/format_tags.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/reader.h"
 #include "mbbootimg/reader_p.h"
@@ -84,15 +85,26 @@ int find_android_header(MbBiReader *bir, mb::File *file,
         return MB_BI_WARN;
     }
 
-    if (!file->seek(0, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Failed to seek to beginning: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    // Reuse the result of a previous search of the probe buffer
+    bool cacheable = file == bir->file && bir->probe_valid;
+
+    if (cacheable && bir->android_hdr_searched) {
+        if (bir->android_hdr_found
+                && bir->android_hdr_offset <= max_header_offset) {
+            *header_out = bir->android_hdr;
+            *offset_out = bir->android_hdr_offset;
+            return MB_BI_OK;
+        } else if (bir->android_hdr_found
+                || max_header_offset <= bir->android_hdr_max_offset) {
+            mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
+                                   "Android magic not found in first %"
+                                   PRIu64 " bytes", max_header_offset);
+            return MB_BI_WARN;
+        }
     }
 
-    if (!mb::file_read_fully(*file, buf,
-                             max_header_offset + sizeof(AndroidHeader), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, 0, buf,
+                               max_header_offset + sizeof(AndroidHeader), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read header: %s",
                                file->error_string().c_str());
@@ -101,6 +113,12 @@ int find_android_header(MbBiReader *bir, mb::File *file,
 
     ptr = mb_memmem(buf, n, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
     if (!ptr) {
+        if (cacheable) {
+            bir->android_hdr_searched = true;
+            bir->android_hdr_found = false;
+            bir->android_hdr_max_offset = max_header_offset;
+        }
+
         mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
                                "Android magic not found in first %d bytes",
                                ANDROID_MAX_HEADER_OFFSET);
@@ -121,6 +139,14 @@ int find_android_header(MbBiReader *bir, mb::File *file,
     android_fix_header_byte_order(header_out);
     *offset_out = offset;
 
+    if (cacheable) {
+        bir->android_hdr_searched = true;
+        bir->android_hdr_found = true;
+        bir->android_hdr_max_offset = max_header_offset;
+        bir->android_hdr_offset = offset;
+        bir->android_hdr = *header_out;
+    }
+
     return MB_BI_OK;
 }
 
@@ -169,14 +195,7 @@ int find_samsung_seandroid_magic(MbBiReader *bir, mb::File *file,
     pos += hdr->dt_size;
     pos += align_page_size<uint64_t>(pos, hdr->page_size);
 
-    if (!file->seek(pos, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "SEAndroid magic not found: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    if (!mb::file_read_fully(*file, buf, sizeof(buf), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, pos, buf, sizeof(buf), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read SEAndroid magic: %s",
                                file->error_string().c_str());
@@ -240,14 +259,7 @@ int find_bump_magic(MbBiReader *bir, mb::File *file,
     pos += hdr->dt_size;
     pos += align_page_size<uint64_t>(pos, hdr->page_size);
 
-    if (!file->seek(pos, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "SEAndroid magic not found: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    if (!mb::file_read_fully(*file, buf, sizeof(buf), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, pos, buf, sizeof(buf), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read SEAndroid magic: %s",
                                file->error_string().c_str());
@@ -545,6 +557,15 @@ int android_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int android_reader_read_data_view(MbBiReader *bir, void *userdata,
+                                  const void *&data, size_t &data_size)
+{
+    AndroidReaderCtx *const ctx = static_cast<AndroidReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, data,
+                                          data_size, bir);
+}
+
 int android_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -566,20 +587,11 @@ int android_reader_free(MbBiReader *bir, void *userdata)
  */
 int mb_bi_reader_enable_format_android(MbBiReader *bir)
 {
-    AndroidReaderCtx *const ctx = static_cast<AndroidReaderCtx *>(
-            calloc(1, sizeof(AndroidReaderCtx)));
+    void *ctx = mb::bootimg::AndroidFormat::reader_new(bir);
     if (!ctx) {
-        mb_bi_reader_set_error(bir, -errno,
-                               "Failed to allocate AndroidReaderCtx: %s",
-                               strerror(errno));
         return MB_BI_FAILED;
     }
 
-    _segment_reader_init(&ctx->segctx);
-
-    // Allow truncated dt image by default
-    ctx->allow_truncated_dt = true;
-
     return _mb_bi_reader_register_format(bir,
                                          ctx,
                                          MB_BI_FORMAT_ANDROID,
@@ -590,7 +602,77 @@ int mb_bi_reader_enable_format_android(MbBiReader *bir)
                                          &android_reader_read_entry,
                                          &android_reader_go_to_entry,
                                          &android_reader_read_data,
+                                         &android_reader_read_data_view,
                                          &android_reader_free);
 }
 
 MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+void * AndroidFormat::reader_new(MbBiReader *bir)
+{
+    AndroidReaderCtx *const ctx = static_cast<AndroidReaderCtx *>(
+            calloc(1, sizeof(AndroidReaderCtx)));
+    if (!ctx) {
+        mb_bi_reader_set_error(bir, -errno,
+                               "Failed to allocate AndroidReaderCtx: %s",
+                               strerror(errno));
+        return nullptr;
+    }
+
+    _segment_reader_init(&ctx->segctx);
+
+    // Allow truncated dt image by default
+    ctx->allow_truncated_dt = true;
+
+    return ctx;
+}
+
+int AndroidFormat::reader_free(MbBiReader *bir, void *ctx)
+{
+    return android_reader_free(bir, ctx);
+}
+
+int AndroidFormat::reader_bid(MbBiReader *bir, void *ctx, int best_bid)
+{
+    return android_reader_bid(bir, ctx, best_bid);
+}
+
+int AndroidFormat::reader_read_header(MbBiReader *bir, void *ctx,
+                                      MbBiHeader *header)
+{
+    return android_reader_read_header(bir, ctx, header);
+}
+
+int AndroidFormat::reader_read_entry(MbBiReader *bir, void *ctx,
+                                     MbBiEntry *entry)
+{
+    return android_reader_read_entry(bir, ctx, entry);
+}
+
+int AndroidFormat::reader_go_to_entry(MbBiReader *bir, void *ctx,
+                                      MbBiEntry *entry, int entry_type)
+{
+    return android_reader_go_to_entry(bir, ctx, entry, entry_type);
+}
+
+int AndroidFormat::reader_read_data(MbBiReader *bir, void *ctx,
+                                    void *buf, size_t buf_size,
+                                    size_t &bytes_read)
+{
+    return android_reader_read_data(bir, ctx, buf, buf_size, bytes_read);
+}
+
+int AndroidFormat::reader_read_data_view(MbBiReader *bir, void *ctx,
+                                         const void *&data,
+                                         size_t &data_size)
+{
+    return android_reader_read_data_view(bir, ctx, data, data_size);
+}
+
+}
+}
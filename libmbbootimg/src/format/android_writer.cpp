@@ -20,6 +20,7 @@
 #include "mbbootimg/format/android_writer_p.h"
 
 #include <algorithm>
+#include <new>
 
 #include <cerrno>
 #include <cinttypes>
@@ -30,12 +31,14 @@
 
 #include "mbcommon/endian.h"
 #include "mbcommon/file.h"
+#include "mbcommon/file/memory.h"
 #include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
 
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/align_p.h"
 #include "mbbootimg/format/bump_defs.h"
+#include "mbbootimg/format_tags.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/writer.h"
 #include "mbbootimg/writer_p.h"
@@ -43,6 +46,49 @@
 
 MB_BEGIN_C_DECLS
 
+/*!
+ * \brief Get file that the image data should be written to
+ *
+ * \return The in-memory spool file in streaming mode, otherwise the writer's
+ *         output file
+ */
+static mb::File * output_file(MbBiWriter *biw, AndroidWriterCtx *ctx)
+{
+    return ctx->spool ? ctx->spool : biw->file;
+}
+
+static bool update_sha1(AndroidWriterCtx *ctx, const void *data, size_t size)
+{
+    if (ctx->sha_pipeline) {
+        return ctx->sha_pipeline->update(data, size);
+    } else {
+        return SHA1_Update(&ctx->sha_ctx, data, size);
+    }
+}
+
+int android_writer_set_option(MbBiWriter *biw, void *userdata,
+                              const char *key, const char *value)
+{
+    (void) biw;
+
+    AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
+
+    bool enabled = strcasecmp(value, "true") == 0
+            || strcasecmp(value, "yes") == 0
+            || strcasecmp(value, "y") == 0
+            || strcmp(value, "1") == 0;
+
+    if (strcmp(key, "streaming") == 0) {
+        ctx->streaming = enabled;
+        return MB_BI_OK;
+    } else if (strcmp(key, "parallel_hash") == 0) {
+        ctx->parallel_hash = enabled;
+        return MB_BI_OK;
+    } else {
+        return MB_BI_WARN;
+    }
+}
+
 int android_writer_get_header(MbBiWriter *biw, void *userdata,
                               MbBiHeader *header)
 {
@@ -133,6 +179,27 @@ int android_writer_write_header(MbBiWriter *biw, void *userdata,
     // the user reattempts to call it)
     _segment_writer_entries_clear(&ctx->segctx);
 
+    if (ctx->streaming && !ctx->spool) {
+        ctx->spool = new(std::nothrow) mb::MemoryFile(&ctx->spool_buf,
+                                                      &ctx->spool_size);
+        if (!ctx->spool || !ctx->spool->is_open()) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                                   "Failed to create in-memory spool file");
+            delete ctx->spool;
+            ctx->spool = nullptr;
+            return MB_BI_FAILED;
+        }
+    }
+
+    if (ctx->parallel_hash && !ctx->sha_pipeline) {
+        ctx->sha_pipeline = new(std::nothrow) Sha1Pipeline(&ctx->sha_ctx);
+        if (!ctx->sha_pipeline) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                                   "Failed to start SHA1 hashing thread");
+            return MB_BI_FAILED;
+        }
+    }
+
     ret = _segment_writer_entries_add(&ctx->segctx, MB_BI_ENTRY_KERNEL,
                                       0, false, ctx->hdr.page_size, biw);
     if (ret != MB_BI_OK) return ret;
@@ -149,12 +216,14 @@ int android_writer_write_header(MbBiWriter *biw, void *userdata,
                                       0, false, ctx->hdr.page_size, biw);
     if (ret != MB_BI_OK) return ret;
 
+    mb::File *file = output_file(biw, ctx);
+
     // Start writing after first page
-    if (!biw->file->seek(ctx->hdr.page_size, SEEK_SET, nullptr)) {
-        mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+    if (!file->seek(ctx->hdr.page_size, SEEK_SET, nullptr)) {
+        mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                "Failed to seek to first page: %s",
-                               biw->file->error_string().c_str());
-        return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
     }
 
     return MB_BI_OK;
@@ -165,7 +234,8 @@ int android_writer_get_entry(MbBiWriter *biw, void *userdata,
 {
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
 
-    return _segment_writer_get_entry(&ctx->segctx, biw->file, entry, biw);
+    return _segment_writer_get_entry(&ctx->segctx, output_file(biw, ctx),
+                                     entry, biw);
 }
 
 int android_writer_write_entry(MbBiWriter *biw, void *userdata,
@@ -173,7 +243,8 @@ int android_writer_write_entry(MbBiWriter *biw, void *userdata,
 {
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
 
-    return _segment_writer_write_entry(&ctx->segctx, biw->file, entry, biw);
+    return _segment_writer_write_entry(&ctx->segctx, output_file(biw, ctx),
+                                       entry, biw);
 }
 
 int android_writer_write_data(MbBiWriter *biw, void *userdata,
@@ -183,15 +254,15 @@ int android_writer_write_data(MbBiWriter *biw, void *userdata,
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
     int ret;
 
-    ret = _segment_writer_write_data(&ctx->segctx, biw->file, buf, buf_size,
-                                     bytes_written, biw);
+    ret = _segment_writer_write_data(&ctx->segctx, output_file(biw, ctx),
+                                     buf, buf_size, bytes_written, biw);
     if (ret != MB_BI_OK) {
         return ret;
     }
 
     // We always include the image in the hash. The size is sometimes included
     // and is handled in android_writer_finish_entry().
-    if (!SHA1_Update(&ctx->sha_ctx, buf, buf_size)) {
+    if (!update_sha1(ctx, buf, buf_size)) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Failed to update SHA1 hash");
         // This must be fatal as the write already happened and cannot be
@@ -208,7 +279,8 @@ int android_writer_finish_entry(MbBiWriter *biw, void *userdata)
     SegmentWriterEntry *swentry;
     int ret;
 
-    ret = _segment_writer_finish_entry(&ctx->segctx, biw->file, biw);
+    ret = _segment_writer_finish_entry(&ctx->segctx, output_file(biw, ctx),
+                                       biw);
     if (ret != MB_BI_OK) {
         return ret;
     }
@@ -220,7 +292,7 @@ int android_writer_finish_entry(MbBiWriter *biw, void *userdata)
 
     // Include size for everything except empty DT images
     if ((swentry->type != MB_BI_ENTRY_DEVICE_TREE || swentry->size > 0)
-            && !SHA1_Update(&ctx->sha_ctx, &le32_size, sizeof(le32_size))) {
+            && !update_sha1(ctx, &le32_size, sizeof(le32_size))) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Failed to update SHA1 hash");
         return MB_BI_FATAL;
@@ -248,21 +320,22 @@ int android_writer_close(MbBiWriter *biw, void *userdata)
 {
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
     SegmentWriterEntry *swentry;
+    mb::File *file = output_file(biw, ctx);
     size_t n;
 
     if (ctx->have_file_size) {
-        if (!biw->file->seek(ctx->file_size, SEEK_SET, nullptr)) {
-            mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+        if (!file->seek(ctx->file_size, SEEK_SET, nullptr)) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                    "Failed to seek to end of file: %s",
-                                   biw->file->error_string().c_str());
-            return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
         }
     } else {
-        if (!biw->file->seek(0, SEEK_CUR, &ctx->file_size)) {
-            mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+        if (!file->seek(0, SEEK_CUR, &ctx->file_size)) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                    "Failed to get file offset: %s",
-                                   biw->file->error_string().c_str());
-            return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
         }
 
         ctx->have_file_size = true;
@@ -275,28 +348,29 @@ int android_writer_close(MbBiWriter *biw, void *userdata)
         // Write bump magic if we're outputting a bump'd image. Otherwise, write
         // the Samsung SEAndroid magic.
         if (ctx->is_bump) {
-            if (!mb::file_write_fully(*biw->file, BUMP_MAGIC,
+            if (!mb::file_write_fully(*file, BUMP_MAGIC,
                                       BUMP_MAGIC_SIZE, n)
                     || n != BUMP_MAGIC_SIZE) {
-                mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+                mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                        "Failed to write Bump magic: %s",
-                                       biw->file->error_string().c_str());
-                return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                       file->error_string().c_str());
+                return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
             }
         } else {
-            if (!mb::file_write_fully(*biw->file, SAMSUNG_SEANDROID_MAGIC,
+            if (!mb::file_write_fully(*file, SAMSUNG_SEANDROID_MAGIC,
                                       SAMSUNG_SEANDROID_MAGIC_SIZE, n)
                     || n != SAMSUNG_SEANDROID_MAGIC_SIZE) {
-                mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+                mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                        "Failed to write SEAndroid magic: %s",
-                                       biw->file->error_string().c_str());
-                return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                       file->error_string().c_str());
+                return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
             }
         }
 
         // Set ID
         unsigned char digest[SHA_DIGEST_LENGTH];
-        if (!SHA1_Final(digest, &ctx->sha_ctx)) {
+        if ((ctx->sha_pipeline && !ctx->sha_pipeline->finish())
+                || !SHA1_Final(digest, &ctx->sha_ctx)) {
             mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                    "Failed to update SHA1 hash");
             return MB_BI_FATAL;
@@ -308,20 +382,32 @@ int android_writer_close(MbBiWriter *biw, void *userdata)
         android_fix_header_byte_order(&hdr);
 
         // Seek back to beginning to write header
-        if (!biw->file->seek(0, SEEK_SET, nullptr)) {
-            mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+        if (!file->seek(0, SEEK_SET, nullptr)) {
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                    "Failed to seek to beginning: %s",
-                                   biw->file->error_string().c_str());
-            return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
         }
 
         // Write header
-        if (!mb::file_write_fully(*biw->file, &hdr, sizeof(hdr), n)
+        if (!mb::file_write_fully(*file, &hdr, sizeof(hdr), n)
                 || n != sizeof(hdr)) {
-            mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+            mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
                                    "Failed to write header: %s",
-                                   biw->file->error_string().c_str());
-            return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+                                   file->error_string().c_str());
+            return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        }
+
+        // Stream the assembled image to the output file
+        if (ctx->spool) {
+            if (!mb::file_write_fully(*biw->file, ctx->spool_buf,
+                                      ctx->spool_size, n)
+                    || n != ctx->spool_size) {
+                mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+                                       "Failed to write boot image: %s",
+                                       biw->file->error_string().c_str());
+                return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+            }
         }
     }
 
@@ -333,6 +419,9 @@ int android_writer_free(MbBiWriter *bir, void *userdata)
     (void) bir;
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(userdata);
     _segment_writer_deinit(&ctx->segctx);
+    delete ctx->sha_pipeline;
+    delete ctx->spool;
+    free(ctx->spool_buf);
     free(ctx);
     return MB_BI_OK;
 }
@@ -340,6 +429,14 @@ int android_writer_free(MbBiWriter *bir, void *userdata)
 /*!
  * \brief Set Android boot image output format
  *
+ * If the `streaming` option is enabled with mb_bi_writer_set_option(), the
+ * image is assembled in memory and written out sequentially when the writer is
+ * closed. This allows writing to files that do not support seeking, such as
+ * pipes.
+ *
+ * If the `parallel_hash` option is enabled, the SHA1 hash used for the header's
+ * ID is computed on a separate thread while the entries are being written.
+ *
  * \param biw MbBiWriter
  *
  * \return
@@ -349,29 +446,16 @@ int android_writer_free(MbBiWriter *bir, void *userdata)
  */
 int mb_bi_writer_set_format_android(MbBiWriter *biw)
 {
-    AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(
-            calloc(1, sizeof(AndroidWriterCtx)));
+    void *ctx = mb::bootimg::AndroidFormat::writer_new(biw);
     if (!ctx) {
-        mb_bi_writer_set_error(biw, -errno,
-                               "Failed to allocate AndroidWriterCtx: %s",
-                               strerror(errno));
         return MB_BI_FAILED;
     }
 
-    if (!SHA1_Init(&ctx->sha_ctx)) {
-        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
-                               "Failed to initialize SHA_CTX");
-        free(ctx);
-        return false;
-    }
-
-    _segment_writer_init(&ctx->segctx);
-
     return _mb_bi_writer_register_format(biw,
                                          ctx,
                                          MB_BI_FORMAT_ANDROID,
                                          MB_BI_FORMAT_NAME_ANDROID,
-                                         nullptr,
+                                         &android_writer_set_option,
                                          &android_writer_get_header,
                                          &android_writer_write_header,
                                          &android_writer_get_entry,
@@ -383,3 +467,86 @@ int mb_bi_writer_set_format_android(MbBiWriter *biw)
 }
 
 MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+void * AndroidFormat::writer_new(MbBiWriter *biw)
+{
+    AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(
+            calloc(1, sizeof(AndroidWriterCtx)));
+    if (!ctx) {
+        mb_bi_writer_set_error(biw, -errno,
+                               "Failed to allocate AndroidWriterCtx: %s",
+                               strerror(errno));
+        return nullptr;
+    }
+
+    if (!SHA1_Init(&ctx->sha_ctx)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to initialize SHA_CTX");
+        free(ctx);
+        return nullptr;
+    }
+
+    _segment_writer_init(&ctx->segctx);
+
+    return ctx;
+}
+
+int AndroidFormat::writer_free(MbBiWriter *biw, void *ctx)
+{
+    return android_writer_free(biw, ctx);
+}
+
+int AndroidFormat::writer_set_option(MbBiWriter *biw, void *ctx,
+                                     const char *key, const char *value)
+{
+    return android_writer_set_option(biw, ctx, key, value);
+}
+
+int AndroidFormat::writer_get_header(MbBiWriter *biw, void *ctx,
+                                     MbBiHeader *header)
+{
+    return android_writer_get_header(biw, ctx, header);
+}
+
+int AndroidFormat::writer_write_header(MbBiWriter *biw, void *ctx,
+                                       MbBiHeader *header)
+{
+    return android_writer_write_header(biw, ctx, header);
+}
+
+int AndroidFormat::writer_get_entry(MbBiWriter *biw, void *ctx,
+                                    MbBiEntry *entry)
+{
+    return android_writer_get_entry(biw, ctx, entry);
+}
+
+int AndroidFormat::writer_write_entry(MbBiWriter *biw, void *ctx,
+                                      MbBiEntry *entry)
+{
+    return android_writer_write_entry(biw, ctx, entry);
+}
+
+int AndroidFormat::writer_write_data(MbBiWriter *biw, void *ctx,
+                                     const void *buf, size_t buf_size,
+                                     size_t &bytes_written)
+{
+    return android_writer_write_data(biw, ctx, buf, buf_size, bytes_written);
+}
+
+int AndroidFormat::writer_finish_entry(MbBiWriter *biw, void *ctx)
+{
+    return android_writer_finish_entry(biw, ctx);
+}
+
+int AndroidFormat::writer_close(MbBiWriter *biw, void *ctx)
+{
+    return android_writer_close(biw, ctx);
+}
+
+}
+}
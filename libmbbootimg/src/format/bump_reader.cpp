@@ -23,6 +23,7 @@
 #include <cstdlib>
 #include <cstring>
 
+#include "mbbootimg/format_tags.h"
 #include "mbbootimg/reader_p.h"
 
 MB_BEGIN_C_DECLS
@@ -39,19 +40,11 @@ MB_BEGIN_C_DECLS
  */
 int mb_bi_reader_enable_format_bump(MbBiReader *bir)
 {
-    AndroidReaderCtx *const ctx = static_cast<AndroidReaderCtx *>(
-            calloc(1, sizeof(AndroidReaderCtx)));
+    void *ctx = mb::bootimg::BumpFormat::reader_new(bir);
     if (!ctx) {
-        mb_bi_reader_set_error(bir, -errno,
-                               "Failed to allocate AndroidReaderCtx: %s",
-                               strerror(errno));
         return MB_BI_FAILED;
     }
 
-    _segment_reader_init(&ctx->segctx);
-
-    ctx->is_bump = true;
-
     return _mb_bi_reader_register_format(bir,
                                          ctx,
                                          MB_BI_FORMAT_BUMP,
@@ -62,7 +55,76 @@ int mb_bi_reader_enable_format_bump(MbBiReader *bir)
                                          &android_reader_read_entry,
                                          &android_reader_go_to_entry,
                                          &android_reader_read_data,
+                                         &android_reader_read_data_view,
                                          &android_reader_free);
 }
 
 MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+void * BumpFormat::reader_new(MbBiReader *bir)
+{
+    AndroidReaderCtx *const ctx = static_cast<AndroidReaderCtx *>(
+            calloc(1, sizeof(AndroidReaderCtx)));
+    if (!ctx) {
+        mb_bi_reader_set_error(bir, -errno,
+                               "Failed to allocate AndroidReaderCtx: %s",
+                               strerror(errno));
+        return nullptr;
+    }
+
+    _segment_reader_init(&ctx->segctx);
+
+    ctx->is_bump = true;
+
+    return ctx;
+}
+
+int BumpFormat::reader_free(MbBiReader *bir, void *ctx)
+{
+    return android_reader_free(bir, ctx);
+}
+
+int BumpFormat::reader_bid(MbBiReader *bir, void *ctx, int best_bid)
+{
+    return bump_reader_bid(bir, ctx, best_bid);
+}
+
+int BumpFormat::reader_read_header(MbBiReader *bir, void *ctx,
+                                   MbBiHeader *header)
+{
+    return android_reader_read_header(bir, ctx, header);
+}
+
+int BumpFormat::reader_read_entry(MbBiReader *bir, void *ctx,
+                                  MbBiEntry *entry)
+{
+    return android_reader_read_entry(bir, ctx, entry);
+}
+
+int BumpFormat::reader_go_to_entry(MbBiReader *bir, void *ctx,
+                                   MbBiEntry *entry, int entry_type)
+{
+    return android_reader_go_to_entry(bir, ctx, entry, entry_type);
+}
+
+int BumpFormat::reader_read_data(MbBiReader *bir, void *ctx,
+                                 void *buf, size_t buf_size,
+                                 size_t &bytes_read)
+{
+    return android_reader_read_data(bir, ctx, buf, buf_size, bytes_read);
+}
+
+int BumpFormat::reader_read_data_view(MbBiReader *bir, void *ctx,
+                                      const void *&data,
+                                      size_t &data_size)
+{
+    return android_reader_read_data_view(bir, ctx, data, data_size);
+}
+
+}
+}
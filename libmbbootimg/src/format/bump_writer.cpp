@@ -23,6 +23,7 @@
 #include <cstdlib>
 #include <cstring>
 
+#include "mbbootimg/format_tags.h"
 #include "mbbootimg/writer_p.h"
 
 MB_BEGIN_C_DECLS
@@ -38,6 +39,36 @@ MB_BEGIN_C_DECLS
  *   * \<= #MB_BI_FAILED if an error occurs
  */
 int mb_bi_writer_set_format_bump(MbBiWriter *biw)
+{
+    void *ctx = mb::bootimg::BumpFormat::writer_new(biw);
+    if (!ctx) {
+        return MB_BI_FAILED;
+    }
+
+    return _mb_bi_writer_register_format(biw,
+                                         ctx,
+                                         MB_BI_FORMAT_BUMP,
+                                         MB_BI_FORMAT_NAME_BUMP,
+                                         &android_writer_set_option,
+                                         &android_writer_get_header,
+                                         &android_writer_write_header,
+                                         &android_writer_get_entry,
+                                         &android_writer_write_entry,
+                                         &android_writer_write_data,
+                                         &android_writer_finish_entry,
+                                         &android_writer_close,
+                                         &android_writer_free);
+}
+
+
+MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+void * BumpFormat::writer_new(MbBiWriter *biw)
 {
     AndroidWriterCtx *const ctx = static_cast<AndroidWriterCtx *>(
             calloc(1, sizeof(AndroidWriterCtx)));
@@ -45,34 +76,74 @@ int mb_bi_writer_set_format_bump(MbBiWriter *biw)
         mb_bi_writer_set_error(biw, -errno,
                                "Failed to allocate AndroidWriterCtx: %s",
                                strerror(errno));
-        return MB_BI_FAILED;
+        return nullptr;
     }
 
     if (!SHA1_Init(&ctx->sha_ctx)) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Failed to initialize SHA_CTX");
         free(ctx);
-        return false;
+        return nullptr;
     }
 
     _segment_writer_init(&ctx->segctx);
 
     ctx->is_bump = true;
 
-    return _mb_bi_writer_register_format(biw,
-                                         ctx,
-                                         MB_BI_FORMAT_BUMP,
-                                         MB_BI_FORMAT_NAME_BUMP,
-                                         nullptr,
-                                         &android_writer_get_header,
-                                         &android_writer_write_header,
-                                         &android_writer_get_entry,
-                                         &android_writer_write_entry,
-                                         &android_writer_write_data,
-                                         &android_writer_finish_entry,
-                                         &android_writer_close,
-                                         &android_writer_free);
+    return ctx;
 }
 
+int BumpFormat::writer_free(MbBiWriter *biw, void *ctx)
+{
+    return android_writer_free(biw, ctx);
+}
 
-MB_END_C_DECLS
+int BumpFormat::writer_set_option(MbBiWriter *biw, void *ctx,
+                                  const char *key, const char *value)
+{
+    return android_writer_set_option(biw, ctx, key, value);
+}
+
+int BumpFormat::writer_get_header(MbBiWriter *biw, void *ctx,
+                                  MbBiHeader *header)
+{
+    return android_writer_get_header(biw, ctx, header);
+}
+
+int BumpFormat::writer_write_header(MbBiWriter *biw, void *ctx,
+                                    MbBiHeader *header)
+{
+    return android_writer_write_header(biw, ctx, header);
+}
+
+int BumpFormat::writer_get_entry(MbBiWriter *biw, void *ctx,
+                                 MbBiEntry *entry)
+{
+    return android_writer_get_entry(biw, ctx, entry);
+}
+
+int BumpFormat::writer_write_entry(MbBiWriter *biw, void *ctx,
+                                   MbBiEntry *entry)
+{
+    return android_writer_write_entry(biw, ctx, entry);
+}
+
+int BumpFormat::writer_write_data(MbBiWriter *biw, void *ctx,
+                                  const void *buf, size_t buf_size,
+                                  size_t &bytes_written)
+{
+    return android_writer_write_data(biw, ctx, buf, buf_size, bytes_written);
+}
+
+int BumpFormat::writer_finish_entry(MbBiWriter *biw, void *ctx)
+{
+    return android_writer_finish_entry(biw, ctx);
+}
+
+int BumpFormat::writer_close(MbBiWriter *biw, void *ctx)
+{
+    return android_writer_close(biw, ctx);
+}
+
+}
+}
@@ -34,6 +34,7 @@
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/align_p.h"
 #include "mbbootimg/format/android_reader_p.h"
+#include "mbbootimg/format_tags.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/reader.h"
 #include "mbbootimg/reader_p.h"
@@ -69,14 +70,8 @@ int find_loki_header(MbBiReader *bir, mb::File *file,
     LokiHeader header;
     size_t n;
 
-    if (!file->seek(LOKI_MAGIC_OFFSET, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Loki magic not found: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_WARN;
-    }
-
-    if (!mb::file_read_fully(*file, &header, sizeof(header), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, LOKI_MAGIC_OFFSET,
+                               &header, sizeof(header), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read header: %s",
                                file->error_string().c_str());
@@ -194,6 +189,31 @@ int loki_find_ramdisk_address(MbBiReader *bir, mb::File *file,
     return MB_BI_OK;
 }
 
+/*!
+ * \brief Check whether a 10-byte gzip member header looks like a ramdisk
+ *
+ * Besides the magic and compression method, the header must have:
+ *
+ *   * A flags byte of `0x00` or `0x08` (FNAME)
+ *   * A modification time that is either unset or fits in a signed 32-bit
+ *     `time_t` (the clock on the device cannot be trusted for a better bound)
+ *   * An extra flags byte of `0x00`, `0x02`, or `0x04`
+ *   * A known operating system byte (`0x00`-`0x0d` or `0xff`)
+ */
+static bool loki_is_ramdisk_gzip_header(const unsigned char *hdr)
+{
+    uint32_t mtime = static_cast<uint32_t>(hdr[4])
+            | static_cast<uint32_t>(hdr[5]) << 8
+            | static_cast<uint32_t>(hdr[6]) << 16
+            | static_cast<uint32_t>(hdr[7]) << 24;
+
+    return hdr[0] == 0x1f && hdr[1] == 0x8b && hdr[2] == 0x08
+            && (hdr[3] == 0x00 || hdr[3] == 0x08)
+            && mtime <= INT32_MAX
+            && (hdr[8] == 0x00 || hdr[8] == 0x02 || hdr[8] == 0x04)
+            && (hdr[9] <= 0x0d || hdr[9] == 0xff);
+}
+
 /*!
  * \brief Find gzip ramdisk offset in old-style Loki image
  *
@@ -203,6 +223,12 @@ int loki_find_ramdisk_address(MbBiReader *bir, mb::File *file,
  * as it indiciates that the original filename field is set. This is usually the
  * case for ramdisks packed via the `gzip` command line tool.
  *
+ * The magic and flags byte are matched by the search itself. Only those
+ * matches have the rest of the gzip member header validated (see
+ * loki_is_ramdisk_gzip_header()) with a single positional read, so random
+ * matches in compressed or padding data are discarded cheaply. The search stops
+ * as soon as a valid header with the `0x08` flag is found.
+ *
  * \pre The file position can be at any offset prior to calling this function.
  *
  * \post The file pointer position is undefined after this function returns.
@@ -238,59 +264,59 @@ int loki_old_find_gzip_offset(MbBiReader *bir, mb::File *file,
     // byte 8   : compression flags
     // byte 9   : operating system
 
-    static const unsigned char gzip_deflate_magic[] = { 0x1f, 0x8b, 0x08 };
+    // Search for both flag values at once instead of reading the flags byte
+    // of every gzip magic match
+    static const unsigned char gzip_flag0_magic[] = { 0x1f, 0x8b, 0x08, 0x00 };
+    static const unsigned char gzip_flag8_magic[] = { 0x1f, 0x8b, 0x08, 0x08 };
+    static const void * const patterns[] = {
+        gzip_flag0_magic,
+        gzip_flag8_magic,
+    };
+    static const size_t pattern_sizes[] = {
+        sizeof(gzip_flag0_magic),
+        sizeof(gzip_flag8_magic),
+    };
 
     SearchResult result = {};
 
-    // Find first result with flags == 0x00 and flags == 0x08
-    auto result_cb = [](mb::File &file, void *userdata, uint64_t offset)
-            -> mb::FileSearchAction {
+    // Validate the rest of the header of each match and keep the first valid
+    // header for both flags
+    auto result_cb = [](mb::File &file, void *userdata, size_t pattern_index,
+                        uint64_t offset) -> mb::FileSearchAction {
         SearchResult *result = static_cast<SearchResult *>(userdata);
-        uint64_t orig_offset;
-        unsigned char flags;
+        unsigned char hdr[10];
         size_t n;
 
-        // Stop early if possible
-        if (result->have_flag0 && result->have_flag8) {
-            return mb::FileSearchAction::Stop;
-        }
-
-        // Save original position
-        if (!file.seek(0, SEEK_CUR, &orig_offset)) {
-            return mb::FileSearchAction::Fail;
+        if (pattern_index == 0 && result->have_flag0) {
+            // Only a flag-8 header can still change the result
+            return mb::FileSearchAction::Continue;
         }
 
-        // Seek to flags byte
-        if (!file.seek(offset + 3, SEEK_SET, nullptr)) {
+        // Positional read, so the search's file position is left alone
+        if (!file.read_at(offset, hdr, sizeof(hdr), n)) {
             return mb::FileSearchAction::Fail;
         }
 
-        // Read next bytes for flags
-        if (!mb::file_read_fully(file, &flags, sizeof(flags), n)) {
-            return mb::FileSearchAction::Fail;
-        } else if (n != sizeof(flags)) {
-            // EOF
-            return mb::FileSearchAction::Stop;
+        if (n != sizeof(hdr) || !loki_is_ramdisk_gzip_header(hdr)) {
+            return mb::FileSearchAction::Continue;
         }
 
-        if (!result->have_flag0 && flags == 0x00) {
-            result->have_flag0 = true;
-            result->flag0_offset = offset;
-        } else if (!result->have_flag8 && flags == 0x08) {
+        if (pattern_index == 1) {
             result->have_flag8 = true;
             result->flag8_offset = offset;
-        }
 
-        // Restore original position as per contract
-        if (!file.seek(orig_offset, SEEK_SET, nullptr)) {
-            return mb::FileSearchAction::Fail;
+            // Takes precedence over any header with flags == 0x00
+            return mb::FileSearchAction::Stop;
+        } else {
+            result->have_flag0 = true;
+            result->flag0_offset = offset;
         }
 
         return mb::FileSearchAction::Continue;
     };
 
-    if (!mb::file_search(*file, start_offset, -1, 0, gzip_deflate_magic,
-                         sizeof(gzip_deflate_magic), -1, result_cb, &result)) {
+    if (!mb::file_search_multi(*file, start_offset, -1, 0, patterns,
+                               pattern_sizes, 2, -1, result_cb, &result)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to search for gzip magic: %s",
                                file->error_string().c_str());
@@ -863,6 +889,15 @@ int loki_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int loki_reader_read_data_view(MbBiReader *bir, void *userdata,
+                               const void *&data, size_t &data_size)
+{
+    LokiReaderCtx *const ctx = static_cast<LokiReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, data,
+                                          data_size, bir);
+}
+
 int loki_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -884,17 +919,11 @@ int loki_reader_free(MbBiReader *bir, void *userdata)
  */
 int mb_bi_reader_enable_format_loki(MbBiReader *bir)
 {
-    LokiReaderCtx *const ctx = static_cast<LokiReaderCtx *>(
-            calloc(1, sizeof(LokiReaderCtx)));
+    void *ctx = mb::bootimg::LokiFormat::reader_new(bir);
     if (!ctx) {
-        mb_bi_reader_set_error(bir, -errno,
-                               "Failed to allocate LokiReaderCtx: %s",
-                               strerror(errno));
         return MB_BI_FAILED;
     }
 
-    _segment_reader_init(&ctx->segctx);
-
     return _mb_bi_reader_register_format(bir,
                                          ctx,
                                          MB_BI_FORMAT_LOKI,
@@ -905,7 +934,74 @@ int mb_bi_reader_enable_format_loki(MbBiReader *bir)
                                          &loki_reader_read_entry,
                                          &loki_reader_go_to_entry,
                                          &loki_reader_read_data,
+                                         &loki_reader_read_data_view,
                                          &loki_reader_free);
 }
 
 MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+void * LokiFormat::reader_new(MbBiReader *bir)
+{
+    LokiReaderCtx *const ctx = static_cast<LokiReaderCtx *>(
+            calloc(1, sizeof(LokiReaderCtx)));
+    if (!ctx) {
+        mb_bi_reader_set_error(bir, -errno,
+                               "Failed to allocate LokiReaderCtx: %s",
+                               strerror(errno));
+        return nullptr;
+    }
+
+    _segment_reader_init(&ctx->segctx);
+
+    return ctx;
+}
+
+int LokiFormat::reader_free(MbBiReader *bir, void *ctx)
+{
+    return loki_reader_free(bir, ctx);
+}
+
+int LokiFormat::reader_bid(MbBiReader *bir, void *ctx, int best_bid)
+{
+    return loki_reader_bid(bir, ctx, best_bid);
+}
+
+int LokiFormat::reader_read_header(MbBiReader *bir, void *ctx,
+                                   MbBiHeader *header)
+{
+    return loki_reader_read_header(bir, ctx, header);
+}
+
+int LokiFormat::reader_read_entry(MbBiReader *bir, void *ctx,
+                                  MbBiEntry *entry)
+{
+    return loki_reader_read_entry(bir, ctx, entry);
+}
+
+int LokiFormat::reader_go_to_entry(MbBiReader *bir, void *ctx,
+                                   MbBiEntry *entry, int entry_type)
+{
+    return loki_reader_go_to_entry(bir, ctx, entry, entry_type);
+}
+
+int LokiFormat::reader_read_data(MbBiReader *bir, void *ctx,
+                                 void *buf, size_t buf_size,
+                                 size_t &bytes_read)
+{
+    return loki_reader_read_data(bir, ctx, buf, buf_size, bytes_read);
+}
+
+int LokiFormat::reader_read_data_view(MbBiReader *bir, void *ctx,
+                                      const void *&data,
+                                      size_t &data_size)
+{
+    return loki_reader_read_data_view(bir, ctx, data, data_size);
+}
+
+}
+}
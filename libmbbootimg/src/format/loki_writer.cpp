@@ -20,6 +20,7 @@
 #include "mbbootimg/format/loki_writer_p.h"
 
 #include <algorithm>
+#include <new>
 
 #include <cerrno>
 #include <cinttypes>
@@ -37,6 +38,7 @@
 #include "mbbootimg/format/align_p.h"
 #include "mbbootimg/format/loki_defs.h"
 #include "mbbootimg/format/loki_p.h"
+#include "mbbootimg/format_tags.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/writer.h"
 #include "mbbootimg/writer_p.h"
@@ -46,6 +48,33 @@
 
 MB_BEGIN_C_DECLS
 
+static bool update_sha1(LokiWriterCtx *ctx, const void *data, size_t size)
+{
+    if (ctx->sha_pipeline) {
+        return ctx->sha_pipeline->update(data, size);
+    } else {
+        return SHA1_Update(&ctx->sha_ctx, data, size);
+    }
+}
+
+int loki_writer_set_option(MbBiWriter *biw, void *userdata,
+                           const char *key, const char *value)
+{
+    (void) biw;
+
+    LokiWriterCtx *const ctx = static_cast<LokiWriterCtx *>(userdata);
+
+    if (strcmp(key, "parallel_hash") == 0) {
+        ctx->parallel_hash = strcasecmp(value, "true") == 0
+                || strcasecmp(value, "yes") == 0
+                || strcasecmp(value, "y") == 0
+                || strcmp(value, "1") == 0;
+        return MB_BI_OK;
+    } else {
+        return MB_BI_WARN;
+    }
+}
+
 int loki_writer_get_header(MbBiWriter *biw, void *userdata,
                            MbBiHeader *header)
 {
@@ -152,6 +181,15 @@ int loki_writer_write_header(MbBiWriter *biw, void *userdata,
                                       0, true, 0, biw);
     if (ret != MB_BI_OK) return ret;
 
+    if (ctx->parallel_hash && !ctx->sha_pipeline) {
+        ctx->sha_pipeline = new(std::nothrow) Sha1Pipeline(&ctx->sha_ctx);
+        if (!ctx->sha_pipeline) {
+            mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                                   "Failed to start SHA1 hashing thread");
+            return MB_BI_FAILED;
+        }
+    }
+
     // Start writing after first page
     if (!biw->file->seek(ctx->hdr.page_size, SEEK_SET, nullptr)) {
         mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
@@ -222,7 +260,7 @@ int loki_writer_write_data(MbBiWriter *biw, void *userdata,
 
         // We always include the image in the hash. The size is sometimes
         // included and is handled in loki_writer_finish_entry().
-        if (!SHA1_Update(&ctx->sha_ctx, buf, buf_size)) {
+        if (!update_sha1(ctx, buf, buf_size)) {
             mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                    "Failed to update SHA1 hash");
             // This must be fatal as the write already happened and cannot be
@@ -252,7 +290,7 @@ int loki_writer_finish_entry(MbBiWriter *biw, void *userdata)
 
     // Include fake 0 size for unsupported secondboot image
     if (swentry->type == MB_BI_ENTRY_DEVICE_TREE
-            && !SHA1_Update(&ctx->sha_ctx, "\x00\x00\x00\x00", 4)) {
+            && !update_sha1(ctx, "\x00\x00\x00\x00", 4)) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Failed to update SHA1 hash");
         return MB_BI_FATAL;
@@ -261,7 +299,7 @@ int loki_writer_finish_entry(MbBiWriter *biw, void *userdata)
     // Include size for everything except empty DT images
     if (swentry->type != MB_BI_ENTRY_ABOOT
             && (swentry->type != MB_BI_ENTRY_DEVICE_TREE || swentry->size > 0)
-            && !SHA1_Update(&ctx->sha_ctx, &le32_size, sizeof(le32_size))) {
+            && !update_sha1(ctx, &le32_size, sizeof(le32_size))) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Failed to update SHA1 hash");
         return MB_BI_FATAL;
@@ -321,7 +359,8 @@ int loki_writer_close(MbBiWriter *biw, void *userdata)
 
         // Set ID
         unsigned char digest[SHA_DIGEST_LENGTH];
-        if (!SHA1_Final(digest, &ctx->sha_ctx)) {
+        if ((ctx->sha_pipeline && !ctx->sha_pipeline->finish())
+                || !SHA1_Final(digest, &ctx->sha_ctx)) {
             mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                    "Failed to update SHA1 hash");
             return MB_BI_FATAL;
@@ -364,6 +403,7 @@ int loki_writer_free(MbBiWriter *bir, void *userdata)
     (void) bir;
     LokiWriterCtx *const ctx = static_cast<LokiWriterCtx *>(userdata);
     _segment_writer_deinit(&ctx->segctx);
+    delete ctx->sha_pipeline;
     free(ctx->aboot);
     free(ctx);
     return MB_BI_OK;
@@ -372,6 +412,10 @@ int loki_writer_free(MbBiWriter *bir, void *userdata)
 /*!
  * \brief Set Loki boot image output format
  *
+ * If the `parallel_hash` option is enabled with mb_bi_writer_set_option(), the
+ * SHA1 hash used for the header's ID is computed on a separate thread while the
+ * entries are being written.
+ *
  * \param biw MbBiWriter
  *
  * \return
@@ -381,29 +425,16 @@ int loki_writer_free(MbBiWriter *bir, void *userdata)
  */
 int mb_bi_writer_set_format_loki(MbBiWriter *biw)
 {
-    LokiWriterCtx *const ctx = static_cast<LokiWriterCtx *>(
-            calloc(1, sizeof(LokiWriterCtx)));
+    void *ctx = mb::bootimg::LokiFormat::writer_new(biw);
     if (!ctx) {
-        mb_bi_writer_set_error(biw, -errno,
-                               "Failed to allocate LokiWriterCtx: %s",
-                               strerror(errno));
         return MB_BI_FAILED;
     }
 
-    if (!SHA1_Init(&ctx->sha_ctx)) {
-        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
-                               "Failed to initialize SHA_CTX");
-        free(ctx);
-        return false;
-    }
-
-    _segment_writer_init(&ctx->segctx);
-
     return _mb_bi_writer_register_format(biw,
                                          ctx,
                                          MB_BI_FORMAT_LOKI,
                                          MB_BI_FORMAT_NAME_LOKI,
-                                         nullptr,
+                                         &loki_writer_set_option,
                                          &loki_writer_get_header,
                                          &loki_writer_write_header,
                                          &loki_writer_get_entry,
@@ -415,3 +446,86 @@ int mb_bi_writer_set_format_loki(MbBiWriter *biw)
 }
 
 MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+void * LokiFormat::writer_new(MbBiWriter *biw)
+{
+    LokiWriterCtx *const ctx = static_cast<LokiWriterCtx *>(
+            calloc(1, sizeof(LokiWriterCtx)));
+    if (!ctx) {
+        mb_bi_writer_set_error(biw, -errno,
+                               "Failed to allocate LokiWriterCtx: %s",
+                               strerror(errno));
+        return nullptr;
+    }
+
+    if (!SHA1_Init(&ctx->sha_ctx)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to initialize SHA_CTX");
+        free(ctx);
+        return nullptr;
+    }
+
+    _segment_writer_init(&ctx->segctx);
+
+    return ctx;
+}
+
+int LokiFormat::writer_free(MbBiWriter *biw, void *ctx)
+{
+    return loki_writer_free(biw, ctx);
+}
+
+int LokiFormat::writer_set_option(MbBiWriter *biw, void *ctx,
+                                  const char *key, const char *value)
+{
+    return loki_writer_set_option(biw, ctx, key, value);
+}
+
+int LokiFormat::writer_get_header(MbBiWriter *biw, void *ctx,
+                                  MbBiHeader *header)
+{
+    return loki_writer_get_header(biw, ctx, header);
+}
+
+int LokiFormat::writer_write_header(MbBiWriter *biw, void *ctx,
+                                    MbBiHeader *header)
+{
+    return loki_writer_write_header(biw, ctx, header);
+}
+
+int LokiFormat::writer_get_entry(MbBiWriter *biw, void *ctx,
+                                 MbBiEntry *entry)
+{
+    return loki_writer_get_entry(biw, ctx, entry);
+}
+
+int LokiFormat::writer_write_entry(MbBiWriter *biw, void *ctx,
+                                   MbBiEntry *entry)
+{
+    return loki_writer_write_entry(biw, ctx, entry);
+}
+
+int LokiFormat::writer_write_data(MbBiWriter *biw, void *ctx,
+                                  const void *buf, size_t buf_size,
+                                  size_t &bytes_written)
+{
+    return loki_writer_write_data(biw, ctx, buf, buf_size, bytes_written);
+}
+
+int LokiFormat::writer_finish_entry(MbBiWriter *biw, void *ctx)
+{
+    return loki_writer_finish_entry(biw, ctx);
+}
+
+int LokiFormat::writer_close(MbBiWriter *biw, void *ctx)
+{
+    return loki_writer_close(biw, ctx);
+}
+
+}
+}
@@ -35,6 +35,7 @@
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/align_p.h"
 #include "mbbootimg/format/android_reader_p.h"
+#include "mbbootimg/format_tags.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/reader.h"
 #include "mbbootimg/reader_p.h"
@@ -67,14 +68,7 @@ int read_mtk_header(MbBiReader *bir, mb::File *file,
     MtkHeader mtkhdr;
     size_t n;
 
-    if (!file->seek(offset, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Failed to seek to MTK header at %" PRIu64 ": %s",
-                               offset, file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    if (!mb::file_read_fully(*file, &mtkhdr, sizeof(mtkhdr), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, offset, &mtkhdr, sizeof(mtkhdr), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read MTK header: %s",
                                file->error_string().c_str());
@@ -364,6 +358,15 @@ int mtk_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int mtk_reader_read_data_view(MbBiReader *bir, void *userdata,
+                              const void *&data, size_t &data_size)
+{
+    MtkReaderCtx *const ctx = static_cast<MtkReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, data,
+                                          data_size, bir);
+}
+
 int mtk_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -385,17 +388,11 @@ int mtk_reader_free(MbBiReader *bir, void *userdata)
  */
 int mb_bi_reader_enable_format_mtk(MbBiReader *bir)
 {
-    MtkReaderCtx *const ctx = static_cast<MtkReaderCtx *>(
-            calloc(1, sizeof(MtkReaderCtx)));
+    void *ctx = mb::bootimg::MtkFormat::reader_new(bir);
     if (!ctx) {
-        mb_bi_reader_set_error(bir, -errno,
-                               "Failed to allocate MtkReaderCtx: %s",
-                               strerror(errno));
         return MB_BI_FAILED;
     }
 
-    _segment_reader_init(&ctx->segctx);
-
     return _mb_bi_reader_register_format(bir,
                                          ctx,
                                          MB_BI_FORMAT_MTK,
@@ -406,7 +403,74 @@ int mb_bi_reader_enable_format_mtk(MbBiReader *bir)
                                          &mtk_reader_read_entry,
                                          &mtk_reader_go_to_entry,
                                          &mtk_reader_read_data,
+                                         &mtk_reader_read_data_view,
                                          &mtk_reader_free);
 }
 
 MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+void * MtkFormat::reader_new(MbBiReader *bir)
+{
+    MtkReaderCtx *const ctx = static_cast<MtkReaderCtx *>(
+            calloc(1, sizeof(MtkReaderCtx)));
+    if (!ctx) {
+        mb_bi_reader_set_error(bir, -errno,
+                               "Failed to allocate MtkReaderCtx: %s",
+                               strerror(errno));
+        return nullptr;
+    }
+
+    _segment_reader_init(&ctx->segctx);
+
+    return ctx;
+}
+
+int MtkFormat::reader_free(MbBiReader *bir, void *ctx)
+{
+    return mtk_reader_free(bir, ctx);
+}
+
+int MtkFormat::reader_bid(MbBiReader *bir, void *ctx, int best_bid)
+{
+    return mtk_reader_bid(bir, ctx, best_bid);
+}
+
+int MtkFormat::reader_read_header(MbBiReader *bir, void *ctx,
+                                  MbBiHeader *header)
+{
+    return mtk_reader_read_header(bir, ctx, header);
+}
+
+int MtkFormat::reader_read_entry(MbBiReader *bir, void *ctx,
+                                 MbBiEntry *entry)
+{
+    return mtk_reader_read_entry(bir, ctx, entry);
+}
+
+int MtkFormat::reader_go_to_entry(MbBiReader *bir, void *ctx,
+                                  MbBiEntry *entry, int entry_type)
+{
+    return mtk_reader_go_to_entry(bir, ctx, entry, entry_type);
+}
+
+int MtkFormat::reader_read_data(MbBiReader *bir, void *ctx,
+                                void *buf, size_t buf_size,
+                                size_t &bytes_read)
+{
+    return mtk_reader_read_data(bir, ctx, buf, buf_size, bytes_read);
+}
+
+int MtkFormat::reader_read_data_view(MbBiReader *bir, void *ctx,
+                                     const void *&data,
+                                     size_t &data_size)
+{
+    return mtk_reader_read_data_view(bir, ctx, data, data_size);
+}
+
+}
+}
@@ -34,6 +34,7 @@
 #include "mbcommon/string.h"
 
 #include "mbbootimg/entry.h"
+#include "mbbootimg/format_tags.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/writer.h"
 #include "mbbootimg/writer_p.h"
@@ -480,17 +481,11 @@ int mtk_writer_free(MbBiWriter *bir, void *userdata)
  */
 int mb_bi_writer_set_format_mtk(MbBiWriter *biw)
 {
-    MtkWriterCtx *const ctx = static_cast<MtkWriterCtx *>(
-            calloc(1, sizeof(MtkWriterCtx)));
+    void *ctx = mb::bootimg::MtkFormat::writer_new(biw);
     if (!ctx) {
-        mb_bi_writer_set_error(biw, -errno,
-                               "Failed to allocate MtkWriterCtx: %s",
-                               strerror(errno));
         return MB_BI_FAILED;
     }
 
-    _segment_writer_init(&ctx->segctx);
-
     return _mb_bi_writer_register_format(biw,
                                          ctx,
                                          MB_BI_FORMAT_MTK,
@@ -507,3 +502,85 @@ int mb_bi_writer_set_format_mtk(MbBiWriter *biw)
 }
 
 MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+void * MtkFormat::writer_new(MbBiWriter *biw)
+{
+    MtkWriterCtx *const ctx = static_cast<MtkWriterCtx *>(
+            calloc(1, sizeof(MtkWriterCtx)));
+    if (!ctx) {
+        mb_bi_writer_set_error(biw, -errno,
+                               "Failed to allocate MtkWriterCtx: %s",
+                               strerror(errno));
+        return nullptr;
+    }
+
+    _segment_writer_init(&ctx->segctx);
+
+    return ctx;
+}
+
+int MtkFormat::writer_free(MbBiWriter *biw, void *ctx)
+{
+    return mtk_writer_free(biw, ctx);
+}
+
+int MtkFormat::writer_set_option(MbBiWriter *biw, void *ctx,
+                                 const char *key, const char *value)
+{
+    (void) ctx;
+    (void) key;
+    (void) value;
+
+    mb_bi_writer_set_error(biw, MB_BI_ERROR_UNSUPPORTED,
+                           "Format does not support any options");
+    return MB_BI_WARN;
+}
+
+int MtkFormat::writer_get_header(MbBiWriter *biw, void *ctx,
+                                 MbBiHeader *header)
+{
+    return mtk_writer_get_header(biw, ctx, header);
+}
+
+int MtkFormat::writer_write_header(MbBiWriter *biw, void *ctx,
+                                   MbBiHeader *header)
+{
+    return mtk_writer_write_header(biw, ctx, header);
+}
+
+int MtkFormat::writer_get_entry(MbBiWriter *biw, void *ctx,
+                                MbBiEntry *entry)
+{
+    return mtk_writer_get_entry(biw, ctx, entry);
+}
+
+int MtkFormat::writer_write_entry(MbBiWriter *biw, void *ctx,
+                                  MbBiEntry *entry)
+{
+    return mtk_writer_write_entry(biw, ctx, entry);
+}
+
+int MtkFormat::writer_write_data(MbBiWriter *biw, void *ctx,
+                                 const void *buf, size_t buf_size,
+                                 size_t &bytes_written)
+{
+    return mtk_writer_write_data(biw, ctx, buf, buf_size, bytes_written);
+}
+
+int MtkFormat::writer_finish_entry(MbBiWriter *biw, void *ctx)
+{
+    return mtk_writer_finish_entry(biw, ctx);
+}
+
+int MtkFormat::writer_close(MbBiWriter *biw, void *ctx)
+{
+    return mtk_writer_close(biw, ctx);
+}
+
+}
+}
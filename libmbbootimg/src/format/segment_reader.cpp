@@ -23,8 +23,15 @@
 
 #include <cinttypes>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
+#if defined(__linux__) \
+        && (!defined(__ANDROID__) || __ANDROID_API__ >= 21)
+#  include <fcntl.h>
+#  define HAVE_POSIX_FADVISE
+#endif
+
 #include "mbcommon/file.h"
 #include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
@@ -36,13 +43,18 @@ int _segment_reader_init(SegmentReaderCtx *ctx)
     memset(ctx, 0, sizeof(*ctx));
 
     ctx->state = SegmentReaderState::BEGIN;
+    ctx->fd = -1;
 
     return MB_BI_OK;
 }
 
 int _segment_reader_deinit(SegmentReaderCtx *ctx)
 {
-    (void) ctx;
+    free(ctx->ra_buf);
+    ctx->ra_buf = nullptr;
+    ctx->ra_pos = 0;
+    ctx->ra_len = 0;
+
     return MB_BI_OK;
 }
 
@@ -133,6 +145,78 @@ SegmentReaderEntry * _segment_reader_find_entry(SegmentReaderCtx *ctx,
     return nullptr;
 }
 
+/*!
+ * \brief Hint to the kernel that an entry will be read soon
+ *
+ * This is best effort and does nothing if the file does not expose a file
+ * descriptor.
+ */
+static void advise_will_need(SegmentReaderCtx *ctx, mb::File *file,
+                             const SegmentReaderEntry *srentry)
+{
+#ifdef HAVE_POSIX_FADVISE
+    if (!ctx->fd_checked) {
+        ctx->fd_checked = true;
+        if (!file->native_fd(ctx->fd)) {
+            ctx->fd = -1;
+        }
+    }
+
+    if (ctx->fd >= 0 && srentry->size > 0) {
+        posix_fadvise(ctx->fd, static_cast<off_t>(srentry->offset),
+                      static_cast<off_t>(srentry->size), POSIX_FADV_WILLNEED);
+    }
+#else
+    (void) ctx;
+    (void) file;
+    (void) srentry;
+#endif
+}
+
+static int read_file(mb::File *file, void *buf, size_t size,
+                     size_t &bytes_read, MbBiReader *bir)
+{
+    if (!mb::file_read_fully(*file, buf, size, bytes_read)) {
+        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                               "Failed to read data: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Refill read-ahead buffer
+ *
+ * Reads up to the next #SEGMENT_READER_READ_AHEAD_SIZE-aligned file offset or
+ * the end of the entry, whichever comes first. ctx->ra_len is 0 on EOF.
+ */
+static int fill_read_ahead(SegmentReaderCtx *ctx, mb::File *file,
+                           MbBiReader *bir)
+{
+    if (!ctx->ra_buf) {
+        ctx->ra_buf = static_cast<unsigned char *>(
+                malloc(SEGMENT_READER_READ_AHEAD_SIZE));
+        if (!ctx->ra_buf) {
+            mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                                   "Failed to allocate read-ahead buffer");
+            return MB_BI_FAILED;
+        }
+    }
+
+    uint64_t block_end = ctx->read_cur_offset
+            - ctx->read_cur_offset % SEGMENT_READER_READ_AHEAD_SIZE
+            + SEGMENT_READER_READ_AHEAD_SIZE;
+    size_t to_read = static_cast<size_t>(std::min(
+            block_end, ctx->read_end_offset) - ctx->read_cur_offset);
+
+    ctx->ra_pos = 0;
+    ctx->ra_len = 0;
+
+    return read_file(file, ctx->ra_buf, to_read, ctx->ra_len, bir);
+}
+
 int _segment_reader_move_to_entry(SegmentReaderCtx *ctx, mb::File *file,
                                   MbBiEntry *entry, SegmentReaderEntry *srentry,
                                   MbBiReader *bir)
@@ -149,12 +233,18 @@ int _segment_reader_move_to_entry(SegmentReaderCtx *ctx, mb::File *file,
     uint64_t read_end_offset = read_start_offset + srentry->size;
     uint64_t read_cur_offset = read_start_offset;
 
-    if (ctx->read_cur_offset != srentry->offset) {
+    // The file position is past any unconsumed read-ahead data
+    uint64_t file_offset = ctx->read_cur_offset + (ctx->ra_len - ctx->ra_pos);
+
+    if (file_offset != srentry->offset) {
         if (!file->seek(read_start_offset, SEEK_SET, nullptr)) {
             return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
         }
     }
 
+    ctx->ra_pos = 0;
+    ctx->ra_len = 0;
+
     ret = mb_bi_entry_set_type(entry, srentry->type);
     if (ret != MB_BI_OK) return ret;
 
@@ -167,6 +257,13 @@ int _segment_reader_move_to_entry(SegmentReaderCtx *ctx, mb::File *file,
     ctx->read_end_offset = read_end_offset;
     ctx->read_cur_offset = read_cur_offset;
 
+    // Let the kernel start fetching this entry and the next one while the
+    // caller processes the data
+    advise_will_need(ctx, file, srentry);
+    if (static_cast<size_t>(srentry - ctx->entries + 1) < ctx->entries_len) {
+        advise_will_need(ctx, file, srentry + 1);
+    }
+
     return MB_BI_OK;
 }
 
@@ -216,14 +313,44 @@ int _segment_reader_read_data(SegmentReaderCtx *ctx, mb::File *file,
         return MB_BI_FAILED;
     }
 
-    if (!mb::file_read_fully(*file, buf, to_copy, bytes_read)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Failed to read data: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-    }
+    bytes_read = 0;
+
+    // Small reads are served from aligned read-ahead blocks so that callers
+    // using small buffers do not issue a syscall per call. Large reads bypass
+    // the buffer once it is drained.
+    while (bytes_read < to_copy) {
+        unsigned char *out = static_cast<unsigned char *>(buf) + bytes_read;
+        size_t remaining = to_copy - bytes_read;
+        size_t n;
+        int ret;
+
+        if (ctx->ra_pos == ctx->ra_len) {
+            if (remaining >= SEGMENT_READER_READ_AHEAD_SIZE) {
+                ret = read_file(file, out, remaining, n, bir);
+                if (ret != MB_BI_OK) {
+                    return ret;
+                }
+
+                bytes_read += n;
+                ctx->read_cur_offset += n;
+                break;
+            }
 
-    ctx->read_cur_offset += bytes_read;
+            ret = fill_read_ahead(ctx, file, bir);
+            if (ret != MB_BI_OK) {
+                return ret;
+            } else if (ctx->ra_len == 0) {
+                break;
+            }
+        }
+
+        n = std::min(remaining, ctx->ra_len - ctx->ra_pos);
+        memcpy(out, ctx->ra_buf + ctx->ra_pos, n);
+
+        ctx->ra_pos += n;
+        bytes_read += n;
+        ctx->read_cur_offset += n;
+    }
 
     // Fail if we reach EOF early
     if (bytes_read == 0 && ctx->read_cur_offset != ctx->read_end_offset
@@ -237,3 +364,59 @@ int _segment_reader_read_data(SegmentReaderCtx *ctx, mb::File *file,
 
     return bytes_read == 0 ? MB_BI_EOF : MB_BI_OK;
 }
+
+int _segment_reader_read_data_view(SegmentReaderCtx *ctx, mb::File *file,
+                                   const void *&data, size_t &data_size,
+                                   MbBiReader *bir)
+{
+    size_t to_map = std::min<uint64_t>(
+            SIZE_MAX, ctx->read_end_offset - ctx->read_cur_offset);
+
+    if (to_map == 0) {
+        data = nullptr;
+        data_size = 0;
+        return MB_BI_EOF;
+    }
+
+    if (!file->map_range(ctx->read_cur_offset, to_map, data, data_size)) {
+        if (file->error() == mb::FileError::UnsupportedMap) {
+            mb_bi_reader_set_error(bir, MB_BI_ERROR_UNSUPPORTED,
+                                   "Failed to map data: %s",
+                                   file->error_string().c_str());
+            return MB_BI_UNSUPPORTED;
+        }
+
+        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                               "Failed to map data: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    // Fail if the entry is truncated
+    if (data_size != to_map && !ctx->entry->can_truncate) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
+                               "Entry is truncated "
+                               "(expected %" PRIu64 " more bytes)",
+                               ctx->read_end_offset - ctx->read_cur_offset
+                                       - data_size);
+        return MB_BI_FATAL;
+    }
+
+    // Keep the file position in sync with the entry so that the next entry can
+    // be read without seeking
+    ctx->read_cur_offset += data_size;
+    ctx->ra_pos = 0;
+    ctx->ra_len = 0;
+
+    if (!file->seek(ctx->read_cur_offset, SEEK_SET, nullptr)) {
+        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                               "Failed to seek past data: %s",
+                               file->error_string().c_str());
+        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    // If truncated, treat the rest of the entry as consumed
+    ctx->read_end_offset = ctx->read_cur_offset;
+
+    return data_size == 0 ? MB_BI_EOF : MB_BI_OK;
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/format/sha1_pipeline_p.h"
+
+#include <algorithm>
+
+#include <cstring>
+
+/*!
+ * \brief Start hashing thread
+ *
+ * \param ctx Initialized SHA1 context. It must not be used by the caller until
+ *            finish() returns.
+ * \param buffer_size Maximum number of bytes that can be queued for hashing
+ */
+Sha1Pipeline::Sha1Pipeline(SHA_CTX *ctx, size_t buffer_size)
+    : _ctx(ctx)
+    , _buf(buffer_size)
+    , _head(0)
+    , _tail(0)
+    , _done(false)
+    , _failed(false)
+    , _thread(&Sha1Pipeline::run, this)
+{
+}
+
+Sha1Pipeline::~Sha1Pipeline()
+{
+    finish();
+}
+
+/*!
+ * \brief Queue data to be hashed
+ *
+ * \param data Data to hash
+ * \param size Size of \p data
+ *
+ * \return Whether the data was queued. False is returned if the hashing thread
+ *         failed to update the SHA1 context or finish() was already called.
+ */
+bool Sha1Pipeline::update(const void *data, size_t size)
+{
+    auto const *ptr = static_cast<const unsigned char *>(data);
+
+    while (size > 0) {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        _cv_space.wait(lock, [&]{
+            return _failed || _done || _head - _tail < _buf.size();
+        });
+
+        if (_failed || _done) {
+            return false;
+        }
+
+        size_t offset = _head % _buf.size();
+        size_t n = std::min({
+            size,
+            static_cast<size_t>(_buf.size() - (_head - _tail)),
+            _buf.size() - offset,
+        });
+
+        // The worker thread never reads beyond _head, so copying into the free
+        // part of the buffer is safe while it is hashing
+        memcpy(_buf.data() + offset, ptr, n);
+        _head += n;
+
+        lock.unlock();
+        _cv_data.notify_one();
+
+        ptr += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Wait for all queued data to be hashed
+ *
+ * After this function returns, the SHA1 context can be used by the caller
+ * again (eg. for SHA1_Final()).
+ *
+ * \return Whether all of the queued data was successfully hashed
+ */
+bool Sha1Pipeline::finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _done = true;
+    }
+    _cv_data.notify_one();
+    _cv_space.notify_all();
+
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+
+    return !_failed;
+}
+
+void Sha1Pipeline::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true) {
+        _cv_data.wait(lock, [&]{
+            return _done || _head != _tail;
+        });
+
+        if (_head == _tail) {
+            // Done and everything has been hashed
+            break;
+        }
+
+        size_t offset = _tail % _buf.size();
+        size_t n = std::min(static_cast<size_t>(_head - _tail),
+                            _buf.size() - offset);
+
+        lock.unlock();
+        bool ok = SHA1_Update(_ctx, _buf.data() + offset, n);
+        lock.lock();
+
+        if (!ok) {
+            _failed = true;
+            _cv_space.notify_all();
+            break;
+        }
+
+        _tail += n;
+        _cv_space.notify_one();
+    }
+}
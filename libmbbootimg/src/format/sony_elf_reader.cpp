@@ -21,6 +21,7 @@
 
 #include <algorithm>
 #include <type_traits>
+#include <vector>
 
 #include <cerrno>
 #include <cinttypes>
@@ -34,6 +35,7 @@
 
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/sony_elf_defs.h"
+#include "mbbootimg/format_tags.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/reader.h"
 #include "mbbootimg/reader_p.h"
@@ -68,14 +70,7 @@ int find_sony_elf_header(MbBiReader *bir, mb::File *file,
     Sony_Elf32_Ehdr header;
     size_t n;
 
-    if (!file->seek(0, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Failed to seek to beginning: %s",
-                               file->error_string().c_str());
-        return file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    if (!mb::file_read_fully(*file, &header, sizeof(header), n)) {
+    if (!_mb_bi_reader_read_at(bir, file, 0, &header, sizeof(header), n)) {
         mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
                                "Failed to read header: %s",
                                file->error_string().c_str());
@@ -155,47 +150,31 @@ int sony_elf_reader_read_header(MbBiReader *bir, void *userdata,
     ret = mb_bi_header_set_entrypoint_address(header, ctx->hdr.e_entry);
     if (ret != MB_BI_OK) return ret;
 
-    // Calculate offsets for each section
-
-    uint64_t pos = 0;
-
-    // pos cannot overflow due to the nature of the operands (adding UINT32_MAX
-    // a few times can't overflow a uint64_t). File length overflow is checked
-    // during read.
-
-    // Header
-    pos += sizeof(Sony_Elf32_Ehdr);
-
     // Reset entries
     _segment_reader_entries_clear(&ctx->segctx);
 
-    // Read program segment headers
-    for (Elf32_Half i = 0; i < ctx->hdr.e_phnum; ++i) {
-        Sony_Elf32_Phdr phdr;
-        size_t n;
-
-        if (!bir->file->seek(pos, SEEK_SET, nullptr)) {
-            mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
-                                   "Failed to seek to segment %" PRIu16
-                                   " at %" PRIu64 ": %s", i, pos,
-                                   bir->file->error_string().c_str());
-            return bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-        }
+    // Read all of the program segment headers, which immediately follow the
+    // ELF header, at once
+    std::vector<Sony_Elf32_Phdr> phdrs(ctx->hdr.e_phnum);
+    size_t phdrs_size = phdrs.size() * sizeof(Sony_Elf32_Phdr);
+    size_t n;
 
-        if (!mb::file_read_fully(*bir->file, &phdr, sizeof(phdr), n)) {
-            mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
-                                   "Failed to read segment %" PRIu16 ": %s",
-                                   i, bir->file->error_string().c_str());
-            return bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-        } else if (n != sizeof(phdr)) {
-            mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
-                                   "Unexpected EOF when reading segment"
-                                   " header %" PRIu16, i);
-            return MB_BI_WARN;
-        }
+    if (!_mb_bi_reader_read_at(bir, bir->file, sizeof(Sony_Elf32_Ehdr),
+                               phdrs.data(), phdrs_size, n)) {
+        mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
+                               "Failed to read segment headers: %s",
+                               bir->file->error_string().c_str());
+        return bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    } else if (n != phdrs_size) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
+                               "Unexpected EOF when reading segment"
+                               " header %" MB_PRIzu,
+                               n / sizeof(Sony_Elf32_Phdr));
+        return MB_BI_WARN;
+    }
 
-        // Account for program header
-        pos += sizeof(phdr);
+    for (Elf32_Half i = 0; i < ctx->hdr.e_phnum; ++i) {
+        Sony_Elf32_Phdr &phdr = phdrs[i];
 
         // Fix byte order
         sony_elf_fix_phdr_byte_order(&phdr);
@@ -210,14 +189,8 @@ int sony_elf_reader_read_header(MbBiReader *bir, void *userdata,
                 return MB_BI_WARN;
             }
 
-            if (!bir->file->seek(phdr.p_offset, SEEK_SET, nullptr)) {
-                mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
-                                       "Failed to seek to cmdline: %s",
-                                       bir->file->error_string().c_str());
-                return bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-            }
-
-            if (!mb::file_read_fully(*bir->file, cmdline, phdr.p_memsz, n)) {
+            if (!_mb_bi_reader_read_at(bir, bir->file, phdr.p_offset,
+                                       cmdline, phdr.p_memsz, n)) {
                 mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
                                        "Failed to read cmdline: %s",
                                        bir->file->error_string().c_str());
@@ -324,6 +297,15 @@ int sony_elf_reader_read_data(MbBiReader *bir, void *userdata,
                                      bytes_read, bir);
 }
 
+int sony_elf_reader_read_data_view(MbBiReader *bir, void *userdata,
+                                   const void *&data, size_t &data_size)
+{
+    SonyElfReaderCtx *const ctx = static_cast<SonyElfReaderCtx *>(userdata);
+
+    return _segment_reader_read_data_view(&ctx->segctx, bir->file, data,
+                                          data_size, bir);
+}
+
 int sony_elf_reader_free(MbBiReader *bir, void *userdata)
 {
     (void) bir;
@@ -345,17 +327,11 @@ int sony_elf_reader_free(MbBiReader *bir, void *userdata)
  */
 int mb_bi_reader_enable_format_sony_elf(MbBiReader *bir)
 {
-    SonyElfReaderCtx *const ctx = static_cast<SonyElfReaderCtx *>(
-            calloc(1, sizeof(SonyElfReaderCtx)));
+    void *ctx = mb::bootimg::SonyElfFormat::reader_new(bir);
     if (!ctx) {
-        mb_bi_reader_set_error(bir, -errno,
-                               "Failed to allocate SonyElfReaderCtx: %s",
-                               strerror(errno));
         return MB_BI_FAILED;
     }
 
-    _segment_reader_init(&ctx->segctx);
-
     return _mb_bi_reader_register_format(bir,
                                          ctx,
                                          MB_BI_FORMAT_SONY_ELF,
@@ -366,7 +342,74 @@ int mb_bi_reader_enable_format_sony_elf(MbBiReader *bir)
                                          &sony_elf_reader_read_entry,
                                          &sony_elf_reader_go_to_entry,
                                          &sony_elf_reader_read_data,
+                                         &sony_elf_reader_read_data_view,
                                          &sony_elf_reader_free);
 }
 
 MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+void * SonyElfFormat::reader_new(MbBiReader *bir)
+{
+    SonyElfReaderCtx *const ctx = static_cast<SonyElfReaderCtx *>(
+            calloc(1, sizeof(SonyElfReaderCtx)));
+    if (!ctx) {
+        mb_bi_reader_set_error(bir, -errno,
+                               "Failed to allocate SonyElfReaderCtx: %s",
+                               strerror(errno));
+        return nullptr;
+    }
+
+    _segment_reader_init(&ctx->segctx);
+
+    return ctx;
+}
+
+int SonyElfFormat::reader_free(MbBiReader *bir, void *ctx)
+{
+    return sony_elf_reader_free(bir, ctx);
+}
+
+int SonyElfFormat::reader_bid(MbBiReader *bir, void *ctx, int best_bid)
+{
+    return sony_elf_reader_bid(bir, ctx, best_bid);
+}
+
+int SonyElfFormat::reader_read_header(MbBiReader *bir, void *ctx,
+                                      MbBiHeader *header)
+{
+    return sony_elf_reader_read_header(bir, ctx, header);
+}
+
+int SonyElfFormat::reader_read_entry(MbBiReader *bir, void *ctx,
+                                     MbBiEntry *entry)
+{
+    return sony_elf_reader_read_entry(bir, ctx, entry);
+}
+
+int SonyElfFormat::reader_go_to_entry(MbBiReader *bir, void *ctx,
+                                      MbBiEntry *entry, int entry_type)
+{
+    return sony_elf_reader_go_to_entry(bir, ctx, entry, entry_type);
+}
+
+int SonyElfFormat::reader_read_data(MbBiReader *bir, void *ctx,
+                                    void *buf, size_t buf_size,
+                                    size_t &bytes_read)
+{
+    return sony_elf_reader_read_data(bir, ctx, buf, buf_size, bytes_read);
+}
+
+int SonyElfFormat::reader_read_data_view(MbBiReader *bir, void *ctx,
+                                         const void *&data,
+                                         size_t &data_size)
+{
+    return sony_elf_reader_read_data_view(bir, ctx, data, data_size);
+}
+
+}
+}
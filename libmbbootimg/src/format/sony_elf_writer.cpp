@@ -35,6 +35,7 @@
 
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/sony_elf_defs.h"
+#include "mbbootimg/format_tags.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/writer.h"
 #include "mbbootimg/writer_p.h"
@@ -375,15 +376,24 @@ int sony_elf_writer_close(MbBiWriter *biw, void *userdata)
             return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
         }
 
-        // Write headers
+        // Write headers with a single gathered write
+        mb::FileConstIoVec iov[sizeof(headers) / sizeof(headers[0])];
+        size_t iov_count = 0;
+        size_t total_size = 0;
+
         for (auto it = headers; it->ptr && it->can_write; ++it) {
-            if (!mb::file_write_fully(*biw->file, it->ptr, it->size, n)
-                    || n != it->size) {
-                mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
-                                       "Failed to write header: %s",
-                                       biw->file->error_string().c_str());
-                return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-            }
+            iov[iov_count].data = it->ptr;
+            iov[iov_count].size = it->size;
+            ++iov_count;
+            total_size += it->size;
+        }
+
+        if (!mb::file_write_fully_v(*biw->file, iov, iov_count, n)
+                || n != total_size) {
+            mb_bi_writer_set_error(biw, biw->file->error().value() /* TODO */,
+                                   "Failed to write header: %s",
+                                   biw->file->error_string().c_str());
+            return biw->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
         }
     }
 
@@ -412,17 +422,11 @@ int sony_elf_writer_free(MbBiWriter *bir, void *userdata)
  */
 int mb_bi_writer_set_format_sony_elf(MbBiWriter *biw)
 {
-    SonyElfWriterCtx *const ctx = static_cast<SonyElfWriterCtx *>(
-            calloc(1, sizeof(SonyElfWriterCtx)));
+    void *ctx = mb::bootimg::SonyElfFormat::writer_new(biw);
     if (!ctx) {
-        mb_bi_writer_set_error(biw, -errno,
-                               "Failed to allocate SonyElfWriterCtx: %s",
-                               strerror(errno));
         return MB_BI_FAILED;
     }
 
-    _segment_writer_init(&ctx->segctx);
-
     return _mb_bi_writer_register_format(biw,
                                          ctx,
                                          MB_BI_FORMAT_SONY_ELF,
@@ -439,3 +443,85 @@ int mb_bi_writer_set_format_sony_elf(MbBiWriter *biw)
 }
 
 MB_END_C_DECLS
+
+namespace mb
+{
+namespace bootimg
+{
+
+void * SonyElfFormat::writer_new(MbBiWriter *biw)
+{
+    SonyElfWriterCtx *const ctx = static_cast<SonyElfWriterCtx *>(
+            calloc(1, sizeof(SonyElfWriterCtx)));
+    if (!ctx) {
+        mb_bi_writer_set_error(biw, -errno,
+                               "Failed to allocate SonyElfWriterCtx: %s",
+                               strerror(errno));
+        return nullptr;
+    }
+
+    _segment_writer_init(&ctx->segctx);
+
+    return ctx;
+}
+
+int SonyElfFormat::writer_free(MbBiWriter *biw, void *ctx)
+{
+    return sony_elf_writer_free(biw, ctx);
+}
+
+int SonyElfFormat::writer_set_option(MbBiWriter *biw, void *ctx,
+                                     const char *key, const char *value)
+{
+    (void) ctx;
+    (void) key;
+    (void) value;
+
+    mb_bi_writer_set_error(biw, MB_BI_ERROR_UNSUPPORTED,
+                           "Format does not support any options");
+    return MB_BI_WARN;
+}
+
+int SonyElfFormat::writer_get_header(MbBiWriter *biw, void *ctx,
+                                     MbBiHeader *header)
+{
+    return sony_elf_writer_get_header(biw, ctx, header);
+}
+
+int SonyElfFormat::writer_write_header(MbBiWriter *biw, void *ctx,
+                                       MbBiHeader *header)
+{
+    return sony_elf_writer_write_header(biw, ctx, header);
+}
+
+int SonyElfFormat::writer_get_entry(MbBiWriter *biw, void *ctx,
+                                    MbBiEntry *entry)
+{
+    return sony_elf_writer_get_entry(biw, ctx, entry);
+}
+
+int SonyElfFormat::writer_write_entry(MbBiWriter *biw, void *ctx,
+                                      MbBiEntry *entry)
+{
+    return sony_elf_writer_write_entry(biw, ctx, entry);
+}
+
+int SonyElfFormat::writer_write_data(MbBiWriter *biw, void *ctx,
+                                     const void *buf, size_t buf_size,
+                                     size_t &bytes_written)
+{
+    return sony_elf_writer_write_data(biw, ctx, buf, buf_size, bytes_written);
+}
+
+int SonyElfFormat::writer_finish_entry(MbBiWriter *biw, void *ctx)
+{
+    return sony_elf_writer_finish_entry(biw, ctx);
+}
+
+int SonyElfFormat::writer_close(MbBiWriter *biw, void *ctx)
+{
+    return sony_elf_writer_close(biw, ctx);
+}
+
+}
+}
@@ -27,6 +27,8 @@
 #include "mbbootimg/header_p.h"
 #include "mbbootimg/macros_p.h"
 
+using namespace mb::bootimg;
+
 
 MB_BEGIN_C_DECLS
 
@@ -49,8 +51,9 @@ void mb_bi_header_clear(MbBiHeader *header)
 {
     if (header) {
         uint64_t supported = header->fields_supported;
-        free(header->field.board_name);
-        free(header->field.cmdline);
+        string_field_free(&header->field.board_name,
+                          header->storage.board_name);
+        string_field_free(&header->field.cmdline, header->storage.cmdline);
         memset(header, 0, sizeof(*header));
         header->fields_supported = supported;
     }
@@ -90,9 +93,15 @@ MbBiHeader * mb_bi_header_clone(MbBiHeader *header)
     // Deep copy strings
     bool deep_copy_error =
             (header->field.board_name
-                    && !(dup->field.board_name = strdup(header->field.board_name)))
+                    && !string_field_set(&dup->field.board_name,
+                                         dup->storage.board_name,
+                                         sizeof(dup->storage.board_name),
+                                         header->field.board_name))
             || (header->field.cmdline
-                    && !(dup->field.cmdline = strdup(header->field.cmdline)));
+                    && !string_field_set(&dup->field.cmdline,
+                                         dup->storage.cmdline,
+                                         sizeof(dup->storage.cmdline),
+                                         header->field.cmdline));
 
     if (deep_copy_error) {
         mb_bi_header_free(dup);
@@ -19,16 +19,30 @@
 
 #include "mbbootimg/reader.h"
 
+#include <algorithm>
+
 #include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include "mbcommon/file.h"
 #include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
+#ifndef _WIN32
+#include "mbcommon/file/mmap.h"
+#endif
+#include "mbcommon/libc/string.h"
 #include "mbcommon/string.h"
 
+#include "mbbootimg/basic_reader.h"
 #include "mbbootimg/entry.h"
+#include "mbbootimg/format/android_p.h"
+#include "mbbootimg/format/bump_defs.h"
+#include "mbbootimg/format/loki_defs.h"
+#include "mbbootimg/format/mtk_defs.h"
+#include "mbbootimg/format/sony_elf_glibc_p.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/reader_p.h"
 
@@ -156,6 +170,29 @@
  *   * Return \<= #MB_BI_WARN if an error occurs
  */
 
+/*!
+ * \typedef FormatReaderReadDataView
+ * \ingroup MB_BI_READER_FORMAT_CALLBACKS
+ *
+ * \brief Format reader callback to get a zero-copy view of entry data
+ *
+ * The view must contain all of the remaining data of the current entry and the
+ * entry must be fully consumed afterwards (ie. a further call to the read data
+ * callback must return #MB_BI_EOF).
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] userdata User callback data
+ * \param[out] data Output pointer to the entry data
+ * \param[out] data_size Output size of the entry data
+ *
+ * \return
+ *   * Return #MB_BI_OK if the view is successfully retrieved
+ *   * Return #MB_BI_EOF if the end of the curent entry has been reached
+ *   * Return #MB_BI_UNSUPPORTED if the underlying file cannot be mapped. The
+ *     reader state must not be changed.
+ *   * Return \<= #MB_BI_WARN if an error occurs
+ */
+
 /*!
  * \typedef FormatReaderFree
  * \ingroup MB_BI_READER_FORMAT_CALLBACKS
@@ -178,39 +215,56 @@
 
 MB_BEGIN_C_DECLS
 
+/*!
+ * Magic that must be present in the probe buffer for a format's bidder to have
+ * any chance of winning. Each format's bidder is only run if its magic is found
+ * within [offset, offset + window) of the file. max_bid is the highest value
+ * the bidder can return and is used to run the formats most likely to win
+ * first so that the remaining bidders can bail out without doing any I/O.
+ */
 static struct
 {
-    int code;
-    const char *name;
-    int (*func)(MbBiReader *);
-} reader_formats[] = {
+    int base_type;
+    uint64_t offset;
+    size_t window;
+    const char *magic;
+    size_t magic_size;
+    int max_bid;
+} reader_magics[] = {
     {
         MB_BI_FORMAT_ANDROID,
-        MB_BI_FORMAT_NAME_ANDROID,
-        mb_bi_reader_enable_format_android
+        0, ANDROID_MAX_HEADER_OFFSET + sizeof(AndroidHeader),
+        ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE,
+        (ANDROID_BOOT_MAGIC_SIZE + SAMSUNG_SEANDROID_MAGIC_SIZE) * 8
     }, {
         MB_BI_FORMAT_BUMP,
-        MB_BI_FORMAT_NAME_BUMP,
-        mb_bi_reader_enable_format_bump
+        0, ANDROID_MAX_HEADER_OFFSET + sizeof(AndroidHeader),
+        ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE,
+        (ANDROID_BOOT_MAGIC_SIZE + BUMP_MAGIC_SIZE) * 8
     }, {
         MB_BI_FORMAT_LOKI,
-        MB_BI_FORMAT_NAME_LOKI,
-        mb_bi_reader_enable_format_loki
+        LOKI_MAGIC_OFFSET, LOKI_MAGIC_SIZE,
+        LOKI_MAGIC, LOKI_MAGIC_SIZE,
+        (ANDROID_BOOT_MAGIC_SIZE + LOKI_MAGIC_SIZE) * 8
     }, {
         MB_BI_FORMAT_MTK,
-        MB_BI_FORMAT_NAME_MTK,
-        mb_bi_reader_enable_format_mtk
+        0, ANDROID_MAX_HEADER_OFFSET + sizeof(AndroidHeader),
+        ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE,
+        (ANDROID_BOOT_MAGIC_SIZE + 2 * MTK_MAGIC_SIZE) * 8
     }, {
         MB_BI_FORMAT_SONY_ELF,
-        MB_BI_FORMAT_NAME_SONY_ELF,
-        mb_bi_reader_enable_format_sony_elf
-    }, {
-        0,
-        nullptr,
-        nullptr
+        0, SONY_EI_NIDENT,
+        SONY_E_IDENT, SONY_EI_NIDENT,
+        SONY_EI_NIDENT * 8
     },
 };
 
+struct BidCandidate
+{
+    FormatReader *format;
+    int max_bid;
+};
+
 /*!
  * \brief Register a format reader
  *
@@ -231,6 +285,7 @@ static struct
  * \param read_entry_cb Read entry callback (required)
  * \param go_to_entry_cb Go to entry callback (optional)
  * \param read_data_cb Read data callback (required)
+ * \param read_data_view_cb Read data view callback (optional)
  * \param free_cb Free callback (optional)
  *
  * \return
@@ -248,6 +303,7 @@ int _mb_bi_reader_register_format(MbBiReader *bir,
                                   FormatReaderReadEntry read_entry_cb,
                                   FormatReaderGoToEntry go_to_entry_cb,
                                   FormatReaderReadData read_data_cb,
+                                  FormatReaderReadDataView read_data_view_cb,
                                   FormatReaderFree free_cb)
 {
     int ret;
@@ -265,6 +321,7 @@ int _mb_bi_reader_register_format(MbBiReader *bir,
     format.read_entry_cb = read_entry_cb;
     format.go_to_entry_cb = go_to_entry_cb;
     format.read_data_cb = read_data_cb;
+    format.read_data_view_cb = read_data_view_cb;
     format.free_cb = free_cb;
     format.userdata = userdata;
 
@@ -342,6 +399,327 @@ int _mb_bi_reader_free_format(MbBiReader *bir, FormatReader *format)
     return ret;
 }
 
+/*!
+ * \brief Read data for format detection
+ *
+ * If \p file is the reader's file and the requested range lies within the probe
+ * buffer read by mb_bi_reader_open(), the data is copied from the probe buffer
+ * and no I/O is performed. Otherwise, the data is read from \p file.
+ *
+ * \post The file pointer position is undefined after this function returns.
+ *       Use File::seek() to return to a known position.
+ *
+ * \param bir MbBiReader
+ * \param file File handle
+ * \param offset Offset to read from
+ * \param buf Output buffer
+ * \param size Number of bytes to read
+ * \param[out] bytes_read Number of bytes read (less than \p size only if EOF is
+ *                        reached)
+ *
+ * \return Whether the data is successfully read. If false is returned, the
+ *         error is set on \p file.
+ */
+bool _mb_bi_reader_read_at(MbBiReader *bir, mb::File *file,
+                           uint64_t offset, void *buf, size_t size,
+                           size_t &bytes_read)
+{
+    if (file == bir->file && bir->probe_valid && offset <= bir->probe.size()) {
+        size_t avail = bir->probe.size() - offset;
+
+        // A short probe means that the file ends within the probe buffer
+        if (size <= avail || bir->probe.size() < READER_PROBE_SIZE) {
+            bytes_read = std::min(size, avail);
+            memcpy(buf, bir->probe.data() + offset, bytes_read);
+            return true;
+        }
+    }
+
+    return file->seek(offset, SEEK_SET, nullptr)
+            && mb::file_read_fully(*file, buf, size, bytes_read);
+}
+
+/*!
+ * \brief Check that the reader is in one of the specified states
+ *
+ * Same as READER_ENSURE_STATE(), but reports \p func as the caller.
+ */
+static int ensure_state(MbBiReader *bir, unsigned short states,
+                        const char *func)
+{
+    if (!(bir->state & states)) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
+                               "%s: Invalid state: "
+                               "expected 0x%x, actual: 0x%hx",
+                               func, states, bir->state);
+        bir->state = ReaderState::FATAL;
+        return MB_BI_FATAL;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Open File handle for a boot image filename
+ *
+ * On Unix-like systems, the file is memory mapped if possible so that the
+ * format readers can parse headers in place with mb::File::map_range(). If the
+ * file cannot be mapped (eg. because it is a pipe), it is opened normally.
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] filename MBS filename
+ * \param[out] file_out Pointer to store new File handle
+ * \param[in] func Name of the calling function for error messages
+ *
+ * \return
+ *   * #MB_BI_OK if the file is successfully opened
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int _mb_bi_reader_open_file(MbBiReader *bir, const char *filename,
+                            mb::File **file_out, const char *func)
+{
+    int ret = ensure_state(bir, ReaderState::NEW, func);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+#ifndef _WIN32
+    {
+        mb::File *file = new(std::nothrow) mb::MmapFile(filename);
+        if (file && file->is_open()) {
+            *file_out = file;
+            return MB_BI_OK;
+        }
+        delete file;
+    }
+#endif
+
+    mb::File *file = new(std::nothrow) mb::StandardFile(
+            filename, mb::FileOpenMode::READ_ONLY);
+    if (!file) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                               "%s", strerror(errno));
+        return MB_BI_FAILED;
+    }
+
+    if (!file->is_open()) {
+        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
+                               "Failed to open for reading: %s",
+                               file->error_string().c_str());
+        delete file;
+        return MB_BI_FAILED;
+    }
+
+    *file_out = file;
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Begin opening a boot image
+ *
+ * Attaches \p file to the reader. If the reader is not in the correct state,
+ * \p file is freed if \p owned is true.
+ *
+ * \return
+ *   * #MB_BI_OK if the file is attached
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int _mb_bi_reader_open_begin(MbBiReader *bir, mb::File *file, bool owned,
+                             const char *func)
+{
+    int ret = ensure_state(bir, ReaderState::NEW, func);
+    if (ret != MB_BI_OK) {
+        if (owned) {
+            delete file;
+        }
+        return ret;
+    }
+
+    bir->file = file;
+    bir->file_owned = owned;
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Read the probe buffer used by the bidders
+ *
+ * \return
+ *   * #MB_BI_OK if the probe buffer is successfully read
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int _mb_bi_reader_read_probe(MbBiReader *bir)
+{
+    size_t n;
+
+    bir->probe.resize(READER_PROBE_SIZE);
+
+    if (!bir->file->seek(0, SEEK_SET, nullptr)
+            || !mb::file_read_fully(*bir->file, bir->probe.data(),
+                                    bir->probe.size(), n)) {
+        mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
+                               "Failed to read file: %s",
+                               bir->file->error_string().c_str());
+        return bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    bir->probe.resize(n);
+    bir->probe_valid = true;
+    bir->android_hdr_searched = false;
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Check if a format could match the probe buffer
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] type Format type
+ * \param[out] max_bid Highest bid the format can make, or INT_MAX if the
+ *                     format is not in the magic table
+ *
+ * \return Whether the format's bidder should be run
+ */
+bool _mb_bi_reader_probe_matches(MbBiReader *bir, int type, int *max_bid)
+{
+    const std::vector<unsigned char> &probe = bir->probe;
+
+    for (auto const &m : reader_magics) {
+        if ((type & MB_BI_FORMAT_BASE_MASK) != m.base_type) {
+            continue;
+        }
+
+        *max_bid = m.max_bid;
+
+        if (m.offset >= probe.size()) {
+            return false;
+        }
+
+        size_t avail = std::min<size_t>(m.window, probe.size() - m.offset);
+        return mb_memmem(probe.data() + m.offset, avail,
+                         m.magic, m.magic_size) != nullptr;
+    }
+
+    *max_bid = INT_MAX;
+    return true;
+}
+
+/*!
+ * \brief Finish opening a boot image
+ *
+ * Releases the probe buffer. If \p ret is #MB_BI_OK, the reader moves to the
+ * header state. Otherwise, the file is detached (and freed if owned).
+ *
+ * \return \p ret
+ */
+int _mb_bi_reader_open_end(MbBiReader *bir, int ret)
+{
+    bir->probe.clear();
+    bir->probe.shrink_to_fit();
+    bir->probe_valid = false;
+    bir->android_hdr_searched = false;
+
+    if (ret == MB_BI_OK) {
+        bir->state = ReaderState::HEADER;
+    } else {
+        if (bir->file_owned) {
+            delete bir->file;
+        }
+
+        bir->file = nullptr;
+        bir->file_owned = false;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Prepare for a reader operation
+ *
+ * Checks that the reader is in a valid state for \p op and performs the common
+ * setup for the operation. For #MB_BI_READER_OP_READ_HEADER, \p arg is the
+ * MbBiHeader to clear. For #MB_BI_READER_OP_READ_ENTRY and
+ * #MB_BI_READER_OP_GO_TO_ENTRY, \p arg is the MbBiEntry to clear.
+ *
+ * \return
+ *   * #MB_BI_OK if the format callback for \p op should be called
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int _mb_bi_reader_begin_op(MbBiReader *bir, int op, void *arg,
+                           const char *func)
+{
+    int ret;
+
+    switch (op) {
+    case MB_BI_READER_OP_SET_FORMAT:
+        return ensure_state(bir, ReaderState::NEW, func);
+
+    case MB_BI_READER_OP_READ_HEADER:
+        ret = ensure_state(bir, ReaderState::HEADER, func);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        // Seek to beginning
+        if (!bir->file->seek(0, SEEK_SET, nullptr)) {
+            mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
+                                   "Failed to seek file: %s",
+                                   bir->file->error_string().c_str());
+            return bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+        }
+
+        mb_bi_header_clear(static_cast<MbBiHeader *>(arg));
+        return MB_BI_OK;
+
+    case MB_BI_READER_OP_READ_ENTRY:
+    case MB_BI_READER_OP_GO_TO_ENTRY:
+        // Allow skipping to an entry without reading the data
+        ret = ensure_state(bir, ReaderState::ENTRY | ReaderState::DATA, func);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        mb_bi_entry_clear(static_cast<MbBiEntry *>(arg));
+        return MB_BI_OK;
+
+    case MB_BI_READER_OP_READ_DATA:
+    case MB_BI_READER_OP_READ_DATA_VIEW:
+        return ensure_state(bir, ReaderState::DATA, func);
+
+    default:
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
+                               "%s: Invalid operation: %d", func, op);
+        return MB_BI_FAILED;
+    }
+}
+
+/*!
+ * \brief Update reader state after a format callback for \p op returns
+ *
+ * \return \p ret
+ */
+int _mb_bi_reader_end_op(MbBiReader *bir, int op, int ret)
+{
+    if (ret == MB_BI_OK) {
+        switch (op) {
+        case MB_BI_READER_OP_READ_HEADER:
+            bir->state = ReaderState::ENTRY;
+            break;
+        case MB_BI_READER_OP_READ_ENTRY:
+        case MB_BI_READER_OP_GO_TO_ENTRY:
+            bir->state = ReaderState::DATA;
+            break;
+        default:
+            // Do not alter state
+            break;
+        }
+    } else if (ret <= MB_BI_FATAL) {
+        bir->state = ReaderState::FATAL;
+    }
+
+    return ret;
+}
+
 /*!
  * \brief Allocate new MbBiReader.
  *
@@ -408,6 +786,10 @@ int mb_bi_reader_free(MbBiReader *bir)
 /*!
  * \brief Open boot image from filename (MBS).
  *
+ * On Unix-like systems, the file is memory mapped if possible so that the
+ * format readers can parse headers in place with mb::File::map_range(). If the
+ * file cannot be mapped (eg. because it is a pipe), it is opened normally.
+ *
  * \param bir MbBiReader
  * \param filename MBS filename
  *
@@ -417,22 +799,11 @@ int mb_bi_reader_free(MbBiReader *bir)
  */
 int mb_bi_reader_open_filename(MbBiReader *bir, const char *filename)
 {
-    READER_ENSURE_STATE(bir, ReaderState::NEW);
+    mb::File *file;
 
-    mb::File *file = new(std::nothrow) mb::StandardFile(
-            filename, mb::FileOpenMode::READ_ONLY);
-    if (!file) {
-        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
-                               "%s", strerror(errno));
-        return MB_BI_FAILED;
-    }
-
-    if (!file->is_open()) {
-        mb_bi_reader_set_error(bir, file->error().value() /* TODO */,
-                               "Failed to open for reading: %s",
-                               file->error_string().c_str());
-        delete file;
-        return MB_BI_FAILED;
+    int ret = _mb_bi_reader_open_file(bir, filename, &file, __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
     }
 
     return mb_bi_reader_open(bir, file, true);
@@ -494,10 +865,10 @@ int mb_bi_reader_open(MbBiReader *bir, mb::File *file, bool owned)
     bool forced_format = !!bir->format;
 
     // Ensure that the file is freed even if called in an incorrect state
-    READER_ENSURE_STATE_GOTO(bir, ReaderState::NEW, ret, done);
-
-    bir->file = file;
-    bir->file_owned = owned;
+    ret = _mb_bi_reader_open_begin(bir, file, owned, __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
 
     if (bir->formats_len == 0) {
         mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
@@ -509,30 +880,46 @@ int mb_bi_reader_open(MbBiReader *bir, mb::File *file, bool owned)
     // Perform bid if a format wasn't explicitly chosen
     if (!bir->format) {
         FormatReader *format = nullptr, *cur;
+        BidCandidate candidates[MAX_FORMATS];
+        size_t candidates_len = 0;
 
+        // Read the beginning of the file once for all of the bidders
+        ret = _mb_bi_reader_read_probe(bir);
+        if (ret != MB_BI_OK) {
+            goto done;
+        }
+
+        // Only run bidders whose magic is present
         for (size_t i = 0; i < bir->formats_len; ++i) {
             cur = &bir->formats[i];
+            int max_bid;
 
-            if (cur->bidder_cb) {
-                // Seek to beginning
-                if (!bir->file->seek(0, SEEK_SET, nullptr)) {
-                    mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
-                                           "Failed to seek file: %s",
-                                           bir->file->error_string().c_str());
-                    ret = bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
-                    goto done;
-                }
+            if (cur->bidder_cb && _mb_bi_reader_probe_matches(bir, cur->type,
+                                                              &max_bid)) {
+                candidates[candidates_len].format = cur;
+                candidates[candidates_len].max_bid = max_bid;
+                ++candidates_len;
+            }
+        }
 
-                // Call bidder
-                ret = cur->bidder_cb(bir, cur->userdata, best_bid);
-                if (ret > best_bid) {
-                    best_bid = ret;
-                    format = cur;
-                } else if (ret == MB_BI_WARN) {
-                    continue;
-                } else if (ret < 0) {
-                    goto done;
-                }
+        // Try the formats with the highest possible bids first
+        std::stable_sort(candidates, candidates + candidates_len,
+                         [](const BidCandidate &a, const BidCandidate &b) {
+            return a.max_bid > b.max_bid;
+        });
+
+        for (size_t i = 0; i < candidates_len; ++i) {
+            cur = candidates[i].format;
+
+            // Call bidder
+            ret = cur->bidder_cb(bir, cur->userdata, best_bid);
+            if (ret > best_bid) {
+                best_bid = ret;
+                format = cur;
+            } else if (ret == MB_BI_WARN) {
+                continue;
+            } else if (ret < 0) {
+                goto done;
             }
         }
 
@@ -546,22 +933,13 @@ int mb_bi_reader_open(MbBiReader *bir, mb::File *file, bool owned)
         }
     }
 
-    bir->state = ReaderState::HEADER;
-
     ret = MB_BI_OK;
 
 done:
-    if (ret != MB_BI_OK) {
-        if (owned) {
-            delete file;
-        }
+    ret = _mb_bi_reader_open_end(bir, ret);
 
-        bir->file = nullptr;
-        bir->file_owned = false;
-
-        if (!forced_format) {
-            bir->format = nullptr;
-        }
+    if (ret != MB_BI_OK && !forced_format) {
+        bir->format = nullptr;
     }
     return ret;
 }
@@ -654,19 +1032,14 @@ int mb_bi_reader_read_header(MbBiReader *bir, MbBiHeader **header)
  */
 int mb_bi_reader_read_header2(MbBiReader *bir, MbBiHeader *header)
 {
-    READER_ENSURE_STATE(bir, ReaderState::HEADER);
     int ret;
 
-    // Seek to beginning
-    if (!bir->file->seek(0, SEEK_SET, nullptr)) {
-        mb_bi_reader_set_error(bir, bir->file->error().value() /* TODO */,
-                               "Failed to seek file: %s",
-                               bir->file->error_string().c_str());
-        return bir->file->is_fatal() ? MB_BI_FATAL : MB_BI_FAILED;
+    ret = _mb_bi_reader_begin_op(bir, MB_BI_READER_OP_READ_HEADER, header,
+                                 __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
     }
 
-    mb_bi_header_clear(header);
-
     if (!bir->format->read_header_cb) {
         mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
                                "Missing format read_header_cb");
@@ -675,13 +1048,7 @@ int mb_bi_reader_read_header2(MbBiReader *bir, MbBiHeader *header)
     }
 
     ret = bir->format->read_header_cb(bir, bir->format->userdata, header);
-    if (ret == MB_BI_OK) {
-        bir->state = ReaderState::ENTRY;
-    } else if (ret <= MB_BI_FATAL) {
-        bir->state = ReaderState::FATAL;
-    }
-
-    return ret;
+    return _mb_bi_reader_end_op(bir, MB_BI_READER_OP_READ_HEADER, ret);
 }
 
 /*!
@@ -732,11 +1099,13 @@ int mb_bi_reader_read_entry(MbBiReader *bir, MbBiEntry **entry)
  */
 int mb_bi_reader_read_entry2(MbBiReader *bir, MbBiEntry *entry)
 {
-    // Allow skipping to the next entry without reading the data
-    READER_ENSURE_STATE(bir, ReaderState::ENTRY | ReaderState::DATA);
     int ret;
 
-    mb_bi_entry_clear(entry);
+    ret = _mb_bi_reader_begin_op(bir, MB_BI_READER_OP_READ_ENTRY, entry,
+                                 __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
 
     if (!bir->format->read_entry_cb) {
         mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
@@ -746,13 +1115,7 @@ int mb_bi_reader_read_entry2(MbBiReader *bir, MbBiEntry *entry)
     }
 
     ret = bir->format->read_entry_cb(bir, bir->format->userdata, entry);
-    if (ret == MB_BI_OK) {
-        bir->state = ReaderState::DATA;
-    } else if (ret <= MB_BI_FATAL) {
-        bir->state = ReaderState::FATAL;
-    }
-
-    return ret;
+    return _mb_bi_reader_end_op(bir, MB_BI_READER_OP_READ_ENTRY, ret);
 }
 
 /*!
@@ -803,11 +1166,13 @@ int mb_bi_reader_go_to_entry(MbBiReader *bir, MbBiEntry **entry, int entry_type)
  */
 int mb_bi_reader_go_to_entry2(MbBiReader *bir, MbBiEntry *entry, int entry_type)
 {
-    // Allow skipping to an entry without reading the data
-    READER_ENSURE_STATE(bir, ReaderState::ENTRY | ReaderState::DATA);
     int ret;
 
-    mb_bi_entry_clear(entry);
+    ret = _mb_bi_reader_begin_op(bir, MB_BI_READER_OP_GO_TO_ENTRY, entry,
+                                 __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
 
     if (!bir->format->go_to_entry_cb) {
         mb_bi_reader_set_error(bir, MB_BI_ERROR_UNSUPPORTED,
@@ -817,13 +1182,7 @@ int mb_bi_reader_go_to_entry2(MbBiReader *bir, MbBiEntry *entry, int entry_type)
 
     ret = bir->format->go_to_entry_cb(bir, bir->format->userdata, entry,
                                       entry_type);
-    if (ret == MB_BI_OK) {
-        bir->state = ReaderState::DATA;
-    } else if (ret <= MB_BI_FATAL) {
-        bir->state = ReaderState::FATAL;
-    }
-
-    return ret;
+    return _mb_bi_reader_end_op(bir, MB_BI_READER_OP_GO_TO_ENTRY, ret);
 }
 
 /*!
@@ -842,9 +1201,14 @@ int mb_bi_reader_go_to_entry2(MbBiReader *bir, MbBiEntry *entry, int entry_type)
 int mb_bi_reader_read_data(MbBiReader *bir, void *buf, size_t size,
                            size_t *bytes_read)
 {
-    READER_ENSURE_STATE(bir, ReaderState::DATA);
     int ret;
 
+    ret = _mb_bi_reader_begin_op(bir, MB_BI_READER_OP_READ_DATA, nullptr,
+                                 __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
     if (!bir->format->read_data_cb) {
         mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
                                "Missing format read_data_cb");
@@ -854,13 +1218,55 @@ int mb_bi_reader_read_data(MbBiReader *bir, void *buf, size_t size,
 
     ret = bir->format->read_data_cb(bir, bir->format->userdata, buf, size,
                                     *bytes_read);
-    if (ret == MB_BI_OK) {
-        // Do not alter state. Stay in ReaderState::DATA
-    } else if (ret <= MB_BI_FATAL) {
-        bir->state = ReaderState::FATAL;
+    return _mb_bi_reader_end_op(bir, MB_BI_READER_OP_READ_DATA, ret);
+}
+
+/*!
+ * \brief Get a zero-copy view of the current boot image entry data.
+ *
+ * If the boot image is backed by a file that can be mapped into memory (eg. a
+ * file opened with mb_bi_reader_open_filename() or a mb::MemoryFile), this
+ * returns a pointer to the remaining data of the current entry in the mapped
+ * image. This allows entries to be hashed, compared, or written out without
+ * copying them into an intermediate buffer. The current entry is fully consumed
+ * afterwards, so a further call to mb_bi_reader_read_data() will return
+ * #MB_BI_EOF.
+ *
+ * The pointer remains valid until the reader is closed.
+ *
+ * If #MB_BI_UNSUPPORTED is returned, the reader state is not changed and
+ * mb_bi_reader_read_data() can be used instead.
+ *
+ * \param[in] bir MbBiReader
+ * \param[out] data Pointer to store pointer to the entry data
+ * \param[out] size Pointer to store size of the entry data
+ *
+ * \return
+ *   * #MB_BI_OK if the view is successfully retrieved
+ *   * #MB_BI_EOF if EOF is reached for the current entry
+ *   * #MB_BI_UNSUPPORTED if the format or file does not support mapping
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_reader_read_data_view(MbBiReader *bir, const void **data,
+                                size_t *size)
+{
+    int ret;
+
+    ret = _mb_bi_reader_begin_op(bir, MB_BI_READER_OP_READ_DATA_VIEW, nullptr,
+                                 __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
     }
 
-    return ret;
+    if (!bir->format->read_data_view_cb) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_UNSUPPORTED,
+                               "Format does not support zero-copy reads");
+        return MB_BI_UNSUPPORTED;
+    }
+
+    ret = bir->format->read_data_view_cb(bir, bir->format->userdata, *data,
+                                         *size);
+    return _mb_bi_reader_end_op(bir, MB_BI_READER_OP_READ_DATA_VIEW, ret);
 }
 
 /*!
@@ -915,169 +1321,6 @@ const char * mb_bi_reader_format_name(MbBiReader *bir)
     return bir->format->name;
 }
 
-/*!
- * \brief Force support for a boot image format by its code.
- *
- * Calling this function causes the bidding process to be skipped. The chosen
- * format will be used regardless of which formats are enabled.
- *
- * \param bir MbBiReader
- * \param code Boot image format code (\ref MB_BI_FORMAT_CODES)
- *
- * \return
- *   * #MB_BI_OK if the format is successfully enabled
- *   * \<= #MB_BI_WARN if an error occurs
- */
-int mb_bi_reader_set_format_by_code(MbBiReader *bir, int code)
-{
-    READER_ENSURE_STATE(bir, ReaderState::NEW);
-    int ret;
-    FormatReader *format = nullptr;
-
-    ret = mb_bi_reader_enable_format_by_code(bir, code);
-    if (ret < 0 && ret != MB_BI_WARN) {
-        return ret;
-    }
-
-    for (size_t i = 0; i < bir->formats_len; ++i) {
-        if ((MB_BI_FORMAT_BASE_MASK & bir->formats[i].type & code)
-                == (MB_BI_FORMAT_BASE_MASK & code)) {
-            format = &bir->formats[i];
-            break;
-        }
-    }
-
-    if (!format) {
-        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
-                               "Enabled format not found");
-        bir->state = ReaderState::FATAL;
-        return MB_BI_FATAL;
-    }
-
-    bir->format = format;
-
-    return MB_BI_OK;
-}
-
-/*!
- * \brief Force support for a boot image format by its name.
- *
- * Calling this function causes the bidding process to be skipped. The chosen
- * format will be used regardless of which formats are enabled.
- *
- * \param bir MbBiReader
- * \param name Boot image format name (\ref MB_BI_FORMAT_NAMES)
- *
- * \return
- *   * #MB_BI_OK if the format is successfully set
- *   * \<= #MB_BI_WARN if an error occurs
- */
-int mb_bi_reader_set_format_by_name(MbBiReader *bir, const char *name)
-{
-    READER_ENSURE_STATE(bir, ReaderState::NEW);
-    int ret;
-    FormatReader *format = nullptr;
-
-    ret = mb_bi_reader_enable_format_by_name(bir, name);
-    if (ret < 0 && ret != MB_BI_WARN) {
-        return ret;
-    }
-
-    for (size_t i = 0; i < bir->formats_len; ++i) {
-        if (strcmp(name, bir->formats[i].name) == 0) {
-            format = &bir->formats[i];
-            break;
-        }
-    }
-
-    if (!format) {
-        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
-                               "Enabled format not found");
-        bir->state = ReaderState::FATAL;
-        return MB_BI_FATAL;
-    }
-
-    bir->format = format;
-
-    return MB_BI_OK;
-}
-
-/*!
- * \brief Enable support for all boot image formats.
- *
- * \param bir MbBiReader
- *
- * \return
- *   * #MB_BI_OK if all formats are successfully enabled
- *   * \<= #MB_BI_FAILED if an error occurs while enabling a format
- */
-int mb_bi_reader_enable_format_all(MbBiReader *bir)
-{
-    READER_ENSURE_STATE(bir, ReaderState::NEW);
-
-    for (auto it = reader_formats; it->func; ++it) {
-        int ret = it->func(bir);
-        if (ret != MB_BI_OK && ret != MB_BI_WARN) {
-            return ret;
-        }
-    }
-
-    return MB_BI_OK;
-}
-
-/*!
- * \brief Enable support for a boot image format by its code.
- *
- * \param bir MbBiReader
- * \param code Boot image format code (\ref MB_BI_FORMAT_CODES)
- *
- * \return
- *   * #MB_BI_OK if the format is successfully enabled
- *   * #MB_BI_WARN if the format is already enabled
- *   * \<= #MB_BI_FAILED if an error occurs
- */
-int mb_bi_reader_enable_format_by_code(MbBiReader *bir, int code)
-{
-    READER_ENSURE_STATE(bir, ReaderState::NEW);
-
-    for (auto it = reader_formats; it->func; ++it) {
-        if ((code & MB_BI_FORMAT_BASE_MASK)
-                == (it->code & MB_BI_FORMAT_BASE_MASK)) {
-            return it->func(bir);
-        }
-    }
-
-    mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
-                           "Invalid format code: %d", code);
-    return MB_BI_FAILED;
-}
-
-/*!
- * \brief Enable support for a boot image format by its name.
- *
- * \param bir MbBiReader
- * \param name Boot image format name (\ref MB_BI_FORMAT_NAMES)
- *
- * \return
- *   * #MB_BI_OK if the format was successfully enabled
- *   * #MB_BI_WARN if the format is already enabled
- *   * \<= #MB_BI_FAILED if an error occurs
- */
-int mb_bi_reader_enable_format_by_name(MbBiReader *bir, const char *name)
-{
-    READER_ENSURE_STATE(bir, ReaderState::NEW);
-
-    for (auto it = reader_formats; it->func; ++it) {
-        if (strcmp(name, it->name) == 0) {
-            return it->func(bir);
-        }
-    }
-
-    mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
-                           "Invalid format name: %s", name);
-    return MB_BI_FAILED;
-}
-
 /*!
  * \brief Get error code for a failed operation.
  *
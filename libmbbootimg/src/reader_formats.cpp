@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/reader.h"
+
+#include <cstring>
+
+#include "mbbootimg/reader_p.h"
+
+/*
+ * The runtime format selection functions are kept separate from the core
+ * reader so that statically linked programs using mb::bootimg::BasicReader
+ * only pull in the formats they use.
+ */
+
+MB_BEGIN_C_DECLS
+
+static struct
+{
+    int code;
+    const char *name;
+    int (*func)(MbBiReader *);
+} reader_formats[] = {
+    {
+        MB_BI_FORMAT_ANDROID,
+        MB_BI_FORMAT_NAME_ANDROID,
+        mb_bi_reader_enable_format_android
+    }, {
+        MB_BI_FORMAT_BUMP,
+        MB_BI_FORMAT_NAME_BUMP,
+        mb_bi_reader_enable_format_bump
+    }, {
+        MB_BI_FORMAT_LOKI,
+        MB_BI_FORMAT_NAME_LOKI,
+        mb_bi_reader_enable_format_loki
+    }, {
+        MB_BI_FORMAT_MTK,
+        MB_BI_FORMAT_NAME_MTK,
+        mb_bi_reader_enable_format_mtk
+    }, {
+        MB_BI_FORMAT_SONY_ELF,
+        MB_BI_FORMAT_NAME_SONY_ELF,
+        mb_bi_reader_enable_format_sony_elf
+    }, {
+        0,
+        nullptr,
+        nullptr
+    },
+};
+
+/*!
+ * \brief Force support for a boot image format by its code.
+ *
+ * Calling this function causes the bidding process to be skipped. The chosen
+ * format will be used regardless of which formats are enabled.
+ *
+ * \param bir MbBiReader
+ * \param code Boot image format code (\ref MB_BI_FORMAT_CODES)
+ *
+ * \return
+ *   * #MB_BI_OK if the format is successfully enabled
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_reader_set_format_by_code(MbBiReader *bir, int code)
+{
+    READER_ENSURE_STATE(bir, ReaderState::NEW);
+    int ret;
+    FormatReader *format = nullptr;
+
+    ret = mb_bi_reader_enable_format_by_code(bir, code);
+    if (ret < 0 && ret != MB_BI_WARN) {
+        return ret;
+    }
+
+    for (size_t i = 0; i < bir->formats_len; ++i) {
+        if ((MB_BI_FORMAT_BASE_MASK & bir->formats[i].type & code)
+                == (MB_BI_FORMAT_BASE_MASK & code)) {
+            format = &bir->formats[i];
+            break;
+        }
+    }
+
+    if (!format) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Enabled format not found");
+        bir->state = ReaderState::FATAL;
+        return MB_BI_FATAL;
+    }
+
+    bir->format = format;
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Force support for a boot image format by its name.
+ *
+ * Calling this function causes the bidding process to be skipped. The chosen
+ * format will be used regardless of which formats are enabled.
+ *
+ * \param bir MbBiReader
+ * \param name Boot image format name (\ref MB_BI_FORMAT_NAMES)
+ *
+ * \return
+ *   * #MB_BI_OK if the format is successfully set
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_reader_set_format_by_name(MbBiReader *bir, const char *name)
+{
+    READER_ENSURE_STATE(bir, ReaderState::NEW);
+    int ret;
+    FormatReader *format = nullptr;
+
+    ret = mb_bi_reader_enable_format_by_name(bir, name);
+    if (ret < 0 && ret != MB_BI_WARN) {
+        return ret;
+    }
+
+    for (size_t i = 0; i < bir->formats_len; ++i) {
+        if (strcmp(name, bir->formats[i].name) == 0) {
+            format = &bir->formats[i];
+            break;
+        }
+    }
+
+    if (!format) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Enabled format not found");
+        bir->state = ReaderState::FATAL;
+        return MB_BI_FATAL;
+    }
+
+    bir->format = format;
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Enable support for all boot image formats.
+ *
+ * \param bir MbBiReader
+ *
+ * \return
+ *   * #MB_BI_OK if all formats are successfully enabled
+ *   * \<= #MB_BI_FAILED if an error occurs while enabling a format
+ */
+int mb_bi_reader_enable_format_all(MbBiReader *bir)
+{
+    READER_ENSURE_STATE(bir, ReaderState::NEW);
+
+    for (auto it = reader_formats; it->func; ++it) {
+        int ret = it->func(bir);
+        if (ret != MB_BI_OK && ret != MB_BI_WARN) {
+            return ret;
+        }
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Enable support for a boot image format by its code.
+ *
+ * \param bir MbBiReader
+ * \param code Boot image format code (\ref MB_BI_FORMAT_CODES)
+ *
+ * \return
+ *   * #MB_BI_OK if the format is successfully enabled
+ *   * #MB_BI_WARN if the format is already enabled
+ *   * \<= #MB_BI_FAILED if an error occurs
+ */
+int mb_bi_reader_enable_format_by_code(MbBiReader *bir, int code)
+{
+    READER_ENSURE_STATE(bir, ReaderState::NEW);
+
+    for (auto it = reader_formats; it->func; ++it) {
+        if ((code & MB_BI_FORMAT_BASE_MASK)
+                == (it->code & MB_BI_FORMAT_BASE_MASK)) {
+            return it->func(bir);
+        }
+    }
+
+    mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
+                           "Invalid format code: %d", code);
+    return MB_BI_FAILED;
+}
+
+/*!
+ * \brief Enable support for a boot image format by its name.
+ *
+ * \param bir MbBiReader
+ * \param name Boot image format name (\ref MB_BI_FORMAT_NAMES)
+ *
+ * \return
+ *   * #MB_BI_OK if the format was successfully enabled
+ *   * #MB_BI_WARN if the format is already enabled
+ *   * \<= #MB_BI_FAILED if an error occurs
+ */
+int mb_bi_reader_enable_format_by_name(MbBiReader *bir, const char *name)
+{
+    READER_ENSURE_STATE(bir, ReaderState::NEW);
+
+    for (auto it = reader_formats; it->func; ++it) {
+        if (strcmp(name, it->name) == 0) {
+            return it->func(bir);
+        }
+    }
+
+    mb_bi_reader_set_error(bir, MB_BI_ERROR_PROGRAMMER_ERROR,
+                           "Invalid format name: %s", name);
+    return MB_BI_FAILED;
+}
+
+MB_END_C_DECLS
@@ -28,6 +28,7 @@
 #include "mbcommon/file/standard.h"
 #include "mbcommon/string.h"
 
+#include "mbbootimg/basic_writer.h"
 #include "mbbootimg/entry.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/writer_p.h"
@@ -192,39 +193,6 @@
 
 MB_BEGIN_C_DECLS
 
-static struct
-{
-    int code;
-    const char *name;
-    int (*func)(MbBiWriter *);
-} writer_formats[] = {
-    {
-        MB_BI_FORMAT_ANDROID,
-        MB_BI_FORMAT_NAME_ANDROID,
-        mb_bi_writer_set_format_android
-    }, {
-        MB_BI_FORMAT_BUMP,
-        MB_BI_FORMAT_NAME_BUMP,
-        mb_bi_writer_set_format_bump
-    }, {
-        MB_BI_FORMAT_LOKI,
-        MB_BI_FORMAT_NAME_LOKI,
-        mb_bi_writer_set_format_loki
-    }, {
-        MB_BI_FORMAT_MTK,
-        MB_BI_FORMAT_NAME_MTK,
-        mb_bi_writer_set_format_mtk
-    }, {
-        MB_BI_FORMAT_SONY_ELF,
-        MB_BI_FORMAT_NAME_SONY_ELF,
-        mb_bi_writer_set_format_sony_elf
-    }, {
-        0,
-        nullptr,
-        nullptr
-    },
-};
-
 /*!
  * \brief Register a format writer
  *
@@ -345,6 +313,255 @@ int _mb_bi_writer_free_format(MbBiWriter *biw, FormatWriter *format)
     return ret;
 }
 
+/*!
+ * \brief Check that the writer is in one of the specified states
+ *
+ * Same as WRITER_ENSURE_STATE(), but reports \p func as the caller.
+ */
+static int ensure_state(MbBiWriter *biw, unsigned short states,
+                        const char *func)
+{
+    if (!(biw->state & states)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                               "%s: Invalid state: "
+                               "expected 0x%x, actual: 0x%hx",
+                               func, states, biw->state);
+        biw->state = WriterState::FATAL;
+        return MB_BI_FATAL;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Open File handle for a boot image filename
+ *
+ * The file is opened in read/write mode since some formats need to reread the
+ * file.
+ *
+ * \param[in] biw MbBiWriter
+ * \param[in] filename MBS filename
+ * \param[out] file_out Pointer to store new File handle
+ * \param[in] func Name of the calling function for error messages
+ *
+ * \return
+ *   * #MB_BI_OK if the file is successfully opened
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int _mb_bi_writer_open_file(MbBiWriter *biw, const char *filename,
+                            mb::File **file_out, const char *func)
+{
+    int ret = ensure_state(biw, WriterState::NEW, func);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    mb::File *file = new(std::nothrow) mb::StandardFile(
+            filename, mb::FileOpenMode::READ_WRITE_TRUNC);
+    if (!file) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "%s", strerror(errno));
+        return MB_BI_FAILED;
+    }
+
+    if (!file->is_open()) {
+        mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
+                               "Failed to open for writing: %s",
+                               file->error_string().c_str());
+        delete file;
+        return MB_BI_FAILED;
+    }
+
+    *file_out = file;
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Attach File handle to the writer
+ *
+ * If the writer is not in the correct state or \p format_set is false, \p file
+ * is freed if \p owned is true.
+ *
+ * \return
+ *   * #MB_BI_OK if the file is attached
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int _mb_bi_writer_open_begin(MbBiWriter *biw, mb::File *file, bool owned,
+                             bool format_set, const char *func)
+{
+    int ret;
+
+    // Ensure that the file is freed even if called in an incorrect state
+    ret = ensure_state(biw, WriterState::NEW, func);
+    if (ret != MB_BI_OK) {
+        goto done;
+    }
+
+    if (!format_set) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                               "No writer format registered");
+        ret = MB_BI_FAILED;
+        goto done;
+    }
+
+    biw->file = file;
+    biw->file_owned = owned;
+    biw->state = WriterState::HEADER;
+
+    ret = MB_BI_OK;
+
+done:
+    if (ret != MB_BI_OK) {
+        if (owned) {
+            delete file;
+        }
+    }
+    return ret;
+}
+
+/*!
+ * \brief Begin closing the writer
+ *
+ * \return Whether the format's close callback should be called
+ */
+bool _mb_bi_writer_close_begin(MbBiWriter *biw)
+{
+    // Avoid double-closing or closing nothing
+    return !(biw->state & (WriterState::CLOSED | WriterState::NEW));
+}
+
+/*!
+ * \brief Finish closing the writer
+ *
+ * Closes and frees the File handle if it is owned and moves the writer to the
+ * closed state.
+ *
+ * \param biw MbBiWriter
+ * \param ret Return value of the format's close callback
+ *
+ * \return \p ret or #MB_BI_FAILED if the file could not be closed
+ */
+int _mb_bi_writer_close_end(MbBiWriter *biw, int ret)
+{
+    if (!(biw->state & (WriterState::CLOSED | WriterState::NEW))) {
+        if (biw->file && biw->file_owned) {
+            if (!biw->file->close()) {
+                if (MB_BI_FAILED < ret) {
+                    ret = MB_BI_FAILED;
+                }
+            }
+
+            delete biw->file;
+        }
+
+        biw->file = nullptr;
+        biw->file_owned = false;
+
+        // Don't change state to WriterState::FATAL if MB_BI_FATAL is returned.
+        // Otherwise, we risk double-closing the boot image. CLOSED and FATAL
+        // are the same anyway, aside from the fact that boot images can be
+        // closed in the latter state.
+    }
+
+    biw->state = WriterState::CLOSED;
+
+    return ret;
+}
+
+/*!
+ * \brief Prepare for a writer operation
+ *
+ * Checks that the writer is in a valid state for \p op and performs the common
+ * setup for the operation. For #MB_BI_WRITER_OP_GET_HEADER, \p arg is the
+ * MbBiHeader to clear. For #MB_BI_WRITER_OP_GET_ENTRY, \p arg is the MbBiEntry
+ * to clear.
+ *
+ * \return
+ *   * #MB_BI_OK if the format callback for \p op should be called
+ *   * #MB_BI_EOF if \p op is #MB_BI_WRITER_OP_FINISH_ENTRY and there is no
+ *     entry to finish
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int _mb_bi_writer_begin_op(MbBiWriter *biw, int op, void *arg,
+                           const char *func)
+{
+    int ret;
+
+    switch (op) {
+    case MB_BI_WRITER_OP_SET_FORMAT:
+    case MB_BI_WRITER_OP_SET_OPTION:
+        return ensure_state(biw, WriterState::NEW, func);
+
+    case MB_BI_WRITER_OP_GET_HEADER:
+        ret = ensure_state(biw, WriterState::HEADER, func);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        mb_bi_header_clear(static_cast<MbBiHeader *>(arg));
+        return MB_BI_OK;
+
+    case MB_BI_WRITER_OP_WRITE_HEADER:
+        return ensure_state(biw, WriterState::HEADER, func);
+
+    case MB_BI_WRITER_OP_FINISH_ENTRY:
+        ret = ensure_state(biw, WriterState::ENTRY | WriterState::DATA, func);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        return biw->state == WriterState::DATA ? MB_BI_OK : MB_BI_EOF;
+
+    case MB_BI_WRITER_OP_GET_ENTRY:
+        ret = ensure_state(biw, WriterState::ENTRY | WriterState::DATA, func);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+
+        mb_bi_entry_clear(static_cast<MbBiEntry *>(arg));
+        return MB_BI_OK;
+
+    case MB_BI_WRITER_OP_WRITE_ENTRY:
+        return ensure_state(biw, WriterState::ENTRY, func);
+
+    case MB_BI_WRITER_OP_WRITE_DATA:
+        return ensure_state(biw, WriterState::DATA, func);
+
+    default:
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                               "%s: Invalid operation: %d", func, op);
+        return MB_BI_FAILED;
+    }
+}
+
+/*!
+ * \brief Update writer state after a format callback for \p op returns
+ *
+ * \return \p ret
+ */
+int _mb_bi_writer_end_op(MbBiWriter *biw, int op, int ret)
+{
+    if (ret == MB_BI_OK) {
+        switch (op) {
+        case MB_BI_WRITER_OP_WRITE_HEADER:
+        case MB_BI_WRITER_OP_FINISH_ENTRY:
+        case MB_BI_WRITER_OP_GET_ENTRY:
+            biw->state = WriterState::ENTRY;
+            break;
+        case MB_BI_WRITER_OP_WRITE_ENTRY:
+            biw->state = WriterState::DATA;
+            break;
+        default:
+            // Do not alter state
+            break;
+        }
+    } else if (ret <= MB_BI_FATAL) {
+        biw->state = WriterState::FATAL;
+    }
+
+    return ret;
+}
+
 /*!
  * \brief Allocate new MbBiWriter.
  *
@@ -420,23 +637,11 @@ int mb_bi_writer_free(MbBiWriter *biw)
  */
 int mb_bi_writer_open_filename(MbBiWriter *biw, const char *filename)
 {
-    WRITER_ENSURE_STATE(biw, WriterState::NEW);
-
-    mb::File *file = new(std::nothrow) mb::StandardFile(
-            filename, mb::FileOpenMode::READ_WRITE_TRUNC);
-    if (!file) {
-        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
-                               "%s", strerror(errno));
-        return MB_BI_FAILED;
-    }
+    mb::File *file;
 
-    // Open in read/write mode since some formats need to reread the file
-    if (!file->is_open()) {
-        mb_bi_writer_set_error(biw, file->error().value() /* TODO */,
-                               "Failed to open for writing: %s",
-                               file->error_string().c_str());
-        delete file;
-        return MB_BI_FAILED;
+    int ret = _mb_bi_writer_open_file(biw, filename, &file, __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
     }
 
     return mb_bi_writer_open(biw, file, true);
@@ -494,31 +699,8 @@ int mb_bi_writer_open_filename_w(MbBiWriter *biw, const wchar_t *filename)
  */
 int mb_bi_writer_open(MbBiWriter *biw, mb::File *file, bool owned)
 {
-    int ret;
-
-    // Ensure that the file is freed even if called in an incorrect state
-    WRITER_ENSURE_STATE_GOTO(biw, WriterState::NEW, ret, done);
-
-    if (!biw->format_set) {
-        mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
-                               "No writer format registered");
-        ret = MB_BI_FAILED;
-        goto done;
-    }
-
-    biw->file = file;
-    biw->file_owned = owned;
-    biw->state = WriterState::HEADER;
-
-    ret = MB_BI_OK;
-
-done:
-    if (ret != MB_BI_OK) {
-        if (owned) {
-            delete file;
-        }
-    }
-    return ret;
+    return _mb_bi_writer_open_begin(biw, file, owned, biw->format_set,
+                                    __func__);
 }
 
 /*!
@@ -539,34 +721,13 @@ int mb_bi_writer_close(MbBiWriter *biw)
 {
     int ret = MB_BI_OK;
 
-    // Avoid double-closing or closing nothing
-    if (!(biw->state & (WriterState::CLOSED | WriterState::NEW))) {
+    if (_mb_bi_writer_close_begin(biw)) {
         if (biw->format_set && biw->format.close_cb) {
             ret = biw->format.close_cb(biw, biw->format.userdata);
         }
-
-        if (biw->file && biw->file_owned) {
-            if (!biw->file->close()) {
-                if (MB_BI_FAILED < ret) {
-                    ret = MB_BI_FAILED;
-                }
-            }
-
-            delete biw->file;
-        }
-
-        biw->file = nullptr;
-        biw->file_owned = false;
-
-        // Don't change state to WriterState::FATAL if MB_BI_FATAL is returned.
-        // Otherwise, we risk double-closing the boot image. CLOSED and FATAL
-        // are the same anyway, aside from the fact that boot images can be
-        // closed in the latter state.
     }
 
-    biw->state = WriterState::CLOSED;
-
-    return ret;
+    return _mb_bi_writer_close_end(biw, ret);
 }
 
 /*!
@@ -613,10 +774,13 @@ int mb_bi_writer_get_header(MbBiWriter *biw, MbBiHeader **header)
  */
 int mb_bi_writer_get_header2(MbBiWriter *biw, MbBiHeader *header)
 {
-    WRITER_ENSURE_STATE(biw, WriterState::HEADER);
     int ret;
 
-    mb_bi_header_clear(header);
+    ret = _mb_bi_writer_begin_op(biw, MB_BI_WRITER_OP_GET_HEADER, header,
+                                 __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
 
     if (!biw->format.get_header_cb) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
@@ -626,13 +790,7 @@ int mb_bi_writer_get_header2(MbBiWriter *biw, MbBiHeader *header)
     }
 
     ret = biw->format.get_header_cb(biw, biw->format.userdata, header);
-    if (ret == MB_BI_OK) {
-        // Don't alter state
-    } else if (ret <= MB_BI_FATAL) {
-        biw->state = WriterState::FATAL;
-    }
-
-    return ret;
+    return _mb_bi_writer_end_op(biw, MB_BI_WRITER_OP_GET_HEADER, ret);
 }
 
 /*!
@@ -652,9 +810,14 @@ int mb_bi_writer_get_header2(MbBiWriter *biw, MbBiHeader *header)
  */
 int mb_bi_writer_write_header(MbBiWriter *biw, MbBiHeader *header)
 {
-    WRITER_ENSURE_STATE(biw, WriterState::HEADER);
     int ret;
 
+    ret = _mb_bi_writer_begin_op(biw, MB_BI_WRITER_OP_WRITE_HEADER, header,
+                                 __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
     if (!biw->format.write_header_cb) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Missing format write_header_cb");
@@ -663,13 +826,7 @@ int mb_bi_writer_write_header(MbBiWriter *biw, MbBiHeader *header)
     }
 
     ret = biw->format.write_header_cb(biw, biw->format.userdata, header);
-    if (ret == MB_BI_OK) {
-        biw->state = WriterState::ENTRY;
-    } else if (ret <= MB_BI_FATAL) {
-        biw->state = WriterState::FATAL;
-    }
-
-    return ret;
+    return _mb_bi_writer_end_op(biw, MB_BI_WRITER_OP_WRITE_HEADER, ret);
 }
 
 /*!
@@ -721,24 +878,28 @@ int mb_bi_writer_get_entry(MbBiWriter *biw, MbBiEntry **entry)
  */
 int mb_bi_writer_get_entry2(MbBiWriter *biw, MbBiEntry *entry)
 {
-    WRITER_ENSURE_STATE(biw, WriterState::ENTRY | WriterState::DATA);
     int ret;
 
     // Finish current entry
-    if (biw->state == WriterState::DATA && biw->format.finish_entry_cb) {
-        ret = biw->format.finish_entry_cb(biw, biw->format.userdata);
-
-        if (ret == MB_BI_OK) {
-            biw->state = WriterState::ENTRY;
-        } else if (ret <= MB_BI_FATAL) {
-            biw->state = WriterState::FATAL;
-            return ret;
-        } else {
-            return ret;
+    ret = _mb_bi_writer_begin_op(biw, MB_BI_WRITER_OP_FINISH_ENTRY, nullptr,
+                                 __func__);
+    if (ret == MB_BI_OK) {
+        if (biw->format.finish_entry_cb) {
+            ret = biw->format.finish_entry_cb(biw, biw->format.userdata);
+            ret = _mb_bi_writer_end_op(biw, MB_BI_WRITER_OP_FINISH_ENTRY, ret);
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
         }
+    } else if (ret != MB_BI_EOF) {
+        return ret;
     }
 
-    mb_bi_entry_clear(entry);
+    ret = _mb_bi_writer_begin_op(biw, MB_BI_WRITER_OP_GET_ENTRY, entry,
+                                 __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
 
     if (!biw->format.get_entry_cb) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
@@ -748,13 +909,7 @@ int mb_bi_writer_get_entry2(MbBiWriter *biw, MbBiEntry *entry)
     }
 
     ret = biw->format.get_entry_cb(biw, biw->format.userdata, entry);
-    if (ret == MB_BI_OK) {
-        biw->state = WriterState::ENTRY;
-    } else if (ret <= MB_BI_FATAL) {
-        biw->state = WriterState::FATAL;
-    }
-
-    return ret;
+    return _mb_bi_writer_end_op(biw, MB_BI_WRITER_OP_GET_ENTRY, ret);
 }
 
 /*!
@@ -776,9 +931,14 @@ int mb_bi_writer_get_entry2(MbBiWriter *biw, MbBiEntry *entry)
  */
 int mb_bi_writer_write_entry(MbBiWriter *biw, MbBiEntry *entry)
 {
-    WRITER_ENSURE_STATE(biw, WriterState::ENTRY);
     int ret;
 
+    ret = _mb_bi_writer_begin_op(biw, MB_BI_WRITER_OP_WRITE_ENTRY, entry,
+                                 __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
     if (!biw->format.write_entry_cb) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Missing format write_entry_cb");
@@ -787,13 +947,7 @@ int mb_bi_writer_write_entry(MbBiWriter *biw, MbBiEntry *entry)
     }
 
     ret = biw->format.write_entry_cb(biw, biw->format.userdata, entry);
-    if (ret == MB_BI_OK) {
-        biw->state = WriterState::DATA;
-    } else if (ret <= MB_BI_FATAL) {
-        biw->state = WriterState::FATAL;
-    }
-
-    return ret;
+    return _mb_bi_writer_end_op(biw, MB_BI_WRITER_OP_WRITE_ENTRY, ret);
 }
 
 /*!
@@ -811,9 +965,14 @@ int mb_bi_writer_write_entry(MbBiWriter *biw, MbBiEntry *entry)
 int mb_bi_writer_write_data(MbBiWriter *biw, const void *buf, size_t size,
                             size_t *bytes_written)
 {
-    WRITER_ENSURE_STATE(biw, WriterState::DATA);
     int ret;
 
+    ret = _mb_bi_writer_begin_op(biw, MB_BI_WRITER_OP_WRITE_DATA, nullptr,
+                                 __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
     if (!biw->format.write_data_cb) {
         mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
                                "Missing format write_data_cb");
@@ -823,13 +982,7 @@ int mb_bi_writer_write_data(MbBiWriter *biw, const void *buf, size_t size,
 
     ret = biw->format.write_data_cb(biw, biw->format.userdata, buf, size,
                                     *bytes_written);
-    if (ret == MB_BI_OK) {
-        // Do not alter state. Stay in WriterState::DATA
-    } else if (ret <= MB_BI_FATAL) {
-        biw->state = WriterState::FATAL;
-    }
-
-    return ret;
+    return _mb_bi_writer_end_op(biw, MB_BI_WRITER_OP_WRITE_DATA, ret);
 }
 
 /*!
@@ -869,54 +1022,45 @@ const char * mb_bi_writer_format_name(MbBiWriter *biw)
 }
 
 /*!
- * \brief Set boot image output format by its code.
+ * \brief Set format-specific option.
+ *
+ * The option is passed to the selected format writer. The format must be set
+ * with one of the `mb_bi_writer_set_format_*()` functions before calling this
+ * function.
  *
  * \param biw MbBiWriter
- * \param code Boot image format code (\ref MB_BI_FORMAT_CODES)
+ * \param key Option name
+ * \param value Option value
  *
  * \return
- *   * #MB_BI_OK if the format is successfully enabled
- *   * \<= #MB_BI_WARN if an error occurs
+ *   * #MB_BI_OK if the option is successfully set
+ *   * #MB_BI_WARN if the option is not supported by the format
+ *   * \<= #MB_BI_FAILED if an error occurs
  */
-int mb_bi_writer_set_format_by_code(MbBiWriter *biw, int code)
+int mb_bi_writer_set_option(MbBiWriter *biw, const char *key,
+                            const char *value)
 {
-    WRITER_ENSURE_STATE(biw, WriterState::NEW);
+    int ret;
 
-    for (auto it = writer_formats; it->func; ++it) {
-        if ((code & MB_BI_FORMAT_BASE_MASK)
-                == (it->code & MB_BI_FORMAT_BASE_MASK)) {
-            return it->func(biw);
-        }
+    ret = _mb_bi_writer_begin_op(biw, MB_BI_WRITER_OP_SET_OPTION, nullptr,
+                                 __func__);
+    if (ret != MB_BI_OK) {
+        return ret;
     }
 
-    mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
-                           "Invalid format code: %d", code);
-    return MB_BI_FAILED;
-}
-
-/*!
- * \brief Set boot image output format by its name.
- *
- * \param biw MbBiWriter
- * \param name Boot image format name (\ref MB_BI_FORMAT_NAMES)
- *
- * \return
- *   * #MB_BI_OK if the format is successfully enabled
- *   * \<= #MB_BI_WARN if an error occurs
- */
-int mb_bi_writer_set_format_by_name(MbBiWriter *biw, const char *name)
-{
-    WRITER_ENSURE_STATE(biw, WriterState::NEW);
+    if (!biw->format_set) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                               "No format selected");
+        return MB_BI_FAILED;
+    }
 
-    for (auto it = writer_formats; it->func; ++it) {
-        if (strcmp(name, it->name) == 0) {
-            return it->func(biw);
-        }
+    if (!biw->format.set_option_cb) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_UNSUPPORTED,
+                               "Format does not support any options");
+        return MB_BI_WARN;
     }
 
-    mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
-                           "Invalid format name: %s", name);
-    return MB_BI_FAILED;
+    return biw->format.set_option_cb(biw, biw->format.userdata, key, value);
 }
 
 /*!
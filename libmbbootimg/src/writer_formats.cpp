@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbbootimg/writer.h"
+
+#include <cstring>
+
+#include "mbbootimg/writer_p.h"
+
+/*
+ * The runtime format selection functions are kept separate from the core
+ * writer so that statically linked programs using mb::bootimg::BasicWriter
+ * only pull in the formats they use.
+ */
+
+MB_BEGIN_C_DECLS
+
+static struct
+{
+    int code;
+    const char *name;
+    int (*func)(MbBiWriter *);
+} writer_formats[] = {
+    {
+        MB_BI_FORMAT_ANDROID,
+        MB_BI_FORMAT_NAME_ANDROID,
+        mb_bi_writer_set_format_android
+    }, {
+        MB_BI_FORMAT_BUMP,
+        MB_BI_FORMAT_NAME_BUMP,
+        mb_bi_writer_set_format_bump
+    }, {
+        MB_BI_FORMAT_LOKI,
+        MB_BI_FORMAT_NAME_LOKI,
+        mb_bi_writer_set_format_loki
+    }, {
+        MB_BI_FORMAT_MTK,
+        MB_BI_FORMAT_NAME_MTK,
+        mb_bi_writer_set_format_mtk
+    }, {
+        MB_BI_FORMAT_SONY_ELF,
+        MB_BI_FORMAT_NAME_SONY_ELF,
+        mb_bi_writer_set_format_sony_elf
+    }, {
+        0,
+        nullptr,
+        nullptr
+    },
+};
+
+/*!
+ * \brief Set boot image output format by its code.
+ *
+ * \param biw MbBiWriter
+ * \param code Boot image format code (\ref MB_BI_FORMAT_CODES)
+ *
+ * \return
+ *   * #MB_BI_OK if the format is successfully enabled
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_writer_set_format_by_code(MbBiWriter *biw, int code)
+{
+    WRITER_ENSURE_STATE(biw, WriterState::NEW);
+
+    for (auto it = writer_formats; it->func; ++it) {
+        if ((code & MB_BI_FORMAT_BASE_MASK)
+                == (it->code & MB_BI_FORMAT_BASE_MASK)) {
+            return it->func(biw);
+        }
+    }
+
+    mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                           "Invalid format code: %d", code);
+    return MB_BI_FAILED;
+}
+
+/*!
+ * \brief Set boot image output format by its name.
+ *
+ * \param biw MbBiWriter
+ * \param name Boot image format name (\ref MB_BI_FORMAT_NAMES)
+ *
+ * \return
+ *   * #MB_BI_OK if the format is successfully enabled
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int mb_bi_writer_set_format_by_name(MbBiWriter *biw, const char *name)
+{
+    WRITER_ENSURE_STATE(biw, WriterState::NEW);
+
+    for (auto it = writer_formats; it->func; ++it) {
+        if (strcmp(name, it->name) == 0) {
+            return it->func(biw);
+        }
+    }
+
+    mb_bi_writer_set_error(biw, MB_BI_ERROR_PROGRAMMER_ERROR,
+                           "Invalid format name: %s", name);
+    return MB_BI_FAILED;
+}
+
+MB_END_C_DECLS
@@ -24,9 +24,11 @@
 #include "mbcommon/file.h"
 #include "mbcommon/file/memory.h"
 
+#include "mbbootimg/basic_reader.h"
 #include "mbbootimg/entry.h"
 #include "mbbootimg/format/android_reader_p.h"
 #include "mbbootimg/reader.h"
+#include "mbbootimg/reader_p.h"
 
 typedef std::unique_ptr<MbBiHeader, decltype(mb_bi_header_free) *> ScopedHeader;
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
@@ -128,6 +130,74 @@ TEST(FindAndroidHeaderTest, TruncatedHeaderShouldWarn)
                        "exceeds file size"));
 }
 
+TEST(FindAndroidHeaderTest, ProbeResultShouldBeShared)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    unsigned char data[32 + sizeof(AndroidHeader)] = {};
+    memcpy(data + 32, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+
+    AndroidHeader header;
+    uint64_t offset;
+
+    mb::MemoryFile file(data, sizeof(data));
+    ASSERT_TRUE(file.is_open());
+
+    bir->file = &file;
+    ASSERT_EQ(_mb_bi_reader_read_probe(bir.get()), MB_BI_OK);
+
+    ASSERT_EQ(find_android_header(bir.get(), &file,
+                                  ANDROID_MAX_HEADER_OFFSET,
+                                  &header, &offset), MB_BI_OK);
+    ASSERT_EQ(offset, 32u);
+    ASSERT_TRUE(bir->android_hdr_searched);
+    ASSERT_TRUE(bir->android_hdr_found);
+
+    // Smaller search windows are answered from the shared result
+    ASSERT_EQ(find_android_header(bir.get(), &file, 16, &header, &offset),
+              MB_BI_WARN);
+    ASSERT_TRUE(strstr(mb_bi_reader_error_string(bir.get()),
+                       "Android magic not found"));
+    ASSERT_EQ(find_android_header(bir.get(), &file, 32, &header, &offset),
+              MB_BI_OK);
+    ASSERT_EQ(offset, 32u);
+
+    // Releasing the probe buffer invalidates the shared result
+    ASSERT_EQ(_mb_bi_reader_open_end(bir.get(), MB_BI_OK), MB_BI_OK);
+    ASSERT_FALSE(bir->android_hdr_searched);
+
+    bir->file = nullptr;
+}
+
+TEST(FindAndroidHeaderTest, MissingMagicInSmallWindowShouldSearchAgain)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    unsigned char data[64 + sizeof(AndroidHeader)] = {};
+    memcpy(data + 64, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+
+    AndroidHeader header;
+    uint64_t offset;
+
+    mb::MemoryFile file(data, sizeof(data));
+    ASSERT_TRUE(file.is_open());
+
+    bir->file = &file;
+    ASSERT_EQ(_mb_bi_reader_read_probe(bir.get()), MB_BI_OK);
+
+    // The header may still be found beyond a smaller window
+    ASSERT_EQ(find_android_header(bir.get(), &file, 16, &header, &offset),
+              MB_BI_WARN);
+    ASSERT_EQ(find_android_header(bir.get(), &file,
+                                  ANDROID_MAX_HEADER_OFFSET,
+                                  &header, &offset), MB_BI_OK);
+    ASSERT_EQ(offset, 64u);
+
+    bir->file = nullptr;
+}
+
 // Tests for find_samsung_seandroid_magic()
 
 TEST(FindSEAndroidMagicTest, ValidMagicShouldSucceed)
@@ -412,3 +482,53 @@ TEST_F(AndroidReaderGoToEntryTest, GoToMissingEntryShouldFail)
     // In EOF state now, so next read should return MB_BI_EOF
     ASSERT_EQ(mb_bi_reader_read_entry(_bir.get(), &entry), MB_BI_EOF);
 }
+
+TEST_F(AndroidReaderGoToEntryTest, ReadDataViewShouldSucceed)
+{
+    MbBiEntry *entry;
+    const void *data;
+    size_t size;
+    char buf[50];
+    size_t n;
+
+    ASSERT_EQ(mb_bi_reader_go_to_entry(_bir.get(), &entry, MB_BI_ENTRY_RAMDISK),
+              MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_read_data_view(_bir.get(), &data, &size), MB_BI_OK);
+    ASSERT_EQ(size, 7u);
+    ASSERT_EQ(memcmp(data, "ramdisk", size), 0);
+    ASSERT_EQ(data, _data.data() + 2 * 2048);
+
+    // Entry should be fully consumed
+    ASSERT_EQ(mb_bi_reader_read_data_view(_bir.get(), &data, &size), MB_BI_EOF);
+    ASSERT_EQ(mb_bi_reader_read_data(_bir.get(), buf, sizeof(buf), &n),
+              MB_BI_EOF);
+
+    // We should continue at the next entry
+    ASSERT_EQ(mb_bi_reader_read_entry(_bir.get(), &entry), MB_BI_OK);
+    ASSERT_EQ(mb_bi_entry_type(entry), MB_BI_ENTRY_SECONDBOOT);
+    ASSERT_EQ(mb_bi_reader_read_data(_bir.get(), buf, sizeof(buf), &n),
+              MB_BI_OK);
+    ASSERT_EQ(n, 10u);
+    ASSERT_EQ(memcmp(buf, "secondboot", n), 0);
+}
+
+TEST_F(AndroidReaderGoToEntryTest, ReadDataViewAfterPartialReadShouldSucceed)
+{
+    MbBiEntry *entry;
+    const void *data;
+    size_t size;
+    char buf[3];
+    size_t n;
+
+    ASSERT_EQ(mb_bi_reader_go_to_entry(_bir.get(), &entry,
+                                       MB_BI_ENTRY_SECONDBOOT),
+              MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_read_data(_bir.get(), buf, sizeof(buf), &n),
+              MB_BI_OK);
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(mb_bi_reader_read_data_view(_bir.get(), &data, &size), MB_BI_OK);
+    ASSERT_EQ(size, 7u);
+    ASSERT_EQ(memcmp(data, "ondboot", size), 0);
+
+    ASSERT_EQ(mb_bi_reader_read_entry(_bir.get(), &entry), MB_BI_EOF);
+}
@@ -20,7 +20,9 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <string>
 
+#include "mbcommon/file/callbacks.h"
 #include "mbcommon/file/memory.h"
 
 #include "mbbootimg/entry.h"
@@ -155,3 +157,127 @@ TEST_F(AndroidWriterSHA1Test, HandlesKernelRamdiskSecondbootDT)
     TestChecksum(expected, MB_BI_ENTRY_KERNEL | MB_BI_ENTRY_RAMDISK
             | MB_BI_ENTRY_SECONDBOOT | MB_BI_ENTRY_DEVICE_TREE);
 }
+
+static void write_test_image(MbBiWriter *biw)
+{
+    MbBiHeader *header;
+    MbBiEntry *entry;
+    int ret;
+    size_t n;
+
+    ASSERT_EQ(mb_bi_writer_get_header(biw, &header), MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_write_header(biw, header), MB_BI_OK);
+
+    while ((ret = mb_bi_writer_get_entry(biw, &entry)) == MB_BI_OK) {
+        ASSERT_EQ(mb_bi_writer_write_entry(biw, entry), MB_BI_OK);
+
+        if (mb_bi_entry_type(entry) & (MB_BI_ENTRY_KERNEL
+                | MB_BI_ENTRY_RAMDISK)) {
+            ASSERT_EQ(mb_bi_writer_write_data(biw, "hello", 5, &n), MB_BI_OK);
+            ASSERT_EQ(n, 5u);
+        }
+    }
+    ASSERT_EQ(ret, MB_BI_EOF);
+
+    ASSERT_EQ(mb_bi_writer_close(biw), MB_BI_OK);
+}
+
+static bool append_cb(mb::File &file, void *userdata,
+                      const void *buf, size_t size, size_t &bytes_written)
+{
+    (void) file;
+    static_cast<std::string *>(userdata)->append(
+            static_cast<const char *>(buf), size);
+    bytes_written = size;
+    return true;
+}
+
+TEST(AndroidWriterTest, StreamingToUnseekableFileShouldMatchSeekableOutput)
+{
+    void *buf = nullptr;
+    size_t buf_size = 0;
+    std::string streamed;
+
+    {
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+
+        mb::MemoryFile file(&buf, &buf_size);
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+        write_test_image(biw.get());
+    }
+
+    {
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+
+        // Only sequential writes are supported
+        mb::CallbackFile file(nullptr, nullptr, nullptr, &append_cb, nullptr,
+                              nullptr, &streamed);
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_set_option(biw.get(), "streaming", "true"),
+                  MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+        write_test_image(biw.get());
+    }
+
+    ASSERT_EQ(streamed.size(), buf_size);
+    ASSERT_EQ(memcmp(streamed.data(), buf, buf_size), 0);
+
+    free(buf);
+}
+
+TEST(AndroidWriterTest, ParallelHashShouldMatchSerialOutput)
+{
+    void *buf1 = nullptr;
+    size_t buf1_size = 0;
+    void *buf2 = nullptr;
+    size_t buf2_size = 0;
+
+    {
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+
+        mb::MemoryFile file(&buf1, &buf1_size);
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+        write_test_image(biw.get());
+    }
+
+    {
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+
+        mb::MemoryFile file(&buf2, &buf2_size);
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_set_option(biw.get(), "parallel_hash", "true"),
+                  MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+        write_test_image(biw.get());
+    }
+
+    ASSERT_EQ(buf1_size, buf2_size);
+    ASSERT_EQ(memcmp(buf1, buf2, buf1_size), 0);
+
+    free(buf1);
+    free(buf2);
+}
+
+TEST(AndroidWriterTest, SetUnknownOptionShouldWarn)
+{
+    ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+    ASSERT_TRUE(!!biw);
+
+    ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_writer_set_option(biw.get(), "foo", "bar"), MB_BI_WARN);
+}
@@ -226,7 +226,7 @@ TEST(LokiOldFindGzipOffsetTest, ZeroFlagHeaderFoundShouldSucceed)
     ASSERT_TRUE(!!bir);
 
     unsigned char data[] = {
-        0x1f, 0x8b, 0x08, 0x00,
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
     };
 
     uint64_t gzip_offset;
@@ -246,7 +246,7 @@ TEST(LokiOldFindGzipOffsetTest, EightFlagHeaderFoundShouldSucceed)
     ASSERT_TRUE(!!bir);
 
     unsigned char data[] = {
-        0x1f, 0x8b, 0x08, 0x08,
+        0x1f, 0x8b, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
     };
 
     uint64_t gzip_offset;
@@ -266,8 +266,8 @@ TEST(LokiOldFindGzipOffsetTest, EightFlagShouldHavePrecedence)
     ASSERT_TRUE(!!bir);
 
     unsigned char data[] = {
-        0x1f, 0x8b, 0x08, 0x00,
-        0x1f, 0x8b, 0x08, 0x08,
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
+        0x1f, 0x8b, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
     };
 
     uint64_t gzip_offset;
@@ -278,7 +278,7 @@ TEST(LokiOldFindGzipOffsetTest, EightFlagShouldHavePrecedence)
     ASSERT_EQ(loki_old_find_gzip_offset(bir.get(), &file, 0, &gzip_offset),
               MB_BI_OK);
 
-    ASSERT_EQ(gzip_offset, 4u);
+    ASSERT_EQ(gzip_offset, 10u);
 }
 
 TEST(LokiOldFindGzipOffsetTest, StartOffsetShouldBeRespected)
@@ -287,8 +287,8 @@ TEST(LokiOldFindGzipOffsetTest, StartOffsetShouldBeRespected)
     ASSERT_TRUE(!!bir);
 
     unsigned char data[] = {
-        0x1f, 0x8b, 0x08, 0x00,
-        0x1f, 0x8b, 0x08, 0x00,
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
+        0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
     };
 
     uint64_t gzip_offset;
@@ -299,7 +299,36 @@ TEST(LokiOldFindGzipOffsetTest, StartOffsetShouldBeRespected)
     ASSERT_EQ(loki_old_find_gzip_offset(bir.get(), &file, 4, &gzip_offset),
               MB_BI_OK);
 
-    ASSERT_EQ(gzip_offset, 4u);
+    ASSERT_EQ(gzip_offset, 10u);
+}
+
+TEST(LokiOldFindGzipOffsetTest, InvalidHeaderFieldsShouldBeSkipped)
+{
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    unsigned char data[] = {
+        // Unknown flags
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03,
+        // MTIME out of range
+        0x1f, 0x8b, 0x08, 0x08, 0x00, 0x00, 0x00, 0x80, 0x00, 0x03,
+        // Invalid extra flags
+        0x1f, 0x8b, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x01, 0x03,
+        // Unknown OS
+        0x1f, 0x8b, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20,
+        // Valid
+        0x1f, 0x8b, 0x08, 0x00, 0x5c, 0x1d, 0x3a, 0x59, 0x02, 0x03,
+    };
+
+    uint64_t gzip_offset;
+
+    mb::MemoryFile file(data, sizeof(data));
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(loki_old_find_gzip_offset(bir.get(), &file, 0, &gzip_offset),
+              MB_BI_OK);
+
+    ASSERT_EQ(gzip_offset, 40u);
 }
 
 TEST(LokiOldFindGzipOffsetTest, MissingMagicShouldWarn)
@@ -318,13 +347,13 @@ TEST(LokiOldFindGzipOffsetTest, MissingMagicShouldWarn)
                        "No gzip headers found"));
 }
 
-TEST(LokiOldFindGzipOffsetTest, MissingFlagsShouldWarn)
+TEST(LokiOldFindGzipOffsetTest, TruncatedHeaderShouldWarn)
 {
     ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
     ASSERT_TRUE(!!bir);
 
     unsigned char data[] = {
-        0x1f, 0x8b, 0x08,
+        0x1f, 0x8b, 0x08, 0x08, 0x00,
     };
 
     uint64_t gzip_offset;
@@ -332,7 +361,7 @@ TEST(LokiOldFindGzipOffsetTest, MissingFlagsShouldWarn)
     mb::MemoryFile file(data, sizeof(data));
     ASSERT_TRUE(file.is_open());
 
-    ASSERT_EQ(loki_old_find_gzip_offset(bir.get(), &file, 4, &gzip_offset),
+    ASSERT_EQ(loki_old_find_gzip_offset(bir.get(), &file, 0, &gzip_offset),
               MB_BI_WARN);
     ASSERT_TRUE(strstr(mb_bi_reader_error_string(bir.get()),
                        "No gzip headers found"));
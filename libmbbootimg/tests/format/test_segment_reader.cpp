@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/format/segment_reader_p.h"
+#include "mbbootimg/reader.h"
+
+typedef std::unique_ptr<MbBiEntry, decltype(mb_bi_entry_free) *> ScopedEntry;
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+
+struct SegmentReaderTest : testing::Test
+{
+    ScopedReader _bir;
+    ScopedEntry _entry;
+    std::vector<unsigned char> _data;
+    mb::MemoryFile _file;
+    SegmentReaderCtx _ctx;
+
+    // Entries straddle read-ahead block boundaries
+    static constexpr uint32_t first_offset = 100;
+    static constexpr uint32_t first_size =
+            SEGMENT_READER_READ_AHEAD_SIZE + 1000;
+    static constexpr uint32_t second_offset = first_offset + first_size;
+    static constexpr uint32_t second_size =
+            SEGMENT_READER_READ_AHEAD_SIZE * 2 + 3;
+
+    SegmentReaderTest()
+        : _bir(mb_bi_reader_new(), &mb_bi_reader_free)
+        , _entry(mb_bi_entry_new(), &mb_bi_entry_free)
+    {
+    }
+
+    virtual void SetUp() override
+    {
+        ASSERT_TRUE(!!_bir);
+        ASSERT_TRUE(!!_entry);
+
+        _data.resize(second_offset + second_size);
+        for (size_t i = 0; i < _data.size(); ++i) {
+            _data[i] = static_cast<unsigned char>(i * 31 + (i >> 12));
+        }
+
+        ASSERT_TRUE(_file.open(_data.data(), _data.size()));
+        ASSERT_TRUE(_file.set_stats_enabled(true));
+
+        ASSERT_EQ(_segment_reader_init(&_ctx), MB_BI_OK);
+        ASSERT_EQ(_segment_reader_entries_add(
+                &_ctx, MB_BI_ENTRY_KERNEL, first_offset, first_size, false,
+                _bir.get()), MB_BI_OK);
+        ASSERT_EQ(_segment_reader_entries_add(
+                &_ctx, MB_BI_ENTRY_RAMDISK, second_offset, second_size, false,
+                _bir.get()), MB_BI_OK);
+    }
+
+    virtual void TearDown() override
+    {
+        _segment_reader_deinit(&_ctx);
+    }
+
+    std::string expected(uint32_t offset, uint32_t size)
+    {
+        return std::string(reinterpret_cast<char *>(_data.data()) + offset,
+                           size);
+    }
+
+    // Read remaining data of the current entry using buf_size sized reads
+    std::string read_all(size_t buf_size)
+    {
+        std::string result;
+        std::vector<char> buf(buf_size);
+        size_t n;
+        int ret;
+
+        while ((ret = _segment_reader_read_data(&_ctx, &_file, buf.data(),
+                                                buf.size(), n, _bir.get()))
+                == MB_BI_OK) {
+            result.append(buf.data(), n);
+        }
+        EXPECT_EQ(ret, MB_BI_EOF);
+
+        return result;
+    }
+};
+
+TEST_F(SegmentReaderTest, SmallReadsShouldBeCoalesced)
+{
+    ASSERT_EQ(_segment_reader_read_entry(&_ctx, &_file, _entry.get(),
+                                         _bir.get()), MB_BI_OK);
+    ASSERT_EQ(read_all(4096), expected(first_offset, first_size));
+
+    ASSERT_EQ(_segment_reader_read_entry(&_ctx, &_file, _entry.get(),
+                                         _bir.get()), MB_BI_OK);
+    ASSERT_EQ(read_all(1000), expected(second_offset, second_size));
+
+    // One read per aligned block plus the final EOF read for each entry
+    ASSERT_LE(_file.stats().read_calls, 8u);
+}
+
+TEST_F(SegmentReaderTest, LargeReadsShouldBypassBuffer)
+{
+    ASSERT_EQ(_segment_reader_read_entry(&_ctx, &_file, _entry.get(),
+                                         _bir.get()), MB_BI_OK);
+
+    std::vector<char> buf(SEGMENT_READER_READ_AHEAD_SIZE * 4);
+    size_t n;
+
+    ASSERT_EQ(_segment_reader_read_data(&_ctx, &_file, buf.data(), 10, n,
+                                        _bir.get()), MB_BI_OK);
+    ASSERT_EQ(n, 10u);
+    ASSERT_EQ(std::string(buf.data(), n), expected(first_offset, 10));
+
+    // Drains the buffered block, then reads the rest directly
+    ASSERT_EQ(_segment_reader_read_data(&_ctx, &_file, buf.data(), buf.size(),
+                                        n, _bir.get()), MB_BI_OK);
+    ASSERT_EQ(n, first_size - 10);
+    ASSERT_EQ(std::string(buf.data(), n),
+              expected(first_offset + 10, first_size - 10));
+}
+
+TEST_F(SegmentReaderTest, NextEntryAfterPartialReadShouldSucceed)
+{
+    ASSERT_EQ(_segment_reader_read_entry(&_ctx, &_file, _entry.get(),
+                                         _bir.get()), MB_BI_OK);
+
+    char buf[16];
+    size_t n;
+
+    // Leaves unconsumed data in the read-ahead buffer
+    ASSERT_EQ(_segment_reader_read_data(&_ctx, &_file, buf, sizeof(buf), n,
+                                        _bir.get()), MB_BI_OK);
+
+    ASSERT_EQ(_segment_reader_read_entry(&_ctx, &_file, _entry.get(),
+                                         _bir.get()), MB_BI_OK);
+    ASSERT_EQ(read_all(512), expected(second_offset, second_size));
+
+    // Going back to the first entry must not reuse buffered data
+    ASSERT_EQ(_segment_reader_go_to_entry(&_ctx, &_file, _entry.get(),
+                                          MB_BI_ENTRY_KERNEL, _bir.get()),
+              MB_BI_OK);
+    ASSERT_EQ(read_all(777), expected(first_offset, first_size));
+}
+
+TEST_F(SegmentReaderTest, TruncatedEntryShouldFail)
+{
+    _data.resize(second_offset + 10);
+    ASSERT_TRUE(_file.close());
+    ASSERT_TRUE(_file.open(_data.data(), _data.size()));
+
+    ASSERT_EQ(_segment_reader_go_to_entry(&_ctx, &_file, _entry.get(),
+                                          MB_BI_ENTRY_RAMDISK, _bir.get()),
+              MB_BI_OK);
+
+    char buf[64];
+    size_t n;
+
+    ASSERT_EQ(_segment_reader_read_data(&_ctx, &_file, buf, sizeof(buf), n,
+                                        _bir.get()), MB_BI_OK);
+    ASSERT_EQ(n, 10u);
+    ASSERT_EQ(_segment_reader_read_data(&_ctx, &_file, buf, sizeof(buf), n,
+                                        _bir.get()), MB_BI_FATAL);
+    ASSERT_TRUE(strstr(mb_bi_reader_error_string(_bir.get()),
+                       "Entry is truncated"));
+}
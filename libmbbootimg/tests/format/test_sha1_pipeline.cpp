@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <cstring>
+
+#include <openssl/sha.h>
+
+#include "mbbootimg/format/sha1_pipeline_p.h"
+
+
+static std::vector<unsigned char> make_data(size_t size)
+{
+    std::vector<unsigned char> data(size);
+    uint32_t state = 0x12345678;
+
+    for (auto &c : data) {
+        state = state * 1103515245 + 12345;
+        c = static_cast<unsigned char>(state >> 16);
+    }
+
+    return data;
+}
+
+TEST(Sha1PipelineTest, DigestShouldMatchSinglePass)
+{
+    auto data = make_data(256 * 1024 + 123);
+
+    unsigned char expected[SHA_DIGEST_LENGTH];
+    SHA1(data.data(), data.size(), expected);
+
+    // Use a small buffer so that the ring wraps around and update() blocks
+    for (size_t chunk_size : { 1u, 7u, 4096u, 65537u }) {
+        SHA_CTX ctx;
+        ASSERT_TRUE(SHA1_Init(&ctx));
+
+        Sha1Pipeline pipeline(&ctx, 10000);
+
+        for (size_t i = 0; i < data.size(); i += chunk_size) {
+            size_t n = std::min(chunk_size, data.size() - i);
+            ASSERT_TRUE(pipeline.update(data.data() + i, n));
+        }
+
+        ASSERT_TRUE(pipeline.finish());
+
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        ASSERT_TRUE(SHA1_Final(digest, &ctx));
+        ASSERT_EQ(memcmp(digest, expected, sizeof(digest)), 0)
+                << "Chunk size: " << chunk_size;
+    }
+}
+
+TEST(Sha1PipelineTest, UpdateAfterFinishShouldFail)
+{
+    SHA_CTX ctx;
+    ASSERT_TRUE(SHA1_Init(&ctx));
+
+    Sha1Pipeline pipeline(&ctx);
+    ASSERT_TRUE(pipeline.finish());
+    ASSERT_FALSE(pipeline.update("x", 1));
+
+    // Finishing again is a no-op
+    ASSERT_TRUE(pipeline.finish());
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/basic_reader.h"
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+typedef std::unique_ptr<MbBiHeader, decltype(mb_bi_header_free) *> ScopedHeader;
+typedef std::unique_ptr<MbBiEntry, decltype(mb_bi_entry_free) *> ScopedEntry;
+
+using namespace mb::bootimg;
+
+struct BasicReaderTest : public ::testing::Test
+{
+protected:
+    void *_buf;
+    size_t _buf_size;
+
+    BasicReaderTest() : _buf(nullptr), _buf_size(0)
+    {
+    }
+
+    virtual ~BasicReaderTest()
+    {
+        free(_buf);
+    }
+
+    virtual void SetUp()
+    {
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+
+        mb::MemoryFile file(&_buf, &_buf_size);
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        int ret;
+        size_t n;
+
+        ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+        while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+            ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+
+            if (mb_bi_entry_type(entry) & (MB_BI_ENTRY_KERNEL
+                    | MB_BI_ENTRY_RAMDISK)) {
+                ASSERT_EQ(mb_bi_writer_write_data(biw.get(), "hello", 5, &n),
+                          MB_BI_OK);
+            }
+        }
+        ASSERT_EQ(ret, MB_BI_EOF);
+
+        ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+    }
+};
+
+TEST_F(BasicReaderTest, ReadImageWithMultipleFormats)
+{
+    BasicReader<AndroidFormat, LokiFormat> reader;
+    ASSERT_TRUE(reader.is_valid());
+
+    mb::MemoryFile file(_buf, _buf_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(reader.open(&file, false), MB_BI_OK);
+    ASSERT_EQ(reader.format_code(), MB_BI_FORMAT_ANDROID);
+    ASSERT_STREQ(reader.format_name(), MB_BI_FORMAT_NAME_ANDROID);
+
+    ScopedHeader header(mb_bi_header_new(), mb_bi_header_free);
+    ASSERT_TRUE(!!header);
+    ASSERT_EQ(reader.read_header(header.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_page_size(header.get()), 2048u);
+
+    ScopedEntry entry(mb_bi_entry_new(), mb_bi_entry_free);
+    ASSERT_TRUE(!!entry);
+    char buf[16];
+    size_t n;
+
+    ASSERT_EQ(reader.go_to_entry(entry.get(), MB_BI_ENTRY_RAMDISK), MB_BI_OK);
+    ASSERT_EQ(mb_bi_entry_type(entry.get()), MB_BI_ENTRY_RAMDISK);
+    ASSERT_EQ(reader.read_data(buf, sizeof(buf), &n), MB_BI_OK);
+    ASSERT_EQ(n, 5u);
+    ASSERT_EQ(memcmp(buf, "hello", 5), 0);
+
+    int ret;
+    while ((ret = reader.read_entry(entry.get())) == MB_BI_OK);
+    ASSERT_EQ(ret, MB_BI_EOF);
+
+    ASSERT_EQ(reader.close(), MB_BI_OK);
+}
+
+TEST_F(BasicReaderTest, OpenShouldFailIfFormatIsNotIncluded)
+{
+    BasicReader<SonyElfFormat> reader;
+    ASSERT_TRUE(reader.is_valid());
+
+    mb::MemoryFile file(_buf, _buf_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(reader.open(&file, false), MB_BI_FAILED);
+    ASSERT_EQ(reader.error(), MB_BI_ERROR_FILE_FORMAT);
+    ASSERT_STREQ(reader.error_string(),
+                 "Failed to determine boot image format");
+    ASSERT_EQ(reader.format_code(), -1);
+}
+
+TEST_F(BasicReaderTest, SetFormatShouldSkipBidding)
+{
+    BasicReader<AndroidFormat, BumpFormat> reader;
+    ASSERT_TRUE(reader.is_valid());
+
+    mb::MemoryFile file(_buf, _buf_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(reader.set_format<BumpFormat>(), MB_BI_OK);
+    ASSERT_EQ(reader.open(&file, false), MB_BI_OK);
+    ASSERT_EQ(reader.format_code(), MB_BI_FORMAT_BUMP);
+
+    ScopedHeader header(mb_bi_header_new(), mb_bi_header_free);
+    ASSERT_TRUE(!!header);
+    ASSERT_EQ(reader.read_header(header.get()), MB_BI_OK);
+}
+
+TEST_F(BasicReaderTest, OperationsShouldCheckState)
+{
+    BasicReader<AndroidFormat> reader;
+    ASSERT_TRUE(reader.is_valid());
+
+    ScopedHeader header(mb_bi_header_new(), mb_bi_header_free);
+    ASSERT_TRUE(!!header);
+
+    ASSERT_EQ(reader.read_header(header.get()), MB_BI_FATAL);
+    ASSERT_EQ(reader.error(), MB_BI_ERROR_PROGRAMMER_ERROR);
+    ASSERT_NE(strstr(reader.error_string(), "read_header"), nullptr);
+}
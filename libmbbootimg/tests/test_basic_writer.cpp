@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/basic_writer.h"
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+typedef std::unique_ptr<MbBiHeader, decltype(mb_bi_header_free) *> ScopedHeader;
+typedef std::unique_ptr<MbBiEntry, decltype(mb_bi_entry_free) *> ScopedEntry;
+
+using namespace mb::bootimg;
+
+template<typename Writer>
+static void write_test_image(Writer &writer)
+{
+    ScopedHeader header(mb_bi_header_new(), mb_bi_header_free);
+    ASSERT_TRUE(!!header);
+    ScopedEntry entry(mb_bi_entry_new(), mb_bi_entry_free);
+    ASSERT_TRUE(!!entry);
+    int ret;
+    size_t n;
+
+    ASSERT_EQ(writer.get_header(header.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_header_set_page_size(header.get(), 2048), MB_BI_OK);
+    ASSERT_EQ(writer.write_header(header.get()), MB_BI_OK);
+
+    while ((ret = writer.get_entry(entry.get())) == MB_BI_OK) {
+        ASSERT_EQ(writer.write_entry(entry.get()), MB_BI_OK);
+
+        if (mb_bi_entry_type(entry.get()) & (MB_BI_ENTRY_KERNEL
+                | MB_BI_ENTRY_RAMDISK)) {
+            ASSERT_EQ(writer.write_data("hello", 5, &n), MB_BI_OK);
+            ASSERT_EQ(n, 5u);
+        }
+    }
+    ASSERT_EQ(ret, MB_BI_EOF);
+
+    ASSERT_EQ(writer.close(), MB_BI_OK);
+}
+
+// Adapts the C API to the interface used by write_test_image()
+struct CWriter
+{
+    MbBiWriter *biw;
+
+    int get_header(MbBiHeader *header)
+    {
+        return mb_bi_writer_get_header2(biw, header);
+    }
+
+    int write_header(MbBiHeader *header)
+    {
+        return mb_bi_writer_write_header(biw, header);
+    }
+
+    int get_entry(MbBiEntry *entry)
+    {
+        return mb_bi_writer_get_entry2(biw, entry);
+    }
+
+    int write_entry(MbBiEntry *entry)
+    {
+        return mb_bi_writer_write_entry(biw, entry);
+    }
+
+    int write_data(const void *buf, size_t size, size_t *bytes_written)
+    {
+        return mb_bi_writer_write_data(biw, buf, size, bytes_written);
+    }
+
+    int close()
+    {
+        return mb_bi_writer_close(biw);
+    }
+};
+
+TEST(BasicWriterTest, OutputShouldMatchCApi)
+{
+    void *buf1 = nullptr;
+    size_t buf1_size = 0;
+    void *buf2 = nullptr;
+    size_t buf2_size = 0;
+
+    {
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+
+        mb::MemoryFile file(&buf1, &buf1_size);
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(mb_bi_writer_set_format_bump(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(biw.get(), &file, false), MB_BI_OK);
+
+        CWriter writer{biw.get()};
+        write_test_image(writer);
+    }
+
+    {
+        // The only format is selected automatically
+        BasicWriter<BumpFormat> writer;
+        ASSERT_TRUE(writer.is_valid());
+        ASSERT_EQ(writer.format_code(), MB_BI_FORMAT_BUMP);
+
+        mb::MemoryFile file(&buf2, &buf2_size);
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_EQ(writer.open(&file, false), MB_BI_OK);
+        write_test_image(writer);
+    }
+
+    ASSERT_EQ(buf1_size, buf2_size);
+    ASSERT_EQ(memcmp(buf1, buf2, buf1_size), 0);
+
+    // The C API should detect the output as a bump image
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+
+    mb::MemoryFile file(buf2, buf2_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_format_code(bir.get()), MB_BI_FORMAT_BUMP);
+
+    free(buf1);
+    free(buf2);
+}
+
+TEST(BasicWriterTest, FormatMustBeSelectedWithMultipleFormats)
+{
+    BasicWriter<AndroidFormat, MtkFormat> writer;
+    ASSERT_TRUE(writer.is_valid());
+    ASSERT_EQ(writer.format_code(), -1);
+
+    ASSERT_EQ(writer.set_option("foo", "bar"), MB_BI_FAILED);
+
+    mb::MemoryFile file(static_cast<const void *>(nullptr), 0);
+    ASSERT_EQ(writer.open(&file, false), MB_BI_FAILED);
+    ASSERT_EQ(writer.error(), MB_BI_ERROR_PROGRAMMER_ERROR);
+}
+
+TEST(BasicWriterTest, SetOptionShouldDispatchToSelectedFormat)
+{
+    BasicWriter<AndroidFormat, MtkFormat> writer;
+    ASSERT_TRUE(writer.is_valid());
+
+    ASSERT_EQ(writer.set_format<AndroidFormat>(), MB_BI_OK);
+    ASSERT_EQ(writer.set_option("foo", "bar"), MB_BI_WARN);
+
+    ASSERT_EQ(writer.set_format<MtkFormat>(), MB_BI_OK);
+    ASSERT_EQ(writer.format_code(), MB_BI_FORMAT_MTK);
+    ASSERT_EQ(writer.set_option("foo", "bar"), MB_BI_WARN);
+    ASSERT_STREQ(writer.error_string(), "Format does not support any options");
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "mbbootimg/convert.h"
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+struct ConvertTest : testing::Test
+{
+    char _dir[32];
+    std::vector<std::string> _files;
+
+    virtual void SetUp() override
+    {
+        strcpy(_dir, "/tmp/mbbootimg-XXXXXX");
+        ASSERT_NE(mkdtemp(_dir), nullptr);
+    }
+
+    virtual void TearDown() override
+    {
+        for (auto const &path : _files) {
+            unlink(path.c_str());
+        }
+        rmdir(_dir);
+    }
+
+    std::string path(const char *name)
+    {
+        std::string result(_dir);
+        result += "/";
+        result += name;
+        _files.push_back(result);
+        return result;
+    }
+
+    void write_android_image(const std::string &path)
+    {
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        int ret;
+        size_t n;
+
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open_filename(biw.get(), path.c_str()),
+                  MB_BI_OK);
+
+        ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header, "console=null"),
+                  MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+        while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+            ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+
+            if (mb_bi_entry_type(entry) == MB_BI_ENTRY_KERNEL) {
+                ASSERT_EQ(mb_bi_writer_write_data(biw.get(), "kernel", 6, &n),
+                          MB_BI_OK);
+            } else if (mb_bi_entry_type(entry) == MB_BI_ENTRY_RAMDISK) {
+                ASSERT_EQ(mb_bi_writer_write_data(biw.get(), "ramdisk", 7, &n),
+                          MB_BI_OK);
+            }
+        }
+        ASSERT_EQ(ret, MB_BI_EOF);
+
+        ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+    }
+
+    void check_image(const std::string &path, int format)
+    {
+        ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+        ASSERT_TRUE(!!bir);
+
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        char buf[16];
+        size_t n;
+
+        ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_open_filename(bir.get(), path.c_str()),
+                  MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_format_code(bir.get()), format);
+
+        ASSERT_EQ(mb_bi_reader_read_header(bir.get(), &header), MB_BI_OK);
+        ASSERT_STREQ(mb_bi_header_kernel_cmdline(header), "console=null");
+
+        ASSERT_EQ(mb_bi_reader_go_to_entry(bir.get(), &entry,
+                                           MB_BI_ENTRY_KERNEL), MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_read_data(bir.get(), buf, sizeof(buf), &n),
+                  MB_BI_OK);
+        ASSERT_EQ(std::string(buf, n), "kernel");
+
+        ASSERT_EQ(mb_bi_reader_go_to_entry(bir.get(), &entry,
+                                           MB_BI_ENTRY_RAMDISK), MB_BI_OK);
+        ASSERT_EQ(mb_bi_reader_read_data(bir.get(), buf, sizeof(buf), &n),
+                  MB_BI_OK);
+        ASSERT_EQ(std::string(buf, n), "ramdisk");
+    }
+};
+
+TEST_F(ConvertTest, ConvertSingleImageShouldSucceed)
+{
+    std::string input = path("boot.img");
+    std::string output = path("boot-bump.img");
+
+    write_android_image(input);
+
+    MbBiConvertJob job = {};
+    job.input_path = input.c_str();
+    job.output_path = output.c_str();
+    job.output_format = MB_BI_FORMAT_BUMP;
+
+    ASSERT_EQ(mb_bi_convert(&job), MB_BI_OK);
+    ASSERT_EQ(job.ret, MB_BI_OK);
+    ASSERT_STREQ(job.error_string, "");
+
+    check_image(output, MB_BI_FORMAT_BUMP);
+}
+
+TEST_F(ConvertTest, ConvertBatchShouldReportPerJobResults)
+{
+    std::string input = path("boot.img");
+    std::string missing = path("missing.img");
+    std::vector<std::string> outputs;
+
+    write_android_image(input);
+
+    std::vector<MbBiConvertJob> jobs(9);
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        outputs.push_back(path(("out" + std::to_string(i) + ".img").c_str()));
+    }
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        jobs[i].input_path = input.c_str();
+        jobs[i].output_path = outputs[i].c_str();
+        jobs[i].output_format = i % 2 == 0 ? MB_BI_FORMAT_BUMP : 0;
+    }
+
+    // One job fails, but the others should still complete
+    jobs[4].input_path = missing.c_str();
+
+    ASSERT_EQ(mb_bi_convert_batch(jobs.data(), jobs.size(), 3), MB_BI_FAILED);
+
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        if (i == 4) {
+            ASSERT_EQ(jobs[i].ret, MB_BI_FAILED);
+            ASSERT_NE(strstr(jobs[i].error_string, missing.c_str()), nullptr);
+        } else {
+            ASSERT_EQ(jobs[i].ret, MB_BI_OK) << jobs[i].error_string;
+            check_image(outputs[i], i % 2 == 0
+                        ? MB_BI_FORMAT_BUMP : MB_BI_FORMAT_ANDROID);
+        }
+    }
+}
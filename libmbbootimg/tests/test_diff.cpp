@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "mbbootimg/diff.h"
+#include "mbbootimg/entry.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/writer.h"
+
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+struct DiffTest : testing::Test
+{
+    char _dir[32];
+    std::vector<std::string> _files;
+
+    virtual void SetUp() override
+    {
+        strcpy(_dir, "/tmp/mbbootimg-XXXXXX");
+        ASSERT_NE(mkdtemp(_dir), nullptr);
+    }
+
+    virtual void TearDown() override
+    {
+        for (auto const &path : _files) {
+            unlink(path.c_str());
+        }
+        rmdir(_dir);
+    }
+
+    std::string path(const char *name)
+    {
+        std::string result(_dir);
+        result += "/";
+        result += name;
+        _files.push_back(result);
+        return result;
+    }
+
+    static std::string read_file(const std::string &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file),
+                           std::istreambuf_iterator<char>());
+    }
+
+    void write_android_image(const std::string &path, const char *cmdline,
+                             const std::string &kernel,
+                             const std::string &ramdisk)
+    {
+        ScopedWriter biw(mb_bi_writer_new(), mb_bi_writer_free);
+        ASSERT_TRUE(!!biw);
+
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        int ret;
+        size_t n;
+
+        ASSERT_EQ(mb_bi_writer_set_format_android(biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open_filename(biw.get(), path.c_str()),
+                  MB_BI_OK);
+
+        ASSERT_EQ(mb_bi_writer_get_header(biw.get(), &header), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header, cmdline), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_write_header(biw.get(), header), MB_BI_OK);
+
+        while ((ret = mb_bi_writer_get_entry(biw.get(), &entry)) == MB_BI_OK) {
+            ASSERT_EQ(mb_bi_writer_write_entry(biw.get(), entry), MB_BI_OK);
+
+            if (mb_bi_entry_type(entry) == MB_BI_ENTRY_KERNEL) {
+                ASSERT_EQ(mb_bi_writer_write_data(biw.get(), kernel.data(),
+                                                  kernel.size(), &n),
+                          MB_BI_OK);
+            } else if (mb_bi_entry_type(entry) == MB_BI_ENTRY_RAMDISK) {
+                ASSERT_EQ(mb_bi_writer_write_data(biw.get(), ramdisk.data(),
+                                                  ramdisk.size(), &n),
+                          MB_BI_OK);
+            }
+        }
+        ASSERT_EQ(ret, MB_BI_EOF);
+
+        ASSERT_EQ(mb_bi_writer_close(biw.get()), MB_BI_OK);
+    }
+};
+
+TEST_F(DiffTest, PatchShouldReproduceTargetImage)
+{
+    std::string source = path("source.img");
+    std::string target = path("target.img");
+    std::string delta = path("delta.bin");
+    std::string output = path("output.img");
+
+    std::string kernel;
+    for (int i = 0; i < 64 * 1024; ++i) {
+        kernel += static_cast<char>((i * 7919) >> 5);
+    }
+    std::string ramdisk(kernel.rbegin(), kernel.rend());
+    std::string new_ramdisk("prefix");
+    new_ramdisk += ramdisk;
+    new_ramdisk[40000] = 'x';
+
+    write_android_image(source, "console=null", kernel, ramdisk);
+    write_android_image(target, "console=ttyS0", kernel, new_ramdisk);
+
+    char error[256] = {};
+    ASSERT_EQ(mb_bi_diff(source.c_str(), target.c_str(), delta.c_str(),
+                         error, sizeof(error)), MB_BI_OK) << error;
+    ASSERT_EQ(mb_bi_patch(source.c_str(), delta.c_str(), output.c_str(),
+                          error, sizeof(error)), MB_BI_OK) << error;
+
+    ASSERT_EQ(read_file(output), read_file(target));
+
+    // The unchanged kernel and the shifted ramdisk blocks should be copied
+    ASSERT_LT(read_file(delta).size(), 4 * MB_BI_DIFF_BLOCK_SIZE);
+}
+
+TEST_F(DiffTest, PatchWithWrongSourceShouldFail)
+{
+    std::string source = path("source.img");
+    std::string target = path("target.img");
+    std::string other = path("other.img");
+    std::string delta = path("delta.bin");
+    std::string output = path("output.img");
+
+    write_android_image(source, "console=null", "kernel", "ramdisk");
+    write_android_image(target, "console=null", "kernel", "ramdisk2");
+    write_android_image(other, "console=null", "kernel2", "ramdisk");
+
+    char error[256] = {};
+    ASSERT_EQ(mb_bi_diff(source.c_str(), target.c_str(), delta.c_str(),
+                         error, sizeof(error)), MB_BI_OK) << error;
+    ASSERT_EQ(mb_bi_patch(other.c_str(), delta.c_str(), output.c_str(),
+                          error, sizeof(error)), MB_BI_FAILED);
+    ASSERT_NE(strstr(error, "Delta does not match source image"), nullptr);
+}
@@ -20,7 +20,9 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <string>
 
+#include "mbbootimg/defs.h"
 #include "mbbootimg/entry.h"
 #include "mbbootimg/entry_p.h"
 
@@ -92,6 +94,38 @@ TEST(BootImgEntryTest, CheckGettersSetters)
     ASSERT_EQ(mb_bi_entry_size(entry.get()), 0u);
 }
 
+TEST(BootImgEntryTest, CheckNameStorage)
+{
+    ScopedEntry entry(mb_bi_entry_new(), mb_bi_entry_free);
+    ASSERT_TRUE(!!entry);
+
+    std::string long_name(MB_BI_ENTRY_NAME_INLINE_SIZE, 'x');
+
+    // Short names are stored inline
+    ASSERT_EQ(mb_bi_entry_set_name(entry.get(), "short"), MB_BI_OK);
+    ASSERT_EQ(entry->field.name, entry->storage.name);
+    ASSERT_STREQ(mb_bi_entry_name(entry.get()), "short");
+
+    // Long names fall back to the heap
+    ASSERT_EQ(mb_bi_entry_set_name(entry.get(), long_name.c_str()), MB_BI_OK);
+    ASSERT_NE(entry->field.name, entry->storage.name);
+    ASSERT_EQ(mb_bi_entry_name(entry.get()), long_name);
+
+    // Setting the name to itself is allowed
+    ASSERT_EQ(mb_bi_entry_set_name(entry.get(), entry->field.name), MB_BI_OK);
+    ASSERT_EQ(mb_bi_entry_name(entry.get()), long_name);
+
+    // And back to inline storage
+    ASSERT_EQ(mb_bi_entry_set_name(entry.get(), "short"), MB_BI_OK);
+    ASSERT_EQ(entry->field.name, entry->storage.name);
+    ASSERT_STREQ(mb_bi_entry_name(entry.get()), "short");
+
+    ScopedEntry dup(mb_bi_entry_clone(entry.get()), mb_bi_entry_free);
+    ASSERT_TRUE(!!dup);
+    ASSERT_EQ(dup->field.name, dup->storage.name);
+    ASSERT_STREQ(dup->field.name, "short");
+}
+
 TEST(BootImgEntryTest, CheckClone)
 {
     ScopedEntry entry(mb_bi_entry_new(), mb_bi_entry_free);
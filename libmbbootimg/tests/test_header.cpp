@@ -20,6 +20,7 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <string>
 
 #include "mbbootimg/defs.h"
 #include "mbbootimg/header.h"
@@ -243,6 +244,40 @@ TEST(BootImgHeaderTest, CheckGettersSetters)
     ASSERT_EQ(mb_bi_header_entrypoint_address(header.get()), 0u);
 }
 
+TEST(BootImgHeaderTest, CheckStringStorage)
+{
+    ScopedHeader header(mb_bi_header_new(), mb_bi_header_free);
+    ASSERT_TRUE(!!header);
+
+    std::string long_cmdline(MB_BI_HEADER_CMDLINE_INLINE_SIZE, 'x');
+
+    // Short strings are stored inline
+    ASSERT_EQ(mb_bi_header_set_board_name(header.get(), "test"), MB_BI_OK);
+    ASSERT_EQ(header->field.board_name, header->storage.board_name);
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(), "test"),
+              MB_BI_OK);
+    ASSERT_EQ(header->field.cmdline, header->storage.cmdline);
+
+    // Long strings fall back to the heap
+    ASSERT_EQ(mb_bi_header_set_kernel_cmdline(header.get(),
+                                              long_cmdline.c_str()),
+              MB_BI_OK);
+    ASSERT_NE(header->field.cmdline, header->storage.cmdline);
+    ASSERT_EQ(mb_bi_header_kernel_cmdline(header.get()), long_cmdline);
+
+    ScopedHeader dup(mb_bi_header_clone(header.get()), mb_bi_header_free);
+    ASSERT_TRUE(!!dup);
+    ASSERT_EQ(dup->field.board_name, dup->storage.board_name);
+    ASSERT_STREQ(dup->field.board_name, "test");
+    ASSERT_NE(dup->field.cmdline, dup->storage.cmdline);
+    ASSERT_NE(dup->field.cmdline, header->field.cmdline);
+    ASSERT_EQ(mb_bi_header_kernel_cmdline(dup.get()), long_cmdline);
+
+    mb_bi_header_clear(header.get());
+    ASSERT_EQ(header->field.board_name, nullptr);
+    ASSERT_EQ(header->field.cmdline, nullptr);
+}
+
 TEST(BootImgHeaderTest, CheckSettingUnsupported)
 {
     ScopedHeader header(mb_bi_header_new(), mb_bi_header_free);
@@ -20,7 +20,14 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <vector>
 
+#include <cstring>
+
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/format/android_p.h"
+#include "mbbootimg/format/sony_elf_glibc_p.h"
 #include "mbbootimg/reader.h"
 #include "mbbootimg/reader_p.h"
 
@@ -51,3 +58,92 @@ TEST(BootImgReaderTest, CheckInitialValues)
     ASSERT_NE(bir->header, nullptr);
     ASSERT_NE(bir->entry, nullptr);
 }
+
+TEST(BootImgReaderTest, BidShouldDetectAndroidImage)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+
+    std::vector<unsigned char> data(4096);
+    AndroidHeader *hdr = reinterpret_cast<AndroidHeader *>(data.data() + 256);
+    memcpy(hdr->magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+    hdr->page_size = mb_htole32(2048);
+
+    mb::MemoryFile file(data.data(), data.size());
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_format_code(bir.get()), MB_BI_FORMAT_ANDROID);
+
+    // Probe buffer is only kept while bidding
+    ASSERT_FALSE(bir->probe_valid);
+    ASSERT_TRUE(bir->probe.empty());
+}
+
+TEST(BootImgReaderTest, BidShouldDetectSonyElfImage)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+
+    Sony_Elf32_Ehdr ehdr = {};
+    memcpy(ehdr.e_ident, SONY_E_IDENT, SONY_EI_NIDENT);
+
+    mb::MemoryFile file(&ehdr, sizeof(ehdr));
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_format_code(bir.get()), MB_BI_FORMAT_SONY_ELF);
+}
+
+TEST(BootImgReaderTest, BidWithNoMagicShouldFail)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+    ASSERT_EQ(mb_bi_reader_enable_format_all(bir.get()), MB_BI_OK);
+
+    std::vector<unsigned char> data(READER_PROBE_SIZE * 2, 0xaa);
+
+    mb::MemoryFile file(data.data(), data.size());
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), &file, false), MB_BI_FAILED);
+    ASSERT_EQ(mb_bi_reader_error(bir.get()), MB_BI_ERROR_FILE_FORMAT);
+}
+
+TEST(BootImgReaderTest, ReadAtShouldUseProbeBuffer)
+{
+    ScopedReader bir(mb_bi_reader_new(), mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    unsigned char data[] = { 'a', 'b', 'c', 'd', 'e', 'f' };
+    unsigned char buf[4];
+    size_t n;
+
+    mb::MemoryFile file(data, sizeof(data));
+    ASSERT_TRUE(file.is_open());
+
+    bir->file = &file;
+    bir->probe.assign(data, data + sizeof(data));
+    bir->probe_valid = true;
+
+    // Any I/O on the file would fail now
+    ASSERT_TRUE(file.close());
+
+    ASSERT_TRUE(_mb_bi_reader_read_at(bir.get(), &file, 1, buf, 3, n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(memcmp(buf, "bcd", 3), 0);
+
+    // Short probe means EOF was reached
+    ASSERT_TRUE(_mb_bi_reader_read_at(bir.get(), &file, 4, buf, 4, n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(memcmp(buf, "ef", 2), 0);
+
+    // Other files are never served from the probe buffer
+    mb::MemoryFile other(data, sizeof(data));
+    ASSERT_TRUE(other.close());
+    ASSERT_FALSE(_mb_bi_reader_read_at(bir.get(), &other, 0, buf, 3, n));
+
+    bir->file = nullptr;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+#include <cstddef>
+
+namespace mb
+{
+
+MB_EXPORT size_t io_block_size();
+MB_EXPORT void set_io_block_size(size_t size);
+
+MB_EXPORT size_t buffer_pool_alignment();
+MB_EXPORT void buffer_pool_trim();
+
+class MB_EXPORT PooledBuffer
+{
+public:
+    PooledBuffer();
+    explicit PooledBuffer(size_t size);
+    ~PooledBuffer();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(PooledBuffer)
+
+    PooledBuffer(PooledBuffer &&other) noexcept;
+    PooledBuffer & operator=(PooledBuffer &&other) noexcept;
+
+    void * data() const;
+    size_t size() const;
+
+    explicit operator bool() const;
+
+    void reset();
+
+private:
+    void *_data;
+    size_t _size;
+    // Index of the pool size class or -1 if the buffer is not pooled
+    int _class;
+};
+
+}
@@ -33,6 +33,60 @@
 namespace mb
 {
 
+struct FileIoVec
+{
+    void *data;
+    size_t size;
+};
+
+struct FileConstIoVec
+{
+    const void *data;
+    size_t size;
+};
+
+struct FileStats
+{
+    // Number of read, write, and seek operations
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t seek_calls;
+    // Number of bytes transferred
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    // Number of successful reads that returned less than requested
+    uint64_t short_reads;
+    // Cumulative time spent in each type of operation
+    uint64_t read_time_ns;
+    uint64_t write_time_ns;
+    uint64_t seek_time_ns;
+};
+
+enum class FileTraceOp
+{
+    Read,
+    Write,
+    Seek,
+};
+
+struct FileTraceEvent
+{
+    FileTraceOp op;
+    bool success;
+    // Requested size for reads and writes or offset for seeks
+    uint64_t size;
+    // Number of bytes transferred or the new offset for seeks
+    uint64_t result;
+    uint64_t duration_ns;
+};
+
+class File;
+
+typedef void (*FileTraceCallback)(File &file, const FileTraceEvent &event,
+                                  void *userdata);
+
+MB_EXPORT void file_set_trace_callback(FileTraceCallback cb, void *userdata);
+
 class FilePrivate;
 class MB_EXPORT File
 {
@@ -56,6 +110,28 @@ public:
     bool seek(int64_t offset, int whence, uint64_t *new_offset);
     bool truncate(uint64_t size);
 
+    // Vectored file operations
+    bool readv(const FileIoVec *iov, size_t count, size_t &bytes_read);
+    bool writev(const FileConstIoVec *iov, size_t count,
+                size_t &bytes_written);
+
+    // Positional file operations
+    bool read_at(uint64_t offset, void *buf, size_t size, size_t &bytes_read);
+    bool write_at(uint64_t offset, const void *buf, size_t size,
+                  size_t &bytes_written);
+
+    // Zero-copy access
+    bool map_range(uint64_t offset, size_t size,
+                   const void *&data, size_t &data_size);
+
+    // Native handle access
+    bool native_fd(int &fd);
+
+    // I/O statistics
+    bool set_stats_enabled(bool enabled);
+    FileStats stats();
+    bool reset_stats();
+
     // File state
     bool is_open();
     bool is_fatal();
@@ -82,6 +158,17 @@ protected:
     virtual bool on_write(const void *buf, size_t size, size_t &bytes_written);
     virtual bool on_seek(int64_t offset, int whence, uint64_t &new_offset);
     virtual bool on_truncate(uint64_t size);
+    virtual bool on_readv(const FileIoVec *iov, size_t count,
+                          size_t &bytes_read);
+    virtual bool on_writev(const FileConstIoVec *iov, size_t count,
+                           size_t &bytes_written);
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read);
+    virtual bool on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written);
+    virtual bool on_map_range(uint64_t offset, size_t size,
+                              const void *&data, size_t &data_size);
+    virtual bool on_native_fd(int &fd);
 
     std::unique_ptr<FilePrivate> _priv_ptr;
 };
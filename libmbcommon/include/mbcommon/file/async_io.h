@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+#include <memory>
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mbcommon/file.h"
+
+namespace mb
+{
+
+enum class AsyncIoBackend
+{
+    IoUring,
+    ThreadPool,
+    Synchronous,
+};
+
+class AsyncIoPrivate;
+class MB_EXPORT AsyncIo
+{
+    MB_DECLARE_PRIVATE(AsyncIo)
+
+public:
+    typedef void (*CompletionCb)(void *userdata, std::error_code ec,
+                                 size_t bytes);
+
+    AsyncIo();
+    ~AsyncIo();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(AsyncIo)
+
+    bool open(File &file, unsigned int queue_depth);
+    bool open(File &file, unsigned int queue_depth, AsyncIoBackend backend);
+    bool close();
+
+    bool is_open();
+    AsyncIoBackend backend();
+    size_t in_flight();
+
+    bool submit_read(uint64_t offset, void *buf, size_t size,
+                     CompletionCb cb, void *userdata);
+    bool submit_write(uint64_t offset, const void *buf, size_t size,
+                      CompletionCb cb, void *userdata);
+
+    bool poll(size_t &completed);
+    bool wait(size_t &completed);
+    bool drain();
+
+    std::error_code error();
+    std::string error_string();
+
+private:
+    std::unique_ptr<AsyncIoPrivate> _priv_ptr;
+};
+
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/guard_p.h"
+
+#include <memory>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "mbcommon/file/async_io.h"
+
+/*! \cond INTERNAL */
+namespace mb
+{
+
+struct AsyncIoRequest
+{
+    bool write;
+    uint64_t offset;
+    char *buf;
+    size_t size;
+    // Bytes transferred so far
+    size_t done;
+    std::error_code ec;
+    AsyncIo::CompletionCb cb;
+    void *userdata;
+    // Used by the io_uring engine
+    struct iovec iov;
+};
+
+class AsyncIoEngine
+{
+public:
+    virtual ~AsyncIoEngine();
+
+    virtual bool submit(AsyncIoRequest *req, std::error_code &ec) = 0;
+    // Append finished requests to `out`, blocking until at least
+    // `min_complete` requests have been appended
+    virtual bool reap(size_t min_complete, std::vector<AsyncIoRequest *> &out,
+                      std::error_code &ec) = 0;
+};
+
+class AsyncIoPrivate
+{
+public:
+    AsyncIoPrivate();
+    ~AsyncIoPrivate();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(AsyncIoPrivate)
+
+    void clear();
+
+    File *file;
+    AsyncIoBackend backend;
+    std::unique_ptr<AsyncIoEngine> engine;
+
+    // Preallocated requests, one per queue slot
+    std::vector<AsyncIoRequest> requests;
+    std::vector<AsyncIoRequest *> free_requests;
+    std::vector<AsyncIoRequest *> completed;
+
+    std::error_code error_code;
+    std::string error_string;
+};
+
+}
+/*! \endcond */
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/file.h"
+
+namespace mb
+{
+
+class BufferedFilePrivate;
+class MB_EXPORT BufferedFile : public File
+{
+    MB_DECLARE_PRIVATE(BufferedFile)
+
+public:
+    BufferedFile();
+    BufferedFile(File *file);
+    BufferedFile(File *file, size_t buf_size);
+    virtual ~BufferedFile();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(BufferedFile)
+    MB_DEFAULT_MOVE_CONSTRUCT_AND_ASSIGN(BufferedFile)
+
+    bool open(File *file);
+    bool open(File *file, size_t buf_size);
+
+    bool flush();
+
+protected:
+    /*! \cond INTERNAL */
+    BufferedFile(BufferedFilePrivate *priv);
+    BufferedFile(BufferedFilePrivate *priv,
+                 File *file, size_t buf_size);
+    /*! \endcond */
+
+    virtual bool on_open() override;
+    virtual bool on_close() override;
+    virtual bool on_read(void *buf, size_t size,
+                         size_t &bytes_read) override;
+    virtual bool on_write(const void *buf, size_t size,
+                          size_t &bytes_written) override;
+    virtual bool on_seek(int64_t offset, int whence,
+                         uint64_t &new_offset) override;
+    virtual bool on_truncate(uint64_t size) override;
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read) override;
+    virtual bool on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written) override;
+};
+
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/guard_p.h"
+
+#include <vector>
+
+#include "mbcommon/file/buffered.h"
+#include "mbcommon/file_p.h"
+
+/*! \cond INTERNAL */
+namespace mb
+{
+
+class BufferedFilePrivate : public FilePrivate
+{
+public:
+    BufferedFilePrivate();
+    virtual ~BufferedFilePrivate();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(BufferedFilePrivate)
+
+    void clear();
+
+    File *file;
+    size_t buf_size;
+
+    std::vector<unsigned char> buf;
+    // Read-ahead data is buf[read_pos, read_end). The underlying file position
+    // is (read_end - read_pos) bytes ahead of the logical position.
+    size_t read_pos;
+    size_t read_end;
+    // Write-behind data is buf[0, write_end). The underlying file position is
+    // write_end bytes behind the logical position.
+    size_t write_end;
+
+    // Logical file position. Only valid if the underlying file is seekable.
+    bool pos_known;
+    uint64_t pos;
+};
+
+}
+/*! \endcond */
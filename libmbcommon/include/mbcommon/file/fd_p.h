@@ -21,6 +21,10 @@
 
 #include "mbcommon/guard_p.h"
 
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
 #include "mbcommon/file/fd.h"
 #include "mbcommon/file_p.h"
 
@@ -44,6 +48,14 @@ struct FdFileFuncs
     virtual int fn_close(int fd) = 0;
     virtual int fn_ftruncate64(int fd, off_t length) = 0;
     virtual off64_t fn_lseek64(int fd, off64_t offset, int whence) = 0;
+#ifndef _WIN32
+    virtual ssize_t fn_pread64(int fd, void *buf, size_t count,
+                               off64_t offset) = 0;
+    virtual ssize_t fn_pwrite64(int fd, const void *buf, size_t count,
+                                off64_t offset) = 0;
+    virtual ssize_t fn_readv(int fd, const struct iovec *iov, int iovcnt) = 0;
+    virtual ssize_t fn_writev(int fd, const struct iovec *iov, int iovcnt) = 0;
+#endif
     virtual ssize_t fn_read(int fd, void *buf, size_t count) = 0;
     virtual ssize_t fn_write(int fd, const void *buf, size_t count) = 0;
 };
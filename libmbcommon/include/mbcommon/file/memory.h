@@ -33,6 +33,7 @@ public:
     MemoryFile();
     MemoryFile(const void *buf, size_t size);
     MemoryFile(void **buf_ptr, size_t *size_ptr);
+    MemoryFile(void *buf, size_t capacity, size_t *size_ptr);
     virtual ~MemoryFile();
 
     MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(MemoryFile)
@@ -40,6 +41,11 @@ public:
 
     bool open(const void *buf, size_t size);
     bool open(void **buf_ptr, size_t *size_ptr);
+    bool open(void *buf, size_t capacity, size_t *size_ptr);
+
+    // Buffer management
+    bool reserve(size_t capacity);
+    bool release(void *&buf, size_t &size);
 
 protected:
     /*! \cond INTERNAL */
@@ -48,6 +54,8 @@ protected:
                const void *buf, size_t size);
     MemoryFile(MemoryFilePrivate *priv,
                void **buf_ptr, size_t *size_ptr);
+    MemoryFile(MemoryFilePrivate *priv,
+               void *buf, size_t capacity, size_t *size_ptr);
     /*! \endcond */
 
     virtual bool on_close() override;
@@ -58,6 +66,12 @@ protected:
     virtual bool on_seek(int64_t offset, int whence,
                          uint64_t &new_offset) override;
     virtual bool on_truncate(uint64_t size) override;
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read) override;
+    virtual bool on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written) override;
+    virtual bool on_map_range(uint64_t offset, size_t size,
+                              const void *&data, size_t &data_size) override;
 };
 
 }
@@ -40,13 +40,21 @@ public:
 
     void *data;
     size_t size;
+    // Allocated (or arena) size of the buffer. Only [0, size) is file data.
+    size_t capacity;
 
     void **data_ptr;
     size_t *size_ptr;
 
     size_t pos;
 
+    // Writes cannot extend the buffer
     bool fixed_size;
+    // Writes can extend the file up to the capacity of a caller's arena
+    bool fixed_capacity;
+    // Buffer was allocated by us without a caller pointer and is freed on
+    // close() unless it is released
+    bool owned;
 };
 
 }
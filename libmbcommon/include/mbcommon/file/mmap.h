@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/file.h"
+
+namespace mb
+{
+
+class MmapFilePrivate;
+class MB_EXPORT MmapFile : public File
+{
+    MB_DECLARE_PRIVATE(MmapFile)
+
+public:
+    MmapFile();
+    MmapFile(int fd, bool owned);
+    MmapFile(int fd, bool owned, uint64_t offset, uint64_t size);
+    MmapFile(const std::string &filename);
+    MmapFile(const std::string &filename, uint64_t offset, uint64_t size);
+    virtual ~MmapFile();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(MmapFile)
+    MB_DEFAULT_MOVE_CONSTRUCT_AND_ASSIGN(MmapFile)
+
+    bool open(int fd, bool owned);
+    bool open(int fd, bool owned, uint64_t offset, uint64_t size);
+    bool open(const std::string &filename);
+    bool open(const std::string &filename, uint64_t offset, uint64_t size);
+
+protected:
+    /*! \cond INTERNAL */
+    MmapFile(MmapFilePrivate *priv);
+    MmapFile(MmapFilePrivate *priv,
+             int fd, bool owned);
+    MmapFile(MmapFilePrivate *priv,
+             int fd, bool owned, uint64_t offset, uint64_t size);
+    MmapFile(MmapFilePrivate *priv,
+             const std::string &filename);
+    MmapFile(MmapFilePrivate *priv,
+             const std::string &filename, uint64_t offset, uint64_t size);
+    /*! \endcond */
+
+    virtual bool on_open() override;
+    virtual bool on_close() override;
+    virtual bool on_read(void *buf, size_t size,
+                         size_t &bytes_read) override;
+    virtual bool on_seek(int64_t offset, int whence,
+                         uint64_t &new_offset) override;
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read) override;
+    virtual bool on_map_range(uint64_t offset, size_t size,
+                              const void *&data, size_t &data_size) override;
+};
+
+}
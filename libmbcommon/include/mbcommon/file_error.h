@@ -37,6 +37,8 @@ enum class FileError
     UnsupportedWrite        = 31,
     UnsupportedSeek         = 32,
     UnsupportedTruncate     = 33,
+    UnsupportedMap          = 34,
+    UnsupportedNativeFd     = 35,
 
     IntegerOverflow         = 40,
 
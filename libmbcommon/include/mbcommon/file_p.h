@@ -47,6 +47,10 @@ public:
 
     FileState state;
 
+    // Statistics
+    bool stats_enabled;
+    FileStats stats;
+
     // Error
     std::error_code error_code;
     std::string error_string;
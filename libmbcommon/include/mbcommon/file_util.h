@@ -33,6 +33,10 @@ enum class FileSearchAction
 
 typedef FileSearchAction (*FileSearchResultCallback)(File &file, void *userdata,
                                                      uint64_t offset);
+typedef FileSearchAction (*FileSearchMultiResultCallback)(File &file,
+                                                          void *userdata,
+                                                          size_t pattern_index,
+                                                          uint64_t offset);
 
 MB_EXPORT bool file_read_fully(File &file,
                                void *buf, size_t size,
@@ -40,6 +44,9 @@ MB_EXPORT bool file_read_fully(File &file,
 MB_EXPORT bool file_write_fully(File &file,
                                 const void *buf, size_t size,
                                 size_t &bytes_written);
+MB_EXPORT bool file_write_fully_v(File &file,
+                                  const FileConstIoVec *iov, size_t count,
+                                  size_t &bytes_written);
 
 MB_EXPORT bool file_read_discard(File &file, uint64_t size,
                                  uint64_t &bytes_discarded);
@@ -50,7 +57,17 @@ MB_EXPORT bool file_search(File &file, int64_t start, int64_t end,
                            FileSearchResultCallback result_cb,
                            void *userdata);
 
+MB_EXPORT bool file_search_multi(File &file, int64_t start, int64_t end,
+                                 size_t bsize, const void * const *patterns,
+                                 const size_t *pattern_sizes,
+                                 size_t pattern_count, int64_t max_matches,
+                                 FileSearchMultiResultCallback result_cb,
+                                 void *userdata);
+
 MB_EXPORT bool file_move(File &file, uint64_t src, uint64_t dest,
                          uint64_t size, uint64_t &size_moved);
 
+MB_EXPORT bool file_copy(File &src, File &dst, uint64_t size,
+                         uint64_t &size_copied);
+
 }
@@ -54,6 +54,11 @@ MB_PRINTF(1, 2)
 MB_EXPORT std::string format(const char *fmt, ...);
 MB_EXPORT bool format_v(std::string &out, const char *fmt, va_list ap);
 MB_EXPORT std::string format_v(const char *fmt, va_list ap);
+MB_PRINTF(4, 5)
+MB_EXPORT bool format_to(char *buf, size_t size, size_t *len,
+                         const char *fmt, ...);
+MB_EXPORT bool format_to_v(char *buf, size_t size, size_t *len,
+                           const char *fmt, va_list ap);
 
 // String starts with
 MB_EXPORT bool starts_with_n(const char *string, size_t len_string,
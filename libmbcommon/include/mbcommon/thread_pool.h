@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+#include <cstddef>
+
+namespace mb
+{
+
+enum class TaskPriority
+{
+    // Latency sensitive work. Preferentially scheduled on the fastest cores.
+    High,
+    Normal,
+    // Background work. Preferentially scheduled on the slowest cores.
+    Low,
+};
+
+class MB_EXPORT CancellationToken
+{
+public:
+    CancellationToken();
+
+    void cancel();
+    bool is_cancelled() const;
+
+private:
+    std::shared_ptr<std::atomic_bool> _state;
+};
+
+class ThreadPoolPrivate;
+class MB_EXPORT ThreadPool
+{
+    MB_DECLARE_PRIVATE(ThreadPool)
+
+public:
+    // Tasks must not throw
+    typedef std::function<void()> Task;
+
+    explicit ThreadPool(unsigned int threads = 0);
+    ~ThreadPool();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ThreadPool)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(ThreadPool)
+
+    static ThreadPool & shared();
+
+    unsigned int size() const;
+
+    void submit(Task task, TaskPriority priority = TaskPriority::Normal);
+    bool run_one();
+
+    bool is_worker() const;
+
+private:
+    std::unique_ptr<ThreadPoolPrivate> _priv_ptr;
+};
+
+class TaskGroupPrivate;
+class MB_EXPORT TaskGroup
+{
+    MB_DECLARE_PRIVATE(TaskGroup)
+
+public:
+    TaskGroup();
+    explicit TaskGroup(ThreadPool &pool, size_t max_pending = 0,
+                       TaskPriority priority = TaskPriority::Normal,
+                       CancellationToken token = CancellationToken());
+    ~TaskGroup();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(TaskGroup)
+    MB_DISABLE_MOVE_CONSTRUCT_AND_ASSIGN(TaskGroup)
+
+    void run(ThreadPool::Task task);
+    void wait();
+
+    void cancel();
+    bool is_cancelled() const;
+    CancellationToken token() const;
+
+private:
+    std::unique_ptr<TaskGroupPrivate> _priv_ptr;
+};
+
+}
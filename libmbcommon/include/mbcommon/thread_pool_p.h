@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "mbcommon/guard_p.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "mbcommon/thread_pool.h"
+
+/*! \cond INTERNAL */
+namespace mb
+{
+
+// Number of TaskPriority values
+constexpr size_t TASK_PRIORITIES = 3;
+
+struct ThreadPoolWorker
+{
+    std::thread thread;
+    // CPU that the worker is pinned to or -1 if it is not pinned
+    int cpu;
+
+    // Protects the queues below. The owner pushes and pops at the back while
+    // idle workers steal from the front.
+    std::mutex lock;
+    std::deque<ThreadPool::Task> queues[TASK_PRIORITIES];
+};
+
+class ThreadPoolPrivate
+{
+public:
+    ThreadPoolPrivate();
+    ~ThreadPoolPrivate();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ThreadPoolPrivate)
+
+    void start(unsigned int threads);
+    void stop();
+
+    void run_worker(size_t index);
+    size_t pick_worker(TaskPriority priority);
+    void push(size_t index, ThreadPool::Task task, TaskPriority priority);
+    bool pop(size_t index, ThreadPool::Task &task);
+
+    std::vector<std::unique_ptr<ThreadPoolWorker>> workers;
+    // Workers running on the fastest and slowest cores. Both are empty if the
+    // cores are not heterogeneous.
+    std::vector<size_t> big_workers;
+    std::vector<size_t> little_workers;
+    std::atomic<size_t> next_worker;
+
+    // Protects the fields below
+    std::mutex lock;
+    std::condition_variable cv;
+    // Number of queued tasks across all workers
+    size_t pending;
+    bool stopping;
+};
+
+class TaskGroupPrivate
+{
+public:
+    TaskGroupPrivate(ThreadPool *pool, size_t max_pending,
+                     TaskPriority priority, CancellationToken token);
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(TaskGroupPrivate)
+
+    void wait_for_outstanding(size_t limit);
+
+    ThreadPool *pool;
+    size_t max_pending;
+    TaskPriority priority;
+    CancellationToken token;
+
+    // Protects the fields below
+    std::mutex lock;
+    std::condition_variable cv;
+    // Number of submitted tasks that have not yet finished
+    size_t outstanding;
+};
+
+}
+/*! \endcond */
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mbcommon/file.h"
+
+namespace mb
+{
+
+enum class ZipMethod : uint16_t
+{
+    Stored      = 0,
+    Deflated    = 8,
+};
+
+struct ZipEntry
+{
+    std::string name;
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint64_t local_header_offset;
+    uint32_t crc32;
+    uint16_t method;
+    // "Version made by" and external attributes from the central directory
+    uint16_t version_made_by;
+    uint32_t external_attrs;
+};
+
+MB_EXPORT uint32_t zip_entry_unix_mode(const ZipEntry &entry,
+                                       uint32_t default_mode);
+
+class ZipEntryFile;
+
+class ZipArchivePrivate;
+class MB_EXPORT ZipArchive
+{
+    MB_DECLARE_PRIVATE(ZipArchive)
+
+public:
+    // Called from worker threads by for_each_parallel()
+    typedef std::function<bool(const ZipEntry &entry, ZipEntryFile &file)>
+            EntryCallback;
+
+    ZipArchive();
+    ~ZipArchive();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ZipArchive)
+
+    bool open(const std::string &path);
+    bool open(const std::string &path, bool map);
+    bool close();
+
+    bool is_open() const;
+    bool is_mapped() const;
+
+    // Lookup
+    const ZipEntry * find(const std::string &name) const;
+    const std::vector<ZipEntry> & entries() const;
+
+    // Convenience functions
+    bool read(const ZipEntry &entry, std::vector<unsigned char> &data);
+    bool for_each_parallel(const std::vector<const ZipEntry *> &entries,
+                           unsigned int threads, const EntryCallback &cb);
+
+    std::error_code error();
+    std::string error_string();
+
+private:
+    std::unique_ptr<ZipArchivePrivate> _priv_ptr;
+
+    friend class ZipEntryFile;
+};
+
+class ZipEntryFilePrivate;
+class MB_EXPORT ZipEntryFile : public File
+{
+    MB_DECLARE_PRIVATE(ZipEntryFile)
+
+public:
+    ZipEntryFile();
+    ZipEntryFile(ZipArchive &archive, const ZipEntry &entry);
+    virtual ~ZipEntryFile();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ZipEntryFile)
+    MB_DEFAULT_MOVE_CONSTRUCT_AND_ASSIGN(ZipEntryFile)
+
+    bool open(ZipArchive &archive, const ZipEntry &entry);
+
+protected:
+    /*! \cond INTERNAL */
+    ZipEntryFile(ZipEntryFilePrivate *priv);
+    ZipEntryFile(ZipEntryFilePrivate *priv,
+                 ZipArchive &archive, const ZipEntry &entry);
+    /*! \endcond */
+
+    virtual bool on_open() override;
+    virtual bool on_close() override;
+    virtual bool on_read(void *buf, size_t size,
+                         size_t &bytes_read) override;
+    virtual bool on_seek(int64_t offset, int whence,
+                         uint64_t &new_offset) override;
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read) override;
+    virtual bool on_map_range(uint64_t offset, size_t size,
+                              const void *&data, size_t &data_size) override;
+};
+
+}
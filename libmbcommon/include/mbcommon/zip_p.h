@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/guard_p.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <zlib.h>
+
+#include "mbcommon/file_p.h"
+#include "mbcommon/zip.h"
+
+/*! \cond INTERNAL */
+namespace mb
+{
+
+class ZipArchivePrivate
+{
+public:
+    ZipArchivePrivate();
+    ~ZipArchivePrivate();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ZipArchivePrivate)
+
+    void clear();
+
+    int fd;
+    uint64_t size;
+
+    // Read-only mapping of the whole file if the archive was opened with
+    // map = true
+    void *map;
+    size_t map_size;
+
+    std::vector<ZipEntry> entries;
+    std::unordered_map<std::string, size_t> names;
+
+    // Error
+    std::error_code error_code;
+    std::string error_string;
+};
+
+class ZipEntryFilePrivate : public FilePrivate
+{
+public:
+    ZipEntryFilePrivate();
+    virtual ~ZipEntryFilePrivate();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(ZipEntryFilePrivate)
+
+    void clear();
+
+    ZipArchivePrivate *archive;
+    const ZipEntry *entry;
+
+    // Offset of the entry's data in the archive
+    uint64_t data_offset;
+
+    // File position (in uncompressed bytes)
+    uint64_t pos;
+
+    // Amount of uncompressed data covered by crc so far. Stored entries only
+    // accumulate the CRC32 while they are being read sequentially from the
+    // beginning. Deflated entries are always inflated from the beginning, so
+    // this is the position of the inflate stream.
+    uint64_t crc_pos;
+    uLong crc;
+
+    // Deflate state
+    z_stream strm;
+    bool strm_init;
+    bool stream_end;
+    // Offset of the next compressed byte and number of compressed bytes left
+    uint64_t in_offset;
+    uint64_t in_remaining;
+    std::vector<unsigned char> in_buf;
+};
+
+}
+/*! \endcond */
@@ -0,0 +1,406 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbcommon/buffer_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <cerrno>
+#include <cstdlib>
+
+#ifdef _WIN32
+#  include <malloc.h>
+#else
+#  include <unistd.h>
+#endif
+
+// Smallest buffer handed out by the pool. Also the minimum alignment, which is
+// enough for O_DIRECT on every block device we care about.
+#define MIN_CLASS_SIZE                  4096
+// Number of power-of-two size classes (4 KiB to 16 MiB). Larger buffers are
+// allocated and freed directly.
+#define SIZE_CLASSES                    13
+// Buffers up to this size are cached per thread
+#define THREAD_CACHE_MAX_SIZE           (4 * 1024 * 1024)
+// Number of buffers of each size class cached per thread
+#define THREAD_CACHE_DEPTH              2
+// Maximum number of bytes held by the global cache
+#define GLOBAL_CACHE_MAX_BYTES          (32 * 1024 * 1024)
+
+#define DEFAULT_IO_BLOCK_SIZE           (1024 * 1024)
+#define MAX_IO_BLOCK_SIZE               (16 * 1024 * 1024)
+
+/*!
+ * \file mbcommon/buffer_pool.h
+ * \brief Reusable page-aligned I/O buffers
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+
+static std::atomic<size_t> g_io_block_size(DEFAULT_IO_BLOCK_SIZE);
+
+static size_t class_size(int cls)
+{
+    return static_cast<size_t>(MIN_CLASS_SIZE) << cls;
+}
+
+static int size_to_class(size_t size)
+{
+    for (int cls = 0; cls < SIZE_CLASSES; ++cls) {
+        if (size <= class_size(cls)) {
+            return cls;
+        }
+    }
+    return -1;
+}
+
+static void * aligned_alloc_buffer(size_t size)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, buffer_pool_alignment());
+#else
+    void *ptr;
+    int ret = posix_memalign(&ptr, buffer_pool_alignment(), size);
+    if (ret != 0) {
+        // posix_memalign() does not set errno
+        errno = ret;
+        return nullptr;
+    }
+    return ptr;
+#endif
+}
+
+static void aligned_free_buffer(void *ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+class GlobalCache
+{
+public:
+    void * take(int cls)
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+
+        auto &bufs = _bufs[cls];
+        if (bufs.empty()) {
+            return nullptr;
+        }
+
+        void *ptr = bufs.back();
+        bufs.pop_back();
+        _bytes -= class_size(cls);
+        return ptr;
+    }
+
+    void give(int cls, void *ptr)
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+
+            if (_bytes + class_size(cls) <= GLOBAL_CACHE_MAX_BYTES) {
+                _bufs[cls].push_back(ptr);
+                _bytes += class_size(cls);
+                return;
+            }
+        }
+
+        aligned_free_buffer(ptr);
+    }
+
+    void trim()
+    {
+        std::vector<void *> to_free;
+
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+
+            for (auto &bufs : _bufs) {
+                to_free.insert(to_free.end(), bufs.begin(), bufs.end());
+                bufs.clear();
+            }
+            _bytes = 0;
+        }
+
+        for (void *ptr : to_free) {
+            aligned_free_buffer(ptr);
+        }
+    }
+
+private:
+    std::mutex _lock;
+    std::vector<void *> _bufs[SIZE_CLASSES];
+    size_t _bytes = 0;
+};
+
+// Never destroyed so that thread caches can return buffers to it during exit
+static GlobalCache & global_cache()
+{
+    static GlobalCache *cache = new GlobalCache();
+    return *cache;
+}
+
+struct ThreadCache
+{
+    void *bufs[SIZE_CLASSES][THREAD_CACHE_DEPTH] = {};
+    size_t counts[SIZE_CLASSES] = {};
+
+    ~ThreadCache()
+    {
+        flush();
+    }
+
+    void flush()
+    {
+        for (int cls = 0; cls < SIZE_CLASSES; ++cls) {
+            while (counts[cls] > 0) {
+                global_cache().give(cls, bufs[cls][--counts[cls]]);
+            }
+        }
+    }
+};
+
+static thread_local ThreadCache t_cache;
+
+static void * acquire(int cls)
+{
+    void *ptr = nullptr;
+
+    if (t_cache.counts[cls] > 0) {
+        ptr = t_cache.bufs[cls][--t_cache.counts[cls]];
+    } else {
+        ptr = global_cache().take(cls);
+    }
+
+    if (!ptr) {
+        ptr = aligned_alloc_buffer(class_size(cls));
+    }
+
+    return ptr;
+}
+
+static void release(int cls, void *ptr)
+{
+    if (class_size(cls) <= THREAD_CACHE_MAX_SIZE
+            && t_cache.counts[cls] < THREAD_CACHE_DEPTH) {
+        t_cache.bufs[cls][t_cache.counts[cls]++] = ptr;
+    } else {
+        global_cache().give(cls, ptr);
+    }
+}
+
+/*! \endcond */
+
+/*!
+ * \brief Get the preferred size of each read or write in copy loops
+ *
+ * Every loop that streams data through a buffer should use blocks of this
+ * size (via `PooledBuffer(io_block_size())`) unless the format dictates
+ * otherwise. The default is 1 MiB.
+ */
+size_t io_block_size()
+{
+    return g_io_block_size;
+}
+
+/*!
+ * \brief Set the preferred I/O block size
+ *
+ * \param size Block size. It is rounded up to a multiple of
+ *             buffer_pool_alignment() and capped at 16 MiB. If 0, the default
+ *             is restored.
+ */
+void set_io_block_size(size_t size)
+{
+    if (size == 0) {
+        size = DEFAULT_IO_BLOCK_SIZE;
+    }
+
+    size_t alignment = buffer_pool_alignment();
+    size = std::min<size_t>(size, MAX_IO_BLOCK_SIZE);
+    size = (size + alignment - 1) / alignment * alignment;
+
+    g_io_block_size = size;
+}
+
+/*!
+ * \brief Get the alignment of pooled buffers
+ *
+ * This is the page size, but never less than 4096 bytes.
+ */
+size_t buffer_pool_alignment()
+{
+    static const size_t alignment = [] {
+        size_t size = MIN_CLASS_SIZE;
+#ifndef _WIN32
+        long page_size = sysconf(_SC_PAGESIZE);
+        if (page_size > 0) {
+            size = std::max(size, static_cast<size_t>(page_size));
+        }
+#endif
+        return size;
+    }();
+
+    return alignment;
+}
+
+/*!
+ * \brief Free the calling thread's cached buffers and the shared cache
+ *
+ * Buffers cached by other threads are only freed when those threads exit.
+ */
+void buffer_pool_trim()
+{
+    t_cache.flush();
+    global_cache().trim();
+}
+
+/*!
+ * \class PooledBuffer
+ *
+ * \brief Page-aligned buffer borrowed from a process-wide pool
+ *
+ * Buffers are rounded up to power-of-two size classes and returned to the pool
+ * when the PooledBuffer is destroyed. Each thread keeps a small cache of
+ * recently released buffers, so a loop that allocates a buffer per call does
+ * not hit the allocator (or take a lock) after the first call. Buffers are
+ * suitably aligned for `O_DIRECT`.
+ *
+ * The contents of a newly acquired buffer are undefined.
+ */
+
+/*!
+ * \brief Construct an empty buffer
+ */
+PooledBuffer::PooledBuffer()
+    : _data(nullptr)
+    , _size(0)
+    , _class(-1)
+{
+}
+
+/*!
+ * \brief Acquire a buffer from the pool
+ *
+ * If the allocation fails, the PooledBuffer is empty and evaluates to false.
+ *
+ * \param size Minimum size of the buffer
+ */
+PooledBuffer::PooledBuffer(size_t size)
+    : _data(nullptr)
+    , _size(size)
+    , _class(size_to_class(size))
+{
+    if (_class >= 0) {
+        _data = acquire(_class);
+    } else {
+        _data = aligned_alloc_buffer(size);
+    }
+
+    if (!_data) {
+        _size = 0;
+        _class = -1;
+    }
+}
+
+/*!
+ * \brief Return the buffer to the pool
+ */
+PooledBuffer::~PooledBuffer()
+{
+    reset();
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer &&other) noexcept
+    : _data(other._data)
+    , _size(other._size)
+    , _class(other._class)
+{
+    other._data = nullptr;
+    other._size = 0;
+    other._class = -1;
+}
+
+PooledBuffer & PooledBuffer::operator=(PooledBuffer &&other) noexcept
+{
+    if (this != &other) {
+        reset();
+
+        std::swap(_data, other._data);
+        std::swap(_size, other._size);
+        std::swap(_class, other._class);
+    }
+
+    return *this;
+}
+
+/*!
+ * \brief Get pointer to the buffer
+ */
+void * PooledBuffer::data() const
+{
+    return _data;
+}
+
+/*!
+ * \brief Get the requested size of the buffer
+ */
+size_t PooledBuffer::size() const
+{
+    return _size;
+}
+
+/*!
+ * \brief Check whether the buffer was successfully acquired
+ */
+PooledBuffer::operator bool() const
+{
+    return _data != nullptr;
+}
+
+/*!
+ * \brief Return the buffer to the pool and leave this PooledBuffer empty
+ */
+void PooledBuffer::reset()
+{
+    if (_data) {
+        if (_class >= 0) {
+            release(_class, _data);
+        } else {
+            aligned_free_buffer(_data);
+        }
+    }
+
+    _data = nullptr;
+    _size = 0;
+    _class = -1;
+}
+
+}
@@ -19,8 +19,12 @@
 
 #include "mbcommon/file.h"
 
+#include <atomic>
+#include <chrono>
+
 #include <cassert>
 #include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 
@@ -58,6 +62,8 @@ namespace mb
 
 /*! \cond INTERNAL */
 FilePrivate::FilePrivate()
+    : stats_enabled(false)
+    , stats()
 {
 }
 
@@ -66,6 +72,102 @@ FilePrivate::~FilePrivate()
 }
 /*! \endcond */
 
+static std::atomic<FileTraceCallback> g_trace_cb{nullptr};
+static std::atomic<void *> g_trace_userdata{nullptr};
+
+static inline bool should_trace(FilePrivate *priv)
+{
+    return priv->stats_enabled
+            || g_trace_cb.load(std::memory_order_relaxed) != nullptr;
+}
+
+static inline uint64_t trace_now_ns()
+{
+    return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count());
+}
+
+static void trace_io(File &file, FilePrivate *priv, FileTraceOp op,
+                     bool success, uint64_t size, uint64_t result,
+                     uint64_t start_ns)
+{
+    uint64_t duration = trace_now_ns() - start_ns;
+
+    if (priv->stats_enabled) {
+        FileStats &stats = priv->stats;
+
+        switch (op) {
+        case FileTraceOp::Read:
+            ++stats.read_calls;
+            stats.read_time_ns += duration;
+            if (success) {
+                stats.bytes_read += result;
+                if (result < size) {
+                    ++stats.short_reads;
+                }
+            }
+            break;
+        case FileTraceOp::Write:
+            ++stats.write_calls;
+            stats.write_time_ns += duration;
+            if (success) {
+                stats.bytes_written += result;
+            }
+            break;
+        case FileTraceOp::Seek:
+            ++stats.seek_calls;
+            stats.seek_time_ns += duration;
+            break;
+        }
+    }
+
+    auto cb = g_trace_cb.load(std::memory_order_acquire);
+    if (cb) {
+        FileTraceEvent event;
+        event.op = op;
+        event.success = success;
+        event.size = size;
+        event.result = success ? result : 0;
+        event.duration_ns = duration;
+
+        cb(file, event, g_trace_userdata.load(std::memory_order_relaxed));
+    }
+}
+
+template<typename T>
+static uint64_t iov_total_size(const T *iov, size_t count)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        total += iov[i].size;
+    }
+    return total;
+}
+
+/*!
+ * \brief Set global I/O trace callback
+ *
+ * When set, \p cb is called after every read, write, and seek operation on
+ * every File handle, regardless of whether statistics are enabled for the
+ * handle. Vectored and positional operations are reported as reads and writes.
+ * Each layer (eg. a SparseFile and the File it reads from) reports its own
+ * operations.
+ *
+ * The callback is called from the thread performing the operation. It should
+ * be set before any I/O is performed and must not be changed while other
+ * threads are using File handles.
+ *
+ * \param cb Trace callback or nullptr to disable tracing
+ * \param userdata User-supplied pointer to pass to \p cb
+ */
+void file_set_trace_callback(FileTraceCallback cb, void *userdata)
+{
+    g_trace_userdata.store(userdata, std::memory_order_relaxed);
+    g_trace_cb.store(cb, std::memory_order_release);
+}
+
 /*!
  * \class File
  *
@@ -244,7 +346,14 @@ bool File::read(void *buf, size_t size, size_t &bytes_read)
     GET_PIMPL_OR_RETURN(false);
     ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
 
-    return on_read(buf, size, bytes_read);
+    if (!should_trace(priv)) {
+        return on_read(buf, size, bytes_read);
+    }
+
+    uint64_t start = trace_now_ns();
+    bool ret = on_read(buf, size, bytes_read);
+    trace_io(*this, priv, FileTraceOp::Read, ret, size, bytes_read, start);
+    return ret;
 }
 
 /*!
@@ -271,7 +380,14 @@ bool File::write(const void *buf, size_t size, size_t &bytes_written)
     GET_PIMPL_OR_RETURN(false);
     ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
 
-    return on_write(buf, size, bytes_written);
+    if (!should_trace(priv)) {
+        return on_write(buf, size, bytes_written);
+    }
+
+    uint64_t start = trace_now_ns();
+    bool ret = on_write(buf, size, bytes_written);
+    trace_io(*this, priv, FileTraceOp::Write, ret, size, bytes_written, start);
+    return ret;
 }
 
 /*!
@@ -289,8 +405,16 @@ bool File::seek(int64_t offset, int whence, uint64_t *new_offset)
     ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
 
     uint64_t new_offset_temp;
+    bool ret;
 
-    auto ret = on_seek(offset, whence, new_offset_temp);
+    if (!should_trace(priv)) {
+        ret = on_seek(offset, whence, new_offset_temp);
+    } else {
+        uint64_t start = trace_now_ns();
+        ret = on_seek(offset, whence, new_offset_temp);
+        trace_io(*this, priv, FileTraceOp::Seek, ret,
+                 static_cast<uint64_t>(offset), new_offset_temp, start);
+    }
 
     if (ret) {
         if (new_offset) {
@@ -320,6 +444,235 @@ bool File::truncate(uint64_t size)
     return on_truncate(size);
 }
 
+/*!
+ * \brief Read from a File handle into multiple buffers.
+ *
+ * This function behaves like File::read(), except that the data is scattered
+ * into the buffers in \p iov in order. Subclasses backed by a native vectored
+ * read primitive (eg. `readv()`) will perform a single operation. Other
+ * subclasses fall back to calling File::read() for each buffer.
+ *
+ * \param[in] iov Array of buffers to read into
+ * \param[in] count Number of elements in \p iov
+ * \param[out] bytes_read Output total number of bytes that were read. 0
+ *                        indicates end of file.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::readv(const FileIoVec *iov, size_t count, size_t &bytes_read)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    if (!should_trace(priv)) {
+        return on_readv(iov, count, bytes_read);
+    }
+
+    uint64_t start = trace_now_ns();
+    bool ret = on_readv(iov, count, bytes_read);
+    trace_io(*this, priv, FileTraceOp::Read, ret,
+             iov_total_size(iov, count), bytes_read, start);
+    return ret;
+}
+
+/*!
+ * \brief Write to a File handle from multiple buffers.
+ *
+ * This function behaves like File::write(), except that the data is gathered
+ * from the buffers in \p iov in order. See File::readv() for details on how the
+ * operation is performed.
+ *
+ * \param[in] iov Array of buffers to write from
+ * \param[in] count Number of elements in \p iov
+ * \param[out] bytes_written Output total number of bytes that were written.
+ *
+ * \return Whether some bytes were successfully written
+ */
+bool File::writev(const FileConstIoVec *iov, size_t count,
+                  size_t &bytes_written)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    if (!should_trace(priv)) {
+        return on_writev(iov, count, bytes_written);
+    }
+
+    uint64_t start = trace_now_ns();
+    bool ret = on_writev(iov, count, bytes_written);
+    trace_io(*this, priv, FileTraceOp::Write, ret,
+             iov_total_size(iov, count), bytes_written, start);
+    return ret;
+}
+
+/*!
+ * \brief Read from a File handle at a specific offset.
+ *
+ * This function reads from \p offset without using or changing the current
+ * file position. Subclasses backed by a native positional read primitive (eg.
+ * `pread()`) will perform a single operation. Other subclasses fall back to a
+ * seek, read, and another seek to restore the original file position.
+ *
+ * \param[in] offset File offset to read from
+ * \param[out] buf Buffer to read into
+ * \param[in] size Buffer size
+ * \param[out] bytes_read Output number of bytes that were read. 0 indicates end
+ *                        of file.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::read_at(uint64_t offset, void *buf, size_t size, size_t &bytes_read)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    if (!should_trace(priv)) {
+        return on_read_at(offset, buf, size, bytes_read);
+    }
+
+    uint64_t start = trace_now_ns();
+    bool ret = on_read_at(offset, buf, size, bytes_read);
+    trace_io(*this, priv, FileTraceOp::Read, ret, size, bytes_read, start);
+    return ret;
+}
+
+/*!
+ * \brief Write to a File handle at a specific offset.
+ *
+ * This function writes to \p offset without using or changing the current
+ * file position. See File::read_at() for details on how the operation is
+ * performed.
+ *
+ * \note If the file was opened in append mode, the behavior follows that of the
+ *       underlying platform. For example, `pwrite()` on Linux will always
+ *       append to the end of the file.
+ *
+ * \param[in] offset File offset to write to
+ * \param[in] buf Buffer to write from
+ * \param[in] size Buffer size
+ * \param[out] bytes_written Output number of bytes that were written.
+ *
+ * \return Whether some bytes were successfully written
+ */
+bool File::write_at(uint64_t offset, const void *buf, size_t size,
+                    size_t &bytes_written)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    if (!should_trace(priv)) {
+        return on_write_at(offset, buf, size, bytes_written);
+    }
+
+    uint64_t start = trace_now_ns();
+    bool ret = on_write_at(offset, buf, size, bytes_written);
+    trace_io(*this, priv, FileTraceOp::Write, ret, size, bytes_written, start);
+    return ret;
+}
+
+/*!
+ * \brief Get a zero-copy view of a range of a File handle.
+ *
+ * This is a capability query. Subclasses that keep the file contents
+ * addressable in memory (eg. MmapFile and MemoryFile) return a pointer directly
+ * into their backing storage. Other subclasses fail with
+ * FileError::UnsupportedMap, in which case the caller should fall back to
+ * File::read() or File::read_at().
+ *
+ * The file position is not used or changed. The returned pointer remains valid
+ * until the file is closed or, for writable files, until the next write or
+ * truncate operation.
+ *
+ * \param[in] offset File offset of the beginning of the range
+ * \param[in] size Size of the range
+ * \param[out] data Output pointer to the data at \p offset
+ * \param[out] data_size Output size of the available data. This may be smaller
+ *                       than \p size if the range extends past the end of
+ *                       the file. 0 indicates that \p offset is at or beyond
+ *                       the end of the file.
+ *
+ * \return Whether the range was successfully mapped
+ */
+bool File::map_range(uint64_t offset, size_t size,
+                     const void *&data, size_t &data_size)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    return on_map_range(offset, size, data, data_size);
+}
+
+/*!
+ * \brief Get the underlying file descriptor of a File handle.
+ *
+ * This is a capability query. Subclasses that perform I/O directly on a file
+ * descriptor without any userspace buffering (eg. FdFile) return that file
+ * descriptor. Other subclasses fail with FileError::UnsupportedNativeFd.
+ *
+ * The file descriptor is still owned by the File handle and must not be closed
+ * by the caller. Reading, writing, or seeking the file descriptor directly
+ * changes the file position of the File handle in the same way.
+ *
+ * \param[out] fd Output file descriptor
+ *
+ * \return Whether the file descriptor was successfully retrieved
+ */
+bool File::native_fd(int &fd)
+{
+    GET_PIMPL_OR_RETURN(false);
+    ENSURE_STATE_OR_RETURN(FileState::OPENED, false);
+
+    return on_native_fd(fd);
+}
+
+/*!
+ * \brief Enable or disable I/O statistics for a File handle.
+ *
+ * Statistics are disabled by default. When enabled, File::read(),
+ * File::write(), File::seek() and their vectored and positional variants are
+ * counted and timed. Disabling statistics does not clear the existing values.
+ *
+ * \param enabled Whether to collect statistics
+ *
+ * \return Whether the setting was successfully changed
+ */
+bool File::set_stats_enabled(bool enabled)
+{
+    GET_PIMPL_OR_RETURN(false);
+
+    priv->stats_enabled = enabled;
+    return true;
+}
+
+/*!
+ * \brief Get I/O statistics for a File handle.
+ *
+ * The statistics only include operations performed on this handle. If this
+ * handle wraps another File, the statistics of the inner handle must be queried
+ * separately.
+ *
+ * \return Statistics collected since statistics were enabled or last reset
+ */
+FileStats File::stats()
+{
+    GET_PIMPL_OR_RETURN(FileStats());
+
+    return priv->stats;
+}
+
+/*!
+ * \brief Reset I/O statistics for a File handle.
+ *
+ * \return Whether the statistics were successfully reset
+ */
+bool File::reset_stats()
+{
+    GET_PIMPL_OR_RETURN(false);
+
+    priv->stats = FileStats();
+    return true;
+}
+
 /*!
  * \brief Check whether file is opened
  *
@@ -637,4 +990,270 @@ bool File::on_truncate(uint64_t size)
     return false;
 }
 
+/*!
+ * \brief File vectored read callback
+ *
+ * Subclasses should override this method if the underlying file supports
+ * scattering a single read into multiple buffers.
+ *
+ * The return value semantics are the same as on_read(). Short reads are
+ * allowed and are not necessarily indicative of EOF.
+ *
+ * If this method is not overridden, the default implementation will call
+ * on_read() for each buffer until a short read occurs. If on_read() fails after
+ * some bytes have already been read, then the bytes that were read are reported
+ * and the error will be returned by the next operation.
+ *
+ * \param[in] iov Array of buffers to read into
+ * \param[in] count Number of elements in \p iov
+ * \param[out] bytes_read Output total number of bytes that were read. This
+ *                        parameter is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::on_readv(const FileIoVec *iov, size_t count, size_t &bytes_read)
+{
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t n;
+
+        if (!on_read(iov[i].data, iov[i].size, n)) {
+            if (total == 0) {
+                return false;
+            }
+            break;
+        }
+
+        total += n;
+
+        if (n < iov[i].size) {
+            break;
+        }
+    }
+
+    bytes_read = total;
+    return true;
+}
+
+/*!
+ * \brief File vectored write callback
+ *
+ * Subclasses should override this method if the underlying file supports
+ * gathering multiple buffers into a single write.
+ *
+ * The return value semantics are the same as on_write(). Short writes are
+ * allowed.
+ *
+ * If this method is not overridden, the default implementation will call
+ * on_write() for each buffer until a short write occurs. If on_write() fails
+ * after some bytes have already been written, then the bytes that were written
+ * are reported and the error will be returned by the next operation.
+ *
+ * \param[in] iov Array of buffers to write from
+ * \param[in] count Number of elements in \p iov
+ * \param[out] bytes_written Output total number of bytes that were written.
+ *                           This parameter is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were written
+ */
+bool File::on_writev(const FileConstIoVec *iov, size_t count,
+                     size_t &bytes_written)
+{
+    size_t total = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t n;
+
+        if (!on_write(iov[i].data, iov[i].size, n)) {
+            if (total == 0) {
+                return false;
+            }
+            break;
+        }
+
+        total += n;
+
+        if (n < iov[i].size) {
+            break;
+        }
+    }
+
+    bytes_written = total;
+    return true;
+}
+
+/*!
+ * \brief File positional read callback
+ *
+ * Subclasses should override this method if the underlying file supports
+ * reading at an offset without changing the file position.
+ *
+ * This method should return:
+ *
+ *   * True if some bytes were read or EOF was reached
+ *   * False and set error to std::errc::interrupted if the same operation
+ *     should be reattempted
+ *   * False and set specific error for all other cases
+ *
+ * If this method is not overridden, the default implementation will save the
+ * file position with on_seek(), seek to \p offset, call on_read(), and then
+ * restore the original file position. If the original position cannot be
+ * restored, the file handle is placed in the fatal state.
+ *
+ * \param[in] offset File offset to read from
+ * \param[out] buf Buffer to read into
+ * \param[in] size Buffer size
+ * \param[out] bytes_read Output number of bytes that were read. 0 indicates end
+ *                        of file. This parameter is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool File::on_read_at(uint64_t offset, void *buf, size_t size,
+                      size_t &bytes_read)
+{
+    uint64_t old_pos;
+    uint64_t temp;
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset %" PRIu64 " exceeds maximum seekable offset",
+                  offset);
+        return false;
+    }
+
+    if (!on_seek(0, SEEK_CUR, old_pos)
+            || !on_seek(static_cast<int64_t>(offset), SEEK_SET, temp)) {
+        return false;
+    }
+
+    bool ret = on_read(buf, size, bytes_read);
+
+    if (!on_seek(static_cast<int64_t>(old_pos), SEEK_SET, temp)) {
+        // We can't guarantee the file position so the handle shouldn't be used
+        // anymore
+        set_fatal(true);
+        ret = false;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief File positional write callback
+ *
+ * Subclasses should override this method if the underlying file supports
+ * writing at an offset without changing the file position.
+ *
+ * This method should return:
+ *
+ *   * True if some bytes were written
+ *   * False and set error to std::errc::interrupted if the same operation
+ *     should be reattempted
+ *   * False and set specific error for all other cases
+ *
+ * If this method is not overridden, the default implementation will save the
+ * file position with on_seek(), seek to \p offset, call on_write(), and then
+ * restore the original file position. If the original position cannot be
+ * restored, the file handle is placed in the fatal state.
+ *
+ * \param[in] offset File offset to write to
+ * \param[in] buf Buffer to write from
+ * \param[in] size Buffer size
+ * \param[out] bytes_written Output number of bytes that were written. This
+ *                           parameter is guaranteed to be non-NULL.
+ *
+ * \return Whether some bytes were written
+ */
+bool File::on_write_at(uint64_t offset, const void *buf, size_t size,
+                       size_t &bytes_written)
+{
+    uint64_t old_pos;
+    uint64_t temp;
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset %" PRIu64 " exceeds maximum seekable offset",
+                  offset);
+        return false;
+    }
+
+    if (!on_seek(0, SEEK_CUR, old_pos)
+            || !on_seek(static_cast<int64_t>(offset), SEEK_SET, temp)) {
+        return false;
+    }
+
+    bool ret = on_write(buf, size, bytes_written);
+
+    if (!on_seek(static_cast<int64_t>(old_pos), SEEK_SET, temp)) {
+        // We can't guarantee the file position so the handle shouldn't be used
+        // anymore
+        set_fatal(true);
+        ret = false;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief File range mapping callback
+ *
+ * Subclasses should override this method if the file contents can be accessed
+ * directly in memory.
+ *
+ * This method should return:
+ *
+ *   * True if the range was successfully mapped
+ *   * False and set error to FileError::UnsupportedMap if the file does not
+ *     support zero-copy access
+ *   * False and set specific error for all other cases
+ *
+ * If this method is not overridden, it will simply return false and set the
+ * error to FileError::UnsupportedMap.
+ *
+ * \param[in] offset File offset of the beginning of the range
+ * \param[in] size Size of the range
+ * \param[out] data Output pointer to the data at \p offset
+ * \param[out] data_size Output size of the available data
+ *
+ * \return Always returns false and sets the error to
+ *         #FileError::UnsupportedMap
+ */
+bool File::on_map_range(uint64_t offset, size_t size,
+                        const void *&data, size_t &data_size)
+{
+    (void) offset;
+    (void) size;
+    (void) data;
+    (void) data_size;
+
+    set_error(make_error_code(FileError::UnsupportedMap),
+              "%s: Map callback not supported", __func__);
+    return false;
+}
+
+/*!
+ * \brief File descriptor query callback
+ *
+ * Subclasses should override this method if all I/O is performed directly on a
+ * file descriptor so that the file position of the descriptor always matches
+ * the file position of the File handle.
+ *
+ * If this method is not overridden, it will simply return false and set the
+ * error to FileError::UnsupportedNativeFd.
+ *
+ * \param[out] fd Output file descriptor
+ *
+ * \return Always returns false and sets the error to
+ *         #FileError::UnsupportedNativeFd
+ */
+bool File::on_native_fd(int &fd)
+{
+    (void) fd;
+
+    set_error(make_error_code(FileError::UnsupportedNativeFd),
+              "%s: Native fd callback not supported", __func__);
+    return false;
+}
+
 }
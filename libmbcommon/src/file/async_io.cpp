@@ -0,0 +1,940 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/file/async_io.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <cerrno>
+#include <climits>
+#include <cstdarg>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#    if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#      define HAVE_IO_URING 1
+#    endif
+#  endif
+#endif
+
+#include "mbcommon/file/async_io_p.h"
+#include "mbcommon/string.h"
+
+// Number of worker threads is min(queue depth, MAX_WORKER_THREADS)
+#define MAX_WORKER_THREADS              4u
+
+/*!
+ * \file mbcommon/file/async_io.h
+ * \brief Asynchronous positional I/O on File handles
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+
+AsyncIoEngine::~AsyncIoEngine()
+{
+}
+
+/*!
+ * \brief Synchronous engine for File handles without a file descriptor
+ *
+ * Requests are completed during submission and reported on the next reap.
+ */
+class SyncEngine : public AsyncIoEngine
+{
+public:
+    SyncEngine(File &file) : _file(file)
+    {
+    }
+
+    virtual bool submit(AsyncIoRequest *req, std::error_code &ec) override
+    {
+        (void) ec;
+
+        while (req->done < req->size) {
+            size_t n;
+            bool ret;
+
+            if (req->write) {
+                ret = _file.write_at(req->offset + req->done,
+                                     req->buf + req->done,
+                                     req->size - req->done, n);
+            } else {
+                ret = _file.read_at(req->offset + req->done,
+                                    req->buf + req->done,
+                                    req->size - req->done, n);
+            }
+
+            if (!ret) {
+                if (_file.error() == std::errc::interrupted) {
+                    continue;
+                }
+                req->ec = _file.error();
+                break;
+            } else if (n == 0) {
+                break;
+            }
+
+            req->done += n;
+        }
+
+        _done.push_back(req);
+        return true;
+    }
+
+    virtual bool reap(size_t min_complete, std::vector<AsyncIoRequest *> &out,
+                      std::error_code &ec) override
+    {
+        (void) min_complete;
+        (void) ec;
+
+        out.insert(out.end(), _done.begin(), _done.end());
+        _done.clear();
+        return true;
+    }
+
+private:
+    File &_file;
+    std::vector<AsyncIoRequest *> _done;
+};
+
+/*!
+ * \brief Transfer the remainder of a request with pread()/pwrite()
+ */
+static void fd_transfer(int fd, AsyncIoRequest *req)
+{
+    while (req->done < req->size) {
+        size_t size = std::min<size_t>(req->size - req->done, SSIZE_MAX);
+        off64_t offset = static_cast<off64_t>(req->offset + req->done);
+        ssize_t n;
+
+        if (req->write) {
+            n = pwrite64(fd, req->buf + req->done, size, offset);
+        } else {
+            n = pread64(fd, req->buf + req->done, size, offset);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            req->ec = std::error_code(errno, std::generic_category());
+            return;
+        } else if (n == 0) {
+            return;
+        }
+
+        req->done += static_cast<size_t>(n);
+    }
+}
+
+/*!
+ * \brief Engine that runs blocking pread()/pwrite() calls on worker threads
+ */
+class ThreadPoolEngine : public AsyncIoEngine
+{
+public:
+    ThreadPoolEngine(int fd, unsigned int n_threads)
+        : _fd(fd), _stop(false)
+    {
+        for (unsigned int i = 0; i < n_threads; ++i) {
+            _threads.emplace_back(&ThreadPoolEngine::worker, this);
+        }
+    }
+
+    virtual ~ThreadPoolEngine()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _pending_cv.notify_all();
+
+        for (auto &t : _threads) {
+            t.join();
+        }
+    }
+
+    virtual bool submit(AsyncIoRequest *req, std::error_code &ec) override
+    {
+        (void) ec;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _pending.push_back(req);
+        }
+        _pending_cv.notify_one();
+
+        return true;
+    }
+
+    virtual bool reap(size_t min_complete, std::vector<AsyncIoRequest *> &out,
+                      std::error_code &ec) override
+    {
+        (void) ec;
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done_cv.wait(lock, [&]{
+            return _done.size() >= min_complete;
+        });
+
+        out.insert(out.end(), _done.begin(), _done.end());
+        _done.clear();
+        return true;
+    }
+
+private:
+    void worker()
+    {
+        while (true) {
+            AsyncIoRequest *req;
+
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _pending_cv.wait(lock, [&]{
+                    return _stop || !_pending.empty();
+                });
+
+                if (_pending.empty()) {
+                    return;
+                }
+
+                req = _pending.front();
+                _pending.pop_front();
+            }
+
+            fd_transfer(_fd, req);
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _done.push_back(req);
+            }
+            _done_cv.notify_one();
+        }
+    }
+
+    int _fd;
+    bool _stop;
+    std::mutex _mutex;
+    std::condition_variable _pending_cv;
+    std::condition_variable _done_cv;
+    std::deque<AsyncIoRequest *> _pending;
+    std::vector<AsyncIoRequest *> _done;
+    std::vector<std::thread> _threads;
+};
+
+#ifdef HAVE_IO_URING
+
+/*!
+ * \brief Engine backed by io_uring
+ *
+ * The raw syscalls are used since liburing is not available on all of our
+ * targets. The kernel only consumes submission queue entries during
+ * io_uring_enter() because SQPOLL is not used, so no locking is needed beyond
+ * the acquire/release ordering on the ring indexes.
+ */
+class IoUringEngine : public AsyncIoEngine
+{
+public:
+    IoUringEngine(int fd)
+        : _fd(fd)
+        , _ring_fd(-1)
+        , _sq_ptr(MAP_FAILED)
+        , _sq_size(0)
+        , _cq_ptr(MAP_FAILED)
+        , _cq_size(0)
+        , _sqes(static_cast<io_uring_sqe *>(MAP_FAILED))
+        , _sqes_size(0)
+    {
+    }
+
+    virtual ~IoUringEngine()
+    {
+        if (_sqes != MAP_FAILED) {
+            munmap(_sqes, _sqes_size);
+        }
+        if (_cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr) {
+            munmap(_cq_ptr, _cq_size);
+        }
+        if (_sq_ptr != MAP_FAILED) {
+            munmap(_sq_ptr, _sq_size);
+        }
+        if (_ring_fd >= 0) {
+            ::close(_ring_fd);
+        }
+    }
+
+    bool init(unsigned int entries, std::error_code &ec)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+
+        _ring_fd = static_cast<int>(
+                syscall(__NR_io_uring_setup, entries, &p));
+        if (_ring_fd < 0) {
+            ec = std::error_code(errno, std::generic_category());
+            return false;
+        }
+
+        _sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+        _cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        _sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+
+        bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            single_mmap = true;
+            _sq_size = _cq_size = std::max(_sq_size, _cq_size);
+        }
+#endif
+
+        _sq_ptr = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+        if (_sq_ptr == MAP_FAILED) {
+            ec = std::error_code(errno, std::generic_category());
+            return false;
+        }
+
+        if (single_mmap) {
+            _cq_ptr = _sq_ptr;
+        } else {
+            _cq_ptr = mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, _ring_fd,
+                           IORING_OFF_CQ_RING);
+            if (_cq_ptr == MAP_FAILED) {
+                ec = std::error_code(errno, std::generic_category());
+                return false;
+            }
+        }
+
+        _sqes = static_cast<io_uring_sqe *>(
+                mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES));
+        if (_sqes == MAP_FAILED) {
+            ec = std::error_code(errno, std::generic_category());
+            return false;
+        }
+
+        char *sq = static_cast<char *>(_sq_ptr);
+        _sq_head = reinterpret_cast<unsigned int *>(sq + p.sq_off.head);
+        _sq_tail = reinterpret_cast<unsigned int *>(sq + p.sq_off.tail);
+        _sq_mask = reinterpret_cast<unsigned int *>(sq + p.sq_off.ring_mask);
+        _sq_array = reinterpret_cast<unsigned int *>(sq + p.sq_off.array);
+        _sq_entries = p.sq_entries;
+
+        char *cq = static_cast<char *>(_cq_ptr);
+        _cq_head = reinterpret_cast<unsigned int *>(cq + p.cq_off.head);
+        _cq_tail = reinterpret_cast<unsigned int *>(cq + p.cq_off.tail);
+        _cq_mask = reinterpret_cast<unsigned int *>(cq + p.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+
+        return true;
+    }
+
+    virtual bool submit(AsyncIoRequest *req, std::error_code &ec) override
+    {
+        unsigned int tail = *_sq_tail;
+        unsigned int head = __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+
+        if (tail - head >= _sq_entries) {
+            ec = std::make_error_code(std::errc::device_or_resource_busy);
+            return false;
+        }
+
+        req->iov.iov_base = req->buf + req->done;
+        req->iov.iov_len = std::min<size_t>(req->size - req->done, SSIZE_MAX);
+
+        unsigned int index = tail & *_sq_mask;
+        io_uring_sqe *sqe = &_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = _fd;
+        sqe->off = req->offset + req->done;
+        sqe->addr = reinterpret_cast<uintptr_t>(&req->iov);
+        sqe->len = 1;
+        sqe->user_data = reinterpret_cast<uintptr_t>(req);
+        _sq_array[index] = index;
+
+        __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        if (!enter(0, 0, ec)) {
+            // The kernel did not consume anything, so take the entry back
+            __atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+            return false;
+        }
+
+        return true;
+    }
+
+    virtual bool reap(size_t min_complete, std::vector<AsyncIoRequest *> &out,
+                      std::error_code &ec) override
+    {
+        size_t found = 0;
+
+        while (true) {
+            unsigned int head = *_cq_head;
+            unsigned int tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+
+            for (; head != tail; ++head) {
+                io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+                auto *req = reinterpret_cast<AsyncIoRequest *>(
+                        static_cast<uintptr_t>(cqe->user_data));
+
+                if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+                    _retry.push_back(req);
+                    continue;
+                } else if (cqe->res < 0) {
+                    req->ec = std::error_code(-cqe->res,
+                                              std::generic_category());
+                } else if (cqe->res > 0) {
+                    req->done += static_cast<size_t>(cqe->res);
+                    if (req->done < req->size) {
+                        // Short transfer, but not EOF yet
+                        _retry.push_back(req);
+                        continue;
+                    }
+                }
+
+                out.push_back(req);
+                ++found;
+            }
+
+            __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+
+            for (auto *req : _retry) {
+                if (!submit(req, req->ec)) {
+                    out.push_back(req);
+                    ++found;
+                }
+            }
+            _retry.clear();
+
+            if (found >= min_complete) {
+                return true;
+            }
+
+            if (!enter(1, IORING_ENTER_GETEVENTS, ec)) {
+                return false;
+            }
+        }
+    }
+
+private:
+    /*!
+     * \brief Submit all queued entries and optionally wait for completions
+     */
+    bool enter(unsigned int min_complete, unsigned int flags,
+               std::error_code &ec)
+    {
+        while (true) {
+            unsigned int to_submit = *_sq_tail
+                    - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE);
+
+            long ret = syscall(__NR_io_uring_enter, _ring_fd, to_submit,
+                               min_complete, flags, nullptr, 0);
+            if (ret >= 0) {
+                return true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EBUSY) {
+                // Completions need to be reaped first. Anything not consumed
+                // stays in the ring and will be submitted on the next call.
+                return true;
+            }
+
+            ec = std::error_code(errno, std::generic_category());
+            return false;
+        }
+    }
+
+    int _fd;
+    int _ring_fd;
+
+    void *_sq_ptr;
+    size_t _sq_size;
+    void *_cq_ptr;
+    size_t _cq_size;
+    io_uring_sqe *_sqes;
+    size_t _sqes_size;
+
+    unsigned int *_sq_head;
+    unsigned int *_sq_tail;
+    unsigned int *_sq_mask;
+    unsigned int *_sq_array;
+    unsigned int _sq_entries;
+
+    unsigned int *_cq_head;
+    unsigned int *_cq_tail;
+    unsigned int *_cq_mask;
+    io_uring_cqe *_cqes;
+
+    std::vector<AsyncIoRequest *> _retry;
+};
+
+#endif
+
+AsyncIoPrivate::AsyncIoPrivate()
+{
+    clear();
+}
+
+AsyncIoPrivate::~AsyncIoPrivate()
+{
+}
+
+void AsyncIoPrivate::clear()
+{
+    file = nullptr;
+    backend = AsyncIoBackend::Synchronous;
+    engine.reset();
+    std::vector<AsyncIoRequest>().swap(requests);
+    free_requests.clear();
+    completed.clear();
+}
+
+MB_PRINTF(3, 4)
+static void set_error(AsyncIoPrivate *priv, std::error_code ec,
+                      const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+
+    priv->error_code = ec;
+    (void) format_v(priv->error_string, fmt, ap);
+    priv->error_string += ": ";
+    priv->error_string += ec.message();
+
+    va_end(ap);
+}
+
+/*!
+ * \brief Reap finished requests and invoke their completion callbacks
+ */
+static bool dispatch_completions(AsyncIoPrivate *priv, size_t min_complete,
+                                 size_t &completed)
+{
+    std::error_code ec;
+
+    priv->completed.clear();
+    if (!priv->engine->reap(min_complete, priv->completed, ec)) {
+        set_error(priv, ec, "Failed to wait for I/O completion");
+        return false;
+    }
+
+    // Callbacks may submit new requests, which may need to reap completions
+    // themselves if the queue is full
+    std::vector<AsyncIoRequest *> done;
+    done.swap(priv->completed);
+
+    for (auto *req : done) {
+        AsyncIo::CompletionCb cb = req->cb;
+        void *userdata = req->userdata;
+        std::error_code req_ec = req->ec;
+        size_t bytes = req->done;
+
+        // Release the slot before the callback so it can be reused
+        priv->free_requests.push_back(req);
+
+        if (cb) {
+            cb(userdata, req_ec, bytes);
+        }
+    }
+
+    completed = done.size();
+    return true;
+}
+
+static bool submit_request(AsyncIoPrivate *priv, bool write, uint64_t offset,
+                           const void *buf, size_t size,
+                           AsyncIo::CompletionCb cb, void *userdata)
+{
+    if (!priv->engine) {
+        set_error(priv, make_error_code(FileError::InvalidState),
+                  "Async I/O engine is not open");
+        return false;
+    } else if (offset > INT64_MAX || size > INT64_MAX - offset) {
+        set_error(priv, make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset + size exceeds maximum file offset");
+        return false;
+    }
+
+    // Wait for a free slot if the queue is full
+    while (priv->free_requests.empty()) {
+        size_t n;
+        if (!dispatch_completions(priv, 1, n)) {
+            return false;
+        }
+    }
+
+    AsyncIoRequest *req = priv->free_requests.back();
+    priv->free_requests.pop_back();
+
+    req->write = write;
+    req->offset = offset;
+    req->buf = static_cast<char *>(const_cast<void *>(buf));
+    req->size = size;
+    req->done = 0;
+    req->ec.clear();
+    req->cb = cb;
+    req->userdata = userdata;
+
+    std::error_code ec;
+    if (!priv->engine->submit(req, ec)) {
+        priv->free_requests.push_back(req);
+        set_error(priv, ec, "Failed to submit I/O request");
+        return false;
+    }
+
+    return true;
+}
+
+/*! \endcond */
+
+/*!
+ * \class AsyncIo
+ *
+ * \brief Asynchronous positional I/O on a File handle.
+ *
+ * This allows several reads and writes to be in flight at the same time, eg.
+ * to keep the next few blocks of a partition being read while the previous
+ * block is written out.
+ *
+ * The engine is chosen when the AsyncIo is opened:
+ *
+ *   * AsyncIoBackend::IoUring: io_uring on Linux. This is tried first if the
+ *     File handle exposes a file descriptor (see File::native_fd()).
+ *   * AsyncIoBackend::ThreadPool: blocking `pread()`/`pwrite()` calls on a
+ *     small pool of worker threads. This is used if io_uring is unavailable,
+ *     eg. on older kernels or if it is blocked by seccomp.
+ *   * AsyncIoBackend::Synchronous: File::read_at() and File::write_at() are
+ *     called during submission. This is used for File handles without a file
+ *     descriptor.
+ *
+ * Completion callbacks are only ever invoked on the calling thread from
+ * poll(), drain(), close(), or from a submit function when the queue is full.
+ * Reads are only short at end of file. The buffers must remain valid until
+ * their completion callbacks are invoked.
+ *
+ * \note The File handle must remain open until the AsyncIo is closed. The file
+ *       position is never used or changed (except by
+ *       AsyncIoBackend::Synchronous, which relies on the File handle's
+ *       positional I/O implementation).
+ */
+
+/*!
+ * \typedef AsyncIo::CompletionCb
+ *
+ * \brief Request completion callback
+ *
+ * \param userdata User-supplied pointer passed to the submit function
+ * \param ec Error code. This is empty if the request succeeded.
+ * \param bytes Number of bytes transferred. This may be non-zero even if the
+ *              request failed.
+ */
+
+AsyncIo::AsyncIo()
+    : _priv_ptr(new AsyncIoPrivate())
+{
+}
+
+AsyncIo::~AsyncIo()
+{
+    close();
+}
+
+/*!
+ * \brief Open AsyncIo using the best available engine.
+ *
+ * \param file File handle. Its lifetime must exceed that of the AsyncIo.
+ * \param queue_depth Maximum number of requests that can be in flight
+ *
+ * \return Whether the AsyncIo was successfully opened
+ */
+bool AsyncIo::open(File &file, unsigned int queue_depth)
+{
+    return open(file, queue_depth, AsyncIoBackend::IoUring);
+}
+
+/*!
+ * \brief Open AsyncIo using a preferred engine.
+ *
+ * If \p backend is not available, the next engine in the order listed in the
+ * class documentation is used instead. Use backend() to check which engine was
+ * selected.
+ *
+ * \param file File handle. Its lifetime must exceed that of the AsyncIo.
+ * \param queue_depth Maximum number of requests that can be in flight
+ * \param backend Preferred engine
+ *
+ * \return Whether the AsyncIo was successfully opened
+ */
+bool AsyncIo::open(File &file, unsigned int queue_depth, AsyncIoBackend backend)
+{
+    MB_PRIVATE(AsyncIo);
+
+    if (priv->engine) {
+        set_error(priv, make_error_code(FileError::InvalidState),
+                  "Async I/O engine is already open");
+        return false;
+    } else if (queue_depth == 0) {
+        set_error(priv, make_error_code(FileError::ArgumentOutOfRange),
+                  "Queue depth cannot be zero");
+        return false;
+    }
+
+    int fd = -1;
+
+    if (!file.native_fd(fd)) {
+        if (file.error() != FileError::UnsupportedNativeFd) {
+            set_error(priv, file.error(), "%s", file.error_string().c_str());
+            return false;
+        }
+        backend = AsyncIoBackend::Synchronous;
+    }
+
+    if (backend == AsyncIoBackend::IoUring) {
+#ifdef HAVE_IO_URING
+        std::unique_ptr<IoUringEngine> engine(new IoUringEngine(fd));
+        std::error_code ec;
+
+        if (engine->init(queue_depth, ec)) {
+            priv->engine = std::move(engine);
+        } else {
+            backend = AsyncIoBackend::ThreadPool;
+        }
+#else
+        backend = AsyncIoBackend::ThreadPool;
+#endif
+    }
+
+    if (backend == AsyncIoBackend::ThreadPool) {
+        priv->engine.reset(new ThreadPoolEngine(
+                fd, std::min(queue_depth, MAX_WORKER_THREADS)));
+    } else if (backend == AsyncIoBackend::Synchronous) {
+        priv->engine.reset(new SyncEngine(file));
+    }
+
+    priv->file = &file;
+    priv->backend = backend;
+    priv->requests.resize(queue_depth);
+    priv->free_requests.reserve(queue_depth);
+    for (auto &req : priv->requests) {
+        priv->free_requests.push_back(&req);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Wait for all requests and close the AsyncIo.
+ *
+ * \return Whether all pending completions were successfully reaped. The AsyncIo
+ *         is closed regardless of the return value.
+ */
+bool AsyncIo::close()
+{
+    MB_PRIVATE(AsyncIo);
+
+    if (!priv->engine) {
+        return true;
+    }
+
+    bool ret = drain();
+
+    priv->clear();
+
+    return ret;
+}
+
+/*!
+ * \brief Check whether the AsyncIo is opened
+ */
+bool AsyncIo::is_open()
+{
+    MB_PRIVATE(AsyncIo);
+    return !!priv->engine;
+}
+
+/*!
+ * \brief Get the engine in use
+ *
+ * \return Engine in use. The return value is undefined if the AsyncIo is not
+ *         opened.
+ */
+AsyncIoBackend AsyncIo::backend()
+{
+    MB_PRIVATE(AsyncIo);
+    return priv->backend;
+}
+
+/*!
+ * \brief Get the number of requests whose completion callbacks have not been
+ *        invoked yet
+ */
+size_t AsyncIo::in_flight()
+{
+    MB_PRIVATE(AsyncIo);
+    return priv->requests.size() - priv->free_requests.size();
+}
+
+/*!
+ * \brief Submit an asynchronous read.
+ *
+ * If the queue is full, this function will block until a request completes and
+ * invoke its completion callback before submitting.
+ *
+ * \param offset File offset to read from
+ * \param buf Buffer to read into. Must remain valid until \p cb is invoked.
+ * \param size Buffer size
+ * \param cb Completion callback. May be nullptr.
+ * \param userdata User-supplied pointer to pass to \p cb
+ *
+ * \return Whether the request was successfully submitted
+ */
+bool AsyncIo::submit_read(uint64_t offset, void *buf, size_t size,
+                          CompletionCb cb, void *userdata)
+{
+    MB_PRIVATE(AsyncIo);
+    return submit_request(priv, false, offset, buf, size, cb, userdata);
+}
+
+/*!
+ * \brief Submit an asynchronous write.
+ *
+ * If the queue is full, this function will block until a request completes and
+ * invoke its completion callback before submitting.
+ *
+ * \param offset File offset to write to
+ * \param buf Buffer to write from. Must remain valid until \p cb is invoked.
+ * \param size Buffer size
+ * \param cb Completion callback. May be nullptr.
+ * \param userdata User-supplied pointer to pass to \p cb
+ *
+ * \return Whether the request was successfully submitted
+ */
+bool AsyncIo::submit_write(uint64_t offset, const void *buf, size_t size,
+                           CompletionCb cb, void *userdata)
+{
+    MB_PRIVATE(AsyncIo);
+    return submit_request(priv, true, offset, buf, size, cb, userdata);
+}
+
+/*!
+ * \brief Invoke completion callbacks for finished requests without blocking.
+ *
+ * \param[out] completed Output number of completion callbacks invoked
+ *
+ * \return Whether completions were successfully reaped
+ */
+bool AsyncIo::poll(size_t &completed)
+{
+    MB_PRIVATE(AsyncIo);
+
+    completed = 0;
+
+    if (!priv->engine) {
+        set_error(priv, make_error_code(FileError::InvalidState),
+                  "Async I/O engine is not open");
+        return false;
+    }
+
+    return dispatch_completions(priv, 0, completed);
+}
+
+/*!
+ * \brief Wait for at least one request to finish and invoke the completion
+ *        callbacks for all finished requests.
+ *
+ * If no requests are in flight, this behaves like poll().
+ *
+ * \param[out] completed Output number of completion callbacks invoked
+ *
+ * \return Whether completions were successfully reaped
+ */
+bool AsyncIo::wait(size_t &completed)
+{
+    MB_PRIVATE(AsyncIo);
+
+    completed = 0;
+
+    if (!priv->engine) {
+        set_error(priv, make_error_code(FileError::InvalidState),
+                  "Async I/O engine is not open");
+        return false;
+    }
+
+    return dispatch_completions(priv, in_flight() > 0 ? 1 : 0, completed);
+}
+
+/*!
+ * \brief Wait for all requests to finish and invoke their completion callbacks.
+ *
+ * \return Whether all completions were successfully reaped
+ */
+bool AsyncIo::drain()
+{
+    MB_PRIVATE(AsyncIo);
+
+    if (!priv->engine) {
+        set_error(priv, make_error_code(FileError::InvalidState),
+                  "Async I/O engine is not open");
+        return false;
+    }
+
+    while (in_flight() > 0) {
+        size_t n;
+        if (!dispatch_completions(priv, 1, n)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get error code for a failed operation.
+ */
+std::error_code AsyncIo::error()
+{
+    MB_PRIVATE(AsyncIo);
+    return priv->error_code;
+}
+
+/*!
+ * \brief Get error string for a failed operation.
+ */
+std::string AsyncIo::error_string()
+{
+    MB_PRIVATE(AsyncIo);
+    return priv->error_string;
+}
+
+}
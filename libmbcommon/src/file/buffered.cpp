@@ -0,0 +1,507 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/file/buffered.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "mbcommon/file/buffered_p.h"
+#include "mbcommon/file_util.h"
+
+#define DEFAULT_BUFFER_SIZE             (64 * 1024)
+
+/*!
+ * \file mbcommon/file/buffered.h
+ * \brief Buffer reads and writes to another File handle
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+
+BufferedFilePrivate::BufferedFilePrivate()
+{
+    clear();
+}
+
+BufferedFilePrivate::~BufferedFilePrivate()
+{
+}
+
+void BufferedFilePrivate::clear()
+{
+    file = nullptr;
+    buf_size = DEFAULT_BUFFER_SIZE;
+    std::vector<unsigned char>().swap(buf);
+    read_pos = 0;
+    read_end = 0;
+    write_end = 0;
+    pos_known = false;
+    pos = 0;
+}
+
+/*!
+ * \brief Propagate the error from the underlying file
+ *
+ * \return Always returns false
+ */
+static bool copy_error(File &dst, File &src)
+{
+    if (src.is_fatal()) {
+        dst.set_fatal(true);
+    }
+
+    dst.set_error(src.error(), "%s", src.error_string().c_str());
+    return false;
+}
+
+/*!
+ * \brief Write out the write-behind buffer to the underlying file
+ */
+static bool flush_write(File &pub, BufferedFilePrivate *priv)
+{
+    if (priv->write_end == 0) {
+        return true;
+    }
+
+    size_t n;
+    bool ret = file_write_fully(*priv->file, priv->buf.data(),
+                                priv->write_end, n);
+
+    if (!ret || n != priv->write_end) {
+        // Keep whatever could not be written
+        memmove(priv->buf.data(), priv->buf.data() + n, priv->write_end - n);
+        priv->write_end -= n;
+
+        if (!ret) {
+            copy_error(pub, *priv->file);
+        } else {
+            pub.set_error(std::error_code(ENOSPC, std::generic_category()),
+                          "Short write when flushing buffer");
+        }
+        return false;
+    }
+
+    priv->write_end = 0;
+    return true;
+}
+
+/*!
+ * \brief Drop the read-ahead buffer and rewind the underlying file to match the
+ *        logical file position
+ */
+static bool discard_read(File &pub, BufferedFilePrivate *priv)
+{
+    size_t remain = priv->read_end - priv->read_pos;
+
+    if (remain > 0 && !priv->file->seek(-static_cast<int64_t>(remain),
+                                        SEEK_CUR, nullptr)) {
+        return copy_error(pub, *priv->file);
+    }
+
+    priv->read_pos = 0;
+    priv->read_end = 0;
+    return true;
+}
+
+/*! \endcond */
+
+/*!
+ * \class BufferedFile
+ *
+ * \brief Buffer reads and writes to another File handle.
+ *
+ * Small reads are satisfied from a read-ahead buffer that is filled with a
+ * single large read from the underlying file. Small writes are collected in a
+ * write-behind buffer that is written out when it fills up, when the file
+ * position changes, or when flush() or close() is called. Reads and writes that
+ * are at least as large as the buffer bypass it entirely.
+ *
+ * Seeks that land within the read-ahead buffer do not touch the underlying
+ * file. Any other seek drops the buffered data. If the underlying file cannot
+ * seek, neither can the BufferedFile, though switching from reading to writing
+ * will fail if there is unconsumed read-ahead data.
+ *
+ * \note The BufferedFile will *not* take ownership of the underlying file. It
+ *       must remain open until the BufferedFile is closed. The underlying file
+ *       should not be used directly while the BufferedFile is open. After the
+ *       BufferedFile is closed, the underlying file position will match the
+ *       logical position of the BufferedFile if the underlying file is
+ *       seekable.
+ */
+
+/*!
+ * \brief Construct unbound BufferedFile.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+BufferedFile::BufferedFile()
+    : BufferedFile(new BufferedFilePrivate())
+{
+}
+
+/*!
+ * \brief Open File handle wrapping another File handle.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(File *)
+ *
+ * \param file Underlying File handle
+ */
+BufferedFile::BufferedFile(File *file)
+    : BufferedFile(new BufferedFilePrivate(), file, DEFAULT_BUFFER_SIZE)
+{
+}
+
+/*!
+ * \brief Open File handle wrapping another File handle.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(File *, size_t)
+ *
+ * \param file Underlying File handle
+ * \param buf_size Buffer size
+ */
+BufferedFile::BufferedFile(File *file, size_t buf_size)
+    : BufferedFile(new BufferedFilePrivate(), file, buf_size)
+{
+}
+
+/*! \cond INTERNAL */
+
+BufferedFile::BufferedFile(BufferedFilePrivate *priv)
+    : File(priv)
+{
+}
+
+BufferedFile::BufferedFile(BufferedFilePrivate *priv,
+                           File *file, size_t buf_size)
+    : File(priv)
+{
+    open(file, buf_size);
+}
+
+/*! \endcond */
+
+BufferedFile::~BufferedFile()
+{
+    close();
+}
+
+/*!
+ * \brief Open File handle wrapping another File handle.
+ *
+ * The default buffer size of 64 KiB is used.
+ *
+ * \param file Underlying File handle. It must already be opened.
+ *
+ * \return Whether the file is successfully opened
+ */
+bool BufferedFile::open(File *file)
+{
+    return open(file, DEFAULT_BUFFER_SIZE);
+}
+
+/*!
+ * \brief Open File handle wrapping another File handle.
+ *
+ * \param file Underlying File handle. It must already be opened.
+ * \param buf_size Buffer size. Must be non-zero.
+ *
+ * \return Whether the file is successfully opened
+ */
+bool BufferedFile::open(File *file, size_t buf_size)
+{
+    MB_PRIVATE(BufferedFile);
+
+    // pimpl can be NULL if the handle was moved. File::open() will fail
+    // appropriately in that case.
+    if (priv) {
+        priv->file = file;
+        priv->buf_size = buf_size;
+    }
+
+    return File::open();
+}
+
+/*!
+ * \brief Write buffered data to the underlying file.
+ *
+ * \return Whether all of the buffered data was written
+ */
+bool BufferedFile::flush()
+{
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    }
+
+    MB_PRIVATE(BufferedFile);
+
+    return flush_write(*this, priv);
+}
+
+bool BufferedFile::on_open()
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (!priv->file) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "No underlying file");
+        return false;
+    } else if (priv->buf_size == 0) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Buffer size cannot be zero");
+        return false;
+    }
+
+    // Keep track of the position if possible so that tell operations and seeks
+    // within the read-ahead buffer don't need to hit the underlying file
+    if (priv->file->seek(0, SEEK_CUR, &priv->pos)) {
+        priv->pos_known = true;
+    } else if (priv->file->error() != FileError::Unsupported) {
+        return copy_error(*this, *priv->file);
+    }
+
+    priv->buf.resize(priv->buf_size);
+
+    return true;
+}
+
+bool BufferedFile::on_close()
+{
+    MB_PRIVATE(BufferedFile);
+
+    bool ret = flush_write(*this, priv);
+
+    if (priv->pos_known && !discard_read(*this, priv)) {
+        ret = false;
+    }
+
+    // Reset to allow opening another file
+    priv->clear();
+
+    return ret;
+}
+
+bool BufferedFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (!flush_write(*this, priv)) {
+        return false;
+    }
+
+    if (priv->read_pos == priv->read_end) {
+        size_t n;
+
+        if (size >= priv->buf_size) {
+            // Not worth copying through the buffer
+            if (!priv->file->read(buf, size, n)) {
+                return copy_error(*this, *priv->file);
+            }
+
+            priv->pos += n;
+            bytes_read = n;
+            return true;
+        }
+
+        if (!priv->file->read(priv->buf.data(), priv->buf_size, n)) {
+            return copy_error(*this, *priv->file);
+        }
+
+        priv->read_pos = 0;
+        priv->read_end = n;
+    }
+
+    size_t n = std::min(size, priv->read_end - priv->read_pos);
+    memcpy(buf, priv->buf.data() + priv->read_pos, n);
+    priv->read_pos += n;
+    priv->pos += n;
+    bytes_read = n;
+
+    return true;
+}
+
+bool BufferedFile::on_write(const void *buf, size_t size, size_t &bytes_written)
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (priv->read_end > 0 && !discard_read(*this, priv)) {
+        return false;
+    }
+
+    if (size > priv->buf_size - priv->write_end
+            && !flush_write(*this, priv)) {
+        return false;
+    }
+
+    if (size >= priv->buf_size) {
+        // Not worth copying through the buffer
+        size_t n;
+
+        if (!priv->file->write(buf, size, n)) {
+            return copy_error(*this, *priv->file);
+        }
+
+        priv->pos += n;
+        bytes_written = n;
+        return true;
+    }
+
+    memcpy(priv->buf.data() + priv->write_end, buf, size);
+    priv->write_end += size;
+    priv->pos += size;
+    bytes_written = size;
+
+    return true;
+}
+
+bool BufferedFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (priv->pos_known) {
+        // Fast path for tell operations
+        if (whence == SEEK_CUR && offset == 0) {
+            new_offset = priv->pos;
+            return true;
+        }
+
+        // Seeking within the read-ahead buffer
+        if (priv->read_end > 0 && whence != SEEK_END) {
+            uint64_t buf_start = priv->pos - priv->read_pos;
+            uint64_t target;
+            bool valid = true;
+
+            if (whence == SEEK_SET) {
+                valid = offset >= 0;
+                target = static_cast<uint64_t>(offset);
+            } else if (offset < 0) {
+                // Avoid negating INT64_MIN
+                uint64_t back = static_cast<uint64_t>(-(offset + 1)) + 1;
+                valid = back <= priv->pos;
+                target = priv->pos - back;
+            } else {
+                target = priv->pos + static_cast<uint64_t>(offset);
+            }
+
+            if (valid && target >= buf_start
+                    && target - buf_start <= priv->read_end) {
+                priv->read_pos = static_cast<size_t>(target - buf_start);
+                priv->pos = target;
+                new_offset = target;
+                return true;
+            }
+        }
+    }
+
+    if (!flush_write(*this, priv)) {
+        return false;
+    }
+
+    // The underlying file position is ahead of the logical position by the
+    // amount of unconsumed read-ahead data
+    size_t remain = priv->read_end - priv->read_pos;
+    if (whence == SEEK_CUR) {
+        if (offset < INT64_MIN + static_cast<int64_t>(remain)) {
+            set_error(make_error_code(FileError::ArgumentOutOfRange),
+                      "Offset is out of range");
+            return false;
+        }
+        offset -= static_cast<int64_t>(remain);
+    }
+
+    uint64_t n;
+
+    if (!priv->file->seek(offset, whence, &n)) {
+        return copy_error(*this, *priv->file);
+    }
+
+    priv->read_pos = 0;
+    priv->read_end = 0;
+    priv->pos_known = true;
+    priv->pos = n;
+    new_offset = n;
+
+    return true;
+}
+
+bool BufferedFile::on_truncate(uint64_t size)
+{
+    MB_PRIVATE(BufferedFile);
+
+    if (!flush_write(*this, priv) || !discard_read(*this, priv)) {
+        return false;
+    }
+
+    if (!priv->file->truncate(size)) {
+        return copy_error(*this, *priv->file);
+    }
+
+    return true;
+}
+
+bool BufferedFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                              size_t &bytes_read)
+{
+    MB_PRIVATE(BufferedFile);
+
+    // The read-ahead buffer is still valid after a positional read
+    if (!flush_write(*this, priv)) {
+        return false;
+    }
+
+    if (!priv->file->read_at(offset, buf, size, bytes_read)) {
+        return copy_error(*this, *priv->file);
+    }
+
+    return true;
+}
+
+bool BufferedFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                               size_t &bytes_written)
+{
+    MB_PRIVATE(BufferedFile);
+
+    // The write may overlap the read-ahead buffer, so drop it
+    if (!flush_write(*this, priv) || !discard_read(*this, priv)) {
+        return false;
+    }
+
+    if (!priv->file->write_at(offset, buf, size, bytes_written)) {
+        return copy_error(*this, *priv->file);
+    }
+
+    return true;
+}
+
+}
@@ -19,6 +19,8 @@
 
 #include "mbcommon/file/fd.h"
 
+#include <algorithm>
+
 #include <cerrno>
 #include <climits>
 #include <cstdlib>
@@ -35,6 +37,10 @@
 #define DEFAULT_MODE \
     (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 
+// Maximum number of buffers passed to a single readv()/writev() call. Larger
+// arrays result in a short read or write, which callers must handle anyway.
+#define MAX_IOVECS 64
+
 /*!
  * \file mbcommon/file/fd.h
  * \brief Open file with POSIX file descriptors API
@@ -78,6 +84,32 @@ struct RealFdFileFuncs : public FdFileFuncs
         return lseek64(fd, offset, whence);
     }
 
+#ifndef _WIN32
+    virtual ssize_t fn_pread64(int fd, void *buf, size_t count,
+                               off64_t offset) override
+    {
+        return pread64(fd, buf, count, offset);
+    }
+
+    virtual ssize_t fn_pwrite64(int fd, const void *buf, size_t count,
+                                off64_t offset) override
+    {
+        return pwrite64(fd, buf, count, offset);
+    }
+
+    virtual ssize_t fn_readv(int fd, const struct iovec *iov,
+                             int iovcnt) override
+    {
+        return readv(fd, iov, iovcnt);
+    }
+
+    virtual ssize_t fn_writev(int fd, const struct iovec *iov,
+                              int iovcnt) override
+    {
+        return writev(fd, iov, iovcnt);
+    }
+#endif
+
     virtual ssize_t fn_read(int fd, void *buf, size_t count) override
     {
         return read(fd, buf, count);
@@ -92,6 +124,37 @@ struct RealFdFileFuncs : public FdFileFuncs
 
 static RealFdFileFuncs g_default_funcs;
 
+#ifndef _WIN32
+/*!
+ * \brief Convert File I/O vectors to POSIX iovecs
+ *
+ * At most #MAX_IOVECS entries are converted and the total size is limited to
+ * `SSIZE_MAX` bytes.
+ *
+ * \return Number of entries in \p out
+ */
+template<typename T>
+static int to_posix_iovecs(const T *iov, size_t count,
+                           struct iovec (&out)[MAX_IOVECS])
+{
+    size_t remain = SSIZE_MAX;
+    int n = 0;
+
+    for (size_t i = 0; i < count && n < MAX_IOVECS && remain > 0; ++i) {
+        size_t size = std::min(iov[i].size, remain);
+
+        out[n].iov_base = const_cast<void *>(
+                static_cast<const void *>(iov[i].data));
+        out[n].iov_len = size;
+        ++n;
+
+        remain -= size;
+    }
+
+    return n;
+}
+#endif
+
 /*! \cond INTERNAL */
 
 FdFilePrivate::FdFilePrivate()
@@ -488,4 +551,123 @@ bool FdFile::on_truncate(uint64_t size)
     return true;
 }
 
+bool FdFile::on_readv(const FileIoVec *iov, size_t count, size_t &bytes_read)
+{
+#ifdef _WIN32
+    // The MSVCRT has no readv() equivalent
+    return File::on_readv(iov, count, bytes_read);
+#else
+    MB_PRIVATE(FdFile);
+
+    struct iovec posix_iov[MAX_IOVECS];
+    int posix_count = to_posix_iovecs(iov, count, posix_iov);
+
+    ssize_t n = priv->funcs->fn_readv(priv->fd, posix_iov, posix_count);
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to read file");
+        return false;
+    }
+
+    bytes_read = n;
+    return true;
+#endif
+}
+
+bool FdFile::on_writev(const FileConstIoVec *iov, size_t count,
+                       size_t &bytes_written)
+{
+#ifdef _WIN32
+    // The MSVCRT has no writev() equivalent
+    return File::on_writev(iov, count, bytes_written);
+#else
+    MB_PRIVATE(FdFile);
+
+    struct iovec posix_iov[MAX_IOVECS];
+    int posix_count = to_posix_iovecs(iov, count, posix_iov);
+
+    ssize_t n = priv->funcs->fn_writev(priv->fd, posix_iov, posix_count);
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to write file");
+        return false;
+    }
+
+    bytes_written = n;
+    return true;
+#endif
+}
+
+bool FdFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                        size_t &bytes_read)
+{
+#ifdef _WIN32
+    // The MSVCRT has no pread() equivalent
+    return File::on_read_at(offset, buf, size, bytes_read);
+#else
+    MB_PRIVATE(FdFile);
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    }
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    ssize_t n = priv->funcs->fn_pread64(priv->fd, buf, size,
+                                        static_cast<off64_t>(offset));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to read file");
+        return false;
+    }
+
+    bytes_read = n;
+    return true;
+#endif
+}
+
+bool FdFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                         size_t &bytes_written)
+{
+#ifdef _WIN32
+    // The MSVCRT has no pwrite() equivalent
+    return File::on_write_at(offset, buf, size, bytes_written);
+#else
+    MB_PRIVATE(FdFile);
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    }
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    ssize_t n = priv->funcs->fn_pwrite64(priv->fd, buf, size,
+                                         static_cast<off64_t>(offset));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to write file");
+        return false;
+    }
+
+    bytes_written = n;
+    return true;
+#endif
+}
+
+bool FdFile::on_native_fd(int &fd)
+{
+    MB_PRIVATE(FdFile);
+
+    fd = priv->fd;
+    return true;
+}
+
 }
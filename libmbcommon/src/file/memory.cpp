@@ -35,6 +35,9 @@
  * \brief Open file from memory
  */
 
+// Smallest allocation made when a dynamic buffer grows
+#define MIN_DYNAMIC_CAPACITY    4096
+
 namespace mb
 {
 
@@ -53,10 +56,83 @@ void MemoryFilePrivate::clear()
 {
     data = nullptr;
     size = 0;
+    capacity = 0;
     data_ptr = nullptr;
     size_ptr = nullptr;
     pos = 0;
     fixed_size = false;
+    fixed_capacity = false;
+    owned = false;
+}
+
+static void update_pointers(MemoryFilePrivate *priv)
+{
+    if (priv->data_ptr) {
+        *priv->data_ptr = priv->data;
+    }
+    if (priv->size_ptr) {
+        *priv->size_ptr = priv->size;
+    }
+}
+
+/*!
+ * \brief Make sure a dynamic buffer can hold at least \p capacity bytes
+ *
+ * Unless \p exact is true, the buffer grows geometrically so that a series of
+ * appends only reallocates (and copies) the data a logarithmic number of times.
+ */
+static bool ensure_capacity(MemoryFile &file, MemoryFilePrivate *priv,
+                            size_t capacity, bool exact)
+{
+    if (capacity <= priv->capacity) {
+        return true;
+    } else if (priv->fixed_size || priv->fixed_capacity) {
+        file.set_error(make_error_code(FileError::ArgumentOutOfRange),
+                       "Size %" MB_PRIzu " exceeds buffer capacity of %"
+                       MB_PRIzu, capacity, priv->capacity);
+        return false;
+    }
+
+    size_t new_capacity = capacity;
+
+    if (!exact) {
+        size_t grown = priv->capacity > SIZE_MAX / 2
+                ? SIZE_MAX : priv->capacity * 2;
+        new_capacity = std::max(new_capacity, grown);
+        new_capacity = std::max<size_t>(new_capacity, MIN_DYNAMIC_CAPACITY);
+    }
+
+    void *new_data = realloc(priv->data, new_capacity);
+    if (!new_data) {
+        file.set_error(std::error_code(errno, std::generic_category()),
+                       "Failed to enlarge buffer");
+        return false;
+    }
+
+    priv->data = new_data;
+    priv->capacity = new_capacity;
+    update_pointers(priv);
+
+    return true;
+}
+
+/*!
+ * \brief Extend the file to \p size bytes within the existing capacity
+ *
+ * The new space before \p data_offset is zero-initialized. Space after it is
+ * about to be overwritten by the caller.
+ */
+static void extend(MemoryFilePrivate *priv, size_t size, size_t data_offset)
+{
+    size_t zero_end = std::min(size, data_offset);
+
+    if (zero_end > priv->size) {
+        memset(static_cast<char *>(priv->data) + priv->size, 0,
+               zero_end - priv->size);
+    }
+
+    priv->size = size;
+    update_pointers(priv);
 }
 
 /*! \endcond */
@@ -65,6 +141,18 @@ void MemoryFilePrivate::clear()
  * \class MemoryFile
  *
  * \brief Open file from statically or dynamically sized memory buffers.
+ *
+ * There are three kinds of buffers:
+ *
+ * * Fixed size buffers (open(const void *, size_t)). Writes cannot extend the
+ *   file.
+ * * Dynamically allocated buffers (open(void **, size_t *)). Writes past the
+ *   end of the file grow the buffer with realloc(). The allocation grows
+ *   geometrically, so the buffer may be larger than the file. reserve() can be
+ *   used to allocate the final size up front and release() hands the buffer
+ *   off to the caller.
+ * * Caller-provided arenas (open(void *, size_t, size_t *)). Writes can extend
+ *   the file up to the size of the arena. Nothing is ever allocated or copied.
  */
 
 /*!
@@ -110,6 +198,23 @@ MemoryFile::MemoryFile(void **buf_ptr, size_t *size_ptr)
 {
 }
 
+/*!
+ * \brief Open File handle from caller-provided arena.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(void *, size_t, size_t *)
+ *
+ * \param buf Arena buffer
+ * \param capacity Size of arena buffer
+ * \param[in,out] size_ptr Pointer to size of the data in the arena
+ */
+MemoryFile::MemoryFile(void *buf, size_t capacity, size_t *size_ptr)
+    : MemoryFile(new MemoryFilePrivate(), buf, capacity, size_ptr)
+{
+}
+
 /*! \cond INTERNAL */
 
 MemoryFile::MemoryFile(MemoryFilePrivate *priv)
@@ -131,6 +236,13 @@ MemoryFile::MemoryFile(MemoryFilePrivate *priv,
     open(buf_ptr, size_ptr);
 }
 
+MemoryFile::MemoryFile(MemoryFilePrivate *priv,
+                       void *buf, size_t capacity, size_t *size_ptr)
+    : File(priv)
+{
+    open(buf, capacity, size_ptr);
+}
+
 /*! \endcond */
 
 MemoryFile::~MemoryFile()
@@ -152,10 +264,13 @@ bool MemoryFile::open(const void *buf, size_t size)
     if (priv) {
         priv->data = const_cast<void *>(buf);
         priv->size = size;
+        priv->capacity = size;
         priv->data_ptr = nullptr;
         priv->size_ptr = nullptr;
         priv->pos = 0;
         priv->fixed_size = true;
+        priv->fixed_capacity = false;
+        priv->owned = false;
     }
     return File::open();
 }
@@ -163,8 +278,15 @@ bool MemoryFile::open(const void *buf, size_t size)
 /*!
  * \brief Open from dynamically sized memory buffer.
  *
- * \param[in,out] buf_ptr Pointer to data buffer
- * \param[in,out] size_ptr Pointer to size of data buffer
+ * The buffer pointed to by \p buf_ptr must have been allocated with malloc()
+ * (or be null) and is updated whenever the buffer is reallocated. The caller
+ * remains responsible for freeing it.
+ *
+ * If \p buf_ptr is null, the file starts out empty and owns its buffer. The
+ * buffer is freed when the file is closed unless it is taken with release().
+ *
+ * \param[in,out] buf_ptr Pointer to data buffer (may be null)
+ * \param[in,out] size_ptr Pointer to size of data buffer (may be null)
  *
  * \return Whether the file is successfully opened
  */
@@ -172,20 +294,128 @@ bool MemoryFile::open(void **buf_ptr, size_t *size_ptr)
 {
     MB_PRIVATE(MemoryFile);
     if (priv) {
-        priv->data = *buf_ptr;
-        priv->size = *size_ptr;
+        priv->data = buf_ptr ? *buf_ptr : nullptr;
+        priv->size = buf_ptr && size_ptr ? *size_ptr : 0;
+        priv->capacity = priv->size;
         priv->data_ptr = buf_ptr;
         priv->size_ptr = size_ptr;
         priv->pos = 0;
         priv->fixed_size = false;
+        priv->fixed_capacity = false;
+        priv->owned = !buf_ptr;
+        update_pointers(priv);
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Open from caller-provided arena.
+ *
+ * The file initially contains the first \p *size_ptr bytes of the arena (or
+ * nothing if \p size_ptr is null). Writes can extend the file up to \p
+ * capacity bytes. Writes beyond that are truncated, like with fixed size
+ * buffers. The arena is never reallocated or freed.
+ *
+ * \param buf Arena buffer
+ * \param capacity Size of arena buffer
+ * \param[in,out] size_ptr Pointer to size of the data in the arena (may be
+ *                         null)
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MemoryFile::open(void *buf, size_t capacity, size_t *size_ptr)
+{
+    MB_PRIVATE(MemoryFile);
+    if (priv) {
+        priv->data = buf;
+        priv->size = size_ptr ? std::min(*size_ptr, capacity) : 0;
+        priv->capacity = capacity;
+        priv->data_ptr = nullptr;
+        priv->size_ptr = size_ptr;
+        priv->pos = 0;
+        priv->fixed_size = false;
+        priv->fixed_capacity = true;
+        priv->owned = false;
+        update_pointers(priv);
     }
     return File::open();
 }
 
+/*!
+ * \brief Reserve space in the buffer.
+ *
+ * For dynamically sized buffers, this allocates space for at least \p capacity
+ * bytes so that writes up to that size do not need to reallocate the buffer.
+ * The size of the file does not change. For fixed size buffers and arenas, this
+ * only checks that the buffer is large enough.
+ *
+ * \param capacity Size hint
+ *
+ * \return Whether the buffer can hold \p capacity bytes
+ */
+bool MemoryFile::reserve(size_t capacity)
+{
+    MB_PRIVATE(MemoryFile);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    }
+
+    return ensure_capacity(*this, priv, capacity, true);
+}
+
+/*!
+ * \brief Take ownership of a dynamically sized buffer.
+ *
+ * The buffer is handed off without copying and must be freed with free(). The
+ * file remains open, but is empty afterwards. If the file was opened with
+ * pointers to the buffer and size, they are reset to null and 0.
+ *
+ * \note The returned buffer may be larger than \p size due to the geometric
+ *       growth.
+ *
+ * \param[out] buf Buffer containing the file data
+ * \param[out] size Size of the file data
+ *
+ * \return Whether the buffer was released. This fails for fixed size buffers
+ *         and arenas since they are not owned by the file.
+ */
+bool MemoryFile::release(void *&buf, size_t &size)
+{
+    MB_PRIVATE(MemoryFile);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "File is not open");
+        return false;
+    } else if (priv->fixed_size || priv->fixed_capacity) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "Cannot release buffer that is not dynamically allocated");
+        return false;
+    }
+
+    buf = priv->data;
+    size = priv->size;
+
+    priv->data = nullptr;
+    priv->size = 0;
+    priv->capacity = 0;
+    priv->pos = 0;
+    update_pointers(priv);
+
+    return true;
+}
+
 bool MemoryFile::on_close()
 {
     MB_PRIVATE(MemoryFile);
 
+    if (priv->owned) {
+        free(priv->data);
+    }
+
     // Reset to allow opening another file
     priv->clear();
 
@@ -225,25 +455,17 @@ bool MemoryFile::on_write(const void *buf, size_t size, size_t &bytes_written)
         if (priv->fixed_size) {
             to_write = priv->pos <= priv->size ? priv->size - priv->pos : 0;
         } else {
-            // Enlarge buffer
-            void *new_data = realloc(priv->data, desired_size);
-            if (!new_data) {
-                set_error(std::error_code(errno, std::generic_category()),
-                          "Failed to enlarge buffer");
+            if (priv->fixed_capacity) {
+                // Truncate the write at the end of the arena
+                desired_size = std::min(desired_size, priv->capacity);
+                to_write = desired_size > priv->pos
+                        ? desired_size - priv->pos : 0;
+            } else if (!ensure_capacity(*this, priv, desired_size, false)) {
                 return false;
             }
 
-            // Zero-initialize new space
-            memset(static_cast<char *>(new_data) + priv->size, 0,
-                   desired_size - priv->size);
-
-            priv->data = new_data;
-            priv->size = desired_size;
-            if (priv->data_ptr) {
-                *priv->data_ptr = priv->data;
-            }
-            if (priv->size_ptr) {
-                *priv->size_ptr = priv->size;
+            if (desired_size > priv->size) {
+                extend(priv, desired_size, priv->pos);
             }
         }
     }
@@ -307,30 +529,76 @@ bool MemoryFile::on_truncate(uint64_t size)
         set_error(make_error_code(FileError::UnsupportedTruncate),
                   "Cannot truncate fixed buffer");
         return false;
+    } else if (size > SIZE_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Size %" PRIu64 " exceeds maximum buffer size", size);
+        return false;
+    }
+
+    // Shrinking keeps the allocation so that growing again doesn't copy
+    if (!ensure_capacity(*this, priv, static_cast<size_t>(size), true)) {
+        return false;
+    }
+
+    if (size > priv->size) {
+        extend(priv, static_cast<size_t>(size), static_cast<size_t>(size));
     } else {
-        void *new_data = realloc(priv->data, size);
-        if (!new_data) {
-            set_error(std::error_code(errno, std::generic_category()),
-                      "Failed to resize buffer");
-            return false;
-        }
+        priv->size = static_cast<size_t>(size);
+        update_pointers(priv);
+    }
 
-        // Zero-initialize new space
-        if (size > priv->size) {
-            memset(static_cast<char *>(new_data) + priv->size, 0,
-                   size - priv->size);
-        }
+    return true;
+}
 
-        priv->data = new_data;
-        priv->size = size;
-        if (priv->data_ptr) {
-            *priv->data_ptr = priv->data;
-        }
-        if (priv->size_ptr) {
-            *priv->size_ptr = priv->size;
-        }
+bool MemoryFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read)
+{
+    MB_PRIVATE(MemoryFile);
+
+    size_t to_read = 0;
+    if (offset < priv->size) {
+        to_read = std::min<size_t>(priv->size - offset, size);
+    }
+
+    memcpy(buf, static_cast<char *>(priv->data) + offset, to_read);
+
+    bytes_read = to_read;
+    return true;
+}
+
+bool MemoryFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                             size_t &bytes_written)
+{
+    MB_PRIVATE(MemoryFile);
+
+    if (offset > SIZE_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset %" PRIu64 " exceeds maximum buffer size", offset);
+        return false;
+    }
+
+    // Reuse the growth logic in on_write() without disturbing the position
+    size_t old_pos = priv->pos;
+    priv->pos = static_cast<size_t>(offset);
+
+    bool ret = on_write(buf, size, bytes_written);
+
+    priv->pos = old_pos;
+    return ret;
+}
+
+bool MemoryFile::on_map_range(uint64_t offset, size_t size,
+                              const void *&data, size_t &data_size)
+{
+    MB_PRIVATE(MemoryFile);
+
+    size_t available = 0;
+    if (offset < priv->size) {
+        available = std::min<size_t>(priv->size - offset, size);
     }
 
+    data = static_cast<char *>(priv->data) + (available ? offset : 0);
+    data_size = available;
     return true;
 }
 
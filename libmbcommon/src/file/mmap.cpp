@@ -0,0 +1,569 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/file/mmap.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/file/mmap_p.h"
+#include "mbcommon/string.h"
+
+/*!
+ * \file mbcommon/file/mmap.h
+ * \brief Open file as a read-only memory mapping
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+struct RealMmapFileFuncs : public MmapFileFuncs
+{
+    virtual int fn_open(const char *path, int flags, mode_t mode) override
+    {
+        return open(path, flags, mode);
+    }
+
+    virtual void * fn_mmap(void *addr, size_t length, int prot, int flags,
+                           int fd, off64_t offset) override
+    {
+#if defined(__ANDROID__) && !defined(__LP64__)
+        return mmap64(addr, length, prot, flags, fd, offset);
+#else
+        return mmap(addr, length, prot, flags, fd, offset);
+#endif
+    }
+
+    virtual int fn_munmap(void *addr, size_t length) override
+    {
+        return munmap(addr, length);
+    }
+
+    virtual int fn_fstat(int fildes, struct stat *buf) override
+    {
+        return fstat(fildes, buf);
+    }
+
+    virtual int fn_close(int fd) override
+    {
+        return close(fd);
+    }
+
+    virtual off64_t fn_lseek64(int fd, off64_t offset, int whence) override
+    {
+        return lseek64(fd, offset, whence);
+    }
+
+    virtual long fn_sysconf(int name) override
+    {
+        return sysconf(name);
+    }
+};
+/*! \endcond */
+
+static RealMmapFileFuncs g_default_funcs;
+
+/*! \cond INTERNAL */
+
+MmapFilePrivate::MmapFilePrivate()
+    : MmapFilePrivate(&g_default_funcs)
+{
+}
+
+MmapFilePrivate::MmapFilePrivate(MmapFileFuncs *funcs)
+    : funcs(funcs)
+{
+    clear();
+}
+
+MmapFilePrivate::~MmapFilePrivate()
+{
+}
+
+void MmapFilePrivate::clear()
+{
+    fd = -1;
+    owned = false;
+    filename.clear();
+    whole_file = true;
+    window_offset = 0;
+    window_size = 0;
+    map = nullptr;
+    map_size = 0;
+    data = nullptr;
+    size = 0;
+    pos = 0;
+}
+
+/*! \endcond */
+
+/*!
+ * \class MmapFile
+ *
+ * \brief Open file as a read-only memory mapping.
+ *
+ * Either the whole file or a window of it is mapped with `mmap()` when the
+ * handle is opened. Reads are served by copying from the mapping and
+ * File::map_range() returns pointers directly into the mapping, which allows
+ * callers to parse headers in place without any copying.
+ *
+ * Writing and truncation are not supported. The mapping is private, so changes
+ * made to the underlying file by other processes after the handle is opened
+ * may or may not be visible.
+ */
+
+/*!
+ * \brief Construct unbound MmapFile.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+MmapFile::MmapFile()
+    : MmapFile(new MmapFilePrivate())
+{
+}
+
+/*!
+ * \brief Map whole file from file descriptor.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(int, bool)
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ */
+MmapFile::MmapFile(int fd, bool owned)
+    : MmapFile(new MmapFilePrivate(), fd, owned)
+{
+}
+
+/*!
+ * \brief Map window of file from file descriptor.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(int, bool, uint64_t, uint64_t)
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ * \param offset Offset of the window
+ * \param size Size of the window
+ */
+MmapFile::MmapFile(int fd, bool owned, uint64_t offset, uint64_t size)
+    : MmapFile(new MmapFilePrivate(), fd, owned, offset, size)
+{
+}
+
+/*!
+ * \brief Map whole file from filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(const std::string &)
+ *
+ * \param filename Filename
+ */
+MmapFile::MmapFile(const std::string &filename)
+    : MmapFile(new MmapFilePrivate(), filename)
+{
+}
+
+/*!
+ * \brief Map window of file from filename.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(const std::string &, uint64_t, uint64_t)
+ *
+ * \param filename Filename
+ * \param offset Offset of the window
+ * \param size Size of the window
+ */
+MmapFile::MmapFile(const std::string &filename, uint64_t offset, uint64_t size)
+    : MmapFile(new MmapFilePrivate(), filename, offset, size)
+{
+}
+
+/*! \cond INTERNAL */
+
+MmapFile::MmapFile(MmapFilePrivate *priv)
+    : File(priv)
+{
+}
+
+MmapFile::MmapFile(MmapFilePrivate *priv,
+                   int fd, bool owned)
+    : File(priv)
+{
+    open(fd, owned);
+}
+
+MmapFile::MmapFile(MmapFilePrivate *priv,
+                   int fd, bool owned, uint64_t offset, uint64_t size)
+    : File(priv)
+{
+    open(fd, owned, offset, size);
+}
+
+MmapFile::MmapFile(MmapFilePrivate *priv,
+                   const std::string &filename)
+    : File(priv)
+{
+    open(filename);
+}
+
+MmapFile::MmapFile(MmapFilePrivate *priv,
+                   const std::string &filename, uint64_t offset, uint64_t size)
+    : File(priv)
+{
+    open(filename, offset, size);
+}
+
+/*! \endcond */
+
+MmapFile::~MmapFile()
+{
+    close();
+}
+
+/*!
+ * \brief Map whole file from file descriptor.
+ *
+ * If \p owned is true, then the File handle will take ownership of the file
+ * descriptor. In other words, the file descriptor will be closed when the
+ * File handle is closed.
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(int fd, bool owned)
+{
+    MB_PRIVATE(MmapFile);
+    if (priv) {
+        priv->fd = fd;
+        priv->owned = owned;
+        priv->whole_file = true;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Map window of file from file descriptor.
+ *
+ * Only the \p size bytes starting at \p offset are mapped and the resulting
+ * File handle behaves as if it were a file containing only that window. The
+ * window must lie entirely within the file.
+ *
+ * \param fd File descriptor
+ * \param owned Whether the file descriptor should be owned by the File handle
+ * \param offset Offset of the window
+ * \param size Size of the window
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(int fd, bool owned, uint64_t offset, uint64_t size)
+{
+    MB_PRIVATE(MmapFile);
+    if (priv) {
+        priv->fd = fd;
+        priv->owned = owned;
+        priv->whole_file = false;
+        priv->window_offset = offset;
+        priv->window_size = size;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Map whole file from filename.
+ *
+ * \param filename Filename
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(const std::string &filename)
+{
+    MB_PRIVATE(MmapFile);
+    if (priv) {
+        priv->fd = -1;
+        priv->owned = true;
+        priv->filename = filename;
+        priv->whole_file = true;
+    }
+    return File::open();
+}
+
+/*!
+ * \brief Map window of file from filename.
+ *
+ * \sa open(int, bool, uint64_t, uint64_t)
+ *
+ * \param filename Filename
+ * \param offset Offset of the window
+ * \param size Size of the window
+ *
+ * \return Whether the file is successfully opened
+ */
+bool MmapFile::open(const std::string &filename, uint64_t offset, uint64_t size)
+{
+    MB_PRIVATE(MmapFile);
+    if (priv) {
+        priv->fd = -1;
+        priv->owned = true;
+        priv->filename = filename;
+        priv->whole_file = false;
+        priv->window_offset = offset;
+        priv->window_size = size;
+    }
+    return File::open();
+}
+
+bool MmapFile::on_open()
+{
+    MB_PRIVATE(MmapFile);
+
+    if (!priv->filename.empty()) {
+        priv->fd = priv->funcs->fn_open(
+                priv->filename.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (priv->fd < 0) {
+            set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to open file");
+            return false;
+        }
+    }
+
+    struct stat sb;
+
+    if (priv->funcs->fn_fstat(priv->fd, &sb) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to stat file");
+        return false;
+    }
+
+    if (S_ISDIR(sb.st_mode)) {
+        set_error(std::make_error_code(std::errc::is_a_directory),
+                  "Failed to open file");
+        return false;
+    }
+
+    uint64_t file_size;
+
+    if (S_ISREG(sb.st_mode)) {
+        file_size = static_cast<uint64_t>(sb.st_size);
+    } else {
+        // Block devices report a size of 0
+        off64_t end = priv->funcs->fn_lseek64(priv->fd, 0, SEEK_END);
+        if (end < 0) {
+            set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to get file size");
+            return false;
+        }
+        file_size = static_cast<uint64_t>(end);
+    }
+
+    if (priv->whole_file) {
+        priv->window_offset = 0;
+        priv->window_size = file_size;
+    } else if (priv->window_offset > file_size
+            || priv->window_size > file_size - priv->window_offset) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Window [%" PRIu64 ", %" PRIu64 ") exceeds file size %"
+                  PRIu64, priv->window_offset,
+                  priv->window_offset + priv->window_size, file_size);
+        return false;
+    }
+
+    if (priv->window_size > SIZE_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Window size %" PRIu64 " exceeds address space",
+                  priv->window_size);
+        return false;
+    }
+
+    // Mapping offsets must be page-aligned
+    long page_size = priv->funcs->fn_sysconf(_SC_PAGESIZE);
+    if (page_size <= 0) {
+        page_size = 4096;
+    }
+
+    uint64_t aligned_offset = priv->window_offset
+            - priv->window_offset % static_cast<uint64_t>(page_size);
+    size_t delta = static_cast<size_t>(priv->window_offset - aligned_offset);
+
+    if (priv->window_size > SIZE_MAX - delta) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Window size %" PRIu64 " exceeds address space",
+                  priv->window_size);
+        return false;
+    }
+
+    // mmap() fails for zero-length mappings, but empty files are valid
+    if (priv->window_size > 0) {
+        size_t map_size = static_cast<size_t>(priv->window_size) + delta;
+
+        void *map = priv->funcs->fn_mmap(
+                nullptr, map_size, PROT_READ, MAP_PRIVATE, priv->fd,
+                static_cast<off64_t>(aligned_offset));
+        if (map == MAP_FAILED) {
+            set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to map file");
+            return false;
+        }
+
+        priv->map = map;
+        priv->map_size = map_size;
+        priv->data = static_cast<const char *>(map) + delta;
+    }
+
+    priv->size = static_cast<size_t>(priv->window_size);
+    priv->pos = 0;
+
+    return true;
+}
+
+bool MmapFile::on_close()
+{
+    MB_PRIVATE(MmapFile);
+
+    bool ret = true;
+
+    if (priv->map && priv->funcs->fn_munmap(priv->map, priv->map_size) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to unmap file");
+        ret = false;
+    }
+
+    if (priv->owned && priv->fd >= 0 && priv->funcs->fn_close(priv->fd) < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to close file");
+        ret = false;
+    }
+
+    // Reset to allow opening another file
+    priv->clear();
+
+    return ret;
+}
+
+bool MmapFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    MB_PRIVATE(MmapFile);
+
+    size_t to_read = 0;
+    if (priv->pos < priv->size) {
+        to_read = std::min(priv->size - priv->pos, size);
+        memcpy(buf, priv->data + priv->pos, to_read);
+        priv->pos += to_read;
+    }
+
+    bytes_read = to_read;
+    return true;
+}
+
+bool MmapFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    MB_PRIVATE(MmapFile);
+
+    switch (whence) {
+    case SEEK_SET:
+        if (offset < 0 || static_cast<uint64_t>(offset) > SIZE_MAX) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_SET offset %" PRId64, offset);
+            return false;
+        }
+        new_offset = priv->pos = static_cast<size_t>(offset);
+        break;
+    case SEEK_CUR:
+        if ((offset < 0 && static_cast<uint64_t>(-offset) > priv->pos)
+                || (offset > 0 && static_cast<uint64_t>(offset)
+                        > SIZE_MAX - priv->pos)) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_CUR offset %" PRId64
+                      " for position %" MB_PRIzu, offset, priv->pos);
+            return false;
+        }
+        new_offset = priv->pos += offset;
+        break;
+    case SEEK_END:
+        if ((offset < 0 && static_cast<uint64_t>(-offset) > priv->size)
+                || (offset > 0 && static_cast<uint64_t>(offset)
+                        > SIZE_MAX - priv->size)) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Invalid SEEK_END offset %" PRId64
+                      " for file of size %" MB_PRIzu, offset, priv->size);
+            return false;
+        }
+        new_offset = priv->pos = priv->size + offset;
+        break;
+    default:
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid whence argument: %d", whence);
+        return false;
+    }
+
+    return true;
+}
+
+bool MmapFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                          size_t &bytes_read)
+{
+    MB_PRIVATE(MmapFile);
+
+    size_t to_read = 0;
+    if (offset < priv->size) {
+        to_read = std::min<size_t>(priv->size - offset, size);
+        memcpy(buf, priv->data + offset, to_read);
+    }
+
+    bytes_read = to_read;
+    return true;
+}
+
+bool MmapFile::on_map_range(uint64_t offset, size_t size,
+                            const void *&data, size_t &data_size)
+{
+    MB_PRIVATE(MmapFile);
+
+    size_t available = 0;
+    if (offset < priv->size) {
+        available = std::min<size_t>(priv->size - offset, size);
+    }
+
+    data = available ? priv->data + offset : priv->data;
+    data_size = available;
+    return true;
+}
+
+}
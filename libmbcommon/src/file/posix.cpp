@@ -20,6 +20,7 @@
 #include "mbcommon/file/posix.h"
 
 #include <cerrno>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -61,6 +62,11 @@ struct RealPosixFileFuncs : public PosixFileFuncs
         return ferror(stream);
     }
 
+    virtual int fn_fflush(FILE *stream) override
+    {
+        return fflush(stream);
+    }
+
     virtual int fn_fileno(FILE *stream) override
     {
         return fileno(stream);
@@ -105,6 +111,20 @@ struct RealPosixFileFuncs : public PosixFileFuncs
     {
         return ftruncate64(fd, length);
     }
+
+#ifndef _WIN32
+    virtual ssize_t fn_pread64(int fd, void *buf, size_t count,
+                               off64_t offset) override
+    {
+        return pread64(fd, buf, count, offset);
+    }
+
+    virtual ssize_t fn_pwrite64(int fd, const void *buf, size_t count,
+                                off64_t offset) override
+    {
+        return pwrite64(fd, buf, count, offset);
+    }
+#endif
 };
 /*! \endcond */
 
@@ -560,4 +580,96 @@ bool PosixFile::on_truncate(uint64_t size)
     return true;
 }
 
+bool PosixFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                           size_t &bytes_read)
+{
+#ifdef _WIN32
+    // The MSVCRT has no pread() equivalent
+    return File::on_read_at(offset, buf, size, bytes_read);
+#else
+    MB_PRIVATE(PosixFile);
+
+    int fd = priv->funcs->fn_fileno(priv->fp);
+    if (fd < 0) {
+        // Not backed by a file descriptor (eg. fmemopen())
+        return File::on_read_at(offset, buf, size, bytes_read);
+    }
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    }
+
+    // Write out pending data and discard stale read buffers so that the stdio
+    // buffer and the file descriptor agree on the file contents
+    if (priv->funcs->fn_fflush(priv->fp) == EOF) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to flush file");
+        return false;
+    }
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    ssize_t n = priv->funcs->fn_pread64(fd, buf, size,
+                                        static_cast<off64_t>(offset));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to read file");
+        return false;
+    }
+
+    bytes_read = n;
+    return true;
+#endif
+}
+
+bool PosixFile::on_write_at(uint64_t offset, const void *buf, size_t size,
+                            size_t &bytes_written)
+{
+#ifdef _WIN32
+    // The MSVCRT has no pwrite() equivalent
+    return File::on_write_at(offset, buf, size, bytes_written);
+#else
+    MB_PRIVATE(PosixFile);
+
+    int fd = priv->funcs->fn_fileno(priv->fp);
+    if (fd < 0) {
+        // Not backed by a file descriptor (eg. fmemopen())
+        return File::on_write_at(offset, buf, size, bytes_written);
+    }
+
+    if (offset > INT64_MAX) {
+        set_error(make_error_code(FileError::ArgumentOutOfRange),
+                  "Offset exceeds maximum file offset");
+        return false;
+    }
+
+    // Write out pending data and discard read buffers, which may contain data
+    // that is about to be overwritten
+    if (priv->funcs->fn_fflush(priv->fp) == EOF) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to flush file");
+        return false;
+    }
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    ssize_t n = priv->funcs->fn_pwrite64(fd, buf, size,
+                                         static_cast<off64_t>(offset));
+    if (n < 0) {
+        set_error(std::error_code(errno, std::generic_category()),
+                  "Failed to write file");
+        return false;
+    }
+
+    bytes_written = n;
+    return true;
+#endif
+}
+
 }
@@ -594,4 +594,116 @@ bool Win32File::on_truncate(uint64_t size)
     return ret;
 }
 
+bool Win32File::on_read_at(uint64_t offset, void *buf, size_t size,
+                           size_t &bytes_read)
+{
+    MB_PRIVATE(Win32File);
+
+    uint64_t old_pos;
+    uint64_t temp;
+    DWORD n = 0;
+
+    // Synchronous handles move the file pointer even when an OVERLAPPED
+    // structure is used, so the original position must be restored afterwards
+    if (!on_seek(0, SEEK_CUR, old_pos)) {
+        return false;
+    }
+
+    if (size > UINT_MAX) {
+        size = UINT_MAX;
+    }
+
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset & 0xffffffffu);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    bool ret = priv->funcs->fn_ReadFile(
+        priv->handle,   // hFile
+        buf,            // lpBuffer
+        size,           // nNumberOfBytesToRead
+        &n,             // lpNumberOfBytesRead
+        &overlapped     // lpOverlapped
+    );
+
+    if (!ret) {
+        DWORD error = GetLastError();
+
+        // Reading past EOF with an OVERLAPPED structure fails instead of
+        // returning 0 bytes
+        if (error == ERROR_HANDLE_EOF) {
+            n = 0;
+            ret = true;
+        } else {
+            set_error(std::error_code(error, std::system_category()),
+                      "Failed to read file");
+        }
+    }
+
+    if (!on_seek(old_pos, SEEK_SET, temp)) {
+        // We can't guarantee the file position so the handle shouldn't be used
+        // anymore
+        set_fatal(true);
+        ret = false;
+    }
+
+    if (ret) {
+        bytes_read = n;
+    }
+    return ret;
+}
+
+bool Win32File::on_write_at(uint64_t offset, const void *buf, size_t size,
+                            size_t &bytes_written)
+{
+    MB_PRIVATE(Win32File);
+
+    uint64_t old_pos;
+    uint64_t temp;
+    DWORD n = 0;
+
+    // Emulated append mode always writes to the end of the file
+    if (priv->append) {
+        return File::on_write_at(offset, buf, size, bytes_written);
+    }
+
+    // Synchronous handles move the file pointer even when an OVERLAPPED
+    // structure is used, so the original position must be restored afterwards
+    if (!on_seek(0, SEEK_CUR, old_pos)) {
+        return false;
+    }
+
+    if (size > UINT_MAX) {
+        size = UINT_MAX;
+    }
+
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = static_cast<DWORD>(offset & 0xffffffffu);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    bool ret = priv->funcs->fn_WriteFile(
+        priv->handle,   // hFile
+        buf,            // lpBuffer
+        size,           // nNumberOfBytesToWrite
+        &n,             // lpNumberOfBytesWritten
+        &overlapped     // lpOverlapped
+    );
+
+    if (!ret) {
+        set_error(std::error_code(GetLastError(), std::system_category()),
+                  "Failed to write file");
+    }
+
+    if (!on_seek(old_pos, SEEK_SET, temp)) {
+        // We can't guarantee the file position so the handle shouldn't be used
+        // anymore
+        set_fatal(true);
+        ret = false;
+    }
+
+    if (ret) {
+        bytes_written = n;
+    }
+    return ret;
+}
+
 }
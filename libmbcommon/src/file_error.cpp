@@ -77,6 +77,10 @@ std::string FileErrorCategory::message(int condition) const
         return "seek not supported";
     case FileError::UnsupportedTruncate:
         return "truncate not supported";
+    case FileError::UnsupportedMap:
+        return "memory mapping not supported";
+    case FileError::UnsupportedNativeFd:
+        return "file descriptor access not supported";
     case FileError::IntegerOverflow:
         return "integer overflowed";
     case FileError::BadFileFormat:
@@ -102,6 +106,8 @@ FileErrorCategory::default_error_condition(int code) const noexcept
     case FileError::UnsupportedWrite:
     case FileError::UnsupportedSeek:
     case FileError::UnsupportedTruncate:
+    case FileError::UnsupportedMap:
+    case FileError::UnsupportedNativeFd:
         return FileError::Unsupported;
     default:
         return std::error_condition(code, *this);
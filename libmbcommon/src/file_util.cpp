@@ -20,14 +20,43 @@
 #include "mbcommon/file_util.h"
 
 #include <algorithm>
+#include <memory>
+#include <vector>
 
 #include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
+#ifdef __linux__
+#  include <fcntl.h>
+#  include <linux/falloc.h>
+#  include <linux/fs.h>
+#  include <sys/ioctl.h>
+#  include <sys/sendfile.h>
+#  include <sys/stat.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+#include "mbcommon/buffer_pool.h"
 #include "mbcommon/libc/string.h"
 
 #define DEFAULT_BUFFER_SIZE             (8 * 1024 * 1024)
+// Largest transfer that sendfile() and friends will do in one call
+#define KERNEL_COPY_MAX_SIZE            0x7ffff000
+
+#if defined(__linux__) && !defined(FICLONERANGE)
+// Not provided by older kernel headers (added in Linux 4.5)
+struct file_clone_range
+{
+    int64_t src_fd;
+    uint64_t src_offset;
+    uint64_t src_length;
+    uint64_t dest_offset;
+};
+#  define FICLONERANGE _IOW(0x94, 13, struct file_clone_range)
+#endif
 
 /*!
  * \file mbcommon/file_util.h
@@ -125,6 +154,70 @@ bool file_write_fully(File &file, const void *buf, size_t size,
     return true;
 }
 
+/*!
+ * \brief Write to a File handle from multiple buffers.
+ *
+ * This function differs from File::writev() in that it will call
+ * File::writev() repeatedly until all of the buffers are written or EOF is
+ * reached. If File::writev() fails and the error is std::errc::interrupted, the
+ * write operation will be automatically reattempted.
+ *
+ * \note \p bytes_written is updated with the number of bytes successfully
+ *       written even when this function fails. Take this into account if
+ *       reattempting the write operation.
+ *
+ * \param[in] file File handle
+ * \param[in] iov Array of buffers to write from
+ * \param[in] count Number of elements in \p iov
+ * \param[out] bytes_written Output total number of bytes that were written.
+ *
+ * \return Whether some bytes are written
+ */
+bool file_write_fully_v(File &file, const FileConstIoVec *iov, size_t count,
+                        size_t &bytes_written)
+{
+    std::vector<FileConstIoVec> remain(iov, iov + count);
+    size_t index = 0;
+    size_t n;
+
+    bytes_written = 0;
+
+    while (index < remain.size()) {
+        // Skip over empty and fully written buffers
+        if (remain[index].size == 0) {
+            ++index;
+            continue;
+        }
+
+        if (!file.writev(remain.data() + index, remain.size() - index, n)) {
+            if (file.error() == std::errc::interrupted) {
+                continue;
+            } else {
+                return false;
+            }
+        } else if (n == 0) {
+            break;
+        }
+
+        bytes_written += n;
+
+        // Advance past the data that was written
+        while (n > 0) {
+            size_t to_consume = std::min(n, remain[index].size);
+            remain[index].data = static_cast<const char *>(
+                    remain[index].data) + to_consume;
+            remain[index].size -= to_consume;
+            n -= to_consume;
+
+            if (remain[index].size == 0) {
+                ++index;
+            }
+        }
+    }
+
+    return true;
+}
+
 /*!
  * \brief Read from a File handle and discard the data.
  *
@@ -145,13 +238,25 @@ bool file_write_fully(File &file, const void *buf, size_t size,
  */
 bool file_read_discard(File &file, uint64_t size, uint64_t &bytes_discarded)
 {
-    char buf[10240];
     size_t n;
 
     bytes_discarded = 0;
 
+    if (size == 0) {
+        return true;
+    }
+
+    PooledBuffer buf(static_cast<size_t>(
+            std::min<uint64_t>(size, io_block_size())));
+    if (!buf) {
+        file.set_error(std::error_code(errno, std::generic_category()),
+                       "Failed to allocate buffer");
+        return false;
+    }
+
     while (bytes_discarded < size) {
-        if (!file.read(buf, std::min<uint64_t>(size, sizeof(buf)), n)) {
+        if (!file.read(buf.data(), std::min<uint64_t>(
+                size - bytes_discarded, buf.size()), n)) {
             if (file.error() == std::errc::interrupted) {
                 continue;
             } else {
@@ -190,6 +295,74 @@ bool file_read_discard(File &file, uint64_t size, uint64_t &bytes_discarded)
  *   * #FileSearchAction::Fail if an error occurs
  */
 
+/*!
+ * \brief Search in-memory view of a file for binary sequence
+ *
+ * Helper for file_search() when File::map_range() is supported. \p data must
+ * already be limited to the end boundary.
+ */
+static bool search_mapped(File &file, uint64_t offset, const char *data,
+                          size_t data_size, const void *pattern,
+                          size_t pattern_size, int64_t max_matches,
+                          FileSearchResultCallback result_cb,
+                          void *userdata)
+{
+    const char *match = data;
+    size_t match_remain = data_size;
+
+    while ((match = static_cast<const char *>(
+            mb_memmem(match, match_remain, pattern, pattern_size)))) {
+        // Invoke callback
+        auto ret = result_cb(file, userdata, offset + (match - data));
+        if (ret == FileSearchAction::Stop) {
+            // Stop searching early
+            return true;
+        } else if (ret != FileSearchAction::Continue) {
+            return false;
+        }
+
+        if (max_matches > 0) {
+            --max_matches;
+            if (max_matches == 0) {
+                return true;
+            }
+        }
+
+        // We don't do overlapping searches
+        match += pattern_size;
+        match_remain = data_size - (match - data);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Seek to the starting offset of a search
+ *
+ * If the file does not support seeking, any data before \p offset is read and
+ * discarded instead.
+ */
+static bool seek_to_search_start(File &file, uint64_t offset)
+{
+    if (!file.seek(offset, SEEK_SET, nullptr)) {
+        if (file.error() == FileError::Unsupported) {
+            uint64_t discarded;
+            if (!file_read_discard(file, offset, discarded)) {
+                return false;
+            } else if (discarded != offset) {
+                file.set_error(make_error_code(FileError::InvalidArgument),
+                               "Reached EOF before starting offset");
+                file.set_fatal(true);
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 /*!
  * \brief Search file for binary sequence
  *
@@ -200,6 +373,9 @@ bool file_read_discard(File &file, uint64_t size, uint64_t &bytes_discarded)
  * 2 * \p pattern_size would exceed the maximum value of a `size_t`, `SIZE_MAX`
  * will be used.
  *
+ * If \p file supports File::map_range(), the search is performed directly on
+ * the mapped data without any intermediate buffer and \p bsize is ignored.
+ *
  * If \p file does not support seeking, then the file position must be set to
  * the beginning of the file before calling this function. Instead of seeking,
  * the function will read and discard any data before \p start.
@@ -231,7 +407,8 @@ bool file_search(File &file, int64_t start, int64_t end,
                  FileSearchResultCallback result_cb,
                  void *userdata)
 {
-    std::unique_ptr<char, decltype(free) *> buf(nullptr, &free);
+    PooledBuffer pooled_buf;
+    char *buf;
     size_t buf_size;
     char *ptr;
     size_t ptr_remain;
@@ -272,38 +449,46 @@ bool file_search(File &file, int64_t start, int64_t end,
         return false;
     }
 
-    buf.reset(static_cast<char *>(malloc(buf_size)));
-    if (!buf) {
-        file.set_error(std::error_code(errno, std::generic_category()),
-                       "Failed to allocate buffer");
-        return false;
-    }
-
     if (start >= 0) {
         offset = start;
     } else {
         offset = 0;
     }
 
-    // Seek to starting point
-    if (!file.seek(offset, SEEK_SET, nullptr)) {
-        if (file.error() == FileError::Unsupported) {
-            uint64_t discarded;
-            if (!file_read_discard(file, offset, discarded)) {
-                return false;
-            } else if (discarded != offset) {
-                file.set_error(make_error_code(FileError::InvalidArgument),
-                               "Reached EOF before starting offset");
-                file.set_fatal(true);
-                return false;
-            }
-        } else {
+    // Search in place if the file contents are directly addressable
+    {
+        const void *data;
+        size_t data_size;
+        size_t map_size = SIZE_MAX;
+
+        if (end >= 0 && static_cast<uint64_t>(end) - offset < SIZE_MAX) {
+            map_size = static_cast<size_t>(end - offset);
+        }
+
+        if (file.map_range(offset, map_size, data, data_size)) {
+            return search_mapped(file, offset, static_cast<const char *>(data),
+                                 data_size, pattern, pattern_size,
+                                 max_matches, result_cb, userdata);
+        } else if (file.error() != FileError::UnsupportedMap) {
             return false;
         }
     }
 
+    pooled_buf = PooledBuffer(buf_size);
+    if (!pooled_buf) {
+        file.set_error(std::error_code(errno, std::generic_category()),
+                       "Failed to allocate buffer");
+        return false;
+    }
+
+    if (!seek_to_search_start(file, offset)) {
+        return false;
+    }
+
+    buf = static_cast<char *>(pooled_buf.data());
+
     // Initially read to beginning of buffer
-    ptr = buf.get();
+    ptr = buf;
     ptr_remain = buf_size;
 
     while (true) {
@@ -312,7 +497,7 @@ bool file_search(File &file, int64_t start, int64_t end,
         }
 
         // Number of available bytes in buf
-        n += ptr - buf.get();
+        n += ptr - buf;
 
         if (n < pattern_size) {
             // Reached EOF
@@ -331,19 +516,19 @@ bool file_search(File &file, int64_t start, int64_t end,
         }
 
         // Search from beginning of buffer
-        match = buf.get();
+        match = buf;
         match_remain = n;
 
         while ((match = static_cast<char *>(
                 mb_memmem(match, match_remain, pattern, pattern_size)))) {
             // Stop if match falls outside of ending boundary
-            if (end >= 0 && offset + match - buf.get() + pattern_size
+            if (end >= 0 && offset + match - buf + pattern_size
                     > static_cast<uint64_t>(end)) {
                 return true;
             }
 
             // Invoke callback
-            auto ret = result_cb(file, userdata, offset + match - buf.get());
+            auto ret = result_cb(file, userdata, offset + match - buf);
             if (ret == FileSearchAction::Stop) {
                 // Stop searching early
                 return true;
@@ -361,7 +546,7 @@ bool file_search(File &file, int64_t start, int64_t end,
             // We don't do overlapping searches
             if (match_remain >= pattern_size) {
                 match += pattern_size;
-                match_remain = n - (match - buf.get());
+                match_remain = n - (match - buf);
             } else {
                 break;
             }
@@ -371,8 +556,8 @@ bool file_search(File &file, int64_t start, int64_t end,
         // beginning. We will move fewer than pattern_size - 1 bytes if there
         // was a match close to the end.
         size_t to_move = std::min(match_remain, pattern_size - 1);
-        memmove(buf.get(), buf.get() + n - to_move, to_move);
-        ptr = buf.get() + to_move;
+        memmove(buf, buf + n - to_move, to_move);
+        ptr = buf + to_move;
         ptr_remain = buf_size - to_move;
         offset += n - to_move;
     }
@@ -380,56 +565,359 @@ bool file_search(File &file, int64_t start, int64_t end,
     return true;
 }
 
+/*! \cond INTERNAL */
+
+// Limit the transition table to 64 MiB
+#define MAX_AUTOMATON_STATES            (64 * 1024 * 1024 / (256 * 4))
+
+static constexpr uint32_t AC_NONE = UINT32_MAX;
+
 /*!
- * \brief Move data in file
+ * \brief Aho-Corasick automaton compiled into a DFA
  *
- * This function is equivalent to `memmove()`, except it operates on a File
- * handle. The source and destination regions can overlap. In the degenerate
- * case where \p src == \p dest or \p size == 0, no operation will be performed,
- * but the function will return true and set \p size_moved accordingly.
+ * State 0 is the root. Since empty patterns are ignored, the root never has an
+ * output, so 0 also serves as the terminator of the output chains.
+ */
+struct SearchAutomaton
+{
+    // Transition table, indexed by state * 256 + byte
+    std::vector<uint32_t> next;
+    // First pattern ending exactly at each state or AC_NONE
+    std::vector<uint32_t> out;
+    // Next state along the failure chain that has an output or 0
+    std::vector<uint32_t> out_link;
+    // Next pattern ending at the same state (for duplicates) or AC_NONE
+    std::vector<uint32_t> pattern_next;
+
+    bool build(File &file, const void * const *patterns, const size_t *sizes,
+               size_t count)
+    {
+        size_t total = 1;
+        for (size_t i = 0; i < count; ++i) {
+            if (sizes[i] > MAX_AUTOMATON_STATES - total) {
+                file.set_error(make_error_code(FileError::ArgumentOutOfRange),
+                               "Patterns are too large");
+                return false;
+            }
+            total += sizes[i];
+        }
+
+        if (count >= AC_NONE) {
+            file.set_error(make_error_code(FileError::ArgumentOutOfRange),
+                           "Too many patterns");
+            return false;
+        }
+
+        next.assign(256, AC_NONE);
+        out.assign(1, AC_NONE);
+        pattern_next.assign(count, AC_NONE);
+
+        // Build trie
+        for (size_t i = 0; i < count; ++i) {
+            auto const *p = static_cast<const unsigned char *>(patterns[i]);
+            uint32_t state = 0;
+
+            if (sizes[i] == 0) {
+                continue;
+            }
+
+            for (size_t j = 0; j < sizes[i]; ++j) {
+                uint32_t &t = next[state * 256 + p[j]];
+                if (t == AC_NONE) {
+                    t = static_cast<uint32_t>(out.size());
+                    next.resize(next.size() + 256, AC_NONE);
+                    out.push_back(AC_NONE);
+                }
+                // next may have been reallocated
+                state = next[state * 256 + p[j]];
+            }
+
+            // Keep duplicates in index order
+            uint32_t *slot = &out[state];
+            while (*slot != AC_NONE) {
+                slot = &pattern_next[*slot];
+            }
+            *slot = static_cast<uint32_t>(i);
+        }
+
+        // Compute failure links in BFS order and fill in the missing
+        // transitions so that every state has all 256 edges
+        std::vector<uint32_t> fail(out.size(), 0);
+        std::vector<uint32_t> queue;
+        queue.reserve(out.size());
+        out_link.assign(out.size(), 0);
+
+        for (unsigned int c = 0; c < 256; ++c) {
+            uint32_t &t = next[c];
+            if (t == AC_NONE) {
+                t = 0;
+            } else {
+                queue.push_back(t);
+            }
+        }
+
+        for (size_t qi = 0; qi < queue.size(); ++qi) {
+            uint32_t state = queue[qi];
+            uint32_t f = fail[state];
+
+            out_link[state] = out[f] != AC_NONE ? f : out_link[f];
+
+            for (unsigned int c = 0; c < 256; ++c) {
+                uint32_t &t = next[state * 256 + c];
+                if (t == AC_NONE) {
+                    t = next[f * 256 + c];
+                } else {
+                    fail[t] = next[f * 256 + c];
+                    queue.push_back(t);
+                }
+            }
+        }
+
+        return true;
+    }
+};
+
+struct MultiSearchContext
+{
+    const SearchAutomaton *ac;
+    const size_t *sizes;
+    uint32_t state;
+    // Per-pattern offset where the next match may begin to avoid overlaps
+    std::vector<uint64_t> next_allowed;
+    int64_t max_matches;
+    FileSearchMultiResultCallback result_cb;
+    void *userdata;
+};
+
+/*!
+ * \brief Feed data through the automaton
  *
- * \note This function is very seek-heavy and may be slow if the handle cannot
- *       seek efficiently. It will perform two seeks per loop interation. Each
- *       iteration moves up to 10240 bytes.
+ * \return FileSearchAction::Continue if more data should be fed,
+ *         FileSearchAction::Stop if the search is complete, or
+ *         FileSearchAction::Fail if the callback failed
+ */
+static FileSearchAction feed_automaton(File &file, MultiSearchContext &ctx,
+                                       uint64_t offset,
+                                       const unsigned char *data, size_t size)
+{
+    const SearchAutomaton &ac = *ctx.ac;
+    const uint32_t *next = ac.next.data();
+    uint32_t state = ctx.state;
+
+    for (size_t i = 0; i < size; ++i) {
+        state = next[state * 256 + data[i]];
+
+        uint32_t s = ac.out[state] != AC_NONE ? state : ac.out_link[state];
+
+        for (; s != 0; s = ac.out_link[s]) {
+            for (uint32_t p = ac.out[s]; p != AC_NONE; p = ac.pattern_next[p]) {
+                uint64_t match = offset + i + 1 - ctx.sizes[p];
+
+                if (match < ctx.next_allowed[p]) {
+                    continue;
+                }
+                ctx.next_allowed[p] = match + ctx.sizes[p];
+
+                auto ret = ctx.result_cb(file, ctx.userdata, p, match);
+                if (ret != FileSearchAction::Continue) {
+                    return ret;
+                }
+
+                if (ctx.max_matches > 0 && --ctx.max_matches == 0) {
+                    return FileSearchAction::Stop;
+                }
+            }
+        }
+    }
+
+    ctx.state = state;
+    return FileSearchAction::Continue;
+}
+
+/*! \endcond */
+
+/*!
+ * \brief Search file for several binary sequences in a single pass
  *
- * \note If \p *size_moved is less than \p size, then the *first* \p *size_moved
- *       bytes have been copied from offset \p src to offset \p dest. This is
- *       true even if \p src \< \p dest, resulting in a backwards copy.
+ * The patterns are compiled into an Aho-Corasick automaton, so each byte of the
+ * file is examined once regardless of the number of patterns. This is much
+ * faster than calling file_search() once per pattern when scanning large files
+ * for several magic values.
  *
- * \param[in] file File handle
- * \param[in] src Source offset
- * \param[in] dest Destination offset
- * \param[in] size Size of data to move
- * \param[out] size_moved Pointer to store size of data that is moved
+ * Matches are reported in the order in which they end. If several patterns end
+ * at the same offset, the longer pattern is reported first. Identical patterns
+ * are reported in index order. Each pattern is
+ * subject to the same non-overlapping rule as file_search(), but matches of
+ * different patterns may overlap. Empty patterns never match.
  *
- * \return Whether data is successfully moved
+ * If \p file supports File::map_range(), the search is performed directly on
+ * the mapped data and \p bsize is ignored. Otherwise, if \p file does not
+ * support seeking, then the file position must be set to the beginning of the
+ * file before calling this function.
+ *
+ * \note The file position after this function returns is undefined. If
+ *       \p result_cb changes the file position, it must restore it before
+ *       returning.
+ *
+ * \param file File handle
+ * \param start Start offset or negative number for beginning of file
+ * \param end End offset or negative number for end of file
+ * \param bsize Buffer size or 0 to automatically choose a size
+ * \param patterns Array of patterns to search
+ * \param pattern_sizes Array of pattern sizes
+ * \param pattern_count Number of patterns
+ * \param max_matches Maximum number of matches (for all patterns combined) or
+ *                    -1 to find all matches
+ * \param result_cb Callback to invoke upon finding a match
+ * \param userdata User callback data
+ *
+ * \return Whether the search completes successfully
  */
-bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
-               uint64_t &size_moved)
+bool file_search_multi(File &file, int64_t start, int64_t end,
+                       size_t bsize, const void * const *patterns,
+                       const size_t *pattern_sizes, size_t pattern_count,
+                       int64_t max_matches,
+                       FileSearchMultiResultCallback result_cb,
+                       void *userdata)
 {
-    char buf[10240];
-    size_t n_read;
-    size_t n_written;
+    uint64_t offset;
 
-    // Check if we need to do anything
-    if (src == dest || size == 0) {
-        size_moved = size;
+    // Check boundaries
+    if (start >= 0 && end >= 0 && end < start) {
+        file.set_error(make_error_code(FileError::InvalidArgument),
+                       "End offset < start offset");
+        return false;
+    }
+
+    // Trivial case
+    if (max_matches == 0 || pattern_count == 0) {
         return true;
     }
 
-    if (src > UINT64_MAX - size || dest > UINT64_MAX - size) {
-        file.set_error(make_error_code(FileError::InvalidArgument),
-                       "Offset + size overflows integer");
+    SearchAutomaton ac;
+    if (!ac.build(file, patterns, pattern_sizes, pattern_count)) {
+        return false;
+    }
+
+    MultiSearchContext ctx;
+    ctx.ac = &ac;
+    ctx.sizes = pattern_sizes;
+    ctx.state = 0;
+    ctx.next_allowed.assign(pattern_count, 0);
+    ctx.max_matches = max_matches;
+    ctx.result_cb = result_cb;
+    ctx.userdata = userdata;
+
+    offset = start >= 0 ? static_cast<uint64_t>(start) : 0;
+
+    // Search in place if the file contents are directly addressable
+    {
+        const void *data;
+        size_t data_size;
+        size_t map_size = SIZE_MAX;
+
+        if (end >= 0 && static_cast<uint64_t>(end) - offset < SIZE_MAX) {
+            map_size = static_cast<size_t>(end - offset);
+        }
+
+        if (file.map_range(offset, map_size, data, data_size)) {
+            return feed_automaton(
+                    file, ctx, offset,
+                    static_cast<const unsigned char *>(data), data_size)
+                    != FileSearchAction::Fail;
+        } else if (file.error() != FileError::UnsupportedMap) {
+            return false;
+        }
+    }
+
+    size_t buf_size = bsize != 0 ? bsize : DEFAULT_BUFFER_SIZE;
+    PooledBuffer buf(buf_size);
+    if (!buf) {
+        file.set_error(std::error_code(errno, std::generic_category()),
+                       "Failed to allocate buffer");
         return false;
     }
 
+    if (!seek_to_search_start(file, offset)) {
+        return false;
+    }
+
+    // The automaton state carries over between reads, so unlike file_search(),
+    // no data needs to be kept from the previous iteration
+    while (true) {
+        size_t to_read = buf_size;
+        size_t n;
+
+        if (end >= 0) {
+            if (offset >= static_cast<uint64_t>(end)) {
+                // Artificial EOF
+                return true;
+            }
+            to_read = std::min<uint64_t>(to_read, end - offset);
+        }
+
+        if (!file_read_fully(file, buf.data(), to_read, n)) {
+            return false;
+        } else if (n == 0) {
+            return true;
+        }
+
+        if (n > UINT64_MAX - offset) {
+            file.set_error(make_error_code(FileError::IntegerOverflow),
+                           "Read overflows offset value");
+            return false;
+        }
+
+        switch (feed_automaton(file, ctx, offset,
+                               static_cast<unsigned char *>(buf.data()), n)) {
+        case FileSearchAction::Continue:
+            break;
+        case FileSearchAction::Stop:
+            return true;
+        case FileSearchAction::Fail:
+            return false;
+        }
+
+        offset += n;
+
+        if (n < to_read) {
+            // Reached EOF
+            return true;
+        }
+    }
+}
+
+#ifdef __linux__
+
+enum class FastPathResult
+{
+    Done,
+    Unsupported,
+    Failed,
+};
+
+#endif
+
+static bool move_data(File &file, uint64_t src, uint64_t dest, uint64_t size,
+                      uint64_t &size_moved)
+{
+    size_t n_read;
+    size_t n_written;
+
     size_moved = 0;
 
+    PooledBuffer buf(io_block_size());
+    if (!buf) {
+        file.set_error(std::error_code(errno, std::generic_category()),
+                       "Failed to allocate buffer");
+        return false;
+    }
+
     if (dest < src) {
         // Copy forwards
         while (size_moved < size) {
             size_t to_read = std::min<uint64_t>(
-                    sizeof(buf), size - size_moved);
+                    buf.size(), size - size_moved);
 
             // Seek to source offset
             if (!file.seek(src + size_moved, SEEK_SET, nullptr)) {
@@ -437,7 +925,7 @@ bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
             }
 
             // Read data from source
-            if (!file_read_fully(file, buf, to_read, n_read)) {
+            if (!file_read_fully(file, buf.data(), to_read, n_read)) {
                 return false;
             } else if (n_read == 0) {
                 break;
@@ -449,7 +937,7 @@ bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
             }
 
             // Write data to destination
-            if (!file_write_fully(file, buf, n_read, n_written)) {
+            if (!file_write_fully(file, buf.data(), n_read, n_written)) {
                 return false;
             }
 
@@ -463,7 +951,7 @@ bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
         // Copy backwards
         while (size_moved < size) {
             size_t to_read = std::min<uint64_t>(
-                    sizeof(buf), size - size_moved);
+                    buf.size(), size - size_moved);
 
             // Seek to source offset
             if (!file.seek(src + size - size_moved - to_read, SEEK_SET,
@@ -472,7 +960,7 @@ bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
             }
 
             // Read data form source
-            if (!file_read_fully(file, buf, to_read, n_read)) {
+            if (!file_read_fully(file, buf.data(), to_read, n_read)) {
                 return false;
             } else if (n_read == 0) {
                 break;
@@ -485,7 +973,7 @@ bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
             }
 
             // Write data to destination
-            if (!file_write_fully(file, buf, n_read, n_written)) {
+            if (!file_write_fully(file, buf.data(), n_read, n_written)) {
                 return false;
             }
 
@@ -501,4 +989,387 @@ bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
     return true;
 }
 
+#if defined(__linux__) && defined(FALLOC_FL_COLLAPSE_RANGE) \
+        && defined(FALLOC_FL_INSERT_RANGE)
+#  define HAVE_EXTENT_MOVE 1
+
+/*
+ * Move a region that ends at EOF by collapsing or inserting whole blocks with
+ * fallocate(). This is a metadata-only operation on filesystems that support it
+ * (ext4, f2fs, xfs). Only the part of the region that memmove() semantics
+ * leave behind at the old location (the gap between \p src and \p dest) needs
+ * to be copied afterwards.
+ */
+static FastPathResult extent_move(File &file, int fd, uint64_t src,
+                                  uint64_t dest, uint64_t size,
+                                  uint64_t &size_moved)
+{
+    struct stat sb;
+    uint64_t n;
+
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_blksize <= 0) {
+        return FastPathResult::Unsupported;
+    }
+
+    auto block_size = static_cast<uint64_t>(sb.st_blksize);
+
+    // Shifting the region shifts everything after it too, so it must end at
+    // EOF. Both ranges must also be block-aligned.
+    if (src + size != static_cast<uint64_t>(sb.st_size)
+            || src % block_size != 0 || dest % block_size != 0) {
+        return FastPathResult::Unsupported;
+    }
+
+    uint64_t gap = src > dest ? src - dest : dest - src;
+
+    // Not worth it if fixing up the gap costs as much as copying
+    if (gap >= size) {
+        return FastPathResult::Unsupported;
+    }
+
+    if (dest < src) {
+        if (fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, static_cast<off_t>(dest),
+                      static_cast<off_t>(gap)) < 0) {
+            return FastPathResult::Unsupported;
+        }
+
+        // The front of the region is now in place. memmove() would have left
+        // the original last gap bytes after the destination region, so append
+        // them to restore the original file size.
+        size_moved = size - gap;
+
+        if (!move_data(file, dest + size - gap, dest + size, gap, n)) {
+            return FastPathResult::Failed;
+        }
+    } else {
+        if (fallocate(fd, FALLOC_FL_INSERT_RANGE, static_cast<off_t>(src),
+                      static_cast<off_t>(gap)) < 0) {
+            return FastPathResult::Unsupported;
+        }
+
+        // The whole region is now in place, but the hole left at the source
+        // offset must contain the original first gap bytes of the region
+        size_moved = size;
+
+        if (!move_data(file, dest, src, gap, n)) {
+            return FastPathResult::Failed;
+        }
+    }
+
+    if (n != gap) {
+        file.set_error(std::make_error_code(std::errc::io_error),
+                       "File size changed during move");
+        return FastPathResult::Failed;
+    }
+
+    size_moved = size;
+    return FastPathResult::Done;
+}
+
+#endif
+
+/*!
+ * \brief Move data in file
+ *
+ * This function is equivalent to `memmove()`, except it operates on a File
+ * handle. The source and destination regions can overlap. In the degenerate
+ * case where \p src == \p dest or \p size == 0, no operation will be performed,
+ * but the function will return true and set \p size_moved accordingly.
+ *
+ * \note This function is very seek-heavy and may be slow if the handle cannot
+ *       seek efficiently. It will perform two seeks per loop interation. Each
+ *       iteration moves up to 10240 bytes.
+ *
+ * \note On Linux, if the handle provides a file descriptor (File::native_fd())
+ *       and the region ends at EOF, the data is shifted with
+ *       `FALLOC_FL_COLLAPSE_RANGE` or `FALLOC_FL_INSERT_RANGE` when \p src
+ *       and \p dest are aligned to the filesystem block size. Only the
+ *       `abs(src - dest)` bytes that `memmove()` leaves behind are copied. The
+ *       copy loop is used if the filesystem does not support it.
+ *
+ * \note If \p *size_moved is less than \p size, then the *first* \p *size_moved
+ *       bytes have been copied from offset \p src to offset \p dest. This is
+ *       true even if \p src \< \p dest, resulting in a backwards copy.
+ *
+ * \param[in] file File handle
+ * \param[in] src Source offset
+ * \param[in] dest Destination offset
+ * \param[in] size Size of data to move
+ * \param[out] size_moved Pointer to store size of data that is moved
+ *
+ * \return Whether data is successfully moved
+ */
+bool file_move(File &file, uint64_t src, uint64_t dest, uint64_t size,
+               uint64_t &size_moved)
+{
+    // Check if we need to do anything
+    if (src == dest || size == 0) {
+        size_moved = size;
+        return true;
+    }
+
+    if (src > UINT64_MAX - size || dest > UINT64_MAX - size) {
+        file.set_error(make_error_code(FileError::InvalidArgument),
+                       "Offset + size overflows integer");
+        return false;
+    }
+
+#ifdef HAVE_EXTENT_MOVE
+    int fd;
+
+    if (file.native_fd(fd)) {
+        switch (extent_move(file, fd, src, dest, size, size_moved)) {
+        case FastPathResult::Done:
+            return true;
+        case FastPathResult::Failed:
+            return false;
+        case FastPathResult::Unsupported:
+            break;
+        }
+    }
+#endif
+
+    return move_data(file, src, dest, size, size_moved);
+}
+
+#ifdef __linux__
+
+typedef ssize_t (*KernelCopyFn)(int in_fd, int out_fd, size_t size);
+
+static ssize_t copy_file_range_fn(int in_fd, int out_fd, size_t size)
+{
+#ifdef __NR_copy_file_range
+    // Invoke the syscall directly since older glibc and bionic versions do not
+    // provide a wrapper
+    return syscall(__NR_copy_file_range, in_fd, nullptr, out_fd, nullptr,
+                   size, 0u);
+#else
+    (void) in_fd;
+    (void) out_fd;
+    (void) size;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static ssize_t sendfile_fn(int in_fd, int out_fd, size_t size)
+{
+    return sendfile(out_fd, in_fd, nullptr, size);
+}
+
+static ssize_t splice_fn(int in_fd, int out_fd, size_t size)
+{
+    // Only works if one end is a pipe
+    return splice(in_fd, nullptr, out_fd, nullptr, size, SPLICE_F_MOVE);
+}
+
+/*!
+ * \brief Share data extents between file descriptors with FICLONERANGE
+ *
+ * This is a metadata-only operation on filesystems that support reflinks (eg.
+ * btrfs and xfs). The kernel rejects the request if the files are on different
+ * filesystems, if the filesystem does not support it, or if the offsets are
+ * not block-aligned. In all of those cases, the data is left to be copied by
+ * the other methods.
+ *
+ * \return
+ *   * FastPathResult::Done if the data up to \p size bytes or EOF was cloned
+ *   * FastPathResult::Unsupported if nothing was cloned
+ *   * FastPathResult::Failed if the file positions could not be updated after
+ *     the data was cloned. The error is set on \p dst.
+ */
+static FastPathResult clone_copy(File &dst, int in_fd, int out_fd,
+                                 uint64_t size, uint64_t &size_copied)
+{
+    struct stat sb;
+
+    if (fstat(in_fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+        return FastPathResult::Unsupported;
+    }
+
+    off64_t src_offset = lseek64(in_fd, 0, SEEK_CUR);
+    off64_t dst_offset = lseek64(out_fd, 0, SEEK_CUR);
+    if (src_offset < 0 || dst_offset < 0 || src_offset >= sb.st_size) {
+        return FastPathResult::Unsupported;
+    }
+
+    uint64_t remaining = static_cast<uint64_t>(sb.st_size - src_offset);
+    uint64_t length = std::min(size, remaining);
+
+    struct file_clone_range range;
+    range.src_fd = in_fd;
+    range.src_offset = static_cast<uint64_t>(src_offset);
+    // A length of 0 clones to EOF, which also allows the unaligned tail of the
+    // file to be shared
+    range.src_length = length == remaining ? 0 : length;
+    range.dest_offset = static_cast<uint64_t>(dst_offset);
+
+    if (ioctl(out_fd, FICLONERANGE, &range) < 0) {
+        return FastPathResult::Unsupported;
+    }
+
+    if (lseek64(in_fd, static_cast<off64_t>(length), SEEK_CUR) < 0
+            || lseek64(out_fd, static_cast<off64_t>(length), SEEK_CUR) < 0) {
+        dst.set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to seek after cloning data");
+        return FastPathResult::Failed;
+    }
+
+    size_copied = length;
+    return FastPathResult::Done;
+}
+
+/*!
+ * \brief Copy data between file descriptors in the kernel
+ *
+ * \return
+ *   * FastPathResult::Done if \p size bytes were copied
+ *   * FastPathResult::Unsupported if the method cannot be used for the
+ *     remaining data. \p size_copied reflects the bytes that were copied
+ *     before that was determined.
+ *   * FastPathResult::Failed if an error occurred. The error is set on \p dst.
+ */
+static FastPathResult kernel_copy(KernelCopyFn fn, File &dst,
+                                    int in_fd, int out_fd, uint64_t size,
+                                    uint64_t &size_copied)
+{
+    while (size_copied < size) {
+        size_t to_copy = std::min<uint64_t>(
+                KERNEL_COPY_MAX_SIZE, size - size_copied);
+
+        ssize_t n = fn(in_fd, out_fd, to_copy);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == ENOSYS || errno == EINVAL || errno == EXDEV
+                    || errno == EBADF || errno == EOPNOTSUPP
+                    || errno == ENOTSUP) {
+                return FastPathResult::Unsupported;
+            }
+
+            dst.set_error(std::error_code(errno, std::generic_category()),
+                          "Failed to copy data");
+            return FastPathResult::Failed;
+        } else if (n == 0) {
+            // Some pseudo-filesystems incorrectly report EOF here, so let the
+            // userspace loop confirm it
+            return FastPathResult::Unsupported;
+        }
+
+        size_copied += static_cast<uint64_t>(n);
+    }
+
+    return FastPathResult::Done;
+}
+
+#endif
+
+/*!
+ * \brief Copy data from one File handle to another
+ *
+ * Copy up to \p size bytes from the current file position of \p src to the
+ * current file position of \p dst. The file positions of both handles are
+ * advanced by the number of bytes copied.
+ *
+ * If both File handles expose a file descriptor (see File::native_fd()) on
+ * Linux, the data is first shared with the `FICLONERANGE` ioctl if both files
+ * are on the same reflink-capable filesystem. Otherwise, it is copied in the
+ * kernel with `copy_file_range()`, `sendfile()`, or `splice()`, in that order
+ * of preference. If none of those are supported for the pair of files, the
+ * data is copied via a large userspace buffer.
+ *
+ * \note If this function fails, the error is set on whichever File handle
+ *       caused the failure. Errors from the kernel copy functions are set on
+ *       \p dst. \p size_copied is updated with the number of bytes copied
+ *       even when this function fails.
+ *
+ * \param[in] src Source File handle
+ * \param[in] dst Destination File handle
+ * \param[in] size Maximum number of bytes to copy
+ * \param[out] size_copied Output number of bytes that were copied. A short copy
+ *                         indicates end of file on \p src.
+ *
+ * \return Whether the data is successfully copied
+ */
+bool file_copy(File &src, File &dst, uint64_t size, uint64_t &size_copied)
+{
+    size_copied = 0;
+
+#ifdef __linux__
+    int in_fd;
+    int out_fd;
+
+    if (src.native_fd(in_fd) && dst.native_fd(out_fd)) {
+        switch (clone_copy(dst, in_fd, out_fd, size, size_copied)) {
+        case FastPathResult::Done:
+            return true;
+        case FastPathResult::Failed:
+            return false;
+        case FastPathResult::Unsupported:
+            break;
+        }
+
+        static const KernelCopyFn copy_fns[] = {
+            &copy_file_range_fn,
+            &sendfile_fn,
+            &splice_fn,
+        };
+
+        for (auto const &fn : copy_fns) {
+            switch (kernel_copy(fn, dst, in_fd, out_fd, size, size_copied)) {
+            case FastPathResult::Done:
+                return true;
+            case FastPathResult::Failed:
+                return false;
+            case FastPathResult::Unsupported:
+                break;
+            }
+        }
+    }
+#endif
+
+    if (size_copied == size) {
+        return true;
+    }
+
+    PooledBuffer buf(io_block_size());
+    if (!buf) {
+        dst.set_error(std::error_code(errno, std::generic_category()),
+                      "Failed to allocate buffer");
+        return false;
+    }
+
+    while (size_copied < size) {
+        size_t to_read = std::min<uint64_t>(
+                buf.size(), size - size_copied);
+        size_t n_read;
+        size_t n_written;
+
+        if (!file_read_fully(src, buf.data(), to_read, n_read)) {
+            return false;
+        } else if (n_read == 0) {
+            break;
+        }
+
+        if (!file_write_fully(dst, buf.data(), n_read, n_written)) {
+            size_copied += n_written;
+            return false;
+        }
+
+        size_copied += n_written;
+
+        if (n_written < n_read) {
+            dst.set_error(std::error_code(ENOSPC, std::generic_category()),
+                          "Short write when copying data");
+            return false;
+        }
+
+        if (n_read < to_read) {
+            break;
+        }
+    }
+
+    return true;
+}
+
 }
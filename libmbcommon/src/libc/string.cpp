@@ -19,22 +19,226 @@
 
 #include "mbcommon/libc/string.h"
 
+#include <cstdint>
 #include <cstring>
 
-#ifndef __GLIBC__
-#  include "mbcommon/external/musl/memmem.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+        && defined(__SSE2__)
+#  include <immintrin.h>
+#  define HAVE_SSE2 1
+// AVX2 is selected at runtime via the target attribute
+#  if defined(__clang__) || __GNUC__ >= 5
+#    define HAVE_AVX2 1
+#  endif
+#elif defined(__GNUC__) && defined(__ARM_NEON)
+#  include <arm_neon.h>
+#  define HAVE_NEON 1
 #endif
 
 #ifndef __GLIBC__
+#  include "mbcommon/external/musl/memmem.h"
 #  define memmem musl_memmem
 #endif
 
+/*
+ * The SIMD implementations use the "generic SIMD" approach: compare a block of
+ * candidate positions against the first and last bytes of the needle at once
+ * and only run memcmp() on positions where both match. This is much faster
+ * than the two-way algorithm for the short needles (magic values, headers) we
+ * usually search for.
+ *
+ * The worst case of that approach is quadratic (eg. searching for "aaab" in
+ * "aaaa..."), so if verification fails too often, the remainder of the
+ * haystack is handed off to the linear-time fallback.
+ */
+
+typedef void * (*MemmemFn)(const void *haystack, size_t haystacklen,
+                           const void *needle, size_t needlelen);
+
+// Too many false positives relative to the bytes scanned so far
+#define TOO_MANY_FALSE_POSITIVES(n_false, scanned) \
+    ((n_false) > 16 + (scanned) / 8)
+
+static void * fallback_memmem(const void *haystack, size_t haystacklen,
+                              const void *needle, size_t needlelen)
+{
+    return memmem(haystack, haystacklen, needle, needlelen);
+}
+
+#ifdef HAVE_SSE2
+
+static void * sse2_memmem(const void *haystack, size_t haystacklen,
+                          const void *needle, size_t needlelen)
+{
+    auto const *h = static_cast<const unsigned char *>(haystack);
+    auto const *n = static_cast<const unsigned char *>(needle);
+    const __m128i first = _mm_set1_epi8(static_cast<char>(n[0]));
+    const __m128i last = _mm_set1_epi8(static_cast<char>(n[needlelen - 1]));
+    size_t n_false = 0;
+    size_t i = 0;
+
+    for (; i + needlelen - 1 + 16 <= haystacklen; i += 16) {
+        const __m128i block_first = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(h + i));
+        const __m128i block_last = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(h + i + needlelen - 1));
+        unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                              _mm_cmpeq_epi8(last, block_last))));
+
+        while (mask != 0) {
+            size_t bit = static_cast<size_t>(__builtin_ctz(mask));
+            if (memcmp(h + i + bit + 1, n + 1, needlelen - 2) == 0) {
+                return const_cast<unsigned char *>(h + i + bit);
+            }
+            mask &= mask - 1;
+            ++n_false;
+        }
+
+        if (TOO_MANY_FALSE_POSITIVES(n_false, i)) {
+            break;
+        }
+    }
+
+    return fallback_memmem(h + i, haystacklen - i, n, needlelen);
+}
+
+#endif
+
+#ifdef HAVE_AVX2
+
+__attribute__((target("avx2")))
+static void * avx2_memmem(const void *haystack, size_t haystacklen,
+                          const void *needle, size_t needlelen)
+{
+    auto const *h = static_cast<const unsigned char *>(haystack);
+    auto const *n = static_cast<const unsigned char *>(needle);
+    const __m256i first = _mm256_set1_epi8(static_cast<char>(n[0]));
+    const __m256i last = _mm256_set1_epi8(static_cast<char>(n[needlelen - 1]));
+    size_t n_false = 0;
+    size_t i = 0;
+
+    for (; i + needlelen - 1 + 32 <= haystacklen; i += 32) {
+        const __m256i block_first = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(h + i));
+        const __m256i block_last = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(h + i + needlelen - 1));
+        unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                 _mm256_cmpeq_epi8(last, block_last))));
+
+        while (mask != 0) {
+            size_t bit = static_cast<size_t>(__builtin_ctz(mask));
+            if (memcmp(h + i + bit + 1, n + 1, needlelen - 2) == 0) {
+                return const_cast<unsigned char *>(h + i + bit);
+            }
+            mask &= mask - 1;
+            ++n_false;
+        }
+
+        if (TOO_MANY_FALSE_POSITIVES(n_false, i)) {
+            break;
+        }
+    }
+
+    // Finish off with SSE2, which handles its own tail
+    return sse2_memmem(h + i, haystacklen - i, n, needlelen);
+}
+
+#endif
+
+#ifdef HAVE_NEON
+
+static void * neon_memmem(const void *haystack, size_t haystacklen,
+                          const void *needle, size_t needlelen)
+{
+    auto const *h = static_cast<const unsigned char *>(haystack);
+    auto const *n = static_cast<const unsigned char *>(needle);
+    const uint8x16_t first = vdupq_n_u8(n[0]);
+    const uint8x16_t last = vdupq_n_u8(n[needlelen - 1]);
+    size_t n_false = 0;
+    size_t i = 0;
+
+    for (; i + needlelen - 1 + 16 <= haystacklen; i += 16) {
+        const uint8x16_t eq = vandq_u8(
+                vceqq_u8(first, vld1q_u8(h + i)),
+                vceqq_u8(last, vld1q_u8(h + i + needlelen - 1)));
+
+        // NEON has no movemask, so narrow each byte to 4 bits instead. Bits
+        // 4k to 4k+3 of the mask are set if position k matched.
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+
+        while (mask != 0) {
+            size_t bit = static_cast<size_t>(__builtin_ctzll(mask)) / 4;
+            if (memcmp(h + i + bit + 1, n + 1, needlelen - 2) == 0) {
+                return const_cast<unsigned char *>(h + i + bit);
+            }
+            mask &= ~(UINT64_C(0xf) << (bit * 4));
+            ++n_false;
+        }
+
+        if (TOO_MANY_FALSE_POSITIVES(n_false, i)) {
+            break;
+        }
+    }
+
+    return fallback_memmem(h + i, haystacklen - i, n, needlelen);
+}
+
+#endif
+
+static MemmemFn select_memmem()
+{
+#if defined(HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &avx2_memmem;
+    }
+#endif
+#if defined(HAVE_SSE2)
+    return &sse2_memmem;
+#elif defined(HAVE_NEON)
+    return &neon_memmem;
+#else
+    return &fallback_memmem;
+#endif
+}
+
 MB_BEGIN_C_DECLS
 
+/*!
+ * \brief Find the first occurrence of a byte sequence
+ *
+ * This behaves like the GNU `memmem()` extension. On x86 (SSE2 or AVX2,
+ * depending on the CPU) and ARM NEON, a vectorized search is used. Otherwise,
+ * the libc implementation (or musl's implementation where libc does not
+ * provide one) is used.
+ *
+ * \param haystack Data to search
+ * \param haystacklen Size of \p haystack
+ * \param needle Byte sequence to search for
+ * \param needlelen Size of \p needle
+ *
+ * \return Pointer to the first occurrence of \p needle in \p haystack, NULL if
+ *         it does not occur, or \p haystack if \p needlelen is 0.
+ */
 void * mb_memmem(const void *haystack, size_t haystacklen,
                  const void *needle, size_t needlelen)
 {
-    return memmem(haystack, haystacklen, needle, needlelen);
+    static const MemmemFn impl = select_memmem();
+
+    if (needlelen == 0) {
+        return const_cast<void *>(haystack);
+    } else if (needlelen > haystacklen) {
+        return nullptr;
+    } else if (needlelen == 1) {
+        return const_cast<void *>(memchr(
+                haystack, *static_cast<const unsigned char *>(needle),
+                haystacklen));
+    }
+
+    return impl(haystack, haystacklen, needle, needlelen);
 }
 
 MB_END_C_DECLS
@@ -190,28 +190,37 @@ bool format_v(std::string &out, const char *fmt, va_list ap)
     saved_error = GetLastError();
 #endif
 
-    va_copy(copy, ap);
-    ret = vsnprintf(nullptr, 0, fmt, copy);
-    va_end(copy);
-
-    if (ret < 0 || ret == INT_MAX) {
-        return false;
-    }
-
+    // Try formatting into the string's existing capacity first. This is enough
+    // for short strings (which fit in the small string buffer) and for callers
+    // that reuse the same std::string in a loop, so the formatter only needs to
+    // run a second time if the output doesn't fit.
+    //
     // C++11 guarantees that the memory is contiguous, but does not guarantee
     // that the internal buffer is NULL-terminated, so we'll make room for '\0'
     // and then get rid of it.
-    out.resize(ret + 1);
+    out.resize(out.capacity() < 1 ? 1 : out.capacity());
 
     va_copy(copy, ap);
     // NOTE: Change `&out[0]` to `out.data()` once we target C++17.
     ret = vsnprintf(&out[0], out.size(), fmt, copy);
     va_end(copy);
 
-    if (ret < 0) {
+    if (ret < 0 || ret == INT_MAX) {
         return false;
     }
 
+    if (static_cast<size_t>(ret) >= out.size()) {
+        out.resize(ret + 1);
+
+        va_copy(copy, ap);
+        ret = vsnprintf(&out[0], out.size(), fmt, copy);
+        va_end(copy);
+
+        if (ret < 0) {
+            return false;
+        }
+    }
+
     out.resize(ret);
 
     // Restore errno and Win32 error on success
@@ -249,6 +258,96 @@ std::string format_v(const char *fmt, va_list ap)
     return result;
 }
 
+/*!
+ * \brief Format a string into a caller-provided buffer
+ *
+ * This is equivalent to format() except that no memory is allocated. If the
+ * output (including the NULL terminator) does not fit in \p buf, then \p buf
+ * will contain the truncated, NULL-terminated output (if \p size is non-zero)
+ * and the function fails with `errno` set to `ERANGE`. The full length of the
+ * output is still stored in \p len so the caller can retry with a larger
+ * buffer.
+ *
+ * \note This uses the `*printf()` family of functions in the system's C
+ *       library. The format string may not be understood the same way by every
+ *       platform.
+ *
+ * \note The value of `errno` and `GetLastError()` (on Win32) are preserved if
+ *       this function does not fail.
+ *
+ * \param[out] buf Output buffer (may be NULL if \p size is 0)
+ * \param[in] size Size of output buffer
+ * \param[out] len Pointer to store length of the output, excluding the NULL
+ *                 terminator (may be NULL)
+ * \param[in] fmt Format string
+ * \param[in] ... Format arguments
+ *
+ * \return Whether the format string was successfully processed and the output
+ *         fit in \p buf.
+ */
+bool format_to(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    bool result = format_to_v(buf, size, len, fmt, ap);
+    va_end(ap);
+
+    return result;
+}
+
+/*!
+ * \brief Format a string into a caller-provided buffer using a `va_list`
+ *
+ * \sa format_to()
+ *
+ * \param[out] buf Output buffer (may be NULL if \p size is 0)
+ * \param[in] size Size of output buffer
+ * \param[out] len Pointer to store length of the output, excluding the NULL
+ *                 terminator (may be NULL)
+ * \param[in] fmt Format string
+ * \param[in] ap Format arguments as `va_list`
+ *
+ * \return Whether the format string was successfully processed and the output
+ *         fit in \p buf.
+ */
+bool format_to_v(char *buf, size_t size, size_t *len, const char *fmt,
+                 va_list ap)
+{
+    int saved_errno;
+#ifdef _WIN32
+    int saved_error;
+#endif
+    int ret;
+
+    saved_errno = errno;
+#ifdef _WIN32
+    saved_error = GetLastError();
+#endif
+
+    ret = vsnprintf(buf, size, fmt, ap);
+    if (ret < 0 || ret == INT_MAX) {
+        return false;
+    }
+
+    if (len) {
+        *len = static_cast<size_t>(ret);
+    }
+
+    if (static_cast<size_t>(ret) >= size) {
+        errno = ERANGE;
+        return false;
+    }
+
+    // Restore errno and Win32 error on success
+    errno = saved_errno;
+#ifdef _WIN32
+    SetLastError(saved_error);
+#endif
+
+    return true;
+}
+
 /*!
  * \brief Check if string has prefix (allows non-NULL-terminated strings)
  *        (case sensitive)
@@ -603,10 +702,10 @@ bool ends_with_icase(const std::string &string, const std::string &suffix)
 /*!
  * \brief Insert byte sequence into byte sequence
  *
- * Insert (\p data, \p data_pos) into (\p *mem, \p *mem_size). It the function
- * succeeds, \p *mem will be passed to `free()` and \p *mem and \p *mem_size
- * will be updated to point to the newly allocated block of memory and its size.
- * If the function fails, \p *mem will be left unchanged.
+ * Insert (\p data, \p data_pos) into (\p *mem, \p *mem_size). If the function
+ * succeeds, \p *mem will be passed to `realloc()` and \p *mem and \p *mem_size
+ * will be updated to point to the resized block of memory and its size. If the
+ * function fails, \p *mem will be left unchanged.
  *
  * \param[in,out] mem Pointer to byte sequence to modify
  * \param[in,out] mem_size Pointer to size of bytes sequence to modify
@@ -622,7 +721,7 @@ bool ends_with_icase(const std::string &string, const std::string &suffix)
 int mem_insert(void **mem, size_t *mem_size, size_t pos,
                const void *data, size_t data_size)
 {
-    void *buf;
+    char *buf;
     size_t buf_size;
 
     if (pos > *mem_size) {
@@ -631,28 +730,48 @@ int mem_insert(void **mem, size_t *mem_size, size_t pos,
     } else if (*mem_size >= SIZE_MAX - data_size) {
         errno = EOVERFLOW;
         return -1;
+    } else if (data_size == 0) {
+        return 0;
     }
 
     buf_size = *mem_size + data_size;
 
-    buf = static_cast<char *>(malloc(buf_size));
-    if (!buf) {
-        return -1;
-    }
+    // If the new data points into the existing buffer, it won't survive the
+    // realloc(), so copy the pieces into a new buffer instead
+    auto mem_begin = reinterpret_cast<uintptr_t>(*mem);
+    auto data_begin = reinterpret_cast<uintptr_t>(data);
+    if (*mem && data_begin >= mem_begin
+            && data_begin < mem_begin + *mem_size) {
+        buf = static_cast<char *>(malloc(buf_size));
+        if (!buf) {
+            return -1;
+        }
 
-    void *target_ptr = buf;
+        void *target_ptr = buf;
 
-    // Copy data left of the insertion point
-    target_ptr = _mb_mempcpy(target_ptr, *mem, pos);
+        // Copy data left of the insertion point
+        target_ptr = _mb_mempcpy(target_ptr, *mem, pos);
 
-    // Copy new data
-    target_ptr = _mb_mempcpy(target_ptr, data, data_size);
+        // Copy new data
+        target_ptr = _mb_mempcpy(target_ptr, data, data_size);
 
-    // Copy data right of the insertion point
-    target_ptr = _mb_mempcpy(target_ptr, static_cast<char*>(*mem) + pos,
-                             *mem_size - pos);
+        // Copy data right of the insertion point
+        target_ptr = _mb_mempcpy(target_ptr, static_cast<char *>(*mem) + pos,
+                                 *mem_size - pos);
+
+        free(*mem);
+    } else {
+        // realloc() can often grow the block in place, in which case only the
+        // data right of the insertion point needs to be moved
+        buf = static_cast<char *>(realloc(*mem, buf_size));
+        if (!buf) {
+            return -1;
+        }
+
+        memmove(buf + pos + data_size, buf + pos, *mem_size - pos);
+        memcpy(buf + pos, data, data_size);
+    }
 
-    free(*mem);
     *mem = buf;
     *mem_size = buf_size;
     return 0;
@@ -662,8 +781,8 @@ int mem_insert(void **mem, size_t *mem_size, size_t pos,
  * \brief Insert string into string
  *
  * Insert \p s into \p *str. It the function succeeds. \p *str will be passed to
- * `free()` and \p *str will be updated to point to the newly allocated string.
- * If the function fails, \p *str will be left unchanged.
+ * `realloc()` and \p *str will be updated to point to the resized string. If
+ * the function fails, \p *str will be left unchanged.
  *
  * \param[in,out] str Pointer to string to modify
  * \param[in] pos Position in which to insert new string
@@ -699,11 +818,15 @@ int str_insert(char **str, size_t pos, const char *s)
  *
  * Replace (\p from, \p from_size) with (\p to, \p to_size) in (\p *mem,
  * \p *mem_size), up to \p n times if \p n \> 0. If the function succeeds,
- * \p *mem will be passed to `free()` and \p *mem and \p *mem_size will be
- * updated to point to the newly allocated block of memory and its size. If
- * \p n_replaced is not NULL, the number of replacements done will be stored at
- * the value pointed by \p n_replaced. If the function fails, \p *mem will be
- * left unchanged.
+ * \p *mem and \p *mem_size will be updated to point to the resulting block of
+ * memory and its size. If the replacement is not longer than the original
+ * sequence, the replacement is done in place and \p *mem is not reallocated.
+ * Otherwise, \p *mem will be passed to `free()` and replaced with a newly
+ * allocated block of memory. If \p n_replaced is not NULL, the number of
+ * replacements done will be stored at the value pointed by \p n_replaced. If
+ * the function fails, \p *mem will be left unchanged.
+ *
+ * \note \p from and \p to must not point into \p *mem.
  *
  * \param[in,out] mem Pointer to byte sequence to modify
  * \param[in,out] mem_size Pointer to size of bytes sequence to modify
@@ -723,12 +846,9 @@ int mem_replace(void **mem, size_t *mem_size,
                 const void *to, size_t to_size,
                 size_t n, size_t *n_replaced)
 {
-    char *buf = nullptr;
-    size_t buf_size = 0;
-    void *target_ptr;
     char *base_ptr = static_cast<char *>(*mem);
-    char *ptr = static_cast<char *>(*mem);
-    size_t ptr_remain = *mem_size;
+    char *end_ptr = base_ptr + *mem_size;
+    char *ptr;
     size_t matches = 0;
 
     // Special case for replacing nothing
@@ -739,63 +859,89 @@ int mem_replace(void **mem, size_t *mem_size,
         return 0;
     }
 
-    while ((n == 0 || matches < n) && (ptr = static_cast<char *>(
-            mb_memmem(ptr, ptr_remain, from, from_size)))) {
-        // Resize buffer to accomodate data
-        if (buf_size >= SIZE_MAX - (ptr - base_ptr)
-                || buf_size + (ptr - base_ptr) >= SIZE_MAX - to_size) {
-            free(buf);
-            errno = EOVERFLOW;
-            return -1;
+    if (to_size <= from_size) {
+        // The result can't be larger than the input, so compact the data in
+        // place. The read pointer always stays ahead of the write pointer.
+        char *read_ptr = base_ptr;
+        char *write_ptr = base_ptr;
+
+        while ((n == 0 || matches < n) && (ptr = static_cast<char *>(
+                mb_memmem(read_ptr, end_ptr - read_ptr, from, from_size)))) {
+            // Move data left of the match
+            if (write_ptr != read_ptr) {
+                memmove(write_ptr, read_ptr, ptr - read_ptr);
+            }
+            write_ptr += ptr - read_ptr;
+
+            // Copy replacement
+            memcpy(write_ptr, to, to_size);
+            write_ptr += to_size;
+
+            read_ptr = ptr + from_size;
+            ++matches;
         }
 
-        size_t new_buf_size = buf_size + (ptr - base_ptr) + to_size;
-        char *new_buf = static_cast<char *>(realloc(buf, new_buf_size));
-        if (!new_buf) {
-            free(buf);
-            return -1;
+        // Move remainder of data
+        if (write_ptr != read_ptr) {
+            memmove(write_ptr, read_ptr, end_ptr - read_ptr);
         }
+        write_ptr += end_ptr - read_ptr;
 
-        target_ptr = new_buf + buf_size;
-
-        // Copy data left of the match
-        target_ptr = _mb_mempcpy(target_ptr, base_ptr, ptr - base_ptr);
+        *mem_size = write_ptr - base_ptr;
 
-        // Copy replacement
-        target_ptr = _mb_mempcpy(target_ptr, to, to_size);
+        if (n_replaced) {
+            *n_replaced = matches;
+        }
 
-        buf = new_buf;
-        buf_size = new_buf_size;
+        return 0;
+    }
 
+    // Count the matches first so that the output buffer is only allocated once
+    ptr = base_ptr;
+    while ((n == 0 || matches < n) && (ptr = static_cast<char *>(
+            mb_memmem(ptr, end_ptr - ptr, from, from_size)))) {
         ptr += from_size;
-        ptr_remain -= ptr - base_ptr;
-        base_ptr = ptr;
-
         ++matches;
     }
 
-    // Copy remainder of string
-    if (ptr_remain > 0) {
-        if (buf_size >= SIZE_MAX - ptr_remain) {
-            free(buf);
-            errno = EOVERFLOW;
-            return -1;
+    if (matches == 0) {
+        if (n_replaced) {
+            *n_replaced = 0;
         }
+        return 0;
+    }
 
-        size_t new_buf_size = buf_size + ptr_remain;
-        char *new_buf = static_cast<char *>(realloc(buf, new_buf_size));
-        if (!new_buf) {
-            free(buf);
-            return -1;
-        }
+    size_t growth = to_size - from_size;
+    if (matches > (SIZE_MAX - *mem_size) / growth) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    size_t buf_size = *mem_size + matches * growth;
+    char *buf = static_cast<char *>(malloc(buf_size));
+    if (!buf) {
+        return -1;
+    }
 
-        target_ptr = new_buf + buf_size;
-        target_ptr = _mb_mempcpy(target_ptr, base_ptr, ptr_remain);
+    void *target_ptr = buf;
+    char *read_ptr = base_ptr;
 
-        buf = new_buf;
-        buf_size = new_buf_size;
+    for (size_t i = 0; i < matches; ++i) {
+        ptr = static_cast<char *>(
+                mb_memmem(read_ptr, end_ptr - read_ptr, from, from_size));
+
+        // Copy data left of the match
+        target_ptr = _mb_mempcpy(target_ptr, read_ptr, ptr - read_ptr);
+
+        // Copy replacement
+        target_ptr = _mb_mempcpy(target_ptr, to, to_size);
+
+        read_ptr = ptr + from_size;
     }
 
+    // Copy remainder of data
+    target_ptr = _mb_mempcpy(target_ptr, read_ptr, end_ptr - read_ptr);
+
     free(*mem);
     *mem = buf;
     *mem_size = buf_size;
@@ -811,10 +957,11 @@ int mem_replace(void **mem, size_t *mem_size,
  * \brief Replace string in string
  *
  * Replace \p from with \p to in \p *str, up to \p n times if \p n \> 0. If the
- * function succeeds, \p *str will be passed to `free()` and \p *str will be
- * updated to point to the newly allocated string. If \p n_replaced is not NULL,
- * the number of replacements done will be stored at the value pointed by
- * \p n_replaced. If the function fails, \p *str will be left unchanged.
+ * function succeeds, \p *str will be updated to point to the resulting string.
+ * As with mem_replace(), the string is modified in place if \p to is not longer
+ * than \p from. If \p n_replaced is not NULL, the number of replacements done
+ * will be stored at the value pointed by \p n_replaced. If the function fails,
+ * \p *str will be left unchanged.
  *
  * \param[in,out] str Pointer to string to modify
  * \param[in] from String to replace
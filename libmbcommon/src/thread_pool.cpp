@@ -0,0 +1,606 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbcommon/thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <cstdint>
+#include <cstdio>
+
+#ifdef __linux__
+#  include <sched.h>
+#endif
+#ifndef _WIN32
+#  include <unistd.h>
+#endif
+
+#include "mbcommon/thread_pool_p.h"
+
+// How long a waiting TaskGroup sleeps before checking for new tasks to help
+// with
+#define TASK_GROUP_HELP_INTERVAL_MS     10
+
+/*!
+ * \file mbcommon/thread_pool.h
+ * \brief Shared work-stealing thread pool
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+
+// Pool and worker index of the current thread if it is a pool worker
+static thread_local ThreadPoolPrivate *tls_pool = nullptr;
+static thread_local size_t tls_worker = 0;
+
+#ifdef __linux__
+static std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+
+    return cpus;
+}
+
+/*!
+ * \brief Get maximum frequency of a CPU in kHz
+ *
+ * \return Frequency or 0 if it is unknown
+ */
+static unsigned long cpu_max_freq(int cpu)
+{
+    char path[64];
+    unsigned long freq;
+
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", cpu);
+
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        return 0;
+    }
+
+    if (fscanf(fp, "%lu", &freq) != 1) {
+        freq = 0;
+    }
+
+    fclose(fp);
+    return freq;
+}
+#endif
+
+ThreadPoolPrivate::ThreadPoolPrivate()
+    : next_worker(0)
+    , pending(0)
+    , stopping(false)
+{
+}
+
+ThreadPoolPrivate::~ThreadPoolPrivate() = default;
+
+void ThreadPoolPrivate::start(unsigned int threads)
+{
+    std::vector<int> cpus;
+
+#ifdef __linux__
+    // Only pin workers when there is exactly one per CPU
+    if (threads == 0) {
+        cpus = allowed_cpus();
+    }
+#endif
+
+    if (threads == 0) {
+        threads = cpus.empty()
+                ? std::max(1u, std::thread::hardware_concurrency())
+                : static_cast<unsigned int>(cpus.size());
+    }
+
+    workers.reserve(threads);
+
+    for (unsigned int i = 0; i < threads; ++i) {
+        workers.emplace_back(new ThreadPoolWorker());
+        workers.back()->cpu = i < cpus.size() ? cpus[i] : -1;
+    }
+
+#ifdef __linux__
+    // On big.LITTLE systems, the clusters are distinguished by their maximum
+    // frequencies
+    if (!cpus.empty()) {
+        std::vector<unsigned long> freqs;
+        for (int cpu : cpus) {
+            freqs.push_back(cpu_max_freq(cpu));
+        }
+
+        auto minmax = std::minmax_element(freqs.begin(), freqs.end());
+
+        if (*minmax.first != 0 && *minmax.first != *minmax.second) {
+            for (size_t i = 0; i < freqs.size(); ++i) {
+                if (freqs[i] == *minmax.second) {
+                    big_workers.push_back(i);
+                } else if (freqs[i] == *minmax.first) {
+                    little_workers.push_back(i);
+                }
+            }
+        }
+    }
+#endif
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i]->thread = std::thread(&ThreadPoolPrivate::run_worker,
+                                         this, i);
+    }
+}
+
+void ThreadPoolPrivate::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    cv.notify_all();
+
+    for (auto &worker : workers) {
+        worker->thread.join();
+    }
+}
+
+void ThreadPoolPrivate::run_worker(size_t index)
+{
+    tls_pool = this;
+    tls_worker = index;
+
+#ifdef __linux__
+    int cpu = workers[index]->cpu;
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        // Not fatal. The CPU may have gone offline since the pool started.
+        (void) sched_setaffinity(0, sizeof(set), &set);
+    }
+#endif
+
+    while (true) {
+        ThreadPool::Task task;
+
+        if (pop(index, task)) {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [&] { return pending > 0 || stopping; });
+
+        // Queued tasks are still run when the pool is destroyed
+        if (pending == 0 && stopping) {
+            break;
+        }
+    }
+
+    tls_pool = nullptr;
+}
+
+size_t ThreadPoolPrivate::pick_worker(TaskPriority priority)
+{
+    const std::vector<size_t> *preferred = nullptr;
+
+    if (priority == TaskPriority::High && !big_workers.empty()) {
+        preferred = &big_workers;
+    } else if (priority == TaskPriority::Low && !little_workers.empty()) {
+        preferred = &little_workers;
+    }
+
+    size_t n = next_worker++;
+
+    if (preferred) {
+        return (*preferred)[n % preferred->size()];
+    } else {
+        return n % workers.size();
+    }
+}
+
+void ThreadPoolPrivate::push(size_t index, ThreadPool::Task task,
+                             TaskPriority priority)
+{
+    ThreadPoolWorker &worker = *workers[index];
+
+    {
+        std::lock_guard<std::mutex> worker_guard(worker.lock);
+        worker.queues[static_cast<size_t>(priority)].push_back(
+                std::move(task));
+
+        // The counter is updated under the queue lock so that it never
+        // disagrees with the queues' contents
+        std::lock_guard<std::mutex> guard(lock);
+        ++pending;
+    }
+
+    cv.notify_one();
+}
+
+/*!
+ * \brief Take the highest priority task available
+ *
+ * Tasks are taken from the back of the queue of worker \p index (if it's a
+ * valid index) first and stolen from the front of the other workers' queues
+ * otherwise.
+ */
+bool ThreadPoolPrivate::pop(size_t index, ThreadPool::Task &task)
+{
+    for (size_t p = 0; p < TASK_PRIORITIES; ++p) {
+        for (size_t i = 0; i < workers.size(); ++i) {
+            bool own = index < workers.size() && i == 0;
+            size_t victim = index < workers.size()
+                    ? (index + i) % workers.size() : i;
+            ThreadPoolWorker &worker = *workers[victim];
+
+            std::lock_guard<std::mutex> worker_guard(worker.lock);
+            auto &queue = worker.queues[p];
+
+            if (queue.empty()) {
+                continue;
+            }
+
+            if (own) {
+                task = std::move(queue.back());
+                queue.pop_back();
+            } else {
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            --pending;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+TaskGroupPrivate::TaskGroupPrivate(ThreadPool *pool_, size_t max_pending_,
+                                   TaskPriority priority_,
+                                   CancellationToken token_)
+    : pool(pool_)
+    , max_pending(max_pending_)
+    , priority(priority_)
+    , token(std::move(token_))
+    , outstanding(0)
+{
+}
+
+/*!
+ * \brief Wait until fewer than \p limit tasks are outstanding
+ *
+ * The calling thread runs queued tasks from the pool while it waits. This
+ * keeps nested groups from deadlocking when every worker is waiting.
+ */
+void TaskGroupPrivate::wait_for_outstanding(size_t limit)
+{
+    while (true) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (outstanding < limit) {
+                return;
+            }
+        }
+
+        if (pool->run_one()) {
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait_for(guard,
+                    std::chrono::milliseconds(TASK_GROUP_HELP_INTERVAL_MS),
+                    [&] { return outstanding < limit; });
+    }
+}
+
+/*! \endcond */
+
+/*!
+ * \enum TaskPriority
+ *
+ * \brief Scheduling priority of a task
+ *
+ * Queued tasks of a higher priority are always run before tasks of a lower
+ * priority. On heterogeneous (eg. big.LITTLE) systems, high priority tasks are
+ * also queued on the workers of the fastest cores and low priority tasks on
+ * the workers of the slowest cores. Idle workers steal tasks regardless of
+ * priority, so this only affects where a task is likely to run.
+ */
+
+/*!
+ * \class CancellationToken
+ *
+ * \brief Shared flag for cooperatively cancelling work
+ *
+ * Copies of a token refer to the same flag.
+ */
+
+CancellationToken::CancellationToken()
+    : _state(std::make_shared<std::atomic_bool>(false))
+{
+}
+
+/*!
+ * \brief Request cancellation
+ */
+void CancellationToken::cancel()
+{
+    *_state = true;
+}
+
+/*!
+ * \brief Check whether cancellation has been requested
+ */
+bool CancellationToken::is_cancelled() const
+{
+    return *_state;
+}
+
+/*!
+ * \class ThreadPool
+ *
+ * \brief Work-stealing thread pool
+ *
+ * Each worker has its own set of per-priority task queues. Tasks submitted
+ * from a worker are queued on that worker, which runs them in LIFO order for
+ * cache locality, while idle workers steal from the other end of the queues.
+ *
+ * The default constructor creates one worker per CPU that the process may run
+ * on and pins each worker to its CPU.
+ *
+ * Most code should use shared() instead of creating its own pool so that
+ * nested parallel operations don't oversubscribe the CPUs.
+ */
+
+/*!
+ * \brief Construct thread pool and start its workers
+ *
+ * \param threads Number of workers (0 to use one per CPU)
+ */
+ThreadPool::ThreadPool(unsigned int threads)
+    : _priv_ptr(new ThreadPoolPrivate())
+{
+    MB_PRIVATE(ThreadPool);
+    priv->start(threads);
+}
+
+/*!
+ * \brief Run remaining tasks and stop the workers
+ */
+ThreadPool::~ThreadPool()
+{
+    MB_PRIVATE(ThreadPool);
+    priv->stop();
+}
+
+/*!
+ * \brief Get process-wide thread pool
+ *
+ * The pool is created on first use and is never destroyed, so tasks cannot
+ * outlive it during static destruction. Worker threads do not survive
+ * `fork()`, so a child process gets a new pool.
+ */
+ThreadPool & ThreadPool::shared()
+{
+    static std::mutex lock;
+    static ThreadPool *pool = nullptr;
+
+    std::lock_guard<std::mutex> guard(lock);
+
+#ifdef _WIN32
+    if (!pool) {
+        pool = new ThreadPool();
+    }
+#else
+    static pid_t owner = 0;
+
+    if (!pool || owner != getpid()) {
+        pool = new ThreadPool();
+        owner = getpid();
+    }
+#endif
+
+    return *pool;
+}
+
+/*!
+ * \brief Get number of workers
+ */
+unsigned int ThreadPool::size() const
+{
+    MB_PRIVATE(const ThreadPool);
+    return static_cast<unsigned int>(priv->workers.size());
+}
+
+/*!
+ * \brief Queue a task
+ *
+ * \param task Task to run. It must not throw.
+ * \param priority Scheduling priority
+ */
+void ThreadPool::submit(Task task, TaskPriority priority)
+{
+    MB_PRIVATE(ThreadPool);
+
+    size_t index = tls_pool == priv ? tls_worker : priv->pick_worker(priority);
+    priv->push(index, std::move(task), priority);
+}
+
+/*!
+ * \brief Run a single queued task on the calling thread
+ *
+ * \return Whether a task was run
+ */
+bool ThreadPool::run_one()
+{
+    MB_PRIVATE(ThreadPool);
+
+    Task task;
+
+    if (!priv->pop(tls_pool == priv ? tls_worker : SIZE_MAX, task)) {
+        return false;
+    }
+
+    task();
+    return true;
+}
+
+/*!
+ * \brief Check whether the calling thread is a worker of this pool
+ */
+bool ThreadPool::is_worker() const
+{
+    MB_PRIVATE(const ThreadPool);
+    return tls_pool == priv;
+}
+
+/*!
+ * \class TaskGroup
+ *
+ * \brief Set of tasks that can be waited on and cancelled together
+ *
+ * If the group has a maximum number of pending tasks, run() blocks until an
+ * earlier task finishes once the limit is reached. This bounds the amount of
+ * queued work (and the memory it holds) when a producer is faster than the
+ * workers. It also caps the group's concurrency at that limit.
+ *
+ * Threads waiting on the group run other queued tasks in the meantime.
+ */
+
+/*!
+ * \brief Construct task group using the shared pool
+ */
+TaskGroup::TaskGroup()
+    : TaskGroup(ThreadPool::shared())
+{
+}
+
+/*!
+ * \brief Construct task group
+ *
+ * \param pool Thread pool to run tasks on
+ * \param max_pending Maximum number of unfinished tasks (0 for no limit)
+ * \param priority Scheduling priority of the tasks
+ * \param token Token for cancelling the group. Cancelling the token makes the
+ *              group skip tasks that have not started yet.
+ */
+TaskGroup::TaskGroup(ThreadPool &pool, size_t max_pending,
+                     TaskPriority priority, CancellationToken token)
+    : _priv_ptr(new TaskGroupPrivate(&pool, max_pending, priority,
+                                     std::move(token)))
+{
+}
+
+/*!
+ * \brief Wait for the group's tasks to finish
+ */
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+/*!
+ * \brief Queue a task in the group
+ *
+ * \param task Task to run. It must not throw.
+ */
+void TaskGroup::run(ThreadPool::Task task)
+{
+    MB_PRIVATE(TaskGroup);
+
+    if (priv->max_pending > 0) {
+        priv->wait_for_outstanding(priv->max_pending);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(priv->lock);
+        ++priv->outstanding;
+    }
+
+    priv->pool->submit([priv, task] {
+        if (!priv->token.is_cancelled()) {
+            task();
+        }
+
+        // Notify under the lock because the group may be destroyed as soon as
+        // the waiter sees the last task finish
+        std::lock_guard<std::mutex> guard(priv->lock);
+        --priv->outstanding;
+        priv->cv.notify_all();
+    }, priv->priority);
+}
+
+/*!
+ * \brief Wait for all queued tasks to finish or be skipped
+ */
+void TaskGroup::wait()
+{
+    MB_PRIVATE(TaskGroup);
+    priv->wait_for_outstanding(1);
+}
+
+/*!
+ * \brief Cancel the group
+ *
+ * Tasks that have not started yet are skipped. Running tasks can check
+ * is_cancelled() to stop early.
+ */
+void TaskGroup::cancel()
+{
+    MB_PRIVATE(TaskGroup);
+    priv->token.cancel();
+}
+
+/*!
+ * \brief Check whether the group has been cancelled
+ */
+bool TaskGroup::is_cancelled() const
+{
+    MB_PRIVATE(const TaskGroup);
+    return priv->token.is_cancelled();
+}
+
+/*!
+ * \brief Get the group's cancellation token
+ */
+CancellationToken TaskGroup::token() const
+{
+    MB_PRIVATE(const TaskGroup);
+    return priv->token;
+}
+
+}
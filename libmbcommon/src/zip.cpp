@@ -0,0 +1,1209 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/zip.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
+#include "mbcommon/zip_p.h"
+
+#define LOCAL_HEADER_SIGNATURE          0x04034b50
+#define LOCAL_HEADER_SIZE               30
+#define CENTRAL_HEADER_SIGNATURE        0x02014b50
+#define CENTRAL_HEADER_SIZE             46
+#define EOCD_SIGNATURE                  0x06054b50
+#define EOCD_SIZE                       22
+#define ZIP64_EOCD_LOCATOR_SIGNATURE    0x07064b50
+#define ZIP64_EOCD_LOCATOR_SIZE         20
+#define ZIP64_EOCD_SIGNATURE            0x06064b50
+#define ZIP64_EOCD_SIZE                 56
+#define ZIP64_EXTRA_FIELD_ID            0x0001
+
+// Maximum size of the archive comment
+#define MAX_COMMENT_SIZE                0xffff
+
+// Version made by: UNIX
+#define HOST_UNIX                       3
+
+#define INPUT_BUF_SIZE                  (256 * 1024)
+#define SKIP_BUF_SIZE                   (64 * 1024)
+
+/*!
+ * \file mbcommon/zip.h
+ * \brief Indexed zip archive reader
+ */
+
+namespace mb
+{
+
+/*! \cond INTERNAL */
+
+static inline uint16_t read_le16(const unsigned char *p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t read_le32(const unsigned char *p)
+{
+    return static_cast<uint32_t>(p[0])
+            | (static_cast<uint32_t>(p[1]) << 8)
+            | (static_cast<uint32_t>(p[2]) << 16)
+            | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline uint64_t read_le64(const unsigned char *p)
+{
+    return static_cast<uint64_t>(read_le32(p))
+            | (static_cast<uint64_t>(read_le32(p + 4)) << 32);
+}
+
+ZipArchivePrivate::ZipArchivePrivate()
+{
+    clear();
+}
+
+ZipArchivePrivate::~ZipArchivePrivate()
+{
+}
+
+void ZipArchivePrivate::clear()
+{
+    fd = -1;
+    size = 0;
+    map = nullptr;
+    map_size = 0;
+    entries.clear();
+    names.clear();
+}
+
+ZipEntryFilePrivate::ZipEntryFilePrivate()
+{
+    strm_init = false;
+    clear();
+}
+
+ZipEntryFilePrivate::~ZipEntryFilePrivate()
+{
+    if (strm_init) {
+        inflateEnd(&strm);
+    }
+}
+
+void ZipEntryFilePrivate::clear()
+{
+    if (strm_init) {
+        inflateEnd(&strm);
+    }
+
+    archive = nullptr;
+    entry = nullptr;
+    data_offset = 0;
+    pos = 0;
+    crc_pos = 0;
+    crc = 0;
+    strm = z_stream();
+    strm_init = false;
+    stream_end = false;
+    in_offset = 0;
+    in_remaining = 0;
+    std::vector<unsigned char>().swap(in_buf);
+}
+
+MB_PRINTF(3, 4)
+static void set_error(ZipArchivePrivate *priv, std::error_code ec,
+                      const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+
+    priv->error_code = ec;
+    (void) format_v(priv->error_string, fmt, ap);
+    priv->error_string += ": ";
+    priv->error_string += ec.message();
+
+    va_end(ap);
+}
+
+/*!
+ * \brief Read exactly \p size bytes at \p offset of the archive
+ *
+ * This never touches a file position, so it is safe to call from multiple
+ * threads.
+ */
+static bool read_raw(const ZipArchivePrivate *priv, uint64_t offset,
+                     void *buf, size_t size, std::error_code &ec)
+{
+    if (offset > priv->size || size > priv->size - offset) {
+        ec = make_error_code(FileError::BadFileFormat);
+        return false;
+    }
+
+    if (priv->map) {
+        memcpy(buf, static_cast<const char *>(priv->map) + offset, size);
+        return true;
+    }
+
+    char *ptr = static_cast<char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = pread64(priv->fd, ptr, size, static_cast<off64_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ec = std::error_code(errno, std::generic_category());
+            return false;
+        } else if (n == 0) {
+            ec = std::error_code(EIO, std::generic_category());
+            return false;
+        }
+
+        ptr += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+
+    return true;
+}
+
+static bool read_central_directory(ZipArchivePrivate *priv)
+{
+    std::error_code ec;
+
+    if (priv->size < EOCD_SIZE) {
+        set_error(priv, make_error_code(FileError::BadFileFormat),
+                  "File is too small to be a zip");
+        return false;
+    }
+
+    // Find end of central directory record. It is followed only by the
+    // archive comment.
+    size_t tail_size = static_cast<size_t>(std::min<uint64_t>(
+            priv->size, EOCD_SIZE + ZIP64_EOCD_LOCATOR_SIZE
+                    + MAX_COMMENT_SIZE));
+    uint64_t tail_offset = priv->size - tail_size;
+    std::vector<unsigned char> tail(tail_size);
+
+    if (!read_raw(priv, tail_offset, tail.data(), tail_size, ec)) {
+        set_error(priv, ec, "Failed to read end of central directory");
+        return false;
+    }
+
+    size_t eocd = SIZE_MAX;
+    for (size_t i = tail_size - EOCD_SIZE + 1; i-- > 0;) {
+        if (read_le32(&tail[i]) == EOCD_SIGNATURE
+                && i + EOCD_SIZE + read_le16(&tail[i + 20]) == tail_size) {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd == SIZE_MAX) {
+        set_error(priv, make_error_code(FileError::BadFileFormat),
+                  "End of central directory record not found");
+        return false;
+    }
+
+    const unsigned char *p = &tail[eocd];
+    uint32_t disk = read_le16(p + 4);
+    uint32_t cd_disk = read_le16(p + 6);
+    uint64_t disk_entries = read_le16(p + 8);
+    uint64_t total_entries = read_le16(p + 10);
+    uint64_t cd_size = read_le32(p + 12);
+    uint64_t cd_offset = read_le32(p + 16);
+    uint64_t cd_end = tail_offset + eocd;
+
+    // Archives with more than 65535 entries or larger than 4 GiB store the
+    // real values in the zip64 end of central directory record
+    if (eocd >= ZIP64_EOCD_LOCATOR_SIZE && read_le32(
+            &tail[eocd - ZIP64_EOCD_LOCATOR_SIZE])
+                    == ZIP64_EOCD_LOCATOR_SIGNATURE) {
+        const unsigned char *l = &tail[eocd - ZIP64_EOCD_LOCATOR_SIZE];
+        uint64_t eocd64_offset = read_le64(l + 8);
+        unsigned char eocd64[ZIP64_EOCD_SIZE];
+
+        if (!read_raw(priv, eocd64_offset, eocd64, sizeof(eocd64), ec)
+                || read_le32(eocd64) != ZIP64_EOCD_SIGNATURE) {
+            set_error(priv, make_error_code(FileError::BadFileFormat),
+                      "Invalid zip64 end of central directory record");
+            return false;
+        }
+
+        disk = read_le32(eocd64 + 16);
+        cd_disk = read_le32(eocd64 + 20);
+        disk_entries = read_le64(eocd64 + 24);
+        total_entries = read_le64(eocd64 + 32);
+        cd_size = read_le64(eocd64 + 40);
+        cd_offset = read_le64(eocd64 + 48);
+        cd_end = eocd64_offset;
+    }
+
+    if (disk != 0 || cd_disk != 0 || disk_entries != total_entries) {
+        set_error(priv, make_error_code(FileError::BadFileFormat),
+                  "Multi-disk archives are not supported");
+        return false;
+    }
+    if (cd_offset > cd_end || cd_size > cd_end - cd_offset) {
+        set_error(priv, make_error_code(FileError::BadFileFormat),
+                  "Central directory is out of bounds");
+        return false;
+    }
+    // Each record is at least CENTRAL_HEADER_SIZE bytes
+    if (total_entries > cd_size / CENTRAL_HEADER_SIZE) {
+        set_error(priv, make_error_code(FileError::BadFileFormat),
+                  "Central directory is truncated");
+        return false;
+    }
+
+    // Parse the central directory straight out of the mapping if there is one
+    std::vector<unsigned char> cd_buf;
+    const unsigned char *cd;
+
+    if (priv->map) {
+        cd = static_cast<const unsigned char *>(priv->map) + cd_offset;
+    } else {
+        cd_buf.resize(static_cast<size_t>(cd_size));
+        if (!read_raw(priv, cd_offset, cd_buf.data(), cd_buf.size(), ec)) {
+            set_error(priv, ec, "Failed to read central directory");
+            return false;
+        }
+        cd = cd_buf.data();
+    }
+
+    priv->entries.clear();
+    priv->entries.reserve(static_cast<size_t>(total_entries));
+    priv->names.clear();
+    priv->names.reserve(static_cast<size_t>(total_entries));
+
+    size_t pos = 0;
+    for (uint64_t i = 0; i < total_entries; ++i) {
+        if (pos + CENTRAL_HEADER_SIZE > cd_size
+                || read_le32(&cd[pos]) != CENTRAL_HEADER_SIGNATURE) {
+            set_error(priv, make_error_code(FileError::BadFileFormat),
+                      "Invalid central directory record %" PRIu64, i);
+            return false;
+        }
+
+        const unsigned char *h = &cd[pos];
+        uint16_t name_size = read_le16(h + 28);
+        uint16_t extra_size = read_le16(h + 30);
+        uint16_t comment_size = read_le16(h + 32);
+        size_t record_size = CENTRAL_HEADER_SIZE + name_size + extra_size
+                + comment_size;
+
+        if (pos + record_size > cd_size) {
+            set_error(priv, make_error_code(FileError::BadFileFormat),
+                      "Truncated central directory record %" PRIu64, i);
+            return false;
+        }
+
+        ZipEntry entry;
+        entry.name.assign(reinterpret_cast<const char *>(
+                h + CENTRAL_HEADER_SIZE), name_size);
+        entry.version_made_by = read_le16(h + 4);
+        entry.method = read_le16(h + 10);
+        entry.crc32 = read_le32(h + 16);
+        entry.compressed_size = read_le32(h + 20);
+        entry.uncompressed_size = read_le32(h + 24);
+        entry.external_attrs = read_le32(h + 38);
+        entry.local_header_offset = read_le32(h + 42);
+
+        // Fields that do not fit in 32 bits are stored in the zip64 extra
+        // field in this order
+        const unsigned char *extra = h + CENTRAL_HEADER_SIZE + name_size;
+        for (size_t e = 0; e + 4 <= extra_size;) {
+            uint16_t id = read_le16(extra + e);
+            uint16_t size = read_le16(extra + e + 2);
+            const unsigned char *data = extra + e + 4;
+            size_t data_size = std::min<size_t>(size, extra_size - e - 4);
+
+            if (id == ZIP64_EXTRA_FIELD_ID) {
+                size_t d = 0;
+                for (uint64_t *field : { &entry.uncompressed_size,
+                                         &entry.compressed_size,
+                                         &entry.local_header_offset }) {
+                    if (*field == UINT32_MAX && d + 8 <= data_size) {
+                        *field = read_le64(data + d);
+                        d += 8;
+                    }
+                }
+                break;
+            }
+
+            e += 4 + size;
+        }
+
+        if (entry.local_header_offset > cd_offset
+                || entry.compressed_size > cd_offset
+                        - entry.local_header_offset) {
+            set_error(priv, make_error_code(FileError::BadFileFormat),
+                      "%s: Entry is out of bounds", entry.name.c_str());
+            return false;
+        }
+
+        // Like a sequential scan, the first entry with a given name wins
+        if (priv->names.emplace(entry.name, priv->entries.size()).second) {
+            priv->entries.push_back(std::move(entry));
+        }
+
+        pos += record_size;
+    }
+
+    return true;
+}
+
+/*! \endcond */
+
+/*!
+ * \brief Get the Unix permission bits of an entry
+ *
+ * \param entry Zip entry
+ * \param default_mode Mode to return if the entry was not created on a Unix
+ *                     system or does not specify any permissions
+ *
+ * \return Permission bits (`07777` mask) of the entry or \p default_mode
+ */
+uint32_t zip_entry_unix_mode(const ZipEntry &entry, uint32_t default_mode)
+{
+    uint32_t mode = 0;
+
+    if ((entry.version_made_by >> 8) == HOST_UNIX) {
+        mode = (entry.external_attrs >> 16) & 07777;
+    }
+
+    return mode != 0 ? mode : default_mode;
+}
+
+/*!
+ * \class ZipArchive
+ *
+ * \brief Random access to the entries of a zip through its central directory
+ *
+ * The central directory (including zip64 records) is read once when the zip is
+ * opened and every entry is indexed by name, so find() is a constant time
+ * lookup. Entries can then be opened as ZipEntryFile streams in any order
+ * without scanning through the local headers.
+ *
+ * All reads from the archive use `pread()` or a read-only memory mapping of the
+ * whole file, so any number of ZipEntryFile handles can be used concurrently
+ * from different threads. The archive itself must not be closed while entries
+ * are open.
+ */
+
+/*!
+ * \typedef ZipArchive::EntryCallback
+ *
+ * \brief Callback for for_each_parallel()
+ *
+ * \param entry Entry being processed
+ * \param file Opened stream of the entry's uncompressed data
+ *
+ * \return Whether the entry was successfully processed. Returning false stops
+ *         the remaining entries from being processed. The callback should set
+ *         an error on \p file to report the reason.
+ */
+
+ZipArchive::ZipArchive()
+    : _priv_ptr(new ZipArchivePrivate())
+{
+}
+
+ZipArchive::~ZipArchive()
+{
+    close();
+}
+
+/*!
+ * \brief Open zip and read its central directory
+ *
+ * \param path Path to zip file
+ *
+ * \return Whether the central directory was successfully read
+ */
+bool ZipArchive::open(const std::string &path)
+{
+    return open(path, false);
+}
+
+/*!
+ * \brief Open zip and read its central directory
+ *
+ * If \p map is true, the whole file is mapped into memory. Stored entries can
+ * then be accessed without copying via File::map_range() and deflated entries
+ * are inflated straight out of the mapping. If the file cannot be mapped (eg.
+ * it is larger than the address space), it is read with `pread()` instead. Use
+ * is_mapped() to check which was used.
+ *
+ * \param path Path to zip file
+ * \param map Whether to map the file into memory
+ *
+ * \return Whether the central directory was successfully read
+ */
+bool ZipArchive::open(const std::string &path, bool map)
+{
+    MB_PRIVATE(ZipArchive);
+
+    if (priv->fd >= 0) {
+        set_error(priv, make_error_code(FileError::InvalidState),
+                  "%s: Archive is already open", path.c_str());
+        return false;
+    }
+
+    priv->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (priv->fd < 0) {
+        set_error(priv, std::error_code(errno, std::generic_category()),
+                  "%s: Failed to open", path.c_str());
+        priv->clear();
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(priv->fd, &sb) < 0) {
+        set_error(priv, std::error_code(errno, std::generic_category()),
+                  "%s: Failed to stat", path.c_str());
+        close();
+        return false;
+    }
+    priv->size = static_cast<uint64_t>(sb.st_size);
+
+    if (map && priv->size > 0 && priv->size <= SIZE_MAX) {
+#if defined(__ANDROID__) && !defined(__LP64__)
+        void *ptr = mmap64(nullptr, static_cast<size_t>(priv->size),
+                           PROT_READ, MAP_SHARED, priv->fd, 0);
+#else
+        void *ptr = mmap(nullptr, static_cast<size_t>(priv->size),
+                         PROT_READ, MAP_SHARED, priv->fd, 0);
+#endif
+        if (ptr != MAP_FAILED) {
+            priv->map = ptr;
+            priv->map_size = static_cast<size_t>(priv->size);
+        }
+    }
+
+    if (!read_central_directory(priv)) {
+        priv->error_string = path + ": " + priv->error_string;
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Close the archive
+ *
+ * \return Whether the file was closed successfully. The archive is closed
+ *         regardless of the return value.
+ */
+bool ZipArchive::close()
+{
+    MB_PRIVATE(ZipArchive);
+
+    bool ret = true;
+
+    if (priv->map) {
+        munmap(priv->map, priv->map_size);
+    }
+    if (priv->fd >= 0 && ::close(priv->fd) < 0) {
+        set_error(priv, std::error_code(errno, std::generic_category()),
+                  "Failed to close archive");
+        ret = false;
+    }
+
+    priv->clear();
+
+    return ret;
+}
+
+/*!
+ * \brief Check whether the archive is open
+ */
+bool ZipArchive::is_open() const
+{
+    MB_PRIVATE(const ZipArchive);
+    return priv->fd >= 0;
+}
+
+/*!
+ * \brief Check whether the archive is mapped into memory
+ */
+bool ZipArchive::is_mapped() const
+{
+    MB_PRIVATE(const ZipArchive);
+    return priv->map != nullptr;
+}
+
+/*!
+ * \brief Look up an entry by its full path in the archive
+ *
+ * \return Pointer to the entry or nullptr if it does not exist. The pointer is
+ *         valid until the archive is closed.
+ */
+const ZipEntry * ZipArchive::find(const std::string &name) const
+{
+    MB_PRIVATE(const ZipArchive);
+
+    auto it = priv->names.find(name);
+    return it == priv->names.end() ? nullptr : &priv->entries[it->second];
+}
+
+/*!
+ * \brief List of entries in central directory order
+ *
+ * If a name appears more than once, only the first entry is listed.
+ */
+const std::vector<ZipEntry> & ZipArchive::entries() const
+{
+    MB_PRIVATE(const ZipArchive);
+    return priv->entries;
+}
+
+/*!
+ * \brief Read the uncompressed contents of an entry into memory
+ *
+ * \param[in] entry Entry of this archive
+ * \param[out] data Output buffer. It is only modified on success.
+ *
+ * \return Whether the entry was successfully read and its CRC32 matched
+ */
+bool ZipArchive::read(const ZipEntry &entry, std::vector<unsigned char> &data)
+{
+    MB_PRIVATE(ZipArchive);
+
+    if (entry.uncompressed_size > SIZE_MAX) {
+        set_error(priv, make_error_code(FileError::IntegerOverflow),
+                  "%s: Entry is too large to read into memory",
+                  entry.name.c_str());
+        return false;
+    }
+
+    ZipEntryFile file(*this, entry);
+    if (!file.is_open()) {
+        priv->error_code = file.error();
+        priv->error_string = file.error_string();
+        return false;
+    }
+
+    std::vector<unsigned char> buf(
+            static_cast<size_t>(entry.uncompressed_size));
+    size_t total = 0;
+
+    // Read one extra byte to make sure the entry ends where it should
+    while (true) {
+        unsigned char extra;
+        size_t n;
+
+        bool ret = total < buf.size()
+                ? file.read(buf.data() + total, buf.size() - total, n)
+                : file.read(&extra, 1, n);
+        if (!ret) {
+            priv->error_code = file.error();
+            priv->error_string = file.error_string();
+            return false;
+        } else if (n == 0) {
+            break;
+        } else if (total == buf.size()) {
+            set_error(priv, make_error_code(FileError::BadFileFormat),
+                      "%s: Entry is larger than expected", entry.name.c_str());
+            return false;
+        }
+
+        total += n;
+    }
+
+    if (total != buf.size()) {
+        set_error(priv, make_error_code(FileError::BadFileFormat),
+                  "%s: Entry is smaller than expected", entry.name.c_str());
+        return false;
+    }
+
+    data.swap(buf);
+    return true;
+}
+
+/*!
+ * \brief Decode entries in parallel
+ *
+ * Each entry in \p entries is opened as a ZipEntryFile on one of up to
+ * \p threads tasks (including the calling thread) on the shared thread pool
+ * and passed to \p cb. The order in which entries are processed
+ * is unspecified. If an entry cannot be opened or \p cb returns false, the
+ * entries that have not been started yet are skipped.
+ *
+ * \param entries Entries of this archive to process
+ * \param threads Number of threads (0 to use one per CPU)
+ * \param cb Callback for each entry. It is called concurrently from different
+ *           threads.
+ *
+ * \return Whether every entry was successfully processed. If false, the error
+ *         of the first failed entry is reported by error().
+ */
+bool ZipArchive::for_each_parallel(const std::vector<const ZipEntry *> &entries,
+                                   unsigned int threads,
+                                   const EntryCallback &cb)
+{
+    MB_PRIVATE(ZipArchive);
+
+    if (threads == 0) {
+        threads = ThreadPool::shared().size();
+    }
+    threads = static_cast<unsigned int>(
+            std::min<size_t>(threads, entries.size()));
+
+    std::atomic<size_t> next(0);
+    TaskGroup group;
+    std::mutex error_lock;
+    bool have_error = false;
+
+    auto worker = [&] {
+        ZipEntryFile file;
+
+        while (!group.is_cancelled()) {
+            size_t i = next++;
+            if (i >= entries.size()) {
+                break;
+            }
+
+            const ZipEntry &entry = *entries[i];
+
+            if (!file.open(*this, entry) || !cb(entry, file)) {
+                group.cancel();
+
+                std::lock_guard<std::mutex> lock(error_lock);
+                if (!have_error) {
+                    have_error = true;
+                    priv->error_code = file.error();
+                    priv->error_string = file.error_string();
+                    if (!priv->error_code) {
+                        set_error(priv,
+                                  make_error_code(FileError::InvalidState),
+                                  "%s: Failed to process entry",
+                                  entry.name.c_str());
+                    }
+                }
+            }
+
+            file.close();
+        }
+    };
+
+    // The calling thread is one of the workers
+    for (unsigned int i = 1; i < threads; ++i) {
+        group.run(worker);
+    }
+    if (threads > 0) {
+        worker();
+    }
+    group.wait();
+
+    return !group.is_cancelled();
+}
+
+/*!
+ * \brief Get error code for a failed operation.
+ *
+ * \note The return value is undefined if an operation did not fail.
+ *
+ * \return Error code for failed operation
+ */
+std::error_code ZipArchive::error()
+{
+    MB_PRIVATE(ZipArchive);
+    return priv->error_code;
+}
+
+/*!
+ * \brief Get error string for a failed operation.
+ *
+ * \note The return value is undefined if an operation did not fail.
+ *
+ * \return Error string for failed operation. The string contents may be
+ *         undefined, but will never be NULL or an invalid string.
+ */
+std::string ZipArchive::error_string()
+{
+    MB_PRIVATE(ZipArchive);
+    return priv->error_string;
+}
+
+/*!
+ * \class ZipEntryFile
+ *
+ * \brief Read-only File handle for the uncompressed data of a zip entry
+ *
+ * Stored and deflated entries are supported. The handle is seekable:
+ *
+ * * Stored entries are read directly from their position in the archive. If the
+ *   archive is mapped, map_range() returns pointers into the mapping.
+ * * Deflated entries are inflated on demand. Seeking forward skips over the
+ *   uncompressed data and seeking backward restarts the inflate stream, so
+ *   sequential reads are the fast path.
+ *
+ * The CRC32 and size of the entry are checked once the end of the data is
+ * reached. For stored entries, this only happens if the data was read
+ * sequentially from the beginning.
+ */
+
+/*!
+ * \brief Construct unbound ZipEntryFile.
+ *
+ * The File handle will not be bound to any entry. open() will need to be
+ * called to open an entry.
+ */
+ZipEntryFile::ZipEntryFile()
+    : ZipEntryFile(new ZipEntryFilePrivate())
+{
+}
+
+/*!
+ * \brief Open File handle for a zip entry.
+ *
+ * Construct the file handle and open the entry. Use is_open() to check if the
+ * entry was successfully opened.
+ *
+ * \sa open(ZipArchive &, const ZipEntry &)
+ *
+ * \param archive Opened zip archive
+ * \param entry Entry of \p archive
+ */
+ZipEntryFile::ZipEntryFile(ZipArchive &archive, const ZipEntry &entry)
+    : ZipEntryFile(new ZipEntryFilePrivate(), archive, entry)
+{
+}
+
+/*! \cond INTERNAL */
+
+ZipEntryFile::ZipEntryFile(ZipEntryFilePrivate *priv)
+    : File(priv)
+{
+}
+
+ZipEntryFile::ZipEntryFile(ZipEntryFilePrivate *priv,
+                           ZipArchive &archive, const ZipEntry &entry)
+    : File(priv)
+{
+    open(archive, entry);
+}
+
+/*! \endcond */
+
+ZipEntryFile::~ZipEntryFile()
+{
+    close();
+}
+
+/*!
+ * \brief Open zip entry.
+ *
+ * \param archive Opened zip archive. It must remain open until this file is
+ *                closed.
+ * \param entry Entry of \p archive (eg. from ZipArchive::find())
+ *
+ * \return Whether the entry's local header was valid and the entry is opened
+ */
+bool ZipEntryFile::open(ZipArchive &archive, const ZipEntry &entry)
+{
+    MB_PRIVATE(ZipEntryFile);
+    // Don't clobber the state of an open handle. File::open() will fail.
+    if (priv && priv->state == FileState::NEW) {
+        priv->clear();
+        priv->archive = archive._priv_func();
+        priv->entry = &entry;
+    }
+    return File::open();
+}
+
+bool ZipEntryFile::on_open()
+{
+    MB_PRIVATE(ZipEntryFile);
+
+    const ZipEntry *entry = priv->entry;
+    std::error_code ec;
+
+    if (priv->archive->fd < 0) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "%s: Archive is not open", entry->name.c_str());
+        return false;
+    }
+
+    if (entry->method != static_cast<uint16_t>(ZipMethod::Stored)
+            && entry->method != static_cast<uint16_t>(ZipMethod::Deflated)) {
+        set_error(make_error_code(FileError::UnsupportedRead),
+                  "%s: Unsupported compression method: %u",
+                  entry->name.c_str(), entry->method);
+        return false;
+    }
+
+    unsigned char header[LOCAL_HEADER_SIZE];
+    if (!read_raw(priv->archive, entry->local_header_offset,
+                  header, sizeof(header), ec)) {
+        set_error(ec, "%s: Failed to read local header", entry->name.c_str());
+        return false;
+    } else if (read_le32(header) != LOCAL_HEADER_SIGNATURE) {
+        set_error(make_error_code(FileError::BadFileFormat),
+                  "%s: Invalid local header", entry->name.c_str());
+        return false;
+    }
+
+    // The sizes come from the central directory, so entries with data
+    // descriptors are supported
+    priv->data_offset = entry->local_header_offset + LOCAL_HEADER_SIZE
+            + read_le16(header + 26) + read_le16(header + 28);
+    if (priv->data_offset > priv->archive->size
+            || entry->compressed_size
+                    > priv->archive->size - priv->data_offset) {
+        set_error(make_error_code(FileError::BadFileFormat),
+                  "%s: Entry data is out of bounds", entry->name.c_str());
+        return false;
+    }
+
+    if (entry->method == static_cast<uint16_t>(ZipMethod::Stored)
+            && entry->compressed_size != entry->uncompressed_size) {
+        set_error(make_error_code(FileError::BadFileFormat),
+                  "%s: Stored entry sizes do not match", entry->name.c_str());
+        return false;
+    }
+
+    if (entry->method == static_cast<uint16_t>(ZipMethod::Deflated)) {
+        // Raw deflate stream without zlib header
+        if (inflateInit2(&priv->strm, -MAX_WBITS) != Z_OK) {
+            set_error(make_error_code(FileError::InvalidState),
+                      "%s: Failed to initialize zlib: %s", entry->name.c_str(),
+                      priv->strm.msg ? priv->strm.msg : "(unknown)");
+            return false;
+        }
+        priv->strm_init = true;
+        priv->in_offset = priv->data_offset;
+        priv->in_remaining = entry->compressed_size;
+        if (!priv->archive->map) {
+            priv->in_buf.resize(static_cast<size_t>(std::min<uint64_t>(
+                    INPUT_BUF_SIZE, entry->compressed_size)));
+        }
+    }
+
+    priv->pos = 0;
+    priv->crc_pos = 0;
+    priv->crc = crc32(0, nullptr, 0);
+
+    return true;
+}
+
+bool ZipEntryFile::on_close()
+{
+    MB_PRIVATE(ZipEntryFile);
+
+    // Reset to allow opening another entry
+    priv->clear();
+
+    return true;
+}
+
+/*! \cond INTERNAL */
+
+/*!
+ * \brief Check the size and CRC32 of the data once the end is reached
+ */
+static bool check_crc(ZipEntryFile &file, ZipEntryFilePrivate *priv)
+{
+    if (priv->crc_pos != priv->entry->uncompressed_size) {
+        file.set_error(make_error_code(FileError::BadFileFormat),
+                       "%s: Expected %" PRIu64 " bytes, but got %" PRIu64,
+                       priv->entry->name.c_str(),
+                       priv->entry->uncompressed_size, priv->crc_pos);
+        return false;
+    } else if (priv->crc != priv->entry->crc32) {
+        file.set_error(make_error_code(FileError::BadFileFormat),
+                       "%s: CRC32 mismatch", priv->entry->name.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Inflate up to \p size bytes from the current stream position
+ *
+ * The output is added to the CRC32. \p bytes_read is less than \p size only at
+ * the end of the stream.
+ */
+static bool inflate_data(ZipEntryFile &file, ZipEntryFilePrivate *priv,
+                         void *buf, size_t size, size_t &bytes_read)
+{
+    const ZipEntry *entry = priv->entry;
+    z_stream *strm = &priv->strm;
+
+    bytes_read = 0;
+
+    while (size > 0 && !priv->stream_end) {
+        strm->next_out = static_cast<Bytef *>(buf) + bytes_read;
+        strm->avail_out = static_cast<uInt>(std::min<size_t>(size, UINT32_MAX));
+
+        if (strm->avail_in == 0 && priv->in_remaining > 0) {
+            if (priv->archive->map) {
+                // Inflate directly from the mapping
+                size_t n = static_cast<size_t>(std::min<uint64_t>(
+                        priv->in_remaining, UINT32_MAX));
+                strm->next_in = static_cast<Bytef *>(priv->archive->map)
+                        + priv->in_offset;
+                strm->avail_in = static_cast<uInt>(n);
+                priv->in_offset += n;
+                priv->in_remaining -= n;
+            } else {
+                std::error_code ec;
+                size_t n = static_cast<size_t>(std::min<uint64_t>(
+                        priv->in_buf.size(), priv->in_remaining));
+
+                if (!read_raw(priv->archive, priv->in_offset,
+                              priv->in_buf.data(), n, ec)) {
+                    file.set_error(ec, "%s: Failed to read data",
+                                   entry->name.c_str());
+                    return false;
+                }
+
+                strm->next_in = priv->in_buf.data();
+                strm->avail_in = static_cast<uInt>(n);
+                priv->in_offset += n;
+                priv->in_remaining -= n;
+            }
+        }
+
+        int ret = inflate(strm, Z_NO_FLUSH);
+        size_t n = strm->next_out - static_cast<Bytef *>(buf) - bytes_read;
+
+        priv->crc = crc32(priv->crc, static_cast<Bytef *>(buf) + bytes_read,
+                          static_cast<uInt>(n));
+        priv->crc_pos += n;
+        bytes_read += n;
+        size -= n;
+
+        if (ret == Z_STREAM_END) {
+            priv->stream_end = true;
+            if (!check_crc(file, priv)) {
+                return false;
+            }
+        } else if (ret == Z_BUF_ERROR && strm->avail_in == 0
+                && priv->in_remaining == 0) {
+            file.set_error(make_error_code(FileError::BadFileFormat),
+                           "%s: Compressed data is truncated",
+                           entry->name.c_str());
+            return false;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            file.set_error(make_error_code(FileError::BadFileFormat),
+                           "%s: Failed to inflate data: %s",
+                           entry->name.c_str(),
+                           strm->msg ? strm->msg : "(unknown)");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Move the inflate stream to the file position
+ */
+static bool sync_stream(ZipEntryFile &file, ZipEntryFilePrivate *priv)
+{
+    if (priv->crc_pos > priv->pos) {
+        // Start over from the beginning of the compressed data
+        if (inflateReset(&priv->strm) != Z_OK) {
+            file.set_error(make_error_code(FileError::InvalidState),
+                           "%s: Failed to reset zlib stream",
+                           priv->entry->name.c_str());
+            return false;
+        }
+        priv->strm.next_in = nullptr;
+        priv->strm.avail_in = 0;
+        priv->stream_end = false;
+        priv->in_offset = priv->data_offset;
+        priv->in_remaining = priv->entry->compressed_size;
+        priv->crc_pos = 0;
+        priv->crc = crc32(0, nullptr, 0);
+    }
+
+    unsigned char buf[SKIP_BUF_SIZE];
+
+    while (priv->crc_pos < priv->pos && !priv->stream_end) {
+        size_t n;
+
+        if (!inflate_data(file, priv, buf, static_cast<size_t>(
+                std::min<uint64_t>(sizeof(buf), priv->pos - priv->crc_pos)),
+                n)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*! \endcond */
+
+bool ZipEntryFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    MB_PRIVATE(ZipEntryFile);
+
+    const ZipEntry *entry = priv->entry;
+
+    if (entry->method == static_cast<uint16_t>(ZipMethod::Stored)) {
+        size_t n;
+
+        if (!on_read_at(priv->pos, buf, size, n)) {
+            return false;
+        }
+
+        // Only accumulate the CRC32 while reading sequentially
+        if (priv->crc_pos == priv->pos && n > 0) {
+            priv->crc = crc32(priv->crc, static_cast<const Bytef *>(buf),
+                              static_cast<uInt>(n));
+            priv->crc_pos += n;
+
+            if (priv->crc_pos == entry->uncompressed_size
+                    && !check_crc(*this, priv)) {
+                return false;
+            }
+        }
+
+        priv->pos += n;
+        bytes_read = n;
+        return true;
+    }
+
+    if (!sync_stream(*this, priv)) {
+        return false;
+    }
+
+    if (priv->crc_pos < priv->pos) {
+        // Past the end of the data
+        bytes_read = 0;
+        return true;
+    }
+
+    if (!inflate_data(*this, priv, buf, size, bytes_read)) {
+        return false;
+    }
+
+    priv->pos += bytes_read;
+    return true;
+}
+
+bool ZipEntryFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    MB_PRIVATE(ZipEntryFile);
+
+    uint64_t base;
+
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = priv->pos;
+        break;
+    case SEEK_END:
+        base = priv->entry->uncompressed_size;
+        break;
+    default:
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid whence argument: %d", whence);
+        return false;
+    }
+
+    if ((offset < 0 && static_cast<uint64_t>(-offset) > base)
+            || (offset > 0 && static_cast<uint64_t>(offset)
+                    > INT64_MAX - base)) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Invalid offset %" PRId64 " for position %" PRIu64,
+                  offset, base);
+        return false;
+    }
+
+    // Deflated entries catch up lazily on the next read, so seeking to the end
+    // to query the size is free
+    new_offset = priv->pos = base + offset;
+    return true;
+}
+
+bool ZipEntryFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                              size_t &bytes_read)
+{
+    MB_PRIVATE(ZipEntryFile);
+
+    const ZipEntry *entry = priv->entry;
+
+    if (entry->method != static_cast<uint16_t>(ZipMethod::Stored)) {
+        return File::on_read_at(offset, buf, size, bytes_read);
+    }
+
+    size_t to_read = 0;
+    if (offset < entry->uncompressed_size) {
+        to_read = static_cast<size_t>(std::min<uint64_t>(
+                entry->uncompressed_size - offset, size));
+    }
+
+    std::error_code ec;
+    if (to_read > 0 && !read_raw(priv->archive, priv->data_offset + offset,
+                                 buf, to_read, ec)) {
+        set_error(ec, "%s: Failed to read data", entry->name.c_str());
+        return false;
+    }
+
+    bytes_read = to_read;
+    return true;
+}
+
+bool ZipEntryFile::on_map_range(uint64_t offset, size_t size,
+                                const void *&data, size_t &data_size)
+{
+    MB_PRIVATE(ZipEntryFile);
+
+    const ZipEntry *entry = priv->entry;
+
+    if (entry->method != static_cast<uint16_t>(ZipMethod::Stored)
+            || !priv->archive->map) {
+        set_error(make_error_code(FileError::UnsupportedMap),
+                  "%s: Only stored entries of mapped archives can be mapped",
+                  entry->name.c_str());
+        return false;
+    }
+
+    size_t available = 0;
+    if (offset < entry->uncompressed_size) {
+        available = static_cast<size_t>(std::min<uint64_t>(
+                entry->uncompressed_size - offset, size));
+    }
+
+    data = static_cast<const char *>(priv->archive->map) + priv->data_offset
+            + (available ? offset : 0);
+    data_size = available;
+    return true;
+}
+
+}
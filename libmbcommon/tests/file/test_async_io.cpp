@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mbcommon/file/async_io.h"
+#include "mbcommon/file/fd.h"
+#include "mbcommon/file/memory.h"
+
+struct Completion
+{
+    std::error_code ec;
+    size_t bytes = 0;
+    unsigned int count = 0;
+};
+
+static void completion_cb(void *userdata, std::error_code ec, size_t bytes)
+{
+    auto *c = static_cast<Completion *>(userdata);
+    c->ec = ec;
+    c->bytes = bytes;
+    ++c->count;
+}
+
+struct FileAsyncIoTest : testing::Test
+{
+    char _path[32];
+    int _fd = -1;
+
+    virtual void SetUp() override
+    {
+        strcpy(_path, "/tmp/mbcommon-XXXXXX");
+        _fd = mkstemp(_path);
+        ASSERT_GE(_fd, 0);
+    }
+
+    virtual void TearDown() override
+    {
+        if (_fd >= 0) {
+            close(_fd);
+            unlink(_path);
+        }
+    }
+
+    // Write blocks out of order and read them back with a small queue so that
+    // the queue-full path is exercised
+    void test_round_trip(mb::File &file, mb::AsyncIoBackend backend)
+    {
+        constexpr size_t block_size = 64 * 1024;
+        constexpr size_t n_blocks = 8;
+
+        mb::AsyncIo aio;
+        ASSERT_TRUE(aio.open(file, 2, backend));
+        ASSERT_TRUE(aio.is_open());
+
+        std::vector<char> data(block_size * n_blocks);
+        for (size_t i = 0; i < data.size(); ++i) {
+            data[i] = static_cast<char>(i * 7 % 253);
+        }
+
+        std::vector<Completion> done(n_blocks);
+
+        for (size_t i = 0; i < n_blocks; ++i) {
+            size_t block = (i * 3) % n_blocks;
+            ASSERT_TRUE(aio.submit_write(block * block_size,
+                                         data.data() + block * block_size,
+                                         block_size, &completion_cb,
+                                         &done[block]));
+            ASSERT_LE(aio.in_flight(), 2u);
+        }
+        ASSERT_TRUE(aio.drain());
+        ASSERT_EQ(aio.in_flight(), 0u);
+
+        for (auto const &c : done) {
+            ASSERT_EQ(c.count, 1u);
+            ASSERT_FALSE(c.ec);
+            ASSERT_EQ(c.bytes, block_size);
+        }
+
+        std::vector<char> result(data.size());
+        done.assign(n_blocks, Completion());
+
+        for (size_t i = 0; i < n_blocks; ++i) {
+            ASSERT_TRUE(aio.submit_read(i * block_size,
+                                        result.data() + i * block_size,
+                                        block_size, &completion_cb,
+                                        &done[i]));
+        }
+        ASSERT_TRUE(aio.drain());
+
+        for (auto const &c : done) {
+            ASSERT_EQ(c.count, 1u);
+            ASSERT_FALSE(c.ec);
+            ASSERT_EQ(c.bytes, block_size);
+        }
+        ASSERT_EQ(result, data);
+
+        // Reads are only short at EOF
+        Completion eof;
+        ASSERT_TRUE(aio.submit_read(data.size() - 10, result.data(), 100,
+                                    &completion_cb, &eof));
+        ASSERT_TRUE(aio.close());
+        ASSERT_FALSE(aio.is_open());
+        ASSERT_EQ(eof.count, 1u);
+        ASSERT_FALSE(eof.ec);
+        ASSERT_EQ(eof.bytes, 10u);
+    }
+};
+
+TEST_F(FileAsyncIoTest, OpenWithZeroQueueDepthFails)
+{
+    mb::FdFile file(_fd, false);
+    ASSERT_TRUE(file.is_open());
+
+    mb::AsyncIo aio;
+    ASSERT_FALSE(aio.open(file, 0));
+    ASSERT_EQ(aio.error(), mb::FileError::ArgumentOutOfRange);
+}
+
+TEST_F(FileAsyncIoTest, SubmitWhenClosedFails)
+{
+    mb::AsyncIo aio;
+    char c;
+    ASSERT_FALSE(aio.submit_read(0, &c, 1, nullptr, nullptr));
+    ASSERT_EQ(aio.error(), mb::FileError::InvalidState);
+}
+
+TEST_F(FileAsyncIoTest, RoundTripDefaultEngine)
+{
+    mb::FdFile file(_fd, false);
+    ASSERT_TRUE(file.is_open());
+
+    // io_uring may not be available in the test environment
+    test_round_trip(file, mb::AsyncIoBackend::IoUring);
+}
+
+TEST_F(FileAsyncIoTest, RoundTripThreadPool)
+{
+    mb::FdFile file(_fd, false);
+    ASSERT_TRUE(file.is_open());
+
+    test_round_trip(file, mb::AsyncIoBackend::ThreadPool);
+}
+
+TEST_F(FileAsyncIoTest, RoundTripSynchronous)
+{
+    mb::FdFile file(_fd, false);
+    ASSERT_TRUE(file.is_open());
+
+    test_round_trip(file, mb::AsyncIoBackend::Synchronous);
+}
+
+TEST_F(FileAsyncIoTest, FileWithoutFdUsesSynchronousEngine)
+{
+    void *buf = nullptr;
+    size_t size = 0;
+
+    mb::MemoryFile file(&buf, &size);
+    ASSERT_TRUE(file.is_open());
+
+    mb::AsyncIo aio;
+    ASSERT_TRUE(aio.open(file, 4));
+    ASSERT_EQ(aio.backend(), mb::AsyncIoBackend::Synchronous);
+
+    Completion c;
+    ASSERT_TRUE(aio.submit_write(0, "hello", 5, &completion_cb, &c));
+    // Nothing is invoked until completions are reaped
+    ASSERT_EQ(c.count, 0u);
+
+    size_t n;
+    ASSERT_TRUE(aio.poll(n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(c.count, 1u);
+    ASSERT_EQ(c.bytes, 5u);
+    ASSERT_EQ(size, 5u);
+    ASSERT_EQ(memcmp(buf, "hello", 5), 0);
+
+    ASSERT_TRUE(aio.close());
+    ASSERT_TRUE(file.close());
+    free(buf);
+}
+
+TEST_F(FileAsyncIoTest, ErrorIsReportedInCompletion)
+{
+    int ro_fd = open(_path, O_RDONLY);
+    ASSERT_GE(ro_fd, 0);
+
+    mb::FdFile file(ro_fd, true);
+    ASSERT_TRUE(file.is_open());
+
+    for (auto backend : { mb::AsyncIoBackend::IoUring,
+                          mb::AsyncIoBackend::ThreadPool }) {
+        mb::AsyncIo aio;
+        ASSERT_TRUE(aio.open(file, 1, backend));
+
+        Completion c;
+        ASSERT_TRUE(aio.submit_write(0, "x", 1, &completion_cb, &c));
+        ASSERT_TRUE(aio.drain());
+        ASSERT_EQ(c.count, 1u);
+        ASSERT_EQ(c.ec, std::errc::bad_file_descriptor);
+    }
+}
+
+TEST_F(FileAsyncIoTest, WaitReapsAtLeastOneCompletion)
+{
+    mb::FdFile file(_fd, false);
+    ASSERT_TRUE(file.is_open());
+
+    for (auto backend : { mb::AsyncIoBackend::IoUring,
+                          mb::AsyncIoBackend::ThreadPool,
+                          mb::AsyncIoBackend::Synchronous }) {
+        mb::AsyncIo aio;
+        ASSERT_TRUE(aio.open(file, 4, backend));
+
+        size_t n;
+
+        // Nothing in flight, so this must not block
+        ASSERT_TRUE(aio.wait(n));
+        ASSERT_EQ(n, 0u);
+
+        Completion c[2];
+        ASSERT_TRUE(aio.submit_write(0, "ab", 2, &completion_cb, &c[0]));
+        ASSERT_TRUE(aio.submit_write(2, "cd", 2, &completion_cb, &c[1]));
+
+        size_t total = 0;
+        while (aio.in_flight() > 0) {
+            ASSERT_TRUE(aio.wait(n));
+            ASSERT_GE(n, 1u);
+            total += n;
+        }
+        ASSERT_EQ(total, 2u);
+        ASSERT_EQ(c[0].count, 1u);
+        ASSERT_EQ(c[1].count, 1u);
+        ASSERT_TRUE(aio.close());
+    }
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+
+#include "mbcommon/file/buffered.h"
+
+#include "mock_test_file.h"
+
+struct FileBufferedTest : testing::Test
+{
+    TestFileCounters _counters;
+    TestFile _file{&_counters};
+
+    virtual void SetUp() override
+    {
+        ASSERT_TRUE(_file.open());
+    }
+};
+
+TEST_F(FileBufferedTest, OpenFailsWithZeroBufferSize)
+{
+    mb::BufferedFile file(&_file, 0);
+    ASSERT_FALSE(file.is_open());
+    ASSERT_EQ(file.error(), mb::FileError::ArgumentOutOfRange);
+}
+
+TEST_F(FileBufferedTest, OpenFailsIfUnderlyingFileIsClosed)
+{
+    TestFile closed;
+    mb::BufferedFile file(&closed);
+    ASSERT_FALSE(file.is_open());
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+}
+
+TEST_F(FileBufferedTest, SmallReadsAreCoalesced)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[4];
+    size_t n;
+
+    for (int i = 0; i < 16; ++i) {
+        ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+        ASSERT_EQ(n, sizeof(buf));
+        ASSERT_EQ(buf[0], 'a' + (i * 4) % 26);
+    }
+    ASSERT_EQ(_counters.n_read, 1u);
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(buf));
+    ASSERT_EQ(_counters.n_read, 2u);
+}
+
+TEST_F(FileBufferedTest, LargeReadsBypassBuffer)
+{
+    mb::BufferedFile file(&_file, 16);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[32];
+    size_t n;
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(buf));
+    ASSERT_EQ(memcmp(buf, _file._buf.data(), sizeof(buf)), 0);
+    ASSERT_EQ(_counters.n_read, 1u);
+}
+
+TEST_F(FileBufferedTest, ReadReachesEOF)
+{
+    mb::BufferedFile file(&_file, 100);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.seek(-10, SEEK_END, nullptr));
+
+    char buf[20];
+    size_t n;
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 10u);
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 0u);
+}
+
+TEST_F(FileBufferedTest, SeekWithinReadBuffer)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    uint64_t offset;
+
+    ASSERT_TRUE(file.read(&c, 1, n));
+    unsigned int n_seek = _counters.n_seek;
+
+    // Tell
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 1u);
+
+    // Forwards and backwards within the buffer
+    ASSERT_TRUE(file.seek(30, SEEK_SET, &offset));
+    ASSERT_EQ(offset, 30u);
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(c, 'a' + 30 % 26);
+    ASSERT_TRUE(file.seek(-31, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 0u);
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(c, 'a');
+
+    ASSERT_EQ(_counters.n_seek, n_seek);
+    ASSERT_EQ(_counters.n_read, 1u);
+
+    // Outside of the buffer
+    ASSERT_TRUE(file.seek(100, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 101u);
+    ASSERT_EQ(_file._position, 101u);
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(c, 'a' + 101 % 26);
+    ASSERT_EQ(_counters.n_read, 2u);
+}
+
+TEST_F(FileBufferedTest, SmallWritesAreCoalesced)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+
+    for (int i = 0; i < 16; ++i) {
+        ASSERT_TRUE(file.write("0123", 4, n));
+        ASSERT_EQ(n, 4u);
+    }
+    ASSERT_EQ(_counters.n_write, 0u);
+
+    ASSERT_TRUE(file.write("0123", 4, n));
+    ASSERT_EQ(_counters.n_write, 1u);
+    ASSERT_EQ(_file._position, 64u);
+
+    ASSERT_TRUE(file.flush());
+    ASSERT_EQ(_counters.n_write, 2u);
+    ASSERT_EQ(_file._position, 68u);
+    ASSERT_EQ(memcmp(_file._buf.data() + 60, "01230123", 8), 0);
+}
+
+TEST_F(FileBufferedTest, WriteAfterReadRewindsUnderlyingFile)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[4];
+    size_t n;
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(_file._position, 64u);
+
+    ASSERT_TRUE(file.write("xyz", 3, n));
+    ASSERT_EQ(_file._position, 4u);
+
+    ASSERT_TRUE(file.read(buf, 1, n));
+    ASSERT_EQ(_file._position, 71u);
+    ASSERT_EQ(memcmp(_file._buf.data() + 4, "xyz", 3), 0);
+    ASSERT_EQ(buf[0], 'h');
+}
+
+TEST_F(FileBufferedTest, CloseFlushesAndRestoresPosition)
+{
+    size_t n;
+
+    {
+        mb::BufferedFile file(&_file, 64);
+        ASSERT_TRUE(file.is_open());
+
+        ASSERT_TRUE(file.write("xyz", 3, n));
+        ASSERT_EQ(_counters.n_write, 0u);
+    }
+
+    ASSERT_EQ(_counters.n_write, 1u);
+    ASSERT_EQ(memcmp(_file._buf.data(), "xyz", 3), 0);
+
+    {
+        mb::BufferedFile file(&_file, 64);
+        ASSERT_TRUE(file.is_open());
+
+        char c;
+        ASSERT_TRUE(file.read(&c, 1, n));
+        ASSERT_EQ(c, 'd');
+        ASSERT_EQ(_file._position, 67u);
+
+        ASSERT_TRUE(file.close());
+        ASSERT_EQ(_file._position, 4u);
+    }
+
+    // Underlying file should not be closed
+    ASSERT_TRUE(_file.is_open());
+}
+
+TEST_F(FileBufferedTest, TruncateFlushesBuffer)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+
+    ASSERT_TRUE(file.seek(0, SEEK_END, nullptr));
+    ASSERT_TRUE(file.write("xyz", 3, n));
+    ASSERT_TRUE(file.truncate(INITIAL_BUF_SIZE + 2));
+    ASSERT_EQ(_file._buf.size(), INITIAL_BUF_SIZE + 2);
+    ASSERT_EQ(memcmp(_file._buf.data() + INITIAL_BUF_SIZE, "xy", 2), 0);
+}
+
+TEST_F(FileBufferedTest, ReadAtSeesBufferedWrites)
+{
+    mb::BufferedFile file(&_file, 64);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[3];
+    size_t n;
+    uint64_t offset;
+
+    ASSERT_TRUE(file.write("xyz", 3, n));
+    ASSERT_TRUE(file.read_at(0, buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(buf));
+    ASSERT_EQ(memcmp(buf, "xyz", 3), 0);
+
+    // Position is unchanged
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 3u);
+}
@@ -43,6 +43,16 @@ struct MockFdFileFuncs : public mb::FdFileFuncs
     MOCK_METHOD1(fn_close, int(int fd));
     MOCK_METHOD2(fn_ftruncate64, int(int fd, off_t length));
     MOCK_METHOD3(fn_lseek64, off64_t(int fd, off64_t offset, int whence));
+#ifndef _WIN32
+    MOCK_METHOD4(fn_pread64, ssize_t(int fd, void *buf, size_t count,
+                                     off64_t offset));
+    MOCK_METHOD4(fn_pwrite64, ssize_t(int fd, const void *buf, size_t count,
+                                      off64_t offset));
+    MOCK_METHOD3(fn_readv, ssize_t(int fd, const struct iovec *iov,
+                                   int iovcnt));
+    MOCK_METHOD3(fn_writev, ssize_t(int fd, const struct iovec *iov,
+                                    int iovcnt));
+#endif
     MOCK_METHOD3(fn_read, ssize_t(int fd, void *buf, size_t count));
     MOCK_METHOD3(fn_write, ssize_t(int fd, const void *buf, size_t count));
 
@@ -68,6 +78,18 @@ struct MockFdFileFuncs : public mb::FdFileFuncs
                 .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
         ON_CALL(*this, fn_lseek64(testing::_, testing::_, testing::_))
                 .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+#ifndef _WIN32
+        ON_CALL(*this, fn_pread64(testing::_, testing::_, testing::_,
+                                  testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_pwrite64(testing::_, testing::_, testing::_,
+                                   testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_readv(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_writev(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+#endif
         ON_CALL(*this, fn_read(testing::_, testing::_, testing::_))
                 .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
         ON_CALL(*this, fn_write(testing::_, testing::_, testing::_))
@@ -550,3 +572,180 @@ TEST_F(FileFdTest, TruncateFailed)
     ASSERT_FALSE(file.truncate(1024));
     ASSERT_EQ(file.error(), std::errc::io_error);
 }
+
+#ifndef _WIN32
+TEST_F(FileFdTest, ReadAtSuccess)
+{
+    _funcs.report_as_regular_file();
+
+    // Ensure that pread is used instead of seek + read
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, 1, 1024))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+    EXPECT_CALL(_funcs, fn_lseek64(testing::_, testing::_, testing::_))
+            .Times(0);
+    EXPECT_CALL(_funcs, fn_read(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read_at(1024, &c, 1, n));
+    ASSERT_EQ(n, 1u);
+}
+
+TEST_F(FileFdTest, ReadAtFailure)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, testing::_,
+                                   testing::_))
+            .Times(1);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(0, &c, 1, n));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileFdTest, ReadAtOutOfRange)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, testing::_,
+                                   testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(UINT64_MAX, &c, 1, n));
+    ASSERT_EQ(file.error(), mb::FileError::ArgumentOutOfRange);
+}
+
+TEST_F(FileFdTest, WriteAtSuccess)
+{
+    _funcs.report_as_regular_file();
+
+    // Ensure that pwrite is used instead of seek + write
+    EXPECT_CALL(_funcs, fn_pwrite64(testing::_, testing::_, 1, 1024))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+    EXPECT_CALL(_funcs, fn_lseek64(testing::_, testing::_, testing::_))
+            .Times(0);
+    EXPECT_CALL(_funcs, fn_write(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(file.write_at(1024, "x", 1, n));
+    ASSERT_EQ(n, 1u);
+}
+
+TEST_F(FileFdTest, WriteAtFailure)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_pwrite64(testing::_, testing::_, testing::_,
+                                    testing::_))
+            .Times(1);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_FALSE(file.write_at(0, "x", 1, n));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileFdTest, ReadvSuccess)
+{
+    _funcs.report_as_regular_file();
+
+    // Ensure that a single readv call is made
+    EXPECT_CALL(_funcs, fn_readv(testing::_, testing::_, 2))
+            .Times(1)
+            .WillOnce(testing::Return(3));
+    EXPECT_CALL(_funcs, fn_read(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    char buf1[2];
+    char buf2[2];
+    mb::FileIoVec iov[] = {
+        { buf1, sizeof(buf1) },
+        { buf2, sizeof(buf2) },
+    };
+
+    size_t n;
+    ASSERT_TRUE(file.readv(iov, 2, n));
+    ASSERT_EQ(n, 3u);
+}
+
+TEST_F(FileFdTest, WritevSuccess)
+{
+    _funcs.report_as_regular_file();
+
+    // Ensure that a single writev call is made
+    EXPECT_CALL(_funcs, fn_writev(testing::_, testing::_, 3))
+            .Times(1)
+            .WillOnce(testing::Return(6));
+    EXPECT_CALL(_funcs, fn_write(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    mb::FileConstIoVec iov[] = {
+        { "ab", 2 },
+        { "cd", 2 },
+        { "ef", 2 },
+    };
+
+    size_t n;
+    ASSERT_TRUE(file.writev(iov, 3, n));
+    ASSERT_EQ(n, 6u);
+}
+
+TEST_F(FileFdTest, WritevFailure)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_writev(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    TestableFdFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+
+    mb::FileConstIoVec iov[] = {
+        { "ab", 2 },
+    };
+
+    size_t n;
+    ASSERT_FALSE(file.writev(iov, 1, n));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+#endif
+
+TEST_F(FileFdTest, NativeFd)
+{
+    _funcs.report_as_regular_file();
+
+    TestableFdFile file(&_funcs, 10, true);
+    ASSERT_TRUE(file.is_open());
+
+    int fd;
+    ASSERT_TRUE(file.native_fd(fd));
+    ASSERT_EQ(fd, 10);
+}
@@ -20,6 +20,9 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <string>
+
+#include <cstring>
 
 #include "mbcommon/file.h"
 #include "mbcommon/file/memory.h"
@@ -104,6 +107,59 @@ TEST(FileStaticMemoryTest, ReadTooLarge)
     ASSERT_EQ(out[0], 'x');
 }
 
+TEST(FileStaticMemoryTest, ReadAtInBounds)
+{
+    constexpr char in[] = "abc";
+    constexpr size_t in_size = 3;
+    char out[2];
+    size_t out_size;
+    uint64_t pos;
+
+    mb::MemoryFile file(in, in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.read_at(1, out, sizeof(out), out_size));
+    ASSERT_EQ(out_size, 2u);
+    ASSERT_EQ(out[0], 'b');
+    ASSERT_EQ(out[1], 'c');
+
+    // File position should not change
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, 0u);
+}
+
+TEST(FileStaticMemoryTest, ReadAtOutOfBounds)
+{
+    constexpr char in[] = "x";
+    constexpr size_t in_size = 1;
+    char out[1];
+    size_t out_size;
+
+    mb::MemoryFile file(in, in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.read_at(10, out, sizeof(out), out_size));
+    ASSERT_EQ(out_size, 0u);
+}
+
+TEST(FileStaticMemoryTest, MapRange)
+{
+    constexpr char in[] = "abc";
+    constexpr size_t in_size = 3;
+    const void *data;
+    size_t data_size;
+
+    mb::MemoryFile file(in, in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.map_range(1, 10, data, data_size));
+    ASSERT_EQ(data, in + 1);
+    ASSERT_EQ(data_size, 2u);
+
+    ASSERT_TRUE(file.map_range(3, 1, data, data_size));
+    ASSERT_EQ(data_size, 0u);
+}
+
 TEST(FileStaticMemoryTest, WriteInBounds)
 {
     constexpr char in[] = "x";
@@ -411,6 +467,30 @@ TEST(FileDynamicMemoryTest, WriteTooLarge)
     free(in);
 }
 
+TEST(FileDynamicMemoryTest, WriteAtOutOfBounds)
+{
+    void *in = strdup("x");
+    size_t in_size = 1;
+    size_t n;
+    uint64_t pos;
+
+    ASSERT_NE(in, nullptr);
+
+    mb::MemoryFile file(&in, &in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.write_at(2, "y", 1, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(in_size, 3u);
+    ASSERT_EQ(memcmp(in, "x\0y", 3), 0);
+
+    // File position should not change
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, 0u);
+
+    free(in);
+}
+
 TEST(FileDynamicMemoryTest, SeekNormal)
 {
     void *in = strdup("abcdefghijklmnopqrstuvwxyz");
@@ -515,3 +595,210 @@ TEST(FileDynamicMemoryTest, TruncateFile)
 
     free(in);
 }
+
+TEST(FileDynamicMemoryTest, TruncateShrinkThenGrowZeroesData)
+{
+    void *in = strdup("xyz");
+    size_t in_size = 3;
+
+    mb::MemoryFile file(&in, &in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.truncate(1));
+    ASSERT_EQ(in_size, 1u);
+    ASSERT_TRUE(file.truncate(3));
+    ASSERT_EQ(in_size, 3u);
+    ASSERT_EQ(memcmp(in, "x\0\0", 3), 0);
+
+    free(in);
+}
+
+TEST(FileDynamicMemoryTest, WriteGrowsGeometrically)
+{
+    void *in = nullptr;
+    size_t in_size = 0;
+    void *prev = nullptr;
+    int reallocs = 0;
+    size_t n;
+
+    mb::MemoryFile file(&in, &in_size);
+    ASSERT_TRUE(file.is_open());
+
+    for (int i = 0; i < 100000; ++i) {
+        ASSERT_TRUE(file.write("x", 1, n));
+        ASSERT_EQ(n, 1u);
+
+        if (in != prev) {
+            ++reallocs;
+            prev = in;
+        }
+    }
+
+    ASSERT_EQ(in_size, 100000u);
+    ASSERT_LE(reallocs, 10);
+
+    free(in);
+}
+
+TEST(FileDynamicMemoryTest, ReserveAvoidsReallocation)
+{
+    void *in = nullptr;
+    size_t in_size = 0;
+    std::string data(1024, 'x');
+    size_t n;
+
+    mb::MemoryFile file(&in, &in_size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.reserve(64 * data.size()));
+    ASSERT_NE(in, nullptr);
+    ASSERT_EQ(in_size, 0u);
+
+    void *reserved = in;
+
+    for (int i = 0; i < 64; ++i) {
+        ASSERT_TRUE(file.write(data.data(), data.size(), n));
+        ASSERT_EQ(n, data.size());
+    }
+
+    ASSERT_EQ(in, reserved);
+    ASSERT_EQ(in_size, 64 * data.size());
+
+    free(in);
+}
+
+TEST(FileDynamicMemoryTest, ReleaseOwnedBuffer)
+{
+    void *buf;
+    size_t size;
+    size_t n;
+    uint64_t pos;
+
+    mb::MemoryFile file(nullptr, nullptr);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.write("abc", 3, n));
+    ASSERT_EQ(n, 3u);
+
+    ASSERT_TRUE(file.release(buf, size));
+    ASSERT_EQ(size, 3u);
+    ASSERT_EQ(memcmp(buf, "abc", 3), 0);
+
+    // File is empty after releasing the buffer
+    ASSERT_TRUE(file.seek(0, SEEK_END, &pos));
+    ASSERT_EQ(pos, 0u);
+
+    ASSERT_TRUE(file.close());
+
+    free(buf);
+}
+
+TEST(FileDynamicMemoryTest, ReleaseResetsCallerPointers)
+{
+    void *in = strdup("x");
+    size_t in_size = 1;
+    void *buf;
+    size_t size;
+
+    mb::MemoryFile file(&in, &in_size);
+    ASSERT_TRUE(file.is_open());
+
+    void *orig = in;
+
+    ASSERT_TRUE(file.release(buf, size));
+    ASSERT_EQ(buf, orig);
+    ASSERT_EQ(size, 1u);
+    ASSERT_EQ(in, nullptr);
+    ASSERT_EQ(in_size, 0u);
+
+    free(buf);
+}
+
+TEST(FileStaticMemoryTest, CheckReleaseUnsupported)
+{
+    constexpr char in[] = "x";
+    void *buf;
+    size_t size;
+
+    mb::MemoryFile file(in, sizeof(in) - 1);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_FALSE(file.release(buf, size));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidState);
+}
+
+TEST(FileArenaMemoryTest, WriteWithinCapacity)
+{
+    char arena[8];
+    size_t size = 0;
+    size_t n;
+
+    mb::MemoryFile file(arena, sizeof(arena), &size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.write("abc", 3, n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(size, 3u);
+    ASSERT_EQ(memcmp(arena, "abc", 3), 0);
+
+    // Gaps are zero-initialized
+    ASSERT_TRUE(file.write_at(5, "d", 1, n));
+    ASSERT_EQ(n, 1u);
+    ASSERT_EQ(size, 6u);
+    ASSERT_EQ(memcmp(arena, "abc\0\0d", 6), 0);
+}
+
+TEST(FileArenaMemoryTest, WritePastCapacityIsTruncated)
+{
+    char arena[4];
+    size_t size = 0;
+    size_t n;
+
+    mb::MemoryFile file(arena, sizeof(arena), &size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.write("abcdef", 6, n));
+    ASSERT_EQ(n, 4u);
+    ASSERT_EQ(size, 4u);
+
+    ASSERT_TRUE(file.write("g", 1, n));
+    ASSERT_EQ(n, 0u);
+    ASSERT_EQ(size, 4u);
+}
+
+TEST(FileArenaMemoryTest, ReadExistingData)
+{
+    char arena[8] = "abc";
+    size_t size = 3;
+    char out[8];
+    size_t n;
+
+    mb::MemoryFile file(arena, sizeof(arena), &size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.read(out, sizeof(out), n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(memcmp(out, "abc", 3), 0);
+}
+
+TEST(FileArenaMemoryTest, TruncateWithinCapacity)
+{
+    char arena[8] = "abcdefg";
+    size_t size = 7;
+
+    mb::MemoryFile file(arena, sizeof(arena), &size);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(file.truncate(2));
+    ASSERT_EQ(size, 2u);
+    ASSERT_TRUE(file.truncate(4));
+    ASSERT_EQ(size, 4u);
+    ASSERT_EQ(memcmp(arena, "ab\0\0", 4), 0);
+
+    ASSERT_FALSE(file.truncate(9));
+    ASSERT_EQ(file.error(), mb::FileError::ArgumentOutOfRange);
+    ASSERT_EQ(size, 4u);
+
+    ASSERT_TRUE(file.reserve(8));
+    ASSERT_FALSE(file.reserve(9));
+}
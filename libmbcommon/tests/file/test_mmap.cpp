@@ -0,0 +1,377 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gmock/gmock.h>
+
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/mmap.h"
+#include "mbcommon/file/mmap_p.h"
+
+static constexpr long PAGE_SIZE_FOR_TESTS = 16;
+
+struct MockMmapFileFuncs : public mb::MmapFileFuncs
+{
+    // fcntl.h
+    MOCK_METHOD3(fn_open, int(const char *path, int flags, mode_t mode));
+
+    // sys/mman.h
+    MOCK_METHOD6(fn_mmap, void *(void *addr, size_t length, int prot,
+                                 int flags, int fd, off64_t offset));
+    MOCK_METHOD2(fn_munmap, int(void *addr, size_t length));
+
+    // sys/stat.h
+    MOCK_METHOD2(fn_fstat, int(int fildes, struct stat *buf));
+
+    // unistd.h
+    MOCK_METHOD1(fn_close, int(int fd));
+    MOCK_METHOD3(fn_lseek64, off64_t(int fd, off64_t offset, int whence));
+    MOCK_METHOD1(fn_sysconf, long(int name));
+
+    // Backing storage for the fake mapping
+    char _contents[64];
+    struct stat _sb_regfile{};
+
+    MockMmapFileFuncs()
+    {
+        for (size_t i = 0; i < sizeof(_contents); ++i) {
+            _contents[i] = static_cast<char>('a' + (i % 26));
+        }
+
+        _sb_regfile.st_mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
+        _sb_regfile.st_size = sizeof(_contents);
+
+        // Fail everything by default
+        ON_CALL(*this, fn_open(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_mmap(testing::_, testing::_, testing::_, testing::_,
+                               testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, MAP_FAILED));
+        ON_CALL(*this, fn_munmap(testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_fstat(testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_close(testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_lseek64(testing::_, testing::_, testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_sysconf(testing::_))
+                .WillByDefault(testing::Return(PAGE_SIZE_FOR_TESTS));
+    }
+
+    void report_as_regular_file()
+    {
+        ON_CALL(*this, fn_fstat(testing::_, testing::_))
+                .WillByDefault(testing::DoAll(
+                        testing::SetArgPointee<1>(_sb_regfile),
+                        testing::Return(0)));
+    }
+
+    void map_with_success()
+    {
+        ON_CALL(*this, fn_mmap(testing::_, testing::_, testing::_, testing::_,
+                               testing::_, testing::_))
+                .WillByDefault(testing::Invoke(
+                        this, &MockMmapFileFuncs::fake_mmap));
+        ON_CALL(*this, fn_munmap(testing::_, testing::_))
+                .WillByDefault(testing::Return(0));
+        ON_CALL(*this, fn_close(testing::_))
+                .WillByDefault(testing::Return(0));
+    }
+
+    void * fake_mmap(void *addr, size_t length, int prot, int flags, int fd,
+                     off64_t offset)
+    {
+        (void) addr;
+        (void) length;
+        (void) prot;
+        (void) flags;
+        (void) fd;
+        return _contents + offset;
+    }
+};
+
+class TestableMmapFilePrivate : public mb::MmapFilePrivate
+{
+public:
+    TestableMmapFilePrivate(mb::MmapFileFuncs *funcs)
+        : mb::MmapFilePrivate(funcs)
+    {
+    }
+};
+
+class TestableMmapFile : public mb::MmapFile
+{
+public:
+    MB_DECLARE_PRIVATE(TestableMmapFile)
+
+    TestableMmapFile(mb::MmapFileFuncs *funcs)
+        : mb::MmapFile(new TestableMmapFilePrivate(funcs))
+    {
+    }
+
+    TestableMmapFile(mb::MmapFileFuncs *funcs, int fd, bool owned)
+        : mb::MmapFile(new TestableMmapFilePrivate(funcs), fd, owned)
+    {
+    }
+
+    TestableMmapFile(mb::MmapFileFuncs *funcs, int fd, bool owned,
+                     uint64_t offset, uint64_t size)
+        : mb::MmapFile(new TestableMmapFilePrivate(funcs), fd, owned,
+                       offset, size)
+    {
+    }
+
+    ~TestableMmapFile()
+    {
+    }
+};
+
+struct FileMmapTest : testing::Test
+{
+    testing::NiceMock<MockMmapFileFuncs> _funcs;
+};
+
+TEST_F(FileMmapTest, OpenFilenameSuccess)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    EXPECT_CALL(_funcs, fn_open(testing::_, testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(3));
+    EXPECT_CALL(_funcs, fn_mmap(testing::_, sizeof(_funcs._contents),
+                                PROT_READ, MAP_PRIVATE, 3, 0))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_TRUE(file.open("x"));
+}
+
+TEST_F(FileMmapTest, OpenFilenameFailure)
+{
+    EXPECT_CALL(_funcs, fn_open(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs);
+    ASSERT_FALSE(file.open("x"));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileMmapTest, OpenDirectory)
+{
+    struct stat sb{};
+    sb.st_mode = S_IFDIR;
+
+    EXPECT_CALL(_funcs, fn_fstat(testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::DoAll(testing::SetArgPointee<1>(sb),
+                                     testing::Return(0)));
+    EXPECT_CALL(_funcs, fn_mmap(testing::_, testing::_, testing::_,
+                                testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_FALSE(file.is_open());
+    ASSERT_EQ(file.error(), std::errc::is_a_directory);
+}
+
+TEST_F(FileMmapTest, OpenMmapFailure)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_mmap(testing::_, testing::_, testing::_,
+                                testing::_, testing::_, testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_FALSE(file.is_open());
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FileMmapTest, OpenEmptyFile)
+{
+    struct stat sb = _funcs._sb_regfile;
+    sb.st_size = 0;
+
+    EXPECT_CALL(_funcs, fn_fstat(testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::DoAll(testing::SetArgPointee<1>(sb),
+                                     testing::Return(0)));
+    EXPECT_CALL(_funcs, fn_mmap(testing::_, testing::_, testing::_,
+                                testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read(&c, 1, n));
+    ASSERT_EQ(n, 0u);
+}
+
+TEST_F(FileMmapTest, OpenWindowUnaligned)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    // Offset 20 must be mapped starting from the page boundary at 16
+    EXPECT_CALL(_funcs, fn_mmap(testing::_, 4 + 10, PROT_READ, MAP_PRIVATE,
+                                0, 16))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs, 0, false, 20, 10);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[20];
+    size_t n;
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 10u);
+    ASSERT_EQ(memcmp(buf, _funcs._contents + 20, 10), 0);
+}
+
+TEST_F(FileMmapTest, OpenWindowOutOfRange)
+{
+    _funcs.report_as_regular_file();
+
+    EXPECT_CALL(_funcs, fn_mmap(testing::_, testing::_, testing::_,
+                                testing::_, testing::_, testing::_))
+            .Times(0);
+
+    TestableMmapFile file(&_funcs, 0, false, 60, 10);
+    ASSERT_FALSE(file.is_open());
+    ASSERT_EQ(file.error(), mb::FileError::ArgumentOutOfRange);
+}
+
+TEST_F(FileMmapTest, CloseUnownedFile)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    EXPECT_CALL(_funcs, fn_munmap(testing::_, testing::_))
+            .Times(1);
+    EXPECT_CALL(_funcs, fn_close(testing::_))
+            .Times(0);
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+    ASSERT_TRUE(file.close());
+}
+
+TEST_F(FileMmapTest, CloseOwnedFile)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    EXPECT_CALL(_funcs, fn_munmap(testing::_, testing::_))
+            .Times(1);
+    EXPECT_CALL(_funcs, fn_close(testing::_))
+            .Times(1);
+
+    TestableMmapFile file(&_funcs, 0, true);
+    ASSERT_TRUE(file.is_open());
+    ASSERT_TRUE(file.close());
+}
+
+TEST_F(FileMmapTest, ReadAndSeek)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[4];
+    size_t n;
+    uint64_t pos;
+
+    ASSERT_TRUE(file.seek(-4, SEEK_END, &pos));
+    ASSERT_EQ(pos, sizeof(_funcs._contents) - 4);
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 4u);
+    ASSERT_EQ(memcmp(buf, _funcs._contents + pos, 4), 0);
+
+    // EOF
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 0u);
+}
+
+TEST_F(FileMmapTest, ReadAt)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    char buf[4];
+    size_t n;
+    uint64_t pos;
+
+    ASSERT_TRUE(file.read_at(26, buf, sizeof(buf), n));
+    ASSERT_EQ(n, 4u);
+    ASSERT_EQ(memcmp(buf, "abcd", 4), 0);
+
+    // File position should not change
+    ASSERT_TRUE(file.seek(0, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, 0u);
+}
+
+TEST_F(FileMmapTest, MapRange)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    const void *data;
+    size_t data_size;
+
+    // Points into the mapping without copying
+    ASSERT_TRUE(file.map_range(10, 4, data, data_size));
+    ASSERT_EQ(data, _funcs._contents + 10);
+    ASSERT_EQ(data_size, 4u);
+
+    // Truncated at EOF
+    ASSERT_TRUE(file.map_range(60, 10, data, data_size));
+    ASSERT_EQ(data_size, 4u);
+
+    // Beyond EOF
+    ASSERT_TRUE(file.map_range(100, 10, data, data_size));
+    ASSERT_EQ(data_size, 0u);
+}
+
+TEST_F(FileMmapTest, WriteUnsupported)
+{
+    _funcs.report_as_regular_file();
+    _funcs.map_with_success();
+
+    TestableMmapFile file(&_funcs, 0, false);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_FALSE(file.write("x", 1, n));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedWrite);
+}
@@ -34,6 +34,7 @@ struct MockPosixFileFuncs : public mb::PosixFileFuncs
     // stdio.h
     MOCK_METHOD1(fn_fclose, int(FILE *stream));
     MOCK_METHOD1(fn_ferror, int(FILE *stream));
+    MOCK_METHOD1(fn_fflush, int(FILE *stream));
     MOCK_METHOD1(fn_fileno, int(FILE *stream));
 #ifdef _WIN32
     MOCK_METHOD2(fn_wfopen, FILE *(const wchar_t *filename,
@@ -50,6 +51,12 @@ struct MockPosixFileFuncs : public mb::PosixFileFuncs
 
     // unistd.h
     MOCK_METHOD2(fn_ftruncate64, int(int fd, off_t length));
+#ifndef _WIN32
+    MOCK_METHOD4(fn_pread64, ssize_t(int fd, void *buf, size_t count,
+                                     off64_t offset));
+    MOCK_METHOD4(fn_pwrite64, ssize_t(int fd, const void *buf, size_t count,
+                                      off64_t offset));
+#endif
 
     bool stream_error = false;
 
@@ -69,6 +76,8 @@ struct MockPosixFileFuncs : public mb::PosixFileFuncs
                 .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
         ON_CALL(*this, fn_ferror(testing::_))
                 .WillByDefault(testing::ReturnPointee(&stream_error));
+        ON_CALL(*this, fn_fflush(testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, EOF));
         ON_CALL(*this, fn_fileno(testing::_))
                 .WillByDefault(testing::Return(-1));
         ON_CALL(*this, fn_fread(testing::_, testing::_, testing::_, testing::_))
@@ -87,6 +96,14 @@ struct MockPosixFileFuncs : public mb::PosixFileFuncs
                         testing::SetErrnoAndReturn(EIO, 0)));
         ON_CALL(*this, fn_ftruncate64(testing::_, testing::_))
                 .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+#ifndef _WIN32
+        ON_CALL(*this, fn_pread64(testing::_, testing::_, testing::_,
+                                  testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+        ON_CALL(*this, fn_pwrite64(testing::_, testing::_, testing::_,
+                                   testing::_))
+                .WillByDefault(testing::SetErrnoAndReturn(EIO, -1));
+#endif
     }
 
     void set_ferror_fail()
@@ -673,3 +690,99 @@ TEST_F(FilePosixTest, TruncateFailed)
     ASSERT_FALSE(file.truncate(1024));
     ASSERT_EQ(file.error(), std::errc::io_error);
 }
+
+#ifndef _WIN32
+TEST_F(FilePosixTest, ReadAtSuccess)
+{
+    // Fail when opening to avoid fstat check
+    EXPECT_CALL(_funcs, fn_fileno(testing::_))
+            .Times(2)
+            .WillOnce(testing::Return(-1))
+            .WillOnce(testing::Return(0));
+    EXPECT_CALL(_funcs, fn_fflush(testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(0));
+    EXPECT_CALL(_funcs, fn_pread64(0, testing::_, 1, 1024))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+    EXPECT_CALL(_funcs, fn_fseeko(testing::_, testing::_, testing::_))
+            .Times(0);
+    EXPECT_CALL(_funcs, fn_fread(testing::_, testing::_, testing::_,
+                                 testing::_))
+            .Times(0);
+
+    TestablePosixFile file(&_funcs, g_fp, true);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_TRUE(file.read_at(1024, &c, 1, n));
+    ASSERT_EQ(n, 1u);
+}
+
+TEST_F(FilePosixTest, ReadAtFlushFailed)
+{
+    // Fail when opening to avoid fstat check
+    EXPECT_CALL(_funcs, fn_fileno(testing::_))
+            .Times(2)
+            .WillOnce(testing::Return(-1))
+            .WillOnce(testing::Return(0));
+    EXPECT_CALL(_funcs, fn_fflush(testing::_))
+            .Times(1);
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, testing::_,
+                                   testing::_))
+            .Times(0);
+
+    TestablePosixFile file(&_funcs, g_fp, true);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(0, &c, 1, n));
+    ASSERT_EQ(file.error(), std::errc::io_error);
+}
+
+TEST_F(FilePosixTest, ReadAtWithoutFdFallsBack)
+{
+    // No file descriptor, so the seek-based fallback is used, which fails
+    // because the file is not seekable
+    EXPECT_CALL(_funcs, fn_fileno(testing::_))
+            .Times(2);
+    EXPECT_CALL(_funcs, fn_pread64(testing::_, testing::_, testing::_,
+                                   testing::_))
+            .Times(0);
+
+    TestablePosixFile file(&_funcs, g_fp, true);
+    ASSERT_TRUE(file.is_open());
+
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(0, &c, 1, n));
+    ASSERT_EQ(file.error(), mb::FileError::UnsupportedSeek);
+}
+
+TEST_F(FilePosixTest, WriteAtSuccess)
+{
+    // Fail when opening to avoid fstat check
+    EXPECT_CALL(_funcs, fn_fileno(testing::_))
+            .Times(2)
+            .WillOnce(testing::Return(-1))
+            .WillOnce(testing::Return(0));
+    EXPECT_CALL(_funcs, fn_fflush(testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(0));
+    EXPECT_CALL(_funcs, fn_pwrite64(0, testing::_, 1, 1024))
+            .Times(1)
+            .WillOnce(testing::ReturnArg<2>());
+    EXPECT_CALL(_funcs, fn_fwrite(testing::_, testing::_, testing::_,
+                                  testing::_))
+            .Times(0);
+
+    TestablePosixFile file(&_funcs, g_fp, true);
+    ASSERT_TRUE(file.is_open());
+
+    size_t n;
+    ASSERT_TRUE(file.write_at(1024, "x", 1, n));
+    ASSERT_EQ(n, 1u);
+}
+#endif
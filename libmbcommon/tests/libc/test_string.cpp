@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include <cstring>
+
+#include "mbcommon/libc/string.h"
+
+static const void * naive_memmem(const void *haystack, size_t haystacklen,
+                                 const void *needle, size_t needlelen)
+{
+    auto h = static_cast<const unsigned char *>(haystack);
+
+    if (needlelen == 0) {
+        return haystack;
+    }
+    for (size_t i = 0; i + needlelen <= haystacklen; ++i) {
+        if (memcmp(h + i, needle, needlelen) == 0) {
+            return h + i;
+        }
+    }
+    return nullptr;
+}
+
+TEST(LibcStringTest, MemmemEmptyNeedle)
+{
+    const char haystack[] = "abc";
+    ASSERT_EQ(mb_memmem(haystack, 3, "", 0), haystack);
+    ASSERT_EQ(mb_memmem(haystack, 0, "", 0), haystack);
+}
+
+TEST(LibcStringTest, MemmemNeedleLongerThanHaystack)
+{
+    ASSERT_EQ(mb_memmem("abc", 3, "abcd", 4), nullptr);
+}
+
+TEST(LibcStringTest, MemmemFindsFirstOccurrence)
+{
+    const char haystack[] = "xxabcxxabcxx";
+    ASSERT_EQ(mb_memmem(haystack, sizeof(haystack) - 1, "abc", 3),
+              haystack + 2);
+    ASSERT_EQ(mb_memmem(haystack, sizeof(haystack) - 1, "b", 1),
+              haystack + 3);
+    ASSERT_EQ(mb_memmem(haystack, sizeof(haystack) - 1, "ac", 2), nullptr);
+}
+
+TEST(LibcStringTest, MemmemMatchesNaiveAtAllPositions)
+{
+    // Cover every needle size and position across the SIMD block boundaries
+    // and the scalar tail
+    for (size_t haystack_size : { 1, 15, 16, 17, 31, 32, 33, 64, 100, 257 }) {
+        std::vector<unsigned char> haystack(haystack_size, 'a');
+
+        for (size_t needle_size = 1; needle_size <= haystack_size
+                && needle_size <= 40; ++needle_size) {
+            std::string needle(needle_size, 'a');
+            needle.front() = 'x';
+            needle.back() = 'y';
+            if (needle_size == 1) {
+                needle[0] = 'z';
+            }
+
+            for (size_t pos = 0; pos + needle_size <= haystack_size; ++pos) {
+                std::fill(haystack.begin(), haystack.end(), 'a');
+                memcpy(haystack.data() + pos, needle.data(), needle_size);
+
+                auto expected = naive_memmem(haystack.data(), haystack.size(),
+                                             needle.data(), needle.size());
+                auto actual = mb_memmem(haystack.data(), haystack.size(),
+                                        needle.data(), needle.size());
+                ASSERT_EQ(actual, expected)
+                        << "haystack_size=" << haystack_size
+                        << ", needle_size=" << needle_size
+                        << ", pos=" << pos;
+            }
+        }
+    }
+}
+
+TEST(LibcStringTest, MemmemUnalignedHaystack)
+{
+    std::vector<unsigned char> buf(300);
+    for (size_t i = 0; i < buf.size(); ++i) {
+        buf[i] = static_cast<unsigned char>(i * 7);
+    }
+
+    for (size_t offset = 0; offset < 32; ++offset) {
+        const unsigned char *haystack = buf.data() + offset;
+        size_t haystack_size = buf.size() - offset;
+        const unsigned char *needle = buf.data() + 250;
+
+        ASSERT_EQ(mb_memmem(haystack, haystack_size, needle, 9),
+                  naive_memmem(haystack, haystack_size, needle, 9))
+                << "offset=" << offset;
+    }
+}
+
+TEST(LibcStringTest, MemmemManyFalsePositives)
+{
+    // Every position matches the first and last bytes, which forces the
+    // vectorized search to hand off to the fallback implementation
+    std::vector<unsigned char> haystack(10000);
+    for (size_t i = 0; i < haystack.size(); ++i) {
+        haystack[i] = (i % 2 == 0) ? 'a' : 'b';
+    }
+    const char needle[] = "ababababbba";
+    size_t needle_size = sizeof(needle) - 1;
+
+    ASSERT_EQ(mb_memmem(haystack.data(), haystack.size(), needle, needle_size),
+              nullptr);
+
+    memcpy(haystack.data() + 9000, needle, needle_size);
+    ASSERT_EQ(mb_memmem(haystack.data(), haystack.size(), needle, needle_size),
+              haystack.data() + 9000);
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include <cstdint>
+#include <cstring>
+
+#include "mbcommon/buffer_pool.h"
+
+using namespace mb;
+
+TEST(BufferPoolTest, BufferIsAligned)
+{
+    PooledBuffer buf(10000);
+    ASSERT_TRUE(buf);
+    ASSERT_EQ(buf.size(), 10000u);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(buf.data())
+            % buffer_pool_alignment(), 0u);
+
+    // Whole buffer must be writable
+    memset(buf.data(), 0xaa, buf.size());
+}
+
+TEST(BufferPoolTest, ReleasedBufferIsReused)
+{
+    void *ptr;
+
+    {
+        PooledBuffer buf(64 * 1024);
+        ASSERT_TRUE(buf);
+        ptr = buf.data();
+    }
+
+    // Same size class
+    PooledBuffer buf(60 * 1024);
+    ASSERT_TRUE(buf);
+    ASSERT_EQ(buf.data(), ptr);
+}
+
+TEST(BufferPoolTest, LargeBufferIsNotPooled)
+{
+    PooledBuffer buf(32 * 1024 * 1024);
+    ASSERT_TRUE(buf);
+    ASSERT_EQ(buf.size(), 32u * 1024 * 1024);
+    ASSERT_EQ(reinterpret_cast<uintptr_t>(buf.data())
+            % buffer_pool_alignment(), 0u);
+}
+
+TEST(BufferPoolTest, MoveTransfersOwnership)
+{
+    PooledBuffer a(4096);
+    void *ptr = a.data();
+
+    PooledBuffer b(std::move(a));
+    ASSERT_FALSE(a);
+    ASSERT_EQ(a.size(), 0u);
+    ASSERT_EQ(b.data(), ptr);
+
+    PooledBuffer c;
+    ASSERT_FALSE(c);
+    c = std::move(b);
+    ASSERT_FALSE(b);
+    ASSERT_EQ(c.data(), ptr);
+
+    c.reset();
+    ASSERT_FALSE(c);
+}
+
+TEST(BufferPoolTest, BuffersSurviveThreadExit)
+{
+    PooledBuffer buf;
+
+    // The thread's cache is flushed to the shared cache when it exits
+    std::thread([] {
+        PooledBuffer tmp(128 * 1024);
+        ASSERT_TRUE(tmp);
+    }).join();
+
+    buf = PooledBuffer(128 * 1024);
+    ASSERT_TRUE(buf);
+
+    buffer_pool_trim();
+}
+
+TEST(BufferPoolTest, IoBlockSizeIsRounded)
+{
+    size_t orig = io_block_size();
+    size_t alignment = buffer_pool_alignment();
+
+    set_io_block_size(alignment + 1);
+    ASSERT_EQ(io_block_size(), alignment * 2);
+
+    set_io_block_size(1024 * 1024 * 1024);
+    ASSERT_EQ(io_block_size(), 16u * 1024 * 1024);
+
+    set_io_block_size(0);
+    ASSERT_EQ(io_block_size(), 1024u * 1024);
+
+    set_io_block_size(orig);
+}
@@ -453,6 +453,161 @@ TEST(FileTest, SeekReturnFailure)
     ASSERT_EQ(file._priv_func()->state, mb::FileState::OPENED);
 }
 
+TEST(FileTest, ReadvFallbackStopsAtShortRead)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    // Third buffer is never reached because the second read is short
+    EXPECT_CALL(file, on_read(testing::_, testing::_, testing::_))
+            .Times(2);
+
+    // Open file
+    ASSERT_TRUE(file.open());
+    ASSERT_TRUE(file.seek(-6, SEEK_END, nullptr));
+
+    char buf1[4];
+    char buf2[4];
+    char buf3[4];
+    mb::FileIoVec iov[] = {
+        { buf1, sizeof(buf1) },
+        { buf2, sizeof(buf2) },
+        { buf3, sizeof(buf3) },
+    };
+
+    size_t n;
+    ASSERT_TRUE(file.readv(iov, 3, n));
+    ASSERT_EQ(n, 6u);
+    ASSERT_EQ(memcmp(buf1, file._buf.data() + file._buf.size() - 6, 4), 0);
+    ASSERT_EQ(memcmp(buf2, file._buf.data() + file._buf.size() - 2, 2), 0);
+}
+
+TEST(FileTest, WritevFallbackReportsPartialWrite)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_write(testing::_, testing::_, testing::_))
+            .Times(2)
+            .WillOnce(testing::DoDefault())
+            .WillOnce(testing::Return(false));
+
+    // Open file
+    ASSERT_TRUE(file.open());
+
+    mb::FileConstIoVec iov[] = {
+        { "foo", 3 },
+        { "bar", 3 },
+    };
+
+    // The bytes written before the failure are reported
+    size_t n;
+    ASSERT_TRUE(file.writev(iov, 2, n));
+    ASSERT_EQ(n, 3u);
+}
+
+TEST(FileTest, WritevFallbackFirstFailure)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_write(testing::_, testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(false));
+
+    // Open file
+    ASSERT_TRUE(file.open());
+
+    mb::FileConstIoVec iov[] = {
+        { "foo", 3 },
+    };
+
+    size_t n;
+    ASSERT_FALSE(file.writev(iov, 1, n));
+}
+
+TEST(FileTest, ReadAtFallbackRestoresPosition)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_seek(testing::_, testing::_, testing::_))
+            .Times(4);
+    EXPECT_CALL(file, on_read(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    // Open file
+    ASSERT_TRUE(file.open());
+    ASSERT_TRUE(file.seek(5, SEEK_SET, nullptr));
+
+    // Read from offset 10
+    char buf[10];
+    size_t n;
+    ASSERT_TRUE(file.read_at(10, buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(buf));
+    ASSERT_EQ(memcmp(buf, file._buf.data() + 10, sizeof(buf)), 0);
+
+    // Original position should be restored
+    ASSERT_EQ(file._position, 5u);
+}
+
+TEST(FileTest, ReadAtInWrongState)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_read(testing::_, testing::_, testing::_))
+            .Times(0);
+    EXPECT_CALL(file, on_seek(testing::_, testing::_, testing::_))
+            .Times(0);
+
+    // Read from file
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(0, &c, 1, n));
+    ASSERT_EQ(file._priv_func()->state, mb::FileState::NEW);
+    ASSERT_EQ(file._priv_func()->error_code, mb::FileError::InvalidState);
+    ASSERT_NE(file._priv_func()->error_string.find("read_at"), std::string::npos);
+}
+
+TEST(FileTest, ReadAtFallbackRestoreFailure)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    // Succeed for getting and setting the position, but fail when restoring it
+    EXPECT_CALL(file, on_seek(testing::_, testing::_, testing::_))
+            .Times(3)
+            .WillOnce(testing::DoDefault())
+            .WillOnce(testing::DoDefault())
+            .WillOnce(testing::Return(false));
+
+    // Open file
+    ASSERT_TRUE(file.open());
+
+    // Read from file
+    char c;
+    size_t n;
+    ASSERT_FALSE(file.read_at(10, &c, 1, n));
+    ASSERT_EQ(file._priv_func()->state, mb::FileState::FATAL);
+}
+
+TEST(FileTest, WriteAtFallbackRestoresPosition)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_seek(testing::_, testing::_, testing::_))
+            .Times(3);
+    EXPECT_CALL(file, on_write(testing::_, testing::_, testing::_))
+            .Times(1);
+
+    // Open file
+    ASSERT_TRUE(file.open());
+
+    // Write to offset 10
+    size_t n;
+    ASSERT_TRUE(file.write_at(10, "foobar", 6, n));
+    ASSERT_EQ(n, 6u);
+    ASSERT_EQ(memcmp(file._buf.data() + 10, "foobar", 6), 0);
+
+    // Original position should be restored
+    ASSERT_EQ(file._position, 0u);
+}
+
 TEST(FileTest, TruncateCallbackCalled)
 {
     testing::NiceMock<MockTestFile> file;
@@ -516,3 +671,127 @@ TEST(FileTest, SetError)
     ASSERT_EQ(file.error(), file._priv_func()->error_code);
     ASSERT_EQ(file.error_string(), file._priv_func()->error_string);
 }
+
+TEST(FileTest, StatsDisabledByDefault)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    ASSERT_TRUE(file.open());
+
+    char buf[10];
+    size_t n;
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+
+    mb::FileStats stats = file.stats();
+    ASSERT_EQ(stats.read_calls, 0u);
+    ASSERT_EQ(stats.bytes_read, 0u);
+}
+
+TEST(FileTest, StatsCountOperations)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    ASSERT_TRUE(file.set_stats_enabled(true));
+    ASSERT_TRUE(file.open());
+
+    char buf[10];
+    size_t n;
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_TRUE(file.seek(-5, SEEK_END, nullptr));
+    // Short read at EOF
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 5u);
+    ASSERT_TRUE(file.write("abc", 3, n));
+    ASSERT_TRUE(file.read_at(0, buf, 4, n));
+
+    // The seeks done by the positional read fallback are not counted
+    mb::FileStats stats = file.stats();
+    ASSERT_EQ(stats.read_calls, 3u);
+    ASSERT_EQ(stats.write_calls, 1u);
+    ASSERT_EQ(stats.seek_calls, 1u);
+    ASSERT_EQ(stats.bytes_read, 19u);
+    ASSERT_EQ(stats.bytes_written, 3u);
+    ASSERT_EQ(stats.short_reads, 1u);
+
+    ASSERT_TRUE(file.reset_stats());
+    stats = file.stats();
+    ASSERT_EQ(stats.read_calls, 0u);
+    ASSERT_EQ(stats.seek_calls, 0u);
+}
+
+TEST(FileTest, StatsCountFailedOperations)
+{
+    testing::NiceMock<MockTestFile> file;
+
+    EXPECT_CALL(file, on_write(testing::_, testing::_, testing::_))
+            .Times(1)
+            .WillOnce(testing::Return(false));
+
+    ASSERT_TRUE(file.set_stats_enabled(true));
+    ASSERT_TRUE(file.open());
+
+    size_t n;
+    ASSERT_FALSE(file.write("abc", 3, n));
+
+    mb::FileStats stats = file.stats();
+    ASSERT_EQ(stats.write_calls, 1u);
+    ASSERT_EQ(stats.bytes_written, 0u);
+}
+
+struct TraceCounter
+{
+    mb::File *file;
+    size_t reads;
+    size_t seeks;
+    uint64_t last_result;
+};
+
+static void trace_cb(mb::File &file, const mb::FileTraceEvent &event,
+                     void *userdata)
+{
+    auto counter = static_cast<TraceCounter *>(userdata);
+
+    if (&file != counter->file) {
+        return;
+    }
+
+    switch (event.op) {
+    case mb::FileTraceOp::Read:
+        ++counter->reads;
+        break;
+    case mb::FileTraceOp::Seek:
+        ++counter->seeks;
+        break;
+    default:
+        break;
+    }
+
+    counter->last_result = event.result;
+}
+
+TEST(FileTest, TraceCallbackCalled)
+{
+    testing::NiceMock<MockTestFile> file;
+    TraceCounter counter{&file, 0, 0, 0};
+
+    ASSERT_TRUE(file.open());
+
+    mb::file_set_trace_callback(&trace_cb, &counter);
+
+    char buf[10];
+    size_t n;
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(counter.reads, 1u);
+    ASSERT_EQ(counter.last_result, 10u);
+    ASSERT_TRUE(file.seek(100, SEEK_SET, nullptr));
+    ASSERT_EQ(counter.seeks, 1u);
+    ASSERT_EQ(counter.last_result, 100u);
+
+    mb::file_set_trace_callback(nullptr, nullptr);
+
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(counter.reads, 1u);
+
+    // Tracing does not enable per-file statistics
+    ASSERT_EQ(file.stats().read_calls, 0u);
+}
@@ -45,4 +45,10 @@ TEST(FileErrorTest, CheckErrorCodesComparableToErrorConditions)
     ec = mb::make_error_code(mb::FileError::UnsupportedTruncate);
     ASSERT_EQ(ec, mb::FileError::Unsupported);
     ASSERT_EQ(mb::FileError::Unsupported, ec);
+    ec = mb::make_error_code(mb::FileError::UnsupportedMap);
+    ASSERT_EQ(ec, mb::FileError::Unsupported);
+    ASSERT_EQ(mb::FileError::Unsupported, ec);
+    ec = mb::make_error_code(mb::FileError::UnsupportedNativeFd);
+    ASSERT_EQ(ec, mb::FileError::Unsupported);
+    ASSERT_EQ(mb::FileError::Unsupported, ec);
 }
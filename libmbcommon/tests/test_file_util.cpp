@@ -20,9 +20,12 @@
 #include <gmock/gmock.h>
 
 #include <memory>
+#include <vector>
 
 #include <cinttypes>
+#include <cstdio>
 
+#include "mbcommon/file/fd.h"
 #include "mbcommon/file/memory.h"
 #include "mbcommon/file_p.h"
 #include "mbcommon/file_util.h"
@@ -161,6 +164,68 @@ TEST_F(FileUtilTest, WriteFullyPartialFail)
     ASSERT_EQ(n, 8u);
 }
 
+TEST_F(FileUtilTest, WriteFullyVNormal)
+{
+    // Default TestFile implementation writes everything that is requested
+    ASSERT_TRUE(_file.open());
+
+    mb::FileConstIoVec iov[] = {
+        { "abc", 3 },
+        { "", 0 },
+        { "defgh", 5 },
+    };
+
+    size_t n;
+    ASSERT_TRUE(mb::file_write_fully_v(_file, iov, 3, n));
+    ASSERT_EQ(n, 8u);
+    ASSERT_EQ(memcmp(_file._buf.data(), "abcdefgh", 8), 0);
+}
+
+TEST_F(FileUtilTest, WriteFullyVShortWrites)
+{
+    EXPECT_CALL(_file, on_write(testing::_, testing::_, testing::_))
+            .Times(4)
+            .WillRepeatedly(testing::DoAll(testing::SetArgReferee<2>(2),
+                                           testing::Return(true)));
+
+    // Open file
+    ASSERT_TRUE(_file.open());
+
+    mb::FileConstIoVec iov[] = {
+        { "xxx", 3 },
+        { "xxxxx", 5 },
+    };
+
+    // Each short write must resume from the correct buffer and offset
+    size_t n;
+    ASSERT_TRUE(mb::file_write_fully_v(_file, iov, 2, n));
+    ASSERT_EQ(n, 8u);
+}
+
+TEST_F(FileUtilTest, WriteFullyVPartialFail)
+{
+    // The first failure is deferred by the writev() fallback because some
+    // bytes were already written. The next writev() call reports it.
+    EXPECT_CALL(_file, on_write(testing::_, testing::_, testing::_))
+            .Times(3)
+            .WillOnce(testing::DoAll(testing::SetArgReferee<2>(3),
+                                     testing::Return(true)))
+            .WillRepeatedly(testing::DoAll(testing::SetArgReferee<2>(0),
+                                           testing::Return(false)));
+
+    // Open file
+    ASSERT_TRUE(_file.open());
+
+    mb::FileConstIoVec iov[] = {
+        { "xxx", 3 },
+        { "xxxxx", 5 },
+    };
+
+    size_t n;
+    ASSERT_FALSE(mb::file_write_fully_v(_file, iov, 2, n));
+    ASSERT_EQ(n, 3u);
+}
+
 TEST_F(FileUtilTest, ReadDiscardNormal)
 {
     EXPECT_CALL(_file, on_read(testing::_, testing::_, testing::_))
@@ -226,15 +291,16 @@ struct FileSearchTest : testing::Test
 {
     // Callback counters
     int _n_result = 0;
+    std::vector<uint64_t> _offsets;
 
     static mb::FileSearchAction _result_cb(mb::File &file, void *userdata,
                                            uint64_t offset)
     {
         (void) file;
-        (void) offset;
 
         FileSearchTest *test = static_cast<FileSearchTest *>(userdata);
         ++test->_n_result;
+        test->_offsets.push_back(offset);
 
         return mb::FileSearchAction::Continue;
     }
@@ -297,6 +363,139 @@ TEST_F(FileSearchTest, FindNormal)
                                 this));
 }
 
+TEST_F(FileSearchTest, FindMappedWithBoundaries)
+{
+    // MemoryFile supports map_range(), so the search happens in place
+    mb::MemoryFile file("abababab", 8);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(mb::file_search(file, 1, 7, 0, "ab", 2, -1, &_result_cb,
+                                this));
+    ASSERT_EQ(_offsets, (std::vector<uint64_t>{2, 4}));
+}
+
+TEST_F(FileSearchTest, FindMappedMaxMatches)
+{
+    mb::MemoryFile file("abababab", 8);
+    ASSERT_TRUE(file.is_open());
+
+    ASSERT_TRUE(mb::file_search(file, -1, -1, 0, "ab", 2, 3, &_result_cb,
+                                this));
+    ASSERT_EQ(_offsets, (std::vector<uint64_t>{0, 2, 4}));
+}
+
+TEST_F(FileSearchTest, FindBuffered)
+{
+    // TestFile does not support map_range(), so the buffered path is used
+    testing::NiceMock<MockTestFile> file;
+    ASSERT_TRUE(file.open());
+
+    ASSERT_TRUE(mb::file_search(file, -1, -1, 4, "xyz", 3, 2, &_result_cb,
+                                this));
+    ASSERT_EQ(_offsets, (std::vector<uint64_t>{23, 49}));
+}
+
+struct FileSearchMultiTest : testing::Test
+{
+    std::vector<std::pair<size_t, uint64_t>> _matches;
+
+    static mb::FileSearchAction _result_cb(mb::File &file, void *userdata,
+                                           size_t pattern_index,
+                                           uint64_t offset)
+    {
+        (void) file;
+
+        auto *test = static_cast<FileSearchMultiTest *>(userdata);
+        test->_matches.emplace_back(pattern_index, offset);
+
+        return mb::FileSearchAction::Continue;
+    }
+
+    typedef std::vector<std::pair<size_t, uint64_t>> Matches;
+};
+
+TEST_F(FileSearchMultiTest, CheckInvalidBoundariesFail)
+{
+    mb::MemoryFile file("", 0);
+    ASSERT_TRUE(file.is_open());
+
+    const void *patterns[] = { "x" };
+    size_t sizes[] = { 1 };
+
+    ASSERT_FALSE(mb::file_search_multi(file, 20, 10, 0, patterns, sizes, 1,
+                                       -1, &_result_cb, this));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_F(FileSearchMultiTest, FindMappedOverlappingPatterns)
+{
+    mb::MemoryFile file("xabcdbcdcdx", 11);
+    ASSERT_TRUE(file.is_open());
+
+    // Suffixes of each other, plus an empty and a duplicate pattern
+    const void *patterns[] = { "abcd", "bcd", "cd", "", "cd", "zz" };
+    size_t sizes[] = { 4, 3, 2, 0, 2, 2 };
+
+    ASSERT_TRUE(mb::file_search_multi(file, -1, -1, 0, patterns, sizes, 6,
+                                      -1, &_result_cb, this));
+    ASSERT_EQ(_matches, (Matches{
+        {0, 1}, {1, 2}, {2, 3}, {4, 3},
+        {1, 5}, {2, 6}, {4, 6},
+        {2, 8}, {4, 8},
+    }));
+}
+
+TEST_F(FileSearchMultiTest, FindWithoutOverlapsOfSamePattern)
+{
+    mb::MemoryFile file("aaaaa", 5);
+    ASSERT_TRUE(file.is_open());
+
+    const void *patterns[] = { "aa", "a" };
+    size_t sizes[] = { 2, 1 };
+
+    ASSERT_TRUE(mb::file_search_multi(file, -1, -1, 0, patterns, sizes, 2,
+                                      -1, &_result_cb, this));
+    ASSERT_EQ(_matches, (Matches{
+        {1, 0}, {0, 0}, {1, 1}, {1, 2}, {0, 2}, {1, 3}, {1, 4},
+    }));
+}
+
+TEST_F(FileSearchMultiTest, FindMappedWithBoundariesAndMaxMatches)
+{
+    mb::MemoryFile file("abababab", 8);
+    ASSERT_TRUE(file.is_open());
+
+    const void *patterns[] = { "ab", "ba" };
+    size_t sizes[] = { 2, 2 };
+
+    ASSERT_TRUE(mb::file_search_multi(file, 1, 7, 0, patterns, sizes, 2,
+                                      -1, &_result_cb, this));
+    ASSERT_EQ(_matches, (Matches{
+        {1, 1}, {0, 2}, {1, 3}, {0, 4}, {1, 5},
+    }));
+
+    _matches.clear();
+    ASSERT_TRUE(mb::file_search_multi(file, -1, -1, 0, patterns, sizes, 2,
+                                      2, &_result_cb, this));
+    ASSERT_EQ(_matches, (Matches{{0, 0}, {1, 1}}));
+}
+
+TEST_F(FileSearchMultiTest, FindBufferedAcrossReads)
+{
+    // TestFile does not support map_range(), so the buffered path is used.
+    // With a 5 byte buffer, matches span read boundaries. The last "cdefg"
+    // match at 54 extends past the end boundary.
+    testing::NiceMock<MockTestFile> file;
+    ASSERT_TRUE(file.open());
+
+    const void *patterns[] = { "xyz", "cdefg" };
+    size_t sizes[] = { 3, 5 };
+
+    ASSERT_TRUE(mb::file_search_multi(file, -1, 58, 5, patterns, sizes, 2,
+                                      -1, &_result_cb, this));
+    ASSERT_EQ(_matches, (Matches{{1, 2}, {0, 23}, {1, 28}, {0, 49}}));
+}
+
 TEST(FileMoveTest, DegenerateCasesShouldSucceed)
 {
     constexpr char buf[] = "abcdef";
@@ -414,4 +613,196 @@ TEST(FileMoveTest, LargeBackwardsCopyShouldSucceed)
     free(buf);
 }
 
+static void test_fd_file_move(uint64_t src, uint64_t dest, uint64_t size,
+                              size_t file_size)
+{
+    std::unique_ptr<FILE, decltype(fclose) *> fp(tmpfile(), &fclose);
+    ASSERT_TRUE(!!fp);
+
+    mb::FdFile file(fileno(fp.get()), false);
+    ASSERT_TRUE(file.is_open());
+
+    std::vector<char> expected(file_size);
+    for (size_t i = 0; i < expected.size(); ++i) {
+        expected[i] = static_cast<char>(i % 251);
+    }
+
+    size_t n;
+    ASSERT_TRUE(mb::file_write_fully(file, expected.data(), expected.size(),
+                                     n));
+    ASSERT_EQ(n, expected.size());
+
+    uint64_t n_moved;
+    ASSERT_TRUE(mb::file_move(file, src, dest, size, n_moved));
+    ASSERT_EQ(n_moved, size);
+
+    // Result must match memmove() regardless of whether the filesystem
+    // supports collapsing or inserting ranges
+    if (dest + size > expected.size()) {
+        expected.resize(dest + size);
+    }
+    memmove(expected.data() + dest, expected.data() + src, size);
+
+    uint64_t file_end;
+    ASSERT_TRUE(file.seek(0, SEEK_END, &file_end));
+    ASSERT_EQ(file_end, expected.size());
+
+    std::vector<char> result(expected.size());
+    ASSERT_TRUE(file.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(mb::file_read_fully(file, result.data(), result.size(), n));
+    ASSERT_EQ(n, result.size());
+    ASSERT_EQ(result, expected);
+}
+
+TEST(FileMoveTest, AlignedForwardsMoveOfFdFileTailShouldSucceed)
+{
+    test_fd_file_move(4 * 4096, 4096, 12 * 4096 + 123, 16 * 4096 + 123);
+}
+
+TEST(FileMoveTest, AlignedBackwardsMoveOfFdFileTailShouldSucceed)
+{
+    test_fd_file_move(4096, 3 * 4096, 12 * 4096 + 123, 13 * 4096 + 123);
+}
+
+TEST(FileMoveTest, UnalignedMoveOfFdFileShouldSucceed)
+{
+    test_fd_file_move(4097, 10, 40000, 50000);
+    test_fd_file_move(10, 4097, 40000, 50000);
+}
+
+TEST(FileCopyTest, CopyBetweenMemoryFilesShouldSucceed)
+{
+    constexpr char src_buf[] = "abcdef";
+    void *dst_buf = nullptr;
+    size_t dst_size = 0;
+    uint64_t n;
+
+    mb::MemoryFile src(src_buf, sizeof(src_buf) - 1);
+    ASSERT_TRUE(src.is_open());
+    mb::MemoryFile dst(&dst_buf, &dst_size);
+    ASSERT_TRUE(dst.is_open());
+
+    ASSERT_TRUE(src.seek(1, SEEK_SET, nullptr));
+
+    ASSERT_TRUE(mb::file_copy(src, dst, 3, n));
+    ASSERT_EQ(n, 3u);
+    ASSERT_EQ(dst_size, 3u);
+    ASSERT_EQ(memcmp(dst_buf, "bcd", 3), 0);
+
+    // Copying past EOF should result in a short copy
+    ASSERT_TRUE(mb::file_copy(src, dst, 10, n));
+    ASSERT_EQ(n, 2u);
+    ASSERT_EQ(dst_size, 5u);
+    ASSERT_EQ(memcmp(dst_buf, "bcdef", 5), 0);
+
+    ASSERT_TRUE(dst.close());
+    free(dst_buf);
+}
+
+TEST(FileCopyTest, CopyBetweenFdFilesShouldSucceed)
+{
+    std::unique_ptr<FILE, decltype(fclose) *> src_fp(tmpfile(), &fclose);
+    ASSERT_TRUE(!!src_fp);
+    std::unique_ptr<FILE, decltype(fclose) *> dst_fp(tmpfile(), &fclose);
+    ASSERT_TRUE(!!dst_fp);
+
+    mb::FdFile src(fileno(src_fp.get()), false);
+    ASSERT_TRUE(src.is_open());
+    mb::FdFile dst(fileno(dst_fp.get()), false);
+    ASSERT_TRUE(dst.is_open());
+
+    std::vector<char> data(3 * 1024 * 1024 + 1);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i % 251);
+    }
+
+    size_t n;
+    ASSERT_TRUE(mb::file_write_fully(src, data.data(), data.size(), n));
+    ASSERT_EQ(n, data.size());
+    ASSERT_TRUE(src.seek(0, SEEK_SET, nullptr));
+
+    uint64_t n_copied;
+    ASSERT_TRUE(mb::file_copy(src, dst, UINT64_MAX, n_copied));
+    ASSERT_EQ(n_copied, data.size());
+
+    // Both file positions should have been advanced
+    uint64_t offset;
+    ASSERT_TRUE(src.seek(0, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, data.size());
+    ASSERT_TRUE(dst.seek(0, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, data.size());
+
+    std::vector<char> result(data.size());
+    ASSERT_TRUE(dst.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(mb::file_read_fully(dst, result.data(), result.size(), n));
+    ASSERT_EQ(n, result.size());
+    ASSERT_EQ(result, data);
+}
+
+TEST(FileCopyTest, PartialCopyBetweenFdFilesShouldStopAtSize)
+{
+    std::unique_ptr<FILE, decltype(fclose) *> src_fp(tmpfile(), &fclose);
+    ASSERT_TRUE(!!src_fp);
+    std::unique_ptr<FILE, decltype(fclose) *> dst_fp(tmpfile(), &fclose);
+    ASSERT_TRUE(!!dst_fp);
+
+    mb::FdFile src(fileno(src_fp.get()), false);
+    ASSERT_TRUE(src.is_open());
+    mb::FdFile dst(fileno(dst_fp.get()), false);
+    ASSERT_TRUE(dst.is_open());
+
+    std::vector<char> data(64 * 1024);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i % 251);
+    }
+
+    size_t n;
+    ASSERT_TRUE(mb::file_write_fully(src, data.data(), data.size(), n));
+    ASSERT_EQ(n, data.size());
+
+    // Block-aligned offsets, but not ending at EOF, so a reflink clone (if
+    // supported) must not share the tail
+    ASSERT_TRUE(src.seek(4096, SEEK_SET, nullptr));
+    ASSERT_TRUE(dst.seek(8192, SEEK_SET, nullptr));
+
+    uint64_t n_copied;
+    ASSERT_TRUE(mb::file_copy(src, dst, 16384, n_copied));
+    ASSERT_EQ(n_copied, 16384u);
+
+    uint64_t offset;
+    ASSERT_TRUE(src.seek(0, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 4096u + 16384u);
+    ASSERT_TRUE(dst.seek(0, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 8192u + 16384u);
+
+    std::vector<char> result(16384);
+    ASSERT_TRUE(dst.seek(8192, SEEK_SET, nullptr));
+    ASSERT_TRUE(mb::file_read_fully(dst, result.data(), result.size(), n));
+    ASSERT_EQ(n, result.size());
+    ASSERT_EQ(memcmp(result.data(), data.data() + 4096, result.size()), 0);
+
+    // Nothing should have been written past the requested range
+    ASSERT_TRUE(dst.seek(0, SEEK_END, &offset));
+    ASSERT_EQ(offset, 8192u + 16384u);
+}
+
+TEST(FileCopyTest, CopyFailureShouldSetErrorOnFailedFile)
+{
+    constexpr char src_buf[] = "abcdef";
+    uint64_t n;
+
+    mb::MemoryFile src(src_buf, sizeof(src_buf) - 1);
+    ASSERT_TRUE(src.is_open());
+    testing::NiceMock<MockTestFile> dst;
+    ASSERT_TRUE(dst.open());
+
+    EXPECT_CALL(dst, on_write(testing::_, testing::_, testing::_))
+            .WillOnce(testing::DoAll(testing::SetArgReferee<2>(2),
+                                     testing::Return(true)))
+            .WillOnce(testing::Return(false));
+
+    ASSERT_FALSE(mb::file_copy(src, dst, 6, n));
+    ASSERT_EQ(n, 2u);
+}
+
 // TODO: Add more tests after integrating gmock
@@ -19,6 +19,8 @@
 
 #include <gtest/gtest.h>
 
+#include <cerrno>
+
 #include "mbcommon/string.h"
 
 TEST(StringTest, FormatString)
@@ -31,6 +33,47 @@ TEST(StringTest, FormatEmptyString)
     ASSERT_EQ(mb::format(""), "");
 }
 
+TEST(StringTest, FormatLongString)
+{
+    std::string arg(1000, 'x');
+    ASSERT_EQ(mb::format("[%s]", arg.c_str()), "[" + arg + "]");
+}
+
+TEST(StringTest, FormatReusesString)
+{
+    std::string out(100, 'a');
+
+    ASSERT_TRUE(mb::format(out, "%d", 12345));
+    ASSERT_EQ(out, "12345");
+
+    ASSERT_TRUE(mb::format(out, "%s", std::string(200, 'b').c_str()));
+    ASSERT_EQ(out, std::string(200, 'b'));
+
+    ASSERT_TRUE(mb::format(out, "%s", ""));
+    ASSERT_EQ(out, "");
+}
+
+TEST(StringTest, FormatToBuffer)
+{
+    char buf[8];
+    size_t len;
+
+    ASSERT_TRUE(mb::format_to(buf, sizeof(buf), &len, "%d-%s", 12, "ab"));
+    ASSERT_STREQ(buf, "12-ab");
+    ASSERT_EQ(len, 5u);
+
+    // Output exactly filling the buffer (no room for the NULL terminator)
+    ASSERT_FALSE(mb::format_to(buf, sizeof(buf), &len, "%s", "abcdefgh"));
+    ASSERT_EQ(errno, ERANGE);
+    ASSERT_STREQ(buf, "abcdefg");
+    ASSERT_EQ(len, 8u);
+
+    // Query length only
+    ASSERT_FALSE(mb::format_to(nullptr, 0, &len, "%s", "abc"));
+    ASSERT_EQ(errno, ERANGE);
+    ASSERT_EQ(len, 3u);
+}
+
 TEST(StringTest, FormatSizeT)
 {
     ptrdiff_t signed_val = 0x7FFFFFFF;
@@ -202,6 +245,22 @@ TEST(StringTest, InsertMemoryOutOfRange)
     ASSERT_LT(mb::mem_insert(&buf, &buf_size, 1, "", 0), 0);
 }
 
+TEST(StringTest, InsertMemoryFromSelf)
+{
+    size_t buf_size = 4;
+    void *buf = malloc(buf_size);
+    ASSERT_NE(buf, nullptr);
+    memcpy(buf, "abcd", buf_size);
+
+    // Insert a copy of the middle of the buffer into itself
+    ASSERT_EQ(mb::mem_insert(&buf, &buf_size, 1,
+                             static_cast<char *>(buf) + 1, 2), 0);
+    ASSERT_EQ(buf_size, 6u);
+    ASSERT_EQ(memcmp(buf, "abcbcd", buf_size), 0);
+
+    free(buf);
+}
+
 TEST(StringTest, InsertString)
 {
     struct {
@@ -298,6 +357,49 @@ TEST(StringTest, ReplaceMemory)
     }
 }
 
+TEST(StringTest, ReplaceMemoryInPlace)
+{
+    size_t buf_size = 12;
+    void *buf = malloc(buf_size);
+    ASSERT_NE(buf, nullptr);
+    memcpy(buf, "abcXabcXabcX", buf_size);
+    void *orig_buf = buf;
+
+    size_t matches;
+    ASSERT_EQ(mb::mem_replace(&buf, &buf_size, "abc", 3, "d", 1, 0, &matches),
+              0);
+    ASSERT_EQ(matches, 3u);
+    ASSERT_EQ(buf, orig_buf);
+    ASSERT_EQ(buf_size, 6u);
+    ASSERT_EQ(memcmp(buf, "dXdXdX", buf_size), 0);
+
+    free(buf);
+}
+
+TEST(StringTest, ReplaceMemoryGrowMany)
+{
+    std::string source;
+    std::string expected;
+    for (int i = 0; i < 1000; ++i) {
+        source += "a-";
+        expected += "xyz-";
+    }
+
+    size_t buf_size = source.size();
+    void *buf = malloc(buf_size);
+    ASSERT_NE(buf, nullptr);
+    memcpy(buf, source.data(), buf_size);
+
+    size_t matches;
+    ASSERT_EQ(mb::mem_replace(&buf, &buf_size, "a", 1, "xyz", 3, 0, &matches),
+              0);
+    ASSERT_EQ(matches, 1000u);
+    ASSERT_EQ(buf_size, expected.size());
+    ASSERT_EQ(memcmp(buf, expected.data(), buf_size), 0);
+
+    free(buf);
+}
+
 TEST(StringTest, ReplaceString)
 {
     struct {
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "mbcommon/thread_pool.h"
+
+using namespace mb;
+
+TEST(ThreadPoolTest, RunsAllTasks)
+{
+    ThreadPool pool(4);
+    std::atomic<int> count(0);
+
+    ASSERT_EQ(pool.size(), 4u);
+
+    {
+        TaskGroup group(pool);
+        for (int i = 0; i < 1000; ++i) {
+            group.run([&] { ++count; });
+        }
+        group.wait();
+    }
+
+    ASSERT_EQ(count.load(), 1000);
+}
+
+TEST(ThreadPoolTest, TasksRunOnWorkers)
+{
+    ThreadPool pool(2);
+    std::atomic<bool> on_worker(true);
+    auto main_id = std::this_thread::get_id();
+
+    ASSERT_FALSE(pool.is_worker());
+
+    TaskGroup group(pool);
+    for (int i = 0; i < 100; ++i) {
+        group.run([&] {
+            // The waiting thread may help run tasks, so only check that the
+            // workers identify themselves
+            if (std::this_thread::get_id() != main_id && !pool.is_worker()) {
+                on_worker = false;
+            }
+        });
+    }
+    group.wait();
+
+    ASSERT_TRUE(on_worker);
+}
+
+TEST(ThreadPoolTest, HigherPriorityRunsFirst)
+{
+    ThreadPool pool(1);
+    std::mutex lock;
+    std::vector<int> order;
+
+    // Block the only worker so that the tasks below are all queued before any
+    // of them run
+    std::atomic<bool> started(false);
+    std::atomic<bool> release(false);
+    TaskGroup blocker(pool);
+    blocker.run([&] {
+        started = true;
+        while (!release) {
+            std::this_thread::yield();
+        }
+    });
+    while (!started) {
+        std::this_thread::yield();
+    }
+
+    TaskGroup low(pool, 0, TaskPriority::Low);
+    TaskGroup normal(pool, 0, TaskPriority::Normal);
+    TaskGroup high(pool, 0, TaskPriority::High);
+
+    auto record = [&](int value) {
+        return [&, value] {
+            std::lock_guard<std::mutex> guard(lock);
+            order.push_back(value);
+        };
+    };
+
+    low.run(record(2));
+    normal.run(record(1));
+    high.run(record(0));
+
+    release = true;
+
+    // Don't wait on the groups here since a waiting thread helps run tasks,
+    // which would race with the worker
+    while (true) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (order.size() == 3) {
+            break;
+        }
+    }
+
+    ASSERT_EQ(order, (std::vector<int>{0, 1, 2}));
+}
+
+TEST(ThreadPoolTest, CancelSkipsQueuedTasks)
+{
+    ThreadPool pool(1);
+    std::atomic<bool> release(false);
+    std::atomic<bool> started(false);
+    std::atomic<int> count(0);
+
+    TaskGroup blocker(pool);
+    blocker.run([&] {
+        started = true;
+        while (!release) {
+            std::this_thread::yield();
+        }
+    });
+    while (!started) {
+        std::this_thread::yield();
+    }
+
+    TaskGroup group(pool);
+    for (int i = 0; i < 10; ++i) {
+        group.run([&] { ++count; });
+    }
+
+    group.cancel();
+    ASSERT_TRUE(group.is_cancelled());
+    ASSERT_TRUE(group.token().is_cancelled());
+
+    release = true;
+    group.wait();
+    blocker.wait();
+
+    ASSERT_EQ(count.load(), 0);
+}
+
+TEST(ThreadPoolTest, SharedTokenCancelsGroup)
+{
+    ThreadPool pool(2);
+    CancellationToken token;
+    TaskGroup group(pool, 0, TaskPriority::Normal, token);
+
+    token.cancel();
+    ASSERT_TRUE(group.is_cancelled());
+}
+
+TEST(ThreadPoolTest, MaxPendingBoundsConcurrency)
+{
+    ThreadPool pool(4);
+    std::atomic<int> running(0);
+    std::atomic<int> max_running(0);
+
+    TaskGroup group(pool, 2);
+    for (int i = 0; i < 50; ++i) {
+        group.run([&] {
+            int now = ++running;
+            int prev = max_running;
+            while (now > prev
+                    && !max_running.compare_exchange_weak(prev, now)) {
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            --running;
+        });
+    }
+    group.wait();
+
+    ASSERT_LE(max_running.load(), 2);
+}
+
+TEST(ThreadPoolTest, NestedGroupsDoNotDeadlock)
+{
+    ThreadPool pool(2);
+    std::atomic<int> count(0);
+
+    TaskGroup outer(pool);
+    for (int i = 0; i < 8; ++i) {
+        outer.run([&] {
+            TaskGroup inner(pool);
+            for (int j = 0; j < 8; ++j) {
+                inner.run([&] { ++count; });
+            }
+            inner.wait();
+        });
+    }
+    outer.wait();
+
+    ASSERT_EQ(count.load(), 64);
+}
+
+TEST(ThreadPoolTest, SharedPoolIsReused)
+{
+    ASSERT_EQ(&ThreadPool::shared(), &ThreadPool::shared());
+    ASSERT_GE(ThreadPool::shared().size(), 1u);
+}
@@ -0,0 +1,408 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <cstring>
+
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "mbcommon/zip.h"
+
+struct TestZipEntry
+{
+    std::string name;
+    std::string data;
+    bool deflate;
+    uint32_t mode;
+};
+
+static void put_le16(std::string &out, uint16_t value)
+{
+    out += static_cast<char>(value & 0xff);
+    out += static_cast<char>(value >> 8);
+}
+
+static void put_le32(std::string &out, uint32_t value)
+{
+    put_le16(out, static_cast<uint16_t>(value & 0xffff));
+    put_le16(out, static_cast<uint16_t>(value >> 16));
+}
+
+static std::string raw_deflate(const std::string &data)
+{
+    z_stream strm{};
+    EXPECT_EQ(deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                           8, Z_DEFAULT_STRATEGY), Z_OK);
+
+    std::string out(deflateBound(&strm, data.size()), '\0');
+    strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    strm.avail_in = static_cast<uInt>(data.size());
+    strm.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    strm.avail_out = static_cast<uInt>(out.size());
+    EXPECT_EQ(deflate(&strm, Z_FINISH), Z_STREAM_END);
+    out.resize(strm.total_out);
+    deflateEnd(&strm);
+
+    return out;
+}
+
+// Build a minimal (non-zip64) zip archive
+static std::string build_zip(const std::vector<TestZipEntry> &entries)
+{
+    std::string out;
+    std::string cd;
+
+    for (auto const &entry : entries) {
+        std::string payload = entry.deflate
+                ? raw_deflate(entry.data) : entry.data;
+        uint32_t crc = static_cast<uint32_t>(crc32(
+                0, reinterpret_cast<const Bytef *>(entry.data.data()),
+                static_cast<uInt>(entry.data.size())));
+        uint32_t offset = static_cast<uint32_t>(out.size());
+        uint16_t method = entry.deflate ? 8 : 0;
+
+        put_le32(out, 0x04034b50);
+        put_le16(out, 20);
+        put_le16(out, 0);
+        put_le16(out, method);
+        put_le32(out, 0);
+        put_le32(out, crc);
+        put_le32(out, static_cast<uint32_t>(payload.size()));
+        put_le32(out, static_cast<uint32_t>(entry.data.size()));
+        put_le16(out, static_cast<uint16_t>(entry.name.size()));
+        put_le16(out, 0);
+        out += entry.name;
+        out += payload;
+
+        put_le32(cd, 0x02014b50);
+        // Version made by: UNIX
+        put_le16(cd, (3 << 8) | 20);
+        put_le16(cd, 20);
+        put_le16(cd, 0);
+        put_le16(cd, method);
+        put_le32(cd, 0);
+        put_le32(cd, crc);
+        put_le32(cd, static_cast<uint32_t>(payload.size()));
+        put_le32(cd, static_cast<uint32_t>(entry.data.size()));
+        put_le16(cd, static_cast<uint16_t>(entry.name.size()));
+        put_le16(cd, 0);
+        put_le16(cd, 0);
+        put_le16(cd, 0);
+        put_le16(cd, 0);
+        put_le32(cd, entry.mode << 16);
+        put_le32(cd, offset);
+        cd += entry.name;
+    }
+
+    uint32_t cd_offset = static_cast<uint32_t>(out.size());
+    out += cd;
+
+    put_le32(out, 0x06054b50);
+    put_le16(out, 0);
+    put_le16(out, 0);
+    put_le16(out, static_cast<uint16_t>(entries.size()));
+    put_le16(out, static_cast<uint16_t>(entries.size()));
+    put_le32(out, static_cast<uint32_t>(cd.size()));
+    put_le32(out, cd_offset);
+    put_le16(out, 0);
+
+    return out;
+}
+
+static std::string test_data(size_t size)
+{
+    std::string data;
+    data.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+        data += static_cast<char>("abcdefgh"[(i * 7 + i / 100) % 8]);
+    }
+    return data;
+}
+
+static std::string read_all(mb::File &file)
+{
+    std::string result;
+    char buf[1000];
+    size_t n;
+
+    while (file.read(buf, sizeof(buf), n) && n > 0) {
+        result.append(buf, n);
+    }
+
+    return result;
+}
+
+// Parameter: whether the archive is mapped into memory
+struct ZipArchiveTest : testing::TestWithParam<bool>
+{
+    char _path[32];
+    int _fd = -1;
+
+    std::vector<TestZipEntry> _entries{
+        { "stored.txt", test_data(10000), false, 0644 },
+        { "dir/deflated.txt", test_data(300000), true, 0755 },
+        { "empty", "", false, 0 },
+        { "empty_deflated", "", true, 0600 },
+    };
+
+    virtual void SetUp() override
+    {
+        strcpy(_path, "/tmp/mbcommon-XXXXXX");
+        _fd = mkstemp(_path);
+        ASSERT_GE(_fd, 0);
+    }
+
+    virtual void TearDown() override
+    {
+        if (_fd >= 0) {
+            close(_fd);
+            unlink(_path);
+        }
+    }
+
+    void write_zip(const std::string &contents)
+    {
+        ASSERT_EQ(ftruncate(_fd, 0), 0);
+        ASSERT_EQ(pwrite(_fd, contents.data(), contents.size(), 0),
+                  static_cast<ssize_t>(contents.size()));
+    }
+};
+
+TEST_P(ZipArchiveTest, FindEntries)
+{
+    write_zip(build_zip(_entries));
+
+    mb::ZipArchive zip;
+    ASSERT_TRUE(zip.open(_path, GetParam())) << zip.error_string();
+    ASSERT_TRUE(zip.is_open());
+    ASSERT_EQ(zip.is_mapped(), GetParam());
+    ASSERT_EQ(zip.entries().size(), _entries.size());
+
+    for (auto const &entry : _entries) {
+        const mb::ZipEntry *ze = zip.find(entry.name);
+        ASSERT_NE(ze, nullptr) << entry.name;
+        ASSERT_EQ(ze->name, entry.name);
+        ASSERT_EQ(ze->uncompressed_size, entry.data.size());
+        ASSERT_EQ(mb::zip_entry_unix_mode(*ze, 0644),
+                  entry.mode ? entry.mode : 0644u);
+    }
+
+    ASSERT_EQ(zip.find("missing"), nullptr);
+    ASSERT_EQ(zip.find("dir"), nullptr);
+
+    ASSERT_TRUE(zip.close());
+    ASSERT_FALSE(zip.is_open());
+    ASSERT_EQ(zip.find("stored.txt"), nullptr);
+}
+
+TEST_P(ZipArchiveTest, ReadEntries)
+{
+    write_zip(build_zip(_entries));
+
+    mb::ZipArchive zip;
+    ASSERT_TRUE(zip.open(_path, GetParam())) << zip.error_string();
+
+    for (auto const &entry : _entries) {
+        const mb::ZipEntry *ze = zip.find(entry.name);
+        ASSERT_NE(ze, nullptr);
+
+        mb::ZipEntryFile file(zip, *ze);
+        ASSERT_TRUE(file.is_open()) << file.error_string();
+        ASSERT_EQ(read_all(file), entry.data) << entry.name;
+
+        std::vector<unsigned char> data;
+        ASSERT_TRUE(zip.read(*ze, data)) << zip.error_string();
+        ASSERT_EQ(std::string(data.begin(), data.end()), entry.data);
+    }
+}
+
+TEST_P(ZipArchiveTest, SeekDeflatedEntry)
+{
+    write_zip(build_zip(_entries));
+
+    mb::ZipArchive zip;
+    ASSERT_TRUE(zip.open(_path, GetParam())) << zip.error_string();
+
+    const TestZipEntry &entry = _entries[1];
+    mb::ZipEntryFile file(zip, *zip.find(entry.name));
+    ASSERT_TRUE(file.is_open()) << file.error_string();
+
+    uint64_t offset;
+    char buf[100];
+    size_t n;
+
+    // Seeking to the end reports the size without inflating anything
+    ASSERT_TRUE(file.seek(0, SEEK_END, &offset));
+    ASSERT_EQ(offset, entry.data.size());
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 0u);
+
+    // Forward
+    ASSERT_TRUE(file.seek(200000, SEEK_SET, nullptr));
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(std::string(buf, n), entry.data.substr(200000, sizeof(buf)));
+
+    // Backward
+    ASSERT_TRUE(file.seek(-150000, SEEK_CUR, &offset));
+    ASSERT_EQ(offset, 50100u);
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(std::string(buf, n), entry.data.substr(50100, sizeof(buf)));
+
+    // Positional read
+    ASSERT_TRUE(file.read_at(123456, buf, sizeof(buf), n));
+    ASSERT_EQ(std::string(buf, n), entry.data.substr(123456, sizeof(buf)));
+
+    ASSERT_FALSE(file.seek(-1, SEEK_SET, nullptr));
+    ASSERT_EQ(file.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_P(ZipArchiveTest, SeekStoredEntry)
+{
+    write_zip(build_zip(_entries));
+
+    mb::ZipArchive zip;
+    ASSERT_TRUE(zip.open(_path, GetParam())) << zip.error_string();
+
+    const TestZipEntry &entry = _entries[0];
+    mb::ZipEntryFile file(zip, *zip.find(entry.name));
+    ASSERT_TRUE(file.is_open()) << file.error_string();
+
+    char buf[100];
+    size_t n;
+
+    ASSERT_TRUE(file.seek(9950, SEEK_SET, nullptr));
+    ASSERT_TRUE(file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(std::string(buf, n), entry.data.substr(9950));
+
+    const void *data;
+    size_t size;
+    if (GetParam()) {
+        ASSERT_TRUE(file.map_range(100, 50, data, size));
+        ASSERT_EQ(size, 50u);
+        ASSERT_EQ(memcmp(data, entry.data.data() + 100, size), 0);
+    } else {
+        ASSERT_FALSE(file.map_range(100, 50, data, size));
+        ASSERT_EQ(file.error(), mb::FileError::UnsupportedMap);
+    }
+}
+
+TEST_P(ZipArchiveTest, DetectCorruptData)
+{
+    std::string contents = build_zip(_entries);
+
+    // Flip a byte in the middle of the stored entry's data
+    size_t pos = contents.find(_entries[0].data);
+    ASSERT_NE(pos, std::string::npos);
+    contents[pos + 5000] ^= 1;
+    write_zip(contents);
+
+    mb::ZipArchive zip;
+    ASSERT_TRUE(zip.open(_path, GetParam())) << zip.error_string();
+
+    std::vector<unsigned char> data;
+    ASSERT_FALSE(zip.read(*zip.find(_entries[0].name), data));
+    ASSERT_EQ(zip.error(), mb::FileError::BadFileFormat);
+    ASSERT_NE(zip.error_string().find("CRC32"), std::string::npos);
+    ASSERT_TRUE(data.empty());
+}
+
+TEST_P(ZipArchiveTest, DuplicateNamesKeepFirst)
+{
+    write_zip(build_zip({
+        { "a", "first", false, 0644 },
+        { "a", "second", false, 0644 },
+    }));
+
+    mb::ZipArchive zip;
+    ASSERT_TRUE(zip.open(_path, GetParam())) << zip.error_string();
+    ASSERT_EQ(zip.entries().size(), 1u);
+
+    std::vector<unsigned char> data;
+    ASSERT_TRUE(zip.read(*zip.find("a"), data));
+    ASSERT_EQ(std::string(data.begin(), data.end()), "first");
+}
+
+TEST_P(ZipArchiveTest, ForEachParallel)
+{
+    std::vector<TestZipEntry> entries;
+    for (int i = 0; i < 64; ++i) {
+        entries.push_back({ "file" + std::to_string(i),
+                            test_data(1000 + i * 997), i % 2 == 0, 0644 });
+    }
+    write_zip(build_zip(entries));
+
+    mb::ZipArchive zip;
+    ASSERT_TRUE(zip.open(_path, GetParam())) << zip.error_string();
+
+    std::vector<const mb::ZipEntry *> todo;
+    for (auto const &entry : zip.entries()) {
+        todo.push_back(&entry);
+    }
+
+    std::vector<std::string> results(entries.size());
+    std::atomic<size_t> count(0);
+
+    ASSERT_TRUE(zip.for_each_parallel(todo, 4,
+            [&](const mb::ZipEntry &entry, mb::ZipEntryFile &file) {
+        size_t i = static_cast<size_t>(&entry - zip.entries().data());
+        results[i] = read_all(file);
+        ++count;
+        return true;
+    })) << zip.error_string();
+
+    ASSERT_EQ(count, entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        ASSERT_EQ(results[i], entries[i].data) << entries[i].name;
+    }
+
+    // Stop on first failure
+    count = 0;
+    ASSERT_FALSE(zip.for_each_parallel(todo, 1,
+            [&](const mb::ZipEntry &, mb::ZipEntryFile &file) {
+        ++count;
+        file.set_error(mb::make_error_code(mb::FileError::InvalidState),
+                       "Callback failed");
+        return false;
+    }));
+    ASSERT_EQ(count, 1u);
+    ASSERT_EQ(zip.error(), mb::FileError::InvalidState);
+}
+
+TEST_P(ZipArchiveTest, OpenInvalidFile)
+{
+    write_zip("This is not a zip file");
+
+    mb::ZipArchive zip;
+    ASSERT_FALSE(zip.open(_path, GetParam()));
+    ASSERT_FALSE(zip.is_open());
+    ASSERT_EQ(zip.error(), mb::FileError::BadFileFormat);
+
+    ASSERT_FALSE(zip.open("/nonexistent/file.zip", GetParam()));
+    ASSERT_EQ(zip.error(), std::errc::no_such_file_or_directory);
+}
+
+INSTANTIATE_TEST_CASE_P(ZipArchiveModes, ZipArchiveTest,
+                        testing::Values(false, true));
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "mbcommon/common.h"
+#include "mbdevice/device.h"
+
+
+namespace mb
+{
+namespace device
+{
+
+class DeviceDatabasePrivate;
+
+class MB_EXPORT DeviceView
+{
+public:
+    DeviceView();
+
+    bool is_valid() const;
+
+    std::string id() const;
+    std::vector<std::string> codenames() const;
+    std::string name() const;
+    std::string architecture() const;
+    DeviceFlags flags() const;
+
+    std::vector<std::string> block_dev_base_dirs() const;
+    std::vector<std::string> system_block_devs() const;
+    std::vector<std::string> cache_block_devs() const;
+    std::vector<std::string> data_block_devs() const;
+    std::vector<std::string> boot_block_devs() const;
+    std::vector<std::string> recovery_block_devs() const;
+    std::vector<std::string> extra_block_devs() const;
+
+    bool tw_supported() const;
+    TwFlags tw_flags() const;
+    TwPixelFormat tw_pixel_format() const;
+    TwForcePixelFormat tw_force_pixel_format() const;
+    int tw_overscan_percent() const;
+    int tw_default_x_offset() const;
+    int tw_default_y_offset() const;
+    std::string tw_brightness_path() const;
+    std::string tw_secondary_brightness_path() const;
+    int tw_max_brightness() const;
+    int tw_default_brightness() const;
+    std::string tw_battery_path() const;
+    std::string tw_cpu_temp_path() const;
+    std::string tw_input_blacklist() const;
+    std::string tw_input_whitelist() const;
+    std::vector<std::string> tw_graphics_backends() const;
+    std::string tw_theme() const;
+
+    bool to_device(Device &device) const;
+
+private:
+    DeviceView(const DeviceDatabasePrivate *db, uint32_t index);
+
+    const DeviceDatabasePrivate *_db;
+    uint32_t _index;
+
+    friend class DeviceDatabase;
+};
+
+class MB_EXPORT DeviceDatabase
+{
+    MB_DECLARE_PRIVATE(DeviceDatabase)
+
+public:
+    DeviceDatabase();
+    ~DeviceDatabase();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(DeviceDatabase)
+
+    bool open_memory(const void *data, size_t size);
+    bool open_file(const std::string &path);
+    void close();
+
+    bool is_open() const;
+
+    size_t size() const;
+
+    bool device(size_t index, Device &device) const;
+    bool find_by_id(const std::string &id, Device &device) const;
+    bool find_by_codename(const std::string &codename, Device &device) const;
+
+    DeviceView view(size_t index) const;
+    DeviceView find_view_by_id(const std::string &id) const;
+    DeviceView find_view_by_codename(const std::string &codename) const;
+
+private:
+    std::unique_ptr<DeviceDatabasePrivate> _priv_ptr;
+};
+
+MB_EXPORT bool device_list_to_database(const std::vector<Device> &devices,
+                                       std::string &out);
+
+}
+}
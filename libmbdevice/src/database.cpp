@@ -0,0 +1,1033 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbdevice/database.h"
+
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <cstdio>
+#include <cstring>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file_util.h"
+#include "mbcommon/file/mmap.h"
+#include "mbcommon/file/standard.h"
+
+/*
+ * Database layout. All integers are little-endian uint32_t values.
+ *
+ *   Header           magic + HEADER_WORDS words
+ *   Device records   device_count * RECORD_WORDS words
+ *   List entries     list_count string references
+ *   Id index         id_buckets displacements + id_slots * SLOT_WORDS words
+ *   Codename index   codename_buckets displacements
+ *                    + codename_slots * SLOT_WORDS words
+ *   String table     strings_size bytes
+ *
+ * A string reference is an (offset, size) pair into the string table and a
+ * list reference is an (index, count) pair into the list entries. Every record
+ * field occupies two words so that scalars, strings, and lists share a single
+ * fixed layout.
+ *
+ * Both indexes are minimal perfect hashes built with hash-and-displace. A key
+ * belongs to bucket hash(key, 0) % buckets and that bucket's displacement seed
+ * places it in slot hash(key, seed) % slots. A slot stores the key's string
+ * reference and the device index so that lookups can reject unknown keys.
+ */
+
+namespace mb
+{
+namespace device
+{
+
+constexpr char DB_MAGIC[8] = { 'M', 'B', 'D', 'E', 'V', 'D', 'B', '\0' };
+constexpr uint32_t DB_VERSION = 1;
+
+enum HeaderWord : size_t
+{
+    HEADER_VERSION,
+    HEADER_DEVICE_COUNT,
+    HEADER_RECORDS_OFFSET,
+    HEADER_LIST_COUNT,
+    HEADER_LISTS_OFFSET,
+    HEADER_ID_BUCKETS,
+    HEADER_ID_SLOTS,
+    HEADER_ID_INDEX_OFFSET,
+    HEADER_CODENAME_BUCKETS,
+    HEADER_CODENAME_SLOTS,
+    HEADER_CODENAME_INDEX_OFFSET,
+    HEADER_STRINGS_SIZE,
+    HEADER_STRINGS_OFFSET,
+    HEADER_WORDS,
+};
+
+enum RecordField : size_t
+{
+    FIELD_ID,
+    FIELD_CODENAMES,
+    FIELD_NAME,
+    FIELD_ARCHITECTURE,
+    FIELD_FLAGS,
+    FIELD_BASE_DIRS,
+    FIELD_SYSTEM_DEVS,
+    FIELD_CACHE_DEVS,
+    FIELD_DATA_DEVS,
+    FIELD_BOOT_DEVS,
+    FIELD_RECOVERY_DEVS,
+    FIELD_EXTRA_DEVS,
+    FIELD_TW_SUPPORTED,
+    FIELD_TW_FLAGS,
+    FIELD_TW_PIXEL_FORMAT,
+    FIELD_TW_FORCE_PIXEL_FORMAT,
+    FIELD_TW_OVERSCAN_PERCENT,
+    FIELD_TW_DEFAULT_X_OFFSET,
+    FIELD_TW_DEFAULT_Y_OFFSET,
+    FIELD_TW_BRIGHTNESS_PATH,
+    FIELD_TW_SECONDARY_BRIGHTNESS_PATH,
+    FIELD_TW_MAX_BRIGHTNESS,
+    FIELD_TW_DEFAULT_BRIGHTNESS,
+    FIELD_TW_BATTERY_PATH,
+    FIELD_TW_CPU_TEMP_PATH,
+    FIELD_TW_INPUT_BLACKLIST,
+    FIELD_TW_INPUT_WHITELIST,
+    FIELD_TW_GRAPHICS_BACKENDS,
+    FIELD_TW_THEME,
+    FIELD_COUNT,
+};
+
+constexpr size_t HEADER_SIZE = sizeof(DB_MAGIC) + HEADER_WORDS * 4;
+constexpr size_t RECORD_WORDS = FIELD_COUNT * 2;
+constexpr size_t SLOT_WORDS = 3;
+constexpr size_t KEYS_PER_BUCKET = 4;
+constexpr uint32_t MAX_DISPLACEMENT_SEED = 1u << 24;
+
+struct Ref
+{
+    uint32_t first;
+    uint32_t second;
+};
+
+/*!
+ * \brief Seeded FNV-1a hash followed by the MurmurHash3 finalizer
+ */
+static uint32_t hash_key(const char *data, size_t size, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+
+    for (size_t i = 0; i < size; ++i) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 16777619u;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static uint32_t read_word(const unsigned char *data, uint64_t offset)
+{
+    uint32_t value;
+    memcpy(&value, data + offset, sizeof(value));
+    return mb_le32toh(value);
+}
+
+static void append_word(std::string &out, uint32_t value)
+{
+    value = mb_htole32(value);
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+// Writer
+
+struct IndexKey
+{
+    std::string key;
+    Ref ref;
+    uint32_t device;
+};
+
+class DatabaseWriter
+{
+public:
+    bool add_device(const Device &device);
+    bool finish(std::string &out);
+
+private:
+    std::string _strings;
+    std::unordered_map<std::string, uint32_t> _string_offsets;
+    std::vector<Ref> _lists;
+    std::vector<uint32_t> _records;
+    std::vector<IndexKey> _id_keys;
+    std::vector<IndexKey> _codename_keys;
+    std::unordered_set<std::string> _seen_ids;
+    std::unordered_set<std::string> _seen_codenames;
+    uint32_t _device_count = 0;
+
+    Ref intern_string(const std::string &str);
+    Ref add_string(const std::string &str);
+    bool add_list(const std::vector<std::string> &list);
+    void add_scalar(uint32_t value);
+};
+
+Ref DatabaseWriter::intern_string(const std::string &str)
+{
+    auto it = _string_offsets.find(str);
+    if (it == _string_offsets.end()) {
+        auto offset = static_cast<uint32_t>(_strings.size());
+        _strings.append(str);
+        _strings.push_back('\0');
+        it = _string_offsets.emplace(str, offset).first;
+    }
+
+    return {it->second, static_cast<uint32_t>(str.size())};
+}
+
+Ref DatabaseWriter::add_string(const std::string &str)
+{
+    Ref ref = intern_string(str);
+    _records.push_back(ref.first);
+    _records.push_back(ref.second);
+    return ref;
+}
+
+bool DatabaseWriter::add_list(const std::vector<std::string> &list)
+{
+    auto index = static_cast<uint32_t>(_lists.size());
+
+    for (auto const &item : list) {
+        _lists.push_back(intern_string(item));
+    }
+
+    _records.push_back(index);
+    _records.push_back(static_cast<uint32_t>(list.size()));
+
+    return _lists.size() <= UINT32_MAX;
+}
+
+void DatabaseWriter::add_scalar(uint32_t value)
+{
+    _records.push_back(value);
+    _records.push_back(0);
+}
+
+bool DatabaseWriter::add_device(const Device &device)
+{
+    if (_device_count == UINT32_MAX) {
+        return false;
+    }
+
+    uint32_t index = _device_count++;
+    auto id = device.id();
+    auto codenames = device.codenames();
+
+    Ref id_ref = add_string(id);
+    if (_seen_ids.insert(id).second) {
+        _id_keys.push_back({id, id_ref, index});
+    }
+
+    auto codenames_index = static_cast<uint32_t>(_lists.size());
+    if (!add_list(codenames)) {
+        return false;
+    }
+    for (size_t i = 0; i < codenames.size(); ++i) {
+        // The first device to claim a codename wins
+        if (_seen_codenames.insert(codenames[i]).second) {
+            _codename_keys.push_back({codenames[i],
+                                      _lists[codenames_index + i], index});
+        }
+    }
+
+    add_string(device.name());
+    add_string(device.architecture());
+    add_scalar(static_cast<uint32_t>(device.flags()));
+    if (!add_list(device.block_dev_base_dirs())
+            || !add_list(device.system_block_devs())
+            || !add_list(device.cache_block_devs())
+            || !add_list(device.data_block_devs())
+            || !add_list(device.boot_block_devs())
+            || !add_list(device.recovery_block_devs())
+            || !add_list(device.extra_block_devs())) {
+        return false;
+    }
+    add_scalar(device.tw_supported());
+    add_scalar(static_cast<uint32_t>(device.tw_flags()));
+    add_scalar(static_cast<uint32_t>(device.tw_pixel_format()));
+    add_scalar(static_cast<uint32_t>(device.tw_force_pixel_format()));
+    add_scalar(static_cast<uint32_t>(device.tw_overscan_percent()));
+    add_scalar(static_cast<uint32_t>(device.tw_default_x_offset()));
+    add_scalar(static_cast<uint32_t>(device.tw_default_y_offset()));
+    add_string(device.tw_brightness_path());
+    add_string(device.tw_secondary_brightness_path());
+    add_scalar(static_cast<uint32_t>(device.tw_max_brightness()));
+    add_scalar(static_cast<uint32_t>(device.tw_default_brightness()));
+    add_string(device.tw_battery_path());
+    add_string(device.tw_cpu_temp_path());
+    add_string(device.tw_input_blacklist());
+    add_string(device.tw_input_whitelist());
+    if (!add_list(device.tw_graphics_backends())) {
+        return false;
+    }
+    add_string(device.tw_theme());
+
+    return _strings.size() <= UINT32_MAX;
+}
+
+/*!
+ * \brief Build a minimal perfect hash index over a set of unique keys
+ *
+ * Buckets are placed largest first. For each bucket, displacement seeds are
+ * tried until every key in the bucket lands in a distinct free slot.
+ *
+ * \param[in] keys Unique keys to index
+ * \param[out] displacements Per-bucket displacement seeds
+ * \param[out] slots Slot words (SLOT_WORDS per key)
+ *
+ * \return Whether a placement was found for every bucket
+ */
+static bool build_index(const std::vector<IndexKey> &keys,
+                        std::vector<uint32_t> &displacements,
+                        std::vector<uint32_t> &slots)
+{
+    size_t n_slots = keys.size();
+    size_t n_buckets = (n_slots + KEYS_PER_BUCKET - 1) / KEYS_PER_BUCKET;
+
+    displacements.assign(n_buckets, 0);
+    slots.assign(n_slots * SLOT_WORDS, 0);
+
+    std::vector<std::vector<size_t>> buckets(n_buckets);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto const &key = keys[i].key;
+        buckets[hash_key(key.data(), key.size(), 0) % n_buckets].push_back(i);
+    }
+
+    std::vector<size_t> order(n_buckets);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    std::vector<bool> used(n_slots);
+    std::vector<size_t> candidate;
+
+    for (size_t b : order) {
+        auto const &bucket = buckets[b];
+        if (bucket.empty()) {
+            break;
+        }
+
+        uint32_t seed = 1;
+
+        for (; seed <= MAX_DISPLACEMENT_SEED; ++seed) {
+            candidate.clear();
+
+            for (size_t i : bucket) {
+                auto const &key = keys[i].key;
+                size_t slot = hash_key(key.data(), key.size(), seed) % n_slots;
+
+                if (used[slot] || std::find(candidate.begin(), candidate.end(),
+                                            slot) != candidate.end()) {
+                    break;
+                }
+                candidate.push_back(slot);
+            }
+
+            if (candidate.size() == bucket.size()) {
+                break;
+            }
+        }
+
+        if (seed > MAX_DISPLACEMENT_SEED) {
+            return false;
+        }
+
+        displacements[b] = seed;
+
+        for (size_t i = 0; i < bucket.size(); ++i) {
+            auto const &key = keys[bucket[i]];
+            size_t slot = candidate[i];
+
+            used[slot] = true;
+            slots[slot * SLOT_WORDS] = key.ref.first;
+            slots[slot * SLOT_WORDS + 1] = key.ref.second;
+            slots[slot * SLOT_WORDS + 2] = key.device;
+        }
+    }
+
+    return true;
+}
+
+bool DatabaseWriter::finish(std::string &out)
+{
+    std::vector<uint32_t> id_displacements;
+    std::vector<uint32_t> id_slots;
+    std::vector<uint32_t> codename_displacements;
+    std::vector<uint32_t> codename_slots;
+
+    if (!build_index(_id_keys, id_displacements, id_slots)
+            || !build_index(_codename_keys, codename_displacements,
+                            codename_slots)) {
+        return false;
+    }
+
+    uint64_t records_offset = HEADER_SIZE;
+    uint64_t lists_offset = records_offset + _records.size() * 4;
+    uint64_t id_index_offset = lists_offset + _lists.size() * 8;
+    uint64_t codename_index_offset = id_index_offset
+            + (id_displacements.size() + id_slots.size()) * 4;
+    uint64_t strings_offset = codename_index_offset
+            + (codename_displacements.size() + codename_slots.size()) * 4;
+
+    if (strings_offset + _strings.size() > UINT32_MAX) {
+        return false;
+    }
+
+    uint32_t header[HEADER_WORDS];
+    header[HEADER_VERSION] = DB_VERSION;
+    header[HEADER_DEVICE_COUNT] = _device_count;
+    header[HEADER_RECORDS_OFFSET] = static_cast<uint32_t>(records_offset);
+    header[HEADER_LIST_COUNT] = static_cast<uint32_t>(_lists.size());
+    header[HEADER_LISTS_OFFSET] = static_cast<uint32_t>(lists_offset);
+    header[HEADER_ID_BUCKETS] =
+            static_cast<uint32_t>(id_displacements.size());
+    header[HEADER_ID_SLOTS] = static_cast<uint32_t>(_id_keys.size());
+    header[HEADER_ID_INDEX_OFFSET] = static_cast<uint32_t>(id_index_offset);
+    header[HEADER_CODENAME_BUCKETS] =
+            static_cast<uint32_t>(codename_displacements.size());
+    header[HEADER_CODENAME_SLOTS] =
+            static_cast<uint32_t>(_codename_keys.size());
+    header[HEADER_CODENAME_INDEX_OFFSET] =
+            static_cast<uint32_t>(codename_index_offset);
+    header[HEADER_STRINGS_SIZE] = static_cast<uint32_t>(_strings.size());
+    header[HEADER_STRINGS_OFFSET] = static_cast<uint32_t>(strings_offset);
+
+    out.clear();
+    out.reserve(static_cast<size_t>(strings_offset + _strings.size()));
+    out.append(DB_MAGIC, sizeof(DB_MAGIC));
+
+    for (uint32_t word : header) {
+        append_word(out, word);
+    }
+    for (uint32_t word : _records) {
+        append_word(out, word);
+    }
+    for (auto const &ref : _lists) {
+        append_word(out, ref.first);
+        append_word(out, ref.second);
+    }
+    for (auto const *words : { &id_displacements, &id_slots,
+                               &codename_displacements, &codename_slots }) {
+        for (uint32_t word : *words) {
+            append_word(out, word);
+        }
+    }
+    out.append(_strings);
+
+    return true;
+}
+
+/*!
+ * \brief Serialize a list of devices into a binary device database
+ *
+ * If multiple devices share an ID or codename, lookups will return the first
+ * device in \p devices.
+ *
+ * \param[in] devices List of devices
+ * \param[out] out Output buffer for the database
+ *
+ * \return Whether the database was successfully built
+ */
+bool device_list_to_database(const std::vector<Device> &devices,
+                             std::string &out)
+{
+    DatabaseWriter writer;
+
+    for (auto const &device : devices) {
+        if (!writer.add_device(device)) {
+            return false;
+        }
+    }
+
+    return writer.finish(out);
+}
+
+// Reader
+
+class DeviceDatabasePrivate
+{
+public:
+    std::unique_ptr<File> file;
+    std::vector<unsigned char> buf;
+
+    const unsigned char *data = nullptr;
+    size_t size = 0;
+    uint32_t header[HEADER_WORDS];
+
+    bool load(const void *data, size_t size);
+    void reset();
+
+    bool range_valid(uint64_t offset, uint64_t size) const;
+    uint32_t field(uint32_t index, RecordField field, size_t word) const;
+    bool read_string(uint32_t offset, uint32_t size, std::string &out) const;
+    bool read_string_field(uint32_t index, RecordField field,
+                           std::string &out) const;
+    bool read_list_field(uint32_t index, RecordField field,
+                         std::vector<std::string> &out) const;
+    bool read_device(uint32_t index, Device &device) const;
+    bool lookup(HeaderWord buckets_word, HeaderWord slots_word,
+                HeaderWord offset_word, const std::string &key,
+                uint32_t &index) const;
+};
+
+bool DeviceDatabasePrivate::range_valid(uint64_t offset, uint64_t size) const
+{
+    return offset <= this->size && size <= this->size - offset;
+}
+
+bool DeviceDatabasePrivate::load(const void *data_, size_t size_)
+{
+    data = static_cast<const unsigned char *>(data_);
+    size = size_;
+
+    if (!data || size < HEADER_SIZE
+            || memcmp(data, DB_MAGIC, sizeof(DB_MAGIC)) != 0) {
+        return false;
+    }
+
+    for (size_t i = 0; i < HEADER_WORDS; ++i) {
+        header[i] = read_word(data, sizeof(DB_MAGIC) + i * 4);
+    }
+
+    if (header[HEADER_VERSION] != DB_VERSION
+            || (header[HEADER_ID_BUCKETS] == 0)
+                    != (header[HEADER_ID_SLOTS] == 0)
+            || (header[HEADER_CODENAME_BUCKETS] == 0)
+                    != (header[HEADER_CODENAME_SLOTS] == 0)) {
+        return false;
+    }
+
+    return range_valid(header[HEADER_RECORDS_OFFSET],
+                       uint64_t(header[HEADER_DEVICE_COUNT])
+                               * RECORD_WORDS * 4)
+            && range_valid(header[HEADER_LISTS_OFFSET],
+                           uint64_t(header[HEADER_LIST_COUNT]) * 8)
+            && range_valid(header[HEADER_ID_INDEX_OFFSET],
+                           (uint64_t(header[HEADER_ID_BUCKETS])
+                                   + uint64_t(header[HEADER_ID_SLOTS])
+                                           * SLOT_WORDS) * 4)
+            && range_valid(header[HEADER_CODENAME_INDEX_OFFSET],
+                           (uint64_t(header[HEADER_CODENAME_BUCKETS])
+                                   + uint64_t(header[HEADER_CODENAME_SLOTS])
+                                           * SLOT_WORDS) * 4)
+            && range_valid(header[HEADER_STRINGS_OFFSET],
+                           header[HEADER_STRINGS_SIZE]);
+}
+
+void DeviceDatabasePrivate::reset()
+{
+    file.reset();
+    buf.clear();
+    buf.shrink_to_fit();
+    data = nullptr;
+    size = 0;
+}
+
+uint32_t DeviceDatabasePrivate::field(uint32_t index, RecordField field,
+                                      size_t word) const
+{
+    return read_word(data, header[HEADER_RECORDS_OFFSET]
+            + (uint64_t(index) * RECORD_WORDS + field * 2 + word) * 4);
+}
+
+bool DeviceDatabasePrivate::read_string(uint32_t offset, uint32_t size,
+                                        std::string &out) const
+{
+    if (uint64_t(offset) + size > header[HEADER_STRINGS_SIZE]) {
+        return false;
+    }
+
+    out.assign(reinterpret_cast<const char *>(data)
+            + header[HEADER_STRINGS_OFFSET] + offset, size);
+    return true;
+}
+
+bool DeviceDatabasePrivate::read_string_field(uint32_t index,
+                                              RecordField field,
+                                              std::string &out) const
+{
+    return read_string(this->field(index, field, 0),
+                       this->field(index, field, 1), out);
+}
+
+bool DeviceDatabasePrivate::read_list_field(uint32_t index, RecordField field,
+                                            std::vector<std::string> &out) const
+{
+    uint32_t first = this->field(index, field, 0);
+    uint32_t count = this->field(index, field, 1);
+
+    if (uint64_t(first) + count > header[HEADER_LIST_COUNT]) {
+        return false;
+    }
+
+    out.resize(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t offset = header[HEADER_LISTS_OFFSET]
+                + (uint64_t(first) + i) * 8;
+
+        if (!read_string(read_word(data, offset),
+                         read_word(data, offset + 4), out[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool DeviceDatabasePrivate::read_device(uint32_t index, Device &device) const
+{
+    if (index >= header[HEADER_DEVICE_COUNT]) {
+        return false;
+    }
+
+    Device result;
+    std::string str;
+    std::vector<std::string> list;
+
+#define STRING_FIELD(FIELD, SETTER) \
+    do { \
+        if (!read_string_field(index, FIELD, str)) { \
+            return false; \
+        } \
+        result.SETTER(std::move(str)); \
+    } while (0)
+#define LIST_FIELD(FIELD, SETTER) \
+    do { \
+        if (!read_list_field(index, FIELD, list)) { \
+            return false; \
+        } \
+        result.SETTER(std::move(list)); \
+    } while (0)
+#define SCALAR_FIELD(FIELD, SETTER, TYPE) \
+    result.SETTER(static_cast<TYPE>(field(index, FIELD, 0)))
+
+    STRING_FIELD(FIELD_ID, set_id);
+    LIST_FIELD(FIELD_CODENAMES, set_codenames);
+    STRING_FIELD(FIELD_NAME, set_name);
+    STRING_FIELD(FIELD_ARCHITECTURE, set_architecture);
+    SCALAR_FIELD(FIELD_FLAGS, set_flags, DeviceFlag);
+    LIST_FIELD(FIELD_BASE_DIRS, set_block_dev_base_dirs);
+    LIST_FIELD(FIELD_SYSTEM_DEVS, set_system_block_devs);
+    LIST_FIELD(FIELD_CACHE_DEVS, set_cache_block_devs);
+    LIST_FIELD(FIELD_DATA_DEVS, set_data_block_devs);
+    LIST_FIELD(FIELD_BOOT_DEVS, set_boot_block_devs);
+    LIST_FIELD(FIELD_RECOVERY_DEVS, set_recovery_block_devs);
+    LIST_FIELD(FIELD_EXTRA_DEVS, set_extra_block_devs);
+    SCALAR_FIELD(FIELD_TW_SUPPORTED, set_tw_supported, bool);
+    SCALAR_FIELD(FIELD_TW_FLAGS, set_tw_flags, TwFlag);
+    SCALAR_FIELD(FIELD_TW_PIXEL_FORMAT, set_tw_pixel_format, TwPixelFormat);
+    SCALAR_FIELD(FIELD_TW_FORCE_PIXEL_FORMAT, set_tw_force_pixel_format,
+                 TwForcePixelFormat);
+    SCALAR_FIELD(FIELD_TW_OVERSCAN_PERCENT, set_tw_overscan_percent, int32_t);
+    SCALAR_FIELD(FIELD_TW_DEFAULT_X_OFFSET, set_tw_default_x_offset, int32_t);
+    SCALAR_FIELD(FIELD_TW_DEFAULT_Y_OFFSET, set_tw_default_y_offset, int32_t);
+    STRING_FIELD(FIELD_TW_BRIGHTNESS_PATH, set_tw_brightness_path);
+    STRING_FIELD(FIELD_TW_SECONDARY_BRIGHTNESS_PATH,
+                 set_tw_secondary_brightness_path);
+    SCALAR_FIELD(FIELD_TW_MAX_BRIGHTNESS, set_tw_max_brightness, int32_t);
+    SCALAR_FIELD(FIELD_TW_DEFAULT_BRIGHTNESS, set_tw_default_brightness,
+                 int32_t);
+    STRING_FIELD(FIELD_TW_BATTERY_PATH, set_tw_battery_path);
+    STRING_FIELD(FIELD_TW_CPU_TEMP_PATH, set_tw_cpu_temp_path);
+    STRING_FIELD(FIELD_TW_INPUT_BLACKLIST, set_tw_input_blacklist);
+    STRING_FIELD(FIELD_TW_INPUT_WHITELIST, set_tw_input_whitelist);
+    LIST_FIELD(FIELD_TW_GRAPHICS_BACKENDS, set_tw_graphics_backends);
+    STRING_FIELD(FIELD_TW_THEME, set_tw_theme);
+
+#undef STRING_FIELD
+#undef LIST_FIELD
+#undef SCALAR_FIELD
+
+    device = std::move(result);
+    return true;
+}
+
+bool DeviceDatabasePrivate::lookup(HeaderWord buckets_word,
+                                   HeaderWord slots_word,
+                                   HeaderWord offset_word,
+                                   const std::string &key,
+                                   uint32_t &index) const
+{
+    uint32_t n_buckets = header[buckets_word];
+    uint32_t n_slots = header[slots_word];
+    uint64_t offset = header[offset_word];
+
+    if (n_slots == 0) {
+        return false;
+    }
+
+    uint32_t bucket = hash_key(key.data(), key.size(), 0) % n_buckets;
+    uint32_t seed = read_word(data, offset + uint64_t(bucket) * 4);
+    uint32_t slot = hash_key(key.data(), key.size(), seed) % n_slots;
+    uint64_t slot_offset = offset + uint64_t(n_buckets) * 4
+            + uint64_t(slot) * SLOT_WORDS * 4;
+
+    uint32_t str_offset = read_word(data, slot_offset);
+    uint32_t str_size = read_word(data, slot_offset + 4);
+
+    if (str_size != key.size()
+            || uint64_t(str_offset) + str_size > header[HEADER_STRINGS_SIZE]
+            || memcmp(data + header[HEADER_STRINGS_OFFSET] + str_offset,
+                      key.data(), str_size) != 0) {
+        return false;
+    }
+
+    index = read_word(data, slot_offset + 8);
+    return true;
+}
+
+/*!
+ * \class DeviceDatabase
+ *
+ * \brief Read-only view of a binary device database
+ *
+ * The database is accessed in place. Opening it only validates the header and
+ * section bounds and lookups by ID or codename are a single perfect hash probe.
+ * Only the records that are looked up are decoded into Device objects.
+ */
+
+DeviceDatabase::DeviceDatabase()
+    : _priv_ptr(new DeviceDatabasePrivate())
+{
+}
+
+DeviceDatabase::~DeviceDatabase()
+{
+}
+
+/*!
+ * \brief Open database from memory
+ *
+ * The memory is not copied and must remain valid until the database is closed.
+ *
+ * \param data Pointer to database
+ * \param size Size of database
+ *
+ * \return Whether the database header is valid
+ */
+bool DeviceDatabase::open_memory(const void *data, size_t size)
+{
+    MB_PRIVATE(DeviceDatabase);
+
+    priv->reset();
+
+    if (!priv->load(data, size)) {
+        priv->reset();
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Open database from a file
+ *
+ * On Unix-like systems, the file is memory mapped if possible. Otherwise, it is
+ * read into memory.
+ *
+ * \param path Path to database
+ *
+ * \return Whether the file was opened and the database header is valid
+ */
+bool DeviceDatabase::open_file(const std::string &path)
+{
+    MB_PRIVATE(DeviceDatabase);
+
+    priv->reset();
+
+    uint64_t size;
+
+#ifndef _WIN32
+    {
+        std::unique_ptr<File> file(new MmapFile(path));
+        const void *data;
+        size_t data_size;
+
+        if (file->is_open() && file->seek(0, SEEK_END, &size)
+                && size <= SIZE_MAX
+                && file->map_range(0, static_cast<size_t>(size),
+                                   data, data_size)
+                && priv->load(data, data_size)) {
+            priv->file = std::move(file);
+            return true;
+        }
+
+        priv->reset();
+    }
+#endif
+
+    StandardFile file(path, FileOpenMode::READ_ONLY);
+    size_t n;
+
+    if (!file.is_open() || !file.seek(0, SEEK_END, &size) || size > SIZE_MAX
+            || !file.seek(0, SEEK_SET, nullptr)) {
+        return false;
+    }
+
+    priv->buf.resize(static_cast<size_t>(size));
+
+    if (!file_read_fully(file, priv->buf.data(), priv->buf.size(), n)
+            || n != priv->buf.size()
+            || !priv->load(priv->buf.data(), priv->buf.size())) {
+        priv->reset();
+        return false;
+    }
+
+    return true;
+}
+
+void DeviceDatabase::close()
+{
+    MB_PRIVATE(DeviceDatabase);
+    priv->reset();
+}
+
+bool DeviceDatabase::is_open() const
+{
+    auto priv = _priv_func();
+    return priv->data != nullptr;
+}
+
+/*!
+ * \brief Number of devices in the database
+ */
+size_t DeviceDatabase::size() const
+{
+    auto priv = _priv_func();
+    return priv->data ? priv->header[HEADER_DEVICE_COUNT] : 0;
+}
+
+/*!
+ * \brief Decode device at index
+ *
+ * \param[in] index Device index
+ * \param[out] device Device to store the result
+ *
+ * \return Whether the index is valid and the record could be decoded
+ */
+bool DeviceDatabase::device(size_t index, Device &device) const
+{
+    return view(index).to_device(device);
+}
+
+/*!
+ * \brief Find device by ID
+ *
+ * \param[in] id Device ID
+ * \param[out] device Device to store the result
+ *
+ * \return Whether a device with the specified ID exists
+ */
+bool DeviceDatabase::find_by_id(const std::string &id, Device &device) const
+{
+    return find_view_by_id(id).to_device(device);
+}
+
+/*!
+ * \brief Find device by codename
+ *
+ * \param[in] codename Device codename
+ * \param[out] device Device to store the result
+ *
+ * \return Whether a device with the specified codename exists
+ */
+bool DeviceDatabase::find_by_codename(const std::string &codename,
+                                      Device &device) const
+{
+    return find_view_by_codename(codename).to_device(device);
+}
+
+/*!
+ * \brief Get lazy view of device at index
+ *
+ * \return DeviceView for the device or an invalid view if the index is out of
+ *         range
+ */
+DeviceView DeviceDatabase::view(size_t index) const
+{
+    auto priv = _priv_func();
+
+    if (!priv->data || index >= priv->header[HEADER_DEVICE_COUNT]) {
+        return {};
+    }
+
+    return { priv, static_cast<uint32_t>(index) };
+}
+
+/*!
+ * \brief Find lazy view of device by ID
+ *
+ * \return DeviceView for the device or an invalid view if no device has the
+ *         specified ID
+ */
+DeviceView DeviceDatabase::find_view_by_id(const std::string &id) const
+{
+    auto priv = _priv_func();
+    uint32_t index;
+
+    if (!priv->data || !priv->lookup(HEADER_ID_BUCKETS, HEADER_ID_SLOTS,
+                                     HEADER_ID_INDEX_OFFSET, id, index)) {
+        return {};
+    }
+
+    return view(index);
+}
+
+/*!
+ * \brief Find lazy view of device by codename
+ *
+ * \return DeviceView for the device or an invalid view if no device has the
+ *         specified codename
+ */
+DeviceView
+DeviceDatabase::find_view_by_codename(const std::string &codename) const
+{
+    auto priv = _priv_func();
+    uint32_t index;
+
+    if (!priv->data || !priv->lookup(HEADER_CODENAME_BUCKETS,
+                                     HEADER_CODENAME_SLOTS,
+                                     HEADER_CODENAME_INDEX_OFFSET,
+                                     codename, index)) {
+        return {};
+    }
+
+    return view(index);
+}
+
+/*!
+ * \class DeviceView
+ *
+ * \brief Lazily decoded device record in a DeviceDatabase
+ *
+ * A view is only a reference to a record. Each getter decodes just the
+ * requested field, so callers that only need a device's ID, codenames, or
+ * architecture never materialize its block device lists or Boot UI options.
+ *
+ * A view remains valid until its database is closed or reopened. The getters
+ * of an invalid view return empty or zero values.
+ */
+
+DeviceView::DeviceView()
+    : DeviceView(nullptr, 0)
+{
+}
+
+DeviceView::DeviceView(const DeviceDatabasePrivate *db, uint32_t index)
+    : _db(db)
+    , _index(index)
+{
+}
+
+bool DeviceView::is_valid() const
+{
+    return _db != nullptr;
+}
+
+/*!
+ * \brief Decode all fields into a Device
+ *
+ * \param[out] device Device to store the result
+ *
+ * \return Whether the view is valid and the record could be decoded
+ */
+bool DeviceView::to_device(Device &device) const
+{
+    return _db && _db->read_device(_index, device);
+}
+
+#define STRING_GETTER(NAME, FIELD) \
+    std::string DeviceView::NAME() const \
+    { \
+        std::string result; \
+        if (_db && !_db->read_string_field(_index, FIELD, result)) { \
+            result.clear(); \
+        } \
+        return result; \
+    }
+#define LIST_GETTER(NAME, FIELD) \
+    std::vector<std::string> DeviceView::NAME() const \
+    { \
+        std::vector<std::string> result; \
+        if (_db && !_db->read_list_field(_index, FIELD, result)) { \
+            result.clear(); \
+        } \
+        return result; \
+    }
+#define SCALAR_GETTER(TYPE, NAME, FIELD, CAST) \
+    TYPE DeviceView::NAME() const \
+    { \
+        return _db ? static_cast<CAST>(_db->field(_index, FIELD, 0)) \
+                : TYPE(); \
+    }
+
+STRING_GETTER(id, FIELD_ID)
+LIST_GETTER(codenames, FIELD_CODENAMES)
+STRING_GETTER(name, FIELD_NAME)
+STRING_GETTER(architecture, FIELD_ARCHITECTURE)
+SCALAR_GETTER(DeviceFlags, flags, FIELD_FLAGS, DeviceFlag)
+LIST_GETTER(block_dev_base_dirs, FIELD_BASE_DIRS)
+LIST_GETTER(system_block_devs, FIELD_SYSTEM_DEVS)
+LIST_GETTER(cache_block_devs, FIELD_CACHE_DEVS)
+LIST_GETTER(data_block_devs, FIELD_DATA_DEVS)
+LIST_GETTER(boot_block_devs, FIELD_BOOT_DEVS)
+LIST_GETTER(recovery_block_devs, FIELD_RECOVERY_DEVS)
+LIST_GETTER(extra_block_devs, FIELD_EXTRA_DEVS)
+SCALAR_GETTER(bool, tw_supported, FIELD_TW_SUPPORTED, bool)
+SCALAR_GETTER(TwFlags, tw_flags, FIELD_TW_FLAGS, TwFlag)
+SCALAR_GETTER(TwPixelFormat, tw_pixel_format, FIELD_TW_PIXEL_FORMAT,
+              TwPixelFormat)
+SCALAR_GETTER(TwForcePixelFormat, tw_force_pixel_format,
+              FIELD_TW_FORCE_PIXEL_FORMAT, TwForcePixelFormat)
+SCALAR_GETTER(int, tw_overscan_percent, FIELD_TW_OVERSCAN_PERCENT, int32_t)
+SCALAR_GETTER(int, tw_default_x_offset, FIELD_TW_DEFAULT_X_OFFSET, int32_t)
+SCALAR_GETTER(int, tw_default_y_offset, FIELD_TW_DEFAULT_Y_OFFSET, int32_t)
+STRING_GETTER(tw_brightness_path, FIELD_TW_BRIGHTNESS_PATH)
+STRING_GETTER(tw_secondary_brightness_path, FIELD_TW_SECONDARY_BRIGHTNESS_PATH)
+SCALAR_GETTER(int, tw_max_brightness, FIELD_TW_MAX_BRIGHTNESS, int32_t)
+SCALAR_GETTER(int, tw_default_brightness, FIELD_TW_DEFAULT_BRIGHTNESS, int32_t)
+STRING_GETTER(tw_battery_path, FIELD_TW_BATTERY_PATH)
+STRING_GETTER(tw_cpu_temp_path, FIELD_TW_CPU_TEMP_PATH)
+STRING_GETTER(tw_input_blacklist, FIELD_TW_INPUT_BLACKLIST)
+STRING_GETTER(tw_input_whitelist, FIELD_TW_INPUT_WHITELIST)
+LIST_GETTER(tw_graphics_backends, FIELD_TW_GRAPHICS_BACKENDS)
+STRING_GETTER(tw_theme, FIELD_TW_THEME)
+
+#undef STRING_GETTER
+#undef LIST_GETTER
+#undef SCALAR_GETTER
+
+}
+}
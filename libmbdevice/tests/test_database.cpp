@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include "mbdevice/database.h"
+
+using namespace mb::device;
+
+static Device make_device(const std::string &id,
+                          std::vector<std::string> codenames)
+{
+    Device device;
+    device.set_id(id);
+    device.set_codenames(std::move(codenames));
+    device.set_name("Device " + id);
+    device.set_architecture(ARCH_ARM64_V8A);
+    device.set_flags(DeviceFlag::HasCombinedBootAndRecovery);
+    device.set_block_dev_base_dirs({"/dev/block/bootdevice/by-name"});
+    device.set_system_block_devs({"/dev/block/bootdevice/by-name/system",
+                                  "/dev/block/sda1"});
+    device.set_cache_block_devs({"/dev/block/bootdevice/by-name/cache"});
+    device.set_data_block_devs({"/dev/block/bootdevice/by-name/userdata"});
+    device.set_boot_block_devs({"/dev/block/bootdevice/by-name/boot"});
+    device.set_recovery_block_devs({"/dev/block/bootdevice/by-name/recovery"});
+    device.set_extra_block_devs({"/dev/block/bootdevice/by-name/modem"});
+    device.set_tw_supported(true);
+    device.set_tw_flags(TwFlag::TouchscreenSwapXY | TwFlag::RoundScreen);
+    device.set_tw_pixel_format(TwPixelFormat::Rgba8888);
+    device.set_tw_force_pixel_format(TwForcePixelFormat::Rgb565);
+    device.set_tw_overscan_percent(10);
+    device.set_tw_default_x_offset(-20);
+    device.set_tw_default_y_offset(30);
+    device.set_tw_brightness_path("/sys/class/backlight");
+    device.set_tw_secondary_brightness_path("/sys/class/backlight2");
+    device.set_tw_max_brightness(255);
+    device.set_tw_default_brightness(-1);
+    device.set_tw_battery_path("/sys/class/battery");
+    device.set_tw_cpu_temp_path("/sys/class/temp");
+    device.set_tw_input_blacklist("foo");
+    device.set_tw_input_whitelist("bar");
+    device.set_tw_graphics_backends({"overlay_msm_old", "fbdev"});
+    device.set_tw_theme("portrait_hdpi");
+    return device;
+}
+
+static std::vector<Device> make_devices(size_t count)
+{
+    std::vector<Device> devices;
+
+    for (size_t i = 0; i < count; ++i) {
+        auto id = "device" + std::to_string(i);
+        devices.push_back(make_device(id, {id + "a", id + "b", id + "c"}));
+    }
+
+    return devices;
+}
+
+TEST(DatabaseTest, RoundTripAllDevices)
+{
+    auto devices = make_devices(100);
+    std::string data;
+    ASSERT_TRUE(device_list_to_database(devices, data));
+
+    DeviceDatabase db;
+    ASSERT_TRUE(db.open_memory(data.data(), data.size()));
+    ASSERT_TRUE(db.is_open());
+    ASSERT_EQ(db.size(), devices.size());
+
+    for (size_t i = 0; i < devices.size(); ++i) {
+        Device device;
+        ASSERT_TRUE(db.device(i, device));
+        ASSERT_EQ(device, devices[i]);
+    }
+
+    Device device;
+    ASSERT_FALSE(db.device(devices.size(), device));
+}
+
+TEST(DatabaseTest, FindByIdAndCodename)
+{
+    auto devices = make_devices(100);
+    std::string data;
+    ASSERT_TRUE(device_list_to_database(devices, data));
+
+    DeviceDatabase db;
+    ASSERT_TRUE(db.open_memory(data.data(), data.size()));
+
+    for (auto const &expected : devices) {
+        Device device;
+        ASSERT_TRUE(db.find_by_id(expected.id(), device));
+        ASSERT_EQ(device, expected);
+
+        for (auto const &codename : expected.codenames()) {
+            Device device2;
+            ASSERT_TRUE(db.find_by_codename(codename, device2));
+            ASSERT_EQ(device2, expected);
+        }
+    }
+
+    Device device;
+    ASSERT_FALSE(db.find_by_id("device100", device));
+    ASSERT_FALSE(db.find_by_id("device0a", device));
+    ASSERT_FALSE(db.find_by_codename("device0", device));
+    ASSERT_FALSE(db.find_by_codename("", device));
+}
+
+TEST(DatabaseTest, FirstDeviceWinsDuplicateCodename)
+{
+    std::vector<Device> devices{
+        make_device("first", {"shared", "first"}),
+        make_device("second", {"second", "shared"}),
+    };
+    std::string data;
+    ASSERT_TRUE(device_list_to_database(devices, data));
+
+    DeviceDatabase db;
+    ASSERT_TRUE(db.open_memory(data.data(), data.size()));
+
+    Device device;
+    ASSERT_TRUE(db.find_by_codename("shared", device));
+    ASSERT_EQ(device.id(), "first");
+    ASSERT_TRUE(db.find_by_codename("second", device));
+    ASSERT_EQ(device.id(), "second");
+}
+
+TEST(DatabaseTest, EmptyDatabase)
+{
+    std::string data;
+    ASSERT_TRUE(device_list_to_database({}, data));
+
+    DeviceDatabase db;
+    ASSERT_TRUE(db.open_memory(data.data(), data.size()));
+    ASSERT_EQ(db.size(), 0u);
+
+    Device device;
+    ASSERT_FALSE(db.device(0, device));
+    ASSERT_FALSE(db.find_by_id("test", device));
+    ASSERT_FALSE(db.find_by_codename("test", device));
+}
+
+TEST(DatabaseTest, RejectInvalidData)
+{
+    auto devices = make_devices(10);
+    std::string data;
+    ASSERT_TRUE(device_list_to_database(devices, data));
+
+    DeviceDatabase db;
+
+    // Truncated header
+    ASSERT_FALSE(db.open_memory(data.data(), 16));
+    ASSERT_FALSE(db.is_open());
+
+    // Truncated sections
+    ASSERT_FALSE(db.open_memory(data.data(), data.size() - 1));
+
+    // Bad magic
+    std::string bad_magic = data;
+    bad_magic[0] = 'X';
+    ASSERT_FALSE(db.open_memory(bad_magic.data(), bad_magic.size()));
+
+    // Bad version
+    std::string bad_version = data;
+    bad_version[8] = 0x7f;
+    ASSERT_FALSE(db.open_memory(bad_version.data(), bad_version.size()));
+
+    ASSERT_TRUE(db.open_memory(data.data(), data.size()));
+    db.close();
+    ASSERT_FALSE(db.is_open());
+    ASSERT_EQ(db.size(), 0u);
+}
+
+TEST(DatabaseTest, OpenMissingFile)
+{
+    DeviceDatabase db;
+    ASSERT_FALSE(db.open_file("/nonexistent/devices.bin"));
+    ASSERT_FALSE(db.is_open());
+}
+
+TEST(DatabaseTest, ViewMatchesDevice)
+{
+    auto devices = make_devices(20);
+    std::string data;
+    ASSERT_TRUE(device_list_to_database(devices, data));
+
+    DeviceDatabase db;
+    ASSERT_TRUE(db.open_memory(data.data(), data.size()));
+
+    auto view = db.find_view_by_codename("device7b");
+    ASSERT_TRUE(view.is_valid());
+
+    auto const &d = devices[7];
+    ASSERT_EQ(view.id(), d.id());
+    ASSERT_EQ(view.codenames(), d.codenames());
+    ASSERT_EQ(view.name(), d.name());
+    ASSERT_EQ(view.architecture(), d.architecture());
+    ASSERT_EQ(view.flags(), d.flags());
+    ASSERT_EQ(view.block_dev_base_dirs(), d.block_dev_base_dirs());
+    ASSERT_EQ(view.system_block_devs(), d.system_block_devs());
+    ASSERT_EQ(view.cache_block_devs(), d.cache_block_devs());
+    ASSERT_EQ(view.data_block_devs(), d.data_block_devs());
+    ASSERT_EQ(view.boot_block_devs(), d.boot_block_devs());
+    ASSERT_EQ(view.recovery_block_devs(), d.recovery_block_devs());
+    ASSERT_EQ(view.extra_block_devs(), d.extra_block_devs());
+    ASSERT_EQ(view.tw_supported(), d.tw_supported());
+    ASSERT_EQ(view.tw_flags(), d.tw_flags());
+    ASSERT_EQ(view.tw_pixel_format(), d.tw_pixel_format());
+    ASSERT_EQ(view.tw_force_pixel_format(), d.tw_force_pixel_format());
+    ASSERT_EQ(view.tw_overscan_percent(), d.tw_overscan_percent());
+    ASSERT_EQ(view.tw_default_x_offset(), d.tw_default_x_offset());
+    ASSERT_EQ(view.tw_default_y_offset(), d.tw_default_y_offset());
+    ASSERT_EQ(view.tw_brightness_path(), d.tw_brightness_path());
+    ASSERT_EQ(view.tw_secondary_brightness_path(),
+              d.tw_secondary_brightness_path());
+    ASSERT_EQ(view.tw_max_brightness(), d.tw_max_brightness());
+    ASSERT_EQ(view.tw_default_brightness(), d.tw_default_brightness());
+    ASSERT_EQ(view.tw_battery_path(), d.tw_battery_path());
+    ASSERT_EQ(view.tw_cpu_temp_path(), d.tw_cpu_temp_path());
+    ASSERT_EQ(view.tw_input_blacklist(), d.tw_input_blacklist());
+    ASSERT_EQ(view.tw_input_whitelist(), d.tw_input_whitelist());
+    ASSERT_EQ(view.tw_graphics_backends(), d.tw_graphics_backends());
+    ASSERT_EQ(view.tw_theme(), d.tw_theme());
+
+    Device device;
+    ASSERT_TRUE(view.to_device(device));
+    ASSERT_EQ(device, d);
+
+    ASSERT_TRUE(db.view(3).is_valid());
+    ASSERT_EQ(db.view(3).id(), "device3");
+    ASSERT_TRUE(db.find_view_by_id("device5").is_valid());
+}
+
+TEST(DatabaseTest, InvalidView)
+{
+    DeviceDatabase db;
+    ASSERT_FALSE(db.view(0).is_valid());
+    ASSERT_FALSE(db.find_view_by_id("test").is_valid());
+    ASSERT_FALSE(db.find_view_by_codename("test").is_valid());
+
+    DeviceView view;
+    ASSERT_FALSE(view.is_valid());
+    ASSERT_TRUE(view.id().empty());
+    ASSERT_TRUE(view.codenames().empty());
+    ASSERT_FALSE(view.flags());
+    ASSERT_EQ(view.tw_max_brightness(), 0);
+
+    Device device;
+    ASSERT_FALSE(view.to_device(device));
+}
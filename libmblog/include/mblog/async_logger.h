@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mblog/base_logger.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#define ASYNC_LOG_MSG_SIZE 512
+
+namespace mb
+{
+namespace log
+{
+
+class MB_EXPORT AsyncLogger : public BaseLogger
+{
+public:
+    AsyncLogger(std::shared_ptr<BaseLogger> logger, size_t capacity = 256);
+
+    virtual ~AsyncLogger();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(AsyncLogger)
+
+    virtual void log(LogLevel prio, const char *fmt, va_list ap) override;
+
+    void flush();
+
+    uint64_t dropped() const;
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> seq;
+        LogLevel prio;
+        char msg[ASYNC_LOG_MSG_SIZE];
+    };
+
+    std::shared_ptr<BaseLogger> _logger;
+    std::unique_ptr<Slot[]> _slots;
+    size_t _mask;
+
+    std::atomic<size_t> _enqueue_pos;
+    std::atomic<size_t> _dequeue_pos;
+    std::atomic<uint64_t> _dropped;
+    uint64_t _reported_dropped;
+
+    // Held by whoever is draining the ring (writer thread or flush())
+    std::mutex _drain_mutex;
+
+    std::mutex _wait_mutex;
+    std::condition_variable _wait_cv;
+    std::atomic<bool> _sleeping;
+    bool _stop;
+
+    unsigned int _fork_generation;
+    std::unique_ptr<std::thread> _thread;
+
+    bool push(LogLevel prio, const char *msg, size_t size);
+    bool empty() const;
+    bool drain_locked();
+    void run();
+};
+
+}
+}
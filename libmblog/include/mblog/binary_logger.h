@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mblog/base_logger.h"
+
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include <cstdint>
+
+#define BINARY_LOG_MSG_SIZE 512
+
+namespace mb
+{
+namespace log
+{
+
+enum class BinaryLogRecordType : uint8_t
+{
+    Padding = 0,
+    // |text| is the log tag of the process that opened the log
+    Session = 1,
+    // |text| is the formatted message
+    Message = 2,
+};
+
+struct BinaryLogRecord
+{
+    BinaryLogRecordType type;
+    LogLevel level;
+    uint32_t pid;
+    // Nanoseconds since the Unix epoch
+    uint64_t timestamp;
+    std::string text;
+};
+
+class MB_EXPORT BinaryLogger : public BaseLogger
+{
+public:
+    BinaryLogger(const std::string &path, size_t capacity);
+
+    virtual ~BinaryLogger();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(BinaryLogger)
+
+    bool is_open() const;
+
+    virtual void log(LogLevel prio, const char *fmt, va_list ap) override;
+
+private:
+    int _fd;
+    unsigned char *_map;
+    size_t _map_size;
+    std::mutex _mutex;
+    char _buf[BINARY_LOG_MSG_SIZE];
+
+    void write_record(BinaryLogRecordType type, LogLevel level,
+                      const char *data, size_t size);
+};
+
+MB_EXPORT bool binary_log_read(
+        const std::string &path,
+        const std::function<bool(const BinaryLogRecord &)> &callback);
+
+}
+}
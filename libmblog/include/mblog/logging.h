@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <memory>
 
 #include <cstdarg>
@@ -27,23 +28,54 @@
 #include "mblog/base_logger.h"
 #include "mblog/log_level.h"
 
-#define LOGE(...) mb::log::log(mb::log::LogLevel::Error, __VA_ARGS__)
-#define LOGW(...) mb::log::log(mb::log::LogLevel::Warning, __VA_ARGS__)
-#define LOGI(...) mb::log::log(mb::log::LogLevel::Info, __VA_ARGS__)
-#define LOGD(...) mb::log::log(mb::log::LogLevel::Debug, __VA_ARGS__)
-#define LOGV(...) mb::log::log(mb::log::LogLevel::Verbose, __VA_ARGS__)
+/*
+ * Messages less severe than MBLOG_MIN_LEVEL are compiled out. It may be set to
+ * the name of any LogLevel value (eg. -DMBLOG_MIN_LEVEL=Info). Messages that
+ * pass the compile-time check are also filtered at runtime by log_set_level().
+ * In both cases, filtered messages do not evaluate their arguments.
+ */
+#ifndef MBLOG_MIN_LEVEL
+#  define MBLOG_MIN_LEVEL Verbose
+#endif
+
+#define MBLOG_ENABLED(LEVEL) \
+    (mb::log::LogLevel::LEVEL <= mb::log::LogLevel::MBLOG_MIN_LEVEL \
+            && mb::log::log_level_enabled(mb::log::LogLevel::LEVEL))
 
-#define VLOGE(...) mb::log::logv(mb::log::LogLevel::Error, __VA_ARGS__)
-#define VLOGW(...) mb::log::logv(mb::log::LogLevel::Warning, __VA_ARGS__)
-#define VLOGI(...) mb::log::logv(mb::log::LogLevel::Info, __VA_ARGS__)
-#define VLOGD(...) mb::log::logv(mb::log::LogLevel::Debug, __VA_ARGS__)
-#define VLOGV(...) mb::log::logv(mb::log::LogLevel::Verbose, __VA_ARGS__)
+#define MBLOG_CALL(FUNC, LEVEL, ...) \
+    (MBLOG_ENABLED(LEVEL) \
+            ? mb::log::FUNC(mb::log::LogLevel::LEVEL, __VA_ARGS__) \
+            : static_cast<void>(0))
+
+#define LOGE(...) MBLOG_CALL(log, Error, __VA_ARGS__)
+#define LOGW(...) MBLOG_CALL(log, Warning, __VA_ARGS__)
+#define LOGI(...) MBLOG_CALL(log, Info, __VA_ARGS__)
+#define LOGD(...) MBLOG_CALL(log, Debug, __VA_ARGS__)
+#define LOGV(...) MBLOG_CALL(log, Verbose, __VA_ARGS__)
+
+#define VLOGE(...) MBLOG_CALL(logv, Error, __VA_ARGS__)
+#define VLOGW(...) MBLOG_CALL(logv, Warning, __VA_ARGS__)
+#define VLOGI(...) MBLOG_CALL(logv, Info, __VA_ARGS__)
+#define VLOGD(...) MBLOG_CALL(logv, Debug, __VA_ARGS__)
+#define VLOGV(...) MBLOG_CALL(logv, Verbose, __VA_ARGS__)
 
 namespace mb
 {
 namespace log
 {
 
+namespace detail
+{
+MB_EXPORT extern std::atomic<LogLevel> log_level;
+}
+
+inline bool log_level_enabled(LogLevel prio)
+{
+    return prio <= detail::log_level.load(std::memory_order_relaxed);
+}
+
+MB_EXPORT LogLevel log_get_level();
+MB_EXPORT void log_set_level(LogLevel level);
 MB_EXPORT const char * get_log_tag();
 MB_EXPORT void set_log_tag(const char *tag);
 MB_EXPORT void log_set_logger(std::shared_ptr<BaseLogger> logger);
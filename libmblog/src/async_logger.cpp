@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mblog/async_logger.h"
+
+#include <algorithm>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#  include <pthread.h>
+#endif
+
+namespace mb
+{
+namespace log
+{
+
+// Maximum number of messages written per drain pass
+constexpr size_t ASYNC_LOG_BATCH_SIZE = 64;
+
+static std::atomic<unsigned int> fork_generation{0};
+
+#ifndef _WIN32
+static void on_fork_child()
+{
+    fork_generation.fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
+static void register_fork_handler()
+{
+#ifndef _WIN32
+    static std::once_flag once;
+    std::call_once(once, []{
+        pthread_atfork(nullptr, nullptr, &on_fork_child);
+    });
+#endif
+}
+
+MB_PRINTF(3, 4)
+static void log_to(BaseLogger &logger, LogLevel prio, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    logger.log(prio, fmt, ap);
+    va_end(ap);
+}
+
+/*!
+ * \class AsyncLogger
+ *
+ * \brief Logger that hands messages to a background writer thread
+ *
+ * Callers format messages into a per-thread buffer and push them onto a
+ * bounded lock-free multi-producer, single-consumer ring. A writer thread
+ * drains the ring in batches and passes each message to the wrapped logger.
+ * If the ring is full, the message is dropped and counted. The count is
+ * reported through the wrapped logger the next time the ring is drained.
+ *
+ * In a child process created with fork(), the writer thread no longer exists,
+ * so messages are passed to the wrapped logger synchronously.
+ */
+
+/*!
+ * \brief Construct a new AsyncLogger
+ *
+ * \param logger Logger that receives messages from the writer thread
+ * \param capacity Number of messages the ring can hold. This is rounded up to
+ *                 a power of two.
+ */
+AsyncLogger::AsyncLogger(std::shared_ptr<BaseLogger> logger, size_t capacity)
+    : _logger(std::move(logger))
+    , _enqueue_pos(0)
+    , _dequeue_pos(0)
+    , _dropped(0)
+    , _reported_dropped(0)
+    , _sleeping(false)
+    , _stop(false)
+{
+    register_fork_handler();
+    _fork_generation = fork_generation.load(std::memory_order_relaxed);
+
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    _slots.reset(new Slot[size]);
+    _mask = size - 1;
+
+    for (size_t i = 0; i < size; ++i) {
+        _slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    _thread.reset(new std::thread(&AsyncLogger::run, this));
+}
+
+AsyncLogger::~AsyncLogger()
+{
+    if (_fork_generation != fork_generation.load(std::memory_order_relaxed)) {
+        // The thread belongs to the parent process and cannot be joined
+        _thread.release();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_wait_mutex);
+        _stop = true;
+        _wait_cv.notify_one();
+    }
+
+    _thread->join();
+
+    flush();
+}
+
+void AsyncLogger::log(LogLevel prio, const char *fmt, va_list ap)
+{
+    if (_fork_generation != fork_generation.load(std::memory_order_relaxed)) {
+        _logger->log(prio, fmt, ap);
+        return;
+    }
+
+    static thread_local char buf[ASYNC_LOG_MSG_SIZE];
+
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    if (n < 0) {
+        return;
+    }
+
+    if (!push(prio, buf, std::min(static_cast<size_t>(n), sizeof(buf) - 1))) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // Pairs with the fence in run() so that either the writer thread sees the
+    // new message or this thread sees that the writer thread is sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (_sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(_wait_mutex);
+        _wait_cv.notify_one();
+    }
+}
+
+/*!
+ * \brief Write all queued messages from the calling thread
+ *
+ * This does not wait for the writer thread, so it is safe to call from crash
+ * paths right before the process exits.
+ */
+void AsyncLogger::flush()
+{
+    std::lock_guard<std::mutex> lock(_drain_mutex);
+
+    while (drain_locked());
+}
+
+/*!
+ * \brief Number of messages dropped because the ring was full
+ */
+uint64_t AsyncLogger::dropped() const
+{
+    return _dropped.load(std::memory_order_relaxed);
+}
+
+bool AsyncLogger::push(LogLevel prio, const char *msg, size_t size)
+{
+    size_t pos = _enqueue_pos.load(std::memory_order_relaxed);
+    Slot *slot;
+
+    while (true) {
+        slot = &_slots[pos & _mask];
+        size_t seq = slot->seq.load(std::memory_order_acquire);
+        auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+        if (diff == 0) {
+            if (_enqueue_pos.compare_exchange_weak(
+                    pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Full
+            return false;
+        } else {
+            pos = _enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->prio = prio;
+    memcpy(slot->msg, msg, size);
+    slot->msg[size] = '\0';
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    return true;
+}
+
+bool AsyncLogger::empty() const
+{
+    size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+    size_t seq = _slots[pos & _mask].seq.load(std::memory_order_acquire);
+    return seq != pos + 1;
+}
+
+/*!
+ * \brief Write up to ASYNC_LOG_BATCH_SIZE queued messages
+ *
+ * \pre _drain_mutex is held by the caller
+ *
+ * \return Whether any message was written
+ */
+bool AsyncLogger::drain_locked()
+{
+    size_t pos = _dequeue_pos.load(std::memory_order_relaxed);
+    size_t count = 0;
+
+    for (; count < ASYNC_LOG_BATCH_SIZE; ++count, ++pos) {
+        Slot &slot = _slots[pos & _mask];
+        if (slot.seq.load(std::memory_order_acquire) != pos + 1) {
+            break;
+        }
+
+        log_to(*_logger, slot.prio, "%s", slot.msg);
+
+        slot.seq.store(pos + _mask + 1, std::memory_order_release);
+        _dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+    }
+
+    uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+    if (dropped != _reported_dropped) {
+        log_to(*_logger, LogLevel::Warning, "%" PRIu64 " log messages dropped",
+               dropped - _reported_dropped);
+        _reported_dropped = dropped;
+    }
+
+    return count > 0;
+}
+
+void AsyncLogger::run()
+{
+    std::unique_lock<std::mutex> lock(_wait_mutex);
+
+    while (!_stop) {
+        lock.unlock();
+
+        bool wrote;
+        {
+            std::lock_guard<std::mutex> drain_lock(_drain_mutex);
+            wrote = drain_locked();
+        }
+
+        lock.lock();
+
+        if (!wrote) {
+            _sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (!_stop && empty()) {
+                _wait_cv.wait(lock);
+            }
+
+            _sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+}
+
+}
+}
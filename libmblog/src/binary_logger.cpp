@@ -0,0 +1,413 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mblog/binary_logger.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+
+/*
+ * The log file consists of a header followed by a ring of |capacity| bytes.
+ * Integers are stored in native byte order since the file is only read on the
+ * device that wrote it.
+ *
+ * |head| and |tail| are logical byte offsets that only increase. The records
+ * in [tail, head) are valid and each starts at offset % capacity. Records are
+ * 8-byte aligned and never wrap around the end of the ring. The space at the
+ * end that is too small for the next record is filled with a padding record.
+ * When the ring is full, the oldest records are discarded.
+ *
+ * Every process that opens the log writes a session record first. Writers in
+ * different processes (including forked children) are serialized with a POSIX
+ * record lock on the file.
+ */
+
+namespace mb
+{
+namespace log
+{
+
+constexpr char BINARY_LOG_MAGIC[8] =
+        { 'M', 'B', 'L', 'O', 'G', 'B', 'I', 'N' };
+constexpr uint32_t BINARY_LOG_VERSION = 1;
+constexpr size_t BINARY_LOG_MIN_CAPACITY = 4096;
+
+struct BinaryLogHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+};
+
+struct BinaryLogRecordHeader
+{
+    uint16_t size;
+    uint8_t type;
+    uint8_t level;
+    uint32_t pid;
+    uint64_t timestamp;
+};
+
+static_assert(sizeof(BinaryLogRecordHeader) == 16,
+              "Unexpected record header size");
+
+static size_t align8(size_t n)
+{
+    return (n + 7) & ~static_cast<size_t>(7);
+}
+
+static bool lock_file(int fd, short type)
+{
+    struct flock fl = {};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+
+    int ret;
+    do {
+        ret = fcntl(fd, F_SETLKW, &fl);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret == 0;
+}
+
+static void unlock_file(int fd)
+{
+    struct flock fl = {};
+    fl.l_type = F_UNLCK;
+    fl.l_whence = SEEK_SET;
+    fcntl(fd, F_SETLK, &fl);
+}
+
+static bool header_valid(const BinaryLogHeader &hdr, size_t file_size)
+{
+    return memcmp(hdr.magic, BINARY_LOG_MAGIC, sizeof(hdr.magic)) == 0
+            && hdr.version == BINARY_LOG_VERSION
+            && hdr.header_size == sizeof(BinaryLogHeader)
+            && hdr.capacity >= BINARY_LOG_MIN_CAPACITY
+            && hdr.capacity % 8 == 0
+            && hdr.capacity == file_size - sizeof(BinaryLogHeader)
+            && hdr.tail <= hdr.head
+            && hdr.head - hdr.tail <= hdr.capacity
+            && hdr.tail % 8 == 0
+            && hdr.head % 8 == 0;
+}
+
+/*!
+ * \brief Get the size of the record at a ring offset
+ *
+ * \return Record size or 0 if the record is corrupt
+ */
+static size_t record_size_at(const unsigned char *ring, uint64_t capacity,
+                             uint64_t offset)
+{
+    uint64_t pos = offset % capacity;
+    uint16_t size;
+    memcpy(&size, ring + pos, sizeof(size));
+
+    if (size < 8 || size % 8 != 0 || size > capacity - pos) {
+        return 0;
+    }
+
+    return size;
+}
+
+/*!
+ * \class BinaryLogger
+ *
+ * \brief Logger that stores compact records in a memory-mapped ring file
+ *
+ * Each message is stored with its timestamp, level, and pid. Old records are
+ * overwritten when the ring is full, so the file never grows and the kernel
+ * writes back only the dirty pages.
+ */
+
+/*!
+ * \brief Open or create a binary log
+ *
+ * If the file does not exist or does not match \p capacity, it is
+ * reinitialized. Otherwise, new records are appended to the existing ones.
+ *
+ * \param path Path to log file
+ * \param capacity Size of the ring in bytes (rounded to a multiple of 8)
+ */
+BinaryLogger::BinaryLogger(const std::string &path, size_t capacity)
+    : _fd(-1)
+    , _map(nullptr)
+    , _map_size(0)
+{
+    capacity = align8(std::max(capacity, BINARY_LOG_MIN_CAPACITY));
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return;
+    }
+
+    if (!lock_file(fd, F_WRLCK)) {
+        close(fd);
+        return;
+    }
+
+    size_t map_size = sizeof(BinaryLogHeader) + capacity;
+    struct stat sb;
+    bool size_matches = fstat(fd, &sb) == 0
+            && static_cast<uint64_t>(sb.st_size) == map_size;
+
+    if (!size_matches && ftruncate(fd, static_cast<off_t>(map_size)) < 0) {
+        unlock_file(fd);
+        close(fd);
+        return;
+    }
+
+    void *map = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    if (map == MAP_FAILED) {
+        unlock_file(fd);
+        close(fd);
+        return;
+    }
+
+    auto *hdr = static_cast<BinaryLogHeader *>(map);
+    if (!size_matches || !header_valid(*hdr, map_size)) {
+        memset(hdr, 0, sizeof(*hdr));
+        memcpy(hdr->magic, BINARY_LOG_MAGIC, sizeof(hdr->magic));
+        hdr->version = BINARY_LOG_VERSION;
+        hdr->header_size = sizeof(BinaryLogHeader);
+        hdr->capacity = capacity;
+    }
+
+    _fd = fd;
+    _map = static_cast<unsigned char *>(map);
+    _map_size = map_size;
+
+    unlock_file(fd);
+
+    const char *tag = get_log_tag();
+    write_record(BinaryLogRecordType::Session, LogLevel::Info, tag,
+                 std::min(strlen(tag), sizeof(_buf) - 1));
+}
+
+BinaryLogger::~BinaryLogger()
+{
+    if (_map) {
+        munmap(_map, _map_size);
+    }
+    if (_fd >= 0) {
+        close(_fd);
+    }
+}
+
+bool BinaryLogger::is_open() const
+{
+    return _map != nullptr;
+}
+
+void BinaryLogger::log(LogLevel prio, const char *fmt, va_list ap)
+{
+    if (!_map) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    int n = vsnprintf(_buf, sizeof(_buf), fmt, ap);
+    if (n < 0) {
+        return;
+    }
+
+    write_record(BinaryLogRecordType::Message, prio, _buf,
+                 std::min(static_cast<size_t>(n), sizeof(_buf) - 1));
+}
+
+void BinaryLogger::write_record(BinaryLogRecordType type, LogLevel level,
+                                const char *data, size_t size)
+{
+    if (!lock_file(_fd, F_WRLCK)) {
+        return;
+    }
+
+    auto *hdr = reinterpret_cast<BinaryLogHeader *>(_map);
+    unsigned char *ring = _map + sizeof(BinaryLogHeader);
+    uint64_t capacity = hdr->capacity;
+    size_t record_size = align8(sizeof(BinaryLogRecordHeader) + size);
+
+    // Discard the oldest records until |needed| bytes are free
+    auto make_room = [&](uint64_t needed) {
+        while (hdr->head + needed - hdr->tail > capacity) {
+            size_t n = record_size_at(ring, capacity, hdr->tail);
+            if (n == 0) {
+                // Corrupt; drop everything
+                hdr->tail = hdr->head;
+                break;
+            }
+            hdr->tail += n;
+        }
+    };
+
+    uint64_t pos = hdr->head % capacity;
+
+    if (capacity - pos < record_size) {
+        auto padding = static_cast<uint16_t>(capacity - pos);
+        make_room(padding);
+
+        BinaryLogRecordHeader rh = {};
+        rh.size = padding;
+        rh.type = static_cast<uint8_t>(BinaryLogRecordType::Padding);
+        memcpy(ring + pos, &rh, std::min<size_t>(padding, sizeof(rh)));
+
+        hdr->head += padding;
+        pos = 0;
+    }
+
+    make_room(record_size);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    BinaryLogRecordHeader rh;
+    rh.size = static_cast<uint16_t>(record_size);
+    rh.type = static_cast<uint8_t>(type);
+    rh.level = static_cast<uint8_t>(level);
+    rh.pid = static_cast<uint32_t>(getpid());
+    rh.timestamp = static_cast<uint64_t>(ts.tv_sec) * 1000000000u
+            + static_cast<uint64_t>(ts.tv_nsec);
+
+    memcpy(ring + pos, &rh, sizeof(rh));
+    memcpy(ring + pos + sizeof(rh), data, size);
+    memset(ring + pos + sizeof(rh) + size, 0,
+           record_size - sizeof(rh) - size);
+
+    hdr->head += record_size;
+
+    unlock_file(_fd);
+}
+
+/*!
+ * \brief Decode a binary log
+ *
+ * Records are passed to \p callback from oldest to newest. Padding records are
+ * skipped. Decoding stops at the first corrupt record.
+ *
+ * \param path Path to log file
+ * \param callback Function to call for each record. Return false to stop.
+ *
+ * \return Whether the file has a valid header and could be read
+ */
+bool binary_log_read(
+        const std::string &path,
+        const std::function<bool(const BinaryLogRecord &)> &callback)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    std::vector<unsigned char> data;
+    struct stat sb;
+    bool ok = lock_file(fd, F_RDLCK) && fstat(fd, &sb) == 0
+            && static_cast<uint64_t>(sb.st_size) >= sizeof(BinaryLogHeader);
+
+    if (ok) {
+        data.resize(static_cast<size_t>(sb.st_size));
+
+        size_t total = 0;
+        while (total < data.size()) {
+            ssize_t n = pread(fd, data.data() + total, data.size() - total,
+                              static_cast<off_t>(total));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                ok = false;
+                break;
+            }
+            total += static_cast<size_t>(n);
+        }
+    }
+
+    unlock_file(fd);
+    close(fd);
+
+    if (!ok) {
+        return false;
+    }
+
+    BinaryLogHeader hdr;
+    memcpy(&hdr, data.data(), sizeof(hdr));
+
+    if (!header_valid(hdr, data.size())) {
+        return false;
+    }
+
+    const unsigned char *ring = data.data() + sizeof(BinaryLogHeader);
+    BinaryLogRecord record;
+
+    for (uint64_t offset = hdr.tail; offset < hdr.head;) {
+        size_t size = record_size_at(ring, hdr.capacity, offset);
+        if (size == 0) {
+            break;
+        }
+
+        uint64_t pos = offset % hdr.capacity;
+        offset += size;
+
+        BinaryLogRecordHeader rh = {};
+        memcpy(&rh, ring + pos, std::min(size, sizeof(rh)));
+
+        auto type = static_cast<BinaryLogRecordType>(rh.type);
+        if (type == BinaryLogRecordType::Padding) {
+            continue;
+        } else if (size < sizeof(rh)) {
+            break;
+        }
+
+        const char *text = reinterpret_cast<const char *>(ring + pos)
+                + sizeof(rh);
+        size_t text_size = size - sizeof(rh);
+        text_size = strnlen(text, text_size);
+
+        record.type = type;
+        record.level = static_cast<LogLevel>(rh.level);
+        record.pid = rh.pid;
+        record.timestamp = rh.timestamp;
+        record.text.assign(text, text_size);
+
+        if (!callback(record)) {
+            break;
+        }
+    }
+
+    return true;
+}
+
+}
+}
@@ -30,9 +30,30 @@ namespace mb
 namespace log
 {
 
+namespace detail
+{
+std::atomic<LogLevel> log_level{LogLevel::Verbose};
+}
+
 static std::string log_tag("mblog");
 static std::shared_ptr<BaseLogger> logger;
 
+LogLevel log_get_level()
+{
+    return detail::log_level.load(std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Set the least severe level that is logged
+ *
+ * Messages less severe than \p level are skipped before their arguments are
+ * evaluated. This does not affect direct calls to log() and logv().
+ */
+void log_set_level(LogLevel level)
+{
+    detail::log_level.store(level, std::memory_order_relaxed);
+}
+
 const char * get_log_tag()
 {
     return log_tag.c_str();
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mblog/tee_logger.h"
+
+namespace mb
+{
+namespace log
+{
+
+/*!
+ * \class TeeLogger
+ *
+ * \brief Logger that passes every message to several loggers
+ */
+
+TeeLogger::TeeLogger(std::vector<std::shared_ptr<BaseLogger>> loggers)
+    : _loggers(std::move(loggers))
+{
+}
+
+void TeeLogger::log(LogLevel prio, const char *fmt, va_list ap)
+{
+    for (auto const &logger : _loggers) {
+        va_list copy;
+        va_copy(copy, ap);
+        logger->log(prio, fmt, copy);
+        va_end(copy);
+    }
+}
+
+}
+}
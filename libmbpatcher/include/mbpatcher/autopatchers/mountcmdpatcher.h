@@ -50,6 +50,8 @@ public:
     virtual std::vector<std::string> existing_files() const override;
 
     virtual bool patch_files(const std::string &directory) override;
+    virtual bool patch_buffer(const std::string &name,
+                              std::string &contents) override;
 
 private:
     std::unique_ptr<MountCmdPatcherPrivate> _priv_ptr;
@@ -54,6 +54,8 @@ public:
     virtual std::vector<std::string> existing_files() const override;
 
     virtual bool patch_files(const std::string &directory) override;
+    virtual bool patch_buffer(const std::string &name,
+                              std::string &contents) override;
 
     bool patch_updater(const std::string &directory);
     bool patch_transfer_list(const std::string &directory);
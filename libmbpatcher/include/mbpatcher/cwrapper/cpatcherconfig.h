@@ -20,6 +20,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "mbcommon/common.h"
 #include "mbpatcher/cwrapper/ctypes.h"
@@ -28,6 +30,10 @@
 extern "C" {
 #endif
 
+typedef void (*BatchProgressUpdatedCallback) (size_t, uint64_t, uint64_t, void *);
+typedef void (*BatchDetailsUpdatedCallback) (size_t, const char *, void *);
+typedef void (*BatchJobFinishedCallback) (size_t, /* enum ErrorCode */ int, void *);
+
 MB_EXPORT CPatcherConfig * mbpatcher_config_create(void);
 MB_EXPORT void mbpatcher_config_destroy(CPatcherConfig *pc);
 
@@ -35,9 +41,11 @@ MB_EXPORT /* enum ErrorCode */ int mbpatcher_config_error(const CPatcherConfig *
 
 MB_EXPORT char * mbpatcher_config_data_directory(const CPatcherConfig *pc);
 MB_EXPORT char * mbpatcher_config_temp_directory(const CPatcherConfig *pc);
+MB_EXPORT char * mbpatcher_config_cache_directory(const CPatcherConfig *pc);
 
 MB_EXPORT void mbpatcher_config_set_data_directory(CPatcherConfig *pc, char *path);
 MB_EXPORT void mbpatcher_config_set_temp_directory(CPatcherConfig *pc, char *path);
+MB_EXPORT void mbpatcher_config_set_cache_directory(CPatcherConfig *pc, char *path);
 
 MB_EXPORT char ** mbpatcher_config_patchers(const CPatcherConfig *pc);
 MB_EXPORT char ** mbpatcher_config_autopatchers(const CPatcherConfig *pc);
@@ -50,6 +58,19 @@ MB_EXPORT CAutoPatcher * mbpatcher_config_create_autopatcher(CPatcherConfig *pc,
 MB_EXPORT void mbpatcher_config_destroy_patcher(CPatcherConfig *pc, CPatcher *patcher);
 MB_EXPORT void mbpatcher_config_destroy_autopatcher(CPatcherConfig *pc, CAutoPatcher *patcher);
 
+MB_EXPORT bool mbpatcher_config_patch_batch(CPatcherConfig *pc,
+                                            const char * const *patcher_ids,
+                                            const CFileInfo * const *infos,
+                                            size_t count,
+                                            unsigned int max_jobs,
+                                            BatchProgressUpdatedCallback progress_cb,
+                                            BatchDetailsUpdatedCallback details_cb,
+                                            BatchJobFinishedCallback finished_cb,
+                                            void *userdata,
+                                            /* enum ErrorCode */ int *results);
+MB_EXPORT void mbpatcher_config_cancel_batch_job(CPatcherConfig *pc, size_t index);
+MB_EXPORT void mbpatcher_config_cancel_batch(CPatcherConfig *pc);
+
 #ifdef __cplusplus
 }
 #endif
@@ -22,6 +22,8 @@
 #include <string>
 #include <vector>
 
+#include <cstdint>
+
 #include "mbcommon/common.h"
 
 namespace mb
@@ -253,6 +255,8 @@ protected:
 
     static void escape(const std::string &str, std::string *out);
     static bool unescape(const std::string &str, std::string *out);
+
+    friend class EdifyTokenizer;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -269,22 +273,68 @@ private:
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Compact token referring to a range of the tokenized buffer
+struct EdifyTokenSpan
+{
+    EdifyTokenType type;
+    uint32_t offset;
+    uint32_t size;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Applies ordered, non-overlapping replacements to a buffer
+class EdifyScriptEditor
+{
+public:
+    EdifyScriptEditor(const char *data, std::size_t size);
+
+    bool replace(std::size_t offset, std::size_t size,
+                 std::string replacement);
+
+    std::string result() const;
+
+private:
+    struct Edit
+    {
+        std::size_t offset;
+        std::size_t size;
+        std::string replacement;
+    };
+
+    const char *m_data;
+    std::size_t m_size;
+    std::vector<Edit> m_edits;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
 class EdifyTokenizer
 {
 public:
     static bool tokenize(const char *data, std::size_t size,
                          std::vector<EdifyToken *> *tokens);
+    static bool tokenize(const char *data, std::size_t size,
+                         std::vector<EdifyTokenSpan> *tokens);
+    static std::string token_string(const char *data,
+                                    const EdifyTokenSpan &token);
+    static std::string token_unescaped_string(const char *data,
+                                              const EdifyTokenSpan &token);
     static std::string untokenize(const std::vector<EdifyToken *> &tokens);
     static std::string untokenize(const std::vector<EdifyToken *>::iterator &begin,
                                   const std::vector<EdifyToken *>::iterator &end);
 
     static void dump(const std::vector<EdifyToken *> &tokens);
+    static void dump(const char *data,
+                     const std::vector<EdifyTokenSpan> &tokens);
 
 private:
     static bool is_valid_unquoted(char c);
 
     static bool next_token(const char *data, std::size_t size, std::size_t *pos,
                            EdifyToken **token);
+    static bool next_token_span(const char *data, std::size_t size,
+                                std::size_t *pos, EdifyTokenSpan *token);
 
     MB_DISABLE_DEFAULT_CONSTRUCTOR(EdifyTokenizer)
     MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(EdifyTokenizer)
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "mbcommon/common.h"
@@ -42,6 +43,16 @@ class MB_EXPORT PatcherConfig
     MB_DECLARE_PRIVATE(PatcherConfig)
 
 public:
+    struct BatchJob
+    {
+        std::string patcher_id;
+        const FileInfo *info;
+    };
+
+    typedef void (*BatchProgressCallback) (size_t, uint64_t, uint64_t, void *);
+    typedef void (*BatchDetailsCallback) (size_t, const std::string &, void *);
+    typedef void (*BatchFinishedCallback) (size_t, ErrorCode, void *);
+
     PatcherConfig();
     ~PatcherConfig();
 
@@ -49,9 +60,11 @@ public:
 
     std::string data_directory() const;
     std::string temp_directory() const;
+    std::string cache_directory() const;
 
     void set_data_directory(std::string path);
     void set_temp_directory(std::string path);
+    void set_cache_directory(std::string path);
 
     std::vector<std::string> patchers() const;
     std::vector<std::string> auto_patchers() const;
@@ -63,6 +76,15 @@ public:
     void destroy_patcher(Patcher *patcher);
     void destroy_auto_patcher(AutoPatcher *patcher);
 
+    std::vector<ErrorCode> patch_batch(const std::vector<BatchJob> &jobs,
+                                       unsigned int max_jobs,
+                                       BatchProgressCallback progress_cb,
+                                       BatchDetailsCallback details_cb,
+                                       BatchFinishedCallback finished_cb,
+                                       void *userdata);
+    void cancel_batch_job(size_t index);
+    void cancel_batch();
+
     MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(PatcherConfig)
     MB_DEFAULT_MOVE_CONSTRUCT_AND_ASSIGN(PatcherConfig)
 
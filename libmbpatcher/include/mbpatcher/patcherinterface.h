@@ -140,6 +140,18 @@ public:
      * \param directory Directory containing the files to be patched
      */
     virtual bool patch_files(const std::string &directory) = 0;
+
+    /*!
+     * \brief Patch the contents of a single file in memory
+     *
+     * \param name Path of the file within the zip archive
+     * \param contents Contents of the file, which are replaced in place
+     *
+     * \return True if the file was patched or does not need to be patched.
+     *         False if an error occurred.
+     */
+    virtual bool patch_buffer(const std::string &name,
+                              std::string &contents) = 0;
 };
 
 }
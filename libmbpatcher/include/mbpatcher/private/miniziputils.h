@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -41,6 +42,11 @@ public:
         uint64_t total_size;
     };
 
+    typedef std::function<bool(void *buf, size_t size, size_t &bytes_read)>
+            ReadCallback;
+
+    static void set_deflate_threads(unsigned int threads);
+
     static std::string unz_error_string(int ret);
 
     static std::string zip_error_string(int ret);
@@ -54,7 +60,7 @@ public:
 
     static UnzCtx * open_input_file(std::string path);
 
-    static ZipCtx * open_output_file(std::string path);
+    static ZipCtx * open_output_file(std::string path, bool append = false);
 
     static int close_input_file(UnzCtx *ctx);
 
@@ -89,6 +95,11 @@ public:
     static ErrorCode add_file(zipFile zf,
                               const std::string &name,
                               const std::string &path);
+
+    static ErrorCode add_file(zipFile zf,
+                              const std::string &name,
+                              uint64_t size,
+                              const ReadCallback &read_cb);
 };
 
 }
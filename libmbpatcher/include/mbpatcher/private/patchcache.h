@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include "mbpatcher/fileinfo.h"
+#include "mbpatcher/patcherconfig.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+class PatchCache
+{
+public:
+    explicit PatchCache(const PatcherConfig *pc);
+
+    bool enabled() const;
+
+    std::string template_path(const std::string &patcher_id,
+                              const std::string &input_digest) const;
+    std::string result_path(const std::string &patcher_id,
+                            const std::string &input_digest,
+                            const FileInfo *info) const;
+
+    static bool fetch(const std::string &cached_path,
+                      const std::string &output_path);
+    static bool store(const std::string &path,
+                      const std::string &cached_path);
+
+private:
+    std::string path_for_key(const std::string &key,
+                             const char *suffix) const;
+
+    std::string _directory;
+};
+
+}
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <cstdint>
+
+#include "mbpatcher/patcherinterface.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+class ProgressReporter
+{
+public:
+    ProgressReporter(Patcher::ProgressUpdatedCallback progress_cb,
+                     Patcher::FilesUpdatedCallback files_cb,
+                     Patcher::DetailsUpdatedCallback details_cb,
+                     void *userdata,
+                     unsigned int interval_ms = DEFAULT_INTERVAL_MS,
+                     double min_ratio_delta = DEFAULT_MIN_RATIO_DELTA);
+    ~ProgressReporter();
+
+    void set_progress(uint64_t bytes, uint64_t max_bytes);
+    void set_files(uint64_t files, uint64_t max_files);
+    void set_details(const std::string &details);
+
+    void stop();
+
+    static constexpr unsigned int DEFAULT_INTERVAL_MS = 50;
+    static constexpr double DEFAULT_MIN_RATIO_DELTA = 0.0001;
+
+    ProgressReporter(const ProgressReporter &) = delete;
+    ProgressReporter & operator=(const ProgressReporter &) = delete;
+
+private:
+    void run();
+    void deliver(bool final);
+
+    Patcher::ProgressUpdatedCallback _progress_cb;
+    Patcher::FilesUpdatedCallback _files_cb;
+    Patcher::DetailsUpdatedCallback _details_cb;
+    void *_userdata;
+    unsigned int _interval_ms;
+    double _min_ratio_delta;
+
+    // Written by the patcher
+    std::atomic<uint64_t> _bytes;
+    std::atomic<uint64_t> _max_bytes;
+    std::atomic<uint64_t> _files;
+    std::atomic<uint64_t> _max_files;
+    std::atomic<uint64_t> _details_seq;
+
+    // Last values delivered by the notification thread
+    uint64_t _sent_bytes;
+    uint64_t _sent_max_bytes;
+    uint64_t _sent_files;
+    uint64_t _sent_max_files;
+    uint64_t _sent_details_seq;
+    bool _sent_any_progress;
+    bool _sent_any_files;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::string _details;
+    bool _stopped;
+    std::thread _thread;
+};
+
+}
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbcommon/file/standard.h"
+
+#include "mbpatcher/errors.h"
+
+
+namespace mb
+{
+namespace patcher
+{
+
+class ZipRewriter
+{
+public:
+    typedef void (*ProgressCb)(uint64_t bytes, void *userdata);
+
+    ErrorCode open_input(const std::string &input_path);
+    ErrorCode open_output(const std::string &output_path);
+
+    const std::string & input_digest() const;
+
+    size_t entries() const;
+    const std::string & entry_name(size_t index) const;
+    uint64_t entry_size(size_t index) const;
+    uint64_t entry_central_dir_offset(size_t index) const;
+
+    ErrorCode copy_entry(size_t index, const std::string &name,
+                         ProgressCb cb, void *userdata);
+
+    ErrorCode finish();
+
+private:
+    struct Entry
+    {
+        std::string name;
+        // Central directory record, including name, extra field and comment
+        std::vector<unsigned char> cd_record;
+        // Offset of the central directory record in the input file
+        uint64_t cd_offset;
+        uint64_t uncompressed_size;
+        // Start of the local header and end of the entry's data (including
+        // the data descriptor) in the input file
+        uint64_t start;
+        uint64_t end;
+    };
+
+    ErrorCode read_central_directory();
+
+    StandardFile _input;
+    StandardFile _output;
+    uint64_t _output_offset;
+    std::vector<Entry> _entries;
+    std::vector<unsigned char> _central_dir;
+    uint64_t _central_dir_entries;
+    std::string _input_digest;
+};
+
+}
+}
@@ -88,15 +88,8 @@ static bool space_or_end(const char *ptr)
     return !*ptr || isspace(*ptr);
 }
 
-static bool patch_file(const std::string &path)
+static void patch_contents(std::string &contents)
 {
-    std::string contents;
-
-    ErrorCode ret = FileUtils::read_to_string(path, &contents);
-    if (ret != ErrorCode::NoError) {
-        return false;
-    }
-
     std::vector<std::string> lines = StringUtils::split(contents, '\n');
 
     for (std::string &line : lines) {
@@ -112,6 +105,18 @@ static bool patch_file(const std::string &path)
     }
 
     contents = StringUtils::join(lines, "\n");
+}
+
+static bool patch_file(const std::string &path)
+{
+    std::string contents;
+
+    ErrorCode ret = FileUtils::read_to_string(path, &contents);
+    if (ret != ErrorCode::NoError) {
+        return false;
+    }
+
+    patch_contents(contents);
     FileUtils::write_from_string(path, contents);
 
     return true;
@@ -126,5 +131,15 @@ bool MountCmdPatcher::patch_files(const std::string &directory)
     return true;
 }
 
+bool MountCmdPatcher::patch_buffer(const std::string &name,
+                                   std::string &contents)
+{
+    if (name == FlashScript || name == InstallerScript) {
+        patch_contents(contents);
+    }
+
+    return true;
+}
+
 }
 }
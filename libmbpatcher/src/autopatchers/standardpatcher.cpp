@@ -21,12 +21,13 @@
 
 #include <cstring>
 
+#include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 
 #include "mbpatcher/edify/tokenizer.h"
 #include "mbpatcher/private/fileutils.h"
-#include "mbpatcher/private/stringutils.h"
 
 #define DUMP_DEBUG 0
 
@@ -62,6 +63,106 @@ static constexpr char UNMOUNT_FMT[] =
 static constexpr char FORMAT_FMT[] =
         "(run_program(\"/update-binary-tool\", \"format\", \"%s\") == 0)";
 
+typedef std::vector<EdifyTokenSpan>::const_iterator TokenIter;
+
+struct ScriptContext
+{
+    const char *data;
+    TokenIter begin;
+    // Index of the matching right parenthesis for each left parenthesis
+    std::vector<std::size_t> matching_paren;
+    EdifyScriptEditor editor;
+};
+
+enum class EdifyFunction
+{
+    None,
+    Mount,
+    Unmount,
+    RunProgram,
+    DeleteRecursive,
+    Format,
+};
+
+struct EdifyFunctionName
+{
+    const char *name;
+    EdifyFunction function;
+};
+
+// Indexed by name length, which is unique for each rewritten function
+static const EdifyFunctionName FUNCTION_TABLE[] = {
+    { nullptr,            EdifyFunction::None            }, //  0
+    { nullptr,            EdifyFunction::None            }, //  1
+    { nullptr,            EdifyFunction::None            }, //  2
+    { nullptr,            EdifyFunction::None            }, //  3
+    { nullptr,            EdifyFunction::None            }, //  4
+    { "mount",            EdifyFunction::Mount           }, //  5
+    { "format",           EdifyFunction::Format          }, //  6
+    { "unmount",          EdifyFunction::Unmount         }, //  7
+    { nullptr,            EdifyFunction::None            }, //  8
+    { nullptr,            EdifyFunction::None            }, //  9
+    { nullptr,            EdifyFunction::None            }, // 10
+    { "run_program",      EdifyFunction::RunProgram      }, // 11
+    { nullptr,            EdifyFunction::None            }, // 12
+    { nullptr,            EdifyFunction::None            }, // 13
+    { nullptr,            EdifyFunction::None            }, // 14
+    { nullptr,            EdifyFunction::None            }, // 15
+    { "delete_recursive", EdifyFunction::DeleteRecursive }, // 16
+};
+
+static EdifyFunction lookup_function(const char *name, std::size_t size)
+{
+    if (size >= sizeof(FUNCTION_TABLE) / sizeof(FUNCTION_TABLE[0])) {
+        return EdifyFunction::None;
+    }
+
+    const EdifyFunctionName &entry = FUNCTION_TABLE[size];
+    if (entry.name && std::memcmp(entry.name, name, size) == 0) {
+        return entry.function;
+    }
+
+    return EdifyFunction::None;
+}
+
+static EdifyFunction lookup_function(const char *data,
+                                     const EdifyTokenSpan &token)
+{
+    if (data[token.offset] != '"') {
+        return lookup_function(data + token.offset, token.size);
+    }
+
+    // Quoted function names are rare, so just unescape them
+    std::string name = EdifyTokenizer::token_unescaped_string(data, token);
+    return lookup_function(name.data(), name.size());
+}
+
+/*!
+ * \brief Find matching parentheses in a single pass
+ *
+ * \return List containing the index of the matching right parenthesis for every
+ *         left parenthesis. Unmatched and non-parenthesis tokens map to
+ *         std::string::npos.
+ */
+static std::vector<std::size_t>
+match_parens(const std::vector<EdifyTokenSpan> &tokens)
+{
+    std::vector<std::size_t> matching(tokens.size(), std::string::npos);
+    std::vector<std::size_t> stack;
+
+    for (std::size_t i = 0; i < tokens.size(); ++i) {
+        if (tokens[i].type == EdifyTokenType::LeftParen) {
+            stack.push_back(i);
+        } else if (tokens[i].type == EdifyTokenType::RightParen
+                && !stack.empty()) {
+            matching[stack.back()] = i;
+            stack.pop_back();
+        }
+    }
+
+    return matching;
+}
+
 
 StandardPatcher::StandardPatcher(const PatcherConfig * const pc,
                                  const FileInfo * const info)
@@ -108,35 +209,34 @@ static bool find_items_in_string(const std::string &haystack,
     return false;
 }
 
-static bool find_function(const std::vector<EdifyToken *>::iterator begin,
-                          const std::vector<EdifyToken *>::iterator end,
-                          std::vector<EdifyToken *>::iterator *out_func_name,
-                          std::vector<EdifyToken *>::iterator *out_left_paren,
-                          std::vector<EdifyToken *>::iterator *out_right_paren)
+static bool find_function(const ScriptContext &script,
+                          const TokenIter begin,
+                          const TokenIter end,
+                          TokenIter *out_func_name,
+                          TokenIter *out_left_paren,
+                          TokenIter *out_right_paren)
 {
-    std::vector<EdifyToken *>::iterator func_name;
-    std::vector<EdifyToken *>::iterator left_paren;
-    std::vector<EdifyToken *>::iterator right_paren;
+    TokenIter func_name;
+    TokenIter left_paren;
 
     for (auto it = begin; it != end; ++it) {
         // Find string representing the function name
-        if ((*it)->type() != EdifyTokenType::String) {
+        if (it->type != EdifyTokenType::String) {
             continue;
         }
 
         func_name = it;
 
         bool found_left_paren = false;
-        bool found_right_paren = false;
 
         // Barring any whitespace, newlines, or comments, the function name
         // should be followed by a left parenthesis
         for (auto it2 = it + 1; it2 != end; ++it2) {
-            if ((*it2)->type() == EdifyTokenType::Whitespace
-                    || (*it2)->type() == EdifyTokenType::Newline
-                    || (*it2)->type() == EdifyTokenType::Comment) {
+            if (it2->type == EdifyTokenType::Whitespace
+                    || it2->type == EdifyTokenType::Newline
+                    || it2->type == EdifyTokenType::Comment) {
                 continue;
-            } else if ((*it2)->type() == EdifyTokenType::LeftParen) {
+            } else if (it2->type == EdifyTokenType::LeftParen) {
                 found_left_paren = true;
                 left_paren = it2;
             }
@@ -149,32 +249,19 @@ static bool find_function(const std::vector<EdifyToken *>::iterator begin,
             continue;
         }
 
-        // Left for matching right parenthesis
-        std::size_t depth = 0;
-
-        for (auto it2 = left_paren; it2 != end; ++it2) {
-            if ((*it2)->type() == EdifyTokenType::LeftParen) {
-                ++depth;
-            } else if ((*it2)->type() == EdifyTokenType::RightParen) {
-                --depth;
-            }
-            if (depth == 0) {
-                found_right_paren = true;
-                right_paren = it2;
-                break;
-            }
-        }
+        std::size_t right_paren =
+                script.matching_paren[left_paren - script.begin];
 
         // If a right parenthesis was not found, but the function name and left
         // parenthesis were found, then assume there's a syntax error and bail
         // out
-        if (!found_right_paren) {
+        if (right_paren == std::string::npos) {
             return false;
         }
 
         *out_func_name = func_name;
         *out_left_paren = left_paren;
-        *out_right_paren = right_paren;
+        *out_right_paren = script.begin + right_paren;
 
         return true;
     }
@@ -185,59 +272,36 @@ static bool find_function(const std::vector<EdifyToken *>::iterator begin,
 /*!
  * \brief Replace edify function
  *
- * \param tokens List of edify tokens
+ * \param script Script being patched
  * \param func_name Function name token of the replaced function
  * \param left_paren Left parenthesis token of the replaced function
  * \param right_paren Right parenthesis token of the replaced function
  * \param replacement Replacement edify function (in string form)
  *
  * \return New iterator pointing to position *after* the right parenthesis of
- *         the replaced function. Returns tokens->end() if the replacement
- *         string could not be tokenized.
+ *         the replaced function
  */
-static std::vector<EdifyToken *>::iterator
-replace_function(std::vector<EdifyToken *> *tokens,
-                 std::vector<EdifyToken *>::iterator func_name,
-                 std::vector<EdifyToken *>::iterator left_paren,
-                 std::vector<EdifyToken *>::iterator right_paren,
+static TokenIter
+replace_function(ScriptContext *script,
+                 TokenIter func_name,
+                 TokenIter left_paren,
+                 TokenIter right_paren,
                  const std::string &replacement)
 {
     // Included for completeness' sake
     (void) left_paren;
 
-    std::vector<EdifyToken *> replacement_tokens;
-    bool result = EdifyTokenizer::tokenize(
-            replacement.data(), replacement.size(), &replacement_tokens);
-    if (!result) {
-        LOGE("Failed to tokenize replacement function string: %s",
-             replacement.c_str());
-        return tokens->end();
-    }
-
-    // Deallocate replaced tokens
-    for (auto it = func_name; it != right_paren; ++it) {
-        delete *it;
-    }
-    delete *right_paren;
-
-    // Remove replaced tokens
-    auto it = tokens->erase(func_name, right_paren);
-    it = tokens->erase(it);
-
-    // Add replacement tokens
-    it = tokens->insert(it, replacement_tokens.begin(),
-                        replacement_tokens.end());
-
-    // Move iterator to the end of the replaced tokens
-    it += replacement_tokens.size();
+    std::size_t end = right_paren->offset + right_paren->size;
+    script->editor.replace(func_name->offset, end - func_name->offset,
+                           replacement);
 
-    return it;
+    return right_paren + 1;
 }
 
 /*!
  * \brief Replace edify mount() command
  *
- * \param tokens List of edify tokens
+ * \param script Script being patched
  * \param func_name Function name token
  * \param left_paren Left parenthesis token
  * \param right_paren Right parenthesis token
@@ -247,11 +311,11 @@ replace_function(std::vector<EdifyToken *> *tokens,
  *
  * \return Iterator pointing to position immediately after the right parenthesis
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_mount(std::vector<EdifyToken *> *tokens,
-                    const std::vector<EdifyToken *>::iterator func_name,
-                    const std::vector<EdifyToken *>::iterator left_paren,
-                    const std::vector<EdifyToken *>::iterator right_paren,
+static TokenIter
+replace_edify_mount(ScriptContext *script,
+                    const TokenIter func_name,
+                    const TokenIter left_paren,
+                    const TokenIter right_paren,
                     const std::vector<std::string> &system_devs,
                     const std::vector<std::string> &cache_devs,
                     const std::vector<std::string> &data_devs)
@@ -259,12 +323,11 @@ replace_edify_mount(std::vector<EdifyToken *> *tokens,
     // For the mount() edify function, replace with the corresponding
     // update-binary-tool command
     for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+        if (it->type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
+        const std::string str = EdifyTokenizer::token_string(script->data, *it);
 
         bool is_system = str.find("/system") != std::string::npos
                 || find_items_in_string(str.c_str(), system_devs);
@@ -275,13 +338,13 @@ replace_edify_mount(std::vector<EdifyToken *> *tokens,
                 || find_items_in_string(str.c_str(), data_devs);
 
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/data"));
         }
     }
@@ -291,7 +354,7 @@ replace_edify_mount(std::vector<EdifyToken *> *tokens,
 /*!
  * \brief Replace edify unmount() command
  *
- * \param tokens List of edify tokens
+ * \param script Script being patched
  * \param func_name Function name token
  * \param left_paren Left parenthesis token
  * \param right_paren Right parenthesis token
@@ -301,11 +364,11 @@ replace_edify_mount(std::vector<EdifyToken *> *tokens,
  *
  * \return Iterator pointing to position immediately after the right parenthesis
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_unmount(std::vector<EdifyToken *> *tokens,
-                      const std::vector<EdifyToken *>::iterator func_name,
-                      const std::vector<EdifyToken *>::iterator left_paren,
-                      const std::vector<EdifyToken *>::iterator right_paren,
+static TokenIter
+replace_edify_unmount(ScriptContext *script,
+                      const TokenIter func_name,
+                      const TokenIter left_paren,
+                      const TokenIter right_paren,
                       const std::vector<std::string> &system_devs,
                       const std::vector<std::string> &cache_devs,
                       const std::vector<std::string> &data_devs)
@@ -313,12 +376,11 @@ replace_edify_unmount(std::vector<EdifyToken *> *tokens,
     // For the unmount() edify function, replace with the corresponding
     // update-binary-tool command
     for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+        if (it->type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
+        const std::string str = EdifyTokenizer::token_string(script->data, *it);
 
         bool is_system = str.find("/system") != std::string::npos
                 || find_items_in_string(str.c_str(), system_devs);
@@ -329,13 +391,13 @@ replace_edify_unmount(std::vector<EdifyToken *> *tokens,
                 || find_items_in_string(str.c_str(), data_devs);
 
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/data"));
         }
     }
@@ -345,7 +407,7 @@ replace_edify_unmount(std::vector<EdifyToken *> *tokens,
 /*!
  * \brief Replace edify run_program() command
  *
- * \param tokens List of edify tokens
+ * \param script Script being patched
  * \param func_name Function name token
  * \param left_paren Left parenthesis token
  * \param right_paren Right parenthesis token
@@ -355,11 +417,11 @@ replace_edify_unmount(std::vector<EdifyToken *> *tokens,
  *
  * \return Iterator pointing to position immediately after the right parenthesis
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_run_program(std::vector<EdifyToken *> *tokens,
-                          const std::vector<EdifyToken *>::iterator func_name,
-                          const std::vector<EdifyToken *>::iterator left_paren,
-                          const std::vector<EdifyToken *>::iterator right_paren,
+static TokenIter
+replace_edify_run_program(ScriptContext *script,
+                          const TokenIter func_name,
+                          const TokenIter left_paren,
+                          const TokenIter right_paren,
                           const std::vector<std::string> &system_devs,
                           const std::vector<std::string> &cache_devs,
                           const std::vector<std::string> &data_devs)
@@ -374,12 +436,12 @@ replace_edify_run_program(std::vector<EdifyToken *> *tokens,
     bool is_data = false;
 
     for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+        if (it->type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string unescaped = token->unescaped_string();
+        const std::string unescaped =
+                EdifyTokenizer::token_unescaped_string(script->data, *it);
 
         if (ends_with(unescaped, "reboot")) {
             found_reboot = true;
@@ -413,42 +475,42 @@ replace_edify_run_program(std::vector<EdifyToken *> *tokens,
     }
 
     if (found_reboot) {
-        return replace_function(tokens, func_name, left_paren, right_paren,
+        return replace_function(script, func_name, left_paren, right_paren,
                                 "(ui_print(\"Removed reboot command\") == 0)");
     } else if (found_umount) {
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(UNMOUNT_FMT, "/data"));
         }
     } else if (found_mount) {
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(MOUNT_FMT, "/data"));
         }
     } else if (found_format_sh) {
-        return replace_function(tokens, func_name, left_paren, right_paren,
+        return replace_function(script, func_name, left_paren, right_paren,
                                 format(FORMAT_FMT, "/system"));
     } else if (found_mke2fs) {
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/data"));
         }
     }
@@ -459,32 +521,32 @@ replace_edify_run_program(std::vector<EdifyToken *> *tokens,
 /*!
  * \brief Replace edify delete_recursive() command
  *
- * \param tokens List of edify tokens
+ * \param script Script being patched
  * \param func_name Function name token
  * \param left_paren Left parenthesis token
  * \param right_paren Right parenthesis token
  *
  * \return Iterator pointing to position immediately after the right parenthesis
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_delete_recursive(std::vector<EdifyToken *> *tokens,
-                               const std::vector<EdifyToken *>::iterator func_name,
-                               const std::vector<EdifyToken *>::iterator left_paren,
-                               const std::vector<EdifyToken *>::iterator right_paren)
+static TokenIter
+replace_edify_delete_recursive(ScriptContext *script,
+                               const TokenIter func_name,
+                               const TokenIter left_paren,
+                               const TokenIter right_paren)
 {
     for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+        if (it->type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string unescaped = token->unescaped_string();
+        const std::string unescaped =
+                EdifyTokenizer::token_unescaped_string(script->data, *it);
 
         if (unescaped == "/system" || unescaped == "/system/") {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/system"));
         } else if (unescaped == "/cache" || unescaped == "/cache/") {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/cache"));
         }
     }
@@ -494,7 +556,7 @@ replace_edify_delete_recursive(std::vector<EdifyToken *> *tokens,
 /*!
  * \brief Replace edify format() command
  *
- * \param tokens List of edify tokens
+ * \param script Script being patched
  * \param func_name Function name token
  * \param left_paren Left parenthesis token
  * \param right_paren Right parenthesis token
@@ -504,11 +566,11 @@ replace_edify_delete_recursive(std::vector<EdifyToken *> *tokens,
  *
  * \return Iterator pointing to position immediately after the right parenthesis
  */
-static std::vector<EdifyToken *>::iterator
-replace_edify_format(std::vector<EdifyToken *> *tokens,
-                     const std::vector<EdifyToken *>::iterator func_name,
-                     const std::vector<EdifyToken *>::iterator left_paren,
-                     const std::vector<EdifyToken *>::iterator right_paren,
+static TokenIter
+replace_edify_format(ScriptContext *script,
+                     const TokenIter func_name,
+                     const TokenIter left_paren,
+                     const TokenIter right_paren,
                      const std::vector<std::string> &system_devs,
                      const std::vector<std::string> &cache_devs,
                      const std::vector<std::string> &data_devs)
@@ -516,12 +578,11 @@ replace_edify_format(std::vector<EdifyToken *> *tokens,
     // For the format() edify function, replace with the corresponding
     // update-binary-tool command
     for (auto it = left_paren + 1; it != right_paren; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+        if (it->type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
+        const std::string str = EdifyTokenizer::token_string(script->data, *it);
 
         bool is_system = str.find("/system") != std::string::npos
                 || find_items_in_string(str.c_str(), system_devs);
@@ -532,51 +593,32 @@ replace_edify_format(std::vector<EdifyToken *> *tokens,
                 || find_items_in_string(str.c_str(), data_devs);
 
         if (is_system) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/system"));
         } else if (is_cache) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/cache"));
         } else if (is_data) {
-            return replace_function(tokens, func_name, left_paren, right_paren,
+            return replace_function(script, func_name, left_paren, right_paren,
                                     format(FORMAT_FMT, "/data"));
         }
     }
     return right_paren + 1;
 }
 
-bool StandardPatcher::patch_files(const std::string &directory)
-{
-    if (!patch_updater(directory)) {
-        return false;
-    }
-
-    if (!patch_transfer_list(directory)) {
-        return false;
-    }
-
-    return true;
-}
-
-bool StandardPatcher::patch_updater(const std::string &directory)
+/*!
+ * \brief Patch updater-script contents in place
+ *
+ * \return Whether the script was tokenized successfully
+ */
+static bool patch_updater_contents(const FileInfo *info, std::string &contents)
 {
-    MB_PRIVATE(StandardPatcher);
-
-    std::string contents;
-    std::string path;
-
-    path += directory;
-    path += "/";
-    path += UpdaterScript;
-
-    FileUtils::read_to_string(path, &contents);
-
     if (contents.size() >= 2 && std::memcmp(contents.data(), "#!", 2) == 0) {
         // Ignore any script with a shebang line
         return true;
     }
 
-    std::vector<EdifyToken *> tokens;
+    std::vector<EdifyTokenSpan> tokens;
     bool result = EdifyTokenizer::tokenize(
             contents.data(), contents.size(), &tokens);
     if (!result) {
@@ -585,98 +627,297 @@ bool StandardPatcher::patch_updater(const std::string &directory)
     }
 
 #if DUMP_DEBUG
-    EdifyTokenizer::dump(tokens);
+    EdifyTokenizer::dump(contents.data(), tokens);
 #endif
 
-    auto &&device = priv->info->device();
+    auto &&device = info->device();
     auto system_devs = device.system_block_devs();
     auto cache_devs = device.cache_block_devs();
     auto data_devs = device.data_block_devs();
 
-    std::vector<EdifyToken *>::iterator begin = tokens.begin();
-    std::vector<EdifyToken *>::iterator end;
+    ScriptContext script{contents.data(), tokens.begin(), match_parens(tokens),
+                         EdifyScriptEditor(contents.data(), contents.size())};
+
+    TokenIter begin = tokens.begin();
+    TokenIter end = tokens.end();
 
     // TODO: Catch errors
     while (true) {
-        end = tokens.end();
-
         // Need to find:
         // 1. String containing function name
         // 2. Left parenthesis for the function
         // 3. Right parenthesis for the function
-        std::vector<EdifyToken *>::iterator func_name;
-        std::vector<EdifyToken *>::iterator left_paren;
-        std::vector<EdifyToken *>::iterator right_paren;
+        TokenIter func_name;
+        TokenIter left_paren;
+        TokenIter right_paren;
 
-        if (!find_function(begin, end, &func_name, &left_paren, &right_paren)) {
+        if (!find_function(script, begin, end,
+                           &func_name, &left_paren, &right_paren)) {
             break;
         }
 
-        // Tokens (types are checked by findFunction())
-        EdifyTokenString *t_func_name = (EdifyTokenString *)(*func_name);
-
-        if (t_func_name->unescaped_string() == "mount") {
-            begin = replace_edify_mount(&tokens, func_name, left_paren, right_paren,
+        // Tokens (types are checked by find_function())
+        switch (lookup_function(script.data, *func_name)) {
+        case EdifyFunction::Mount:
+            begin = replace_edify_mount(&script, func_name, left_paren, right_paren,
                                         system_devs, cache_devs, data_devs);
-        } else if (t_func_name->unescaped_string() == "unmount") {
-            begin = replace_edify_unmount(&tokens, func_name, left_paren, right_paren,
+            break;
+        case EdifyFunction::Unmount:
+            begin = replace_edify_unmount(&script, func_name, left_paren, right_paren,
                                           system_devs, cache_devs, data_devs);
-        } else if (t_func_name->unescaped_string() == "run_program") {
-            begin = replace_edify_run_program(&tokens, func_name, left_paren, right_paren,
+            break;
+        case EdifyFunction::RunProgram:
+            begin = replace_edify_run_program(&script, func_name, left_paren, right_paren,
                                               system_devs, cache_devs, data_devs);
-        } else if (t_func_name->unescaped_string() == "delete_recursive") {
-            begin = replace_edify_delete_recursive(&tokens, func_name, left_paren, right_paren);
-        } else if (t_func_name->unescaped_string() == "format") {
-            begin = replace_edify_format(&tokens, func_name, left_paren, right_paren,
+            break;
+        case EdifyFunction::DeleteRecursive:
+            begin = replace_edify_delete_recursive(&script, func_name, left_paren, right_paren);
+            break;
+        case EdifyFunction::Format:
+            begin = replace_edify_format(&script, func_name, left_paren, right_paren,
                                          system_devs, cache_devs, data_devs);
-        } else {
+            break;
+        case EdifyFunction::None:
             begin = func_name + 1;
+            break;
         }
     }
 
-#if DUMP_DEBUG
-    EdifyTokenizer::dump(tokens);
-#endif
+    contents = script.editor.result();
 
-    FileUtils::write_from_string(path, EdifyTokenizer::untokenize(tokens));
+    return true;
+}
 
-    for (EdifyToken *t : tokens) {
-        delete t;
+// Size of the chunks that transfer lists on disk are filtered in
+#define TRANSFER_LIST_CHUNK_SIZE (64 * 1024)
+
+/*!
+ * \brief Streaming filter for removing erase commands from a transfer list
+ *
+ * Only the first few bytes of the current line are held back until it is
+ * known whether the line is an erase command, so the memory needed does not
+ * depend on the size of the list. The output never has more bytes than the
+ * input that has been fed so far, which allows filtering a file in place.
+ * Like splitting into lines and joining them again, the newline separating a
+ * kept line from the previous kept line is only written once the line is
+ * known to be kept.
+ */
+class TransferListFilter
+{
+public:
+    void feed(const char *data, size_t size, std::string &out)
+    {
+        const char *end = data + size;
+
+        while (data != end) {
+            if (_state == LineState::Undecided) {
+                char c = *data++;
+
+                if (c == '\n') {
+                    keep_line(out);
+                    _state = LineState::Undecided;
+                    continue;
+                }
+
+                _prefix += c;
+
+                if (_prefix.size() == sizeof(ERASE) - 1
+                        && _prefix == ERASE) {
+                    _prefix.clear();
+                    _state = LineState::Drop;
+                } else if (c != ERASE[_prefix.size() - 1]) {
+                    keep_line(out);
+                }
+            } else {
+                auto nl = static_cast<const char *>(
+                        memchr(data, '\n', end - data));
+                const char *line_end = nl ? nl : end;
+
+                if (_state == LineState::Keep) {
+                    out.append(data, line_end);
+                }
+
+                data = line_end;
+                if (nl) {
+                    ++data;
+                    _state = LineState::Undecided;
+                }
+            }
+        }
+    }
+
+    void finish(std::string &out)
+    {
+        if (_state == LineState::Undecided) {
+            keep_line(out);
+        }
+    }
+
+private:
+    static constexpr const char ERASE[] = "erase ";
+
+    enum class LineState
+    {
+        Undecided,
+        Keep,
+        Drop,
+    };
+
+    void keep_line(std::string &out)
+    {
+        if (!_first) {
+            out += '\n';
+        }
+        _first = false;
+        out += _prefix;
+        _prefix.clear();
+        _state = LineState::Keep;
+    }
+
+    std::string _prefix;
+    LineState _state = LineState::Undecided;
+    bool _first = true;
+};
+
+constexpr const char TransferListFilter::ERASE[];
+
+/*!
+ * \brief Remove erase commands from transfer list contents in place
+ */
+static void patch_transfer_list_contents(std::string &contents)
+{
+    TransferListFilter filter;
+    std::string out;
+
+    out.reserve(contents.size());
+    filter.feed(contents.data(), contents.size(), out);
+    filter.finish(out);
+
+    contents.swap(out);
+}
+
+/*!
+ * \brief Remove erase commands from a transfer list on disk
+ *
+ * The file is filtered in place in fixed-size chunks, so it is never loaded
+ * into memory as a whole.
+ */
+static ErrorCode patch_transfer_list_file(const std::string &path)
+{
+    StandardFile file;
+    auto ret = FileUtils::open_file(file, path, FileOpenMode::READ_WRITE);
+    if (ret != ErrorCode::NoError) {
+        return ret;
+    }
+
+    TransferListFilter filter;
+    std::vector<char> buf(TRANSFER_LIST_CHUNK_SIZE);
+    std::string out;
+    uint64_t read_pos = 0;
+    uint64_t write_pos = 0;
+    size_t n;
+
+    out.reserve(buf.size());
+
+    while (true) {
+        if (!file.seek(static_cast<int64_t>(read_pos), SEEK_SET, nullptr)
+                || !file_read_fully(file, buf.data(), buf.size(), n)) {
+            LOGE("%s: Failed to read file: %s",
+                 path.c_str(), file.error_string().c_str());
+            return ErrorCode::FileReadError;
+        }
+        read_pos += n;
+
+        out.clear();
+        if (n == 0) {
+            filter.finish(out);
+        } else {
+            filter.feed(buf.data(), n, out);
+        }
+
+        size_t n_written;
+        if (!file.seek(static_cast<int64_t>(write_pos), SEEK_SET, nullptr)
+                || !file_write_fully(file, out.data(), out.size(), n_written)
+                || n_written != out.size()) {
+            LOGE("%s: Failed to write file: %s",
+                 path.c_str(), file.error_string().c_str());
+            return ErrorCode::FileWriteError;
+        }
+        write_pos += out.size();
+
+        if (n == 0) {
+            break;
+        }
+    }
+
+    if (!file.truncate(write_pos) || !file.close()) {
+        LOGE("%s: Failed to truncate file: %s",
+             path.c_str(), file.error_string().c_str());
+        return ErrorCode::FileWriteError;
+    }
+
+    return ErrorCode::NoError;
+}
+
+bool StandardPatcher::patch_files(const std::string &directory)
+{
+    if (!patch_updater(directory)) {
+        return false;
+    }
+
+    if (!patch_transfer_list(directory)) {
+        return false;
     }
 
     return true;
 }
 
-bool StandardPatcher::patch_transfer_list(const std::string &directory)
+bool StandardPatcher::patch_buffer(const std::string &name,
+                                   std::string &contents)
+{
+    MB_PRIVATE(StandardPatcher);
+
+    if (name == UpdaterScript) {
+        return patch_updater_contents(priv->info, contents);
+    } else if (name == SystemTransferList) {
+        patch_transfer_list_contents(contents);
+    }
+
+    return true;
+}
+
+bool StandardPatcher::patch_updater(const std::string &directory)
 {
+    MB_PRIVATE(StandardPatcher);
+
     std::string contents;
     std::string path;
-    std::vector<std::string> lines;
 
     path += directory;
     path += "/";
-    path += SystemTransferList;
-
-    auto ret = FileUtils::read_to_string(path, &contents);
-    if (ret != ErrorCode::NoError) {
-        return ret == ErrorCode::FileOpenError;
-    }
+    path += UpdaterScript;
 
-    lines = StringUtils::split(contents, '\n');
+    FileUtils::read_to_string(path, &contents);
 
-    for (auto it = lines.begin(); it != lines.end();) {
-        if (starts_with(*it, "erase ")) {
-            it = lines.erase(it);
-        } else {
-            ++it;
-        }
+    if (!patch_updater_contents(priv->info, contents)) {
+        return false;
     }
 
-    contents = StringUtils::join(lines, "\n");
     FileUtils::write_from_string(path, contents);
 
     return true;
 }
 
+bool StandardPatcher::patch_transfer_list(const std::string &directory)
+{
+    std::string path;
+
+    path += directory;
+    path += "/";
+    path += SystemTransferList;
+
+    auto ret = patch_transfer_list_file(path);
+    return ret == ErrorCode::NoError || ret == ErrorCode::FileOpenError;
+}
 }
 }
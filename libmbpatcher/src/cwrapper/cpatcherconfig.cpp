@@ -126,6 +126,23 @@ char * mbpatcher_config_temp_directory(const CPatcherConfig *pc)
     return mb::capi_str_to_cstr(config->temp_directory());
 }
 
+/*!
+ * \brief Get the patch cache directory
+ *
+ * \note The returned string is dynamically allocated. It should be free()'d
+ *       when it is no longer needed.
+ *
+ * \param pc CPatcherConfig object
+ * \return Cache directory
+ *
+ * \sa PatcherConfig::cache_directory()
+ */
+char * mbpatcher_config_cache_directory(const CPatcherConfig *pc)
+{
+    CCAST(pc);
+    return mb::capi_str_to_cstr(config->cache_directory());
+}
+
 /*!
  * \brief Set top-level data directory
  *
@@ -154,6 +171,20 @@ void mbpatcher_config_set_temp_directory(CPatcherConfig *pc, char *path)
     config->set_temp_directory(path);
 }
 
+/*!
+ * \brief Set the patch cache directory
+ *
+ * \param pc CPatcherConfig object
+ * \param path Path to cache directory
+ *
+ * \sa PatcherConfig::set_cache_directory()
+ */
+void mbpatcher_config_set_cache_directory(CPatcherConfig *pc, char *path)
+{
+    CAST(pc);
+    config->set_cache_directory(path);
+}
+
 /*!
  * \brief Get list of Patcher IDs
  *
@@ -256,4 +287,132 @@ void mbpatcher_config_destroy_autopatcher(CPatcherConfig *pc,
     config->destroy_auto_patcher(ap);
 }
 
+struct BatchCallbackWrapper
+{
+    BatchProgressUpdatedCallback progress_cb;
+    BatchDetailsUpdatedCallback details_cb;
+    BatchJobFinishedCallback finished_cb;
+    void *userdata;
+};
+
+static void batch_progress_cb_wrapper(size_t index, uint64_t bytes,
+                                      uint64_t max_bytes, void *userdata)
+{
+    auto *wrapper = reinterpret_cast<BatchCallbackWrapper *>(userdata);
+    if (wrapper->progress_cb != nullptr) {
+        wrapper->progress_cb(index, bytes, max_bytes, wrapper->userdata);
+    }
+}
+
+static void batch_details_cb_wrapper(size_t index, const std::string &text,
+                                     void *userdata)
+{
+    auto *wrapper = reinterpret_cast<BatchCallbackWrapper *>(userdata);
+    if (wrapper->details_cb != nullptr) {
+        wrapper->details_cb(index, text.c_str(), wrapper->userdata);
+    }
+}
+
+static void batch_finished_cb_wrapper(size_t index,
+                                      mb::patcher::ErrorCode error,
+                                      void *userdata)
+{
+    auto *wrapper = reinterpret_cast<BatchCallbackWrapper *>(userdata);
+    if (wrapper->finished_cb != nullptr) {
+        wrapper->finished_cb(index, static_cast<int>(error),
+                             wrapper->userdata);
+    }
+}
+
+/*!
+ * \brief Patch several files concurrently
+ *
+ * \param pc CPatcherConfig object
+ * \param patcher_ids Patcher ID to use for each file
+ * \param infos CFileInfo describing each file to be patched
+ * \param count Number of files
+ * \param max_jobs Maximum number of concurrent jobs or 0 to use one job per
+ *                 CPU
+ * \param progress_cb Progress callback (called with the job index)
+ * \param details_cb Details callback (called with the job index)
+ * \param finished_cb Callback for when a job finishes
+ * \param userdata Data passed to the callbacks
+ * \param results Array of \p count elements to store the ErrorCode of each job
+ *                in or NULL
+ *
+ * \return true if every job succeeded, otherwise false
+ *
+ * \sa PatcherConfig::patch_batch()
+ */
+bool mbpatcher_config_patch_batch(CPatcherConfig *pc,
+                                  const char * const *patcher_ids,
+                                  const CFileInfo * const *infos,
+                                  size_t count,
+                                  unsigned int max_jobs,
+                                  BatchProgressUpdatedCallback progress_cb,
+                                  BatchDetailsUpdatedCallback details_cb,
+                                  BatchJobFinishedCallback finished_cb,
+                                  void *userdata,
+                                  int *results)
+{
+    CAST(pc);
+
+    std::vector<mb::patcher::PatcherConfig::BatchJob> jobs(count);
+    for (size_t i = 0; i < count; ++i) {
+        jobs[i].patcher_id = patcher_ids[i];
+        jobs[i].info = reinterpret_cast<const mb::patcher::FileInfo *>(
+                infos[i]);
+    }
+
+    BatchCallbackWrapper wrapper;
+    wrapper.progress_cb = progress_cb;
+    wrapper.details_cb = details_cb;
+    wrapper.finished_cb = finished_cb;
+    wrapper.userdata = userdata;
+
+    auto errors = config->patch_batch(jobs, max_jobs,
+                                      &batch_progress_cb_wrapper,
+                                      &batch_details_cb_wrapper,
+                                      &batch_finished_cb_wrapper,
+                                      &wrapper);
+
+    bool ret = true;
+    for (size_t i = 0; i < count; ++i) {
+        if (results) {
+            results[i] = static_cast<int>(errors[i]);
+        }
+        if (errors[i] != mb::patcher::ErrorCode::NoError) {
+            ret = false;
+        }
+    }
+    return ret;
+}
+
+/*!
+ * \brief Cancel a job of the running batch
+ *
+ * \param pc CPatcherConfig object
+ * \param index Index of the job
+ *
+ * \sa PatcherConfig::cancel_batch_job()
+ */
+void mbpatcher_config_cancel_batch_job(CPatcherConfig *pc, size_t index)
+{
+    CAST(pc);
+    config->cancel_batch_job(index);
+}
+
+/*!
+ * \brief Cancel all jobs of the running batch
+ *
+ * \param pc CPatcherConfig object
+ *
+ * \sa PatcherConfig::cancel_batch()
+ */
+void mbpatcher_config_cancel_batch(CPatcherConfig *pc)
+{
+    CAST(pc);
+    config->cancel_batch();
+}
+
 }
@@ -368,6 +368,58 @@ std::string EdifyTokenUnknown::generate()
 
 ////////////////////////////////////////////////////////////////////////////////
 
+EdifyScriptEditor::EdifyScriptEditor(const char *data, std::size_t size)
+    : m_data(data), m_size(size)
+{
+}
+
+/*!
+ * \brief Replace a range of the buffer
+ *
+ * Replacements must be made in order and cannot overlap.
+ *
+ * \return Whether the range is valid
+ */
+bool EdifyScriptEditor::replace(std::size_t offset, std::size_t size,
+                                std::string replacement)
+{
+    std::size_t min_offset = m_edits.empty()
+            ? 0 : m_edits.back().offset + m_edits.back().size;
+
+    if (offset < min_offset || offset > m_size || size > m_size - offset) {
+        return false;
+    }
+
+    m_edits.push_back({offset, size, std::move(replacement)});
+    return true;
+}
+
+/*!
+ * \brief Get buffer with all replacements applied
+ */
+std::string EdifyScriptEditor::result() const
+{
+    std::size_t out_size = m_size;
+    for (auto const &edit : m_edits) {
+        out_size = out_size - edit.size + edit.replacement.size();
+    }
+
+    std::string output;
+    output.reserve(out_size);
+
+    std::size_t pos = 0;
+    for (auto const &edit : m_edits) {
+        output.append(m_data + pos, edit.offset - pos);
+        output += edit.replacement;
+        pos = edit.offset + edit.size;
+    }
+    output.append(m_data + pos, m_size - pos);
+
+    return output;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 bool EdifyTokenizer::is_valid_unquoted(char c)
 {
     return std::isalnum(c)
@@ -377,88 +429,79 @@ bool EdifyTokenizer::is_valid_unquoted(char c)
             || c == '.';
 }
 
-bool EdifyTokenizer::next_token(const char *data, std::size_t size,
-                                std::size_t *pos, EdifyToken **token)
+bool EdifyTokenizer::next_token_span(const char *data, std::size_t size,
+                                     std::size_t *pos, EdifyTokenSpan *token)
 {
     std::size_t p = *pos;
     assert(p < size);
 
+    EdifyTokenType type;
+
     if (size - p >= 2 && std::memcmp(data + p, "if", 2) == 0) {
-        *token = new EdifyTokenIf();
+        type = EdifyTokenType::If;
         p += 2;
     } else if (size - p >= 4 && std::memcmp(data + p, "then", 4) == 0) {
-        *token = new EdifyTokenThen();
+        type = EdifyTokenType::Then;
         p += 4;
     } else if (size - p >= 4 && std::memcmp(data + p, "else", 4) == 0) {
-        *token = new EdifyTokenElse();
+        type = EdifyTokenType::Else;
         p += 4;
     } else if (size - p >= 5 && std::memcmp(data + p, "endif", 5) == 0) {
-        *token = new EdifyTokenEndif();
+        type = EdifyTokenType::Endif;
         p += 5;
     } else if (size - p >= 2 && std::memcmp(data + p, "&&", 2) == 0) {
-        *token = new EdifyTokenAnd();
+        type = EdifyTokenType::And;
         p += 2;
     } else if (size - p >= 2 && std::memcmp(data + p, "||", 2) == 0) {
-        *token = new EdifyTokenOr();
+        type = EdifyTokenType::Or;
         p += 2;
     } else if (size - p >= 2 && std::memcmp(data + p, "==", 2) == 0) {
-        *token = new EdifyTokenEquals();
+        type = EdifyTokenType::Equals;
         p += 2;
     } else if (size - p >= 2 && std::memcmp(data + p, "!=", 2) == 0) {
-        *token = new EdifyTokenNotEquals();
+        type = EdifyTokenType::NotEquals;
         p += 2;
     } else if (data[p] == '!') {
-        *token = new EdifyTokenNot();
+        type = EdifyTokenType::Not;
         p += 1;
     } else if (data[p] == '(') {
-        *token = new EdifyTokenLeftParen();
+        type = EdifyTokenType::LeftParen;
         p += 1;
     } else if (data[p] == ')') {
-        *token = new EdifyTokenRightParen();
+        type = EdifyTokenType::RightParen;
         p += 1;
     } else if (data[p] == ';') {
-        *token = new EdifyTokenSemicolon();
+        type = EdifyTokenType::Semicolon;
         p += 1;
     } else if (data[p] == ',') {
-        *token = new EdifyTokenComma();
+        type = EdifyTokenType::Comma;
         p += 1;
     } else if (data[p] == '+') {
-        *token = new EdifyTokenConcat();
+        type = EdifyTokenType::Concat;
         p += 1;
     } else if (data[p] == '\n') {
-        *token = new EdifyTokenNewline();
+        type = EdifyTokenType::Newline;
         p += 1;
     } else if (data[p] != '\n' && std::isspace(data[p])) {
-        std::string buf;
-        buf += data[p];
+        type = EdifyTokenType::Whitespace;
         p += 1;
         while (size - p >= 1 && data[p] != '\n' && std::isspace(data[p])) {
-            buf += data[p];
             p += 1;
         }
-        *token = new EdifyTokenWhitespace(std::move(buf));
     } else if (data[p] == '#') {
-        std::string buf;
-        // Omit '#' character
+        type = EdifyTokenType::Comment;
         p += 1;
         while (size - p >= 1 && data[p] != '\n') {
-            buf += data[p];
             p += 1;
         }
-        *token = new EdifyTokenComment(std::move(buf));
     } else if (is_valid_unquoted(data[p])) {
-        std::string buf;
-        buf += data[p];
+        type = EdifyTokenType::String;
         p += 1;
         while (size - p >= 1 && is_valid_unquoted(data[p])) {
-            buf += data[p];
             p += 1;
         }
-        *token = new EdifyTokenString(std::move(buf), EdifyTokenString::NotQuoted);
     } else if (data[p] == '"') {
         std::size_t curPos = p;
-        std::string buf;
-        buf += data[p];
         p += 1;
         bool escaped = false;
         bool terminated = false;
@@ -466,29 +509,79 @@ bool EdifyTokenizer::next_token(const char *data, std::size_t size,
             if (data[p] == '\\' || escaped) {
                 escaped = !escaped;
             } else if (!escaped && data[p] == '"') {
-                buf += data[p];
                 p += 1;
                 terminated = true;
                 break;
             }
-            buf += data[p];
             p += 1;
         }
         if (!terminated) {
             LOGE("Unterminated quote at position %" MB_PRIzu, curPos);
             return false;
         }
-        *token = new EdifyTokenString(std::move(buf), EdifyTokenString::AlreadyQuoted);
+        type = EdifyTokenType::String;
     } else {
-        *token = new EdifyTokenUnknown(data[p]);
+        type = EdifyTokenType::Unknown;
         p += 1;
     }
 
+    token->type = type;
+    token->offset = static_cast<uint32_t>(*pos);
+    token->size = static_cast<uint32_t>(p - *pos);
+
     *pos = p;
 
     return true;
 }
 
+bool EdifyTokenizer::next_token(const char *data, std::size_t size,
+                                std::size_t *pos, EdifyToken **token)
+{
+    EdifyTokenSpan span;
+
+    if (!next_token_span(data, size, pos, &span)) {
+        return false;
+    }
+
+    const char *str = data + span.offset;
+
+    switch (span.type) {
+    case EdifyTokenType::If:         *token = new EdifyTokenIf();         break;
+    case EdifyTokenType::Then:       *token = new EdifyTokenThen();       break;
+    case EdifyTokenType::Else:       *token = new EdifyTokenElse();       break;
+    case EdifyTokenType::Endif:      *token = new EdifyTokenEndif();      break;
+    case EdifyTokenType::And:        *token = new EdifyTokenAnd();        break;
+    case EdifyTokenType::Or:         *token = new EdifyTokenOr();         break;
+    case EdifyTokenType::Equals:     *token = new EdifyTokenEquals();     break;
+    case EdifyTokenType::NotEquals:  *token = new EdifyTokenNotEquals();  break;
+    case EdifyTokenType::Not:        *token = new EdifyTokenNot();        break;
+    case EdifyTokenType::LeftParen:  *token = new EdifyTokenLeftParen();  break;
+    case EdifyTokenType::RightParen: *token = new EdifyTokenRightParen(); break;
+    case EdifyTokenType::Semicolon:  *token = new EdifyTokenSemicolon();  break;
+    case EdifyTokenType::Comma:      *token = new EdifyTokenComma();      break;
+    case EdifyTokenType::Concat:     *token = new EdifyTokenConcat();     break;
+    case EdifyTokenType::Newline:    *token = new EdifyTokenNewline();    break;
+    case EdifyTokenType::Whitespace:
+        *token = new EdifyTokenWhitespace(std::string(str, span.size));
+        break;
+    case EdifyTokenType::Comment:
+        // Omit '#' character
+        *token = new EdifyTokenComment(std::string(str + 1, span.size - 1));
+        break;
+    case EdifyTokenType::String:
+        *token = new EdifyTokenString(std::string(str, span.size),
+                                      *str == '"'
+                                      ? EdifyTokenString::AlreadyQuoted
+                                      : EdifyTokenString::NotQuoted);
+        break;
+    case EdifyTokenType::Unknown:
+        *token = new EdifyTokenUnknown(*str);
+        break;
+    }
+
+    return true;
+}
+
 bool EdifyTokenizer::tokenize(const char *data, std::size_t size,
                               std::vector<EdifyToken *> *tokens)
 {
@@ -523,6 +616,57 @@ bool EdifyTokenizer::tokenize(const char *data, std::size_t size,
     return true;
 }
 
+/*!
+ * \brief Tokenize buffer into compact tokens
+ *
+ * The tokens only store their type and their position in \p data, so the
+ * buffer must outlive them.
+ */
+bool EdifyTokenizer::tokenize(const char *data, std::size_t size,
+                              std::vector<EdifyTokenSpan> *tokens)
+{
+    if (size > UINT32_MAX) {
+        LOGE("Data is too large to tokenize: %" MB_PRIzu, size);
+        return false;
+    }
+
+    std::vector<EdifyTokenSpan> temp;
+    EdifyTokenSpan token;
+    std::size_t pos = 0;
+
+    // Most tokens are a few bytes long
+    temp.reserve(size / 4);
+
+    while (pos < size) {
+        if (!next_token_span(data, size, &pos, &token)) {
+            return false;
+        }
+        temp.push_back(token);
+    }
+
+    tokens->swap(temp);
+    return true;
+}
+
+std::string EdifyTokenizer::token_string(const char *data,
+                                         const EdifyTokenSpan &token)
+{
+    return std::string(data + token.offset, token.size);
+}
+
+std::string EdifyTokenizer::token_unescaped_string(const char *data,
+                                                   const EdifyTokenSpan &token)
+{
+    std::string out;
+    // TODO: Check return value
+    EdifyTokenString::unescape(token_string(data, token), &out);
+    if (data[token.offset] == '"' && out.size() >= 2) {
+        out.pop_back();
+        out.erase(out.begin());
+    }
+    return out;
+}
+
 std::string EdifyTokenizer::untokenize(const std::vector<EdifyToken *> &tokens)
 {
     std::string output;
@@ -542,36 +686,48 @@ std::string EdifyTokenizer::untokenize(const std::vector<EdifyToken *>::iterator
     return output;
 }
 
-void EdifyTokenizer::dump(const std::vector<EdifyToken *> &tokens)
+static const char * token_type_name(EdifyTokenType type)
 {
-    const char *token_name = nullptr;
+    switch (type) {
+    case EdifyTokenType::If:         return "If";
+    case EdifyTokenType::Then:       return "Then";
+    case EdifyTokenType::Else:       return "Else";
+    case EdifyTokenType::Endif:      return "Endif";
+    case EdifyTokenType::And:        return "And";
+    case EdifyTokenType::Or:         return "Or";
+    case EdifyTokenType::Equals:     return "Equals";
+    case EdifyTokenType::NotEquals:  return "NotEquals";
+    case EdifyTokenType::Not:        return "Not";
+    case EdifyTokenType::LeftParen:  return "LeftParen";
+    case EdifyTokenType::RightParen: return "RightParen";
+    case EdifyTokenType::Semicolon:  return "Semicolon";
+    case EdifyTokenType::Comma:      return "Comma";
+    case EdifyTokenType::Concat:     return "Concat";
+    case EdifyTokenType::Newline:    return "Newline";
+    case EdifyTokenType::Whitespace: return "Whitespace";
+    case EdifyTokenType::Comment:    return "Comment";
+    case EdifyTokenType::String:     return "String";
+    case EdifyTokenType::Unknown:    return "Unknown";
+    }
+    return nullptr;
+}
 
+void EdifyTokenizer::dump(const std::vector<EdifyToken *> &tokens)
+{
     for (std::size_t i = 0; i < tokens.size(); ++i) {
         EdifyToken *t = tokens[i];
 
-        switch (t->type()) {
-        case EdifyTokenType::If:         token_name = "If";         break;
-        case EdifyTokenType::Then:       token_name = "Then";       break;
-        case EdifyTokenType::Else:       token_name = "Else";       break;
-        case EdifyTokenType::Endif:      token_name = "Endif";      break;
-        case EdifyTokenType::And:        token_name = "And";        break;
-        case EdifyTokenType::Or:         token_name = "Or";         break;
-        case EdifyTokenType::Equals:     token_name = "Equals";     break;
-        case EdifyTokenType::NotEquals:  token_name = "NotEquals";  break;
-        case EdifyTokenType::Not:        token_name = "Not";        break;
-        case EdifyTokenType::LeftParen:  token_name = "LeftParen";  break;
-        case EdifyTokenType::RightParen: token_name = "RightParen"; break;
-        case EdifyTokenType::Semicolon:  token_name = "Semicolon";  break;
-        case EdifyTokenType::Comma:      token_name = "Comma";      break;
-        case EdifyTokenType::Concat:     token_name = "Concat";     break;
-        case EdifyTokenType::Newline:    token_name = "Newline";    break;
-        case EdifyTokenType::Whitespace: token_name = "Whitespace"; break;
-        case EdifyTokenType::Comment:    token_name = "Comment";    break;
-        case EdifyTokenType::String:     token_name = "String";     break;
-        case EdifyTokenType::Unknown:    token_name = "Unknown";    break;
-        }
+        LOGD("%" MB_PRIzu ": %-20s: %s", i, token_type_name(t->type()),
+             t->generate().c_str());
+    }
+}
 
-        LOGD("%" MB_PRIzu ": %-20s: %s", i, token_name, t->generate().c_str());
+void EdifyTokenizer::dump(const char *data,
+                          const std::vector<EdifyTokenSpan> &tokens)
+{
+    for (std::size_t i = 0; i < tokens.size(); ++i) {
+        LOGD("%" MB_PRIzu ": %-20s: %s", i, token_type_name(tokens[i].type),
+             token_string(data, tokens[i]).c_str());
     }
 }
 
@@ -20,11 +20,17 @@
 #include "mbpatcher/patcherconfig.h"
 
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 #include <cassert>
 
+#include "mblog/logging.h"
+
 #include "mbpatcher/patcherinterface.h"
 #include "mbpatcher/private/fileutils.h"
+#include "mbpatcher/private/miniziputils.h"
 
 // Patchers
 #include "mbpatcher/autopatchers/standardpatcher.h"
@@ -46,6 +52,7 @@ public:
     // Directories
     std::string data_dir;
     std::string temp_dir;
+    std::string cache_dir;
 
     // Errors
     ErrorCode error;
@@ -53,7 +60,56 @@ public:
     // Created patchers
     std::vector<Patcher *> alloc_patchers;
     std::vector<AutoPatcher *> alloc_auto_patchers;
+
+    // Running batch
+    std::mutex batch_mutex;
+    std::vector<Patcher *> batch_patchers;
+    std::vector<bool> batch_cancelled;
+};
+
+struct BatchCallbackCtx
+{
+    PatcherConfigPrivate *priv;
+    Patcher *patcher;
+    size_t index;
+    PatcherConfig::BatchProgressCallback progress_cb;
+    PatcherConfig::BatchDetailsCallback details_cb;
+    void *userdata;
 };
+
+static void batch_progress_cb(uint64_t bytes, uint64_t max_bytes,
+                              void *userdata)
+{
+    auto *ctx = static_cast<BatchCallbackCtx *>(userdata);
+
+    // Patchers reset their cancellation flag when patching starts, so forward
+    // a cancellation that may have raced with it
+    {
+        std::lock_guard<std::mutex> lock(ctx->priv->batch_mutex);
+        if (ctx->priv->batch_cancelled[ctx->index]) {
+            ctx->patcher->cancel_patching();
+        }
+    }
+
+    if (ctx->progress_cb) {
+        ctx->progress_cb(ctx->index, bytes, max_bytes, ctx->userdata);
+    }
+}
+
+static void batch_files_cb(uint64_t files, uint64_t max_files, void *userdata)
+{
+    (void) files;
+    (void) max_files;
+    (void) userdata;
+}
+
+static void batch_details_cb(const std::string &text, void *userdata)
+{
+    auto *ctx = static_cast<BatchCallbackCtx *>(userdata);
+    if (ctx->details_cb) {
+        ctx->details_cb(ctx->index, text, ctx->userdata);
+    }
+}
 /*! \endcond */
 
 /*!
@@ -125,6 +181,17 @@ std::string PatcherConfig::temp_directory() const
     }
 }
 
+/*!
+ * \brief Get the patch cache directory
+ *
+ * \return Cache directory or an empty string if caching is disabled
+ */
+std::string PatcherConfig::cache_directory() const
+{
+    MB_PRIVATE(const PatcherConfig);
+    return priv->cache_dir;
+}
+
 /*!
  * \brief Set top-level data directory
  *
@@ -150,6 +217,22 @@ void PatcherConfig::set_temp_directory(std::string path)
     priv->temp_dir = std::move(path);
 }
 
+/*!
+ * \brief Set the patch cache directory
+ *
+ * If set, patchers store the device-independent portion of their output, as
+ * well as complete outputs, in this directory so that patching the same input
+ * again (for the same or another device) can reuse them. The directory must
+ * already exist. Caching is disabled by default.
+ *
+ * \param path Path to cache directory or an empty string to disable caching
+ */
+void PatcherConfig::set_cache_directory(std::string path)
+{
+    MB_PRIVATE(PatcherConfig);
+    priv->cache_dir = std::move(path);
+}
+
 /*!
  * \brief Get list of Patcher IDs
  *
@@ -270,6 +353,186 @@ void PatcherConfig::destroy_auto_patcher(AutoPatcher *patcher)
     priv->alloc_auto_patchers.erase(it);
     delete patcher;
 }
+/*!
+ * \brief Patch several files concurrently
+ *
+ * Each job is patched by a new patcher of the requested type. Up to \p max_jobs
+ * jobs run at the same time and the deflate threads of each job are limited so
+ * that, together, they use about one thread per CPU. The function returns once
+ * all jobs have finished or have been cancelled.
+ *
+ * \note The callbacks are invoked from the worker threads, possibly
+ *       concurrently for different jobs. The FilesUpdated notifications of the
+ *       individual patchers are not forwarded.
+ *
+ * \param jobs Files to patch and the ID of the patcher to use for each one
+ * \param max_jobs Maximum number of concurrent jobs or 0 to use one job per
+ *                 CPU
+ * \param progress_cb Called with the job index when its progress changes
+ * \param details_cb Called with the job index when its details change
+ * \param finished_cb Called with the job index and result when a job finishes
+ * \param userdata Data passed to the callbacks
+ *
+ * \return Result of each job. ErrorCode::NoError indicates success and
+ *         ErrorCode::PatchingCancelled indicates that the job was cancelled.
+ *
+ * \sa cancel_batch_job()
+ * \sa cancel_batch()
+ */
+std::vector<ErrorCode> PatcherConfig::patch_batch(
+        const std::vector<BatchJob> &jobs,
+        unsigned int max_jobs,
+        BatchProgressCallback progress_cb,
+        BatchDetailsCallback details_cb,
+        BatchFinishedCallback finished_cb,
+        void *userdata)
+{
+    MB_PRIVATE(PatcherConfig);
+
+    std::vector<ErrorCode> results(jobs.size(), ErrorCode::NoError);
+    std::vector<Patcher *> patchers(jobs.size(), nullptr);
+
+    // Patchers are created up front since create_patcher() is not thread-safe
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        patchers[i] = create_patcher(jobs[i].patcher_id);
+        if (!patchers[i]) {
+            LOGE("Invalid patcher ID: %s", jobs[i].patcher_id.c_str());
+            results[i] = ErrorCode::PatcherCreateError;
+        } else {
+            patchers[i]->set_file_info(jobs[i].info);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(priv->batch_mutex);
+        priv->batch_patchers.assign(jobs.size(), nullptr);
+        priv->batch_cancelled.assign(jobs.size(), false);
+    }
+
+    unsigned int cpus = std::max(1u, std::thread::hardware_concurrency());
+    if (max_jobs == 0) {
+        max_jobs = cpus;
+    }
+    unsigned int workers = static_cast<unsigned int>(
+            std::min<size_t>(max_jobs, jobs.size()));
+    unsigned int deflate_threads = std::max(1u, cpus / std::max(1u, workers));
+
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]() {
+        MinizipUtils::set_deflate_threads(deflate_threads);
+
+        size_t i;
+        while ((i = next++) < jobs.size()) {
+            if (!patchers[i]) {
+                if (finished_cb) {
+                    finished_cb(i, results[i], userdata);
+                }
+                continue;
+            }
+
+            bool cancelled;
+            {
+                std::lock_guard<std::mutex> lock(priv->batch_mutex);
+                cancelled = priv->batch_cancelled[i];
+                if (!cancelled) {
+                    priv->batch_patchers[i] = patchers[i];
+                }
+            }
+
+            if (cancelled) {
+                results[i] = ErrorCode::PatchingCancelled;
+            } else {
+                BatchCallbackCtx ctx{priv, patchers[i], i, progress_cb,
+                                     details_cb, userdata};
+
+                if (!patchers[i]->patch_file(&batch_progress_cb,
+                                             &batch_files_cb,
+                                             &batch_details_cb,
+                                             &ctx)) {
+                    results[i] = patchers[i]->error();
+                }
+
+                std::lock_guard<std::mutex> lock(priv->batch_mutex);
+                priv->batch_patchers[i] = nullptr;
+            }
+
+            if (finished_cb) {
+                finished_cb(i, results[i], userdata);
+            }
+        }
+
+        MinizipUtils::set_deflate_threads(0);
+    };
+
+    if (workers <= 1) {
+        worker();
+    } else {
+        std::vector<std::thread> threads;
+        threads.reserve(workers);
+        for (unsigned int i = 0; i < workers; ++i) {
+            threads.emplace_back(worker);
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(priv->batch_mutex);
+        priv->batch_patchers.clear();
+        priv->batch_cancelled.clear();
+    }
+
+    for (Patcher *p : patchers) {
+        if (p) {
+            destroy_patcher(p);
+        }
+    }
+
+    return results;
+}
+
+/*!
+ * \brief Cancel a job of the running batch
+ *
+ * This can be called from any thread. If the job has not started yet, it will
+ * be skipped.
+ *
+ * \param index Index of the job in the list passed to patch_batch()
+ */
+void PatcherConfig::cancel_batch_job(size_t index)
+{
+    MB_PRIVATE(PatcherConfig);
+
+    std::lock_guard<std::mutex> lock(priv->batch_mutex);
+
+    if (index < priv->batch_cancelled.size()) {
+        priv->batch_cancelled[index] = true;
+        if (priv->batch_patchers[index]) {
+            priv->batch_patchers[index]->cancel_patching();
+        }
+    }
+}
+
+/*!
+ * \brief Cancel all jobs of the running batch
+ *
+ * This can be called from any thread.
+ */
+void PatcherConfig::cancel_batch()
+{
+    MB_PRIVATE(PatcherConfig);
+
+    std::lock_guard<std::mutex> lock(priv->batch_mutex);
+
+    for (size_t i = 0; i < priv->batch_cancelled.size(); ++i) {
+        priv->batch_cancelled[i] = true;
+        if (priv->batch_patchers[i]) {
+            priv->batch_patchers[i]->cancel_patching();
+        }
+    }
+}
 
 }
 }
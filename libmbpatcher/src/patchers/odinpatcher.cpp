@@ -35,6 +35,8 @@
 #include <archive.h>
 #include <archive_entry.h>
 
+#include <openssl/md5.h>
+
 #include "mbcommon/locale.h"
 #include "mbcommon/string.h"
 
@@ -46,6 +48,7 @@
 #include "mbpatcher/patchers/zippatcher.h"
 #include "mbpatcher/private/fileutils.h"
 #include "mbpatcher/private/miniziputils.h"
+#include "mbpatcher/private/progressreporter.h"
 #include "mbpatcher/private/stringutils.h"
 
 #if defined(__ANDROID__)
@@ -65,13 +68,100 @@ namespace patcher
 {
 
 /*! \cond INTERNAL */
+
+// Room for "<32 hex digits>  <file name>\n" at the end of a .tar.md5 file
+#define TAR_MD5_MAX_TRAILER     1024
+
+enum class TarMd5Result
+{
+    Match,
+    Mismatch,
+    NoTrailer,
+};
+
+/*!
+ * \brief Computes the MD5 of a .tar.md5 file as it is streamed
+ *
+ * The last TAR_MD5_MAX_TRAILER bytes are held back until the end of the file
+ * because the trailer line is not part of the hashed data.
+ */
+class TarMd5Verifier
+{
+public:
+    TarMd5Verifier()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        MD5_Init(&_ctx);
+        _window.clear();
+    }
+
+    void update(const void *data, size_t size)
+    {
+        auto ptr = static_cast<const unsigned char *>(data);
+
+        if (size >= TAR_MD5_MAX_TRAILER) {
+            MD5_Update(&_ctx, _window.data(), _window.size());
+            MD5_Update(&_ctx, ptr, size - TAR_MD5_MAX_TRAILER);
+            _window.assign(ptr + size - TAR_MD5_MAX_TRAILER, ptr + size);
+        } else {
+            _window.insert(_window.end(), ptr, ptr + size);
+            if (_window.size() > TAR_MD5_MAX_TRAILER) {
+                size_t excess = _window.size() - TAR_MD5_MAX_TRAILER;
+                MD5_Update(&_ctx, _window.data(), excess);
+                _window.erase(_window.begin(), _window.begin() + excess);
+            }
+        }
+    }
+
+    TarMd5Result finish(std::string &expected, std::string &actual)
+    {
+        // The trailer directly follows the zero blocks at the end of the tar
+        auto nul = std::find(_window.rbegin(), _window.rend(), '\0');
+        size_t start = static_cast<size_t>(_window.rend() - nul);
+
+        if (_window.size() - start < 32 + 2
+                || !std::all_of(_window.begin() + start,
+                                _window.begin() + start + 32,
+                                [](unsigned char c) { return isxdigit(c); })
+                || _window[start + 32] != ' ') {
+            return TarMd5Result::NoTrailer;
+        }
+
+        static const char digits[] = "0123456789abcdef";
+        unsigned char digest[MD5_DIGEST_LENGTH];
+
+        MD5_Update(&_ctx, _window.data(), start);
+        MD5_Final(digest, &_ctx);
+
+        expected.assign(_window.begin() + start, _window.begin() + start + 32);
+        std::transform(expected.begin(), expected.end(), expected.begin(),
+                       [](unsigned char c) { return tolower(c); });
+
+        actual.clear();
+        for (unsigned char c : digest) {
+            actual += digits[c >> 4];
+            actual += digits[c & 0xf];
+        }
+
+        return expected == actual
+                ? TarMd5Result::Match : TarMd5Result::Mismatch;
+    }
+
+private:
+    MD5_CTX _ctx;
+    std::vector<unsigned char> _window;
+};
+
 class OdinPatcherPrivate
 {
 public:
     PatcherConfig *pc;
     const FileInfo *info;
 
-    uint64_t old_bytes;
     uint64_t bytes;
     uint64_t max_bytes;
 
@@ -86,13 +176,14 @@ public:
 #else
     StandardFile la_file;
 #endif
+    // Only uncompressed tarballs can be verified while they are read
+    bool verify_md5;
+    TarMd5Verifier md5;
 
     std::unordered_set<std::string> added_files;
 
     // Callbacks
-    OdinPatcher::ProgressUpdatedCallback progress_cb;
-    OdinPatcher::DetailsUpdatedCallback details_cb;
-    void *userdata;
+    ProgressReporter *reporter = nullptr;
 
     // Patching
     archive *a_input = nullptr;
@@ -102,6 +193,7 @@ public:
 
     bool process_file(archive *a, archive_entry *entry, bool sparse);
     bool process_contents(archive *a, int depth);
+    bool check_md5(TarMd5Verifier &verifier, const char *name);
     bool open_input_archive();
     bool close_input_archive();
     bool open_output_archive();
@@ -173,19 +265,16 @@ bool OdinPatcher::patch_file(ProgressUpdatedCallback progress_cb,
 
     assert(priv->info != nullptr);
 
-    priv->progress_cb = progress_cb;
-    priv->details_cb = details_cb;
-    priv->userdata = userdata;
+    ProgressReporter reporter(progress_cb, nullptr, details_cb, userdata);
+    priv->reporter = &reporter;
 
-    priv->old_bytes = 0;
     priv->bytes = 0;
     priv->max_bytes = 0;
 
     bool ret = priv->patch_tar();
 
-    priv->progress_cb = nullptr;
-    priv->details_cb = nullptr;
-    priv->userdata = nullptr;
+    reporter.stop();
+    priv->reporter = nullptr;
 
     if (priv->a_input != nullptr) {
         priv->close_input_archive();
@@ -242,9 +331,17 @@ bool OdinPatcherPrivate::patch_tar()
 
     update_progress(bytes, max_bytes);
 
+    verify_md5 = true;
+    md5.reset();
+
     if (!open_input_archive()) {
         return false;
     }
+
+    // The MD5 covers the uncompressed tarball
+    if (archive_filter_code(a_input, 0) != ARCHIVE_FILTER_NONE) {
+        verify_md5 = false;
+    }
     if (!open_output_archive()) {
         return false;
     }
@@ -268,6 +365,25 @@ bool OdinPatcherPrivate::patch_tar()
         return false;
     }
 
+    if (verify_md5 && (archive_format(a_input) & ARCHIVE_FORMAT_BASE_MASK)
+            == ARCHIVE_FORMAT_TAR) {
+        // Feed whatever libarchive did not need to read, ie. the trailer
+        size_t n;
+        do {
+            if (!la_file.read(la_buf, sizeof(la_buf), n)) {
+                LOGE("%s: Failed to read: %s", info->input_path().c_str(),
+                     la_file.error_string().c_str());
+                error = ErrorCode::FileReadError;
+                return false;
+            }
+            md5.update(la_buf, n);
+        } while (n > 0);
+
+        if (!check_md5(md5, info->input_path().c_str())) {
+            return false;
+        }
+    }
+
     std::string arch_dir(pc->data_directory());
     arch_dir += "/binaries/android/";
     arch_dir += info->device().architecture();
@@ -382,66 +498,41 @@ bool OdinPatcherPrivate::process_file(archive *a, archive_entry *entry,
         zip_name += ".sparse";
     }
 
-    // Ha! I'll be impressed if a Samsung firmware image does NOT need zip64
-    int zip64 = archive_entry_size(entry) > ((1ll << 32) - 1);
-
-    zip_fileinfo zi;
-    memset(&zi, 0, sizeof(zi));
-
     zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
+    bool read_failed = false;
+
+    // The entry data is decoded on this thread while the deflate blocks are
+    // compressed on a worker pool with a bounded number of blocks in flight
+    auto result = MinizipUtils::add_file(
+            zf, zip_name, static_cast<uint64_t>(archive_entry_size(entry)),
+            [&](void *buf, size_t size, size_t &bytes_read) {
+        bytes_read = 0;
+
+        while (bytes_read < size) {
+            if (cancelled) return false;
+
+            la_ssize_t n = archive_read_data(
+                    a, static_cast<char *>(buf) + bytes_read,
+                    size - bytes_read);
+            if (n == 0) {
+                break;
+            } else if (n < 0) {
+                LOGE("libarchive: Failed to read %s: %s",
+                     name, archive_error_string(a));
+                read_failed = true;
+                return false;
+            }
 
-    // Open file in output zip
-    int mz_ret = zipOpenNewFileInZip2_64(
-        zf,                    // file
-        zip_name.c_str(),      // filename
-        &zi,                   // zip_fileinfo
-        nullptr,               // extrafield_local
-        0,                     // size_extrafield_local
-        nullptr,               // extrafield_global
-        0,                     // size_extrafield_global
-        nullptr,               // comment
-        Z_DEFLATED,            // method
-        Z_DEFAULT_COMPRESSION, // level
-        0,                     // raw
-        zip64                  // zip64
-    );
-    if (mz_ret != ZIP_OK) {
-        LOGE("minizip: Failed to open new file in output zip: %s",
-             MinizipUtils::zip_error_string(mz_ret).c_str());
-        error = ErrorCode::ArchiveWriteHeaderError;
-        return false;
-    }
-
-    la_ssize_t n_read;
-    char buf[10240];
-    while ((n_read = archive_read_data(a, buf, sizeof(buf))) > 0) {
-        if (cancelled) return false;
-
-        mz_ret = zipWriteInFileInZip(zf, buf, n_read);
-        if (mz_ret != ZIP_OK) {
-            LOGE("minizip: Failed to write %s in output zip: %s",
-                 zip_name.c_str(),
-                 MinizipUtils::zip_error_string(mz_ret).c_str());
-            error = ErrorCode::ArchiveWriteDataError;
-            zipCloseFileInZip(zf);
-            return false;
+            bytes_read += static_cast<size_t>(n);
         }
-    }
 
-    if (n_read != 0) {
-        LOGE("libarchive: Failed to read %s: %s",
-             name, archive_error_string(a));
-        error = ErrorCode::ArchiveReadDataError;
-        zipCloseFileInZip(zf);
-        return false;
-    }
+        return true;
+    });
+
+    if (cancelled) return false;
 
-    // Close file in output zip
-    mz_ret = zipCloseFileInZip(zf);
-    if (mz_ret != ZIP_OK) {
-        LOGE("minizip: Failed to close file in output zip: %s",
-             MinizipUtils::zip_error_string(mz_ret).c_str());
-        error = ErrorCode::ArchiveWriteDataError;
+    if (result != ErrorCode::NoError) {
+        error = read_failed ? ErrorCode::ArchiveReadDataError : result;
         return false;
     }
 
@@ -467,6 +558,7 @@ struct NestedCtx
     archive *nested;
     archive *parent;
     char buf[10240];
+    TarMd5Verifier md5;
 
     NestedCtx(archive *a) : nested(archive_read_new()), parent(a)
     {
@@ -545,6 +637,21 @@ bool OdinPatcherPrivate::process_contents(archive *a, int depth)
             if (!process_contents(ctx.nested, depth + 1)) {
                 return false;
             }
+
+            la_ssize_t n;
+            while ((n = archive_read_data(a, ctx.buf, sizeof(ctx.buf))) > 0) {
+                ctx.md5.update(ctx.buf, static_cast<size_t>(n));
+            }
+            if (n != 0) {
+                LOGE("libarchive: Failed to read %s: %s",
+                     name, archive_error_string(a));
+                error = ErrorCode::ArchiveReadDataError;
+                return false;
+            }
+
+            if (!check_md5(ctx.md5, name)) {
+                return false;
+            }
         } else {
             LOGD("%sSkipping unneeded file: %s", indent(depth), name);
 
@@ -569,6 +676,34 @@ bool OdinPatcherPrivate::process_contents(archive *a, int depth)
     return true;
 }
 
+/*!
+ * \brief Check the MD5 trailer of a fully read .tar.md5 file
+ *
+ * \return False if the checksum does not match. Files without a trailer are
+ *         accepted.
+ */
+bool OdinPatcherPrivate::check_md5(TarMd5Verifier &verifier, const char *name)
+{
+    std::string expected;
+    std::string actual;
+
+    switch (verifier.finish(expected, actual)) {
+    case TarMd5Result::Match:
+        LOGD("%s: MD5 checksum verified: %s", name, actual.c_str());
+        return true;
+    case TarMd5Result::NoTrailer:
+        LOGW("%s: No MD5 checksum trailer; not verifying", name);
+        return true;
+    case TarMd5Result::Mismatch:
+        LOGE("%s: MD5 checksum mismatch: expected %s, but have %s",
+             name, expected.c_str(), actual.c_str());
+        error = ErrorCode::ArchiveReadDataError;
+        return false;
+    }
+
+    return false;
+}
+
 bool OdinPatcherPrivate::open_input_archive()
 {
     assert(a_input == nullptr);
@@ -650,28 +785,12 @@ bool OdinPatcherPrivate::close_output_archive()
 
 void OdinPatcherPrivate::update_progress(uint64_t bytes, uint64_t max_bytes)
 {
-    if (progress_cb) {
-        bool should_call = true;
-        if (max_bytes > 0) {
-            // Rate limit... call back only if percentage exceeds 0.01%
-            double old_ratio = (double) old_bytes / max_bytes;
-            double new_ratio = (double) bytes / max_bytes;
-            if (new_ratio - old_ratio < 0.0001) {
-                should_call = false;
-            }
-        }
-        if (should_call) {
-            progress_cb(bytes, max_bytes, userdata);
-            old_bytes = bytes;
-        }
-    }
+    reporter->set_progress(bytes, max_bytes);
 }
 
 void OdinPatcherPrivate::update_details(const std::string &msg)
 {
-    if (details_cb) {
-        details_cb(msg, userdata);
-    }
+    reporter->set_details(msg);
 }
 
 la_ssize_t OdinPatcherPrivate::la_nested_read_cb(archive *a, void *userdata,
@@ -683,7 +802,12 @@ la_ssize_t OdinPatcherPrivate::la_nested_read_cb(archive *a, void *userdata,
 
     *buffer = ctx->buf;
 
-    return archive_read_data(ctx->parent, ctx->buf, sizeof(ctx->buf));
+    la_ssize_t n = archive_read_data(ctx->parent, ctx->buf, sizeof(ctx->buf));
+    if (n > 0) {
+        ctx->md5.update(ctx->buf, static_cast<size_t>(n));
+    }
+
+    return n;
 }
 
 la_ssize_t OdinPatcherPrivate::la_read_cb(archive *a, void *userdata,
@@ -701,6 +825,10 @@ la_ssize_t OdinPatcherPrivate::la_read_cb(archive *a, void *userdata,
         return -1;
     }
 
+    if (priv->verify_md5) {
+        priv->md5.update(priv->la_buf, bytes_read);
+    }
+
     priv->bytes += bytes_read;
     priv->update_progress(priv->bytes, priv->max_bytes);
     return static_cast<la_ssize_t>(bytes_read);
@@ -712,6 +840,11 @@ la_int64_t OdinPatcherPrivate::la_skip_cb(archive *a, void *userdata,
     (void) a;
     auto *priv = static_cast<OdinPatcherPrivate *>(userdata);
 
+    // Skipped data still needs to be hashed, so have libarchive read it
+    if (priv->verify_md5) {
+        return 0;
+    }
+
     if (!priv->la_file.seek(request, SEEK_CUR, nullptr)) {
         LOGE("%s: Failed to seek: %s", priv->info->input_path().c_str(),
              priv->la_file.error_string().c_str());
@@ -20,6 +20,7 @@
 #include "mbpatcher/patchers/zippatcher.h"
 
 #include <algorithm>
+#include <unordered_map>
 #include <unordered_set>
 
 #include <cassert>
@@ -34,12 +35,19 @@
 #include "mbpatcher/patcherconfig.h"
 #include "mbpatcher/private/fileutils.h"
 #include "mbpatcher/private/miniziputils.h"
+#include "mbpatcher/private/patchcache.h"
+#include "mbpatcher/private/progressreporter.h"
 #include "mbpatcher/private/stringutils.h"
+#include "mbpatcher/private/ziprewriter.h"
 
 // minizip
 #include "minizip/unzip.h"
 #include "minizip/zip.h"
 
+// Files needed by the autopatchers that are no larger than this are kept in
+// memory instead of being extracted to a temporary directory
+#define MAX_BUFFERED_FILE_SIZE          (16 * 1024 * 1024)
+
 
 namespace mb
 {
@@ -63,25 +71,32 @@ public:
     ErrorCode error;
 
     // Callbacks
-    ZipPatcher::ProgressUpdatedCallback progress_cb;
-    ZipPatcher::FilesUpdatedCallback files_cb;
-    ZipPatcher::DetailsUpdatedCallback details_cb;
-    void *userdata;
+    ProgressReporter *reporter = nullptr;
 
     // Patching
     MinizipUtils::UnzCtx *z_input = nullptr;
     MinizipUtils::ZipCtx *z_output = nullptr;
     std::vector<AutoPatcher *> auto_patchers;
+    // Autopatcher files kept in memory
+    std::unordered_map<std::string, std::string> buffered_files;
+    // Autopatcher files too large to keep in memory
+    std::unordered_set<std::string> extracted_files;
+    std::string temp_dir;
+    // Where to store the output once it is complete
+    std::string result_cache_path;
 
     bool patch_zip();
 
-    bool pass1(const std::string &temporary_dir,
-               const std::unordered_set<std::string> &exclude);
-    bool pass2(const std::string &temporary_dir,
-               const std::unordered_set<std::string> &files);
+    bool pass1(const std::unordered_set<std::string> &exclude);
+    bool pass1_rewrite(const std::unordered_set<std::string> &exclude,
+                       ZipRewriter &rewriter, bool extract_only);
+    bool pass2(const std::unordered_set<std::string> &files);
+    bool extract_for_autopatchers(unzFile uf, const unz_file_info64 &fi,
+                                  const std::string &name);
+    void remove_temporary_dir();
     bool open_input_archive();
     void close_input_archive();
-    bool open_output_archive();
+    bool open_output_archive(bool append);
     void close_output_archive();
 
     void update_progress(uint64_t bytes, uint64_t maxBytes);
@@ -140,10 +155,8 @@ bool ZipPatcher::patch_file(ProgressUpdatedCallback progress_cb,
 
     assert(priv->info != nullptr);
 
-    priv->progress_cb = progress_cb;
-    priv->files_cb = files_cb;
-    priv->details_cb = details_cb;
-    priv->userdata = userdata;
+    ProgressReporter reporter(progress_cb, files_cb, details_cb, userdata);
+    priv->reporter = &reporter;
 
     priv->bytes = 0;
     priv->max_bytes = 0;
@@ -152,10 +165,8 @@ bool ZipPatcher::patch_file(ProgressUpdatedCallback progress_cb,
 
     bool ret = priv->patch_zip();
 
-    priv->progress_cb = nullptr;
-    priv->files_cb = nullptr;
-    priv->details_cb = nullptr;
-    priv->userdata = nullptr;
+    reporter.stop();
+    priv->reporter = nullptr;
 
     for (auto *p : priv->auto_patchers) {
         priv->pc->destroy_auto_patcher(p);
@@ -169,6 +180,15 @@ bool ZipPatcher::patch_file(ProgressUpdatedCallback progress_cb,
         priv->close_output_archive();
     }
 
+    priv->buffered_files.clear();
+    priv->extracted_files.clear();
+    priv->remove_temporary_dir();
+
+    if (ret && !priv->cancelled && !priv->result_cache_path.empty()) {
+        PatchCache::store(priv->info->output_path(), priv->result_cache_path);
+    }
+    priv->result_cache_path.clear();
+
     if (priv->cancelled) {
         priv->error = ErrorCode::PatchingCancelled;
         return false;
@@ -209,21 +229,31 @@ bool ZipPatcherPrivate::patch_zip()
         }
     }
 
-    // Unlike the old patcher, we'll write directly to the new file
-    if (!open_output_archive()) {
-        return false;
-    }
-
-    zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
-
     if (cancelled) return false;
 
+    // Untouched entries are copied as raw byte ranges if the input can be
+    // rewritten directly. The rewriter's parsed central directory is also
+    // used for computing the progress totals and for walking the entries.
+    ZipRewriter rewriter;
+    bool use_rewriter = rewriter.open_input(info->input_path())
+            == ErrorCode::NoError;
+
     MinizipUtils::ArchiveStats stats;
-    auto result = MinizipUtils::archive_stats(info->input_path(), &stats,
-                                              std::vector<std::string>());
-    if (result != ErrorCode::NoError) {
-        error = result;
-        return false;
+    ErrorCode result;
+
+    if (use_rewriter) {
+        stats.files = rewriter.entries();
+        stats.total_size = 0;
+        for (size_t i = 0; i < rewriter.entries(); ++i) {
+            stats.total_size += rewriter.entry_size(i);
+        }
+    } else {
+        result = MinizipUtils::archive_stats(info->input_path(), &stats,
+                                             std::vector<std::string>());
+        if (result != ErrorCode::NoError) {
+            error = result;
+            return false;
+        }
     }
 
     max_bytes = stats.total_size;
@@ -275,25 +305,85 @@ bool ZipPatcherPrivate::patch_zip()
         return false;
     }
 
-    // Create temporary dir for extracted files for autopatchers
-    std::string temp_dir =
-            FileUtils::create_temporary_dir(pc->temp_directory());
+    // Unlike the old patcher, we'll write directly to the new file. If the
+    // input cannot be rewritten directly, entries are copied through minizip.
+
+    // The rewritten entries do not depend on the target device, so they are
+    // cached as a template that later runs start from
+    PatchCache cache(pc);
+    std::string template_cache_path;
+    bool from_template = false;
+
+    if (use_rewriter && cache.enabled()) {
+        result_cache_path = cache.result_path(
+                ZipPatcher::Id, rewriter.input_digest(), info);
+        if (!result_cache_path.empty() && PatchCache::fetch(
+                result_cache_path, info->output_path())) {
+            result_cache_path.clear();
+            files = max_files;
+            update_files(files, max_files);
+            return true;
+        }
 
-    if (!pass1(temp_dir, exclude_from_pass1)) {
-        io::deleteRecursively(temp_dir);
+        template_cache_path = cache.template_path(
+                ZipPatcher::Id, rewriter.input_digest());
+        from_template = PatchCache::fetch(template_cache_path,
+                                          info->output_path());
+    }
+
+    if (from_template) {
+        // Only the files for the autopatchers need to be read
+    } else if (use_rewriter) {
+        result = rewriter.open_output(info->output_path());
+        if (result != ErrorCode::NoError) {
+            error = ErrorCode::ArchiveWriteOpenError;
+            return false;
+        }
+    } else {
+        LOGW("Cannot rewrite zip directly; copying entries with minizip");
+
+        if (!open_output_archive(false)) {
+            return false;
+        }
+    }
+
+    if (use_rewriter
+            ? !pass1_rewrite(exclude_from_pass1, rewriter, from_template)
+            : !pass1(exclude_from_pass1)) {
         return false;
     }
 
     if (cancelled) return false;
 
+    if (use_rewriter && !from_template) {
+        // Add the remaining files to the rewritten zip with minizip
+        result = rewriter.finish();
+        if (result != ErrorCode::NoError) {
+            error = result;
+            return false;
+        }
+
+        if (!template_cache_path.empty()) {
+            PatchCache::store(info->output_path(), template_cache_path);
+        }
+    }
+
+    if (use_rewriter || from_template) {
+        if (!open_output_archive(true)) {
+            return false;
+        }
+    }
+
+    zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
+
     // On the second pass, run the autopatchers on the rest of the files
 
-    if (!pass2(temp_dir, exclude_from_pass1)) {
-        io::deleteRecursively(temp_dir);
+    if (!pass2(exclude_from_pass1)) {
         return false;
     }
 
-    io::deleteRecursively(temp_dir);
+    buffered_files.clear();
+    remove_temporary_dir();
 
     for (const CopySpec &spec : to_copy) {
         if (cancelled) return false;
@@ -352,11 +442,11 @@ bool ZipPatcherPrivate::patch_zip()
  *
  * This performs the following operations:
  *
- * - Files needed by an AutoPatcher are extracted to the temporary directory.
+ * - Files needed by an AutoPatcher are read into memory or, if they are too
+ *   large, extracted to the temporary directory.
  * - Otherwise, the file is copied directly to the output zip.
  */
-bool ZipPatcherPrivate::pass1(const std::string &temporary_dir,
-                              const std::unordered_set<std::string> &exclude)
+bool ZipPatcherPrivate::pass1(const std::unordered_set<std::string> &exclude)
 {
     unzFile uf = MinizipUtils::ctx_get_unz_file(z_input);
     zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
@@ -383,8 +473,7 @@ bool ZipPatcherPrivate::pass1(const std::string &temporary_dir,
 
         // Skip files that should be patched and added in pass 2
         if (exclude.find(cur_file) != exclude.end()) {
-            if (!MinizipUtils::extract_file(uf, temporary_dir)) {
-                error = ErrorCode::ArchiveReadDataError;
+            if (!extract_for_autopatchers(uf, fi, cur_file)) {
                 return false;
             }
             continue;
@@ -395,7 +484,8 @@ bool ZipPatcherPrivate::pass1(const std::string &temporary_dir,
             cur_file = "META-INF/com/google/android/update-binary.orig";
         }
 
-        if (!MinizipUtils::copy_file_raw(uf, zf, cur_file, &la_progress_cb, this)) {
+        if (!MinizipUtils::copy_file_raw(uf, zf, cur_file,
+                                         &la_progress_cb, this)) {
             LOGW("minizip: Failed to copy raw data: %s", cur_file.c_str());
             error = ErrorCode::ArchiveWriteDataError;
             return false;
@@ -414,22 +504,139 @@ bool ZipPatcherPrivate::pass1(const std::string &temporary_dir,
     return true;
 }
 
+/*!
+ * \brief First pass of patching operation using the rewriter
+ *
+ * Same as pass1(), except that the entries are walked using the central
+ * directory already parsed by \p rewriter and are copied as raw byte ranges.
+ * minizip is only moved directly to the files needed by the AutoPatchers. If
+ * \p extract_only is set, nothing is copied because the output already
+ * contains the entries.
+ */
+bool ZipPatcherPrivate::pass1_rewrite(
+        const std::unordered_set<std::string> &exclude,
+        ZipRewriter &rewriter, bool extract_only)
+{
+    unzFile uf = MinizipUtils::ctx_get_unz_file(z_input);
+
+    for (size_t i = 0; i < rewriter.entries(); ++i) {
+        if (cancelled) return false;
+
+        std::string cur_file = rewriter.entry_name(i);
+
+        update_files(++files, max_files);
+        update_details(cur_file);
+
+        // Skip files that should be patched and added in pass 2
+        if (exclude.find(cur_file) != exclude.end()) {
+            unz_file_info64 fi;
+            std::string name;
+
+            if (unzSetOffset64(uf, rewriter.entry_central_dir_offset(i))
+                    != UNZ_OK
+                    || !MinizipUtils::get_info(uf, &fi, &name)
+                    || name != cur_file) {
+                LOGE("%s: Entry does not match central directory",
+                     cur_file.c_str());
+                error = ErrorCode::ArchiveReadHeaderError;
+                return false;
+            }
+
+            if (!extract_for_autopatchers(uf, fi, cur_file)) {
+                return false;
+            }
+            continue;
+        }
+
+        // Rename the installer for mbtool
+        if (cur_file == "META-INF/com/google/android/update-binary") {
+            cur_file = "META-INF/com/google/android/update-binary.orig";
+        }
+
+        if (!extract_only) {
+            auto result = rewriter.copy_entry(i, cur_file,
+                                              &la_progress_cb, this);
+            if (result != ErrorCode::NoError) {
+                error = result;
+                return false;
+            }
+        }
+
+        bytes += rewriter.entry_size(i);
+    }
+
+    if (cancelled) return false;
+
+    return true;
+}
+
+/*!
+ * \brief Read or extract a file needed by the AutoPatchers
+ */
+bool ZipPatcherPrivate::extract_for_autopatchers(unzFile uf,
+                                                 const unz_file_info64 &fi,
+                                                 const std::string &name)
+{
+    if (fi.uncompressed_size <= MAX_BUFFERED_FILE_SIZE) {
+        std::vector<unsigned char> data;
+
+        if (!MinizipUtils::read_to_memory(uf, &data, nullptr, nullptr)) {
+            error = ErrorCode::ArchiveReadDataError;
+            return false;
+        }
+
+        buffered_files[name].assign(data.begin(), data.end());
+        return true;
+    }
+
+    if (temp_dir.empty()) {
+        temp_dir = FileUtils::create_temporary_dir(pc->temp_directory());
+        if (temp_dir.empty()) {
+            error = ErrorCode::FileOpenError;
+            return false;
+        }
+    }
+
+    if (!MinizipUtils::extract_file(uf, temp_dir)) {
+        error = ErrorCode::ArchiveReadDataError;
+        return false;
+    }
+
+    extracted_files.insert(name);
+    return true;
+}
+
+void ZipPatcherPrivate::remove_temporary_dir()
+{
+    if (!temp_dir.empty()) {
+        io::deleteRecursively(temp_dir);
+        temp_dir.clear();
+    }
+}
+
 /*!
  * \brief Second pass of patching operation
  *
  * This performs the following operations:
  *
- * - Patch files in the temporary directory using the AutoPatchers and add the
+ * - Patch the buffered and extracted files using the AutoPatchers and add the
  *   resulting files to the output zip
  */
-bool ZipPatcherPrivate::pass2(const std::string &temporary_dir,
-                              const std::unordered_set<std::string> &files)
+bool ZipPatcherPrivate::pass2(const std::unordered_set<std::string> &files)
 {
     zipFile zf = MinizipUtils::ctx_get_zip_file(z_output);
 
     for (auto *ap : auto_patchers) {
         if (cancelled) return false;
-        if (!ap->patch_files(temporary_dir)) {
+
+        for (auto &item : buffered_files) {
+            if (!ap->patch_buffer(item.first, item.second)) {
+                error = ap->error();
+                return false;
+            }
+        }
+
+        if (!temp_dir.empty() && !ap->patch_files(temp_dir)) {
             error = ap->error();
             return false;
         }
@@ -440,23 +647,26 @@ bool ZipPatcherPrivate::pass2(const std::string &temporary_dir,
     for (auto const &file : files) {
         if (cancelled) return false;
 
+        std::string name = file;
+        if (name == "META-INF/com/google/android/update-binary") {
+            name = "META-INF/com/google/android/update-binary.orig";
+        }
+
         ErrorCode ret;
+        auto it = buffered_files.find(file);
 
-        if (file == "META-INF/com/google/android/update-binary") {
+        if (it != buffered_files.end()) {
             ret = MinizipUtils::add_file(
-                    zf,
-                    "META-INF/com/google/android/update-binary.orig",
-                      temporary_dir + "/" + file);
+                    zf, name, std::vector<unsigned char>(
+                            it->second.begin(), it->second.end()));
+        } else if (extracted_files.find(file) != extracted_files.end()) {
+            ret = MinizipUtils::add_file(zf, name, temp_dir + "/" + file);
         } else {
-            ret = MinizipUtils::add_file(
-                    zf,
-                    file,
-                      temporary_dir + "/" + file);
+            LOGW("File does not exist in input zip: %s", file.c_str());
+            continue;
         }
 
-        if (ret == ErrorCode::FileOpenError) {
-            LOGW("File does not exist in temporary directory: %s", file.c_str());
-        } else if (ret != ErrorCode::NoError) {
+        if (ret != ErrorCode::NoError) {
             error = ret;
             return false;
         }
@@ -495,11 +705,11 @@ void ZipPatcherPrivate::close_input_archive()
     z_input = nullptr;
 }
 
-bool ZipPatcherPrivate::open_output_archive()
+bool ZipPatcherPrivate::open_output_archive(bool append)
 {
     assert(z_output == nullptr);
 
-    z_output = MinizipUtils::open_output_file(info->output_path());
+    z_output = MinizipUtils::open_output_file(info->output_path(), append);
 
     if (!z_output) {
         LOGE("minizip: Failed to open for writing: %s",
@@ -525,23 +735,17 @@ void ZipPatcherPrivate::close_output_archive()
 
 void ZipPatcherPrivate::update_progress(uint64_t bytes, uint64_t max_bytes)
 {
-    if (progress_cb) {
-        progress_cb(bytes, max_bytes, userdata);
-    }
+    reporter->set_progress(bytes, max_bytes);
 }
 
 void ZipPatcherPrivate::update_files(uint64_t files, uint64_t max_files)
 {
-    if (files_cb) {
-        files_cb(files, max_files, userdata);
-    }
+    reporter->set_files(files, max_files);
 }
 
 void ZipPatcherPrivate::update_details(const std::string &msg)
 {
-    if (details_cb) {
-        details_cb(msg, userdata);
-    }
+    reporter->set_details(msg);
 }
 
 void ZipPatcherPrivate::la_progress_cb(uint64_t bytes, void *userdata)
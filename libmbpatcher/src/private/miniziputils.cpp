@@ -20,6 +20,12 @@
 #include "mbpatcher/private/miniziputils.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include <cassert>
 #include <cerrno>
@@ -31,6 +37,7 @@
 #endif
 
 #include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
 #include "mbcommon/locale.h"
 
 #include "mblog/logging.h"
@@ -57,6 +64,7 @@
 #endif
 
 #include "mbpatcher/private/fileutils.h"
+#include "mbpatcher/private/ziprewriter.h"
 
 
 namespace mb
@@ -192,7 +200,8 @@ MinizipUtils::UnzCtx * MinizipUtils::open_input_file(std::string path)
     return ctx;
 }
 
-MinizipUtils::ZipCtx * MinizipUtils::open_output_file(std::string path)
+MinizipUtils::ZipCtx * MinizipUtils::open_output_file(std::string path,
+                                                      bool append)
 {
     ZipCtx *ctx = new(std::nothrow) ZipCtx();
     if (!ctx) {
@@ -215,7 +224,10 @@ MinizipUtils::ZipCtx * MinizipUtils::open_output_file(std::string path)
 #endif
 
     fill_buffer_filefunc64(&ctx->z_func, &ctx->buf);
-    ctx->zf = zipOpen2_64(ctx->path.c_str(), 0, nullptr, &ctx->z_func);
+    ctx->zf = zipOpen2_64(ctx->path.c_str(),
+                          append ? APPEND_STATUS_ADDINZIP
+                                 : APPEND_STATUS_CREATE,
+                          nullptr, &ctx->z_func);
     if (!ctx->zf) {
         free(ctx);
         return nullptr;
@@ -244,6 +256,27 @@ ErrorCode MinizipUtils::archive_stats(const std::string &path,
 {
     assert(stats != nullptr);
 
+    uint64_t count = 0;
+    uint64_t total_size = 0;
+
+    // The sizes can be read from the central directory with a single read,
+    // unless the archive needs zip64 records
+    ZipRewriter rewriter;
+    if (rewriter.open_input(path) == ErrorCode::NoError) {
+        for (size_t i = 0; i < rewriter.entries(); ++i) {
+            if (std::find(ignore.begin(), ignore.end(),
+                          rewriter.entry_name(i)) == ignore.end()) {
+                ++count;
+                total_size += rewriter.entry_size(i);
+            }
+        }
+
+        stats->files = count;
+        stats->total_size = total_size;
+
+        return ErrorCode::NoError;
+    }
+
     UnzCtx *ctx = open_input_file(path);
 
     if (!ctx) {
@@ -251,8 +284,6 @@ ErrorCode MinizipUtils::archive_stats(const std::string &path,
         return ErrorCode::ArchiveReadOpenError;
     }
 
-    uint64_t count = 0;
-    uint64_t total_size = 0;
     std::string name;
     unz_file_info64 fi;
     memset(&fi, 0, sizeof(fi));
@@ -630,15 +661,202 @@ static bool get_file_time(const std::string &filename, uint32_t *dostime)
     return false;
 }
 
-ErrorCode MinizipUtils::add_file(zipFile zf,
-                                 const std::string &name,
-                                 const std::vector<unsigned char> &contents)
+/*
+ * Entries added to the output zip are deflated in independent blocks on a
+ * pool of threads, the same way pigz does it. Each block is primed with the
+ * last 32 KiB of the data before it and all but the last one end with a sync
+ * flush, so the compressed blocks can simply be concatenated into a single
+ * valid deflate stream. Only a bounded number of blocks are kept in memory.
+ */
+
+// Uncompressed size of each independently compressed block
+#define DEFLATE_BLOCK_SIZE      (256 * 1024)
+// Size of deflate's window, which is used to prime each block
+#define DEFLATE_DICT_SIZE       (32 * 1024)
+// Maximum number of compression threads
+#define DEFLATE_MAX_THREADS     8u
+// Number of blocks queued per thread before waiting for the oldest one
+#define DEFLATE_BLOCKS_PER_THREAD 2u
+
+// Per-thread override for the number of compression threads (0 = default)
+static thread_local unsigned int deflate_threads = 0;
+
+struct DeflateBlock
 {
-    // Obviously never true, but we'll keep it here just in case
-    bool zip64 = (uint64_t) contents.size() >= ((1ull << 32) - 1);
+    std::vector<unsigned char> input;
+    std::vector<unsigned char> dict;
+    std::vector<unsigned char> output;
+    size_t size;
+    uLong crc;
+    bool last;
+    bool done;
+    bool ok;
+};
 
-    zip_fileinfo zi;
-    memset(&zi, 0, sizeof(zi));
+static bool deflate_block(DeflateBlock &block)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+
+    int ret = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+                           8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        LOGE("zlib: Failed to initialize deflate: %s",
+             zlib_error_string(ret).c_str());
+        return false;
+    }
+
+    if (!block.dict.empty()) {
+        ret = deflateSetDictionary(&zs, block.dict.data(),
+                                   static_cast<uInt>(block.dict.size()));
+        if (ret != Z_OK) {
+            LOGE("zlib: Failed to set dictionary: %s",
+                 zlib_error_string(ret).c_str());
+            deflateEnd(&zs);
+            return false;
+        }
+    }
+
+    // deflateBound() does not account for the sync flush marker
+    block.output.resize(deflateBound(&zs, static_cast<uLong>(
+            block.input.size())) + 16);
+
+    zs.next_in = block.input.data();
+    zs.avail_in = static_cast<uInt>(block.input.size());
+    zs.next_out = block.output.data();
+    zs.avail_out = static_cast<uInt>(block.output.size());
+
+    ret = deflate(&zs, block.last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ret != (block.last ? Z_STREAM_END : Z_OK) || zs.avail_in != 0
+            || (!block.last && zs.avail_out == 0)) {
+        LOGE("zlib: Failed to deflate block: %s",
+             zlib_error_string(ret).c_str());
+        deflateEnd(&zs);
+        return false;
+    }
+
+    block.output.resize(block.output.size() - zs.avail_out);
+    block.crc = crc32(crc32(0L, Z_NULL, 0), block.input.data(),
+                      static_cast<uInt>(block.input.size()));
+
+    deflateEnd(&zs);
+
+    // The uncompressed data is no longer needed
+    block.size = block.input.size();
+    std::vector<unsigned char>().swap(block.input);
+    std::vector<unsigned char>().swap(block.dict);
+
+    return true;
+}
+
+class DeflatePool
+{
+public:
+    explicit DeflatePool(unsigned int threads)
+        : _stop(false)
+    {
+        for (unsigned int i = 0; i < threads; ++i) {
+            _threads.emplace_back(&DeflatePool::worker, this);
+        }
+    }
+
+    ~DeflatePool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_all();
+
+        for (auto &t : _threads) {
+            t.join();
+        }
+    }
+
+    void submit(const std::shared_ptr<DeflateBlock> &block)
+    {
+        if (_threads.empty()) {
+            block->ok = deflate_block(*block);
+            block->done = true;
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _queue.push_back(block);
+        }
+        _cv.notify_one();
+    }
+
+    void wait(const DeflateBlock &block)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done_cv.wait(lock, [&] { return block.done; });
+    }
+
+private:
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        while (true) {
+            _cv.wait(lock, [&] { return _stop || !_queue.empty(); });
+            if (_queue.empty()) {
+                return;
+            }
+
+            auto block = std::move(_queue.front());
+            _queue.pop_front();
+
+            lock.unlock();
+            bool ok = deflate_block(*block);
+            lock.lock();
+
+            block->ok = ok;
+            block->done = true;
+            _done_cv.notify_all();
+        }
+    }
+
+    std::vector<std::thread> _threads;
+    std::deque<std::shared_ptr<DeflateBlock>> _queue;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::condition_variable _done_cv;
+    bool _stop;
+};
+
+/*!
+ * \brief Limit the number of compression threads used by the calling thread
+ *
+ * This only affects entries added from the calling thread. It is meant for
+ * callers that already run several patchers at once so that their compression
+ * pools do not oversubscribe the CPU.
+ *
+ * \param threads Maximum number of compression threads or 0 to use one thread
+ *                per CPU (up to an internal limit)
+ */
+void MinizipUtils::set_deflate_threads(unsigned int threads)
+{
+    deflate_threads = threads;
+}
+
+/*!
+ * \brief Add a deflated entry to the zip, compressing blocks in parallel
+ *
+ * \param zf Output zip
+ * \param name Entry name
+ * \param zi Entry file info
+ * \param size Size of the uncompressed data. Only used to size the thread
+ *             pool and to determine whether zip64 is needed.
+ * \param read_fn Function for reading the uncompressed data. It must fill the
+ *                buffer completely, except at EOF.
+ */
+static ErrorCode add_file_deflated(zipFile zf, const std::string &name,
+                                   const zip_fileinfo &zi, uint64_t size,
+                                   const MinizipUtils::ReadCallback &read_fn)
+{
+    bool zip64 = size >= ((1ull << 32) - 1);
 
     int ret = zipOpenNewFileInZip2_64(
         zf,                     // file
@@ -651,46 +869,126 @@ ErrorCode MinizipUtils::add_file(zipFile zf,
         nullptr,                // comment
         Z_DEFLATED,             // method
         Z_DEFAULT_COMPRESSION,  // level
-        0,                      // raw
+        1,                      // raw
         zip64                   // zip64
     );
-
     if (ret != ZIP_OK) {
         LOGE("minizip: Failed to open inner file: %s",
-             zip_error_string(ret).c_str());
-
+             MinizipUtils::zip_error_string(ret).c_str());
         return ErrorCode::ArchiveWriteDataError;
     }
 
-    // Write data to file
-    ret = zipWriteInFileInZip(zf, contents.data(), contents.size());
-    if (ret != ZIP_OK) {
-        LOGE("minizip: Failed to write inner file data: %s",
-             zip_error_string(ret).c_str());
-        zipCloseFileInZip(zf);
+    uint64_t blocks = size / DEFLATE_BLOCK_SIZE + 1;
+    unsigned int threads = deflate_threads != 0 ? deflate_threads
+            : std::max(1u, std::thread::hardware_concurrency());
+    threads = static_cast<unsigned int>(std::min<uint64_t>(
+            std::min(threads, DEFLATE_MAX_THREADS), blocks));
+
+    // A single block is compressed on this thread
+    DeflatePool pool(threads > 1 ? threads : 0);
+    std::deque<std::shared_ptr<DeflateBlock>> pending;
+    size_t max_pending = std::max(1u, threads) * DEFLATE_BLOCKS_PER_THREAD;
+    std::vector<unsigned char> dict;
+    uint64_t total = 0;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    ErrorCode error = ErrorCode::NoError;
+    bool eof = false;
+
+    while (!eof || !pending.empty()) {
+        if (!eof && error == ErrorCode::NoError
+                && pending.size() < max_pending) {
+            auto block = std::make_shared<DeflateBlock>();
+            block->input.resize(DEFLATE_BLOCK_SIZE);
+            block->done = false;
+            block->ok = false;
+
+            size_t n;
+            if (!read_fn(block->input.data(), block->input.size(), n)) {
+                error = ErrorCode::FileReadError;
+                eof = true;
+                continue;
+            }
+            block->input.resize(n);
+            eof = n < DEFLATE_BLOCK_SIZE;
+            block->last = eof;
+            block->dict = dict;
+
+            // Keep the last 32 KiB of uncompressed data for the next block
+            dict.insert(dict.end(), block->input.begin(), block->input.end());
+            if (dict.size() > DEFLATE_DICT_SIZE) {
+                dict.erase(dict.begin(), dict.end() - DEFLATE_DICT_SIZE);
+            }
+
+            pool.submit(block);
+            pending.push_back(std::move(block));
+            continue;
+        }
 
-        return ErrorCode::ArchiveWriteDataError;
+        // Write out the oldest block so that the output stays in order
+        auto block = std::move(pending.front());
+        pending.pop_front();
+        pool.wait(*block);
+
+        if (error != ErrorCode::NoError) {
+            continue;
+        } else if (!block->ok) {
+            error = ErrorCode::ArchiveWriteDataError;
+            continue;
+        }
+
+        ret = zipWriteInFileInZip(zf, block->output.data(),
+                                  static_cast<uint32_t>(block->output.size()));
+        if (ret != ZIP_OK) {
+            LOGE("minizip: Failed to write inner file data: %s",
+                 MinizipUtils::zip_error_string(ret).c_str());
+            error = ErrorCode::ArchiveWriteDataError;
+            continue;
+        }
+
+        crc = crc32_combine(crc, block->crc, static_cast<z_off_t>(block->size));
+        total += block->size;
     }
 
-    ret = zipCloseFileInZip(zf);
+    if (error != ErrorCode::NoError) {
+        zipCloseFileInZipRaw64(zf, total, crc);
+        return error;
+    }
+
+    ret = zipCloseFileInZipRaw64(zf, total, crc);
     if (ret != ZIP_OK) {
         LOGE("minizip: Failed to close inner file: %s",
-             zip_error_string(ret).c_str());
-
+             MinizipUtils::zip_error_string(ret).c_str());
         return ErrorCode::ArchiveWriteDataError;
     }
 
     return ErrorCode::NoError;
 }
 
+ErrorCode MinizipUtils::add_file(zipFile zf,
+                                 const std::string &name,
+                                 const std::vector<unsigned char> &contents)
+{
+    zip_fileinfo zi;
+    memset(&zi, 0, sizeof(zi));
+
+    size_t offset = 0;
+
+    return add_file_deflated(zf, name, zi, contents.size(),
+                             [&](void *buf, size_t buf_size,
+                                 size_t &bytes_read) {
+        bytes_read = std::min(buf_size, contents.size() - offset);
+        memcpy(buf, contents.data() + offset, bytes_read);
+        offset += bytes_read;
+        return true;
+    });
+}
+
 ErrorCode MinizipUtils::add_file(zipFile zf,
                                  const std::string &name,
                                  const std::string &path)
 {
     // Copy file into archive
     StandardFile file;
-    bool file_ret;
-    int ret;
 
     auto error = FileUtils::open_file(file, path,
                                       FileOpenMode::READ_ONLY);
@@ -707,8 +1005,6 @@ ErrorCode MinizipUtils::add_file(zipFile zf,
         return ErrorCode::FileSeekError;
     }
 
-    bool zip64 = size >= ((1ull << 32) - 1);
-
     zip_fileinfo zi;
     memset(&zi, 0, sizeof(zi));
 
@@ -717,60 +1013,36 @@ ErrorCode MinizipUtils::add_file(zipFile zf,
         return ErrorCode::FileOpenError;
     }
 
-    ret = zipOpenNewFileInZip2_64(
-        zf,                     // file
-        name.c_str(),           // filename
-        &zi,                    // zip_fileinfo
-        nullptr,                // extrafield_local
-        0,                      // size_extrafield_local
-        nullptr,                // extrafield_global
-        0,                      // size_extrafield_global
-        nullptr,                // comment
-        Z_DEFLATED,             // method
-        Z_DEFAULT_COMPRESSION,  // level
-        0,                      // raw
-        zip64                   // zip64
-    );
-
-    if (ret != ZIP_OK) {
-        LOGE("minizip: Failed to open inner file: %s",
-             zip_error_string(ret).c_str());
-
-        return ErrorCode::ArchiveWriteDataError;
-    }
-
-    // Write data to file
-    char buf[32768];
-    size_t bytes_read;
-
-    while ((file_ret = file.read(buf, sizeof(buf), bytes_read))
-            && bytes_read > 0) {
-        ret = zipWriteInFileInZip(zf, buf, bytes_read);
-        if (ret != ZIP_OK) {
-            LOGE("minizip: Failed to write inner file data: %s",
-                 zip_error_string(ret).c_str());
-            zipCloseFileInZip(zf);
-
-            return ErrorCode::ArchiveWriteDataError;
+    return add_file_deflated(zf, name, zi, size,
+                             [&](void *buf, size_t buf_size,
+                                 size_t &bytes_read) {
+        if (!file_read_fully(file, buf, buf_size, bytes_read)) {
+            LOGE("%s: Failed to read data: %s",
+                 path.c_str(), file.error_string().c_str());
+            return false;
         }
-    }
-    if (!file_ret) {
-        LOGE("%s: Failed to read data: %s",
-             path.c_str(), file.error_string().c_str());
-        zipCloseFileInZip(zf);
-
-        return ErrorCode::FileReadError;
-    }
-
-    ret = zipCloseFileInZip(zf);
-    if (ret != ZIP_OK) {
-        LOGE("minizip: Failed to close inner file: %s",
-             zip_error_string(ret).c_str());
+        return true;
+    });
+}
 
-        return ErrorCode::ArchiveWriteDataError;
-    }
+/*!
+ * \brief Add a deflated entry to the zip from a stream
+ *
+ * \param zf Output zip
+ * \param name Entry name
+ * \param size Size of the uncompressed data
+ * \param read_cb Function for reading the uncompressed data. It must fill the
+ *                buffer completely, except at EOF.
+ */
+ErrorCode MinizipUtils::add_file(zipFile zf,
+                                 const std::string &name,
+                                 uint64_t size,
+                                 const ReadCallback &read_cb)
+{
+    zip_fileinfo zi;
+    memset(&zi, 0, sizeof(zi));
 
-    return ErrorCode::NoError;
+    return add_file_deflated(zf, name, zi, size, read_cb);
 }
 
 }
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/private/patchcache.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <openssl/sha.h>
+
+#include "mbcommon/file_util.h"
+#include "mbcommon/version.h"
+
+#include "mbdevice/json.h"
+
+#include "mblog/logging.h"
+
+#include "mbpatcher/private/fileutils.h"
+
+#ifdef _WIN32
+#include "mbcommon/locale.h"
+#include "mbpatcher/private/win32.h"
+#include <windows.h>
+#endif
+
+
+namespace mb
+{
+namespace patcher
+{
+
+/*!
+ * \class PatchCache
+ * \brief Cache of patcher outputs
+ *
+ * Two kinds of files are cached:
+ *
+ * - Templates: the device-independent portion of an output, keyed by the
+ *   input's contents. A patcher can start from a copy of the template and only
+ *   regenerate the device-specific entries.
+ * - Results: complete outputs, keyed by the input's contents and the FileInfo
+ *   that was used to produce them.
+ *
+ * Keys also include the libmbpatcher version, so outputs from older versions
+ * are never reused.
+ */
+
+PatchCache::PatchCache(const PatcherConfig *pc)
+    : _directory(pc->cache_directory())
+{
+}
+
+bool PatchCache::enabled() const
+{
+    return !_directory.empty();
+}
+
+static std::string sha1_hex(const std::string &data)
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    std::string out;
+
+    SHA1(reinterpret_cast<const unsigned char *>(data.data()), data.size(),
+         digest);
+
+    for (unsigned char c : digest) {
+        out += digits[c >> 4];
+        out += digits[c & 0xf];
+    }
+
+    return out;
+}
+
+std::string PatchCache::path_for_key(const std::string &key,
+                                     const char *suffix) const
+{
+    std::string path(_directory);
+    path += "/";
+    path += sha1_hex(key);
+    path += suffix;
+    return path;
+}
+
+/*!
+ * \brief Path of the template for an input
+ *
+ * \param patcher_id ID of the patcher producing the template
+ * \param input_digest Digest identifying the input's contents
+ */
+std::string PatchCache::template_path(const std::string &patcher_id,
+                                      const std::string &input_digest) const
+{
+    std::string key;
+    key += version();
+    key += '\0';
+    key += patcher_id;
+    key += '\0';
+    key += input_digest;
+
+    return path_for_key(key, ".template");
+}
+
+/*!
+ * \brief Path of the result for an input and FileInfo
+ *
+ * \param patcher_id ID of the patcher producing the result
+ * \param input_digest Digest identifying the input's contents
+ * \param info FileInfo containing the target device and ROM ID
+ *
+ * \return Path or an empty string if the device cannot be serialized
+ */
+std::string PatchCache::result_path(const std::string &patcher_id,
+                                    const std::string &input_digest,
+                                    const FileInfo *info) const
+{
+    std::string json;
+    if (!device::device_to_json(info->device(), json)) {
+        return std::string();
+    }
+
+    std::string key;
+    key += version();
+    key += '\0';
+    key += patcher_id;
+    key += '\0';
+    key += input_digest;
+    key += '\0';
+    key += info->rom_id();
+    key += '\0';
+    key += json;
+
+    return path_for_key(key, ".zip");
+}
+
+static bool copy_file(const std::string &source, const std::string &target)
+{
+    StandardFile src;
+    StandardFile dst;
+    uint64_t size;
+    uint64_t n;
+
+    if (FileUtils::open_file(src, source, FileOpenMode::READ_ONLY)
+            != ErrorCode::NoError) {
+        return false;
+    }
+
+    if (!src.seek(0, SEEK_END, &size) || !src.seek(0, SEEK_SET, nullptr)) {
+        LOGE("%s: Failed to seek: %s",
+             source.c_str(), src.error_string().c_str());
+        return false;
+    }
+
+    if (FileUtils::open_file(dst, target, FileOpenMode::WRITE_ONLY)
+            != ErrorCode::NoError) {
+        LOGE("%s: Failed to open for writing: %s",
+             target.c_str(), dst.error_string().c_str());
+        return false;
+    }
+
+    if (!file_copy(src, dst, size, n) || n != size) {
+        LOGE("%s: Failed to copy to %s: %s",
+             source.c_str(), target.c_str(), dst.error_string().c_str());
+        return false;
+    }
+
+    if (!dst.close()) {
+        LOGE("%s: Failed to close: %s",
+             target.c_str(), dst.error_string().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static bool rename_file(const std::string &source, const std::string &target)
+{
+#ifdef _WIN32
+    std::wstring w_source;
+    std::wstring w_target;
+
+    if (!utf8_to_wcs(w_source, source) || !utf8_to_wcs(w_target, target)) {
+        LOGE("Failed to convert UTF-8 to WCS");
+        return false;
+    }
+
+    if (!MoveFileExW(w_source.c_str(), w_target.c_str(),
+                     MOVEFILE_REPLACE_EXISTING)) {
+        LOGE("%s: Failed to rename to %s: %s", source.c_str(), target.c_str(),
+             win32_error_to_string(GetLastError()).c_str());
+        return false;
+    }
+#else
+    if (std::rename(source.c_str(), target.c_str()) != 0) {
+        LOGE("%s: Failed to rename to %s: %s", source.c_str(), target.c_str(),
+             strerror(errno));
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+/*!
+ * \brief Copy a cached file to the output path
+ *
+ * \return Whether the cached file exists and was copied
+ */
+bool PatchCache::fetch(const std::string &cached_path,
+                       const std::string &output_path)
+{
+    if (!copy_file(cached_path, output_path)) {
+        return false;
+    }
+
+    LOGD("%s: Reused cached output %s",
+         output_path.c_str(), cached_path.c_str());
+    return true;
+}
+
+/*!
+ * \brief Store a copy of a file in the cache
+ *
+ * The file is copied to a temporary path and then renamed so that a partially
+ * written file is never used.
+ *
+ * \return Whether the file was stored
+ */
+bool PatchCache::store(const std::string &path,
+                       const std::string &cached_path)
+{
+    std::string temp_path(cached_path);
+    temp_path += ".tmp";
+
+    if (!copy_file(path, temp_path)) {
+        LOGW("%s: Failed to store in cache", path.c_str());
+        std::remove(temp_path.c_str());
+        return false;
+    }
+
+    if (!rename_file(temp_path, cached_path)) {
+        std::remove(temp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+}
+}
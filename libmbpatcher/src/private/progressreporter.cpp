@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/private/progressreporter.h"
+
+#include <chrono>
+
+
+namespace mb
+{
+namespace patcher
+{
+
+constexpr unsigned int ProgressReporter::DEFAULT_INTERVAL_MS;
+constexpr double ProgressReporter::DEFAULT_MIN_RATIO_DELTA;
+
+/*!
+ * \class ProgressReporter
+ * \brief Throttled delivery of patcher progress
+ *
+ * The patcher only stores the latest counters and details. A notification
+ * thread wakes up every \p interval_ms milliseconds and invokes the callbacks
+ * for whatever changed since its last snapshot, so the patching loops never
+ * wait on the (possibly slow) callbacks. Byte progress is only reported if it
+ * changed by at least \p min_ratio_delta of the total. The final values are
+ * always delivered by stop().
+ *
+ * \note The callbacks are invoked from the notification thread.
+ */
+
+ProgressReporter::ProgressReporter(Patcher::ProgressUpdatedCallback progress_cb,
+                                   Patcher::FilesUpdatedCallback files_cb,
+                                   Patcher::DetailsUpdatedCallback details_cb,
+                                   void *userdata,
+                                   unsigned int interval_ms,
+                                   double min_ratio_delta)
+    : _progress_cb(progress_cb)
+    , _files_cb(files_cb)
+    , _details_cb(details_cb)
+    , _userdata(userdata)
+    , _interval_ms(interval_ms)
+    , _min_ratio_delta(min_ratio_delta)
+    , _bytes(0)
+    , _max_bytes(0)
+    , _files(0)
+    , _max_files(0)
+    , _details_seq(0)
+    , _sent_bytes(0)
+    , _sent_max_bytes(0)
+    , _sent_files(0)
+    , _sent_max_files(0)
+    , _sent_details_seq(0)
+    , _sent_any_progress(false)
+    , _sent_any_files(false)
+    , _stopped(false)
+{
+    if (_progress_cb || _files_cb || _details_cb) {
+        _thread = std::thread(&ProgressReporter::run, this);
+    }
+}
+
+ProgressReporter::~ProgressReporter()
+{
+    stop();
+}
+
+void ProgressReporter::set_progress(uint64_t bytes, uint64_t max_bytes)
+{
+    _max_bytes.store(max_bytes, std::memory_order_relaxed);
+    _bytes.store(bytes, std::memory_order_relaxed);
+}
+
+void ProgressReporter::set_files(uint64_t files, uint64_t max_files)
+{
+    _max_files.store(max_files, std::memory_order_relaxed);
+    _files.store(files, std::memory_order_relaxed);
+}
+
+void ProgressReporter::set_details(const std::string &details)
+{
+    if (!_details_cb) {
+        return;
+    }
+
+    // Only held for the copy. The notification thread does not hold the lock
+    // while calling back.
+    std::lock_guard<std::mutex> lock(_mutex);
+    _details = details;
+    _details_seq.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Stop the notification thread and deliver the final values
+ *
+ * It is safe to call this more than once.
+ */
+void ProgressReporter::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stopped) {
+            return;
+        }
+        _stopped = true;
+    }
+
+    if (_thread.joinable()) {
+        _cv.notify_one();
+        _thread.join();
+    }
+}
+
+void ProgressReporter::run()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (!_stopped) {
+        _cv.wait_for(lock, std::chrono::milliseconds(_interval_ms));
+
+        bool final = _stopped;
+        lock.unlock();
+        deliver(final);
+        lock.lock();
+    }
+}
+
+void ProgressReporter::deliver(bool final)
+{
+    if (_details_cb) {
+        uint64_t seq = _details_seq.load(std::memory_order_relaxed);
+        if (seq != _sent_details_seq) {
+            std::string details;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                details = _details;
+                seq = _details_seq.load(std::memory_order_relaxed);
+            }
+            _sent_details_seq = seq;
+            _details_cb(details, _userdata);
+        }
+    }
+
+    if (_files_cb) {
+        uint64_t files = _files.load(std::memory_order_relaxed);
+        uint64_t max_files = _max_files.load(std::memory_order_relaxed);
+
+        if (!_sent_any_files || files != _sent_files
+                || max_files != _sent_max_files) {
+            _files_cb(files, max_files, _userdata);
+            _sent_files = files;
+            _sent_max_files = max_files;
+            _sent_any_files = true;
+        }
+    }
+
+    if (_progress_cb) {
+        uint64_t bytes = _bytes.load(std::memory_order_relaxed);
+        uint64_t max_bytes = _max_bytes.load(std::memory_order_relaxed);
+
+        bool changed = !_sent_any_progress || max_bytes != _sent_max_bytes;
+        if (!changed && bytes != _sent_bytes) {
+            changed = final || bytes == max_bytes || max_bytes == 0
+                    || bytes < _sent_bytes
+                    || static_cast<double>(bytes - _sent_bytes) / max_bytes
+                            >= _min_ratio_delta;
+        }
+
+        if (changed) {
+            _progress_cb(bytes, max_bytes, _userdata);
+            _sent_bytes = bytes;
+            _sent_max_bytes = max_bytes;
+            _sent_any_progress = true;
+        }
+    }
+}
+
+}
+}
@@ -0,0 +1,512 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpatcher/private/ziprewriter.h"
+
+#include <algorithm>
+
+#include <cstring>
+
+#include <openssl/sha.h>
+
+#include "mbcommon/file_util.h"
+
+#include "mblog/logging.h"
+
+#include "mbpatcher/private/fileutils.h"
+
+#define LOCAL_HEADER_SIGNATURE          0x04034b50
+#define LOCAL_HEADER_SIZE               30
+#define CENTRAL_HEADER_SIGNATURE        0x02014b50
+#define CENTRAL_HEADER_SIZE             46
+#define EOCD_SIGNATURE                  0x06054b50
+#define EOCD_SIZE                       22
+#define ZIP64_EOCD_LOCATOR_SIGNATURE    0x07064b50
+#define ZIP64_EOCD_LOCATOR_SIZE         20
+
+// Maximum size of the archive comment
+#define MAX_COMMENT_SIZE                0xffff
+
+// Entries are copied in pieces of this size so progress can be reported
+#define COPY_CHUNK_SIZE                 (8 * 1024 * 1024)
+
+// Room left for entries that are renamed. Inputs larger than 4 GiB minus
+// this need zip64 offsets, which the rewriter does not produce.
+#define OFFSET_MARGIN                   (16 * 1024 * 1024)
+
+
+namespace mb
+{
+namespace patcher
+{
+
+static inline uint16_t read_le16(const unsigned char *p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t read_le32(const unsigned char *p)
+{
+    return static_cast<uint32_t>(p[0])
+            | (static_cast<uint32_t>(p[1]) << 8)
+            | (static_cast<uint32_t>(p[2]) << 16)
+            | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline void write_le16(unsigned char *p, uint16_t value)
+{
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+}
+
+static inline void write_le32(unsigned char *p, uint32_t value)
+{
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+static bool read_at(StandardFile &file, uint64_t offset, void *buf,
+                    size_t size)
+{
+    size_t bytes_read;
+
+    return file.seek(static_cast<int64_t>(offset), SEEK_SET, nullptr)
+            && file_read_fully(file, buf, size, bytes_read)
+            && bytes_read == size;
+}
+
+static bool write_all(StandardFile &file, const void *buf, size_t size)
+{
+    size_t bytes_written;
+
+    return file_write_fully(file, buf, size, bytes_written)
+            && bytes_written == size;
+}
+
+/*!
+ * \brief Open input zip
+ *
+ * The input's central directory is parsed so that entries can later be copied
+ * as raw byte ranges. Archives that need zip64 records, span multiple disks,
+ * or cannot be parsed are rejected so that the caller can fall back to
+ * copying the entries with minizip.
+ *
+ * \param input_path Path to input zip
+ *
+ * \return ErrorCode::NoError if the archive can be rewritten. Otherwise, an
+ *         error code.
+ */
+ErrorCode ZipRewriter::open_input(const std::string &input_path)
+{
+    auto ret = FileUtils::open_file(_input, input_path,
+                                    FileOpenMode::READ_ONLY);
+    if (ret != ErrorCode::NoError) {
+        LOGE("%s: Failed to open for reading: %s",
+             input_path.c_str(), _input.error_string().c_str());
+        return ret;
+    }
+
+    return read_central_directory();
+}
+
+/*!
+ * \brief Create output file
+ *
+ * \param output_path Path to output zip. It will be truncated.
+ *
+ * \return ErrorCode::NoError if successful. Otherwise, an error code.
+ */
+ErrorCode ZipRewriter::open_output(const std::string &output_path)
+{
+    auto ret = FileUtils::open_file(_output, output_path,
+                                    FileOpenMode::WRITE_ONLY);
+    if (ret != ErrorCode::NoError) {
+        LOGE("%s: Failed to open for writing: %s",
+             output_path.c_str(), _output.error_string().c_str());
+        return ret;
+    }
+
+    _output_offset = 0;
+    _central_dir.clear();
+    _central_dir_entries = 0;
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Digest identifying the input zip's contents
+ *
+ * This is the hex-encoded SHA-1 of the input size, central directory and end
+ * of central directory record. The central directory contains the CRC32 and
+ * sizes of every entry, so this identifies the contents without reading all
+ * of the data.
+ */
+const std::string & ZipRewriter::input_digest() const
+{
+    return _input_digest;
+}
+
+ErrorCode ZipRewriter::read_central_directory()
+{
+    uint64_t size;
+
+    if (!_input.seek(0, SEEK_END, &size)) {
+        LOGE("Failed to get input size: %s", _input.error_string().c_str());
+        return ErrorCode::FileSeekError;
+    }
+
+    if (size < EOCD_SIZE) {
+        return ErrorCode::ArchiveReadHeaderError;
+    } else if (size > UINT32_MAX - OFFSET_MARGIN) {
+        LOGD("Input too large to rewrite without zip64");
+        return ErrorCode::ArchiveReadHeaderError;
+    }
+
+    // Find end of central directory record. It is followed only by the
+    // archive comment.
+    size_t tail_size = std::min<uint64_t>(
+            size, EOCD_SIZE + ZIP64_EOCD_LOCATOR_SIZE + MAX_COMMENT_SIZE);
+    std::vector<unsigned char> tail(tail_size);
+
+    if (!read_at(_input, size - tail_size, tail.data(), tail_size)) {
+        LOGE("Failed to read end of central directory: %s",
+             _input.error_string().c_str());
+        return ErrorCode::FileReadError;
+    }
+
+    size_t eocd = SIZE_MAX;
+    for (size_t i = tail_size - EOCD_SIZE + 1; i-- > 0;) {
+        if (read_le32(&tail[i]) == EOCD_SIGNATURE
+                && i + EOCD_SIZE + read_le16(&tail[i + 20]) == tail_size) {
+            eocd = i;
+            break;
+        }
+    }
+    if (eocd == SIZE_MAX) {
+        LOGD("End of central directory record not found");
+        return ErrorCode::ArchiveReadHeaderError;
+    }
+
+    const unsigned char *p = &tail[eocd];
+    uint16_t disk = read_le16(p + 4);
+    uint16_t cd_disk = read_le16(p + 6);
+    uint16_t disk_entries = read_le16(p + 8);
+    uint16_t total_entries = read_le16(p + 10);
+    uint32_t cd_size = read_le32(p + 12);
+    uint32_t cd_offset = read_le32(p + 16);
+
+    if (eocd >= ZIP64_EOCD_LOCATOR_SIZE && read_le32(
+            &tail[eocd - ZIP64_EOCD_LOCATOR_SIZE])
+                    == ZIP64_EOCD_LOCATOR_SIGNATURE) {
+        LOGD("Archive uses zip64 records");
+        return ErrorCode::ArchiveReadHeaderError;
+    }
+    if (disk != 0 || cd_disk != 0 || disk_entries != total_entries) {
+        LOGD("Multi-disk archives are not supported");
+        return ErrorCode::ArchiveReadHeaderError;
+    }
+    if (static_cast<uint64_t>(cd_offset) + cd_size
+            > size - tail_size + eocd) {
+        LOGD("Central directory is out of bounds");
+        return ErrorCode::ArchiveReadHeaderError;
+    }
+
+    std::vector<unsigned char> cd(cd_size);
+    if (!read_at(_input, cd_offset, cd.data(), cd.size())) {
+        LOGE("Failed to read central directory: %s",
+             _input.error_string().c_str());
+        return ErrorCode::FileReadError;
+    }
+
+    static const char digits[] = "0123456789abcdef";
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA_CTX sha_ctx;
+
+    SHA1_Init(&sha_ctx);
+    SHA1_Update(&sha_ctx, &size, sizeof(size));
+    SHA1_Update(&sha_ctx, cd.data(), cd.size());
+    SHA1_Update(&sha_ctx, p, tail_size - eocd);
+    SHA1_Final(digest, &sha_ctx);
+
+    _input_digest.clear();
+    for (unsigned char c : digest) {
+        _input_digest += digits[c >> 4];
+        _input_digest += digits[c & 0xf];
+    }
+
+    _entries.clear();
+    _entries.reserve(total_entries);
+
+    size_t pos = 0;
+    for (uint16_t i = 0; i < total_entries; ++i) {
+        if (pos + CENTRAL_HEADER_SIZE > cd.size()
+                || read_le32(&cd[pos]) != CENTRAL_HEADER_SIGNATURE) {
+            LOGD("Invalid central directory record %u", i);
+            return ErrorCode::ArchiveReadHeaderError;
+        }
+
+        const unsigned char *h = &cd[pos];
+        uint32_t compressed_size = read_le32(h + 20);
+        uint32_t uncompressed_size = read_le32(h + 24);
+        uint16_t name_size = read_le16(h + 28);
+        uint16_t extra_size = read_le16(h + 30);
+        uint16_t comment_size = read_le16(h + 32);
+        uint16_t start_disk = read_le16(h + 34);
+        uint32_t offset = read_le32(h + 42);
+        size_t record_size = CENTRAL_HEADER_SIZE + name_size + extra_size
+                + comment_size;
+
+        if (pos + record_size > cd.size()) {
+            LOGD("Truncated central directory record %u", i);
+            return ErrorCode::ArchiveReadHeaderError;
+        }
+        if (compressed_size == UINT32_MAX || uncompressed_size == UINT32_MAX
+                || offset == UINT32_MAX || start_disk != 0) {
+            LOGD("Entry %u uses zip64 fields", i);
+            return ErrorCode::ArchiveReadHeaderError;
+        }
+
+        _entries.emplace_back();
+        Entry &entry = _entries.back();
+        entry.name.assign(reinterpret_cast<const char *>(
+                h + CENTRAL_HEADER_SIZE), name_size);
+        entry.cd_record.assign(h, h + record_size);
+        entry.cd_offset = cd_offset + pos;
+        entry.uncompressed_size = uncompressed_size;
+        entry.start = offset;
+        entry.end = 0;
+
+        pos += record_size;
+    }
+
+    // Each entry's data (and data descriptor, if any) extends up to the next
+    // local header or the central directory
+    std::vector<Entry *> sorted;
+    sorted.reserve(_entries.size());
+    for (Entry &entry : _entries) {
+        sorted.push_back(&entry);
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const Entry *a, const Entry *b) {
+        return a->start < b->start;
+    });
+
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        sorted[i]->end = i + 1 < sorted.size()
+                ? sorted[i + 1]->start : cd_offset;
+        if (sorted[i]->end < sorted[i]->start + LOCAL_HEADER_SIZE) {
+            LOGD("%s: Overlapping or truncated entry",
+                 sorted[i]->name.c_str());
+            return ErrorCode::ArchiveReadHeaderError;
+        }
+    }
+
+    return ErrorCode::NoError;
+}
+
+size_t ZipRewriter::entries() const
+{
+    return _entries.size();
+}
+
+const std::string & ZipRewriter::entry_name(size_t index) const
+{
+    return _entries[index].name;
+}
+
+uint64_t ZipRewriter::entry_size(size_t index) const
+{
+    return _entries[index].uncompressed_size;
+}
+
+/*!
+ * \brief Offset of an entry's central directory record in the input
+ *
+ * This can be passed to unzSetOffset64() to move minizip to the entry without
+ * walking the central directory.
+ */
+uint64_t ZipRewriter::entry_central_dir_offset(size_t index) const
+{
+    return _entries[index].cd_offset;
+}
+
+/*!
+ * \brief Copy an entry to the output without recompressing it
+ *
+ * The local header and compressed data are copied as a single byte range,
+ * which can be done entirely by the kernel on Linux. If \p name differs from
+ * the original name, only the local header is rebuilt.
+ *
+ * \param index Index of the entry in the input's central directory
+ * \param name Name of the entry in the output
+ * \param cb Progress callback receiving the number of bytes copied so far
+ * \param userdata Data pointer to pass to \p cb
+ *
+ * \return ErrorCode::NoError if successful. Otherwise, an error code.
+ */
+ErrorCode ZipRewriter::copy_entry(size_t index, const std::string &name,
+                                  ProgressCb cb, void *userdata)
+{
+    Entry &entry = _entries[index];
+    uint64_t new_offset = _output_offset;
+    uint64_t copy_start = entry.start;
+
+    if (name.size() > UINT16_MAX) {
+        return ErrorCode::ArchiveWriteHeaderError;
+    }
+
+    if (name != entry.name) {
+        unsigned char header[LOCAL_HEADER_SIZE];
+
+        if (!read_at(_input, entry.start, header, sizeof(header))
+                || read_le32(header) != LOCAL_HEADER_SIGNATURE) {
+            LOGE("%s: Failed to read local header: %s",
+                 entry.name.c_str(), _input.error_string().c_str());
+            return ErrorCode::ArchiveReadHeaderError;
+        }
+
+        uint16_t name_size = read_le16(header + 26);
+        uint16_t extra_size = read_le16(header + 28);
+        std::vector<unsigned char> extra(extra_size);
+
+        if (entry.start + LOCAL_HEADER_SIZE + name_size + extra_size
+                > entry.end
+                || !read_at(_input, entry.start + LOCAL_HEADER_SIZE
+                            + name_size, extra.data(), extra.size())) {
+            LOGE("%s: Failed to read local header: %s",
+                 entry.name.c_str(), _input.error_string().c_str());
+            return ErrorCode::ArchiveReadHeaderError;
+        }
+
+        write_le16(header + 26, static_cast<uint16_t>(name.size()));
+
+        if (!_output.seek(static_cast<int64_t>(_output_offset), SEEK_SET,
+                          nullptr)
+                || !write_all(_output, header, sizeof(header))
+                || !write_all(_output, name.data(), name.size())
+                || !write_all(_output, extra.data(), extra.size())) {
+            LOGE("%s: Failed to write local header: %s",
+                 name.c_str(), _output.error_string().c_str());
+            return ErrorCode::ArchiveWriteHeaderError;
+        }
+
+        _output_offset += sizeof(header) + name.size() + extra.size();
+        copy_start = entry.start + LOCAL_HEADER_SIZE + name_size + extra_size;
+
+        // Rebuild the central directory record with the new name
+        std::vector<unsigned char> record;
+        const unsigned char *h = entry.cd_record.data();
+        uint16_t old_name_size = read_le16(h + 28);
+
+        record.insert(record.end(), h, h + CENTRAL_HEADER_SIZE);
+        record.insert(record.end(), name.begin(), name.end());
+        record.insert(record.end(),
+                      h + CENTRAL_HEADER_SIZE + old_name_size,
+                      h + entry.cd_record.size());
+        write_le16(record.data() + 28, static_cast<uint16_t>(name.size()));
+        entry.cd_record.swap(record);
+        entry.name = name;
+    }
+
+    if (!_input.seek(static_cast<int64_t>(copy_start), SEEK_SET, nullptr)
+            || !_output.seek(static_cast<int64_t>(_output_offset), SEEK_SET,
+                             nullptr)) {
+        LOGE("%s: Failed to seek: %s", name.c_str(),
+             _input.error_string().c_str());
+        return ErrorCode::FileSeekError;
+    }
+
+    uint64_t remaining = entry.end - copy_start;
+    uint64_t copied = 0;
+
+    while (remaining > 0) {
+        uint64_t to_copy = std::min<uint64_t>(remaining, COPY_CHUNK_SIZE);
+        uint64_t n;
+
+        if (!file_copy(_input, _output, to_copy, n) || n != to_copy) {
+            LOGE("%s: Failed to copy data: %s", name.c_str(),
+                 _output.error_string().c_str());
+            return ErrorCode::ArchiveWriteDataError;
+        }
+
+        remaining -= n;
+        copied += n;
+
+        if (cb) {
+            cb(copied, userdata);
+        }
+    }
+
+    _output_offset += copied;
+
+    // Point the central directory record at the new local header
+    write_le32(entry.cd_record.data() + 42, static_cast<uint32_t>(new_offset));
+    _central_dir.insert(_central_dir.end(),
+                        entry.cd_record.begin(), entry.cd_record.end());
+    ++_central_dir_entries;
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Write central directory and close the files
+ *
+ * The output is a complete zip file that can be opened by minizip in
+ * APPEND_STATUS_ADDINZIP mode to add more entries.
+ *
+ * \return ErrorCode::NoError if successful. Otherwise, an error code.
+ */
+ErrorCode ZipRewriter::finish()
+{
+    unsigned char eocd[EOCD_SIZE] = {};
+
+    if (_central_dir_entries > UINT16_MAX
+            || _output_offset + _central_dir.size() > UINT32_MAX) {
+        LOGE("Output needs zip64 records");
+        return ErrorCode::ArchiveWriteHeaderError;
+    }
+
+    write_le32(eocd, EOCD_SIGNATURE);
+    write_le16(eocd + 8, static_cast<uint16_t>(_central_dir_entries));
+    write_le16(eocd + 10, static_cast<uint16_t>(_central_dir_entries));
+    write_le32(eocd + 12, static_cast<uint32_t>(_central_dir.size()));
+    write_le32(eocd + 16, static_cast<uint32_t>(_output_offset));
+
+    if (!_output.seek(static_cast<int64_t>(_output_offset), SEEK_SET, nullptr)
+            || !write_all(_output, _central_dir.data(), _central_dir.size())
+            || !write_all(_output, eocd, sizeof(eocd))) {
+        LOGE("Failed to write central directory: %s",
+             _output.error_string().c_str());
+        return ErrorCode::ArchiveWriteHeaderError;
+    }
+
+    _input.close();
+
+    if (!_output.close()) {
+        LOGE("Failed to close output: %s", _output.error_string().c_str());
+        return ErrorCode::FileCloseError;
+    }
+
+    return ErrorCode::NoError;
+}
+
+}
+}
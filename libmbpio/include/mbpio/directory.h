@@ -24,6 +24,60 @@
 namespace io
 {
 
+enum class FileType
+{
+    Unknown,
+    Regular,
+    Directory,
+    Symlink,
+    Other
+};
+
+struct DirEntry
+{
+    // Entry name relative to the directory
+    std::string name;
+    // Type reported by the directory listing (FileType::Unknown if the
+    // filesystem does not provide it)
+    FileType type;
+};
+
+#ifndef _WIN32
+/*!
+ * Directory listing that reads entries in large batches
+ *
+ * On Linux, entries are read with getdents64() into a large buffer. Other
+ * POSIX systems use readdir(). The entry types come from the listing itself,
+ * so no stat() calls are needed. The "." and ".." entries are skipped.
+ *
+ * This is not available on Windows.
+ */
+class Directory
+{
+public:
+    Directory();
+    ~Directory();
+
+    Directory(const Directory &) = delete;
+    Directory & operator=(const Directory &) = delete;
+
+    bool open(const std::string &path);
+    bool open(const Directory &parent, const std::string &name);
+    bool close();
+
+    bool isOpen() const;
+
+    bool next(DirEntry &entry);
+    bool atEnd() const;
+
+    int fd() const;
+
+private:
+    struct Impl;
+    Impl *_impl;
+};
+#endif
+
 bool createDirectories(const std::string &path);
 
 }
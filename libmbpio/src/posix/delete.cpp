@@ -22,8 +22,11 @@
 #include <cerrno>
 #include <cstring>
 
-#include <ftw.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "mbpio/directory.h"
 #include "mbpio/error.h"
 #include "mbpio/private/string.h"
 
@@ -32,24 +35,110 @@ namespace io
 namespace posix
 {
 
-static int deleteCbNftw(const char *fpath, const struct stat *sb,
-                        int typeflag, struct FTW *ftwbuf)
-{
-    (void) sb;
-    (void) typeflag;
-    (void) ftwbuf;
+static bool deleteContents(Directory &dir, const std::string &path);
 
-    int ret = remove(fpath);
-    if (ret < 0) {
+static bool unlinkEntry(const Directory &dir, const std::string &path,
+                        const std::string &name, int flags)
+{
+    if (unlinkat(dir.fd(), name.c_str(), flags) < 0) {
         setLastError(Error::PlatformError, priv::format(
-                "%s: Failed to remove: %s", fpath, strerror(errno)));
+                "%s/%s: Failed to remove: %s",
+                path.c_str(), name.c_str(), strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+static bool deleteSubdirectory(const Directory &parent,
+                               const std::string &parentPath,
+                               const std::string &name)
+{
+    std::string path(parentPath);
+    path += '/';
+    path += name;
+
+    // Entries unlinked while the directory is being read may cause others to
+    // be skipped on some filesystems, so retry once if it is not empty
+    for (int attempt = 0; ; ++attempt) {
+        Directory dir;
+        if (!dir.open(parent, name) || !deleteContents(dir, path)
+                || !dir.close()) {
+            return false;
+        }
+
+        if (unlinkat(parent.fd(), name.c_str(), AT_REMOVEDIR) == 0) {
+            return true;
+        } else if (errno != ENOTEMPTY || attempt > 0) {
+            setLastError(Error::PlatformError, priv::format(
+                    "%s: Failed to remove: %s", path.c_str(), strerror(errno)));
+            return false;
+        }
     }
-    return ret;
+}
+
+/*!
+ * \brief Delete everything inside an open directory
+ *
+ * All operations are relative to the directory's file descriptor and the
+ * entry types come from the listing, so no full paths are built and no stat()
+ * calls are needed unless the filesystem does not report entry types. \a path
+ * is only used for error messages.
+ */
+static bool deleteContents(Directory &dir, const std::string &path)
+{
+    DirEntry entry;
+
+    while (dir.next(entry)) {
+        FileType type = entry.type;
+
+        if (type == FileType::Unknown) {
+            struct stat sb;
+            if (fstatat(dir.fd(), entry.name.c_str(), &sb,
+                        AT_SYMLINK_NOFOLLOW) < 0) {
+                setLastError(Error::PlatformError, priv::format(
+                        "%s/%s: Failed to stat: %s",
+                        path.c_str(), entry.name.c_str(), strerror(errno)));
+                return false;
+            }
+            type = S_ISDIR(sb.st_mode) ? FileType::Directory : FileType::Other;
+        }
+
+        if (type == FileType::Directory) {
+            if (!deleteSubdirectory(dir, path, entry.name)) {
+                return false;
+            }
+        } else if (!unlinkEntry(dir, path, entry.name, 0)) {
+            return false;
+        }
+    }
+
+    return dir.atEnd();
 }
 
 bool deleteRecursively(const std::string &path)
 {
-    return nftw(path.c_str(), deleteCbNftw, 64, FTW_DEPTH | FTW_PHYS);
+    struct stat sb;
+
+    if (lstat(path.c_str(), &sb) < 0) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to stat: %s", path.c_str(), strerror(errno)));
+        return false;
+    }
+
+    if (S_ISDIR(sb.st_mode)) {
+        Directory dir;
+        if (!dir.open(path) || !deleteContents(dir, path) || !dir.close()) {
+            return false;
+        }
+    }
+
+    if (remove(path.c_str()) < 0) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to remove: %s", path.c_str(), strerror(errno)));
+        return false;
+    }
+
+    return true;
 }
 
 }
@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbpio/directory.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "mbpio/error.h"
+#include "mbpio/private/string.h"
+
+// Read directories with the getdents64 syscall on Linux. Neither glibc (until
+// 2.30) nor older versions of bionic expose a wrapper.
+#if defined(__linux__) && defined(SYS_getdents64)
+#define IO_USE_GETDENTS64 1
+#endif
+
+#define DIRENT_BUF_SIZE (32 * 1024)
+
+namespace io
+{
+
+#if IO_USE_GETDENTS64
+// Fixed-size header of a getdents64() record. The NULL-terminated name
+// immediately follows d_type (before any struct padding).
+struct LinuxDirent64Header
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+};
+
+#define DIRENT64_NAME_OFFSET \
+    (offsetof(LinuxDirent64Header, d_type) + sizeof(unsigned char))
+#endif
+
+struct Directory::Impl
+{
+    int fd = -1;
+#if IO_USE_GETDENTS64
+    char buf[DIRENT_BUF_SIZE];
+    size_t pos = 0;
+    size_t len = 0;
+#else
+    DIR *dp = nullptr;
+#endif
+    bool end = false;
+
+    static Impl * create(int fd, const std::string &path);
+};
+
+static FileType fromDType(unsigned char type)
+{
+    switch (type) {
+    case DT_REG:
+        return FileType::Regular;
+    case DT_DIR:
+        return FileType::Directory;
+    case DT_LNK:
+        return FileType::Symlink;
+    case DT_UNKNOWN:
+        return FileType::Unknown;
+    default:
+        return FileType::Other;
+    }
+}
+
+static inline bool isDotOrDotDot(const char *name)
+{
+    return name[0] == '.'
+            && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+Directory::Directory() : _impl(nullptr)
+{
+}
+
+Directory::~Directory()
+{
+    close();
+}
+
+Directory::Impl * Directory::Impl::create(int fd, const std::string &path)
+{
+    (void) path;
+
+    Impl *impl = new Impl();
+    impl->fd = fd;
+
+#if !IO_USE_GETDENTS64
+    impl->dp = fdopendir(fd);
+    if (!impl->dp) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to open directory: %s",
+                path.c_str(), strerror(errno)));
+        ::close(fd);
+        delete impl;
+        return nullptr;
+    }
+#endif
+
+    return impl;
+}
+
+bool Directory::open(const std::string &path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to open directory: %s",
+                path.c_str(), strerror(errno)));
+        return false;
+    }
+
+    _impl = Impl::create(fd, path);
+    return _impl;
+}
+
+/*!
+ * \brief Open a subdirectory relative to an open directory
+ *
+ * The subdirectory is opened relative to the parent's file descriptor, so no
+ * full path has to be built. Symlinks are not followed.
+ */
+bool Directory::open(const Directory &parent, const std::string &name)
+{
+    close();
+
+    if (!parent._impl) {
+        setLastError(Error::InvalidArguments, "Parent directory is not open");
+        return false;
+    }
+
+    int fd = openat(parent._impl->fd, name.c_str(),
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        setLastError(Error::PlatformError, priv::format(
+                "%s: Failed to open directory: %s",
+                name.c_str(), strerror(errno)));
+        return false;
+    }
+
+    _impl = Impl::create(fd, name);
+    return _impl;
+}
+
+bool Directory::close()
+{
+    if (!_impl) {
+        return true;
+    }
+
+    bool ret = true;
+
+#if IO_USE_GETDENTS64
+    if (::close(_impl->fd) < 0) {
+#else
+    if (closedir(_impl->dp) < 0) {
+#endif
+        setLastError(Error::PlatformError, priv::format(
+                "Failed to close directory: %s", strerror(errno)));
+        ret = false;
+    }
+
+    delete _impl;
+    _impl = nullptr;
+
+    return ret;
+}
+
+bool Directory::isOpen() const
+{
+    return _impl;
+}
+
+/*!
+ * \brief Get the next entry in the directory
+ *
+ * \return True if an entry was read. False if the end of the directory was
+ *         reached (atEnd() returns true) or an error occurred.
+ */
+bool Directory::next(DirEntry &entry)
+{
+    if (!_impl) {
+        setLastError(Error::InvalidArguments, "Directory is not open");
+        return false;
+    }
+
+    while (!_impl->end) {
+#if IO_USE_GETDENTS64
+        if (_impl->pos >= _impl->len) {
+            long n = syscall(SYS_getdents64, _impl->fd, _impl->buf,
+                             sizeof(_impl->buf));
+            if (n < 0) {
+                setLastError(Error::PlatformError, priv::format(
+                        "Failed to read directory: %s", strerror(errno)));
+                return false;
+            } else if (n == 0) {
+                _impl->end = true;
+                break;
+            }
+
+            _impl->pos = 0;
+            _impl->len = static_cast<size_t>(n);
+        }
+
+        // The records are only 8-byte aligned, so copy the header out
+        LinuxDirent64Header hdr;
+        const char *record = _impl->buf + _impl->pos;
+        memcpy(&hdr, record, DIRENT64_NAME_OFFSET);
+        _impl->pos += hdr.d_reclen;
+
+        const char *name = record + DIRENT64_NAME_OFFSET;
+        unsigned char type = hdr.d_type;
+#else
+        errno = 0;
+        struct dirent *de = readdir(_impl->dp);
+        if (!de) {
+            if (errno != 0) {
+                setLastError(Error::PlatformError, priv::format(
+                        "Failed to read directory: %s", strerror(errno)));
+                return false;
+            }
+            _impl->end = true;
+            break;
+        }
+
+        const char *name = de->d_name;
+        unsigned char type = de->d_type;
+#endif
+
+        if (isDotOrDotDot(name)) {
+            continue;
+        }
+
+        entry.name = name;
+        entry.type = fromDType(type);
+        return true;
+    }
+
+    return false;
+}
+
+bool Directory::atEnd() const
+{
+    return !_impl || _impl->end;
+}
+
+int Directory::fd() const
+{
+    return _impl ? _impl->fd : -1;
+}
+
+}
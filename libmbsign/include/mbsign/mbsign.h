@@ -45,6 +45,15 @@ MB_EXPORT bool sign_data(BIO *bio_data_in, BIO *bio_sig_out,
                          EVP_PKEY *pkey);
 MB_EXPORT bool verify_data(BIO *bio_data_in, BIO *bio_sig_in,
                            EVP_PKEY *pkey, bool *result_out);
+MB_EXPORT bool verify_data_multi(BIO *bio_data_in, BIO *bio_sig_in,
+                                 EVP_PKEY * const *pkeys, size_t num_pkeys,
+                                 bool *result_out);
+MB_EXPORT bool verify_memory_multi(const void *data, size_t size,
+                                   BIO *bio_sig_in, EVP_PKEY * const *pkeys,
+                                   size_t num_pkeys, bool *result_out);
+MB_EXPORT bool verify_digest(const unsigned char *digest, size_t digest_size,
+                             BIO *bio_sig_in, EVP_PKEY * const *pkeys,
+                             size_t num_pkeys, bool *result_out);
 
 }
 }
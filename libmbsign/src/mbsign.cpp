@@ -29,6 +29,8 @@
 #include <openssl/pem.h>
 #include <openssl/pkcs12.h>
 
+#include "mbcommon/string.h"
+
 #include "mblog/logging.h"
 
 #define BUFSIZE                 1024 * 8
@@ -37,7 +39,13 @@
 #define MAGIC_SIZE              8
 
 #define VERSION_1_SHA512_DGST   1u
-#define VERSION_LATEST          VERSION_1_SHA512_DGST
+#define VERSION_2_ED25519_SHA512_DGST 2u
+#define VERSION_LATEST          VERSION_2_ED25519_SHA512_DGST
+
+#ifdef EVP_PKEY_ED25519
+#  define HAVE_ED25519          1
+#  define ED25519_SIG_SIZE      64
+#endif
 
 // NOTE: All integers are stored in little endian form
 struct SigHeader
@@ -331,19 +339,149 @@ EVP_PKEY * load_public_key_from_file(const char *file, int format,
 }
 
 /*!
- * \brief Sign data from stream
+ * \brief Compute the SHA512 digest of data from stream
  *
  * \param bio_data_in Input stream for data
- * \param bio_sig_out Output stream for signature
- * \param pkey Private key
+ * \param digest Output buffer for digest (at least EVP_MAX_MD_SIZE bytes)
+ * \param digest_size Output pointer for size of digest
  *
- * \return Whether the signing operation was successful
+ * \return Whether the data was successfully read and hashed
  */
-bool sign_data(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
+static bool digest_data(BIO *bio_data_in, unsigned char *digest,
+                        unsigned int *digest_size)
 {
-    assert(bio_data_in && bio_sig_out && pkey);
+    EVP_MD_CTX *mctx = nullptr;
+    unsigned char *buf = nullptr;
+    bool ret = false;
+    int n;
+
+    mctx = EVP_MD_CTX_create();
+    if (!mctx) {
+        LOGE("Failed to create message digest context");
+        openssl_log_errors();
+        goto done;
+    }
+
+    if (!EVP_DigestInit_ex(mctx, EVP_sha512(), nullptr)) {
+        LOGE("Failed to set message digest context");
+        openssl_log_errors();
+        goto done;
+    }
+
+    buf = (unsigned char *) OPENSSL_malloc(BUFSIZE);
+    if (!buf) {
+        LOGE("Failed to allocate I/O buffer");
+        openssl_log_errors();
+        goto done;
+    }
+
+    while (true) {
+        n = BIO_read(bio_data_in, buf, BUFSIZE);
+        if (n < 0) {
+            LOGE("Failed to read input data BIO stream");
+            openssl_log_errors();
+            goto done;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (!EVP_DigestUpdate(mctx, buf, n)) {
+            LOGE("Failed to update digest");
+            openssl_log_errors();
+            goto done;
+        }
+    }
+
+    if (!EVP_DigestFinal_ex(mctx, digest, digest_size)) {
+        LOGE("Failed to finalize digest");
+        openssl_log_errors();
+        goto done;
+    }
+
+    ret = true;
+
+done:
+    EVP_MD_CTX_destroy(mctx);
+    OPENSSL_free(buf);
+    return ret;
+}
+
+/*!
+ * \brief Write signature header and signature to stream
+ */
+static bool write_signature(BIO *bio_sig_out, unsigned int version,
+                            const unsigned char *sig, size_t sig_size)
+{
+    SigHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, MAGIC, MAGIC_SIZE);
+    hdr.version = version;
+
+    if (BIO_write(bio_sig_out, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        LOGE("Failed to write header to signature BIO stream");
+        openssl_log_errors();
+        return false;
+    }
+
+    if (BIO_write(bio_sig_out, sig, sig_size) != (int) sig_size) {
+        LOGE("Failed to write signature to signature BIO stream");
+        openssl_log_errors();
+        return false;
+    }
+
+    return true;
+}
+
+#ifdef HAVE_ED25519
+/*!
+ * \brief Sign data from stream with an Ed25519 key (version 2 signature)
+ *
+ * Ed25519 signs the SHA512 digest of the data rather than the data itself so
+ * that signatures can still be verified against a precomputed digest with
+ * verify_digest().
+ */
+static bool sign_data_ed25519(BIO *bio_data_in, BIO *bio_sig_out,
+                              EVP_PKEY *pkey)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+    unsigned char sig[ED25519_SIG_SIZE];
+    size_t sig_size = sizeof(sig);
+    EVP_MD_CTX *mctx;
+    bool ret;
+
+    if (!digest_data(bio_data_in, digest, &digest_size)) {
+        return false;
+    }
+
+    mctx = EVP_MD_CTX_create();
+    if (!mctx) {
+        LOGE("Failed to create message digest context");
+        openssl_log_errors();
+        return false;
+    }
+
+    ret = EVP_DigestSignInit(mctx, nullptr, nullptr, nullptr, pkey) > 0
+            && EVP_DigestSign(mctx, sig, &sig_size, digest, digest_size) > 0;
+    EVP_MD_CTX_destroy(mctx);
+
+    if (!ret) {
+        LOGE("Failed to sign data");
+        openssl_log_errors();
+        return false;
+    }
+
+    return write_signature(bio_sig_out, VERSION_2_ED25519_SHA512_DGST,
+                           sig, sig_size);
+}
+#endif
 
-    unsigned int version = VERSION_LATEST;
+/*!
+ * \brief Sign data from stream with any other key (version 1 signature)
+ */
+static bool sign_data_v1(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
+{
+    unsigned int version = VERSION_1_SHA512_DGST;
     const EVP_MD *md_type = nullptr;
     EVP_MD_CTX *mctx = nullptr;
     EVP_PKEY_CTX *pctx = nullptr;
@@ -426,21 +564,7 @@ bool sign_data(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
         goto error;
     }
 
-    // Write header
-    SigHeader hdr;
-    memset(&hdr, 0, sizeof(hdr));
-    memcpy(hdr.magic, MAGIC, MAGIC_SIZE);
-    hdr.version = version;
-
-    if (BIO_write(bio_sig_out, &hdr, sizeof(hdr)) != sizeof(hdr)) {
-        LOGE("Failed to write header to signature BIO stream");
-        openssl_log_errors();
-        goto error;
-    }
-
-    if (BIO_write(bio_sig_out, buf, len) != (int) len) {
-        LOGE("Failed to write signature to signature BIO stream");
-        openssl_log_errors();
+    if (!write_signature(bio_sig_out, version, buf, len)) {
         goto error;
     }
 
@@ -462,6 +586,32 @@ error:
     return false;
 }
 
+/*!
+ * \brief Sign data from stream
+ *
+ * The signature format is chosen based on the type of \a pkey. Ed25519 keys
+ * produce version 2 signatures, which are much cheaper to verify. All other
+ * keys (eg. RSA) produce version 1 signatures.
+ *
+ * \param bio_data_in Input stream for data
+ * \param bio_sig_out Output stream for signature
+ * \param pkey Private key
+ *
+ * \return Whether the signing operation was successful
+ */
+bool sign_data(BIO *bio_data_in, BIO *bio_sig_out, EVP_PKEY *pkey)
+{
+    assert(bio_data_in && bio_sig_out && pkey);
+
+#ifdef HAVE_ED25519
+    if (EVP_PKEY_id(pkey) == EVP_PKEY_ED25519) {
+        return sign_data_ed25519(bio_data_in, bio_sig_out, pkey);
+    }
+#endif
+
+    return sign_data_v1(bio_data_in, bio_sig_out, pkey);
+}
+
 /*!
  * \brief Verify signature of data from stream
  *
@@ -478,37 +628,199 @@ bool verify_data(BIO *bio_data_in, BIO *bio_sig_in,
 {
     assert(bio_data_in && bio_sig_in && pkey && result_out);
 
-    SigHeader hdr;
-    const EVP_MD *md_type = nullptr;
-    EVP_MD_CTX *mctx = nullptr;
-    EVP_PKEY_CTX *pctx = nullptr;
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX ctx;
+    return verify_data_multi(bio_data_in, bio_sig_in, &pkey, 1, result_out);
+}
+
+/*!
+ * \brief Verify signature of data from stream against several keys
+ *
+ * The data is read and hashed once, regardless of the number of keys. The
+ * signature is considered valid if it was made by any of the keys.
+ *
+ * \param bio_data_in Input stream for data (eg. from BIO_new_fd())
+ * \param bio_sig_in Input stream for signature
+ * \param pkeys Public keys to try in order
+ * \param num_pkeys Number of keys in \a pkeys
+ * \param result_out Output pointer for result of verification operation
+ *
+ * \return Whether the verification operation completed successfully (does not
+ *         indicate whether the signature is valid)
+ */
+bool verify_data_multi(BIO *bio_data_in, BIO *bio_sig_in,
+                       EVP_PKEY * const *pkeys, size_t num_pkeys,
+                       bool *result_out)
+{
+    assert(bio_data_in && bio_sig_in && (pkeys || num_pkeys == 0)
+            && result_out);
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+
+    if (!digest_data(bio_data_in, digest, &digest_size)) {
+        return false;
+    }
+
+    return verify_digest(digest, digest_size, bio_sig_in, pkeys, num_pkeys,
+                         result_out);
+}
+
+/*!
+ * \brief Verify signature of data in memory against several keys
+ *
+ * This is the same as verify_data_multi(), except that the data is hashed in
+ * place. This is useful for memory-mapped files.
+ *
+ * \param data Pointer to data
+ * \param size Size of \a data
+ * \param bio_sig_in Input stream for signature
+ * \param pkeys Public keys to try in order
+ * \param num_pkeys Number of keys in \a pkeys
+ * \param result_out Output pointer for result of verification operation
+ *
+ * \return Whether the verification operation completed successfully (does not
+ *         indicate whether the signature is valid)
+ */
+bool verify_memory_multi(const void *data, size_t size, BIO *bio_sig_in,
+                         EVP_PKEY * const *pkeys, size_t num_pkeys,
+                         bool *result_out)
+{
+    assert((data || size == 0) && bio_sig_in && (pkeys || num_pkeys == 0)
+            && result_out);
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_size;
+
+    if (!EVP_Digest(data, size, digest, &digest_size, EVP_sha512(), nullptr)) {
+        LOGE("Failed to compute digest");
+        openssl_log_errors();
+        return false;
+    }
+
+    return verify_digest(digest, digest_size, bio_sig_in, pkeys, num_pkeys,
+                         result_out);
+}
+
+/*!
+ * \brief Check if a signature version can be verified
+ */
+static bool is_supported_version(unsigned int version)
+{
+    switch (version) {
+    case VERSION_1_SHA512_DGST:
+#ifdef HAVE_ED25519
+    case VERSION_2_ED25519_SHA512_DGST:
+#endif
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*!
+ * \brief Check if a key can have made a signature of the specified version
+ */
+static bool key_matches_version(EVP_PKEY *pkey, unsigned int version)
+{
+#ifdef HAVE_ED25519
+    bool is_ed25519 = EVP_PKEY_id(pkey) == EVP_PKEY_ED25519;
 #else
-    BIO *bio_md = nullptr;
+    bool is_ed25519 = false;
 #endif
-    BIO *bio_input = nullptr;
-    unsigned char *buf = nullptr;
-    unsigned char *sigbuf = nullptr;
-    int siglen;
+
+    if (version == VERSION_2_ED25519_SHA512_DGST) {
+        return is_ed25519;
+    } else {
+        return !is_ed25519;
+    }
+}
+
+/*!
+ * \brief Verify signature of a digest against a single key
+ *
+ * \return 1 if the signature was made by \a pkey, 0 if it was not, or -1 if
+ *         an error occurred
+ */
+static int verify_digest_with_key(EVP_PKEY *pkey, unsigned int version,
+                                  const unsigned char *sig, size_t sig_size,
+                                  const unsigned char *digest,
+                                  size_t digest_size)
+{
     int n;
 
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_init(&ctx);
-    mctx = &ctx;
+#ifdef HAVE_ED25519
+    if (version == VERSION_2_ED25519_SHA512_DGST) {
+        EVP_MD_CTX *mctx = EVP_MD_CTX_create();
+        if (!mctx) {
+            LOGE("Failed to create message digest context");
+            openssl_log_errors();
+            return -1;
+        }
+
+        if (EVP_DigestVerifyInit(mctx, nullptr, nullptr, nullptr, pkey) <= 0) {
+            LOGE("Failed to set message digest context");
+            openssl_log_errors();
+            EVP_MD_CTX_destroy(mctx);
+            return -1;
+        }
+
+        n = EVP_DigestVerify(mctx, sig, sig_size, digest, digest_size);
+        EVP_MD_CTX_destroy(mctx);
+
+        return n == 1 ? 1 : n == 0 ? 0 : -1;
+    }
 #else
-    bio_md = BIO_new(BIO_f_md());
-    if (!bio_md) {
+    (void) version;
+#endif
+
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new(pkey, nullptr);
+    if (!pctx) {
+        LOGE("Failed to create public key context");
         openssl_log_errors();
-        goto error;
+        return -1;
     }
 
-    if (!BIO_get_md_ctx(bio_md, &mctx)) {
-        LOGE("Failed to get message digest context");
+    if (EVP_PKEY_verify_init(pctx) <= 0
+            || EVP_PKEY_CTX_set_signature_md(pctx, EVP_sha512()) <= 0) {
+        LOGE("Failed to set public key context");
         openssl_log_errors();
-        goto error;
+        EVP_PKEY_CTX_free(pctx);
+        return -1;
     }
-#endif
+
+    n = EVP_PKEY_verify(pctx, sig, sig_size, digest, digest_size);
+    EVP_PKEY_CTX_free(pctx);
+
+    return n == 1 ? 1 : n == 0 ? 0 : -1;
+}
+
+/*!
+ * \brief Verify signature of a precomputed digest against several keys
+ *
+ * This is equivalent to calling verify_data() once for each key, except that
+ * the data only has to be read and hashed once by the caller. The signature
+ * is considered valid if it was made by any of the keys. Keys that cannot
+ * have made the signature (eg. RSA keys for an Ed25519 signature) are skipped.
+ *
+ * \param digest SHA512 digest of the data
+ * \param digest_size Size of \a digest
+ * \param bio_sig_in Input stream for signature
+ * \param pkeys Public keys to try in order
+ * \param num_pkeys Number of keys in \a pkeys
+ * \param result_out Output pointer for result of verification operation
+ *
+ * \return Whether the verification operation completed successfully (does not
+ *         indicate whether the signature is valid)
+ */
+bool verify_digest(const unsigned char *digest, size_t digest_size,
+                   BIO *bio_sig_in, EVP_PKEY * const *pkeys, size_t num_pkeys,
+                   bool *result_out)
+{
+    assert(digest && bio_sig_in && (pkeys || num_pkeys == 0) && result_out);
+
+    SigHeader hdr;
+    unsigned char *sigbuf = nullptr;
+    int siglen = 0;
+    int n;
 
     // Read header from signature file
     if (BIO_read(bio_sig_in, &hdr, sizeof(hdr)) != sizeof(hdr)) {
@@ -525,28 +837,35 @@ bool verify_data(BIO *bio_data_in, BIO *bio_sig_in,
     }
 
     // Verify version
-    if (hdr.version == VERSION_1_SHA512_DGST) {
-        md_type = EVP_sha512();
-    } else {
+    if (!is_supported_version(hdr.version)) {
         LOGE("Invalid version in signature file: %u", hdr.version);
         openssl_log_errors();
         goto error;
     }
 
-    if (!EVP_DigestVerifyInit(mctx, &pctx, md_type, nullptr, pkey)) {
-        LOGE("Failed to set message digest context");
-        openssl_log_errors();
+    // All versions sign a SHA512 digest
+    if (digest_size != (size_t) EVP_MD_size(EVP_sha512())) {
+        LOGE("Digest size (%" MB_PRIzu ") does not match signature type",
+             digest_size);
         goto error;
     }
 
-    buf = (unsigned char *) OPENSSL_malloc(BUFSIZE);
-    if (!buf) {
-        LOGE("Failed to allocate I/O buffer");
-        openssl_log_errors();
-        goto error;
+    *result_out = false;
+
+    for (size_t i = 0; i < num_pkeys; ++i) {
+        if (key_matches_version(pkeys[i], hdr.version)) {
+            n = EVP_PKEY_size(pkeys[i]);
+            if (n > siglen) {
+                siglen = n;
+            }
+        }
+    }
+
+    if (siglen == 0) {
+        // None of the keys can have made a signature of this type
+        return true;
     }
 
-    siglen = EVP_PKEY_size(pkey);
     sigbuf = (unsigned char *) OPENSSL_malloc(siglen);
     if (!sigbuf) {
         LOGE("Failed to allocate signature buffer");
@@ -560,61 +879,31 @@ bool verify_data(BIO *bio_data_in, BIO *bio_sig_in,
         goto error;
     }
 
-#ifdef OPENSSL_IS_BORINGSSL
-    bio_input = bio_data_in;
-#else
-    bio_input = BIO_push(bio_md, bio_data_in);
-#endif
-
-    while (true) {
-        n = BIO_read(bio_input, buf, BUFSIZE);
-        if (n < 0) {
-            LOGE("Failed to read input data BIO stream");
-            openssl_log_errors();
-            goto error;
+    for (size_t i = 0; i < num_pkeys && !*result_out; ++i) {
+        if (!key_matches_version(pkeys[i], hdr.version)) {
+            continue;
         }
-        if (n == 0) {
-            break;
-        }
-#ifdef OPENSSL_IS_BORINGSSL
-        if (!EVP_DigestUpdate(mctx, buf, n)) {
-            LOGE("Failed to update digest");
+
+        n = verify_digest_with_key(pkeys[i], hdr.version, sigbuf, siglen,
+                                   digest, digest_size);
+        if (n == 1) {
+            *result_out = true;
+        } else if (n == 0) {
+            // Signature was not made by this key
+            ERR_clear_error();
+        } else {
+            LOGE("Failed to verify data");
             openssl_log_errors();
             goto error;
         }
-#endif
     }
 
-    n = EVP_DigestVerifyFinal(mctx, sigbuf, siglen);
-    if (n == 1) {
-        *result_out = true;
-    } else if (n == 0) {
-        *result_out = false;
-    } else {
-        LOGE("Failed to verify data");
-        openssl_log_errors();
-        goto error;
-    }
-
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_cleanup(&ctx);
-#else
-    BIO_free(bio_md);
-#endif
     OPENSSL_free(sigbuf);
-    OPENSSL_free(buf);
     return true;
 
 error:
-#ifdef OPENSSL_IS_BORINGSSL
-    EVP_MD_CTX_cleanup(&ctx);
-#else
-    BIO_free(bio_md);
-#endif
     OPENSSL_free(sigbuf);
-    OPENSSL_free(buf);
     return false;
 }
-
 }
 }
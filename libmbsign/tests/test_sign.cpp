@@ -22,6 +22,7 @@
 #include <openssl/err.h>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
+#include <openssl/sha.h>
 
 #include "mblog/logging.h"
 #include "mbsign/mbsign.h"
@@ -97,6 +98,53 @@ error:
     return false;
 }
 
+#ifdef EVP_PKEY_ED25519
+static bool generate_ed25519_keys(EVP_PKEY **private_key_out,
+                                  EVP_PKEY **public_key_out)
+{
+    assert(private_key_out && public_key_out);
+
+    EVP_PKEY *private_key = nullptr;
+    EVP_PKEY *public_key = nullptr;
+    EVP_PKEY_CTX *pctx = nullptr;
+    unsigned char raw[32];
+    size_t raw_size = sizeof(raw);
+
+    pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, nullptr);
+    if (!pctx || EVP_PKEY_keygen_init(pctx) <= 0
+            || EVP_PKEY_keygen(pctx, &private_key) <= 0) {
+        LOGE("Failed to generate Ed25519 key");
+        openssl_log_errors();
+        goto error;
+    }
+
+    if (!EVP_PKEY_get_raw_public_key(private_key, raw, &raw_size)) {
+        LOGE("EVP_PKEY_get_raw_public_key() failed");
+        openssl_log_errors();
+        goto error;
+    }
+
+    public_key = EVP_PKEY_new_raw_public_key(
+            EVP_PKEY_ED25519, nullptr, raw, raw_size);
+    if (!public_key) {
+        LOGE("EVP_PKEY_new_raw_public_key() failed");
+        openssl_log_errors();
+        goto error;
+    }
+
+    *private_key_out = private_key;
+    *public_key_out = public_key;
+    EVP_PKEY_CTX_free(pctx);
+    return true;
+
+error:
+    EVP_PKEY_free(private_key);
+    EVP_PKEY_free(public_key);
+    EVP_PKEY_CTX_free(pctx);
+    return false;
+}
+#endif
+
 TEST(SignTest, TestLoadInvalidPemKeys)
 {
     BIO *bio_private_key;
@@ -235,3 +283,293 @@ TEST(SignTest, TestLoadValidPemKeysWithInvalidPassphrase)
     EVP_PKEY_free(private_key_read);
     BIO_free(bio);
 }
+
+TEST(SignTest, TestVerifyDigestWithMultipleKeys)
+{
+    EVP_PKEY *private_key;
+    EVP_PKEY *public_key;
+    EVP_PKEY *other_private_key;
+    EVP_PKEY *other_public_key;
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    const char data[] = "The quick brown fox jumps over the lazy dog";
+    BIO *bio_data;
+    BIO *bio_sig;
+    BIO *bio_sig_in;
+    char *sig_data;
+    long sig_size;
+    bool valid;
+
+    // Generate keys
+    ASSERT_TRUE(generate_keys(&private_key, &public_key));
+    ASSERT_TRUE(generate_keys(&other_private_key, &other_public_key));
+
+    // Sign data
+    bio_data = BIO_new_mem_buf((void *) data, sizeof(data) - 1);
+    ASSERT_NE(bio_data, nullptr);
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(mb::sign::sign_data(bio_data, bio_sig, private_key));
+    sig_size = BIO_get_mem_data(bio_sig, &sig_data);
+    ASSERT_GT(sig_size, 0);
+
+    SHA512(reinterpret_cast<const unsigned char *>(data), sizeof(data) - 1,
+           digest);
+
+    // Valid if any of the keys made the signature
+    EVP_PKEY *all_keys[] = { other_public_key, public_key };
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_digest(digest, sizeof(digest), bio_sig_in,
+                                        all_keys, 2, &valid));
+    ASSERT_TRUE(valid);
+    BIO_free(bio_sig_in);
+
+    // Invalid if none of them did
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_digest(digest, sizeof(digest), bio_sig_in,
+                                        all_keys, 1, &valid));
+    ASSERT_FALSE(valid);
+    BIO_free(bio_sig_in);
+
+    // Invalid if the data changed
+    digest[0] ^= 0xff;
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_digest(digest, sizeof(digest), bio_sig_in,
+                                        all_keys, 2, &valid));
+    ASSERT_FALSE(valid);
+    BIO_free(bio_sig_in);
+
+    // Digest must match the signature type
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_FALSE(mb::sign::verify_digest(digest, SHA256_DIGEST_LENGTH,
+                                         bio_sig_in, all_keys, 2, &valid));
+    BIO_free(bio_sig_in);
+
+    EVP_PKEY_free(private_key);
+    EVP_PKEY_free(public_key);
+    EVP_PKEY_free(other_private_key);
+    EVP_PKEY_free(other_public_key);
+    BIO_free(bio_data);
+    BIO_free(bio_sig);
+}
+
+TEST(SignTest, TestVerifyDataWithMultipleKeys)
+{
+    EVP_PKEY *private_key;
+    EVP_PKEY *public_key;
+    EVP_PKEY *other_private_key;
+    EVP_PKEY *other_public_key;
+    const char data[] = "The quick brown fox jumps over the lazy dog";
+    BIO *bio_data;
+    BIO *bio_sig;
+    BIO *bio_sig_in;
+    char *sig_data;
+    long sig_size;
+    bool valid;
+
+    // Generate keys
+    ASSERT_TRUE(generate_keys(&private_key, &public_key));
+    ASSERT_TRUE(generate_keys(&other_private_key, &other_public_key));
+
+    // Sign data
+    bio_data = BIO_new_mem_buf((void *) data, sizeof(data) - 1);
+    ASSERT_NE(bio_data, nullptr);
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(mb::sign::sign_data(bio_data, bio_sig, private_key));
+    sig_size = BIO_get_mem_data(bio_sig, &sig_data);
+    ASSERT_GT(sig_size, 0);
+    BIO_free(bio_data);
+
+    EVP_PKEY *all_keys[] = { other_public_key, public_key };
+
+    // Streamed data is valid if any of the keys made the signature
+    bio_data = BIO_new_mem_buf((void *) data, sizeof(data) - 1);
+    ASSERT_NE(bio_data, nullptr);
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_data_multi(bio_data, bio_sig_in,
+                                            all_keys, 2, &valid));
+    ASSERT_TRUE(valid);
+    BIO_free(bio_sig_in);
+    BIO_free(bio_data);
+
+    // Invalid if none of them did
+    bio_data = BIO_new_mem_buf((void *) data, sizeof(data) - 1);
+    ASSERT_NE(bio_data, nullptr);
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_data_multi(bio_data, bio_sig_in,
+                                            all_keys, 1, &valid));
+    ASSERT_FALSE(valid);
+    BIO_free(bio_sig_in);
+    BIO_free(bio_data);
+
+    // In-memory data gives the same results
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_memory_multi(data, sizeof(data) - 1,
+                                              bio_sig_in, all_keys, 2,
+                                              &valid));
+    ASSERT_TRUE(valid);
+    BIO_free(bio_sig_in);
+
+    // Invalid if the data changed
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_memory_multi(data, sizeof(data) - 2,
+                                              bio_sig_in, all_keys, 2,
+                                              &valid));
+    ASSERT_FALSE(valid);
+    BIO_free(bio_sig_in);
+
+    EVP_PKEY_free(private_key);
+    EVP_PKEY_free(public_key);
+    EVP_PKEY_free(other_private_key);
+    EVP_PKEY_free(other_public_key);
+    BIO_free(bio_sig);
+}
+
+#ifdef EVP_PKEY_ED25519
+TEST(SignTest, TestSignAndVerifyEd25519)
+{
+    EVP_PKEY *private_key;
+    EVP_PKEY *public_key;
+    EVP_PKEY *other_private_key;
+    EVP_PKEY *other_public_key;
+    EVP_PKEY *rsa_private_key;
+    EVP_PKEY *rsa_public_key;
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    const char data[] = "The quick brown fox jumps over the lazy dog";
+    BIO *bio_data;
+    BIO *bio_sig;
+    BIO *bio_sig_in;
+    char *sig_data;
+    long sig_size;
+    bool valid;
+
+    // Generate keys
+    ASSERT_TRUE(generate_ed25519_keys(&private_key, &public_key));
+    ASSERT_TRUE(generate_ed25519_keys(&other_private_key, &other_public_key));
+    ASSERT_TRUE(generate_keys(&rsa_private_key, &rsa_public_key));
+
+    // Sign data
+    bio_data = BIO_new_mem_buf((void *) data, sizeof(data) - 1);
+    ASSERT_NE(bio_data, nullptr);
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(mb::sign::sign_data(bio_data, bio_sig, private_key));
+    sig_size = BIO_get_mem_data(bio_sig, &sig_data);
+    BIO_free(bio_data);
+
+    // 20-byte header with version 2, followed by the 64-byte signature
+    ASSERT_EQ(sig_size, 20 + 64);
+    ASSERT_EQ(memcmp(sig_data, "!MBSIGN!\x02\x00\x00\x00", 12), 0);
+
+    SHA512(reinterpret_cast<const unsigned char *>(data), sizeof(data) - 1,
+           digest);
+
+    // Valid against a mix of RSA and Ed25519 keys
+    EVP_PKEY *all_keys[] = { rsa_public_key, other_public_key, public_key };
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_digest(digest, sizeof(digest), bio_sig_in,
+                                        all_keys, 3, &valid));
+    ASSERT_TRUE(valid);
+    BIO_free(bio_sig_in);
+
+    // Invalid if none of the keys made the signature
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_digest(digest, sizeof(digest), bio_sig_in,
+                                        all_keys, 2, &valid));
+    ASSERT_FALSE(valid);
+    BIO_free(bio_sig_in);
+
+    // Streamed data gives the same result
+    bio_data = BIO_new_mem_buf((void *) data, sizeof(data) - 1);
+    ASSERT_NE(bio_data, nullptr);
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_data(bio_data, bio_sig_in, public_key,
+                                      &valid));
+    ASSERT_TRUE(valid);
+    BIO_free(bio_sig_in);
+    BIO_free(bio_data);
+
+    // Invalid if the data changed
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_memory_multi(data, sizeof(data) - 2,
+                                              bio_sig_in, all_keys, 3,
+                                              &valid));
+    ASSERT_FALSE(valid);
+    BIO_free(bio_sig_in);
+
+    EVP_PKEY_free(private_key);
+    EVP_PKEY_free(public_key);
+    EVP_PKEY_free(other_private_key);
+    EVP_PKEY_free(other_public_key);
+    EVP_PKEY_free(rsa_private_key);
+    EVP_PKEY_free(rsa_public_key);
+    BIO_free(bio_sig);
+}
+
+TEST(SignTest, TestVerifyRsaSignatureWithEd25519Keys)
+{
+    EVP_PKEY *private_key;
+    EVP_PKEY *public_key;
+    EVP_PKEY *ed25519_private_key;
+    EVP_PKEY *ed25519_public_key;
+    const char data[] = "The quick brown fox jumps over the lazy dog";
+    BIO *bio_data;
+    BIO *bio_sig;
+    BIO *bio_sig_in;
+    char *sig_data;
+    long sig_size;
+    bool valid;
+
+    // Generate keys
+    ASSERT_TRUE(generate_keys(&private_key, &public_key));
+    ASSERT_TRUE(generate_ed25519_keys(&ed25519_private_key,
+                                      &ed25519_public_key));
+
+    // RSA keys still produce version 1 signatures
+    bio_data = BIO_new_mem_buf((void *) data, sizeof(data) - 1);
+    ASSERT_NE(bio_data, nullptr);
+    bio_sig = BIO_new(BIO_s_mem());
+    ASSERT_NE(bio_sig, nullptr);
+    ASSERT_TRUE(mb::sign::sign_data(bio_data, bio_sig, private_key));
+    sig_size = BIO_get_mem_data(bio_sig, &sig_data);
+    ASSERT_GT(sig_size, 12);
+    ASSERT_EQ(memcmp(sig_data, "!MBSIGN!\x01\x00\x00\x00", 12), 0);
+    BIO_free(bio_data);
+
+    // Ed25519 keys are skipped when verifying RSA signatures
+    EVP_PKEY *all_keys[] = { ed25519_public_key, public_key };
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_memory_multi(data, sizeof(data) - 1,
+                                              bio_sig_in, all_keys, 2,
+                                              &valid));
+    ASSERT_TRUE(valid);
+    BIO_free(bio_sig_in);
+
+    bio_sig_in = BIO_new_mem_buf(sig_data, sig_size);
+    ASSERT_NE(bio_sig_in, nullptr);
+    ASSERT_TRUE(mb::sign::verify_memory_multi(data, sizeof(data) - 1,
+                                              bio_sig_in, all_keys, 1,
+                                              &valid));
+    ASSERT_FALSE(valid);
+    BIO_free(bio_sig_in);
+
+    EVP_PKEY_free(private_key);
+    EVP_PKEY_free(public_key);
+    EVP_PKEY_free(ed25519_private_key);
+    EVP_PKEY_free(ed25519_public_key);
+    BIO_free(bio_sig);
+}
+#endif
@@ -20,6 +20,8 @@
 
 #pragma once
 
+#include <vector>
+
 #include "mbcommon/file.h"
 
 namespace mb
@@ -27,6 +29,27 @@ namespace mb
 namespace sparse
 {
 
+enum class SparseChunkType
+{
+    Raw,
+    Fill,
+    DontCare,
+};
+
+struct SparseChunk
+{
+    SparseChunkType type;
+    // Byte range in the output file
+    uint64_t begin;
+    uint64_t end;
+    // Byte range of the chunk data (after the chunk header), relative to the
+    // start of the sparse image
+    uint64_t src_begin;
+    uint64_t src_end;
+    // Fill value for fill chunks
+    uint32_t fill_val;
+};
+
 class SparseFilePrivate;
 class MB_EXPORT SparseFile : public File
 {
@@ -46,6 +69,18 @@ public:
     // File size
     uint64_t size();
 
+    // Chunk index
+    bool build_index();
+    bool save_index(File &file);
+    bool load_index(File &file);
+
+    // Integrity checking
+    bool set_crc32_verification_enabled(bool enabled);
+
+    // Chunk access
+    bool chunks(std::vector<SparseChunk> &chunks);
+    bool current_chunk(SparseChunk &chunk, bool &found);
+
 protected:
     /*! \cond INTERNAL */
     SparseFile(SparseFilePrivate *priv);
@@ -58,6 +93,8 @@ protected:
                          size_t &bytes_read) override;
     virtual bool on_seek(int64_t offset, int whence,
                          uint64_t &new_offset) override;
+    virtual bool on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read) override;
 
 private:
     std::unique_ptr<SparseFilePrivate> _priv_ptr;
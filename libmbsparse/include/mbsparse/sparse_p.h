@@ -22,8 +22,12 @@
 
 #include "mbsparse/guard_p.h"
 
+#include <vector>
+
 #include <cstdint>
 
+#include "mbsparse/sparse.h"
+
 namespace mb
 {
 namespace sparse
@@ -69,6 +73,42 @@ struct ChunkHeader
  * - For a CRC32 chunk, it's 4 bytes of CRC32
  */
 
+constexpr uint32_t INDEX_HEADER_MAGIC =     0x4953424d; // "MBSI"
+constexpr uint32_t INDEX_VERSION =          2;
+
+/*!
+ * \brief Header of a saved chunk index
+ *
+ * All fields are little-endian. The sparse header fields are copied from the
+ * image that the index was built from and must match when loading the index.
+ */
+struct IndexHeader
+{
+    uint32_t magic;          // INDEX_HEADER_MAGIC
+    uint32_t version;        // INDEX_VERSION
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;   // also the number of IndexEntry records
+    uint32_t image_checksum;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t reserved;
+};
+
+/*! \brief Saved chunk index record (little-endian version of ChunkInfo) */
+struct IndexEntry
+{
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t fill_val;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t src_begin;
+    uint64_t src_end;
+    uint64_t raw_begin;
+    uint64_t raw_end;
+};
+
 /*! \brief Minimum information we need from the chunk headers while reading */
 struct ChunkInfo
 {
@@ -90,7 +130,11 @@ struct ChunkInfo
     /*! \brief [CHUNK_TYPE_RAW only] End of raw bytes in input file */
     uint64_t raw_end;
 
-    /*! \brief [CHUNK_TYPE_FILL only] Filler value for the chunk */
+    /*!
+     * \brief [CHUNK_TYPE_FILL only] Filler value for the chunk
+     *
+     * [CHUNK_TYPE_CRC32 only] Expected checksum of all data before the chunk
+     */
     uint32_t fill_val;
 };
 
@@ -132,12 +176,31 @@ public:
 
     bool move_to_chunk(uint64_t offset);
 
+    bool check_index_header(const IndexHeader &ihdr);
+    bool check_index_entry(const ChunkInfo &info, size_t chunk_num,
+                           const ChunkInfo *prev);
+    bool verify_chunk_at(const ChunkInfo &info);
+
+    bool update_crc32(uint64_t offset, const void *buf, size_t size);
+    bool skip_crc32(uint64_t offset);
+    bool check_crc32(const ChunkInfo &info);
+    bool check_crc32_at_offset();
+
     File *file;
     Seekability seekability;
 
-    // Expected CRC32 checksum. We currently do *not* validate this. It would
-    // only work if the entire file was read sequentially anyway.
-    uint32_t expected_crc32;
+    // Whether to verify CRC32 chunks and the image checksum
+    bool verify_crc32;
+    // Whether crc32 covers all data before crc32_offset. Verification stops
+    // once some data cannot be checksummed (eg. a raw chunk is skipped).
+    bool crc32_valid;
+    // Offset in output file up to which the data has been checksummed
+    uint64_t crc32_offset;
+    // Running CRC32 checksum of the output data
+    uint32_t crc32;
+    // Absolute offset of the sparse header in the input file. Only valid if
+    // the input file can seek.
+    uint64_t src_base_offset;
     // Relative offset in input file
     uint64_t cur_src_offset;
     // Absolute offset in output file
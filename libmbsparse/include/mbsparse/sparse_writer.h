@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/file.h"
+
+namespace mb
+{
+namespace sparse
+{
+
+class SparseWriterPrivate;
+class MB_EXPORT SparseWriter : public File
+{
+    MB_DECLARE_PRIVATE(SparseWriter)
+
+public:
+    SparseWriter();
+    SparseWriter(File *file, uint32_t block_size, bool crc32);
+    virtual ~SparseWriter();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(SparseWriter)
+    MB_DEFAULT_MOVE_CONSTRUCT_AND_ASSIGN(SparseWriter)
+
+    // File open
+    bool open(File *file, uint32_t block_size, bool crc32);
+
+protected:
+    /*! \cond INTERNAL */
+    SparseWriter(SparseWriterPrivate *priv);
+    SparseWriter(SparseWriterPrivate *priv, File *file, uint32_t block_size,
+                 bool crc32);
+    /*! \endcond */
+
+    virtual bool on_open() override;
+    virtual bool on_close() override;
+    virtual bool on_write(const void *buf, size_t size,
+                          size_t &bytes_written) override;
+    virtual bool on_seek(int64_t offset, int whence,
+                         uint64_t &new_offset) override;
+
+private:
+    std::unique_ptr<SparseWriterPrivate> _priv_ptr;
+};
+
+}
+}
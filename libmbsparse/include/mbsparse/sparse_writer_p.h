@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbsparse/guard_p.h"
+
+#include <vector>
+
+#include <cstdint>
+
+#include "mbsparse/sparse_p.h"
+
+namespace mb
+{
+namespace sparse
+{
+
+/*! \cond INTERNAL */
+
+class SparseWriterPrivate
+{
+    MB_DECLARE_PUBLIC(SparseWriter)
+
+public:
+    SparseWriterPrivate(SparseWriter *sw);
+    ~SparseWriterPrivate() = default;
+
+    void clear();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(SparseWriterPrivate)
+
+    bool wwrite(const void *buf, size_t size);
+    bool write_sparse_header();
+    bool write_chunk_header(uint16_t type, uint32_t blocks, uint32_t data_size);
+
+    bool flush_chunk();
+    bool add_block(const unsigned char *data);
+    bool add_dont_care_blocks(uint64_t blocks);
+    bool add_zeros(uint64_t size);
+
+    File *file;
+    uint32_t block_size;
+    bool crc32_enabled;
+
+    // Offset of the sparse header in the output file
+    uint64_t header_offset;
+    // Offset in the (non-sparse) input stream
+    uint64_t cur_offset;
+
+    // Partially filled block
+    std::vector<unsigned char> block_buf;
+    size_t block_buf_used;
+
+    // Chunk currently being built
+    uint16_t chunk_type;
+    uint32_t chunk_blocks;
+    uint32_t chunk_fill_val;
+    std::vector<unsigned char> raw_buf;
+
+    uint32_t total_blocks;
+    uint32_t total_chunks;
+    uint32_t crc32;
+
+private:
+    SparseWriter *_pub_ptr;
+};
+
+/*! \endcond */
+
+}
+}
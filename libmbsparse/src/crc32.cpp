@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/crc32_p.h"
+
+#include <cstring>
+
+#include "mbcommon/endian.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+// PCLMUL (and SSE4.1) are selected at runtime via the target attribute
+#  if defined(__clang__) || __GNUC__ >= 5
+#    define HAVE_PCLMUL 1
+#  endif
+#elif defined(__GNUC__) && defined(__ARM_FEATURE_CRC32)
+#  include <arm_acle.h>
+#  define HAVE_ARM_CRC32 1
+#endif
+
+namespace mb
+{
+namespace sparse
+{
+
+/*! \cond INTERNAL */
+
+/*
+ * All of the implementations below operate on the raw CRC register (ie. the
+ * checksum with the initial and final inversion not applied).
+ *
+ * The fallback is the slicing-by-8 algorithm, which processes 8 bytes per
+ * iteration using 8 lookup tables. On x86, the data is folded 64 bytes at a
+ * time with carry-less multiplication (see Intel's "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" paper). Note that SSE4.2's
+ * crc32 instruction cannot be used because it computes CRC32C. On ARMv8, the
+ * CRC32 instructions compute the same polynomial that the sparse image format
+ * uses.
+ */
+
+// Standard 802.3 polynomial (reversed), as used by the sparse image format
+static constexpr uint32_t CRC32_POLY = 0xedb88320;
+
+typedef uint32_t (*Crc32Fn)(uint32_t crc, const unsigned char *p, size_t size);
+
+struct Crc32Tables
+{
+    uint32_t data[8][256];
+
+    Crc32Tables()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int j = 0; j < 8; ++j) {
+                c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+            }
+            data[0][i] = c;
+        }
+
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) {
+                uint32_t c = data[k - 1][i];
+                data[k][i] = (c >> 8) ^ data[0][c & 0xff];
+            }
+        }
+    }
+};
+
+static const Crc32Tables & crc32_tables()
+{
+    static const Crc32Tables tables;
+    return tables;
+}
+
+static uint32_t slice8_crc32(uint32_t crc, const unsigned char *p,
+                             size_t size)
+{
+    auto const &t = crc32_tables().data;
+
+    while (size >= 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+        lo = mb_le32toh(lo) ^ crc;
+        hi = mb_le32toh(hi);
+
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff]
+                ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+                ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff]
+                ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+
+        p += 8;
+        size -= 8;
+    }
+
+    while (size-- > 0) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef HAVE_PCLMUL
+
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t pclmul_crc32(uint32_t crc, const unsigned char *p,
+                             size_t size)
+{
+    // Folding constants for the bit-reflected polynomial
+    alignas(16) static const uint64_t k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+    alignas(16) static const uint64_t k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+    alignas(16) static const uint64_t k5k0[] = { 0x0163cd6124, 0x0000000000 };
+    // Polynomial and Barrett reduction constant (mu)
+    alignas(16) static const uint64_t poly[] = { 0x01db710641, 0x01f7011641 };
+
+    if (size < 64) {
+        return slice8_crc32(crc, p, size);
+    }
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x00));
+    x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x10));
+    x3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x20));
+    x4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k1k2));
+
+    p += 64;
+    size -= 64;
+
+    // Fold 4 blocks of 128 bits in parallel
+    while (size >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(p + 0x30)));
+
+        p += 64;
+        size -= 64;
+    }
+
+    // Fold the 4 blocks into 1
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(k3k4));
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Fold remaining 128-bit blocks
+    while (size >= 16) {
+        x2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        p += 16;
+        size -= 16;
+    }
+
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(k5k0));
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128(reinterpret_cast<const __m128i *>(poly));
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    crc = static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+
+    // Remaining bytes that don't fill a 128-bit block
+    return slice8_crc32(crc, p, size);
+}
+
+#endif
+
+#ifdef HAVE_ARM_CRC32
+
+static uint32_t arm_crc32(uint32_t crc, const unsigned char *p, size_t size)
+{
+    while (size > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+        crc = __crc32b(crc, *p++);
+        --size;
+    }
+
+    while (size >= 8) {
+        uint64_t value;
+        memcpy(&value, p, sizeof(value));
+        crc = __crc32d(crc, mb_le64toh(value));
+        p += 8;
+        size -= 8;
+    }
+
+    while (size-- > 0) {
+        crc = __crc32b(crc, *p++);
+    }
+
+    return crc;
+}
+
+#endif
+
+static Crc32Fn select_crc32()
+{
+#if defined(HAVE_PCLMUL)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        return &pclmul_crc32;
+    }
+#endif
+#if defined(HAVE_ARM_CRC32)
+    return &arm_crc32;
+#else
+    return &slice8_crc32;
+#endif
+}
+
+/*!
+ * \brief Update CRC32 checksum with more data
+ *
+ * On x86 CPUs with PCLMULQDQ and ARMv8 CPUs with the CRC32 extension, the
+ * checksum is computed with hardware instructions. Otherwise, a slicing-by-8
+ * table implementation is used.
+ *
+ * \param crc Current checksum (0 for the initial value)
+ * \param buf Data
+ * \param size Size of data
+ *
+ * \return New checksum
+ */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t size)
+{
+    static const Crc32Fn impl = select_crc32();
+
+    return ~impl(~crc, static_cast<const unsigned char *>(buf), size);
+}
+
+// Multiply a and b modulo the CRC polynomial (bit-reflected)
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = UINT32_C(1) << 31;
+    uint32_t p = 0;
+
+    while (true) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+// Compute x^(8 * n) modulo the CRC polynomial
+static uint32_t x8nmodp(uint64_t n)
+{
+    // x^(2^k) for k >= 3
+    uint32_t x2k = UINT32_C(1) << 30;
+    for (int i = 0; i < 3; ++i) {
+        x2k = multmodp(x2k, x2k);
+    }
+
+    // x^0
+    uint32_t p = UINT32_C(1) << 31;
+
+    while (n > 0) {
+        if (n & 1) {
+            p = multmodp(x2k, p);
+        }
+        n >>= 1;
+        x2k = multmodp(x2k, x2k);
+    }
+
+    return p;
+}
+
+/*!
+ * \brief Combine the checksums of two consecutive pieces of data
+ *
+ * \param crc1 Checksum of the first piece of data
+ * \param crc2 Checksum of the second piece of data
+ * \param size2 Size of the second piece of data
+ *
+ * \return Checksum of the concatenated data
+ */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t size2)
+{
+    return multmodp(x8nmodp(size2), crc1) ^ crc2;
+}
+
+/*!
+ * \brief Update CRC32 checksum with a repeating pattern
+ *
+ * This computes the same result as calling crc32_update() with \p pattern
+ * repeated \p count times, but only takes `O(log(count))` time. This allows
+ * sparse fill and "don't care" chunks to be checksummed without generating
+ * their data.
+ *
+ * \param crc Current checksum (0 for the initial value)
+ * \param pattern Pattern data
+ * \param size Size of pattern
+ * \param count Number of times the pattern repeats
+ *
+ * \return New checksum
+ */
+uint32_t crc32_update_repeat(uint32_t crc, const void *pattern, size_t size,
+                             uint64_t count)
+{
+    uint32_t unit_crc = crc32_update(0, pattern, size);
+    uint64_t unit_size = size;
+
+    while (count > 0) {
+        if (count & 1) {
+            crc = crc32_combine(crc, unit_crc, unit_size);
+        }
+        count >>= 1;
+        if (count > 0) {
+            unit_crc = crc32_combine(unit_crc, unit_crc, unit_size);
+            unit_size *= 2;
+        }
+    }
+
+    return crc;
+}
+
+/*! \endcond */
+
+}
+}
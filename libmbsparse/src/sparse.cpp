@@ -35,6 +35,7 @@
 #include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
 
+#include "mbsparse/crc32_p.h"
 #include "mbsparse/sparse_p.h"
 
 // Enable debug logging of headers, offsets, etc.?
@@ -84,6 +85,47 @@ static void fix_chunk_header_byte_order(ChunkHeader &header)
     header.total_sz = mb_le32toh(header.total_sz);
 }
 
+static void fix_index_header_byte_order(IndexHeader &header)
+{
+    header.magic = mb_le32toh(header.magic);
+    header.version = mb_le32toh(header.version);
+    header.blk_sz = mb_le32toh(header.blk_sz);
+    header.total_blks = mb_le32toh(header.total_blks);
+    header.total_chunks = mb_le32toh(header.total_chunks);
+    header.image_checksum = mb_le32toh(header.image_checksum);
+    header.file_hdr_sz = mb_le16toh(header.file_hdr_sz);
+    header.chunk_hdr_sz = mb_le16toh(header.chunk_hdr_sz);
+    header.reserved = mb_le32toh(header.reserved);
+}
+
+static IndexEntry chunk_info_to_index_entry(const ChunkInfo &info)
+{
+    IndexEntry entry = {};
+    entry.type = mb_htole16(info.type);
+    entry.fill_val = mb_htole32(info.fill_val);
+    entry.begin = mb_htole64(info.begin);
+    entry.end = mb_htole64(info.end);
+    entry.src_begin = mb_htole64(info.src_begin);
+    entry.src_end = mb_htole64(info.src_end);
+    entry.raw_begin = mb_htole64(info.raw_begin);
+    entry.raw_end = mb_htole64(info.raw_end);
+    return entry;
+}
+
+static ChunkInfo index_entry_to_chunk_info(const IndexEntry &entry)
+{
+    ChunkInfo info{};
+    info.type = mb_le16toh(entry.type);
+    info.fill_val = mb_le32toh(entry.fill_val);
+    info.begin = mb_le64toh(entry.begin);
+    info.end = mb_le64toh(entry.end);
+    info.src_begin = mb_le64toh(entry.src_begin);
+    info.src_end = mb_le64toh(entry.src_end);
+    info.raw_begin = mb_le64toh(entry.raw_begin);
+    info.raw_end = mb_le64toh(entry.raw_end);
+    return info;
+}
+
 #if SPARSE_DEBUG
 static void dump_sparse_header(const SparseHeader &header)
 {
@@ -141,8 +183,64 @@ struct OffsetComp
     }
 };
 
+/*!
+ * \brief Fill buffer with the contents of a fill chunk
+ *
+ * \param buf Buffer to fill
+ * \param size Number of bytes to fill
+ * \param chunk Fill chunk
+ * \param offset Output file offset corresponding to the start of \p buf
+ */
+static void fill_buffer(void *buf, size_t size, const ChunkInfo &chunk,
+                        uint64_t offset)
+{
+    static_assert(sizeof(chunk.fill_val) == sizeof(uint32_t),
+                  "Mismatched fill_val size");
+    auto shift = (offset - chunk.begin) % sizeof(uint32_t);
+    uint32_t fill_val = mb_htole32(chunk.fill_val);
+    unsigned char shifted[4];
+    for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+        shifted[i] = reinterpret_cast<unsigned char *>(&fill_val)
+                [(i + shift) % sizeof(uint32_t)];
+    }
+    unsigned char *temp_buf = reinterpret_cast<unsigned char *>(buf);
+    while (size > 0) {
+        size_t to_write = std::min<size_t>(sizeof(shifted), size);
+        memcpy(temp_buf, &shifted, to_write);
+        size -= to_write;
+        temp_buf += to_write;
+    }
+}
+
+static SparseChunk to_sparse_chunk(const ChunkInfo &info)
+{
+    SparseChunk chunk = {};
+    chunk.begin = info.begin;
+    chunk.end = info.end;
+    chunk.src_end = info.src_end;
+
+    switch (info.type) {
+    case CHUNK_TYPE_RAW:
+        chunk.type = SparseChunkType::Raw;
+        chunk.src_begin = info.raw_begin;
+        break;
+    case CHUNK_TYPE_FILL:
+        chunk.type = SparseChunkType::Fill;
+        chunk.src_begin = info.src_end - sizeof(uint32_t);
+        chunk.fill_val = info.fill_val;
+        break;
+    default:
+        chunk.type = SparseChunkType::DontCare;
+        chunk.src_begin = info.src_end;
+        break;
+    }
+
+    return chunk;
+}
+
 SparseFilePrivate::SparseFilePrivate(SparseFile *sf)
-    : _pub_ptr(sf)
+    : verify_crc32(false)
+    , _pub_ptr(sf)
 {
     clear();
 }
@@ -150,7 +248,10 @@ SparseFilePrivate::SparseFilePrivate(SparseFile *sf)
 void SparseFilePrivate::clear()
 {
     file = nullptr;
-    expected_crc32 = 0;
+    crc32_valid = true;
+    crc32_offset = 0;
+    crc32 = 0;
+    src_base_offset = 0;
     cur_src_offset = 0;
     cur_tgt_offset = 0;
     file_size = 0;
@@ -226,6 +327,7 @@ bool SparseFilePrivate::skip_bytes(uint64_t bytes)
             pub->set_fatal(true);
             return false;
         }
+        cur_src_offset += discarded;
         return true;
     }
 
@@ -366,6 +468,7 @@ bool SparseFilePrivate::process_raw_chunk(const ChunkHeader &chdr,
  *
  * This function will check the following properties:
  *   * Chunk data size is 4 bytes (`sizeof(uint32_t)`)
+ *   * Checksum matches the data read so far (if CRC32 verification is enabled)
  *
  * \param[in] chdr Chunk header
  * \param[in] tgt_offset Offset of the output file
@@ -449,6 +552,7 @@ bool SparseFilePrivate::process_skip_chunk(const ChunkHeader &chdr,
  *
  * This function will check the following properties:
  *   * Chunk data size is 4 bytes (`sizeof(uint32_t)`)
+ *   * Checksum matches the data read so far (if CRC32 verification is enabled)
  *
  * \param[in] chdr Chunk header
  * \param[in] tgt_offset Offset of the output file
@@ -461,7 +565,6 @@ bool SparseFilePrivate::process_crc32_chunk(const ChunkHeader &chdr,
                                             ChunkInfo &chunk_out)
 {
     MB_PUBLIC(SparseFile);
-    (void) tgt_offset;
 
     uint32_t data_size = chdr.total_sz - shdr.chunk_hdr_sz;
     uint64_t chunk_size = static_cast<uint64_t>(chdr.chunk_sz) * shdr.blk_sz;
@@ -480,19 +583,22 @@ bool SparseFilePrivate::process_crc32_chunk(const ChunkHeader &chdr,
         return false;
     }
 
+    uint64_t src_begin = cur_src_offset - shdr.chunk_hdr_sz;
+
     if (!wread(&crc32, sizeof(crc32))) {
         return false;
     }
 
-    expected_crc32 = mb_le32toh(crc32);
+    uint64_t src_end = cur_src_offset;
 
     chunk_out.type = chdr.chunk_type;
     chunk_out.begin = tgt_offset;
     chunk_out.end = tgt_offset;
-    chunk_out.src_begin = tgt_offset - shdr.chunk_hdr_sz;
-    chunk_out.src_end = tgt_offset + data_size;
+    chunk_out.src_begin = src_begin;
+    chunk_out.src_end = src_end;
+    chunk_out.fill_val = mb_le32toh(crc32);
 
-    return true;
+    return check_crc32(chunk_out);
 }
 
 /*!
@@ -686,6 +792,154 @@ bool SparseFilePrivate::move_to_chunk(uint64_t offset)
     return true;
 }
 
+/*!
+ * \brief Check that a saved index belongs to the opened sparse file
+ *
+ * \param ihdr Index header (in host byte order)
+ *
+ * \return Whether the index header matches the sparse header
+ */
+bool SparseFilePrivate::check_index_header(const IndexHeader &ihdr)
+{
+    MB_PUBLIC(SparseFile);
+
+    if (ihdr.magic != INDEX_HEADER_MAGIC) {
+        pub->set_error(make_error_code(FileError::BadFileFormat),
+                       "Expected index magic to be %08x, but got %08x",
+                       INDEX_HEADER_MAGIC, ihdr.magic);
+        return false;
+    }
+
+    if (ihdr.version != INDEX_VERSION) {
+        pub->set_error(make_error_code(FileError::BadFileFormat),
+                       "Unsupported index version: %" PRIu32, ihdr.version);
+        return false;
+    }
+
+    if (ihdr.blk_sz != shdr.blk_sz
+            || ihdr.total_blks != shdr.total_blks
+            || ihdr.total_chunks != shdr.total_chunks
+            || ihdr.image_checksum != shdr.image_checksum
+            || ihdr.file_hdr_sz != shdr.file_hdr_sz
+            || ihdr.chunk_hdr_sz != shdr.chunk_hdr_sz) {
+        pub->set_error(make_error_code(FileError::BadFileFormat),
+                       "Index does not match the sparse header");
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Check that a saved index entry describes a valid chunk
+ *
+ * The entry must have the same layout that move_to_chunk() would have computed
+ * from the chunk header: chunks are contiguous in both the source and output
+ * files and the sizes are consistent with the chunk type.
+ *
+ * \param info Chunk info from the index
+ * \param chunk_num Index of the chunk
+ * \param prev Previous chunk or nullptr if this is the first chunk
+ *
+ * \return Whether the entry is valid
+ */
+bool SparseFilePrivate::check_index_entry(const ChunkInfo &info,
+                                          size_t chunk_num,
+                                          const ChunkInfo *prev)
+{
+    MB_PUBLIC(SparseFile);
+
+    uint64_t expected_begin = prev ? prev->end : 0;
+    uint64_t expected_src_begin = prev ? prev->src_end : shdr.file_hdr_sz;
+    uint64_t expected_data_size = 0;
+    bool valid = true;
+
+    if (info.begin != expected_begin
+            || info.src_begin != expected_src_begin
+            || info.end < info.begin
+            || info.end > file_size
+            || (info.end - info.begin) % shdr.blk_sz != 0) {
+        valid = false;
+    }
+
+    switch (info.type) {
+    case CHUNK_TYPE_RAW:
+        expected_data_size = info.end - info.begin;
+        if (info.raw_begin != info.src_begin + shdr.chunk_hdr_sz
+                || info.raw_end != info.raw_begin + expected_data_size) {
+            valid = false;
+        }
+        break;
+    case CHUNK_TYPE_FILL:
+        expected_data_size = sizeof(uint32_t);
+        break;
+    case CHUNK_TYPE_DONT_CARE:
+        break;
+    case CHUNK_TYPE_CRC32:
+        expected_data_size = sizeof(uint32_t);
+        if (info.end != info.begin) {
+            valid = false;
+        }
+        break;
+    default:
+        valid = false;
+        break;
+    }
+
+    if (info.src_end != info.src_begin + shdr.chunk_hdr_sz
+            + expected_data_size) {
+        valid = false;
+    }
+
+    if (!valid) {
+        pub->set_error(make_error_code(FileError::BadFileFormat),
+                       "Index entry for chunk #%" MB_PRIzu " is invalid",
+                       chunk_num);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Check that the chunk header in the source file matches a chunk
+ *
+ * \param info Chunk info from the index
+ *
+ * \return Whether the chunk header matches
+ */
+bool SparseFilePrivate::verify_chunk_at(const ChunkInfo &info)
+{
+    MB_PUBLIC(SparseFile);
+
+    int64_t seek_offset;
+    if (info.src_begin < cur_src_offset) {
+        seek_offset = -static_cast<int64_t>(cur_src_offset - info.src_begin);
+    } else {
+        seek_offset = static_cast<int64_t>(info.src_begin - cur_src_offset);
+    }
+
+    ChunkHeader chdr;
+
+    if (!wseek(seek_offset) || !wread(&chdr, sizeof(chdr))) {
+        return false;
+    }
+
+    fix_chunk_header_byte_order(chdr);
+
+    if (chdr.chunk_type != info.type
+            || chdr.total_sz != info.src_end - info.src_begin
+            || static_cast<uint64_t>(chdr.chunk_sz) * shdr.blk_sz
+                    != info.end - info.begin) {
+        pub->set_error(make_error_code(FileError::BadFileFormat),
+                       "Index does not match chunk header at source offset %"
+                       PRIu64, info.src_begin);
+        return false;
+    }
+
+    return true;
+}
+
 /*! \endcond */
 
 /*!
@@ -770,6 +1024,429 @@ uint64_t SparseFile::size()
     return priv->file_size;
 }
 
+/*!
+ * \brief Add output data to the running CRC32 checksum
+ *
+ * Data before the checksummed range is ignored. If there is a gap between the
+ * checksummed range and \p offset, CRC32 verification is stopped.
+ *
+ * \param offset Offset of the data in the output file
+ * \param buf Data
+ * \param size Size of data
+ *
+ * \return False if a checksum mismatch is found. Otherwise, true.
+ */
+bool SparseFilePrivate::update_crc32(uint64_t offset, const void *buf,
+                                     size_t size)
+{
+    if (!verify_crc32 || !crc32_valid) {
+        return true;
+    } else if (offset > crc32_offset) {
+        DEBUG("Data at %" PRIu64 " skipped; disabling CRC32 verification",
+              crc32_offset);
+        crc32_valid = false;
+        return true;
+    } else if (offset + size <= crc32_offset) {
+        return true;
+    }
+
+    size_t skip = static_cast<size_t>(crc32_offset - offset);
+    crc32 = crc32_update(crc32, static_cast<const unsigned char *>(buf) + skip,
+                         size - skip);
+    crc32_offset += size - skip;
+
+    return check_crc32_at_offset();
+}
+
+/*!
+ * \brief Add output data up to an offset to the running CRC32 checksum
+ *
+ * The data for fill and "don't care" chunks is checksummed without being
+ * generated. If a raw chunk is in the range, CRC32 verification is stopped
+ * because its data would have to be read.
+ *
+ * \param offset Offset in the output file
+ *
+ * \return False if a checksum mismatch is found or if a file operation fails.
+ *         Otherwise, true.
+ */
+bool SparseFilePrivate::skip_crc32(uint64_t offset)
+{
+    while (verify_crc32 && crc32_valid && crc32_offset < offset) {
+        if (!move_to_chunk(crc32_offset)) {
+            return false;
+        } else if (chunk == chunks.end()) {
+            break;
+        } else if (chunk->type == CHUNK_TYPE_RAW) {
+            DEBUG("Raw data at %" PRIu64 " skipped; disabling CRC32"
+                  " verification", crc32_offset);
+            crc32_valid = false;
+            break;
+        }
+
+        // Pattern, rotated so that it starts at crc32_offset
+        uint32_t fill_val = chunk->type == CHUNK_TYPE_FILL
+                ? mb_htole32(chunk->fill_val) : 0;
+        auto const *fill_bytes = reinterpret_cast<unsigned char *>(&fill_val);
+        unsigned char pattern[sizeof(fill_val)];
+        size_t shift = (crc32_offset - chunk->begin) % sizeof(fill_val);
+        for (size_t i = 0; i < sizeof(fill_val); ++i) {
+            pattern[i] = fill_bytes[(shift + i) % sizeof(fill_val)];
+        }
+
+        uint64_t size = std::min(offset, chunk->end) - crc32_offset;
+        crc32 = crc32_update_repeat(crc32, pattern, sizeof(pattern),
+                                    size / sizeof(pattern));
+        crc32 = crc32_update(crc32, pattern, size % sizeof(pattern));
+        crc32_offset += size;
+
+        if (!check_crc32_at_offset()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compare running CRC32 checksum against a CRC32 chunk
+ *
+ * \param info CRC32 chunk
+ *
+ * \return False if the checksum does not match. True if it matches or if it
+ *         cannot be compared because not all of the data preceding the chunk
+ *         has been checksummed yet.
+ */
+bool SparseFilePrivate::check_crc32(const ChunkInfo &info)
+{
+    MB_PUBLIC(SparseFile);
+
+    if (!verify_crc32 || !crc32_valid || crc32_offset != info.begin) {
+        return true;
+    }
+
+    if (crc32 != info.fill_val) {
+        pub->set_error(make_error_code(FileError::BadFileFormat),
+                       "CRC32 checksum mismatch at offset %" PRIu64 ":"
+                       " expected 0x%08" PRIx32 ", but have 0x%08" PRIx32,
+                       info.begin, info.fill_val, crc32);
+        pub->set_fatal(true);
+        return false;
+    }
+
+    DEBUG("CRC32 checksum verified at offset %" PRIu64, info.begin);
+
+    return true;
+}
+
+/*!
+ * \brief Check CRC32 chunks and image checksum at the checksummed offset
+ *
+ * CRC32 chunks that have not been read yet are checked by
+ * process_crc32_chunk() instead.
+ *
+ * \return False if a checksum does not match. Otherwise, true.
+ */
+bool SparseFilePrivate::check_crc32_at_offset()
+{
+    MB_PUBLIC(SparseFile);
+
+    if (chunk != chunks.end() && crc32_offset == chunk->end) {
+        for (auto it = chunk + 1; it != chunks.end()
+                && it->begin == crc32_offset && it->end == crc32_offset; ++it) {
+            if (it->type == CHUNK_TYPE_CRC32 && !check_crc32(*it)) {
+                return false;
+            }
+        }
+    }
+
+    // A zero image checksum means that it was not computed
+    if (crc32_offset == file_size && shdr.image_checksum != 0
+            && crc32 != shdr.image_checksum) {
+        pub->set_error(make_error_code(FileError::BadFileFormat),
+                       "Image checksum mismatch: expected 0x%08" PRIx32 ","
+                       " but have 0x%08" PRIx32, shdr.image_checksum, crc32);
+        pub->set_fatal(true);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Enable or disable CRC32 verification
+ *
+ * When enabled, a running CRC32 checksum of all output data is kept and checked
+ * against CRC32 chunks and the image checksum (if it is non-zero) as they are
+ * reached. A mismatch causes read() or seek() to fail with
+ * FileError::BadFileFormat.
+ *
+ * Verification only covers data read with read() starting at offset 0. Fill
+ * and "don't care" chunks can be skipped with forward seeks without stopping
+ * verification, but skipping raw data, seeking backwards and then skipping
+ * ahead, or enabling verification after data has been read will silently stop
+ * further verification.
+ *
+ * \param enabled Whether to verify checksums
+ *
+ * \return Always true
+ */
+bool SparseFile::set_crc32_verification_enabled(bool enabled)
+{
+    MB_PRIVATE(SparseFile);
+
+    priv->verify_crc32 = enabled;
+    return true;
+}
+
+/*!
+ * \brief Read all chunk headers
+ *
+ * Chunk headers are normally processed lazily as the sparse file is read, so a
+ * seek to a far offset requires reading every chunk header before it. This
+ * function reads the remaining chunk headers immediately so that all further
+ * seeks and reads are a binary search through the chunk table. Calling this
+ * right after open() ensures that the cost of the index is never paid during a
+ * read.
+ *
+ * \note The underlying file must support random seeking.
+ *
+ * \return Whether all chunk headers were successfully read
+ */
+bool SparseFile::build_index()
+{
+    MB_PRIVATE(SparseFile);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "Sparse file is not open");
+        return false;
+    } else if (priv->seekability != Seekability::CAN_SEEK) {
+        set_error(make_error_code(FileError::UnsupportedSeek),
+                  "Underlying file does not support seeking");
+        return false;
+    }
+
+    // No chunk contains the end of the file, so this reads every chunk header
+    return priv->move_to_chunk(priv->file_size);
+}
+
+/*!
+ * \brief Get list of all chunks
+ *
+ * The chunk index is built with build_index() if it is not complete. CRC32
+ * chunks are not included in the list because they do not represent any data
+ * in the output file.
+ *
+ * \note The underlying file must support random seeking.
+ *
+ * \param[out] chunks Vector to store the list of chunks
+ *
+ * \return Whether the list of chunks was successfully retrieved
+ */
+bool SparseFile::chunks(std::vector<SparseChunk> &chunks)
+{
+    MB_PRIVATE(SparseFile);
+
+    if (!build_index()) {
+        return false;
+    }
+
+    chunks.clear();
+    chunks.reserve(priv->chunks.size());
+
+    for (auto const &info : priv->chunks) {
+        if (info.type != CHUNK_TYPE_CRC32) {
+            chunks.push_back(to_sparse_chunk(info));
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get the chunk containing the current file offset
+ *
+ * Unlike chunks(), this function works with underlying files that do not
+ * support seeking because it only reads chunk headers up to the current
+ * offset. This allows a sparse image to be processed chunk by chunk while
+ * streaming it by calling this function, handling the chunk, and then reading
+ * or seeking to SparseChunk::end.
+ *
+ * \param[out] chunk SparseChunk to store the chunk information
+ * \param[out] found Whether a chunk was found. This is set to false if the
+ *                   current offset is at or past the end of the sparse file.
+ *
+ * \return Whether the chunk lookup was successful
+ */
+bool SparseFile::current_chunk(SparseChunk &chunk, bool &found)
+{
+    MB_PRIVATE(SparseFile);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "Sparse file is not open");
+        return false;
+    }
+
+    if (!priv->move_to_chunk(priv->cur_tgt_offset)) {
+        return false;
+    }
+
+    found = priv->chunk != priv->chunks.end();
+    if (found) {
+        chunk = to_sparse_chunk(*priv->chunk);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Save chunk index to a file
+ *
+ * The chunk index is built with build_index() if it is not complete. The saved
+ * index can be loaded with load_index() to open the same sparse file later
+ * without reading any chunk headers.
+ *
+ * \param file File to write the index to
+ *
+ * \return Whether the index was successfully written
+ */
+bool SparseFile::save_index(File &file)
+{
+    MB_PRIVATE(SparseFile);
+
+    if (!build_index()) {
+        return false;
+    }
+
+    IndexHeader ihdr = {};
+    ihdr.magic = mb_htole32(INDEX_HEADER_MAGIC);
+    ihdr.version = mb_htole32(INDEX_VERSION);
+    ihdr.blk_sz = mb_htole32(priv->shdr.blk_sz);
+    ihdr.total_blks = mb_htole32(priv->shdr.total_blks);
+    ihdr.total_chunks = mb_htole32(priv->shdr.total_chunks);
+    ihdr.image_checksum = mb_htole32(priv->shdr.image_checksum);
+    ihdr.file_hdr_sz = mb_htole16(priv->shdr.file_hdr_sz);
+    ihdr.chunk_hdr_sz = mb_htole16(priv->shdr.chunk_hdr_sz);
+
+    size_t n;
+
+    if (!file_write_fully(file, &ihdr, sizeof(ihdr), n)
+            || n != sizeof(ihdr)) {
+        set_error(file.error(), "Failed to write index header: %s",
+                  file.error_string().c_str());
+        return false;
+    }
+
+    for (auto const &info : priv->chunks) {
+        IndexEntry entry = chunk_info_to_index_entry(info);
+
+        if (!file_write_fully(file, &entry, sizeof(entry), n)
+                || n != sizeof(entry)) {
+            set_error(file.error(), "Failed to write index entry: %s",
+                      file.error_string().c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Load chunk index from a file
+ *
+ * Replace the chunk table with one previously written by save_index(). The
+ * index must have been saved from the same sparse image. The index is checked
+ * against the sparse header and every entry is checked for consistency. The
+ * first and last chunk headers in the source file are also compared against
+ * the index. If any check fails, the existing chunk table is kept.
+ *
+ * \note The underlying file must support random seeking.
+ *
+ * \param file File to read the index from
+ *
+ * \return Whether the index was successfully loaded
+ */
+bool SparseFile::load_index(File &file)
+{
+    MB_PRIVATE(SparseFile);
+
+    if (!is_open()) {
+        set_error(make_error_code(FileError::InvalidState),
+                  "Sparse file is not open");
+        return false;
+    } else if (priv->seekability != Seekability::CAN_SEEK) {
+        set_error(make_error_code(FileError::UnsupportedSeek),
+                  "Underlying file does not support seeking");
+        return false;
+    }
+
+    IndexHeader ihdr;
+    size_t n;
+
+    if (!file_read_fully(file, &ihdr, sizeof(ihdr), n)) {
+        set_error(file.error(), "Failed to read index header: %s",
+                  file.error_string().c_str());
+        return false;
+    } else if (n != sizeof(ihdr)) {
+        set_error(make_error_code(FileError::BadFileFormat),
+                  "Index header is truncated");
+        return false;
+    }
+
+    fix_index_header_byte_order(ihdr);
+
+    if (!priv->check_index_header(ihdr)) {
+        return false;
+    }
+
+    std::vector<ChunkInfo> chunks;
+
+    for (size_t i = 0; i < ihdr.total_chunks; ++i) {
+        IndexEntry entry;
+
+        if (!file_read_fully(file, &entry, sizeof(entry), n)) {
+            set_error(file.error(), "Failed to read index entry: %s",
+                      file.error_string().c_str());
+            return false;
+        } else if (n != sizeof(entry)) {
+            set_error(make_error_code(FileError::BadFileFormat),
+                      "Index is truncated at chunk #%" MB_PRIzu, i);
+            return false;
+        }
+
+        ChunkInfo info = index_entry_to_chunk_info(entry);
+
+        if (!priv->check_index_entry(
+                info, i, chunks.empty() ? nullptr : &chunks.back())) {
+            return false;
+        }
+
+        chunks.push_back(info);
+    }
+
+    if (!chunks.empty()) {
+        if (chunks.back().end != priv->file_size) {
+            set_error(make_error_code(FileError::BadFileFormat),
+                      "Last chunk in index does not end (%" PRIu64 ") at"
+                      " position specified by sparse header (%" PRIu64 ")",
+                      chunks.back().end, priv->file_size);
+            return false;
+        }
+
+        if (!priv->verify_chunk_at(chunks.front())
+                || !priv->verify_chunk_at(chunks.back())) {
+            return false;
+        }
+    }
+
+    priv->chunks = std::move(chunks);
+    priv->chunk = priv->chunks.end();
+
+    return true;
+}
+
 /*!
  * \brief Open sparse file for reading
  *
@@ -819,7 +1496,7 @@ bool SparseFile::on_open()
 
     priv->seekability = Seekability::CAN_READ;
 
-    if (priv->file->seek(0, SEEK_CUR, nullptr)) {
+    if (priv->file->seek(0, SEEK_CUR, &priv->src_base_offset)) {
         DEBUG("File supports forward skipping");
         priv->seekability = Seekability::CAN_SKIP;
     } else if (priv->file->error() != FileError::Unsupported) {
@@ -934,7 +1611,13 @@ bool SparseFile::on_read(void *buf, size_t size, size_t &bytes_read)
             OPER("Raw data is %" PRIu64 " bytes into the raw chunk", diff);
 
             uint64_t raw_src_offset = priv->chunk->raw_begin + diff;
-            if (raw_src_offset != priv->cur_src_offset) {
+            if (raw_src_offset > priv->cur_src_offset
+                    && priv->seekability != Seekability::CAN_SEEK) {
+                // Forward seeks on non-seekable files only skip raw data
+                if (!priv->skip_bytes(raw_src_offset - priv->cur_src_offset)) {
+                    return false;
+                }
+            } else if (raw_src_offset != priv->cur_src_offset) {
                 assert(priv->seekability == Seekability::CAN_SEEK);
 
                 int64_t seek_offset;
@@ -957,27 +1640,10 @@ bool SparseFile::on_read(void *buf, size_t size, size_t &bytes_read)
             n_read = to_read;
             break;
         }
-        case CHUNK_TYPE_FILL: {
-            static_assert(sizeof(priv->chunk->fill_val) == sizeof(uint32_t),
-                          "Mismatched fill_val size");
-            auto shift = (priv->cur_tgt_offset - priv->chunk->begin)
-                    % sizeof(uint32_t);
-            uint32_t fill_val = mb_htole32(priv->chunk->fill_val);
-            unsigned char shifted[4];
-            for (size_t i = 0; i < sizeof(uint32_t); ++i) {
-                shifted[i] = reinterpret_cast<unsigned char *>(&fill_val)
-                        [(i + shift) % sizeof(uint32_t)];
-            }
-            unsigned char *temp_buf = reinterpret_cast<unsigned char *>(buf);
-            while (to_read > 0) {
-                size_t to_write = std::min<size_t>(sizeof(shifted), to_read);
-                memcpy(temp_buf, &shifted, to_write);
-                n_read += to_write;
-                to_read -= to_write;
-                temp_buf += to_write;
-            }
+        case CHUNK_TYPE_FILL:
+            fill_buffer(buf, to_read, *priv->chunk, priv->cur_tgt_offset);
+            n_read = to_read;
             break;
-        }
         case CHUNK_TYPE_DONT_CARE:
             memset(buf, 0, to_read);
             n_read = to_read;
@@ -987,6 +1653,11 @@ bool SparseFile::on_read(void *buf, size_t size, size_t &bytes_read)
         }
 
         OPER("Read %" PRIu64 " bytes", n_read);
+
+        if (!priv->update_crc32(priv->cur_tgt_offset, buf, n_read)) {
+            return false;
+        }
+
         total_read += n_read;
         priv->cur_tgt_offset += n_read;
         size -= n_read;
@@ -1003,7 +1674,10 @@ bool SparseFile::on_read(void *buf, size_t size, size_t &bytes_read)
  * \p whence takes the same \a SEEK_SET, \a SEEK_CUR, and \a SEEK_END values as
  * \a lseek() in `\<stdio.h\>`.
  *
- * \note Seeking will only work if the underlying file handle supports seeking.
+ * \note Seeking backwards will only work if the underlying file handle supports
+ *       seeking. If it does not, forward seeks are still allowed and the skipped
+ *       raw data is discarded from the underlying file. The data in fill and
+ *       "don't care" chunks is never read, so skipping over them is cheap.
  *
  * \param[in] offset Offset to seek
  * \param[in] whence \a SEEK_SET, \a SEEK_CUR, or \a SEEK_END
@@ -1017,12 +1691,6 @@ bool SparseFile::on_seek(int64_t offset, int whence, uint64_t &new_offset_out)
 
     OPER("seek(%" PRId64 ", %d)", offset, whence);
 
-    if (priv->seekability != Seekability::CAN_SEEK) {
-        set_error(make_error_code(FileError::UnsupportedSeek),
-                  "Underlying file does not support seeking");
-        return false;
-    }
-
     uint64_t new_offset;
     switch (whence) {
     case SEEK_SET:
@@ -1057,6 +1725,17 @@ bool SparseFile::on_seek(int64_t offset, int whence, uint64_t &new_offset_out)
         return false;
     }
 
+    if (priv->seekability != Seekability::CAN_SEEK
+            && new_offset < priv->cur_tgt_offset) {
+        set_error(make_error_code(FileError::UnsupportedSeek),
+                  "Underlying file does not support seeking backwards");
+        return false;
+    }
+
+    if (new_offset > priv->cur_tgt_offset && !priv->skip_crc32(new_offset)) {
+        return false;
+    }
+
     if (!priv->move_to_chunk(new_offset)) {
         return false;
     }
@@ -1069,5 +1748,105 @@ bool SparseFile::on_seek(int64_t offset, int whence, uint64_t &new_offset_out)
     return true;
 }
 
+/*!
+ * \brief Read sparse file at a specific offset
+ *
+ * Unlike read(), this does not use or change the file position or any other
+ * state of the sparse file apart from building the chunk index on first use.
+ * Data for raw chunks is read with File::read_at() on the underlying file and
+ * data for fill and don't care chunks is generated without accessing the
+ * underlying file.
+ *
+ * Once the chunk index is complete (see build_index() and load_index()),
+ * multiple threads may call read_at() concurrently, provided that read_at() on
+ * the underlying file is also safe to call concurrently (eg. FdFile).
+ *
+ * \note Reading at an offset will only work if the underlying file handle
+ *       supports seeking.
+ *
+ * \param offset Output file offset to read from
+ * \param buf Buffer to read data into
+ * \param size Number of bytes to read
+ * \param bytes_read Number of bytes that were read
+ *
+ * \return Whether some bytes were read or EOF was reached
+ */
+bool SparseFile::on_read_at(uint64_t offset, void *buf, size_t size,
+                            size_t &bytes_read)
+{
+    MB_PRIVATE(SparseFile);
+
+    OPER("read_at(%" PRIu64 ", buf, %" MB_PRIzu ", *bytesRead)", offset, size);
+
+    if (priv->seekability != Seekability::CAN_SEEK) {
+        set_error(make_error_code(FileError::UnsupportedSeek),
+                  "Underlying file does not support seeking");
+        return false;
+    }
+
+    if (priv->chunks.size() != priv->shdr.total_chunks && !build_index()) {
+        return false;
+    }
+
+    auto const &chunks = priv->chunks;
+    size_t total_read = 0;
+
+    while (size > 0) {
+        auto chunk = binary_find(chunks.begin(), chunks.end(), offset,
+                                 OffsetComp());
+        if (chunk == chunks.end()) {
+            OPER("Reached EOF");
+            break;
+        }
+
+        size_t to_read = std::min<uint64_t>(size, chunk->end - offset);
+
+        switch (chunk->type) {
+        case CHUNK_TYPE_RAW: {
+            uint64_t src_offset = priv->src_base_offset + chunk->raw_begin
+                    + (offset - chunk->begin);
+            auto *ptr = static_cast<unsigned char *>(buf);
+            size_t remaining = to_read;
+
+            while (remaining > 0) {
+                size_t n;
+
+                if (!priv->file->read_at(src_offset, ptr, remaining, n)) {
+                    set_error(priv->file->error(), "Failed to read file: %s",
+                              priv->file->error_string().c_str());
+                    return false;
+                } else if (n == 0) {
+                    set_error(make_error_code(FileError::BadFileFormat),
+                              "Reached EOF in raw chunk at source offset %"
+                              PRIu64, src_offset);
+                    return false;
+                }
+
+                src_offset += n;
+                ptr += n;
+                remaining -= n;
+            }
+            break;
+        }
+        case CHUNK_TYPE_FILL:
+            fill_buffer(buf, to_read, *chunk, offset);
+            break;
+        case CHUNK_TYPE_DONT_CARE:
+            memset(buf, 0, to_read);
+            break;
+        default:
+            assert(false);
+        }
+
+        total_read += to_read;
+        offset += to_read;
+        size -= to_read;
+        buf = static_cast<unsigned char *>(buf) + to_read;
+    }
+
+    bytes_read = total_read;
+    return true;
+}
+
 }
 }
@@ -0,0 +1,628 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/sparse_writer.h"
+
+#include <algorithm>
+
+#include <cinttypes>
+#include <cstring>
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file_util.h"
+#include "mbcommon/string.h"
+
+#include "mbsparse/crc32_p.h"
+#include "mbsparse/sparse_writer_p.h"
+
+/*!
+ * \file mbsparse/sparse_writer.h
+ * \brief Android sparse image writer
+ */
+
+// Chunk type for when no chunk is being built
+#define CHUNK_TYPE_NONE                 0
+// Maximum size of buffered raw data before a raw chunk is written out
+#define MAX_RAW_CHUNK_SIZE              (4 * 1024 * 1024)
+
+namespace mb
+{
+namespace sparse
+{
+
+/*! \cond INTERNAL */
+
+/*!
+ * \brief Check if a block consists of a repeating 32-bit value
+ *
+ * A block is a repeating 32-bit value if and only if every byte equals the
+ * byte 4 positions after it, which is a single memcmp() of the block against
+ * itself. libc's memcmp() is vectorized on all the platforms we care about, so
+ * this is much faster than comparing 32-bit words in a loop.
+ */
+static bool is_fill_block(const unsigned char *data, uint32_t block_size,
+                          uint32_t &fill_val)
+{
+    if (memcmp(data, data + sizeof(fill_val),
+               block_size - sizeof(fill_val)) != 0) {
+        return false;
+    }
+
+    // Stored as-is since the fill value is a byte pattern
+    memcpy(&fill_val, data, sizeof(fill_val));
+    return true;
+}
+
+SparseWriterPrivate::SparseWriterPrivate(SparseWriter *sw)
+    : _pub_ptr(sw)
+{
+    clear();
+}
+
+void SparseWriterPrivate::clear()
+{
+    file = nullptr;
+    block_size = 0;
+    crc32_enabled = false;
+    header_offset = 0;
+    cur_offset = 0;
+    block_buf.clear();
+    block_buf.shrink_to_fit();
+    block_buf_used = 0;
+    chunk_type = CHUNK_TYPE_NONE;
+    chunk_blocks = 0;
+    chunk_fill_val = 0;
+    raw_buf.clear();
+    raw_buf.shrink_to_fit();
+    total_blocks = 0;
+    total_chunks = 0;
+    crc32 = 0;
+}
+
+bool SparseWriterPrivate::wwrite(const void *buf, size_t size)
+{
+    MB_PUBLIC(SparseWriter);
+    size_t bytes_written;
+
+    if (!file_write_fully(*file, buf, size, bytes_written)) {
+        pub->set_error(file->error(), "Failed to write file: %s",
+                       file->error_string().c_str());
+        pub->set_fatal(true);
+        return false;
+    }
+
+    if (bytes_written != size) {
+        pub->set_error(file->error(), "Requested %" MB_PRIzu
+                       " bytes, but only wrote %" MB_PRIzu " bytes",
+                       size, bytes_written);
+        pub->set_fatal(true);
+        return false;
+    }
+
+    return true;
+}
+
+bool SparseWriterPrivate::write_sparse_header()
+{
+    SparseHeader shdr = {};
+    shdr.magic = mb_htole32(SPARSE_HEADER_MAGIC);
+    shdr.major_version = mb_htole16(SPARSE_HEADER_MAJOR_VER);
+    shdr.minor_version = mb_htole16(0);
+    shdr.file_hdr_sz = mb_htole16(sizeof(SparseHeader));
+    shdr.chunk_hdr_sz = mb_htole16(sizeof(ChunkHeader));
+    shdr.blk_sz = mb_htole32(block_size);
+    shdr.total_blks = mb_htole32(total_blocks);
+    shdr.total_chunks = mb_htole32(total_chunks);
+    shdr.image_checksum = mb_htole32(crc32_enabled ? crc32 : 0);
+
+    return wwrite(&shdr, sizeof(shdr));
+}
+
+bool SparseWriterPrivate::write_chunk_header(uint16_t type, uint32_t blocks,
+                                             uint32_t data_size)
+{
+    ChunkHeader chdr = {};
+    chdr.chunk_type = mb_htole16(type);
+    chdr.chunk_sz = mb_htole32(blocks);
+    chdr.total_sz = mb_htole32(sizeof(ChunkHeader) + data_size);
+
+    if (!wwrite(&chdr, sizeof(chdr))) {
+        return false;
+    }
+
+    ++total_chunks;
+    return true;
+}
+
+/*!
+ * \brief Write out the chunk currently being built
+ *
+ * \return Whether the chunk was successfully written
+ */
+bool SparseWriterPrivate::flush_chunk()
+{
+    switch (chunk_type) {
+    case CHUNK_TYPE_NONE:
+        return true;
+    case CHUNK_TYPE_RAW:
+        if (!write_chunk_header(CHUNK_TYPE_RAW, chunk_blocks,
+                                static_cast<uint32_t>(raw_buf.size()))
+                || !wwrite(raw_buf.data(), raw_buf.size())) {
+            return false;
+        }
+        raw_buf.clear();
+        break;
+    case CHUNK_TYPE_FILL:
+        if (!write_chunk_header(CHUNK_TYPE_FILL, chunk_blocks,
+                                sizeof(chunk_fill_val))
+                || !wwrite(&chunk_fill_val, sizeof(chunk_fill_val))) {
+            return false;
+        }
+        break;
+    case CHUNK_TYPE_DONT_CARE:
+        if (!write_chunk_header(CHUNK_TYPE_DONT_CARE, chunk_blocks, 0)) {
+            return false;
+        }
+        break;
+    }
+
+    chunk_type = CHUNK_TYPE_NONE;
+    chunk_blocks = 0;
+    return true;
+}
+
+/*!
+ * \brief Add a complete block of data
+ *
+ * Blocks consisting of a repeating 32-bit value are coalesced into fill chunks
+ * and all other blocks are coalesced into raw chunks.
+ *
+ * \param data Block data (\a block_size bytes)
+ *
+ * \return Whether the block was successfully added
+ */
+bool SparseWriterPrivate::add_block(const unsigned char *data)
+{
+    MB_PUBLIC(SparseWriter);
+
+    if (total_blocks == UINT32_MAX) {
+        pub->set_error(make_error_code(FileError::IntegerOverflow),
+                       "Too many blocks for sparse image");
+        return false;
+    }
+
+    if (crc32_enabled) {
+        crc32 = crc32_update(crc32, data, block_size);
+    }
+
+    uint32_t fill_val;
+
+    if (is_fill_block(data, block_size, fill_val)) {
+        if (chunk_type != CHUNK_TYPE_FILL || fill_val != chunk_fill_val) {
+            if (!flush_chunk()) {
+                return false;
+            }
+            chunk_type = CHUNK_TYPE_FILL;
+            chunk_fill_val = fill_val;
+        }
+    } else {
+        if (chunk_type != CHUNK_TYPE_RAW) {
+            if (!flush_chunk()) {
+                return false;
+            }
+            chunk_type = CHUNK_TYPE_RAW;
+        }
+        raw_buf.insert(raw_buf.end(), data, data + block_size);
+    }
+
+    ++chunk_blocks;
+    ++total_blocks;
+
+    // Bound the amount of buffered raw data and keep the fill chunk size
+    // representable
+    if ((chunk_type == CHUNK_TYPE_RAW
+            && raw_buf.size() + block_size > MAX_RAW_CHUNK_SIZE)
+            || chunk_blocks == UINT32_MAX) {
+        return flush_chunk();
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add blocks that will not be written to the output image
+ *
+ * \param blocks Number of blocks
+ *
+ * \return Whether the blocks were successfully added
+ */
+bool SparseWriterPrivate::add_dont_care_blocks(uint64_t blocks)
+{
+    MB_PUBLIC(SparseWriter);
+
+    if (blocks > UINT32_MAX - total_blocks) {
+        pub->set_error(make_error_code(FileError::IntegerOverflow),
+                       "Too many blocks for sparse image");
+        return false;
+    }
+
+    if (crc32_enabled) {
+        // Don't care blocks count as zeros for the image checksum. The block
+        // size is a multiple of 4, so the whole run is a repeated zero word.
+        const unsigned char zeros[sizeof(uint32_t)] = {};
+        crc32 = crc32_update_repeat(crc32, zeros, sizeof(zeros),
+                                    blocks * (block_size / sizeof(zeros)));
+    }
+
+    while (blocks > 0) {
+        if (chunk_type != CHUNK_TYPE_DONT_CARE) {
+            if (!flush_chunk()) {
+                return false;
+            }
+            chunk_type = CHUNK_TYPE_DONT_CARE;
+        }
+
+        auto n = static_cast<uint32_t>(std::min<uint64_t>(
+                blocks, UINT32_MAX - chunk_blocks));
+        chunk_blocks += n;
+        total_blocks += n;
+        blocks -= n;
+
+        if (chunk_blocks == UINT32_MAX && !flush_chunk()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add zeros to the partially filled block
+ *
+ * \param size Number of zero bytes (must not exceed the free space in the block
+ *             buffer)
+ *
+ * \return Whether the zeros were successfully added
+ */
+bool SparseWriterPrivate::add_zeros(uint64_t size)
+{
+    memset(block_buf.data() + block_buf_used, 0, size);
+    block_buf_used += size;
+    cur_offset += size;
+
+    if (block_buf_used == block_size) {
+        block_buf_used = 0;
+        return add_block(block_buf.data());
+    }
+
+    return true;
+}
+
+/*! \endcond */
+
+/*!
+ * \class SparseWriter
+ *
+ * \brief Write Android sparse file image.
+ *
+ * Data written to this handle is split into blocks. Blocks consisting of a
+ * repeating 32-bit value (including all zeros) are stored as fill chunks and
+ * consecutive runs of other blocks are stored as raw chunks. Seeking forward
+ * leaves a hole that is stored as a don't care chunk.
+ *
+ * If the data size is not a multiple of the block size, the last block is
+ * padded with zeros when the handle is closed.
+ */
+
+/*!
+ * \brief Construct unbound SparseWriter.
+ *
+ * The File handle will not be bound to any file. One of the open functions will
+ * need to be called to open a file.
+ */
+SparseWriter::SparseWriter()
+    : SparseWriter(new SparseWriterPrivate(this))
+{
+}
+
+/*!
+ * \brief Open sparse writer for a File handle.
+ *
+ * Construct the file handle and open the file. Use is_open() to check if the
+ * file was successfully opened.
+ *
+ * \sa open(File *, uint32_t, bool)
+ *
+ * \param file File to write the sparse image to
+ * \param block_size Block size of the sparse image
+ * \param crc32 Whether to write a CRC32 chunk and image checksum
+ */
+SparseWriter::SparseWriter(File *file, uint32_t block_size, bool crc32)
+    : SparseWriter(new SparseWriterPrivate(this), file, block_size, crc32)
+{
+}
+
+/*! \cond INTERNAL */
+SparseWriter::SparseWriter(SparseWriterPrivate *priv)
+    : _priv_ptr(priv)
+{
+}
+
+SparseWriter::SparseWriter(SparseWriterPrivate *priv, File *file,
+                           uint32_t block_size, bool crc32)
+    : _priv_ptr(priv)
+{
+    open(file, block_size, crc32);
+}
+/*! \endcond */
+
+SparseWriter::~SparseWriter()
+{
+    close();
+}
+
+/*!
+ * \brief Open sparse writer for a File handle.
+ *
+ * \note The SparseWriter will *not* take ownership of \p file. The caller must
+ *       ensure that it is properly closed and destroyed when it is no longer
+ *       needed.
+ *
+ * \param file File to write the sparse image to. The file must support
+ *             seeking so that the sparse header can be updated when the
+ *             SparseWriter is closed.
+ * \param block_size Block size of the sparse image. Must be a non-zero
+ *                   multiple of 4 (usually 4096).
+ * \param crc32 Whether to write a CRC32 chunk and image checksum
+ *
+ * \return Whether the file is successfully opened
+ */
+bool SparseWriter::open(File *file, uint32_t block_size, bool crc32)
+{
+    MB_PRIVATE(SparseWriter);
+    if (priv) {
+        priv->file = file;
+        priv->block_size = block_size;
+        priv->crc32_enabled = crc32;
+    }
+    return File::open();
+}
+
+bool SparseWriter::on_open()
+{
+    MB_PRIVATE(SparseWriter);
+
+    if (!priv->file->is_open()) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Underlying file is not open");
+        return false;
+    }
+
+    if (priv->block_size == 0 || priv->block_size % sizeof(uint32_t) != 0) {
+        set_error(make_error_code(FileError::InvalidArgument),
+                  "Block size (%" PRIu32 ") is not a multiple of 4",
+                  priv->block_size);
+        return false;
+    }
+
+    if (!priv->file->seek(0, SEEK_CUR, &priv->header_offset)) {
+        set_error(priv->file->error(), "Failed to get file position: %s",
+                  priv->file->error_string().c_str());
+        return false;
+    }
+
+    priv->block_buf.resize(priv->block_size);
+
+    // Reserve space for the header. It is rewritten with the final values when
+    // the file is closed.
+    return priv->write_sparse_header();
+}
+
+/*!
+ * \brief Finish writing the sparse image
+ *
+ * The last partial block is padded with zeros, the last chunk is written out,
+ * the CRC32 chunk is written (if enabled), and the sparse header is updated.
+ * The file position of the underlying file is left at the end of the sparse
+ * image.
+ *
+ * \return Whether the sparse image was successfully written
+ */
+bool SparseWriter::on_close()
+{
+    MB_PRIVATE(SparseWriter);
+
+    bool ret = !is_fatal();
+
+    if (ret && priv->block_buf_used > 0) {
+        ret = priv->add_zeros(priv->block_size - priv->block_buf_used);
+    }
+
+    if (ret) {
+        ret = priv->flush_chunk();
+    }
+
+    if (ret && priv->crc32_enabled) {
+        uint32_t crc32 = mb_htole32(priv->crc32);
+        ret = priv->write_chunk_header(CHUNK_TYPE_CRC32, 0, sizeof(crc32))
+                && priv->wwrite(&crc32, sizeof(crc32));
+    }
+
+    if (ret) {
+        uint64_t end_offset;
+
+        if (!priv->file->seek(0, SEEK_CUR, &end_offset)
+                || !priv->file->seek(static_cast<int64_t>(priv->header_offset),
+                                     SEEK_SET, nullptr)) {
+            set_error(priv->file->error(), "Failed to seek file: %s",
+                      priv->file->error_string().c_str());
+            ret = false;
+        } else if (!priv->write_sparse_header()) {
+            ret = false;
+        } else if (!priv->file->seek(static_cast<int64_t>(end_offset),
+                                     SEEK_SET, nullptr)) {
+            set_error(priv->file->error(), "Failed to seek file: %s",
+                      priv->file->error_string().c_str());
+            ret = false;
+        }
+    }
+
+    // Reset to allow opening another file
+    priv->clear();
+
+    return ret;
+}
+
+/*!
+ * \brief Write data to the sparse image
+ *
+ * \param buf Buffer to write from
+ * \param size Buffer size
+ * \param bytes_written Output number of bytes that were written. This is always
+ *                      \p size if the function succeeds.
+ *
+ * \return Whether the data was successfully written
+ */
+bool SparseWriter::on_write(const void *buf, size_t size,
+                            size_t &bytes_written)
+{
+    MB_PRIVATE(SparseWriter);
+
+    auto const *ptr = static_cast<const unsigned char *>(buf);
+    size_t remaining = size;
+
+    while (remaining > 0) {
+        if (priv->block_buf_used == 0 && remaining >= priv->block_size) {
+            // Avoid copying complete blocks into the block buffer
+            if (!priv->add_block(ptr)) {
+                return false;
+            }
+
+            ptr += priv->block_size;
+            remaining -= priv->block_size;
+            priv->cur_offset += priv->block_size;
+            continue;
+        }
+
+        size_t n = std::min<size_t>(
+                remaining, priv->block_size - priv->block_buf_used);
+        memcpy(priv->block_buf.data() + priv->block_buf_used, ptr, n);
+        priv->block_buf_used += n;
+        priv->cur_offset += n;
+        ptr += n;
+        remaining -= n;
+
+        if (priv->block_buf_used == priv->block_size) {
+            priv->block_buf_used = 0;
+            if (!priv->add_block(priv->block_buf.data())) {
+                return false;
+            }
+        }
+    }
+
+    bytes_written = size;
+    return true;
+}
+
+/*!
+ * \brief Seek sparse writer
+ *
+ * Only seeking forward (or querying the current position) is supported. Bytes
+ * that are skipped over within a block are written as zeros and complete
+ * blocks that are skipped over are stored as a don't care chunk.
+ *
+ * \param[in] offset Offset to seek
+ * \param[in] whence \a SEEK_SET or \a SEEK_CUR
+ * \param[out] new_offset Output new offset in the (non-sparse) image
+ *
+ * \return Whether the seeking was successful
+ */
+bool SparseWriter::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    MB_PRIVATE(SparseWriter);
+
+    uint64_t target;
+
+    switch (whence) {
+    case SEEK_SET:
+        if (offset < 0) {
+            set_error(make_error_code(FileError::InvalidArgument),
+                      "Cannot seek to negative offset");
+            return false;
+        }
+        target = static_cast<uint64_t>(offset);
+        break;
+    case SEEK_CUR:
+        if (offset < 0) {
+            set_error(make_error_code(FileError::UnsupportedSeek),
+                      "Cannot seek backwards in sparse writer");
+            return false;
+        } else if (static_cast<uint64_t>(offset) > UINT64_MAX
+                - priv->cur_offset) {
+            set_error(make_error_code(FileError::IntegerOverflow),
+                      "Offset overflows uint64_t");
+            return false;
+        }
+        target = priv->cur_offset + static_cast<uint64_t>(offset);
+        break;
+    default:
+        set_error(make_error_code(FileError::UnsupportedSeek),
+                  "Cannot seek relative to end of sparse writer");
+        return false;
+    }
+
+    if (target < priv->cur_offset) {
+        set_error(make_error_code(FileError::UnsupportedSeek),
+                  "Cannot seek backwards in sparse writer");
+        return false;
+    }
+
+    uint64_t remaining = target - priv->cur_offset;
+
+    // Finish the partial block with zeros
+    if (remaining > 0 && priv->block_buf_used > 0) {
+        uint64_t n = std::min<uint64_t>(
+                remaining, priv->block_size - priv->block_buf_used);
+        if (!priv->add_zeros(n)) {
+            return false;
+        }
+        remaining -= n;
+    }
+
+    // Skip whole blocks
+    if (remaining >= priv->block_size) {
+        uint64_t blocks = remaining / priv->block_size;
+        if (!priv->add_dont_care_blocks(blocks)) {
+            return false;
+        }
+        priv->cur_offset += blocks * priv->block_size;
+        remaining %= priv->block_size;
+    }
+
+    // Start of the new partial block
+    if (remaining > 0 && !priv->add_zeros(remaining)) {
+        return false;
+    }
+
+    new_offset = priv->cur_offset;
+    return true;
+}
+
+}
+}
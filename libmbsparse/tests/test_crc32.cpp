@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include "mbsparse/crc32_p.h"
+
+TEST(Crc32Test, CheckKnownValue)
+{
+    ASSERT_EQ(mb::sparse::crc32_update(0, "123456789", 9), 0xcbf43926u);
+    ASSERT_EQ(mb::sparse::crc32_update(0, "", 0), 0u);
+}
+
+TEST(Crc32Test, IncrementalUpdateMatchesSinglePass)
+{
+    unsigned char data[1000];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = static_cast<unsigned char>(i * 31);
+    }
+
+    uint32_t expected = mb::sparse::crc32_update(0, data, sizeof(data));
+
+    for (size_t split = 0; split <= sizeof(data); split += 7) {
+        uint32_t crc = mb::sparse::crc32_update(0, data, split);
+        crc = mb::sparse::crc32_update(crc, data + split, sizeof(data) - split);
+        ASSERT_EQ(crc, expected) << "split=" << split;
+    }
+}
+
+static uint32_t reference_crc32(const unsigned char *p, size_t size)
+{
+    uint32_t crc = ~UINT32_C(0);
+    while (size-- > 0) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; ++i) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+TEST(Crc32Test, CheckAllSizesAndAlignments)
+{
+    unsigned char data[600];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = static_cast<unsigned char>((i * 7919) >> 3);
+    }
+
+    // Covers the table lookup tail and the vectorized folding on their own and
+    // combined
+    for (size_t offset = 0; offset < 16; ++offset) {
+        for (size_t size = 0; size <= sizeof(data) - offset; size += 13) {
+            ASSERT_EQ(mb::sparse::crc32_update(0, data + offset, size),
+                      reference_crc32(data + offset, size))
+                    << "offset=" << offset << ", size=" << size;
+        }
+    }
+}
+
+TEST(Crc32Test, CombineMatchesSinglePass)
+{
+    unsigned char data[1000];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = static_cast<unsigned char>(i * 13);
+    }
+
+    uint32_t expected = mb::sparse::crc32_update(0, data, sizeof(data));
+
+    for (size_t split = 0; split <= sizeof(data); split += 111) {
+        uint32_t crc1 = mb::sparse::crc32_update(0, data, split);
+        uint32_t crc2 = mb::sparse::crc32_update(
+                0, data + split, sizeof(data) - split);
+        ASSERT_EQ(mb::sparse::crc32_combine(crc1, crc2, sizeof(data) - split),
+                  expected) << "split=" << split;
+    }
+}
+
+TEST(Crc32Test, RepeatMatchesSinglePass)
+{
+    const unsigned char pattern[] = { 0x78, 0x56, 0x34, 0x12 };
+    unsigned char data[4 * 1000];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = pattern[i % sizeof(pattern)];
+    }
+
+    for (uint64_t count : { 0, 1, 2, 3, 7, 64, 999, 1000 }) {
+        uint32_t crc = mb::sparse::crc32_update(0, "abc", 3);
+        ASSERT_EQ(mb::sparse::crc32_update_repeat(
+                          crc, pattern, sizeof(pattern), count),
+                  mb::sparse::crc32_update(crc, data, count * sizeof(pattern)))
+                << "count=" << count;
+    }
+}
@@ -19,11 +19,14 @@
 
 #include <gtest/gtest.h>
 
+#include <vector>
+
 #include "mbsparse/sparse.h"
 
 #include "mbcommon/endian.h"
 #include "mbcommon/file/memory.h"
 
+#include "mbsparse/crc32_p.h"
 #include "mbsparse/sparse_p.h"
 
 class CustomMemoryFile : public mb::MemoryFile
@@ -86,7 +89,7 @@ struct SparseTest : testing::Test
         ASSERT_TRUE(_source_file.open(&_data, &_size));
     }
 
-    void build_valid_data()
+    void build_valid_data(uint32_t crc32 = 0)
     {
         size_t n;
 
@@ -145,7 +148,9 @@ struct SparseTest : testing::Test
         fix_chunk_header_byte_order(chdr);
 
         ASSERT_TRUE(_source_file.write(&chdr, sizeof(chdr), n));
-        ASSERT_TRUE(_source_file.write("\x00\x00\x00\x00", 4, n));
+
+        crc32 = mb_htole32(crc32);
+        ASSERT_TRUE(_source_file.write(&crc32, sizeof(crc32), n));
 
         // Move back to beginning of the file
         ASSERT_TRUE(_source_file.seek(0, SEEK_SET, nullptr));
@@ -728,3 +733,396 @@ TEST_F(SparseTest, ReadValidDataWithUnseekableFile)
 
     ASSERT_TRUE(_file.close());
 }
+
+TEST_F(SparseTest, ForwardSeekWithUnseekableFile)
+{
+    char buf[1024];
+    size_t n;
+    build_valid_data();
+
+    _source_file.set_seekability(mb::sparse::Seekability::CAN_READ);
+    ASSERT_TRUE(_file.open(&_source_file));
+
+    // Check that seeking into the middle of a raw chunk skips the raw data
+    ASSERT_TRUE(_file.seek(4, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.read(buf, 4, n));
+    ASSERT_EQ(n, 4u);
+    ASSERT_EQ(memcmp(buf, expected_valid_data + 4, 4), 0);
+
+    // Check that seeking past the rest of the raw chunk works
+    ASSERT_TRUE(_file.seek(20, SEEK_CUR, nullptr));
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 20u);
+    ASSERT_EQ(memcmp(buf, expected_valid_data + 28, 20), 0);
+
+    // Check that seeking backwards fails
+    ASSERT_FALSE(_file.seek(-1, SEEK_CUR, nullptr));
+    ASSERT_EQ(_file.error(), mb::FileError::UnsupportedSeek);
+
+    ASSERT_TRUE(_file.close());
+}
+
+TEST_F(SparseTest, GetChunks)
+{
+    std::vector<mb::sparse::SparseChunk> chunks;
+    build_valid_data();
+
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_TRUE(_file.chunks(chunks));
+
+    // CRC32 chunk is not included
+    ASSERT_EQ(chunks.size(), 3u);
+
+    ASSERT_EQ(chunks[0].type, mb::sparse::SparseChunkType::Raw);
+    ASSERT_EQ(chunks[0].begin, 0u);
+    ASSERT_EQ(chunks[0].end, 16u);
+    ASSERT_EQ(chunks[0].src_begin, 40u);
+    ASSERT_EQ(chunks[0].src_end, 56u);
+
+    ASSERT_EQ(chunks[1].type, mb::sparse::SparseChunkType::Fill);
+    ASSERT_EQ(chunks[1].begin, 16u);
+    ASSERT_EQ(chunks[1].end, 32u);
+    ASSERT_EQ(chunks[1].src_begin, 68u);
+    ASSERT_EQ(chunks[1].src_end, 72u);
+    ASSERT_EQ(chunks[1].fill_val, 0x12345678u);
+
+    ASSERT_EQ(chunks[2].type, mb::sparse::SparseChunkType::DontCare);
+    ASSERT_EQ(chunks[2].begin, 32u);
+    ASSERT_EQ(chunks[2].end, 48u);
+    ASSERT_EQ(chunks[2].src_begin, 84u);
+    ASSERT_EQ(chunks[2].src_end, 84u);
+
+    ASSERT_TRUE(_file.close());
+}
+
+TEST_F(SparseTest, GetCurrentChunkWithUnseekableFile)
+{
+    char buf[16];
+    size_t n;
+    mb::sparse::SparseChunk chunk;
+    bool found;
+    std::vector<mb::sparse::SparseChunkType> types;
+    build_valid_data();
+
+    _source_file.set_seekability(mb::sparse::Seekability::CAN_READ);
+    ASSERT_TRUE(_file.open(&_source_file));
+
+    // Walk the chunks, only reading data from raw chunks
+    while (true) {
+        ASSERT_TRUE(_file.current_chunk(chunk, found));
+        if (!found) {
+            break;
+        }
+        types.push_back(chunk.type);
+
+        if (chunk.type == mb::sparse::SparseChunkType::Raw) {
+            ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+            ASSERT_EQ(n, 16u);
+            ASSERT_EQ(memcmp(buf, expected_valid_data, 16), 0);
+        } else {
+            ASSERT_TRUE(_file.seek(chunk.end, SEEK_SET, nullptr));
+        }
+    }
+
+    ASSERT_EQ(types, (std::vector<mb::sparse::SparseChunkType>{
+        mb::sparse::SparseChunkType::Raw,
+        mb::sparse::SparseChunkType::Fill,
+        mb::sparse::SparseChunkType::DontCare,
+    }));
+
+    ASSERT_TRUE(_file.close());
+}
+
+TEST_F(SparseTest, VerifyCrc32)
+{
+    char buf[1024];
+    size_t n;
+    build_valid_data(mb::sparse::crc32_update(
+            0, expected_valid_data, sizeof(expected_valid_data)));
+
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_TRUE(_file.set_crc32_verification_enabled(true));
+
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(expected_valid_data));
+    ASSERT_EQ(memcmp(buf, expected_valid_data, sizeof(expected_valid_data)), 0);
+
+    ASSERT_TRUE(_file.close());
+}
+
+TEST_F(SparseTest, VerifyCrc32MismatchFails)
+{
+    char buf[1024];
+    size_t n;
+    build_valid_data(0xdeadbeef);
+
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_TRUE(_file.set_crc32_verification_enabled(true));
+
+    ASSERT_FALSE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(_file.error(), mb::FileError::BadFileFormat);
+    ASSERT_NE(_file.error_string().find("CRC32"), std::string::npos);
+}
+
+// Read raw chunks and skip over all other chunks
+static bool read_raw_chunks(mb::sparse::SparseFile &file)
+{
+    char buf[16];
+    size_t n;
+    mb::sparse::SparseChunk chunk;
+    bool found;
+
+    while (file.current_chunk(chunk, found)) {
+        if (!found) {
+            return true;
+        } else if (chunk.type == mb::sparse::SparseChunkType::Raw) {
+            if (!file.read(buf, sizeof(buf), n)) {
+                return false;
+            }
+        } else if (!file.seek(chunk.end, SEEK_SET, nullptr)) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+TEST_F(SparseTest, VerifyCrc32WithSkippedChunks)
+{
+    build_valid_data(mb::sparse::crc32_update(
+            0, expected_valid_data, sizeof(expected_valid_data)));
+
+    // Fill and "don't care" chunks are checksummed without being read
+    _source_file.set_seekability(mb::sparse::Seekability::CAN_READ);
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_TRUE(_file.set_crc32_verification_enabled(true));
+    ASSERT_TRUE(read_raw_chunks(_file));
+    ASSERT_TRUE(_file.close());
+}
+
+TEST_F(SparseTest, VerifyCrc32WithSkippedChunksMismatchFails)
+{
+    build_valid_data(0xdeadbeef);
+
+    _source_file.set_seekability(mb::sparse::Seekability::CAN_READ);
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_TRUE(_file.set_crc32_verification_enabled(true));
+    ASSERT_FALSE(read_raw_chunks(_file));
+    ASSERT_EQ(_file.error(), mb::FileError::BadFileFormat);
+}
+
+TEST_F(SparseTest, BuildIndexReadsAllChunks)
+{
+    char buf[1024];
+    size_t n;
+    build_valid_data();
+
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_TRUE(_file.build_index());
+
+    // Reading the end of the last chunk must not read any more chunk headers
+    ASSERT_TRUE(_source_file.set_stats_enabled(true));
+    ASSERT_TRUE(_file.seek(-16, SEEK_END, nullptr));
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 16u);
+    ASSERT_EQ(memcmp(buf, expected_valid_data + 32, 16), 0);
+    ASSERT_EQ(_source_file.stats().read_calls, 0u);
+
+    ASSERT_TRUE(_file.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(expected_valid_data));
+    ASSERT_EQ(memcmp(buf, expected_valid_data, sizeof(expected_valid_data)), 0);
+
+    ASSERT_TRUE(_file.close());
+}
+
+TEST_F(SparseTest, BuildIndexWithSkippableFileFails)
+{
+    build_valid_data();
+
+    _source_file.set_seekability(mb::sparse::Seekability::CAN_SKIP);
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_FALSE(_file.build_index());
+    ASSERT_EQ(_file.error(), mb::FileError::UnsupportedSeek);
+}
+
+TEST_F(SparseTest, SaveAndLoadIndex)
+{
+    char buf[1024];
+    size_t n;
+    void *index_data = nullptr;
+    size_t index_size = 0;
+    build_valid_data();
+
+    {
+        mb::MemoryFile index_file(&index_data, &index_size);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_TRUE(_file.open(&_source_file));
+        ASSERT_TRUE(_file.save_index(index_file));
+        ASSERT_TRUE(_file.close());
+    }
+
+    ASSERT_EQ(index_size, sizeof(mb::sparse::IndexHeader)
+            + 4 * sizeof(mb::sparse::IndexEntry));
+
+    ASSERT_TRUE(_source_file.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.open(&_source_file));
+
+    {
+        mb::MemoryFile index_file(index_data, index_size);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_TRUE(_source_file.set_stats_enabled(true));
+        ASSERT_TRUE(_file.load_index(index_file));
+    }
+
+    // Only the first and last chunk headers are read for verification
+    ASSERT_TRUE(_file.seek(-16, SEEK_END, nullptr));
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, 16u);
+    ASSERT_EQ(memcmp(buf, expected_valid_data + 32, 16), 0);
+    ASSERT_EQ(_source_file.stats().read_calls, 2u);
+
+    ASSERT_TRUE(_file.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(expected_valid_data));
+    ASSERT_EQ(memcmp(buf, expected_valid_data, sizeof(expected_valid_data)), 0);
+
+    ASSERT_TRUE(_file.close());
+    free(index_data);
+}
+
+TEST_F(SparseTest, LoadCorruptIndexFails)
+{
+    void *index_data = nullptr;
+    size_t index_size = 0;
+    build_valid_data();
+
+    {
+        mb::MemoryFile index_file(&index_data, &index_size);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_TRUE(_file.open(&_source_file));
+        ASSERT_TRUE(_file.save_index(index_file));
+    }
+
+    auto entries = reinterpret_cast<mb::sparse::IndexEntry *>(
+            static_cast<char *>(index_data) + sizeof(mb::sparse::IndexHeader));
+
+    // Chunk that is not contiguous with the previous chunk
+    entries[1].begin = mb_htole64(mb_le64toh(entries[1].begin) + 4);
+
+    {
+        mb::MemoryFile index_file(index_data, index_size);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_FALSE(_file.load_index(index_file));
+        ASSERT_EQ(_file.error(), mb::FileError::BadFileFormat);
+        ASSERT_NE(_file.error_string().find("chunk #1"), std::string::npos);
+    }
+
+    // Truncated index
+    {
+        mb::MemoryFile index_file(index_data, index_size - 1);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_FALSE(_file.load_index(index_file));
+        ASSERT_EQ(_file.error(), mb::FileError::BadFileFormat);
+    }
+
+    // Index for a different image
+    auto ihdr = static_cast<mb::sparse::IndexHeader *>(index_data);
+    ihdr->total_blks = mb_htole32(mb_le32toh(ihdr->total_blks) + 1);
+
+    {
+        mb::MemoryFile index_file(index_data, index_size);
+        ASSERT_TRUE(index_file.is_open());
+
+        ASSERT_FALSE(_file.load_index(index_file));
+        ASSERT_NE(_file.error_string().find("does not match"),
+                  std::string::npos);
+    }
+
+    // The sparse file is still usable
+    char buf[1024];
+    size_t n;
+    ASSERT_TRUE(_file.seek(0, SEEK_SET, nullptr));
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(expected_valid_data));
+
+    ASSERT_TRUE(_file.close());
+    free(index_data);
+}
+
+TEST_F(SparseTest, ReadAtValidData)
+{
+    char buf[1024];
+    size_t n;
+    uint64_t pos;
+    build_valid_data();
+
+    ASSERT_TRUE(_file.open(&_source_file));
+
+    // Every offset and size combination should match the expected data. The
+    // chunk index is built on the first call.
+    for (size_t offset = 0; offset <= sizeof(expected_valid_data); ++offset) {
+        for (size_t size = 0; size <= sizeof(expected_valid_data) - offset;
+                ++size) {
+            ASSERT_TRUE(_file.read_at(offset, buf, size, n));
+            ASSERT_EQ(n, size);
+            ASSERT_EQ(memcmp(buf, expected_valid_data + offset, size), 0)
+                    << "offset=" << offset << ", size=" << size;
+        }
+    }
+
+    // Reading past EOF returns a short read
+    ASSERT_TRUE(_file.read_at(40, buf, sizeof(buf), n));
+    ASSERT_EQ(n, 8u);
+    ASSERT_TRUE(_file.read_at(1000, buf, sizeof(buf), n));
+    ASSERT_EQ(n, 0u);
+
+    // The file position is not changed
+    ASSERT_TRUE(_file.seek(0, SEEK_CUR, &pos));
+    ASSERT_EQ(pos, 0u);
+    ASSERT_TRUE(_file.read(buf, sizeof(buf), n));
+    ASSERT_EQ(n, sizeof(expected_valid_data));
+    ASSERT_EQ(memcmp(buf, expected_valid_data, sizeof(expected_valid_data)), 0);
+
+    ASSERT_TRUE(_file.close());
+}
+
+TEST_F(SparseTest, ReadAtWithNonZeroBaseOffset)
+{
+    char buf[1024];
+    size_t n;
+    build_valid_data();
+
+    // Prepend junk to the sparse data and open from the middle of the file
+    std::vector<unsigned char> data(16, 0xff);
+    data.insert(data.end(), static_cast<unsigned char *>(_data),
+                static_cast<unsigned char *>(_data) + _size);
+
+    mb::MemoryFile source(data.data(), data.size());
+    ASSERT_TRUE(source.is_open());
+    ASSERT_TRUE(source.seek(16, SEEK_SET, nullptr));
+
+    ASSERT_TRUE(_file.open(&source));
+    ASSERT_TRUE(_file.read_at(4, buf, 20, n));
+    ASSERT_EQ(n, 20u);
+    ASSERT_EQ(memcmp(buf, expected_valid_data + 4, 20), 0);
+
+    ASSERT_TRUE(_file.close());
+}
+
+TEST_F(SparseTest, ReadAtWithSkippableFileFails)
+{
+    char c;
+    size_t n;
+    build_valid_data();
+
+    _source_file.set_seekability(mb::sparse::Seekability::CAN_SKIP);
+    ASSERT_TRUE(_file.open(&_source_file));
+    ASSERT_FALSE(_file.read_at(0, &c, 1, n));
+    ASSERT_EQ(_file.error(), mb::FileError::UnsupportedSeek);
+}
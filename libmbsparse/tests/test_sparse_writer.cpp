@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <cstring>
+
+#include "mbsparse/sparse.h"
+#include "mbsparse/sparse_writer.h"
+
+#include "mbcommon/endian.h"
+#include "mbcommon/file/memory.h"
+
+#include "mbsparse/crc32_p.h"
+#include "mbsparse/sparse_p.h"
+
+struct SparseWriterTest : testing::Test
+{
+    mb::MemoryFile _output_file;
+    void *_data = nullptr;
+    size_t _size = 0;
+
+    virtual ~SparseWriterTest()
+    {
+        free(_data);
+    }
+
+    void SetUp() override
+    {
+        ASSERT_TRUE(_output_file.open(&_data, &_size));
+    }
+
+    mb::sparse::SparseHeader sparse_header()
+    {
+        mb::sparse::SparseHeader shdr;
+        memcpy(&shdr, _data, sizeof(shdr));
+        shdr.total_blks = mb_le32toh(shdr.total_blks);
+        shdr.total_chunks = mb_le32toh(shdr.total_chunks);
+        shdr.image_checksum = mb_le32toh(shdr.image_checksum);
+        return shdr;
+    }
+
+    void read_back(std::vector<unsigned char> &out)
+    {
+        mb::MemoryFile input(_data, _size);
+        ASSERT_TRUE(input.is_open());
+
+        mb::sparse::SparseFile sparse_file(&input);
+        ASSERT_TRUE(sparse_file.is_open());
+        ASSERT_TRUE(sparse_file.set_crc32_verification_enabled(true));
+
+        out.resize(sparse_file.size());
+
+        size_t n;
+        ASSERT_TRUE(sparse_file.read(out.data(), out.size(), n));
+        ASSERT_EQ(n, out.size());
+
+        ASSERT_TRUE(sparse_file.close());
+    }
+};
+
+TEST_F(SparseWriterTest, InvalidBlockSizeFails)
+{
+    mb::sparse::SparseWriter writer;
+    ASSERT_FALSE(writer.open(&_output_file, 4095, false));
+    ASSERT_EQ(writer.error(), mb::FileError::InvalidArgument);
+}
+
+TEST_F(SparseWriterTest, CoalesceChunks)
+{
+    constexpr size_t block_size = 64;
+    std::vector<unsigned char> data;
+
+    // 3 raw blocks
+    for (size_t i = 0; i < 3 * block_size; ++i) {
+        data.push_back(static_cast<unsigned char>(i));
+    }
+    // 4 zero blocks
+    data.resize(data.size() + 4 * block_size, 0);
+    // 2 blocks filled with a repeating 32-bit pattern
+    for (size_t i = 0; i < 2 * block_size / 4; ++i) {
+        data.insert(data.end(), { 0xde, 0xad, 0xbe, 0xef });
+    }
+    // 1 raw block
+    for (size_t i = 0; i < block_size; ++i) {
+        data.push_back(static_cast<unsigned char>(255 - i));
+    }
+
+    {
+        mb::sparse::SparseWriter writer(&_output_file, block_size, false);
+        ASSERT_TRUE(writer.is_open());
+
+        // Write in odd sizes so that blocks span multiple writes
+        size_t n;
+        for (size_t i = 0; i < data.size(); i += 37) {
+            size_t to_write = std::min<size_t>(37, data.size() - i);
+            ASSERT_TRUE(writer.write(data.data() + i, to_write, n));
+            ASSERT_EQ(n, to_write);
+        }
+
+        ASSERT_TRUE(writer.close());
+    }
+
+    auto shdr = sparse_header();
+    ASSERT_EQ(shdr.total_blks, 10u);
+    ASSERT_EQ(shdr.total_chunks, 4u);
+
+    // The zero blocks are stored as a fill chunk, so the output should be
+    // much smaller than the input
+    ASSERT_EQ(_size, sizeof(mb::sparse::SparseHeader)
+            + 4 * sizeof(mb::sparse::ChunkHeader)
+            + 4 * block_size + 2 * sizeof(uint32_t));
+
+    std::vector<unsigned char> result;
+    read_back(result);
+    ASSERT_EQ(result, data);
+}
+
+TEST_F(SparseWriterTest, PartialLastBlockIsPadded)
+{
+    {
+        mb::sparse::SparseWriter writer(&_output_file, 16, false);
+        ASSERT_TRUE(writer.is_open());
+
+        size_t n;
+        ASSERT_TRUE(writer.write("0123456789abcdefXYZ", 19, n));
+        ASSERT_TRUE(writer.close());
+    }
+
+    std::vector<unsigned char> result;
+    read_back(result);
+    ASSERT_EQ(result.size(), 32u);
+    ASSERT_EQ(memcmp(result.data(), "0123456789abcdefXYZ", 19), 0);
+    for (size_t i = 19; i < result.size(); ++i) {
+        ASSERT_EQ(result[i], 0);
+    }
+}
+
+TEST_F(SparseWriterTest, SeekForwardCreatesDontCareChunk)
+{
+    {
+        mb::sparse::SparseWriter writer(&_output_file, 16, false);
+        ASSERT_TRUE(writer.is_open());
+
+        size_t n;
+        uint64_t pos;
+        ASSERT_TRUE(writer.write("abcdefgh", 8, n));
+        ASSERT_TRUE(writer.seek(100, SEEK_SET, &pos));
+        ASSERT_EQ(pos, 100u);
+        ASSERT_TRUE(writer.write("ijkl", 4, n));
+
+        // Seeking backwards is not supported
+        ASSERT_FALSE(writer.seek(0, SEEK_SET, nullptr));
+        ASSERT_EQ(writer.error(), mb::FileError::UnsupportedSeek);
+
+        ASSERT_TRUE(writer.close());
+    }
+
+    auto shdr = sparse_header();
+    ASSERT_EQ(shdr.total_blks, 7u);
+    // Raw, don't care (blocks 1-5), raw
+    ASSERT_EQ(shdr.total_chunks, 3u);
+
+    std::vector<unsigned char> expected(112, 0);
+    memcpy(expected.data(), "abcdefgh", 8);
+    memcpy(expected.data() + 100, "ijkl", 4);
+
+    std::vector<unsigned char> result;
+    read_back(result);
+    ASSERT_EQ(result, expected);
+}
+
+TEST_F(SparseWriterTest, WriteCrc32)
+{
+    std::vector<unsigned char> data(256);
+    for (size_t i = 0; i < 128; ++i) {
+        data[i] = static_cast<unsigned char>(i * 3);
+    }
+
+    {
+        mb::sparse::SparseWriter writer(&_output_file, 32, true);
+        ASSERT_TRUE(writer.is_open());
+
+        size_t n;
+        ASSERT_TRUE(writer.write(data.data(), data.size(), n));
+        ASSERT_TRUE(writer.close());
+    }
+
+    auto shdr = sparse_header();
+    ASSERT_EQ(shdr.image_checksum,
+              mb::sparse::crc32_update(0, data.data(), data.size()));
+    // Raw, fill, CRC32
+    ASSERT_EQ(shdr.total_chunks, 3u);
+
+    std::vector<unsigned char> result;
+    read_back(result);
+    ASSERT_EQ(result, data);
+}
+
+TEST_F(SparseWriterTest, DontCareChunkChecksummedAsZeros)
+{
+    {
+        mb::sparse::SparseWriter writer(&_output_file, 16, true);
+        ASSERT_TRUE(writer.is_open());
+
+        size_t n;
+        ASSERT_TRUE(writer.write("abcdefgh", 8, n));
+        ASSERT_TRUE(writer.seek(1000, SEEK_SET, nullptr));
+        ASSERT_TRUE(writer.write("ijkl", 4, n));
+        ASSERT_TRUE(writer.close());
+    }
+
+    std::vector<unsigned char> expected(1008, 0);
+    memcpy(expected.data(), "abcdefgh", 8);
+    memcpy(expected.data() + 1000, "ijkl", 4);
+
+    auto shdr = sparse_header();
+    ASSERT_EQ(shdr.image_checksum,
+              mb::sparse::crc32_update(0, expected.data(), expected.size()));
+    // Raw, don't care (blocks 1-61), raw, CRC32
+    ASSERT_EQ(shdr.total_chunks, 4u);
+
+    std::vector<unsigned char> result;
+    read_back(result);
+    ASSERT_EQ(result, expected);
+}
@@ -22,6 +22,8 @@
 #include <string>
 #include <vector>
 
+#include <cstdint>
+
 #include <archive.h>
 #include <archive_entry.h>
 
@@ -40,6 +42,11 @@ struct exists_info {
     bool exists;
 };
 
+struct sparse_extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
 enum class compression_type
 {
     NONE,
@@ -48,6 +55,48 @@ enum class compression_type
     XZ
 };
 
+/*!
+ * \brief External storage for the contents of regular files in tar archives
+ *
+ * When creating an archive, store() is called for each regular file with data
+ * while the disk reader is positioned at the file's contents. It should save
+ * the data elsewhere and record how to find it in the entry (eg. as an xattr).
+ * The entry is then written to the archive without any data.
+ *
+ * When extracting an archive, is_stored() is called for each entry. If it
+ * returns true, load() is responsible for writing the entry's header, data,
+ * and finishing the entry in the disk writer.
+ */
+class TarDataStore
+{
+public:
+    virtual ~TarDataStore() {}
+
+    virtual bool store(archive *in, archive_entry *entry) = 0;
+    virtual bool is_stored(archive_entry *entry) = 0;
+    virtual bool load(archive_entry *entry, archive *out) = 0;
+};
+
+/*!
+ * \brief Filter for the entries of tar archives
+ *
+ * When creating an archive, include() is called for every entry found while
+ * walking the paths, after the entry's path has been made relative to the base
+ * directory. Entries for which it returns false are left out of the archive.
+ * Directories are still walked.
+ *
+ * When extracting an archive, include() is called for every entry that
+ * matches the patterns, after the entry's path has been prefixed with the
+ * target directory. Entries for which it returns false are not extracted.
+ */
+class TarEntryFilter
+{
+public:
+    virtual ~TarEntryFilter() {}
+
+    virtual bool include(archive_entry *entry) = 0;
+};
+
 int libarchive_copy_data(archive *in, archive *out, archive_entry *entry);
 bool libarchive_copy_data_disk_to_archive(archive *in, archive *out,
                                           archive_entry *entry);
@@ -56,11 +105,22 @@ int libarchive_copy_header_and_data(archive *in, archive *out,
 bool libarchive_tar_extract(const std::string &filename,
                             const std::string &target,
                             const std::vector<std::string> &patterns,
-                            compression_type compression);
+                            compression_type compression,
+                            TarDataStore *store = nullptr,
+                            TarEntryFilter *filter = nullptr);
 bool libarchive_tar_create(const std::string &filename,
                            const std::string &base_dir,
                            const std::vector<std::string> &paths,
-                           compression_type compression);
+                           compression_type compression,
+                           TarDataStore *store = nullptr,
+                           TarEntryFilter *filter = nullptr,
+                           bool adaptive = false);
+bool libarchive_tar_create_sparse(const std::string &filename,
+                                  const std::string &path,
+                                  const std::string &name,
+                                  const std::vector<sparse_extent> &extents,
+                                  compression_type compression,
+                                  bool adaptive = false);
 
 bool extract_archive(const std::string &filename, const std::string &target);
 bool extract_files(const std::string &filename, const std::string &target,
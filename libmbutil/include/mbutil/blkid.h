@@ -19,12 +19,32 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
 namespace mb
 {
 namespace util
 {
 
+struct BlkidInfo
+{
+    /*! Filesystem type or nullptr if the filesystem is unknown */
+    const char *type = nullptr;
+    /*! Filesystem UUID or serial number (empty if unavailable) */
+    std::string uuid;
+    /*! Filesystem label (empty if unavailable) */
+    std::string label;
+};
+
 bool blkid_get_fs_type(const char *path, const char **type);
+bool blkid_probe(const char *path, BlkidInfo *info);
+void blkid_probe_all(const std::vector<std::string> &paths);
+
+void blkid_invalidate(dev_t dev);
+void blkid_invalidate_all();
 
 }
 }
@@ -34,6 +34,11 @@ enum ChownFlags : int
     CHOWN_RECURSIVE       = 0x2
 };
 
+bool lookup_uid(const std::string &user, uid_t *uid_out);
+bool lookup_gid(const std::string &group, gid_t *gid_out);
+bool lookup_owner(const std::string &user, const std::string &group,
+                  uid_t *uid_out, gid_t *gid_out);
+
 bool chown(const std::string &path,
            const std::string &user,
            const std::string &group,
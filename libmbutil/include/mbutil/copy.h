@@ -31,7 +31,9 @@ enum CopyFlags : int
     COPY_ATTRIBUTES          = 0x1,
     COPY_XATTRS              = 0x2,
     COPY_EXCLUDE_TOP_LEVEL   = 0x4,
-    COPY_FOLLOW_SYMLINKS     = 0x8
+    COPY_FOLLOW_SYMLINKS     = 0x8,
+    // Copy the contents of directories using a pool of worker threads
+    COPY_PARALLEL            = 0x10
 };
 
 bool copy_data_fd(int fd_source, int fd_target);
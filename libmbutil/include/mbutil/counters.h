@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+/*!
+ * \file counters.h
+ * \brief Always-on counters for hot paths
+ *
+ * Unlike the MB_TRACE_*() macros, the counters are always compiled in. Adding
+ * to a counter is a single relaxed atomic add, so they can be used in loops
+ * that run for every file or every uevent.
+ *
+ * The counters are local to the process until counters_attach() is called.
+ * Afterwards, they are shared with every other process that attached to the
+ * same file, which lets `mbtool stats` report them for the current boot.
+ */
+
+namespace mb
+{
+namespace util
+{
+
+enum class Counter : unsigned int
+{
+    // initwrapper/devices.cpp
+    UeventsHandled,
+    UeventHandleTimeNs,
+    // FtsWrapper (also used by copy_dir(), chmod_recursive(), etc.)
+    FtsEntriesVisited,
+    // copy_data_fd() (used by copy_file(), copy_dir(), etc.)
+    BytesCopied,
+    // appsync's installd proxy
+    AppsyncRepliesProxied,
+    AppsyncReplyTimeMs,
+    // Daemon requests (per-type statistics are available from the daemon)
+    DaemonRequests,
+    DaemonRequestTimeNs,
+    // SELinux policy patching
+    SepolicyPatches,
+    SepolicyPatchTimeNs,
+    // mount()
+    Mounts,
+    MountTimeNs,
+};
+
+constexpr size_t COUNTER_COUNT =
+        static_cast<size_t>(Counter::MountTimeNs) + 1;
+
+void counter_add(Counter counter, uint64_t value = 1);
+uint64_t counter_get(Counter counter);
+const char * counter_name(Counter counter);
+
+bool counters_attach(const std::string &path);
+bool counters_read(const std::string &path, std::vector<uint64_t> *values);
+
+/*!
+ * \brief Count an event and the time spent in the rest of the enclosing scope
+ */
+class CounterTimer
+{
+public:
+    CounterTimer(Counter count, Counter time_ns);
+    ~CounterTimer();
+
+    CounterTimer(const CounterTimer &) = delete;
+    CounterTimer & operator=(const CounterTimer &) = delete;
+
+private:
+    Counter _count;
+    Counter _time_ns;
+    uint64_t _start;
+};
+
+}
+}
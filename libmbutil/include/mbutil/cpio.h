@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include "mbutil/archive.h"
+#include "mbutil/autoclose/archive.h"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief In-memory editor for (optionally compressed) cpio archives
+ *
+ * The archive is decompressed once by load_file() or load_memory() into an
+ * entry table. Entries can then be queried and added, replaced, removed,
+ * renamed, or symlinked without touching the filesystem. save_file() or
+ * save_memory() recompresses the table in a single pass using the same format
+ * and filters as the input archive. Files added with add_file() are streamed
+ * from disk during the save instead of being buffered. gzip and LZ4 legacy
+ * compressed archives are recompressed with compress_parallel().
+ *
+ * Paths are relative to the archive root. Leading "/" and "./" components are
+ * ignored.
+ */
+class CpioEditor
+{
+public:
+    CpioEditor();
+    ~CpioEditor();
+
+    CpioEditor(const CpioEditor &) = delete;
+    CpioEditor & operator=(const CpioEditor &) = delete;
+
+    bool load_file(const std::string &path);
+    bool load_memory(const void *data, size_t size);
+
+    bool save_file(const std::string &path);
+    bool save_memory(std::string &out);
+
+    bool exists(const std::string &path) const;
+    bool is_symlink(const std::string &path) const;
+    bool read_link(const std::string &path, std::string &target) const;
+    bool contents(const std::string &path, std::string &out) const;
+    mode_t mode(const std::string &path) const;
+
+    bool set_contents(const std::string &path, std::string data,
+                      mode_t perm);
+    bool add_file(const std::string &path, const std::string &source,
+                  mode_t perm);
+    bool add_symlink(const std::string &path, const std::string &target);
+    bool remove(const std::string &path);
+    bool rename(const std::string &from, const std::string &to);
+
+private:
+    struct Entry
+    {
+        autoclose::archive_entry entry;
+        // Entry contents if the entry is a regular file
+        std::string data;
+        // If not empty, contents are streamed from this file when saving
+        std::string source;
+
+        Entry();
+    };
+
+    std::vector<Entry>::iterator find(const std::string &path);
+    std::vector<Entry>::const_iterator find(const std::string &path) const;
+    Entry & replace_entry(const std::string &path);
+
+    bool load(archive *a, const char *name);
+    bool save(archive *a, const char *name);
+    bool write_memory(std::string &out, bool use_filters);
+    bool parallel_compression(compression_type &compression) const;
+
+    std::vector<Entry> _entries;
+    int _format;
+    std::vector<int> _filters;
+    // Whether the LZ4 filter uses the legacy frame format
+    bool _lz4_legacy;
+};
+
+}
+}
@@ -20,13 +20,24 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 namespace mb
 {
 namespace util
 {
 
+enum DeleteFlags : int
+{
+    // Delete the contents of the directory, but not the directory itself
+    DELETE_CONTENTS_ONLY     = 0x1,
+    // Delete independent subtrees using a pool of worker threads
+    DELETE_PARALLEL          = 0x2
+};
+
 bool delete_recursive(const std::string &path);
+bool delete_recursive(const std::string &path, int flags,
+                      const std::vector<std::string> &exclusions);
 
 }
 }
\ No newline at end of file
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Directory tree walker operating on directory file descriptors
+ *
+ * Unlike FTSWrapper, entries are not identified by full paths. Each entry
+ * is passed to the hooks as a directory fd and a name relative to it, so
+ * the hooks can use the `*at()` family of syscalls (`unlinkat()`,
+ * `fchownat()`, `fchmodat()`, etc.) without having the kernel resolve the
+ * path from the root of the tree again. Directories are read in large
+ * `getdents64()` batches and no memory is allocated per entry.
+ *
+ * The walk is always physical: symlinks are reported, but never followed.
+ */
+class DirWalker {
+public:
+    enum Flags : int {
+        // If tree contains a mountpoint, traverse its contents
+        DW_CrossMountPointBoundaries    = 0x1,
+    };
+
+    enum Action : int {
+        // Hook succeeded
+        DW_OK                           = 0x0,
+        // Hook failed (run() will return false)
+        DW_Fail                         = 0x1,
+        // Skip current file or tree (in case of directory)
+        DW_Skip                         = 0x2,
+        // Stop traversal (if specified with DW_Skip, behavior is undefined)
+        DW_Stop                         = 0x4,
+        // Go to next entry (only useful for on_changed_path(). If this is
+        // returned, then the on_reached_*() functions will not be called)
+        DW_Next                         = 0x8,
+    };
+
+    struct Entry {
+        // Directory fd that `name` is relative to (AT_FDCWD for the root)
+        int dirfd;
+        // Name of the entry relative to `dirfd`
+        const char *name;
+        // Full path of the entry (for error messages)
+        const char *path;
+        // Depth of the entry (the root is at level 0)
+        size_t level;
+        // lstat() result for the entry
+        struct stat sb;
+    };
+
+    DirWalker(std::string path, int flags);
+    virtual ~DirWalker();
+
+    bool run();
+    std::string error();
+
+    virtual bool on_pre_execute();
+    virtual bool on_post_execute(bool success);
+    virtual int on_changed_path();
+    virtual int on_reached_directory_pre();
+    virtual int on_reached_directory_post();
+    virtual int on_reached_file();
+    virtual int on_reached_symlink();
+    virtual int on_reached_special_file();
+
+protected:
+    // Input path
+    std::string _path;
+    // Input flags
+    int _flags = 0;
+    // Current entry (valid only during a hook)
+    const Entry *_curr = nullptr;
+    // Error message (valid only if run() returned false)
+    std::string _error_msg;
+
+private:
+    bool visit(Entry &entry);
+    bool walk_dir(const Entry &dir);
+
+    bool _ran = false;
+    bool _ret = true;
+    dev_t _root_dev = 0;
+    // Path of the current entry. The capacity is reused between entries.
+    std::string _path_buf;
+    // One getdents64() buffer per directory level currently being read
+    std::vector<std::unique_ptr<char[]>> _dent_bufs;
+};
+
+}
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+#include <sys/stat.h>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief SELinux label lookups for a textual file_contexts file
+ *
+ * Specs are matched with the same precedence as libselinux: exact paths win
+ * over regexes and later specs win over earlier ones. Exact paths are found
+ * with a hash lookup. A regex is only evaluated if the path starts with the
+ * regex's literal prefix, and the candidates are found by walking a prefix
+ * trie. The trie walks for recently seen parent directories are memoized, so
+ * a lookup for an entry in the same directory as a previous lookup only walks
+ * the entry's name.
+ *
+ * Regexes are evaluated as POSIX extended regexes, which covers the subset of
+ * PCRE used by file_contexts in practice. Specs that fail to compile are
+ * ignored.
+ *
+ * An instance must not be used by more than one thread at a time.
+ */
+class FileContexts
+{
+public:
+    FileContexts();
+    ~FileContexts();
+
+    FileContexts(const FileContexts &) = delete;
+    FileContexts & operator=(const FileContexts &) = delete;
+
+    bool load(const std::string &path);
+    void clear();
+
+    bool lookup(const std::string &path, mode_t mode, std::string *context);
+
+private:
+    struct Spec;
+
+    struct TrieNode
+    {
+        // (character, node index) pairs sorted by character
+        std::vector<std::pair<char, uint32_t>> children;
+        // Regex specs whose literal prefix ends at this node
+        std::vector<uint32_t> specs;
+    };
+
+    struct DirMemo
+    {
+        // Trie node reached after walking the directory or UINT32_MAX if the
+        // walk fell off the trie (no literal prefix extends past it)
+        uint32_t node;
+        // Regex specs whose literal prefix is a prefix of the directory
+        std::vector<uint32_t> specs;
+    };
+
+    bool add_spec(const char *regex, const char *type, const char *context);
+    void index_specs();
+    uint32_t trie_walk(uint32_t node, const char *begin, const char *end,
+                       std::vector<uint32_t> &specs) const;
+    const DirMemo & dir_memo(const std::string &dir);
+
+    std::vector<std::unique_ptr<Spec>> _specs;
+    // Exact path -> indexes of the specs for that path
+    std::unordered_map<std::string, std::vector<uint32_t>> _exact;
+    // Literal prefix trie for the regex specs. Node 0 is the root.
+    std::vector<TrieNode> _trie;
+    // Parent directory (with a trailing slash) -> trie walk result
+    std::unordered_map<std::string, DirMemo> _memo;
+    // Scratch space for lookup()
+    std::vector<uint32_t> _candidates;
+};
+
+}
+}
@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <cstddef>
+
 #include <string>
 #include <vector>
 
@@ -66,6 +68,51 @@ struct fstab_rec
     std::string orig_line;
 };
 
+/*!
+ * \brief fstab entry that points into the buffer of a Fstab
+ *
+ * The fields have the same meaning as the fields of fstab_rec. All of the
+ * strings are NULL-terminated and remain valid for the lifetime of the Fstab
+ * that the entry came from.
+ */
+struct FstabEntry
+{
+    const char *blk_device;
+    const char *mount_point;
+    const char *fs_type;
+    unsigned long flags;
+    const char *fs_options;
+    unsigned long fs_mgr_flags;
+    const char *vold_args;
+    const char *mount_args;
+    const char *orig_line;
+};
+
+/*!
+ * \brief Parsed fstab file
+ *
+ * The file is read once and all of the entries' strings are stored in a single
+ * buffer, so parsing does not allocate memory per entry or per field. The mount
+ * flags and fs_mgr flags are computed during parsing.
+ */
+class Fstab
+{
+public:
+    Fstab();
+
+    Fstab(const Fstab &) = delete;
+    Fstab & operator=(const Fstab &) = delete;
+
+    bool load(const std::string &path);
+    bool load_data(const char *data, size_t size);
+
+    const std::vector<FstabEntry> & entries() const;
+
+private:
+    std::vector<char> _buf;
+    std::vector<FstabEntry> _entries;
+};
+
 struct twrp_fstab_rec
 {
     std::vector<std::string> blk_devices;
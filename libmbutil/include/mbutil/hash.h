@@ -19,7 +19,9 @@
 
 #pragma once
 
+#include <array>
 #include <string>
+#include <vector>
 
 #include <openssl/sha.h>
 
@@ -28,8 +30,17 @@ namespace mb
 namespace util
 {
 
+typedef std::array<unsigned char, SHA512_DIGEST_LENGTH> Sha512Digest;
+
 bool sha512_hash(const std::string &path,
                  unsigned char digest[SHA512_DIGEST_LENGTH]);
+bool sha512_hash_files(const std::vector<std::string> &paths,
+                       std::vector<Sha512Digest> &digests,
+                       unsigned int threads = 0);
+bool sha512_tree_hash(const std::string &path, size_t chunk_size,
+                      unsigned char digest[SHA512_DIGEST_LENGTH],
+                      std::vector<Sha512Digest> *chunk_digests = nullptr,
+                      unsigned int threads = 0);
 
 }
 }
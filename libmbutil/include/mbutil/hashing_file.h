@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <sys/stat.h>
+
+#include <openssl/sha.h>
+
+#include "mbcommon/file.h"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief File decorator that computes the SHA512 digest of the data passing
+ *        through it
+ *
+ * All data read from or written to the underlying file is hashed in order.
+ * The digest is the hash of the file's contents as long as the data is
+ * transferred sequentially from the beginning of the file. Seeking to any
+ * other position invalidates the digest.
+ *
+ * The native file descriptor of the underlying file is deliberately not
+ * exposed so that file_copy() cannot bypass the hashing with an in-kernel
+ * copy.
+ *
+ * \note The HashingFile does not take ownership of the underlying file. It
+ *       must remain open until the HashingFile is closed.
+ */
+class HashingFile : public File
+{
+public:
+    HashingFile();
+    HashingFile(File *file);
+    virtual ~HashingFile();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(HashingFile)
+
+    bool open(File *file);
+
+    bool digest(unsigned char digest[SHA512_DIGEST_LENGTH]);
+
+protected:
+    virtual bool on_open() override;
+    virtual bool on_close() override;
+    virtual bool on_read(void *buf, size_t size,
+                         size_t &bytes_read) override;
+    virtual bool on_write(const void *buf, size_t size,
+                          size_t &bytes_written) override;
+    virtual bool on_seek(int64_t offset, int whence,
+                         uint64_t &new_offset) override;
+    virtual bool on_truncate(uint64_t size) override;
+
+private:
+    bool copy_error();
+
+    File *_file;
+    SHA512_CTX _ctx;
+    uint64_t _offset;
+    bool _valid;
+};
+
+bool copy_and_hash(const std::string &source, const std::string &target,
+                   unsigned char digest[SHA512_DIGEST_LENGTH],
+                   struct stat *sb = nullptr);
+
+}
+}
@@ -26,9 +26,18 @@ namespace mb
 namespace util
 {
 
+enum LoopdevFlags : int
+{
+    LOOPDEV_READ_ONLY   = 0x1,
+    LOOPDEV_DIRECT_IO   = 0x2,
+};
+
+bool loopdev_preallocate(unsigned int count);
 std::string loopdev_find_unused(void);
 bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
                            uint64_t offset, bool ro);
+std::string loopdev_set_up_unused(const std::string &file, uint64_t offset,
+                                  int flags);
 bool loopdev_remove_device(const std::string &loopdev);
 
 }
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <sys/types.h>
+
+namespace mb
+{
+namespace util
+{
+
+struct Metadata
+{
+    uid_t uid;
+    gid_t gid;
+    // Permission bits (applied to everything except symlinks)
+    mode_t mode;
+    // SELinux label (not changed if empty)
+    std::string context;
+};
+
+bool apply_metadata_recursive(const std::string &path,
+                              const Metadata &metadata);
+
+}
+}
@@ -19,6 +19,7 @@
 
 #pragma once
 
+#include <deque>
 #include <string>
 #include <unordered_map>
 
@@ -95,6 +96,44 @@ bool property_list(PropertyListCb prop_fn, void *cookie);
 
 bool property_get_all(std::unordered_map<std::string, std::string> &map);
 
+// Cached property lookups
+
+/*!
+ * \brief Handle to a system property that caches its lookup and value
+ *
+ * The property is looked up once and its value is only read again when its
+ * serial number changes. If the property does not exist, it is looked up
+ * again only after some property in the property area has changed.
+ *
+ * \note Not thread safe. Each thread should use its own handles.
+ */
+class PropertyHandle
+{
+public:
+    explicit PropertyHandle(std::string name);
+
+    const std::string & name() const;
+
+    bool get(std::string &value_out);
+    bool changed();
+
+private:
+    const prop_info * info();
+
+    std::string _name;
+    const prop_info *_pi;
+    // Global serial when the property was last looked up and not found
+    uint32_t _area_serial;
+    // Serial of the cached value
+    uint32_t _serial;
+    bool _cached;
+    std::string _value;
+};
+
+bool property_wait_any(PropertyHandle * const *handles, size_t count,
+                       const struct timespec *relative_timeout,
+                       size_t *index_out);
+
 // Properties file functions
 
 bool property_file_get(const std::string &path, const std::string &key,
@@ -146,5 +185,102 @@ bool property_file_get_all(const std::string &path,
 bool property_file_write_all(const std::string &path,
                              const std::unordered_map<std::string, std::string> &map);
 
+/*!
+ * \brief Properties file parsed once for repeated queries and edits
+ *
+ * The file is read into a single buffer and indexed by key, with keys and
+ * values pointing into the buffer, so lookups do not re-read or re-tokenize
+ * the file. If a key appears more than once, the last occurrence wins (like
+ * Android's init).
+ *
+ * Edits are applied to the data when it is serialized: modified properties
+ * are rewritten on their original lines, removed properties are dropped, new
+ * properties are appended, and everything else (comments, blank lines,
+ * ordering) is preserved byte for byte.
+ */
+class PropertyFile
+{
+public:
+    PropertyFile();
+
+    PropertyFile(const PropertyFile &) = delete;
+    PropertyFile & operator=(const PropertyFile &) = delete;
+
+    bool open(const std::string &path);
+    void load(std::string data);
+
+    bool get(const std::string &key, std::string &value_out) const;
+    std::string get_string(const std::string &key,
+                           const std::string &default_value) const;
+    bool get_bool(const std::string &key, bool default_value) const;
+
+    template<typename SNumType>
+    SNumType get_snum(const std::string &key, SNumType default_value) const
+    {
+        std::string value;
+        SNumType result;
+
+        if (get(key, value) && str_to_snum(value.c_str(), 10, &result)) {
+            return result;
+        }
+
+        return default_value;
+    }
+
+    template<typename UNumType>
+    UNumType get_unum(const std::string &key, UNumType default_value) const
+    {
+        std::string value;
+        UNumType result;
+
+        if (get(key, value) && str_to_unum(value.c_str(), 10, &result)) {
+            return result;
+        }
+
+        return default_value;
+    }
+
+    void get_all(std::unordered_map<std::string, std::string> &map) const;
+
+    void set(const std::string &key, const std::string &value);
+    bool remove(const std::string &key);
+
+    std::string data() const;
+    bool write(const std::string &path) const;
+
+private:
+    struct Slice
+    {
+        const char *data;
+        size_t size;
+
+        bool operator==(const Slice &other) const;
+    };
+
+    struct SliceHash
+    {
+        size_t operator()(const Slice &slice) const;
+    };
+
+    struct Entry
+    {
+        // Line range in the original data (npos for new entries)
+        size_t line_begin;
+        size_t line_end;
+        Slice key;
+        Slice value;
+        bool modified;
+        bool removed;
+        // Storage for new keys and modified values
+        std::string new_key;
+        std::string new_value;
+    };
+
+    std::string _data;
+    // std::deque never moves its elements, so the slices stay valid
+    std::deque<Entry> _entries;
+    std::unordered_map<Slice, Entry *, SliceHash> _index;
+};
+
 }
 }
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include <sepol/policydb/policydb.h>
 
@@ -36,6 +37,8 @@ namespace mb
 namespace util
 {
 
+class FileContexts;
+
 enum class SELinuxAttr
 {
     CURRENT,
@@ -48,6 +51,9 @@ enum class SELinuxAttr
 
 bool selinux_read_policy(const std::string &path, policydb_t *pdb);
 bool selinux_write_policy(const std::string &path, policydb_t *pdb);
+bool selinux_policy_to_data(policydb_t *pdb, std::vector<unsigned char> *data);
+bool selinux_write_policy_data(const std::string &path,
+                               const void *data, size_t size);
 bool selinux_get_context(const std::string &path, std::string *context);
 bool selinux_lget_context(const std::string &path, std::string *context);
 bool selinux_fget_context(int fd, std::string *context);
@@ -58,6 +64,9 @@ bool selinux_set_context_recursive(const std::string &path,
                                    const std::string &context);
 bool selinux_lset_context_recursive(const std::string &path,
                                     const std::string &context);
+bool selinux_restore_context_recursive(const std::string &path,
+                                       FileContexts &contexts,
+                                       const std::string &lookup_path);
 bool selinux_get_enforcing(int *value);
 bool selinux_set_enforcing(int value);
 bool selinux_get_process_attr(pid_t pid, SELinuxAttr attr,
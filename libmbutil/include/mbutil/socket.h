@@ -52,5 +52,57 @@ bool socket_write_string_array(int fd, const std::vector<std::string> &list);
 bool socket_receive_fds(int fd, std::vector<int> *fds);
 bool socket_send_fds(int fd, const std::vector<int> &fds);
 
+/*!
+ * \brief Buffered reader/writer for length-prefixed frames
+ *
+ * Frames use the same format as socket_read_bytes() and socket_write_bytes():
+ * a native-endian 32-bit signed length followed by the payload.
+ *
+ * Received data is read into a buffer that is reused across frames. Each
+ * receive reads as much as is available (up to the buffer capacity), so if
+ * the peer has queued several frames, they are all returned by read_frame()
+ * without further syscalls. Because of this read-ahead, all reads from the
+ * socket must go through the same FramedSocket instance.
+ *
+ * File descriptors sent with `SCM_RIGHTS` alongside the frames are collected
+ * and can be retrieved with take_fds().
+ *
+ * Outgoing frames can be queued with queue_frame() and sent together with
+ * flush(). write_frame() flushes queued frames first so ordering is kept.
+ *
+ * The FramedSocket does not own the socket fd.
+ */
+class FramedSocket
+{
+public:
+    explicit FramedSocket(int fd);
+    ~FramedSocket();
+
+    FramedSocket(const FramedSocket &) = delete;
+    FramedSocket & operator=(const FramedSocket &) = delete;
+
+    bool read_frame(const uint8_t **data, size_t *size);
+    bool has_buffered_frame() const;
+    bool write_frame(const void *data, size_t size);
+    bool write_frame(const void *data, size_t size,
+                     const std::vector<int> &fds);
+    bool queue_frame(const void *data, size_t size);
+    bool flush();
+
+    void take_fds(std::vector<int> *fds);
+
+private:
+    bool fill(size_t needed);
+
+    int _fd;
+    std::vector<uint8_t> _buf;
+    // Unconsumed data is at [_begin, _end)
+    size_t _begin;
+    size_t _end;
+    std::vector<int> _fds;
+    // Queued frames that have not been written yet
+    std::vector<uint8_t> _out;
+};
+
 }
 }
\ No newline at end of file
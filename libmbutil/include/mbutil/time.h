@@ -101,6 +101,7 @@ inline int64_t timespec_diff_ns(const struct timespec &start,
 }
 
 uint64_t current_time_ms();
+uint64_t monotonic_time_ns();
 bool format_time(const std::string &format, std::string *out);
 std::string format_time(const std::string &format);
 
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <cstddef>
+#include <cstdint>
+
+/*!
+ * \file trace.h
+ * \brief Timing spans, counters, histograms, and timelines
+ *
+ * The MB_TRACE_*() macros are compiled out unless MB_ENABLE_TRACING is set to
+ * 1 (eg. by configuring with `-DMBP_ENABLE_TRACING=ON`). The functions and
+ * classes below can always be used directly.
+ *
+ * MB_TIMELINE_SCOPE() is always compiled in. It only records anything while a
+ * timeline is active (see timeline_start()), which makes it cheap enough for
+ * code that runs on every boot.
+ */
+
+#ifndef MB_ENABLE_TRACING
+#  define MB_ENABLE_TRACING 0
+#endif
+
+#define MB_TRACE_CONCAT_INNER(a, b) a ## b
+#define MB_TRACE_CONCAT(a, b) MB_TRACE_CONCAT_INNER(a, b)
+
+#if MB_ENABLE_TRACING
+   //! Time the rest of the enclosing scope as span \a name
+#  define MB_TRACE_SCOPE(name) \
+        ::mb::util::ScopedTimer MB_TRACE_CONCAT(_mb_trace_, __LINE__)(name)
+   //! Add \a delta to counter \a name
+#  define MB_TRACE_COUNT(name, delta) \
+        ::mb::util::trace_count((name), (delta))
+   //! Write all spans and counters to the log
+#  define MB_TRACE_DUMP() \
+        ::mb::util::trace_dump_to_log()
+#else
+#  define MB_TRACE_SCOPE(name) do {} while (0)
+#  define MB_TRACE_COUNT(name, delta) do {} while (0)
+#  define MB_TRACE_DUMP() do {} while (0)
+#endif
+
+#if MB_ENABLE_TRACING
+   //! Record the rest of the enclosing scope on the timeline and as a span
+#  define MB_TIMELINE_SCOPE(name) \
+        MB_TRACE_SCOPE(name); \
+        ::mb::util::TimelineSpan MB_TRACE_CONCAT(_mb_timeline_, __LINE__)(name)
+#else
+   //! Record the rest of the enclosing scope on the timeline
+#  define MB_TIMELINE_SCOPE(name) \
+        ::mb::util::TimelineSpan MB_TRACE_CONCAT(_mb_timeline_, __LINE__)(name)
+#endif
+
+namespace mb
+{
+namespace util
+{
+
+void trace_record(const char *name, uint64_t duration_ns);
+void trace_count(const char *name, int64_t delta = 1);
+void trace_reset();
+
+std::string trace_dump();
+void trace_dump_to_log();
+bool trace_dump_to_file(const std::string &path);
+
+/*!
+ * \brief Record the lifetime of the object as a span
+ *
+ * \note \a name must remain valid for the lifetime of the object. String
+ *       literals are expected.
+ */
+class ScopedTimer
+{
+public:
+    explicit ScopedTimer(const char *name);
+    ~ScopedTimer();
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer & operator=(const ScopedTimer &) = delete;
+
+    uint64_t elapsed_ns() const;
+
+private:
+    const char *_name;
+    uint64_t _start;
+};
+
+void timeline_start();
+void timeline_stop();
+
+std::string timeline_dump_json();
+void timeline_dump_to_log();
+bool timeline_dump_to_file(const std::string &path);
+
+/*!
+ * \brief Record the lifetime of the object on the active timeline
+ *
+ * Spans can be recorded from any thread. Nesting depth is tracked separately
+ * for each thread. This does nothing if no timeline is active.
+ *
+ * \note \a name must remain valid until the timeline is dumped. String
+ *       literals are expected.
+ */
+class TimelineSpan
+{
+public:
+    explicit TimelineSpan(const char *name);
+    ~TimelineSpan();
+
+    TimelineSpan(const TimelineSpan &) = delete;
+    TimelineSpan & operator=(const TimelineSpan &) = delete;
+
+private:
+    size_t _index;
+    uint64_t _generation;
+};
+
+}
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Snapshot of all extended attributes of a file
+ *
+ * The names and values are stored in two flat buffers that are reused when
+ * the snapshot is read again, so a single instance can be used for a whole
+ * tree without allocating per file. Reading normally takes one list call plus
+ * one get call per attribute. The buffers are only resized (and the size
+ * probed) when an attribute does not fit.
+ */
+class XattrSnapshot
+{
+public:
+    bool read_fd(int fd);
+    bool read_path(const std::string &path, bool follow_symlinks);
+
+    bool apply_fd(int fd) const;
+    bool apply_path(const std::string &path, bool follow_symlinks) const;
+
+    void clear();
+    size_t size() const;
+    bool empty() const;
+
+    bool operator==(const XattrSnapshot &other) const;
+    bool operator!=(const XattrSnapshot &other) const;
+
+private:
+    struct Attr
+    {
+        // Offset of the NULL-terminated name in _names
+        size_t name;
+        // Offset and size of the value in _values
+        size_t value;
+        size_t value_size;
+    };
+
+    // Exactly one of fd and path is used
+    bool read(int fd, const char *path, bool follow_symlinks);
+    bool apply(int fd, const char *path, bool follow_symlinks) const;
+
+    // The buffers are only grown. The sizes below are the used portions.
+    std::vector<char> _names;
+    std::vector<char> _values;
+    size_t _names_size = 0;
+    size_t _values_size = 0;
+    std::vector<Attr> _attrs;
+};
+
+}
+}
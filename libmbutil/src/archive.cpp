@@ -20,12 +20,27 @@
 #include "mbutil/archive.h"
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
+
 #include <cerrno>
+#include <cinttypes>
+#include <cstdio>
 #include <cstring>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lz4frame.h>
+
 #include "mblog/logging.h"
 #include "mbutil/autoclose/archive.h"
+#include "mbutil/compress.h"
 #include "mbutil/directory.h"
 #include "mbutil/finally.h"
 #include "mbutil/path.h"
@@ -45,6 +60,14 @@
 #define LIBARCHIVE_DISK_READER_FLAGS \
     ARCHIVE_READDISK_MAC_COPYFILE
 
+// Uncompressed size of each independently compressed batch
+#define PARALLEL_COMPRESS_BATCH_SIZE    (4 * 1024 * 1024)
+// Size and maximum number of queued decompressed chunks
+#define PIPELINE_CHUNK_SIZE             (1024 * 1024)
+#define PIPELINE_MAX_CHUNKS             8
+// Number of levels tried by adaptive compression
+#define ADAPTIVE_LEVEL_COUNT            4
+
 namespace mb
 {
 namespace util
@@ -163,6 +186,521 @@ int libarchive_copy_header_and_data(archive *in, archive *out,
     return ret;
 }
 
+/*!
+ * \brief Compressed archive output with compression on a pool of threads
+ *
+ * libarchive's compression filters run on the thread writing the archive.
+ * Instead, the uncompressed archive is written to this class, which splits
+ * the stream into batches that are compressed independently by worker
+ * threads (one complete gzip member or LZ4 frame per batch). The workers
+ * write the compressed batches to the file in order. Concatenated gzip
+ * members and LZ4 frames are valid streams, so the result can be read by
+ * libarchive, gzip, and lz4.
+ *
+ * In adaptive mode, every batch can use a different compression level. It
+ * starts at the fastest level and is re-evaluated after every window of one
+ * batch per thread. If the file was left idle while batches were still waiting
+ * for a worker, compression is the bottleneck and the level is lowered.
+ * Otherwise, the destination or the input is slower than the compressors and
+ * the spare CPU time is spent on a higher level.
+ */
+class ParallelCompressWriter
+{
+public:
+    ParallelCompressWriter(compression_type compression, bool adaptive)
+        : _compression(compression), _adaptive(adaptive)
+    {
+        // Fastest to strongest. For LZ4, levels 3 and up use LZ4 HC.
+        static const int gzip_levels[ADAPTIVE_LEVEL_COUNT] = { 1, 3, 6, 9 };
+        static const int lz4_levels[ADAPTIVE_LEVEL_COUNT] = { 0, 3, 6, 9 };
+
+        _levels = compression == compression_type::GZIP
+                ? gzip_levels : lz4_levels;
+    }
+
+    ~ParallelCompressWriter()
+    {
+        finish();
+    }
+
+    ParallelCompressWriter(const ParallelCompressWriter &) = delete;
+    ParallelCompressWriter & operator=(const ParallelCompressWriter &) = delete;
+
+    bool open(const std::string &filename)
+    {
+        _fd = ::open(filename.c_str(),
+                     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (_fd < 0) {
+            LOGE("%s: Failed to open file: %s",
+                 filename.c_str(), strerror(errno));
+            return false;
+        }
+
+        unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+        _max_in_flight = threads * 2;
+        _window_size = threads;
+
+        _threads.reserve(threads);
+        for (unsigned int i = 0; i < threads; ++i) {
+            _threads.emplace_back(&ParallelCompressWriter::worker, this);
+        }
+
+        _batch.reserve(PARALLEL_COMPRESS_BATCH_SIZE);
+
+        return true;
+    }
+
+    bool write(const void *data, size_t size)
+    {
+        auto ptr = static_cast<const char *>(data);
+
+        while (size > 0) {
+            size_t n = std::min<size_t>(
+                    size, PARALLEL_COMPRESS_BATCH_SIZE - _batch.size());
+            _batch.append(ptr, n);
+            ptr += n;
+            size -= n;
+
+            if (_batch.size() == PARALLEL_COMPRESS_BATCH_SIZE
+                    && !submit()) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /*!
+     * \brief Compress the remaining data and wait for all batches to be
+     *        written
+     *
+     * \return Whether all data was successfully compressed and written
+     */
+    bool finish()
+    {
+        if (_fd < 0) {
+            return !_failed;
+        }
+
+        // An empty stream still needs a gzip header or LZ4 frame
+        if (!_batch.empty() || _next_seq == 0) {
+            submit();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _done = true;
+        }
+        _cv.notify_all();
+
+        for (auto &t : _threads) {
+            t.join();
+        }
+        _threads.clear();
+
+        if (close(_fd) < 0) {
+            LOGE("Failed to close compressed archive: %s", strerror(errno));
+            _failed = true;
+        }
+        _fd = -1;
+
+        if (_adaptive) {
+            LOGD("Adaptive compression finished at level %d",
+                 _levels[_level_index]);
+        }
+
+        return !_failed;
+    }
+
+private:
+    struct Job
+    {
+        uint64_t seq;
+        std::string data;
+    };
+
+    bool submit()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{ return _in_flight < _max_in_flight || _failed; });
+        if (_failed) {
+            return false;
+        }
+
+        _jobs.push_back({_next_seq++, std::move(_batch)});
+        ++_in_flight;
+        lock.unlock();
+        _cv.notify_all();
+
+        _batch.clear();
+        _batch.reserve(PARALLEL_COMPRESS_BATCH_SIZE);
+        return true;
+    }
+
+    bool compress(const std::string &in, std::string &out, int level)
+    {
+        switch (_compression) {
+        case compression_type::GZIP:
+            return compress_parallel(compression_type::GZIP,
+                                     in.data(), in.size(), out, 1, level);
+        case compression_type::LZ4: {
+            LZ4F_preferences_t prefs;
+            memset(&prefs, 0, sizeof(prefs));
+            // Same defaults as libarchive's lz4 writer
+            prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+            prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+            prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+            prefs.compressionLevel = level < 0 ? 0 : level;
+
+            out.resize(LZ4F_compressFrameBound(in.size(), &prefs));
+            size_t n = LZ4F_compressFrame(&out[0], out.size(),
+                                          in.data(), in.size(), &prefs);
+            if (LZ4F_isError(n)) {
+                LOGE("Failed to compress LZ4 frame: %s",
+                     LZ4F_getErrorName(n));
+                return false;
+            }
+            out.resize(n);
+            return true;
+        }
+        default:
+            LOGE("Unsupported parallel compression type");
+            return false;
+        }
+    }
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::string out;
+
+        while (true) {
+            _cv.wait(lock, [&]{ return _done || !_jobs.empty(); });
+            if (_jobs.empty()) {
+                break;
+            }
+
+            Job job = std::move(_jobs.front());
+            _jobs.pop_front();
+            int level = _adaptive ? _levels[_level_index] : -1;
+            lock.unlock();
+
+            bool ok = compress(job.data, out, level);
+
+            // Jobs are taken in order, so every earlier job is already being
+            // compressed by another worker
+            lock.lock();
+            _cv.wait(lock, [&]{ return _next_write == job.seq; });
+            ok = ok && !_failed;
+            bool backlog = !_jobs.empty();
+            lock.unlock();
+
+            auto start = std::chrono::steady_clock::now();
+            if (ok) {
+                ok = write_all(out);
+            }
+            auto end = std::chrono::steady_clock::now();
+
+            lock.lock();
+            if (!ok) {
+                _failed = true;
+            } else if (_adaptive) {
+                adapt(start, end, backlog);
+            }
+            ++_next_write;
+            --_in_flight;
+            _cv.notify_all();
+        }
+    }
+
+    /*!
+     * \brief Update the compression level after a batch has been written
+     *
+     * Must be called with the mutex held by the worker whose turn it is to
+     * write, so calls are serialized in the order of the batches.
+     *
+     * \param start When the batch started being written
+     * \param end When the batch finished being written
+     * \param backlog Whether batches were waiting for a worker when this batch
+     *                was ready to be written
+     */
+    void adapt(std::chrono::steady_clock::time_point start,
+               std::chrono::steady_clock::time_point end,
+               bool backlog)
+    {
+        if (_have_last_write && backlog
+                && start - _last_write_end > end - start) {
+            ++_window_starved;
+        }
+        _last_write_end = end;
+        _have_last_write = true;
+
+        if (++_window_count < _window_size) {
+            return;
+        }
+
+        if (_window_starved * 2 > _window_count && _level_index > 0) {
+            --_level_index;
+        } else if (_window_starved == 0
+                && _level_index < ADAPTIVE_LEVEL_COUNT - 1) {
+            ++_level_index;
+        }
+
+        _window_count = 0;
+        _window_starved = 0;
+    }
+
+    bool write_all(const std::string &data)
+    {
+        const char *ptr = data.data();
+        size_t remain = data.size();
+
+        while (remain > 0) {
+            ssize_t n = ::write(_fd, ptr, remain);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOGE("Failed to write compressed archive: %s",
+                     strerror(errno));
+                return false;
+            }
+            ptr += n;
+            remain -= static_cast<size_t>(n);
+        }
+
+        return true;
+    }
+
+    compression_type _compression;
+    bool _adaptive;
+    int _fd = -1;
+    std::string _batch;
+
+    // Adaptive compression state (protected by _mutex)
+    const int *_levels;
+    unsigned int _level_index = 0;
+    unsigned int _window_size = 0;
+    unsigned int _window_count = 0;
+    unsigned int _window_starved = 0;
+    std::chrono::steady_clock::time_point _last_write_end;
+    bool _have_last_write = false;
+
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Job> _jobs;
+    uint64_t _next_seq = 0;
+    uint64_t _next_write = 0;
+    size_t _in_flight = 0;
+    size_t _max_in_flight = 0;
+    bool _done = false;
+    bool _failed = false;
+};
+
+static la_ssize_t parallel_compress_write_cb(archive *a, void *userdata,
+                                             const void *buf, size_t size)
+{
+    auto writer = static_cast<ParallelCompressWriter *>(userdata);
+
+    if (!writer->write(buf, size)) {
+        archive_set_error(a, EIO, "Failed to compress archive data");
+        return -1;
+    }
+
+    return static_cast<la_ssize_t>(size);
+}
+
+static int parallel_compress_close_cb(archive *a, void *userdata)
+{
+    auto writer = static_cast<ParallelCompressWriter *>(userdata);
+
+    if (!writer->finish()) {
+        archive_set_error(a, EIO, "Failed to compress archive data");
+        return ARCHIVE_FATAL;
+    }
+
+    return ARCHIVE_OK;
+}
+
+/*!
+ * \brief Decompressed archive input with decompression on a separate thread
+ *
+ * A reader thread uses libarchive's decompression filters with the raw format
+ * handler to decompress the file and hands the data to the thread extracting
+ * the archive in chunks. This way, decompression runs concurrently with
+ * parsing the archive and writing the files to disk.
+ */
+class PipelinedDecompressReader
+{
+public:
+    PipelinedDecompressReader(compression_type compression)
+        : _compression(compression)
+    {
+    }
+
+    ~PipelinedDecompressReader()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _cancelled = true;
+        }
+        _cv.notify_all();
+
+        if (_thread.joinable()) {
+            _thread.join();
+        }
+    }
+
+    PipelinedDecompressReader(const PipelinedDecompressReader &) = delete;
+    PipelinedDecompressReader & operator=(const PipelinedDecompressReader &) = delete;
+
+    void start(const std::string &filename)
+    {
+        _thread = std::thread(&PipelinedDecompressReader::reader, this,
+                              filename);
+    }
+
+    /*!
+     * \brief Get the next chunk of decompressed data
+     *
+     * The returned buffer is valid until the next call.
+     *
+     * \return Size of the chunk, 0 on EOF, or -1 on error
+     */
+    la_ssize_t read(const void **buf)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{ return !_chunks.empty() || _eof || _failed; });
+
+        if (_chunks.empty()) {
+            return _failed ? -1 : 0;
+        }
+
+        _current = std::move(_chunks.front());
+        _chunks.pop_front();
+        lock.unlock();
+        _cv.notify_all();
+
+        *buf = _current.data();
+        return static_cast<la_ssize_t>(_current.size());
+    }
+
+    const std::string & error() const
+    {
+        return _error_msg;
+    }
+
+private:
+    bool push(std::string chunk)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait(lock, [&]{
+            return _chunks.size() < PIPELINE_MAX_CHUNKS || _cancelled;
+        });
+        if (_cancelled) {
+            return false;
+        }
+
+        _chunks.push_back(std::move(chunk));
+        lock.unlock();
+        _cv.notify_all();
+        return true;
+    }
+
+    void set_result(bool ok, std::string error_msg)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (ok) {
+                _eof = true;
+            } else {
+                _error_msg = std::move(error_msg);
+                _failed = true;
+            }
+        }
+        _cv.notify_all();
+    }
+
+    void reader(std::string filename)
+    {
+        autoclose::archive in(archive_read_new(), archive_read_free);
+        if (!in) {
+            set_result(false, "Out of memory when creating archive reader");
+            return;
+        }
+
+        archive_read_support_format_raw(in.get());
+
+        switch (_compression) {
+        case compression_type::LZ4:
+            archive_read_support_filter_lz4(in.get());
+            break;
+        case compression_type::GZIP:
+            archive_read_support_filter_gzip(in.get());
+            break;
+        case compression_type::XZ:
+            archive_read_support_filter_xz(in.get());
+            break;
+        default:
+            break;
+        }
+
+        archive_entry *entry;
+
+        if (archive_read_open_filename(
+                in.get(), filename.c_str(), 10240) != ARCHIVE_OK
+                || archive_read_next_header(in.get(), &entry) != ARCHIVE_OK) {
+            set_result(false, archive_error_string(in.get()));
+            return;
+        }
+
+        while (true) {
+            std::string chunk(PIPELINE_CHUNK_SIZE, '\0');
+
+            la_ssize_t n = archive_read_data(in.get(), &chunk[0], chunk.size());
+            if (n < 0) {
+                set_result(false, archive_error_string(in.get()));
+                return;
+            } else if (n == 0) {
+                break;
+            }
+
+            chunk.resize(static_cast<size_t>(n));
+            if (!push(std::move(chunk))) {
+                return;
+            }
+        }
+
+        set_result(true, {});
+    }
+
+    compression_type _compression;
+    std::thread _thread;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::string> _chunks;
+    std::string _current;
+    bool _eof = false;
+    bool _failed = false;
+    bool _cancelled = false;
+    std::string _error_msg;
+};
+
+static la_ssize_t pipelined_decompress_read_cb(archive *a, void *userdata,
+                                               const void **buf)
+{
+    auto reader = static_cast<PipelinedDecompressReader *>(userdata);
+
+    la_ssize_t n = reader->read(buf);
+    if (n < 0) {
+        archive_set_error(a, EIO, "%s", reader->error().c_str());
+    }
+
+    return n;
+}
+
 /*
  * The following libarchive functions are based on code from bsdtar. The main
  * difference is that they will not try to extract/add as many files as possible
@@ -173,7 +711,9 @@ int libarchive_copy_header_and_data(archive *in, archive *out,
 bool libarchive_tar_extract(const std::string &filename,
                             const std::string &target,
                             const std::vector<std::string> &patterns,
-                            compression_type compression)
+                            compression_type compression,
+                            TarDataStore *store,
+                            TarEntryFilter *filter)
 {
     if (target.empty()) {
         LOGE("%s: Invalid target path for extraction", target.c_str());
@@ -211,15 +751,9 @@ bool libarchive_tar_extract(const std::string &filename,
 
     switch (compression) {
     case compression_type::NONE:
-        break;
     case compression_type::LZ4:
-        archive_read_support_filter_lz4(in.get());
-        break;
     case compression_type::GZIP:
-        archive_read_support_filter_gzip(in.get());
-        break;
     case compression_type::XZ:
-        archive_read_support_filter_xz(in.get());
         break;
     default:
         LOGE("Invalid compression type");
@@ -230,15 +764,26 @@ bool libarchive_tar_extract(const std::string &filename,
     archive_write_disk_set_standard_lookup(out.get());
     archive_write_disk_set_options(out.get(), LIBARCHIVE_DISK_WRITER_FLAGS);
 
-    if (archive_read_open_filename(
-            in.get(), filename.c_str(), 10240) != ARCHIVE_OK) {
+    // Compressed archives are decompressed on a separate thread
+    std::unique_ptr<PipelinedDecompressReader> decompressor;
+    int ret;
+
+    if (compression == compression_type::NONE) {
+        ret = archive_read_open_filename(in.get(), filename.c_str(), 10240);
+    } else {
+        decompressor.reset(new PipelinedDecompressReader(compression));
+        decompressor->start(filename);
+
+        ret = archive_read_open(in.get(), decompressor.get(), nullptr,
+                                &pipelined_decompress_read_cb, nullptr);
+    }
+    if (ret != ARCHIVE_OK) {
         LOGE("%s: Failed to open file: %s",
              filename.c_str(), archive_error_string(in.get()));
         return false;
     }
 
     archive_entry *entry;
-    int ret;
     std::string target_path;
 
     while (true) {
@@ -271,11 +816,35 @@ bool libarchive_tar_extract(const std::string &filename,
 
         archive_entry_set_pathname(entry, target_path.c_str());
 
+        // Hard link targets are relative to the archive root too
+        const char *hardlink = archive_entry_hardlink(entry);
+        if (hardlink && *hardlink != '/') {
+            target_path = target;
+            if (target_path.back() != '/') {
+                target_path += '/';
+            }
+            target_path += hardlink;
+
+            archive_entry_set_hardlink(entry, target_path.c_str());
+        }
+
         // Check pattern matches
         if (archive_match_excluded(matcher.get(), entry)) {
             continue;
         }
 
+        if (filter && !filter->include(entry)) {
+            continue;
+        }
+
+        // Data kept outside of the archive is written by the store
+        if (store && store->is_stored(entry)) {
+            if (!store->load(entry, out.get())) {
+                return false;
+            }
+            continue;
+        }
+
         // Extract file
         ret = archive_read_extract2(in.get(), entry, out.get());
         if (ret != ARCHIVE_OK) {
@@ -304,10 +873,22 @@ bool libarchive_tar_extract(const std::string &filename,
     return archive_match_path_unmatched_inclusions(matcher.get()) == 0;
 }
 
-static bool write_file(archive *in, archive *out, archive_entry *entry)
+static bool write_file(archive *in, archive *out, archive_entry *entry,
+                       TarDataStore *store)
 {
     int ret;
 
+    // Hard links after the first have no data of their own
+    if (store && archive_entry_filetype(entry) == AE_IFREG
+            && archive_entry_size(entry) > 0
+            && !archive_entry_hardlink(entry)) {
+        if (!store->store(in, entry)) {
+            return false;
+        }
+        archive_entry_set_size(entry, 0);
+        archive_entry_sparse_clear(entry);
+    }
+
     ret = archive_write_header(out, entry);
     if (ret != ARCHIVE_OK) {
         LOGE("%s: %s", archive_entry_pathname(entry), archive_error_string(out));
@@ -332,25 +913,129 @@ static int metadata_filter(archive *a, void *data, archive_entry *entry)
     return 1;
 }
 
+/*!
+ * \brief Open a pax archive for writing
+ *
+ * \param out Archive writer
+ * \param filename Target archive path
+ * \param compression Compression type
+ * \param adaptive Whether to pick the compression level based on the
+ *                 throughput of the destination
+ * \param[out] compressor Set to the parallel compressor used for gzip and
+ *                        LZ4. It must be destroyed after \p out.
+ *
+ * \return Whether the archive was successfully opened
+ */
+static bool open_archive_writer(
+        archive *out, const std::string &filename,
+        compression_type compression, bool adaptive,
+        std::unique_ptr<ParallelCompressWriter> &compressor)
+{
+    int ret;
+
+    // Set up archive writer parameters
+    // NOTE: We are creating POSIX pax archives instead of GNU tar archives
+    //       because libarchive's GNU tar writer is very limited. In particular,
+    //       it does not support storing sparse file information, xattrs, or
+    //       ACLs. Since this information is stored as extended attributes in
+    //       the pax archive, the GNU tar tool will not be able to extract any
+    //       of this additional metadata. In other words, extracting and
+    //       repacking a backup on a Linux machine with GNU tar will render the
+    //       backup useless.
+    //archive_write_set_format_gnutar(out);
+    archive_write_set_format_pax_restricted(out);
+    archive_write_set_bytes_per_block(out, 10240);
+
+    switch (compression) {
+    case compression_type::NONE:
+        break;
+    case compression_type::LZ4:
+    case compression_type::GZIP:
+        compressor.reset(new ParallelCompressWriter(compression, adaptive));
+        break;
+    case compression_type::XZ: {
+        archive_write_add_filter_xz(out);
+
+        if (adaptive) {
+            LOGW("%s: Adaptive compression is not supported for xz",
+                 filename.c_str());
+        }
+
+        // Use liblzma's multithreaded encoder if available
+        char threads[16];
+        snprintf(threads, sizeof(threads), "%u",
+                 std::max(1u, std::thread::hardware_concurrency()));
+        if (archive_write_set_filter_option(
+                out, "xz", "threads", threads) != ARCHIVE_OK) {
+            LOGW("%s: Multithreaded xz compression is not supported: %s",
+                 filename.c_str(), archive_error_string(out));
+        }
+        break;
+    }
+    default:
+        LOGE("Invalid compression type");
+        return false;
+    }
+
+    // Open output file
+    if (compressor) {
+        if (!compressor->open(filename)) {
+            return false;
+        }
+        ret = archive_write_open(out, compressor.get(), nullptr,
+                                 &parallel_compress_write_cb,
+                                 &parallel_compress_close_cb);
+    } else {
+        ret = archive_write_open_filename(out, filename.c_str());
+    }
+    if (ret != ARCHIVE_OK) {
+        LOGE("%s: Failed to open file: %s",
+             filename.c_str(), archive_error_string(out));
+        return false;
+    }
+
+    return true;
+}
+
 /*!
  * \brief Create pax archive with all metadata
  *
+ * gzip and LZ4 compression is done in independent batches on a pool of
+ * threads. xz compression uses liblzma's multithreaded encoder.
+ *
+ * If \p adaptive is true, gzip and LZ4 batches are compressed at the highest
+ * level that still keeps up with the destination. See ParallelCompressWriter.
+ *
  * \param filename Target archive path
  * \param base_dir Base directory for \a paths
  * \param paths List of paths to add to the archive
+ * \param compression Compression type
+ * \param store If not null, where the contents of regular files are stored
+ *              instead of the archive
+ * \param filter If not null, decides which entries are added to the archive
+ * \param adaptive Whether to pick the compression level based on the
+ *                 throughput of the destination
  *
  * \return Whether the archive creation was successful
  */
 bool libarchive_tar_create(const std::string &filename,
                            const std::string &base_dir,
                            const std::vector<std::string> &paths,
-                           compression_type compression)
+                           compression_type compression,
+                           TarDataStore *store,
+                           TarEntryFilter *filter,
+                           bool adaptive)
 {
     if (base_dir.empty() && paths.empty()) {
         LOGE("%s: No base directory or paths specified", filename.c_str());
         return false;
     }
 
+    // gzip and LZ4 compression is done on a pool of threads. This must be
+    // destroyed after the writer, which flushes it when closed.
+    std::unique_ptr<ParallelCompressWriter> compressor;
+    int ret;
+
     autoclose::archive in(archive_read_disk_new(), archive_read_free);
     if (!in) {
         LOGE("%s: Out of memory when creating disk reader", __FUNCTION__);
@@ -376,33 +1061,8 @@ bool libarchive_tar_create(const std::string &filename,
     // We don't want to look up usernames and group names on Android
     //archive_read_disk_set_standard_lookup(in.get());
 
-    // Set up archive writer parameters
-    // NOTE: We are creating POSIX pax archives instead of GNU tar archives
-    //       because libarchive's GNU tar writer is very limited. In particular,
-    //       it does not support storing sparse file information, xattrs, or
-    //       ACLs. Since this information is stored as extended attributes in
-    //       the pax archive, the GNU tar tool will not be able to extract any
-    //       of this additional metadata. In other words, extracting and
-    //       repacking a backup on a Linux machine with GNU tar will render the
-    //       backup useless.
-    //archive_write_set_format_gnutar(out.get());
-    archive_write_set_format_pax_restricted(out.get());
-    archive_write_set_bytes_per_block(out.get(), 10240);
-
-    switch (compression) {
-    case compression_type::NONE:
-        break;
-    case compression_type::LZ4:
-        archive_write_add_filter_lz4(out.get());
-        break;
-    case compression_type::GZIP:
-        archive_write_add_filter_gzip(out.get());
-        break;
-    case compression_type::XZ:
-        archive_write_add_filter_xz(out.get());
-        break;
-    default:
-        LOGE("Invalid compression type");
+    if (!open_archive_writer(out.get(), filename, compression, adaptive,
+                             compressor)) {
         return false;
     }
 
@@ -410,16 +1070,8 @@ bool libarchive_tar_create(const std::string &filename,
     archive_entry_linkresolver_set_strategy(resolver.get(),
                                             archive_format(out.get()));
 
-    // Open output file
-    if (archive_write_open_filename(out.get(), filename.c_str()) != ARCHIVE_OK) {
-        LOGE("%s: Failed to open file: %s",
-             filename.c_str(), archive_error_string(out.get()));
-        return false;
-    }
-
     archive_entry *entry = nullptr;
     archive_entry *sparse_entry = nullptr;
-    int ret;
     std::string full_path;
 
     // Add hierarchies
@@ -489,14 +1141,19 @@ bool libarchive_tar_create(const std::string &filename,
                 LOGW("%s: Skipping socket", archive_entry_pathname(entry));
                 continue;
             default:
-                LOGV("%s", archive_entry_pathname(entry));
                 break;
             }
 
+            if (filter && !filter->include(entry)) {
+                continue;
+            }
+
+            LOGV("%s", archive_entry_pathname(entry));
+
             archive_entry_linkify(resolver.get(), &entry, &sparse_entry);
 
             if (entry) {
-                if (!write_file(in.get(), out.get(), entry)) {
+                if (!write_file(in.get(), out.get(), entry, store)) {
                     archive_entry_free(entry);
                     return false;
                 }
@@ -504,7 +1161,7 @@ bool libarchive_tar_create(const std::string &filename,
                 entry = nullptr;
             }
             if (sparse_entry) {
-                if (!write_file(in.get(), out.get(), sparse_entry)) {
+                if (!write_file(in.get(), out.get(), sparse_entry, store)) {
                     archive_entry_free(sparse_entry);
                     return false;
                 }
@@ -548,7 +1205,7 @@ bool libarchive_tar_create(const std::string &filename,
             return false;
         }
 
-        if (!write_file(in.get(), out.get(), entry)) {
+        if (!write_file(in.get(), out.get(), entry, store)) {
             archive_entry_free(entry);
             return false;
         }
@@ -566,6 +1223,164 @@ bool libarchive_tar_create(const std::string &filename,
     return true;
 }
 
+static bool write_zeros(archive *out, uint64_t size, const char *name)
+{
+    static const char null_buf[64 * 1024] = {};
+
+    while (size > 0) {
+        size_t n = static_cast<size_t>(
+                std::min<uint64_t>(size, sizeof(null_buf)));
+
+        la_ssize_t bytes_written = archive_write_data(out, null_buf, n);
+        if (bytes_written < 0) {
+            LOGE("%s: %s", name, archive_error_string(out));
+            return false;
+        } else if (static_cast<size_t>(bytes_written) < n) {
+            LOGE("%s: Truncated write", name);
+            return false;
+        }
+
+        size -= n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Create pax archive containing a single sparse file
+ *
+ * Only the byte ranges in \p extents are read from \p path and stored in the
+ * archive. Everything else is recorded as holes, which are not written when
+ * the archive is extracted. This is meant for disk images where the used
+ * ranges are known from the filesystem's own metadata.
+ *
+ * \param filename Target archive path
+ * \param path File to add to the archive
+ * \param name Path of the file in the archive
+ * \param extents Ordered, non-overlapping byte ranges of \p path to store
+ * \param compression Compression type
+ * \param adaptive Whether to pick the compression level based on the
+ *                 throughput of the destination
+ *
+ * \return Whether the archive creation was successful
+ */
+bool libarchive_tar_create_sparse(const std::string &filename,
+                                  const std::string &path,
+                                  const std::string &name,
+                                  const std::vector<sparse_extent> &extents,
+                                  compression_type compression,
+                                  bool adaptive)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    uint64_t size = static_cast<uint64_t>(sb.st_size);
+    for (auto const &extent : extents) {
+        if (extent.offset > size || extent.length > size - extent.offset) {
+            LOGE("%s: Extent %" PRIu64 "-%" PRIu64 " is past end of file",
+                 path.c_str(), extent.offset, extent.offset + extent.length);
+            return false;
+        }
+    }
+
+    // Must be destroyed after the writer, which flushes it when closed
+    std::unique_ptr<ParallelCompressWriter> compressor;
+
+    autoclose::archive out(archive_write_new(), archive_write_free);
+    if (!out) {
+        LOGE("%s: Out of memory when creating archive writer", __FUNCTION__);
+        return false;
+    }
+    autoclose::archive_entry entry(archive_entry_new(), archive_entry_free);
+    if (!entry) {
+        LOGE("%s: Out of memory when creating archive entry", __FUNCTION__);
+        return false;
+    }
+
+    if (!open_archive_writer(out.get(), filename, compression, adaptive,
+                             compressor)) {
+        return false;
+    }
+
+    archive_entry_copy_stat(entry.get(), &sb);
+    archive_entry_set_pathname(entry.get(), name.c_str());
+    for (auto const &extent : extents) {
+        archive_entry_sparse_add_entry(
+                entry.get(), static_cast<la_int64_t>(extent.offset),
+                static_cast<la_int64_t>(extent.length));
+    }
+
+    if (archive_write_header(out.get(), entry.get()) != ARCHIVE_OK) {
+        LOGE("%s: Failed to write header: %s",
+             name.c_str(), archive_error_string(out.get()));
+        return false;
+    }
+
+    // The pax writer expects the whole file and skips the holes itself
+    std::vector<char> buf(1024 * 1024);
+    uint64_t offset = 0;
+
+    for (auto const &extent : extents) {
+        if (!write_zeros(out.get(), extent.offset - offset, name.c_str())) {
+            return false;
+        }
+        offset = extent.offset;
+
+        uint64_t remain = extent.length;
+        while (remain > 0) {
+            size_t to_read = static_cast<size_t>(
+                    std::min<uint64_t>(remain, buf.size()));
+
+            ssize_t n = pread64(fd, buf.data(), to_read,
+                                static_cast<off64_t>(offset));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                LOGE("%s: Failed to read: %s", path.c_str(),
+                     n == 0 ? "Unexpected EOF" : strerror(errno));
+                return false;
+            }
+
+            la_ssize_t bytes_written = archive_write_data(
+                    out.get(), buf.data(), static_cast<size_t>(n));
+            if (bytes_written < 0) {
+                LOGE("%s: %s", name.c_str(), archive_error_string(out.get()));
+                return false;
+            } else if (bytes_written < n) {
+                LOGE("%s: Truncated write", name.c_str());
+                return false;
+            }
+
+            offset += static_cast<uint64_t>(n);
+            remain -= static_cast<uint64_t>(n);
+        }
+    }
+
+    if (!write_zeros(out.get(), size - offset, name.c_str())) {
+        return false;
+    }
+
+    if (archive_write_close(out.get()) != ARCHIVE_OK) {
+        LOGE("%s: %s", filename.c_str(), archive_error_string(out.get()));
+        return false;
+    }
+
+    return true;
+}
+
 static bool set_up_input(archive *in, const std::string &filename)
 {
     // Add more as needed
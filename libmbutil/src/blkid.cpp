@@ -19,12 +19,22 @@
 
 #include "mbutil/blkid.h"
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <cerrno>
+#include <cinttypes>
+#include <cstdio>
 #include <cstring>
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "mbutil/finally.h"
@@ -32,11 +42,20 @@
 // NOTE: We don't use libblkid from util-linux because we don't need most of its
 // features and it increases mbtool's binary size more than 200KiB (armeabi-v7a)
 
+// Number of bytes to read from the beginning of the device. This must cover the
+// last byte examined by any of the probe functions below (btrfs's label)
+#define PROBE_SIZE              (64 * 1024 + 4 * 1024)
+
+// Maximum number of devices to probe concurrently in blkid_probe_all()
+#define MAX_PROBE_THREADS       8
+
 namespace mb
 {
 namespace util
 {
 
+typedef const unsigned char *Bytes;
+
 static inline bool check_magic(const void *data, size_t data_size,
                                const void *magic, size_t magic_size,
                                size_t offset)
@@ -94,23 +113,162 @@ static inline bool is_vfat(const void *data, size_t size)
             || check_magic(data, size, "\125\252", 2, 0x1fe);
 }
 
+static inline uint32_t read_le32(Bytes data, size_t offset)
+{
+    return static_cast<uint32_t>(data[offset])
+            | static_cast<uint32_t>(data[offset + 1]) << 8
+            | static_cast<uint32_t>(data[offset + 2]) << 16
+            | static_cast<uint32_t>(data[offset + 3]) << 24;
+}
+
+static inline uint64_t read_le64(Bytes data, size_t offset)
+{
+    return static_cast<uint64_t>(read_le32(data, offset))
+            | static_cast<uint64_t>(read_le32(data, offset + 4)) << 32;
+}
+
+/*!
+ * \brief Format a 16-byte UUID in the usual 8-4-4-4-12 form
+ */
+static std::string format_uuid(Bytes data, size_t offset)
+{
+    char buf[37];
+    char *ptr = buf;
+
+    for (size_t i = 0; i < 16; ++i) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            *ptr++ = '-';
+        }
+        ptr += sprintf(ptr, "%02x", data[offset + i]);
+    }
+
+    return buf;
+}
+
+/*!
+ * \brief Format a 32-bit FAT/exFAT volume serial number as XXXX-XXXX
+ */
+static std::string format_serial32(Bytes data, size_t offset)
+{
+    uint32_t serial = read_le32(data, offset);
+
+    char buf[10];
+    snprintf(buf, sizeof(buf), "%04X-%04X", serial >> 16, serial & 0xffff);
+    return buf;
+}
+
+/*!
+ * \brief Get fixed-size label with trailing spaces and NULL bytes removed
+ */
+static std::string get_label(Bytes data, size_t offset, size_t size)
+{
+    const char *begin = reinterpret_cast<const char *>(data + offset);
+    const char *end = static_cast<const char *>(memchr(begin, '\0', size));
+    if (!end) {
+        end = begin + size;
+    }
+
+    while (end > begin && *(end - 1) == ' ') {
+        --end;
+    }
+
+    return {begin, end};
+}
+
+static void btrfs_info(Bytes data, BlkidInfo *info)
+{
+    info->uuid = format_uuid(data, 64 * 1024 + 0x20);
+    info->label = get_label(data, 64 * 1024 + 0x12b, 256);
+}
+
+static void exfat_info(Bytes data, BlkidInfo *info)
+{
+    // The label is stored in the root directory, which is not read
+    info->uuid = format_serial32(data, 0x64);
+}
+
+static void ext_info(Bytes data, BlkidInfo *info)
+{
+    info->uuid = format_uuid(data, 0x400 + 0x68);
+    info->label = get_label(data, 0x400 + 0x78, 16);
+}
+
+static void f2fs_info(Bytes data, BlkidInfo *info)
+{
+    info->uuid = format_uuid(data, 0x400 + 0x6c);
+
+    // The label is UTF-16LE. Only keep it if it is plain ASCII
+    for (size_t offset = 0x400 + 0x7c; offset < 0x400 + 0x7c + 512 * 2;
+            offset += 2) {
+        if (data[offset + 1] != 0 || data[offset] >= 0x80) {
+            info->label.clear();
+            break;
+        } else if (data[offset] == 0) {
+            break;
+        }
+        info->label += static_cast<char>(data[offset]);
+    }
+}
+
+static void ntfs_info(Bytes data, BlkidInfo *info)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016" PRIX64, read_le64(data, 0x48));
+    info->uuid = buf;
+}
+
+static void vfat_info(Bytes data, BlkidInfo *info)
+{
+    // FAT32 has a larger BPB, which moves the extended boot signature fields
+    bool fat32 = check_magic(data, PROBE_SIZE, "FAT32   ", 8, 0x52);
+    size_t serial_offset = fat32 ? 0x43 : 0x27;
+    size_t label_offset = fat32 ? 0x47 : 0x2b;
+
+    info->uuid = format_serial32(data, serial_offset);
+    info->label = get_label(data, label_offset, 11);
+    if (info->label == "NO NAME") {
+        info->label.clear();
+    }
+}
+
 struct probe_func
 {
     const char *name;
     bool (*func)(const void *, size_t);
+    // Only called with a buffer of at least PROBE_SIZE bytes
+    void (*info)(Bytes, BlkidInfo *);
 };
 
 static probe_func probe_funcs[] = {
-    { "btrfs",    &is_btrfs },
-    { "exfat",    &is_exfat },
-    { "ext",      &is_ext },
-    { "f2fs",     &is_f2fs },
-    { "ntfs",     &is_ntfs },
-    { "squashfs", &is_squashfs },
-    { "vfat",     &is_vfat },
-    { nullptr,    nullptr },
+    { "btrfs",    &is_btrfs,    &btrfs_info },
+    { "exfat",    &is_exfat,    &exfat_info },
+    { "ext",      &is_ext,      &ext_info },
+    { "f2fs",     &is_f2fs,     &f2fs_info },
+    { "ntfs",     &is_ntfs,     &ntfs_info },
+    { "squashfs", &is_squashfs, nullptr },
+    { "vfat",     &is_vfat,     &vfat_info },
+    { nullptr,    nullptr,      nullptr },
 };
 
+struct ProbeCacheEntry
+{
+    uint64_t size;
+    BlkidInfo info;
+};
+
+/*!
+ * \brief Probe results for block devices, keyed on the device number
+ *
+ * Entries are validated against the device size on lookup and are dropped by
+ * blkid_invalidate() when the device changes (eg. when a uevent is received
+ * for it). The generation counter is incremented on every invalidation so that
+ * a probe that was running concurrently with an invalidation does not store a
+ * stale result.
+ */
+static std::mutex probe_cache_lock;
+static std::unordered_map<dev_t, ProbeCacheEntry> probe_cache;
+static uint64_t probe_cache_generation = 0;
+
 static ssize_t read_all(int fd, void *buf, size_t size)
 {
     size_t total = 0;
@@ -133,10 +291,38 @@ static ssize_t read_all(int fd, void *buf, size_t size)
     return total;
 }
 
-bool blkid_get_fs_type(const char *path, const char **type)
+static void probe_buffer(const unsigned char *data, size_t size,
+                         BlkidInfo *info)
 {
-    std::vector<unsigned char> buf(1024 * 1024);
+    *info = {};
 
+    for (auto it = probe_funcs; it->name; ++it) {
+        if (it->func(data, size)) {
+            info->type = it->name;
+            if (it->info && size >= PROBE_SIZE) {
+                it->info(data, info);
+            }
+            break;
+        }
+    }
+}
+
+/*!
+ * \brief Probe the filesystem on a block device or file
+ *
+ * For block devices, the results are cached until blkid_invalidate() or
+ * blkid_invalidate_all() is called for the device or the device size changes.
+ * Only the first `PROBE_SIZE` bytes of the device are read.
+ *
+ * \param[in] path Path to block device or file
+ * \param[out] info Pointer to store filesystem information. If the filesystem
+ *                  is unknown, `info->type` is set to nullptr.
+ *
+ * \return True if the device was successfully read. False with errno set if
+ *         the device could not be opened or read.
+ */
+bool blkid_probe(const char *path, BlkidInfo *info)
+{
     int fd = open(path, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
         return false;
@@ -148,19 +334,119 @@ bool blkid_get_fs_type(const char *path, const char **type)
         errno = saved_errno;
     });
 
+    struct stat sb;
+    uint64_t size = 0;
+    bool cacheable = fstat(fd, &sb) == 0 && S_ISBLK(sb.st_mode)
+            && ioctl(fd, BLKGETSIZE64, &size) == 0;
+    uint64_t generation = 0;
+
+    if (cacheable) {
+        std::lock_guard<std::mutex> lock(probe_cache_lock);
+
+        auto it = probe_cache.find(sb.st_rdev);
+        if (it != probe_cache.end()) {
+            if (it->second.size == size) {
+                *info = it->second.info;
+                return true;
+            }
+            probe_cache.erase(it);
+        }
+
+        generation = probe_cache_generation;
+    }
+
+    std::vector<unsigned char> buf(PROBE_SIZE);
+
     ssize_t n = read_all(fd, buf.data(), buf.size());
     if (n < 0) {
         return false;
     }
 
-    for (auto it = probe_funcs; it->name; ++it) {
-        if (it->func(buf.data(), n)) {
-            *type = it->name;
-            return true;
+    probe_buffer(buf.data(), n, info);
+
+    if (cacheable) {
+        std::lock_guard<std::mutex> lock(probe_cache_lock);
+
+        if (generation == probe_cache_generation) {
+            probe_cache[sb.st_rdev] = { size, *info };
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Probe multiple devices concurrently
+ *
+ * This populates the cache for all of the block devices in \a paths, so that
+ * subsequent calls to blkid_probe() or blkid_get_fs_type() for those devices
+ * do not need to read from the devices. This is useful when a list of candidate
+ * devices is known ahead of time, since most of the time spent probing is
+ * waiting for the superblock reads to complete. Errors are ignored and will be
+ * reported by the subsequent calls.
+ *
+ * \param paths Paths to block devices
+ */
+void blkid_probe_all(const std::vector<std::string> &paths)
+{
+    std::atomic<size_t> next(0);
+
+    auto worker = [&]{
+        size_t i;
+        while ((i = next++) < paths.size()) {
+            BlkidInfo info;
+            blkid_probe(paths[i].c_str(), &info);
         }
+    };
+
+    size_t threads = std::min<size_t>(paths.size(), MAX_PROBE_THREADS);
+
+    if (threads <= 1) {
+        worker();
+    } else {
+        std::vector<std::thread> pool;
+        pool.reserve(threads);
+
+        for (size_t i = 0; i < threads; ++i) {
+            pool.emplace_back(worker);
+        }
+        for (auto &t : pool) {
+            t.join();
+        }
+    }
+}
+
+/*!
+ * \brief Drop the cached probe result for a device
+ *
+ * \param dev Device number of the block device
+ */
+void blkid_invalidate(dev_t dev)
+{
+    std::lock_guard<std::mutex> lock(probe_cache_lock);
+    probe_cache.erase(dev);
+    ++probe_cache_generation;
+}
+
+/*!
+ * \brief Drop all cached probe results
+ */
+void blkid_invalidate_all()
+{
+    std::lock_guard<std::mutex> lock(probe_cache_lock);
+    probe_cache.clear();
+    ++probe_cache_generation;
+}
+
+bool blkid_get_fs_type(const char *path, const char **type)
+{
+    BlkidInfo info;
+
+    if (!blkid_probe(path, &info)) {
+        return false;
     }
 
-    *type = nullptr;
+    *type = info.type;
     return true;
 }
 
@@ -23,12 +23,13 @@
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/fts.h"
+#include "mbutil/dirwalk.h"
 #include "mbutil/string.h"
 
 namespace mb
@@ -36,10 +37,10 @@ namespace mb
 namespace util
 {
 
-class RecursiveChmod : public FTSWrapper {
+class RecursiveChmod : public DirWalker {
 public:
     RecursiveChmod(std::string path, mode_t perms)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        : DirWalker(path, 0),
         _perms(perms)
     {
     }
@@ -48,30 +49,30 @@ public:
     {
         // Do nothing. Need depth-first search, so directories are deleted in
         // on_reached_directory_post()
-        return Action::FTS_OK;
+        return Action::DW_OK;
     }
 
     virtual int on_reached_directory_post() override
     {
-        return chmod_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chmod_path() ? Action::DW_OK : Action::DW_Fail;
     }
 
     virtual int on_reached_file() override
     {
-        return chmod_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chmod_path() ? Action::DW_OK : Action::DW_Fail;
     }
 
     virtual int on_reached_symlink() override
     {
         // Avoid security issue
         LOGW("%s: Not setting permissions on symlink",
-             _curr->fts_path);
-        return Action::FTS_Skip;
+             _curr->path);
+        return Action::DW_Skip;
     }
 
     virtual int on_reached_special_file() override
     {
-        return chmod_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chmod_path() ? Action::DW_OK : Action::DW_Fail;
     }
 
 private:
@@ -79,9 +80,9 @@ private:
 
     bool chmod_path()
     {
-        if (::chmod(_curr->fts_accpath, _perms) < 0) {
+        if (fchmodat(_curr->dirfd, _curr->name, _perms, 0) < 0) {
             mb::format(_error_msg, "%s: Failed to chmod: %s",
-                       _curr->fts_path, strerror(errno));
+                       _curr->path, strerror(errno));
             LOGW("%s", _error_msg.c_str());
             return false;
         }
@@ -93,8 +94,8 @@ private:
 bool chmod(const std::string &path, mode_t perms, int flags)
 {
     if (flags & CHMOD_RECURSIVE) {
-        RecursiveChmod fts(path, perms);
-        return fts.run();
+        RecursiveChmod walker(path, perms);
+        return walker.run();
     } else {
         return ::chmod(path.c_str(), perms) == 0;
     }
@@ -22,15 +22,19 @@
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
+#include <mutex>
+#include <unordered_map>
 
+#include <fcntl.h>
 #include <grp.h>
 #include <pwd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/fts.h"
+#include "mbutil/dirwalk.h"
 #include "mbutil/string.h"
 
 namespace mb
@@ -38,6 +42,114 @@ namespace mb
 namespace util
 {
 
+// Names resolved so far. Only successful lookups are cached since users and
+// groups (eg. for newly installed apps) may be added later.
+static std::unordered_map<std::string, uid_t> uid_cache;
+static std::unordered_map<std::string, gid_t> gid_cache;
+// Also serializes getpwnam() and getgrnam(), which are not thread safe
+static std::mutex id_cache_lock;
+
+static bool lookup_uid_locked(const std::string &user, uid_t *uid_out)
+{
+    auto it = uid_cache.find(user);
+    if (it != uid_cache.end()) {
+        *uid_out = it->second;
+        return true;
+    }
+
+    errno = 0;
+    struct passwd *pw = getpwnam(user.c_str());
+    if (!pw) {
+        if (!errno) {
+            errno = EINVAL; // User does not exist
+        }
+        return false;
+    }
+
+    uid_cache[user] = pw->pw_uid;
+    *uid_out = pw->pw_uid;
+    return true;
+}
+
+static bool lookup_gid_locked(const std::string &group, gid_t *gid_out)
+{
+    auto it = gid_cache.find(group);
+    if (it != gid_cache.end()) {
+        *gid_out = it->second;
+        return true;
+    }
+
+    errno = 0;
+    struct group *gr = getgrnam(group.c_str());
+    if (!gr) {
+        if (!errno) {
+            errno = EINVAL; // Group does not exist
+        }
+        return false;
+    }
+
+    gid_cache[group] = gr->gr_gid;
+    *gid_out = gr->gr_gid;
+    return true;
+}
+
+/*!
+ * \brief Look up the uid of a user
+ *
+ * Results are cached for the lifetime of the process (and inherited by forked
+ * children), so repeated lookups of the same name do not go through the
+ * passwd database (or bionic's emulation of it) again.
+ *
+ * \param[in] user User name
+ * \param[out] uid_out Pointer to store uid
+ *
+ * \return True if the user exists. False and sets errno (EINVAL if the user
+ *         does not exist) otherwise.
+ */
+bool lookup_uid(const std::string &user, uid_t *uid_out)
+{
+    std::lock_guard<std::mutex> lock(id_cache_lock);
+    return lookup_uid_locked(user, uid_out);
+}
+
+/*!
+ * \brief Look up the gid of a group
+ *
+ * \sa lookup_uid()
+ *
+ * \param[in] group Group name
+ * \param[out] gid_out Pointer to store gid
+ *
+ * \return True if the group exists. False and sets errno (EINVAL if the group
+ *         does not exist) otherwise.
+ */
+bool lookup_gid(const std::string &group, gid_t *gid_out)
+{
+    std::lock_guard<std::mutex> lock(id_cache_lock);
+    return lookup_gid_locked(group, gid_out);
+}
+
+/*!
+ * \brief Look up the uid of a user and the gid of a group at once
+ *
+ * \sa lookup_uid()
+ *
+ * \param[in] user User name
+ * \param[in] group Group name
+ * \param[out] uid_out Pointer to store uid
+ * \param[out] gid_out Pointer to store gid
+ *
+ * \return True if both the user and group exist. False and sets errno (EINVAL
+ *         if either does not exist) otherwise.
+ */
+bool lookup_owner(const std::string &user, const std::string &group,
+                  uid_t *uid_out, gid_t *gid_out)
+{
+    std::lock_guard<std::mutex> lock(id_cache_lock);
+    return lookup_uid_locked(user, uid_out)
+            && lookup_gid_locked(group, gid_out);
+}
+
 static bool chown_internal(const std::string &path,
                            uid_t uid,
                            gid_t gid,
@@ -50,11 +162,11 @@ static bool chown_internal(const std::string &path,
     }
 }
 
-class RecursiveChown : public FTSWrapper {
+class RecursiveChown : public DirWalker {
 public:
     RecursiveChown(std::string path, uid_t uid, gid_t gid,
                    bool follow_symlinks)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        : DirWalker(path, 0),
         _uid(uid),
         _gid(gid),
         _follow_symlinks(follow_symlinks)
@@ -63,22 +175,22 @@ public:
 
     virtual int on_reached_directory_post() override
     {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chown_path() ? Action::DW_OK : Action::DW_Fail;
     }
 
     virtual int on_reached_file() override
     {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chown_path() ? Action::DW_OK : Action::DW_Fail;
     }
 
     virtual int on_reached_symlink() override
     {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chown_path() ? Action::DW_OK : Action::DW_Fail;
     }
 
     virtual int on_reached_special_file() override
     {
-        return chown_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return chown_path() ? Action::DW_OK : Action::DW_Fail;
     }
 
 private:
@@ -86,11 +198,31 @@ private:
     gid_t _gid;
     bool _follow_symlinks;
 
+    // The walker's lstat() result describes the link itself, so it can only
+    // be trusted for symlinks if they are not followed
+    bool owner_matches()
+    {
+        if (_follow_symlinks && S_ISLNK(_curr->sb.st_mode)) {
+            return false;
+        }
+
+        return (_uid == static_cast<uid_t>(-1) || _curr->sb.st_uid == _uid)
+                && (_gid == static_cast<gid_t>(-1) || _curr->sb.st_gid == _gid);
+    }
+
     bool chown_path()
     {
-        if (!chown_internal(_curr->fts_accpath, _uid, _gid, _follow_symlinks)) {
+        int flags = _follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW;
+
+        // Skip entries that are already owned correctly so that re-running a
+        // recursive chown on an unchanged tree does not modify anything
+        if (owner_matches()) {
+            return true;
+        }
+
+        if (fchownat(_curr->dirfd, _curr->name, _uid, _gid, flags) < 0) {
             mb::format(_error_msg, "%s: Failed to chown: %s",
-                       _curr->fts_path, strerror(errno));
+                       _curr->path, strerror(errno));
             LOGW("%s", _error_msg.c_str());
             return false;
         }
@@ -98,7 +230,6 @@ private:
     }
 };
 
-// WARNING: Not thread safe! Android doesn't have getpwnam_r() or getgrnam_r()
 bool chown(const std::string &path,
            const std::string &user,
            const std::string &group,
@@ -107,26 +238,8 @@ bool chown(const std::string &path,
     uid_t uid;
     gid_t gid;
 
-    errno = 0;
-    struct passwd *pw = getpwnam(user.c_str());
-    if (!pw) {
-        if (!errno) {
-            errno = EINVAL; // User does not exist
-        }
+    if (!lookup_owner(user, group, &uid, &gid)) {
         return false;
-    } else {
-        uid = pw->pw_uid;
-    }
-
-    errno = 0;
-    struct group *gr = getgrnam(group.c_str());
-    if (!gr) {
-        if (!errno) {
-            errno = EINVAL; // Group does not exist
-        }
-        return false;
-    } else {
-        gid = gr->gr_gid;
     }
 
     return chown(path, uid, gid, flags);
@@ -138,8 +251,8 @@ bool chown(const std::string &path,
            int flags)
 {
     if (flags & CHOWN_RECURSIVE) {
-        RecursiveChown fts(path, uid, gid, flags & CHOWN_FOLLOW_SYMLINKS);
-        return fts.run();
+        RecursiveChown walker(path, uid, gid, flags & CHOWN_FOLLOW_SYMLINKS);
+        return walker.run();
     } else {
         return chown_internal(path, uid, gid, flags & CHOWN_FOLLOW_SYMLINKS);
     }
@@ -26,6 +26,8 @@
 
 #include <fcntl.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -97,8 +99,154 @@ static void initialize_priv(struct CommandCtxPriv *priv)
     priv->stderr_pipe[1] = -1;
 }
 
+enum class ChildStep
+{
+    None,
+    Chdir,
+    Chroot,
+    RedirectStdout,
+    RedirectStderr,
+    Exec,
+};
+
+/*!
+ * \brief Error reported by the child process before it exits
+ *
+ * The child shares the parent's memory until it calls exec or exits, so it
+ * stores the failing step and errno here for the parent to log.
+ */
+struct ChildError
+{
+    ChildStep step;
+    int error;
+};
+
+/*!
+ * \brief Make \a fd the target fd \a target_fd for the child
+ *
+ * The pipe fds are created with O_CLOEXEC. dup2() clears the flag on the new
+ * fd, except when \a fd is already \a target_fd, in which case the flag has to
+ * be cleared manually.
+ */
+static int redirect_fd(int fd, int target_fd)
+{
+    if (fd == target_fd) {
+        int flags = fcntl(fd, F_GETFD);
+        if (flags < 0) {
+            return -1;
+        }
+        return fcntl(fd, F_SETFD, flags & ~FD_CLOEXEC);
+    }
+
+    return dup2(fd, target_fd);
+}
+
+/*!
+ * \brief Child half of command_start()
+ *
+ * This runs in a vfork()'d child that is borrowing the parent's address space
+ * and stack. Only async-signal-safe system calls may be made here: no logging,
+ * no allocation, and no modification of state other than \a err.
+ */
+[[noreturn]]
+static void exec_child(const struct CommandCtx *ctx, const sigset_t *old_mask,
+                       volatile ChildError *err)
+{
+    // Signal handlers inherited from the parent expect the parent's state, so
+    // reset them before unblocking signals
+    for (int sig = 1; sig < NSIG; ++sig) {
+        struct sigaction sa;
+        if (sigaction(sig, nullptr, &sa) == 0
+                && sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN) {
+            sa.sa_handler = SIG_DFL;
+            sa.sa_flags = 0;
+            sigaction(sig, &sa, nullptr);
+        }
+    }
+    sigprocmask(SIG_SETMASK, old_mask, nullptr);
+
+    // Chroot if needed
+    if (ctx->chroot_dir) {
+        if (chdir(ctx->chroot_dir) < 0) {
+            err->step = ChildStep::Chdir;
+            goto error;
+        }
+        if (chroot(ctx->chroot_dir) < 0) {
+            err->step = ChildStep::Chroot;
+            goto error;
+        }
+    }
+
+    // Reassign stdout/stderr fds. The remaining pipe fds are closed by exec
+    if (ctx->redirect_stdio) {
+        if (redirect_fd(ctx->_priv->stdout_pipe[1], STDOUT_FILENO) < 0) {
+            err->step = ChildStep::RedirectStdout;
+            goto error;
+        }
+        if (redirect_fd(ctx->_priv->stderr_pipe[1], STDERR_FILENO) < 0) {
+            err->step = ChildStep::RedirectStderr;
+            goto error;
+        }
+    }
+
+    if (ctx->envp) {
+        execvpe(ctx->path, const_cast<char * const *>(ctx->argv),
+                const_cast<char * const *>(ctx->envp));
+    } else {
+        execvp(ctx->path, const_cast<char * const *>(ctx->argv));
+    }
+    err->step = ChildStep::Exec;
+
+error:
+    err->error = errno;
+    _exit(127);
+}
+
+static void log_child_error(const struct CommandCtx *ctx,
+                            const ChildError &err)
+{
+    switch (err.step) {
+    case ChildStep::Chdir:
+        LOGE("%s: Failed to chdir: %s", ctx->chroot_dir, strerror(err.error));
+        break;
+    case ChildStep::Chroot:
+        LOGE("%s: Failed to chroot: %s", ctx->chroot_dir, strerror(err.error));
+        break;
+    case ChildStep::RedirectStdout:
+        LOGE("Failed to redirect stdout: %s", strerror(err.error));
+        break;
+    case ChildStep::RedirectStderr:
+        LOGE("Failed to redirect stderr: %s", strerror(err.error));
+        break;
+    case ChildStep::Exec:
+        LOGE("%s: Failed to exec: %s", ctx->path, strerror(err.error));
+        break;
+    case ChildStep::None:
+        break;
+    }
+}
+
+/*!
+ * \brief Start a command
+ *
+ * The child is created with vfork() instead of fork(). mbtool's address space
+ * can be large (especially in the daemon) and the child immediately execs, so
+ * copying the page tables for a full fork() is wasted work. The calling thread
+ * is suspended until the child has exec'd or exited, which also means that
+ * errors that occur in the child before exec are reported synchronously. The
+ * return value of command_wait() for such a child is an exit status of 127,
+ * like before.
+ *
+ * \param ctx Command context
+ *
+ * \return Whether the process was successfully started
+ */
 bool command_start(struct CommandCtx *ctx)
 {
+    sigset_t all_mask;
+    sigset_t old_mask;
+    volatile ChildError child_error = { ChildStep::None, 0 };
+
     if (ctx->_priv                              // Process already started
             || !ctx->path                       // Invalid path
             || !ctx->argv || !ctx->argv[0]) {   // Invalid arguments
@@ -115,14 +263,17 @@ bool command_start(struct CommandCtx *ctx)
     log_command(ctx->path, ctx->log_argv ? ctx->argv : nullptr,
                 ctx->log_envp ? ctx->envp : nullptr);
 
-    // Create stdout/stderr pipe if output callback is provided
+    // Create stdout/stderr pipe if output callback is provided. The pipes are
+    // close-on-exec so that commands started concurrently from other threads
+    // do not inherit the write ends and hold the pipes open past our child's
+    // exit
     if (ctx->redirect_stdio) {
-        if (pipe(ctx->_priv->stdout_pipe) < 0) {
+        if (pipe2(ctx->_priv->stdout_pipe, O_CLOEXEC) < 0) {
             ctx->_priv->stdout_pipe[0] = -1;
             ctx->_priv->stdout_pipe[1] = -1;
             goto error;
         }
-        if (pipe(ctx->_priv->stderr_pipe) < 0) {
+        if (pipe2(ctx->_priv->stderr_pipe, O_CLOEXEC) < 0) {
             ctx->_priv->stderr_pipe[0] = -1;
             ctx->_priv->stderr_pipe[1] = -1;
             goto error;
@@ -135,70 +286,39 @@ bool command_start(struct CommandCtx *ctx)
         }
     }
 
-    ctx->_priv->pid = fork();
-    if (ctx->_priv->pid < 0) {
-        LOGE("Failed to fork: %s", strerror(errno));
-        goto error;
-    } else if (ctx->_priv->pid == 0) {
-        // Close read end of the pipes
-        if (ctx->redirect_stdio) {
-            safely_close(&ctx->_priv->stdout_pipe[0]);
-            safely_close(&ctx->_priv->stderr_pipe[0]);
-        }
-
-        // Chroot if needed
-        if (ctx->chroot_dir) {
-            if (chdir(ctx->chroot_dir) < 0) {
-                LOGE("%s: Failed to chdir: %s",
-                     ctx->chroot_dir, strerror(errno));
-                goto child_error;
-            }
-            if (chroot(ctx->chroot_dir) < 0) {
-                LOGE("%s: Failed to chroot: %s",
-                     ctx->chroot_dir, strerror(errno));
-                goto child_error;
-            }
-        }
-
-        // Reassign stdout/stderr fds
-        if (ctx->redirect_stdio) {
-            if (dup2(ctx->_priv->stdout_pipe[1], STDOUT_FILENO) < 0) {
-                LOGE("Failed to redirect stdout: %s", strerror(errno));
-                goto child_error;
-            }
-            if (dup2(ctx->_priv->stderr_pipe[1], STDERR_FILENO) < 0) {
-                LOGE("Failed to redirect stderr: %s", strerror(errno));
-                goto child_error;
-            }
+    // Block all signals so that no handler runs in the child while it is
+    // sharing our memory
+    sigfillset(&all_mask);
+    pthread_sigmask(SIG_SETMASK, &all_mask, &old_mask);
 
-            safely_close(&ctx->_priv->stdout_pipe[1]);
-            safely_close(&ctx->_priv->stderr_pipe[1]);
-        }
+    ctx->_priv->pid = vfork();
+    if (ctx->_priv->pid == 0) {
+        exec_child(ctx, &old_mask, &child_error);
+    }
 
-        if (ctx->envp) {
-            execvpe(ctx->path, const_cast<char * const *>(ctx->argv),
-                    const_cast<char * const *>(ctx->envp));
-        } else {
-            execvp(ctx->path, const_cast<char * const *>(ctx->argv));
-        }
+    {
+        int saved_errno = errno;
+        pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+        errno = saved_errno;
+    }
 
-        LOGE("%s: Failed to exec: %s", ctx->path, strerror(errno));
+    if (ctx->_priv->pid < 0) {
+        LOGE("Failed to vfork: %s", strerror(errno));
+        goto error;
+    }
 
-child_error:
-        if (ctx->redirect_stdio) {
-            safely_close(&ctx->_priv->stdout_pipe[0]);
-            safely_close(&ctx->_priv->stdout_pipe[1]);
-            safely_close(&ctx->_priv->stderr_pipe[0]);
-            safely_close(&ctx->_priv->stderr_pipe[1]);
-        }
+    // The child has either exec'd or exited by now
+    {
+        ChildError err;
+        err.step = child_error.step;
+        err.error = child_error.error;
+        log_child_error(ctx, err);
+    }
 
-        _exit(127);
-    } else {
-        // Close write ends of the pipes
-        if (ctx->redirect_stdio) {
-            safely_close(&ctx->_priv->stdout_pipe[1]);
-            safely_close(&ctx->_priv->stderr_pipe[1]);
-        }
+    // Close write ends of the pipes
+    if (ctx->redirect_stdio) {
+        safely_close(&ctx->_priv->stdout_pipe[1]);
+        safely_close(&ctx->_priv->stderr_pipe[1]);
     }
 
     return true;
@@ -211,6 +331,7 @@ error:
         safely_close(&ctx->_priv->stderr_pipe[1]);
     }
     free(ctx->_priv);
+    ctx->_priv = nullptr;
 
     return false;
 }
@@ -277,33 +398,36 @@ bool command_raw_reader(struct CommandCtx *ctx, CmdRawCb cb, void *userdata)
         for (int i = 0; i < fds_size; ++i) {
             bool is_stderr = fds[i].fd == ctx->_priv->stderr_pipe[0];
 
-            if (fds[i].revents & POLLHUP) {
+            // POLLHUP may be reported together with POLLIN when the child
+            // exits with unread output in the pipe, so keep reading until
+            // read() reports EOF
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            ssize_t n = read(fds[i].fd, buf, sizeof(buf) - 1);
+            if (n < 0) {
+                if (errno != EAGAIN
+                        && errno != EWOULDBLOCK
+                        && errno != EINTR) {
+                    // Read failed; disable FD
+                    fds[i].fd = -1;
+                    fds[i].events = 0;
+                    ret = false;
+                }
+            } else if (n == 0) {
                 // EOF/pipe closed. The fd will be closed later
                 fds[i].fd = -1;
                 fds[i].events = 0;
 
                 // Final call for EOF
+                buf[0] = '\0';
                 cb(buf, 0, is_stderr, userdata);
-            } else if (fds[i].revents & POLLIN) {
-                ssize_t n = read(fds[i].fd, buf, sizeof(buf) - 1);
-                if (n < 0) {
-                    if (errno != EAGAIN
-                            && errno != EWOULDBLOCK
-                            && errno != EINTR) {
-                        // Read failed; disable FD
-                        fds[i].fd = -1;
-                        fds[i].events = 0;
-                        ret = false;
-                    }
-                } else {
-                    // NULL-terminate
-                    buf[n] = '\0';
-
-                    // Potential EOF (n == 0) here on some non-Linux systems,
-                    // which is fine since it's not possible to reach both the
-                    // POLLHUP block and this block
-                    cb(buf, n, is_stderr, userdata);
-                }
+            } else {
+                // NULL-terminate
+                buf[n] = '\0';
+
+                cb(buf, n, is_stderr, userdata);
             }
         }
     }
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/compress.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <cstring>
+
+#include <lz4.h>
+#include <lz4hc.h>
+#include <zlib.h>
+
+#include "mbcommon/thread_pool.h"
+#include "mblog/logging.h"
+
+// Uncompressed size of each independently compressed gzip block
+#define GZIP_BLOCK_SIZE         (128 * 1024)
+// Amount of preceding input used to prime each block's deflate dictionary
+#define GZIP_DICT_SIZE          (32 * 1024)
+// Maximum uncompressed size of an LZ4 legacy frame block
+#define LZ4_LEGACY_BLOCK_SIZE   (8 * 1024 * 1024)
+#define LZ4_LEGACY_MAGIC        0x184c2102u
+
+namespace mb
+{
+namespace util
+{
+
+struct CompressBlock
+{
+    std::string data;
+    uint32_t crc;
+};
+
+static void put_le32(std::string &out, uint32_t value)
+{
+    out += static_cast<char>(value & 0xff);
+    out += static_cast<char>((value >> 8) & 0xff);
+    out += static_cast<char>((value >> 16) & 0xff);
+    out += static_cast<char>((value >> 24) & 0xff);
+}
+
+/*!
+ * \brief Compress one block of a gzip member to a raw deflate stream
+ *
+ * Every block except the last ends with a sync flush so that it is byte
+ * aligned and can be concatenated with its successor. Blocks after the first
+ * use the preceding 32 KiB of input as the dictionary to keep the compression
+ * ratio close to that of a single-threaded compressor.
+ */
+static bool gzip_compress_block(const unsigned char *data, size_t size,
+                                size_t offset, size_t len, bool last,
+                                int level, CompressBlock &block)
+{
+    (void) size;
+
+    z_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+
+    ret = deflateInit2(&strm, level < 0 ? Z_DEFAULT_COMPRESSION : level,
+                       Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        LOGE("Failed to initialize deflate stream: %d", ret);
+        return false;
+    }
+
+    if (offset > 0) {
+        size_t dict_size = std::min<size_t>(offset, GZIP_DICT_SIZE);
+        ret = deflateSetDictionary(&strm, data + offset - dict_size,
+                                   static_cast<uInt>(dict_size));
+        if (ret != Z_OK) {
+            LOGE("Failed to set deflate dictionary: %d", ret);
+            deflateEnd(&strm);
+            return false;
+        }
+    }
+
+    block.data.resize(deflateBound(&strm, static_cast<uLong>(len)) + 16);
+    block.crc = static_cast<uint32_t>(
+            crc32(0, data + offset, static_cast<uInt>(len)));
+
+    strm.next_in = const_cast<Bytef *>(data + offset);
+    strm.avail_in = static_cast<uInt>(len);
+    strm.next_out = reinterpret_cast<Bytef *>(&block.data[0]);
+    strm.avail_out = static_cast<uInt>(block.data.size());
+
+    ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((last && ret != Z_STREAM_END) || (!last && ret != Z_OK)
+            || strm.avail_in != 0) {
+        LOGE("Failed to deflate block: %d", ret);
+        deflateEnd(&strm);
+        return false;
+    }
+
+    block.data.resize(block.data.size() - strm.avail_out);
+
+    deflateEnd(&strm);
+    return true;
+}
+
+static bool lz4_legacy_compress_block(const unsigned char *data, size_t size,
+                                      size_t offset, size_t len, bool last,
+                                      int level, CompressBlock &block)
+{
+    (void) size;
+    (void) last;
+
+    int bound = LZ4_compressBound(static_cast<int>(len));
+    block.data.resize(static_cast<size_t>(bound));
+
+    int n = LZ4_compress_HC(reinterpret_cast<const char *>(data + offset),
+                            &block.data[0], static_cast<int>(len), bound,
+                            level < 0 ? LZ4HC_CLEVEL_DEFAULT : level);
+    if (n <= 0) {
+        LOGE("Failed to compress LZ4 block");
+        return false;
+    }
+
+    block.data.resize(static_cast<size_t>(n));
+    block.crc = 0;
+    return true;
+}
+
+typedef bool (*CompressBlockFn)(const unsigned char *data, size_t size,
+                                size_t offset, size_t len, bool last,
+                                int level, CompressBlock &block);
+
+/*!
+ * \brief Compress fixed-size blocks of \p data on the shared thread pool
+ */
+static bool compress_blocks(const unsigned char *data, size_t size,
+                            size_t block_size, CompressBlockFn fn,
+                            int level, unsigned int threads,
+                            std::vector<CompressBlock> &blocks)
+{
+    size_t count = std::max<size_t>(1, (size + block_size - 1) / block_size);
+    std::atomic<size_t> next(0);
+    TaskGroup group;
+
+    blocks.resize(count);
+
+    auto worker = [&]{
+        size_t i;
+        while (!group.is_cancelled() && (i = next++) < count) {
+            size_t offset = i * block_size;
+            size_t len = std::min(block_size, size - offset);
+
+            if (!fn(data, size, offset, len, i == count - 1, level,
+                    blocks[i])) {
+                group.cancel();
+            }
+        }
+    };
+
+    if (threads == 0) {
+        threads = ThreadPool::shared().size();
+    }
+    threads = static_cast<unsigned int>(std::min<size_t>(threads, count));
+
+    if (threads <= 1) {
+        worker();
+    } else {
+        for (unsigned int i = 0; i < threads; ++i) {
+            group.run(worker);
+        }
+        group.wait();
+    }
+
+    return !group.is_cancelled();
+}
+
+static bool compress_gzip(const unsigned char *data, size_t size,
+                          std::string &out, unsigned int threads, int level)
+{
+    static const unsigned char header[] = {
+        0x1f, 0x8b,             // Magic
+        0x08,                   // Deflate
+        0x00,                   // Flags
+        0x00, 0x00, 0x00, 0x00, // MTIME
+        0x00,                   // Extra flags
+        0x03,                   // OS (Unix)
+    };
+
+    std::vector<CompressBlock> blocks;
+
+    if (!compress_blocks(data, size, GZIP_BLOCK_SIZE, &gzip_compress_block,
+                         level, threads, blocks)) {
+        return false;
+    }
+
+    size_t total = sizeof(header) + 8;
+    for (auto const &block : blocks) {
+        total += block.data.size();
+    }
+
+    out.clear();
+    out.reserve(total);
+    out.append(reinterpret_cast<const char *>(header), sizeof(header));
+
+    uLong crc = crc32(0, nullptr, 0);
+    size_t offset = 0;
+
+    for (auto const &block : blocks) {
+        size_t len = std::min<size_t>(GZIP_BLOCK_SIZE, size - offset);
+        crc = crc32_combine(crc, block.crc, static_cast<z_off_t>(len));
+        offset += len;
+
+        out += block.data;
+    }
+
+    put_le32(out, static_cast<uint32_t>(crc));
+    put_le32(out, static_cast<uint32_t>(size & 0xffffffffu));
+
+    return true;
+}
+
+static bool compress_lz4_legacy(const unsigned char *data, size_t size,
+                                std::string &out, unsigned int threads,
+                                int level)
+{
+    std::vector<CompressBlock> blocks;
+
+    if (!compress_blocks(data, size, LZ4_LEGACY_BLOCK_SIZE,
+                         &lz4_legacy_compress_block, level, threads,
+                         blocks)) {
+        return false;
+    }
+
+    size_t total = 4;
+    for (auto const &block : blocks) {
+        total += 4 + block.data.size();
+    }
+
+    out.clear();
+    out.reserve(total);
+    put_le32(out, LZ4_LEGACY_MAGIC);
+
+    for (auto const &block : blocks) {
+        put_le32(out, static_cast<uint32_t>(block.data.size()));
+        out += block.data;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compress data using multiple threads
+ *
+ * The input is split into blocks that are compressed concurrently.
+ *
+ *   * compression_type::GZIP produces a single standard gzip member (pigz
+ *     style), which is readable by the kernel's and any other gzip
+ *     decompressor.
+ *   * compression_type::LZ4 produces the LZ4 legacy frame format (as written
+ *     by `lz4 -l`), which is what the kernel expects for lz4 compressed
+ *     ramdisks and kernels.
+ *   * compression_type::NONE copies the data as is.
+ *
+ * \param compression Compression type
+ * \param data Input data
+ * \param size Size of input data
+ * \param[out] out String to store the compressed data
+ * \param threads Number of worker threads (or 0 to use the number of CPUs)
+ * \param level zlib or LZ4 HC compression level (or -1 to use the default)
+ *
+ * \return Whether the data was successfully compressed
+ */
+bool compress_parallel(compression_type compression,
+                       const void *data, size_t size,
+                       std::string &out, unsigned int threads, int level)
+{
+    auto const *ptr = static_cast<const unsigned char *>(data);
+
+    switch (compression) {
+    case compression_type::NONE:
+        out.assign(static_cast<const char *>(data), size);
+        return true;
+    case compression_type::GZIP:
+        return compress_gzip(ptr, size, out, threads, level);
+    case compression_type::LZ4:
+        return compress_lz4_legacy(ptr, size, out, threads, level);
+    default:
+        LOGE("Unsupported parallel compression type");
+        return false;
+    }
+}
+
+}
+}
@@ -19,21 +19,31 @@
 
 #include "mbutil/copy.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
 #include <fts.h>
 #include <sys/stat.h>
-#include <sys/xattr.h>
 #include <unistd.h>
 
+#include "mbcommon/file/fd.h"
+#include "mbcommon/file_util.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
+#include "mbutil/counters.h"
 #include "mbutil/finally.h"
 #include "mbutil/fts.h"
 #include "mbutil/path.h"
 #include "mbutil/string.h"
+#include "mbutil/xattr.h"
 
 // WARNING: Everything operates on paths, so it's subject to race conditions
 // Directory copy operations will not cross mountpoint boundaries
@@ -45,24 +55,29 @@ namespace util
 
 bool copy_data_fd(int fd_source, int fd_target)
 {
-    char buf[10240];
-    ssize_t nread;
+    FdFile source(fd_source, false);
+    FdFile target(fd_target, false);
+    uint64_t n;
 
-    while ((nread = read(fd_source, buf, sizeof buf)) > 0) {
-        char *out_ptr = buf;
-        ssize_t nwritten;
+    if (!source.is_open() || !target.is_open()) {
+        errno = EBADF;
+        return false;
+    }
 
-        do {
-            if ((nwritten = write(fd_target, out_ptr, nread)) < 0) {
-                return false;
-            }
+    // Copies in the kernel if possible
+    if (!file_copy(source, target, UINT64_MAX, n)) {
+        std::error_code ec = target.error();
+        if (!ec) {
+            ec = source.error();
+        }
 
-            nread -= nwritten;
-            out_ptr += nwritten;
-        } while (nread > 0);
+        // Callers report failures with strerror(errno)
+        errno = ec.category() == std::generic_category() ? ec.value() : EIO;
+        return false;
     }
 
-    return nread == 0;
+    counter_add(Counter::BytesCopied, n);
+    return true;
 }
 
 static bool copy_data(const std::string &source, const std::string &target)
@@ -95,77 +110,69 @@ static bool copy_data(const std::string &source, const std::string &target)
     return true;
 }
 
-bool copy_xattrs(const std::string &source, const std::string &target)
+// Reused for every file copied by a thread so that the xattr buffers are only
+// allocated once
+static thread_local XattrSnapshot t_xattrs;
+
+/*!
+ * \brief Apply the xattrs in the calling thread's snapshot to a target
+ *
+ * \return True if the xattrs were set or the target filesystem does not
+ *         support xattrs. False otherwise.
+ */
+static bool apply_xattrs(int fd, const std::string &target)
 {
-    ssize_t size;
-    std::vector<char> names;
-    char *end_names;
-    char *name;
-    std::vector<char> value;
-
-    // xattr names are in a NULL-separated list
-    size = llistxattr(source.c_str(), nullptr, 0);
-    if (size < 0) {
+    bool ret = fd >= 0
+            ? t_xattrs.apply_fd(fd)
+            : t_xattrs.apply_path(target, false);
+    if (!ret) {
         if (errno == ENOTSUP) {
-            LOGV("%s: xattrs not supported on source filesystem",
-                 source.c_str());
+            LOGV("%s: xattrs not supported on target filesystem",
+                 target.c_str());
             return true;
         } else {
-            LOGE("%s: Failed to list xattrs: %s",
-                 source.c_str(), strerror(errno));
+            LOGE("%s: Failed to set xattrs: %s",
+                 target.c_str(), strerror(errno));
             return false;
         }
     }
 
-    names.resize(size + 1);
-
-    size = llistxattr(source.c_str(), names.data(), size);
-    if (size < 0) {
-        LOGE("%s: Failed to list xattrs on second try: %s",
-             source.c_str(), strerror(errno));
-        return false;
-    } else {
-        names[size] = '\0';
-        end_names = names.data() + size;
-    }
-
-    for (name = names.data(); name != end_names; name = strchr(name, '\0') + 1) {
-        if (!*name) {
-            continue;
-        }
-
-        size = lgetxattr(source.c_str(), name, nullptr, 0);
-        if (size < 0) {
-            LOGW("%s: Failed to get attribute '%s': %s",
-                 source.c_str(), name, strerror(errno));
-            continue;
-        }
-
-        value.resize(size);
+    return true;
+}
 
-        size = lgetxattr(source.c_str(), name, value.data(), size);
-        if (size < 0) {
-            LOGW("%s: Failed to get attribute '%s' on second try: %s",
-                 source.c_str(), name, strerror(errno));
-            continue;
-        }
+/*!
+ * \brief Read the xattrs of a source into the calling thread's snapshot
+ *
+ * \return True if the xattrs were read or the source filesystem does not
+ *         support xattrs (the snapshot is empty in that case). False otherwise.
+ */
+static bool read_xattrs(int fd, const std::string &source)
+{
+    bool ret = fd >= 0
+            ? t_xattrs.read_fd(fd)
+            : t_xattrs.read_path(source, false);
+    if (!ret) {
+        t_xattrs.clear();
 
-        if (lsetxattr(target.c_str(), name, value.data(), size, 0) < 0) {
-            if (errno == ENOTSUP) {
-                LOGV("%s: xattrs not supported on target filesystem",
-                     target.c_str());
-                break;
-            } else {
-                LOGE("%s: Failed to set xattrs: %s",
-                     target.c_str(), strerror(errno));
-                return false;
-            }
+        if (errno == ENOTSUP) {
+            LOGV("%s: xattrs not supported on source filesystem",
+                 source.c_str());
+            return true;
+        } else {
+            LOGE("%s: Failed to read xattrs: %s",
+                 source.c_str(), strerror(errno));
+            return false;
         }
     }
 
     return true;
 }
 
+bool copy_xattrs(const std::string &source, const std::string &target)
+{
+    return read_xattrs(-1, source) && apply_xattrs(-1, target);
+}
+
 bool copy_stat(const std::string &source, const std::string &target)
 {
     struct stat sb;
@@ -322,6 +329,338 @@ bool copy_file(const std::string &source, const std::string &target, int flags)
 }
 
 
+/*!
+ * \brief Copy attributes and xattrs of a tree entry as specified by \p flags
+ */
+static bool copy_entry_attrs(const std::string &source,
+                             const std::string &target, int flags,
+                             std::string &error_msg)
+{
+    if ((flags & COPY_ATTRIBUTES) && !copy_stat(source, target)) {
+        mb::format(error_msg, "%s: Failed to copy attributes: %s",
+                   target.c_str(), strerror(errno));
+        LOGW("%s", error_msg.c_str());
+        return false;
+    }
+    if ((flags & COPY_XATTRS) && !copy_xattrs(source, target)) {
+        mb::format(error_msg, "%s: Failed to copy xattrs: %s",
+                   target.c_str(), strerror(errno));
+        LOGW("%s", error_msg.c_str());
+        return false;
+    }
+    return true;
+}
+
+enum class CopyEntryType
+{
+    File,
+    Symlink,
+    BlockDevice,
+    CharacterDevice,
+    Fifo,
+};
+
+struct CopyEntry
+{
+    CopyEntryType type;
+    std::string source;
+    std::string target;
+    dev_t rdev;
+};
+
+/*!
+ * \brief Copy a regular file of a tree
+ *
+ * This is equivalent to copy_data() followed by copy_entry_attrs(), except
+ * that the attributes and xattrs are read from and written to the open fds,
+ * so the kernel does not have to resolve either path again. As with
+ * copy_stat() and copy_xattrs(), the owner is changed before the xattrs are
+ * set so that file capabilities are not cleared by the chown.
+ */
+static bool copy_file_entry(const CopyEntry &entry, int flags,
+                            std::string &error_msg)
+{
+    auto fail = [&](const std::string &path, const char *action) {
+        mb::format(error_msg, "%s: Failed to %s: %s",
+                   path.c_str(), action, strerror(errno));
+        LOGW("%s", error_msg.c_str());
+        return false;
+    };
+
+    int fd_source = open(entry.source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_source < 0) {
+        return fail(entry.target, "copy data");
+    }
+
+    auto close_source_fd = finally([&] {
+        close(fd_source);
+    });
+
+    int fd_target = open(entry.target.c_str(),
+                         O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd_target < 0) {
+        return fail(entry.target, "copy data");
+    }
+
+    auto close_target_fd = finally([&] {
+        close(fd_target);
+    });
+
+    if (!copy_data_fd(fd_source, fd_target)) {
+        return fail(entry.target, "copy data");
+    }
+
+    if (flags & COPY_ATTRIBUTES) {
+        struct stat sb;
+
+        if (fstat(fd_source, &sb) < 0) {
+            return fail(entry.source, "stat");
+        }
+        if (fchown(fd_target, sb.st_uid, sb.st_gid) < 0) {
+            return fail(entry.target, "chown");
+        }
+        if (fchmod(fd_target, sb.st_mode & (S_ISUID | S_ISGID | S_ISVTX
+                | S_IRWXU | S_IRWXG | S_IRWXO)) < 0) {
+            return fail(entry.target, "chmod");
+        }
+    }
+
+    if ((flags & COPY_XATTRS) && (!read_xattrs(fd_source, entry.source)
+            || !apply_xattrs(fd_target, entry.target))) {
+        return fail(entry.target, "copy xattrs");
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Copy a non-directory entry of a tree
+ *
+ * The existing target is removed first. If \p flags contains COPY_ATTRIBUTES
+ * or COPY_XATTRS, the attributes and xattrs are copied after the entry is
+ * created.
+ *
+ * \param entry Entry to copy
+ * \param flags Copy flags
+ * \param error_msg String to store error message in if the copy fails
+ *
+ * \return Whether the entry was successfully copied
+ */
+static bool copy_entry(const CopyEntry &entry, int flags,
+                       std::string &error_msg)
+{
+    // Remove existing file
+    if (unlink(entry.target.c_str()) < 0 && errno != ENOENT) {
+        mb::format(error_msg, "%s: Failed to remove old path: %s",
+                   entry.target.c_str(), strerror(errno));
+        LOGW("%s", error_msg.c_str());
+        return false;
+    }
+
+    switch (entry.type) {
+    case CopyEntryType::File:
+        // Data, attributes, and xattrs are all copied through the open fds
+        return copy_file_entry(entry, flags, error_msg);
+
+    case CopyEntryType::Symlink: {
+        // Find current symlink target
+        std::string symlink_path;
+        if (!read_link(entry.source, &symlink_path)) {
+            mb::format(error_msg, "%s: Failed to read symlink path: %s",
+                       entry.source.c_str(), strerror(errno));
+            LOGW("%s", error_msg.c_str());
+            return false;
+        }
+
+        // Create new symlink
+        if (symlink(symlink_path.c_str(), entry.target.c_str()) < 0) {
+            mb::format(error_msg, "%s: Failed to create symlink: %s",
+                       entry.target.c_str(), strerror(errno));
+            LOGW("%s", error_msg.c_str());
+            return false;
+        }
+        break;
+    }
+
+    case CopyEntryType::BlockDevice:
+        if (mknod(entry.target.c_str(), S_IFBLK | S_IRWXU, entry.rdev) < 0) {
+            mb::format(error_msg, "%s: Failed to create block device: %s",
+                       entry.target.c_str(), strerror(errno));
+            LOGW("%s", error_msg.c_str());
+            return false;
+        }
+        break;
+
+    case CopyEntryType::CharacterDevice:
+        if (mknod(entry.target.c_str(), S_IFCHR | S_IRWXU, entry.rdev) < 0) {
+            mb::format(error_msg, "%s: Failed to create character device: %s",
+                       entry.target.c_str(), strerror(errno));
+            LOGW("%s", error_msg.c_str());
+            return false;
+        }
+        break;
+
+    case CopyEntryType::Fifo:
+        if (mkfifo(entry.target.c_str(), S_IRWXU) < 0) {
+            mb::format(error_msg, "%s: Failed to create FIFO pipe: %s",
+                       entry.target.c_str(), strerror(errno));
+            LOGW("%s", error_msg.c_str());
+            return false;
+        }
+        break;
+    }
+
+    return copy_entry_attrs(entry.source, entry.target, flags, error_msg);
+}
+
+/*!
+ * \brief Pool of threads copying tree entries
+ *
+ * Each worker has its own queue. Entries are distributed round-robin among the
+ * queues. A worker takes entries from the front of its own queue and, when it
+ * runs out, steals from the back of the other workers' queues. This keeps all
+ * workers busy when some entries (eg. large files) take much longer to copy
+ * than others.
+ */
+class CopyWorkerPool
+{
+public:
+    CopyWorkerPool(unsigned int threads, int copyflags)
+        : _queues(threads), _copyflags(copyflags)
+    {
+        for (auto &q : _queues) {
+            q.reset(new Queue());
+        }
+
+        _threads.reserve(threads);
+        for (unsigned int i = 0; i < threads; ++i) {
+            _threads.emplace_back(&CopyWorkerPool::worker, this, i);
+        }
+    }
+
+    ~CopyWorkerPool()
+    {
+        finish();
+    }
+
+    CopyWorkerPool(const CopyWorkerPool &) = delete;
+    CopyWorkerPool & operator=(const CopyWorkerPool &) = delete;
+
+    void push(CopyEntry entry)
+    {
+        Queue &q = *_queues[_next++ % _queues.size()];
+
+        {
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.entries.push_back(std::move(entry));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            ++_pending;
+        }
+        _cv.notify_one();
+    }
+
+    /*!
+     * \brief Wait for all queued entries to be copied
+     *
+     * \param[out] error_msg Error message of the first failed entry
+     *
+     * \return Whether all entries were successfully copied
+     */
+    bool finish(std::string *error_msg = nullptr)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _done = true;
+        }
+        _cv.notify_all();
+
+        for (auto &t : _threads) {
+            t.join();
+        }
+        _threads.clear();
+
+        if (_failed && error_msg) {
+            *error_msg = _error_msg;
+        }
+
+        return !_failed;
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<CopyEntry> entries;
+    };
+
+    bool pop(size_t self, CopyEntry &entry)
+    {
+        for (size_t i = 0; i < _queues.size(); ++i) {
+            Queue &q = *_queues[(self + i) % _queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+
+            if (q.entries.empty()) {
+                continue;
+            }
+
+            if (i == 0) {
+                entry = std::move(q.entries.front());
+                q.entries.pop_front();
+            } else {
+                entry = std::move(q.entries.back());
+                q.entries.pop_back();
+            }
+
+            std::lock_guard<std::mutex> lock2(_mutex);
+            --_pending;
+            return true;
+        }
+
+        return false;
+    }
+
+    void worker(size_t self)
+    {
+        CopyEntry entry;
+        std::string error_msg;
+
+        while (true) {
+            if (pop(self, entry)) {
+                if (!copy_entry(entry, _copyflags, error_msg)) {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!_failed) {
+                        _error_msg = error_msg;
+                        _failed = true;
+                    }
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [&]{ return _done || _pending > 0; });
+            if (_done && _pending == 0) {
+                break;
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> _queues;
+    std::vector<std::thread> _threads;
+    int _copyflags;
+    size_t _next = 0;
+
+    // Protects everything below
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    size_t _pending = 0;
+    bool _done = false;
+    bool _failed = false;
+    std::string _error_msg;
+};
+
 class RecursiveCopier : public FTSWrapper {
 public:
     RecursiveCopier(std::string path, std::string target, int copyflags)
@@ -362,9 +701,48 @@ public:
             return false;
         }
 
+        // The traversal only creates directories. Everything else is copied
+        // by the workers.
+        if (_copyflags & COPY_PARALLEL) {
+            unsigned int threads = std::thread::hardware_concurrency();
+            _pool.reset(new CopyWorkerPool(std::max(1u, threads), _copyflags));
+        }
+
         return true;
     }
 
+    virtual bool on_post_execute(bool success) override
+    {
+        if (!_pool) {
+            return true;
+        }
+
+        std::string error_msg;
+
+        if (!_pool->finish(&error_msg)) {
+            if (success) {
+                _error_msg = error_msg;
+            }
+            success = false;
+        }
+        _pool.reset();
+
+        // Directory attributes are set last, when nothing else will be written
+        // to them. The list is in post-order, so children come before parents.
+        for (auto const &dir : _dirs) {
+            if (!copy_entry_attrs(dir.first, dir.second, _copyflags,
+                                  error_msg)) {
+                if (success) {
+                    _error_msg = error_msg;
+                }
+                success = false;
+            }
+        }
+        _dirs.clear();
+
+        return success;
+    }
+
     virtual int on_changed_path() override
     {
         // Make sure we aren't copying the target on top of itself
@@ -430,11 +808,8 @@ public:
         // If we're skipping, then we have to set the attributes now, since
         // on_reached_directory_post() won't be called
         if (skip) {
-            if (!cp_attrs()) {
-                success = false;
-            }
-
-            if (!cp_xattrs()) {
+            if (!copy_entry_attrs(_curr->fts_accpath, _curtgtpath, _copyflags,
+                                  _error_msg)) {
                 success = false;
             }
         }
@@ -445,11 +820,14 @@ public:
 
     virtual int on_reached_directory_post() override
     {
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
+        // Workers may still be writing to the directory
+        if (_pool) {
+            _dirs.emplace_back(_curr->fts_accpath, _curtgtpath);
+            return Action::FTS_OK;
         }
 
-        if (!cp_xattrs()) {
+        if (!copy_entry_attrs(_curr->fts_accpath, _curtgtpath, _copyflags,
+                              _error_msg)) {
             return Action::FTS_Fail;
         }
 
@@ -458,135 +836,27 @@ public:
 
     virtual int on_reached_file() override
     {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
-
-        // Copy file contents
-        if (!copy_data(_curr->fts_accpath, _curtgtpath)) {
-            mb::format(_error_msg, "%s: Failed to copy data: %s",
-                       _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
-
-        return Action::FTS_OK;
+        return handle_entry(CopyEntryType::File);
     }
 
     virtual int on_reached_symlink() override
     {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
-
-        // Find current symlink target
-        std::string symlink_path;
-        if (!read_link(_curr->fts_accpath, &symlink_path)) {
-            mb::format(_error_msg, "%s: Failed to read symlink path: %s",
-                       _curr->fts_accpath, strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
-
-        // Create new symlink
-        if (symlink(symlink_path.c_str(), _curtgtpath.c_str()) < 0) {
-            mb::format(_error_msg, "%s: Failed to create symlink: %s",
-                       _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
-
-        return Action::FTS_OK;
+        return handle_entry(CopyEntryType::Symlink);
     }
 
     virtual int on_reached_block_device() override
     {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
-
-        if (mknod(_curtgtpath.c_str(), S_IFBLK | S_IRWXU,
-                _curr->fts_statp->st_rdev) < 0) {
-            mb::format(_error_msg, "%s: Failed to create block device: %s",
-                       _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
-
-        return Action::FTS_OK;
+        return handle_entry(CopyEntryType::BlockDevice);
     }
 
     virtual int on_reached_character_device() override
     {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
-
-        if (mknod(_curtgtpath.c_str(), S_IFCHR | S_IRWXU,
-                _curr->fts_statp->st_rdev) < 0) {
-            mb::format(_error_msg, "%s: Failed to create character device: %s",
-                       _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
-
-        return Action::FTS_OK;
+        return handle_entry(CopyEntryType::CharacterDevice);
     }
 
     virtual int on_reached_fifo() override
     {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
-
-        if (mkfifo(_curtgtpath.c_str(), S_IRWXU) < 0) {
-            mb::format(_error_msg, "%s: Failed to create FIFO pipe: %s",
-                       _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
-
-        return Action::FTS_OK;
+        return handle_entry(CopyEntryType::Fifo);
     }
 
     virtual int on_reached_socket() override
@@ -600,41 +870,21 @@ private:
     std::string _target;
     struct stat sb_target;
     std::string _curtgtpath;
+    std::unique_ptr<CopyWorkerPool> _pool;
+    std::vector<std::pair<std::string, std::string>> _dirs;
 
-    bool remove_existing_file()
+    int handle_entry(CopyEntryType type)
     {
-        // Remove existing file
-        if (unlink(_curtgtpath.c_str()) < 0 && errno != ENOENT) {
-            mb::format(_error_msg, "%s: Failed to remove old path: %s",
-                       _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return false;
-        }
-        return true;
-    }
+        CopyEntry entry{type, _curr->fts_accpath, _curtgtpath,
+                        _curr->fts_statp->st_rdev};
 
-    bool cp_attrs()
-    {
-        if ((_copyflags & COPY_ATTRIBUTES)
-                && !copy_stat(_curr->fts_accpath, _curtgtpath)) {
-            mb::format(_error_msg, "%s: Failed to copy attributes: %s",
-                       _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return false;
+        if (_pool) {
+            _pool->push(std::move(entry));
+            return Action::FTS_OK;
         }
-        return true;
-    }
 
-    bool cp_xattrs()
-    {
-        if ((_copyflags & COPY_XATTRS)
-                && !copy_xattrs(_curr->fts_accpath, _curtgtpath)) {
-            mb::format(_error_msg, "%s: Failed to copy xattrs: %s",
-                       _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return false;
-        }
-        return true;
+        return copy_entry(entry, _copyflags, _error_msg)
+                ? Action::FTS_OK : Action::FTS_Fail;
     }
 };
 
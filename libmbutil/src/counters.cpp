@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/counters.h"
+
+#include <atomic>
+#include <new>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/file.h"
+#include "mbutil/finally.h"
+#include "mbutil/time.h"
+
+// "MBCT" in little endian
+#define COUNTERS_MAGIC          0x5443424du
+#define COUNTERS_VERSION        1u
+
+// Counters are only kept for the current boot
+#define BOOT_ID_PATH            "/proc/sys/kernel/random/boot_id"
+#define BOOT_ID_SIZE            40
+
+namespace mb
+{
+namespace util
+{
+
+struct CounterHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+    char boot_id[BOOT_ID_SIZE];
+};
+
+struct CounterBlock
+{
+    CounterHeader header;
+    std::atomic<uint64_t> values[COUNTER_COUNT];
+};
+
+static const char *counter_names[] = {
+    "uevents_handled",
+    "uevent_handle_time_ns",
+    "fts_entries_visited",
+    "bytes_copied",
+    "appsync_replies_proxied",
+    "appsync_reply_time_ms",
+    "daemon_requests",
+    "daemon_request_time_ns",
+    "sepolicy_patches",
+    "sepolicy_patch_time_ns",
+    "mounts",
+    "mount_time_ns",
+};
+
+static_assert(sizeof(counter_names) / sizeof(counter_names[0])
+                      == COUNTER_COUNT,
+              "counter_names must have an entry for every counter");
+
+// Used until the process attaches to the shared counters
+static CounterBlock local_block;
+static std::atomic<CounterBlock *> block(&local_block);
+
+/*!
+ * \brief Add \a value to a counter
+ */
+void counter_add(Counter counter, uint64_t value)
+{
+    block.load(std::memory_order_acquire)
+            ->values[static_cast<size_t>(counter)]
+            .fetch_add(value, std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Get the current value of a counter
+ */
+uint64_t counter_get(Counter counter)
+{
+    return block.load(std::memory_order_acquire)
+            ->values[static_cast<size_t>(counter)]
+            .load(std::memory_order_relaxed);
+}
+
+/*!
+ * \brief Get the name of a counter (eg. "bytes_copied")
+ */
+const char * counter_name(Counter counter)
+{
+    return counter_names[static_cast<size_t>(counter)];
+}
+
+static void get_boot_id(char (&boot_id)[BOOT_ID_SIZE])
+{
+    std::string line;
+
+    memset(boot_id, 0, sizeof(boot_id));
+    if (file_first_line(BOOT_ID_PATH, &line)) {
+        strncpy(boot_id, line.c_str(), sizeof(boot_id) - 1);
+    }
+}
+
+static bool header_is_current(const CounterHeader &header,
+                              const char (&boot_id)[BOOT_ID_SIZE])
+{
+    return header.magic == COUNTERS_MAGIC
+            && header.version == COUNTERS_VERSION
+            && header.count == COUNTER_COUNT
+            && memcmp(header.boot_id, boot_id, BOOT_ID_SIZE) == 0;
+}
+
+/*!
+ * \brief Share the counters with other processes through a file
+ *
+ * The file is created if it does not exist. If it was written during a
+ * previous boot or by an incompatible version of mbtool, the counters in it
+ * are reset. Whatever this process counted before attaching is added to the
+ * shared counters.
+ *
+ * Processes forked after this is called keep using the shared counters. The
+ * counters are never shared if 64-bit atomics are not lock-free on the target
+ * because lock-based atomics only work within a single process.
+ *
+ * \param path Path to counters file
+ *
+ * \return Whether the process is now using the shared counters
+ */
+bool counters_attach(const std::string &path)
+{
+    if (block.load() != &local_block) {
+        return true;
+    }
+
+    if (!local_block.values[0].is_lock_free()) {
+        LOGW("%s: Not sharing counters without lock-free atomics",
+             path.c_str());
+        return false;
+    }
+
+    char boot_id[BOOT_ID_SIZE];
+    get_boot_id(boot_id);
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGW("%s: Failed to open counters file: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        close(fd);
+    });
+
+    // Another process may be setting up the file at the same time
+    if (flock(fd, LOCK_EX) < 0) {
+        LOGW("%s: Failed to lock counters file: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        LOGW("%s: Failed to stat counters file: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool reset = static_cast<size_t>(sb.st_size) != sizeof(CounterBlock);
+    if (reset && ftruncate(fd, sizeof(CounterBlock)) < 0) {
+        LOGW("%s: Failed to resize counters file: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    void *mem = mmap(nullptr, sizeof(CounterBlock), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        LOGW("%s: Failed to map counters file: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto shared = static_cast<CounterBlock *>(mem);
+
+    if (reset || !header_is_current(shared->header, boot_id)) {
+        shared = new (mem) CounterBlock();
+        shared->header.magic = COUNTERS_MAGIC;
+        shared->header.version = COUNTERS_VERSION;
+        shared->header.count = COUNTER_COUNT;
+        memcpy(shared->header.boot_id, boot_id, BOOT_ID_SIZE);
+    }
+
+    block.store(shared, std::memory_order_release);
+
+    for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+        shared->values[i].fetch_add(
+                local_block.values[i].exchange(0, std::memory_order_relaxed),
+                std::memory_order_relaxed);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read the shared counters without attaching to them
+ *
+ * \param path Path to counters file
+ * \param[out] values Value of each counter, indexed by Counter
+ *
+ * \return True if the counters were read. False with errno set to ESTALE if
+ *         the file was not written during the current boot or by this version
+ *         of mbtool, or with errno set by open() or read() otherwise.
+ */
+bool counters_read(const std::string &path, std::vector<uint64_t> *values)
+{
+    char boot_id[BOOT_ID_SIZE];
+    get_boot_id(boot_id);
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        close(fd);
+    });
+
+    CounterHeader header;
+    uint64_t raw[COUNTER_COUNT];
+
+    ssize_t n = pread(fd, &header, sizeof(header), 0);
+    if (n < 0) {
+        return false;
+    } else if (static_cast<size_t>(n) != sizeof(header)
+            || !header_is_current(header, boot_id)) {
+        errno = ESTALE;
+        return false;
+    }
+
+    n = pread(fd, raw, sizeof(raw), offsetof(CounterBlock, values));
+    if (n < 0) {
+        return false;
+    } else if (static_cast<size_t>(n) != sizeof(raw)) {
+        errno = ESTALE;
+        return false;
+    }
+
+    values->assign(raw, raw + COUNTER_COUNT);
+    return true;
+}
+
+CounterTimer::CounterTimer(Counter count, Counter time_ns)
+    : _count(count)
+    , _time_ns(time_ns)
+    , _start(monotonic_time_ns())
+{
+}
+
+CounterTimer::~CounterTimer()
+{
+    counter_add(_count);
+    counter_add(_time_ns, monotonic_time_ns() - _start);
+}
+
+}
+}
@@ -0,0 +1,729 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/cpio.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/stat.h>
+
+#include "mbcommon/buffer_pool.h"
+#include "mblog/logging.h"
+#include "mbutil/compress.h"
+#include "mbutil/finally.h"
+
+#define LZ4_LEGACY_MAGIC        "\x02\x21\x4c\x18"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Strip leading "/" and "./" components from an archive path
+ */
+static std::string normalize_path(const std::string &path)
+{
+    size_t pos = 0;
+
+    while (pos < path.size()) {
+        if (path[pos] == '/') {
+            ++pos;
+        } else if (path.compare(pos, 2, "./") == 0) {
+            pos += 2;
+        } else {
+            break;
+        }
+    }
+
+    if (path.compare(pos, std::string::npos, ".") == 0) {
+        return {};
+    }
+
+    return path.substr(pos);
+}
+
+static bool path_matches(archive_entry *entry, const std::string &path)
+{
+    const char *name = archive_entry_pathname(entry);
+    return name && normalize_path(name) == path;
+}
+
+static la_ssize_t write_to_string_cb(archive *a, void *userdata,
+                                     const void *buf, size_t size)
+{
+    (void) a;
+    std::string *out = static_cast<std::string *>(userdata);
+    out->append(static_cast<const char *>(buf), size);
+    return static_cast<la_ssize_t>(size);
+}
+
+CpioEditor::Entry::Entry()
+    : entry(archive_entry_new(), archive_entry_free)
+{
+}
+
+static bool is_lz4_legacy(const void *data, size_t size)
+{
+    return size >= 4 && memcmp(data, LZ4_LEGACY_MAGIC, 4) == 0;
+}
+
+CpioEditor::CpioEditor()
+    : _format(ARCHIVE_FORMAT_CPIO_SVR4_NOCRC)
+    , _lz4_legacy(false)
+{
+}
+
+CpioEditor::~CpioEditor()
+{
+}
+
+std::vector<CpioEditor::Entry>::iterator
+CpioEditor::find(const std::string &path)
+{
+    std::string normalized = normalize_path(path);
+
+    return std::find_if(_entries.begin(), _entries.end(),
+                        [&](const Entry &e) {
+        return path_matches(e.entry.get(), normalized);
+    });
+}
+
+std::vector<CpioEditor::Entry>::const_iterator
+CpioEditor::find(const std::string &path) const
+{
+    std::string normalized = normalize_path(path);
+
+    return std::find_if(_entries.cbegin(), _entries.cend(),
+                        [&](const Entry &e) {
+        return path_matches(e.entry.get(), normalized);
+    });
+}
+
+/*!
+ * \brief Get a blank entry for \p path
+ *
+ * If an entry for \p path already exists, it is reset in place so that the
+ * archive ordering is preserved. Otherwise, a new entry is appended.
+ */
+CpioEditor::Entry & CpioEditor::replace_entry(const std::string &path)
+{
+    auto it = find(path);
+    if (it == _entries.end()) {
+        _entries.emplace_back();
+        it = _entries.end() - 1;
+    } else {
+        archive_entry_clear(it->entry.get());
+        it->data.clear();
+        it->source.clear();
+    }
+
+    archive_entry_set_pathname(it->entry.get(), normalize_path(path).c_str());
+    archive_entry_set_nlink(it->entry.get(), 1);
+    archive_entry_set_uid(it->entry.get(), 0);
+    archive_entry_set_gid(it->entry.get(), 0);
+
+    return *it;
+}
+
+bool CpioEditor::load(archive *a, const char *name)
+{
+    archive_entry *entry;
+    la_ssize_t n;
+    int ret;
+
+    _entries.clear();
+    _filters.clear();
+
+    PooledBuffer buf(io_block_size());
+    if (!buf) {
+        LOGE("%s: Failed to allocate buffer: %s", name, strerror(errno));
+        return false;
+    }
+
+    while (true) {
+        ret = archive_read_next_header(a, &entry);
+        if (ret == ARCHIVE_EOF) {
+            break;
+        } else if (ret == ARCHIVE_RETRY) {
+            continue;
+        } else if (ret != ARCHIVE_OK) {
+            LOGE("%s: Failed to read header: %s",
+                 name, archive_error_string(a));
+            return false;
+        }
+
+        const char *path = archive_entry_pathname(entry);
+        if (!path || !*path) {
+            LOGE("%s: Header has null or empty filename", name);
+            return false;
+        }
+
+        Entry e;
+        e.entry.reset(archive_entry_clone(entry));
+        if (!e.entry) {
+            LOGE("%s: Failed to allocate entry", path);
+            return false;
+        }
+
+        while ((n = archive_read_data(a, buf.data(), buf.size())) > 0) {
+            e.data.append(static_cast<const char *>(buf.data()),
+                          static_cast<size_t>(n));
+        }
+        if (n < 0) {
+            LOGE("%s: Failed to read data: %s", path, archive_error_string(a));
+            return false;
+        }
+
+        _entries.push_back(std::move(e));
+    }
+
+    // Save format
+    _format = archive_format(a);
+    for (int i = 0; i < archive_filter_count(a); ++i) {
+        int code = archive_filter_code(a, i);
+        if (code != ARCHIVE_FILTER_NONE) {
+            _filters.push_back(code);
+        }
+    }
+
+    if (archive_read_close(a) != ARCHIVE_OK) {
+        LOGE("%s: %s", name, archive_error_string(a));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Load entry table from a cpio archive on disk
+ *
+ * \param path Path to (optionally gzip, lz4, lzma, or xz compressed) archive
+ *
+ * \return Whether the archive was successfully loaded
+ */
+bool CpioEditor::load_file(const std::string &path)
+{
+    autoclose::archive a(archive_read_new(), archive_read_free);
+    if (!a) {
+        LOGE("Failed to allocate archive reader instance");
+        return false;
+    }
+
+    archive_read_support_filter_gzip(a.get());
+    archive_read_support_filter_lz4(a.get());
+    archive_read_support_filter_lzma(a.get());
+    archive_read_support_filter_xz(a.get());
+    archive_read_support_format_cpio(a.get());
+
+    if (archive_read_open_filename(a.get(), path.c_str(), 10240)
+            != ARCHIVE_OK) {
+        LOGE("%s: Failed to open for reading: %s",
+             path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    // libarchive does not report which LZ4 frame format was used
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        LOGE("%s: Failed to open for reading: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    char magic[4];
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+
+    _lz4_legacy = is_lz4_legacy(magic, n);
+
+    return load(a.get(), path.c_str());
+}
+
+/*!
+ * \brief Load entry table from a cpio archive in memory
+ *
+ * \param data Archive data (must remain valid until this function returns)
+ * \param size Size of \p data
+ *
+ * \return Whether the archive was successfully loaded
+ */
+bool CpioEditor::load_memory(const void *data, size_t size)
+{
+    autoclose::archive a(archive_read_new(), archive_read_free);
+    if (!a) {
+        LOGE("Failed to allocate archive reader instance");
+        return false;
+    }
+
+    archive_read_support_filter_gzip(a.get());
+    archive_read_support_filter_lz4(a.get());
+    archive_read_support_filter_lzma(a.get());
+    archive_read_support_filter_xz(a.get());
+    archive_read_support_format_cpio(a.get());
+
+    if (archive_read_open_memory(a.get(), data, size) != ARCHIVE_OK) {
+        LOGE("<memory>: Failed to open for reading: %s",
+             archive_error_string(a.get()));
+        return false;
+    }
+
+    _lz4_legacy = is_lz4_legacy(data, size);
+
+    return load(a.get(), "<memory>");
+}
+
+bool CpioEditor::save(archive *a, const char *name)
+{
+    for (auto &e : _entries) {
+        archive_entry *entry = e.entry.get();
+        const char *path = archive_entry_pathname(entry);
+        FILE *fp = nullptr;
+
+        auto close_fp = finally([&]{
+            if (fp) {
+                fclose(fp);
+            }
+        });
+
+        if (!e.source.empty()) {
+            struct stat sb;
+
+            fp = fopen(e.source.c_str(), "rb");
+            if (!fp) {
+                LOGE("%s: Failed to open for reading: %s",
+                     e.source.c_str(), strerror(errno));
+                return false;
+            }
+
+            if (fstat(fileno(fp), &sb) < 0) {
+                LOGE("%s: Failed to stat: %s",
+                     e.source.c_str(), strerror(errno));
+                return false;
+            }
+
+            archive_entry_set_size(entry, sb.st_size);
+        } else if (archive_entry_filetype(entry) == AE_IFREG) {
+            archive_entry_set_size(entry, e.data.size());
+        } else {
+            archive_entry_set_size(entry, 0);
+        }
+
+        if (archive_write_header(a, entry) != ARCHIVE_OK) {
+            LOGE("%s: %s: Failed to write header: %s",
+                 name, path, archive_error_string(a));
+            return false;
+        }
+
+        if (fp) {
+            PooledBuffer buf(io_block_size());
+            size_t n;
+
+            if (!buf) {
+                LOGE("%s: Failed to allocate buffer: %s",
+                     name, strerror(errno));
+                return false;
+            }
+
+            while ((n = fread(buf.data(), 1, buf.size(), fp)) > 0) {
+                if (archive_write_data(a, buf.data(), n)
+                        != static_cast<la_ssize_t>(n)) {
+                    LOGE("%s: %s: Failed to write data: %s",
+                         name, path, archive_error_string(a));
+                    return false;
+                }
+            }
+
+            if (ferror(fp)) {
+                LOGE("%s: Failed to read file: %s",
+                     e.source.c_str(), strerror(errno));
+                return false;
+            }
+        } else if (!e.data.empty()) {
+            if (archive_write_data(a, e.data.data(), e.data.size())
+                    != static_cast<la_ssize_t>(e.data.size())) {
+                LOGE("%s: %s: Failed to write data: %s",
+                     name, path, archive_error_string(a));
+                return false;
+            }
+        }
+    }
+
+    if (archive_write_close(a) != ARCHIVE_OK) {
+        LOGE("%s: %s", name, archive_error_string(a));
+        return false;
+    }
+
+    return true;
+}
+
+static bool setup_writer(archive *a, int format, const std::vector<int> &filters)
+{
+    if (archive_write_set_format(a, format) != ARCHIVE_OK) {
+        LOGE("Failed to set output archive format: %s",
+             archive_error_string(a));
+        return false;
+    }
+    for (int filter : filters) {
+        if (archive_write_add_filter(a, filter) != ARCHIVE_OK) {
+            LOGE("Failed to add output archive filter: %s",
+                 archive_error_string(a));
+            return false;
+        }
+    }
+
+    archive_write_set_bytes_per_block(a, 512);
+
+    return true;
+}
+
+/*!
+ * \brief Get the compression to apply with compress_parallel() when saving
+ *
+ * \return Whether the loaded archive's filters can be handled by
+ *         compress_parallel() instead of libarchive
+ */
+bool CpioEditor::parallel_compression(compression_type &compression) const
+{
+    if (_filters.size() != 1) {
+        return false;
+    } else if (_filters[0] == ARCHIVE_FILTER_GZIP) {
+        compression = compression_type::GZIP;
+        return true;
+    } else if (_filters[0] == ARCHIVE_FILTER_LZ4 && _lz4_legacy) {
+        compression = compression_type::LZ4;
+        return true;
+    }
+
+    return false;
+}
+
+bool CpioEditor::write_memory(std::string &out, bool use_filters)
+{
+    autoclose::archive a(archive_write_new(), archive_write_free);
+    if (!a) {
+        LOGE("Failed to allocate archive writer instance");
+        return false;
+    }
+
+    if (!setup_writer(a.get(), _format,
+                      use_filters ? _filters : std::vector<int>())) {
+        return false;
+    }
+
+    out.clear();
+
+    if (archive_write_open(a.get(), &out, nullptr, &write_to_string_cb,
+                           nullptr) != ARCHIVE_OK) {
+        LOGE("<memory>: Failed to open for writing: %s",
+             archive_error_string(a.get()));
+        return false;
+    }
+
+    return save(a.get(), "<memory>");
+}
+
+/*!
+ * \brief Write entry table to a cpio archive on disk
+ *
+ * The archive is written with the same format and compression filters as the
+ * loaded archive.
+ *
+ * \param path Output path
+ *
+ * \return Whether the archive was successfully written
+ */
+bool CpioEditor::save_file(const std::string &path)
+{
+    compression_type compression;
+
+    if (parallel_compression(compression)) {
+        std::string data;
+
+        if (!save_memory(data)) {
+            return false;
+        }
+
+        FILE *fp = fopen(path.c_str(), "wb");
+        if (!fp) {
+            LOGE("%s: Failed to open for writing: %s",
+                 path.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (fwrite(data.data(), 1, data.size(), fp) != data.size()) {
+            LOGE("%s: Failed to write file: %s",
+                 path.c_str(), strerror(errno));
+            fclose(fp);
+            return false;
+        }
+
+        if (fclose(fp) < 0) {
+            LOGE("%s: Failed to close file: %s",
+                 path.c_str(), strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    autoclose::archive a(archive_write_new(), archive_write_free);
+    if (!a) {
+        LOGE("Failed to allocate archive writer instance");
+        return false;
+    }
+
+    if (!setup_writer(a.get(), _format, _filters)) {
+        return false;
+    }
+
+    if (archive_write_open_filename(a.get(), path.c_str()) != ARCHIVE_OK) {
+        LOGE("%s: Failed to open for writing: %s",
+             path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    return save(a.get(), path.c_str());
+}
+
+/*!
+ * \brief Write entry table to a cpio archive in memory
+ *
+ * \param[out] out String to store the archive data
+ *
+ * \return Whether the archive was successfully written
+ */
+bool CpioEditor::save_memory(std::string &out)
+{
+    compression_type compression;
+
+    if (parallel_compression(compression)) {
+        std::string raw;
+
+        return write_memory(raw, false)
+                && compress_parallel(compression, raw.data(), raw.size(),
+                                     out);
+    }
+
+    return write_memory(out, true);
+}
+
+/*!
+ * \brief Check whether an entry exists
+ */
+bool CpioEditor::exists(const std::string &path) const
+{
+    return find(path) != _entries.end();
+}
+
+/*!
+ * \brief Check whether an entry exists and is a symlink
+ */
+bool CpioEditor::is_symlink(const std::string &path) const
+{
+    auto it = find(path);
+    return it != _entries.end()
+            && archive_entry_filetype(it->entry.get()) == AE_IFLNK;
+}
+
+/*!
+ * \brief Get symlink target of an entry
+ *
+ * \return Whether the entry exists and is a symlink
+ */
+bool CpioEditor::read_link(const std::string &path, std::string &target) const
+{
+    auto it = find(path);
+    if (it == _entries.end()
+            || archive_entry_filetype(it->entry.get()) != AE_IFLNK) {
+        return false;
+    }
+
+    const char *symlink = archive_entry_symlink(it->entry.get());
+    target = symlink ? symlink : "";
+    return true;
+}
+
+/*!
+ * \brief Get contents of a regular file entry
+ *
+ * \return Whether the entry exists and is a regular file
+ */
+bool CpioEditor::contents(const std::string &path, std::string &out) const
+{
+    auto it = find(path);
+    if (it == _entries.end()) {
+        LOGE("%s: Entry not found in archive", path.c_str());
+        return false;
+    } else if (archive_entry_filetype(it->entry.get()) != AE_IFREG) {
+        LOGE("%s: Entry is not a regular file", path.c_str());
+        return false;
+    } else if (!it->source.empty()) {
+        LOGE("%s: Entry contents are stored on disk", path.c_str());
+        return false;
+    }
+
+    out = it->data;
+    return true;
+}
+
+/*!
+ * \brief Get mode (file type and permissions) of an entry
+ *
+ * \return Entry mode or 0 if the entry does not exist
+ */
+mode_t CpioEditor::mode(const std::string &path) const
+{
+    auto it = find(path);
+    if (it == _entries.end()) {
+        return 0;
+    }
+
+    return archive_entry_mode(it->entry.get());
+}
+
+/*!
+ * \brief Add or replace a regular file entry with in-memory contents
+ *
+ * \param path Entry path
+ * \param data File contents
+ * \param perm Permission bits
+ */
+bool CpioEditor::set_contents(const std::string &path, std::string data,
+                              mode_t perm)
+{
+    Entry &e = replace_entry(path);
+    archive_entry_set_mode(e.entry.get(), AE_IFREG | (perm & 07777));
+    e.data = std::move(data);
+    return true;
+}
+
+/*!
+ * \brief Add or replace a regular file entry with the contents of a file
+ *
+ * The file is not read until the archive is saved.
+ *
+ * \param path Entry path
+ * \param source Path to file on disk
+ * \param perm Permission bits
+ */
+bool CpioEditor::add_file(const std::string &path, const std::string &source,
+                          mode_t perm)
+{
+    struct stat sb;
+
+    if (stat(source.c_str(), &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", source.c_str(), strerror(errno));
+        return false;
+    } else if (!S_ISREG(sb.st_mode)) {
+        LOGE("%s: Not a regular file", source.c_str());
+        return false;
+    }
+
+    Entry &e = replace_entry(path);
+    archive_entry_set_mode(e.entry.get(), AE_IFREG | (perm & 07777));
+    e.source = source;
+    return true;
+}
+
+/*!
+ * \brief Add or replace a symlink entry
+ *
+ * \param path Entry path
+ * \param target Symlink target
+ */
+bool CpioEditor::add_symlink(const std::string &path, const std::string &target)
+{
+    Entry &e = replace_entry(path);
+    archive_entry_set_mode(e.entry.get(), AE_IFLNK | 0777);
+    archive_entry_set_symlink(e.entry.get(), target.c_str());
+    return true;
+}
+
+/*!
+ * \brief Remove an entry
+ *
+ * If the entry is a directory, all entries beneath it are removed as well.
+ *
+ * \return Whether the entry existed
+ */
+bool CpioEditor::remove(const std::string &path)
+{
+    auto it = find(path);
+    if (it == _entries.end()) {
+        return false;
+    }
+
+    std::string prefix = normalize_path(path);
+    prefix += '/';
+
+    _entries.erase(it);
+
+    _entries.erase(std::remove_if(_entries.begin(), _entries.end(),
+                                  [&](const Entry &e) {
+        const char *name = archive_entry_pathname(e.entry.get());
+        return name && normalize_path(name).compare(
+                0, prefix.size(), prefix) == 0;
+    }), _entries.end());
+
+    return true;
+}
+
+/*!
+ * \brief Rename a non-directory entry
+ *
+ * If \p to already exists, it is replaced.
+ */
+bool CpioEditor::rename(const std::string &from, const std::string &to)
+{
+    std::string from_normalized = normalize_path(from);
+    std::string to_normalized = normalize_path(to);
+
+    if (from_normalized == to_normalized) {
+        return exists(from);
+    }
+
+    auto it = find(from);
+    if (it == _entries.end()) {
+        LOGE("%s: Entry not found in archive", from.c_str());
+        return false;
+    } else if (archive_entry_filetype(it->entry.get()) == AE_IFDIR) {
+        LOGE("%s: Cannot rename directory entry", from.c_str());
+        return false;
+    }
+
+    archive_entry_set_pathname(it->entry.get(), to_normalized.c_str());
+
+    auto target = std::find_if(_entries.begin(), _entries.end(),
+                               [&](const Entry &e) {
+        return &e != &*it && path_matches(e.entry.get(), to_normalized);
+    });
+    if (target != _entries.end()) {
+        _entries.erase(target);
+    }
+
+    return true;
+}
+
+}
+}
@@ -19,14 +19,23 @@
 
 #include "mbutil/delete.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
 #include <cerrno>
 #include <cstdlib>
 #include <cstring>
+
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "mbcommon/string.h"
+#include "mbcommon/thread_pool.h"
 #include "mblog/logging.h"
-#include "mbutil/fts.h"
+#include "mbutil/dirwalk.h"
 #include "mbutil/string.h"
 
 namespace mb
@@ -34,46 +43,79 @@ namespace mb
 namespace util
 {
 
-class RecursiveDeleter : public FTSWrapper {
+static bool is_excluded(const std::vector<std::string> &exclusions,
+                        const char *name)
+{
+    for (auto const &exclusion : exclusions) {
+        if (exclusion == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+class RecursiveDeleter : public DirWalker {
 public:
-    RecursiveDeleter(std::string path)
-        : FTSWrapper(path, FTS_GroupSpecialFiles)
+    RecursiveDeleter(std::string path, int flags,
+                     const std::vector<std::string> &exclusions)
+        : DirWalker(path, 0),
+        _delete_flags(flags),
+        _exclusions(exclusions)
     {
     }
 
+    virtual int on_changed_path() override
+    {
+        // Exclude first-level entries
+        if (_curr->level == 1 && is_excluded(_exclusions, _curr->name)) {
+            return Action::DW_Skip;
+        }
+
+        return Action::DW_OK;
+    }
+
     virtual int on_reached_directory_pre() override
     {
         // Do nothing. Need depth-first search, so directories are deleted in
         // on_reached_directory_post()
-        return Action::FTS_OK;
+        return Action::DW_OK;
     }
 
     virtual int on_reached_directory_post() override
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return delete_path() ? Action::DW_OK : Action::DW_Fail;
     }
 
     virtual int on_reached_file() override
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return delete_path() ? Action::DW_OK : Action::DW_Fail;
     }
 
     virtual int on_reached_symlink() override
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return delete_path() ? Action::DW_OK : Action::DW_Fail;
     }
 
     virtual int on_reached_special_file() override
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return delete_path() ? Action::DW_OK : Action::DW_Fail;
     }
 
 private:
+    int _delete_flags;
+    const std::vector<std::string> &_exclusions;
+
     bool delete_path()
     {
-        if (remove(_curr->fts_accpath) < 0) {
+        if (_curr->level == 0 && (_delete_flags & DELETE_CONTENTS_ONLY)) {
+            return true;
+        }
+
+        int flags = S_ISDIR(_curr->sb.st_mode) ? AT_REMOVEDIR : 0;
+
+        if (unlinkat(_curr->dirfd, _curr->name, flags) < 0) {
             mb::format(_error_msg, "%s: Failed to remove: %s",
-                       _curr->fts_path, strerror(errno));
+                       _curr->path, strerror(errno));
             LOGE("%s", _error_msg.c_str());
             return false;
         }
@@ -81,16 +123,234 @@ private:
     }
 };
 
+/*!
+ * \brief Parallel deletion of a directory tree
+ *
+ * Every directory in the tree is a separate task. A worker takes a directory,
+ * unlinks all of its non-directory children relative to the directory's fd,
+ * and queues its subdirectories as new tasks. Once the whole tree has been
+ * emptied, the directories are removed bottom-up.
+ */
+class ParallelDeleter
+{
+public:
+    ParallelDeleter(std::string path, int flags,
+                    const std::vector<std::string> &exclusions)
+        : _path(std::move(path)), _flags(flags), _exclusions(exclusions)
+    {
+    }
+
+    bool run(const struct stat &sb)
+    {
+        _root_dev = sb.st_dev;
+        _tasks.push_back({std::move(_path), 0});
+
+        // Workers that start late simply find nothing left to do
+        TaskGroup group;
+        for (unsigned int i = 0; i < ThreadPool::shared().size(); ++i) {
+            group.run([this] { worker(); });
+        }
+        group.wait();
+
+        // Children must be removed before their parents
+        std::stable_sort(_dirs.begin(), _dirs.end(),
+                         [](const Task &a, const Task &b) {
+            return a.level > b.level;
+        });
+
+        for (auto const &dir : _dirs) {
+            if (dir.level == 0 && (_flags & DELETE_CONTENTS_ONLY)) {
+                continue;
+            }
+
+            if (rmdir(dir.path.c_str()) < 0) {
+                fail(dir.path.c_str());
+            }
+        }
+
+        return !_failed;
+    }
+
+private:
+    struct Task
+    {
+        std::string path;
+        size_t level;
+    };
+
+    // Walks a single directory, queuing subdirectories instead of descending
+    class DirectoryEmptier : public DirWalker
+    {
+    public:
+        DirectoryEmptier(ParallelDeleter &deleter, const Task &task)
+            : DirWalker(task.path, 0), _deleter(deleter), _task(task)
+        {
+        }
+
+        virtual int on_changed_path() override
+        {
+            // Exclude first-level entries
+            if (_task.level == 0 && _curr->level == 1
+                    && is_excluded(_deleter._exclusions, _curr->name)) {
+                return Action::DW_Skip;
+            }
+
+            return Action::DW_OK;
+        }
+
+        virtual int on_reached_directory_pre() override
+        {
+            if (_curr->level == 0) {
+                return Action::DW_OK;
+            }
+
+            Task child{_curr->path, _task.level + _curr->level};
+
+            // Don't descend into mountpoints, but still try to remove them
+            if (_curr->sb.st_dev != _deleter._root_dev) {
+                _deleter.add_dir(std::move(child));
+            } else {
+                _deleter.push(std::move(child));
+            }
+
+            return Action::DW_Skip;
+        }
+
+        virtual int on_reached_file() override
+        {
+            return unlink_path() ? Action::DW_OK : Action::DW_Fail;
+        }
+
+        virtual int on_reached_symlink() override
+        {
+            return unlink_path() ? Action::DW_OK : Action::DW_Fail;
+        }
+
+        virtual int on_reached_special_file() override
+        {
+            return unlink_path() ? Action::DW_OK : Action::DW_Fail;
+        }
+
+    private:
+        ParallelDeleter &_deleter;
+        const Task &_task;
+
+        bool unlink_path()
+        {
+            if (unlinkat(_curr->dirfd, _curr->name, 0) < 0) {
+                _deleter.fail(_curr->path);
+                return false;
+            }
+            return true;
+        }
+    };
+
+    void push(Task task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _tasks.push_back(std::move(task));
+        }
+        _cv.notify_one();
+    }
+
+    void add_dir(Task task)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _dirs.push_back(std::move(task));
+    }
+
+    void fail(const char *path)
+    {
+        std::string error_msg;
+        mb::format(error_msg, "%s: Failed to remove: %s",
+                   path, strerror(errno));
+        LOGE("%s", error_msg.c_str());
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _failed = true;
+    }
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        while (true) {
+            // Finished once there are no tasks left and no running task can
+            // queue more
+            _cv.wait(lock, [&]{ return !_tasks.empty() || _active == 0; });
+            if (_tasks.empty()) {
+                break;
+            }
+
+            Task task = std::move(_tasks.front());
+            _tasks.pop_front();
+            ++_active;
+
+            lock.unlock();
+
+            DirectoryEmptier emptier(*this, task);
+            if (!emptier.run()) {
+                lock.lock();
+                _failed = true;
+                lock.unlock();
+            }
+
+            lock.lock();
+
+            _dirs.push_back(std::move(task));
+            if (--_active == 0 && _tasks.empty()) {
+                _cv.notify_all();
+            }
+        }
+    }
+
+    std::string _path;
+    int _flags;
+    const std::vector<std::string> &_exclusions;
+    dev_t _root_dev = 0;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<Task> _tasks;
+    size_t _active = 0;
+    // Directories to remove once the tree is empty
+    std::vector<Task> _dirs;
+    bool _failed = false;
+};
+
 bool delete_recursive(const std::string &path)
+{
+    return delete_recursive(path, 0, {});
+}
+
+/*!
+ * \brief Recursively delete a path
+ *
+ * \param path Path to delete
+ * \param flags \ref DeleteFlags
+ * \param exclusions Names of first-level entries in \p path to leave alone.
+ *                   When any entry is excluded, removing \p path itself will
+ *                   fail unless `DELETE_CONTENTS_ONLY` is specified.
+ *
+ * \return True if the path was deleted or did not exist. False, otherwise.
+ */
+bool delete_recursive(const std::string &path, int flags,
+                      const std::vector<std::string> &exclusions)
 {
     struct stat sb;
-    if (stat(path.c_str(), &sb) < 0 && errno == ENOENT) {
+    if (lstat(path.c_str(), &sb) < 0 && errno == ENOENT) {
         // Don't fail if directory does not exist
         return true;
     }
 
-    RecursiveDeleter deleter(path);
-    return deleter.run();
+    if ((flags & DELETE_PARALLEL) && S_ISDIR(sb.st_mode)) {
+        ParallelDeleter deleter(path, flags, exclusions);
+        return deleter.run(sb);
+    } else {
+        RecursiveDeleter deleter(path, flags, exclusions);
+        return deleter.run();
+    }
 }
 
 }
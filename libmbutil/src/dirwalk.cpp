@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/dirwalk.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+#include "mbutil/finally.h"
+
+// Large enough for several hundred entries per getdents64() call
+#define DENT_BUF_SIZE           (32 * 1024)
+
+namespace mb
+{
+namespace util
+{
+
+// Not exposed by bionic or glibc (before 2.30)
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+DirWalker::DirWalker(std::string path, int flags)
+    : _path(std::move(path))
+    , _flags(flags)
+{
+}
+
+DirWalker::~DirWalker() = default;
+
+bool DirWalker::run()
+{
+    if (_ran) {
+        _error_msg = "Already ran";
+        return false;
+    }
+    _ran = true;
+
+    // Pre-execute hook
+    if (!on_pre_execute()) {
+        return false;
+    }
+
+    Entry root;
+    root.dirfd = AT_FDCWD;
+    root.name = _path.c_str();
+    root.level = 0;
+
+    _path_buf = _path;
+    root.path = _path_buf.c_str();
+
+    if (fstatat(AT_FDCWD, root.name, &root.sb, AT_SYMLINK_NOFOLLOW) < 0) {
+        mb::format(_error_msg, "%s: Failed to stat: %s",
+                   root.path, strerror(errno));
+        _ret = false;
+    } else {
+        _root_dev = root.sb.st_dev;
+        visit(root);
+    }
+
+    _curr = nullptr;
+
+    if (!on_post_execute(_ret)) {
+        return false;
+    }
+
+    return _ret;
+}
+
+std::string DirWalker::error()
+{
+    return _error_msg;
+}
+
+/*!
+ * \brief Run the hooks for an entry and descend into it if it's a directory
+ *
+ * \return Whether the traversal should continue
+ */
+bool DirWalker::visit(Entry &entry)
+{
+    size_t path_len = _path_buf.size();
+    int result;
+
+    _curr = &entry;
+
+    // Current path hook
+    _error_msg = "Handler returned failure";
+    result = on_changed_path();
+    if (result & DW_Fail) {
+        _ret = false;
+    }
+    if (result & (DW_Next | DW_Skip)) {
+        return true;
+    }
+    if (result & DW_Stop) {
+        return false;
+    }
+
+    // Call other hooks
+    _error_msg = "Handler returned failure";
+
+    switch (entry.sb.st_mode & S_IFMT) {
+    case S_IFDIR: result = on_reached_directory_pre(); break;
+    case S_IFREG: result = on_reached_file(); break;
+    case S_IFLNK: result = on_reached_symlink(); break;
+    default: result = on_reached_special_file(); break;
+    }
+
+    // Handle result
+    if (result & DW_Fail) {
+        _ret = false;
+    }
+    if (result & DW_Skip) {
+        return true;
+    }
+    if (result & DW_Stop) {
+        return false;
+    }
+
+    if (!S_ISDIR(entry.sb.st_mode)) {
+        return true;
+    }
+
+    // Don't descend into mountpoints by default
+    if ((_flags & DW_CrossMountPointBoundaries)
+            || entry.sb.st_dev == _root_dev) {
+        if (!walk_dir(entry)) {
+            return false;
+        }
+    }
+
+    // The children may have reallocated the path buffer
+    _path_buf.resize(path_len);
+    entry.path = _path_buf.c_str();
+    _curr = &entry;
+
+    _error_msg = "Handler returned failure";
+    result = on_reached_directory_post();
+    if (result & DW_Fail) {
+        _ret = false;
+    }
+
+    return !(result & DW_Stop);
+}
+
+/*!
+ * \brief Visit every entry in a directory
+ *
+ * \return Whether the traversal should continue
+ */
+bool DirWalker::walk_dir(const Entry &dir)
+{
+    int fd = openat(dir.dirfd, dir.name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        mb::format(_error_msg, "%s: Failed to open directory: %s",
+                   dir.path, strerror(errno));
+        _ret = false;
+        return true;
+    }
+
+    auto close_fd = finally([&] {
+        close(fd);
+    });
+
+    size_t level = dir.level + 1;
+    if (_dent_bufs.size() < level) {
+        _dent_bufs.emplace_back(new char[DENT_BUF_SIZE]);
+    }
+    char *buf = _dent_bufs[level - 1].get();
+
+    size_t parent_len = _path_buf.size();
+    if (parent_len > 0 && _path_buf.back() != '/') {
+        ++parent_len;
+    }
+
+    Entry child;
+    child.dirfd = fd;
+    child.level = level;
+
+    while (true) {
+        long n = syscall(SYS_getdents64, fd, buf, DENT_BUF_SIZE);
+        if (n < 0) {
+            mb::format(_error_msg, "%s: Failed to read directory: %s",
+                       dir.path, strerror(errno));
+            _ret = false;
+            return true;
+        } else if (n == 0) {
+            return true;
+        }
+
+        for (long offset = 0; offset < n;) {
+            auto dent = reinterpret_cast<linux_dirent64 *>(buf + offset);
+            offset += dent->d_reclen;
+
+            const char *name = dent->d_name;
+            if (name[0] == '.' && (name[1] == '\0'
+                    || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+
+            _path_buf.resize(parent_len, '/');
+            _path_buf += name;
+
+            child.name = name;
+            child.path = _path_buf.c_str();
+
+            if (fstatat(fd, name, &child.sb, AT_SYMLINK_NOFOLLOW) < 0) {
+                mb::format(_error_msg, "%s: Failed to stat: %s",
+                           child.path, strerror(errno));
+                _ret = false;
+                continue;
+            }
+
+            if (!visit(child)) {
+                return false;
+            }
+        }
+    }
+}
+
+bool DirWalker::on_pre_execute()
+{
+    return true;
+}
+
+bool DirWalker::on_post_execute(bool success)
+{
+    (void) success;
+    return true;
+}
+
+int DirWalker::on_changed_path()
+{
+    return Action::DW_OK;
+}
+
+int DirWalker::on_reached_directory_pre()
+{
+    return Action::DW_OK;
+}
+
+int DirWalker::on_reached_directory_post()
+{
+    return Action::DW_OK;
+}
+
+int DirWalker::on_reached_file()
+{
+    return Action::DW_OK;
+}
+
+int DirWalker::on_reached_symlink()
+{
+    return Action::DW_OK;
+}
+
+int DirWalker::on_reached_special_file()
+{
+    return Action::DW_OK;
+}
+
+}
+}
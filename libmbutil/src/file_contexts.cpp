@@ -0,0 +1,466 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/file_contexts.h"
+
+#include <algorithm>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <regex.h>
+
+#include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/finally.h"
+
+#define NO_NODE                 UINT32_MAX
+
+// Maximum number of memoized parent directories
+#define MAX_DIR_MEMOS           256
+
+namespace mb
+{
+namespace util
+{
+
+struct FileContexts::Spec
+{
+    std::string regex_str;
+    std::string context;
+    mode_t mode;
+    // Has no regex metacharacters (same definition as libselinux, which uses
+    // it for ordering the specs)
+    bool exact;
+    // Can be matched with a plain string comparison
+    bool literal;
+    bool compiled;
+    regex_t regex;
+
+    Spec() : mode(0), exact(false), literal(false), compiled(false)
+    {
+    }
+
+    ~Spec()
+    {
+        if (compiled) {
+            regfree(&regex);
+        }
+    }
+};
+
+static bool string_to_mode(const char *str, mode_t *mode)
+{
+    if (!str) {
+        *mode = 0;
+        return true;
+    }
+
+    if (str[0] != '-' || !str[1] || str[2]) {
+        return false;
+    }
+
+    switch (str[1]) {
+    case 'b': *mode = S_IFBLK;  return true;
+    case 'c': *mode = S_IFCHR;  return true;
+    case 'd': *mode = S_IFDIR;  return true;
+    case 'p': *mode = S_IFIFO;  return true;
+    case 'l': *mode = S_IFLNK;  return true;
+    case 's': *mode = S_IFSOCK; return true;
+    case '-': *mode = S_IFREG;  return true;
+    default:  return false;
+    }
+}
+
+// Same as spec_hasMetaChars() in libselinux
+static bool has_meta_chars(const std::string &regex)
+{
+    for (size_t i = 0; i < regex.size(); ++i) {
+        switch (regex[i]) {
+        case '.':
+        case '^':
+        case '$':
+        case '?':
+        case '*':
+        case '+':
+        case '|':
+        case '[':
+        case '(':
+        case '{':
+            return true;
+        case '\\':
+            ++i;
+            break;
+        default:
+            break;
+        }
+    }
+    return false;
+}
+
+/*!
+ * \brief Get the literal text that every path matched by a regex starts with
+ *
+ * This is conservative. An empty prefix is returned if the regex has a
+ * top-level alternation, since either branch could match.
+ */
+static std::string literal_prefix(const std::string &regex)
+{
+    int depth = 0;
+    bool in_bracket = false;
+
+    for (size_t i = 0; i < regex.size(); ++i) {
+        char c = regex[i];
+
+        if (c == '\\') {
+            ++i;
+        } else if (in_bracket) {
+            in_bracket = c != ']';
+        } else if (c == '[') {
+            in_bracket = true;
+        } else if (c == '(') {
+            ++depth;
+        } else if (c == ')') {
+            --depth;
+        } else if (c == '|' && depth == 0) {
+            return {};
+        }
+    }
+
+    std::string prefix;
+
+    for (size_t i = 0; i < regex.size(); ++i) {
+        char c = regex[i];
+
+        switch (c) {
+        case '?':
+        case '*':
+        case '{':
+            // The previous character is optional
+            if (!prefix.empty()) {
+                prefix.pop_back();
+            }
+            return prefix;
+        case '+':
+            return prefix;
+        case '.':
+        case '^':
+        case '$':
+        case '|':
+        case '[':
+        case '(':
+            return prefix;
+        case '\\':
+            // Escaped letters and digits are classes or backreferences
+            if (i + 1 == regex.size()
+                    || isalnum(static_cast<unsigned char>(regex[i + 1]))) {
+                return prefix;
+            }
+            prefix += regex[++i];
+            break;
+        default:
+            prefix += c;
+            break;
+        }
+    }
+
+    return prefix;
+}
+
+FileContexts::FileContexts() = default;
+
+FileContexts::~FileContexts() = default;
+
+void FileContexts::clear()
+{
+    _specs.clear();
+    _exact.clear();
+    _trie.clear();
+    _memo.clear();
+}
+
+bool FileContexts::add_spec(const char *regex, const char *type,
+                            const char *context)
+{
+    std::unique_ptr<Spec> spec(new Spec());
+
+    if (!string_to_mode(type, &spec->mode)) {
+        LOGW("Invalid file type in file_contexts: %s", type);
+        return false;
+    }
+
+    spec->regex_str = regex;
+    spec->context = context;
+    spec->exact = !has_meta_chars(spec->regex_str);
+    spec->literal = spec->exact && !strchr(regex, '\\');
+
+    _specs.push_back(std::move(spec));
+    return true;
+}
+
+/*!
+ * \brief Load specs from a textual file_contexts file
+ *
+ * Binary file_contexts files contain precompiled PCRE regexes and would need
+ * libpcre to evaluate. Use file-contexts-tool to decompile them first.
+ */
+bool FileContexts::load(const std::string &path)
+{
+    clear();
+
+    autoclose::file fp(autoclose::fopen(path.c_str(), "re"));
+    if (!fp) {
+        LOGE("%s: Failed to open for reading: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t n;
+
+    auto free_line = finally([&] {
+        free(line);
+    });
+
+    while ((n = getline(&line, &len, fp.get())) >= 0) {
+        char *fields[4];
+        int count = 0;
+        char *save_ptr;
+        char *p = line;
+
+        while (isspace(static_cast<unsigned char>(*p))) {
+            ++p;
+        }
+        if (*p == '#') {
+            continue;
+        }
+
+        for (p = strtok_r(p, " \t\r\n", &save_ptr);
+                p && count < 4; p = strtok_r(nullptr, " \t\r\n", &save_ptr)) {
+            fields[count++] = p;
+        }
+
+        if (count == 2) {
+            add_spec(fields[0], nullptr, fields[1]);
+        } else if (count == 3) {
+            add_spec(fields[0], fields[1], fields[2]);
+        } else if (count != 0) {
+            LOGW("%s: Ignoring invalid line: %s", path.c_str(), fields[0]);
+        }
+    }
+
+    if (ferror(fp.get())) {
+        LOGE("%s: Failed to read file: %s", path.c_str(), strerror(errno));
+        clear();
+        return false;
+    }
+
+    index_specs();
+    return true;
+}
+
+void FileContexts::index_specs()
+{
+    // Like libselinux, move the exact paths to the end while keeping the
+    // relative order. Specs with higher indexes have precedence.
+    std::stable_partition(_specs.begin(), _specs.end(),
+                          [](const std::unique_ptr<Spec> &spec) {
+        return !spec->exact;
+    });
+
+    _trie.emplace_back();
+
+    for (uint32_t i = 0; i < _specs.size(); ++i) {
+        Spec &spec = *_specs[i];
+
+        if (spec.literal) {
+            _exact[spec.regex_str].push_back(i);
+            continue;
+        }
+
+        std::string anchored("^");
+        anchored += spec.regex_str;
+        anchored += '$';
+
+        int ret = regcomp(&spec.regex, anchored.c_str(),
+                          REG_EXTENDED | REG_NOSUB);
+        if (ret != 0) {
+            char buf[128];
+            regerror(ret, &spec.regex, buf, sizeof(buf));
+            LOGW("Ignoring invalid file_contexts regex: %s: %s",
+                 spec.regex_str.c_str(), buf);
+            continue;
+        }
+        spec.compiled = true;
+
+        // Insert into the trie
+        uint32_t node = 0;
+
+        for (char c : literal_prefix(spec.regex_str)) {
+            auto &children = _trie[node].children;
+            auto it = std::lower_bound(
+                    children.begin(), children.end(), c,
+                    [](const std::pair<char, uint32_t> &child, char c) {
+                return child.first < c;
+            });
+
+            if (it != children.end() && it->first == c) {
+                node = it->second;
+            } else {
+                uint32_t child = static_cast<uint32_t>(_trie.size());
+                children.insert(it, { c, child });
+                _trie.emplace_back();
+                node = child;
+            }
+        }
+
+        _trie[node].specs.push_back(i);
+    }
+}
+
+/*!
+ * \brief Walk the trie and collect the specs for every node on the way
+ *
+ * \return Final node or NO_NODE if the walk fell off the trie
+ */
+uint32_t FileContexts::trie_walk(uint32_t node, const char *begin,
+                                 const char *end,
+                                 std::vector<uint32_t> &specs) const
+{
+    for (const char *p = begin; p != end; ++p) {
+        auto &children = _trie[node].children;
+        auto it = std::lower_bound(
+                children.begin(), children.end(), *p,
+                [](const std::pair<char, uint32_t> &child, char c) {
+            return child.first < c;
+        });
+
+        if (it == children.end() || it->first != *p) {
+            return NO_NODE;
+        }
+
+        node = it->second;
+        specs.insert(specs.end(), _trie[node].specs.begin(),
+                     _trie[node].specs.end());
+    }
+
+    return node;
+}
+
+const FileContexts::DirMemo & FileContexts::dir_memo(const std::string &dir)
+{
+    auto it = _memo.find(dir);
+    if (it != _memo.end()) {
+        return it->second;
+    }
+
+    if (_memo.size() >= MAX_DIR_MEMOS) {
+        _memo.clear();
+    }
+
+    DirMemo memo;
+    memo.specs = _trie[0].specs;
+    memo.node = trie_walk(0, dir.data(), dir.data() + dir.size(), memo.specs);
+
+    return _memo.emplace(dir, std::move(memo)).first->second;
+}
+
+/*!
+ * \brief Look up the SELinux label for a path
+ *
+ * \param path Absolute path as it would exist on the running system
+ * \param mode File mode (only the file type bits are used) or 0 to match specs
+ *             for any file type
+ * \param[out] context Matching context
+ *
+ * \return True if a matching spec was found. False if no spec matched or if
+ *         the matching spec is `<<none>>`.
+ */
+bool FileContexts::lookup(const std::string &path, mode_t mode,
+                          std::string *context)
+{
+    if (_specs.empty()) {
+        return false;
+    }
+
+    // Normalize trailing slashes (eg. "/data/" -> "/data")
+    size_t path_len = path.size();
+    while (path_len > 1 && path[path_len - 1] == '/') {
+        --path_len;
+    }
+    const std::string *key = &path;
+    std::string normalized;
+    if (path_len != path.size()) {
+        normalized = path.substr(0, path_len);
+        key = &normalized;
+    }
+
+    size_t slash = key->rfind('/');
+    size_t name_pos = slash == std::string::npos ? 0 : slash + 1;
+
+    const DirMemo &memo = dir_memo(key->substr(0, name_pos));
+
+    _candidates = memo.specs;
+    if (memo.node != NO_NODE) {
+        trie_walk(memo.node, key->data() + name_pos,
+                  key->data() + key->size(), _candidates);
+    }
+
+    auto exact = _exact.find(*key);
+    if (exact != _exact.end()) {
+        _candidates.insert(_candidates.end(), exact->second.begin(),
+                           exact->second.end());
+    }
+
+    // Highest index has precedence
+    std::sort(_candidates.begin(), _candidates.end(),
+              std::greater<uint32_t>());
+
+    mode_t file_type = mode & S_IFMT;
+
+    for (uint32_t index : _candidates) {
+        const Spec &spec = *_specs[index];
+
+        if (file_type && spec.mode && spec.mode != file_type) {
+            continue;
+        }
+
+        // Exact entries come from the hash lookup and have already matched
+        if (!spec.literal
+                && regexec(&spec.regex, key->c_str(), 0, nullptr, 0) != 0) {
+            continue;
+        }
+
+        if (spec.context == "<<none>>") {
+            return false;
+        }
+
+        *context = spec.context;
+        return true;
+    }
+
+    return false;
+}
+
+}
+}
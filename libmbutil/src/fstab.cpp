@@ -32,6 +32,7 @@
 
 #include "mblog/logging.h"
 #include "mbutil/autoclose/file.h"
+#include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/string.h"
 
@@ -47,7 +48,7 @@ struct mount_flag
     int flag;
 };
 
-static struct mount_flag mount_flags[] =
+static const struct mount_flag mount_flags[] =
 {
     { "active",         MS_ACTIVE },
     { "bind",           MS_BIND },
@@ -78,7 +79,7 @@ static struct mount_flag mount_flags[] =
     { nullptr,          0 }
 };
 
-static struct mount_flag fs_mgr_flags[] =
+static const struct mount_flag fs_mgr_flags[] =
 {
     { "wait",           MF_WAIT },
     { "check",          MF_CHECK },
@@ -100,22 +101,41 @@ static struct mount_flag fs_mgr_flags[] =
     { nullptr,          0 }
 };
 
-static int options_to_flags(struct mount_flag *flags_map, char *args,
-                            char *new_args, int size)
+/*!
+ * \brief Compute flags from a comma-separated list of options
+ *
+ * \param flags_map Flags table. Options match an entry if they begin with the
+ *                  entry's name.
+ * \param args Options (NULL-terminated)
+ * \param new_args If not nullptr, options that are not in \p flags_map are
+ *                 written here, separated by commas and NULL-terminated. This
+ *                 must be at least as large as \p args.
+ *
+ * \return Flags for the recognized options
+ */
+static unsigned long options_to_flags(const struct mount_flag *flags_map,
+                                      const char *args, char *new_args)
 {
-    char *temp;
-    char *save_ptr;
-    int flags = 0;
-    int i;
+    unsigned long flags = 0;
+    char *out = new_args;
 
-    if (new_args && size > 0) {
-        new_args[0] = '\0';
-    }
+    while (*args) {
+        // Skip empty options
+        if (*args == ',') {
+            ++args;
+            continue;
+        }
+
+        const char *end = strchr(args, ',');
+        if (!end) {
+            end = args + strlen(args);
+        }
+        size_t len = end - args;
 
-    temp = strtok_r(args, ",", &save_ptr);
-    while (temp) {
+        int i;
         for (i = 0; flags_map[i].name; ++i) {
-            if (strncmp(temp, flags_map[i].name, strlen(flags_map[i].name)) == 0) {
+            size_t name_len = strlen(flags_map[i].name);
+            if (name_len <= len && memcmp(args, flags_map[i].name, name_len) == 0) {
                 flags |= flags_map[i].flag;
                 break;
             }
@@ -123,144 +143,188 @@ static int options_to_flags(struct mount_flag *flags_map, char *args,
 
         if (!flags_map[i].name) {
             if (new_args) {
-                strlcat(new_args, temp, size);
-                strlcat(new_args, ",", size);
+                if (out != new_args) {
+                    *out++ = ',';
+                }
+                memcpy(out, args, len);
+                out += len;
             } else {
-                LOGW("Only universal mount options expected, but found %s", temp);
+                LOGW("Only universal mount options expected, but found %.*s",
+                     static_cast<int>(len), args);
             }
         }
 
-        temp = strtok_r(nullptr, ",", &save_ptr);
+        args = end;
     }
 
-    if (new_args && new_args[0]) {
-        new_args[strlen(new_args) - 1] = '\0';
+    if (new_args) {
+        *out = '\0';
     }
 
     return flags;
 }
 
-// Much simplified version of fs_mgr's fstab parsing code
-std::vector<fstab_rec> read_fstab(const std::string &path)
+Fstab::Fstab() = default;
+
+/*!
+ * \brief Read and parse fstab file
+ *
+ * \param path Path to fstab file
+ *
+ * \return True if the file was successfully parsed and contains at least one
+ *         entry. Otherwise, false (and the error is logged).
+ */
+bool Fstab::load(const std::string &path)
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "rb"));
-    if (!fp) {
+    std::vector<unsigned char> data;
+
+    if (!file_read_all(path, &data)) {
         LOGE("Failed to open file %s: %s", path.c_str(), strerror(errno));
-        return std::vector<fstab_rec>();
+        _buf.clear();
+        _entries.clear();
+        return false;
     }
 
-    int count, entries;
-    char *line = nullptr;
-    size_t len = 0; // allocated memory size
-    ssize_t bytes_read; // number of bytes read
-    char *temp;
-    char *save_ptr;
-    const char *delim = " \t";
-    std::vector<fstab_rec> fstab;
-    char temp_mount_args[1024];
-
-    auto free_line = finally([&] {
-        free(line);
-    });
+    return load_data(reinterpret_cast<const char *>(data.data()), data.size());
+}
 
-    entries = 0;
-    while ((bytes_read = getline(&line, &len, fp.get())) != -1) {
-        // Strip newlines
-        if (bytes_read > 0 && line[bytes_read - 1] == '\n') {
-            line[bytes_read - 1] = '\0';
+/*!
+ * \brief Parse fstab data
+ *
+ * This is a much simplified version of fs_mgr's fstab parsing code.
+ *
+ * \param data fstab file contents
+ * \param size Size of \p data
+ *
+ * \return True if the data was successfully parsed and contains at least one
+ *         entry. Otherwise, false (and the error is logged).
+ */
+bool Fstab::load_data(const char *data, size_t size)
+{
+    static const char *delim = " \t";
+
+    _buf.clear();
+    _entries.clear();
+
+    // Each line is stored three times at most: the original line, the line
+    // split into NULL-terminated fields, and the filtered filesystem options.
+    // Reserving all of the space up front guarantees that the entries'
+    // pointers are never invalidated by a reallocation.
+    _buf.reserve(3 * (size + 1));
+
+    auto append = [&](const char *begin, size_t n) {
+        char *ptr = _buf.data() + _buf.size();
+        _buf.insert(_buf.end(), begin, begin + n);
+        _buf.push_back('\0');
+        return ptr;
+    };
+
+    const char *end = data + size;
+
+    for (const char *line = data; line < end;) {
+        const char *line_end = static_cast<const char *>(
+                memchr(line, '\n', end - line));
+        if (!line_end) {
+            line_end = end;
         }
+        size_t line_size = line_end - line;
 
-        // Strip leading
-        temp = line;
-        while (isspace(*temp)) {
-            ++temp;
-        }
+        const char *next_line = line_end < end ? line_end + 1 : end;
 
         // Skip empty lines and comments
-        if (*temp == '\0' || *temp == '#') {
-            continue;
-        }
-
-        ++entries;
-    }
-
-    if (entries == 0) {
-        LOGE("fstab contains no entries");
-        return std::vector<fstab_rec>();
-    }
-
-    std::fseek(fp.get(), 0, SEEK_SET);
-
-    count = 0;
-    while ((bytes_read = getline(&line, &len, fp.get())) != -1) {
-        // Strip newlines
-        if (bytes_read > 0 && line[bytes_read - 1] == '\n') {
-            line[bytes_read - 1] = '\0';
-        }
-
-        // Strip leading
-        temp = line;
-        while (isspace(*temp)) {
+        const char *temp = line;
+        while (temp < line_end && isspace(*temp)) {
             ++temp;
         }
-
-        // Skip empty lines and comments
-        if (*temp == '\0' || *temp == '#') {
+        if (temp == line_end || *temp == '#') {
+            line = next_line;
             continue;
         }
 
-        // Avoid possible overflow if the file was changed
-        if (count >= entries) {
-            LOGE("Found more fstab entries on second read than first read");
-            break;
+        FstabEntry entry;
+        entry.orig_line = append(line, line_size);
+
+        // Split the line into fields in place
+        char *fields = append(line, line_size);
+        char *save_ptr;
+        char *field[5];
+
+        static const char *missing[] = {
+            "No source path/device found in entry",
+            "No mount point found in entry",
+            "No filesystem type found in entry",
+            "No mount options found in entry",
+            "No fs_mgr/vold options found in entry",
+        };
+
+        for (size_t i = 0; i < 5; ++i) {
+            field[i] = strtok_r(i == 0 ? fields : nullptr, delim, &save_ptr);
+            if (!field[i]) {
+                LOGE("%s: %s", missing[i], entry.orig_line);
+                _buf.clear();
+                _entries.clear();
+                return false;
+            }
         }
 
-        fstab_rec rec;
+        entry.blk_device = field[0];
+        entry.mount_point = field[1];
+        entry.fs_type = field[2];
+        entry.mount_args = field[3];
+        entry.vold_args = field[4];
 
-        rec.orig_line = line;
+        char *fs_options = _buf.data() + _buf.size();
+        _buf.resize(_buf.size() + line_size + 1);
+        entry.flags = options_to_flags(mount_flags, entry.mount_args,
+                                       fs_options);
+        entry.fs_options = fs_options;
+        entry.fs_mgr_flags = options_to_flags(fs_mgr_flags, entry.vold_args,
+                                              nullptr);
 
-        if ((temp = strtok_r(line, delim, &save_ptr)) == nullptr) {
-            LOGE("No source path/device found in entry: %s", line);
-            return std::vector<fstab_rec>();
-        }
-        rec.blk_device = temp;
+        _entries.push_back(entry);
 
-        if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
-            LOGE("No mount point found in entry: %s", line);
-            return std::vector<fstab_rec>();
-        }
-        rec.mount_point = temp;
+        line = next_line;
+    }
 
-        if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
-            LOGE("No filesystem type found in entry: %s", line);
-            return std::vector<fstab_rec>();
-        }
-        rec.fs_type = temp;
+    if (_entries.empty()) {
+        LOGE("fstab contains no entries");
+        return false;
+    }
 
-        if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
-            LOGE("No mount options found in entry: %s", line);
-            return std::vector<fstab_rec>();
-        }
-        rec.mount_args = temp;
-        rec.flags = options_to_flags(mount_flags, temp, temp_mount_args, 1024);
+    return true;
+}
 
-        if (temp_mount_args[0]) {
-            rec.fs_options = temp_mount_args;
-        }
+const std::vector<FstabEntry> & Fstab::entries() const
+{
+    return _entries;
+}
 
-        if ((temp = strtok_r(nullptr, delim, &save_ptr)) == nullptr) {
-            LOGE("No fs_mgr/vold options found in entry: %s", line);
-            return std::vector<fstab_rec>();
-        }
-        rec.vold_args = temp;
-        rec.fs_mgr_flags = options_to_flags(fs_mgr_flags, temp, nullptr, 0);
+std::vector<fstab_rec> read_fstab(const std::string &path)
+{
+    Fstab fstab;
+    std::vector<fstab_rec> result;
 
-        fstab.push_back(std::move(rec));
+    if (!fstab.load(path)) {
+        return result;
+    }
 
-        ++count;
+    result.reserve(fstab.entries().size());
+
+    for (const FstabEntry &entry : fstab.entries()) {
+        fstab_rec rec;
+        rec.blk_device = entry.blk_device;
+        rec.mount_point = entry.mount_point;
+        rec.fs_type = entry.fs_type;
+        rec.flags = entry.flags;
+        rec.fs_options = entry.fs_options;
+        rec.fs_mgr_flags = entry.fs_mgr_flags;
+        rec.vold_args = entry.vold_args;
+        rec.mount_args = entry.mount_args;
+        rec.orig_line = entry.orig_line;
+        result.push_back(std::move(rec));
     }
 
-    return fstab;
+    return result;
 }
 
 static bool convert_to_int(const char *str, int *out)
@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 
 #include "mbcommon/string.h"
+#include "mbutil/counters.h"
 #include "mbutil/string.h"
 
 
@@ -60,6 +61,8 @@ bool FTSWrapper::run()
     bool ret = true;
     int fts_flags = 0;
     int result;
+    // Added to the shared counter once the traversal is done
+    uint64_t visited = 0;
 
     // Don't change directories
     fts_flags += FTS_NOCHDIR;
@@ -91,6 +94,8 @@ bool FTSWrapper::run()
     }
 
     while (_ftsp && (_curr = fts_read(_ftsp))) {
+        ++visited;
+
         switch (_curr->fts_info) {
         case FTS_NS:  // no stat()
         case FTS_DNR: // directory not read
@@ -165,6 +170,8 @@ bool FTSWrapper::run()
         }
     }
 
+    counter_add(Counter::FtsEntriesVisited, visited);
+
     if (!on_post_execute(ret)) {
         return false;
     }
@@ -16,22 +16,126 @@
  * You should have received a copy of the GNU General Public License
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
-
 #include "mbutil/hash.h"
 
-#include <memory>
+#include <algorithm>
+#include <atomic>
 
 #include <cerrno>
-#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "mbcommon/buffer_pool.h"
+#include "mbcommon/thread_pool.h"
 #include "mblog/logging.h"
-#include "mbutil/autoclose/file.h"
+#include "mbutil/finally.h"
 
 namespace mb
 {
 namespace util
 {
 
+/*!
+ * \brief Run \p fn for every index in [0, \p count) on the shared thread pool
+ *
+ * At most \p threads (or the pool size if 0) calls run concurrently. The
+ * remaining indexes are skipped once a call fails.
+ *
+ * \return Whether every call to \p fn returned true
+ */
+template<typename Fn>
+static bool parallel_for(size_t count, unsigned int threads, const Fn &fn)
+{
+    std::atomic<size_t> next(0);
+    TaskGroup group;
+
+    auto worker = [&]{
+        size_t i;
+        while (!group.is_cancelled() && (i = next++) < count) {
+            if (!fn(i)) {
+                group.cancel();
+            }
+        }
+    };
+
+    if (threads == 0) {
+        threads = ThreadPool::shared().size();
+    }
+    threads = static_cast<unsigned int>(std::min<size_t>(threads, count));
+
+    if (threads <= 1) {
+        worker();
+    } else {
+        for (unsigned int i = 0; i < threads; ++i) {
+            group.run(worker);
+        }
+        group.wait();
+    }
+
+    return !group.is_cancelled();
+}
+
+static int open_for_hashing(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    // Hashing reads every byte exactly once
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    return fd;
+}
+
+/*!
+ * \brief Hash \p size bytes starting at \p offset (or until EOF if \p size is
+ *        -1) into \p ctx
+ */
+static bool sha512_update_fd(const std::string &path, int fd,
+                             SHA512_CTX &ctx, uint64_t offset, int64_t size,
+                             unsigned char *buf, size_t buf_size)
+{
+    while (size != 0) {
+        size_t to_read = buf_size;
+        if (size > 0 && static_cast<uint64_t>(size) < to_read) {
+            to_read = static_cast<size_t>(size);
+        }
+
+        ssize_t n = pread64(fd, buf, to_read, static_cast<off64_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("%s: Failed to read file: %s", path.c_str(), strerror(errno));
+            return false;
+        } else if (n == 0) {
+            if (size > 0) {
+                LOGE("%s: Unexpected EOF", path.c_str());
+                errno = EIO;
+                return false;
+            }
+            break;
+        }
+
+        if (!SHA512_Update(&ctx, buf, static_cast<size_t>(n))) {
+            LOGE("openssl: SHA512_Update() failed");
+            return false;
+        }
+
+        offset += static_cast<uint64_t>(n);
+        if (size > 0) {
+            size -= n;
+        }
+    }
+
+    return true;
+}
+
 /*!
  * \brief Compute SHA512 hash of a file
  *
@@ -44,14 +148,21 @@ namespace util
 bool sha512_hash(const std::string &path,
                  unsigned char digest[SHA512_DIGEST_LENGTH])
 {
-    autoclose::file fp(autoclose::fopen(path.c_str(), "rb"));
-    if (!fp) {
-        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+    int fd = open_for_hashing(path);
+    if (fd < 0) {
         return false;
     }
 
-    unsigned char buf[10240];
-    size_t n;
+    auto close_fd = finally([&] {
+        close(fd);
+    });
+
+    PooledBuffer buf(io_block_size());
+    if (!buf) {
+        LOGE("%s: Failed to allocate buffer: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
 
     SHA512_CTX ctx;
     if (!SHA512_Init(&ctx)) {
@@ -59,27 +170,146 @@ bool sha512_hash(const std::string &path,
         return false;
     }
 
-    while ((n = fread(buf, 1, sizeof(buf), fp.get())) > 0) {
-        if (!SHA512_Update(&ctx, buf, n)) {
-            LOGE("openssl: SHA512_Update() failed");
+    if (!sha512_update_fd(path, fd, ctx, 0, -1,
+                          static_cast<unsigned char *>(buf.data()),
+                          buf.size())) {
+        return false;
+    }
+
+    if (!SHA512_Final(digest, &ctx)) {
+        LOGE("openssl: SHA512_Final() failed");
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compute SHA512 hashes of multiple files in parallel
+ *
+ * \param paths Paths to files
+ * \param[out] digests Computed hash values in the same order as \p paths
+ * \param threads Number of worker threads (or 0 to use the number of CPUs)
+ *
+ * \return true if every file was hashed, false if any failed
+ */
+bool sha512_hash_files(const std::vector<std::string> &paths,
+                       std::vector<Sha512Digest> &digests,
+                       unsigned int threads)
+{
+    digests.resize(paths.size());
+
+    return parallel_for(paths.size(), threads, [&](size_t i) {
+        return sha512_hash(paths[i], digests[i].data());
+    });
+}
+
+/*!
+ * \brief Compute a two-level tree hash of a file in parallel
+ *
+ * The file is split into \p chunk_size sized chunks, which are hashed
+ * concurrently. The resulting digest is the SHA512 hash of:
+ *
+ *   * the file size (64-bit little endian)
+ *   * \p chunk_size (64-bit little endian)
+ *   * the SHA512 digests of all chunks, in order
+ *
+ * This is not the same as sha512_hash() of the file. The chunk digests can
+ * be kept to later verify or locate corruption in individual chunks.
+ *
+ * \param path Path to file or block device
+ * \param chunk_size Size of each chunk (must not be 0)
+ * \param[out] digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to
+ *                    store the root hash value
+ * \param[out] chunk_digests If not null, the hash values of the chunks
+ * \param threads Number of worker threads (or 0 to use the number of CPUs)
+ *
+ * \return true on success, false on failure and errno set appropriately
+ */
+bool sha512_tree_hash(const std::string &path, size_t chunk_size,
+                      unsigned char digest[SHA512_DIGEST_LENGTH],
+                      std::vector<Sha512Digest> *chunk_digests,
+                      unsigned int threads)
+{
+    if (chunk_size == 0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    int fd = open_for_hashing(path);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        close(fd);
+    });
+
+    // lseek() works for both regular files and block devices
+    off64_t file_size = lseek64(fd, 0, SEEK_END);
+    if (file_size < 0) {
+        LOGE("%s: Failed to get size: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    uint64_t size = static_cast<uint64_t>(file_size);
+    size_t count = static_cast<size_t>((size + chunk_size - 1) / chunk_size);
+    std::vector<Sha512Digest> leaves(count);
+
+    bool ret = parallel_for(count, threads, [&](size_t i) {
+        uint64_t offset = static_cast<uint64_t>(i) * chunk_size;
+        int64_t len = static_cast<int64_t>(
+                std::min<uint64_t>(chunk_size, size - offset));
+        PooledBuffer buf(std::min<size_t>(io_block_size(), len));
+        SHA512_CTX ctx;
+
+        if (!buf) {
+            LOGE("%s: Failed to allocate buffer: %s",
+                 path.c_str(), strerror(errno));
             return false;
         }
-        if (n < sizeof(buf)) {
-            break;
+
+        if (!SHA512_Init(&ctx)) {
+            LOGE("openssl: SHA512_Init() failed");
+            return false;
         }
-    }
 
-    if (ferror(fp.get())) {
-        LOGE("%s: Failed to read file", path.c_str());
-        errno = EIO;
+        return sha512_update_fd(path, fd, ctx, offset, len,
+                                static_cast<unsigned char *>(buf.data()),
+                                buf.size())
+                && SHA512_Final(leaves[i].data(), &ctx);
+    });
+    if (!ret) {
         return false;
     }
 
+    unsigned char header[16];
+    for (int i = 0; i < 8; ++i) {
+        header[i] = static_cast<unsigned char>(size >> (i * 8));
+        header[8 + i] = static_cast<unsigned char>(
+                static_cast<uint64_t>(chunk_size) >> (i * 8));
+    }
+
+    SHA512_CTX ctx;
+    if (!SHA512_Init(&ctx) || !SHA512_Update(&ctx, header, sizeof(header))) {
+        LOGE("openssl: Failed to compute root hash");
+        return false;
+    }
+    for (auto const &leaf : leaves) {
+        if (!SHA512_Update(&ctx, leaf.data(), leaf.size())) {
+            LOGE("openssl: SHA512_Update() failed");
+            return false;
+        }
+    }
     if (!SHA512_Final(digest, &ctx)) {
         LOGE("openssl: SHA512_Final() failed");
         return false;
     }
 
+    if (chunk_digests) {
+        *chunk_digests = std::move(leaves);
+    }
+
     return true;
 }
 
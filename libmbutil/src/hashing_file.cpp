@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/hashing_file.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <sys/stat.h>
+
+#include "mbcommon/file/standard.h"
+#include "mbcommon/file_util.h"
+
+#include "mblog/logging.h"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Construct unbound HashingFile.
+ *
+ * open() will need to be called to wrap a file.
+ */
+HashingFile::HashingFile()
+    : _file(nullptr)
+    , _offset(0)
+    , _valid(false)
+{
+}
+
+/*!
+ * \brief Open File handle wrapping another File handle.
+ *
+ * Use is_open() to check if the file was successfully opened.
+ *
+ * \param file Underlying File handle
+ */
+HashingFile::HashingFile(File *file)
+    : HashingFile()
+{
+    open(file);
+}
+
+HashingFile::~HashingFile()
+{
+    close();
+}
+
+/*!
+ * \brief Open File handle wrapping another File handle.
+ *
+ * \param file Underlying File handle. It must already be opened and be
+ *             positioned at the beginning of the file.
+ *
+ * \return Whether the file is successfully opened
+ */
+bool HashingFile::open(File *file)
+{
+    _file = file;
+    return File::open();
+}
+
+/*!
+ * \brief Get the digest of the data transferred so far
+ *
+ * This can only be called once per open() since it finalizes the hash.
+ *
+ * \param[out] digest `unsigned char` array of size `SHA512_DIGEST_LENGTH`
+ *
+ * \return Whether the digest is valid. It is not if there was a seek to a
+ *         different position or if it was already retrieved.
+ */
+bool HashingFile::digest(unsigned char digest[SHA512_DIGEST_LENGTH])
+{
+    if (!_valid) {
+        LOGE("Digest is not valid after seeking");
+        return false;
+    }
+
+    _valid = false;
+
+    if (!SHA512_Final(digest, &_ctx)) {
+        LOGE("openssl: SHA512_Final() failed");
+        return false;
+    }
+
+    return true;
+}
+
+bool HashingFile::on_open()
+{
+    if (!_file || !_file->is_open()) {
+        set_error(std::make_error_code(std::errc::bad_file_descriptor),
+                  "Underlying file is not open");
+        return false;
+    }
+
+    if (!SHA512_Init(&_ctx)) {
+        set_error(std::make_error_code(std::errc::io_error),
+                  "openssl: SHA512_Init() failed");
+        return false;
+    }
+
+    _offset = 0;
+    _valid = true;
+    return true;
+}
+
+bool HashingFile::on_close()
+{
+    _file = nullptr;
+    _valid = false;
+    return true;
+}
+
+bool HashingFile::on_read(void *buf, size_t size, size_t &bytes_read)
+{
+    if (!_file->read(buf, size, bytes_read)) {
+        return copy_error();
+    }
+
+    if (_valid) {
+        SHA512_Update(&_ctx, buf, bytes_read);
+    }
+    _offset += bytes_read;
+
+    return true;
+}
+
+bool HashingFile::on_write(const void *buf, size_t size,
+                           size_t &bytes_written)
+{
+    if (!_file->write(buf, size, bytes_written)) {
+        return copy_error();
+    }
+
+    if (_valid) {
+        SHA512_Update(&_ctx, buf, bytes_written);
+    }
+    _offset += bytes_written;
+
+    return true;
+}
+
+bool HashingFile::on_seek(int64_t offset, int whence, uint64_t &new_offset)
+{
+    if (!_file->seek(offset, whence, &new_offset)) {
+        return copy_error();
+    }
+
+    if (new_offset != _offset) {
+        _valid = false;
+        _offset = new_offset;
+    }
+
+    return true;
+}
+
+bool HashingFile::on_truncate(uint64_t size)
+{
+    if (!_file->truncate(size)) {
+        return copy_error();
+    }
+
+    if (size < _offset) {
+        _valid = false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Propagate the error from the underlying file
+ *
+ * \return Always returns false
+ */
+bool HashingFile::copy_error()
+{
+    if (_file->is_fatal()) {
+        set_fatal(true);
+    }
+
+    set_error(_file->error(), "%s", _file->error_string().c_str());
+    return false;
+}
+
+/*!
+ * \brief Copy a file while computing the SHA512 digest of the copied data
+ *
+ * \param source Source file
+ * \param target Target file (truncated if it exists)
+ * \param[out] digest Digest of the data written to \a target
+ * \param[out] sb Metadata of \a target right after it was written (optional)
+ */
+bool copy_and_hash(const std::string &source, const std::string &target,
+                   unsigned char digest[SHA512_DIGEST_LENGTH], struct stat *sb)
+{
+    StandardFile fin(source, FileOpenMode::READ_ONLY);
+    if (!fin.is_open()) {
+        LOGE("%s: Failed to open for reading: %s",
+             source.c_str(), fin.error_string().c_str());
+        return false;
+    }
+
+    StandardFile fout(target, FileOpenMode::WRITE_ONLY);
+    if (!fout.is_open()) {
+        LOGE("%s: Failed to open for writing: %s",
+             target.c_str(), fout.error_string().c_str());
+        return false;
+    }
+
+    HashingFile hashed(&fout);
+    uint64_t n;
+    int fd;
+
+    if (!hashed.is_open() || !file_copy(fin, hashed, UINT64_MAX, n)) {
+        LOGE("Failed to copy %s to %s: %s", source.c_str(), target.c_str(),
+             hashed.error_string().c_str());
+        return false;
+    }
+
+    if (!hashed.digest(digest)) {
+        return false;
+    }
+
+    if (sb && (!fout.native_fd(fd) || fstat(fd, sb) < 0)) {
+        LOGE("%s: Failed to stat: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    return hashed.close() && fout.close();
+}
+
+}
+}
@@ -25,6 +25,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <unistd.h>
@@ -32,6 +33,7 @@
 #include <linux/loop.h>
 
 #include "mbcommon/string.h"
+#include "mblog/logging.h"
 #include "mbutil/finally.h"
 #include "mbutil/string.h"
 
@@ -44,12 +46,32 @@
 
 #define MAX_LOOPDEVS    1024
 
+// Number of times to retry when another process claims the loopdev returned by
+// LOOP_CTL_GET_FREE before we can attach to it
+#define MAX_ATTACH_ATTEMPTS 16
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
 
 namespace mb
 {
 namespace util
 {
 
+/*!
+ * \brief Create the node for loopdev \a n if it does not already exist
+ */
+static bool create_loopdev_node(int n)
+{
+    char loopdev[64];
+    sprintf(loopdev, LOOP_FMT, n);
+
+    return mknod(loopdev, S_IFBLK | 0644, makedev(7, n)) == 0
+            || errno == EEXIST;
+}
+
 /*!
  * \brief Find empty loopdev by using the new ioctl for /dev/block/loop-control
  *
@@ -73,10 +95,7 @@ static int find_loopdev_by_loop_control(void)
         return -1;
     }
 
-    char loopdev[64];
-    sprintf(loopdev, LOOP_FMT, n);
-
-    if (mknod(loopdev, S_IFBLK | 0644, makedev(7, n)) < 0 && errno != EEXIST) {
+    if (!create_loopdev_node(n)) {
         return -1;
     }
 
@@ -147,6 +166,47 @@ static int find_loopdev_by_scanning(void)
     return -1;
 }
 
+/*!
+ * \brief Preallocate loop devices
+ *
+ * Create loop devices 0 through \a count - 1 with `LOOP_CTL_ADD` (if they do
+ * not already exist in the kernel) and their nodes in /dev/block. This allows
+ * loopdev_set_up_unused() to attach to a free device without having to wait
+ * for the kernel to allocate a new one or for a node to be created.
+ *
+ * \param count Number of loop devices to preallocate
+ *
+ * \return True if all of the loop devices were created or already existed.
+ *         False if /dev/loop-control could not be opened or any of the loop
+ *         devices or nodes could not be created.
+ */
+bool loopdev_preallocate(unsigned int count)
+{
+    int fd = open(LOOP_CONTROL, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&] {
+        close(fd);
+    });
+
+    bool ret = true;
+
+    for (unsigned int n = 0; n < count && n < MAX_LOOPDEVS; ++n) {
+        if (ioctl(fd, LOOP_CTL_ADD, n) < 0 && errno != EEXIST) {
+            ret = false;
+            continue;
+        }
+
+        if (!create_loopdev_node(n)) {
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
 std::string loopdev_find_unused(void)
 {
     int n = find_loopdev_by_loop_control();
@@ -202,6 +262,118 @@ bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
     return true;
 }
 
+/*!
+ * \brief Attach \a file to the first free loop device
+ *
+ * Unlike calling loopdev_find_unused() followed by loopdev_set_up_device(),
+ * this function does not race with other users of loop devices. If another
+ * process attaches to the loop device between the `LOOP_CTL_GET_FREE` ioctl
+ * and the `LOOP_SET_FD` ioctl (which fails with `EBUSY`), then the next free
+ * loop device is tried. In the common case, finding and claiming a loop device
+ * only takes one ioctl each.
+ *
+ * If \a flags contains LOOPDEV_DIRECT_IO, then the loop device is switched to
+ * direct I/O mode so that the data is not cached by both the loop device and
+ * the backing filesystem. This is silently skipped if the kernel or the backing
+ * filesystem does not support it or if \a offset is not suitably aligned.
+ *
+ * \param file Backing file
+ * \param offset Offset in backing file
+ * \param flags LoopdevFlags
+ *
+ * \return Path to the loop device if \a file was successfully attached.
+ *         Otherwise, an empty string with errno set appropriately.
+ */
+std::string loopdev_set_up_unused(const std::string &file, uint64_t offset,
+                                  int flags)
+{
+    bool ro = flags & LOOPDEV_READ_ONLY;
+    int ffd = -1;
+    int lfd = -1;
+    int ctl_fd = -1;
+    std::string loopdev;
+
+    if ((ffd = open(file.c_str(), (ro ? O_RDONLY : O_RDWR) | O_CLOEXEC)) < 0) {
+        return {};
+    }
+
+    auto close_fds = finally([&] {
+        int saved_errno = errno;
+        close(ffd);
+        if (lfd >= 0) {
+            close(lfd);
+        }
+        if (ctl_fd >= 0) {
+            close(ctl_fd);
+        }
+        errno = saved_errno;
+    });
+
+    ctl_fd = open(LOOP_CONTROL, O_RDWR | O_CLOEXEC);
+
+    for (int attempt = 0; attempt < MAX_ATTACH_ATTEMPTS; ++attempt) {
+        int n = -1;
+
+        if (ctl_fd >= 0) {
+            n = ioctl(ctl_fd, LOOP_CTL_GET_FREE);
+            if (n >= 0 && !create_loopdev_node(n)) {
+                return {};
+            }
+        }
+        // Also search by scanning if n == 0, since some installers hardcode
+        // /dev/block/loop0
+        if (n <= 0) {
+            n = find_loopdev_by_scanning();
+        }
+        if (n < 0) {
+            errno = ENODEV;
+            return {};
+        }
+
+        loopdev = mb::format(LOOP_FMT, n);
+
+        if ((lfd = open(loopdev.c_str(),
+                        (ro ? O_RDONLY : O_RDWR) | O_CLOEXEC)) < 0) {
+            return {};
+        }
+
+        if (ioctl(lfd, LOOP_SET_FD, ffd) == 0) {
+            break;
+        } else if (errno != EBUSY) {
+            return {};
+        }
+
+        // Someone else claimed the device first
+        close(lfd);
+        lfd = -1;
+    }
+
+    if (lfd < 0) {
+        errno = EBUSY;
+        return {};
+    }
+
+    struct loop_info64 loopinfo;
+    memset(&loopinfo, 0, sizeof(struct loop_info64));
+    strlcpy((char *) loopinfo.lo_file_name, file.c_str(), LO_NAME_SIZE);
+    loopinfo.lo_offset = offset;
+
+    if (ioctl(lfd, LOOP_SET_STATUS64, &loopinfo) < 0) {
+        int saved_errno = errno;
+        ioctl(lfd, LOOP_CLR_FD, 0);
+        errno = saved_errno;
+        return {};
+    }
+
+    if ((flags & LOOPDEV_DIRECT_IO)
+            && ioctl(lfd, LOOP_SET_DIRECT_IO, 1UL) < 0) {
+        LOGD("%s: Direct I/O not available for %s: %s",
+             loopdev.c_str(), file.c_str(), strerror(errno));
+    }
+
+    return loopdev;
+}
+
 bool loopdev_remove_device(const std::string &loopdev)
 {
     int lfd;
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/metadata.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbutil/dirwalk.h"
+#include "mbutil/finally.h"
+
+#define SELINUX_XATTR           "security.selinux"
+
+namespace mb
+{
+namespace util
+{
+
+class RecursiveMetadataApplier : public DirWalker {
+public:
+    RecursiveMetadataApplier(std::string path, const Metadata &metadata)
+        : DirWalker(path, 0),
+        _metadata(metadata)
+    {
+    }
+
+    virtual int on_reached_directory_post() override
+    {
+        return apply_fd() ? Action::DW_OK : Action::DW_Fail;
+    }
+
+    virtual int on_reached_file() override
+    {
+        return apply_fd() ? Action::DW_OK : Action::DW_Fail;
+    }
+
+    virtual int on_reached_symlink() override
+    {
+        return apply_path() ? Action::DW_OK : Action::DW_Fail;
+    }
+
+    virtual int on_reached_special_file() override
+    {
+        return apply_path() ? Action::DW_OK : Action::DW_Fail;
+    }
+
+private:
+    const Metadata &_metadata;
+
+    bool owner_matches()
+    {
+        return _curr->sb.st_uid == _metadata.uid
+                && _curr->sb.st_gid == _metadata.gid;
+    }
+
+    bool mode_matches()
+    {
+        return (_curr->sb.st_mode & 07777) == (_metadata.mode & 07777);
+    }
+
+    bool context_matches(ssize_t size, const char *value)
+    {
+        // The stored value normally includes the NULL terminator
+        if (size > 0 && value[size - 1] == '\0') {
+            --size;
+        }
+
+        return static_cast<size_t>(size) == _metadata.context.size()
+                && memcmp(value, _metadata.context.data(), size) == 0;
+    }
+
+    bool fail(const char *action)
+    {
+        mb::format(_error_msg, "%s: Failed to %s: %s",
+                   _curr->path, action, strerror(errno));
+        LOGW("%s", _error_msg.c_str());
+        return false;
+    }
+
+    // Directories and regular files: operate on an open fd
+    bool apply_fd()
+    {
+        int fd = openat(_curr->dirfd, _curr->name,
+                        O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            return fail("open");
+        }
+
+        auto close_fd = finally([&] {
+            close(fd);
+        });
+
+        if (!owner_matches()
+                && fchown(fd, _metadata.uid, _metadata.gid) < 0) {
+            return fail("chown");
+        }
+
+        if (!mode_matches() && fchmod(fd, _metadata.mode) < 0) {
+            return fail("chmod");
+        }
+
+        if (!_metadata.context.empty()) {
+            char value[256];
+            ssize_t size = fgetxattr(fd, SELINUX_XATTR, value, sizeof(value));
+
+            if ((size < 0 || !context_matches(size, value))
+                    && fsetxattr(fd, SELINUX_XATTR, _metadata.context.c_str(),
+                                 _metadata.context.size() + 1, 0) < 0) {
+                return fail("set context");
+            }
+        }
+
+        return true;
+    }
+
+    // Symlinks and special files: opening them is either impossible or could
+    // block (eg. FIFOs), so use the *at() functions and the path
+    bool apply_path()
+    {
+        if (!owner_matches()
+                && fchownat(_curr->dirfd, _curr->name, _metadata.uid,
+                            _metadata.gid, AT_SYMLINK_NOFOLLOW) < 0) {
+            return fail("chown");
+        }
+
+        // Avoid security issue
+        if (!S_ISLNK(_curr->sb.st_mode) && !mode_matches()
+                && fchmodat(_curr->dirfd, _curr->name, _metadata.mode, 0) < 0) {
+            return fail("chmod");
+        }
+
+        if (!_metadata.context.empty()) {
+            char value[256];
+            ssize_t size = lgetxattr(_curr->path, SELINUX_XATTR,
+                                     value, sizeof(value));
+
+            if ((size < 0 || !context_matches(size, value))
+                    && lsetxattr(_curr->path, SELINUX_XATTR,
+                                 _metadata.context.c_str(),
+                                 _metadata.context.size() + 1, 0) < 0) {
+                return fail("set context");
+            }
+        }
+
+        return true;
+    }
+};
+
+/*!
+ * \brief Recursively set the owner, mode, and SELinux label of a tree
+ *
+ * This is equivalent to running a recursive chown(), chmod(), and
+ * selinux_lset_context_recursive() on \p path, but the tree is only walked
+ * once and entries whose metadata already matches are not modified.
+ * Symlinks are never followed and their mode is not changed.
+ *
+ * \param path Root of the tree
+ * \param metadata Metadata to apply to every entry in the tree
+ *
+ * \return True if all entries were updated successfully. False, otherwise.
+ */
+bool apply_metadata_recursive(const std::string &path,
+                              const Metadata &metadata)
+{
+    RecursiveMetadataApplier walker(path, metadata);
+    return walker.run();
+}
+
+}
+}
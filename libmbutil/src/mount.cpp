@@ -37,6 +37,7 @@
 #include "mblog/logging.h"
 #include "mbutil/autoclose/file.h"
 #include "mbutil/blkid.h"
+#include "mbutil/counters.h"
 #include "mbutil/directory.h"
 #include "mbutil/finally.h"
 #include "mbutil/loopdev.h"
@@ -204,6 +205,8 @@ bool unmount_all(const std::string &dir)
 bool mount(const char *source, const char *target, const char *fstype,
            unsigned long mount_flags, const void *data)
 {
+    CounterTimer timer(Counter::Mounts, Counter::MountTimeNs);
+
     bool need_loopdev = false;
     struct stat sb;
 
@@ -225,21 +228,21 @@ bool mount(const char *source, const char *target, const char *fstype,
     }
 
     if (need_loopdev) {
-        std::string loopdev = util::loopdev_find_unused();
-        if (loopdev.empty()) {
-            LOGE("Failed to find unused loop device: %s", strerror(errno));
-            return false;
+        int loop_flags = LOOPDEV_DIRECT_IO;
+        if (mount_flags & MS_RDONLY) {
+            loop_flags |= LOOPDEV_READ_ONLY;
         }
 
-        LOGD("Assigning %s to loop device %s", source, loopdev.c_str());
-
-        if (!util::loopdev_set_up_device(
-                loopdev, source, 0, mount_flags & MS_RDONLY)) {
-            LOGE("Failed to set up loop device %s: %s",
-                 loopdev.c_str(), strerror(errno));
+        std::string loopdev = util::loopdev_set_up_unused(
+                source, 0, loop_flags);
+        if (loopdev.empty()) {
+            LOGE("Failed to set up loop device for %s: %s",
+                 source, strerror(errno));
             return false;
         }
 
+        LOGD("Assigned %s to loop device %s", source, loopdev.c_str());
+
         if (::mount(loopdev.c_str(), target, fstype, mount_flags, data) < 0) {
             util::loopdev_remove_device(loopdev);
             return false;
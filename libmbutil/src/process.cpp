@@ -35,26 +35,35 @@ namespace util
 static char * args_mem_start = nullptr;
 static size_t args_mem_size = 0;
 
+// Saved by set_process_title_init() until the first title change
+static int saved_argc = 0;
+static char **saved_argv = nullptr;
+
 /*!
  * \brief Initialize state before setting process name
  *
+ * This only saves \a argc and \a argv. The memory holding the arguments and
+ * environment is located and \a environ is cloned on the first call to
+ * set_process_title(), so processes that never set their title don't pay for
+ * copying the environment.
+ *
  * \warning Call this function as early as possible in the \a main() function
  *          and do not modify \a argv or \a environ beforehand. \a argv will be
- *          modified by this function, so make a copy before using it, but
- *          \a environ will be automatically cloned and set appropriately.
+ *          modified when the title is first set, so make a copy before using
+ *          it, but \a environ will be automatically cloned and set
+ *          appropriately.
  *
  * \param argc MUST be the \a argc from \a main()
  * \param argv MUST be the \a argv from \a main()
  *
  * \return Returns true if the initialization is successful or if the function
  *         has already been called. Returns false and sets errno to EINVAL if
- *         \a argc or \a argv are invalid. Returns false and sets errno
- *         appropriately if memory allocation fails.
+ *         \a argc or \a argv are invalid.
  */
 bool set_process_title_init(int argc, char *argv[])
 {
     // Already called once
-    if (args_mem_start) {
+    if (saved_argv) {
         return true;
     }
 
@@ -64,6 +73,24 @@ bool set_process_title_init(int argc, char *argv[])
         return false;
     }
 
+    saved_argc = argc;
+    saved_argv = argv;
+
+    return true;
+}
+
+static bool init_args_mem()
+{
+    if (args_mem_start) {
+        return true;
+    } else if (!saved_argv) {
+        errno = EINVAL;
+        return false;
+    }
+
+    int argc = saved_argc;
+    char **argv = saved_argv;
+
     // The arguments and environment are stored in a contiguous block of memory,
     // so find the end of that block
     char *end = nullptr;
@@ -101,14 +128,17 @@ bool set_process_title_init(int argc, char *argv[])
  * \param size_out Actual size that was set (can be NULL)
  *
  * \return Returns false and sets errno to EINVAL if set_process_title_init()
- *         hasn't been called yet. Otherwise, returns true and \a size_out, if
+ *         hasn't been called yet or sets errno appropriately if cloning the
+ *         environment fails. Otherwise, returns true and \a size_out, if
  *         non-NULL, is set to the number of bytes that were actually used in
  *         the process title, which may be fewer than requested.
  */
 bool set_process_title(const char *str, size_t size, size_t *size_out)
 {
     // Don't do anything if set_process_title_init() hasn't been called
-    if (!args_mem_start || args_mem_size == 0) {
+    if (!init_args_mem()) {
+        return false;
+    } else if (args_mem_size == 0) {
         errno = EINVAL;
         return false;
     }
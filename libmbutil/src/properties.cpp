@@ -25,6 +25,7 @@
 
 #include <cstdio>
 #include <cstring>
+#include <ctime>
 
 #include "mbcommon/common.h"
 #include "mbcommon/string.h"
@@ -235,6 +236,160 @@ bool property_get_all(std::unordered_map<std::string, std::string> &map)
     }, &map);
 }
 
+// Cached property lookups
+
+PropertyHandle::PropertyHandle(std::string name)
+    : _name(std::move(name))
+    , _pi(nullptr)
+    , _area_serial(0)
+    , _serial(0)
+    , _cached(false)
+{
+}
+
+const std::string & PropertyHandle::name() const
+{
+    return _name;
+}
+
+const prop_info * PropertyHandle::info()
+{
+    if (!_pi) {
+        initialize_properties();
+
+        // Property area serial is bumped whenever a property is added
+        uint32_t area_serial = mb__system_property_area_serial();
+        if (_area_serial != 0 && area_serial == _area_serial) {
+            return nullptr;
+        }
+
+        _pi = mb__system_property_find(_name.c_str());
+        if (!_pi) {
+            _area_serial = area_serial;
+        }
+    }
+
+    return _pi;
+}
+
+/*!
+ * \brief Get value of the property
+ *
+ * If the property has not changed since the last call, the cached value is
+ * returned without reading the property.
+ *
+ * \param[out] value_out Output value
+ *
+ * \return Whether the property exists
+ */
+bool PropertyHandle::get(std::string &value_out)
+{
+    const prop_info *pi = info();
+    if (!pi) {
+        return false;
+    }
+
+    if (!_cached || mb__system_property_serial(pi) != _serial) {
+        libc_system_property_read_callback(
+                pi, [](void *cookie, const char *name, const char *value,
+                       uint32_t serial) {
+            (void) name;
+            auto *handle = static_cast<PropertyHandle *>(cookie);
+            handle->_value = value;
+            handle->_serial = serial;
+        }, this);
+
+        _cached = true;
+    }
+
+    value_out = _value;
+    return true;
+}
+
+/*!
+ * \brief Check if the property changed since get() was last called
+ *
+ * \return Whether the value changed or the property has been created
+ */
+bool PropertyHandle::changed()
+{
+    const prop_info *pi = info();
+    if (!pi) {
+        return false;
+    }
+
+    return !_cached || mb__system_property_serial(pi) != _serial;
+}
+
+/*!
+ * \brief Wait for any of several properties to change
+ *
+ * This waits on the property area's global serial number, which changes
+ * whenever any property is changed, so any number of properties can be
+ * waited for with a single futex wait. A property counts as changed if its
+ * value changed since PropertyHandle::get() was last called on its handle or
+ * if it was created.
+ *
+ * \param handles Property handles
+ * \param count Number of handles
+ * \param relative_timeout Maximum time to wait or nullptr to wait forever
+ * \param[out] index_out Index of a handle whose property changed
+ *
+ * \return True if a property changed. False if the timeout expired.
+ */
+bool property_wait_any(PropertyHandle * const *handles, size_t count,
+                       const struct timespec *relative_timeout,
+                       size_t *index_out)
+{
+    initialize_properties();
+
+    struct timespec deadline;
+    if (relative_timeout) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += relative_timeout->tv_sec;
+        deadline.tv_nsec += relative_timeout->tv_nsec;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    // Read the global serial before checking the properties so that changes
+    // made in between wake up the wait below
+    uint32_t area_serial = mb__system_property_area_serial();
+
+    while (true) {
+        for (size_t i = 0; i < count; ++i) {
+            if (handles[i]->changed()) {
+                *index_out = i;
+                return true;
+            }
+        }
+
+        struct timespec remaining;
+        if (relative_timeout) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+
+            remaining.tv_sec = deadline.tv_sec - now.tv_sec;
+            remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (remaining.tv_nsec < 0) {
+                --remaining.tv_sec;
+                remaining.tv_nsec += 1000000000;
+            }
+            if (remaining.tv_sec < 0) {
+                return false;
+            }
+        }
+
+        if (!libc_system_property_wait(nullptr, area_serial, &area_serial,
+                                       relative_timeout ? &remaining
+                                                        : nullptr)) {
+            return false;
+        }
+    }
+}
+
 // Properties file functions
 
 enum class PropIterAction
@@ -396,5 +551,264 @@ bool property_file_write_all(const std::string &path,
     return true;
 }
 
+bool PropertyFile::Slice::operator==(const Slice &other) const
+{
+    return size == other.size && memcmp(data, other.data, size) == 0;
+}
+
+size_t PropertyFile::SliceHash::operator()(const Slice &slice) const
+{
+    // FNV-1a
+    size_t hash = static_cast<size_t>(2166136261u);
+    for (size_t i = 0; i < slice.size; ++i) {
+        hash ^= static_cast<unsigned char>(slice.data[i]);
+        hash *= static_cast<size_t>(16777619u);
+    }
+    return hash;
+}
+
+PropertyFile::PropertyFile() = default;
+
+/*!
+ * \brief Read and index a properties file
+ *
+ * \param path Path to properties file
+ *
+ * \return Whether the file was successfully read
+ */
+bool PropertyFile::open(const std::string &path)
+{
+    ScopedFILE fp(fopen(path.c_str(), "rb"), &fclose);
+    if (!fp) {
+        return false;
+    }
+
+    std::string data;
+    char buf[8192];
+    size_t n;
+
+    while ((n = fread(buf, 1, sizeof(buf), fp.get())) > 0) {
+        data.append(buf, n);
+    }
+
+    if (ferror(fp.get())) {
+        return false;
+    }
+
+    load(std::move(data));
+    return true;
+}
+
+/*!
+ * \brief Index properties file data that is already in memory
+ *
+ * Lines are parsed the same way as property_file_get(): empty lines, lines
+ * starting with `#`, and lines without `=` are ignored.
+ *
+ * \param data Properties file contents
+ */
+void PropertyFile::load(std::string data)
+{
+    _data = std::move(data);
+    _entries.clear();
+    _index.clear();
+
+    const char *base = _data.data();
+    size_t begin = 0;
+
+    while (begin < _data.size()) {
+        size_t end = _data.find('\n', begin);
+        size_t content_end = end == std::string::npos ? _data.size() : end;
+        end = end == std::string::npos ? _data.size() : end + 1;
+
+        if (content_end > begin && base[begin] != '#') {
+            const char *line = base + begin;
+            auto equals = static_cast<const char *>(
+                    memchr(line, '=', content_end - begin));
+
+            if (equals) {
+                Entry entry;
+                entry.line_begin = begin;
+                entry.line_end = end;
+                entry.key = { line, static_cast<size_t>(equals - line) };
+                entry.value = { equals + 1, static_cast<size_t>(
+                        base + content_end - equals - 1) };
+                entry.modified = false;
+                entry.removed = false;
+
+                _entries.push_back(std::move(entry));
+                _index[_entries.back().key] = &_entries.back();
+            }
+        }
+
+        begin = end;
+    }
+}
+
+bool PropertyFile::get(const std::string &key, std::string &value_out) const
+{
+    auto it = _index.find({ key.data(), key.size() });
+    if (it == _index.end()) {
+        return false;
+    }
+
+    value_out.assign(it->second->value.data, it->second->value.size);
+    return true;
+}
+
+std::string PropertyFile::get_string(const std::string &key,
+                                     const std::string &default_value) const
+{
+    std::string value;
+
+    if (get(key, value) && !value.empty()) {
+        return value;
+    }
+
+    return default_value;
+}
+
+bool PropertyFile::get_bool(const std::string &key, bool default_value) const
+{
+    std::string value;
+    bool result;
+
+    if (get(key, value) && string_to_bool(value, result)) {
+        return result;
+    }
+
+    return default_value;
+}
+
+void PropertyFile::get_all(
+        std::unordered_map<std::string, std::string> &map) const
+{
+    for (auto const &pair : _index) {
+        map[std::string(pair.first.data, pair.first.size)] =
+                std::string(pair.second->value.data, pair.second->value.size);
+    }
+}
+
+/*!
+ * \brief Set a property
+ *
+ * If the property exists, its (last) line is rewritten in place. Otherwise,
+ * the property is appended to the end of the file.
+ */
+void PropertyFile::set(const std::string &key, const std::string &value)
+{
+    auto it = _index.find({ key.data(), key.size() });
+    Entry *entry;
+
+    if (it != _index.end()) {
+        entry = it->second;
+    } else {
+        Entry new_entry;
+        new_entry.line_begin = std::string::npos;
+        new_entry.line_end = std::string::npos;
+        new_entry.modified = false;
+        new_entry.removed = false;
+
+        _entries.push_back(std::move(new_entry));
+        entry = &_entries.back();
+        entry->new_key = key;
+        entry->key = { entry->new_key.data(), entry->new_key.size() };
+
+        _index[entry->key] = entry;
+    }
+
+    entry->new_value = value;
+    entry->value = { entry->new_value.data(), entry->new_value.size() };
+    entry->modified = true;
+}
+
+/*!
+ * \brief Remove all occurrences of a property
+ *
+ * \return Whether the property existed
+ */
+bool PropertyFile::remove(const std::string &key)
+{
+    Slice slice{ key.data(), key.size() };
+
+    auto it = _index.find(slice);
+    if (it == _index.end()) {
+        return false;
+    }
+    _index.erase(it);
+
+    for (auto &entry : _entries) {
+        if (entry.key == slice) {
+            entry.removed = true;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Serialize the properties file with all edits applied
+ */
+std::string PropertyFile::data() const
+{
+    std::string out;
+    out.reserve(_data.size());
+
+    size_t pos = 0;
+
+    auto append_entry = [&](const Entry &entry) {
+        out.append(entry.key.data, entry.key.size);
+        out += '=';
+        out.append(entry.value.data, entry.value.size);
+        out += '\n';
+    };
+
+    for (auto const &entry : _entries) {
+        if (entry.line_begin == std::string::npos) {
+            continue;
+        }
+
+        // Copy comments and other lines before the entry as is
+        out.append(_data, pos, entry.line_begin - pos);
+        pos = entry.line_end;
+
+        if (entry.removed) {
+            continue;
+        } else if (entry.modified) {
+            append_entry(entry);
+        } else {
+            out.append(_data, entry.line_begin,
+                       entry.line_end - entry.line_begin);
+        }
+    }
+
+    out.append(_data, pos, std::string::npos);
+
+    for (auto const &entry : _entries) {
+        if (entry.line_begin == std::string::npos && !entry.removed) {
+            // Don't join the new line onto a final line without a newline
+            if (!out.empty() && out.back() != '\n') {
+                out += '\n';
+            }
+            append_entry(entry);
+        }
+    }
+
+    return out;
+}
+
+bool PropertyFile::write(const std::string &path) const
+{
+    std::string contents = data();
+
+    ScopedFILE fp(fopen(path.c_str(), "wb"), fclose);
+    if (!fp) {
+        return false;
+    }
+
+    return fwrite(contents.data(), 1, contents.size(), fp.get())
+            == contents.size() && fclose(fp.release()) == 0;
+}
+
 }
 }
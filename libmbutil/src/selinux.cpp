@@ -31,8 +31,9 @@
 #include <sepol/sepol.h>
 
 #include "mblog/logging.h"
+#include "mbutil/dirwalk.h"
+#include "mbutil/file_contexts.h"
 #include "mbutil/finally.h"
-#include "mbutil/fts.h"
 
 #define SELINUX_XATTR           "security.selinux"
 
@@ -44,11 +45,11 @@ namespace mb
 namespace util
 {
 
-class RecursiveSetContext : public FTSWrapper {
+class RecursiveSetContext : public DirWalker {
 public:
     RecursiveSetContext(std::string path, std::string context,
                         bool follow_symlinks)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        : DirWalker(path, 0),
         _context(std::move(context)),
         _follow_symlinks(follow_symlinks)
     {
@@ -56,22 +57,22 @@ public:
 
     virtual int on_reached_directory_post() override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return set_context() ? Action::DW_OK : Action::DW_Fail;
     }
 
     virtual int on_reached_file() override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return set_context() ? Action::DW_OK : Action::DW_Fail;
     }
 
     virtual int on_reached_symlink() override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return set_context() ? Action::DW_OK : Action::DW_Fail;
     }
 
     virtual int on_reached_special_file() override
     {
-        return set_context() ? Action::FTS_OK : Action::FTS_Fail;
+        return set_context() ? Action::DW_OK : Action::DW_Fail;
     }
 
 private:
@@ -80,14 +81,73 @@ private:
 
     bool set_context()
     {
+        // There is no *at() variant of setxattr(), so the path is used
         if (_follow_symlinks) {
-            return selinux_set_context(_curr->fts_accpath, _context);
+            return setxattr(_curr->path, SELINUX_XATTR, _context.c_str(),
+                            _context.size() + 1, 0) == 0;
         } else {
-            return selinux_lset_context(_curr->fts_accpath, _context);
+            return lsetxattr(_curr->path, SELINUX_XATTR, _context.c_str(),
+                             _context.size() + 1, 0) == 0;
         }
     }
 };
 
+class RecursiveRestoreContext : public DirWalker {
+public:
+    RecursiveRestoreContext(std::string path, FileContexts &contexts,
+                            std::string lookup_path)
+        : DirWalker(path, 0),
+        _contexts(contexts),
+        _lookup_path(std::move(lookup_path))
+    {
+    }
+
+    virtual int on_reached_directory_post() override
+    {
+        return restore_context() ? Action::DW_OK : Action::DW_Fail;
+    }
+
+    virtual int on_reached_file() override
+    {
+        return restore_context() ? Action::DW_OK : Action::DW_Fail;
+    }
+
+    virtual int on_reached_symlink() override
+    {
+        return restore_context() ? Action::DW_OK : Action::DW_Fail;
+    }
+
+    virtual int on_reached_special_file() override
+    {
+        return restore_context() ? Action::DW_OK : Action::DW_Fail;
+    }
+
+private:
+    FileContexts &_contexts;
+    std::string _lookup_path;
+    std::string _lookup_buf;
+    std::string _context;
+
+    bool restore_context()
+    {
+        // Map the path to where the tree will be on the running system
+        const char *suffix = _curr->path + _path.size();
+        _lookup_buf = _lookup_path;
+        if (*suffix && *suffix != '/') {
+            _lookup_buf += '/';
+        }
+        _lookup_buf += suffix;
+
+        // Leave files without a matching spec (or <<none>>) alone
+        if (!_contexts.lookup(_lookup_buf, _curr->sb.st_mode, &_context)) {
+            return true;
+        }
+
+        return lsetxattr(_curr->path, SELINUX_XATTR, _context.c_str(),
+                         _context.size() + 1, 0) == 0;
+    }
+};
+
 bool selinux_read_policy(const std::string &path, policydb_t *pdb)
 {
     struct policy_file pf;
@@ -141,15 +201,19 @@ bool selinux_read_policy(const std::string &path, policydb_t *pdb)
     return policydb_read(pdb, &pf, 0) == 0;
 }
 
-// /sys/fs/selinux/load requires the entire policy to be written in a single
-// write(2) call.
-// See: http://marc.info/?l=selinux&m=141882521027239&w=2
-bool selinux_write_policy(const std::string &path, policydb_t *pdb)
+/*!
+ * \brief Serialize a policy to memory
+ *
+ * \param[in] pdb Policy to serialize
+ * \param[out] data Serialized policy
+ *
+ * \return Whether the policy was successfully serialized
+ */
+bool selinux_policy_to_data(policydb_t *pdb, std::vector<unsigned char> *data)
 {
-    void *data;
+    void *image;
     size_t len;
     sepol_handle_t *handle;
-    int fd;
 
     // Don't print warnings to stderr
     handle = sepol_handle_create();
@@ -159,15 +223,29 @@ bool selinux_write_policy(const std::string &path, policydb_t *pdb)
         sepol_handle_destroy(handle);
     });
 
-    if (policydb_to_image(handle, pdb, &data, &len) < 0) {
+    if (policydb_to_image(handle, pdb, &image, &len) < 0) {
         LOGE("Failed to write policydb to memory");
         return false;
     }
 
-    auto free_data = finally([&] {
-        free(data);
+    auto free_image = finally([&] {
+        free(image);
     });
 
+    data->assign(static_cast<unsigned char *>(image),
+                 static_cast<unsigned char *>(image) + len);
+
+    return true;
+}
+
+// /sys/fs/selinux/load requires the entire policy to be written in a single
+// write(2) call.
+// See: http://marc.info/?l=selinux&m=141882521027239&w=2
+bool selinux_write_policy_data(const std::string &path,
+                               const void *data, size_t size)
+{
+    int fd;
+
     for (int i = 0; i < OPEN_ATTEMPTS; ++i) {
         fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0644);
         if (fd < 0) {
@@ -187,14 +265,27 @@ bool selinux_write_policy(const std::string &path, policydb_t *pdb)
         close(fd);
     });
 
-    if (write(fd, data, len) < 0) {
+    ssize_t n = write(fd, data, size);
+    if (n < 0) {
         LOGE("%s: Failed to write sepolicy: %s", path.c_str(), strerror(errno));
         return false;
+    } else if (static_cast<size_t>(n) != size) {
+        LOGE("%s: Short write of sepolicy: %zd of %zu bytes",
+             path.c_str(), n, size);
+        return false;
     }
 
     return true;
 }
 
+bool selinux_write_policy(const std::string &path, policydb_t *pdb)
+{
+    std::vector<unsigned char> data;
+
+    return selinux_policy_to_data(pdb, &data)
+            && selinux_write_policy_data(path, data.data(), data.size());
+}
+
 bool selinux_get_context(const std::string &path, std::string *context)
 {
     ssize_t size;
@@ -294,6 +385,24 @@ bool selinux_lset_context_recursive(const std::string &path,
     return RecursiveSetContext(path, context, false).run();
 }
 
+/*!
+ * \brief Recursively restore the SELinux labels for a tree
+ *
+ * The label for each entry is looked up in \p contexts. Symlinks are not
+ * followed.
+ *
+ * \param path Path of the tree to relabel
+ * \param contexts Loaded file_contexts specs
+ * \param lookup_path Path that \p path corresponds to on the running system
+ *                    (eg. "/data" when relabeling a ROM's data directory)
+ */
+bool selinux_restore_context_recursive(const std::string &path,
+                                       FileContexts &contexts,
+                                       const std::string &lookup_path)
+{
+    return RecursiveRestoreContext(path, contexts, lookup_path).run();
+}
+
 bool selinux_get_enforcing(int *value)
 {
     int fd = open(SELINUX_ENFORCE_FILE, O_RDONLY);
@@ -19,12 +19,22 @@
 
 #include "mbutil/socket.h"
 
+#include <algorithm>
+
+#include <cerrno>
 #include <climits>
 #include <cstdlib>
 #include <cstring>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+// Minimum number of bytes to request per receive in FramedSocket
+#define FRAMED_SOCKET_MIN_READ  (64 * 1024)
+
+// Maximum number of fds accepted per receive in FramedSocket
+#define FRAMED_SOCKET_MAX_FDS   16
+
 namespace mb
 {
 namespace util
@@ -82,6 +92,79 @@ ssize_t socket_write(int fd, const void *buf, size_t size)
     return bytes_written;
 }
 
+/*!
+ * \brief Write all of the data in \a iov, retrying on partial writes
+ *
+ * \note This modifies the elements of \a iov.
+ */
+static bool socket_writev_all(int fd, struct iovec *iov, int iovcnt,
+                              const struct msghdr *control_msg = nullptr)
+{
+    bool first = true;
+
+    while (iovcnt > 0) {
+        ssize_t n;
+
+        if (first && control_msg) {
+            // The ancillary data is only sent with the first chunk
+            struct msghdr msg = *control_msg;
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        } else {
+            n = writev(fd, iov, iovcnt);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+
+        first = false;
+
+        // Skip fully written buffers and advance the partially written one
+        size_t written = n;
+        while (iovcnt > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write a length-prefixed buffer with a single writev()
+ */
+static bool socket_write_frame(int fd, const void *data, size_t len,
+                               const struct msghdr *control_msg = nullptr)
+{
+    if (len > INT32_MAX) {
+        errno = EMSGSIZE;
+        return false;
+    }
+
+    int32_t header = static_cast<int32_t>(len);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = const_cast<void *>(data);
+    iov[1].iov_len = len;
+
+    return socket_writev_all(fd, iov, len > 0 ? 2 : 1, control_msg);
+}
+
 bool socket_read_bytes(int fd, std::vector<uint8_t> *result)
 {
     int32_t len;
@@ -93,25 +176,15 @@ bool socket_read_bytes(int fd, std::vector<uint8_t> *result)
         return false;
     }
 
-    std::vector<uint8_t> buf(len);
+    // Reuse the caller's buffer if it is already large enough
+    result->resize(len);
 
-    if (socket_read(fd, buf.data(), len) == (ssize_t) len) {
-        result->swap(buf);
-        return true;
-    }
-    return false;
+    return socket_read(fd, result->data(), len) == (ssize_t) len;
 }
 
 bool socket_write_bytes(int fd, const uint8_t *data, size_t len)
 {
-    if (!socket_write_int32(fd, len)) {
-        return false;
-    }
-
-    if (socket_write(fd, data, len) == (ssize_t) len) {
-        return true;
-    }
-    return false;
+    return socket_write_frame(fd, data, len);
 }
 
 template<typename TYPE>
@@ -213,14 +286,7 @@ bool socket_read_string(int fd, std::string *result)
 
 bool socket_write_string(int fd, const std::string &str)
 {
-    if (!socket_write_int32(fd, str.size())) {
-        return false;
-    }
-
-    if (socket_write(fd, str.data(), str.size()) == (ssize_t) str.size()) {
-        return true;
-    }
-    return false;
+    return socket_write_frame(fd, str.data(), str.size());
 }
 
 bool socket_read_string_array(int fd, std::vector<std::string> *result)
@@ -287,7 +353,12 @@ bool socket_receive_fds(int fd, std::vector<int> *fds)
     cmsg->cmsg_level = SOL_SOCKET;
     cmsg->cmsg_type = SCM_RIGHTS;
 
-    if (recvmsg(fd, &msg, 0) < 0) {
+    ssize_t n = recvmsg(fd, &msg, 0);
+    if (n < 0) {
+        return false;
+    } else if (n == 0 || msg.msg_controllen < sizeof(struct cmsghdr)) {
+        // Peer closed the connection or sent no control message
+        errno = EPIPE;
         return false;
     }
 
@@ -342,5 +413,266 @@ bool socket_send_fds(int fd, const std::vector<int> &fds)
     return false;
 }
 
+FramedSocket::FramedSocket(int fd)
+    : _fd(fd)
+    , _begin(0)
+    , _end(0)
+{
+}
+
+FramedSocket::~FramedSocket()
+{
+    // Close any received fds that were never taken
+    for (int fd : _fds) {
+        close(fd);
+    }
+}
+
+/*!
+ * \brief Ensure that at least \p needed unconsumed bytes are buffered
+ *
+ * The buffered data is moved if needed so that the byte at offset 4 (ie. the
+ * payload of the next frame) is 8-byte aligned. This lets flatbuffers and other payloads
+ * with aligned fields be used in place.
+ */
+bool FramedSocket::fill(size_t needed)
+{
+    static constexpr size_t data_offset = 8 - sizeof(int32_t);
+
+    size_t buffered = _end - _begin;
+    bool aligned = (_begin + sizeof(int32_t)) % 8 == 0;
+
+    // Only move the data if the next payload would be misaligned or if more
+    // room is needed for the next receive
+    if (_begin != data_offset && (!aligned || buffered < needed)) {
+        if (buffered > 0) {
+            memmove(_buf.data() + data_offset, _buf.data() + _begin, buffered);
+        }
+        _begin = data_offset;
+        _end = _begin + buffered;
+    }
+
+    if (buffered >= needed) {
+        return true;
+    }
+
+    if (_buf.size() < data_offset + needed) {
+        _buf.resize(data_offset + std::max<size_t>(needed,
+                                                   FRAMED_SOCKET_MIN_READ));
+    }
+
+    while (_end - _begin < needed) {
+        struct iovec iov;
+        iov.iov_base = _buf.data() + _end;
+        iov.iov_len = _buf.size() - _end;
+
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int) * FRAMED_SOCKET_MAX_FDS)];
+        } control;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t n = recvmsg(_fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            // EOF before a complete frame was received
+            errno = ECONNRESET;
+            return false;
+        }
+
+        _end += n;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+                cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET
+                    && cmsg->cmsg_type == SCM_RIGHTS) {
+                const int *fds = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+                size_t n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                _fds.insert(_fds.end(), fds, fds + n_fds);
+            }
+        }
+
+        if (msg.msg_flags & MSG_CTRUNC) {
+            // Some fds were discarded by the kernel
+            errno = EMSGSIZE;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read the next frame
+ *
+ * \param[out] data Pointer to the frame payload. The payload is 8-byte aligned
+ *                  and remains valid until the next call to read_frame().
+ * \param[out] size Size of the frame payload
+ *
+ * \return True if a complete frame was read. False with errno set if the
+ *         socket could not be read, if EOF was reached, or if the frame length
+ *         was invalid.
+ */
+bool FramedSocket::read_frame(const uint8_t **data, size_t *size)
+{
+    if (!fill(sizeof(int32_t))) {
+        return false;
+    }
+
+    int32_t len;
+    memcpy(&len, _buf.data() + _begin, sizeof(len));
+    if (len < 0) {
+        errno = EBADMSG;
+        return false;
+    }
+
+    if (!fill(sizeof(int32_t) + len)) {
+        return false;
+    }
+
+    *data = _buf.data() + _begin + sizeof(int32_t);
+    *size = len;
+
+    _begin += sizeof(int32_t) + len;
+
+    return true;
+}
+
+/*!
+ * \brief Check whether a complete frame is already buffered
+ *
+ * If this returns true, the next call to read_frame() will not block.
+ */
+bool FramedSocket::has_buffered_frame() const
+{
+    size_t buffered = _end - _begin;
+    if (buffered < sizeof(int32_t)) {
+        return false;
+    }
+
+    int32_t len;
+    memcpy(&len, _buf.data() + _begin, sizeof(len));
+
+    // Invalid lengths are reported by read_frame()
+    return len < 0 || buffered - sizeof(int32_t) >= static_cast<size_t>(len);
+}
+
+/*!
+ * \brief Write a frame
+ *
+ * The header and payload are written with a single writev().
+ */
+bool FramedSocket::write_frame(const void *data, size_t size)
+{
+    if (!flush()) {
+        return false;
+    }
+
+    return socket_write_frame(_fd, data, size);
+}
+
+/*!
+ * \brief Write a frame and send file descriptors along with it
+ *
+ * The fds are sent as `SCM_RIGHTS` ancillary data attached to the first byte
+ * of the frame.
+ */
+bool FramedSocket::write_frame(const void *data, size_t size,
+                               const std::vector<int> &fds)
+{
+    if (fds.empty()) {
+        return write_frame(data, size);
+    } else if (fds.size() > FRAMED_SOCKET_MAX_FDS) {
+        errno = EINVAL;
+        return false;
+    } else if (!flush()) {
+        return false;
+    }
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * FRAMED_SOCKET_MAX_FDS)];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    return socket_write_frame(_fd, data, size, &msg);
+}
+
+/*!
+ * \brief Queue a frame to be written by the next flush()
+ *
+ * The payload is copied, so \p data does not need to remain valid.
+ */
+bool FramedSocket::queue_frame(const void *data, size_t size)
+{
+    if (size > INT32_MAX) {
+        errno = EMSGSIZE;
+        return false;
+    }
+
+    int32_t header = static_cast<int32_t>(size);
+    auto bytes = static_cast<const uint8_t *>(data);
+
+    _out.insert(_out.end(), reinterpret_cast<const uint8_t *>(&header),
+                reinterpret_cast<const uint8_t *>(&header) + sizeof(header));
+    _out.insert(_out.end(), bytes, bytes + size);
+
+    return true;
+}
+
+/*!
+ * \brief Write all queued frames
+ *
+ * The queued frames are written with a single writev() if possible.
+ */
+bool FramedSocket::flush()
+{
+    if (_out.empty()) {
+        return true;
+    }
+
+    struct iovec iov;
+    iov.iov_base = _out.data();
+    iov.iov_len = _out.size();
+
+    bool ret = socket_writev_all(_fd, &iov, 1);
+
+    // The buffer's capacity is kept for the next batch of queued frames
+    _out.clear();
+
+    return ret;
+}
+
+/*!
+ * \brief Take ownership of the file descriptors received so far
+ *
+ * \param[out] fds Vector to append the received fds to
+ */
+void FramedSocket::take_fds(std::vector<int> *fds)
+{
+    fds->insert(fds->end(), _fds.begin(), _fds.end());
+    _fds.clear();
+}
+
 }
 }
\ No newline at end of file
@@ -33,6 +33,19 @@ uint64_t current_time_ms()
     return 1000u * res.tv_sec + res.tv_nsec / 1e6;
 }
 
+/*!
+ * \brief Get time from the monotonic clock in nanoseconds
+ *
+ * Unlike current_time_ms(), this is unaffected by changes to the system time,
+ * so it is suitable for measuring durations.
+ */
+uint64_t monotonic_time_ns()
+{
+    struct timespec res;
+    clock_gettime(CLOCK_MONOTONIC, &res);
+    return UINT64_C(1000000000) * res.tv_sec + res.tv_nsec;
+}
+
 /*!
  * \brief Format date and time
  *
@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/trace.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/time.h"
+
+// Durations are bucketed by their base-2 logarithm in nanoseconds
+#define HISTOGRAM_BUCKETS 64
+
+// Spans past this limit are dropped so that a loop cannot grow the timeline
+// without bound
+#define TIMELINE_MAX_SPANS 1024
+
+#define TIMELINE_INVALID_INDEX static_cast<size_t>(-1)
+
+namespace mb
+{
+namespace util
+{
+
+struct SpanStats
+{
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t min_ns = UINT64_MAX;
+    uint64_t max_ns = 0;
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+};
+
+static std::mutex trace_lock;
+// Ordered so that the dumps are sorted by name
+static std::map<std::string, SpanStats> trace_spans;
+static std::map<std::string, int64_t> trace_counters;
+
+struct TimelineEntry
+{
+    const char *name;
+    uint64_t start_ns;
+    // UINT64_MAX while the span is still open
+    uint64_t duration_ns;
+    unsigned int depth;
+    unsigned int thread;
+};
+
+static std::mutex timeline_lock;
+static bool timeline_active = false;
+static std::vector<TimelineEntry> timeline_entries;
+// Spans nest per thread. Threads are numbered in the order that they first
+// record a span.
+static thread_local unsigned int timeline_depth = 0;
+static thread_local unsigned int timeline_thread = 0;
+static unsigned int timeline_threads = 0;
+static uint64_t timeline_dropped = 0;
+// Incremented by timeline_start() so that spans from an older timeline do not
+// end entries of the new one
+static uint64_t timeline_generation = 0;
+
+static unsigned int bucket_index(uint64_t ns)
+{
+    unsigned int i = 0;
+    while (ns > 1 && i < HISTOGRAM_BUCKETS - 1) {
+        ns >>= 1;
+        ++i;
+    }
+    return i;
+}
+
+/*!
+ * \brief Get upper bound of the bucket containing the \a pct percentile
+ */
+static uint64_t percentile_ns(const SpanStats &stats, unsigned int pct)
+{
+    uint64_t target = (stats.count * pct + 99) / 100;
+    uint64_t seen = 0;
+
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += stats.buckets[i];
+        if (seen >= target) {
+            uint64_t bound = i + 1 < 64 ? UINT64_C(1) << (i + 1) : UINT64_MAX;
+            return bound < stats.max_ns ? bound : stats.max_ns;
+        }
+    }
+
+    return stats.max_ns;
+}
+
+static void append_ms(std::string &out, uint64_t ns)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%" PRIu64 ".%03" PRIu64 "ms",
+             ns / 1000000, ns / 1000 % 1000);
+    out += buf;
+}
+
+/*!
+ * \brief Add a sample to span \a name
+ *
+ * \param name Span name
+ * \param duration_ns Duration in nanoseconds
+ */
+void trace_record(const char *name, uint64_t duration_ns)
+{
+    std::lock_guard<std::mutex> lock(trace_lock);
+
+    SpanStats &stats = trace_spans[name];
+    ++stats.count;
+    stats.total_ns += duration_ns;
+    if (duration_ns < stats.min_ns) {
+        stats.min_ns = duration_ns;
+    }
+    if (duration_ns > stats.max_ns) {
+        stats.max_ns = duration_ns;
+    }
+    ++stats.buckets[bucket_index(duration_ns)];
+}
+
+/*!
+ * \brief Add \a delta to counter \a name
+ */
+void trace_count(const char *name, int64_t delta)
+{
+    std::lock_guard<std::mutex> lock(trace_lock);
+    trace_counters[name] += delta;
+}
+
+/*!
+ * \brief Discard all recorded spans and counters
+ */
+void trace_reset()
+{
+    std::lock_guard<std::mutex> lock(trace_lock);
+    trace_spans.clear();
+    trace_counters.clear();
+}
+
+/*!
+ * \brief Format all recorded spans and counters
+ *
+ * Each span or counter is written on its own line. Spans include the number
+ * of samples, the total, average, minimum, and maximum durations, and the
+ * approximate 50th, 90th, and 99th percentiles (upper bounds of power-of-two
+ * buckets).
+ *
+ * \return Formatted string (empty if nothing was recorded)
+ */
+std::string trace_dump()
+{
+    std::lock_guard<std::mutex> lock(trace_lock);
+    std::string out;
+
+    for (auto const &pair : trace_spans) {
+        const SpanStats &stats = pair.second;
+        char buf[32];
+
+        out += "span ";
+        out += pair.first;
+        snprintf(buf, sizeof(buf), ": count=%" PRIu64, stats.count);
+        out += buf;
+        out += " total=";
+        append_ms(out, stats.total_ns);
+        out += " avg=";
+        append_ms(out, stats.total_ns / stats.count);
+        out += " min=";
+        append_ms(out, stats.min_ns);
+        out += " max=";
+        append_ms(out, stats.max_ns);
+        out += " p50<=";
+        append_ms(out, percentile_ns(stats, 50));
+        out += " p90<=";
+        append_ms(out, percentile_ns(stats, 90));
+        out += " p99<=";
+        append_ms(out, percentile_ns(stats, 99));
+        out += '\n';
+    }
+
+    for (auto const &pair : trace_counters) {
+        char buf[32];
+
+        out += "counter ";
+        out += pair.first;
+        snprintf(buf, sizeof(buf), ": %" PRId64 "\n", pair.second);
+        out += buf;
+    }
+
+    return out;
+}
+
+/*!
+ * \brief Write all recorded spans and counters to the log
+ */
+void trace_dump_to_log()
+{
+    std::string dump = trace_dump();
+
+    const char *begin = dump.c_str();
+    const char *end;
+    while ((end = strchr(begin, '\n'))) {
+        LOGI("[trace] %.*s", static_cast<int>(end - begin), begin);
+        begin = end + 1;
+    }
+}
+
+/*!
+ * \brief Write all recorded spans and counters to a file
+ *
+ * \param path Output file (truncated if it exists)
+ *
+ * \return Whether the file was successfully written
+ */
+bool trace_dump_to_file(const std::string &path)
+{
+    std::string dump = trace_dump();
+
+    autoclose::file fp(autoclose::fopen(path.c_str(), "wb"));
+    if (!fp) {
+        LOGE("%s: Failed to open for writing: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fwrite(dump.data(), 1, dump.size(), fp.get()) != dump.size()) {
+        LOGE("%s: Failed to write: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+ScopedTimer::ScopedTimer(const char *name)
+    : _name(name)
+    , _start(monotonic_time_ns())
+{
+}
+
+ScopedTimer::~ScopedTimer()
+{
+    trace_record(_name, elapsed_ns());
+}
+
+/*!
+ * \brief Get time elapsed since the object was constructed
+ */
+uint64_t ScopedTimer::elapsed_ns() const
+{
+    return monotonic_time_ns() - _start;
+}
+
+/*!
+ * \brief Start recording a new timeline
+ *
+ * Any previously recorded timeline is discarded. Timestamps are taken from
+ * CLOCK_MONOTONIC, so they line up with the kernel log timestamps.
+ */
+void timeline_start()
+{
+    std::lock_guard<std::mutex> lock(timeline_lock);
+    timeline_entries.clear();
+    timeline_entries.reserve(64);
+    timeline_dropped = 0;
+    ++timeline_generation;
+    timeline_active = true;
+}
+
+/*!
+ * \brief Stop recording spans
+ *
+ * The spans recorded so far are kept until the next timeline_start().
+ */
+void timeline_stop()
+{
+    std::lock_guard<std::mutex> lock(timeline_lock);
+    timeline_active = false;
+}
+
+static void append_json_string(std::string &out, const char *str)
+{
+    out += '"';
+    for (; *str; ++str) {
+        unsigned char c = static_cast<unsigned char>(*str);
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += static_cast<char>(c);
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += static_cast<char>(c);
+        }
+    }
+    out += '"';
+}
+
+/*!
+ * \brief Format the recorded timeline as JSON
+ *
+ * The output is an object with a `spans` array containing the `name`,
+ * `start_us` (microseconds since boot), `duration_us`, nesting `depth`, and
+ * `thread` number of each span in the order that they were started. Spans that have not finished
+ * yet have a `duration_us` of `null`.
+ */
+std::string timeline_dump_json()
+{
+    std::lock_guard<std::mutex> lock(timeline_lock);
+    std::string out;
+    char buf[64];
+
+    out += "{\n  \"clock\": \"monotonic\",\n";
+    snprintf(buf, sizeof(buf), "  \"dropped\": %" PRIu64 ",\n",
+             timeline_dropped);
+    out += buf;
+    out += "  \"spans\": [";
+
+    for (size_t i = 0; i < timeline_entries.size(); ++i) {
+        const TimelineEntry &entry = timeline_entries[i];
+
+        out += i == 0 ? "\n" : ",\n";
+        out += "    {\"name\": ";
+        append_json_string(out, entry.name);
+        snprintf(buf, sizeof(buf), ", \"start_us\": %" PRIu64,
+                 entry.start_ns / 1000);
+        out += buf;
+        if (entry.duration_ns == UINT64_MAX) {
+            out += ", \"duration_us\": null";
+        } else {
+            snprintf(buf, sizeof(buf), ", \"duration_us\": %" PRIu64,
+                     entry.duration_ns / 1000);
+            out += buf;
+        }
+        snprintf(buf, sizeof(buf), ", \"depth\": %u, \"thread\": %u}",
+                 entry.depth, entry.thread);
+        out += buf;
+    }
+
+    out += "\n  ]\n}\n";
+    return out;
+}
+
+/*!
+ * \brief Write the recorded timeline to the log
+ *
+ * Each span is written on its own line and indented by its nesting depth.
+ */
+void timeline_dump_to_log()
+{
+    std::lock_guard<std::mutex> lock(timeline_lock);
+
+    for (const TimelineEntry &entry : timeline_entries) {
+        std::string line;
+        if (timeline_threads > 1) {
+            char buf[16];
+            snprintf(buf, sizeof(buf), "[%u] ", entry.thread);
+            line += buf;
+        }
+        line.append(entry.depth * 2, ' ');
+        line += entry.name;
+        line += ": start=";
+        append_ms(line, entry.start_ns);
+        line += " duration=";
+        if (entry.duration_ns == UINT64_MAX) {
+            line += "(unfinished)";
+        } else {
+            append_ms(line, entry.duration_ns);
+        }
+
+        LOGI("[timeline] %s", line.c_str());
+    }
+
+    if (timeline_dropped > 0) {
+        LOGW("[timeline] %" PRIu64 " spans were dropped", timeline_dropped);
+    }
+}
+
+/*!
+ * \brief Write the recorded timeline to a file as JSON
+ *
+ * \param path Output file (truncated if it exists)
+ *
+ * \return Whether the file was successfully written
+ */
+bool timeline_dump_to_file(const std::string &path)
+{
+    std::string dump = timeline_dump_json();
+
+    autoclose::file fp(autoclose::fopen(path.c_str(), "wbe"));
+    if (!fp) {
+        LOGE("%s: Failed to open for writing: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fwrite(dump.data(), 1, dump.size(), fp.get()) != dump.size()) {
+        LOGE("%s: Failed to write: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+TimelineSpan::TimelineSpan(const char *name)
+    : _index(TIMELINE_INVALID_INDEX)
+    , _generation(0)
+{
+    std::lock_guard<std::mutex> lock(timeline_lock);
+
+    if (!timeline_active) {
+        return;
+    } else if (timeline_entries.size() >= TIMELINE_MAX_SPANS) {
+        ++timeline_dropped;
+        return;
+    }
+
+    if (timeline_thread == 0) {
+        timeline_thread = ++timeline_threads;
+    }
+
+    _index = timeline_entries.size();
+    _generation = timeline_generation;
+    timeline_entries.push_back({ name, monotonic_time_ns(), UINT64_MAX,
+                                 timeline_depth, timeline_thread });
+    ++timeline_depth;
+}
+
+TimelineSpan::~TimelineSpan()
+{
+    if (_index == TIMELINE_INVALID_INDEX) {
+        return;
+    }
+
+    --timeline_depth;
+
+    std::lock_guard<std::mutex> lock(timeline_lock);
+
+    if (_generation == timeline_generation) {
+        TimelineEntry &entry = timeline_entries[_index];
+        entry.duration_ns = monotonic_time_ns() - entry.start_ns;
+    }
+}
+
+}
+}
@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "mbutil/xattr.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/xattr.h>
+
+// Initial size of the name and value buffers. This is enough for the SELinux
+// label and file capabilities of almost every file.
+#define MIN_BUF_SIZE            512
+
+namespace mb
+{
+namespace util
+{
+
+static ssize_t list_xattrs(int fd, const char *path, bool follow_symlinks,
+                           char *buf, size_t size)
+{
+    if (!path) {
+        return flistxattr(fd, buf, size);
+    } else if (follow_symlinks) {
+        return listxattr(path, buf, size);
+    } else {
+        return llistxattr(path, buf, size);
+    }
+}
+
+static ssize_t get_xattr(int fd, const char *path, bool follow_symlinks,
+                         const char *name, void *buf, size_t size)
+{
+    if (!path) {
+        return fgetxattr(fd, name, buf, size);
+    } else if (follow_symlinks) {
+        return getxattr(path, name, buf, size);
+    } else {
+        return lgetxattr(path, name, buf, size);
+    }
+}
+
+static int set_xattr(int fd, const char *path, bool follow_symlinks,
+                     const char *name, const void *value, size_t size)
+{
+    if (!path) {
+        return fsetxattr(fd, name, value, size, 0);
+    } else if (follow_symlinks) {
+        return setxattr(path, name, value, size, 0);
+    } else {
+        return lsetxattr(path, name, value, size, 0);
+    }
+}
+
+bool XattrSnapshot::read(int fd, const char *path, bool follow_symlinks)
+{
+    clear();
+
+    if (_names.size() < MIN_BUF_SIZE) {
+        _names.resize(MIN_BUF_SIZE);
+    }
+
+    // xattr names are in a NULL-separated list
+    ssize_t n;
+    while ((n = list_xattrs(fd, path, follow_symlinks,
+                            _names.data(), _names.size())) < 0) {
+        if (errno != ERANGE) {
+            return false;
+        }
+
+        // Only probe the size if the list does not fit
+        n = list_xattrs(fd, path, follow_symlinks, nullptr, 0);
+        if (n < 0) {
+            return false;
+        }
+        _names.resize(std::max<size_t>(n, _names.size() * 2));
+    }
+    _names_size = n;
+
+    size_t name_size;
+    for (size_t offset = 0; offset < _names_size; offset += name_size + 1) {
+        const char *name = _names.data() + offset;
+        name_size = strnlen(name, _names_size - offset);
+        if (name_size == 0 || offset + name_size == _names_size) {
+            // Empty or unterminated name
+            continue;
+        }
+
+        while (true) {
+            if (_values.size() - _values_size < MIN_BUF_SIZE) {
+                _values.resize(std::max<size_t>(_values.size() * 2,
+                                                _values_size + MIN_BUF_SIZE));
+            }
+
+            n = get_xattr(fd, path, follow_symlinks, name,
+                          _values.data() + _values_size,
+                          _values.size() - _values_size);
+            if (n >= 0) {
+                _attrs.push_back({ offset, _values_size,
+                                   static_cast<size_t>(n) });
+                _values_size += n;
+                break;
+            } else if (errno == ENODATA) {
+                // Removed after the list was read
+                break;
+            } else if (errno != ERANGE) {
+                return false;
+            }
+
+            n = get_xattr(fd, path, follow_symlinks, name, nullptr, 0);
+            if (n < 0) {
+                if (errno == ENODATA) {
+                    break;
+                }
+                return false;
+            }
+            _values.resize(_values_size + n);
+        }
+    }
+
+    return true;
+}
+
+bool XattrSnapshot::apply(int fd, const char *path, bool follow_symlinks) const
+{
+    for (const Attr &attr : _attrs) {
+        if (set_xattr(fd, path, follow_symlinks, _names.data() + attr.name,
+                      _values.data() + attr.value, attr.value_size) < 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read all xattrs of an open file
+ *
+ * \return True if all attributes were read. False and sets errno if the
+ *         attributes could not be listed (eg. ENOTSUP if the filesystem does
+ *         not support xattrs) or one of them could not be read.
+ */
+bool XattrSnapshot::read_fd(int fd)
+{
+    return read(fd, nullptr, false);
+}
+
+/*!
+ * \brief Read all xattrs of a path
+ *
+ * \sa read_fd()
+ */
+bool XattrSnapshot::read_path(const std::string &path, bool follow_symlinks)
+{
+    return read(-1, path.c_str(), follow_symlinks);
+}
+
+/*!
+ * \brief Set all attributes in the snapshot on an open file
+ *
+ * Attributes that the file has, but are not in the snapshot, are left alone.
+ *
+ * \return True if all attributes were set. False and sets errno (eg. ENOTSUP
+ *         if the filesystem does not support xattrs) otherwise.
+ */
+bool XattrSnapshot::apply_fd(int fd) const
+{
+    return apply(fd, nullptr, false);
+}
+
+/*!
+ * \brief Set all attributes in the snapshot on a path
+ *
+ * \sa apply_fd()
+ */
+bool XattrSnapshot::apply_path(const std::string &path,
+                               bool follow_symlinks) const
+{
+    return apply(-1, path.c_str(), follow_symlinks);
+}
+
+/*!
+ * \brief Remove all attributes from the snapshot, but keep the buffers
+ */
+void XattrSnapshot::clear()
+{
+    _names_size = 0;
+    _values_size = 0;
+    _attrs.clear();
+}
+
+size_t XattrSnapshot::size() const
+{
+    return _attrs.size();
+}
+
+bool XattrSnapshot::empty() const
+{
+    return _attrs.empty();
+}
+
+/*!
+ * \brief Check if two snapshots contain the same attributes in the same order
+ */
+bool XattrSnapshot::operator==(const XattrSnapshot &other) const
+{
+    if (_attrs.size() != other._attrs.size()) {
+        return false;
+    }
+
+    for (size_t i = 0; i < _attrs.size(); ++i) {
+        const Attr &a = _attrs[i];
+        const Attr &b = other._attrs[i];
+
+        if (a.value_size != b.value_size
+                || strcmp(_names.data() + a.name,
+                          other._names.data() + b.name) != 0
+                || memcmp(_values.data() + a.value,
+                          other._values.data() + b.value, a.value_size) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool XattrSnapshot::operator!=(const XattrSnapshot &other) const
+{
+    return !(*this == other);
+}
+
+}
+}
@@ -17,18 +17,31 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include <cerrno>
 #include <cstdarg>
 #include <cstdlib>
 #include <cstring>
 
+#include <pthread.h>
+#include <sys/stat.h>
+
 #include <archive.h>
 #include <archive_entry.h>
 
 #include <jni.h>
 
+#include <openssl/sha.h>
+
 #include "mbcommon/common.h"
 
 #include "mbbootimg/entry.h"
@@ -45,6 +58,9 @@
 #define IOException             "java/io/IOException"
 #define OutOfMemoryError        "java/lang/OutOfMemoryError"
 
+// Must match CMDLINE_ROM_ID_PREFIX in mbtool/multiboot.h
+#define CMDLINE_ROM_ID_PREFIX   "mbtool.romid="
+
 typedef std::unique_ptr<archive, decltype(archive_free) *> ScopedArchive;
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
 
@@ -80,83 +96,172 @@ static bool throw_exception(JNIEnv *env, const char *class_name,
     return ret == 0;
 }
 
-JNIEXPORT void JNICALL
-CLASS_METHOD(extractArchive)(JNIEnv *env, jclass clazz, jstring jfilename,
-                            jstring jtarget)
+// Archive extraction jobs
+//
+// Extraction is split between two native threads: the reader thread
+// decompresses the archive and the writer thread writes the entries to disk.
+// They're connected by a bounded queue, so slow storage only stalls
+// decompression once the queue is full. The Java side starts a job, polls its
+// progress, and can cancel it at any time.
+
+// Maximum amount of decompressed data buffered between the threads
+#define EXTRACT_QUEUE_MAX_BYTES         (4 * 1024 * 1024)
+
+// Indexes into the array returned by extractArchiveProgress()
+enum ExtractProgress
 {
-    (void) clazz;
+    EXTRACT_PROGRESS_BYTES_READ = 0,
+    EXTRACT_PROGRESS_BYTES_TOTAL,
+    EXTRACT_PROGRESS_BYTES_WRITTEN,
+    EXTRACT_PROGRESS_ENTRIES_WRITTEN,
+    EXTRACT_PROGRESS_DONE,
+    EXTRACT_PROGRESS_COUNT,
+};
 
-    bool ret = false;
-    const char *filename = nullptr;
-    const char *target = nullptr;
-    struct archive *in = nullptr;
-    struct archive *out = nullptr;
-    struct archive_entry *entry;
-    int laret;
-    char *cwd = nullptr;
+struct ExtractChunk
+{
+    // Set for the chunk that starts a new entry
+    archive_entry *entry;
+    std::vector<char> data;
+    int64_t offset;
+};
 
-    filename = env->GetStringUTFChars(jfilename, nullptr);
-    if (!filename) {
-        goto done;
+struct ExtractJob
+{
+    std::string filename;
+    std::string target;
+    // Entries to extract or empty to extract everything
+    std::unordered_set<std::string> selected;
+
+    archive *in;
+
+    pthread_t reader;
+    pthread_t writer;
+
+    // Protects the fields below
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<ExtractChunk> queue;
+    size_t queue_bytes;
+    bool reader_done;
+    std::string error;
+
+    // Only modified with the lock held so that waiters don't miss an update
+    std::atomic_bool failed;
+    std::atomic_bool cancelled;
+    std::atomic_int running;
+
+    // Compressed bytes consumed out of the archive's size
+    std::atomic<uint64_t> bytes_read;
+    uint64_t bytes_total;
+    // Uncompressed bytes written to disk
+    std::atomic<uint64_t> bytes_written;
+    std::atomic<uint64_t> entries_written;
+
+    ExtractJob()
+        : in(nullptr)
+        , queue_bytes(0)
+        , reader_done(false)
+        , failed(false)
+        , cancelled(false)
+        , running(0)
+        , bytes_read(0)
+        , bytes_total(0)
+        , bytes_written(0)
+        , entries_written(0)
+    {
     }
 
-    target = env->GetStringUTFChars(jtarget, nullptr);
-    if (!target) {
-        goto done;
+    ~ExtractJob()
+    {
+        for (auto &chunk : queue) {
+            archive_entry_free(chunk.entry);
+        }
+        archive_read_free(in);
     }
+};
 
-    if (!(in = archive_read_new())) {
-        throw_exception(env, OutOfMemoryError, "Out of memory");
-        goto done;
-    }
+MB_PRINTF(2, 3)
+static void extract_job_fail(ExtractJob *job, const char *fmt, ...)
+{
+    char *buf;
+    va_list ap;
 
-    // Add more as needed
-    //archive_read_support_format_all(in);
-    //archive_read_support_filter_all(in);
-    archive_read_support_format_tar(in);
-    archive_read_support_format_zip(in);
-    archive_read_support_filter_xz(in);
+    va_start(ap, fmt);
+    int ret = vasprintf(&buf, fmt, ap);
+    va_end(ap);
 
-    if (archive_read_open_filename(in, filename, 10240) != ARCHIVE_OK) {
-        throw_exception(env, IOException,
-                        "%s: Failed to open archive: %s",
-                        filename, archive_error_string(in));
-        goto done;
+    if (ret < 0) {
+        abort();
     }
 
-    if (!(out = archive_write_disk_new())) {
-        throw_exception(env, OutOfMemoryError, "Out of memory");
-        goto done;
+    {
+        std::lock_guard<std::mutex> guard(job->lock);
+
+        // Only the first error is reported
+        if (!job->failed) {
+            job->failed = true;
+            job->error = buf;
+        }
     }
+    job->cv.notify_all();
 
-    archive_write_disk_set_options(out,
-                                   ARCHIVE_EXTRACT_ACL |
-                                   ARCHIVE_EXTRACT_FFLAGS |
-                                   ARCHIVE_EXTRACT_PERM |
-                                   ARCHIVE_EXTRACT_SECURE_NODOTDOT |
-                                   ARCHIVE_EXTRACT_SECURE_SYMLINKS |
-                                   ARCHIVE_EXTRACT_TIME |
-                                   ARCHIVE_EXTRACT_UNLINK |
-                                   ARCHIVE_EXTRACT_XATTR);
+    free(buf);
+}
 
-    if (!(cwd = getcwd(nullptr, 0))) {
-        throw_exception(env, IOException,
-                        "Failed to get cwd: %s", strerror(errno));
-        goto done;
-    }
+// Returns false if the writer has given up
+static bool extract_job_push(ExtractJob *job, ExtractChunk chunk)
+{
+    std::unique_lock<std::mutex> guard(job->lock);
 
-    if (chdir(target) < 0) {
-        throw_exception(env, IOException,
-                        "%s: Failed to change to target directory: %s",
-                        target, strerror(errno));
-        goto done;
+    job->cv.wait(guard, [job] {
+        return job->queue_bytes < EXTRACT_QUEUE_MAX_BYTES
+                || job->failed || job->cancelled;
+    });
+
+    if (job->failed || job->cancelled) {
+        archive_entry_free(chunk.entry);
+        return false;
     }
 
-    while ((laret = archive_read_next_header(in, &entry)) == ARCHIVE_OK) {
-        if ((laret = archive_write_header(out, entry)) != ARCHIVE_OK) {
-            throw_exception(env, IOException,
-                            "%s: Failed to write header: %s",
-                            target, archive_error_string(out));
+    job->queue_bytes += chunk.data.size();
+    job->queue.push_back(std::move(chunk));
+
+    guard.unlock();
+    job->cv.notify_all();
+
+    return true;
+}
+
+static void * extract_read_thread(void *userdata)
+{
+    auto job = static_cast<ExtractJob *>(userdata);
+    archive_entry *entry;
+    int laret = ARCHIVE_OK;
+
+    while (!job->cancelled && !job->failed
+            && (laret = archive_read_next_header(job->in, &entry))
+                    == ARCHIVE_OK) {
+        const char *path = archive_entry_pathname(entry);
+
+        if (!job->selected.empty()
+                && (!path || job->selected.find(path) == job->selected.end())) {
+            if (archive_read_data_skip(job->in) != ARCHIVE_OK) {
+                extract_job_fail(job, "%s: Failed to skip entry: %s",
+                                 job->filename.c_str(),
+                                 archive_error_string(job->in));
+                goto done;
+            }
+            continue;
+        }
+
+        ExtractChunk header{};
+        header.entry = archive_entry_clone(entry);
+        if (!header.entry) {
+            extract_job_fail(job, "Out of memory");
+            goto done;
+        }
+        if (!extract_job_push(job, std::move(header))) {
             goto done;
         }
 
@@ -165,44 +270,337 @@ CLASS_METHOD(extractArchive)(JNIEnv *env, jclass clazz, jstring jfilename,
         int64_t offset;
 
         while ((laret = archive_read_data_block(
-                in, &buff, &size, &offset)) == ARCHIVE_OK) {
-            if (archive_write_data_block(out, buff, size, offset) != ARCHIVE_OK) {
-                throw_exception(env, IOException,
-                                "%s: Failed to write data: %s",
-                                target, archive_error_string(out));
+                job->in, &buff, &size, &offset)) == ARCHIVE_OK) {
+            ExtractChunk chunk{};
+            chunk.data.assign(static_cast<const char *>(buff),
+                              static_cast<const char *>(buff) + size);
+            chunk.offset = offset;
+
+            job->bytes_read = archive_filter_bytes(job->in, -1);
+
+            if (!extract_job_push(job, std::move(chunk))) {
                 goto done;
             }
         }
 
         if (laret != ARCHIVE_EOF) {
-            throw_exception(env, IOException,
-                            "%s: Data copy ended without reaching EOF: %s",
-                            filename, archive_error_string(in));
+            extract_job_fail(job,
+                             "%s: Data copy ended without reaching EOF: %s",
+                             job->filename.c_str(),
+                             archive_error_string(job->in));
             goto done;
         }
     }
 
-    if (laret != ARCHIVE_EOF) {
-        throw_exception(env, IOException,
-                        "%s: Archive extraction ended without reaching EOF: %s",
-                        filename, archive_error_string(in));
+    if (!job->cancelled && !job->failed && laret != ARCHIVE_EOF) {
+        extract_job_fail(job,
+                         "%s: Archive extraction ended without reaching EOF: %s",
+                         job->filename.c_str(), archive_error_string(job->in));
         goto done;
     }
 
-    ret = true;
+    if (laret == ARCHIVE_EOF) {
+        job->bytes_read = job->bytes_total;
+    }
 
 done:
-    if (cwd) {
-        chdir(cwd);
+    {
+        std::lock_guard<std::mutex> guard(job->lock);
+        job->reader_done = true;
+    }
+    job->cv.notify_all();
+
+    --job->running;
+    return nullptr;
+}
+
+// Entries are written relative to the target directory. This is done by
+// rewriting the paths instead of chdir()'ing since the cwd is process-wide.
+static void extract_set_target_path(ExtractJob *job, archive_entry *entry)
+{
+    std::string path;
+
+    if (const char *pathname = archive_entry_pathname(entry)) {
+        path = job->target;
+        path += '/';
+        path += pathname;
+        archive_entry_set_pathname(entry, path.c_str());
+    }
+    if (const char *hardlink = archive_entry_hardlink(entry)) {
+        path = job->target;
+        path += '/';
+        path += hardlink;
+        archive_entry_set_hardlink(entry, path.c_str());
     }
+}
+
+static void * extract_write_thread(void *userdata)
+{
+    auto job = static_cast<ExtractJob *>(userdata);
+
+    archive *out = archive_write_disk_new();
+    if (!out) {
+        extract_job_fail(job, "Out of memory");
+        --job->running;
+        return nullptr;
+    }
+
+    archive_write_disk_set_options(out,
+                                   ARCHIVE_EXTRACT_ACL |
+                                   ARCHIVE_EXTRACT_FFLAGS |
+                                   ARCHIVE_EXTRACT_PERM |
+                                   ARCHIVE_EXTRACT_SECURE_NODOTDOT |
+                                   ARCHIVE_EXTRACT_SECURE_SYMLINKS |
+                                   ARCHIVE_EXTRACT_TIME |
+                                   ARCHIVE_EXTRACT_UNLINK |
+                                   ARCHIVE_EXTRACT_XATTR);
+
+    while (true) {
+        ExtractChunk chunk{};
+
+        {
+            std::unique_lock<std::mutex> guard(job->lock);
+
+            job->cv.wait(guard, [job] {
+                return !job->queue.empty() || job->reader_done
+                        || job->failed || job->cancelled;
+            });
+
+            if (job->failed || job->cancelled || job->queue.empty()) {
+                break;
+            }
 
-    archive_read_free(in);
+            chunk = std::move(job->queue.front());
+            job->queue.pop_front();
+            job->queue_bytes -= chunk.data.size();
+        }
+        job->cv.notify_all();
+
+        if (chunk.entry) {
+            extract_set_target_path(job, chunk.entry);
+
+            int laret = archive_write_header(out, chunk.entry);
+            archive_entry_free(chunk.entry);
+
+            if (laret != ARCHIVE_OK) {
+                extract_job_fail(job, "%s: Failed to write header: %s",
+                                 job->target.c_str(),
+                                 archive_error_string(out));
+                break;
+            }
+
+            ++job->entries_written;
+        } else {
+            if (archive_write_data_block(out, chunk.data.data(),
+                                         chunk.data.size(), chunk.offset)
+                    != ARCHIVE_OK) {
+                extract_job_fail(job, "%s: Failed to write data: %s",
+                                 job->target.c_str(),
+                                 archive_error_string(out));
+                break;
+            }
+
+            job->bytes_written += chunk.data.size();
+        }
+    }
+
+    if (archive_write_close(out) != ARCHIVE_OK) {
+        extract_job_fail(job, "%s: Failed to close archive: %s",
+                         job->target.c_str(), archive_error_string(out));
+    }
     archive_write_free(out);
 
-    if (filename) {
-        env->ReleaseStringUTFChars(jfilename, filename);
-        env->ReleaseStringUTFChars(jtarget, target);
+    --job->running;
+    return nullptr;
+}
+
+static ExtractJob * extract_job_start(JNIEnv *env, jstring jfilename,
+                                      jstring jtarget, jobjectArray jentries)
+{
+    std::unique_ptr<ExtractJob> job(new ExtractJob());
+    const char *filename = nullptr;
+    const char *target = nullptr;
+    struct stat sb;
+    int ret;
+
+    filename = env->GetStringUTFChars(jfilename, nullptr);
+    if (!filename) {
+        return nullptr;
+    }
+    job->filename = filename;
+    env->ReleaseStringUTFChars(jfilename, filename);
+
+    target = env->GetStringUTFChars(jtarget, nullptr);
+    if (!target) {
+        return nullptr;
+    }
+    job->target = target;
+    env->ReleaseStringUTFChars(jtarget, target);
+
+    if (jentries) {
+        jsize length = env->GetArrayLength(jentries);
+
+        for (jsize i = 0; i < length; ++i) {
+            jstring jentry = static_cast<jstring>(
+                    env->GetObjectArrayElement(jentries, i));
+            if (!jentry) {
+                return nullptr;
+            }
+
+            const char *entry = env->GetStringUTFChars(jentry, nullptr);
+            if (!entry) {
+                return nullptr;
+            }
+            job->selected.insert(entry);
+            env->ReleaseStringUTFChars(jentry, entry);
+            env->DeleteLocalRef(jentry);
+        }
+    }
+
+    if (!(job->in = archive_read_new())) {
+        throw_exception(env, OutOfMemoryError, "Out of memory");
+        return nullptr;
+    }
+
+    // Add more as needed
+    //archive_read_support_format_all(job->in);
+    //archive_read_support_filter_all(job->in);
+    archive_read_support_format_tar(job->in);
+    archive_read_support_format_zip(job->in);
+    archive_read_support_filter_xz(job->in);
+
+    if (archive_read_open_filename(job->in, job->filename.c_str(), 10240)
+            != ARCHIVE_OK) {
+        throw_exception(env, IOException,
+                        "%s: Failed to open archive: %s",
+                        job->filename.c_str(), archive_error_string(job->in));
+        return nullptr;
+    }
+
+    if (stat(job->filename.c_str(), &sb) == 0) {
+        job->bytes_total = sb.st_size;
+    }
+
+    job->running = 2;
+
+    ret = pthread_create(&job->writer, nullptr, &extract_write_thread,
+                         job.get());
+    if (ret != 0) {
+        job->running = 0;
+        throw_exception(env, IOException,
+                        "Failed to start writer thread: %s", strerror(ret));
+        return nullptr;
+    }
+
+    ret = pthread_create(&job->reader, nullptr, &extract_read_thread,
+                         job.get());
+    if (ret != 0) {
+        // Let the writer thread exit
+        {
+            std::lock_guard<std::mutex> guard(job->lock);
+            job->cancelled = true;
+        }
+        job->cv.notify_all();
+        pthread_join(job->writer, nullptr);
+        job->running = 0;
+
+        throw_exception(env, IOException,
+                        "Failed to start reader thread: %s", strerror(ret));
+        return nullptr;
+    }
+
+    return job.release();
+}
+
+// Waits for the job to complete and frees it. Returns false if the job was
+// cancelled.
+static bool extract_job_finish(JNIEnv *env, ExtractJob *job)
+{
+    pthread_join(job->reader, nullptr);
+    pthread_join(job->writer, nullptr);
+
+    bool ret = !job->cancelled;
+
+    if (job->failed) {
+        throw_exception(env, IOException, "%s", job->error.c_str());
+        ret = false;
+    }
+
+    delete job;
+    return ret;
+}
+
+JNIEXPORT void JNICALL
+CLASS_METHOD(extractArchive)(JNIEnv *env, jclass clazz, jstring jfilename,
+                            jstring jtarget)
+{
+    (void) clazz;
+
+    ExtractJob *job = extract_job_start(env, jfilename, jtarget, nullptr);
+    if (job) {
+        extract_job_finish(env, job);
+    }
+}
+
+JNIEXPORT jlong JNICALL
+CLASS_METHOD(extractArchiveStart)(JNIEnv *env, jclass clazz, jstring jfilename,
+                                 jstring jtarget, jobjectArray jentries)
+{
+    (void) clazz;
+
+    ExtractJob *job = extract_job_start(env, jfilename, jtarget, jentries);
+    return reinterpret_cast<jlong>(job);
+}
+
+JNIEXPORT jlongArray JNICALL
+CLASS_METHOD(extractArchiveProgress)(JNIEnv *env, jclass clazz, jlong handle)
+{
+    (void) clazz;
+
+    ExtractJob *job = reinterpret_cast<ExtractJob *>(handle);
+    jlong progress[EXTRACT_PROGRESS_COUNT];
+
+    progress[EXTRACT_PROGRESS_BYTES_READ] =
+            static_cast<jlong>(job->bytes_read);
+    progress[EXTRACT_PROGRESS_BYTES_TOTAL] =
+            static_cast<jlong>(job->bytes_total);
+    progress[EXTRACT_PROGRESS_BYTES_WRITTEN] =
+            static_cast<jlong>(job->bytes_written);
+    progress[EXTRACT_PROGRESS_ENTRIES_WRITTEN] =
+            static_cast<jlong>(job->entries_written);
+    progress[EXTRACT_PROGRESS_DONE] = job->running == 0;
+
+    jlongArray result = env->NewLongArray(EXTRACT_PROGRESS_COUNT);
+    if (!result) {
+        return nullptr;
+    }
+    env->SetLongArrayRegion(result, 0, EXTRACT_PROGRESS_COUNT, progress);
+
+    return result;
+}
+
+JNIEXPORT void JNICALL
+CLASS_METHOD(extractArchiveCancel)(JNIEnv *env, jclass clazz, jlong handle)
+{
+    (void) env;
+    (void) clazz;
+
+    ExtractJob *job = reinterpret_cast<ExtractJob *>(handle);
+
+    {
+        std::lock_guard<std::mutex> guard(job->lock);
+        job->cancelled = true;
     }
+    job->cv.notify_all();
+}
+
+JNIEXPORT jboolean JNICALL
+CLASS_METHOD(extractArchiveFinish)(JNIEnv *env, jclass clazz, jlong handle)
+{
+    (void) clazz;
+
+    ExtractJob *job = reinterpret_cast<ExtractJob *>(handle);
+    return extract_job_finish(env, job);
 }
 
 JNIEXPORT void JNICALL
@@ -218,6 +616,7 @@ CLASS_METHOD(mblogSetLogcat)(JNIEnv *env, jclass clazz)
 struct LaBootImgCtx
 {
     MbBiReader *bir;
+    bool view_unsupported;
     char buf[10240];
 };
 
@@ -229,6 +628,23 @@ static la_ssize_t laBootImgReadCb(archive *a, void *userdata,
     size_t bytesRead;
     int ret;
 
+    // Hand the entire mapped entry to libarchive if possible
+    if (!ctx->view_unsupported) {
+        const void *data;
+
+        ret = mb_bi_reader_read_data_view(ctx->bir, &data, &bytesRead);
+        if (ret == MB_BI_OK) {
+            *buffer = data;
+            return static_cast<la_ssize_t>(bytesRead);
+        } else if (ret == MB_BI_EOF) {
+            return 0;
+        } else if (ret != MB_BI_UNSUPPORTED) {
+            return -1;
+        }
+
+        ctx->view_unsupported = true;
+    }
+
     ret = mb_bi_reader_read_data(ctx->bir, ctx->buf, sizeof(ctx->buf),
                                  &bytesRead);
     if (ret == MB_BI_EOF) {
@@ -241,6 +657,28 @@ static la_ssize_t laBootImgReadCb(archive *a, void *userdata,
     return static_cast<la_ssize_t>(bytesRead);
 }
 
+// mbtool records the ROM ID in the kernel cmdline when patching, which avoids
+// decompressing the ramdisk. Older boot images only have the "romid" file.
+static bool getCmdlineRomId(MbBiHeader *header, std::string *romId)
+{
+    const char *cmdline = mb_bi_header_kernel_cmdline(header);
+    if (!cmdline) {
+        return false;
+    }
+
+    const char *token = cmdline;
+    while ((token = strstr(token, CMDLINE_ROM_ID_PREFIX))) {
+        if (token == cmdline || token[-1] == ' ') {
+            token += strlen(CMDLINE_ROM_ID_PREFIX);
+            romId->assign(token, strcspn(token, " "));
+            return !romId->empty();
+        }
+        token += strlen(CMDLINE_ROM_ID_PREFIX);
+    }
+
+    return false;
+}
+
 JNIEXPORT jstring JNICALL
 CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
 {
@@ -254,6 +692,7 @@ CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
     LaBootImgCtx ctx;
     int ret;
     const char *filename;
+    std::string cmdlineRomId;
     jstring romId = nullptr;
 
     filename = env->GetStringUTFChars(jfilename, nullptr);
@@ -294,6 +733,11 @@ CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
         goto done;
     }
 
+    if (getCmdlineRomId(header, &cmdlineRomId)) {
+        romId = env->NewStringUTF(cmdlineRomId.c_str());
+        goto done;
+    }
+
     // Go to ramdisk
     ret = mb_bi_reader_go_to_entry(bir.get(), &entry, MB_BI_ENTRY_RAMDISK);
     if (ret == MB_BI_EOF) {
@@ -316,6 +760,7 @@ CLASS_METHOD(getBootImageRomId)(JNIEnv *env, jclass clazz, jstring jfilename)
 
     // Open ramdisk archive
     ctx.bir = bir.get();
+    ctx.view_unsupported = false;
     ret = archive_read_open(a.get(), &ctx, nullptr, &laBootImgReadCb, nullptr);
     if (ret != ARCHIVE_OK) {
         throw_exception(env, IOException,
@@ -482,6 +927,168 @@ static bool bootImgHeadersEqual(MbBiHeader *header1, MbBiHeader *header2)
 #undef CHECK_STRING_VALUES
 }
 
+struct EntryDigest
+{
+    int type;
+    uint64_t size;
+    unsigned char sha1[SHA_DIGEST_LENGTH];
+};
+
+struct ImageDigests
+{
+    // File that the digests were computed from. Only cached if stat() succeeded
+    bool have_sb;
+    struct stat sb;
+    std::vector<EntryDigest> entries;
+};
+
+// Maximum number of boot images to keep entry digests for
+#define DIGEST_CACHE_MAX_ENTRIES 64
+
+static std::mutex digest_cache_mutex;
+static std::unordered_map<std::string, ImageDigests> digest_cache;
+
+static bool sameFile(const struct stat &sb1, const struct stat &sb2)
+{
+    return sb1.st_dev == sb2.st_dev
+            && sb1.st_ino == sb2.st_ino
+            && sb1.st_size == sb2.st_size
+            && sb1.st_mtim.tv_sec == sb2.st_mtim.tv_sec
+            && sb1.st_mtim.tv_nsec == sb2.st_mtim.tv_nsec;
+}
+
+static const EntryDigest * findEntryDigest(
+        const std::vector<EntryDigest> &entries, int type)
+{
+    for (auto const &entry : entries) {
+        if (entry.type == type) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+static bool entryDigestsEqual(const std::vector<EntryDigest> &entries1,
+                              const std::vector<EntryDigest> &entries2)
+{
+    if (entries1.size() != entries2.size()) {
+        return false;
+    }
+
+    for (auto const &entry2 : entries2) {
+        const EntryDigest *entry1 = findEntryDigest(entries1, entry2.type);
+        if (!entry1 || entry1->size != entry2.size
+                || memcmp(entry1->sha1, entry2.sha1, sizeof(entry2.sha1)) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Compute the SHA1 digest of every entry in a boot image whose header has
+// already been read. digests->sb must be the result of stat()'ing the file
+// beforehand. The digests are cached until the file changes.
+//
+// If reference is not null, the digests are compared against it as they are
+// computed and the function returns early if an entry is known to differ.
+//
+// Returns 1 on success, 0 if the image doesn't match reference, and -1 (with an
+// exception thrown) on error.
+static int getEntryDigests(JNIEnv *env, MbBiReader *bir, const char *filename,
+                           const ImageDigests *reference,
+                           ImageDigests *digests)
+{
+    {
+        std::lock_guard<std::mutex> lock(digest_cache_mutex);
+
+        auto it = digest_cache.find(filename);
+        if (digests->have_sb && it != digest_cache.end()
+                && sameFile(it->second.sb, digests->sb)) {
+            digests->entries = it->second.entries;
+            return 1;
+        }
+    }
+
+    MbBiEntry *entry;
+    int ret;
+
+    digests->entries.clear();
+
+    while ((ret = mb_bi_reader_read_entry(bir, &entry)) == MB_BI_OK) {
+        EntryDigest digest;
+        digest.type = mb_bi_entry_type(entry);
+
+        // Skip reading the data if the size already doesn't match
+        if (reference && mb_bi_entry_size_is_set(entry)) {
+            const EntryDigest *other =
+                    findEntryDigest(reference->entries, digest.type);
+            if (!other || other->size != mb_bi_entry_size(entry)) {
+                return 0;
+            }
+        }
+
+        SHA_CTX sha_ctx;
+        SHA1_Init(&sha_ctx);
+
+        const void *data;
+        size_t size;
+
+        // Hash the mapped image directly if possible
+        ret = mb_bi_reader_read_data_view(bir, &data, &size);
+        if (ret == MB_BI_OK) {
+            SHA1_Update(&sha_ctx, data, size);
+            digest.size = size;
+        } else if (ret == MB_BI_EOF) {
+            digest.size = 0;
+        } else if (ret == MB_BI_UNSUPPORTED) {
+            char buf[10240];
+            size_t n;
+
+            digest.size = 0;
+
+            while ((ret = mb_bi_reader_read_data(
+                    bir, buf, sizeof(buf), &n)) == MB_BI_OK) {
+                SHA1_Update(&sha_ctx, buf, n);
+                digest.size += n;
+            }
+
+            if (ret != MB_BI_EOF) {
+                throw_exception(env, IOException,
+                                "%s: Failed to read data: %s", filename,
+                                mb_bi_reader_error_string(bir));
+                return -1;
+            }
+        } else {
+            throw_exception(env, IOException,
+                            "%s: Failed to read data: %s", filename,
+                            mb_bi_reader_error_string(bir));
+            return -1;
+        }
+
+        SHA1_Final(digest.sha1, &sha_ctx);
+        digests->entries.push_back(digest);
+    }
+
+    if (ret != MB_BI_EOF) {
+        throw_exception(env, IOException,
+                        "%s: Failed to read entry: %s",
+                        filename, mb_bi_reader_error_string(bir));
+        return -1;
+    }
+
+    if (digests->have_sb) {
+        std::lock_guard<std::mutex> lock(digest_cache_mutex);
+
+        if (digest_cache.size() >= DIGEST_CACHE_MAX_ENTRIES) {
+            digest_cache.clear();
+        }
+        digest_cache[filename] = *digests;
+    }
+
+    return 1;
+}
+
 JNIEXPORT jboolean JNICALL
 CLASS_METHOD(bootImagesEqual)(JNIEnv *env, jclass clazz, jstring jfilename1,
                               jstring jfilename2)
@@ -492,13 +1099,12 @@ CLASS_METHOD(bootImagesEqual)(JNIEnv *env, jclass clazz, jstring jfilename1,
     ScopedReader bir2(mb_bi_reader_new(), &mb_bi_reader_free);
     MbBiHeader *header1;
     MbBiHeader *header2;
-    MbBiEntry *entry1;
-    MbBiEntry *entry2;
-    size_t entries = 0;
     int ret;
     const char *filename1 = nullptr;
     const char *filename2 = nullptr;
     jboolean result = false;
+    ImageDigests digests1;
+    ImageDigests digests2;
 
     filename1 = env->GetStringUTFChars(jfilename1, nullptr);
     if (!filename1) {
@@ -509,6 +1115,16 @@ CLASS_METHOD(bootImagesEqual)(JNIEnv *env, jclass clazz, jstring jfilename1,
         goto done;
     }
 
+    // A file is always equal to itself
+    digests1.have_sb = stat(filename1, &digests1.sb) == 0;
+    digests2.have_sb = stat(filename2, &digests2.sb) == 0;
+    if (digests1.have_sb && digests2.have_sb
+            && digests1.sb.st_dev == digests2.sb.st_dev
+            && digests1.sb.st_ino == digests2.sb.st_ino) {
+        result = true;
+        goto done;
+    }
+
     if (!bir1 || !bir2) {
         throw_exception(env, IOException,
                         "Failed to allocate MbBiReader instances");
@@ -568,78 +1184,21 @@ CLASS_METHOD(bootImagesEqual)(JNIEnv *env, jclass clazz, jstring jfilename1,
         goto done;
     }
 
-    // Count entries in first boot image
+    // Compare entry digests. The saved boot image of a ROM rarely changes, so
+    // its digests usually come from the cache and only the other image has to
+    // be read.
     {
-        while ((ret = mb_bi_reader_read_entry(bir1.get(), &entry1))
-                == MB_BI_OK) {
-            ++entries;
-        }
-
-        if (ret != MB_BI_EOF) {
-            throw_exception(env, IOException,
-                            "%s: Failed to read entry: %s",
-                            filename1, mb_bi_reader_error_string(bir1.get()));
+        ret = getEntryDigests(env, bir1.get(), filename1, nullptr, &digests1);
+        if (ret <= 0) {
             goto done;
         }
-    }
-
-    // Compare each entry in second image to first
-    {
-        while ((ret = mb_bi_reader_read_entry(bir2.get(), &entry2))
-                == MB_BI_OK) {
-            if (entries == 0) {
-                // Too few entries in second image
-                goto done;
-            }
-            --entries;
-
-            // Find the same entry in first image
-            ret = mb_bi_reader_go_to_entry(bir1.get(), &entry1,
-                                           mb_bi_entry_type(entry2));
-            if (ret == MB_BI_EOF) {
-                // Cannot be equal if entry is missing
-                goto done;
-            } else if (ret != MB_BI_OK) {
-                throw_exception(env, IOException,
-                                "%s: Failed to seek to entry: %s", filename1,
-                                mb_bi_reader_error_string(bir1.get()));
-                goto done;
-            }
-
-            // Compare data
-            char buf1[10240];
-            char buf2[10240];
-            size_t n1;
-            size_t n2;
-
-            while ((ret = mb_bi_reader_read_data(
-                    bir1.get(), buf1, sizeof(buf1), &n1)) == MB_BI_OK) {
-                ret = mb_bi_reader_read_data(bir2.get(), buf2, n1, &n2);
-                if (ret != MB_BI_OK) {
-                    throw_exception(env, IOException,
-                                    "%s: Failed to read data: %s", filename2,
-                                    mb_bi_reader_error_string(bir2.get()));
-                    goto done;
-                }
-
-                if (n1 != n2 || memcmp(buf1, buf2, n1) != 0) {
-                    // Data is not equivalent
-                    goto done;
-                }
-            }
-
-            if (ret != MB_BI_EOF) {
-                throw_exception(env, IOException,
-                                "%s: Failed to read data: %s", filename1,
-                                mb_bi_reader_error_string(bir1.get()));
-                goto done;
-            }
+        ret = getEntryDigests(env, bir2.get(), filename2, &digests1,
+                              &digests2);
+        if (ret <= 0) {
+            goto done;
         }
 
-        if (ret != MB_BI_EOF) {
-            throw_exception(env, IOException,
-                            "%s: Failed to read entry: %s",
-                            filename2, mb_bi_reader_error_string(bir2.get()));
+        if (!entryDigestsEqual(digests1.entries, digests2.entries)) {
             goto done;
         }
     }
@@ -25,6 +25,7 @@ extern std::string tw_resource_path;
 extern std::string tw_settings_path;
 extern std::string tw_screenshots_path;
 extern std::string tw_theme_zip_path;
+extern std::string tw_image_cache_path;
 
 // TODO: Make TW_USE_KEY_CODE_TOUCH_SYNC an option
 
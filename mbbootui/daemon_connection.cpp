@@ -48,6 +48,7 @@
 // Singleton
 MbtoolConnection mbtool_connection;
 MbtoolInterface *mbtool_interface = nullptr;
+InstalledRomsFetcher installed_roms_fetcher;
 
 namespace v3 = mbtool::daemon::v3;
 namespace fb = flatbuffers;
@@ -271,6 +272,10 @@ private:
                       v3::ResponseType expected_type,
                       const void **result)
     {
+        // Requests may come from the UI thread, action threads, and the ROM
+        // list fetcher, but only one can be in flight on the socket
+        std::lock_guard<std::mutex> lock(_mutex);
+
         // Build request table
         v3::RequestBuilder rb(*builder);
         rb.add_request_type(request_type);
@@ -316,6 +321,7 @@ private:
     }
 
     int _fd;
+    std::mutex _mutex;
 };
 
 MbtoolConnection::MbtoolConnection() : _fd(-1), _iface(nullptr)
@@ -425,3 +431,66 @@ MbtoolInterface * MbtoolConnection::interface()
 {
     return _iface;
 }
+
+InstalledRomsFetcher::InstalledRomsFetcher() : _running(false), _generation(0)
+{
+}
+
+InstalledRomsFetcher::~InstalledRomsFetcher()
+{
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+void InstalledRomsFetcher::start(MbtoolInterface *iface, Callback callback)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (_running || !iface) {
+        return;
+    }
+
+    // The previous fetch has finished, so this won't block
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+
+    _running = true;
+    _thread = std::thread(&InstalledRomsFetcher::run, this, iface, callback);
+}
+
+bool InstalledRomsFetcher::get(std::vector<Rom> *result,
+                               unsigned int *generation)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (_generation == *generation) {
+        return false;
+    }
+
+    *result = _roms;
+    *generation = _generation;
+    return true;
+}
+
+void InstalledRomsFetcher::run(MbtoolInterface *iface, Callback callback)
+{
+    std::vector<Rom> roms;
+    if (!iface->get_installed_roms(&roms)) {
+        // Show an empty list rather than a placeholder that never goes away
+        LOGE("Failed to get list of installed ROMs");
+        roms.clear();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _roms.swap(roms);
+        ++_generation;
+        _running = false;
+    }
+
+    if (callback) {
+        callback();
+    }
+}
@@ -17,7 +17,10 @@
 
 #pragma once
 
+#include <functional>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <flatbuffers/flatbuffers.h>
@@ -78,5 +81,39 @@ private:
     MbtoolInterface *_iface;
 };
 
+// Fetches the list of installed ROMs on a background thread. mbtool has to
+// scan every ROM location (including external storage) to answer the request,
+// so the boot menu must not block on it.
+class InstalledRomsFetcher
+{
+public:
+    typedef std::function<void()> Callback;
+
+    InstalledRomsFetcher();
+    ~InstalledRomsFetcher();
+
+    // Start a new fetch unless one is already in progress. The callback is
+    // invoked on the fetcher thread once the list is available.
+    void start(MbtoolInterface *iface, Callback callback);
+
+    // Get the most recently fetched list if it is newer than *generation.
+    // Every completed fetch has a new generation and the first one is 1, so
+    // passing 0 returns any list that is available.
+    bool get(std::vector<Rom> *result, unsigned int *generation);
+
+    InstalledRomsFetcher(const InstalledRomsFetcher &) = delete;
+    InstalledRomsFetcher & operator=(const InstalledRomsFetcher &) = delete;
+
+private:
+    void run(MbtoolInterface *iface, Callback callback);
+
+    std::mutex _mutex;
+    std::thread _thread;
+    bool _running;
+    unsigned int _generation;
+    std::vector<Rom> _roms;
+};
+
 extern MbtoolConnection mbtool_connection;
 extern MbtoolInterface *mbtool_interface;
+extern InstalledRomsFetcher installed_roms_fetcher;
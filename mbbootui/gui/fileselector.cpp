@@ -20,15 +20,19 @@
 
 #include <algorithm>
 
+#include <cstdlib>
 #include <cstring>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #include "mblog/logging.h"
 
 #include "data.hpp"
 
+#include "gui/pages.hpp"
+
 int GUIFileSelector::mSortOrder = 0;
 
 GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
@@ -41,6 +45,12 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
     mUpdate = 0;
     mPathVar = "cwd";
     updateFileList = false;
+    mPendingResult = 0;
+    mListThreadRunning = false;
+    mListDone = false;
+    mListing.mtime = {};
+    mListing.hasStats = false;
+    pthread_mutex_init(&mListLock, nullptr);
 
     // Load filter for filtering files (e.g. *.zip for only zips)
     child = FindNode(node, "filter");
@@ -126,11 +136,15 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
     // Fetch the file/folder list
     std::string value;
     DataManager::GetValue(mPathVar, value);
-    GetFileList(value);
+    updateFileList = GetFileList(value) != 0;
 }
 
 GUIFileSelector::~GUIFileSelector()
 {
+    if (mListThreadRunning) {
+        pthread_join(mListThread, nullptr);
+    }
+    pthread_mutex_destroy(&mListLock);
 }
 
 int GUIFileSelector::Update()
@@ -192,7 +206,7 @@ int GUIFileSelector::NotifyVarChange(const std::string& varName,
     return 0;
 }
 
-bool GUIFileSelector::fileSort(FileData d1, FileData d2)
+bool GUIFileSelector::fileSort(const FileData& d1, const FileData& d2)
 {
     if (d1.fileName == ".") {
         return -1;
@@ -242,93 +256,202 @@ bool GUIFileSelector::fileSort(FileData d1, FileData d2)
     return 0;
 }
 
-int GUIFileSelector::GetFileList(const std::string& folder)
+static void fileTypeFromMode(mode_t mode, unsigned char* type)
+{
+    if (S_ISDIR(mode)) {
+        *type = DT_DIR;
+    } else if (S_ISBLK(mode)) {
+        *type = DT_BLK;
+    } else if (S_ISCHR(mode)) {
+        *type = DT_CHR;
+    } else if (S_ISFIFO(mode)) {
+        *type = DT_FIFO;
+    } else if (S_ISLNK(mode)) {
+        *type = DT_LNK;
+    } else if (S_ISREG(mode)) {
+        *type = DT_REG;
+    } else if (S_ISSOCK(mode)) {
+        *type = DT_SOCK;
+    }
+}
+
+// Runs on the listing thread. Entries are only stat()'ed when readdir()
+// doesn't report the file type or when the sort order needs the size or date,
+// which keeps large directories (eg. a backups folder on the SD card) cheap.
+int GUIFileSelector::ReadDirectory(DirListing& listing)
 {
     DIR* d;
     struct dirent* de;
     struct stat st;
 
-    // Clear all data
-    mFolderList.clear();
-    mFileList.clear();
+    listing.entries.clear();
 
-    d = opendir(folder.c_str());
+    d = opendir(listing.folder.c_str());
     if (d == nullptr) {
-        LOGI("Unable to open '%s'", folder.c_str());
-        if (folder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
-            size_t found;
-            found = folder.find_last_of('/');
-            if (found != std::string::npos) {
-                std::string new_folder = folder.substr(0, found);
-
-                if (new_folder.length() < 2) {
-                    new_folder = "/";
-                }
-                DataManager::SetValue(mPathVar, new_folder);
-            }
-        }
+        LOGI("Unable to open '%s'", listing.folder.c_str());
         return -1;
     }
 
+    if (fstat(dirfd(d), &st) == 0) {
+        listing.mtime = st.st_mtim;
+    } else {
+        listing.mtime = {};
+    }
+
     while ((de = readdir(d)) != nullptr) {
-        FileData data;
+        FileData data{};
 
         data.fileName = de->d_name;
         if (data.fileName == ".") {
             continue;
         }
-        if (data.fileName == ".." && folder == "/") {
+        if (data.fileName == ".." && listing.folder == "/") {
             continue;
         }
 
         data.fileType = de->d_type;
 
-        std::string path = folder + "/" + data.fileName;
-        stat(path.c_str(), &st);
-        data.protection = st.st_mode;
-        data.userId = st.st_uid;
-        data.groupId = st.st_gid;
-        data.fileSize = st.st_size;
-        data.lastAccess = st.st_atime;
-        data.lastModified = st.st_mtime;
-        data.lastStatChange = st.st_ctime;
-
-        if (data.fileType == DT_UNKNOWN) {
-            struct stat sb;
-            if (stat(path.c_str(), &sb) == 0) {
-                if (sb.st_mode & S_IFDIR) {
-                    data.fileType = DT_DIR;
-                } else if (sb.st_mode & S_IFBLK) {
-                    data.fileType = DT_BLK;
-                } else if (sb.st_mode & S_IFCHR) {
-                    data.fileType = DT_CHR;
-                } else if (sb.st_mode & S_IFIFO) {
-                    data.fileType = DT_FIFO;
-                } else if (sb.st_mode & S_IFLNK) {
-                    data.fileType = DT_LNK;
-                } else if (sb.st_mode & S_IFREG) {
-                    data.fileType = DT_REG;
-                } else if (sb.st_mode & S_IFSOCK) {
-                    data.fileType = DT_SOCK;
-                }
+        if ((listing.hasStats || data.fileType == DT_UNKNOWN)
+                && fstatat(dirfd(d), de->d_name, &st, 0) == 0) {
+            data.protection = st.st_mode;
+            data.userId = st.st_uid;
+            data.groupId = st.st_gid;
+            data.fileSize = st.st_size;
+            data.lastAccess = st.st_atime;
+            data.lastModified = st.st_mtime;
+            data.lastStatChange = st.st_ctime;
+
+            if (data.fileType == DT_UNKNOWN) {
+                fileTypeFromMode(st.st_mode, &data.fileType);
             }
         }
+
+        listing.entries.push_back(std::move(data));
+    }
+    closedir(d);
+
+    return 0;
+}
+
+void* GUIFileSelector::ListThread(void* cookie)
+{
+    GUIFileSelector* fs = static_cast<GUIFileSelector*>(cookie);
+
+    int ret = ReadDirectory(fs->mPendingListing);
+
+    pthread_mutex_lock(&fs->mListLock);
+    fs->mPendingResult = ret;
+    fs->mListDone = true;
+    pthread_mutex_unlock(&fs->mListLock);
+
+    // Wake up the main loop so Update() picks up the new list
+    gui_forceRender();
+    return nullptr;
+}
+
+// Filter and sort the cached listing into the folder and file lists
+void GUIFileSelector::ApplyListing()
+{
+    mFolderList.clear();
+    mFileList.clear();
+
+    for (const FileData& data : mListing.entries) {
         if (data.fileType == DT_DIR) {
             if (mShowNavFolders || (data.fileName != "." && data.fileName != "..")) {
                 mFolderList.push_back(data);
             }
         } else if (data.fileType == DT_REG || data.fileType == DT_LNK || data.fileType == DT_BLK) {
-            if (mExtn.empty() || (data.fileName.length() > mExtn.length() && data.fileName.substr(data.fileName.length() - mExtn.length()) == mExtn)) {
+            if (mExtn.empty() || (data.fileName.length() > mExtn.length() && data.fileName.compare(data.fileName.length() - mExtn.length(), mExtn.length(), mExtn) == 0)) {
                 mFileList.push_back(data);
             }
         }
     }
-    closedir(d);
 
     std::sort(mFolderList.begin(), mFolderList.end(), fileSort);
     std::sort(mFileList.begin(), mFileList.end(), fileSort);
+}
 
-    return 0;
+// Take ownership of the result of the listing thread. Returns -1 if reading
+// folder failed, in which case we move up to the parent directory.
+int GUIFileSelector::FinishListing(const std::string& folder)
+{
+    if (mPendingResult == 0) {
+        std::swap(mListing, mPendingListing);
+        return 0;
+    }
+
+    mListing.folder.clear();
+    mListing.entries.clear();
+
+    if (mPendingListing.folder != folder) {
+        // Stale result for a folder we've already navigated away from
+        return 0;
+    }
+
+    if (folder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
+        size_t found;
+        found = folder.find_last_of('/');
+        if (found != std::string::npos) {
+            std::string new_folder = folder.substr(0, found);
+
+            if (new_folder.length() < 2) {
+                new_folder = "/";
+            }
+            DataManager::SetValue(mPathVar, new_folder);
+        }
+    }
+    return -1;
+}
+
+int GUIFileSelector::GetFileList(const std::string& folder)
+{
+    bool needStats = std::abs(mSortOrder) == 2 || std::abs(mSortOrder) == 3;
+    struct stat sb;
+
+    if (mListThreadRunning) {
+        pthread_mutex_lock(&mListLock);
+        bool done = mListDone;
+        pthread_mutex_unlock(&mListLock);
+        if (!done) {
+            return 1;
+        }
+
+        pthread_join(mListThread, nullptr);
+        mListThreadRunning = false;
+
+        if (FinishListing(folder) < 0) {
+            return -1;
+        }
+    }
+
+    // Reuse the previous listing if the directory hasn't changed since it was
+    // read, so refocusing the page or changing the sort order doesn't hit the
+    // filesystem again
+    if (mListing.folder == folder && (!needStats || mListing.hasStats)
+            && stat(folder.c_str(), &sb) == 0
+            && sb.st_mtim.tv_sec == mListing.mtime.tv_sec
+            && sb.st_mtim.tv_nsec == mListing.mtime.tv_nsec) {
+        ApplyListing();
+        return 0;
+    }
+
+    mPendingListing.folder = folder;
+    mPendingListing.hasStats = needStats;
+    mListDone = false;
+
+    if (pthread_create(&mListThread, nullptr, &ListThread, this) != 0) {
+        LOGW("Failed to create listing thread; reading '%s' synchronously",
+             folder.c_str());
+        mPendingResult = ReadDirectory(mPendingListing);
+        if (FinishListing(folder) < 0) {
+            return -1;
+        }
+        ApplyListing();
+        return 0;
+    }
+    mListThreadRunning = true;
+
+    return 1;
 }
 
 void GUIFileSelector::SetPageFocus(int inFocus)
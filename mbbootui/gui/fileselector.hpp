@@ -18,6 +18,9 @@
 
 #pragma once
 
+#include <pthread.h>
+#include <time.h>
+
 #include "gui/scrolllist.hpp"
 
 class GUIFileSelector : public GUIScrollList
@@ -54,9 +57,22 @@ protected:
         time_t lastStatChange;  // Uses time_t format from stat
     };
 
+    // Unfiltered contents of a directory, as read by the listing thread
+    struct DirListing {
+        std::string folder;
+        struct timespec mtime;  // mtime of the directory when it was read
+        bool hasStats;          // entries have stat() data (only needed for sorting by size or date)
+        std::vector<FileData> entries;
+    };
+
 protected:
+    // GetFileList - Returns 0 when the list for folder is ready, 1 while it is being read, and -1 on error
     virtual int GetFileList(const std::string& folder);
-    static bool fileSort(FileData d1, FileData d2);
+    int FinishListing(const std::string& folder);
+    void ApplyListing();
+    static int ReadDirectory(DirListing& listing);
+    static void* ListThread(void* cookie);
+    static bool fileSort(const FileData& d1, const FileData& d2);
 
 protected:
     std::vector<FileData> mFolderList;
@@ -73,4 +89,12 @@ protected:
     ImageResource* mFolderIcon;
     ImageResource* mFileIcon;
     bool updateFileList;
+
+    DirListing mListing; // last completed listing, reused while the directory is unchanged
+    DirListing mPendingListing; // owned by the listing thread while it is running
+    int mPendingResult;
+    pthread_t mListThread;
+    pthread_mutex_t mListLock;
+    bool mListThreadRunning;
+    bool mListDone; // protected by mListLock
 };
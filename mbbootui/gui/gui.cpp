@@ -18,9 +18,18 @@
 
 #include "gui/gui.h"
 
+#include <algorithm>
 #include <atomic>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
 
 #include <linux/input.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "mblog/logging.h"
@@ -37,6 +46,7 @@
 
 #include "gui/blanktimer.hpp"
 #include "gui/hardwarekeyboard.hpp"
+#include "gui/imagecache.hpp"
 #include "gui/mousecursor.hpp"
 #include "gui/objects.hpp"
 #include "gui/pages.hpp"
@@ -114,6 +124,17 @@ public:
     // process input events. returns true if any event was received.
     bool processInput(int timeout_ms);
 
+    // Number of events received so far and the evdev timestamp
+    // (CLOCK_MONOTONIC) of the last one
+    unsigned eventCount() const
+    {
+        return event_count;
+    }
+    const timespec & lastEventTime() const
+    {
+        return last_event_time;
+    }
+
     void handleDrag();
 
 private:
@@ -147,6 +168,8 @@ private:
     action_state_enum state;
     int x, y; // x and y coordinates of last touch
     struct timespec touchStart; // used to track time for long press / key repeat
+    unsigned event_count = 0;
+    struct timespec last_event_time;
 
     void processHoldAndRepeat();
     void process_EV_REL(input_event& ev);
@@ -174,6 +197,10 @@ bool InputHandler::processInput(int timeout_ms)
         return (ret != -2);  // -2 means no more events in the queue
     }
 
+    ++event_count;
+    last_event_time.tv_sec = ev.time.tv_sec;
+    last_event_time.tv_nsec = ev.time.tv_usec * 1000;
+
     switch (ev.type) {
     case EV_ABS:
         process_EV_ABS(ev);
@@ -359,48 +386,258 @@ void InputHandler::handleDrag()
     }
 }
 
-// Get and dispatch input events until it's time to draw the next frame
-// This special function will return immediately the first time, but then
-// always returns 1/30th of a second (or immediately if called later) from
-// the last time it was called
-static void loopTimer(int input_timeout_ms)
+#define FRAME_INTERVAL_NS       33333333    // 30 fps
+#define IDLE_INTERVAL_NS        1000000000  // Periodic update when idle
+#define FRAME_STATS_INTERVAL_S  30
+#define MAX_EVENTS              16
+
+// Central event loop for the UI thread. Input devices, the terminal pty, a
+// frame timer and a wakeup eventfd (for other threads) are all watched by a
+// single epoll instance, so the thread sleeps until there is actual work.
+class EventLoop
 {
-    static timespec lastCall;
-    static int initialized = 0;
+public:
+    bool init()
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epfd < 0 || timer_fd < 0 || wake_fd < 0) {
+            LOGE("Failed to create event loop fds: %s", strerror(errno));
+            return false;
+        }
 
-    if (!initialized) {
-        clock_gettime(CLOCK_MONOTONIC, &lastCall);
-        initialized = 1;
-        return;
+        if (!add_fd(timer_fd) || !add_fd(wake_fd)) {
+            return false;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &last_frame);
+        return true;
     }
 
-    do {
-        bool got_event = input_handler.processInput(input_timeout_ms); // get inputs but don't send drag notices
-        timespec curTime, diff;
-        clock_gettime(CLOCK_MONOTONIC, &curTime);
+    // Thread-safe. Makes the current or next call to waitForFrame() return
+    // without waiting for the frame timer.
+    void wake()
+    {
+        if (wake_fd >= 0) {
+            uint64_t value = 1;
+            write(wake_fd, &value, sizeof(value));
+        }
+    }
 
-        mb::util::timespec_diff(lastCall, curTime, &diff);
+    // Get and dispatch input events until it's time to draw the next frame.
+    // The next frame is due 1/30th of a second after the previous one. When
+    // idle, it is due a second after the previous one or as soon as any
+    // event arrives.
+    void waitForFrame(bool idle);
 
-        // This is really 2 or 30 times per second
-        // As long as we get events, increase the timeout so we can catch up with input
-        long timeout = got_event ? 500000000 : 33333333;
+    // Time of the first input event dispatched by the last waitForFrame()
+    // call or nullptr if there was none
+    const timespec * inputTime() const
+    {
+        return has_input ? &input_time : nullptr;
+    }
 
-        if (diff.tv_sec || diff.tv_nsec > timeout) {
-            // int64_t input_time = mb::util::timespec_diff_ms(lastCall, curTime);
-            // LOGI("loopTimer(): %" PRId64 " ms, count: %u", input_time, count);
+private:
+    int epfd = -1;
+    int timer_fd = -1;
+    int wake_fd = -1;
+    int pty_fd = -1;
+    std::vector<int> input_fds;
+    unsigned input_generation = 0;
+    timespec last_frame;
+    timespec input_time;
+    bool has_input = false;
+
+    bool add_fd(int fd)
+    {
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            LOGE("Failed to add fd %d to event loop: %s", fd, strerror(errno));
+            return false;
+        }
+        return true;
+    }
 
-            lastCall = curTime;
-            input_handler.handleDrag(); // send only drag notices if needed
-            return;
+    void syncFds();
+    bool dispatchInput();
+};
+
+static EventLoop event_loop;
+
+void EventLoop::syncFds()
+{
+    // The terminal opens its pty lazily
+    if (g_pty_fd != pty_fd) {
+        if (pty_fd > 0) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, pty_fd, nullptr);
+        }
+        pty_fd = g_pty_fd;
+        if (pty_fd > 0 && !add_fd(pty_fd)) {
+            pty_fd = -1;
+        }
+    }
+
+    if (input_generation != ev_generation()) {
+        // The old fds were already closed, which removes them from the epoll
+        // set automatically
+        int fds[32];
+        unsigned count = ev_get_fds(fds, sizeof(fds) / sizeof(fds[0]));
+
+        input_fds.clear();
+        for (unsigned i = 0; i < count; ++i) {
+            if (add_fd(fds[i])) {
+                input_fds.push_back(fds[i]);
+            }
+        }
+        input_generation = ev_generation();
+    }
+}
+
+// Dispatch all queued input events. This also handles touch/key hold and
+// repeat and input device reloading. Returns true if any event was received.
+bool EventLoop::dispatchInput()
+{
+    bool got_event = false;
+    unsigned count = input_handler.eventCount();
+
+    while (input_handler.processInput(0)) {
+        // Latency is measured from when the kernel saw the first event
+        if (!has_input && input_handler.eventCount() != count) {
+            has_input = true;
+            input_time = input_handler.lastEventTime();
+        }
+        got_event = true;
+    }
+
+    syncFds();
+    return got_event;
+}
+
+void EventLoop::waitForFrame(bool idle)
+{
+    long interval = idle ? IDLE_INTERVAL_NS : FRAME_INTERVAL_NS;
+
+    itimerspec deadline = {};
+    deadline.it_value.tv_sec = last_frame.tv_sec + interval / 1000000000;
+    deadline.it_value.tv_nsec = last_frame.tv_nsec + interval % 1000000000;
+    if (deadline.it_value.tv_nsec >= 1000000000) {
+        ++deadline.it_value.tv_sec;
+        deadline.it_value.tv_nsec -= 1000000000;
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &deadline, nullptr);
+
+    has_input = false;
+    syncFds();
+
+    bool done = false;
+    while (!done) {
+        epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("epoll_wait() failed: %s", strerror(errno));
+            break;
+        }
+
+        bool input_ready = false;
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            uint64_t value;
+
+            if (fd == timer_fd) {
+                read(timer_fd, &value, sizeof(value));
+                // Also polls hold/repeat and device reloads below
+                input_ready = true;
+                done = true;
+            } else if (fd == wake_fd) {
+                read(wake_fd, &value, sizeof(value));
+                done = true;
+            } else if (fd == pty_fd) {
+                terminal_pty_read();
+                // Terminal output needs to be drawn
+                done = done || idle;
+            } else {
+                input_ready = true;
+            }
         }
 
-        // We need to sleep some period time microseconds
-        //unsigned int sleepTime = 33333 -(diff.tv_nsec / 1000);
-        //usleep(sleepTime); // removed so we can scan for input
-        input_timeout_ms = 0;
-    } while (1);
+        if (input_ready && dispatchInput() && idle) {
+            done = true;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &last_frame);
+    input_handler.handleDrag(); // send only drag notices if needed
 }
 
+// Built-in frame time counters. Periodically logs the average and worst-case
+// render + flip time and the latency from the first input event of a frame to
+// that frame being flipped to the screen.
+class FrameStats
+{
+public:
+    FrameStats()
+    {
+        clock_gettime(CLOCK_MONOTONIC, &last_report);
+    }
+
+    void add(const timespec &start, const timespec &end, const timespec *input)
+    {
+        int64_t frame_us = mb::util::timespec_diff_us(start, end);
+        ++frames;
+        frame_total_us += frame_us;
+        frame_max_us = std::max(frame_max_us, frame_us);
+
+        if (input) {
+            int64_t input_us = mb::util::timespec_diff_us(*input, end);
+            ++input_frames;
+            input_total_us += input_us;
+            input_max_us = std::max(input_max_us, input_us);
+        }
+
+#ifdef PRINT_RENDER_TIME
+        LOGI("Render() + flip(): %" PRId64 " us", frame_us);
+#endif
+
+        if (mb::util::timespec_diff_s(last_report, end)
+                >= FRAME_STATS_INTERVAL_S) {
+            report();
+            last_report = end;
+        }
+    }
+
+private:
+    void report()
+    {
+        LOGD("Frames: %" PRIu64 ", frame time: "
+             "%" PRId64 " us avg, %" PRId64 " us max",
+             frames, frame_total_us / frames, frame_max_us);
+        if (input_frames > 0) {
+            LOGD("Input frames: %" PRIu64 ", input to flip latency: "
+                 "%" PRId64 " us avg, %" PRId64 " us max",
+                 input_frames, input_total_us / input_frames, input_max_us);
+        }
+
+        frames = input_frames = 0;
+        frame_total_us = frame_max_us = 0;
+        input_total_us = input_max_us = 0;
+    }
+
+    timespec last_report;
+    uint64_t frames = 0;
+    int64_t frame_total_us = 0;
+    int64_t frame_max_us = 0;
+    uint64_t input_frames = 0;
+    int64_t input_total_us = 0;
+    int64_t input_max_us = 0;
+};
+
 static int runPages(const char *page_name, const int stop_on_page_done)
 {
     DataManager::SetValue(VAR_TW_PAGE_DONE, 0);
@@ -415,26 +652,15 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 
     DataManager::SetValue(VAR_TW_LOADED, 1);
 
-    struct timeval timeout;
-    fd_set fdset;
-    int has_data = 0;
-
-    int input_timeout_ms = 0;
     int idle_frames = 0;
+    FrameStats stats;
 
     for (;;) {
-        loopTimer(input_timeout_ms);
-        if (g_pty_fd > 0) {
-            // TODO: this is not nice, we should have one central select for input, pty
-            FD_ZERO(&fdset);
-            FD_SET(g_pty_fd, &fdset);
-            timeout.tv_sec = 0;
-            timeout.tv_usec = 1;
-            has_data = select(g_pty_fd + 1, &fdset, nullptr, nullptr, &timeout);
-            if (has_data > 0) {
-                terminal_pty_read();
-            }
-        }
+        // Due to possible animation objects, we need to delay going idle
+        event_loop.waitForFrame(idle_frames > 15);
+
+        timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
 
         if (!gForceRender) {
             int ret = PageManager::Update();
@@ -445,41 +671,23 @@ static int runPages(const char *page_name, const int stop_on_page_done)
             } else {
                 idle_frames = 0;
             }
-            // due to possible animation objects, we need to delay activating the input timeout
-            input_timeout_ms = idle_frames > 15 ? 1000 : 0;
 
-#ifndef PRINT_RENDER_TIME
             if (ret > 1) {
-                PageManager::Render();
+                PageManager::RenderDamage();
             }
 
             if (ret > 0) {
                 flip();
-            }
-#else
-            if (ret > 1) {
-                timespec start, end;
-                int64_t render_t, flip_t;
-                clock_gettime(CLOCK_MONOTONIC, &start);
-                PageManager::Render();
                 clock_gettime(CLOCK_MONOTONIC, &end);
-                render_t = mb::util::timespec_diff_ms(start, end);
-
-                flip();
-                clock_gettime(CLOCK_MONOTONIC, &start);
-                flip_t = mb::util::timespec_diff_ms(end, start);
-
-                LOGI("Render(): %" PRId64 " ms, flip(): %" PRId64 " ms, total: %" PRId64 " ms",
-                     render_t, flip_t, render_t + flip_t);
-            } else if (ret > 0) {
-                flip();
+                stats.add(start, end, event_loop.inputTime());
             }
-#endif
         } else {
             gForceRender = 0;
             PageManager::Render();
             flip();
-            input_timeout_ms = 0;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            stats.add(start, end, event_loop.inputTime());
+            idle_frames = 0;
         }
 
         blankTimer.checkForTimeout();
@@ -498,6 +706,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 int gui_forceRender()
 {
     gForceRender = 1;
+    event_loop.wake();
     return 0;
 }
 
@@ -506,6 +715,7 @@ int gui_changePage(std::string newPage)
     LOGI("Set page: '%s'", newPage.c_str());
     PageManager::ChangePage(newPage);
     gForceRender = 1;
+    event_loop.wake();
     return 0;
 }
 
@@ -514,6 +724,7 @@ int gui_changeOverlay(std::string overlay)
     LOGI("Set overlay: '%s'", overlay.c_str());
     PageManager::ChangeOverlay(overlay);
     gForceRender = 1;
+    event_loop.wake();
     return 0;
 }
 
@@ -605,6 +816,9 @@ extern "C" int gui_init()
     }
 
     ev_init();
+    if (!event_loop.init()) {
+        return -1;
+    }
     return 0;
 }
 
@@ -637,6 +851,9 @@ extern "C" int gui_loadResources()
     // Set the default package
     PageManager::SelectPackage("TWRP");
 
+    // Decoded and scaled images are reused on the next boot
+    ImageCache::Save();
+
     gGuiInitialized = 1;
     return 0;
 
@@ -662,6 +879,7 @@ extern "C" int gui_loadCustomResources()
     }
     // Set the default package
     PageManager::SelectPackage("TWRP");
+    ImageCache::Save();
 #endif
     return 0;
 
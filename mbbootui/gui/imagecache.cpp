@@ -0,0 +1,415 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gui/imagecache.hpp"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pixelflinger/pixelflinger.h>
+
+#include "mblog/logging.h"
+#include "mbutil/directory.h"
+
+#include "minzip/Zip.h"
+
+#include "config/config.hpp"
+
+#define CACHE_MAGIC             "MBUIIMG"
+#define CACHE_VERSION           1
+#define CACHE_DATA_ALIGNMENT    64
+
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t fb_width;
+    uint32_t fb_height;
+    uint32_t pixel_format;
+    uint32_t entry_count;
+    uint32_t reserved;
+    uint64_t index_offset;
+    uint64_t index_size;
+};
+
+// Followed by key_size bytes of key in the index
+struct CacheEntryHeader
+{
+    uint64_t source_size;
+    uint64_t source_id;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint32_t key_size;
+    uint32_t reserved;
+};
+
+struct CacheEntry
+{
+    uint64_t source_size;
+    uint64_t source_id;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;
+    const unsigned char *data;
+    size_t data_size;
+    // Pixel data of images added during this boot
+    std::vector<unsigned char> owned;
+};
+
+static bool g_loaded = false;
+// Entries read from the cache file. The mapping is never unmapped because
+// cached surfaces point into it.
+static std::unordered_map<std::string, CacheEntry> g_entries;
+// Keys of entries that were used or added during this boot
+static std::unordered_set<std::string> g_used;
+static bool g_dirty = false;
+
+static bool is_cacheable_format(uint32_t format)
+{
+    return format == GGL_PIXEL_FORMAT_RGBA_8888
+            || format == GGL_PIXEL_FORMAT_RGBX_8888
+            || format == GGL_PIXEL_FORMAT_BGRA_8888;
+}
+
+// Find the file that LoadImage() would decode and identify its contents
+static bool get_source(ZipArchive* pZip, const std::string& file,
+                       float scale_w, float scale_h, std::string* key,
+                       uint64_t* size, uint64_t* id)
+{
+    std::string source;
+
+    if (pZip) {
+        for (auto const &ext : { ".png", "" }) {
+            std::string name = "images/" + file + ext;
+            const ZipEntry* entry = mzFindZipEntry(pZip, name.c_str());
+            if (entry) {
+                source = "zip:" + name;
+                *size = static_cast<uint64_t>(entry->uncompLen);
+                *id = static_cast<uint32_t>(entry->crc32);
+                break;
+            }
+        }
+    } else {
+        std::string images = tw_resource_path + "/images/";
+        for (auto const &path : { images + file + ".png", file,
+                                  images + file }) {
+            struct stat sb;
+            if (stat(path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
+                source = path;
+                *size = static_cast<uint64_t>(sb.st_size);
+                *id = static_cast<uint64_t>(sb.st_mtim.tv_sec) * 1000000000
+                        + static_cast<uint64_t>(sb.st_mtim.tv_nsec);
+                break;
+            }
+        }
+    }
+
+    if (source.empty()) {
+        return false;
+    }
+
+    char scale[32];
+    uint32_t sw, sh;
+    memcpy(&sw, &scale_w, sizeof(sw));
+    memcpy(&sh, &scale_h, sizeof(sh));
+    snprintf(scale, sizeof(scale), "@%08" PRIx32 ",%08" PRIx32, sw, sh);
+
+    *key = source + scale;
+    return true;
+}
+
+static bool load_cache()
+{
+    int fd = open(tw_image_cache_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            LOGW("%s: Failed to open: %s", tw_image_cache_path.c_str(), strerror(errno));
+        }
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0
+            || static_cast<size_t>(sb.st_size) < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    size_t size = static_cast<size_t>(sb.st_size);
+
+    // Private writable mapping so the surfaces behave like malloc'd ones
+    void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOGW("%s: Failed to mmap: %s", tw_image_cache_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto base = static_cast<const unsigned char*>(map);
+    CacheHeader header;
+    memcpy(&header, base, sizeof(header));
+
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0
+            || header.version != CACHE_VERSION
+            || header.fb_width != static_cast<uint32_t>(gr_fb_width())
+            || header.fb_height != static_cast<uint32_t>(gr_fb_height())
+            || header.pixel_format
+                    != static_cast<uint32_t>(tw_device.tw_pixel_format())
+            || header.index_offset > size
+            || header.index_size > size - header.index_offset) {
+        LOGI("%s: Discarding stale image cache", tw_image_cache_path.c_str());
+        munmap(map, size);
+        return false;
+    }
+
+    const unsigned char* ptr = base + header.index_offset;
+    const unsigned char* end = ptr + header.index_size;
+
+    for (uint32_t i = 0; i < header.entry_count; ++i) {
+        CacheEntryHeader eh;
+        if (static_cast<size_t>(end - ptr) < sizeof(eh)) {
+            break;
+        }
+        memcpy(&eh, ptr, sizeof(eh));
+        ptr += sizeof(eh);
+
+        if (static_cast<size_t>(end - ptr) < eh.key_size
+                || eh.data_offset > size
+                || eh.data_size > size - eh.data_offset
+                || eh.data_size < static_cast<uint64_t>(eh.stride)
+                        * eh.height * 4
+                || eh.stride < eh.width
+                || !is_cacheable_format(eh.format)) {
+            LOGW("%s: Corrupted image cache index", tw_image_cache_path.c_str());
+            break;
+        }
+
+        std::string key(reinterpret_cast<const char*>(ptr), eh.key_size);
+        ptr += eh.key_size;
+
+        CacheEntry& entry = g_entries[key];
+        entry.source_size = eh.source_size;
+        entry.source_id = eh.source_id;
+        entry.width = eh.width;
+        entry.height = eh.height;
+        entry.stride = eh.stride;
+        entry.format = eh.format;
+        entry.data = base + eh.data_offset;
+        entry.data_size = static_cast<size_t>(eh.data_size);
+    }
+
+    LOGV("%s: Loaded %zu cached images", tw_image_cache_path.c_str(), g_entries.size());
+    return true;
+}
+
+gr_surface ImageCache::Find(ZipArchive* pZip, const std::string& file,
+                            float scale_w, float scale_h)
+{
+    if (tw_image_cache_path.empty()) {
+        return nullptr;
+    }
+
+    if (!g_loaded) {
+        load_cache();
+        g_loaded = true;
+    }
+
+    std::string key;
+    uint64_t size, id;
+    if (!get_source(pZip, file, scale_w, scale_h, &key, &size, &id)) {
+        return nullptr;
+    }
+
+    auto it = g_entries.find(key);
+    if (it == g_entries.end() || it->second.source_size != size
+            || it->second.source_id != id) {
+        return nullptr;
+    }
+
+    const CacheEntry& entry = it->second;
+
+    GGLSurface* surface = static_cast<GGLSurface*>(malloc(sizeof(GGLSurface)));
+    if (!surface) {
+        return nullptr;
+    }
+    memset(surface, 0, sizeof(GGLSurface));
+    surface->version = sizeof(GGLSurface);
+    surface->width = entry.width;
+    surface->height = entry.height;
+    surface->stride = entry.stride;
+    surface->data = const_cast<GGLubyte*>(entry.data);
+    surface->format = entry.format;
+
+    g_used.insert(key);
+    return reinterpret_cast<gr_surface>(surface);
+}
+
+void ImageCache::Add(ZipArchive* pZip, const std::string& file,
+                     float scale_w, float scale_h, gr_surface surface)
+{
+    GGLSurface* s = reinterpret_cast<GGLSurface*>(surface);
+
+    if (tw_image_cache_path.empty() || !s || !is_cacheable_format(s->format)) {
+        return;
+    }
+
+    std::string key;
+    uint64_t size, id;
+    if (!get_source(pZip, file, scale_w, scale_h, &key, &size, &id)) {
+        return;
+    }
+
+    size_t data_size = static_cast<size_t>(s->stride) * s->height * 4;
+
+    CacheEntry& entry = g_entries[key];
+    entry.source_size = size;
+    entry.source_id = id;
+    entry.width = s->width;
+    entry.height = s->height;
+    entry.stride = s->stride;
+    entry.format = s->format;
+    entry.owned.assign(s->data, s->data + data_size);
+    entry.data = entry.owned.data();
+    entry.data_size = data_size;
+
+    g_used.insert(key);
+    g_dirty = true;
+}
+
+static bool write_padding(FILE* fp, uint64_t* offset)
+{
+    static const char zeros[CACHE_DATA_ALIGNMENT] = {};
+    size_t n = (CACHE_DATA_ALIGNMENT - *offset % CACHE_DATA_ALIGNMENT)
+            % CACHE_DATA_ALIGNMENT;
+    *offset += n;
+    return fwrite(zeros, 1, n, fp) == n;
+}
+
+bool ImageCache::Save()
+{
+    if (tw_image_cache_path.empty() || !g_dirty) {
+        return true;
+    }
+
+    std::string temp_path = tw_image_cache_path + ".tmp";
+
+    if (!mb::util::mkdir_parent(tw_image_cache_path, 0700)) {
+        LOGW("%s: Failed to create parent directory: %s",
+             tw_image_cache_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    FILE* fp = fopen(temp_path.c_str(), "wbe");
+    if (!fp) {
+        LOGW("%s: Failed to open for writing: %s",
+             temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    CacheHeader header = {};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.fb_width = static_cast<uint32_t>(gr_fb_width());
+    header.fb_height = static_cast<uint32_t>(gr_fb_height());
+    header.pixel_format = static_cast<uint32_t>(tw_device.tw_pixel_format());
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    uint64_t offset = sizeof(header);
+    std::vector<unsigned char> index;
+
+    // Only keep images used during this boot so stale entries age out
+    for (auto it = g_used.begin(); ok && it != g_used.end(); ++it) {
+        const CacheEntry& entry = g_entries[*it];
+
+        ok = write_padding(fp, &offset)
+                && fwrite(entry.data, 1, entry.data_size, fp)
+                        == entry.data_size;
+
+        CacheEntryHeader eh = {};
+        eh.source_size = entry.source_size;
+        eh.source_id = entry.source_id;
+        eh.width = entry.width;
+        eh.height = entry.height;
+        eh.stride = entry.stride;
+        eh.format = entry.format;
+        eh.data_offset = offset;
+        eh.data_size = entry.data_size;
+        eh.key_size = static_cast<uint32_t>(it->size());
+
+        auto eh_ptr = reinterpret_cast<const unsigned char*>(&eh);
+        index.insert(index.end(), eh_ptr, eh_ptr + sizeof(eh));
+        index.insert(index.end(), it->begin(), it->end());
+
+        offset += entry.data_size;
+        ++header.entry_count;
+    }
+
+    header.index_offset = offset;
+    header.index_size = index.size();
+
+    ok = ok
+            && fwrite(index.data(), 1, index.size(), fp) == index.size()
+            && fseek(fp, 0, SEEK_SET) == 0
+            && fwrite(&header, sizeof(header), 1, fp) == 1
+            && fflush(fp) == 0
+            && fsync(fileno(fp)) == 0;
+
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+
+    if (!ok || rename(temp_path.c_str(), tw_image_cache_path.c_str()) < 0) {
+        LOGW("%s: Failed to write image cache: %s",
+             tw_image_cache_path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    // The copies of newly added images are only needed for writing the file.
+    // They'll be available from the mapping on the next boot.
+    for (auto it = g_entries.begin(); it != g_entries.end();) {
+        if (!it->second.owned.empty()) {
+            g_used.erase(it->first);
+            it = g_entries.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    LOGV("%s: Wrote %" PRIu32 " cached images", tw_image_cache_path.c_str(),
+         header.entry_count);
+    g_dirty = false;
+    return true;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include "minuitwrp/minui.h"
+
+struct ZipArchive;
+
+// Persistent cache of theme images that have already been decoded, converted
+// to the framebuffer pixel format and scaled to the screen resolution.
+//
+// The cache file is mmap()'d and cached surfaces point directly into the
+// mapping, so a cache hit costs a stat() instead of a PNG decode and rescale.
+// Entries are validated against the source file's size and mtime (or the zip
+// entry's size and CRC) and the whole cache is discarded if the framebuffer
+// size or pixel format changes. The cache is stored at tw_image_cache_path and
+// is disabled if the path is empty.
+class ImageCache
+{
+public:
+    // Look up the scaled surface for an image. Returns nullptr on a miss.
+    static gr_surface Find(ZipArchive* pZip, const std::string& file,
+                           float scale_w, float scale_h);
+
+    // Record a newly loaded and scaled surface. The pixel data is copied.
+    static void Add(ZipArchive* pZip, const std::string& file,
+                    float scale_w, float scale_h, gr_surface surface);
+
+    // Write the cache file if any images were added since it was loaded
+    static bool Save();
+};
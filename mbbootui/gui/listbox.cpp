@@ -22,6 +22,8 @@
 #include "data.hpp"
 #include "variables.h"
 
+#include "gui/pages.hpp"
+
 GUIListBox::GUIListBox(xml_node<>* node) : GUIScrollList(node)
 {
     xml_attribute<>* attr;
@@ -29,6 +31,8 @@ GUIListBox::GUIListBox(xml_node<>* node) : GUIScrollList(node)
     mIconSelected = mIconUnselected = nullptr;
     mUpdate = 0;
     isCheckList = isTextParsed = false;
+    isRomListLoading = false;
+    mRomListGeneration = 0;
 
     // Get the icons, if any
     child = FindNode(node, "icon");
@@ -126,6 +130,11 @@ int GUIListBox::Update()
 
     GUIScrollList::Update();
 
+    if (mVariable == VAR_TW_ROM_ID && UpdateRomList()) {
+        NotifyVarChange(mVariable, currentValue);
+        mUpdate = 1;
+    }
+
     if (mUpdate) {
         mUpdate = 0;
         if (Render() == 0) {
@@ -201,20 +210,10 @@ void GUIListBox::SetPageFocus(int inFocus)
         }
 
         if (mVariable == VAR_TW_ROM_ID) {
-            mListItems.clear();
-
-            std::vector<Rom> roms;
-            mbtool_interface->get_installed_roms(&roms);
-
-            for (Rom rom : roms) {
-                ListItem data;
-                // TODO: Read name from config file
-                data.displayName = rom.id;
-                data.variableValue = rom.id;
-                data.action = nullptr;
-                data.selected = (currentValue == rom.id);
-                mListItems.push_back(std::move(data));
-            }
+            // Show the last known list (or a placeholder) immediately and
+            // refresh it in the background. Update() picks up the new list.
+            installed_roms_fetcher.start(mbtool_interface, gui_forceRender);
+            UpdateRomList();
         }
 
         DataManager::GetValue(mVariable, currentValue);
@@ -222,6 +221,41 @@ void GUIListBox::SetPageFocus(int inFocus)
     }
 }
 
+// Returns true if mListItems changed
+bool GUIListBox::UpdateRomList()
+{
+    std::vector<Rom> roms;
+
+    if (!installed_roms_fetcher.get(&roms, &mRomListGeneration)) {
+        if (mRomListGeneration == 0 && !isRomListLoading) {
+            isRomListLoading = true;
+            mListItems.clear();
+
+            ListItem data;
+            data.displayName = gui_lookup("switch_rom_list_loading", "Loading ROMs...");
+            data.action = nullptr;
+            data.selected = 0;
+            mListItems.push_back(std::move(data));
+            return true;
+        }
+        return false;
+    }
+
+    isRomListLoading = false;
+    mListItems.clear();
+
+    for (const Rom& rom : roms) {
+        ListItem data;
+        // TODO: Read name from config file
+        data.displayName = rom.id;
+        data.variableValue = rom.id;
+        data.action = nullptr;
+        data.selected = (currentValue == rom.id);
+        mListItems.push_back(std::move(data));
+    }
+    return true;
+}
+
 size_t GUIListBox::GetItemCount()
 {
     return mVisibleItems.size();
@@ -240,6 +274,11 @@ void GUIListBox::RenderItem(size_t itemindex, int yPos, bool selected)
 
 void GUIListBox::NotifySelect(size_t item_selected)
 {
+    if (isRomListLoading) {
+        // The placeholder can't be selected
+        return;
+    }
+
     if (!isCheckList) {
         // deselect all items, even invisible ones
         for (size_t i = 0; i < mListItems.size(); i++) {
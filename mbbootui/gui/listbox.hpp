@@ -54,6 +54,9 @@ protected:
         std::vector<Condition> mConditions;
     };
 
+protected:
+    bool UpdateRomList();
+
 protected:
     std::vector<ListItem> mListItems;
     std::vector<size_t> mVisibleItems; // contains indexes in mListItems of visible items only
@@ -63,4 +66,6 @@ protected:
     ImageResource* mIconUnselected;
     bool isCheckList;
     bool isTextParsed;
+    bool isRomListLoading; // showing a placeholder until the ROM list is fetched
+    unsigned int mRomListGeneration;
 };
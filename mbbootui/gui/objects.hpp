@@ -60,6 +60,14 @@ public:
         return 0;
     }
 
+    // GetDamageRect - Returns the area that must be redrawn when the object changes
+    //  Return 0 on success, <0 if the area is unknown and the whole screen must be redrawn
+    virtual int GetDamageRect(int& x, int& y, int& w, int& h)
+    {
+        GetRenderPos(x, y, w, h);
+        return (w > 0 && h > 0) ? 0 : -1;
+    }
+
     // SetRenderPos - Update the position of the object
     //  Return 0 on success, <0 on error
     virtual int SetRenderPos(int x, int y, int w = 0, int h = 0)
@@ -522,16 +522,36 @@ int Page::Render()
     return 0;
 }
 
+static void damage_rect(int ret, int x, int y, int w, int h)
+{
+    if (ret < 0) {
+        gr_damage_all();
+    } else {
+        gr_damage(x, y, w, h);
+    }
+}
+
 int Page::Update()
 {
     int retCode = 0;
 
     for (auto iter = mRenders.begin(); iter != mRenders.end(); iter++) {
+        // Objects may move or resize when updated, so both the old and the
+        // new areas are damaged
+        int x, y, w, h;
+        int rect_ret = (*iter)->GetDamageRect(x, y, w, h);
+
         int ret = (*iter)->Update();
         if (ret < 0) {
             LOGE("An update request has failed.");
-        } else if (ret > retCode) {
-            retCode = ret;
+        } else if (ret > 0) {
+            damage_rect(rect_ret, x, y, w, h);
+            rect_ret = (*iter)->GetDamageRect(x, y, w, h);
+            damage_rect(rect_ret, x, y, w, h);
+
+            if (ret > retCode) {
+                retCode = ret;
+            }
         }
     }
 
@@ -1576,6 +1596,8 @@ int PageManager::Render()
         return 0;
     }
 
+    gr_damage_all();
+
     int res = (mCurrentSet ? mCurrentSet->Render() : -1);
     if (mMouseCursor) {
         mMouseCursor->Render();
@@ -1583,6 +1605,33 @@ int PageManager::Render()
     return res;
 }
 
+/*!
+ * \brief Redraw only the area damaged by the last Update()
+ *
+ * Every object is still rendered, but drawing is clipped to the damaged area,
+ * which is what the backends flush. Falls back to Render() if the damage is
+ * unknown.
+ */
+int PageManager::RenderDamage()
+{
+    int x, y, w, h;
+
+    if (blankTimer.isScreenOff()) {
+        return 0;
+    } else if (gr_get_damage(&x, &y, &w, &h) < 0) {
+        return Render();
+    }
+
+    gr_clip(x, y, w, h);
+    int res = (mCurrentSet ? mCurrentSet->Render() : -1);
+    if (mMouseCursor) {
+        mMouseCursor->Render();
+    }
+    gr_noclip();
+
+    return res;
+}
+
 HardwareKeyboard *PageManager::GetHardwareKeyboard()
 {
     if (!mHardwareKeyboard) {
@@ -1646,6 +1695,10 @@ int PageManager::Update()
 
     if (mMouseCursor) {
         int c_res = mMouseCursor->Update();
+        // The cursor moves between updates, so its old position is unknown
+        if (c_res > 0) {
+            gr_damage_all();
+        }
         if (c_res > res) {
             res = c_res;
         }
@@ -173,6 +173,7 @@ public:
 
     // These are routing routines
     static int Render();
+    static int RenderDamage();
     static int Update();
     static int NotifyTouch(TOUCH_STATE state, int x, int y);
     static int NotifyKey(int key, bool down);
@@ -13,6 +13,7 @@
 #include "twrp-functions.hpp"
 
 #include "gui/gui.h"
+#include "gui/imagecache.hpp"
 
 #define TMP_RESOURCE_NAME   "/tmp/extract.bin"
 
@@ -75,6 +76,19 @@ void Resource::LoadImage(ZipArchive* pZip, const std::string& file,
     }
 }
 
+static void GetImageScale(int retain_aspect, float* scale_w, float* scale_h)
+{
+    *scale_w = get_scale_w();
+    *scale_h = get_scale_h();
+    if (*scale_w != 0 && *scale_h != 0 && retain_aspect) {
+        if (*scale_w < *scale_h) {
+            *scale_h = *scale_w;
+        } else {
+            *scale_w = *scale_h;
+        }
+    }
+}
+
 void Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, int retain_aspect)
 {
     if (!source) {
@@ -82,14 +96,8 @@ void Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, in
         return;
     }
     if (get_scale_w() != 0 && get_scale_h() != 0) {
-        float scale_w = get_scale_w(), scale_h = get_scale_h();
-        if (retain_aspect) {
-            if (scale_w < scale_h) {
-                scale_h = scale_w;
-            } else {
-                scale_w = scale_h;
-            }
-        }
+        float scale_w, scale_h;
+        GetImageScale(retain_aspect, &scale_w, &scale_h);
         if (res_scale_surface(source, destination, scale_w, scale_h)) {
             LOGI("Error scaling image, using regular size.");
             *destination = source;
@@ -99,6 +107,25 @@ void Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, in
     }
 }
 
+void Resource::LoadAndScaleImage(ZipArchive* pZip, const std::string& file,
+                                 int retain_aspect, gr_surface* surface)
+{
+    float scale_w, scale_h;
+    GetImageScale(retain_aspect, &scale_w, &scale_h);
+
+    *surface = ImageCache::Find(pZip, file, scale_w, scale_h);
+    if (*surface) {
+        return;
+    }
+
+    gr_surface temp_surface = nullptr;
+    LoadImage(pZip, file, &temp_surface);
+    CheckAndScaleImage(temp_surface, surface, retain_aspect);
+    if (*surface) {
+        ImageCache::Add(pZip, file, scale_w, scale_h, *surface);
+    }
+}
+
 FontResource::FontResource(xml_node<>* node, ZipArchive* pZip)
     : Resource(node, pZip)
 {
@@ -194,7 +221,6 @@ ImageResource::ImageResource(xml_node<>* node, ZipArchive* pZip)
     : Resource(node, pZip)
 {
     std::string file;
-    gr_surface temp_surface = nullptr;
 
     mSurface = nullptr;
     if (!node) {
@@ -211,8 +237,7 @@ ImageResource::ImageResource(xml_node<>* node, ZipArchive* pZip)
 
     bool retain_aspect = (node->first_attribute("retainaspect") != nullptr);
     // the value does not matter, if retainaspect is present, we assume that we want to retain it
-    LoadImage(pZip, file, &temp_surface);
-    CheckAndScaleImage(temp_surface, &mSurface, retain_aspect);
+    LoadAndScaleImage(pZip, file, retain_aspect, &mSurface);
 }
 
 ImageResource::~ImageResource()
@@ -245,9 +270,8 @@ AnimationResource::AnimationResource(xml_node<>* node, ZipArchive* pZip)
         std::ostringstream fileName;
         fileName << file << std::setfill ('0') << std::setw (3) << fileNum;
 
-        gr_surface surface, temp_surface = nullptr;
-        LoadImage(pZip, fileName.str(), &temp_surface);
-        CheckAndScaleImage(temp_surface, &surface, retain_aspect);
+        gr_surface surface;
+        LoadAndScaleImage(pZip, fileName.str(), retain_aspect, &surface);
         if (surface) {
             mSurfaces.push_back(surface);
             fileNum++;
@@ -35,6 +35,9 @@ protected:
                           const std::string& file, gr_surface* surface);
     static void CheckAndScaleImage(gr_surface source, gr_surface* destination,
                                    int retain_aspect);
+    // LoadImage() and CheckAndScaleImage(), using the image cache if possible
+    static void LoadAndScaleImage(ZipArchive* pZip, const std::string& file,
+                                  int retain_aspect, gr_surface* surface);
 };
 
 class FontResource : public Resource
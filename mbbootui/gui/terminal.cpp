@@ -20,6 +20,7 @@
 
 #include "gui/terminal.hpp"
 
+#include <deque>
 #include <vector>
 
 #include <cstring>
@@ -43,6 +44,14 @@
 
 extern int g_pty_fd; // in gui.cpp where the select is
 
+// Maximum number of lines kept in the buffer, including scrollback. The oldest
+// lines are dropped once this is reached so that long running output (eg.
+// logcat or dmesg) doesn't grow the buffer without bounds.
+#define TERMINAL_MAX_LINES 1000
+
+// Maximum number of bytes processed per read from the pty
+#define TERMINAL_READ_SIZE 16384
+
 /*
 Pseudoterminal handler.
 */
@@ -345,7 +354,7 @@ public:
         void eraseTo(size_t x)
         {
             if (x > 0) {
-                cells.erase(cells.begin(), cells.begin() + x);
+                cells.erase(cells.begin(), cells.begin() + std::min(x, cells.size()));
             }
         }
     };
@@ -383,16 +392,14 @@ public:
 
     void readPty()
     {
-        char buffer[1024];
+        static char buffer[TERMINAL_READ_SIZE];
         int rc = pty.read(buffer, sizeof(buffer));
         debug_printf("readPty: %d bytes\n", rc);
         if (rc < 0) {
             output("\r\nChild process exited.\r\n");
             // TODO: maybe exit terminal here
         } else {
-            for (int i = 0; i < rc; ++i) {
-                output(buffer[i]);
-            }
+            output(buffer, rc);
         }
     }
 
@@ -407,8 +414,28 @@ public:
 
     void output(const char *buf)
     {
-        for (const char* p = buf; *p; ++p) {
-            output(*p);
+        output(buf, strlen(buf));
+    }
+
+    void output(const char *buf, size_t size)
+    {
+        size_t i = 0;
+        while (i < size) {
+            // Fast path for runs of printable ASCII characters, which is what
+            // most output consists of
+            if (state == kStateGround && utf8state == UTF8_ACCEPT) {
+                size_t n = 0;
+                while (i + n < size && buf[i + n] >= ' ' && buf[i + n] < 127) {
+                    ++n;
+                }
+                if (n > 0) {
+                    outputPrintable(buf + i, n);
+                    i += n;
+                    continue;
+                }
+            }
+            output(buf[i]);
+            ++i;
         }
     }
 
@@ -514,6 +541,9 @@ public:
         while (lines.size() <= (size_t) y) {
             lines.push_back(Line());
         }
+        if (lines.size() > TERMINAL_MAX_LINES) {
+            trimScrollback();
+        }
         ++updateCounter;
     }
 
@@ -538,6 +568,55 @@ public:
     }
 
 private:
+    // Drop the oldest lines so that at most TERMINAL_MAX_LINES remain
+    void trimScrollback()
+    {
+        size_t excess = lines.size() - TERMINAL_MAX_LINES;
+
+        lines.erase(lines.begin(), lines.begin() + excess);
+        cursorY = std::max(cursorY - (int) excess, 0);
+
+        if (unpackedY >= excess) {
+            unpackedY -= excess;
+        } else {
+            // The line being edited was dropped
+            unpackLine(cursorY);
+        }
+    }
+
+    // Same as calling processChar() for each character, but without the
+    // per-character overhead. All characters must be printable ASCII.
+    void outputPrintable(const char *buf, size_t size)
+    {
+        while (size > 0) {
+            if (cursorX >= width) {
+                // Cursor was moved to the right margin
+                processChar((unsigned char) *buf);
+                ++buf;
+                --size;
+                continue;
+            }
+
+            ensureUnpacked(cursorY);
+
+            size_t n = std::min(size, (size_t) (width - cursorX));
+            if (unpackedLine.cells.size() < cursorX + n) {
+                unpackedLine.cells.resize(cursorX + n);
+            }
+            for (size_t i = 0; i < n; ++i) {
+                unpackedLine.cells[cursorX + i].cp = (unsigned char) buf[i];
+            }
+            buf += n;
+            size -= n;
+
+            setX(cursorX + n);
+            if (cursorX >= width) {
+                down();
+                setX(0);
+            }
+        }
+    }
+
     void packLine()
     {
         std::string& s = lines[unpackedY].text;
@@ -797,7 +876,7 @@ private:
 private:
     int cursorX, cursorY; // 0-based, char based. TODO: decide how to handle scrollback
     int width, height; // window size in chars
-    std::vector<Line> lines; // the text buffer
+    std::deque<Line> lines; // the text buffer
     UnpackedLine unpackedLine; // current line for editing
     size_t unpackedY; // number of current line
     int updateCounter; // changes whenever terminal could require redraw
@@ -147,6 +147,23 @@ int GUIText::Update()
     return 2;
 }
 
+int GUIText::GetDamageRect(int& x, int& y, int& w, int& h)
+{
+    // Must match the vertical placement in gr_textEx_scaleW()
+    x = 0;
+    y = mRenderY;
+    w = gr_fb_width();
+    h = mFontHeight;
+
+    if (mPlacement == CENTER || mPlacement == TEXT_ONLY_RIGHT) {
+        y -= h / 2;
+    } else if (mPlacement == BOTTOM_LEFT || mPlacement == BOTTOM_RIGHT) {
+        y -= h;
+    }
+
+    return h > 0 ? 0 : -1;
+}
+
 int GUIText::GetCurrentBounds(int& w, int& h)
 {
     void* fontResource = nullptr;
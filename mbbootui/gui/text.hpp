@@ -40,6 +40,9 @@ public:
     // Retrieve the size of the current string (dynamic strings may change per call)
     virtual int GetCurrentBounds(int& w, int& h);
 
+    // The width of the text depends on its value, so use the whole row
+    virtual int GetDamageRect(int& x, int& y, int& w, int& h);
+
     // Notify of a variable change
     virtual int NotifyVarChange(const std::string& varName, const std::string& value);
 
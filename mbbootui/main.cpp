@@ -60,6 +60,7 @@
 #define MBBOOTUI_LOG_PATH           MBBOOTUI_BASE_PATH "/exec.log"
 #define MBBOOTUI_SCREENSHOTS_PATH   MBBOOTUI_BASE_PATH "/screenshots";
 #define MBBOOTUI_SETTINGS_PATH      MBBOOTUI_BASE_PATH "/settings.bin"
+#define MBBOOTUI_IMAGE_CACHE_PATH   MBBOOTUI_BASE_PATH "/image-cache.bin"
 
 #define MBBOOTUI_RUNTIME_PATH       "/mbbootui"
 #define MBBOOTUI_THEME_PATH         MBBOOTUI_RUNTIME_PATH "/theme"
@@ -331,6 +332,7 @@ static void log_startup()
     LOGV("- tw_settings_path:             %s", tw_settings_path.c_str());
     LOGV("- tw_screenshots_path:          %s", tw_screenshots_path.c_str());
     LOGV("- tw_theme_zip_path:            %s", tw_theme_zip_path.c_str());
+    LOGV("- tw_image_cache_path:          %s", tw_image_cache_path.c_str());
 
     if (!tw_graphics_backends.empty()) {
         LOGV("- tw_graphics_backends:         (%zu backends)", tw_graphics_backends.size());
@@ -414,6 +416,7 @@ int main(int argc, char *argv[])
     tw_resource_path = MBBOOTUI_THEME_PATH;
     tw_settings_path = MBBOOTUI_SETTINGS_PATH;
     tw_screenshots_path = MBBOOTUI_SCREENSHOTS_PATH;
+    tw_image_cache_path = MBBOOTUI_IMAGE_CACHE_PATH;
     // Disallow custom themes, which could manipulate variables in such as way
     // as to execute malicious code
     tw_theme_zip_path = "";
@@ -454,6 +457,10 @@ int main(int argc, char *argv[])
     mbtool_interface->version(&mbtool_version);
     DataManager::SetValue(VAR_TW_MBTOOL_VERSION, mbtool_version);
 
+    // Start scanning for installed ROMs now so it overlaps with loading the
+    // theme instead of delaying the first frame of the ROM list
+    installed_roms_fetcher.start(mbtool_interface, gui_forceRender);
+
     LOGV("Loading graphics system...");
     if (gui_init() < 0) {
         LOGE("Failed to load graphics system");
@@ -15,7 +15,9 @@
  */
 
 #include <drm_fourcc.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,8 +46,19 @@ struct drm_surface
     uint32_t handle;
 };
 
-static drm_surface *drm_surfaces[2];
-static int current_buffer;
+// Triple buffering: while one buffer is scanned out and another is waiting
+// for vblank in a queued page flip, the next frame is drawn into the third one
+// instead of blocking until the flip completes.
+#define NUM_BUFFERS 3
+
+// Maximum time to wait for a page flip event. Normally this is at most one
+// refresh cycle.
+#define FLIP_TIMEOUT_MS 100
+
+static drm_surface *drm_surfaces[NUM_BUFFERS];
+static int current_buffer;        // Being drawn into
+static int front_buffer;          // Being scanned out
+static int pending_buffer = -1;   // Queued for the next vblank
 
 static drmModeCrtc *main_monitor_crtc;
 static drmModeConnector *main_monitor_connector;
@@ -81,13 +94,59 @@ static void drm_enable_crtc(int drm_fd, drmModeCrtc *crtc,
     }
 }
 
+static void drm_page_flip_handler(int fd __unused,
+                                  unsigned int sequence __unused,
+                                  unsigned int tv_sec __unused,
+                                  unsigned int tv_usec __unused,
+                                  void *user_data __unused)
+{
+    front_buffer = pending_buffer;
+    pending_buffer = -1;
+}
+
+// Wait for the queued page flip (if any) to complete. Only one flip can be
+// queued per CRTC at a time.
+static void drm_wait_for_flip()
+{
+    drmEventContext ev_ctx;
+    memset(&ev_ctx, 0, sizeof(ev_ctx));
+    ev_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+    ev_ctx.page_flip_handler = drm_page_flip_handler;
+
+    while (pending_buffer >= 0) {
+        struct pollfd fds[1];
+        fds[0].fd = drm_fd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+
+        int ret = poll(fds, 1, FLIP_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            // Don't hang the UI if the event never arrives. Assume the flip
+            // happened.
+            printf("Timed out waiting for page flip\n");
+            drm_page_flip_handler(drm_fd, 0, 0, 0, nullptr);
+            break;
+        }
+
+        if (drmHandleEvent(drm_fd, &ev_ctx) != 0) {
+            printf("drmHandleEvent failed\n");
+            drm_page_flip_handler(drm_fd, 0, 0, 0, nullptr);
+            break;
+        }
+    }
+}
+
 static void drm_blank(minui_backend* backend __unused, bool blank)
 {
+    drm_wait_for_flip();
+
     if (blank) {
         drm_disable_crtc(drm_fd, main_monitor_crtc);
     } else {
         drm_enable_crtc(drm_fd, main_monitor_crtc,
-                        drm_surfaces[current_buffer]);
+                        drm_surfaces[front_buffer]);
     }
 }
 
@@ -473,42 +532,68 @@ static GRSurface* drm_init(minui_backend* backend __unused)
 
     drmModeFreeResources(res);
 
-    drm_surfaces[0] = drm_create_surface(width, height);
-    drm_surfaces[1] = drm_create_surface(width, height);
-    if (!drm_surfaces[0] || !drm_surfaces[1]) {
-        drm_destroy_surface(drm_surfaces[0]);
-        drm_destroy_surface(drm_surfaces[1]);
-        drmModeFreeResources(res);
-        close(drm_fd);
-        return nullptr;
+    for (i = 0; i < NUM_BUFFERS; i++) {
+        drm_surfaces[i] = drm_create_surface(width, height);
+        if (!drm_surfaces[i]) {
+            for (int j = 0; j < i; j++) {
+                drm_destroy_surface(drm_surfaces[j]);
+                drm_surfaces[j] = nullptr;
+            }
+            close(drm_fd);
+            return nullptr;
+        }
     }
 
     current_buffer = 0;
+    front_buffer = 1;
+    pending_buffer = -1;
 
-    drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
+    drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[front_buffer]);
 
-    return &(drm_surfaces[0]->base);
+    return &(drm_surfaces[current_buffer]->base);
 }
 
 static GRSurface* drm_flip(minui_backend* backend __unused)
 {
     int ret;
 
+    // This only blocks if the previous frame still hasn't been scanned out,
+    // ie. if we're drawing faster than the refresh rate
+    drm_wait_for_flip();
+
     ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
-                          drm_surfaces[current_buffer]->fb_id, 0, nullptr);
+                          drm_surfaces[current_buffer]->fb_id,
+                          DRM_MODE_PAGE_FLIP_EVENT, nullptr);
     if (ret < 0) {
+        // Eg. the CRTC is disabled. Fall back to a (blocking) modeset.
         printf("drmModePageFlip failed ret=%d\n", ret);
-        return nullptr;
+        drm_enable_crtc(drm_fd, main_monitor_crtc,
+                        drm_surfaces[current_buffer]);
+        front_buffer = current_buffer;
+    } else {
+        pending_buffer = current_buffer;
+    }
+
+    // Draw the next frame into the buffer that is neither on screen nor
+    // waiting to be
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+        if (i != front_buffer && i != pending_buffer) {
+            current_buffer = i;
+            break;
+        }
     }
-    current_buffer = 1 - current_buffer;
+
     return &(drm_surfaces[current_buffer]->base);
 }
 
 static void drm_exit(minui_backend* backend __unused)
 {
+    drm_wait_for_flip();
     drm_disable_crtc(drm_fd, main_monitor_crtc);
-    drm_destroy_surface(drm_surfaces[0]);
-    drm_destroy_surface(drm_surfaces[1]);
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+        drm_destroy_surface(drm_surfaces[i]);
+        drm_surfaces[i] = nullptr;
+    }
     drmModeFreeCrtc(main_monitor_crtc);
     drmModeFreeConnector(main_monitor_connector);
     close(drm_fd);
@@ -520,6 +605,8 @@ static minui_backend drm_backend = {
     .flip = drm_flip,
     .blank = drm_blank,
     .exit = drm_exit,
+    .flip_damage = nullptr,
+    .buffer_count = NUM_BUFFERS,
 };
 
 extern "C" struct minui_backend * BACKEND_FUNCTION(drm)() {
@@ -39,6 +39,7 @@
 
 static GRSurface* fbdev_init(minui_backend*);
 static GRSurface* fbdev_flip(minui_backend*);
+static GRSurface* fbdev_flip_damage(minui_backend*, int, int, int, int);
 static void fbdev_blank(minui_backend*, bool);
 static void fbdev_exit(minui_backend*);
 
@@ -56,6 +57,7 @@ static minui_backend my_backend = {
     .flip = fbdev_flip,
     .blank = fbdev_blank,
     .exit = fbdev_exit,
+    .flip_damage = fbdev_flip_damage,
 };
 
 extern "C" struct minui_backend * BACKEND_FUNCTION(fbdev)()
@@ -333,6 +335,33 @@ static GRSurface* fbdev_flip(minui_backend* backend __unused)
     return gr_draw;
 }
 
+static GRSurface* fbdev_flip_damage(minui_backend* backend, int x __unused,
+                                    int y, int w __unused, int h)
+{
+    // The byte swapping and rotation are done in place or over the whole
+    // frame, so only plain copies can be limited to the damaged rows
+    if (tw_device.tw_pixel_format() == mb::device::TwPixelFormat::Bgra8888
+            || (tw_device.tw_flags()
+                    & mb::device::TwFlag::BoardHasFlippedScreen)) {
+        return fbdev_flip(backend);
+    }
+
+    // The damage covers the last two frames, so this also brings the back
+    // buffer of a double-buffered framebuffer up to date
+    size_t offset = y * gr_draw->row_bytes;
+    size_t size = h * gr_draw->row_bytes;
+
+    if (double_buffered) {
+        memcpy(gr_framebuffer[1-displayed_buffer].data + offset,
+               gr_draw->data + offset, size);
+        set_displayed_framebuffer(1-displayed_buffer);
+    } else {
+        memcpy(gr_framebuffer[0].data + offset, gr_draw->data + offset, size);
+    }
+
+    return gr_draw;
+}
+
 static void fbdev_exit(minui_backend* backend __unused)
 {
     close(fb_fd);
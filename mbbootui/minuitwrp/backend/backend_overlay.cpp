@@ -48,6 +48,7 @@
 
 static GRSurface* overlay_init(minui_backend*);
 static GRSurface* overlay_flip(minui_backend*);
+static GRSurface* overlay_flip_damage(minui_backend*, int, int, int, int);
 static void overlay_blank(minui_backend*, bool);
 static void overlay_exit(minui_backend*);
 
@@ -100,6 +101,7 @@ static minui_backend my_backend = {
     .flip = overlay_flip,
     .blank = overlay_blank,
     .exit = overlay_exit,
+    .flip_damage = overlay_flip_damage,
 };
 
 bool target_has_overlay(char *version)
@@ -440,7 +442,9 @@ int allocate_overlay(int fd, GRSurface gr_fb)
     return 0;
 }
 
-int overlay_display_frame(int fd, void* data, size_t size)
+// Only the byte range [offset, offset + size) of the frame is copied, since the
+// rest of the ion buffer still holds the previous frame
+int overlay_display_frame(int fd, void* data, size_t offset, size_t size)
 {
     int ret = 0;
     struct msmfb_overlay_data ovdataL, ovdataR;
@@ -452,7 +456,8 @@ int overlay_display_frame(int fd, void* data, size_t size)
             return -EINVAL;
         }
 
-        memcpy(mem_info.mem_buf, data, size);
+        memcpy(mem_info.mem_buf + offset,
+               static_cast<unsigned char *>(data) + offset, size);
 
         memset(&ovdataL, 0, sizeof(struct msmfb_overlay_data));
 
@@ -473,7 +478,8 @@ int overlay_display_frame(int fd, void* data, size_t size)
             return -EINVAL;
         }
 
-        memcpy(mem_info.mem_buf, data, size);
+        memcpy(mem_info.mem_buf + offset,
+               static_cast<unsigned char *>(data) + offset, size);
 
         memset(&ovdataL, 0, sizeof(struct msmfb_overlay_data));
 
@@ -529,7 +535,20 @@ static GRSurface* overlay_flip(minui_backend* backend __unused)
         }
     }
     // Copy from the in-memory surface to the framebuffer.
-    overlay_display_frame(fb_fd, gr_draw->data, frame_size);
+    overlay_display_frame(fb_fd, gr_draw->data, 0, frame_size);
+    return gr_draw;
+}
+
+static GRSurface* overlay_flip_damage(minui_backend* backend, int x __unused,
+                                      int y, int w __unused, int h)
+{
+    // The byte swapping is done in place, so it must cover the whole frame
+    if (tw_device.tw_pixel_format() == mb::device::TwPixelFormat::Bgra8888) {
+        return overlay_flip(backend);
+    }
+
+    overlay_display_frame(fb_fd, gr_draw->data, y * gr_draw->row_bytes,
+                          h * gr_draw->row_bytes);
     return gr_draw;
 }
 
@@ -694,6 +713,13 @@ static GRSurface* overlay_flip(minui_backend* backend __unused)
     return nullptr;
 }
 
+static GRSurface* overlay_flip_damage(minui_backend* backend __unused,
+                                      int x __unused, int y __unused,
+                                      int w __unused, int h __unused)
+{
+    return nullptr;
+}
+
 static GRSurface* overlay_init(minui_backend* backend __unused)
 {
     return nullptr;
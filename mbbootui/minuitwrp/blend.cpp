@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2017 Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "blend.h"
+
+#include <algorithm>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BLEND_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BLEND_SSE2 1
+#endif
+
+// Scalar helpers. The R/B and G/A channel pairs are processed together in
+// 16-bit lanes of a 32-bit value.
+
+static inline uint32_t swap_rb_pixel(uint32_t px)
+{
+    return (px & 0xff00ff00) | ((px >> 16) & 0xff) | ((px & 0xff) << 16);
+}
+
+// (s * a + d * (255 - a)) / 255, rounded, for each channel
+static inline uint32_t blend_pixel(uint32_t s, uint32_t d, uint32_t a)
+{
+    uint32_t ia = 255 - a;
+    uint32_t rb = (s & 0xff00ff) * a + (d & 0xff00ff) * ia + 0x800080;
+    uint32_t ga = ((s >> 8) & 0xff00ff) * a + ((d >> 8) & 0xff00ff) * ia
+            + 0x800080;
+    rb = ((rb + ((rb >> 8) & 0xff00ff)) >> 8) & 0xff00ff;
+    ga = (ga + ((ga >> 8) & 0xff00ff)) & 0xff00ff00;
+    return rb | ga;
+}
+
+static inline uint32_t over_pixel(uint32_t s, uint32_t d)
+{
+    uint32_t a = s >> 24;
+    if (a == 255) {
+        return s;
+    } else if (a == 0) {
+        return d;
+    }
+    return blend_pixel(s, d, a);
+}
+
+// (p0 * (256 - w) + p1 * w) / 256 for each channel, with w in [0, 256]
+static inline uint32_t lerp_pixel(uint32_t p0, uint32_t p1, uint32_t w)
+{
+    uint32_t iw = 256 - w;
+    uint32_t rb = ((p0 & 0xff00ff) * iw + (p1 & 0xff00ff) * w) >> 8;
+    uint32_t ga = ((p0 >> 8) & 0xff00ff) * iw + ((p1 >> 8) & 0xff00ff) * w;
+    return (rb & 0xff00ff) | (ga & 0xff00ff00);
+}
+
+#if BLEND_SSE2
+// t / 255, rounded, for 16-bit lanes holding t + 128
+static inline __m128i div255_epi16(__m128i t)
+{
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static inline __m128i swap_rb_epi32(__m128i px)
+{
+    const __m128i ga_mask = _mm_set1_epi32(0xff00ff00);
+    const __m128i b_mask = _mm_set1_epi32(0xff);
+    return _mm_or_si128(
+            _mm_and_si128(px, ga_mask),
+            _mm_or_si128(_mm_and_si128(_mm_srli_epi32(px, 16), b_mask),
+                         _mm_slli_epi32(_mm_and_si128(px, b_mask), 16)));
+}
+
+// Blend 4 source pixels, whose alpha channels hold the blend factor, over 4
+// destination pixels
+static inline __m128i blend_epi8(__m128i s, __m128i d)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i c128 = _mm_set1_epi16(128);
+
+    __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+    __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+    __m128i d_lo = _mm_unpacklo_epi8(d, zero);
+    __m128i d_hi = _mm_unpackhi_epi8(d, zero);
+
+    __m128i a_lo = _mm_shufflehi_epi16(
+            _mm_shufflelo_epi16(s_lo, _MM_SHUFFLE(3, 3, 3, 3)),
+            _MM_SHUFFLE(3, 3, 3, 3));
+    __m128i a_hi = _mm_shufflehi_epi16(
+            _mm_shufflelo_epi16(s_hi, _MM_SHUFFLE(3, 3, 3, 3)),
+            _MM_SHUFFLE(3, 3, 3, 3));
+
+    __m128i t_lo = _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(s_lo, a_lo),
+                          _mm_mullo_epi16(d_lo, _mm_xor_si128(a_lo, c255))),
+            c128);
+    __m128i t_hi = _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(s_hi, a_hi),
+                          _mm_mullo_epi16(d_hi, _mm_xor_si128(a_hi, c255))),
+            c128);
+
+    return _mm_packus_epi16(div255_epi16(t_lo), div255_epi16(t_hi));
+}
+#endif
+
+#if BLEND_NEON
+// (s * a + d * (255 - a)) / 255, rounded
+static inline uint8x8_t blend_u8(uint8x8_t s, uint8x8_t d, uint8x8_t a)
+{
+    uint16x8_t t = vmull_u8(s, a);
+    t = vmlal_u8(t, d, vmvn_u8(a));
+    return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+#endif
+
+void blend_fill(uint32_t *dst, uint32_t px, int n)
+{
+    // The compiler vectorizes this on its own
+    std::fill_n(dst, n, px);
+}
+
+void blend_fill_alpha(uint32_t *dst, uint32_t px, int n)
+{
+    uint32_t a = px >> 24;
+    if (a == 255) {
+        blend_fill(dst, px, n);
+        return;
+    } else if (a == 0) {
+        return;
+    }
+
+    int i = 0;
+
+#if BLEND_NEON
+    uint8x8_t va = vdup_n_u8(a);
+    uint8x8_t vs[4];
+    for (int c = 0; c < 4; ++c) {
+        vs[c] = vdup_n_u8((px >> (c * 8)) & 0xff);
+    }
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t d = vld4_u8(reinterpret_cast<uint8_t *>(dst + i));
+        for (int c = 0; c < 4; ++c) {
+            d.val[c] = blend_u8(vs[c], d.val[c], va);
+        }
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), d);
+    }
+#elif BLEND_SSE2
+    __m128i s = _mm_set1_epi32(px);
+    for (; i + 4 <= n; i += 4) {
+        __m128i *p = reinterpret_cast<__m128i *>(dst + i);
+        _mm_storeu_si128(p, blend_epi8(s, _mm_loadu_si128(p)));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        dst[i] = blend_pixel(px, dst[i], a);
+    }
+}
+
+void blend_copy(uint32_t *dst, const uint32_t *src, int n, bool swap_rb)
+{
+    int i = 0;
+
+#if BLEND_NEON
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t *>(src + i));
+        if (swap_rb) {
+            std::swap(s.val[0], s.val[2]);
+        }
+        s.val[3] = vdup_n_u8(0xff);
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), s);
+    }
+#elif BLEND_SSE2
+    const __m128i a_mask = _mm_set1_epi32(0xff000000);
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(src + i));
+        if (swap_rb) {
+            s = swap_rb_epi32(s);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_or_si128(s, a_mask));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        dst[i] = (swap_rb ? swap_rb_pixel(src[i]) : src[i]) | 0xff000000;
+    }
+}
+
+void blend_over(uint32_t *dst, const uint32_t *src, int n, bool swap_rb)
+{
+    int i = 0;
+
+#if BLEND_NEON
+    for (; i + 8 <= n; i += 8) {
+        uint8x8x4_t s = vld4_u8(reinterpret_cast<const uint8_t *>(src + i));
+        uint64_t alpha = vget_lane_u64(vreinterpret_u64_u8(s.val[3]), 0);
+        if (alpha == 0) {
+            continue;
+        }
+        if (swap_rb) {
+            std::swap(s.val[0], s.val[2]);
+        }
+        if (alpha != UINT64_MAX) {
+            uint8x8x4_t d = vld4_u8(reinterpret_cast<uint8_t *>(dst + i));
+            for (int c = 0; c < 4; ++c) {
+                s.val[c] = blend_u8(s.val[c], d.val[c], s.val[3]);
+            }
+        }
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), s);
+    }
+#elif BLEND_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i a_mask = _mm_set1_epi32(0xff000000);
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(src + i));
+        __m128i a = _mm_and_si128(s, a_mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) == 0xffff) {
+            continue;
+        }
+        if (swap_rb) {
+            s = swap_rb_epi32(s);
+        }
+        __m128i *p = reinterpret_cast<__m128i *>(dst + i);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, a_mask)) != 0xffff) {
+            s = blend_epi8(s, _mm_loadu_si128(p));
+        }
+        _mm_storeu_si128(p, s);
+    }
+#endif
+
+    for (; i < n; ++i) {
+        dst[i] = over_pixel(swap_rb ? swap_rb_pixel(src[i]) : src[i], dst[i]);
+    }
+}
+
+void blend_mask(uint32_t *dst, const uint8_t *mask, uint32_t px, int n)
+{
+    int i = 0;
+
+    px &= 0xffffff;
+
+#if BLEND_NEON
+    uint8x8_t vs[3];
+    for (int c = 0; c < 3; ++c) {
+        vs[c] = vdup_n_u8((px >> (c * 8)) & 0xff);
+    }
+    for (; i + 8 <= n; i += 8) {
+        uint8x8_t a = vld1_u8(mask + i);
+        uint64_t alpha = vget_lane_u64(vreinterpret_u64_u8(a), 0);
+        if (alpha == 0) {
+            continue;
+        }
+        uint8x8x4_t d = vld4_u8(reinterpret_cast<uint8_t *>(dst + i));
+        for (int c = 0; c < 3; ++c) {
+            d.val[c] = blend_u8(vs[c], d.val[c], a);
+        }
+        d.val[3] = blend_u8(a, d.val[3], a);
+        vst4_u8(reinterpret_cast<uint8_t *>(dst + i), d);
+    }
+#elif BLEND_SSE2
+    const __m128i rgb = _mm_set1_epi32(px);
+    for (; i + 4 <= n; i += 4) {
+        uint32_t m;
+        std::copy_n(mask + i, 4, reinterpret_cast<uint8_t *>(&m));
+        if (m == 0) {
+            continue;
+        }
+        // Spread each coverage byte into the alpha byte of its pixel
+        __m128i a = _mm_cvtsi32_si128(static_cast<int>(m));
+        a = _mm_unpacklo_epi8(a, a);
+        a = _mm_unpacklo_epi16(a, a);
+        a = _mm_slli_epi32(a, 24);
+
+        __m128i *p = reinterpret_cast<__m128i *>(dst + i);
+        _mm_storeu_si128(p, blend_epi8(_mm_or_si128(rgb, a),
+                                       _mm_loadu_si128(p)));
+    }
+#endif
+
+    for (; i < n; ++i) {
+        dst[i] = over_pixel(px | (static_cast<uint32_t>(mask[i]) << 24),
+                            dst[i]);
+    }
+}
+
+void blend_scale_bilinear(uint32_t *dst, int dst_w, int dst_h, int dst_stride,
+                          const uint32_t *src, int src_w, int src_h,
+                          int src_stride)
+{
+    if (dst_w <= 0 || dst_h <= 0 || src_w <= 0 || src_h <= 0) {
+        return;
+    }
+
+    // Source coordinates of destination pixel centers in 16.16 fixed point
+    int64_t step_x = (static_cast<int64_t>(src_w) << 16) / dst_w;
+    int64_t step_y = (static_cast<int64_t>(src_h) << 16) / dst_h;
+    int64_t max_x = static_cast<int64_t>(src_w - 1) << 16;
+    int64_t max_y = static_cast<int64_t>(src_h - 1) << 16;
+
+    int64_t fy = step_y / 2 - 0x8000;
+
+    for (int y = 0; y < dst_h; ++y, fy += step_y) {
+        int64_t cy = std::min(std::max<int64_t>(fy, 0), max_y);
+        int y0 = static_cast<int>(cy >> 16);
+        int y1 = std::min(y0 + 1, src_h - 1);
+        uint32_t wy = static_cast<uint32_t>((cy & 0xffff) >> 8);
+
+        const uint32_t *row0 = src + y0 * src_stride;
+        const uint32_t *row1 = src + y1 * src_stride;
+        uint32_t *out = dst + y * dst_stride;
+
+        int64_t fx = step_x / 2 - 0x8000;
+
+        for (int x = 0; x < dst_w; ++x, fx += step_x) {
+            int64_t cx = std::min(std::max<int64_t>(fx, 0), max_x);
+            int x0 = static_cast<int>(cx >> 16);
+            int x1 = std::min(x0 + 1, src_w - 1);
+            uint32_t wx = static_cast<uint32_t>((cx & 0xffff) >> 8);
+
+            uint32_t top = lerp_pixel(row0[x0], row0[x1], wx);
+            uint32_t bottom = lerp_pixel(row1[x0], row1[x1], wx);
+            out[x] = lerp_pixel(top, bottom, wy);
+        }
+    }
+}
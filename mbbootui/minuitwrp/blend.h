@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2017 Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+// Row kernels for 32bpp surfaces. Pixels are native-endian uint32_t values
+// with alpha in the top byte (RGBA_8888, RGBX_8888 and BGRA_8888 in memory).
+// Blending matches GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA for all channels.
+// NEON and SSE2 versions are used when available.
+
+// Fill n pixels with px
+void blend_fill(uint32_t *dst, uint32_t px, int n);
+
+// Blend px (with its alpha) over n pixels
+void blend_fill_alpha(uint32_t *dst, uint32_t px, int n);
+
+// Copy n opaque pixels, optionally swapping the R and B channels. The alpha
+// channel of the result is always 0xff.
+void blend_copy(uint32_t *dst, const uint32_t *src, int n, bool swap_rb);
+
+// Blend n pixels over dst using the source alpha, optionally swapping the R
+// and B channels of the source first
+void blend_over(uint32_t *dst, const uint32_t *src, int n, bool swap_rb);
+
+// Blend the color px (whose alpha is ignored) over n pixels using the 8-bit
+// coverage values in mask as alpha
+void blend_mask(uint32_t *dst, const uint8_t *mask, uint32_t px, int n);
+
+// Bilinearly scale the src image into dst. Strides are in pixels.
+void blend_scale_bilinear(uint32_t *dst, int dst_w, int dst_h, int dst_stride,
+                          const uint32_t *src, int src_w, int src_h,
+                          int src_stride);
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/ioctl.h>
 #include <sys/poll.h>
 #include <limits.h>
 #include <linux/input.h>
@@ -34,6 +35,8 @@
 //#define _EVENT_LOGGING
 
 #define MAX_DEVICES         32
+// Number of events read from a device per read() call
+#define EVENT_BATCH_SIZE    64
 
 #define VIBRATOR_TIMEOUT_FILE "/sys/class/timed_output/vibrator/enable"
 #define VIBRATOR_TIME_MS    50
@@ -98,6 +101,17 @@ struct ev
 
     struct position p, mt_p;
     int down;
+
+    // Events read from the device, but not yet processed
+    struct input_event buf[EVENT_BATCH_SIZE];
+    unsigned buf_pos, buf_len;
+    // Translated event held back while coalescing drags
+    struct input_event pending;
+    int has_pending;
+    // Whether a touch start has been delivered without a release
+    int touching;
+    // Whether the kernel timestamps events with CLOCK_MONOTONIC
+    int monotonic;
 };
 
 static struct pollfd ev_fds[MAX_DEVICES];
@@ -106,6 +120,7 @@ static unsigned ev_count = 0;
 static struct timespec lastInputStat;
 static unsigned long lastInputMTime;
 static int has_mouse = 0;
+static unsigned ev_generation_count = 0;
 
 static inline int ABS(int x)
 {
@@ -323,6 +338,22 @@ int ev_has_mouse(void)
     return has_mouse;
 }
 
+unsigned ev_get_fds(int *fds, unsigned max)
+{
+    unsigned n;
+
+    for (n = 0; n < ev_count && n < max; n++) {
+        fds[n] = ev_fds[n].fd;
+    }
+
+    return n;
+}
+
+unsigned ev_generation(void)
+{
+    return ev_generation_count;
+}
+
 int ev_init(void)
 {
     DIR *dir;
@@ -330,6 +361,7 @@ int ev_init(void)
     int fd;
 
     has_mouse = 0;
+    ++ev_generation_count;
 
     dir = opendir("/dev/input");
     if (dir) {
@@ -346,6 +378,14 @@ int ev_init(void)
             ev_fds[ev_count].fd = fd;
             ev_fds[ev_count].events = POLLIN;
             evs[ev_count].fd = &ev_fds[ev_count];
+            evs[ev_count].buf_pos = evs[ev_count].buf_len = 0;
+            evs[ev_count].has_pending = 0;
+            evs[ev_count].touching = 0;
+
+            // Use the same clock as the UI for measuring input latency
+            int clock_id = CLOCK_MONOTONIC;
+            evs[ev_count].monotonic =
+                    ioctl(fd, EVIOCSCLOCKID, &clock_id) == 0;
 
             /* Load virtualkeys if there are any */
             vk_init(&evs[ev_count]);
@@ -761,6 +801,64 @@ static int vk_modify(struct ev *e, struct input_event *ev)
     return 0;
 }
 
+static inline int is_drag(const struct input_event *ev)
+{
+    return ev->type == EV_ABS && ev->code == 1;
+}
+
+/* Translate the next buffered event from a device */
+/* Returns non-zero if there was none */
+static int ev_translate_next(struct ev *e, struct input_event *ev)
+{
+    while (e->buf_pos < e->buf_len) {
+        *ev = e->buf[e->buf_pos++];
+        if (!vk_modify(e, ev)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Get the next event from a device's buffer. Drags that were read in the same */
+/* batch are coalesced into the last one, so the UI gets one drag per batch */
+/* instead of one per SYN_REPORT. Returns non-zero if the buffer is empty. */
+static int ev_next(struct ev *e, struct input_event *ev)
+{
+    struct input_event next;
+
+    if (e->has_pending) {
+        *ev = e->pending;
+        e->has_pending = 0;
+    } else if (ev_translate_next(e, ev)) {
+        return 1;
+    }
+
+    // The first drag after a release is the touch start, which must not move
+    while (e->touching && is_drag(ev) && !ev_translate_next(e, &next)) {
+        if (!is_drag(&next)) {
+            e->pending = next;
+            e->has_pending = 1;
+            break;
+        }
+        *ev = next;
+    }
+
+    if (is_drag(ev)) {
+        e->touching = 1;
+    } else if (ev->type == EV_ABS && ev->code == 0) {
+        e->touching = 0;
+    }
+
+    if (!e->monotonic) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ev->time.tv_sec = now.tv_sec;
+        ev->time.tv_usec = now.tv_nsec / 1000;
+    }
+
+    return 0;
+}
+
 int ev_get(struct input_event *ev, int timeout_ms)
 {
     int r;
@@ -780,14 +878,23 @@ int ev_get(struct input_event *ev, int timeout_ms)
         lastInputStat = curr;
     }
 
+    // Deliver events left over from the previous read() first
+    for (n = 0; n < ev_count; n++) {
+        if (!ev_next(&evs[n], ev)) {
+            return 0;
+        }
+    }
+
     r = poll(ev_fds, ev_count, timeout_ms);
 
     if (r > 0) {
         for (n = 0; n < ev_count; n++) {
             if (ev_fds[n].revents & POLLIN) {
-                r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                if (r == sizeof(*ev)) {
-                    if (!vk_modify(&evs[n], ev)) {
+                r = read(ev_fds[n].fd, evs[n].buf, sizeof(evs[n].buf));
+                if (r >= (int) sizeof(*ev)) {
+                    evs[n].buf_pos = 0;
+                    evs[n].buf_len = r / sizeof(*ev);
+                    if (!ev_next(&evs[n], ev)) {
                         return 0;
                     }
                 }
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,6 +38,7 @@
 #include "config/config.hpp"
 #include "backend/backend.h"
 #include "minui.h"
+#include "blend.h"
 #include "graphics.h"
 #include "gui/placement.h"
 
@@ -67,10 +70,49 @@ static unsigned char gr_current_b5 = 31;
 
 GRSurface* gr_draw = nullptr;
 
+struct GRDamage
+{
+    bool full;
+    bool empty;
+    int x0, y0, x1, y1;
+};
+
+// Damage reported since the last flip
+static GRDamage gr_cur_damage = { false, true, 0, 0, 0, 0 };
+// Damage flushed by the previous flips, newest first. A backend with N buffers
+// draws into a buffer that is N frames old, so partial redraws must also cover
+// the damage of the last N - 1 frames.
+#define GR_MAX_BUFFERS 3
+static GRDamage gr_prev_damage[GR_MAX_BUFFERS - 1] = {
+    { true, false, 0, 0, 0, 0 },
+    { true, false, 0, 0, 0, 0 },
+};
+
 static GGLContext *gr_context = 0;
 GGLSurface gr_mem_surface;
 static int gr_is_curr_clr_opaque = 0;
 
+// Channel order of the draw surface for the blend.cpp fast paths. 16bpp
+// surfaces are left to pixelflinger.
+enum GRFastFormat
+{
+    GR_FAST_NONE,
+    GR_FAST_RGBA,   // RGBA_8888 and RGBX_8888
+    GR_FAST_BGRA,   // BGRA_8888
+};
+
+static GRFastFormat gr_fast_format = GR_FAST_NONE;
+// Current color packed in the draw surface's format
+static uint32_t gr_current_px = 0xffffffff;
+
+struct GRRect
+{
+    int x0, y0, x1, y1;
+};
+
+// Current scissor rectangle, mirrored for the fast paths
+static GRRect gr_clip_rect = { 0, 0, 0, 0 };
+
 #if 0 // unused
 static bool outside(int x, int y)
 {
@@ -138,6 +180,11 @@ void gr_clip(int x, int y, int w, int h)
     GGLContext *gl = gr_context;
     gl->scissor(gl, x, y, w, h);
     gl->enable(gl, GGL_SCISSOR_TEST);
+
+    gr_clip_rect.x0 = std::max(x, 0);
+    gr_clip_rect.y0 = std::max(y, 0);
+    gr_clip_rect.x1 = std::min(x + w, (int) gr_draw->width);
+    gr_clip_rect.y1 = std::min(y + h, (int) gr_draw->height);
 }
 
 void gr_noclip()
@@ -145,6 +192,44 @@ void gr_noclip()
     GGLContext *gl = gr_context;
     gl->scissor(gl, 0, 0, gr_fb_width(), gr_fb_height());
     gl->disable(gl, GGL_SCISSOR_TEST);
+
+    gr_clip_rect = { 0, 0, (int) gr_draw->width, (int) gr_draw->height };
+}
+
+// Clip a destination rectangle against the scissor rectangle. Returns false if
+// nothing is left to draw.
+static bool gr_fast_clip(GRRect *r)
+{
+    r->x0 = std::max(r->x0, gr_clip_rect.x0);
+    r->y0 = std::max(r->y0, gr_clip_rect.y0);
+    r->x1 = std::min(r->x1, gr_clip_rect.x1);
+    r->y1 = std::min(r->y1, gr_clip_rect.y1);
+    return r->x0 < r->x1 && r->y0 < r->y1;
+}
+
+static inline uint32_t * gr_fast_row(int x, int y)
+{
+    return reinterpret_cast<uint32_t *>(gr_draw->data + y * gr_draw->row_bytes)
+            + x;
+}
+
+bool gr_fast_blit_mask(const unsigned char *mask, int stride,
+                       int x, int y, int w, int h)
+{
+    if (gr_fast_format == GR_FAST_NONE) {
+        return false;
+    }
+
+    GRRect r = { x, y, x + w, y + h };
+    if (gr_fast_clip(&r)) {
+        for (int dy = r.y0; dy < r.y1; ++dy) {
+            blend_mask(gr_fast_row(r.x0, dy),
+                       mask + (dy - y) * stride + (r.x0 - x),
+                       gr_current_px, r.x1 - r.x0);
+        }
+    }
+
+    return true;
 }
 
 void gr_line(int x0, int y0, int x1, int y1, int width)
@@ -201,12 +286,14 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
 {
     GGLContext *gl = gr_context;
     GGLint color[4];
+    bool swap_rb = false;
     if (tw_device.tw_pixel_format() == mb::device::TwPixelFormat::Abgr8888
             || tw_device.tw_pixel_format() == mb::device::TwPixelFormat::Bgra8888) {
         color[0] = ((b << 8) | r) + 1;
         color[1] = ((g << 8) | g) + 1;
         color[2] = ((r << 8) | b) + 1;
         color[3] = ((a << 8) | a) + 1;
+        swap_rb = true;
     } else {
         color[0] = ((r << 8) | r) + 1;
         color[1] = ((g << 8) | g) + 1;
@@ -216,6 +303,16 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     gl->color4xv(gl, color);
 
     gr_is_curr_clr_opaque = (a == 255);
+
+    // Same bytes pixelflinger would write for this color
+    if (gr_fast_format == GR_FAST_BGRA) {
+        swap_rb = !swap_rb;
+    }
+    if (swap_rb) {
+        std::swap(r, b);
+    }
+    gr_current_px = (uint32_t) a << 24 | (uint32_t) b << 16
+            | (uint32_t) g << 8 | r;
 }
 
 void gr_clear()
@@ -246,6 +343,22 @@ void gr_fill(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
 
+    if (gr_fast_format != GR_FAST_NONE) {
+        GRRect r = { x, y, x + w, y + h };
+        if (gr_fast_clip(&r)) {
+            for (int dy = r.y0; dy < r.y1; ++dy) {
+                if (gr_is_curr_clr_opaque) {
+                    blend_fill(gr_fast_row(r.x0, dy), gr_current_px,
+                               r.x1 - r.x0);
+                } else {
+                    blend_fill_alpha(gr_fast_row(r.x0, dy), gr_current_px,
+                                     r.x1 - r.x0);
+                }
+            }
+        }
+        return;
+    }
+
     if (gr_is_curr_clr_opaque) {
         gl->disable(gl, GGL_BLEND);
     }
@@ -266,6 +379,33 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
     GGLContext *gl = gr_context;
     GGLSurface *surface = (GGLSurface*)source;
 
+    if (gr_fast_format != GR_FAST_NONE
+            && (surface->format == GGL_PIXEL_FORMAT_RGBA_8888
+            || surface->format == GGL_PIXEL_FORMAT_RGBX_8888)) {
+        // Destination rectangle, limited to the source surface's bounds
+        GRRect r = {
+            std::max(dx, dx - sx),
+            std::max(dy, dy - sy),
+            std::min(dx + w, dx - sx + (int) surface->width),
+            std::min(dy + h, dy - sy + (int) surface->height),
+        };
+        bool swap = gr_fast_format == GR_FAST_BGRA;
+
+        if (gr_fast_clip(&r)) {
+            for (int y = r.y0; y < r.y1; ++y) {
+                const uint32_t *src = reinterpret_cast<uint32_t *>(
+                        surface->data) + (y - dy + sy) * surface->stride
+                        + (r.x0 - dx + sx);
+                if (surface->format == GGL_PIXEL_FORMAT_RGBX_8888) {
+                    blend_copy(gr_fast_row(r.x0, y), src, r.x1 - r.x0, swap);
+                } else {
+                    blend_over(gr_fast_row(r.x0, y), src, r.x1 - r.x0, swap);
+                }
+            }
+        }
+        return;
+    }
+
     if (surface->format == GGL_PIXEL_FORMAT_RGBX_8888) {
         gl->disable(gl, GGL_BLEND);
     }
@@ -300,9 +440,100 @@ unsigned int gr_get_height(gr_surface surface)
     return ((GGLSurface*) surface)->height;
 }
 
+void gr_damage(int x, int y, int w, int h)
+{
+    GRDamage *d = &gr_cur_damage;
+
+    int x0 = std::max(x, 0);
+    int y0 = std::max(y, 0);
+    int x1 = std::min<int>(x + w, gr_draw->width);
+    int y1 = std::min<int>(y + h, gr_draw->height);
+
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
+
+    if (d->empty) {
+        d->x0 = x0;
+        d->y0 = y0;
+        d->x1 = x1;
+        d->y1 = y1;
+        d->empty = false;
+    } else {
+        d->x0 = std::min(d->x0, x0);
+        d->y0 = std::min(d->y0, y0);
+        d->x1 = std::max(d->x1, x1);
+        d->y1 = std::max(d->y1, y1);
+    }
+}
+
+void gr_damage_all()
+{
+    gr_cur_damage.full = true;
+}
+
+// Returns 0 and the area that must be redrawn and flushed if only part of the
+// screen changed or -1 if the whole screen must be redrawn
+int gr_get_damage(int *x, int *y, int *w, int *h)
+{
+    const GRDamage *cur = &gr_cur_damage;
+
+    if (cur->full || cur->empty) {
+        return -1;
+    }
+
+    int x0 = cur->x0;
+    int y0 = cur->y0;
+    int x1 = cur->x1;
+    int y1 = cur->y1;
+
+    unsigned int buffers = gr_backend->buffer_count;
+    if (buffers < 2) {
+        buffers = 2;
+    } else if (buffers > GR_MAX_BUFFERS) {
+        buffers = GR_MAX_BUFFERS;
+    }
+
+    for (unsigned int i = 0; i < buffers - 1; ++i) {
+        const GRDamage *prev = &gr_prev_damage[i];
+
+        if (prev->full) {
+            return -1;
+        } else if (!prev->empty) {
+            x0 = std::min(x0, prev->x0);
+            y0 = std::min(y0, prev->y0);
+            x1 = std::max(x1, prev->x1);
+            y1 = std::max(y1, prev->y1);
+        }
+    }
+
+    *x = x0;
+    *y = y0;
+    *w = x1 - x0;
+    *h = y1 - y0;
+    return 0;
+}
+
 void gr_flip()
 {
-    gr_draw = gr_backend->flip(gr_backend);
+    int x, y, w, h;
+
+    if (gr_backend->flip_damage && gr_get_damage(&x, &y, &w, &h) == 0) {
+        gr_draw = gr_backend->flip_damage(gr_backend, x, y, w, h);
+    } else {
+        gr_draw = gr_backend->flip(gr_backend);
+    }
+
+    // A flip without reported damage flushes everything
+    for (int i = GR_MAX_BUFFERS - 2; i > 0; --i) {
+        gr_prev_damage[i] = gr_prev_damage[i - 1];
+    }
+    gr_prev_damage[0] = gr_cur_damage;
+    if (gr_prev_damage[0].empty) {
+        gr_prev_damage[0].full = true;
+    }
+    gr_cur_damage = { false, true, 0, 0, 0, 0 };
+
     // On double buffered back ends, when we flip, we need to tell
     // pixel flinger to draw to the other buffer
     gr_mem_surface.data = (GGLubyte*)gr_draw->data;
@@ -370,6 +601,19 @@ int gr_init(void)
     gl->enable(gl, GGL_BLEND);
     gl->blendFunc(gl, GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA);
 
+    // Select the fast paths for the pixel format chosen by the backend (from
+    // the device's boot UI pixel format)
+    if (gr_draw->pixel_bytes == 4) {
+        if (gr_draw->format == GGL_PIXEL_FORMAT_BGRA_8888) {
+            gr_fast_format = GR_FAST_BGRA;
+        } else if (gr_draw->format == GGL_PIXEL_FORMAT_RGBA_8888
+                || gr_draw->format == GGL_PIXEL_FORMAT_RGBX_8888) {
+            gr_fast_format = GR_FAST_RGBA;
+        }
+    }
+    gr_noclip();
+    gr_color(255, 255, 255, 255);
+
     gr_flip();
     gr_flip();
 
@@ -35,6 +35,21 @@ struct minui_backend
 
     // Device cleanup when drawing is done.
     void (*exit)(minui_backend*);
+
+    // Like flip(), but only the given rectangle of the drawing surface has
+    // changed in the last buffer_count frames. May be null, in which case flip() is
+    // always used.
+    GRSurface* (*flip_damage)(minui_backend*, int x, int y, int w, int h);
+
+    // Number of buffers the backend cycles through, ie. how many frames old
+    // the surface returned by flip() is. 0 means double buffered.
+    unsigned int buffer_count;
 };
 
+// Composite an 8-bit coverage mask (eg. rendered text) in the current color
+// onto the draw surface at (x, y). Returns false if the draw surface's pixel
+// format has no fast path, in which case pixelflinger must be used instead.
+bool gr_fast_blit_mask(const unsigned char *mask, int stride,
+                       int x, int y, int w, int h);
+
 #endif
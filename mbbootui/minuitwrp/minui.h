@@ -51,6 +51,12 @@ gr_pixel *gr_fb_data(void);
 void gr_flip(void);
 void gr_fb_blank(bool blank);
 
+// Damage tracking for partial redraws. If nothing is reported before a flip,
+// the whole screen is flushed.
+void gr_damage(int x, int y, int w, int h);
+void gr_damage_all(void);
+int gr_get_damage(int *x, int *y, int *w, int *h);
+
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_clip(int x, int y, int w, int h);
 void gr_noclip();
@@ -86,8 +92,15 @@ struct input_event;
 
 int ev_init(void);
 void ev_exit(void);
+// Events are timestamped with CLOCK_MONOTONIC. Touch drags that arrive in the
+// same read() batch are coalesced into the most recent one.
 int ev_get(struct input_event *ev, int timeout_ms);
 int ev_has_mouse(void);
+// For callers running their own poll/epoll loop: copies up to max input device
+// fds into fds and returns the count. The set changes whenever ev_get() reloads
+// the devices, which bumps the value returned by ev_generation().
+unsigned ev_get_fds(int *fds, unsigned max);
+unsigned ev_generation(void);
 
 // Resources
 
@@ -38,6 +38,7 @@ extern "C" {
 #endif
 #include "config/config.hpp"
 #include "minui.h"
+#include "blend.h"
 
 #define SURFACE_DATA_ALIGNMENT 8
 
@@ -421,6 +422,18 @@ int res_scale_surface(gr_surface source, gr_surface* destination, float scale_w,
     }
     sc_mem_surface->format = surface->format;
 
+    if (surface->format == GGL_PIXEL_FORMAT_RGBA_8888
+            || surface->format == GGL_PIXEL_FORMAT_RGBX_8888) {
+        blend_scale_bilinear((uint32_t *) sc_mem_surface->data,
+                             sc_mem_surface->width, sc_mem_surface->height,
+                             sc_mem_surface->stride,
+                             (const uint32_t *) surface->data, w, h,
+                             surface->stride);
+        *destination = (gr_surface*) sc_mem_surface;
+        res_free_surface(source);
+        return 0;
+    }
+
     // Initialize the context
     gglInit(&gl);
     gl->colorBuffer(gl, sc_mem_surface);
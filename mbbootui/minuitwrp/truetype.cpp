@@ -6,6 +6,7 @@
 #include <stdio.h>
 
 #include "minui.h"
+#include "graphics.h"
 
 #include <cutils/hashmap.h>
 #include <ft2build.h>
@@ -15,8 +16,14 @@
 #include <pixelflinger/pixelflinger.h>
 #include <pthread.h>
 
-#define STRING_CACHE_MAX_ENTRIES 400
-#define STRING_CACHE_TRUNCATE_ENTRIES 150
+// String cache entries only hold glyph positions, so many more can be kept
+// than when each one had its own rendered surface
+#define STRING_CACHE_MAX_ENTRIES 2000
+#define STRING_CACHE_TRUNCATE_ENTRIES 500
+
+// Memory bound for the rendered glyph bitmaps of each font (face and size).
+// The least recently used glyphs are evicted first.
+#define GLYPH_CACHE_MAX_BYTES (512 * 1024)
 
 typedef struct
 {
@@ -35,6 +42,9 @@ typedef struct
     int base;
     FT_Face face;
     Hashmap *glyph_cache;
+    struct TrueTypeCacheEntry *glyph_cache_head;
+    struct TrueTypeCacheEntry *glyph_cache_tail;
+    size_t glyph_cache_bytes;
     Hashmap *string_cache;
     struct StringCacheEntry *string_cache_head;
     struct StringCacheEntry *string_cache_tail;
@@ -42,11 +52,17 @@ typedef struct
     TrueTypeFontKey *key;
 } TrueTypeFont;
 
-typedef struct
+struct TrueTypeCacheEntry
 {
     FT_BBox bbox;
     FT_BitmapGlyph glyph;
-} TrueTypeCacheEntry;
+    int *key;
+    size_t bytes;
+    struct TrueTypeCacheEntry *prev;
+    struct TrueTypeCacheEntry *next;
+};
+
+typedef struct TrueTypeCacheEntry TrueTypeCacheEntry;
 
 typedef struct
 {
@@ -54,9 +70,17 @@ typedef struct
     int max_width;
 } StringCacheKey;
 
+typedef struct
+{
+    int char_idx;
+    int x; // pen position relative to the start of the string
+} StringCacheGlyph;
+
 struct StringCacheEntry
 {
-    GGLSurface surface;
+    int width;
+    int glyph_count;
+    StringCacheGlyph *glyphs;
     int rendered_bytes; // number of bytes from C string rendered, not number of UTF8 characters!
     StringCacheKey *key;
     struct StringCacheEntry *prev;
@@ -287,7 +311,7 @@ static bool gr_ttf_freeStringCache(void *key, void *value, void *context __unuse
     free(k);
 
     StringCacheEntry *e = (StringCacheEntry *)value;
-    free(e->surface.data);
+    free(e->glyphs);
     free(e);
     return true;
 }
@@ -326,6 +350,34 @@ static TrueTypeCacheEntry *gr_ttf_glyph_cache_peek(TrueTypeFont *font, int char_
     return (TrueTypeCacheEntry *)hashmapGet(font->glyph_cache, &char_index);
 }
 
+static void gr_ttf_glyph_cache_unlink(TrueTypeFont *font, TrueTypeCacheEntry *e)
+{
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        font->glyph_cache_head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        font->glyph_cache_tail = e->prev;
+    }
+    e->prev = e->next = nullptr;
+}
+
+static void gr_ttf_glyph_cache_append(TrueTypeFont *font, TrueTypeCacheEntry *e)
+{
+    e->prev = font->glyph_cache_tail;
+    e->next = nullptr;
+    if (font->glyph_cache_tail) {
+        font->glyph_cache_tail->next = e;
+    } else {
+        font->glyph_cache_head = e;
+    }
+    font->glyph_cache_tail = e;
+}
+
+// The returned entry is only valid until the next call, which may evict it
 static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_index)
 {
     TrueTypeCacheEntry *res = (TrueTypeCacheEntry *)hashmapGet(font->glyph_cache, &char_index);
@@ -346,42 +398,72 @@ static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_i
         res = (TrueTypeCacheEntry *)malloc(sizeof(TrueTypeCacheEntry));
         memset(res, 0, sizeof(TrueTypeCacheEntry));
         res->glyph = glyph;
+        res->bytes = sizeof(TrueTypeCacheEntry)
+                + glyph->bitmap.rows * abs(glyph->bitmap.pitch);
         FT_Glyph_Get_CBox((FT_Glyph)glyph, FT_GLYPH_BBOX_PIXELS, &res->bbox);
 
+        // Evict least recently used glyphs to stay within the memory bound
+        while (font->glyph_cache_head
+                && font->glyph_cache_bytes + res->bytes > GLYPH_CACHE_MAX_BYTES) {
+            TrueTypeCacheEntry *old = font->glyph_cache_head;
+            gr_ttf_glyph_cache_unlink(font, old);
+            hashmapRemove(font->glyph_cache, old->key);
+            font->glyph_cache_bytes -= old->bytes;
+            gr_ttf_freeFontCache(old->key, old, nullptr);
+        }
+
         int *key = (int *)malloc(sizeof(int));
         *key = char_index;
+        res->key = key;
 
         hashmapPut(font->glyph_cache, key, res);
+        gr_ttf_glyph_cache_append(font, res);
+        font->glyph_cache_bytes += res->bytes;
+    } else if (res != font->glyph_cache_tail) {
+        gr_ttf_glyph_cache_unlink(font, res);
+        gr_ttf_glyph_cache_append(font, res);
     }
 
     return res;
 }
 
-static int gr_ttf_copy_glyph_to_surface(GGLSurface *dest, FT_BitmapGlyph glyph, int offX, int offY, int base)
+// Composite the part of a glyph bitmap at (gx, gy) that lies within the
+// (x0, y0)-(x1, y1) rectangle in the current color
+static void gr_ttf_draw_glyph(GGLContext *gl, FT_BitmapGlyph glyph, int gx, int gy,
+                              int x0, int y0, int x1, int y1)
 {
-    unsigned y;
-    uint8_t *src_itr = glyph->bitmap.buffer;
-    uint8_t *dest_itr = dest->data;
-
     if (glyph->bitmap.pixel_mode != FT_PIXEL_MODE_GRAY) {
         fprintf(stderr, "Unsupported pixel mode in FT_BitmapGlyph %d\n", glyph->bitmap.pixel_mode);
-        return -1;
+        return;
     }
 
-    dest_itr += (offY + base - glyph->top)*dest->stride + (offX + glyph->left);
-
-    // FIXME: if glyph->left is negative and everything else is 0 (e.g. letter 'j' in Roboto-Regular),
-    // the result might end up being before the buffer - I'm not sure how to properly handle this.
-    if (dest_itr < dest->data) {
-        dest_itr = dest->data;
+    int rx0 = MAX(gx, x0);
+    int ry0 = MAX(gy, y0);
+    int rx1 = MIN(gx + (int) glyph->bitmap.width, x1);
+    int ry1 = MIN(gy + (int) glyph->bitmap.rows, y1);
+    if (rx0 >= rx1 || ry0 >= ry1) {
+        return;
     }
 
-    for (y = 0; y < glyph->bitmap.rows; ++y) {
-        memcpy(dest_itr, src_itr, glyph->bitmap.width);
-        src_itr += glyph->bitmap.pitch;
-        dest_itr += dest->stride;
+    int pitch = glyph->bitmap.pitch;
+    unsigned char *mask = glyph->bitmap.buffer + (ry0 - gy) * pitch + (rx0 - gx);
+
+    if (gr_fast_blit_mask(mask, pitch, rx0, ry0, rx1 - rx0, ry1 - ry0)) {
+        return;
     }
-    return 0;
+
+    GGLSurface texture;
+    memset(&texture, 0, sizeof(texture));
+    texture.version = sizeof(texture);
+    texture.width = rx1 - rx0;
+    texture.height = ry1 - ry0;
+    texture.stride = pitch;
+    texture.data = (GGLubyte*)mask;
+    texture.format = GGL_PIXEL_FORMAT_A_8;
+
+    gl->bindTexture(gl, &texture);
+    gl->texCoord2i(gl, -rx0, -ry0);
+    gl->recti(gl, rx0, ry0, rx1, ry1);
 }
 
 static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
@@ -435,8 +517,9 @@ static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
     f->base += f->size / 4;
 }
 
-// returns number of bytes from const char *text rendered to fit max_width, not number of UTF8 characters!
-static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const char *text, int max_width)
+// Lay out the glyphs of text. Returns number of bytes from const char *text
+// that fit within max_width, not number of UTF8 characters!
+static int gr_ttf_layout_text(TrueTypeFont *font, StringCacheEntry *entry, const char *text, int max_width)
 {
     TrueTypeFont *f = font;
     TrueTypeCacheEntry *ent;
@@ -444,9 +527,7 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
     int utf_bytes = 0;
     unsigned int unicode = 0;
     int i, x, diff, char_idx, prev_idx = 0;
-    int height;
     FT_Vector delta;
-    uint8_t *data = nullptr;
     const char *text_itr = text;
     int *char_idxs;
     int char_idxs_len = 0;
@@ -489,19 +570,12 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
         return -1;
     }
 
-    height = font->max_height;
-
-    data = (uint8_t *) malloc(total_w*height);
-    memset(data, 0, total_w*height);
     x = 0;
     prev_idx = 0;
 
-    surface->version = sizeof(*surface);
-    surface->width = total_w;
-    surface->height = height;
-    surface->stride = total_w;
-    surface->data = (GGLubyte*)data;
-    surface->format = GGL_PIXEL_FORMAT_A_8;
+    entry->width = total_w;
+    entry->glyph_count = 0;
+    entry->glyphs = (StringCacheGlyph *) malloc(MAX(char_idxs_len, 1) * sizeof(StringCacheGlyph));
 
     for (i = 0; i < char_idxs_len; ++i) {
         char_idx = char_idxs[i];
@@ -512,7 +586,9 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
 
         ent = gr_ttf_glyph_cache_get(f, char_idx);
         if (ent) {
-            gr_ttf_copy_glyph_to_surface(surface, ent->glyph, x, 0, font->base);
+            entry->glyphs[entry->glyph_count].char_idx = char_idx;
+            entry->glyphs[entry->glyph_count].x = x;
+            ++entry->glyph_count;
             x += ent->glyph->root.advance.x >> 16;
         }
 
@@ -543,10 +619,31 @@ static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char
 
     res = (StringCacheEntry *)hashmapGet(font->string_cache, &k);
     if (!res) {
+        // truncate old entries
+        if (hashmapSize(font->string_cache) >= STRING_CACHE_MAX_ENTRIES) {
+            printf("Truncating string cache entries.\n");
+            int i;
+            StringCacheEntry *ent;
+            for (i = 0; i < STRING_CACHE_TRUNCATE_ENTRIES && font->string_cache_head; ++i) {
+                ent = font->string_cache_head;
+                font->string_cache_head = ent->next;
+                if (font->string_cache_head) {
+                    font->string_cache_head->prev = nullptr;
+                } else {
+                    font->string_cache_tail = nullptr;
+                }
+
+                hashmapRemove(font->string_cache, ent->key);
+
+                gr_ttf_freeStringCache(ent->key, ent, nullptr);
+            }
+        }
+
         res = (StringCacheEntry *)malloc(sizeof(StringCacheEntry));
         memset(res, 0, sizeof(StringCacheEntry));
-        res->rendered_bytes = gr_ttf_render_text(font, &res->surface, text, max_width);
+        res->rendered_bytes = gr_ttf_layout_text(font, res, text, max_width);
         if (res->rendered_bytes < 0) {
+            free(res->glyphs);
             free(res);
             return nullptr;
         }
@@ -584,22 +681,6 @@ static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char
         res->prev = font->string_cache_tail;
         res->prev->next = res;
         font->string_cache_tail = res;
-
-        // truncate old entries
-        if (hashmapSize(font->string_cache) >= STRING_CACHE_MAX_ENTRIES) {
-            printf("Truncating string cache entries.\n");
-            int i;
-            StringCacheEntry *ent;
-            for (i = 0; i < STRING_CACHE_TRUNCATE_ENTRIES; ++i) {
-                ent = font->string_cache_head;
-                font->string_cache_head = ent->next;
-                font->string_cache_head->prev = nullptr;
-
-                hashmapRemove(font->string_cache, ent->key);
-
-                gr_ttf_freeStringCache(ent->key, ent, nullptr);
-            }
-        }
     }
     return res;
 }
@@ -612,7 +693,7 @@ int gr_ttf_measureEx(const char *s, void *font)
     pthread_mutex_lock(&f->mutex);
     StringCacheEntry *e = gr_ttf_string_cache_get(f, s, -1);
     if (e) {
-        res = e->surface.width;
+        res = e->width;
     }
     pthread_mutex_unlock(&f->mutex);
 
@@ -689,7 +770,7 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
         return -1;
     }
 
-    int y_bottom = y + e->surface.height;
+    int y_bottom = y + font->max_height;
     int res = e->rendered_bytes;
 
     if (max_height != -1 && max_height < y_bottom) {
@@ -700,14 +781,22 @@ int gr_ttf_textExWH(void *context, int x, int y, const char *s, void *pFont, int
         }
     }
 
-    gl->bindTexture(gl, &e->surface);
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
-
     gl->enable(gl, GGL_TEXTURE_2D);
-    gl->texCoord2i(gl, -x, -y);
-    gl->recti(gl, x, y, x + e->surface.width, y_bottom);
+
+    // Glyphs are composited straight from the glyph cache
+    for (int i = 0; i < e->glyph_count; ++i) {
+        TrueTypeCacheEntry *ent = gr_ttf_glyph_cache_get(font, e->glyphs[i].char_idx);
+        if (ent) {
+            gr_ttf_draw_glyph(gl, ent->glyph,
+                              x + e->glyphs[i].x + ent->glyph->left,
+                              y + font->base - ent->glyph->top,
+                              x, y, x + e->width, y_bottom);
+        }
+    }
+
     gl->disable(gl, GGL_TEXTURE_2D);
 
     pthread_mutex_unlock(&font->mutex);
@@ -734,7 +823,7 @@ static bool gr_ttf_dump_stats_count_string_cache(void *key __unused, void *value
 {
     int *string_cache_size = (int *) context;
     StringCacheEntry *e = (StringCacheEntry *) value;
-    *string_cache_size += e->surface.height*e->surface.width + sizeof(StringCacheEntry);
+    *string_cache_size += e->glyph_count * sizeof(StringCacheGlyph) + sizeof(StringCacheEntry);
     return true;
 }
 
@@ -753,11 +842,11 @@ static bool gr_ttf_dump_stats_font(void *key, void *value, void *context)
            "    refcount: %d\n"
            "    max_height: %d\n"
            "    base: %d\n"
-           "    glyph_cache: %zu entries\n"
+           "    glyph_cache: %zu entries (%.2f kB)\n"
            "    string_cache: %zu entries (%.2f kB)\n",
            k->path, k->size, k->dpi,
            f->refcount, f->max_height, f->base,
-           hashmapSize(f->glyph_cache),
+           hashmapSize(f->glyph_cache), ((double)f->glyph_cache_bytes)/1024,
            hashmapSize(f->string_cache), ((double)string_cache_size)/1024);
 
     pthread_mutex_unlock(&f->mutex);
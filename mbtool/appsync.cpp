@@ -20,16 +20,22 @@
 #include "appsync.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
-#include <cassert>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -42,17 +48,21 @@
 #include "mbcommon/common.h"
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
+#include "mblog/async_logger.h"
 #include "mblog/logging.h"
 #include "mblog/stdio_logger.h"
+#include "mbutil/autoclose/dir.h"
 #include "mbutil/autoclose/file.h"
 #include "mbutil/chown.h"
 #include "mbutil/command.h"
 #include "mbutil/copy.h"
+#include "mbutil/counters.h"
 #include "mbutil/delete.h"
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/fts.h"
+#include "mbutil/hash.h"
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
 #include "mbutil/socket.h"
@@ -62,6 +72,7 @@
 #include "appsyncmanager.h"
 #include "multiboot.h"
 #include "packages.h"
+#include "rom_metadata.h"
 #include "romconfig.h"
 #include "roms.h"
 
@@ -80,12 +91,15 @@
 #define INSTALLD_SOCKET_CONTEXT         "u:object_r:installd_socket:s0"
 
 #define COMMAND_BUF_SIZE                1024
+// Maximum number of bytes to read from a socket at once
+#define MESSAGE_READ_SIZE               4096
 
 #define PACKAGES_XML_PATH_FMT           "%s/system/packages.xml"
 
 namespace mb
 {
 
+static std::shared_ptr<Rom> this_rom;
 static RomConfig config;
 static Packages packages;
 
@@ -105,8 +119,11 @@ static bool load_config_files()
     Roms roms;
     roms.add_installed();
 
-    for (const std::shared_ptr<Rom> &rom : roms.roms) {
-        std::string config_path = rom->config_path();
+    std::vector<RomMetadata> metadata;
+    rom_metadata_get_all(roms.roms, metadata);
+
+    for (size_t i = 0; i < roms.roms.size(); ++i) {
+        const std::shared_ptr<Rom> &rom = roms.roms[i];
         std::string packages_path = mb::format(PACKAGES_XML_PATH_FMT,
                                                rom->full_data_path().c_str());
 
@@ -116,9 +133,11 @@ static bool load_config_files()
         RomConfig &rom_config = cfg_pkgs_list.back().config;
         Packages &rom_packages = cfg_pkgs_list.back().packages;
 
-        if (!rom_config.load_file(config_path)) {
+        if (metadata[i].has_config) {
+            rom_config = std::move(metadata[i].config);
+        } else {
             LOGW("%s: Failed to load config for ROM %s",
-                 config_path.c_str(), rom->id.c_str());
+                 rom->config_path().c_str(), rom->id.c_str());
         }
         if (!rom_packages.load_xml(packages_path)) {
             LOGW("%s: Failed to load packages for ROM %s",
@@ -126,6 +145,7 @@ static bool load_config_files()
         }
 
         if (rom->id == current_rom->id) {
+            this_rom = rom;
             config = rom_config;
             packages = rom_packages;
         }
@@ -135,6 +155,10 @@ static bool load_config_files()
     LOGD("[Config] ROM Name:                  %s", config.name.c_str());
     LOGD("[Config] Individual app sharing:    %s",
          config.indiv_app_sharing ? "true" : "false");
+    LOGD("[Config] Shared APK store:          %s",
+         config.shared_apks ? "true" : "false");
+    LOGD("[Config] Shared oat cache:          %s",
+         config.shared_oat ? "true" : "false");
 
     for (const SharedPackage &pkg : config.shared_pkgs) {
         LOGD("[Config] Shared package:");
@@ -157,6 +181,10 @@ static bool prepare_appsync()
 
     uint64_t start = util::current_time_ms(), stop;
 
+    // Plan all of the shared data directories up front
+    std::vector<SharedDataDirectory> dirs;
+    std::vector<SharedPackage *> dir_pkgs;
+
     for (auto it = config.shared_pkgs.begin();
             it != config.shared_pkgs.end();) {
         SharedPackage &shared_pkg = *it;
@@ -170,25 +198,29 @@ static bool prepare_appsync()
             continue;
         }
 
-        // Ensure that the data directory exists if data sharing is enabled
-        if (shared_pkg.share_data
-                && !AppSyncManager::create_shared_data_directory(
-                        shared_pkg.pkg_id, pkg->get_uid())) {
-            LOGW("Failed to create shared data directory for package %s. "
-                 "App data will not be shared", shared_pkg.pkg_id.c_str());
-            shared_pkg.share_data = false;
+        // Erasing only moves later elements, so earlier pointers stay valid
+        if (shared_pkg.share_data) {
+            dirs.push_back({ pkg->name, pkg->get_uid(), false });
+            dir_pkgs.push_back(&shared_pkg);
         }
 
         ++it;
     }
 
-    // Ensure that the shared data is under the u:object_r:app_data_file:s0
-    // context. Otherwise, apps won't be able to write to the shared directory
-    bool disable_data_sharing = false;
-    if (!AppSyncManager::fix_shared_data_permissions()) {
+    // Ensure that the data directories exist and that the shared data is under
+    // the u:object_r:app_data_file:s0 context. Otherwise, apps won't be able to
+    // write to the shared directory
+    if (!AppSyncManager::prepare_shared_data_directories(dirs)) {
         LOGW("Failed to fix permissions on shared data directory");
         LOGW("Data sharing will be disabled for all packages");
-        disable_data_sharing = true;
+    }
+
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        if (!dirs[i].ok) {
+            LOGW("Failed to prepare shared data directory for package %s. "
+                 "App data will not be shared", dirs[i].pkg.c_str());
+            dir_pkgs[i]->share_data = false;
+        }
     }
 
     stop = util::current_time_ms();
@@ -197,17 +229,13 @@ static bool prepare_appsync()
     start = util::current_time_ms();
 
     // Actually share the data
-    for (SharedPackage &shared_pkg : config.shared_pkgs) {
-        auto pkg = packages.find_by_pkg(shared_pkg.pkg_id);
+    AppSyncManager::mount_shared_directories(dirs);
 
-        if (disable_data_sharing) {
-            shared_pkg.share_data = false;
-        }
-
-        if (shared_pkg.share_data && !AppSyncManager::mount_shared_directory(
-                pkg->name, pkg->get_uid())) {
-            LOGW("Failed to mount shared data directory");
-            shared_pkg.share_data = false;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        if (dir_pkgs[i]->share_data && !dirs[i].ok) {
+            LOGW("[%s] Failed to mount shared data directory",
+                 dirs[i].pkg.c_str());
+            dir_pkgs[i]->share_data = false;
         }
     }
 
@@ -217,6 +245,237 @@ static bool prepare_appsync()
     return true;
 }
 
+static const char * abi_to_isa(const std::string &abi)
+{
+    if (starts_with(abi, "arm64")) {
+        return "arm64";
+    } else if (starts_with(abi, "armeabi")) {
+        return "arm";
+    } else if (abi == "x86_64") {
+        return "x86_64";
+    } else if (abi == "x86") {
+        return "x86";
+    } else if (abi == "mips64") {
+        return "mips64";
+    } else if (abi == "mips") {
+        return "mips";
+    }
+    return nullptr;
+}
+
+/*!
+ * \brief Exchange compiled dex artifacts of shared APKs with the oat cache
+ *
+ * The cache key of each artifact covers the ISA, the SHA512 digest of the
+ * ROM's boot image for that ISA, and the path of the artifact. ROMs built from
+ * the same base have identical boot images, so their artifacts can be reused
+ * as long as the app is installed to the same path.
+ *
+ * \param data_path Raw path of the current ROM's data directory
+ */
+static void share_oat_files(const std::string &data_path)
+{
+    uint64_t start = util::current_time_ms(), stop;
+
+    int sdk = util::property_get_snum<int>("ro.build.version.sdk", 0);
+    if (sdk < 21) {
+        LOGD("Not sharing oat files on a non-ART ROM");
+        return;
+    }
+
+    std::string default_abi = util::property_get_string(
+            "ro.product.cpu.abi", {});
+
+    // Fingerprint the boot image of each ISA the ROM supports
+    static const char *isas[] = {
+        "arm", "arm64", "mips", "mips64", "x86", "x86_64"
+    };
+    std::vector<std::string> boot_images;
+    std::vector<std::string> boot_isas;
+
+    for (const char *isa : isas) {
+        std::string path = format("/system/framework/%s/boot.art", isa);
+        if (access(path.c_str(), R_OK) == 0) {
+            boot_images.push_back(std::move(path));
+            boot_isas.push_back(isa);
+        }
+    }
+
+    std::vector<util::Sha512Digest> digests;
+    if (boot_images.empty()
+            || !util::sha512_hash_files(boot_images, digests)) {
+        LOGW("Failed to fingerprint boot images; not sharing oat files");
+        return;
+    }
+
+    std::unordered_map<std::string, std::string> boot_fingerprints;
+    for (size_t i = 0; i < boot_isas.size(); ++i) {
+        boot_fingerprints[boot_isas[i]] =
+                util::hex_string(digests[i].data(), digests[i].size());
+    }
+
+    std::vector<SharedOatFile> files;
+
+    auto add_file = [&](const std::string &apk_path, const std::string &isa,
+                        const std::string &path, gid_t gid) {
+        std::string ident(isa);
+        ident += '\0';
+        ident += boot_fingerprints[isa];
+        ident += '\0';
+        ident += path;
+
+        unsigned char digest[SHA512_DIGEST_LENGTH];
+        SHA512(reinterpret_cast<const unsigned char *>(ident.data()),
+               ident.size(), digest);
+
+        std::string raw_path(data_path);
+        raw_path += path.substr(5);
+
+        // Identify by the first 128 bits of the digest to keep names short
+        files.push_back({ apk_path, std::move(raw_path),
+                          util::hex_string(digest, 16), gid });
+    };
+
+    for (auto const &pkg : packages.pkgs) {
+        // Pre-Lollipop single file installs aren't compiled by ART
+        if (!starts_with(pkg->code_path, "/data/app/")
+                || ends_with(pkg->code_path, ".apk")) {
+            continue;
+        }
+
+        const char *isa = abi_to_isa(pkg->primary_cpu_abi.empty()
+                ? default_abi : pkg->primary_cpu_abi);
+        if (!isa || boot_fingerprints.find(isa) == boot_fingerprints.end()) {
+            continue;
+        }
+
+        std::string apk_path(data_path);
+        apk_path += pkg->code_path.substr(5);
+        apk_path += "/base.apk";
+
+        gid_t gid = pkg->get_uid();
+
+        if (sdk >= 24) {
+            // Nougat and newer store artifacts next to the APK
+            std::string oat_path = format("%s/oat/%s/base.",
+                                          pkg->code_path.c_str(), isa);
+            add_file(apk_path, isa, oat_path + "odex", gid);
+            if (sdk >= 26) {
+                add_file(apk_path, isa, oat_path + "vdex", gid);
+            }
+        } else {
+            // Lollipop and Marshmallow store them in the dalvik-cache
+            std::string name = pkg->code_path.substr(1) + "/base.apk";
+            std::replace(name.begin(), name.end(), '/', '@');
+            add_file(apk_path, isa,
+                     format("/data/dalvik-cache/%s/%s@classes.dex",
+                            isa, name.c_str()), gid);
+        }
+    }
+
+    // Wiping the dalvik-cache removes the ISA directories, which ART would
+    // only recreate at startup
+    if (sdk < 24) {
+        std::string cache_dir(data_path);
+        cache_dir += "/dalvik-cache";
+
+        struct stat sb;
+        std::string context;
+
+        if (stat(cache_dir.c_str(), &sb) == 0
+                && util::selinux_lget_context(cache_dir, &context)) {
+            for (auto const &item : boot_fingerprints) {
+                std::string isa_dir(cache_dir);
+                isa_dir += "/";
+                isa_dir += item.first;
+
+                if (mkdir(isa_dir.c_str(), 0711) == 0
+                        && (!util::chown(isa_dir, sb.st_uid, sb.st_gid, 0)
+                        || !util::selinux_lset_context(isa_dir, context))) {
+                    LOGW("%s: Failed to set attributes: %s",
+                         isa_dir.c_str(), strerror(errno));
+                }
+            }
+        }
+    }
+
+    size_t published;
+    size_t offered;
+    AppSyncManager::sync_shared_oat_files(files, &published, &offered);
+    size_t removed = AppSyncManager::prune_shared_oat_files();
+
+    stop = util::current_time_ms();
+    LOGD("Restored %zu and cached %zu of %zu oat files and removed %zu "
+         "unused cache entries in %" PRIu64 "ms",
+         offered, published, files.size(), removed, stop - start);
+}
+
+/*!
+ * \brief Link the current ROM's APKs into the shared APK store
+ *
+ * Only apps installed to /data/app are considered. The raw path of the ROM's
+ * data directory is used so that the APKs are on the same mount as the store.
+ */
+static void share_apks()
+{
+    AppSyncManager::detect_directories();
+
+    if (!AppSyncManager::initialize_apk_store()) {
+        return;
+    }
+
+    std::string data_path = this_rom->full_data_path();
+    if (data_path.empty()) {
+        LOGW("Failed to determine raw data path of %s",
+             this_rom->id.c_str());
+        return;
+    }
+
+    uint64_t start = util::current_time_ms(), stop;
+
+    std::vector<std::string> paths;
+
+    for (auto const &pkg : packages.pkgs) {
+        if (!starts_with(pkg->code_path, "/data/app/")) {
+            continue;
+        }
+
+        std::string code_path(data_path);
+        code_path += pkg->code_path.substr(5);
+
+        if (ends_with(code_path, ".apk")) {
+            // Pre-Lollipop installs are a single file
+            paths.push_back(std::move(code_path));
+            continue;
+        }
+
+        // base.apk and any split APKs
+        autoclose::dir dp(autoclose::opendir(code_path.c_str()));
+        if (!dp) {
+            continue;
+        }
+
+        struct dirent *ent;
+        while ((ent = readdir(dp.get()))) {
+            if (ends_with(ent->d_name, ".apk")) {
+                paths.push_back(code_path + "/" + ent->d_name);
+            }
+        }
+    }
+
+    size_t linked = AppSyncManager::link_shared_apks(paths);
+    size_t removed = AppSyncManager::prune_shared_apks();
+
+    stop = util::current_time_ms();
+    LOGD("Linked %zu/%zu APKs to the shared APK store and removed %zu "
+         "unused APKs in %" PRIu64 "ms",
+         linked, paths.size(), removed, stop - start);
+
+    if (config.shared_oat) {
+        share_oat_files(data_path);
+    }
+}
+
 /*!
  * \brief Get installd socket fd created by init from ANDROID_SOCKET_installd
  *
@@ -303,65 +562,130 @@ static int create_new_socket()
  * a string and a null terminator must be added to the end.
  */
 
+struct Message
+{
+    int async_id = 0;
+    std::string data;
+};
+
 /*!
- * \brief Receive a message from a socket
+ * \brief Buffer for parsing messages from a socket
+ *
+ * Whatever data is available is read at once, so several messages can be
+ * parsed after a single read().
  */
-static bool receive_message(int fd, char *buf, std::size_t size,
-                            bool is_async, int *async_id)
+struct MessageBuffer
 {
-    unsigned short count;
-
-    if (is_async) {
-        assert(async_id != nullptr);
+    std::vector<char> data;
+    // Offset of the first byte that hasn't been parsed
+    size_t offset = 0;
+};
 
-        if (!util::socket_read_int32(fd, async_id)) {
-            LOGE("Failed to receive async command ID: %s", strerror(errno));
-            return false;
+/*!
+ * \brief Read the data that is available from a socket into a buffer
+ *
+ * \return False if the socket was closed or an error occurred
+ */
+static bool fill_message_buffer(int fd, MessageBuffer *buf)
+{
+    // Discard messages that were already parsed
+    buf->data.erase(buf->data.begin(), buf->data.begin() + buf->offset);
+    buf->offset = 0;
+
+    size_t old_size = buf->data.size();
+    buf->data.resize(old_size + MESSAGE_READ_SIZE);
+
+    ssize_t n;
+    do {
+        n = read(fd, buf->data.data() + old_size, MESSAGE_READ_SIZE);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        buf->data.resize(old_size);
+        if (n == 0) {
+            LOGD("Connection closed");
+        } else {
+            LOGE("Failed to read from socket: %s", strerror(errno));
         }
+        return false;
     }
 
-    if (!util::socket_read_uint16(fd, &count)) {
-        LOGE("Failed to read command size: %s", strerror(errno));
-        return false;
+    buf->data.resize(old_size + n);
+
+    return true;
+}
+
+/*!
+ * \brief Parse the next message from a buffer
+ *
+ * \return 1 if a message was parsed, 0 if the rest of the message has not been
+ *         received yet, or -1 if the message is invalid
+ */
+static int next_message(MessageBuffer *buf, bool is_async, Message *msg)
+{
+    size_t header_size = (is_async ? sizeof(int32_t) : 0) + sizeof(uint16_t);
+    size_t avail = buf->data.size() - buf->offset;
+    const char *ptr = buf->data.data() + buf->offset;
+
+    if (avail < header_size) {
+        return 0;
     }
 
-    if (count < 1 || count >= size) {
+    int32_t async_id = 0;
+    uint16_t count;
+
+    if (is_async) {
+        memcpy(&async_id, ptr, sizeof(async_id));
+        ptr += sizeof(async_id);
+    }
+    memcpy(&count, ptr, sizeof(count));
+    ptr += sizeof(count);
+
+    if (count < 1 || count >= COMMAND_BUF_SIZE) {
         LOGE("Invalid size %u", count);
-        return false;
+        return -1;
     }
 
-    if (util::socket_read(fd, buf, count) != count) {
-        LOGE("Failed to read command: %s", strerror(errno));
-        return false;
+    if (avail < header_size + count) {
+        return 0;
     }
 
-    buf[count] = 0;
+    msg->async_id = async_id;
+    msg->data.assign(ptr, count);
+    buf->offset += header_size + count;
 
-    return true;
+    return 1;
 }
 
 /*!
- * \brief Send a message to a socket
+ * \brief Append an encoded message to a buffer
  */
-static bool send_message(int fd, const char *command,
-                         bool is_async, int async_id)
+static void append_message(std::string *out, const Message &msg,
+                           bool is_async)
 {
-    unsigned short count = strlen(command);
-
     if (is_async) {
-        if (!util::socket_write_int32(fd, async_id)) {
-            LOGE("Failed to write async command ID: %s", strerror(errno));
-            return false;
-        }
+        int32_t async_id = msg.async_id;
+        out->append(reinterpret_cast<const char *>(&async_id),
+                    sizeof(async_id));
     }
 
-    if (!util::socket_write_uint16(fd, count)) {
-        LOGE("Failed to write command size: %s", strerror(errno));
-        return false;
+    uint16_t count = msg.data.size();
+    out->append(reinterpret_cast<const char *>(&count), sizeof(count));
+    out->append(msg.data);
+}
+
+/*!
+ * \brief Send encoded messages to a socket with a single write
+ */
+static bool send_messages(int fd, const std::string &buf)
+{
+    if (buf.empty()) {
+        return true;
     }
 
-    if (util::socket_write(fd, command, count) != count) {
-        LOGE("Failed to write command: %s", strerror(errno));
+    if (util::socket_write(fd, buf.data(), buf.size())
+            != static_cast<ssize_t>(buf.size())) {
+        LOGE("Failed to write messages: %s", strerror(errno));
         return false;
     }
 
@@ -534,173 +858,353 @@ static void handle_command(const std::vector<std::string> &args)
     }
 }
 
-static bool handle_installd_event(int client_fd, int installd_fd,
-                                  bool is_async)
+static bool has_hook(const std::string &cmd)
 {
-    // Use the same buffer size as installd
-    char buf[COMMAND_BUF_SIZE];
-
-    uint64_t time_start, time_stop;
-    uint64_t time_start_installd, time_stop_installd;
-    uint64_t time_start_send, time_stop_send;
-
-    int async_id;
-
-    time_start = util::current_time_ms();
+    for (std::size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); ++i) {
+        if (cmd == cmds[i].name) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    time_start_installd = util::current_time_ms();
-    if (!receive_message(
-            installd_fd, buf, sizeof(buf), is_async, &async_id)) {
-        LOGE("Failed to receive reply from installd");
-        return false;
+/*!
+ * \brief Runs command hooks on a separate thread
+ *
+ * Hooks are run one at a time in the order that they are submitted. After each
+ * hook finishes, a byte is written to the notification fd so that the proxy can
+ * forward the hooked command to installd. The destructor waits for all pending
+ * hooks to finish.
+ */
+class HookWorker
+{
+public:
+    explicit HookWorker(int notify_fd)
+        : _notify_fd(notify_fd), _stop(false),
+          _thread(&HookWorker::run, this)
+    {
     }
-    time_stop_installd = util::current_time_ms();
 
-    std::vector<std::string> args = parse_args(buf);
-    LOGD("Received async (probably) reply: %s", args_to_string(args).c_str());
+    ~HookWorker()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_one();
+        _thread.join();
+    }
 
-    time_start_send = util::current_time_ms();
-    if (!send_message(client_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send reply to client");
-        return false;
+    void submit(std::vector<std::string> args)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _jobs.push_back(std::move(args));
+        }
+        _cv.notify_one();
     }
-    time_stop_send = util::current_time_ms();
 
-    time_stop = util::current_time_ms();
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
 
-    LOGD("Command stats:");
-    LOGD("- Time to send result back to client:  %" PRIu64 "ms",
-         time_stop_send - time_start_send);
-    LOGD("- Time to receive reply from installd: %" PRIu64 "ms",
-         time_stop_installd - time_start_installd);
-    LOGD("- Time to complete entire proxy logic: %" PRIu64 "ms",
-         time_stop - time_start);
-    LOGD("---");
+        while (true) {
+            _cv.wait(lock, [&] { return _stop || !_jobs.empty(); });
+            if (_jobs.empty()) {
+                break;
+            }
 
-    return true;
-}
+            std::vector<std::string> args = std::move(_jobs.front());
+            _jobs.pop_front();
 
-static bool handle_android_event(int client_fd, int installd_fd,
-                                 bool can_appsync, bool is_async)
-{
-    // Use the same buffer size as installd
-    char buf[COMMAND_BUF_SIZE];
+            lock.unlock();
 
-    uint64_t time_start, time_stop;
-    uint64_t time_start_installd, time_stop_installd;
-    uint64_t time_start_hook = 0, time_stop_hook = 0;
-    uint64_t time_start_send, time_stop_send;
+            uint64_t time_start = util::current_time_ms();
+            handle_command(args);
+            LOGD("- Time to hook installd command:       %" PRIu64 "ms",
+                 util::current_time_ms() - time_start);
 
-    int async_id;
+            char c = 0;
+            if (write(_notify_fd, &c, 1) < 0) {
+                LOGE("Failed to notify proxy of hook completion: %s",
+                     strerror(errno));
+            }
 
-    if (!receive_message(client_fd, buf, sizeof(buf), is_async, &async_id)) {
-        LOGE("Failed to receive request from client");
-        return false;
+            lock.lock();
+        }
     }
 
-    time_start = util::current_time_ms();
-
-    std::vector<std::string> args = parse_args(buf);
-
-    bool log_result = true;
+    int _notify_fd;
+    bool _stop;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::vector<std::string>> _jobs;
+    std::thread _thread;
+};
 
+/*!
+ * \brief Log a command received from the client
+ *
+ * \return Whether the reply to the command should be logged
+ */
+static bool log_command(const std::vector<std::string> &args)
+{
     if (args.empty()) {
         LOGE("Invalid command (empty message)");
-    } else {
-        const std::string &cmd = args[0];
-
-        if (cmd == "ping"
-                || cmd == "freecache") {
-            LOGD("Received unimportant command: [%s, ...]", cmd.c_str());
-        } else if (cmd == "aapt"
-                || cmd == "aapt_with_common") {
-            LOGD("Received CyanogenMod-specific command: %s",
-                 args_to_string(args).c_str());
-        } else if (cmd == "rmrcl"
-                || cmd == "asyncDexopt"
-                || cmd == "changeDexOwner") {
-            LOGD("Received Touchwiz-specific command: %s",
-                 args_to_string(args).c_str());
-            if (cmd == "asyncDexopt") {
-                LOGD("Expecting future installd reply for 'asyncDexopt'");
-            }
-        } else if (cmd == "getsize") {
-            // Get size is so annoying we don't want it to show... EVER!
-            log_result = false;
-        } else if (cmd == "install"
-                || cmd == "dexopt"
-                || cmd == "markbootcomplete"
-                || cmd == "movedex"
-                || cmd == "rmdex"
-                || cmd == "remove"
-                || cmd == "rename"
-                || cmd == "fixuid"
-                || cmd == "rmcache"
-                || cmd == "rmcodecache"
-                || cmd == "rmuserdata"
-                || cmd == "movefiles"
-                || cmd == "linklib"
-                || cmd == "mkuserdata"
-                || cmd == "mkuserconfig"
-                || cmd == "rmuser"
-                || cmd == "idmap"
-                || cmd == "restorecondata"
-                || cmd == "patchoat") {
-            LOGD("Received command: %s", args_to_string(args).c_str());
-
-            if (can_appsync) {
-                time_start_hook = util::current_time_ms();
-                handle_command(args);
-                time_stop_hook = util::current_time_ms();
-            }
-        } else {
-            LOGW("Unrecognized command: %s", args_to_string(args).c_str());
-        }
+        return true;
     }
 
-    time_start_installd = util::current_time_ms();
-    if (!send_message(installd_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send request to installd");
-        return false;
-    }
-    if (!receive_message(
-            installd_fd, buf, sizeof(buf), is_async, &async_id)) {
-        LOGE("Failed to receive reply from installd");
+    const std::string &cmd = args[0];
+
+    if (cmd == "ping"
+            || cmd == "freecache") {
+        LOGD("Received unimportant command: [%s, ...]", cmd.c_str());
+    } else if (cmd == "aapt"
+            || cmd == "aapt_with_common") {
+        LOGD("Received CyanogenMod-specific command: %s",
+             args_to_string(args).c_str());
+    } else if (cmd == "rmrcl"
+            || cmd == "asyncDexopt"
+            || cmd == "changeDexOwner") {
+        LOGD("Received Touchwiz-specific command: %s",
+             args_to_string(args).c_str());
+        if (cmd == "asyncDexopt") {
+            LOGD("Expecting future installd reply for 'asyncDexopt'");
+        }
+    } else if (cmd == "getsize") {
+        // Get size is so annoying we don't want it to show... EVER!
         return false;
+    } else if (cmd == "install"
+            || cmd == "dexopt"
+            || cmd == "markbootcomplete"
+            || cmd == "movedex"
+            || cmd == "rmdex"
+            || cmd == "remove"
+            || cmd == "rename"
+            || cmd == "fixuid"
+            || cmd == "rmcache"
+            || cmd == "rmcodecache"
+            || cmd == "rmuserdata"
+            || cmd == "movefiles"
+            || cmd == "linklib"
+            || cmd == "mkuserdata"
+            || cmd == "mkuserconfig"
+            || cmd == "rmuser"
+            || cmd == "idmap"
+            || cmd == "restorecondata"
+            || cmd == "patchoat") {
+        LOGD("Received command: %s", args_to_string(args).c_str());
+    } else {
+        LOGW("Unrecognized command: %s", args_to_string(args).c_str());
     }
-    time_stop_installd = util::current_time_ms();
 
-    args = parse_args(buf);
+    return true;
+}
+
+struct ProxyCommand
+{
+    Message msg;
+    // Whether the command's hook (if any) has finished
+    bool ready;
+    bool log_result;
+};
+
+struct PendingReply
+{
+    uint64_t time_sent;
+    bool log_result;
+};
 
-    if (log_result) {
-        LOGD("Sending reply: %s", args_to_string(args).c_str());
+/*!
+ * \brief Proxy messages between a client and installd until either side
+ *        disconnects
+ *
+ * Both sockets are watched with epoll and every message that has been received
+ * is handled on each wakeup. Commands are forwarded to installd as soon as they
+ * are received, unless they have a hook. A hooked command (and any command
+ * received after it) is held back until the hook finishes running on the hook
+ * worker. Replies from installd are always forwarded immediately.
+ */
+static bool proxy_connection(int client_fd, int installd_fd,
+                             bool can_appsync, bool is_async)
+{
+    int notify_fds[2];
+    if (pipe2(notify_fds, O_CLOEXEC) < 0) {
+        LOGE("Failed to create pipe: %s", strerror(errno));
+        return false;
     }
 
-    time_start_send = util::current_time_ms();
-    if (!send_message(client_fd, buf, is_async, async_id)) {
-        LOGE("Failed to send reply to client");
+    auto close_notify_fds = util::finally([&]{
+        close(notify_fds[0]);
+        close(notify_fds[1]);
+    });
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        LOGE("Failed to create epoll fd: %s", strerror(errno));
         return false;
     }
-    time_stop_send = util::current_time_ms();
 
-    time_stop = util::current_time_ms();
+    auto close_epoll_fd = util::finally([&]{
+        close(epoll_fd);
+    });
 
-    if (log_result) {
-        LOGD("Command stats:");
-        LOGD("- Time to send result back to client:  %" PRIu64 "ms",
-             time_stop_send - time_start_send);
-        LOGD("- Time to complete installd command:   %" PRIu64 "ms",
-             time_stop_installd - time_start_installd);
-        if (can_appsync) {
-            LOGD("- Time to hook installd command:       %" PRIu64 "ms",
-                 time_stop_hook - time_start_hook);
+    for (int fd : { client_fd, installd_fd, notify_fds[0] }) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            LOGE("Failed to add fd to epoll: %s", strerror(errno));
+            return false;
         }
-        LOGD("- Time to complete entire proxy logic: %" PRIu64 "ms",
-             time_stop - time_start);
-        LOGD("---");
     }
 
-    return true;
+    // Must be destroyed before the notification pipe is closed
+    HookWorker worker(notify_fds[1]);
+
+    MessageBuffer client_buf;
+    MessageBuffer installd_buf;
+    std::deque<ProxyCommand> commands;
+    std::deque<PendingReply> replies;
+    std::unordered_map<int, PendingReply> async_replies;
+
+    // Send every command at the front of the queue that is ready
+    auto flush_commands = [&]{
+        std::string out;
+        uint64_t now = util::current_time_ms();
+
+        while (!commands.empty() && commands.front().ready) {
+            ProxyCommand &command = commands.front();
+            PendingReply reply{now, command.log_result};
+
+            if (is_async) {
+                async_replies[command.msg.async_id] = reply;
+            } else {
+                replies.push_back(reply);
+            }
+
+            append_message(&out, command.msg, is_async);
+            commands.pop_front();
+        }
+
+        return send_messages(installd_fd, out);
+    };
+
+    struct epoll_event events[3];
+
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, 3, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Failed to wait for events: %s", strerror(errno));
+            return false;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            Message msg;
+            int ret;
+
+            if (fd == client_fd) {
+                if (!fill_message_buffer(client_fd, &client_buf)) {
+                    return false;
+                }
+
+                while ((ret = next_message(&client_buf, is_async, &msg)) > 0) {
+                    std::vector<std::string> args =
+                            parse_args(msg.data.c_str());
+                    bool log_result = log_command(args);
+                    bool hooked = can_appsync && !args.empty()
+                            && has_hook(args[0]);
+
+                    commands.push_back({ std::move(msg), !hooked,
+                                         log_result });
+
+                    if (hooked) {
+                        worker.submit(std::move(args));
+                    }
+                }
+
+                if (ret < 0 || !flush_commands()) {
+                    LOGE("Failed to forward request to installd");
+                    return false;
+                }
+            } else if (fd == installd_fd) {
+                if (!fill_message_buffer(installd_fd, &installd_buf)) {
+                    return false;
+                }
+
+                std::string out;
+                uint64_t now = util::current_time_ms();
+
+                while ((ret = next_message(
+                        &installd_buf, is_async, &msg)) > 0) {
+                    PendingReply reply{0, true};
+                    bool expected = false;
+
+                    if (is_async) {
+                        auto it = async_replies.find(msg.async_id);
+                        if (it != async_replies.end()) {
+                            reply = it->second;
+                            async_replies.erase(it);
+                            expected = true;
+                        }
+                    } else if (!replies.empty()) {
+                        reply = replies.front();
+                        replies.pop_front();
+                        expected = true;
+                    }
+
+                    if (expected) {
+                        util::counter_add(
+                                util::Counter::AppsyncRepliesProxied);
+                        util::counter_add(util::Counter::AppsyncReplyTimeMs,
+                                          now - reply.time_sent);
+                    }
+
+                    if (!expected) {
+                        LOGD("Received async (probably) reply: %s",
+                             args_to_string(parse_args(
+                                     msg.data.c_str())).c_str());
+                    } else if (reply.log_result) {
+                        LOGD("Sending reply: %s", args_to_string(
+                                parse_args(msg.data.c_str())).c_str());
+                        LOGD("- Time to complete installd command:   %"
+                             PRIu64 "ms", now - reply.time_sent);
+                    }
+
+                    append_message(&out, msg, is_async);
+                }
+
+                if (ret < 0 || !send_messages(client_fd, out)) {
+                    LOGE("Failed to forward reply to client");
+                    return false;
+                }
+            } else {
+                char buf[64];
+                ssize_t count = read(notify_fds[0], buf, sizeof(buf));
+
+                // Hooks finish in the order they were submitted
+                for (auto it = commands.begin();
+                        count > 0 && it != commands.end(); ++it) {
+                    if (!it->ready) {
+                        it->ready = true;
+                        --count;
+                    }
+                }
+
+                if (!flush_commands()) {
+                    LOGE("Failed to forward request to installd");
+                    return false;
+                }
+            }
+        }
+    }
 }
 
 /**
@@ -749,8 +1253,7 @@ static bool proxy_process(int fd, bool can_appsync)
         });
 
         // Check if we're using some variant of the CyanogenMood async installd
-        // NOTE: We'll effectively make the connection sychronous because we
-        //       always wait for a reply before receiving the next command.
+        // Replies are matched to their commands by transaction ID.
         // See: https://github.com/CyanogenMod/android_frameworks_native/commit/8124b181d4b5a3a44796fdb0e3ea4e4171f102c7
         bool is_async = util::file_find_one_of(
                 INSTALLD_PATH, { "failed to read transaction id" });
@@ -758,32 +1261,7 @@ static bool proxy_process(int fd, bool can_appsync)
 
         LOGD("---");
 
-        struct pollfd fds[2];
-        memset(fds, 0, sizeof(fds));
-
-        fds[0].fd = client_fd;
-        fds[0].events = POLLIN;
-        fds[1].fd = installd_fd;
-        fds[1].events = POLLIN;
-
-        while (true) {
-            fds[0].revents = 0;
-            fds[1].revents = 1;
-
-            if (poll(fds, 2, -1) < 0) {
-                LOGE("Failed to poll() fds: %s", strerror(errno));
-                break;
-            }
-
-            if (fds[0].revents & POLLIN && !handle_android_event(
-                    client_fd, installd_fd, can_appsync, is_async)) {
-                break;
-            }
-            if (fds[1].revents & POLLIN && !handle_installd_event(
-                    client_fd, installd_fd, is_async)) {
-                break;
-            }
-        }
+        proxy_connection(client_fd, installd_fd, can_appsync, is_async);
     }
 
     // Not reached
@@ -936,11 +1414,20 @@ int appsync_main(int argc, char *argv[])
 
     fix_multiboot_permissions();
 
-    // mbtool logging
-    log::log_set_logger(std::make_shared<log::StdioLogger>(fp.get(), true));
+    // mbtool logging. appsync logs every proxied installd command, so writes
+    // happen on a background thread. The logger must be torn down (and
+    // flushed) before fp is closed.
+    log::log_set_logger(std::make_shared<log::AsyncLogger>(
+            std::make_shared<log::StdioLogger>(fp.get(), true)));
+    auto reset_logger = util::finally([]{
+        log::log_set_logger(nullptr);
+    });
 
     LOGI("=== APPSYNC VERSION %s ===", version());
 
+    // Failing to share the counters only affects `mbtool stats`
+    util::counters_attach(get_raw_path(MULTIBOOT_COUNTERS));
+
     LOGI("Calling restorecon on /data/media/obb");
     const char *restorecon[] =
             { "restorecon", "-R", "-F", "/data/media/obb", nullptr };
@@ -954,6 +1441,10 @@ int appsync_main(int argc, char *argv[])
         LOGW("Failed to load configuration file; app sharing will not work");
         LOGW("Continuing to proxy installd anyway...");
     } else {
+        if (config.shared_apks) {
+            share_apks();
+        }
+
         if (config.indiv_app_sharing) {
             uint64_t start = util::current_time_ms();
             can_appsync = prepare_appsync();
@@ -20,24 +20,51 @@
 #include "appsyncmanager.h"
 
 #include <algorithm>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <cerrno>
+#include <cstdio>
+#include <cstring>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "mblog/logging.h"
+#include "mbutil/autoclose/dir.h"
+#include "mbutil/autoclose/file.h"
 #include "mbutil/chown.h"
+#include "mbutil/copy.h"
+#include "mbutil/delete.h"
 #include "mbutil/directory.h"
+#include "mbutil/file.h"
 #include "mbutil/fts.h"
+#include "mbutil/hash.h"
+#include "mbutil/mount.h"
+#include "mbutil/path.h"
 #include "mbutil/selinux.h"
+#include "mbutil/string.h"
 
 #define APP_SHARING_DATA_DIR            "/data/multiboot/_appsharing/data"
+#define APP_SHARING_STATE_FILE          "/data/multiboot/_appsharing/data.state"
+#define APP_SHARING_APK_DIR             "/data/multiboot/_appsharing/apk"
+#define APP_SHARING_OAT_DIR             "/data/multiboot/_appsharing/oat"
+
+#define DEFAULT_APP_DATA_CONTEXT        "u:object_r:app_data_file:s0"
+#define APP_DATA_CONTEXT_REFERENCE      "/data/data/com.android.systemui"
 
 #define USER_DATA_DIR                   "/data/data"
 
+#define AID_SYSTEM                      1000
+
 static std::string _as_data_dir;
+static std::string _as_state_file;
+static std::string _as_apk_dir;
+static std::string _as_oat_dir;
 static std::string _user_data_dir;
 
 namespace mb
@@ -76,9 +103,14 @@ public:
 void AppSyncManager::detect_directories()
 {
     _as_data_dir = get_raw_path(APP_SHARING_DATA_DIR);
+    _as_state_file = get_raw_path(APP_SHARING_STATE_FILE);
+    _as_apk_dir = get_raw_path(APP_SHARING_APK_DIR);
+    _as_oat_dir = get_raw_path(APP_SHARING_OAT_DIR);
     _user_data_dir = USER_DATA_DIR;
 
     LOGD("App sharing app data directory: %s", _as_data_dir.c_str());
+    LOGD("App sharing APK store:          %s", _as_apk_dir.c_str());
+    LOGD("App sharing oat cache:          %s", _as_oat_dir.c_str());
     LOGD("User app data directory:        %s", _user_data_dir.c_str());
 }
 
@@ -132,8 +164,8 @@ bool AppSyncManager::create_shared_data_directory(const std::string &pkg, uid_t
 
 bool AppSyncManager::fix_shared_data_permissions()
 {
-    std::string context("u:object_r:app_data_file:s0");
-    util::selinux_lget_context("/data/data/com.android.systemui", &context);
+    std::string context(DEFAULT_APP_DATA_CONTEXT);
+    util::selinux_lget_context(APP_DATA_CONTEXT_REFERENCE, &context);
 
     if (!util::selinux_lset_context_recursive(_as_data_dir, context)) {
         LOGW("%s: Failed to set context recursively to %s: %s",
@@ -191,4 +223,644 @@ bool AppSyncManager::unmount_shared_directory(const std::string &pkg)
     return true;
 }
 
+/*!
+ * \brief Ownership state of a shared data directory as of the last fixup
+ */
+struct SharedDataState
+{
+    uid_t uid;
+    ino_t ino;
+    std::string context;
+};
+
+/*!
+ * \brief Load the per-package state recorded by the previous boot
+ *
+ * Each line has the format: `<package> <uid> <inode> <context>`. A missing or
+ * malformed file simply results in every directory being fixed again.
+ */
+static std::unordered_map<std::string, SharedDataState>
+load_shared_data_state(const std::string &path)
+{
+    std::unordered_map<std::string, SharedDataState> states;
+
+    std::vector<unsigned char> data;
+    if (!util::file_read_all(path, &data)) {
+        if (errno != ENOENT) {
+            LOGW("%s: Failed to read state file: %s",
+                 path.c_str(), strerror(errno));
+        }
+        return states;
+    }
+
+    std::istringstream ss(std::string(data.begin(), data.end()));
+    std::string line;
+
+    while (std::getline(ss, line)) {
+        std::istringstream ls(line);
+        std::string pkg;
+        unsigned long long uid;
+        unsigned long long ino;
+        SharedDataState state;
+
+        if (!(ls >> pkg >> uid >> ino >> state.context)) {
+            LOGW("%s: Ignoring malformed state: %s",
+                 path.c_str(), line.c_str());
+            continue;
+        }
+
+        state.uid = static_cast<uid_t>(uid);
+        state.ino = static_cast<ino_t>(ino);
+        states[pkg] = std::move(state);
+    }
+
+    return states;
+}
+
+static bool save_shared_data_state(
+        const std::string &path,
+        const std::unordered_map<std::string, SharedDataState> &states)
+{
+    std::ostringstream ss;
+
+    for (auto const &item : states) {
+        ss << item.first
+           << ' ' << static_cast<unsigned long long>(item.second.uid)
+           << ' ' << static_cast<unsigned long long>(item.second.ino)
+           << ' ' << item.second.context << '\n';
+    }
+
+    std::string data = ss.str();
+    std::string temp_path(path);
+    temp_path += ".tmp";
+
+    if (!util::file_write_data(temp_path, data.data(), data.size())) {
+        LOGW("%s: Failed to write state file: %s",
+             temp_path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    if (rename(temp_path.c_str(), path.c_str()) < 0) {
+        LOGW("%s: Failed to rename to %s: %s",
+             temp_path.c_str(), path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Create shared data directories and fix their ownership in one pass
+ *
+ * This is the batched equivalent of calling create_shared_data_directory() for
+ * each package followed by fix_shared_data_permissions(). The recursive chown
+ * and relabel are only performed for directories whose owner, inode, mode, or
+ * SELinux context differs from what was recorded in the state file during the
+ * previous boot. Unchanged directories only cost a stat and a getxattr.
+ *
+ * \param dirs Directories to prepare. The `ok` field of each entry is set to
+ *             whether the directory is ready to be bind mounted.
+ *
+ * \return False if the shared data root could not be labeled, in which case
+ *         data sharing should be disabled entirely
+ */
+bool AppSyncManager::prepare_shared_data_directories(
+        std::vector<SharedDataDirectory> &dirs)
+{
+    std::string context(DEFAULT_APP_DATA_CONTEXT);
+    util::selinux_lget_context(APP_DATA_CONTEXT_REFERENCE, &context);
+
+    if (!util::selinux_lset_context(_as_data_dir, context)) {
+        LOGW("%s: Failed to set context to %s: %s",
+             _as_data_dir.c_str(), context.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto old_states = load_shared_data_state(_as_state_file);
+    std::unordered_map<std::string, SharedDataState> new_states;
+    size_t fixed = 0;
+
+    for (SharedDataDirectory &dir : dirs) {
+        const char *pkg = dir.pkg.c_str();
+        std::string data_path = get_shared_data_path(dir.pkg);
+
+        dir.ok = false;
+
+        if (!util::mkdir_recursive(data_path, 0751)) {
+            LOGW("[%s] %s: Failed to create directory: %s",
+                 pkg, data_path.c_str(), strerror(errno));
+            continue;
+        }
+
+        struct stat sb;
+        if (lstat(data_path.c_str(), &sb) < 0) {
+            LOGW("[%s] %s: Failed to stat: %s",
+                 pkg, data_path.c_str(), strerror(errno));
+            continue;
+        }
+
+        std::string cur_context;
+        auto it = old_states.find(dir.pkg);
+
+        bool unchanged = it != old_states.end()
+                && it->second.uid == dir.uid
+                && it->second.ino == sb.st_ino
+                && it->second.context == context
+                && sb.st_uid == dir.uid
+                && sb.st_gid == dir.uid
+                && (sb.st_mode & 07777) == 0751
+                && util::selinux_lget_context(data_path, &cur_context)
+                && cur_context == context;
+
+        if (!unchanged) {
+            if (chmod(data_path.c_str(), 0751) < 0) {
+                LOGW("[%s] %s: Failed to chmod: %s",
+                     pkg, data_path.c_str(), strerror(errno));
+                continue;
+            }
+
+            if (!util::chown(data_path, dir.uid, dir.uid,
+                             util::CHOWN_RECURSIVE)) {
+                LOGW("[%s] %s: Failed to chown: %s",
+                     pkg, data_path.c_str(), strerror(errno));
+                continue;
+            }
+
+            if (!util::selinux_lset_context_recursive(data_path, context)) {
+                LOGW("[%s] %s: Failed to set context recursively to %s: %s",
+                     pkg, data_path.c_str(), context.c_str(),
+                     strerror(errno));
+                continue;
+            }
+
+            ++fixed;
+        }
+
+        new_states[dir.pkg] = { dir.uid, sb.st_ino, context };
+        dir.ok = true;
+    }
+
+    LOGD("Fixed ownership of %zu/%zu shared data directories",
+         fixed, dirs.size());
+
+    // Unchanged entries all come from the old state, so the state is only
+    // different if something was fixed or if packages were added or removed
+    if (fixed > 0 || new_states.size() != old_states.size()) {
+        save_shared_data_state(_as_state_file, new_states);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Bind mount all shared data directories in one pass
+ *
+ * The mount table is read once to determine which targets need to be unmounted
+ * first instead of attempting an unmount for every package. Since the bind
+ * mount hides the original contents of the target, only the target directory
+ * itself is chowned.
+ *
+ * \param dirs Directories to mount. Entries with `ok` set to false are
+ *             skipped. On failure, `ok` is set to false.
+ */
+void AppSyncManager::mount_shared_directories(
+        std::vector<SharedDataDirectory> &dirs)
+{
+    std::unordered_set<std::string> mounted;
+
+    autoclose::file fp(std::fopen(PROC_MOUNTS, "re"), std::fclose);
+    if (fp) {
+        util::MountEntry entry;
+        while (util::get_mount_entry(fp.get(), entry)) {
+            mounted.insert(entry.dir);
+        }
+    } else {
+        LOGW("%s: Failed to open: %s", PROC_MOUNTS, strerror(errno));
+    }
+
+    for (SharedDataDirectory &dir : dirs) {
+        if (!dir.ok) {
+            continue;
+        }
+
+        const char *pkg = dir.pkg.c_str();
+        std::string data_path = get_shared_data_path(dir.pkg);
+        std::string target(_user_data_dir);
+        target += "/";
+        target += dir.pkg;
+
+        dir.ok = false;
+
+        if (!util::mkdir_recursive(target, 0755)) {
+            LOGW("[%s] %s: Failed to create directory: %s",
+                 pkg, target.c_str(), strerror(errno));
+            continue;
+        }
+        if (!util::chown(target, dir.uid, dir.uid, 0)) {
+            LOGW("[%s] %s: Failed to chown: %s",
+                 pkg, target.c_str(), strerror(errno));
+            continue;
+        }
+
+        LOGV("[%s] Bind mounting data directory:", pkg);
+        LOGV("[%s] - Source: %s", pkg, data_path.c_str());
+        LOGV("[%s] - Target: %s", pkg, target.c_str());
+
+        // A failed lookup (eg. unreadable mount table) falls back to always
+        // unmounting
+        if ((mounted.empty() || mounted.find(target) != mounted.end())
+                && !unmount_shared_directory(dir.pkg)) {
+            continue;
+        }
+
+        if (mount(data_path.c_str(), target.c_str(), "", MS_BIND, "") < 0) {
+            LOGW("[%s] Failed to bind mount: %s", pkg, strerror(errno));
+            continue;
+        }
+
+        dir.ok = true;
+    }
+}
+
+bool AppSyncManager::initialize_apk_store()
+{
+    for (auto const &dir : { _as_apk_dir, _as_oat_dir }) {
+        if (!util::mkdir_recursive(dir, 0700) && errno != EEXIST) {
+            LOGW("%s: Failed to create directory: %s", dir.c_str(),
+                 strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static std::string get_shared_apk_path(const util::Sha512Digest &digest)
+{
+    std::string path(_as_apk_dir);
+    path += "/";
+    path += util::hex_string(digest.data(), digest.size());
+    path += ".apk";
+    return path;
+}
+
+/*!
+ * \brief Check if two files can share an inode without either ROM noticing
+ */
+static bool same_attributes(const std::string &path1, const struct stat &sb1,
+                            const std::string &path2, const struct stat &sb2)
+{
+    std::string context1;
+    std::string context2;
+
+    return sb1.st_size == sb2.st_size
+            && sb1.st_uid == sb2.st_uid
+            && sb1.st_gid == sb2.st_gid
+            && (sb1.st_mode & 07777) == (sb2.st_mode & 07777)
+            && util::selinux_lget_context(path1, &context1)
+            && util::selinux_lget_context(path2, &context2)
+            && context1 == context2;
+}
+
+/*!
+ * \brief Hard link APKs to identical copies in the shared APK store
+ *
+ * APKs are identified by the SHA512 digest of their contents. Since the
+ * signature block is part of the contents, APKs only share a store entry if
+ * their signatures match too. The first APK with a given digest is linked into
+ * the store and later ones (usually from other ROMs) are atomically replaced by
+ * a link to the store entry.
+ *
+ * The link count of a store entry acts as its reference count. Every ROM using
+ * the APK holds one link and the store holds the last one, so APKs with more
+ * than one link are already shared and are not hashed again.
+ *
+ * \note The store and the APKs must be accessed through the same mount (ie.
+ *       using raw paths). Otherwise, link() fails with EXDEV.
+ *
+ * \param paths Paths of the APKs to deduplicate
+ *
+ * \return Number of APKs that were replaced by a link to the store
+ */
+size_t AppSyncManager::link_shared_apks(const std::vector<std::string> &paths)
+{
+    std::vector<std::string> pending;
+    size_t linked = 0;
+
+    for (auto const &path : paths) {
+        struct stat sb;
+        if (lstat(path.c_str(), &sb) < 0) {
+            LOGW("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+            continue;
+        }
+
+        if (S_ISREG(sb.st_mode) && sb.st_nlink == 1) {
+            pending.push_back(path);
+        }
+    }
+
+    if (pending.empty()) {
+        return 0;
+    }
+
+    std::vector<util::Sha512Digest> digests;
+    if (!util::sha512_hash_files(pending, digests)) {
+        LOGW("Failed to compute digests of %zu APKs", pending.size());
+        return 0;
+    }
+
+    for (size_t i = 0; i < pending.size(); ++i) {
+        const std::string &path = pending[i];
+        std::string store_path = get_shared_apk_path(digests[i]);
+
+        if (link(path.c_str(), store_path.c_str()) == 0) {
+            LOGV("%s: Added to APK store", path.c_str());
+            continue;
+        } else if (errno != EEXIST) {
+            LOGW("%s: Failed to link to %s: %s",
+                 path.c_str(), store_path.c_str(), strerror(errno));
+            continue;
+        }
+
+        struct stat sb;
+        struct stat store_sb;
+
+        if (lstat(path.c_str(), &sb) < 0
+                || lstat(store_path.c_str(), &store_sb) < 0) {
+            LOGW("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+            continue;
+        }
+
+        // Relabeling or chowning the shared inode would affect every ROM
+        // using it, so APKs with different attributes are left alone
+        if (!same_attributes(path, sb, store_path, store_sb)) {
+            LOGV("%s: Attributes differ from %s; not sharing",
+                 path.c_str(), store_path.c_str());
+            continue;
+        }
+
+        std::string temp_path(path);
+        temp_path += ".mbtmp";
+
+        unlink(temp_path.c_str());
+
+        if (link(store_path.c_str(), temp_path.c_str()) < 0) {
+            LOGW("%s: Failed to link to %s: %s",
+                 store_path.c_str(), temp_path.c_str(), strerror(errno));
+            continue;
+        }
+
+        if (rename(temp_path.c_str(), path.c_str()) < 0) {
+            LOGW("%s: Failed to rename to %s: %s",
+                 temp_path.c_str(), path.c_str(), strerror(errno));
+            unlink(temp_path.c_str());
+            continue;
+        }
+
+        LOGV("%s: Linked to %s", path.c_str(), store_path.c_str());
+        ++linked;
+    }
+
+    return linked;
+}
+
+/*!
+ * \brief Remove APKs from the store that are no longer used by any ROM
+ *
+ * When a ROM uninstalls or updates an app, Android deletes its link to the
+ * APK. Once only the store's link remains, the entry is deleted.
+ *
+ * \return Number of APKs removed from the store
+ */
+size_t AppSyncManager::prune_shared_apks()
+{
+    size_t removed = 0;
+
+    autoclose::dir dp(autoclose::opendir(_as_apk_dir.c_str()));
+    if (!dp) {
+        if (errno != ENOENT) {
+            LOGW("%s: Failed to open directory: %s",
+                 _as_apk_dir.c_str(), strerror(errno));
+        }
+        return 0;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        struct stat sb;
+        if (fstatat(dirfd(dp.get()), ent->d_name, &sb,
+                    AT_SYMLINK_NOFOLLOW) < 0) {
+            LOGW("%s/%s: Failed to stat: %s",
+                 _as_apk_dir.c_str(), ent->d_name, strerror(errno));
+            continue;
+        }
+
+        if (S_ISREG(sb.st_mode) && sb.st_nlink == 1) {
+            if (unlinkat(dirfd(dp.get()), ent->d_name, 0) < 0) {
+                LOGW("%s/%s: Failed to remove: %s",
+                     _as_apk_dir.c_str(), ent->d_name, strerror(errno));
+                continue;
+            }
+            ++removed;
+        }
+    }
+
+    return removed;
+}
+
+/*!
+ * \brief Map inodes of the APK store entries to their digests
+ */
+static std::unordered_map<ino_t, std::string> load_shared_apk_inodes()
+{
+    std::unordered_map<ino_t, std::string> inodes;
+
+    autoclose::dir dp(autoclose::opendir(_as_apk_dir.c_str()));
+    if (!dp) {
+        LOGW("%s: Failed to open directory: %s",
+             _as_apk_dir.c_str(), strerror(errno));
+        return inodes;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dp.get()))) {
+        size_t len = strlen(ent->d_name);
+        struct stat sb;
+
+        if (len > 4 && strcmp(ent->d_name + len - 4, ".apk") == 0
+                && fstatat(dirfd(dp.get()), ent->d_name, &sb,
+                           AT_SYMLINK_NOFOLLOW) == 0
+                && S_ISREG(sb.st_mode)) {
+            inodes[sb.st_ino] = std::string(ent->d_name, len - 4);
+        }
+    }
+
+    return inodes;
+}
+
+/*!
+ * \brief Copy an artifact to or from the oat cache
+ *
+ * The copy is written to a temporary file and renamed into place, so ART never
+ * sees a partially written file. If \p context is not empty, the copy is
+ * owned by system:\p gid with mode 0644 and labeled with \p context.
+ */
+static bool copy_oat_file(const std::string &source, const std::string &target,
+                          gid_t gid, const std::string &context)
+{
+    std::string temp_path(target);
+    temp_path += ".mbtmp";
+
+    if (!util::copy_file(source, temp_path, 0)) {
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    if (!context.empty()) {
+        if (!util::chown(temp_path, AID_SYSTEM, gid, 0)
+                || chmod(temp_path.c_str(), 0644) < 0
+                || !util::selinux_lset_context(temp_path, context)) {
+            LOGW("%s: Failed to set attributes: %s",
+                 temp_path.c_str(), strerror(errno));
+            unlink(temp_path.c_str());
+            return false;
+        }
+    }
+
+    if (rename(temp_path.c_str(), target.c_str()) < 0) {
+        LOGW("%s: Failed to rename to %s: %s",
+             temp_path.c_str(), target.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Exchange compiled dex artifacts between a ROM and the oat cache
+ *
+ * Artifacts are cached per shared APK (see link_shared_apks()) under the key
+ * of each SharedOatFile. Artifacts that the ROM has, but the cache doesn't, are
+ * copied into the cache. Artifacts that the ROM is missing, but the cache has,
+ * are copied into the ROM, so ART can load them instead of running dex2oat.
+ * Existing artifacts in the ROM are never overwritten.
+ *
+ * ART still validates the checksums of the boot image and the dex files when
+ * loading an artifact and will recompile it if they don't match.
+ *
+ * \param files Artifacts of the current ROM
+ * \param[out] published Number of artifacts copied into the cache
+ * \param[out] offered Number of artifacts copied into the ROM
+ */
+void AppSyncManager::sync_shared_oat_files(
+        const std::vector<SharedOatFile> &files,
+        size_t *published, size_t *offered)
+{
+    auto inodes = load_shared_apk_inodes();
+
+    *published = 0;
+    *offered = 0;
+
+    for (const SharedOatFile &file : files) {
+        struct stat sb;
+
+        // Only APKs in the APK store have a known digest
+        if (lstat(file.apk_path.c_str(), &sb) < 0 || sb.st_nlink == 1) {
+            continue;
+        }
+
+        auto it = inodes.find(sb.st_ino);
+        if (it == inodes.end()) {
+            continue;
+        }
+
+        std::string cache_dir(_as_oat_dir);
+        cache_dir += "/";
+        cache_dir += it->second;
+
+        std::string cache_path(cache_dir);
+        cache_path += "/";
+        cache_path += file.key;
+
+        bool in_rom = lstat(file.path.c_str(), &sb) == 0;
+        bool in_cache = lstat(cache_path.c_str(), &sb) == 0;
+
+        if (in_rom && !in_cache) {
+            if (mkdir(cache_dir.c_str(), 0700) < 0 && errno != EEXIST) {
+                LOGW("%s: Failed to create directory: %s",
+                     cache_dir.c_str(), strerror(errno));
+                continue;
+            }
+
+            if (copy_oat_file(file.path, cache_path, 0, {})) {
+                LOGV("%s: Added to oat cache", file.path.c_str());
+                ++*published;
+            }
+        } else if (!in_rom && in_cache) {
+            // Label the artifact like the directory ART expects it in
+            std::string context;
+            if (!util::selinux_lget_context(util::dir_name(file.path),
+                                            &context)) {
+                continue;
+            }
+
+            if (copy_oat_file(cache_path, file.path, file.gid, context)) {
+                LOGV("%s: Restored from oat cache", file.path.c_str());
+                ++*offered;
+            }
+        }
+    }
+}
+
+/*!
+ * \brief Remove cached artifacts of APKs that are no longer in the APK store
+ *
+ * \return Number of APKs whose artifacts were removed
+ */
+size_t AppSyncManager::prune_shared_oat_files()
+{
+    std::unordered_set<std::string> digests;
+    size_t removed = 0;
+
+    for (auto const &item : load_shared_apk_inodes()) {
+        digests.insert(item.second);
+    }
+
+    autoclose::dir dp(autoclose::opendir(_as_oat_dir.c_str()));
+    if (!dp) {
+        if (errno != ENOENT) {
+            LOGW("%s: Failed to open directory: %s",
+                 _as_oat_dir.c_str(), strerror(errno));
+        }
+        return 0;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0
+                || digests.find(ent->d_name) != digests.end()) {
+            continue;
+        }
+
+        std::string path(_as_oat_dir);
+        path += "/";
+        path += ent->d_name;
+
+        if (!util::delete_recursive(path)) {
+            LOGW("%s: Failed to remove: %s", path.c_str(), strerror(errno));
+            continue;
+        }
+        ++removed;
+    }
+
+    return removed;
+}
+
 }
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include "packages.h"
 #include "roms.h"
@@ -35,6 +36,25 @@ struct RomConfigAndPackages
     Packages packages;
 };
 
+struct SharedDataDirectory
+{
+    std::string pkg;
+    uid_t uid;
+    bool ok;
+};
+
+struct SharedOatFile
+{
+    // Path to the APK that the artifact was compiled from
+    std::string apk_path;
+    // Path where the ROM's ART looks for the artifact
+    std::string path;
+    // Identifies the ISA, boot image, and artifact location
+    std::string key;
+    // Group that owns the artifact (the app's UID)
+    gid_t gid;
+};
+
 class AppSyncManager
 {
 public:
@@ -48,6 +68,19 @@ public:
 
     static bool mount_shared_directory(const std::string &pkg, uid_t uid);
     static bool unmount_shared_directory(const std::string &pkg);
+
+    static bool prepare_shared_data_directories(
+            std::vector<SharedDataDirectory> &dirs);
+    static void mount_shared_directories(
+            std::vector<SharedDataDirectory> &dirs);
+
+    static bool initialize_apk_store();
+    static size_t link_shared_apks(const std::vector<std::string> &paths);
+    static size_t prune_shared_apks();
+
+    static void sync_shared_oat_files(const std::vector<SharedOatFile> &files,
+                                      size_t *published, size_t *offered);
+    static size_t prune_shared_oat_files();
 };
 
 }
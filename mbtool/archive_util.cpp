@@ -22,25 +22,31 @@
 #include <cerrno>
 #include <cstring>
 
+#include "mbcommon/buffer_pool.h"
 #include "mblog/logging.h"
 
-#define BUF_SIZE    10240
-
 namespace mb
 {
 
 bool la_copy_data_to_fd(archive *a, int fd)
 {
-    char buf[BUF_SIZE];
     la_ssize_t n_read;
     ssize_t n_written;
     la_ssize_t remain;
 
-    while ((n_read = archive_read_data(a, buf, sizeof(buf))) > 0) {
+    PooledBuffer buf(io_block_size());
+    if (!buf) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
+    char *data = static_cast<char *>(buf.data());
+
+    while ((n_read = archive_read_data(a, data, buf.size())) > 0) {
         remain = n_read;
 
         while (remain > 0) {
-            n_written = write(fd, buf + (n_read - remain), remain);
+            n_written = write(fd, data + (n_read - remain), remain);
             if (n_written <= 0) {
                 LOGE("Failed to write data: %s", strerror(errno));
                 return false;
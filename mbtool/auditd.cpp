@@ -19,23 +19,216 @@
 
 #include "auditd.h"
 
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
 #include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include <getopt.h>
+#include <poll.h>
 #include <unistd.h>
 
+#include "mblog/async_logger.h"
 #include "mblog/logging.h"
+#include "mblog/stdio_logger.h"
 #include "mbutil/finally.h"
 
 #include "external/audit/libaudit.h"
 
+// Interval between summaries of repeated messages
+#define AUDITD_SUMMARY_INTERVAL     std::chrono::seconds(10)
+// Maximum number of messages to read before checking if a summary is due
+#define AUDITD_MAX_BATCH_SIZE       64
+// Maximum number of non-AVC messages to log per summary interval
+#define AUDITD_MAX_OTHER_MESSAGES   100
+// Maximum number of distinct AVC denials to track per summary interval
+#define AUDITD_MAX_DENIALS          1024
+// Requested receive buffer size for the audit socket
+#define AUDITD_RECV_BUFFER_SIZE     (1024 * 1024)
+
 
 namespace mb
 {
 
+using Clock = std::chrono::steady_clock;
+
+struct AvcDenial
+{
+    // Number of occurrences that have not been logged
+    uint64_t count;
+};
+
+struct AuditState
+{
+    // Keyed by "<perms> scontext=<x> tcontext=<y> tclass=<z>"
+    std::unordered_map<std::string, AvcDenial> denials;
+    uint64_t untracked_denials = 0;
+    uint64_t other_messages = 0;
+    uint64_t suppressed_others = 0;
+    Clock::time_point last_summary;
+};
+
+/*!
+ * \brief Get value of a `key=value` field in an audit message
+ */
+static bool get_field(const char *msg, size_t size, const char *key,
+                      const char **value_out, size_t *value_size_out)
+{
+    size_t key_size = strlen(key);
+
+    for (size_t i = 0; i + key_size <= size; ++i) {
+        if ((i == 0 || msg[i - 1] == ' ')
+                && memcmp(msg + i, key, key_size) == 0) {
+            size_t begin = i + key_size;
+            size_t end = begin;
+
+            while (end < size && msg[end] != ' ' && msg[end] != '\0') {
+                ++end;
+            }
+
+            *value_out = msg + begin;
+            *value_size_out = end - begin;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Build de-duplication key for an AVC message
+ *
+ * \return Whether the message is an AVC message containing the permissions,
+ *         source and target contexts, and target class
+ */
+static bool get_avc_key(const char *msg, size_t size, std::string &key)
+{
+    const char *begin = static_cast<const char *>(memchr(msg, '{', size));
+    if (!begin) {
+        return false;
+    }
+    const char *end = static_cast<const char *>(
+            memchr(begin, '}', size - (begin - msg)));
+    if (!end) {
+        return false;
+    }
+
+    key.assign(begin, end - begin + 1);
+
+    static const char *fields[] = { "scontext=", "tcontext=", "tclass=" };
+
+    for (const char *field : fields) {
+        const char *value;
+        size_t value_size;
+
+        if (!get_field(msg, size, field, &value, &value_size)) {
+            return false;
+        }
+
+        key += ' ';
+        key += field;
+        key.append(value, value_size);
+    }
+
+    return true;
+}
+
+static void handle_message(AuditState &state, const audit_message &reply,
+                           std::string &key)
+{
+    // The payload is not necessarily NULL-terminated
+    size_t size = strnlen(reply.data, std::min<size_t>(
+            NLMSG_PAYLOAD(&reply.nlh, 0), sizeof(reply.data)));
+
+    if (reply.nlh.nlmsg_type == AUDIT_AVC
+            && get_avc_key(reply.data, size, key)) {
+        auto it = state.denials.find(key);
+        if (it != state.denials.end()) {
+            ++it->second.count;
+            return;
+        }
+
+        if (state.denials.size() >= AUDITD_MAX_DENIALS) {
+            ++state.untracked_denials;
+            return;
+        }
+
+        state.denials.emplace(key, AvcDenial{0});
+    } else if (state.other_messages >= AUDITD_MAX_OTHER_MESSAGES) {
+        ++state.suppressed_others;
+        return;
+    } else {
+        ++state.other_messages;
+    }
+
+    LOGV("type=%d %.*s", reply.nlh.nlmsg_type, static_cast<int>(size),
+         reply.data);
+}
+
+static void log_summary(AuditState &state)
+{
+    for (auto const &item : state.denials) {
+        if (item.second.count > 0) {
+            LOGV("avc: %s repeated %" PRIu64 " times",
+                 item.first.c_str(), item.second.count);
+        }
+    }
+
+    if (state.untracked_denials > 0) {
+        LOGW("%" PRIu64 " AVC messages were not logged because too many"
+             " distinct denials occurred", state.untracked_denials);
+    }
+    if (state.suppressed_others > 0) {
+        LOGW("%" PRIu64 " non-AVC audit messages were not logged",
+             state.suppressed_others);
+    }
+
+    // Denials seen during this interval are logged in full again next time
+    state.denials.clear();
+    state.untracked_denials = 0;
+    state.other_messages = 0;
+    state.suppressed_others = 0;
+    state.last_summary = Clock::now();
+}
+
+/*!
+ * \brief Read all pending messages from the audit socket
+ *
+ * \return 1 if more messages may be pending, 0 if the socket has been drained,
+ *         or -1 if an error occurs
+ */
+static int read_messages(int fd, AuditState &state, audit_message &reply,
+                         std::string &key)
+{
+    for (int i = 0; i < AUDITD_MAX_BATCH_SIZE; ++i) {
+        reply.nlh.nlmsg_type = 0;
+        reply.nlh.nlmsg_len = 0;
+        reply.data[0] = '\0';
+
+        if (audit_get_reply(fd, &reply, GET_REPLY_NONBLOCKING, 0) < 0) {
+            LOGE("Failed to get reply from audit socket: %s",
+                 strerror(errno));
+            return -1;
+        }
+
+        // Nothing was received
+        if (reply.nlh.nlmsg_len == 0) {
+            return 0;
+        }
+
+        handle_message(state, reply, key);
+    }
+
+    return 1;
+}
+
 static bool audit_mainloop()
 {
     int fd = audit_open();
@@ -48,23 +241,54 @@ static bool audit_mainloop()
         audit_close(fd);
     });
 
+    // Give the kernel more room to queue messages while we are busy logging
+    int buf_size = AUDITD_RECV_BUFFER_SIZE;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE,
+                   &buf_size, sizeof(buf_size)) < 0
+            && setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+                          &buf_size, sizeof(buf_size)) < 0) {
+        LOGW("Failed to set audit socket receive buffer size: %s",
+             strerror(errno));
+    }
+
     if (audit_setup(fd, getpid()) < 0) {
         return false;
     }
 
+    // Allocated once since it is too large for the stack of some threads
+    std::unique_ptr<audit_message> reply(new audit_message());
+    std::string key;
+    AuditState state;
+    state.last_summary = Clock::now();
+
     while (true) {
-        struct audit_message reply;
-        reply.nlh.nlmsg_type = 0;
-        reply.nlh.nlmsg_len = 0;
-        reply.data[0] = '\0';
+        auto now = Clock::now();
+        auto next_summary = state.last_summary + AUDITD_SUMMARY_INTERVAL;
 
-        if (audit_get_reply(fd, &reply, GET_REPLY_BLOCKING, 0) < 0) {
-            LOGE("Failed to get reply from audit socket: %s", strerror(errno));
+        if (now >= next_summary) {
+            log_summary(state);
+            continue;
+        }
+
+        int pending = read_messages(fd, state, *reply, key);
+        if (pending < 0) {
             return false;
+        } else if (pending > 0) {
+            continue;
         }
 
-        LOGV("type=%d %.*s",
-             reply.nlh.nlmsg_type, reply.nlh.nlmsg_len, reply.data);
+        int timeout = static_cast<int>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                        next_summary - now).count()) + 1;
+
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            LOGE("Failed to poll audit socket: %s", strerror(errno));
+            return false;
+        }
     }
 
     return false;
@@ -109,6 +333,13 @@ int auditd_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    // Logging must not slow down reading from the audit socket
+    log::log_set_logger(std::make_shared<log::AsyncLogger>(
+            std::make_shared<log::StdioLogger>(stdout, false)));
+    auto reset_logger = util::finally([]{
+        log::log_set_logger(nullptr);
+    });
+
     return audit_mainloop() ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
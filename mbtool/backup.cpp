@@ -20,15 +20,25 @@
 #include "backup.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <csignal>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -37,20 +47,29 @@
 #include "mblog/logging.h"
 #include "mbutil/autoclose/archive.h"
 #include "mbutil/autoclose/dir.h"
+#include "mbutil/autoclose/file.h"
 #include "mbutil/archive.h"
 #include "mbutil/copy.h"
 #include "mbutil/delete.h"
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
+#include "mbutil/integer.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
 #include "mbutil/time.h"
+#include "mbutil/trace.h"
 
+#include "backup_index.h"
+#include "backup_stream.h"
+#include "chunk_store.h"
+#include "differential_restore.h"
+#include "ext4_image.h"
 #include "installer_util.h"
 #include "image.h"
+#include "job_manager.h"
 #include "multiboot.h"
 #include "roms.h"
 #include "wipe.h"
@@ -77,6 +96,34 @@ namespace mb
 #define BACKUP_NAME_BOOT_IMAGE          "boot.img"
 #define BACKUP_NAME_CONFIG              "config.json"
 #define BACKUP_NAME_THUMBNAIL           "thumbnail.webp"
+// Name of the backup that an incremental backup is relative to
+#define BACKUP_NAME_BASE                "base.txt"
+
+// Index of the files in each partition's backup
+#define BACKUP_INDEX_SUFFIX             ".index"
+// Paths deleted since the base backup. Only exists for incremental backups.
+#define BACKUP_DELETED_SUFFIX           ".deleted"
+// Maximum length of a chain of incremental backups
+#define BACKUP_MAX_CHAIN_LENGTH         100
+
+// Chunk store shared by deduplicated backups in the same backup directory
+#define BACKUP_CHUNK_DIR                ".chunks"
+// Deduplicated backups store uncompressed "<prefix>.manifest.tar" archives
+#define BACKUP_MANIFEST_SUFFIX          ".manifest"
+// Block-level backups of images store "<prefix>.blocks.tar[.<ext>]" archives
+// containing only the image as a sparse file
+#define BACKUP_BLOCKS_SUFFIX            ".blocks"
+
+// How often to log the progress of running targets
+#define BACKUP_PROGRESS_INTERVAL        std::chrono::seconds(10)
+// How often to report the progress of running targets to the daemon's job
+// manager (if running as a job)
+#define BACKUP_REPORT_INTERVAL          std::chrono::seconds(1)
+
+// Restore into the existing files instead of wiping them first
+#define RESTORE_DIFFERENTIAL            0x1
+// Also compare the contents of files in deduplicated backups
+#define RESTORE_COMPARE_HASHES          0x2
 
 enum class Result
 {
@@ -86,6 +133,19 @@ enum class Result
     BOOT_IMAGE_UNPATCHED
 };
 
+/*!
+ * \brief One archive in a chain of incremental backups of a partition
+ */
+struct BackupLayer
+{
+    std::string archive;
+    util::compression_type compression;
+    // Whether the archive is a block-level backup of an image
+    bool blocks;
+    // Path to deletion list, or empty if this is a full backup
+    std::string deleted_list;
+};
+
 struct compression_map {
     util::compression_type type;
     const char *name;
@@ -169,7 +229,10 @@ static std::string find_compressed_backup(const std::string &backup_dir,
 static bool backup_directory(const std::string &output_file,
                              const std::string &directory,
                              const std::vector<std::string> &exclusions,
-                             util::compression_type compression)
+                             util::compression_type compression,
+                             bool adaptive,
+                             util::TarDataStore *store,
+                             BackupIndex *index)
 {
     autoclose::dir dp(autoclose::opendir(directory.c_str()));
     if (!dp) {
@@ -199,58 +262,117 @@ static bool backup_directory(const std::string &output_file,
     }
 
     return util::libarchive_tar_create(output_file, directory, contents,
-                                       compression);
+                                       compression, store, index, adaptive);
 }
 
-static bool restore_directory(const std::string &input_file,
+static bool restore_directory(const std::vector<BackupLayer> &layers,
                               const std::string &directory,
                               const std::vector<std::string> &exclusions,
-                              util::compression_type compression)
+                              ChunkStore *store, int flags)
 {
-    if (!wipe_directory(directory, exclusions)) {
+    std::unique_ptr<DifferentialRestore> differential;
+
+    if (flags & RESTORE_DIFFERENTIAL) {
+        differential.reset(new DifferentialRestore(
+                directory, store, flags & RESTORE_COMPARE_HASHES));
+    } else if (!wipe_directory(directory, exclusions)) {
         return false;
     }
 
-    return util::libarchive_tar_extract(input_file, directory, {}, compression);
+    for (auto const &layer : layers) {
+        // Deleted paths include paths that changed type, so they must be
+        // removed before the new entries are extracted
+        if (!layer.deleted_list.empty()) {
+            std::vector<std::string> deleted;
+            if (!BackupIndex::read_deleted(layer.deleted_list, &deleted)) {
+                return false;
+            }
+
+            for (auto const &path : deleted) {
+                std::string full_path(directory);
+                full_path += '/';
+                full_path += path;
+
+                if (!util::delete_recursive(full_path)) {
+                    LOGE("%s: Failed to delete: %s",
+                         full_path.c_str(), strerror(errno));
+                    return false;
+                }
+
+                if (differential) {
+                    differential->forget(path);
+                }
+            }
+        }
+
+        if (!util::libarchive_tar_extract(layer.archive, directory, {},
+                                          layer.compression, store,
+                                          differential.get())) {
+            return false;
+        }
+    }
+
+    if (differential) {
+        if (!differential->delete_extras(exclusions)) {
+            return false;
+        }
+
+        LOGI("%s: %" PRIu64 " unchanged, %" PRIu64 " rewritten,"
+             " %" PRIu64 " deleted", directory.c_str(),
+             differential->unchanged(), differential->rewritten(),
+             differential->deleted());
+    }
+
+    return true;
 }
 
 static bool backup_image(const std::string &output_file,
                          const std::string &image,
+                         const std::string &mount_point,
                          const std::vector<std::string> &exclusions,
-                         util::compression_type compression)
+                         util::compression_type compression,
+                         bool adaptive,
+                         util::TarDataStore *store,
+                         BackupIndex *index)
 {
-    if (!util::mkdir_recursive(BACKUP_MNT_DIR, 0755) && errno != EEXIST) {
+    if (!util::mkdir_recursive(mount_point, 0755) && errno != EEXIST) {
         LOGE("%s: Failed to create directory: %s",
-             BACKUP_MNT_DIR, strerror(errno));
+             mount_point.c_str(), strerror(errno));
         return false;
     }
 
-    fsck_ext4_image(image);
+    fsck_ext4_image_if_needed(image);
 
-    if (!util::mount(image.c_str(), BACKUP_MNT_DIR, "ext4", MS_RDONLY, "")) {
-        LOGE("Failed to mount %s at %s: %s", image.c_str(), BACKUP_MNT_DIR,
-             strerror(errno));
+    if (!util::mount(image.c_str(), mount_point.c_str(), "ext4", MS_RDONLY,
+                     "")) {
+        LOGE("Failed to mount %s at %s: %s", image.c_str(),
+             mount_point.c_str(), strerror(errno));
         return false;
     }
 
-    bool ret = backup_directory(output_file, BACKUP_MNT_DIR, exclusions,
-                                compression);
+    bool ret = backup_directory(output_file, mount_point, exclusions,
+                                compression, adaptive, store, index);
 
-    if (!util::umount(BACKUP_MNT_DIR)) {
-        LOGE("Failed to unmount %s: %s", BACKUP_MNT_DIR, strerror(errno));
+    if (!util::umount(mount_point.c_str())) {
+        LOGE("Failed to unmount %s: %s", mount_point.c_str(), strerror(errno));
         return false;
     }
 
+    mark_ext4_image_clean(image);
+
+    rmdir(mount_point.c_str());
+    // Fails if another target is still using it
     rmdir(BACKUP_MNT_DIR);
 
     return ret;
 }
 
-static bool restore_image(const std::string &input_file,
+static bool restore_image(const std::vector<BackupLayer> &layers,
                           const std::string &image,
+                          const std::string &mount_point,
                           uint64_t size,
                           const std::vector<std::string> &exclusions,
-                          util::compression_type compression)
+                          ChunkStore *store, int flags)
 {
     if (!util::mkdir_parent(image, S_IRWXU)) {
         LOGE("%s: Failed to create parent directory: %s",
@@ -271,55 +393,222 @@ static bool restore_image(const std::string &input_file,
         }
     }
 
-    if (!util::mkdir_recursive(BACKUP_MNT_DIR, 0755) && errno != EEXIST) {
+    if (!util::mkdir_recursive(mount_point, 0755) && errno != EEXIST) {
         LOGE("%s: Failed to create directory: %s",
-             BACKUP_MNT_DIR, strerror(errno));
+             mount_point.c_str(), strerror(errno));
         return false;
     }
 
-    fsck_ext4_image(image);
+    fsck_ext4_image_if_needed(image);
 
-    if (!util::mount(image.c_str(), BACKUP_MNT_DIR, "ext4", 0, "")) {
-        LOGE("Failed to mount %s at %s: %s", image.c_str(), BACKUP_MNT_DIR,
-             strerror(errno));
+    if (!util::mount(image.c_str(), mount_point.c_str(), "ext4", 0, "")) {
+        LOGE("Failed to mount %s at %s: %s", image.c_str(),
+             mount_point.c_str(), strerror(errno));
         return false;
     }
 
-    bool ret = restore_directory(input_file, BACKUP_MNT_DIR, exclusions,
-                                 compression);
+    bool ret = restore_directory(layers, mount_point, exclusions, store,
+                                 flags);
 
-    if (!util::umount(BACKUP_MNT_DIR)) {
-        LOGE("Failed to unmount %s: %s", BACKUP_MNT_DIR, strerror(errno));
+    if (!util::umount(mount_point.c_str())) {
+        LOGE("Failed to unmount %s: %s", mount_point.c_str(), strerror(errno));
         return false;
     }
 
+    mark_ext4_image_clean(image);
+
+    rmdir(mount_point.c_str());
+    // Fails if another target is still using it
     rmdir(BACKUP_MNT_DIR);
 
     return ret;
 }
 
+/*!
+ * \brief Backup the allocated blocks of an ext4 image
+ *
+ * The image is neither checked nor mounted. It is stored as a sparse file
+ * containing only the blocks that are allocated according to the ext4 block
+ * bitmaps.
+ *
+ * \return BlockCopyResult::SUCCEEDED if the image was backed up
+ *         BlockCopyResult::UNSUPPORTED if the image must be backed up file
+ *           by file instead. \a output_file is not created in this case.
+ *         BlockCopyResult::FAILED if an error occurred
+ */
+static BlockCopyResult backup_image_blocks(const std::string &output_file,
+                                           const std::string &image,
+                                           util::compression_type compression,
+                                           bool adaptive)
+{
+    std::vector<util::sparse_extent> extents;
+    uint64_t size;
+
+    auto result = find_ext4_allocated_extents(image, &extents, &size);
+    if (result != BlockCopyResult::SUCCEEDED) {
+        return result;
+    }
+
+    uint64_t allocated = 0;
+    for (auto const &extent : extents) {
+        allocated += extent.length;
+    }
+
+    LOGI("%s: Storing %" PRIu64 " of %" PRIu64 " bytes in %zu extents",
+         image.c_str(), allocated, size, extents.size());
+
+    if (!util::libarchive_tar_create_sparse(output_file, image,
+                                            util::base_name(image), extents,
+                                            compression, adaptive)) {
+        return BlockCopyResult::FAILED;
+    }
+
+    return BlockCopyResult::SUCCEEDED;
+}
+
+/*!
+ * \brief Extracts the image in a block-level backup to a specific path
+ */
+class ImageEntryFilter : public util::TarEntryFilter
+{
+public:
+    ImageEntryFilter(std::string image) : _image(std::move(image))
+    {
+    }
+
+    bool include(archive_entry *entry) override
+    {
+        if (archive_entry_filetype(entry) != AE_IFREG) {
+            LOGW("%s: Skipping non-file entry in block-level backup",
+                 archive_entry_pathname(entry));
+            return false;
+        }
+
+        // The archive stores the image under its name at the time of the
+        // backup
+        archive_entry_set_pathname(entry, _image.c_str());
+        return true;
+    }
+
+private:
+    std::string _image;
+};
+
+/*!
+ * \brief Restore an image from a block-level backup
+ *
+ * The image is replaced by the one in the backup. Blocks that were free when
+ * the backup was made are left as holes.
+ */
+static bool restore_image_blocks(const BackupLayer &layer,
+                                 const std::string &image)
+{
+    if (!util::mkdir_parent(image, S_IRWXU)) {
+        LOGE("%s: Failed to create parent directory: %s",
+             image.c_str(), strerror(errno));
+        return false;
+    }
+
+    ImageEntryFilter filter(image);
+
+    return util::libarchive_tar_extract(layer.archive, util::dir_name(image),
+                                        {}, layer.compression, nullptr,
+                                        &filter);
+}
+
+/*!
+ * \brief Get the mount point for an image
+ *
+ * Each target gets its own mount point (named after the target's archive
+ * prefix) so that targets can be processed concurrently.
+ */
+static std::string image_mount_point(const std::string &prefix)
+{
+    std::string mount_point(BACKUP_MNT_DIR);
+    mount_point += '/';
+    mount_point += prefix;
+    return mount_point;
+}
+
+/*!
+ * \brief Destination of a backup: a backup directory or a stream
+ */
+class BackupOutput
+{
+public:
+    explicit BackupOutput(std::string dir)
+        : _dir(std::move(dir)), _stream(nullptr)
+    {
+    }
+
+    explicit BackupOutput(BackupStreamWriter *stream)
+        : _stream(stream)
+    {
+    }
+
+    bool is_stream() const
+    {
+        return _stream != nullptr;
+    }
+
+    /*!
+     * \brief Path to the backup directory (empty if streaming)
+     */
+    const std::string & dir() const
+    {
+        return _dir;
+    }
+
+    /*!
+     * \brief Store a copy of an existing file as \a name
+     */
+    bool add_file(const std::string &name, const std::string &path)
+    {
+        if (_stream) {
+            return _stream->add_file(name, path);
+        } else {
+            return util::copy_file(path, _dir + "/" + name, 0);
+        }
+    }
+
+    /*!
+     * \brief Store the file that \a fn writes as \a name
+     */
+    bool add_archive(const std::string &name, const StreamProducerFn &fn)
+    {
+        if (_stream) {
+            return _stream->add_archive(name, fn);
+        } else {
+            return fn(_dir + "/" + name);
+        }
+    }
+
+private:
+    std::string _dir;
+    BackupStreamWriter *_stream;
+};
+
 /*!
  * \brief Backup boot image of a ROM
  *
  * \param rom ROM
- * \param backup_dir Backup directory
+ * \param output Backup destination
  *
  * \return Result::SUCCEEDED if the boot image was successfully backed up
  *         Result::FAILED if an error occured
  *         Result::FILES_MISSING if the boot image doesn't exist
  */
 static Result backup_boot_image(const std::shared_ptr<Rom> &rom,
-                                const std::string &backup_dir)
+                                BackupOutput &output)
 {
+    MB_TRACE_SCOPE("backup.boot");
+
     std::string boot_image_path(rom->boot_image_path());
-    std::string boot_image_backup(backup_dir);
-    boot_image_backup += '/';
-    boot_image_backup += BACKUP_NAME_BOOT_IMAGE;
 
     struct stat sb;
     if (stat(boot_image_path.c_str(), &sb) == 0) {
         LOGI("=== Backing up %s ===", boot_image_path.c_str());
-        if (!util::copy_file(boot_image_path, boot_image_backup, 0)) {
+        if (!output.add_file(BACKUP_NAME_BOOT_IMAGE, boot_image_path)) {
             return Result::FAILED;
         }
     } else {
@@ -343,6 +632,8 @@ static Result backup_boot_image(const std::shared_ptr<Rom> &rom,
 static Result restore_boot_image(const std::shared_ptr<Rom> &rom,
                                  const std::string &backup_dir)
 {
+    MB_TRACE_SCOPE("restore.boot");
+
     std::string boot_image_path(rom->boot_image_path());
     std::string boot_image_backup(backup_dir);
     boot_image_backup += '/';
@@ -360,7 +651,7 @@ static Result restore_boot_image(const std::shared_ptr<Rom> &rom,
     rps.push_back(rp_write_rom_id(rom->id));
 
     if (!InstallerUtil::patch_boot_image(
-            boot_image_backup, boot_image_path, rps)) {
+            boot_image_backup, boot_image_path, rps, rom->id)) {
         LOGE("Failed to patch boot image");
         return Result::FAILED;
     }
@@ -375,31 +666,26 @@ static Result restore_boot_image(const std::shared_ptr<Rom> &rom,
  * \brief Backup configuration file and thumbnail for a ROM
  *
  * \param rom ROM
- * \param backup_dir Backup directory
+ * \param output Backup destination
  *
  * \return Result::SUCCEEDED if the configs were successfully backed up
  *         Result::FAILED if an error occured
  *         Result::FILES_MISSING if the configs don't exist
  */
 static Result backup_configs(const std::shared_ptr<Rom> &rom,
-                             const std::string &backup_dir)
+                             BackupOutput &output)
 {
+    MB_TRACE_SCOPE("backup.config");
+
     std::string config_path(rom->config_path());
     std::string thumbnail_path(rom->thumbnail_path());
 
-    std::string config_backup(backup_dir);
-    config_backup += '/';
-    config_backup += BACKUP_NAME_CONFIG;
-    std::string thumbnail_backup(backup_dir);
-    thumbnail_backup += '/';
-    thumbnail_backup += BACKUP_NAME_THUMBNAIL;
-
     Result ret = Result::SUCCEEDED;
 
     struct stat sb;
     if (stat(config_path.c_str(), &sb) == 0) {
         LOGI("=== Backing up %s ===", config_path.c_str());
-        if (!util::copy_file(config_path, config_backup, 0)) {
+        if (!output.add_file(BACKUP_NAME_CONFIG, config_path)) {
             return Result::FAILED;
         }
     } else {
@@ -408,7 +694,7 @@ static Result backup_configs(const std::shared_ptr<Rom> &rom,
     }
     if (stat(thumbnail_path.c_str(), &sb) == 0) {
         LOGI("=== Backing up %s ===", thumbnail_path.c_str());
-        if (!util::copy_file(thumbnail_path, thumbnail_backup, 0)) {
+        if (!output.add_file(BACKUP_NAME_THUMBNAIL, thumbnail_path)) {
             return Result::FAILED;
         }
     } else {
@@ -432,6 +718,8 @@ static Result backup_configs(const std::shared_ptr<Rom> &rom,
 static Result restore_configs(const std::shared_ptr<Rom> &rom,
                               const std::string &backup_dir)
 {
+    MB_TRACE_SCOPE("restore.config");
+
     std::string config_path(rom->config_path());
     std::string thumbnail_path(rom->thumbnail_path());
 
@@ -471,93 +759,445 @@ static Result restore_configs(const std::shared_ptr<Rom> &rom,
  * \brief Backup a partition for a ROM
  *
  * \param path Path to mountpoint/directory or image
- * \param backup_dir Backup directory
+ * \param output Backup destination. Indexes and deletion lists are only
+ *               written to backup directories.
+ * \param prefix Prefix for the archive, index, and deletion list names
  * \param archive_name Backup archive name
  * \param is_image Whether \a path is an ext4 image
+ * \param blocks Whether to backup the allocated blocks of images instead of
+ *               their files if possible
  * \param exclusions List of top-level directories to exclude from the backup
+ * \param compression Compression type
+ * \param adaptive Whether to adapt the compression level to the destination
+ * \param store If not null, chunk store for the contents of files
+ * \param base_dir If not empty, only archive files that changed since this
+ *                 backup
  *
  * \return Result::SUCCEEDED if the directory/image was successfully backed up
  *         Result::FAILED if an error occured
  *         Result::FILES_MISSING if \a path does not exist
  */
 static Result backup_partition(const std::string &path,
-                               const std::string &backup_dir,
+                               BackupOutput &output,
+                               const std::string &prefix,
                                const std::string &archive_name,
-                               bool is_image,
+                               bool is_image, bool blocks,
                                const std::vector<std::string> &exclusions,
-                               util::compression_type compression)
+                               util::compression_type compression,
+                               bool adaptive,
+                               util::TarDataStore *store,
+                               const std::string &base_dir)
 {
-    std::string archive(backup_dir);
-    archive += '/';
-    archive += archive_name;
+    std::string prefix_path(output.dir());
+    prefix_path += '/';
+    prefix_path += prefix;
 
     bool ret = false;
 
     struct stat sb;
-    if (stat(path.c_str(), &sb) == 0) {
-        LOGI("=== Backing up %s ===", path.c_str());
+    if (stat(path.c_str(), &sb) < 0) {
+        LOGW("=== %s does not exist ===", path.c_str());
+        return Result::FILES_MISSING;
+    }
+
+    if (is_image && blocks) {
+        LOGI("=== Backing up blocks of %s ===", path.c_str());
+
+        // Nothing is written (or streamed) if the blocks cannot be backed up
+        BlockCopyResult result = BlockCopyResult::FAILED;
+        bool added = output.add_archive(get_compressed_backup_name(
+                prefix + BACKUP_BLOCKS_SUFFIX, compression),
+                [&](const std::string &blocks_archive) {
+            result = backup_image_blocks(blocks_archive, path, compression,
+                                         adaptive);
+            return result != BlockCopyResult::FAILED;
+        });
+
+        switch (result) {
+        case BlockCopyResult::SUCCEEDED:
+            if (!added) {
+                return Result::FAILED;
+            }
+            // Block-level backups cannot be the base of incremental backups
+            if (!output.is_stream()) {
+                unlink((prefix_path + BACKUP_INDEX_SUFFIX).c_str());
+                unlink((prefix_path + BACKUP_DELETED_SUFFIX).c_str());
+            }
+            return Result::SUCCEEDED;
+        case BlockCopyResult::UNSUPPORTED:
+            LOGW("%s: Cannot backup blocks; backing up files instead",
+                 path.c_str());
+            break;
+        case BlockCopyResult::FAILED:
+            return Result::FAILED;
+        }
+    }
+
+    BackupIndex index;
+
+    if (!base_dir.empty()) {
+        std::string base_index(base_dir);
+        base_index += '/';
+        base_index += prefix;
+        base_index += BACKUP_INDEX_SUFFIX;
+
+        if (access(base_index.c_str(), R_OK) == 0) {
+            if (!index.load_base(base_index)) {
+                return Result::FAILED;
+            }
+        } else {
+            LOGW("%s: Base backup has no index; backing up all files",
+                 base_index.c_str());
+        }
+    }
+
+    LOGI("=== Backing up %s ===", path.c_str());
+    ret = output.add_archive(archive_name, [&](const std::string &archive) {
         if (is_image) {
-            ret = backup_image(archive, path, exclusions, compression);
+            return backup_image(archive, path, image_mount_point(prefix),
+                                exclusions, compression, adaptive, store,
+                                &index);
         } else {
-            ret = backup_directory(archive, path, exclusions, compression);
+            return backup_directory(archive, path, exclusions, compression,
+                                    adaptive, store, &index);
+        }
+    });
+
+    if (!ret) {
+        return Result::FAILED;
+    } else if (output.is_stream()) {
+        // Streamed backups cannot be the base of incremental backups
+        return Result::SUCCEEDED;
+    } else if (!index.write(prefix_path + BACKUP_INDEX_SUFFIX)) {
+        return Result::FAILED;
+    }
+
+    if (index.has_base()) {
+        if (!index.write_deleted(prefix_path + BACKUP_DELETED_SUFFIX)) {
+            return Result::FAILED;
         }
+
+        LOGI("%s: %" PRIu64 " files changed, %" PRIu64 " files unchanged",
+             path.c_str(), index.changed(), index.unchanged());
     } else {
-        LOGW("=== %s does not exist ===", path.c_str());
-        return Result::FILES_MISSING;
+        // Don't let a leftover list from an overwritten backup turn this one
+        // into an incremental backup
+        unlink((prefix_path + BACKUP_DELETED_SUFFIX).c_str());
     }
 
-    return ret ? Result::SUCCEEDED : Result::FAILED;
+    return Result::SUCCEEDED;
 }
 
 /*!
  * \brief Restore a partition for a ROM
  *
  * \param path Path to mountpoint/directory or image
- * \param backup_dir Backup directory
- * \param archive_name Backup archive name
+ * \param prefix Prefix of the archive names
+ * \param layers Full backup followed by the incremental backups to apply
  * \param is_image Whether \a path is an ext4 image
  * \param exclusions List of top-level directories to exclude from the wipe
  *                   process before restoring
+ * \param store Chunk store for the contents of files in manifests
+ * \param flags RESTORE_* flags
  *
  * \return Result::SUCCEEDED if the directory/image was successfully restored
  *         Result::FAILED if an error occured
- *         Result::FILES_MISSING if \a archive_name does not exist in
- *         \a backup_dir
+ *         Result::FILES_MISSING if the full backup's archive does not exist
  */
 static Result restore_partition(const std::string &path,
-                                const std::string &backup_dir,
-                                const std::string &archive_name,
+                                const std::string &prefix,
+                                const std::vector<BackupLayer> &layers,
                                 bool is_image,
                                 uint64_t image_size,
                                 const std::vector<std::string> &exclusions,
-                                util::compression_type compression)
+                                ChunkStore *store, int flags)
 {
-    std::string archive(backup_dir);
-    archive += '/';
-    archive += archive_name;
-
     bool ret = false;
 
     struct stat sb;
-    if (stat(archive.c_str(), &sb) == 0) {
+    if (!layers.empty() && stat(layers.front().archive.c_str(), &sb) == 0) {
         LOGI("=== Restoring to %s ===", path.c_str());
-        if (is_image) {
-            ret = restore_image(archive, path, image_size, exclusions,
-                                compression);
+        for (auto const &layer : layers) {
+            LOGI("- %s", layer.archive.c_str());
+        }
+        if (layers.front().blocks) {
+            if (!is_image) {
+                LOGE("%s: Block-level backups can only be restored to images",
+                     path.c_str());
+                return Result::FAILED;
+            }
+            ret = restore_image_blocks(layers.front(), path);
+        } else if (is_image) {
+            ret = restore_image(layers, path, image_mount_point(prefix),
+                                image_size, exclusions, store, flags);
         } else {
-            ret = restore_directory(archive, path, exclusions, compression);
+            ret = restore_directory(layers, path, exclusions, store, flags);
         }
     } else {
-        LOGW("=== %s does not exist ===", archive.c_str());
+        LOGW("=== Backup of %s does not exist ===", path.c_str());
         return Result::FILES_MISSING;
     }
 
     return ret ? Result::SUCCEEDED : Result::FAILED;
 }
 
+/*!
+ * \brief Backup or restore of a single partition target
+ */
+struct TargetJob
+{
+    enum class State
+    {
+        PENDING,
+        RUNNING,
+        DONE,
+    };
+
+    TargetJob(const char *name_, std::string path_,
+              std::function<Result(ChunkStore *)> func_)
+        : name(name_)
+        , path(std::move(path_))
+        , func(std::move(func_))
+        , state(State::PENDING)
+        , device(0)
+        , tid(0)
+        , result(Result::FAILED)
+    {
+    }
+
+    const char *name;
+    // Path on the device that the target reads from (backup) or writes to
+    // (restore)
+    std::string path;
+    std::function<Result(ChunkStore *)> func;
+    // Each job has its own store since stores are not thread safe
+    std::unique_ptr<ChunkStore> store;
+
+    State state;
+    dev_t device;
+    pid_t tid;
+    std::chrono::steady_clock::time_point start;
+    Result result;
+};
+
+/*!
+ * \brief Get the device of a path or its nearest existing parent
+ */
+static dev_t path_device(std::string path)
+{
+    struct stat sb;
+
+    while (stat(path.c_str(), &sb) < 0) {
+        std::string parent = util::dir_name(path);
+        if (parent == path) {
+            return 0;
+        }
+        path = std::move(parent);
+    }
+
+    return sb.st_dev;
+}
+
+/*!
+ * \brief Get the number of bytes a thread has read from and written to storage
+ */
+static bool get_thread_io(pid_t tid, uint64_t *read_bytes,
+                          uint64_t *write_bytes)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/io", tid);
+
+    autoclose::file fp(autoclose::fopen(path, "r"));
+    if (!fp) {
+        return false;
+    }
+
+    char line[128];
+    int found = 0;
+
+    while (fgets(line, sizeof(line), fp.get())) {
+        if (sscanf(line, "read_bytes: %" SCNu64, read_bytes) == 1
+                || sscanf(line, "write_bytes: %" SCNu64, write_bytes) == 1) {
+            ++found;
+        }
+    }
+
+    return found == 2;
+}
+
+static void log_job_progress(const TargetJob &job, bool log)
+{
+    auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - job.start).count();
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    bool have_io = get_thread_io(job.tid, &read_bytes, &write_bytes);
+
+    // The total is not known in advance
+    job_progress_report(job.name, have_io ? read_bytes + write_bytes : 0,
+                        0, 0, 0);
+
+    if (!log) {
+        return;
+    } else if (have_io) {
+        LOGI("[%s] Running for %" PRId64 "s: read %" PRIu64 " MiB,"
+             " wrote %" PRIu64 " MiB", job.name, static_cast<int64_t>(elapsed),
+             read_bytes / 1024 / 1024, write_bytes / 1024 / 1024);
+    } else {
+        LOGI("[%s] Running for %" PRId64 "s",
+             job.name, static_cast<int64_t>(elapsed));
+    }
+}
+
+/*!
+ * \brief Run partition target jobs concurrently
+ *
+ * At most \a max_jobs jobs run at the same time and jobs whose data is on the
+ * same device are never run concurrently, since they would only compete for
+ * the same storage. Jobs are started in order. If a job fails, jobs that have
+ * not started yet are skipped.
+ *
+ * \return Whether no job failed
+ */
+static bool run_target_jobs(std::vector<TargetJob> &jobs,
+                            unsigned int max_jobs)
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<dev_t> busy_devices;
+    size_t pending = jobs.size();
+    unsigned int exited = 0;
+    bool failed = false;
+
+    for (auto &job : jobs) {
+        job.device = path_device(job.path);
+    }
+
+    auto next_job = [&]() -> TargetJob * {
+        for (auto &job : jobs) {
+            if (job.state == TargetJob::State::PENDING
+                    && std::find(busy_devices.begin(), busy_devices.end(),
+                                 job.device) == busy_devices.end()) {
+                return &job;
+            }
+        }
+        return nullptr;
+    };
+
+    auto worker = [&] {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            TargetJob *job = nullptr;
+
+            cv.wait(lock, [&] {
+                return failed || pending == 0 || (job = next_job());
+            });
+            if (!job) {
+                break;
+            }
+
+            job->state = TargetJob::State::RUNNING;
+            job->tid = static_cast<pid_t>(syscall(SYS_gettid));
+            job->start = std::chrono::steady_clock::now();
+            busy_devices.push_back(job->device);
+            --pending;
+
+            lock.unlock();
+
+            LOGI("[%s] Started", job->name);
+            Result result = job->func(job->store.get());
+
+            lock.lock();
+
+            job->state = TargetJob::State::DONE;
+            job->result = result;
+            busy_devices.erase(std::find(busy_devices.begin(),
+                                         busy_devices.end(), job->device));
+            if (result == Result::FAILED) {
+                failed = true;
+            }
+
+            LOGI("[%s] %s after %" PRId64 "s", job->name,
+                 result == Result::FAILED ? "Failed" : "Finished",
+                 static_cast<int64_t>(
+                         std::chrono::duration_cast<std::chrono::seconds>(
+                                 std::chrono::steady_clock::now()
+                                 - job->start).count()));
+
+            cv.notify_all();
+        }
+
+        ++exited;
+        cv.notify_all();
+    };
+
+    unsigned int n_threads = std::min<unsigned int>(
+            std::max(max_jobs, 1u), static_cast<unsigned int>(jobs.size()));
+    std::vector<std::thread> threads;
+
+    for (unsigned int i = 0; i < n_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto next_report = std::chrono::steady_clock::now()
+                + BACKUP_REPORT_INTERVAL;
+        auto next_log = std::chrono::steady_clock::now()
+                + BACKUP_PROGRESS_INTERVAL;
+
+        while (exited < n_threads) {
+            if (cv.wait_until(lock, next_report) == std::cv_status::timeout) {
+                bool log = next_report >= next_log;
+
+                for (auto const &job : jobs) {
+                    if (job.state == TargetJob::State::RUNNING) {
+                        log_job_progress(job, log);
+                    }
+                }
+                next_report += BACKUP_REPORT_INTERVAL;
+                if (log) {
+                    next_log += BACKUP_PROGRESS_INTERVAL;
+                }
+            }
+        }
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (auto const &job : jobs) {
+        if (job.state == TargetJob::State::PENDING) {
+            LOGW("[%s] Skipped because another target failed", job.name);
+        }
+    }
+
+    return !failed;
+}
+
+/*!
+ * \brief Backup a ROM
+ *
+ * \param rom ROM
+ * \param output Backup directory or stream
+ * \param targets Targets to backup
+ * \param compression Compression type
+ * \param adaptive Whether to adapt the compression level to the destination
+ * \param blocks Whether to backup the allocated blocks of images
+ * \param chunk_dir If not empty, deduplicate the backup using this chunk store
+ * \param base_dir If not empty, make an incremental backup relative to this
+ *                 backup
+ * \param jobs Maximum number of partitions to backup concurrently
+ *
+ * \return Whether all targets were successfully backed up
+ */
 static bool backup_rom(const std::shared_ptr<Rom> &rom,
-                       const std::string &output_dir, int targets,
-                       util::compression_type compression)
+                       BackupOutput &output, int targets,
+                       util::compression_type compression, bool adaptive,
+                       bool blocks, const std::string &chunk_dir,
+                       const std::string &base_dir, unsigned int jobs)
 {
     if (!targets) {
         LOGE("No backup targets specified");
@@ -590,62 +1230,424 @@ static bool backup_rom(const std::shared_ptr<Rom> &rom,
         LOGI("  - Configs: %s", config_path.c_str());
         LOGI("             %s", thumbnail_path.c_str());
     }
-    LOGI("- Backup directory: %s", output_dir.c_str());
+    if (output.is_stream()) {
+        LOGI("- Backup stream: yes");
+    } else {
+        LOGI("- Backup directory: %s", output.dir().c_str());
+    }
+    LOGI("- Deduplicated: %s", chunk_dir.empty() ? "no" : "yes");
+    LOGI("- Adaptive compression: %s", adaptive ? "yes" : "no");
+    LOGI("- Block-level images: %s", blocks ? "yes" : "no");
+    if (!base_dir.empty()) {
+        LOGI("- Incremental from: %s", base_dir.c_str());
+    }
+    LOGI("- Jobs: %u", jobs);
+
+    bool compress_chunks = compression != util::compression_type::NONE;
+    std::string suffix;
+    if (!chunk_dir.empty()) {
+        // Manifests are small, so only the chunks are compressed
+        suffix = BACKUP_MANIFEST_SUFFIX;
+        compression = util::compression_type::NONE;
+    }
 
     std::string output_system = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_SYSTEM, compression);
+            BACKUP_NAME_PREFIX_SYSTEM + suffix, compression);
     std::string output_cache = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_CACHE, compression);
+            BACKUP_NAME_PREFIX_CACHE + suffix, compression);
     std::string output_data = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_DATA, compression);
+            BACKUP_NAME_PREFIX_DATA + suffix, compression);
+
+    // Streamed backups are always full backups
+    if (!output.is_stream()) {
+        std::string base_file(output.dir());
+        base_file += "/" BACKUP_NAME_BASE;
+
+        if (base_dir.empty()) {
+            unlink(base_file.c_str());
+        } else {
+            std::string base_name = util::base_name(base_dir);
+            if (!util::file_write_data(base_file, base_name.data(),
+                                       base_name.size())) {
+                LOGE("%s: Failed to write: %s",
+                     base_file.c_str(), strerror(errno));
+                return false;
+            }
+        }
+    }
 
     // Backup boot image
     if (targets & BACKUP_TARGET_BOOT
-            && backup_boot_image(rom, output_dir) == Result::FAILED) {
+            && backup_boot_image(rom, output) == Result::FAILED) {
         return false;
     }
 
     // Backup configs
     if (targets & BACKUP_TARGET_CONFIG
-            && backup_configs(rom, output_dir) == Result::FAILED) {
+            && backup_configs(rom, output) == Result::FAILED) {
         return false;
     }
 
+    std::vector<TargetJob> target_jobs;
+
     // Backup system
     if (targets & BACKUP_TARGET_SYSTEM) {
-        Result ret = backup_partition(
-                system_path, output_dir, output_system,
-                rom->system_is_image, { "multiboot" }, compression);
-        if (ret == Result::FAILED) {
-            return false;
-        }
+        target_jobs.emplace_back(BACKUP_NAME_PREFIX_SYSTEM, system_path,
+                                 [&](ChunkStore *store) {
+            MB_TRACE_SCOPE("backup.system");
+
+            return backup_partition(
+                    system_path, output, BACKUP_NAME_PREFIX_SYSTEM,
+                    output_system,
+                    rom->system_is_image, blocks, { "multiboot" },
+                    compression, adaptive, store, base_dir);
+        });
     }
 
     // Backup cache
     if (targets & BACKUP_TARGET_CACHE) {
-        Result ret = backup_partition(
-                cache_path, output_dir, output_cache,
-                rom->cache_is_image, { "multiboot" }, compression);
-        if (ret == Result::FAILED) {
-            return false;
-        }
+        target_jobs.emplace_back(BACKUP_NAME_PREFIX_CACHE, cache_path,
+                                 [&](ChunkStore *store) {
+            MB_TRACE_SCOPE("backup.cache");
+
+            return backup_partition(
+                    cache_path, output, BACKUP_NAME_PREFIX_CACHE,
+                    output_cache,
+                    rom->cache_is_image, blocks, { "multiboot" },
+                    compression, adaptive, store, base_dir);
+        });
     }
 
     // Backup data
     if (targets & BACKUP_TARGET_DATA) {
-        Result ret = backup_partition(
-                data_path, output_dir, output_data,
-                rom->data_is_image, { "media", "multiboot" }, compression);
-        if (ret == Result::FAILED) {
+        target_jobs.emplace_back(BACKUP_NAME_PREFIX_DATA, data_path,
+                                 [&](ChunkStore *store) {
+            MB_TRACE_SCOPE("backup.data");
+
+            return backup_partition(
+                    data_path, output, BACKUP_NAME_PREFIX_DATA,
+                    output_data,
+                    rom->data_is_image, blocks, { "media", "multiboot" },
+                    compression, adaptive, store, base_dir);
+        });
+    }
+
+    if (!chunk_dir.empty()) {
+        for (auto &job : target_jobs) {
+            job.store.reset(new ChunkStore(chunk_dir, compress_chunks));
+        }
+    }
+
+    if (!run_target_jobs(target_jobs, jobs)) {
+        return false;
+    }
+
+    if (!chunk_dir.empty()) {
+        uint64_t new_bytes = 0;
+        uint64_t total_bytes = 0;
+
+        for (auto const &job : target_jobs) {
+            new_bytes += job.store->new_bytes();
+            total_bytes += job.store->total_bytes();
+        }
+
+        LOGI("Stored %" PRIu64 " bytes of new data out of %" PRIu64 " bytes",
+             new_bytes, total_bytes);
+    }
+
+    return true;
+}
+
+static bool is_valid_backup_name(const std::string &name)
+{
+    // No empty strings, hidden paths, '..', or directory separators
+    return !name.empty()                            // Must be non-empty
+            && name.find('/') == std::string::npos  // and contain no slashes
+            && name != "."                          // and not current directory
+            && name != "..";                        // and not parent directory
+}
+
+/*!
+ * \brief Find a compressed backup, a deduplicated backup's manifest, or a
+ *        block-level backup
+ */
+static std::string find_backup(const std::string &backup_dir,
+                               const std::string &prefix,
+                               util::compression_type *compression,
+                               bool *blocks)
+{
+    *blocks = false;
+
+    std::string path = find_compressed_backup(
+            backup_dir, prefix, compression);
+    if (path.empty()) {
+        path = find_compressed_backup(
+                backup_dir, prefix + BACKUP_MANIFEST_SUFFIX, compression);
+    }
+    if (path.empty()) {
+        path = find_compressed_backup(
+                backup_dir, prefix + BACKUP_BLOCKS_SUFFIX, compression);
+        *blocks = !path.empty();
+    }
+    return path;
+}
+
+/*!
+ * \brief Find the chain of backups needed to restore a partition
+ *
+ * Starting at \a input_dir, base backups are followed until a full backup of
+ * the partition is found. Base backups are looked up in the same parent
+ * directory as \a input_dir.
+ *
+ * \param input_dir Backup directory
+ * \param prefix Prefix of the partition's archive
+ * \param layers Output list of backups, starting with the full backup
+ *
+ * \return Whether the full chain was found
+ */
+static bool find_backup_layers(const std::string &input_dir,
+                               const std::string &prefix,
+                               std::vector<BackupLayer> *layers)
+{
+    std::string backup_root = util::dir_name(input_dir);
+    std::string dir = input_dir;
+
+    layers->clear();
+
+    while (true) {
+        if (layers->size() == BACKUP_MAX_CHAIN_LENGTH) {
+            LOGE("%s: Too many incremental backups in chain", dir.c_str());
+            return false;
+        }
+
+        BackupLayer layer;
+        std::string name = find_backup(dir, prefix, &layer.compression,
+                                       &layer.blocks);
+        if (name.empty()) {
+            LOGE("%s: Backup of %s not found", dir.c_str(), prefix.c_str());
+            return false;
+        }
+        layer.archive = dir + "/" + name;
+
+        std::string deleted_list = dir + "/" + prefix + BACKUP_DELETED_SUFFIX;
+        bool incremental = access(deleted_list.c_str(), R_OK) == 0;
+        if (incremental) {
+            layer.deleted_list = deleted_list;
+        }
+
+        layers->insert(layers->begin(), std::move(layer));
+
+        if (!incremental) {
+            return true;
+        }
+
+        std::string base_file = dir + "/" BACKUP_NAME_BASE;
+        std::string base_name;
+        if (!util::file_first_line(base_file, &base_name)) {
+            LOGE("%s: Failed to read base backup name: %s",
+                 base_file.c_str(), strerror(errno));
             return false;
+        } else if (!is_valid_backup_name(base_name)) {
+            LOGE("%s: Invalid base backup name: %s",
+                 base_file.c_str(), base_name.c_str());
+            return false;
+        }
+
+        dir = backup_root + "/" + base_name;
+    }
+}
+
+/*!
+ * \brief Check if \a name is the archive of the partition with \a prefix
+ *
+ * \param[out] compression Compression of the archive
+ * \param[out] blocks Whether the archive is a block-level backup
+ */
+static bool parse_archive_name(const std::string &name,
+                               const std::string &prefix,
+                               util::compression_type *compression,
+                               bool *blocks)
+{
+    for (auto i = compression_map; i->name; ++i) {
+        if (name == prefix + i->extension) {
+            *blocks = false;
+        } else if (name == prefix + BACKUP_BLOCKS_SUFFIX + i->extension) {
+            *blocks = true;
+        } else {
+            continue;
         }
+
+        *compression = i->type;
+        return true;
     }
 
+    return false;
+}
+
+/*!
+ * \brief Restore a ROM from a stream written by a streamed backup
+ *
+ * Partition archives are extracted directly from the stream, one at a time
+ * and in the order in which they appear. The boot image and configs are small,
+ * so they are staged in a temporary directory and restored at the end.
+ *
+ * \return Whether all targets were successfully restored
+ */
+static bool restore_rom_from_stream(const std::shared_ptr<Rom> &rom,
+                                    BackupStreamReader &stream, int targets,
+                                    int flags)
+{
+    uint64_t system_image_size = 0;
+
+    if (targets & BACKUP_TARGET_SYSTEM) {
+        system_image_size = util::mount_get_total_size(
+                Roms::get_system_partition().c_str());
+        if (system_image_size == 0) {
+            LOGE("Failed to get the size of the system partition");
+            return false;
+        }
+    }
+
+    struct StreamTarget
+    {
+        int target;
+        const char *prefix;
+        std::string path;
+        bool is_image;
+        uint64_t image_size;
+        std::vector<std::string> exclusions;
+        bool found;
+    } stream_targets[] = {
+        { BACKUP_TARGET_SYSTEM, BACKUP_NAME_PREFIX_SYSTEM,
+          rom->full_system_path(), rom->system_is_image, system_image_size,
+          {}, false },
+        { BACKUP_TARGET_CACHE, BACKUP_NAME_PREFIX_CACHE,
+          rom->full_cache_path(), rom->cache_is_image, DEFAULT_IMAGE_SIZE,
+          {}, false },
+        { BACKUP_TARGET_DATA, BACKUP_NAME_PREFIX_DATA,
+          rom->full_data_path(), rom->data_is_image, DEFAULT_IMAGE_SIZE,
+          { "media" }, false },
+    };
+
+    std::string staging_dir(MULTIBOOT_DIR "/.stream-XXXXXX");
+    if (!mkdtemp(&staging_dir[0])) {
+        LOGE("%s: Failed to create directory: %s",
+             staging_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto delete_staging_dir = util::finally([&] {
+        util::delete_recursive(staging_dir);
+    });
+
+    while (true) {
+        std::string name;
+        bool done;
+
+        if (!stream.next(&name, &done)) {
+            return false;
+        } else if (done) {
+            break;
+        }
+
+        if (name == BACKUP_NAME_BOOT_IMAGE
+                || name == BACKUP_NAME_CONFIG
+                || name == BACKUP_NAME_THUMBNAIL) {
+            if (!stream.extract(staging_dir + "/" + name)) {
+                return false;
+            }
+            continue;
+        }
+
+        StreamTarget *st = nullptr;
+        BackupLayer layer;
+
+        for (auto &t : stream_targets) {
+            if (parse_archive_name(name, t.prefix, &layer.compression,
+                                   &layer.blocks)) {
+                st = &t;
+                break;
+            }
+        }
+
+        if (!st || !(targets & st->target)) {
+            if (!st) {
+                LOGW("%s: Skipping unknown file in stream", name.c_str());
+            }
+            if (!stream.skip()) {
+                return false;
+            }
+            continue;
+        } else if (st->found) {
+            LOGE("%s: Found more than one backup in stream", st->prefix);
+            return false;
+        }
+
+        st->found = true;
+
+        bool ret = stream.pipe([&](const std::string &path) {
+            std::vector<TargetJob> target_jobs;
+            std::vector<BackupLayer> layers;
+
+            layer.archive = path;
+            layers.push_back(std::move(layer));
+
+            target_jobs.emplace_back(st->prefix, st->path,
+                                     [&](ChunkStore *store) {
+                return restore_partition(
+                        st->path, st->prefix, layers, st->is_image,
+                        st->image_size, st->exclusions, store, flags);
+            });
+
+            return run_target_jobs(target_jobs, 1);
+        });
+        if (!ret) {
+            return false;
+        }
+    }
+
+    for (auto const &st : stream_targets) {
+        if ((targets & st.target) && !st.found) {
+            LOGE("Backup of %s not found in stream", st.prefix);
+            return false;
+        }
+    }
+
+    // Restore boot image
+    if (targets & BACKUP_TARGET_BOOT
+            && restore_boot_image(rom, staging_dir) == Result::FAILED) {
+        return false;
+    }
+
+    // Restore configs
+    if (targets & BACKUP_TARGET_CONFIG
+            && restore_configs(rom, staging_dir) == Result::FAILED) {
+        return false;
+    }
+
+    fix_multiboot_permissions();
+
     return true;
 }
 
+/*!
+ * \brief Restore a ROM
+ *
+ * \param rom ROM
+ * \param input_dir Backup directory
+ * \param stream If not null, stream to restore from instead of \a input_dir
+ * \param targets Targets to restore
+ * \param chunk_dir Chunk store for deduplicated backups
+ * \param jobs Maximum number of partitions to restore concurrently
+ * \param flags RESTORE_* flags
+ *
+ * \return Whether all targets were successfully restored
+ */
 static bool restore_rom(const std::shared_ptr<Rom> &rom,
-                        const std::string &input_dir, int targets)
+                        const std::string &input_dir,
+                        BackupStreamReader *stream, int targets,
+                        const std::string &chunk_dir, unsigned int jobs,
+                        int flags)
 {
     if (!targets) {
         LOGE("No restore targets specified");
@@ -678,7 +1680,14 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
         LOGI("  - Configs: %s", config_path.c_str());
         LOGI("             %s", thumbnail_path.c_str());
     }
-    LOGI("- Backup directory: %s", input_dir.c_str());
+    if (stream) {
+        LOGI("- Backup stream: yes");
+    } else {
+        LOGI("- Backup directory: %s", input_dir.c_str());
+        LOGI("- Jobs: %u", jobs);
+    }
+    LOGI("- Differential: %s",
+         (flags & RESTORE_DIFFERENTIAL) ? "true" : "false");
 
     std::string multiboot_dir(MULTIBOOT_DIR);
     multiboot_dir += '/';
@@ -689,6 +1698,10 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
         return false;
     }
 
+    if (stream) {
+        return restore_rom_from_stream(rom, *stream, targets, flags);
+    }
+
     // Restore boot image
     if (targets & BACKUP_TARGET_BOOT
             && restore_boot_image(rom, input_dir) == Result::FAILED) {
@@ -703,68 +1716,82 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
 
     fix_multiboot_permissions();
 
+    std::vector<TargetJob> target_jobs;
+    std::vector<BackupLayer> system_layers;
+    std::vector<BackupLayer> cache_layers;
+    std::vector<BackupLayer> data_layers;
+    uint64_t system_image_size = 0;
+
     // Restore system
     if (targets & BACKUP_TARGET_SYSTEM) {
-        uint64_t image_size = util::mount_get_total_size(
+        system_image_size = util::mount_get_total_size(
                 Roms::get_system_partition().c_str());
-        if (image_size == 0) {
+        if (system_image_size == 0) {
             LOGE("Failed to get the size of the system partition");
             return false;
         }
 
-        util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_SYSTEM, &compression);
-        if (path.empty()) {
+        if (!find_backup_layers(input_dir, BACKUP_NAME_PREFIX_SYSTEM,
+                                &system_layers)) {
             LOGE("Backup of /system not found");
             return false;
         }
 
-        Result ret = restore_partition(
-                system_path, input_dir, path,
-                rom->system_is_image, image_size, {}, compression);
-        if (ret == Result::FAILED) {
-            return false;
-        }
+        target_jobs.emplace_back(BACKUP_NAME_PREFIX_SYSTEM, system_path,
+                                 [&](ChunkStore *store) {
+            MB_TRACE_SCOPE("restore.system");
+
+            return restore_partition(
+                    system_path, BACKUP_NAME_PREFIX_SYSTEM, system_layers,
+                    rom->system_is_image, system_image_size, {}, store,
+                    flags);
+        });
     }
 
     // Restore cache
     if (targets & BACKUP_TARGET_CACHE) {
-        util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_CACHE, &compression);
-        if (path.empty()) {
+        if (!find_backup_layers(input_dir, BACKUP_NAME_PREFIX_CACHE,
+                                &cache_layers)) {
             LOGE("Backup of /cache not found");
             return false;
         }
 
-        Result ret = restore_partition(
-                cache_path, input_dir, path,
-                rom->cache_is_image, DEFAULT_IMAGE_SIZE, {}, compression);
-        if (ret == Result::FAILED) {
-            return false;
-        }
+        target_jobs.emplace_back(BACKUP_NAME_PREFIX_CACHE, cache_path,
+                                 [&](ChunkStore *store) {
+            MB_TRACE_SCOPE("restore.cache");
+
+            return restore_partition(
+                    cache_path, BACKUP_NAME_PREFIX_CACHE, cache_layers,
+                    rom->cache_is_image, DEFAULT_IMAGE_SIZE, {}, store,
+                    flags);
+        });
     }
 
     // Restore data
     if (targets & BACKUP_TARGET_DATA) {
-        util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_DATA, &compression);
-        if (path.empty()) {
+        if (!find_backup_layers(input_dir, BACKUP_NAME_PREFIX_DATA,
+                                &data_layers)) {
             LOGE("Backup of /data not found");
             return false;
         }
 
-        Result ret = restore_partition(
-                data_path, input_dir, path,
-                rom->data_is_image, DEFAULT_IMAGE_SIZE, { "media" }, compression);
-        if (ret == Result::FAILED) {
-            return false;
-        }
+        target_jobs.emplace_back(BACKUP_NAME_PREFIX_DATA, data_path,
+                                 [&](ChunkStore *store) {
+            MB_TRACE_SCOPE("restore.data");
+
+            return restore_partition(
+                    data_path, BACKUP_NAME_PREFIX_DATA, data_layers,
+                    rom->data_is_image, DEFAULT_IMAGE_SIZE, { "media" },
+                    store, flags);
+        });
     }
 
-    return true;
+    // Only used if the backup is deduplicated
+    for (auto &job : target_jobs) {
+        job.store.reset(new ChunkStore(chunk_dir, false));
+    }
+
+    return run_target_jobs(target_jobs, jobs);
 }
 
 static bool ensure_partitions_mounted()
@@ -800,13 +1827,71 @@ static bool remount_partitions_writable()
             && mount("", data_partition.c_str(), "", MS_REMOUNT, "") == 0;
 }
 
-static bool is_valid_backup_name(const std::string &name)
+/*!
+ * \brief Remove chunks that are no longer used by any backup
+ *
+ * \param backup_dir Directory containing backups and the chunk store
+ */
+static bool prune_chunk_store(const std::string &backup_dir)
 {
-    // No empty strings, hidden paths, '..', or directory separators
-    return !name.empty()                            // Must be non-empty
-            && name.find('/') == std::string::npos  // and contain no slashes
-            && name != "."                          // and not current directory
-            && name != "..";                        // and not parent directory
+    static const char *prefixes[] = {
+        BACKUP_NAME_PREFIX_SYSTEM,
+        BACKUP_NAME_PREFIX_CACHE,
+        BACKUP_NAME_PREFIX_DATA,
+        nullptr
+    };
+
+    autoclose::dir dp(autoclose::opendir(backup_dir.c_str()));
+    if (!dp) {
+        LOGE("%s: Failed to open directory: %s",
+             backup_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::vector<std::string> manifests;
+    dirent *ent;
+    errno = 0;
+
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0
+                || strcmp(ent->d_name, "..") == 0
+                || strcmp(ent->d_name, BACKUP_CHUNK_DIR) == 0) {
+            continue;
+        }
+
+        for (auto it = prefixes; *it; ++it) {
+            util::compression_type compression;
+            std::string dir(backup_dir);
+            dir += '/';
+            dir += ent->d_name;
+
+            std::string name = find_compressed_backup(
+                    dir, std::string(*it) + BACKUP_MANIFEST_SUFFIX,
+                    &compression);
+            if (name.empty()) {
+                continue;
+            } else if (compression != util::compression_type::NONE) {
+                LOGE("%s/%s: Compressed manifests are not supported",
+                     dir.c_str(), name.c_str());
+                return false;
+            }
+
+            manifests.push_back(dir + "/" + name);
+        }
+
+        errno = 0;
+    }
+
+    if (errno) {
+        LOGE("%s: Failed to read directory contents: %s",
+             backup_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    LOGI("=== Pruning chunk store ===");
+
+    ChunkStore store(backup_dir + "/" BACKUP_CHUNK_DIR, false);
+    return store.prune(manifests);
 }
 
 static void warn_selinux_context()
@@ -824,10 +1909,50 @@ static void warn_selinux_context()
     }
 }
 
+/*!
+ * \brief Open the destination of a streamed backup or the source of a
+ *        streamed restore
+ *
+ * "-" refers to stdout (for backups) or stdin (for restores), which allows
+ * eg. `adb exec-out mbtool backup ... -s - > backup.tar` to send a backup
+ * straight to a computer. In that case, stdout is redirected to stderr so that
+ * nothing else (eg. the log) can write into the stream.
+ *
+ * \return File descriptor or -1 if an error occurred
+ */
+static int open_stream(const std::string &path, bool write)
+{
+    // Make writes fail with EPIPE instead of killing the process if the other
+    // end goes away
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd;
+
+    if (path == "-") {
+        fd = fcntl(write ? STDOUT_FILENO : STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+        if (fd >= 0 && write) {
+            fflush(stdout);
+            if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+                close(fd);
+                return -1;
+            }
+        }
+    } else if (write) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    } else {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+
+    return fd;
+}
+
 static void backup_usage(FILE *stream)
 {
     fprintf(stream,
-            "Usage: backup -r <romid> -t <targets> [-n <name>] [OPTION...]\n\n"
+            "Usage: backup -r <romid> -t <targets> [-n <name>] [OPTION...]\n"
+            "   or: backup -r <romid> -t <targets> -s <path> [OPTION...]\n"
+            "   or: backup --prune [-d <directory>]\n\n"
             "Options:\n"
             "  -r, --romid <ROM ID>"
             "                   ROM ID to backup\n"
@@ -840,10 +1965,30 @@ static void backup_usage(FILE *stream)
             "  -c, --compression <compression type>\n"
             "                   Compression type (none, lz4, gzip, xz)\n"
             "                   (Default: lz4)\n"
+            "  -a, --adaptive   Use the strongest lz4 or gzip level that keeps\n"
+            "                   up with the backup directory's storage\n"
+            "  -b, --blocks     Backup only the allocated blocks of image-based\n"
+            "                   partitions instead of their files\n"
+            "                   (Cannot be used with -D or -i)\n"
             "  -d, --backupdir <directory>\n"
             "                   Directory to store backups\n"
             "                   (Default: " MULTIBOOT_BACKUP_DIR ")\n"
             "  -f, --force      Allow overwriting old backup with the same name\n"
+            "  -D, --dedup      Store file contents in the chunk store\n"
+            "                   shared by all backups in the directory\n"
+            "                   (Any compression other than none uses lz4)\n"
+            "  -p, --prune      Delete chunks not used by any backup\n"
+            "                   (After the backup if a ROM ID is given)\n"
+            "  -j, --jobs <N>   Backup up to N of system, cache, and data at\n"
+            "                   the same time (Default: 1)\n"
+            "  -i, --incremental <name>\n"
+            "                   Only store files that changed since backup\n"
+            "                   <name>, which must be kept for restoring\n"
+            "  -s, --stream <path>\n"
+            "                   Write the backup to <path> as a single tar\n"
+            "                   stream instead of a backup directory\n"
+            "                   ('-' for stdout, eg. with adb exec-out)\n"
+            "                   (Cannot be used with -D, -p, or -i)\n"
             "  -h, --help       Display this help message\n"
             "\n"
             "Valid backup targets: 'all' or some combination of the following:\n"
@@ -856,7 +2001,8 @@ static void backup_usage(FILE *stream)
 static void restore_usage(FILE *stream)
 {
     fprintf(stream,
-            "Usage: restore -r <romid> -t <targets> -n <name> [OPTION...]\n\n"
+            "Usage: restore -r <romid> -t <targets> -n <name> [OPTION...]\n"
+            "   or: restore -r <romid> -t <targets> -s <path> [OPTION...]\n\n"
             "Options:\n"
             "  -r, --romid <ROM ID>\n"
             "                   ROM ID to restore to\n"
@@ -868,6 +2014,17 @@ static void restore_usage(FILE *stream)
             "  -d, --backupdir <directory>\n"
             "                   Directory containing backups\n"
             "                   (Default: " MULTIBOOT_BACKUP_DIR ")\n"
+            "  -j, --jobs <N>   Restore up to N of system, cache, and data at\n"
+            "                   the same time (Default: 1)\n"
+            "  -D, --differential\n"
+            "                   Only rewrite files that differ from the backup\n"
+            "                   instead of wiping the targets first\n"
+            "  -H, --compare-hashes\n"
+            "                   With --differential, also compare the contents\n"
+            "                   of files in deduplicated backups\n"
+            "  -s, --stream <path>\n"
+            "                   Restore from a stream written by backup -s\n"
+            "                   ('-' for stdin, eg. with adb exec-in)\n"
             "  -h, --help       Display this help message\n"
             "\n"
             "Valid backup targets: 'all' or some combination of the following:\n"
@@ -881,14 +2038,21 @@ int backup_main(int argc, char *argv[])
 {
     int opt;
 
-    static const char *short_options = "r:t:n:c:d:fh";
+    static const char *short_options = "r:t:n:c:abd:fDpj:i:s:h";
     static struct option long_options[] = {
         {"romid",       required_argument, 0, 'r'},
         {"targets",     required_argument, 0, 't'},
         {"name",        required_argument, 0, 'n'},
         {"compression", required_argument, 0, 'c'},
+        {"adaptive",    no_argument,       0, 'a'},
+        {"blocks",      no_argument,       0, 'b'},
         {"backupdir",   required_argument, 0, 'd'},
         {"force",       no_argument,       0, 'f'},
+        {"dedup",       no_argument,       0, 'D'},
+        {"prune",       no_argument,       0, 'p'},
+        {"jobs",        required_argument, 0, 'j'},
+        {"incremental", required_argument, 0, 'i'},
+        {"stream",      required_argument, 0, 's'},
         {"help",        no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
@@ -900,7 +2064,14 @@ int backup_main(int argc, char *argv[])
     std::string name;
     std::string backupdir(MULTIBOOT_BACKUP_DIR);
     util::compression_type compression = util::compression_type::LZ4;
+    bool adaptive = false;
+    bool blocks = false;
     bool force = false;
+    bool dedup = false;
+    bool prune = false;
+    unsigned int jobs = 1;
+    std::string base_name;
+    std::string stream_path;
 
     if (!util::format_time("%Y.%m.%d-%H.%M.%S", &name)) {
         fprintf(stderr, "Failed to format current time\n");
@@ -925,12 +2096,36 @@ int backup_main(int argc, char *argv[])
                 return EXIT_FAILURE;
             }
             break;
+        case 'a':
+            adaptive = true;
+            break;
+        case 'b':
+            blocks = true;
+            break;
         case 'd':
             backupdir = optarg;
             break;
         case 'f':
             force = true;
             break;
+        case 'D':
+            dedup = true;
+            break;
+        case 'p':
+            prune = true;
+            break;
+        case 'j':
+            if (!util::str_to_unum(optarg, 10, &jobs) || jobs == 0) {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            base_name = optarg;
+            break;
+        case 's':
+            stream_path = optarg;
+            break;
         case 'h':
             backup_usage(stdout);
             return EXIT_SUCCESS;
@@ -946,6 +2141,14 @@ int backup_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (romid.empty() && prune) {
+        warn_selinux_context();
+
+        bool ret = prune_chunk_store(backupdir);
+        LOGI(ret ? "=== Finished ===" : "=== Failed ===");
+        return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     if (romid.empty()) {
         fprintf(stderr, "No ROM ID specified\n");
         return EXIT_FAILURE;
@@ -962,6 +2165,47 @@ int backup_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (blocks && (dedup || !base_name.empty())) {
+        fprintf(stderr, "Block-level backups cannot be deduplicated or"
+                " incremental\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!stream_path.empty()) {
+        if (dedup || prune || !base_name.empty()) {
+            fprintf(stderr, "Streamed backups cannot be deduplicated, pruned,"
+                    " or incremental\n");
+            return EXIT_FAILURE;
+        }
+
+        // Targets appear in the stream one after another so that they can be
+        // restored without staging
+        if (jobs > 1) {
+            fprintf(stderr, "WARNING: Streamed targets are backed up one at"
+                    " a time\n");
+            jobs = 1;
+        }
+    }
+
+    std::string base_dir;
+    if (!base_name.empty()) {
+        if (!is_valid_backup_name(base_name) || base_name == name) {
+            fprintf(stderr, "Invalid base backup name: %s\n",
+                    base_name.c_str());
+            return EXIT_FAILURE;
+        }
+
+        base_dir = backupdir;
+        base_dir += "/";
+        base_dir += base_name;
+
+        struct stat sb;
+        if (stat(base_dir.c_str(), &sb) < 0) {
+            fprintf(stderr, "Backup '%s' does not exist\n", base_name.c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
     warn_selinux_context();
 
     if (!ensure_partitions_mounted()) {
@@ -977,6 +2221,27 @@ int backup_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (!stream_path.empty()) {
+        int fd = open_stream(stream_path, true);
+        if (fd < 0) {
+            fprintf(stderr, "%s: Failed to open stream: %s\n",
+                    stream_path.c_str(), strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        BackupStreamWriter writer;
+        BackupOutput output(&writer);
+
+        bool ret = writer.open(fd)
+                && backup_rom(rom, output, targets, compression, adaptive,
+                              blocks, {}, {}, jobs)
+                && writer.close();
+        close(fd);
+        MB_TRACE_DUMP();
+        LOGI(ret ? "=== Finished ===" : "=== Failed ===");
+        return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     std::string output_dir(backupdir);
     output_dir += "/";
     output_dir += name;
@@ -994,7 +2259,17 @@ int backup_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    bool ret = backup_rom(rom, output_dir, targets, compression);
+    std::string chunk_dir;
+    if (dedup) {
+        chunk_dir = backupdir + "/" BACKUP_CHUNK_DIR;
+    }
+
+    BackupOutput output(output_dir);
+
+    bool ret = backup_rom(rom, output, targets, compression, adaptive,
+                          blocks, chunk_dir, base_dir, jobs)
+            && (!prune || prune_chunk_store(backupdir));
+    MB_TRACE_DUMP();
     if (ret) {
         LOGI("=== Finished ===");
         return EXIT_SUCCESS;
@@ -1008,13 +2283,17 @@ int restore_main(int argc, char *argv[])
 {
     int opt;
 
-    static const char *short_options = "r:t:n:d:h";
+    static const char *short_options = "r:t:n:d:j:DHs:h";
     static struct option long_options[] = {
-        {"romid",     required_argument, 0, 'r'},
-        {"targets",   required_argument, 0, 't'},
-        {"name",      required_argument, 0, 'n'},
-        {"backupdir", required_argument, 0, 'd'},
-        {"help",      no_argument,       0, 'h'},
+        {"romid",          required_argument, 0, 'r'},
+        {"targets",        required_argument, 0, 't'},
+        {"name",           required_argument, 0, 'n'},
+        {"backupdir",      required_argument, 0, 'd'},
+        {"jobs",           required_argument, 0, 'j'},
+        {"differential",   no_argument,       0, 'D'},
+        {"compare-hashes", no_argument,       0, 'H'},
+        {"stream",         required_argument, 0, 's'},
+        {"help",           no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
 
@@ -1024,6 +2303,9 @@ int restore_main(int argc, char *argv[])
     std::string targets_str("all");
     std::string name;
     std::string backupdir(MULTIBOOT_BACKUP_DIR);
+    unsigned int jobs = 1;
+    int flags = 0;
+    std::string stream_path;
 
     while ((opt = getopt_long(argc, argv, short_options,
             long_options, &long_index)) != -1) {
@@ -1040,6 +2322,21 @@ int restore_main(int argc, char *argv[])
         case 'd':
             backupdir = optarg;
             break;
+        case 'j':
+            if (!util::str_to_unum(optarg, 10, &jobs) || jobs == 0) {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'D':
+            flags |= RESTORE_DIFFERENTIAL;
+            break;
+        case 'H':
+            flags |= RESTORE_COMPARE_HASHES;
+            break;
+        case 's':
+            stream_path = optarg;
+            break;
         case 'h':
             restore_usage(stdout);
             return EXIT_SUCCESS;
@@ -1060,7 +2357,7 @@ int restore_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if (name.empty()) {
+    if (name.empty() && stream_path.empty()) {
         fprintf(stderr, "No backup name specified\n");
         return EXIT_FAILURE;
     }
@@ -1071,11 +2368,16 @@ int restore_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    if (!is_valid_backup_name(name)) {
+    if (stream_path.empty() && !is_valid_backup_name(name)) {
         fprintf(stderr, "Invalid backup name: %s\n", name.c_str());
         return EXIT_FAILURE;
     }
 
+    if ((flags & RESTORE_COMPARE_HASHES) && !(flags & RESTORE_DIFFERENTIAL)) {
+        fprintf(stderr, "-H/--compare-hashes requires -D/--differential\n");
+        return EXIT_FAILURE;
+    }
+
     warn_selinux_context();
 
     if (!ensure_partitions_mounted()) {
@@ -1094,6 +2396,25 @@ int restore_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    if (!stream_path.empty()) {
+        int fd = open_stream(stream_path, false);
+        if (fd < 0) {
+            fprintf(stderr, "%s: Failed to open stream: %s\n",
+                    stream_path.c_str(), strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        BackupStreamReader reader;
+
+        bool ret = reader.open(fd)
+                && restore_rom(rom, {}, &reader, targets, {}, 1, flags);
+        reader.close();
+        close(fd);
+        MB_TRACE_DUMP();
+        LOGI(ret ? "=== Finished ===" : "=== Failed ===");
+        return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     std::string input_dir(backupdir);
     input_dir += "/";
     input_dir += name;
@@ -1104,7 +2425,9 @@ int restore_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    bool ret = restore_rom(rom, input_dir, targets);
+    bool ret = restore_rom(rom, input_dir, nullptr, targets,
+                           backupdir + "/" BACKUP_CHUNK_DIR, jobs, flags);
+    MB_TRACE_DUMP();
     if (ret) {
         LOGI("=== Finished ===");
         return EXIT_SUCCESS;
@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "backup_index.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include <archive_entry.h>
+
+#include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/file.h"
+
+#define INDEX_HEADER            "mbtool backup index v1\n"
+
+namespace mb
+{
+
+BackupIndex::BackupIndex()
+    : _has_base(false)
+    , _changed(0)
+    , _unchanged(0)
+{
+}
+
+/*!
+ * \brief Load the index of the backup that this backup is relative to
+ *
+ * \param path Path to index file
+ *
+ * \return Whether the index was successfully loaded
+ */
+bool BackupIndex::load_base(const std::string &path)
+{
+    std::vector<unsigned char> data;
+    if (!util::file_read_all(path, &data)) {
+        LOGE("%s: Failed to read index: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    size_t header_size = strlen(INDEX_HEADER);
+    if (data.size() < header_size
+            || memcmp(data.data(), INDEX_HEADER, header_size) != 0) {
+        LOGE("%s: Not a backup index", path.c_str());
+        return false;
+    }
+
+    // Make sure sscanf() cannot read past the end
+    data.push_back('\0');
+
+    const char *ptr = reinterpret_cast<const char *>(data.data()) + header_size;
+    const char *end = reinterpret_cast<const char *>(data.data())
+            + data.size() - 1;
+
+    _base.clear();
+
+    while (ptr < end) {
+        Record record;
+        int offset;
+
+        if (sscanf(ptr, "%" SCNu64 " %" SCNu64 " %" SCNd64 " %" SCNd64
+                   " %" SCNo32 " %n", &record.ino, &record.size,
+                   &record.mtime_ns, &record.ctime_ns, &record.mode,
+                   &offset) != 5) {
+            LOGE("%s: Invalid index record", path.c_str());
+            return false;
+        }
+
+        const char *name = ptr + offset;
+        size_t name_size = strlen(name);
+
+        _base.emplace(std::string(name, name_size), record);
+        ptr = name + name_size + 1;
+    }
+
+    _has_base = true;
+
+    return true;
+}
+
+/*!
+ * \brief Record an entry and decide whether it needs to be archived
+ *
+ * Without a base, every entry is archived. Otherwise, directories are always
+ * archived (so their metadata is restored and new files have a parent) and
+ * other entries are archived if they are new or their inode, size, mode,
+ * mtime, or ctime changed.
+ */
+bool BackupIndex::include(archive_entry *entry)
+{
+    Record record;
+    record.ino = static_cast<uint64_t>(archive_entry_ino64(entry));
+    record.size = static_cast<uint64_t>(archive_entry_size(entry));
+    record.mtime_ns = static_cast<int64_t>(archive_entry_mtime(entry))
+            * 1000000000 + archive_entry_mtime_nsec(entry);
+    record.ctime_ns = static_cast<int64_t>(archive_entry_ctime(entry))
+            * 1000000000 + archive_entry_ctime_nsec(entry);
+    record.mode = archive_entry_mode(entry);
+
+    std::string path(archive_entry_pathname(entry));
+    bool changed = true;
+
+    if (_has_base) {
+        auto it = _base.find(path);
+        if (it != _base.end()) {
+            const Record &old = it->second;
+
+            if ((old.mode & AE_IFMT) != (record.mode & AE_IFMT)) {
+                _replaced.push_back(path);
+            } else if (old.ino == record.ino
+                    && old.size == record.size
+                    && old.mtime_ns == record.mtime_ns
+                    && old.ctime_ns == record.ctime_ns
+                    && old.mode == record.mode) {
+                changed = false;
+            }
+        }
+    }
+
+    _entries.emplace_back(std::move(path), record);
+
+    if (archive_entry_filetype(entry) == AE_IFDIR) {
+        return true;
+    }
+
+    if (changed) {
+        ++_changed;
+    } else {
+        ++_unchanged;
+    }
+
+    return changed;
+}
+
+/*!
+ * \brief Write the index of all entries seen while creating the archive
+ */
+bool BackupIndex::write(const std::string &path) const
+{
+    autoclose::file fp(autoclose::fopen(path.c_str(), "wb"));
+    if (!fp) {
+        LOGE("%s: Failed to open for writing: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fputs(INDEX_HEADER, fp.get()) == EOF) {
+        goto error;
+    }
+
+    for (auto const &item : _entries) {
+        const Record &r = item.second;
+
+        if (fprintf(fp.get(), "%" PRIu64 " %" PRIu64 " %" PRId64 " %" PRId64
+                    " %" PRIo32 " %s", r.ino, r.size, r.mtime_ns, r.ctime_ns,
+                    r.mode, item.first.c_str()) < 0
+                || fputc('\0', fp.get()) == EOF) {
+            goto error;
+        }
+    }
+
+    if (fclose(fp.release()) == EOF) {
+        LOGE("%s: Failed to close file: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+
+error:
+    LOGE("%s: Failed to write index: %s", path.c_str(), strerror(errno));
+    return false;
+}
+
+/*!
+ * \brief Write the list of paths that must be deleted from the base
+ *
+ * The list contains the paths in the base that no longer exist and the paths
+ * whose file type changed. It is sorted, so parents come before their
+ * children.
+ */
+bool BackupIndex::write_deleted(const std::string &path) const
+{
+    std::unordered_set<std::string> seen;
+    for (auto const &item : _entries) {
+        seen.insert(item.first);
+    }
+
+    std::vector<std::string> deleted(_replaced);
+    for (auto const &item : _base) {
+        if (seen.find(item.first) == seen.end()) {
+            deleted.push_back(item.first);
+        }
+    }
+    std::sort(deleted.begin(), deleted.end());
+
+    std::string data;
+    for (auto const &p : deleted) {
+        data += p;
+        data += '\0';
+    }
+
+    if (!util::file_write_data(path, data.data(), data.size())) {
+        LOGE("%s: Failed to write deletion list: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Whether a base index was loaded
+ */
+bool BackupIndex::has_base() const
+{
+    return _has_base;
+}
+
+/*!
+ * \brief Number of non-directory entries that were archived
+ */
+uint64_t BackupIndex::changed() const
+{
+    return _changed;
+}
+
+/*!
+ * \brief Number of non-directory entries that were unchanged from the base
+ */
+uint64_t BackupIndex::unchanged() const
+{
+    return _unchanged;
+}
+
+/*!
+ * \brief Read a deletion list written by write_deleted()
+ */
+bool BackupIndex::read_deleted(const std::string &path,
+                               std::vector<std::string> *paths)
+{
+    std::vector<unsigned char> data;
+    if (!util::file_read_all(path, &data)) {
+        LOGE("%s: Failed to read deletion list: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    paths->clear();
+
+    auto begin = data.begin();
+    while (begin != data.end()) {
+        auto end = std::find(begin, data.end(), '\0');
+        if (end == data.end()) {
+            LOGE("%s: Deletion list is truncated", path.c_str());
+            return false;
+        }
+        paths->emplace_back(begin, end);
+        begin = end + 1;
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbutil/archive.h"
+
+namespace mb
+{
+
+/*!
+ * \brief Index of the files in a partition backup
+ *
+ * Every backup saves an index of the files it saw (path, inode, size, mode,
+ * mtime, and ctime). When an index from a previous backup is loaded as the
+ * base, only the entries that are new or changed since then are included in
+ * the archive and the paths that no longer exist are recorded in a deletion
+ * list.
+ */
+class BackupIndex : public util::TarEntryFilter
+{
+public:
+    BackupIndex();
+
+    bool load_base(const std::string &path);
+
+    bool include(archive_entry *entry) override;
+
+    bool write(const std::string &path) const;
+    bool write_deleted(const std::string &path) const;
+
+    bool has_base() const;
+    uint64_t changed() const;
+    uint64_t unchanged() const;
+
+    static bool read_deleted(const std::string &path,
+                             std::vector<std::string> *paths);
+
+private:
+    struct Record
+    {
+        uint64_t ino;
+        uint64_t size;
+        int64_t mtime_ns;
+        int64_t ctime_ns;
+        uint32_t mode;
+    };
+
+    bool _has_base;
+    std::unordered_map<std::string, Record> _base;
+    std::vector<std::pair<std::string, Record>> _entries;
+    // Paths in the base that changed type and must be deleted before the new
+    // entries are extracted
+    std::vector<std::string> _replaced;
+    uint64_t _changed;
+    uint64_t _unchanged;
+};
+
+}
@@ -0,0 +1,536 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "backup_stream.h"
+
+#include <algorithm>
+#include <thread>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/buffer_pool.h"
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbutil/finally.h"
+#include "mbutil/integer.h"
+
+#include "archive_util.h"
+
+#define STREAM_PART_SEPARATOR   ".part"
+
+namespace mb
+{
+
+/*!
+ * \brief Get the file and part number of a stream entry
+ *
+ * "system.tar.lz4.part000012" is part 12 of "system.tar.lz4". Entries without
+ * a part number (eg. "boot.img") have the part number -1.
+ */
+static void split_entry_name(const std::string &entry_name,
+                             std::string *name, long *part)
+{
+    size_t pos = entry_name.rfind(STREAM_PART_SEPARATOR);
+    unsigned long value;
+
+    if (pos != std::string::npos && pos > 0
+            && pos + strlen(STREAM_PART_SEPARATOR) < entry_name.size()
+            && entry_name.find_first_not_of(
+                    "0123456789", pos + strlen(STREAM_PART_SEPARATOR))
+                            == std::string::npos
+            && util::str_to_unum(
+                    entry_name.c_str() + pos + strlen(STREAM_PART_SEPARATOR),
+                    10, &value)
+            && value <= LONG_MAX) {
+        name->assign(entry_name, 0, pos);
+        *part = static_cast<long>(value);
+    } else {
+        *name = entry_name;
+        *part = -1;
+    }
+}
+
+/*!
+ * \brief Read from a file descriptor until the buffer is full or EOF is
+ *        reached
+ *
+ * \return Number of bytes read or -1 if an error occurred
+ */
+static ssize_t read_fully(int fd, void *data, size_t size)
+{
+    auto ptr = static_cast<char *>(data);
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = read(fd, ptr + total, size - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+        total += static_cast<size_t>(n);
+    }
+
+    return static_cast<ssize_t>(total);
+}
+
+static void discard_fd(int fd)
+{
+    char buf[4096];
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0
+            || (n < 0 && errno == EINTR));
+}
+
+BackupStreamWriter::BackupStreamWriter()
+    : _a(nullptr, archive_write_free)
+{
+}
+
+/*!
+ * \brief Start writing a stream to \a fd
+ *
+ * \a fd is not closed by close().
+ */
+bool BackupStreamWriter::open(int fd)
+{
+    _a.reset(archive_write_new());
+    if (!_a) {
+        LOGE("Out of memory when creating archive writer");
+        return false;
+    }
+
+    archive_write_set_format_pax_restricted(_a.get());
+
+    if (archive_write_open_fd(_a.get(), fd) != ARCHIVE_OK) {
+        LOGE("Failed to open stream: %s", archive_error_string(_a.get()));
+        _a.reset();
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write the end of the stream
+ */
+bool BackupStreamWriter::close()
+{
+    if (!_a) {
+        return true;
+    }
+
+    bool ret = archive_write_close(_a.get()) == ARCHIVE_OK;
+    if (!ret) {
+        LOGE("Failed to finish stream: %s", archive_error_string(_a.get()));
+    }
+
+    _a.reset();
+    return ret;
+}
+
+bool BackupStreamWriter::write_header(const std::string &name, uint64_t size)
+{
+    autoclose::archive_entry entry(archive_entry_new(), archive_entry_free);
+    if (!entry) {
+        LOGE("Out of memory when creating archive entry");
+        return false;
+    }
+
+    archive_entry_set_pathname(entry.get(), name.c_str());
+    archive_entry_set_filetype(entry.get(), AE_IFREG);
+    archive_entry_set_perm(entry.get(), 0644);
+    archive_entry_set_size(entry.get(), static_cast<la_int64_t>(size));
+    archive_entry_set_mtime(entry.get(), time(nullptr), 0);
+
+    if (archive_write_header(_a.get(), entry.get()) != ARCHIVE_OK) {
+        LOGE("%s: Failed to write header to stream: %s",
+             name.c_str(), archive_error_string(_a.get()));
+        return false;
+    }
+
+    return true;
+}
+
+bool BackupStreamWriter::write_data(const std::string &name,
+                                    const void *data, size_t size)
+{
+    la_ssize_t n = archive_write_data(_a.get(), data, size);
+    if (n < 0 || static_cast<size_t>(n) != size) {
+        LOGE("%s: Failed to write data to stream: %s",
+             name.c_str(), archive_error_string(_a.get()));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add an existing file to the stream as \a name
+ */
+bool BackupStreamWriter::add_file(const std::string &name,
+                                  const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open file: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = util::finally([&] {
+        ::close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        LOGE("%s: Failed to stat file: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    PooledBuffer buf(io_block_size());
+    if (!buf) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
+    if (!write_header(name, static_cast<uint64_t>(sb.st_size))) {
+        return false;
+    }
+
+    uint64_t remain = static_cast<uint64_t>(sb.st_size);
+
+    while (remain > 0) {
+        ssize_t n = read_fully(fd, buf.data(),
+                               std::min<uint64_t>(remain, buf.size()));
+        if (n < 0) {
+            LOGE("%s: Failed to read file: %s", path.c_str(), strerror(errno));
+            return false;
+        } else if (n == 0) {
+            LOGE("%s: File shrank while it was being read", path.c_str());
+            return false;
+        }
+
+        if (!write_data(name, buf.data(), static_cast<size_t>(n))) {
+            return false;
+        }
+
+        remain -= static_cast<uint64_t>(n);
+    }
+
+    if (archive_write_finish_entry(_a.get()) != ARCHIVE_OK) {
+        LOGE("%s: Failed to finish entry: %s",
+             name.c_str(), archive_error_string(_a.get()));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add a file of unknown size to the stream as \a name
+ *
+ * \a fn runs on a separate thread and writes the file to a pipe, while the
+ * calling thread splits the data into parts and writes them to the stream.
+ * If writing to the stream fails, the pipe is closed, so \a fn fails with
+ * EPIPE instead of blocking forever. SIGPIPE must be ignored for this.
+ *
+ * Nothing is written to the stream if \a fn does not write any data.
+ *
+ * \return Whether \a fn succeeded and all data was written to the stream
+ */
+bool BackupStreamWriter::add_archive(const std::string &name,
+                                     const StreamProducerFn &fn)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        LOGE("Failed to create pipe: %s", strerror(errno));
+        return false;
+    }
+
+    // The producer opens the write end by path, just like a regular file
+    std::string path = format("/proc/self/fd/%d", fds[1]);
+    bool produced = false;
+
+    std::thread thread([&] {
+        produced = fn(path);
+        // The reader sees EOF once the producer's own descriptor is also
+        // closed
+        ::close(fds[1]);
+    });
+
+    PooledBuffer buf(io_block_size());
+    bool ret = static_cast<bool>(buf);
+    unsigned long part = 0;
+
+    if (!ret) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+    }
+
+    while (ret) {
+        ssize_t n = read_fully(fds[0], buf.data(), buf.size());
+        if (n < 0) {
+            LOGE("%s: Failed to read from pipe: %s",
+                 name.c_str(), strerror(errno));
+            ret = false;
+            break;
+        } else if (n == 0) {
+            break;
+        }
+
+        std::string part_name = format("%s" STREAM_PART_SEPARATOR "%06lu",
+                                       name.c_str(), part++);
+
+        ret = write_header(part_name, static_cast<uint64_t>(n))
+                && write_data(part_name, buf.data(), static_cast<size_t>(n))
+                && archive_write_finish_entry(_a.get()) == ARCHIVE_OK;
+        if (!ret) {
+            LOGE("%s: Failed to write part to stream", part_name.c_str());
+        }
+
+        if (static_cast<size_t>(n) < buf.size()) {
+            // EOF was reached
+            break;
+        }
+    }
+
+    ::close(fds[0]);
+    thread.join();
+
+    return ret && produced;
+}
+
+BackupStreamReader::BackupStreamReader()
+    : _a(nullptr, archive_read_free)
+    , _pending(false)
+    , _eof(false)
+    , _part(-1)
+{
+}
+
+/*!
+ * \brief Start reading a stream from \a fd
+ *
+ * \a fd is not closed by close().
+ */
+bool BackupStreamReader::open(int fd)
+{
+    _a.reset(archive_read_new());
+    if (!_a) {
+        LOGE("Out of memory when creating archive reader");
+        return false;
+    }
+
+    archive_read_support_format_tar(_a.get());
+
+    if (archive_read_open_fd(_a.get(), fd, 10240) != ARCHIVE_OK) {
+        LOGE("Failed to open stream: %s", archive_error_string(_a.get()));
+        _a.reset();
+        return false;
+    }
+
+    _pending = false;
+    _eof = false;
+
+    return true;
+}
+
+bool BackupStreamReader::close()
+{
+    if (!_a) {
+        return true;
+    }
+
+    bool ret = archive_read_close(_a.get()) == ARCHIVE_OK;
+    _a.reset();
+    return ret;
+}
+
+bool BackupStreamReader::read_header()
+{
+    archive_entry *entry;
+
+    int ret = archive_read_next_header(_a.get(), &entry);
+    if (ret == ARCHIVE_EOF) {
+        _pending = false;
+        _eof = true;
+        return true;
+    } else if (ret != ARCHIVE_OK) {
+        LOGE("Failed to read stream: %s", archive_error_string(_a.get()));
+        return false;
+    }
+
+    const char *pathname = archive_entry_pathname(entry);
+    if (!pathname || archive_entry_filetype(entry) != AE_IFREG) {
+        LOGE("Invalid entry in stream: %s", pathname ? pathname : "(null)");
+        return false;
+    }
+
+    split_entry_name(pathname, &_name, &_part);
+    _pending = true;
+
+    return true;
+}
+
+/*!
+ * \brief Go to the next file in the stream
+ *
+ * \param[out] name Name of the file
+ * \param[out] done Set to true if the end of the stream was reached
+ *
+ * \return Whether the next file or the end of the stream was found
+ */
+bool BackupStreamReader::next(std::string *name, bool *done)
+{
+    if (!_pending && !_eof && !read_header()) {
+        return false;
+    }
+
+    if (_eof) {
+        *done = true;
+        return true;
+    }
+
+    if (_part > 0) {
+        LOGE("%s: Stream is missing the beginning of the file",
+             _name.c_str());
+        return false;
+    }
+
+    _pending = false;
+    _current = _name;
+
+    *name = _current;
+    *done = false;
+    return true;
+}
+
+/*!
+ * \brief Copy all parts of the current file to \a fd or discard them if \a fd
+ *        is negative
+ */
+bool BackupStreamReader::copy_parts(int fd)
+{
+    long part = _part;
+
+    while (true) {
+        if (fd >= 0 && !la_copy_data_to_fd(_a.get(), fd)) {
+            LOGE("%s: Failed to copy data from stream", _current.c_str());
+            return false;
+        }
+
+        if (part < 0) {
+            // Stored as a single entry
+            return true;
+        }
+
+        if (!read_header()) {
+            return false;
+        } else if (_eof || _name != _current || _part != part + 1) {
+            // The entry belongs to the next file
+            return true;
+        }
+
+        _pending = false;
+        part = _part;
+    }
+}
+
+/*!
+ * \brief Write the current file to \a path
+ */
+bool BackupStreamReader::extract(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+    if (fd < 0) {
+        LOGE("%s: Failed to open file: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ret = copy_parts(fd);
+
+    if (::close(fd) < 0) {
+        LOGE("%s: Failed to close file: %s", path.c_str(), strerror(errno));
+        ret = false;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Pass the current file to \a fn without writing it to storage
+ *
+ * \a fn runs on a separate thread and reads the file from a pipe, while the
+ * calling thread copies the data from the stream into the pipe. If \a fn
+ * fails, the pipe is closed, so the copy fails with EPIPE instead of blocking
+ * forever. SIGPIPE must be ignored for this.
+ *
+ * \return Whether \a fn succeeded and the whole file was read from the stream
+ */
+bool BackupStreamReader::pipe(const StreamConsumerFn &fn)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        LOGE("Failed to create pipe: %s", strerror(errno));
+        return false;
+    }
+
+    // The consumer opens the read end by path, just like a regular file
+    std::string path = format("/proc/self/fd/%d", fds[0]);
+    bool consumed = false;
+
+    std::thread thread([&] {
+        consumed = fn(path);
+        if (consumed) {
+            // Consumers may stop reading before the end (eg. at the end of
+            // a tar archive's entries), so let the remaining data through
+            discard_fd(fds[0]);
+        }
+        ::close(fds[0]);
+    });
+
+    bool ret = copy_parts(fds[1]);
+
+    ::close(fds[1]);
+    thread.join();
+
+    return ret && consumed;
+}
+
+/*!
+ * \brief Skip the current file
+ */
+bool BackupStreamReader::skip()
+{
+    return copy_parts(-1);
+}
+
+}
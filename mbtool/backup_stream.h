@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+#include <cstdint>
+
+#include "mbutil/autoclose/archive.h"
+
+namespace mb
+{
+
+/*!
+ * \brief Function that writes a file to \a path
+ *
+ * When streaming, \a path refers to a pipe, so the function must write the
+ * file sequentially and must not expect to be able to read it back.
+ */
+typedef std::function<bool(const std::string &path)> StreamProducerFn;
+
+/*!
+ * \brief Function that reads a file from \a path
+ *
+ * When streaming, \a path refers to a pipe, so the file can only be read once
+ * and sequentially.
+ */
+typedef std::function<bool(const std::string &path)> StreamConsumerFn;
+
+/*!
+ * \brief Writes the files of a backup as a single stream
+ *
+ * The stream is a pax tar archive, so it can be written to a pipe (eg.
+ * `adb exec-out`) without any staging on the device. Files with a known size
+ * are stored as regular entries. Archives that are still being created are
+ * stored as a sequence of entries named "<name>.part<N>" of at most
+ * io_block_size() bytes each. Concatenating the parts in order gives the same
+ * file as a backup directory would contain.
+ */
+class BackupStreamWriter
+{
+public:
+    BackupStreamWriter();
+
+    bool open(int fd);
+    bool close();
+
+    bool add_file(const std::string &name, const std::string &path);
+    bool add_archive(const std::string &name, const StreamProducerFn &fn);
+
+private:
+    bool write_header(const std::string &name, uint64_t size);
+    bool write_data(const std::string &name, const void *data, size_t size);
+
+    autoclose::archive _a;
+};
+
+/*!
+ * \brief Reads the files of a backup from a stream written by
+ *        BackupStreamWriter
+ *
+ * Files must be read in the order in which they appear in the stream. After
+ * next() returns a file, exactly one of extract(), pipe(), or skip() must be
+ * called before the next call to next().
+ */
+class BackupStreamReader
+{
+public:
+    BackupStreamReader();
+
+    bool open(int fd);
+    bool close();
+
+    bool next(std::string *name, bool *done);
+
+    bool extract(const std::string &path);
+    bool pipe(const StreamConsumerFn &fn);
+    bool skip();
+
+private:
+    bool read_header();
+    bool copy_parts(int fd);
+
+    autoclose::archive _a;
+    // Whether the stream's last header has been read, but not consumed
+    bool _pending;
+    bool _eof;
+    // File and part number of the entry whose header was read last. The part
+    // number is -1 if the file is stored as a single entry.
+    std::string _name;
+    long _part;
+    // File returned by the last call to next()
+    std::string _current;
+};
+
+}
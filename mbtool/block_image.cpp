@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "block_image.h"
+
+#include <cstring>
+
+#include "mblog/logging.h"
+#include "mbutil/integer.h"
+#include "mbutil/string.h"
+
+#define LOG_TAG "mbtool/block_image"
+
+namespace mb
+{
+
+// Parse a range set ("<count>,<start>,<end>,...") and return the number of
+// blocks it covers
+static bool parse_range_set(const std::string &str, uint64_t *blocks_out)
+{
+    std::vector<std::string> pieces = util::split(str, ",");
+    unsigned int count;
+    uint64_t blocks = 0;
+
+    if (pieces.empty()
+            || !util::str_to_unum(pieces[0].c_str(), 10, &count)
+            || count == 0 || count % 2 != 0
+            || count != pieces.size() - 1) {
+        return false;
+    }
+
+    for (size_t i = 1; i < pieces.size(); i += 2) {
+        uint64_t start;
+        uint64_t end;
+
+        if (!util::str_to_unum(pieces[i].c_str(), 10, &start)
+                || !util::str_to_unum(pieces[i + 1].c_str(), 10, &end)
+                || end <= start) {
+            return false;
+        }
+
+        blocks += end - start;
+    }
+
+    *blocks_out = blocks;
+    return true;
+}
+
+/*!
+ * \brief Parse a block image update transfer list
+ *
+ * Only the header and the command names are validated. The arguments of
+ * commands that read source blocks are not parsed since the update engine in
+ * the ROM's updater is what actually applies them.
+ *
+ * \param contents Contents of the transfer list
+ * \param out Summary of the transfer list
+ *
+ * \return Whether the transfer list was successfully parsed
+ */
+bool parse_transfer_list(const std::string &contents, TransferList *out)
+{
+    std::vector<std::string> lines = util::split(contents, "\n");
+    TransferList tl{};
+    size_t header_lines;
+
+    if (lines.size() < 2) {
+        LOGE("Transfer list is too short");
+        return false;
+    }
+
+    if (!util::str_to_unum(lines[0].c_str(), 10, &tl.version)
+            || tl.version < 1 || tl.version > 4) {
+        LOGE("Unsupported transfer list version: '%s'", lines[0].c_str());
+        return false;
+    }
+
+    if (!util::str_to_unum(lines[1].c_str(), 10, &tl.total_blocks)) {
+        LOGE("Invalid total block count: '%s'", lines[1].c_str());
+        return false;
+    }
+
+    // Versions 2 and newer also list the maximum number of stash entries and
+    // stashed blocks
+    header_lines = tl.version >= 2 ? 4 : 2;
+    if (lines.size() < header_lines) {
+        LOGE("Transfer list header is truncated");
+        return false;
+    }
+
+    for (size_t i = header_lines; i < lines.size(); ++i) {
+        const std::string &line = lines[i];
+        if (line.empty()) {
+            continue;
+        }
+
+        std::vector<std::string> args = util::tokenize(line, " ");
+        if (args.empty()) {
+            continue;
+        }
+
+        const std::string &cmd = args[0];
+
+        if (cmd == "new" || cmd == "zero" || cmd == "erase") {
+            uint64_t blocks;
+
+            if (args.size() != 2 || !parse_range_set(args[1], &blocks)) {
+                LOGE("Invalid '%s' command on line %zu",
+                     cmd.c_str(), i + 1);
+                return false;
+            }
+
+            if (cmd == "new") {
+                tl.new_blocks += blocks;
+            }
+        } else if (cmd == "free") {
+            // Only drops stash entries
+        } else if (cmd == "move" || cmd == "bsdiff" || cmd == "imgdiff"
+                || cmd == "stash") {
+            tl.reads_source = true;
+        } else {
+            LOGE("Unknown command '%s' on line %zu", cmd.c_str(), i + 1);
+            return false;
+        }
+    }
+
+    *out = tl;
+    return true;
+}
+
+}
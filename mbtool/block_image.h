@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace mb
+{
+
+/*!
+ * \brief Summary of an update-engine transfer list (`<partition>.transfer.list`)
+ */
+struct TransferList
+{
+    // Transfer list format version (1-4)
+    unsigned int version;
+    // Size of the target partition in blocks
+    uint64_t total_blocks;
+    // Number of blocks written from `<partition>.new.dat`
+    uint64_t new_blocks;
+    // Whether any command reads blocks from the existing partition (move,
+    // bsdiff, imgdiff, stash). If not, the update overwrites the whole
+    // partition and the previous contents are irrelevant.
+    bool reads_source;
+};
+
+bool parse_transfer_list(const std::string &contents, TransferList *out);
+
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "boot_env.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include "mbdevice/json.h"
+#include "mblog/logging.h"
+#include "mbutil/cmdline.h"
+#include "mbutil/file.h"
+#include "mbutil/trace.h"
+
+#include "multiboot.h"
+
+namespace mb
+{
+
+using namespace device;
+
+BootEnv::BootEnv() : _device_loaded(false)
+{
+}
+
+static util::CmdlineIterAction add_cmdline_option(const char *name,
+                                                  const char *value,
+                                                  void *userdata)
+{
+    auto *options = static_cast<std::vector<CmdlineOption> *>(userdata);
+
+    CmdlineOption option;
+    option.name = name;
+    option.has_value = value != nullptr;
+    if (value) {
+        option.value = value;
+    }
+    options->push_back(std::move(option));
+
+    return util::CmdlineIterAction::Continue;
+}
+
+bool BootEnv::load_cmdline()
+{
+    _cmdline.clear();
+
+    if (!util::kernel_cmdline_iter(&add_cmdline_option, &_cmdline)) {
+        return false;
+    }
+
+    // Same value that init's ro.hardware property gets
+    if (!cmdline_option("androidboot.hardware", &_hardware)) {
+        _hardware = "unknown";
+    }
+
+    return true;
+}
+
+bool BootEnv::load_device()
+{
+    _device_loaded = false;
+
+    std::vector<unsigned char> contents;
+    if (!util::file_read_all(DEVICE_JSON_PATH, &contents)) {
+        LOGE("%s: Failed to read file: %s",
+             DEVICE_JSON_PATH, strerror(errno));
+        return false;
+    }
+    contents.push_back('\0');
+
+    JsonError error;
+
+    if (!device_from_json(
+            reinterpret_cast<char *>(contents.data()), _device, error)) {
+        LOGE("%s: Failed to load device definition", DEVICE_JSON_PATH);
+        return false;
+    }
+
+    _device_loaded = true;
+
+    if (_device.validate()) {
+        LOGE("%s: Device definition validation failed", DEVICE_JSON_PATH);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read the boot environment
+ *
+ * Everything that can be read is loaded, even if another part fails.
+ *
+ * \return Whether the device definition was loaded and is valid. A missing
+ *         kernel command line or ROM ID is only logged since the steps using
+ *         them already handle empty values.
+ */
+bool BootEnv::load()
+{
+    MB_TIMELINE_SCOPE("init.load_boot_env");
+
+    if (!load_cmdline()) {
+        LOGW("Failed to read kernel command line");
+    }
+
+    if (!util::file_first_line("/romid", &_rom_id)) {
+        _rom_id.clear();
+    }
+
+    return load_device();
+}
+
+const std::vector<CmdlineOption> & BootEnv::cmdline() const
+{
+    return _cmdline;
+}
+
+/*!
+ * \brief Get the value of a kernel command line option
+ *
+ * Like util::kernel_cmdline_get_option(), the last occurrence of the option
+ * wins and options without a value are reported as missing.
+ */
+bool BootEnv::cmdline_option(const char *name, std::string *out) const
+{
+    for (auto it = _cmdline.rbegin(); it != _cmdline.rend(); ++it) {
+        if (it->name == name) {
+            if (!it->has_value) {
+                return false;
+            }
+            *out = it->value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Value of androidboot.hardware or "unknown" if it is not set
+ */
+const std::string & BootEnv::hardware() const
+{
+    return _hardware;
+}
+
+/*!
+ * \brief Whether DEVICE_JSON_PATH was parsed
+ *
+ * This is true even if the device definition failed validation so that the
+ * emergency reboot can still use its block device paths.
+ */
+bool BootEnv::device_loaded() const
+{
+    return _device_loaded;
+}
+
+const Device & BootEnv::device() const
+{
+    return _device;
+}
+
+/*!
+ * \brief Contents of /romid or an empty string if it could not be read
+ */
+const std::string & BootEnv::rom_id() const
+{
+    return _rom_id;
+}
+
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "mbdevice/device.h"
+
+namespace mb
+{
+
+struct CmdlineOption
+{
+    std::string name;
+    std::string value;
+    // False for options without an '=' (eg. "quiet")
+    bool has_value;
+};
+
+/*!
+ * \brief Snapshot of the boot environment
+ *
+ * Built once at the start of init_main() from the kernel command line,
+ * DEVICE_JSON_PATH, and /romid. The init steps only read from it, so they can
+ * share it from any thread without re-reading and re-parsing those files.
+ */
+class BootEnv
+{
+public:
+    BootEnv();
+
+    bool load();
+
+    const std::vector<CmdlineOption> & cmdline() const;
+    bool cmdline_option(const char *name, std::string *out) const;
+    const std::string & hardware() const;
+
+    bool device_loaded() const;
+    const device::Device & device() const;
+
+    const std::string & rom_id() const;
+
+private:
+    bool load_cmdline();
+    bool load_device();
+
+    std::vector<CmdlineOption> _cmdline;
+    std::string _hardware;
+    bool _device_loaded;
+    device::Device _device;
+    std::string _rom_id;
+};
+
+}
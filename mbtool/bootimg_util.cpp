@@ -21,39 +21,74 @@
 
 #include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
+#include <memory>
+
 #include <unistd.h>
 
+#include "mbcommon/buffer_pool.h"
 #include "mblog/logging.h"
 
-#define BUF_SIZE    10240
-
 typedef std::unique_ptr<FILE, decltype(fclose) *> ScopedFILE;
 
 namespace mb
 {
 
+static bool write_fully(int fd, const char *data, size_t size)
+{
+    ssize_t n_written;
+
+    while (size > 0) {
+        n_written = write(fd, data, size);
+        if (n_written < 0 && errno == EINTR) {
+            continue;
+        } else if (n_written <= 0) {
+            LOGE("Failed to write data: %s", strerror(errno));
+            return false;
+        }
+
+        data += n_written;
+        size -= n_written;
+    }
+
+    return true;
+}
+
 bool bi_copy_data_to_fd(MbBiReader *bir, int fd)
 {
     int ret;
-    char buf[BUF_SIZE];
     size_t n_read;
-    ssize_t n_written;
-    size_t remain;
+    const void *data;
+    size_t data_size;
 
-    while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n_read))
-            == MB_BI_OK) {
-        remain = n_read;
+    // Write directly from the mapped boot image if possible
+    ret = mb_bi_reader_read_data_view(bir, &data, &data_size);
+    if (ret == MB_BI_OK) {
+        return write_fully(fd, static_cast<const char *>(data), data_size);
+    } else if (ret == MB_BI_EOF) {
+        return true;
+    } else if (ret != MB_BI_UNSUPPORTED) {
+        LOGE("Failed to read boot image entry data: %s",
+             mb_bi_reader_error_string(bir));
+        return false;
+    }
 
-        while (remain > 0) {
-            n_written = write(fd, buf + (n_read - remain), remain);
-            if (n_written <= 0) {
-                LOGE("Failed to write data: %s", strerror(errno));
-                return false;
-            }
+    // Kernel and ramdisk images can be tens of megabytes, so avoid bouncing
+    // everything through a small stack buffer
+    PooledBuffer buf(io_block_size());
+    if (!buf) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
+    char *ptr = static_cast<char *>(buf.data());
 
-            remain -= n_written;
+    while ((ret = mb_bi_reader_read_data(bir, ptr, buf.size(),
+                                         &n_read)) == MB_BI_OK) {
+        if (!write_fully(fd, ptr, n_read)) {
+            return false;
         }
     }
 
@@ -75,22 +110,27 @@ bool bi_copy_file_to_data(const std::string &path, MbBiWriter *biw)
         return false;
     }
 
-    char buf[10240];
+    PooledBuffer buf(io_block_size());
     size_t n;
 
+    if (!buf) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
     while (true) {
-        n = fread(buf, 1, sizeof(buf), fp.get());
+        n = fread(buf.data(), 1, buf.size(), fp.get());
 
         size_t bytes_written;
 
-        if (mb_bi_writer_write_data(biw, buf, n, &bytes_written) != MB_BI_OK
-                || bytes_written != n) {
+        if (mb_bi_writer_write_data(biw, buf.data(), n, &bytes_written)
+                != MB_BI_OK || bytes_written != n) {
             LOGE("Failed to write entry data: %s",
                  mb_bi_writer_error_string(biw));
             return false;
         }
 
-        if (n < sizeof(buf)) {
+        if (n < buf.size()) {
             if (ferror(fp.get())) {
                 LOGE("%s: Failed to read file: %s",
                      path.c_str(), strerror(errno));
@@ -113,12 +153,17 @@ bool bi_copy_data_to_file(MbBiReader *bir, const std::string &path)
     }
 
     int ret;
-    char buf[10240];
+    PooledBuffer buf(io_block_size());
     size_t n;
 
-    while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n))
+    if (!buf) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
+    while ((ret = mb_bi_reader_read_data(bir, buf.data(), buf.size(), &n))
             == MB_BI_OK) {
-        if (fwrite(buf, 1, n, fp.get()) != n) {
+        if (fwrite(buf.data(), 1, n, fp.get()) != n) {
             LOGE("%s: Failed to write data: %s",
                  path.c_str(), strerror(errno));
             return false;
@@ -140,16 +185,82 @@ bool bi_copy_data_to_file(MbBiReader *bir, const std::string &path)
     return true;
 }
 
+bool bi_copy_data_to_memory(MbBiReader *bir, std::string &out)
+{
+    int ret;
+    size_t n_read;
+    const void *data;
+    size_t data_size;
+
+    out.clear();
+
+    // Copy directly from the mapped boot image if possible
+    ret = mb_bi_reader_read_data_view(bir, &data, &data_size);
+    if (ret == MB_BI_OK) {
+        out.assign(static_cast<const char *>(data), data_size);
+        return true;
+    } else if (ret == MB_BI_EOF) {
+        return true;
+    } else if (ret != MB_BI_UNSUPPORTED) {
+        LOGE("Failed to read boot image entry data: %s",
+             mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    size_t size = 0;
+
+    while (true) {
+        out.resize(size + io_block_size());
+
+        ret = mb_bi_reader_read_data(bir, &out[size], io_block_size(),
+                                     &n_read);
+        if (ret != MB_BI_OK) {
+            break;
+        }
+
+        size += n_read;
+    }
+
+    out.resize(size);
+
+    if (ret != MB_BI_EOF) {
+        LOGE("Failed to read boot image entry data: %s",
+             mb_bi_reader_error_string(bir));
+        return false;
+    }
+
+    return true;
+}
+
+bool bi_copy_memory_to_data(const void *data, size_t size, MbBiWriter *biw)
+{
+    size_t bytes_written;
+
+    if (mb_bi_writer_write_data(biw, data, size, &bytes_written) != MB_BI_OK
+            || bytes_written != size) {
+        LOGE("Failed to write entry data: %s",
+             mb_bi_writer_error_string(biw));
+        return false;
+    }
+
+    return true;
+}
+
 bool bi_copy_data_to_data(MbBiReader *bir, MbBiWriter *biw)
 {
     int ret;
-    char buf[10240];
+    PooledBuffer buf(io_block_size());
     size_t n_read;
     size_t n_written;
 
-    while ((ret = mb_bi_reader_read_data(bir, buf, sizeof(buf), &n_read))
-            == MB_BI_OK) {
-        ret = mb_bi_writer_write_data(biw, buf, n_read, &n_written);
+    if (!buf) {
+        LOGE("Failed to allocate buffer: %s", strerror(errno));
+        return false;
+    }
+
+    while ((ret = mb_bi_reader_read_data(bir, buf.data(), buf.size(),
+                                         &n_read)) == MB_BI_OK) {
+        ret = mb_bi_writer_write_data(biw, buf.data(), n_read, &n_written);
         if (ret != MB_BI_OK || n_read != n_written) {
             LOGE("Failed to write entry data: %s",
                  mb_bi_writer_error_string(biw));
@@ -30,6 +30,8 @@ namespace mb
 bool bi_copy_data_to_fd(MbBiReader *bir, int fd);
 bool bi_copy_file_to_data(const std::string &path, MbBiWriter *biw);
 bool bi_copy_data_to_file(MbBiReader *bir, const std::string &path);
+bool bi_copy_data_to_memory(MbBiReader *bir, std::string &out);
+bool bi_copy_memory_to_data(const void *data, size_t size, MbBiWriter *biw);
 bool bi_copy_data_to_data(MbBiReader *bir, MbBiWriter *biw);
 
 }
@@ -0,0 +1,753 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chunk_store.h"
+
+#include <algorithm>
+#include <array>
+#include <utility>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <lz4.h>
+#include <openssl/sha.h>
+
+#include "mbcommon/buffer_pool.h"
+#include "mblog/logging.h"
+#include "mbutil/autoclose/archive.h"
+#include "mbutil/autoclose/dir.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/directory.h"
+#include "mbutil/file.h"
+#include "mbutil/finally.h"
+#include "mbutil/string.h"
+
+// xattr holding the size and chunk list of a file in a manifest
+#define CHUNK_XATTR_NAME        "mbtool.chunks"
+
+// Bytes of SHA-512 digest used to identify a chunk
+#define CHUNK_DIGEST_SIZE       32
+
+// Chunk size bounds. The average size is CHUNK_MIN_SIZE + 64 KiB.
+#define CHUNK_MIN_SIZE          (16 * 1024)
+#define CHUNK_MAX_SIZE          (256 * 1024)
+#define CHUNK_CUT_MASK          (UINT64_C(0xffff) << 48)
+
+// Chunk files start with the storage method and the raw data size
+#define CHUNK_HEADER_SIZE       5
+#define CHUNK_METHOD_RAW        0
+#define CHUNK_METHOD_LZ4        1
+
+namespace mb
+{
+
+typedef std::array<uint64_t, 256> GearTable;
+
+/*!
+ * \brief Get the rolling hash's per-byte values
+ *
+ * The table is generated on first use so that mbtool invocations that never
+ * touch a chunk store don't pay for it.
+ *
+ * The table must never change or chunk boundaries (and thus deduplication
+ * against existing backups) will be different.
+ */
+static const GearTable & gear_table()
+{
+    static const GearTable table = [] {
+        GearTable result;
+        uint64_t state = 0;
+
+        // splitmix64
+        for (auto &value : result) {
+            uint64_t z = (state += UINT64_C(0x9e3779b97f4a7c15));
+            z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+            z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+            value = z ^ (z >> 31);
+        }
+
+        return result;
+    }();
+
+    return table;
+}
+
+static void put_le32(char *buf, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        buf[i] = static_cast<char>(value >> (i * 8));
+    }
+}
+
+static uint32_t get_le32(const unsigned char *buf)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= static_cast<uint32_t>(buf[i]) << (i * 8);
+    }
+    return value;
+}
+
+static void put_le64(std::string *str, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) {
+        str->push_back(static_cast<char>(value >> (i * 8)));
+    }
+}
+
+static uint64_t get_le64(const char *buf)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i) {
+        value |= static_cast<uint64_t>(static_cast<unsigned char>(buf[i]))
+                << (i * 8);
+    }
+    return value;
+}
+
+static std::string chunk_digest(const void *data, size_t size)
+{
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    SHA512(static_cast<const unsigned char *>(data), size, digest);
+    return std::string(reinterpret_cast<char *>(digest), CHUNK_DIGEST_SIZE);
+}
+
+/*!
+ * \brief Get the chunk list xattr of an entry
+ *
+ * \return Whether the xattr exists and is well formed
+ */
+static bool get_chunk_xattr(archive_entry *entry, const char **value_out,
+                            size_t *size_out)
+{
+    const char *name;
+    const void *value;
+    size_t size;
+
+    archive_entry_xattr_reset(entry);
+    while (archive_entry_xattr_next(entry, &name, &value, &size)
+            == ARCHIVE_OK) {
+        if (strcmp(name, CHUNK_XATTR_NAME) == 0) {
+            if (size < 8 || (size - 8) % CHUNK_DIGEST_SIZE != 0) {
+                LOGE("%s: Invalid chunk list", archive_entry_pathname(entry));
+                return false;
+            }
+            *value_out = static_cast<const char *>(value);
+            *size_out = size;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+ChunkStore::ChunkStore(std::string dir, bool compress)
+    : _dir(std::move(dir))
+    , _compress(compress)
+    , _hash(0)
+    , _hash_only(false)
+    , _total_bytes(0)
+    , _new_bytes(0)
+{
+}
+
+/*!
+ * \brief Store the data of a file from a disk reader
+ *
+ * The chunk list is saved in the entry's xattrs. The caller is responsible for
+ * clearing the size of the entry before writing it to the manifest.
+ */
+bool ChunkStore::store(archive *in, archive_entry *entry)
+{
+    static const unsigned char null_buf[64 * 1024] = {};
+    std::string refs;
+    const void *buf;
+    size_t size;
+    int64_t offset;
+    int64_t progress = 0;
+    int ret;
+
+    // Chunks never span files
+    _buf.clear();
+    _hash = 0;
+
+    // Size placeholder
+    put_le64(&refs, 0);
+
+    do {
+        ret = archive_read_data_block(in, &buf, &size, &offset);
+        if (ret == ARCHIVE_EOF) {
+            // Trailing hole
+            offset = archive_entry_size(entry);
+            size = 0;
+        } else if (ret != ARCHIVE_OK) {
+            LOGE("%s: %s", archive_entry_pathname(entry),
+                 archive_error_string(in));
+            return false;
+        }
+
+        // Holes in sparse files are stored as zeros, which deduplicate well
+        while (offset > progress) {
+            size_t n = static_cast<size_t>(std::min<int64_t>(
+                    offset - progress, sizeof(null_buf)));
+            if (!feed(null_buf, n, &refs)) {
+                return false;
+            }
+            progress += n;
+        }
+
+        if (!feed(static_cast<const unsigned char *>(buf), size, &refs)) {
+            return false;
+        }
+        progress += size;
+    } while (ret == ARCHIVE_OK);
+
+    if (!flush(&refs)) {
+        return false;
+    }
+
+    std::string size_buf;
+    put_le64(&size_buf, static_cast<uint64_t>(progress));
+    refs.replace(0, size_buf.size(), size_buf);
+
+    archive_entry_xattr_add_entry(entry, CHUNK_XATTR_NAME,
+                                  refs.data(), refs.size());
+
+    return true;
+}
+
+bool ChunkStore::is_stored(archive_entry *entry)
+{
+    const char *value;
+    size_t size;
+
+    return get_chunk_xattr(entry, &value, &size);
+}
+
+/*!
+ * \brief Get the size of a file whose data is in the store
+ *
+ * \return Whether \a entry's data is in the store
+ */
+bool ChunkStore::stored_size(archive_entry *entry, uint64_t *size_out)
+{
+    const char *value;
+    size_t size;
+
+    if (!get_chunk_xattr(entry, &value, &size)) {
+        return false;
+    }
+
+    *size_out = get_le64(value);
+    return true;
+}
+
+/*!
+ * \brief Check if a file on disk has the same contents as a stored file
+ *
+ * The file is chunked and hashed the same way as when it was stored, so no
+ * chunks need to be read from the store.
+ *
+ * \param entry Entry whose data is in the store
+ * \param path Path to file to compare
+ *
+ * \return Whether the file's contents match. Returns false if the file cannot
+ *         be read.
+ */
+bool ChunkStore::matches(archive_entry *entry, const std::string &path)
+{
+    const char *value;
+    size_t size;
+
+    if (!get_chunk_xattr(entry, &value, &size)) {
+        return false;
+    }
+
+    autoclose::file fp(autoclose::fopen(path.c_str(), "rb"));
+    if (!fp) {
+        return false;
+    }
+
+    std::string refs;
+    put_le64(&refs, 0);
+
+    _buf.clear();
+    _hash = 0;
+    _hash_only = true;
+
+    auto reset = util::finally([&] {
+        _buf.clear();
+        _hash = 0;
+        _hash_only = false;
+    });
+
+    PooledBuffer buf(io_block_size());
+    uint64_t file_size = 0;
+    size_t n;
+
+    if (!buf) {
+        return false;
+    }
+
+    while ((n = fread(buf.data(), 1, buf.size(), fp.get())) > 0) {
+        feed(static_cast<const unsigned char *>(buf.data()), n, &refs);
+        file_size += n;
+    }
+
+    if (ferror(fp.get())) {
+        return false;
+    }
+
+    flush(&refs);
+
+    std::string size_buf;
+    put_le64(&size_buf, file_size);
+    refs.replace(0, size_buf.size(), size_buf);
+
+    return refs.size() == size && memcmp(refs.data(), value, size) == 0;
+}
+
+/*!
+ * \brief Write an entry and its data from the store to a disk writer
+ */
+bool ChunkStore::load(archive_entry *entry, archive *out)
+{
+    const char *value;
+    size_t size;
+
+    if (!get_chunk_xattr(entry, &value, &size)) {
+        return false;
+    }
+
+    uint64_t file_size = get_le64(value);
+    std::vector<std::string> digests;
+    for (size_t i = 8; i < size; i += CHUNK_DIGEST_SIZE) {
+        digests.emplace_back(value + i, CHUNK_DIGEST_SIZE);
+    }
+
+    // Drop the chunk list so it isn't restored as an xattr
+    std::vector<std::pair<std::string, std::string>> xattrs;
+    {
+        const char *name;
+        const void *data;
+        size_t data_size;
+
+        archive_entry_xattr_reset(entry);
+        while (archive_entry_xattr_next(entry, &name, &data, &data_size)
+                == ARCHIVE_OK) {
+            if (strcmp(name, CHUNK_XATTR_NAME) != 0) {
+                xattrs.emplace_back(name, std::string(
+                        static_cast<const char *>(data), data_size));
+            }
+        }
+    }
+    archive_entry_xattr_clear(entry);
+    for (auto const &xattr : xattrs) {
+        archive_entry_xattr_add_entry(entry, xattr.first.c_str(),
+                                      xattr.second.data(),
+                                      xattr.second.size());
+    }
+
+    archive_entry_set_size(entry, static_cast<int64_t>(file_size));
+
+    if (archive_write_header(out, entry) != ARCHIVE_OK) {
+        LOGE("%s: %s", archive_entry_pathname(entry),
+             archive_error_string(out));
+        return false;
+    }
+
+    std::vector<unsigned char> data;
+    uint64_t written = 0;
+
+    for (auto const &digest : digests) {
+        if (!read_chunk(digest, &data)) {
+            LOGE("%s: Failed to read data from chunk store",
+                 archive_entry_pathname(entry));
+            return false;
+        }
+
+        la_ssize_t n = archive_write_data(out, data.data(), data.size());
+        if (n < 0) {
+            LOGE("%s: %s", archive_entry_pathname(entry),
+                 archive_error_string(out));
+            return false;
+        } else if (static_cast<size_t>(n) != data.size()) {
+            LOGE("%s: Truncated write", archive_entry_pathname(entry));
+            return false;
+        }
+
+        written += data.size();
+    }
+
+    if (written != file_size) {
+        LOGE("%s: Expected %" PRIu64 " bytes, but chunks contain %" PRIu64
+             " bytes", archive_entry_pathname(entry), file_size, written);
+        return false;
+    }
+
+    if (archive_write_finish_entry(out) != ARCHIVE_OK) {
+        LOGE("%s: %s", archive_entry_pathname(entry),
+             archive_error_string(out));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Number of bytes of file data passed to the store
+ */
+uint64_t ChunkStore::total_bytes() const
+{
+    return _total_bytes;
+}
+
+/*!
+ * \brief Number of bytes of file data that were not already in the store
+ */
+uint64_t ChunkStore::new_bytes() const
+{
+    return _new_bytes;
+}
+
+/*!
+ * \brief Delete chunks that are not referenced by any of the manifests
+ *
+ * \param manifests Paths to all uncompressed manifests that use the store
+ *
+ * \return Whether all manifests were read. Nothing is deleted if any manifest
+ *         cannot be read.
+ */
+bool ChunkStore::prune(const std::vector<std::string> &manifests)
+{
+    std::unordered_set<std::string> referenced;
+
+    for (auto const &path : manifests) {
+        autoclose::archive in(archive_read_new(), archive_read_free);
+        if (!in) {
+            LOGE("Out of memory");
+            return false;
+        }
+
+        archive_read_support_format_tar(in.get());
+
+        if (archive_read_open_filename(in.get(), path.c_str(), 10240)
+                != ARCHIVE_OK) {
+            LOGE("%s: Failed to open file: %s",
+                 path.c_str(), archive_error_string(in.get()));
+            return false;
+        }
+
+        archive_entry *entry;
+        int ret;
+
+        while ((ret = archive_read_next_header(in.get(), &entry))
+                == ARCHIVE_OK) {
+            const char *value;
+            size_t size;
+
+            if (get_chunk_xattr(entry, &value, &size)) {
+                for (size_t i = 8; i < size; i += CHUNK_DIGEST_SIZE) {
+                    referenced.emplace(value + i, CHUNK_DIGEST_SIZE);
+                }
+            }
+        }
+
+        if (ret != ARCHIVE_EOF) {
+            LOGE("%s: Failed to read header: %s",
+                 path.c_str(), archive_error_string(in.get()));
+            return false;
+        }
+    }
+
+    std::unordered_set<std::string> referenced_names;
+    for (auto const &digest : referenced) {
+        referenced_names.insert(chunk_path(digest));
+    }
+
+    autoclose::dir dp(autoclose::opendir(_dir.c_str()));
+    if (!dp) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        LOGE("%s: Failed to open directory: %s", _dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    uint64_t count = 0;
+    dirent *ent;
+
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        std::string subdir(_dir);
+        subdir += '/';
+        subdir += ent->d_name;
+
+        autoclose::dir sub_dp(autoclose::opendir(subdir.c_str()));
+        if (!sub_dp) {
+            LOGW("%s: Failed to open directory: %s",
+                 subdir.c_str(), strerror(errno));
+            continue;
+        }
+
+        dirent *sub_ent;
+
+        while ((sub_ent = readdir(sub_dp.get()))) {
+            std::string path(subdir);
+            path += '/';
+            path += sub_ent->d_name;
+
+            if (sub_ent->d_type == DT_DIR
+                    || referenced_names.find(path) != referenced_names.end()) {
+                continue;
+            }
+
+            if (unlink(path.c_str()) < 0) {
+                LOGW("%s: Failed to delete: %s", path.c_str(), strerror(errno));
+            } else {
+                ++count;
+            }
+        }
+
+        // Only succeeds if the directory is now empty
+        rmdir(subdir.c_str());
+    }
+
+    _known.clear();
+
+    LOGI("Deleted %" PRIu64 " unreferenced chunks", count);
+
+    return true;
+}
+
+bool ChunkStore::feed(const unsigned char *data, size_t size,
+                      std::string *refs)
+{
+    const GearTable &gear = gear_table();
+
+    if (!_hash_only) {
+        _total_bytes += size;
+    }
+
+    while (size > 0) {
+        // No boundary can occur before the minimum size, so skip hashing
+        size_t n = 0;
+        if (_buf.size() < CHUNK_MIN_SIZE) {
+            n = std::min(size, CHUNK_MIN_SIZE - _buf.size());
+        }
+
+        bool cut = false;
+        while (n < size && _buf.size() + n < CHUNK_MAX_SIZE) {
+            _hash = (_hash << 1) + gear[data[n]];
+            ++n;
+            if ((_hash & CHUNK_CUT_MASK) == 0) {
+                cut = true;
+                break;
+            }
+        }
+
+        _buf.insert(_buf.end(), data, data + n);
+        data += n;
+        size -= n;
+
+        if (cut || _buf.size() >= CHUNK_MAX_SIZE) {
+            if (!flush(refs)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add the current chunk to the store and the chunk list
+ */
+bool ChunkStore::flush(std::string *refs)
+{
+    if (_buf.empty()) {
+        return true;
+    }
+
+    std::string digest = chunk_digest(_buf.data(), _buf.size());
+
+    if (!_hash_only && _known.find(digest) == _known.end()) {
+        struct stat sb;
+        if (stat(chunk_path(digest).c_str(), &sb) < 0) {
+            if (!write_chunk(digest)) {
+                return false;
+            }
+            _new_bytes += _buf.size();
+        }
+        _known.insert(digest);
+    }
+
+    refs->append(digest);
+
+    _buf.clear();
+    _hash = 0;
+
+    return true;
+}
+
+bool ChunkStore::write_chunk(const std::string &digest)
+{
+    std::string path = chunk_path(digest);
+
+    int bound = LZ4_compressBound(static_cast<int>(_buf.size()));
+    _scratch.resize(CHUNK_HEADER_SIZE + static_cast<size_t>(bound));
+
+    // Keep the chunk uncompressed unless that saves space
+    int n = 0;
+    if (_compress) {
+        n = LZ4_compress_default(
+                reinterpret_cast<const char *>(_buf.data()),
+                _scratch.data() + CHUNK_HEADER_SIZE,
+                static_cast<int>(_buf.size()), bound);
+    }
+    if (n > 0 && static_cast<size_t>(n) < _buf.size()) {
+        _scratch[0] = CHUNK_METHOD_LZ4;
+        _scratch.resize(CHUNK_HEADER_SIZE + static_cast<size_t>(n));
+    } else {
+        _scratch[0] = CHUNK_METHOD_RAW;
+        _scratch.resize(CHUNK_HEADER_SIZE);
+        _scratch.insert(_scratch.end(), _buf.begin(), _buf.end());
+    }
+    put_le32(_scratch.data() + 1, static_cast<uint32_t>(_buf.size()));
+
+    if (!util::mkdir_parent(path, 0755)) {
+        LOGE("%s: Failed to create parent directory: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Write to a temporary file so an interrupted backup can never leave a
+    // truncated chunk with a valid name. The name must be unique since other
+    // stores may be writing the same chunk concurrently.
+    std::string temp_path(path);
+    temp_path += ".XXXXXX";
+
+    int fd = mkstemp(&temp_path[0]);
+    if (fd < 0) {
+        LOGE("%s: Failed to create temporary file: %s",
+             temp_path.c_str(), strerror(errno));
+        return false;
+    }
+    close(fd);
+
+    if (!util::file_write_data(temp_path, _scratch.data(), _scratch.size())) {
+        LOGE("%s: Failed to write chunk: %s",
+             temp_path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    if (rename(temp_path.c_str(), path.c_str()) < 0) {
+        LOGE("%s: Failed to rename to %s: %s",
+             temp_path.c_str(), path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool ChunkStore::read_chunk(const std::string &digest,
+                            std::vector<unsigned char> *data)
+{
+    std::string path = chunk_path(digest);
+    std::vector<unsigned char> contents;
+
+    if (!util::file_read_all(path, &contents)) {
+        LOGE("%s: Failed to read chunk: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (contents.size() < CHUNK_HEADER_SIZE) {
+        LOGE("%s: Chunk is truncated", path.c_str());
+        return false;
+    }
+
+    uint32_t raw_size = get_le32(contents.data() + 1);
+    if (raw_size > CHUNK_MAX_SIZE) {
+        LOGE("%s: Invalid chunk size: %" PRIu32, path.c_str(), raw_size);
+        return false;
+    }
+
+    switch (contents[0]) {
+    case CHUNK_METHOD_RAW:
+        data->assign(contents.begin() + CHUNK_HEADER_SIZE, contents.end());
+        break;
+    case CHUNK_METHOD_LZ4: {
+        data->resize(raw_size);
+        int n = LZ4_decompress_safe(
+                reinterpret_cast<const char *>(contents.data())
+                        + CHUNK_HEADER_SIZE,
+                reinterpret_cast<char *>(data->data()),
+                static_cast<int>(contents.size() - CHUNK_HEADER_SIZE),
+                static_cast<int>(raw_size));
+        if (n < 0) {
+            LOGE("%s: Failed to decompress chunk", path.c_str());
+            return false;
+        }
+        data->resize(static_cast<size_t>(n));
+        break;
+    }
+    default:
+        LOGE("%s: Unknown chunk storage method: %d", path.c_str(), contents[0]);
+        return false;
+    }
+
+    if (data->size() != raw_size
+            || chunk_digest(data->data(), data->size()) != digest) {
+        LOGE("%s: Chunk is corrupted", path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+std::string ChunkStore::chunk_path(const std::string &digest) const
+{
+    std::string hex = util::hex_string(
+            reinterpret_cast<const unsigned char *>(digest.data()),
+            digest.size());
+
+    std::string path(_dir);
+    path += '/';
+    path += hex.substr(0, 2);
+    path += '/';
+    path += hex.substr(2);
+
+    return path;
+}
+
+}
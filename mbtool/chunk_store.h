@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbutil/archive.h"
+
+namespace mb
+{
+
+/*!
+ * \brief Content-addressed store for the data of files in backup archives
+ *
+ * File data is split into variable-size chunks with a rolling hash so that
+ * boundaries survive insertions and deletions in the middle of a file. Each
+ * chunk is stored once, named by its hash, and shared by every backup that
+ * uses the same store. The archive (the manifest) keeps the metadata and the
+ * list of chunks for each file instead of the data.
+ */
+class ChunkStore : public util::TarDataStore
+{
+public:
+    ChunkStore(std::string dir, bool compress);
+
+    bool store(archive *in, archive_entry *entry) override;
+    bool is_stored(archive_entry *entry) override;
+    bool load(archive_entry *entry, archive *out) override;
+
+    bool stored_size(archive_entry *entry, uint64_t *size_out);
+    bool matches(archive_entry *entry, const std::string &path);
+
+    uint64_t total_bytes() const;
+    uint64_t new_bytes() const;
+
+    bool prune(const std::vector<std::string> &manifests);
+
+private:
+    bool feed(const unsigned char *data, size_t size, std::string *refs);
+    bool flush(std::string *refs);
+    bool write_chunk(const std::string &digest);
+    bool read_chunk(const std::string &digest,
+                    std::vector<unsigned char> *data);
+    std::string chunk_path(const std::string &digest) const;
+
+    std::string _dir;
+    bool _compress;
+    // Chunks known to be in the store
+    std::unordered_set<std::string> _known;
+    // Current chunk and rolling hash
+    std::vector<unsigned char> _buf;
+    uint64_t _hash;
+    // Only compute the chunk list without writing to the store
+    bool _hash_only;
+    std::vector<char> _scratch;
+    uint64_t _total_bytes;
+    uint64_t _new_bytes;
+};
+
+}
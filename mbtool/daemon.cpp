@@ -23,6 +23,7 @@
 
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -34,19 +35,28 @@
 
 #include "mbcommon/common.h"
 #include "mbcommon/version.h"
+#include "mblog/binary_logger.h"
 #include "mblog/logging.h"
 #include "mblog/kmsg_logger.h"
 #include "mblog/stdio_logger.h"
+#include "mblog/tee_logger.h"
 #include "mbutil/autoclose/file.h"
+#include "mbutil/counters.h"
 #include "mbutil/directory.h"
 #include "mbutil/finally.h"
+#include "mbutil/integer.h"
 #include "mbutil/process.h"
 #include "mbutil/selinux.h"
 #include "mbutil/socket.h"
 
 #include "daemon_v3.h"
+#include "dirsize_cache.h"
+#include "job_manager.h"
+#include "job_scheduler.h"
 #include "multiboot.h"
 #include "packages.h"
+#include "rom_inventory.h"
+#include "signature.h"
 #include "roms.h"
 #include "sepolpatch.h"
 #include "validcerts.h"
@@ -56,6 +66,12 @@
 #define RESPONSE_OK "OK"                        // Generic accepted response
 #define RESPONSE_UNSUPPORTED "UNSUPPORTED"      // Generic unsupported response
 
+// Number of pre-forked connection workers to keep around
+#define DEFAULT_POOL_SIZE       3
+
+// Size of the binary log ring that persists across boots
+#define DAEMON_BINARY_LOG_SIZE  (1024 * 1024)
+
 
 namespace mb
 {
@@ -67,6 +83,17 @@ static bool allow_root_client = false;
 static bool log_to_kmsg = false;
 static bool log_to_stdio = false;
 static bool no_unshare = false;
+static unsigned int pool_size = DEFAULT_POOL_SIZE;
+
+struct Worker
+{
+    pid_t pid;
+    // Daemon side of the socket used to pass the client fd to the worker
+    int fd;
+};
+
+// Workers that are fully initialized and waiting for a client connection
+static std::vector<Worker> idle_workers;
 
 static autoclose::file log_fp(nullptr, std::fclose);
 
@@ -179,6 +206,185 @@ static bool client_connection(int fd)
     return true;
 }
 
+/*!
+ * \brief Give the worker its own private mount namespace
+ *
+ * This must only be done once the worker has a client. An idle worker stays in
+ * the daemon's namespace so that the copy made here includes everything
+ * mounted since the worker was forked (eg. /data after decryption or the
+ * external SD card).
+ */
+static bool isolate_worker_mounts()
+{
+    if (no_unshare) {
+        return true;
+    }
+
+    if (unshare(CLONE_NEWNS) < 0) {
+        LOGE("unshare() failed: %s", strerror(errno));
+        return false;
+    }
+
+    if (mount("", "/", "", MS_PRIVATE | MS_REC, "") < 0) {
+        LOGE("Failed to set private mount propagation: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool init_worker_process()
+{
+    // Change the process name so --replace doesn't kill existing
+    // connections
+    if (!util::set_process_title_v(nullptr, "mbtool connection worker")) {
+        LOGE("Failed to set process title: %s", strerror(errno));
+        return false;
+    }
+
+    // Restore default SIGCHLD and SIGPIPE handlers
+    struct sigaction sa;
+    sa.sa_handler = SIG_DFL;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    if (sigaction(SIGCHLD, &sa, 0) < 0) {
+        LOGE("Failed to set default SIGCHLD handler: %s", strerror(errno));
+        return false;
+    }
+    if (sigaction(SIGPIPE, &sa, 0) < 0) {
+        LOGE("Failed to set default SIGPIPE handler: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+MB_NO_RETURN
+static void worker_main(int listen_fd, int channel_fd)
+{
+    // Don't need the listening socket fd or the other workers' channels
+    close(listen_fd);
+    for (const Worker &worker : idle_workers) {
+        close(worker.fd);
+    }
+    idle_workers.clear();
+
+    if (!init_worker_process()) {
+        _exit(127);
+    }
+
+    std::vector<int> fds(1);
+    if (!util::socket_receive_fds(channel_fd, &fds)) {
+        // EPIPE means that the daemon exited before handing us a client
+        if (errno != EPIPE) {
+            LOGE("Failed to receive client socket: %s", strerror(errno));
+        }
+        _exit(errno == EPIPE ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(channel_fd);
+
+    if (!isolate_worker_mounts()) {
+        close(fds[0]);
+        _exit(EXIT_FAILURE);
+    }
+
+    bool ret = client_connection(fds[0]);
+    close(fds[0]);
+    _exit(ret ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static bool spawn_worker(int listen_fd, Worker *worker)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        LOGE("Failed to create socket pair: %s", strerror(errno));
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOGE("Failed to fork: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    } else if (pid == 0) {
+        close(sv[0]);
+        worker_main(listen_fd, sv[1]);
+    }
+
+    close(sv[1]);
+
+    worker->pid = pid;
+    worker->fd = sv[0];
+    return true;
+}
+
+/*!
+ * \brief Fork workers until the pool is full
+ *
+ * This stops early if a client is waiting to be accepted so that refilling the
+ * pool never delays a connection that could be handed to an idle worker.
+ */
+static void refill_worker_pool(int listen_fd)
+{
+    while (idle_workers.size() < pool_size) {
+        struct pollfd pfd;
+        pfd.fd = listen_fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, 0) != 0) {
+            break;
+        }
+
+        Worker worker;
+        if (!spawn_worker(listen_fd, &worker)) {
+            break;
+        }
+
+        idle_workers.push_back(worker);
+    }
+}
+
+/*!
+ * \brief Pass a client socket to a worker process
+ *
+ * An idle worker from the pool is used if one is available. Otherwise, a new
+ * worker is forked for the connection.
+ */
+static bool hand_off_connection(int listen_fd, int client_fd)
+{
+    while (true) {
+        Worker worker;
+        bool from_pool = !idle_workers.empty();
+
+        if (from_pool) {
+            worker = idle_workers.front();
+            idle_workers.erase(idle_workers.begin());
+        } else if (!spawn_worker(listen_fd, &worker)) {
+            return false;
+        }
+
+        bool ret = util::socket_send_fds(worker.fd, { client_fd });
+        int saved_errno = errno;
+        close(worker.fd);
+
+        if (ret) {
+            return true;
+        }
+
+        LOGW("Failed to pass connection to worker %d: %s",
+             worker.pid, strerror(saved_errno));
+
+        // An idle worker may have been killed, but a fresh one should never
+        // fail
+        if (!from_pool) {
+            return false;
+        }
+    }
+}
+
 static bool run_daemon()
 {
     int fd;
@@ -239,54 +445,66 @@ static bool run_daemon()
         return false;
     }
 
-    LOGD("Socket ready, waiting for connections");
+    // Don't die if a worker exits before we can hand it a connection
+    if (sigaction(SIGPIPE, &sa, 0) < 0) {
+        LOGE("Failed to set SIGPIPE handler: %s", strerror(errno));
+        return false;
+    }
 
-    int client_fd;
-    while ((client_fd = accept(fd, nullptr, nullptr)) >= 0) {
-        pid_t child_pid = fork();
-        if (child_pid < 0) {
-            LOGE("Failed to fork: %s", strerror(errno));
-        } else if (child_pid == 0) {
-            if (!no_unshare) {
-                if (unshare(CLONE_NEWNS) < 0) {
-                    LOGE("unshare() failed: %s", strerror(errno));
-                    _exit(127);
-                }
+    // The following shared state and preloaded data must be set up here, in the
+    // daemon process, before any helper or connection processes are forked, so
+    // that they all inherit it instead of each creating their own.
 
-                if (mount("", "/", "", MS_PRIVATE | MS_REC, "") < 0) {
-                    LOGE("Failed to set private mount propagation: %s",
-                         strerror(errno));
-                    _exit(127);
-                }
-            }
+    // Each process keeps its own counters if they cannot be shared
+    if (!util::counters_attach(get_raw_path(MULTIBOOT_COUNTERS))) {
+        LOGW("Counters will not be visible to mbtool stats");
+    }
 
-            // Change the process name so --replace doesn't kill existing
-            // connections
-            if (!util::set_process_title_v(
-                    nullptr, "mbtool connection initializing")) {
-                LOGE("Failed to set process title: %s", strerror(errno));
-                _exit(127);
-            }
+    // Background jobs are not preempted if the shared queues are unavailable
+    if (!job_scheduler_init()) {
+        LOGW("Background jobs will not yield to interactive requests");
+    }
 
-            // Restore default SIGCHLD handler
-            struct sigaction sa;
-            sa.sa_handler = SIG_DFL;
-            sigemptyset(&sa.sa_mask);
-            sa.sa_flags = 0;
-            if (sigaction(SIGCHLD, &sa, 0) < 0) {
-                LOGE("Failed to set default SIGCHLD handler: %s",
-                     strerror(errno));
-                _exit(127);
-            }
+    // Statistics are not essential, so continue even if they're unavailable
+    if (!connection_version_3_init()) {
+        LOGW("Request statistics will not be collected");
+    }
+
+    // Signatures are fully verified on every signed_exec if there's no cache.
+    // This and the preloaded data must be set up before any helper process is
+    // forked so that jobs inherit the parsed public keys too.
+    if (!verify_signature_enable_cache()) {
+        LOGW("Signature verifications will not be cached");
+    }
+    connection_version_3_preload();
+
+    // Directory sizes are computed by each connection if there's no cache
+    if (!dirsize_cache_start(fd)) {
+        LOGW("Directory sizes will not be cached");
+    }
+
+    // Installed ROMs are scanned on every request if there's no inventory
+    if (!rom_inventory_start(fd)) {
+        LOGW("Installed ROMs will not be cached");
+    }
 
-            // Don't need the listening socket fd
-            close(fd);
+    // Started after the other helper processes so that jobs can use them
+    if (!job_manager_start(fd)) {
+        LOGW("Background jobs will not be available");
+    }
+
+    refill_worker_pool(fd);
+
+    LOGD("Socket ready, waiting for connections");
 
-            bool ret = client_connection(client_fd);
-            close(client_fd);
-            _exit(ret ? EXIT_SUCCESS : EXIT_FAILURE);
+    int client_fd;
+    while ((client_fd = accept(fd, nullptr, nullptr)) >= 0) {
+        if (!hand_off_connection(fd, client_fd)) {
+            LOGE("Failed to start connection worker");
         }
         close(client_fd);
+
+        refill_worker_pool(fd);
     }
 
     if (client_fd < 0) {
@@ -339,10 +557,12 @@ static bool daemon_init()
     }
 
     // Set up logging
+    std::shared_ptr<log::BaseLogger> logger;
+
     if (log_to_stdio) {
         // Default; do nothing
     } else if (log_to_kmsg) {
-        log::log_set_logger(std::make_shared<log::KmsgLogger>(false));
+        logger = std::make_shared<log::KmsgLogger>(false);
     } else {
         if (!util::mkdir_parent(MULTIBOOT_LOG_DAEMON, 0775)
                 && errno != EEXIST) {
@@ -362,8 +582,22 @@ static bool daemon_init()
         fix_multiboot_permissions();
 
         // mbtool logging
-        log::log_set_logger(
-                std::make_shared<log::StdioLogger>(log_fp.get(), true));
+        logger = std::make_shared<log::StdioLogger>(log_fp.get(), true);
+    }
+
+    if (logger) {
+        // Keep the logs of previous boots in a fixed-size ring (the text log is
+        // overwritten every time the daemon starts)
+        auto binary_logger = std::make_shared<log::BinaryLogger>(
+                get_raw_path(MULTIBOOT_LOG_DAEMON_BINARY),
+                DAEMON_BINARY_LOG_SIZE);
+        if (binary_logger->is_open()) {
+            logger = std::make_shared<log::TeeLogger>(
+                    std::vector<std::shared_ptr<log::BaseLogger>>{
+                            std::move(logger), std::move(binary_logger)});
+        }
+
+        log::log_set_logger(std::move(logger));
     }
 
     LOGD("Initialized daemon");
@@ -462,7 +696,12 @@ static void daemon_usage(bool error)
             "                   fully initialized\n"
             "  --log-to-kmsg    Send log output to kernel log instead of file\n"
             "  --log-to-stdio   Send log output to stdout/stderr\n"
-            "  --no-unshare     Don't unshare mount namespace\n");
+            "  --no-unshare     Don't unshare mount namespace\n"
+            "  --pool-size <N>  Number of pre-forked connection workers\n"
+            "                   (default: %u)\n"
+            "  --background-cpus <LIST>\n"
+            "                   CPUs to run background jobs on (eg. 0-3)\n",
+            DEFAULT_POOL_SIZE);
 }
 
 int daemon_main(int argc, char *argv[])
@@ -479,6 +718,8 @@ int daemon_main(int argc, char *argv[])
         OPT_LOG_TO_KMSG = 1003,
         OPT_LOG_TO_STDIO = 1004,
         OPT_NO_UNSHARE = 1005,
+        OPT_POOL_SIZE = 1006,
+        OPT_BACKGROUND_CPUS = 1007,
     };
 
     static struct option long_options[] = {
@@ -491,6 +732,8 @@ int daemon_main(int argc, char *argv[])
         {"log-to-kmsg",        no_argument, 0, OPT_LOG_TO_KMSG},
         {"log-to-stdio",       no_argument, 0, OPT_LOG_TO_STDIO},
         {"no-unshare",         no_argument, 0, OPT_NO_UNSHARE},
+        {"pool-size",          required_argument, 0, OPT_POOL_SIZE},
+        {"background-cpus",    required_argument, 0, OPT_BACKGROUND_CPUS},
         {0, 0, 0, 0}
     };
 
@@ -534,6 +777,20 @@ int daemon_main(int argc, char *argv[])
             no_unshare = true;
             break;
 
+        case OPT_POOL_SIZE:
+            if (!util::str_to_unum(optarg, 10, &pool_size)) {
+                fprintf(stderr, "Invalid pool size: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case OPT_BACKGROUND_CPUS:
+            if (!job_scheduler_set_background_cpus(optarg)) {
+                fprintf(stderr, "Invalid CPU list: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
         default:
             daemon_usage(1);
             return EXIT_FAILURE;
@@ -19,12 +19,21 @@
 
 #include "daemon_v3.h"
 
+#include <algorithm>
+#include <atomic>
+#include <new>
 #include <unordered_map>
 #include <unordered_set>
 
+#include <climits>
+
+#include <dirent.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -33,19 +42,25 @@
 #include "mblog/logging.h"
 #include "mbutil/command.h"
 #include "mbutil/copy.h"
+#include "mbutil/counters.h"
 #include "mbutil/delete.h"
 #include "mbutil/directory.h"
+#include "mbutil/dirwalk.h"
 #include "mbutil/finally.h"
-#include "mbutil/fts.h"
+#include "mbutil/hashing_file.h"
 #include "mbutil/path.h"
-#include "mbutil/properties.h"
 #include "mbutil/selinux.h"
 #include "mbutil/socket.h"
 #include "mbutil/string.h"
+#include "mbutil/time.h"
 
+#include "dirsize_cache.h"
 #include "init.h"
+#include "job_manager.h"
+#include "job_scheduler.h"
 #include "packages.h"
 #include "reboot.h"
+#include "rom_inventory.h"
 #include "roms.h"
 #include "signature.h"
 #include "switcher.h"
@@ -58,21 +73,109 @@
 namespace mb
 {
 
+// Size of each data frame for streamed file reads
+#define STREAM_DEFAULT_CHUNK_SIZE       (256 * 1024)
+#define STREAM_MAX_CHUNK_SIZE           (4 * 1024 * 1024)
+
+// getdents64() buffer for directory listings
+#define LIST_DIRECTORY_BUF_SIZE         (64 * 1024)
+
 namespace v3 = mbtool::daemon::v3;
 namespace fb = flatbuffers;
 
 static std::unordered_map<int, int> fd_map;
 static int fd_count = 0;
 
+// Socket for the current connection. Responses are queued here and flushed
+// once no more pipelined requests are buffered.
+static util::FramedSocket *v3_socket = nullptr;
+
+struct BatchResponses
+{
+    // Finished response buffers, stored back to back
+    std::vector<uint8_t> data;
+    // Offset and size of each response in data
+    std::vector<std::pair<size_t, size_t>> spans;
+};
+
+// Non-null while the sub-requests of a BatchRequest are being handled
+static BatchResponses *batch_responses = nullptr;
+
+struct RequestStats
+{
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> total_time_ns;
+};
+
+// Per-request-type statistics indexed by v3::RequestType. This is shared
+// memory that is inherited by all connection processes.
+static RequestStats *request_stats = nullptr;
+
+// Set when the current request is answered with Invalid or Unsupported
+static bool request_rejected = false;
+
+// ID of the booted ROM. This cannot change while the daemon is running, so it
+// is determined once by the daemon process and inherited by all connection
+// processes. Empty if it could not be determined yet.
+static std::string booted_rom_id;
+
+/*!
+ * \brief Get the ID of the booted ROM
+ *
+ * \return Whether the booted ROM could be determined
+ */
+static bool get_booted_rom_id(std::string *id)
+{
+    if (booted_rom_id.empty()) {
+        auto rom = Roms::get_current_rom();
+        if (!rom) {
+            return false;
+        }
+        booted_rom_id = rom->id;
+    }
+
+    *id = booted_rom_id;
+    return true;
+}
+
+/*!
+ * \brief Get the connection's response builder
+ *
+ * The builder is cleared, but its allocation is kept across requests. Only one
+ * response can be built at a time.
+ */
+static fb::FlatBufferBuilder & v3_builder()
+{
+    static fb::FlatBufferBuilder builder;
+    builder.Clear();
+    return builder;
+}
+
 static bool v3_send_response(int fd, const fb::FlatBufferBuilder &builder)
 {
-    return util::socket_write_bytes(
-            fd, builder.GetBufferPointer(), builder.GetSize());
+    // Responses always go to the connection's socket
+    (void) fd;
+
+    const uint8_t *data = builder.GetBufferPointer();
+    size_t size = builder.GetSize();
+
+    if (batch_responses) {
+        batch_responses->spans.emplace_back(
+                batch_responses->data.size(), size);
+        batch_responses->data.insert(
+                batch_responses->data.end(), data, data + size);
+        return true;
+    }
+
+    return v3_socket->queue_frame(data, size);
 }
 
 static bool v3_send_response_invalid(int fd)
 {
-    fb::FlatBufferBuilder builder;
+    request_rejected = true;
+
+    fb::FlatBufferBuilder &builder = v3_builder();
     auto response = v3::CreateResponse(builder, v3::ResponseType_Invalid,
                                        v3::CreateInvalid(builder).Union());
     builder.Finish(response);
@@ -81,7 +184,9 @@ static bool v3_send_response_invalid(int fd)
 
 static bool v3_send_response_unsupported(int fd)
 {
-    fb::FlatBufferBuilder builder;
+    request_rejected = true;
+
+    fb::FlatBufferBuilder &builder = v3_builder();
     auto response = v3::CreateResponse(builder, v3::ResponseType_Unsupported,
                                        v3::CreateUnsupported(builder).Union());
     builder.Finish(response);
@@ -104,7 +209,7 @@ static bool v3_file_chmod(int fd, const v3::Request *msg)
         return v3_send_response_invalid(fd);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::FileChmodError> error;
 
     bool ret = fchmod(ffd, mode) == 0;
@@ -137,7 +242,7 @@ static bool v3_file_close(int fd, const v3::Request *msg)
     int ffd = it->second;
     fd_map.erase(it);
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::FileCloseError> error;
 
     bool ret = close(ffd) == 0;
@@ -187,7 +292,7 @@ static bool v3_file_open(int fd, const v3::Request *msg)
         }
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::FileOpenError> error;
     int id = -1;
 
@@ -224,13 +329,17 @@ static bool v3_file_read(int fd, const v3::Request *msg)
 
     int ffd = it->second;
 
-    std::vector<unsigned char> buf(request->count());
+    // Reused across requests so that steady-state reads do not allocate
+    static std::vector<unsigned char> buf;
+    if (buf.size() < request->count()) {
+        buf.resize(request->count());
+    }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::FileReadError> error;
     fb::Offset<fb::Vector<unsigned char>> data;
 
-    ssize_t ret = read(ffd, buf.data(), buf.size());
+    ssize_t ret = read(ffd, buf.data(), request->count());
     int saved_errno = errno;
 
     if (ret >= 0) {
@@ -274,7 +383,7 @@ static bool v3_file_seek(int fd, const v3::Request *msg)
         return v3_send_response_invalid(fd);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::FileSeekError> error;
 
     // Ahh, posix...
@@ -299,6 +408,236 @@ static bool v3_file_seek(int fd, const v3::Request *msg)
     return v3_send_response(fd, builder);
 }
 
+/*!
+ * \brief Send a raw data frame with sendfile()
+ *
+ * If the file ends before \p size bytes could be sent, the rest of the frame is
+ * padded with zeros to keep the stream in sync and \p error is set.
+ *
+ * \return False only if the socket could not be written to
+ */
+static bool stream_send_file_frame(int fd, int ffd, size_t size,
+                                   uint64_t *total, int *error)
+{
+    if (!util::socket_write_int32(fd, static_cast<int32_t>(size))) {
+        return false;
+    }
+
+    size_t remain = size;
+
+    while (remain > 0) {
+        ssize_t n = sendfile(fd, ffd, nullptr, remain);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            *error = n < 0 ? errno : EIO;
+            break;
+        }
+
+        remain -= n;
+        *total += n;
+    }
+
+    if (remain > 0) {
+        // The frame length was already sent. If the socket itself failed,
+        // this will fail too.
+        static const char zeros[4096] = {};
+
+        while (remain > 0) {
+            size_t n = std::min(remain, sizeof(zeros));
+            if (util::socket_write(fd, zeros, n) != static_cast<ssize_t>(n)) {
+                return false;
+            }
+            remain -= n;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Send a file's contents as raw data frames
+ *
+ * Seekable files are sent with sendfile() so that the data does not pass
+ * through userspace. Other files are read into a buffer first. Flow control is
+ * provided by the blocking socket.
+ *
+ * \return False only if the socket could not be written to
+ */
+static bool stream_file(int fd, int ffd, uint64_t max_bytes, size_t chunk_size,
+                        uint64_t *total, int *error)
+{
+    // sendfile() needs the frame size up front, so it is only used if the
+    // amount of remaining data is known
+    off_t pos = lseek(ffd, 0, SEEK_CUR);
+    off_t end = pos >= 0 ? lseek(ffd, 0, SEEK_END) : -1;
+
+    if (end >= 0) {
+        if (lseek(ffd, pos, SEEK_SET) < 0) {
+            *error = errno;
+            return true;
+        }
+
+        uint64_t remain = end > pos ? end - pos : 0;
+        if (max_bytes > 0) {
+            remain = std::min(remain, max_bytes);
+        }
+
+        while (remain > 0 && *error == 0) {
+            size_t n = std::min<uint64_t>(remain, chunk_size);
+            if (!stream_send_file_frame(fd, ffd, n, total, error)) {
+                return false;
+            }
+            remain -= n;
+        }
+
+        return true;
+    }
+
+    std::vector<uint8_t> buf(chunk_size);
+
+    while (max_bytes == 0 || *total < max_bytes) {
+        size_t to_read = chunk_size;
+        if (max_bytes > 0) {
+            to_read = std::min<uint64_t>(to_read, max_bytes - *total);
+        }
+
+        ssize_t n = read(ffd, buf.data(), to_read);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            *error = errno;
+            break;
+        } else if (n == 0) {
+            break;
+        }
+
+        if (!v3_socket->write_frame(buf.data(), n)) {
+            return false;
+        }
+        *total += n;
+    }
+
+    return true;
+}
+
+static bool v3_file_stream_read(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::FileStreamReadRequest *>(
+            msg->request());
+    auto it = fd_map.find(request->id());
+    if (it == fd_map.end()) {
+        return v3_send_response_invalid(fd);
+    }
+
+    int ffd = it->second;
+    size_t chunk_size = STREAM_DEFAULT_CHUNK_SIZE;
+    if (request->chunk_size() > 0) {
+        chunk_size = std::min<size_t>(request->chunk_size(),
+                                      STREAM_MAX_CHUNK_SIZE);
+    }
+
+    // The raw frames are written directly to the socket, so the queued
+    // responses must be sent first
+    if (!v3_socket->flush()) {
+        return false;
+    }
+
+    uint64_t total = 0;
+    int saved_errno = 0;
+
+    if (!stream_file(fd, ffd, request->max_bytes(), chunk_size,
+                     &total, &saved_errno)) {
+        return false;
+    }
+
+    // Empty frame marks the end of the data
+    if (!v3_socket->write_frame(nullptr, 0)) {
+        return false;
+    }
+
+    fb::FlatBufferBuilder &builder = v3_builder();
+    fb::Offset<v3::FileStreamReadError> error;
+
+    if (saved_errno != 0) {
+        error = v3::CreateFileStreamReadErrorDirect(
+                builder, saved_errno, strerror(saved_errno));
+    }
+
+    auto response = v3::CreateFileStreamReadResponse(
+            builder, saved_errno == 0, total, error);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_FileStreamReadResponse,
+            response.Union()));
+
+    return v3_send_response(fd, builder);
+}
+
+static bool v3_file_stream_write(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::FileStreamWriteRequest *>(
+            msg->request());
+    auto it = fd_map.find(request->id());
+
+    // The client sends the data without waiting for a reply, so the frames
+    // must be consumed even if the request is invalid. Note that reading the
+    // frames invalidates msg.
+    int ffd = it == fd_map.end() ? -1 : it->second;
+    uint64_t total = 0;
+    int saved_errno = 0;
+
+    while (true) {
+        const uint8_t *data;
+        size_t size;
+
+        if (!v3_socket->read_frame(&data, &size)) {
+            return false;
+        } else if (size == 0) {
+            break;
+        } else if (ffd < 0 || saved_errno != 0) {
+            continue;
+        }
+
+        while (size > 0) {
+            ssize_t n = write(ffd, data, size);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n <= 0) {
+                saved_errno = n < 0 ? errno : EIO;
+                break;
+            }
+
+            data += n;
+            size -= n;
+            total += n;
+        }
+    }
+
+    if (ffd < 0) {
+        return v3_send_response_invalid(fd);
+    }
+
+    fb::FlatBufferBuilder &builder = v3_builder();
+    fb::Offset<v3::FileStreamWriteError> error;
+
+    if (saved_errno != 0) {
+        error = v3::CreateFileStreamWriteErrorDirect(
+                builder, saved_errno, strerror(saved_errno));
+    }
+
+    auto response = v3::CreateFileStreamWriteResponse(
+            builder, saved_errno == 0, total, error);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_FileStreamWriteResponse,
+            response.Union()));
+
+    return v3_send_response(fd, builder);
+}
+
 static bool v3_file_selinux_get_label(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileSELinuxGetLabelRequest *>(
@@ -310,7 +649,7 @@ static bool v3_file_selinux_get_label(int fd, const v3::Request *msg)
 
     int ffd = it->second;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::FileSELinuxGetLabelError> error;
     std::string label;
 
@@ -345,7 +684,7 @@ static bool v3_file_selinux_set_label(int fd, const v3::Request *msg)
 
     int ffd = it->second;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::FileSELinuxSetLabelError> error;
 
     bool ret = util::selinux_fset_context(ffd, request->label()->c_str());
@@ -367,6 +706,26 @@ static bool v3_file_selinux_set_label(int fd, const v3::Request *msg)
     return v3_send_response(fd, builder);
 }
 
+static fb::Offset<v3::StructStat>
+v3_create_struct_stat(fb::FlatBufferBuilder &builder, const struct stat &sb)
+{
+    v3::StructStatBuilder ssb(builder);
+    ssb.add_dev(sb.st_dev);
+    ssb.add_ino(sb.st_ino);
+    ssb.add_mode(sb.st_mode);
+    ssb.add_nlink(sb.st_nlink);
+    ssb.add_uid(sb.st_uid);
+    ssb.add_gid(sb.st_gid);
+    ssb.add_rdev(sb.st_rdev);
+    ssb.add_size(sb.st_size);
+    ssb.add_blksize(sb.st_blksize);
+    ssb.add_blocks(sb.st_blocks);
+    ssb.add_atime(sb.st_atime);
+    ssb.add_mtime(sb.st_mtime);
+    ssb.add_ctime(sb.st_ctime);
+    return ssb.Finish();
+}
+
 static bool v3_file_stat(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileStatRequest *>(msg->request());
@@ -377,7 +736,7 @@ static bool v3_file_stat(int fd, const v3::Request *msg)
 
     int ffd = it->second;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::FileStatError> error;
     fb::Offset<v3::StructStat> statbuf;
     struct stat sb;
@@ -386,21 +745,7 @@ static bool v3_file_stat(int fd, const v3::Request *msg)
     int saved_errno = errno;
 
     if (ret) {
-        v3::StructStatBuilder ssb(builder);
-        ssb.add_dev(sb.st_dev);
-        ssb.add_ino(sb.st_ino);
-        ssb.add_mode(sb.st_mode);
-        ssb.add_nlink(sb.st_nlink);
-        ssb.add_uid(sb.st_uid);
-        ssb.add_gid(sb.st_gid);
-        ssb.add_rdev(sb.st_rdev);
-        ssb.add_size(sb.st_size);
-        ssb.add_blksize(sb.st_blksize);
-        ssb.add_blocks(sb.st_blocks);
-        ssb.add_atime(sb.st_atime);
-        ssb.add_mtime(sb.st_mtime);
-        ssb.add_ctime(sb.st_ctime);
-        statbuf = ssb.Finish();
+        statbuf = v3_create_struct_stat(builder, sb);
     } else {
         error = v3::CreateFileStatErrorDirect(
                 builder, saved_errno, strerror(saved_errno));
@@ -427,7 +772,7 @@ static bool v3_file_write(int fd, const v3::Request *msg)
 
     int ffd = it->second;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::FileWriteError> error;
 
     ssize_t ret = write(ffd, request->data()->Data(), request->data()->size());
@@ -463,7 +808,7 @@ static bool v3_path_chmod(int fd, const v3::Request *msg)
         return v3_send_response_invalid(fd);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::PathChmodError> error;
 
     bool ret = chmod(request->path()->c_str(), mode) == 0;
@@ -491,7 +836,7 @@ static bool v3_path_copy(int fd, const v3::Request *msg)
         return v3_send_response_invalid(fd);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::PathCopyError> error;
 
     bool ret = util::copy_contents(
@@ -544,7 +889,7 @@ static bool v3_path_delete(int fd, const v3::Request *msg)
         return v3_send_response_invalid(fd);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::PathDeleteError> error;
 
     if (!ret) {
@@ -576,7 +921,7 @@ static bool v3_path_mkdir(int fd, const v3::Request *msg)
         return v3_send_response_invalid(fd);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::PathMkdirError> error;
 
     bool ret;
@@ -613,7 +958,7 @@ static bool v3_path_readlink(int fd, const v3::Request *msg)
     bool ret = util::read_link(request->path()->c_str(), &target);
     int saved_errno = errno;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::PathReadlinkError> error;
 
     if (!ret) {
@@ -631,6 +976,159 @@ static bool v3_path_readlink(int fd, const v3::Request *msg)
     return v3_send_response(fd, builder);
 }
 
+// Not exposed by bionic or glibc (before 2.30)
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+/*!
+ * \brief Read directory entries into \p entries
+ *
+ * Entries are read with large getdents64() batches and everything else is
+ * looked up relative to the directory fd, except for the SELinux label since
+ * there is no lgetxattrat().
+ *
+ * \param[in,out] cookie Directory offset to start from. On return, the offset
+ *                       of the entry after the last one added to \p entries.
+ *
+ * \return 0 on success or the errno value on failure
+ */
+typedef std::vector<fb::Offset<v3::PathListDirectoryEntry>> DirectoryEntries;
+
+static int v3_list_directory(fb::FlatBufferBuilder &builder, int dfd,
+                             const v3::PathListDirectoryRequest *request,
+                             DirectoryEntries &entries, bool *more,
+                             uint64_t *cookie)
+{
+    static char dent_buf[LIST_DIRECTORY_BUF_SIZE];
+    char link_buf[PATH_MAX];
+
+    uint32_t max_entries = request->max_entries();
+    std::string entry_path(request->path()->c_str());
+    if (entry_path.empty() || entry_path.back() != '/') {
+        entry_path += '/';
+    }
+    size_t dir_len = entry_path.size();
+
+    *more = false;
+
+    if (*cookie != 0 && lseek64(dfd, static_cast<off64_t>(*cookie),
+                                SEEK_SET) < 0) {
+        return errno;
+    }
+
+    while (true) {
+        long n = syscall(SYS_getdents64, dfd, dent_buf, sizeof(dent_buf));
+        if (n < 0) {
+            return errno;
+        } else if (n == 0) {
+            return 0;
+        }
+
+        for (long offset = 0; offset < n;) {
+            auto dent = reinterpret_cast<linux_dirent64 *>(dent_buf + offset);
+            offset += dent->d_reclen;
+
+            const char *name = dent->d_name;
+            if (name[0] == '.' && (name[1] == '\0'
+                    || (name[1] == '.' && name[2] == '\0'))) {
+                *cookie = static_cast<uint64_t>(dent->d_off);
+                continue;
+            }
+
+            // This entry starts the next page
+            if (max_entries != 0 && entries.size() == max_entries) {
+                *more = true;
+                return 0;
+            }
+
+            *cookie = static_cast<uint64_t>(dent->d_off);
+
+            unsigned int type = dent->d_type;
+            fb::Offset<v3::StructStat> statbuf;
+            const char *target = nullptr;
+            const char *label = nullptr;
+            std::string label_buf;
+            struct stat sb;
+
+            if (request->stat()
+                    && fstatat(dfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+                statbuf = v3_create_struct_stat(builder, sb);
+                if (type == DT_UNKNOWN) {
+                    type = IFTODT(sb.st_mode);
+                }
+            }
+
+            if (request->symlink_target() && type == DT_LNK) {
+                ssize_t len = readlinkat(dfd, name, link_buf, sizeof(link_buf));
+                if (len >= 0 && static_cast<size_t>(len) < sizeof(link_buf)) {
+                    link_buf[len] = '\0';
+                    target = link_buf;
+                }
+            }
+
+            if (request->selinux_label()) {
+                entry_path.resize(dir_len);
+                entry_path += name;
+                if (util::selinux_lget_context(entry_path, &label_buf)) {
+                    label = label_buf.c_str();
+                }
+            }
+
+            entries.push_back(v3::CreatePathListDirectoryEntryDirect(
+                    builder, name, type, statbuf, target, label));
+        }
+    }
+}
+
+static bool v3_path_list_directory(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::PathListDirectoryRequest *>(
+            msg->request());
+    if (!request->path()) {
+        return v3_send_response_invalid(fd);
+    }
+
+    fb::FlatBufferBuilder &builder = v3_builder();
+    fb::Offset<v3::PathListDirectoryError> error;
+    DirectoryEntries entries;
+    bool more = false;
+    uint64_t cookie = request->cookie();
+    int saved_errno;
+
+    int dfd = open(request->path()->c_str(),
+                   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        saved_errno = errno;
+    } else {
+        saved_errno = v3_list_directory(builder, dfd, request, entries,
+                                        &more, &cookie);
+        close(dfd);
+    }
+
+    if (saved_errno != 0) {
+        entries.clear();
+        more = false;
+        error = v3::CreatePathListDirectoryErrorDirect(
+                builder, saved_errno, strerror(saved_errno));
+    }
+
+    auto response = v3::CreatePathListDirectoryResponseDirect(
+            builder, &entries, more, more ? cookie : 0, error);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_PathListDirectoryResponse,
+            response.Union()));
+
+    return v3_send_response(fd, builder);
+}
+
 static bool v3_path_selinux_get_label(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathSELinuxGetLabelRequest *>(
@@ -648,7 +1146,7 @@ static bool v3_path_selinux_get_label(int fd, const v3::Request *msg)
     }
     int saved_errno = errno;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::PathSELinuxGetLabelError> error;
 
     if (!ret) {
@@ -686,7 +1184,7 @@ static bool v3_path_selinux_set_label(int fd, const v3::Request *msg)
     }
     int saved_errno = errno;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::PathSELinuxSetLabelError> error;
 
     if (!ret) {
@@ -705,10 +1203,10 @@ static bool v3_path_selinux_set_label(int fd, const v3::Request *msg)
     return v3_send_response(fd, builder);
 }
 
-class DirectorySizeGetter : public util::FTSWrapper {
+class DirectorySizeGetter : public util::DirWalker {
 public:
     DirectorySizeGetter(std::string path, std::vector<std::string> exclusions)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        : DirWalker(path, 0),
         _exclusions(std::move(exclusions)),
         _total(0)
     {
@@ -717,31 +1215,31 @@ public:
     virtual int on_changed_path() override
     {
         // Exclude first-level directories
-        if (_curr->fts_level == 1) {
-            if (std::find(_exclusions.begin(), _exclusions.end(), _curr->fts_name)
+        if (_curr->level == 1) {
+            if (std::find(_exclusions.begin(), _exclusions.end(), _curr->name)
                     != _exclusions.end()) {
-                return Action::FTS_Skip;
+                return Action::DW_Skip;
             }
         }
 
-        return Action::FTS_OK;
+        return Action::DW_OK;
     }
 
     virtual int on_reached_file() override
     {
-        dev_t dev = _curr->fts_statp->st_dev;
-        ino_t ino = _curr->fts_statp->st_ino;
+        dev_t dev = _curr->sb.st_dev;
+        ino_t ino = _curr->sb.st_ino;
 
         // If this file has been visited before (hard link), then skip it
         if (_links.find(dev) != _links.end()
                 && _links[dev].find(ino) != _links[dev].end()) {
-            return Action::FTS_OK;
+            return Action::DW_OK;
         }
 
-        _total += _curr->fts_statp->st_size;
+        _total += _curr->sb.st_size;
         _links[dev].emplace(ino);
 
-        return Action::FTS_OK;
+        return Action::DW_OK;
     }
 
     uint64_t total() const {
@@ -769,11 +1267,22 @@ static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
         }
     }
 
-    DirectorySizeGetter dsg(request->path()->c_str(), std::move(exclusions));
-    bool ret = dsg.run();
-    int saved_errno = errno;
+    bool ret;
+    uint64_t total;
+    int saved_errno = 0;
 
-    fb::FlatBufferBuilder builder;
+    // Unchanged subtrees are answered by the cache process without a scan
+    if (dirsize_cache_get(request->path()->c_str(), exclusions, &total)) {
+        ret = true;
+    } else {
+        DirectorySizeGetter dsg(request->path()->c_str(),
+                                std::move(exclusions));
+        ret = dsg.run();
+        saved_errno = errno;
+        total = dsg.total();
+    }
+
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::PathGetDirectorySizeError> error;
 
     if (!ret) {
@@ -782,8 +1291,7 @@ static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
     }
 
     auto response = v3::CreatePathGetDirectorySizeResponseDirect(
-            builder, ret, ret ? nullptr : strerror(saved_errno), dsg.total(),
-            error);
+            builder, ret, ret ? nullptr : strerror(saved_errno), total, error);
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
@@ -800,7 +1308,7 @@ static void signed_exec_output_cb(const char *line, bool error, void *userdata)
     int *fd_ptr = (int *) userdata;
     // TODO: Send line
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<fb::String> line_id = builder.CreateString(line);
 
     // Create response
@@ -811,7 +1319,8 @@ static void signed_exec_output_cb(const char *line, bool error, void *userdata)
             builder, v3::ResponseType_SignedExecOutputResponse,
             response.Union()));
 
-    if (!v3_send_response(*fd_ptr, builder)) {
+    // Output is streamed to the client as it is produced
+    if (!v3_send_response(*fd_ptr, builder) || !v3_socket->flush()) {
         // Can't kill the connection from this callback (yet...)
         LOGE("Failed to send output line: %s", strerror(errno));
     }
@@ -832,6 +1341,7 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
     const char **argv;
     int status;
     SigVerifyResult sig_result;
+    unsigned char digest[SHA512_DIGEST_LENGTH];
     bool mounted_tmpfs = false;
     // Variables that are part of the response
     v3::SignedExecResult result = v3::SignedExecResult_OTHER_ERROR;
@@ -880,8 +1390,10 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
     }
     mounted_tmpfs = true;
 
-    // Copy binary to tmpfs
-    if (!util::copy_file(request->binary_path()->str(), target_binary, 0)) {
+    // Copy binary to tmpfs, hashing it along the way so that it does not need
+    // to be read again for the signature verification
+    if (!util::copy_and_hash(request->binary_path()->str(), target_binary,
+                             digest)) {
         result = v3::SignedExecResult_OTHER_ERROR;
         mb::format(error_msg, "%s: Failed to copy binary to tmpfs: %s",
                    request->binary_path()->c_str(), strerror(errno));
@@ -899,7 +1411,7 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
     }
 
     // Verify signature
-    sig_result = verify_signature(target_binary.c_str(), target_sig.c_str());
+    sig_result = verify_signature_digest(digest, target_sig.c_str());
     if (sig_result != SigVerifyResult::VALID) {
         if (sig_result == SigVerifyResult::INVALID) {
             result = v3::SignedExecResult_INVALID_SIGNATURE;
@@ -974,8 +1486,11 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
         LOGE("%s", error_msg.c_str());
     }
 
+    // Signed binaries are used to install and modify ROMs
+    rom_inventory_invalidate();
+
 done:
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<fb::String> error_msg_id = 0;
     fb::Offset<v3::SignedExecError> error;
 
@@ -1000,11 +1515,11 @@ static bool v3_mb_get_booted_rom_id(int fd, const v3::Request *msg)
 {
     (void) msg;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<fb::String> id;
-    auto rom = Roms::get_current_rom();
-    if (rom) {
-        id = builder.CreateString(rom->id);
+    std::string rom_id;
+    if (get_booted_rom_id(&rom_id)) {
+        id = builder.CreateString(rom_id);
     }
 
     // Create response
@@ -1022,44 +1537,26 @@ static bool v3_mb_get_installed_roms(int fd, const v3::Request *msg)
 {
     (void) msg;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
 
-    Roms roms;
-    roms.add_installed();
+    std::vector<InstalledRom> roms;
+    rom_inventory_get(&roms);
 
     std::vector<fb::Offset<v3::MbRom>> fb_roms;
 
-    for (auto r : roms.roms) {
-        std::string system_path = r->full_system_path();
-        std::string cache_path = r->full_cache_path();
-        std::string data_path = r->full_data_path();
-
-        auto fb_id = builder.CreateString(r->id);
-        auto fb_system_path = builder.CreateString(system_path);
-        auto fb_cache_path = builder.CreateString(cache_path);
-        auto fb_data_path = builder.CreateString(data_path);
+    for (auto const &r : roms) {
+        auto fb_id = builder.CreateString(r.id);
+        auto fb_system_path = builder.CreateString(r.system_path);
+        auto fb_cache_path = builder.CreateString(r.cache_path);
+        auto fb_data_path = builder.CreateString(r.data_path);
         fb::Offset<fb::String> fb_version;
         fb::Offset<fb::String> fb_build;
 
-        std::string build_prop;
-        if (r->system_is_image) {
-            build_prop += "/raw/images/";
-            build_prop += r->id;
-        } else {
-            build_prop += system_path;
-        }
-        build_prop += "/build.prop";
-
-        std::unordered_map<std::string, std::string> properties;
-        util::property_file_get_all(build_prop, properties);
-
-        if (properties.find("ro.build.version.release") != properties.end()) {
-            const std::string &version = properties["ro.build.version.release"];
-            fb_version = builder.CreateString(version);
+        if (r.has_version) {
+            fb_version = builder.CreateString(r.version);
         }
-        if (properties.find("ro.build.display.id") != properties.end()) {
-            const std::string &build = properties["ro.build.display.id"];
-            fb_build = builder.CreateString(build);
+        if (r.has_build) {
+            fb_build = builder.CreateString(r.build);
         }
 
         v3::MbRomBuilder mrb(builder);
@@ -1090,7 +1587,7 @@ static bool v3_mb_get_version(int fd, const v3::Request *msg)
 {
     (void) msg;
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
 
     // Get version
     auto response = v3::CreateMbGetVersionResponseDirect(
@@ -1103,6 +1600,53 @@ static bool v3_mb_get_version(int fd, const v3::Request *msg)
     return v3_send_response(fd, builder);
 }
 
+static bool v3_mb_get_daemon_stats(int fd, const v3::Request *msg)
+{
+    (void) msg;
+
+    fb::FlatBufferBuilder &builder = v3_builder();
+    std::vector<fb::Offset<v3::MbRequestStats>> stats;
+
+    if (request_stats) {
+        for (int type = v3::RequestType_MIN + 1; type <= v3::RequestType_MAX;
+                ++type) {
+            const RequestStats &rs = request_stats[type];
+
+            uint64_t count = rs.count.load(std::memory_order_relaxed);
+            if (count == 0) {
+                continue;
+            }
+
+            stats.push_back(v3::CreateMbRequestStatsDirect(
+                    builder,
+                    v3::EnumNameRequestType(static_cast<v3::RequestType>(type)),
+                    count,
+                    rs.errors.load(std::memory_order_relaxed),
+                    rs.total_time_ns.load(std::memory_order_relaxed)));
+        }
+    }
+
+    std::vector<fb::Offset<v3::MbCounter>> counters;
+
+    for (size_t i = 0; i < util::COUNTER_COUNT; ++i) {
+        auto counter = static_cast<util::Counter>(i);
+        counters.push_back(v3::CreateMbCounterDirect(
+                builder, util::counter_name(counter),
+                util::counter_get(counter)));
+    }
+
+    // Create response
+    auto response = v3::CreateMbGetDaemonStatsResponseDirect(
+            builder, &stats, &counters);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_MbGetDaemonStatsResponse,
+            response.Union()));
+
+    return v3_send_response(fd, builder);
+}
+
 static bool v3_mb_set_kernel(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::MbSetKernelRequest *>(msg->request());
@@ -1110,7 +1654,7 @@ static bool v3_mb_set_kernel(int fd, const v3::Request *msg)
         return v3_send_response_invalid(fd);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::MbSetKernelError> error;
 
     bool ret = set_kernel(request->rom_id()->str(),
@@ -1147,7 +1691,7 @@ static bool v3_mb_switch_rom(int fd, const v3::Request *msg)
 
     bool force_update_checksums = request->force_update_checksums();
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::MbSwitchRomError> error;
 
     SwitchRomResult ret = switch_rom(request->rom_id()->str(),
@@ -1206,8 +1750,8 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
     }
 
     // The GUI should check this, but we'll enforce it here
-    auto current_rom = Roms::get_current_rom();
-    if (current_rom && current_rom->id == rom->id) {
+    std::string current_rom_id;
+    if (get_booted_rom_id(&current_rom_id) && current_rom_id == rom->id) {
         LOGE("Cannot wipe currently booted ROM: %s", rom->id.c_str());
         return v3_send_response_invalid(fd);
     }
@@ -1223,32 +1767,42 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
                  raw_system.c_str(), strerror(errno));
         }
 
-        for (short target : *request->targets()) {
-            bool success = false;
+        std::vector<int16_t> requested;
+        std::vector<WipeTarget> targets;
 
+        for (short target : *request->targets()) {
             if (target == v3::MbWipeTarget_SYSTEM) {
-                success = wipe_system(rom);
+                targets.push_back(WipeTarget::System);
             } else if (target == v3::MbWipeTarget_CACHE) {
-                success = wipe_cache(rom);
+                targets.push_back(WipeTarget::Cache);
             } else if (target == v3::MbWipeTarget_DATA) {
-                success = wipe_data(rom);
+                targets.push_back(WipeTarget::Data);
             } else if (target == v3::MbWipeTarget_DALVIK_CACHE) {
-                success = wipe_dalvik_cache(rom);
+                targets.push_back(WipeTarget::DalvikCache);
             } else if (target == v3::MbWipeTarget_MULTIBOOT) {
-                success = wipe_multiboot(rom);
+                targets.push_back(WipeTarget::Multiboot);
             } else {
                 LOGE("Unknown wipe target %d", target);
+                failed.push_back(target);
+                continue;
             }
+            requested.push_back(target);
+        }
 
-            if (success) {
-                succeeded.push_back(target);
+        // Independent targets are wiped concurrently
+        std::vector<bool> results = wipe_targets(rom, targets);
+        for (size_t i = 0; i < requested.size(); ++i) {
+            if (results[i]) {
+                succeeded.push_back(requested[i]);
             } else {
-                failed.push_back(target);
+                failed.push_back(requested[i]);
             }
         }
+
+        rom_inventory_invalidate();
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
 
     // Create response
     auto response = v3::CreateMbWipeRomResponseDirect(
@@ -1281,7 +1835,7 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
     std::string packages_xml(rom->full_data_path());
     packages_xml += "/system/packages.xml";
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::MbGetPackagesCountError> error;
     unsigned int system_pkgs = 0;
     unsigned int update_pkgs = 0;
@@ -1324,7 +1878,7 @@ static bool v3_reboot(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::RebootRequest *>(msg->request());
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::RebootError> error;
 
     std::string reboot_arg;
@@ -1368,7 +1922,7 @@ static bool v3_shutdown(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::ShutdownRequest *>(msg->request());
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = v3_builder();
     fb::Offset<v3::ShutdownError> error;
 
     // The client probably won't get the chance to see the success message, but
@@ -1400,6 +1954,281 @@ static bool v3_shutdown(int fd, const v3::Request *msg)
     return v3_send_response(fd, builder);
 }
 
+static v3::JobState to_v3_job_state(JobState state)
+{
+    switch (state) {
+    case JobState::Queued:
+        return v3::JobState_QUEUED;
+    case JobState::Running:
+        return v3::JobState_RUNNING;
+    case JobState::Finished:
+        return v3::JobState_FINISHED;
+    case JobState::Failed:
+        return v3::JobState_FAILED;
+    case JobState::Cancelled:
+    default:
+        return v3::JobState_CANCELLED;
+    }
+}
+
+static bool is_job_done(JobState state)
+{
+    return state == JobState::Finished
+            || state == JobState::Failed
+            || state == JobState::Cancelled;
+}
+
+static fb::Offset<v3::JobProgress> create_job_progress(
+        fb::FlatBufferBuilder &builder, const JobInfo &info)
+{
+    return v3::CreateJobProgressDirect(
+            builder, to_v3_job_state(info.state), info.stage.c_str(),
+            info.bytes_done, info.bytes_total,
+            info.files_done, info.files_total);
+}
+
+static bool v3_job_start(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::JobStartRequest *>(msg->request());
+    if (!request->request()) {
+        return v3_send_response_invalid(fd);
+    }
+
+    const uint8_t *data = request->request()->data();
+    size_t size = request->request()->size();
+
+    auto verifier = fb::Verifier(data, size);
+    if (!v3::VerifyRequestBuffer(verifier)) {
+        return v3_send_response_invalid(fd);
+    }
+
+    fb::FlatBufferBuilder &builder = v3_builder();
+    fb::Offset<v3::JobError> error;
+    uint64_t id = 0;
+    bool ret = false;
+
+    // Only requests that send a single response (apart from SignedExec's
+    // output lines) can be run as jobs
+    switch (v3::GetRequest(data)->request_type()) {
+    case v3::RequestType_MbWipeRomRequest:
+    case v3::RequestType_PathCopyRequest:
+    case v3::RequestType_SignedExecRequest:
+        ret = job_manager_submit(data, size, &id);
+        if (!ret) {
+            error = v3::CreateJobErrorDirect(
+                    builder, "Job manager is unavailable");
+        }
+        break;
+    default:
+        error = v3::CreateJobErrorDirect(
+                builder, "Request cannot be run as a job");
+        break;
+    }
+
+    // Create response
+    auto response = v3::CreateJobStartResponse(builder, ret, id, error);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_JobStartResponse, response.Union()));
+
+    return v3_send_response(fd, builder);
+}
+
+static bool v3_job_status(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::JobStatusRequest *>(msg->request());
+
+    fb::FlatBufferBuilder &builder = v3_builder();
+    fb::Offset<v3::JobProgress> progress;
+    fb::Offset<fb::Vector<uint8_t>> response_data;
+    fb::Offset<v3::JobError> error;
+    JobInfo info;
+    bool found = false;
+
+    bool ret = job_manager_status(request->id(), &found, &info);
+    if (!ret) {
+        error = v3::CreateJobErrorDirect(builder, "Job manager is unavailable");
+    } else if (!found) {
+        error = v3::CreateJobErrorDirect(builder, "Job not found");
+    } else {
+        progress = create_job_progress(builder, info);
+        if (!info.response.empty()) {
+            response_data = builder.CreateVector(info.response);
+        }
+    }
+
+    // Create response
+    auto response = v3::CreateJobStatusResponse(
+            builder, ret && found, progress, response_data, error);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_JobStatusResponse, response.Union()));
+
+    return v3_send_response(fd, builder);
+}
+
+static bool v3_job_subscribe(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::JobSubscribeRequest *>(
+            msg->request());
+
+    JobInfo info;
+    bool found = false;
+    bool ret;
+    // Never matches, so that the first wait returns the current progress
+    uint64_t seq = UINT64_MAX;
+    uint64_t output_seq = 0;
+
+    while ((ret = job_manager_wait(request->id(), seq, output_seq,
+                                   &found, &info)) && found) {
+        seq = info.seq;
+        output_seq = info.output_seq;
+
+        if (is_job_done(info.state) && info.output_lines.empty()) {
+            break;
+        }
+
+        fb::FlatBufferBuilder &builder = v3_builder();
+        std::vector<fb::Offset<fb::String>> lines;
+        lines.reserve(info.output_lines.size());
+        for (auto const &line : info.output_lines) {
+            lines.push_back(builder.CreateString(line));
+        }
+
+        auto progress = create_job_progress(builder, info);
+
+        // Create event
+        auto event = v3::CreateJobEventResponseDirect(
+                builder, progress, &lines);
+
+        // Wrap event
+        builder.Finish(v3::CreateResponse(
+                builder, v3::ResponseType_JobEventResponse, event.Union()));
+
+        // Events are streamed to the client as they happen
+        if (!v3_send_response(fd, builder) || !v3_socket->flush()) {
+            return false;
+        }
+
+        if (is_job_done(info.state)) {
+            break;
+        }
+    }
+
+    fb::FlatBufferBuilder &builder = v3_builder();
+    fb::Offset<v3::JobProgress> progress;
+    fb::Offset<fb::Vector<uint8_t>> response_data;
+    fb::Offset<v3::JobError> error;
+
+    if (!ret) {
+        error = v3::CreateJobErrorDirect(builder, "Job manager is unavailable");
+    } else if (!found) {
+        error = v3::CreateJobErrorDirect(builder, "Job not found");
+    } else {
+        progress = create_job_progress(builder, info);
+        if (!info.response.empty()) {
+            response_data = builder.CreateVector(info.response);
+        }
+    }
+
+    // Create response
+    auto response = v3::CreateJobSubscribeResponse(
+            builder, ret && found, progress, response_data, error);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_JobSubscribeResponse, response.Union()));
+
+    return v3_send_response(fd, builder);
+}
+
+static bool v3_job_cancel(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::JobCancelRequest *>(msg->request());
+
+    fb::FlatBufferBuilder &builder = v3_builder();
+    fb::Offset<v3::JobError> error;
+    bool found = false;
+
+    bool ret = job_manager_cancel(request->id(), &found);
+    if (!ret) {
+        error = v3::CreateJobErrorDirect(builder, "Job manager is unavailable");
+    } else if (!found) {
+        error = v3::CreateJobErrorDirect(builder, "Job not found");
+    }
+
+    // Create response
+    auto response = v3::CreateJobCancelResponse(
+            builder, ret && found, error);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_JobCancelResponse, response.Union()));
+
+    return v3_send_response(fd, builder);
+}
+
+static bool v3_handle_request(int fd, const v3::Request *request);
+
+static bool v3_batch(int fd, const v3::Request *msg)
+{
+    auto request = static_cast<const v3::BatchRequest *>(msg->request());
+    if (!request->requests() || batch_responses) {
+        return v3_send_response_invalid(fd);
+    }
+
+    BatchResponses responses;
+    responses.spans.reserve(request->requests()->size());
+
+    batch_responses = &responses;
+    auto end_batch = util::finally([&]{
+        batch_responses = nullptr;
+    });
+
+    for (const v3::Request *item : *request->requests()) {
+        bool ret;
+
+        // Nested batches are not allowed and streaming requests send data
+        // outside of the responses
+        if (item->request_type() == v3::RequestType_BatchRequest
+                || item->request_type() == v3::RequestType_SignedExecRequest
+                || item->request_type() == v3::RequestType_FileStreamReadRequest
+                || item->request_type() == v3::RequestType_FileStreamWriteRequest
+                || item->request_type() == v3::RequestType_JobSubscribeRequest) {
+            ret = v3_send_response_invalid(fd);
+        } else {
+            ret = v3_handle_request(fd, item);
+        }
+
+        if (!ret) {
+            return false;
+        }
+    }
+
+    batch_responses = nullptr;
+
+    fb::FlatBufferBuilder &builder = v3_builder();
+    std::vector<fb::Offset<v3::BatchResponseEntry>> entries;
+    entries.reserve(responses.spans.size());
+
+    for (auto const &span : responses.spans) {
+        auto data = builder.CreateVector(
+                responses.data.data() + span.first, span.second);
+        entries.push_back(v3::CreateBatchResponseEntry(builder, data));
+    }
+
+    // Create response
+    auto response = v3::CreateBatchResponseDirect(builder, &entries);
+
+    // Wrap response
+    builder.Finish(v3::CreateResponse(
+            builder, v3::ResponseType_BatchResponse, response.Union()));
+
+    return v3_send_response(fd, builder);
+}
+
 typedef bool (*request_handler_fn)(int, const v3::Request *);
 
 struct RequestMap
@@ -1408,37 +2237,192 @@ struct RequestMap
     request_handler_fn fn;
 };
 
-static RequestMap request_map[] = {
+// Indexed by request type. Unimplemented types have a null handler.
+static constexpr RequestMap request_map[] = {
+    { v3::RequestType_NONE, nullptr },
     { v3::RequestType_FileChmodRequest, v3_file_chmod },
     { v3::RequestType_FileCloseRequest, v3_file_close },
     { v3::RequestType_FileOpenRequest, v3_file_open },
     { v3::RequestType_FileReadRequest, v3_file_read },
     { v3::RequestType_FileSeekRequest, v3_file_seek },
-    { v3::RequestType_FileSELinuxGetLabelRequest, v3_file_selinux_get_label },
-    { v3::RequestType_FileSELinuxSetLabelRequest, v3_file_selinux_set_label },
     { v3::RequestType_FileStatRequest, v3_file_stat },
     { v3::RequestType_FileWriteRequest, v3_file_write },
+    { v3::RequestType_FileSELinuxGetLabelRequest, v3_file_selinux_get_label },
+    { v3::RequestType_FileSELinuxSetLabelRequest, v3_file_selinux_set_label },
     { v3::RequestType_PathChmodRequest, v3_path_chmod },
     { v3::RequestType_PathCopyRequest, v3_path_copy },
-    { v3::RequestType_PathDeleteRequest, v3_path_delete },
-    { v3::RequestType_PathMkdirRequest, v3_path_mkdir },
-    { v3::RequestType_PathReadlinkRequest, v3_path_readlink },
     { v3::RequestType_PathSELinuxGetLabelRequest, v3_path_selinux_get_label },
     { v3::RequestType_PathSELinuxSetLabelRequest, v3_path_selinux_set_label },
     { v3::RequestType_PathGetDirectorySizeRequest, v3_path_get_directory_size },
-    { v3::RequestType_SignedExecRequest, v3_signed_exec },
-    { v3::RequestType_MbGetBootedRomIdRequest, v3_mb_get_booted_rom_id },
-    { v3::RequestType_MbGetInstalledRomsRequest, v3_mb_get_installed_roms },
     { v3::RequestType_MbGetVersionRequest, v3_mb_get_version },
-    { v3::RequestType_MbSetKernelRequest, v3_mb_set_kernel },
+    { v3::RequestType_MbGetInstalledRomsRequest, v3_mb_get_installed_roms },
+    { v3::RequestType_MbGetBootedRomIdRequest, v3_mb_get_booted_rom_id },
     { v3::RequestType_MbSwitchRomRequest, v3_mb_switch_rom },
+    { v3::RequestType_MbSetKernelRequest, v3_mb_set_kernel },
     { v3::RequestType_MbWipeRomRequest, v3_mb_wipe_rom },
     { v3::RequestType_MbGetPackagesCountRequest, v3_mb_get_packages_count },
     { v3::RequestType_RebootRequest, v3_reboot },
+    { v3::RequestType_SignedExecRequest, v3_signed_exec },
     { v3::RequestType_ShutdownRequest, v3_shutdown },
-    { v3::RequestType_NONE, nullptr }
+    { v3::RequestType_PathDeleteRequest, v3_path_delete },
+    { v3::RequestType_PathMkdirRequest, v3_path_mkdir },
+    { v3::RequestType_CryptoDecryptRequest, nullptr },
+    { v3::RequestType_CryptoGetPwTypeRequest, nullptr },
+    { v3::RequestType_PathReadlinkRequest, v3_path_readlink },
+    { v3::RequestType_BatchRequest, v3_batch },
+    { v3::RequestType_MbGetDaemonStatsRequest, v3_mb_get_daemon_stats },
+    { v3::RequestType_FileStreamReadRequest, v3_file_stream_read },
+    { v3::RequestType_FileStreamWriteRequest, v3_file_stream_write },
+    { v3::RequestType_JobStartRequest, v3_job_start },
+    { v3::RequestType_JobStatusRequest, v3_job_status },
+    { v3::RequestType_JobSubscribeRequest, v3_job_subscribe },
+    { v3::RequestType_JobCancelRequest, v3_job_cancel },
+    { v3::RequestType_PathListDirectoryRequest, v3_path_list_directory },
 };
 
+static constexpr size_t request_map_size =
+        sizeof(request_map) / sizeof(request_map[0]);
+
+static constexpr bool request_map_is_dense(size_t i)
+{
+    return i == request_map_size
+            || (static_cast<size_t>(request_map[i].type) == i
+                && request_map_is_dense(i + 1));
+}
+
+static_assert(request_map_size == v3::RequestType_MAX + 1,
+              "request_map must have an entry for every request type");
+static_assert(request_map_is_dense(0),
+              "request_map must be ordered by request type");
+
+static void record_request_stats(v3::RequestType type, bool success,
+                                 uint64_t time_ns)
+{
+    util::counter_add(util::Counter::DaemonRequests);
+    util::counter_add(util::Counter::DaemonRequestTimeNs, time_ns);
+
+    if (!request_stats) {
+        return;
+    }
+
+    RequestStats &rs = request_stats[type];
+    rs.count.fetch_add(1, std::memory_order_relaxed);
+    if (!success) {
+        rs.errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    rs.total_time_ns.fetch_add(time_ns, std::memory_order_relaxed);
+}
+
+static JobClass request_job_class(v3::RequestType type)
+{
+    switch (type) {
+    case v3::RequestType_PathCopyRequest:
+    case v3::RequestType_PathGetDirectorySizeRequest:
+    case v3::RequestType_MbWipeRomRequest:
+    // Backups, restores, and installations run via SignedExec
+    case v3::RequestType_SignedExecRequest:
+        return JobClass::Background;
+    default:
+        return JobClass::Interactive;
+    }
+}
+
+static bool v3_run_handler(request_handler_fn fn, int fd,
+                           const v3::Request *request, uint64_t *elapsed)
+{
+    uint64_t start = util::monotonic_time_ns();
+    bool ret = fn(fd, request);
+    *elapsed = util::monotonic_time_ns() - start;
+    return ret;
+}
+
+static bool v3_handle_request(int fd, const v3::Request *request)
+{
+    v3::RequestType type = request->request_type();
+    request_handler_fn fn = nullptr;
+
+    if (type > v3::RequestType_MIN && type <= v3::RequestType_MAX) {
+        fn = request_map[type].fn;
+    }
+
+    if (!fn) {
+        // Invalid command; allow further commands
+        return v3_send_response_unsupported(fd);
+    }
+
+    // Batch sub-requests are tracked separately from the batch itself
+    bool outer_rejected = request_rejected;
+    request_rejected = false;
+
+    uint64_t elapsed;
+    bool ret;
+
+    // Each sub-request of a batch is scheduled according to its own type.
+    // Subscribing to a job mostly waits for the job itself, so it must not
+    // demote the job as an interactive request would. The scope lives on the
+    // stack so that handling a request does not allocate.
+    if (type != v3::RequestType_BatchRequest
+            && type != v3::RequestType_JobSubscribeRequest) {
+        JobScope job(request_job_class(type));
+        ret = v3_run_handler(fn, fd, request, &elapsed);
+    } else {
+        ret = v3_run_handler(fn, fd, request, &elapsed);
+    }
+
+    record_request_stats(type, ret && !request_rejected, elapsed);
+    request_rejected = outer_rejected;
+
+    return ret;
+}
+
+/*!
+ * \brief Set up the request statistics shared by all connections
+ */
+bool connection_version_3_init()
+{
+    // The statistics are updated by several processes through shared memory,
+    // which only works if the atomics do not need a lock. Without it, requests
+    // are handled as usual, but no statistics are reported.
+    std::atomic<uint64_t> probe(0);
+    if (!probe.is_lock_free()) {
+        LOGW("Not recording request statistics without lock-free atomics");
+        return true;
+    }
+
+    size_t size = sizeof(RequestStats) * (v3::RequestType_MAX + 1);
+
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        LOGE("Failed to map request statistics: %s", strerror(errno));
+        return false;
+    }
+
+    auto stats = static_cast<RequestStats *>(ptr);
+    for (int i = 0; i <= v3::RequestType_MAX; ++i) {
+        new (&stats[i]) RequestStats();
+    }
+
+    request_stats = stats;
+    return true;
+}
+
+/*!
+ * \brief Determine the data that stays the same for the daemon's lifetime
+ *
+ * If something cannot be determined yet (eg. because /system is not mounted),
+ * connection processes will simply try again.
+ */
+void connection_version_3_preload()
+{
+    std::string id;
+    if (get_booted_rom_id(&id)) {
+        LOGD("Booted ROM ID: %s", id.c_str());
+    } else {
+        LOGW("Booted ROM could not be determined yet");
+    }
+}
+
 bool connection_version_3(int fd)
 {
     std::string command;
@@ -1451,41 +2435,38 @@ bool connection_version_3(int fd)
         fd_map.clear();
     });
 
+    // Requests are read into a reusable buffer. The request data is only valid
+    // until the next read_frame() call, which is fine since each request is
+    // fully handled before the next one is read.
+    util::FramedSocket socket(fd);
+
+    v3_socket = &socket;
+    auto reset_socket = util::finally([&]{
+        v3_socket = nullptr;
+    });
+
     while (1) {
-        std::vector<uint8_t> data;
-        if (!util::socket_read_bytes(fd, &data)) {
+        // Clients may pipeline requests. Responses are only written once all
+        // of the already received requests are handled.
+        if (!socket.has_buffered_frame() && !socket.flush()) {
             return false;
         }
 
-        auto verifier = fb::Verifier(data.data(), data.size());
-        if (!v3::VerifyRequestBuffer(verifier)) {
-            LOGE("Received invalid buffer");
+        const uint8_t *data;
+        size_t size;
+        if (!socket.read_frame(&data, &size)) {
             return false;
         }
 
-        const v3::Request *request = v3::GetRequest(data.data());
-        v3::RequestType type = request->request_type();
-        request_handler_fn fn = nullptr;
-
-        for (auto iter = request_map; iter->fn; ++iter) {
-            if (type == iter->type) {
-                fn = iter->fn;
-                break;
-            }
+        auto verifier = fb::Verifier(data, size);
+        if (!v3::VerifyRequestBuffer(verifier)) {
+            LOGE("Received invalid buffer");
+            return false;
         }
 
         // NOTE: A false return value indicates a connection error, not a
         //       command failure!
-        bool ret = true;
-
-        if (fn) {
-            ret = fn(fd, request);
-        } else {
-            // Invalid command; allow further commands
-            ret = v3_send_response_unsupported(fd);
-        }
-
-        if (!ret) {
+        if (!v3_handle_request(fd, v3::GetRequest(data))) {
             return false;
         }
     }
@@ -1493,4 +2474,38 @@ bool connection_version_3(int fd)
     return true;
 }
 
+/*!
+ * rief Handle a single request in a job process
+ *
+ * The responses are sent to \p fd, which is connected to the job manager.
+ *
+ * \param fd Socket connected to the job manager
+ * \param data Serialized request (already verified by the submitter)
+ * \param size Size of \p data
+ */
+bool connection_version_3_run_job(int fd, const uint8_t *data, size_t size)
+{
+    auto close_all_fds = util::finally([&]{
+        for (auto &p : fd_map) {
+            close(p.second);
+        }
+        fd_map.clear();
+    });
+
+    util::FramedSocket socket(fd);
+
+    v3_socket = &socket;
+    auto reset_socket = util::finally([&]{
+        v3_socket = nullptr;
+    });
+
+    auto verifier = fb::Verifier(data, size);
+    if (!v3::VerifyRequestBuffer(verifier)) {
+        LOGE("Received invalid job request");
+        return false;
+    }
+
+    return v3_handle_request(fd, v3::GetRequest(data)) && socket.flush();
+}
+
 }
@@ -19,9 +19,15 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 namespace mb
 {
 
+bool connection_version_3_init();
+void connection_version_3_preload();
 bool connection_version_3(int fd);
+bool connection_version_3_run_job(int fd, const uint8_t *data, size_t size);
 
 }
\ No newline at end of file
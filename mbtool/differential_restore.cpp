@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "differential_restore.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <archive_entry.h>
+
+#include "mblog/logging.h"
+#include "mbutil/autoclose/dir.h"
+#include "mbutil/delete.h"
+
+#include "chunk_store.h"
+
+namespace mb
+{
+
+static bool remove_path(const std::string &path, const struct stat &sb)
+{
+    bool ret;
+
+    if (S_ISDIR(sb.st_mode)) {
+        ret = util::delete_recursive(path);
+    } else {
+        ret = unlink(path.c_str()) == 0 || errno == ENOENT;
+    }
+
+    if (!ret) {
+        LOGE("%s: Failed to delete: %s", path.c_str(), strerror(errno));
+    }
+    return ret;
+}
+
+/*!
+ * \param directory Directory that the archive is being extracted to
+ * \param store Chunk store for deduplicated backups or nullptr
+ * \param compare_hashes Whether to compare the contents of regular files in
+ *                       deduplicated backups against their chunk hashes
+ */
+DifferentialRestore::DifferentialRestore(std::string directory,
+                                         ChunkStore *store,
+                                         bool compare_hashes)
+    : _directory(std::move(directory))
+    , _store(store)
+    , _compare_hashes(compare_hashes)
+    , _unchanged(0)
+    , _rewritten(0)
+    , _deleted(0)
+{
+    while (_directory.size() > 1 && _directory.back() == '/') {
+        _directory.pop_back();
+    }
+}
+
+bool DifferentialRestore::include(archive_entry *entry)
+{
+    std::string path(archive_entry_pathname(entry));
+    while (path.size() > 1 && path.back() == '/') {
+        path.pop_back();
+    }
+
+    _expected.insert(path);
+
+    struct stat sb;
+    if (lstat(path.c_str(), &sb) < 0) {
+        if (errno != ENOENT) {
+            LOGW("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        }
+        ++_rewritten;
+        return true;
+    }
+
+    // Directories are always extracted to update their metadata. This is
+    // cheap and never touches their contents.
+    if (S_ISDIR(sb.st_mode) && !archive_entry_hardlink(entry)
+            && archive_entry_filetype(entry) == AE_IFDIR) {
+        return true;
+    }
+
+    if (is_unchanged(entry, path, sb)) {
+        ++_unchanged;
+        return false;
+    }
+
+    ++_rewritten;
+
+    // Also needed if the file type changed, since extracting does not replace
+    // directories
+    remove_path(path, sb);
+    return true;
+}
+
+bool DifferentialRestore::is_unchanged(archive_entry *entry,
+                                       const std::string &path,
+                                       const struct stat &sb)
+{
+    const char *hardlink = archive_entry_hardlink(entry);
+    if (hardlink) {
+        struct stat target_sb;
+        return lstat(hardlink, &target_sb) == 0
+                && target_sb.st_dev == sb.st_dev
+                && target_sb.st_ino == sb.st_ino;
+    }
+
+    if ((sb.st_mode & S_IFMT) != archive_entry_filetype(entry)
+            || (sb.st_mode & 07777) != archive_entry_perm(entry)
+            || sb.st_uid != static_cast<uid_t>(archive_entry_uid(entry))
+            || sb.st_gid != static_cast<gid_t>(archive_entry_gid(entry))) {
+        return false;
+    }
+
+    switch (archive_entry_filetype(entry)) {
+    case AE_IFREG: {
+        uint64_t size = static_cast<uint64_t>(archive_entry_size(entry));
+        bool stored = _store && _store->stored_size(entry, &size);
+
+        if (static_cast<uint64_t>(sb.st_size) != size
+                || sb.st_mtim.tv_sec != archive_entry_mtime(entry)
+                || sb.st_mtim.tv_nsec != archive_entry_mtime_nsec(entry)) {
+            return false;
+        }
+
+        return !stored || !_compare_hashes || _store->matches(entry, path);
+    }
+    case AE_IFLNK: {
+        const char *target = archive_entry_symlink(entry);
+        std::vector<char> buf(static_cast<size_t>(sb.st_size) + 1);
+        ssize_t n = readlink(path.c_str(), buf.data(), buf.size());
+
+        return target && n == sb.st_size
+                && strncmp(buf.data(), target, static_cast<size_t>(n)) == 0
+                && target[n] == '\0';
+    }
+    case AE_IFCHR:
+    case AE_IFBLK:
+        return sb.st_rdev == archive_entry_rdev(entry);
+    case AE_IFIFO:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*!
+ * \brief Stop expecting a path and its children to exist
+ *
+ * \param path Path relative to the directory, eg. from a deletion list
+ */
+void DifferentialRestore::forget(const std::string &path)
+{
+    std::string full_path(_directory);
+    full_path += '/';
+    full_path += path;
+
+    std::string prefix(full_path);
+    prefix += '/';
+
+    _expected.erase(full_path);
+
+    auto it = _expected.lower_bound(prefix);
+    while (it != _expected.end() && it->compare(0, prefix.size(), prefix) == 0) {
+        it = _expected.erase(it);
+    }
+}
+
+/*!
+ * \brief Delete files that are not in the backup
+ *
+ * \param exclusions List of top-level directories to keep
+ */
+bool DifferentialRestore::delete_extras(
+        const std::vector<std::string> &exclusions)
+{
+    return delete_extras_in(_directory, exclusions);
+}
+
+bool DifferentialRestore::delete_extras_in(
+        const std::string &dir, const std::vector<std::string> &exclusions)
+{
+    autoclose::dir dp(autoclose::opendir(dir.c_str()));
+    if (!dp) {
+        LOGE("%s: Failed to open directory: %s", dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    dirent *ent;
+
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0
+                || std::find(exclusions.begin(), exclusions.end(), ent->d_name)
+                        != exclusions.end()) {
+            continue;
+        }
+
+        std::string path(dir);
+        path += '/';
+        path += ent->d_name;
+
+        struct stat sb;
+        if (lstat(path.c_str(), &sb) < 0) {
+            LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (_expected.find(path) == _expected.end()) {
+            LOGV("%s: Deleting", path.c_str());
+            if (!remove_path(path, sb)) {
+                return false;
+            }
+            ++_deleted;
+        } else if (S_ISDIR(sb.st_mode)) {
+            if (!delete_extras_in(path, {})) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Number of entries that already matched the backup
+ */
+uint64_t DifferentialRestore::unchanged() const
+{
+    return _unchanged;
+}
+
+/*!
+ * \brief Number of non-directory entries that were extracted
+ */
+uint64_t DifferentialRestore::rewritten() const
+{
+    return _rewritten;
+}
+
+/*!
+ * \brief Number of paths deleted by delete_extras()
+ */
+uint64_t DifferentialRestore::deleted() const
+{
+    return _deleted;
+}
+
+}
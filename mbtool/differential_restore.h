@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include <sys/stat.h>
+
+#include "mbutil/archive.h"
+
+namespace mb
+{
+
+class ChunkStore;
+
+/*!
+ * \brief Extract only the entries that differ from what is already on disk
+ *
+ * Used as the extraction filter when restoring into a directory without
+ * wiping it first. Regular files are considered unchanged if their size,
+ * mtime, permissions, and owner match (and, for deduplicated backups, their
+ * chunk hashes if requested). Changed files are unlinked before they are
+ * extracted so that other hard links to the old file are not modified.
+ * Afterwards, delete_extras() removes everything that is not in the backup.
+ */
+class DifferentialRestore : public util::TarEntryFilter
+{
+public:
+    DifferentialRestore(std::string directory, ChunkStore *store,
+                        bool compare_hashes);
+
+    bool include(archive_entry *entry) override;
+
+    void forget(const std::string &path);
+    bool delete_extras(const std::vector<std::string> &exclusions);
+
+    uint64_t unchanged() const;
+    uint64_t rewritten() const;
+    uint64_t deleted() const;
+
+private:
+    bool is_unchanged(archive_entry *entry, const std::string &path,
+                      const struct stat &sb);
+    bool delete_extras_in(const std::string &dir,
+                          const std::vector<std::string> &exclusions);
+
+    std::string _directory;
+    ChunkStore *_store;
+    bool _compare_hashes;
+    // Paths (including the directory) of all entries in the backup
+    std::set<std::string> _expected;
+    uint64_t _unchanged;
+    uint64_t _rewritten;
+    uint64_t _deleted;
+};
+
+}
@@ -0,0 +1,710 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dirsize_cache.h"
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/autoclose/dir.h"
+#include "mbutil/process.h"
+#include "mbutil/socket.h"
+
+#include "job_scheduler.h"
+
+#define CACHE_STATUS_OK                 0
+#define CACHE_STATUS_UNCACHED           1
+
+#define WATCH_MASK \
+    (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY \
+    | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO \
+    | IN_DONT_FOLLOW | IN_EXCL_UNLINK | IN_ONLYDIR)
+
+namespace mb
+{
+
+/*!
+ * \brief Regular file that may be reachable through several hard links
+ *
+ * These are kept individually so that each inode is only counted once per
+ * query, like DirectorySizeGetter does.
+ */
+struct LinkedFile
+{
+    dev_t dev;
+    ino_t ino;
+    uint64_t size;
+};
+
+/*!
+ * \brief Regular file directly in the root of a tree
+ *
+ * These are kept by name since they can be excluded from the total.
+ */
+struct RootFile
+{
+    std::string name;
+    LinkedFile file;
+    bool linked;
+};
+
+struct DirNode
+{
+    DirNode *parent;
+    // Name relative to the parent (or the full path for the root)
+    std::string name;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    int wd = -1;
+    // Entries of this directory need to be read again
+    bool dirty = true;
+    // Subtotals of this directory or one of its descendants are out of date
+    bool stale = true;
+    // Sum of regular files with a single link (unused for the root)
+    uint64_t own_size = 0;
+    std::vector<LinkedFile> own_links;
+    // Regular files in the root directory
+    std::vector<RootFile> root_files;
+    std::unordered_map<std::string, std::unique_ptr<DirNode>> children;
+    // Totals for the subtree (valid if not stale)
+    uint64_t subtotal = 0;
+    size_t subtree_links = 0;
+};
+
+struct CacheTree
+{
+    // Device of the root. Mount points are not traversed.
+    dev_t dev;
+    std::unique_ptr<DirNode> root;
+    // Inodes seen with more than one link
+    std::unordered_set<ino_t> linked;
+    // Whether the initial scan has completed
+    bool built = false;
+    // Whether a file counted as having a single link may have gained another
+    bool rebuild = false;
+};
+
+// Daemon and connection processes
+static int registration_fd = -1;
+static int cache_fd = -1;
+
+// Cache process
+static int inotify_fd = -1;
+static std::unordered_map<std::string, std::unique_ptr<CacheTree>> trees;
+// A directory can be in several trees, so a watch can belong to several nodes
+static std::unordered_map<int, std::vector<DirNode *>> watches;
+// Trees that could not be watched (eg. due to the inotify watch limit)
+static std::unordered_set<std::string> uncacheable;
+
+static std::string node_path(const DirNode *node)
+{
+    std::vector<const std::string *> names;
+    for (; node; node = node->parent) {
+        names.push_back(&node->name);
+    }
+
+    std::string path;
+    for (auto it = names.rbegin(); it != names.rend(); ++it) {
+        if (!path.empty() && path.back() != '/') {
+            path += '/';
+        }
+        path += **it;
+    }
+
+    return path;
+}
+
+static void mark_dirty(DirNode *node)
+{
+    node->dirty = true;
+
+    // Ancestors of a stale node are always stale
+    for (; node && !node->stale; node = node->parent) {
+        node->stale = true;
+    }
+}
+
+static void unwatch_node(DirNode *node)
+{
+    if (node->wd < 0) {
+        return;
+    }
+
+    auto it = watches.find(node->wd);
+    if (it != watches.end()) {
+        auto &nodes = it->second;
+        nodes.erase(std::remove(nodes.begin(), nodes.end(), node),
+                    nodes.end());
+
+        if (nodes.empty()) {
+            inotify_rm_watch(inotify_fd, node->wd);
+            watches.erase(it);
+        }
+    }
+
+    node->wd = -1;
+}
+
+static bool watch_node(DirNode *node, const std::string &path)
+{
+    int wd = inotify_add_watch(inotify_fd, path.c_str(), WATCH_MASK);
+    if (wd < 0) {
+        return false;
+    } else if (wd == node->wd) {
+        return true;
+    }
+
+    unwatch_node(node);
+
+    // The kernel returns the existing watch if the directory is already
+    // watched through another node
+    watches[wd].push_back(node);
+    node->wd = wd;
+
+    return true;
+}
+
+static void remove_subtree(DirNode *node)
+{
+    for (auto &child : node->children) {
+        remove_subtree(child.second.get());
+    }
+    unwatch_node(node);
+}
+
+static void drop_tree(const std::string &path)
+{
+    auto it = trees.find(path);
+    if (it != trees.end()) {
+        remove_subtree(it->second->root.get());
+        trees.erase(it);
+    }
+
+    // Some watches may be available again
+    uncacheable.clear();
+}
+
+/*!
+ * \brief Read the entries of a directory node
+ *
+ * Only the files directly in the directory are counted. New subdirectories
+ * are added as dirty nodes and subdirectories that no longer exist are
+ * removed.
+ */
+static bool scan_dir(CacheTree *tree, DirNode *node)
+{
+    std::string path = node_path(node);
+
+    // Watch before reading so no changes are missed
+    if (!watch_node(node, path)) {
+        return false;
+    }
+
+    int dfd = open(path.c_str(),
+                   O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dfd < 0) {
+        return false;
+    }
+
+    autoclose::dir dp(fdopendir(dfd), closedir);
+    if (!dp) {
+        int saved_errno = errno;
+        close(dfd);
+        errno = saved_errno;
+        return false;
+    }
+
+    struct stat sb;
+    if (fstat(dfd, &sb) < 0) {
+        return false;
+    }
+
+    // If another directory was moved into place, none of the old subtree
+    // applies anymore
+    if (sb.st_dev != node->dev || sb.st_ino != node->ino) {
+        for (auto &child : node->children) {
+            remove_subtree(child.second.get());
+        }
+        node->children.clear();
+        node->dev = sb.st_dev;
+        node->ino = sb.st_ino;
+    }
+
+    node->own_size = 0;
+    node->own_links.clear();
+    node->root_files.clear();
+
+    std::unordered_set<std::string> seen;
+    struct dirent *ent;
+
+    while (errno = 0, (ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        if (fstatat(dfd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+            if (errno == ENOENT) {
+                // Removed while reading. There is an event for it.
+                continue;
+            }
+            return false;
+        }
+
+        if (S_ISREG(sb.st_mode)) {
+            LinkedFile file{sb.st_dev, sb.st_ino,
+                            static_cast<uint64_t>(sb.st_size)};
+
+            // Creating a hard link doesn't notify the directory of the
+            // existing link. If that was counted as a single-link file, the
+            // only way to find it again is a full scan.
+            if (sb.st_nlink > 1 && tree->linked.insert(sb.st_ino).second
+                    && tree->built) {
+                tree->rebuild = true;
+            }
+
+            if (!node->parent) {
+                node->root_files.push_back({ent->d_name, file,
+                                            sb.st_nlink > 1});
+            } else if (sb.st_nlink > 1) {
+                node->own_links.push_back(file);
+            } else {
+                node->own_size += file.size;
+            }
+        } else if (S_ISDIR(sb.st_mode) && sb.st_dev == tree->dev) {
+            seen.emplace(ent->d_name);
+
+            auto &child = node->children[ent->d_name];
+            if (!child) {
+                child.reset(new DirNode());
+                child->parent = node;
+                child->name = ent->d_name;
+            }
+        }
+    }
+
+    if (errno != 0) {
+        return false;
+    }
+
+    for (auto it = node->children.begin(); it != node->children.end();) {
+        if (seen.find(it->first) == seen.end()) {
+            remove_subtree(it->second.get());
+            it = node->children.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    node->dirty = false;
+    return true;
+}
+
+/*!
+ * \brief Rescan dirty directories and recompute stale subtotals
+ *
+ * Only the subtrees containing changes are visited.
+ */
+static bool refresh(CacheTree *tree, DirNode *node)
+{
+    if (!node->stale) {
+        return true;
+    }
+
+    if (node->dirty && !scan_dir(tree, node)) {
+        if (errno != ENOENT || !node->parent) {
+            return false;
+        }
+
+        // Removed during the scan. Count it as empty and let the parent drop
+        // it on the next refresh.
+        for (auto &child : node->children) {
+            remove_subtree(child.second.get());
+        }
+        node->children.clear();
+        node->own_size = 0;
+        node->own_links.clear();
+        node->parent->dirty = true;
+    }
+
+    bool stale = node->dirty;
+    node->subtotal = node->own_size;
+    node->subtree_links = node->own_links.size();
+
+    for (auto &item : node->children) {
+        DirNode *child = item.second.get();
+
+        if (!refresh(tree, child)) {
+            return false;
+        }
+
+        stale = stale || child->stale;
+        node->subtotal += child->subtotal;
+        node->subtree_links += child->subtree_links;
+    }
+
+    node->stale = stale || node->dirty;
+    return true;
+}
+
+static void process_events()
+{
+    alignas(struct inotify_event) char buf[16384];
+
+    while (true) {
+        ssize_t n = read(inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            // EAGAIN once the queue is empty
+            break;
+        }
+
+        for (char *ptr = buf; ptr < buf + n;) {
+            auto event = reinterpret_cast<struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                LOGW("inotify queue overflowed; clearing directory size cache");
+                while (!trees.empty()) {
+                    drop_tree(trees.begin()->first);
+                }
+                continue;
+            }
+
+            auto it = watches.find(event->wd);
+            if (it == watches.end()) {
+                continue;
+            }
+
+            for (DirNode *node : it->second) {
+                mark_dirty(node);
+            }
+
+            if (event->mask & IN_IGNORED) {
+                // Watch was removed by the kernel. It is added again when the
+                // directory is rescanned.
+                for (DirNode *node : it->second) {
+                    node->wd = -1;
+                }
+                watches.erase(it);
+            }
+        }
+    }
+}
+
+static void collect_links(const DirNode *node,
+                          std::vector<const LinkedFile *> *links)
+{
+    for (const LinkedFile &file : node->own_links) {
+        links->push_back(&file);
+    }
+    for (auto const &child : node->children) {
+        if (child.second->subtree_links > 0) {
+            collect_links(child.second.get(), links);
+        }
+    }
+}
+
+static bool cache_get(const std::string &path,
+                      const std::vector<std::string> &exclusions,
+                      uint64_t *total)
+{
+    if (uncacheable.find(path) != uncacheable.end()) {
+        return false;
+    }
+
+    process_events();
+
+    auto it = trees.find(path);
+    if (it != trees.end() && !refresh(it->second.get(),
+                                      it->second->root.get())) {
+        drop_tree(path);
+        return false;
+    } else if (it != trees.end() && it->second->rebuild) {
+        drop_tree(path);
+        it = trees.end();
+    }
+
+    if (it == trees.end()) {
+        struct stat sb;
+        if (lstat(path.c_str(), &sb) < 0 || !S_ISDIR(sb.st_mode)) {
+            return false;
+        }
+
+        std::unique_ptr<CacheTree> tree(new CacheTree());
+        tree->dev = sb.st_dev;
+        tree->root.reset(new DirNode());
+        tree->root->parent = nullptr;
+        tree->root->name = path;
+
+        if (!refresh(tree.get(), tree->root.get())) {
+            int saved_errno = errno;
+            remove_subtree(tree->root.get());
+
+            if (saved_errno == ENOSPC) {
+                LOGW("%s: Too many directories to watch; size will not be"
+                     " cached", path.c_str());
+                uncacheable.insert(path);
+            }
+
+            return false;
+        }
+
+        tree->built = true;
+        it = trees.emplace(path, std::move(tree)).first;
+    }
+
+    const DirNode *root = it->second->root.get();
+
+    auto excluded = [&](const std::string &name) {
+        return std::find(exclusions.begin(), exclusions.end(), name)
+                != exclusions.end();
+    };
+
+    uint64_t sum = 0;
+    std::vector<const LinkedFile *> links;
+
+    for (const RootFile &file : root->root_files) {
+        if (excluded(file.name)) {
+            continue;
+        } else if (file.linked) {
+            links.push_back(&file.file);
+        } else {
+            sum += file.file.size;
+        }
+    }
+
+    for (auto const &child : root->children) {
+        if (!excluded(child.first)) {
+            sum += child.second->subtotal;
+            if (child.second->subtree_links > 0) {
+                collect_links(child.second.get(), &links);
+            }
+        }
+    }
+
+    std::unordered_map<dev_t, std::unordered_set<ino_t>> visited;
+    for (const LinkedFile *file : links) {
+        if (visited[file->dev].emplace(file->ino).second) {
+            sum += file->size;
+        }
+    }
+
+    *total = sum;
+    return true;
+}
+
+static bool serve_client(int fd)
+{
+    std::string path;
+    std::vector<std::string> exclusions;
+
+    if (!util::socket_read_string(fd, &path)
+            || !util::socket_read_string_array(fd, &exclusions)) {
+        return false;
+    }
+
+    uint64_t total = 0;
+    bool ret = cache_get(path, exclusions, &total);
+
+    return util::socket_write_int32(
+                    fd, ret ? CACHE_STATUS_OK : CACHE_STATUS_UNCACHED)
+            && util::socket_write_uint64(fd, total);
+}
+
+static bool cache_main(int reg_fd)
+{
+    if (!util::set_process_title_v(nullptr, "mbtool dirsize cache")) {
+        LOGE("Failed to set process title: %s", strerror(errno));
+        return false;
+    }
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        LOGE("Failed to initialize inotify: %s", strerror(errno));
+        return false;
+    }
+
+    std::vector<int> clients;
+    std::vector<struct pollfd> pfds;
+
+    while (true) {
+        pfds.clear();
+        pfds.push_back({ reg_fd, POLLIN, 0 });
+        pfds.push_back({ inotify_fd, POLLIN, 0 });
+        for (int fd : clients) {
+            pfds.push_back({ fd, POLLIN, 0 });
+        }
+
+        if (poll(pfds.data(), pfds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Failed to poll: %s", strerror(errno));
+            return false;
+        }
+
+        // Drain events as they come so the queue doesn't overflow
+        if (pfds[1].revents) {
+            process_events();
+        }
+
+        for (size_t i = pfds.size(); i-- > 2;) {
+            if (pfds[i].revents && !serve_client(pfds[i].fd)) {
+                close(pfds[i].fd);
+                clients.erase(clients.begin() + (i - 2));
+            }
+        }
+
+        if (pfds[0].revents) {
+            std::vector<int> fds(1);
+
+            if (util::socket_receive_fds(reg_fd, &fds)) {
+                clients.push_back(fds[0]);
+            } else if (errno == EPIPE) {
+                // The daemon and all of its connections have exited
+                return true;
+            } else {
+                LOGE("Failed to receive client socket: %s", strerror(errno));
+            }
+        }
+    }
+}
+
+/*!
+ * \brief Fork the directory size cache process
+ *
+ * The cache process keeps per-directory subtotals of every tree that has been
+ * queried and watches the directories with inotify. When a tree is queried
+ * again, only the directories that changed are read. Connection processes
+ * talk to it through dirsize_cache_get().
+ *
+ * Like the connection workers, this must be called in the daemon process. The
+ * cache process sees the daemon's mount namespace and exits once the daemon
+ * and all of its connections are gone.
+ *
+ * \param listen_fd Daemon socket, which is closed in the cache process
+ */
+bool dirsize_cache_start(int listen_fd)
+{
+    int sv[2];
+
+    // Each message is a single registration, so all connections can share the
+    // same socket
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        LOGE("Failed to create socket pair: %s", strerror(errno));
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOGE("Failed to fork: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    } else if (pid == 0) {
+        close(listen_fd);
+        close(sv[0]);
+
+        // Scans are only done for directory size requests, which are
+        // background jobs anyway
+        if (!job_scheduler_enter_background()) {
+            LOGW("Directory size scans will run at normal priority");
+        }
+
+        _exit(cache_main(sv[1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(sv[1]);
+
+    registration_fd = sv[0];
+    return true;
+}
+
+/*!
+ * \brief Get the size of a directory tree from the cache process
+ *
+ * The result matches DirectorySizeGetter: only regular files are counted,
+ * hard links are counted once, mount points are not traversed, and
+ * \p exclusions are names in the top-level directory.
+ *
+ * \return True if the size was computed. False if the cache process is not
+ *         available or cannot handle \p path, in which case the caller should
+ *         compute the size itself.
+ */
+bool dirsize_cache_get(const std::string &path,
+                       const std::vector<std::string> &exclusions,
+                       uint64_t *total)
+{
+    if (cache_fd < 0) {
+        if (registration_fd < 0) {
+            errno = ENOTCONN;
+            return false;
+        }
+
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+            return false;
+        }
+
+        bool ret = util::socket_send_fds(registration_fd, { sv[1] });
+        close(sv[1]);
+
+        if (!ret) {
+            close(sv[0]);
+            return false;
+        }
+
+        cache_fd = sv[0];
+    }
+
+    int32_t status;
+
+    if (!util::socket_write_string(cache_fd, path)
+            || !util::socket_write_string_array(cache_fd, exclusions)
+            || !util::socket_read_int32(cache_fd, &status)
+            || !util::socket_read_uint64(cache_fd, total)) {
+        close(cache_fd);
+        cache_fd = -1;
+        return false;
+    }
+
+    if (status != CACHE_STATUS_OK) {
+        errno = ENOENT;
+        return false;
+    }
+
+    return true;
+}
+
+}
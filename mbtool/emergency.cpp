@@ -20,16 +20,24 @@
 #include "emergency.h"
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 
 #include <cerrno>
 #include <cstring>
+#include <ctime>
 
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/klog.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-#include "mbdevice/json.h"
 #include "mblog/logging.h"
+#include "mbutil/autoclose/archive.h"
+#include "mbutil/autoclose/dir.h"
 #include "mbutil/autoclose/file.h"
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
@@ -37,11 +45,20 @@
 #include "mbutil/fts.h"
 #include "mbutil/mount.h"
 #include "mbutil/time.h"
+#include "mbutil/trace.h"
 #include "mbutil/vibrate.h"
 
 #include "multiboot.h"
 #include "reboot.h"
 
+// Maximum time to wait for the diagnostic sources to be read
+#define EMERGENCY_DUMP_TIMEOUT          std::chrono::milliseconds(2000)
+// Maximum number of bytes to read from each diagnostic source
+#define EMERGENCY_DUMP_MAX_FILE_SIZE    (4 * 1024 * 1024)
+
+#define PSTORE_DIR                      "/sys/fs/pstore"
+#define LAST_KMSG_PATH                  "/proc/last_kmsg"
+
 using namespace mb::device;
 
 namespace mb
@@ -89,7 +106,7 @@ private:
     std::vector<std::string> _results;
 };
 
-static bool dump_kernel_log(const char *file)
+static bool read_kernel_log(std::string &out)
 {
     int len = klogctl(KLOG_SIZE_BUFFER, nullptr, 0);
     if (len < 0) {
@@ -97,47 +114,254 @@ static bool dump_kernel_log(const char *file)
         return false;
     }
 
-    char *buf = (char *) malloc(len);
-    if (!buf) {
-        LOGE("Failed to allocate %d bytes: %s", len, strerror(errno));
-        return false;
-    }
+    std::string buf;
+    buf.resize(static_cast<size_t>(len));
 
-    auto free_buf = util::finally([&]{
-        free(buf);
-    });
-
-    len = klogctl(KLOG_READ_ALL, buf, len);
+    len = klogctl(KLOG_READ_ALL, &buf[0], len);
     if (len < 0) {
         LOGE("Failed to read kernel log buffer: %s", strerror(errno));
         return false;
     }
+    buf.resize(static_cast<size_t>(len));
+
+    out = util::format_time("%Y/%m/%d %H:%M:%S %Z\n");
+    out += buf;
+    if (!buf.empty() && buf.back() != '\n') {
+        out += '\n';
+    }
 
+    return true;
+}
+
+static bool dump_kernel_log(const char *file, const std::string &log)
+{
     autoclose::file fp(autoclose::fopen(file, "wb"));
     if (!fp) {
         LOGE("%s: Failed to open for writing: %s", file, strerror(errno));
         return false;
     }
 
-    std::string timestamp = util::format_time("%Y/%m/%d %H:%M:%S %Z\n");
-    if (fwrite(timestamp.data(), timestamp.length(), 1, fp.get()) != 1) {
-        LOGE("%s: Failed to write timestamp: %s", file, strerror(errno));
+    if (fwrite(log.data(), 1, log.size(), fp.get()) != log.size()) {
+        LOGE("%s: Failed to write data: %s", file, strerror(errno));
         return false;
     }
 
-    if (len > 0) {
-        if (fwrite(buf, len, 1, fp.get()) != 1) {
-            LOGE("%s: Failed to write data: %s", file, strerror(errno));
+    return true;
+}
+
+struct DumpFile
+{
+    std::string name;
+    std::string data;
+};
+
+/*!
+ * \brief Diagnostics collected during an emergency reboot
+ *
+ * Each slow source (eg. pstore, which may be backed by flash or decompressed
+ * by the kernel on read) is read on its own detached thread while the
+ * emergency reboot continues. wait() gives up on the sources that are not done
+ * by the deadline so that a hung read cannot delay the reboot. The state is
+ * shared with the threads so that it outlives them.
+ */
+class EmergencyDump
+{
+public:
+    EmergencyDump() : _state(std::make_shared<State>())
+    {
+    }
+
+    void add(std::string name, std::string data)
+    {
+        std::lock_guard<std::mutex> lock(_state->mutex);
+        _state->files.push_back({std::move(name), std::move(data)});
+    }
+
+    void add_file_async(std::string name, std::string path)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_state->mutex);
+            ++_state->pending;
+        }
+
+        auto reader = new Reader{_state, std::move(name), std::move(path)};
+
+        pthread_t thread;
+        int ret = pthread_create(&thread, nullptr, &reader_thread, reader);
+        if (ret != 0) {
+            LOGW("%s: Failed to start reader thread: %s",
+                 reader->path.c_str(), strerror(ret));
+            delete reader;
+
+            std::lock_guard<std::mutex> lock(_state->mutex);
+            --_state->pending;
+            _state->cv.notify_all();
+            return;
+        }
+
+        pthread_detach(thread);
+    }
+
+    /*!
+     * \brief Wait for the sources until \p deadline
+     *
+     * \return Files that were read successfully. Sources that finish later are
+     *         ignored.
+     */
+    std::vector<DumpFile> wait(std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock(_state->mutex);
+
+        if (!_state->cv.wait_until(lock, deadline, [&]{
+            return _state->pending == 0;
+        })) {
+            LOGW("Timed out waiting for %zu diagnostic sources",
+                 _state->pending);
+        }
+
+        _state->done = true;
+        return std::move(_state->files);
+    }
+
+private:
+    struct State
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t pending = 0;
+        bool done = false;
+        std::vector<DumpFile> files;
+    };
+
+    std::shared_ptr<State> _state;
+
+    struct Reader
+    {
+        std::shared_ptr<State> state;
+        std::string name;
+        std::string path;
+    };
+
+    static void * reader_thread(void *userdata)
+    {
+        std::unique_ptr<Reader> reader(static_cast<Reader *>(userdata));
+        State &state = *reader->state;
+
+        std::string data;
+        bool ok = read_file(reader->path, data);
+
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (ok && !data.empty() && !state.done) {
+            state.files.push_back({std::move(reader->name), std::move(data)});
+        }
+        --state.pending;
+        state.cv.notify_all();
+
+        return nullptr;
+    }
+
+    static bool read_file(const std::string &path, std::string &out)
+    {
+        autoclose::file fp(autoclose::fopen(path.c_str(), "rbe"));
+        if (!fp) {
             return false;
         }
-        if (buf[len - 1] != '\n') {
-            if (fputc('\n', fp.get()) == EOF) {
-                LOGE("%s: Failed to write data: %s", file, strerror(errno));
-                return false;
+
+        char buf[8192];
+        size_t n;
+
+        while (out.size() < EMERGENCY_DUMP_MAX_FILE_SIZE
+                && (n = fread(buf, 1, std::min(sizeof(buf),
+                        EMERGENCY_DUMP_MAX_FILE_SIZE - out.size()),
+                        fp.get())) > 0) {
+            out.append(buf, n);
+        }
+
+        return !ferror(fp.get());
+    }
+};
+
+static void start_emergency_dump(EmergencyDump &dump,
+                                 const std::string &kernel_log)
+{
+    // Includes the mbtool log since init logs to kmsg
+    dump.add("kmsg.log", kernel_log);
+    dump.add("boot-timeline.json", util::timeline_dump_json());
+
+    dump.add_file_async("last_kmsg", LAST_KMSG_PATH);
+
+    autoclose::dir dir(autoclose::opendir(PSTORE_DIR));
+    if (dir) {
+        struct dirent *ent;
+
+        while ((ent = readdir(dir.get()))) {
+            if (ent->d_name[0] == '.') {
+                continue;
             }
+
+            std::string path(PSTORE_DIR);
+            path += "/";
+            path += ent->d_name;
+
+            std::string name("pstore/");
+            name += ent->d_name;
+
+            dump.add_file_async(std::move(name), std::move(path));
+        }
+    }
+}
+
+static bool write_emergency_dump(const std::string &path,
+                                 const std::vector<DumpFile> &files)
+{
+    autoclose::archive a(archive_write_new(), archive_write_free);
+    autoclose::archive_entry entry(archive_entry_new(), archive_entry_free);
+
+    if (!a || !entry) {
+        LOGE("Failed to allocate archive");
+        return false;
+    }
+
+    if (archive_write_set_format_pax_restricted(a.get()) != ARCHIVE_OK
+            || archive_write_add_filter_gzip(a.get()) != ARCHIVE_OK
+            // Fastest compression level since the device is about to reboot
+            || archive_write_set_filter_option(a.get(), "gzip",
+                                               "compression-level", "1")
+                    != ARCHIVE_OK
+            || archive_write_open_filename(a.get(), path.c_str())
+                    != ARCHIVE_OK) {
+        LOGE("%s: Failed to open archive: %s",
+             path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
+    time_t now = time(nullptr);
+
+    for (auto const &file : files) {
+        archive_entry_clear(entry.get());
+        archive_entry_set_pathname(entry.get(), file.name.c_str());
+        archive_entry_set_filetype(entry.get(), AE_IFREG);
+        archive_entry_set_perm(entry.get(), 0644);
+        archive_entry_set_size(entry.get(),
+                               static_cast<la_int64_t>(file.data.size()));
+        archive_entry_set_mtime(entry.get(), now, 0);
+
+        if (archive_write_header(a.get(), entry.get()) != ARCHIVE_OK
+                || archive_write_data(a.get(), file.data.data(),
+                                      file.data.size())
+                        != static_cast<la_ssize_t>(file.data.size())) {
+            LOGE("%s: Failed to write %s: %s", path.c_str(),
+                 file.name.c_str(), archive_error_string(a.get()));
+            return false;
         }
     }
 
+    if (archive_write_close(a.get()) != ARCHIVE_OK) {
+        LOGE("%s: Failed to close archive: %s",
+             path.c_str(), archive_error_string(a.get()));
+        return false;
+    }
+
     return true;
 }
 
@@ -145,11 +369,30 @@ struct EmergencyMount
 {
     std::string mount_point;
     std::string log_path;
+    std::string dump_path;
     std::vector<std::string> paths;
 };
 
-bool emergency_reboot()
+/*!
+ * \brief Dump the logs to the data or cache partition and reboot
+ *
+ * \param device Device definition from the boot environment or nullptr if it
+ *               could not be loaded. Its block device paths are tried before
+ *               the ones found by searching /dev/block.
+ */
+bool emergency_reboot(const Device *device)
 {
+    auto dump_deadline = std::chrono::steady_clock::now()
+            + EMERGENCY_DUMP_TIMEOUT;
+
+    // Collect the diagnostics in the background while the device vibrates and
+    // the partitions are mounted
+    std::string kernel_log;
+    read_kernel_log(kernel_log);
+
+    EmergencyDump dump;
+    start_emergency_dump(dump, kernel_log);
+
     util::vibrate(100, 150);
     util::vibrate(100, 150);
     util::vibrate(100, 150);
@@ -159,16 +402,6 @@ bool emergency_reboot()
     LOGW("--- EMERGENCY REBOOT FROM MBTOOL ---");
 
     std::vector<EmergencyMount> ems;
-    Device device;
-    JsonError error;
-
-    std::vector<unsigned char> contents;
-    util::file_read_all(DEVICE_JSON_PATH, &contents);
-    contents.push_back('\0');
-
-    bool loaded_json = device_from_json(
-            reinterpret_cast<char *>(contents.data()), device, error);
-
     // /data
     {
         EmergencyMount em;
@@ -178,11 +411,12 @@ bool emergency_reboot()
 
         em.mount_point = "/raw/data";
         em.log_path = "media/0/MultiBoot/logs/kmsg.log";
+        em.dump_path = "media/0/MultiBoot/logs/emergency.tar.gz";
 
         LOGV("Searching for data partition block device paths");
 
-        if (loaded_json) {
-            for (auto const &path : device.data_block_devs()) {
+        if (device) {
+            for (auto const &path : device->data_block_devs()) {
                 LOGV("- %s", path.c_str());
                 em.paths.push_back(path);
             }
@@ -206,11 +440,12 @@ bool emergency_reboot()
 
         em.mount_point = "/raw/cache";
         em.log_path = "multiboot/logs/kmsg.log";
+        em.dump_path = "multiboot/logs/emergency.tar.gz";
 
         LOGV("Searching for cache partition block device paths");
 
-        if (loaded_json) {
-            for (auto const &path : device.cache_block_devs()) {
+        if (device) {
+            for (auto const &path : device->cache_block_devs()) {
                 LOGV("- %s", path.c_str());
                 em.paths.push_back(path);
             }
@@ -225,6 +460,9 @@ bool emergency_reboot()
         ems.push_back(std::move(em));
     }
 
+    std::vector<DumpFile> dump_files;
+    bool dump_collected = false;
+
     for (auto const &em : ems) {
         if (!util::mkdir_recursive(em.mount_point, 0755) && errno != EEXIST) {
             LOGW("%s: Failed to create directory: %s",
@@ -259,7 +497,23 @@ bool emergency_reboot()
         LOGI("Dumping kernel log to %s", log_path.c_str());
 
         rename(log_path.c_str(), log_path_old.c_str());
-        dump_kernel_log(log_path.c_str());
+        dump_kernel_log(log_path.c_str(), kernel_log);
+
+        if (!dump_collected) {
+            dump_files = dump.wait(dump_deadline);
+            dump_collected = true;
+        }
+
+        std::string dump_path(em.mount_point);
+        dump_path += "/";
+        dump_path += em.dump_path;
+        std::string dump_path_old(dump_path);
+        dump_path_old += ".old";
+
+        LOGI("Writing emergency dump to %s", dump_path.c_str());
+
+        rename(dump_path.c_str(), dump_path_old.c_str());
+        write_emergency_dump(dump_path, dump_files);
         sync();
 
         util::umount(em.mount_point.c_str());
@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include "mbdevice/device.h"
+
 #define KLOG_CLOSE         0
 #define KLOG_OPEN          1
 #define KLOG_READ          2
@@ -34,6 +36,6 @@
 namespace mb
 {
 
-bool emergency_reboot();
+bool emergency_reboot(const device::Device *device);
 
 }
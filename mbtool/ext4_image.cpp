@@ -0,0 +1,1022 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ext4_image.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/finally.h"
+
+// This writes the same kind of filesystem as make_ext4fs (no flex_bg, no
+// resize inode), but only the metadata blocks are written. Everything else,
+// including the inode tables and the journal, is left as holes in a sparse
+// file. Holes read back as zeros, so the inode tables are marked as zeroed
+// and the journal only needs its superblock.
+
+#define EXT4_BLOCK_SIZE                 4096
+#define EXT4_LOG_BLOCK_SIZE             2
+#define EXT4_BLOCKS_PER_GROUP           (EXT4_BLOCK_SIZE * 8)
+#define EXT4_INODE_SIZE                 256
+#define EXT4_INODES_PER_BLOCK           (EXT4_BLOCK_SIZE / EXT4_INODE_SIZE)
+#define EXT4_BYTES_PER_INODE            16384
+#define EXT4_DESC_SIZE                  32
+#define EXT4_EXTRA_ISIZE                32
+#define EXT4_SUPERBLOCK_OFFSET          1024
+#define EXT4_SUPERBLOCK_SIZE            1024
+// Same as mke2fs: drop the last group if it could not hold much data
+#define EXT4_MIN_LAST_GROUP_DATA        50
+#define EXT4_MIN_BLOCKS                 2048
+
+#define EXT4_ROOT_INO                   2
+#define EXT4_JOURNAL_INO                8
+#define EXT4_FIRST_INO                  11
+#define EXT4_LOST_FOUND_INO             11
+
+#define EXT4_SUPER_MAGIC                0xef53
+#define EXT4_VALID_FS                   0x0001
+#define EXT4_ERROR_FS                   0x0002
+#define EXT4_EXTENT_MAGIC               0xf30a
+#define JBD2_MAGIC                      0xc03b3998
+#define JBD2_SUPERBLOCK_V2              4
+
+#define EXT4_FEATURE_COMPAT_HAS_JOURNAL         0x0004
+#define EXT4_FEATURE_COMPAT_EXT_ATTR            0x0008
+#define EXT4_FEATURE_COMPAT_DIR_INDEX           0x0020
+#define EXT4_FEATURE_COMPAT_SPARSE_SUPER2       0x0200
+#define EXT4_FEATURE_INCOMPAT_FILETYPE          0x0002
+#define EXT4_FEATURE_INCOMPAT_RECOVER           0x0004
+#define EXT4_FEATURE_INCOMPAT_EXTENTS           0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT             0x0080
+#define EXT4_FEATURE_INCOMPAT_META_BG           0x0010
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER     0x0001
+#define EXT4_FEATURE_RO_COMPAT_LARGE_FILE       0x0002
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM         0x0010
+#define EXT4_FEATURE_RO_COMPAT_DIR_NLINK        0x0020
+#define EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE      0x0040
+
+#define EXT4_BG_INODE_UNINIT            0x0001
+#define EXT4_BG_BLOCK_UNINIT            0x0002
+#define EXT4_BG_INODE_ZEROED            0x0004
+
+#define EXT4_EXTENTS_FL                 0x00080000
+#define EXT4_FLAGS_SIGNED_HASH          0x0001
+#define EXT4_FLAGS_UNSIGNED_HASH        0x0002
+#define EXT4_HASH_HALF_MD4              1
+#define EXT4_JNL_BACKUP_BLOCKS          1
+
+#define EXT4_FT_DIR                     2
+
+namespace mb
+{
+
+struct Ext4Layout
+{
+    uint32_t blocks;
+    uint32_t groups;
+    uint32_t inodes_per_group;
+    uint32_t itable_blocks;
+    uint32_t gdt_blocks;
+    uint32_t journal_group;
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    uint32_t root_block;
+    uint32_t lost_found_block;
+};
+
+static inline void put_le16(uint8_t *p, uint16_t value)
+{
+    p[0] = static_cast<uint8_t>(value);
+    p[1] = static_cast<uint8_t>(value >> 8);
+}
+
+static inline void put_le32(uint8_t *p, uint32_t value)
+{
+    p[0] = static_cast<uint8_t>(value);
+    p[1] = static_cast<uint8_t>(value >> 8);
+    p[2] = static_cast<uint8_t>(value >> 16);
+    p[3] = static_cast<uint8_t>(value >> 24);
+}
+
+static inline void put_be32(uint8_t *p, uint32_t value)
+{
+    p[0] = static_cast<uint8_t>(value >> 24);
+    p[1] = static_cast<uint8_t>(value >> 16);
+    p[2] = static_cast<uint8_t>(value >> 8);
+    p[3] = static_cast<uint8_t>(value);
+}
+
+static inline uint16_t get_le16(const uint8_t *p)
+{
+    return static_cast<uint16_t>(p[0] | p[1] << 8);
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+    return static_cast<uint32_t>(get_le16(p))
+            | static_cast<uint32_t>(get_le16(p + 2)) << 16;
+}
+
+static inline void set_bit(uint8_t *bitmap, uint32_t bit)
+{
+    bitmap[bit / 8] |= static_cast<uint8_t>(1 << (bit % 8));
+}
+
+/*!
+ * \brief CRC16 (polynomial 0x8005, reflected) used for group descriptors
+ */
+static uint16_t crc16(uint16_t crc, const uint8_t *data, size_t size)
+{
+    while (size-- > 0) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; ++i) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+static bool is_power_of(uint32_t n, uint32_t base)
+{
+    while (n > 1 && n % base == 0) {
+        n /= base;
+    }
+    return n == 1;
+}
+
+static bool group_has_super(uint32_t group)
+{
+    return group <= 1 || is_power_of(group, 3) || is_power_of(group, 5)
+            || is_power_of(group, 7);
+}
+
+static uint32_t group_first_block(uint32_t group)
+{
+    return group * EXT4_BLOCKS_PER_GROUP;
+}
+
+static uint32_t group_blocks(const Ext4Layout &layout, uint32_t group)
+{
+    if (group == layout.groups - 1) {
+        return layout.blocks - group_first_block(group);
+    }
+    return EXT4_BLOCKS_PER_GROUP;
+}
+
+static uint32_t group_block_bitmap(const Ext4Layout &layout, uint32_t group)
+{
+    return group_first_block(group)
+            + (group_has_super(group) ? 1 + layout.gdt_blocks : 0);
+}
+
+static uint32_t group_inode_table(const Ext4Layout &layout, uint32_t group)
+{
+    return group_block_bitmap(layout, group) + 2;
+}
+
+/*!
+ * \brief First block in a group that is not used by the group's metadata
+ */
+static uint32_t group_data_block(const Ext4Layout &layout, uint32_t group)
+{
+    return group_inode_table(layout, group) + layout.itable_blocks;
+}
+
+static bool get_bit(const uint8_t *bitmap, uint32_t bit)
+{
+    return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+static void compute_inode_layout(Ext4Layout &layout)
+{
+    uint64_t inodes = static_cast<uint64_t>(layout.blocks) * EXT4_BLOCK_SIZE
+            / EXT4_BYTES_PER_INODE;
+    uint64_t per_group = (inodes + layout.groups - 1) / layout.groups;
+
+    // Inode tables must fill whole blocks
+    per_group = (per_group + EXT4_INODES_PER_BLOCK - 1)
+            / EXT4_INODES_PER_BLOCK * EXT4_INODES_PER_BLOCK;
+    if (per_group < EXT4_INODES_PER_BLOCK) {
+        per_group = EXT4_INODES_PER_BLOCK;
+    }
+
+    layout.inodes_per_group = static_cast<uint32_t>(per_group);
+    layout.itable_blocks = layout.inodes_per_group / EXT4_INODES_PER_BLOCK;
+    layout.gdt_blocks = (layout.groups * EXT4_DESC_SIZE + EXT4_BLOCK_SIZE - 1)
+            / EXT4_BLOCK_SIZE;
+}
+
+/*!
+ * \brief Journal size for a filesystem (same as mke2fs's defaults)
+ */
+static uint32_t default_journal_blocks(uint32_t blocks)
+{
+    if (blocks < 32768) {
+        return 1024;
+    } else if (blocks < 256 * 1024) {
+        return 4096;
+    } else if (blocks < 512 * 1024) {
+        return 8192;
+    } else {
+        // Largest size that still fits in a single group
+        return 16384;
+    }
+}
+
+static bool compute_layout(uint64_t size, Ext4Layout &layout)
+{
+    uint64_t blocks = size / EXT4_BLOCK_SIZE;
+
+    if (blocks < EXT4_MIN_BLOCKS) {
+        LOGE("Image size %" PRIu64 " is too small", size);
+        return false;
+    } else if (blocks > UINT32_MAX) {
+        LOGE("Image size %" PRIu64 " is too large", size);
+        return false;
+    }
+
+    layout.blocks = static_cast<uint32_t>(blocks);
+    layout.groups = (layout.blocks + EXT4_BLOCKS_PER_GROUP - 1)
+            / EXT4_BLOCKS_PER_GROUP;
+    compute_inode_layout(layout);
+
+    uint32_t last = layout.groups - 1;
+    if (layout.groups > 1 && group_blocks(layout, last)
+            < group_data_block(layout, last) - group_first_block(last)
+                    + EXT4_MIN_LAST_GROUP_DATA) {
+        layout.blocks = group_first_block(last);
+        layout.groups = last;
+        compute_inode_layout(layout);
+    }
+
+    // The root directory and lost+found go at the start of the first group's
+    // data
+    layout.root_block = group_data_block(layout, 0);
+    layout.lost_found_block = layout.root_block + 1;
+
+    // Like mke2fs, put the journal in the middle of the filesystem
+    layout.journal_blocks = default_journal_blocks(layout.blocks);
+
+    for (uint32_t i = 0; i < layout.groups; ++i) {
+        uint32_t group = (layout.groups / 2 + i) % layout.groups;
+        uint32_t start = group == 0
+                ? layout.lost_found_block + 1
+                : group_data_block(layout, group);
+        uint32_t end = group_first_block(group) + group_blocks(layout, group);
+
+        if (start < end && end - start >= layout.journal_blocks) {
+            layout.journal_group = group;
+            layout.journal_start = start;
+            return true;
+        }
+    }
+
+    LOGE("Image size %" PRIu64 " is too small for the journal", size);
+    return false;
+}
+
+static void write_extent_inode(uint8_t *inode, uint16_t mode,
+                               uint16_t links, uint32_t start,
+                               uint32_t length, uint32_t now)
+{
+    uint64_t size = static_cast<uint64_t>(length) * EXT4_BLOCK_SIZE;
+
+    put_le16(inode + 0x00, mode);
+    put_le32(inode + 0x04, static_cast<uint32_t>(size));
+    put_le32(inode + 0x08, now);
+    put_le32(inode + 0x0c, now);
+    put_le32(inode + 0x10, now);
+    put_le16(inode + 0x1a, links);
+    put_le32(inode + 0x1c, length * (EXT4_BLOCK_SIZE / 512));
+    put_le32(inode + 0x20, EXT4_EXTENTS_FL);
+
+    // Extent header followed by a single extent
+    uint8_t *i_block = inode + 0x28;
+    put_le16(i_block + 0x00, EXT4_EXTENT_MAGIC);
+    put_le16(i_block + 0x02, 1);
+    put_le16(i_block + 0x04, 4);
+    put_le16(i_block + 0x06, 0);
+    put_le32(i_block + 0x0c, 0);
+    put_le16(i_block + 0x10, static_cast<uint16_t>(length));
+    put_le16(i_block + 0x12, 0);
+    put_le32(i_block + 0x14, start);
+
+    put_le32(inode + 0x6c, static_cast<uint32_t>(size >> 32));
+    put_le16(inode + 0x80, EXT4_EXTRA_ISIZE);
+    put_le32(inode + 0x90, now);
+}
+
+static size_t write_dir_entry(uint8_t *buf, uint32_t ino, uint16_t rec_len,
+                              const char *name)
+{
+    size_t name_len = strlen(name);
+
+    put_le32(buf + 0, ino);
+    put_le16(buf + 4, rec_len);
+    buf[6] = static_cast<uint8_t>(name_len);
+    buf[7] = EXT4_FT_DIR;
+    memcpy(buf + 8, name, name_len);
+
+    return rec_len;
+}
+
+static bool read_block(int fd, uint64_t offset, uint8_t *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = pread64(fd, data, size, static_cast<off64_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+static bool write_block(int fd, uint64_t offset, const uint8_t *data,
+                        size_t size)
+{
+    while (size > 0) {
+        ssize_t n = pwrite64(fd, data, size, static_cast<off64_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+static bool random_bytes(uint8_t *buf, size_t size)
+{
+    autoclose::file fp(autoclose::fopen("/dev/urandom", "rbe"));
+    return fp && fread(buf, 1, size, fp.get()) == size;
+}
+
+static bool write_filesystem(int fd, const Ext4Layout &layout)
+{
+    uint32_t now = static_cast<uint32_t>(time(nullptr));
+    std::vector<uint8_t> block(EXT4_BLOCK_SIZE);
+
+    uint8_t uuid[16];
+    uint8_t hash_seed[16];
+    if (!random_bytes(uuid, sizeof(uuid))
+            || !random_bytes(hash_seed, sizeof(hash_seed))) {
+        LOGE("Failed to generate UUID: %s", strerror(errno));
+        return false;
+    }
+    uuid[6] = static_cast<uint8_t>((uuid[6] & 0x0f) | 0x40);
+    uuid[8] = static_cast<uint8_t>((uuid[8] & 0x3f) | 0x80);
+
+    uint32_t journal_end = layout.journal_start + layout.journal_blocks;
+    uint32_t used_inodes = EXT4_FIRST_INO;
+    uint64_t free_blocks = 0;
+
+    // Group descriptors and block bitmaps
+    std::vector<uint8_t> gdt(static_cast<size_t>(layout.gdt_blocks)
+            * EXT4_BLOCK_SIZE);
+
+    for (uint32_t group = 0; group < layout.groups; ++group) {
+        uint32_t first = group_first_block(group);
+        uint32_t count = group_blocks(layout, group);
+        uint32_t used = group_data_block(layout, group) - first;
+
+        std::fill(block.begin(), block.end(), 0);
+        for (uint32_t i = 0; i < used; ++i) {
+            set_bit(block.data(), i);
+        }
+        if (group == 0) {
+            set_bit(block.data(), layout.root_block - first);
+            set_bit(block.data(), layout.lost_found_block - first);
+            used += 2;
+        }
+        if (group == layout.journal_group) {
+            for (uint32_t b = layout.journal_start; b < journal_end; ++b) {
+                set_bit(block.data(), b - first);
+            }
+            used += layout.journal_blocks;
+        }
+        // Padding past the end of the filesystem
+        for (uint32_t i = count; i < EXT4_BLOCKS_PER_GROUP; ++i) {
+            set_bit(block.data(), i);
+        }
+
+        if (!write_block(fd, static_cast<uint64_t>(
+                group_block_bitmap(layout, group)) * EXT4_BLOCK_SIZE,
+                block.data(), block.size())) {
+            return false;
+        }
+
+        uint32_t free_inodes = layout.inodes_per_group;
+        uint16_t flags = EXT4_BG_INODE_ZEROED;
+        uint16_t dirs = 0;
+        if (group == 0) {
+            free_inodes -= used_inodes;
+            dirs = 2;
+        } else {
+            flags |= EXT4_BG_INODE_UNINIT;
+        }
+
+        uint8_t *desc = gdt.data() + group * EXT4_DESC_SIZE;
+        put_le32(desc + 0x00, group_block_bitmap(layout, group));
+        put_le32(desc + 0x04, group_block_bitmap(layout, group) + 1);
+        put_le32(desc + 0x08, group_inode_table(layout, group));
+        put_le16(desc + 0x0c, static_cast<uint16_t>(count - used));
+        put_le16(desc + 0x0e, static_cast<uint16_t>(free_inodes));
+        put_le16(desc + 0x10, dirs);
+        put_le16(desc + 0x12, flags);
+        put_le16(desc + 0x1c, static_cast<uint16_t>(free_inodes));
+
+        uint8_t group_le[4];
+        put_le32(group_le, group);
+        uint16_t crc = crc16(0xffff, uuid, sizeof(uuid));
+        crc = crc16(crc, group_le, sizeof(group_le));
+        crc = crc16(crc, desc, 0x1e);
+        put_le16(desc + 0x1e, crc);
+
+        free_blocks += count - used;
+    }
+
+    // Inode bitmap for the first group. The other groups are uninitialized.
+    std::fill(block.begin(), block.end(), 0);
+    for (uint32_t i = 0; i < used_inodes; ++i) {
+        set_bit(block.data(), i);
+    }
+    for (uint32_t i = layout.inodes_per_group; i < EXT4_BLOCK_SIZE * 8; ++i) {
+        set_bit(block.data(), i);
+    }
+    if (!write_block(fd, static_cast<uint64_t>(
+            group_block_bitmap(layout, 0) + 1) * EXT4_BLOCK_SIZE,
+            block.data(), block.size())) {
+        return false;
+    }
+
+    // Reserved inodes, the root directory, and lost+found are all in the
+    // first inode table block
+    std::fill(block.begin(), block.end(), 0);
+    uint8_t *root_inode = block.data() + (EXT4_ROOT_INO - 1) * EXT4_INODE_SIZE;
+    uint8_t *journal_inode = block.data()
+            + (EXT4_JOURNAL_INO - 1) * EXT4_INODE_SIZE;
+    write_extent_inode(root_inode, S_IFDIR | 0755, 3, layout.root_block, 1,
+                       now);
+    write_extent_inode(journal_inode, S_IFREG | 0600, 1,
+                       layout.journal_start, layout.journal_blocks, now);
+    write_extent_inode(block.data() + (EXT4_LOST_FOUND_INO - 1)
+                               * EXT4_INODE_SIZE,
+                       S_IFDIR | 0700, 2, layout.lost_found_block, 1, now);
+    if (!write_block(fd, static_cast<uint64_t>(
+            group_inode_table(layout, 0)) * EXT4_BLOCK_SIZE,
+            block.data(), block.size())) {
+        return false;
+    }
+
+    // Superblock
+    std::vector<uint8_t> sb(EXT4_SUPERBLOCK_SIZE);
+    uint32_t inodes = layout.inodes_per_group * layout.groups;
+    char c = static_cast<char>(0xff);
+
+    put_le32(&sb[0x00], inodes);
+    put_le32(&sb[0x04], layout.blocks);
+    put_le32(&sb[0x0c], static_cast<uint32_t>(free_blocks));
+    put_le32(&sb[0x10], inodes - used_inodes);
+    put_le32(&sb[0x18], EXT4_LOG_BLOCK_SIZE);
+    put_le32(&sb[0x1c], EXT4_LOG_BLOCK_SIZE);
+    put_le32(&sb[0x20], EXT4_BLOCKS_PER_GROUP);
+    put_le32(&sb[0x24], EXT4_BLOCKS_PER_GROUP);
+    put_le32(&sb[0x28], layout.inodes_per_group);
+    put_le32(&sb[0x30], now);
+    put_le16(&sb[0x36], 0xffff);
+    put_le16(&sb[0x38], EXT4_SUPER_MAGIC);
+    put_le16(&sb[0x3a], 1);
+    put_le16(&sb[0x3c], 1);
+    put_le32(&sb[0x40], now);
+    put_le32(&sb[0x4c], 1);
+    put_le32(&sb[0x54], EXT4_FIRST_INO);
+    put_le16(&sb[0x58], EXT4_INODE_SIZE);
+    put_le32(&sb[0x5c], EXT4_FEATURE_COMPAT_HAS_JOURNAL
+            | EXT4_FEATURE_COMPAT_EXT_ATTR
+            | EXT4_FEATURE_COMPAT_DIR_INDEX);
+    put_le32(&sb[0x60], EXT4_FEATURE_INCOMPAT_FILETYPE
+            | EXT4_FEATURE_INCOMPAT_EXTENTS);
+    put_le32(&sb[0x64], EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER
+            | EXT4_FEATURE_RO_COMPAT_LARGE_FILE
+            | EXT4_FEATURE_RO_COMPAT_GDT_CSUM
+            | EXT4_FEATURE_RO_COMPAT_DIR_NLINK
+            | EXT4_FEATURE_RO_COMPAT_EXTRA_ISIZE);
+    memcpy(&sb[0x68], uuid, sizeof(uuid));
+    put_le32(&sb[0xe0], EXT4_JOURNAL_INO);
+    memcpy(&sb[0xec], hash_seed, sizeof(hash_seed));
+    sb[0xfc] = EXT4_HASH_HALF_MD4;
+    sb[0xfd] = EXT4_JNL_BACKUP_BLOCKS;
+    put_le32(&sb[0x108], now);
+    // Backup of the journal inode's i_block, i_size_high, and i_size
+    memcpy(&sb[0x10c], journal_inode + 0x28, 60);
+    memcpy(&sb[0x148], journal_inode + 0x6c, 4);
+    memcpy(&sb[0x14c], journal_inode + 0x04, 4);
+    put_le16(&sb[0x15c], EXT4_EXTRA_ISIZE);
+    put_le16(&sb[0x15e], EXT4_EXTRA_ISIZE);
+    put_le32(&sb[0x160], c < 0 ? EXT4_FLAGS_SIGNED_HASH
+                               : EXT4_FLAGS_UNSIGNED_HASH);
+
+    for (uint32_t group = 0; group < layout.groups; ++group) {
+        if (!group_has_super(group)) {
+            continue;
+        }
+
+        uint64_t offset = static_cast<uint64_t>(group_first_block(group))
+                * EXT4_BLOCK_SIZE;
+        put_le16(&sb[0x5a], static_cast<uint16_t>(group));
+
+        if (!write_block(fd, group == 0 ? EXT4_SUPERBLOCK_OFFSET : offset,
+                         sb.data(), sb.size())
+                || !write_block(fd, offset + EXT4_BLOCK_SIZE,
+                                gdt.data(), gdt.size())) {
+            return false;
+        }
+    }
+
+    // Root directory and lost+found
+    std::fill(block.begin(), block.end(), 0);
+    size_t pos = 0;
+    pos += write_dir_entry(&block[pos], EXT4_ROOT_INO, 12, ".");
+    pos += write_dir_entry(&block[pos], EXT4_ROOT_INO, 12, "..");
+    write_dir_entry(&block[pos], EXT4_LOST_FOUND_INO,
+                    static_cast<uint16_t>(EXT4_BLOCK_SIZE - pos),
+                    "lost+found");
+    if (!write_block(fd, static_cast<uint64_t>(layout.root_block)
+            * EXT4_BLOCK_SIZE, block.data(), block.size())) {
+        return false;
+    }
+
+    std::fill(block.begin(), block.end(), 0);
+    pos = 0;
+    pos += write_dir_entry(&block[pos], EXT4_LOST_FOUND_INO, 12, ".");
+    write_dir_entry(&block[pos], EXT4_ROOT_INO,
+                    static_cast<uint16_t>(EXT4_BLOCK_SIZE - pos), "..");
+    if (!write_block(fd, static_cast<uint64_t>(layout.lost_found_block)
+            * EXT4_BLOCK_SIZE, block.data(), block.size())) {
+        return false;
+    }
+
+    // Journal superblock. The journal is empty, so the rest of it is never
+    // read before it is written.
+    std::fill(block.begin(), block.end(), 0);
+    put_be32(&block[0x00], JBD2_MAGIC);
+    put_be32(&block[0x04], JBD2_SUPERBLOCK_V2);
+    put_be32(&block[0x0c], EXT4_BLOCK_SIZE);
+    put_be32(&block[0x10], layout.journal_blocks);
+    put_be32(&block[0x14], 1);
+    put_be32(&block[0x18], 1);
+    memcpy(&block[0x30], uuid, sizeof(uuid));
+    put_be32(&block[0x40], 1);
+    return write_block(fd, static_cast<uint64_t>(layout.journal_start)
+            * EXT4_BLOCK_SIZE, block.data(), block.size());
+}
+
+/*!
+ * \brief Create an empty ext4 image without writing the whole file
+ *
+ * The image is a sparse file of \a size bytes. Only the filesystem metadata
+ * (superblocks, group descriptors, bitmaps, the first inode table block, the
+ * root directory, and the journal superblock) is written, which is on the
+ * order of a few hundred KiB for a 4 GiB image.
+ *
+ * \param path Path to new image. Must not already exist.
+ * \param size Size of the image in bytes
+ * \param allocated If not nullptr, set to the number of bytes actually
+ *                  allocated on disk for the image
+ *
+ * \return Whether the image was successfully created
+ */
+bool write_sparse_ext4_image(const std::string &path, uint64_t size,
+                             uint64_t *allocated)
+{
+    Ext4Layout layout;
+    if (!compute_layout(size, layout)) {
+        return false;
+    }
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                  0644);
+    if (fd < 0) {
+        LOGE("%s: Failed to create: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat sb;
+    bool ret = ftruncate64(fd, static_cast<off64_t>(size)) == 0
+            && write_filesystem(fd, layout)
+            && fsync(fd) == 0
+            && fstat(fd, &sb) == 0;
+    if (!ret) {
+        LOGE("%s: Failed to write image: %s", path.c_str(), strerror(errno));
+    }
+
+    if (close(fd) < 0 && ret) {
+        LOGE("%s: Failed to close: %s", path.c_str(), strerror(errno));
+        ret = false;
+    }
+
+    if (!ret) {
+        unlink(path.c_str());
+        return false;
+    }
+
+    if (allocated) {
+        *allocated = static_cast<uint64_t>(sb.st_blocks) * 512;
+    }
+    return true;
+}
+
+/*!
+ * \brief Copy a range of bytes between two files at the same offset
+ *
+ * sendfile() is used so that the data does not pass through userspace. If
+ * the kernel does not support sendfile() for these files, then this falls
+ * back to pread() and pwrite().
+ */
+static bool copy_range(int in_fd, int out_fd, uint64_t offset,
+                       uint64_t length, bool &use_sendfile)
+{
+    if (use_sendfile) {
+        if (lseek64(out_fd, static_cast<off64_t>(offset), SEEK_SET) < 0) {
+            return false;
+        }
+
+        off64_t in_offset = static_cast<off64_t>(offset);
+
+        while (length > 0) {
+            size_t to_copy = static_cast<size_t>(
+                    std::min<uint64_t>(length, 1 << 30));
+            ssize_t n = sendfile64(out_fd, in_fd, &in_offset, to_copy);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                } else if ((errno == EINVAL || errno == ENOSYS)
+                        && static_cast<uint64_t>(in_offset) == offset) {
+                    LOGD("sendfile() not supported; using read/write");
+                    use_sendfile = false;
+                    break;
+                }
+                return false;
+            } else if (n == 0) {
+                errno = EIO;
+                return false;
+            }
+            length -= static_cast<uint64_t>(n);
+            offset += static_cast<uint64_t>(n);
+        }
+
+        if (length == 0) {
+            return true;
+        }
+    }
+
+    std::vector<uint8_t> buf(1024 * 1024);
+
+    while (length > 0) {
+        size_t to_copy = static_cast<size_t>(
+                std::min<uint64_t>(length, buf.size()));
+        if (!read_block(in_fd, offset, buf.data(), to_copy)
+                || !write_block(out_fd, offset, buf.data(), to_copy)) {
+            return false;
+        }
+        length -= to_copy;
+        offset += to_copy;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Find the allocated blocks of an ext4 filesystem
+ *
+ * The block bitmaps are used to find the allocated blocks. For groups whose
+ * block bitmap is uninitialized, only the group's own metadata is considered
+ * allocated, matching how the kernel initializes such bitmaps.
+ *
+ * \param fd File descriptor of the block device or image
+ * \param source Path of \a fd for log messages
+ * \param require_clean Whether to reject filesystems that were not cleanly
+ *                      unmounted
+ * \param[out] extents Ordered byte ranges of the runs of allocated blocks
+ * \param[out] size Size of the filesystem in bytes
+ *
+ * \return BlockCopyResult::SUCCEEDED if the blocks were found
+ *         BlockCopyResult::UNSUPPORTED if the filesystem's layout is not
+ *           supported (or if it is not clean and \a require_clean is true)
+ *         BlockCopyResult::FAILED if an error occurred
+ */
+static BlockCopyResult read_allocated_extents(
+        int fd, const std::string &source, bool require_clean,
+        std::vector<util::sparse_extent> &extents, uint64_t &size)
+{
+    uint8_t sb[EXT4_SUPERBLOCK_SIZE];
+    if (!read_block(fd, EXT4_SUPERBLOCK_OFFSET, sb, sizeof(sb))) {
+        LOGE("%s: Failed to read superblock: %s",
+             source.c_str(), strerror(errno));
+        return BlockCopyResult::FAILED;
+    }
+
+    uint32_t compat = get_le32(sb + 0x5c);
+    uint32_t incompat = get_le32(sb + 0x60);
+    uint32_t ro_compat = get_le32(sb + 0x64);
+    uint32_t log_block_size = get_le32(sb + 0x18);
+
+    if (get_le16(sb + 0x38) != EXT4_SUPER_MAGIC) {
+        LOGD("%s: Not an ext4 filesystem", source.c_str());
+        return BlockCopyResult::UNSUPPORTED;
+    } else if ((incompat & EXT4_FEATURE_INCOMPAT_META_BG)
+            || (compat & EXT4_FEATURE_COMPAT_SPARSE_SUPER2)
+            || log_block_size > 6
+            || get_le32(sb + 0x1c) != log_block_size) {
+        // Group descriptors are not in the usual place or there are clusters
+        LOGD("%s: Unsupported ext4 layout", source.c_str());
+        return BlockCopyResult::UNSUPPORTED;
+    } else if (require_clean
+            && ((get_le16(sb + 0x3a) & (EXT4_VALID_FS | EXT4_ERROR_FS))
+                    != EXT4_VALID_FS
+                    || (incompat & EXT4_FEATURE_INCOMPAT_RECOVER))) {
+        LOGD("%s: Filesystem is in use or was not cleanly unmounted",
+             source.c_str());
+        return BlockCopyResult::UNSUPPORTED;
+    }
+
+    uint32_t block_size = 1024u << log_block_size;
+    uint64_t blocks = get_le32(sb + 0x04);
+    uint32_t first_data_block = get_le32(sb + 0x14);
+    uint32_t blocks_per_group = get_le32(sb + 0x20);
+    uint32_t reserved_gdt = get_le16(sb + 0xce);
+    uint32_t desc_size = EXT4_DESC_SIZE;
+    bool sparse_super = ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER;
+
+    if (incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+        blocks |= static_cast<uint64_t>(get_le32(sb + 0x150)) << 32;
+        desc_size = get_le16(sb + 0xfe);
+    }
+
+    if (blocks_per_group == 0 || blocks_per_group > block_size * 8
+            || desc_size < EXT4_DESC_SIZE || blocks <= first_data_block) {
+        LOGE("%s: Invalid superblock", source.c_str());
+        return BlockCopyResult::FAILED;
+    }
+
+    uint64_t groups = (blocks - first_data_block + blocks_per_group - 1)
+            / blocks_per_group;
+    uint64_t gdt_blocks = (groups * desc_size + block_size - 1) / block_size;
+
+    std::vector<uint8_t> gdt(static_cast<size_t>(gdt_blocks * block_size));
+    if (!read_block(fd, static_cast<uint64_t>(first_data_block + 1)
+            * block_size, gdt.data(), gdt.size())) {
+        LOGE("%s: Failed to read group descriptors: %s",
+             source.c_str(), strerror(errno));
+        return BlockCopyResult::FAILED;
+    }
+
+    std::vector<uint8_t> bitmap(block_size);
+
+    extents.clear();
+
+    // Merges contiguous runs of allocated blocks
+    auto add_block = [&](uint64_t block) {
+        uint64_t offset = block * block_size;
+
+        if (!extents.empty() && extents.back().offset
+                + extents.back().length == offset) {
+            extents.back().length += block_size;
+        } else {
+            extents.push_back({ offset, block_size });
+        }
+    };
+
+    if (first_data_block > 0) {
+        add_block(0);
+    }
+
+    for (uint64_t group = 0; group < groups; ++group) {
+        const uint8_t *desc = gdt.data() + group * desc_size;
+        uint64_t first = first_data_block + group * blocks_per_group;
+        uint64_t count = std::min<uint64_t>(blocks - first, blocks_per_group);
+
+        if (get_le16(desc + 0x12) & EXT4_BG_BLOCK_UNINIT) {
+            uint64_t meta = 0;
+            if (!sparse_super || group_has_super(
+                    static_cast<uint32_t>(group))) {
+                meta = 1 + gdt_blocks + reserved_gdt;
+            }
+
+            uint64_t locations[] = {
+                get_le32(desc + 0x00),
+                get_le32(desc + 0x04),
+            };
+            uint64_t itable = get_le32(desc + 0x08);
+            if (desc_size >= 64) {
+                locations[0] |= static_cast<uint64_t>(
+                        get_le32(desc + 0x20)) << 32;
+                locations[1] |= static_cast<uint64_t>(
+                        get_le32(desc + 0x24)) << 32;
+                itable |= static_cast<uint64_t>(get_le32(desc + 0x28)) << 32;
+            }
+
+            uint64_t itable_blocks = (static_cast<uint64_t>(
+                    get_le32(sb + 0x28)) * get_le16(sb + 0x58)
+                    + block_size - 1) / block_size;
+
+            std::fill(bitmap.begin(), bitmap.end(), 0);
+            for (uint64_t i = 0; i < meta && i < count; ++i) {
+                set_bit(bitmap.data(), static_cast<uint32_t>(i));
+            }
+            for (uint64_t location : locations) {
+                if (location >= first && location < first + count) {
+                    set_bit(bitmap.data(),
+                            static_cast<uint32_t>(location - first));
+                }
+            }
+            for (uint64_t i = itable; i < itable + itable_blocks; ++i) {
+                if (i >= first && i < first + count) {
+                    set_bit(bitmap.data(), static_cast<uint32_t>(i - first));
+                }
+            }
+        } else {
+            uint64_t location = get_le32(desc + 0x00);
+            if (desc_size >= 64) {
+                location |= static_cast<uint64_t>(
+                        get_le32(desc + 0x20)) << 32;
+            }
+
+            if (!read_block(fd, location * block_size, bitmap.data(),
+                            bitmap.size())) {
+                LOGE("%s: Failed to read block bitmap for group %" PRIu64
+                     ": %s", source.c_str(), group, strerror(errno));
+                return BlockCopyResult::FAILED;
+            }
+        }
+
+        for (uint64_t i = 0; i < count; ++i) {
+            if (get_bit(bitmap.data(), static_cast<uint32_t>(i))) {
+                add_block(first + i);
+            }
+        }
+    }
+
+    size = blocks * block_size;
+    return BlockCopyResult::SUCCEEDED;
+}
+
+/*!
+ * \brief Find the allocated blocks of an unmounted ext4 filesystem
+ *
+ * See read_allocated_extents() for how the allocated blocks are found. The
+ * filesystem must be cleanly unmounted so that the bitmaps match the data.
+ *
+ * \param source Block device or image containing an ext4 filesystem
+ * \param[out] extents Ordered byte ranges of the runs of allocated blocks
+ * \param[out] size Size of the filesystem in bytes
+ *
+ * \return BlockCopyResult::SUCCEEDED if the blocks were found
+ *         BlockCopyResult::UNSUPPORTED if the filesystem's layout is not
+ *           supported or if it is in use or was not cleanly unmounted
+ *         BlockCopyResult::FAILED if an error occurred
+ */
+BlockCopyResult find_ext4_allocated_extents(
+        const std::string &source, std::vector<util::sparse_extent> *extents,
+        uint64_t *size)
+{
+    int fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", source.c_str(), strerror(errno));
+        return BlockCopyResult::FAILED;
+    }
+
+    auto close_fd = util::finally([&] {
+        close(fd);
+    });
+
+    return read_allocated_extents(fd, source, true, *extents, *size);
+}
+
+/*!
+ * \brief Clone an ext4 filesystem by copying only its allocated blocks
+ *
+ * The allocated blocks of \a source are copied to the same offsets in
+ * \a target and everything else is left as holes. See
+ * read_allocated_extents() for how the allocated blocks are found.
+ *
+ * The source filesystem must not be modified while it is being copied (eg.
+ * it must be unmounted or mounted read-only).
+ *
+ * \param source Block device or image containing an ext4 filesystem
+ * \param target Image file to write. It is truncated to the size of the
+ *               source filesystem.
+ * \param copied If not nullptr, set to the number of bytes copied
+ *
+ * \return BlockCopyResult::SUCCEEDED if the filesystem was copied
+ *         BlockCopyResult::UNSUPPORTED if the source filesystem's layout is
+ *           not supported. \a target is not modified in this case.
+ *         BlockCopyResult::FAILED if an error occurred
+ */
+BlockCopyResult copy_ext4_allocated_blocks(const std::string &source,
+                                           const std::string &target,
+                                           uint64_t *copied)
+{
+    int in_fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) {
+        LOGE("%s: Failed to open: %s", source.c_str(), strerror(errno));
+        return BlockCopyResult::FAILED;
+    }
+
+    auto close_in_fd = util::finally([&] {
+        close(in_fd);
+    });
+
+    std::vector<util::sparse_extent> extents;
+    uint64_t size;
+
+    auto result = read_allocated_extents(in_fd, source, false, extents, size);
+    if (result != BlockCopyResult::SUCCEEDED) {
+        return result;
+    }
+
+    int out_fd = open(target.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (out_fd < 0) {
+        LOGE("%s: Failed to open: %s", target.c_str(), strerror(errno));
+        return BlockCopyResult::FAILED;
+    }
+
+    auto close_out_fd = util::finally([&] {
+        if (out_fd >= 0) {
+            close(out_fd);
+        }
+    });
+
+    if (ftruncate64(out_fd, static_cast<off64_t>(size)) < 0) {
+        LOGE("%s: Failed to truncate: %s", target.c_str(), strerror(errno));
+        return BlockCopyResult::FAILED;
+    }
+
+    bool use_sendfile = true;
+    uint64_t total = 0;
+
+    for (auto const &extent : extents) {
+        if (!copy_range(in_fd, out_fd, extent.offset, extent.length,
+                        use_sendfile)) {
+            LOGE("Failed to copy blocks from %s to %s: %s",
+                 source.c_str(), target.c_str(), strerror(errno));
+            return BlockCopyResult::FAILED;
+        }
+        total += extent.length;
+    }
+
+    if (fsync(out_fd) < 0 || close(out_fd) < 0) {
+        out_fd = -1;
+        LOGE("%s: Failed to close: %s", target.c_str(), strerror(errno));
+        return BlockCopyResult::FAILED;
+    }
+    out_fd = -1;
+
+    if (copied) {
+        *copied = total;
+    }
+    return BlockCopyResult::SUCCEEDED;
+}
+
+}
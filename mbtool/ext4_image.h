@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "mbutil/archive.h"
+
+namespace mb
+{
+
+enum class BlockCopyResult
+{
+    SUCCEEDED,
+    UNSUPPORTED,
+    FAILED,
+};
+
+bool write_sparse_ext4_image(const std::string &path, uint64_t size,
+                             uint64_t *allocated);
+BlockCopyResult find_ext4_allocated_extents(
+        const std::string &source, std::vector<util::sparse_extent> *extents,
+        uint64_t *size);
+BlockCopyResult copy_ext4_allocated_blocks(const std::string &source,
+                                           const std::string &target,
+                                           uint64_t *copied);
+
+}
@@ -19,21 +19,62 @@
 
 #include "image.h"
 
+#include <cstdio>
+#include <ctime>
+
 #include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
+#include "mbutil/autoclose/file.h"
 #include "mbutil/command.h"
 #include "mbutil/directory.h"
+#include "mbutil/file.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/string.h"
 
+#include "ext4_image.h"
+
+// Sidecar file recording the state of an image the last time mbtool knew it
+// to be consistent
+#define IMAGE_CLEAN_STATE_SUFFIX        ".fsck_state"
+// Run e2fsck anyway after this many mounts or this many seconds
+#define IMAGE_FSCK_MAX_MOUNTS           30
+#define IMAGE_FSCK_INTERVAL             (7 * 24 * 60 * 60)
+
+#define EXT4_SUPERBLOCK_OFFSET          1024
+#define EXT4_SUPERBLOCK_SIZE            1024
+#define EXT4_SUPER_MAGIC                0xef53
+#define EXT4_VALID_FS                   0x0001
+#define EXT4_ERROR_FS                   0x0002
+#define EXT4_FEATURE_INCOMPAT_RECOVER   0x0004
+
 namespace mb
 {
 
+struct Ext4State
+{
+    uint32_t wtime;
+    uint16_t mnt_count;
+    int16_t max_mnt_count;
+    uint16_t state;
+    uint32_t feature_incompat;
+};
+
+struct ImageCleanState
+{
+    uint64_t last_fsck;
+    uint64_t mounts;
+    uint64_t size;
+    int64_t mtime_sec;
+    long mtime_nsec;
+    uint32_t wtime;
+    uint16_t mnt_count;
+};
+
 static void output_cb(const char *line, bool error, void *userdata)
 {
     (void) error;
@@ -42,6 +83,168 @@ static void output_cb(const char *line, bool error, void *userdata)
     LOGV("%s: %s", args[0], line);
 }
 
+/*!
+ * \brief Read the fields of an ext4 superblock that indicate its state
+ */
+static bool read_ext4_state(const std::string &image, Ext4State &state)
+{
+    unsigned char sb[EXT4_SUPERBLOCK_SIZE];
+
+    autoclose::file fp(autoclose::fopen(image.c_str(), "rbe"));
+    if (!fp) {
+        LOGE("%s: Failed to open: %s", image.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fseeko(fp.get(), EXT4_SUPERBLOCK_OFFSET, SEEK_SET) < 0
+            || fread(sb, sizeof(sb), 1, fp.get()) != 1) {
+        LOGE("%s: Failed to read superblock: %s",
+             image.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto le16 = [&](size_t offset) -> uint16_t {
+        return static_cast<uint16_t>(sb[offset] | sb[offset + 1] << 8);
+    };
+    auto le32 = [&](size_t offset) -> uint32_t {
+        return static_cast<uint32_t>(le16(offset))
+                | static_cast<uint32_t>(le16(offset + 2)) << 16;
+    };
+
+    if (le16(0x38) != EXT4_SUPER_MAGIC) {
+        LOGE("%s: Not an ext4 image", image.c_str());
+        return false;
+    }
+
+    state.wtime = le32(0x30);
+    state.mnt_count = le16(0x34);
+    state.max_mnt_count = static_cast<int16_t>(le16(0x36));
+    state.state = le16(0x3a);
+    state.feature_incompat = le32(0x60);
+
+    return true;
+}
+
+static std::string clean_state_path(const std::string &image)
+{
+    return image + IMAGE_CLEAN_STATE_SUFFIX;
+}
+
+static bool read_clean_state(const std::string &image, ImageCleanState &state)
+{
+    std::string line;
+    if (!util::file_first_line(clean_state_path(image), &line)) {
+        return false;
+    }
+
+    unsigned int mnt_count;
+    if (sscanf(line.c_str(), "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNd64
+               " %ld %" SCNu32 " %u", &state.last_fsck, &state.mounts,
+               &state.size, &state.mtime_sec, &state.mtime_nsec,
+               &state.wtime, &mnt_count) != 7) {
+        LOGW("%s: Invalid clean state record", image.c_str());
+        return false;
+    }
+    state.mnt_count = static_cast<uint16_t>(mnt_count);
+
+    return true;
+}
+
+/*!
+ * \brief Record that an image is consistent in its current state
+ *
+ * \param image Image path
+ * \param last_fsck Time of the last successful e2fsck
+ * \param mounts Number of mounts by mbtool since \a last_fsck
+ */
+static bool write_clean_state(const std::string &image, uint64_t last_fsck,
+                              uint64_t mounts)
+{
+    Ext4State ext4;
+    struct stat sb;
+
+    if (!read_ext4_state(image, ext4)) {
+        return false;
+    } else if (stat(image.c_str(), &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", image.c_str(), strerror(errno));
+        return false;
+    }
+
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf), "%" PRIu64 " %" PRIu64 " %" PRIu64
+                     " %" PRId64 " %ld %" PRIu32 " %u\n", last_fsck, mounts,
+                     static_cast<uint64_t>(sb.st_size),
+                     static_cast<int64_t>(sb.st_mtim.tv_sec),
+                     static_cast<long>(sb.st_mtim.tv_nsec), ext4.wtime,
+                     static_cast<unsigned int>(ext4.mnt_count));
+
+    std::string path(clean_state_path(image));
+    std::string temp_path(path + ".tmp");
+
+    if (!util::file_write_data(temp_path, buf, static_cast<size_t>(n))
+            || rename(temp_path.c_str(), path.c_str()) < 0) {
+        LOGW("%s: Failed to write clean state: %s",
+             path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Check whether an image should be checked before being mounted
+ *
+ * e2fsck is needed if the filesystem was not cleanly unmounted, if the image
+ * was modified since mbtool last recorded it as clean (eg. by being mounted
+ * by the ROM), or if the periodic check is due.
+ */
+static bool ext4_image_needs_fsck(const std::string &image)
+{
+    Ext4State ext4;
+    ImageCleanState clean;
+    struct stat sb;
+
+    if (!read_ext4_state(image, ext4) || stat(image.c_str(), &sb) < 0) {
+        return true;
+    }
+
+    if (!(ext4.state & EXT4_VALID_FS) || (ext4.state & EXT4_ERROR_FS)
+            || (ext4.feature_incompat & EXT4_FEATURE_INCOMPAT_RECOVER)) {
+        LOGD("%s: Not cleanly unmounted", image.c_str());
+        return true;
+    }
+
+    if (ext4.max_mnt_count > 0 && ext4.mnt_count >= ext4.max_mnt_count) {
+        LOGD("%s: Maximum mount count reached", image.c_str());
+        return true;
+    }
+
+    if (!read_clean_state(image, clean)) {
+        LOGD("%s: Not previously checked", image.c_str());
+        return true;
+    }
+
+    if (clean.size != static_cast<uint64_t>(sb.st_size)
+            || clean.mtime_sec != static_cast<int64_t>(sb.st_mtim.tv_sec)
+            || clean.mtime_nsec != static_cast<long>(sb.st_mtim.tv_nsec)
+            || clean.wtime != ext4.wtime
+            || clean.mnt_count != ext4.mnt_count) {
+        LOGD("%s: Modified since last clean unmount", image.c_str());
+        return true;
+    }
+
+    uint64_t now = static_cast<uint64_t>(time(nullptr));
+    if (clean.mounts >= IMAGE_FSCK_MAX_MOUNTS
+            || now < clean.last_fsck
+            || now - clean.last_fsck >= IMAGE_FSCK_INTERVAL) {
+        LOGD("%s: Periodic check is due", image.c_str());
+        return true;
+    }
+
+    return false;
+}
+
 CreateImageResult create_ext4_image(const std::string &path, uint64_t size)
 {
     // Ensure we have enough space since we're creating a sparse file that may
@@ -60,20 +263,20 @@ CreateImageResult create_ext4_image(const std::string &path, uint64_t size)
             LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
             return CreateImageResult::FAILED;
         } else {
-            char size_str[64];
-            snprintf(size_str, sizeof(size_str), "%" PRIu64, size);
-
-            LOGD("%s: Creating new %s ext4 image", path.c_str(), size_str);
+            LOGD("%s: Creating new %" PRIu64 " byte ext4 image",
+                 path.c_str(), size);
 
             // Create new image
-            const char *argv[] =
-                    { "make_ext4fs", "-l", size_str, path.c_str(), nullptr };
-            int ret = util::run_command(argv[0], argv, nullptr, nullptr,
-                                        &output_cb, argv);
-            if (ret < 0 || WEXITSTATUS(ret) != 0) {
+            uint64_t allocated;
+            if (!write_sparse_ext4_image(path, size, &allocated)) {
                 LOGE("%s: Failed to create image", path.c_str());
                 return CreateImageResult::FAILED;
             }
+
+            LOGD("%s: Allocated %" PRIu64 " bytes", path.c_str(), allocated);
+
+            // A freshly formatted image does not need to be checked
+            write_clean_state(path, static_cast<uint64_t>(time(nullptr)), 0);
             return CreateImageResult::SUCCEEDED;
         }
     }
@@ -91,7 +294,39 @@ bool fsck_ext4_image(const std::string &image)
         LOGE("%s: Failed to e2fsck", image.c_str());
         return false;
     }
+
+    write_clean_state(image, static_cast<uint64_t>(time(nullptr)), 0);
     return true;
 }
 
+/*!
+ * \brief Run e2fsck on an image only if it might be inconsistent
+ *
+ * \return Whether the image is clean or was successfully checked
+ */
+bool fsck_ext4_image_if_needed(const std::string &image)
+{
+    if (!ext4_image_needs_fsck(image)) {
+        LOGD("%s: Skipping e2fsck for cleanly unmounted image",
+             image.c_str());
+        return true;
+    }
+
+    return fsck_ext4_image(image);
+}
+
+/*!
+ * \brief Record that mbtool cleanly unmounted an image
+ *
+ * This has no effect if the image has not been checked by mbtool before.
+ */
+void mark_ext4_image_clean(const std::string &image)
+{
+    ImageCleanState clean;
+
+    if (read_clean_state(image, clean)) {
+        write_clean_state(image, clean.last_fsck, clean.mounts + 1);
+    }
+}
+
 }
@@ -36,5 +36,7 @@ enum class CreateImageResult
 
 CreateImageResult create_ext4_image(const std::string &path, uint64_t size);
 bool fsck_ext4_image(const std::string &image);
+bool fsck_ext4_image_if_needed(const std::string &image);
+void mark_ext4_image_clean(const std::string &image);
 
 }
\ No newline at end of file
@@ -21,7 +21,6 @@
 
 #include <algorithm>
 #include <memory>
-#include <unordered_set>
 
 #include <cerrno>
 #include <cstdlib>
@@ -33,48 +32,58 @@
 #include <signal.h>
 #include <sys/klog.h>
 #include <sys/mount.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include "minizip/ioandroid.h"
-#include "minizip/ioapi_buf.h"
-#include "minizip/unzip.h"
-
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
-#include "mbdevice/json.h"
 #include "mblog/kmsg_logger.h"
 #include "mblog/logging.h"
 #include "mbutil/autoclose/dir.h"
 #include "mbutil/autoclose/file.h"
 #include "mbutil/chown.h"
-#include "mbutil/cmdline.h"
 #include "mbutil/command.h"
+#include "mbutil/copy.h"
+#include "mbutil/counters.h"
 #include "mbutil/delete.h"
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/fstab.h"
+#include "mbutil/hash.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
+#include "mbutil/trace.h"
 
 #include "external/property_service.h"
 
 #include "initwrapper/devices.h"
 #include "initwrapper/util.h"
+#include "boot_env.h"
 #include "daemon.h"
 #include "emergency.h"
 #include "mount_fstab.h"
 #include "multiboot.h"
+#include "rc_rewriter.h"
+#include "rom_metadata.h"
 #include "romconfig.h"
+#include "roms.h"
 #include "sepolpatch.h"
 #include "signature.h"
+#include "task_graph.h"
+#include "zip_index.h"
 
 #define RUN_ADB_BEFORE_EXEC_OR_REBOOT 0
 
+#define BOOT_TIMELINE_PATH      "/data/multiboot/boot-timeline.json"
+
+// Maximum number of init steps to run at the same time
+#define INIT_MAX_THREADS        4u
+
 #if RUN_ADB_BEFORE_EXEC_OR_REBOOT
 #include "miniadbd.h"
 #include "miniadbd/adb_log.h"
@@ -88,6 +97,18 @@
 #error Unknown PCRE path for architecture
 #endif
 
+#define FILE_CONTEXTS_TOOL_PATH     "/sbin/file-contexts-tool"
+#define FILE_CONTEXTS_TOOL_SIG_PATH "/sbin/file-contexts-tool.sig"
+
+// Compiled binary file_contexts are cached on /cache, keyed by the hash of the
+// original file, file-contexts-tool, and the ROM's libpcre (compiled regexes
+// are specific to the PCRE version)
+#define FILE_CONTEXTS_CACHE_DIR     "/raw/cache/multiboot/file_contexts"
+// Bump when fix_file_contexts() changes what it writes
+#define FILE_CONTEXTS_CACHE_VERSION "1"
+// Keep a few entries so switching between ROMs doesn't thrash the cache
+#define FILE_CONTEXTS_CACHE_MAX     4
+
 using namespace mb::device;
 
 namespace mb
@@ -196,27 +217,20 @@ static bool stop_daemon()
     return wait_for_pid("daemon", daemon_pid) != -1;
 }
 
-static util::CmdlineIterAction set_kernel_properties_cb(const char *name,
-                                                        const char *value,
-                                                        void *userdata)
+static bool set_kernel_properties(const BootEnv &env)
 {
-    (void) userdata;
-
-    if (mb::starts_with(name, "androidboot.") && strlen(name) > 12 && value) {
-        char buf[PROP_NAME_MAX];
-        int n = snprintf(buf, sizeof(buf), "ro.boot.%s", name + 12);
-        if (n >= 0 && n < (int) sizeof(buf)) {
-            property_set(buf, value);
+    for (auto const &option : env.cmdline()) {
+        if (mb::starts_with(option.name, "androidboot.")
+                && option.name.size() > 12 && option.has_value) {
+            char buf[PROP_NAME_MAX];
+            int n = snprintf(buf, sizeof(buf), "ro.boot.%s",
+                             option.name.c_str() + 12);
+            if (n >= 0 && n < (int) sizeof(buf)) {
+                property_set(buf, option.value);
+            }
         }
     }
 
-    return util::CmdlineIterAction::Continue;
-}
-
-static bool set_kernel_properties()
-{
-    util::kernel_cmdline_iter(&set_kernel_properties_cb, nullptr);
-
     struct {
         const char *src_prop;
         const char *dst_prop;
@@ -239,14 +253,16 @@ static bool set_kernel_properties()
     return true;
 }
 
-static bool properties_setup()
+static bool properties_setup(const BootEnv &env)
 {
+    MB_TIMELINE_SCOPE("init.properties_setup");
+
     if (!property_init()) {
         LOGW("Failed to initialize properties area");
     }
 
     // Set ro.boot.* properties from the kernel command line
-    if (!set_kernel_properties()) {
+    if (!set_kernel_properties(env)) {
         LOGW("Failed to set kernel cmdline properties");
     }
 
@@ -263,6 +279,8 @@ static bool properties_setup()
 
 static bool properties_cleanup()
 {
+    MB_TIMELINE_SCOPE("init.properties_cleanup");
+
     if (!stop_property_service()) {
         LOGW("Failed to stop properties service");
     }
@@ -270,17 +288,6 @@ static bool properties_cleanup()
     return true;
 }
 
-static std::string get_rom_id()
-{
-    std::string rom_id;
-
-    if (!util::file_first_line("/romid", &rom_id)) {
-        return std::string();
-    }
-
-    return rom_id;
-}
-
 // Operating on paths instead of fd's should be safe enough since, at this
 // point, we're the only process alive on the system.
 static bool replace_file(const char *replace, const char *with)
@@ -312,6 +319,8 @@ static bool replace_file(const char *replace, const char *with)
 
 static bool fix_file_contexts(const char *path)
 {
+    MB_TIMELINE_SCOPE("init.fix_file_contexts");
+
     std::string new_path(path);
     new_path += ".new";
 
@@ -367,28 +376,156 @@ static bool fix_file_contexts(const char *path)
     return replace_file(path, new_path.c_str());
 }
 
+static bool file_contexts_cache_path(const char *path, std::string &out)
+{
+    std::vector<util::Sha512Digest> digests;
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    SHA512_CTX ctx;
+
+    if (!util::sha512_hash_files({ path, FILE_CONTEXTS_TOOL_PATH, PCRE_PATH },
+                                 digests)) {
+        return false;
+    }
+
+    if (!SHA512_Init(&ctx)
+            || !SHA512_Update(&ctx, FILE_CONTEXTS_CACHE_VERSION,
+                              strlen(FILE_CONTEXTS_CACHE_VERSION))) {
+        return false;
+    }
+    for (auto const &d : digests) {
+        if (!SHA512_Update(&ctx, d.data(), d.size())) {
+            return false;
+        }
+    }
+    if (!SHA512_Final(digest, &ctx)) {
+        return false;
+    }
+
+    out = FILE_CONTEXTS_CACHE_DIR "/";
+    out += util::hex_string(digest, sizeof(digest));
+    out += ".bin";
+
+    return true;
+}
+
+// Remove the least recently used entries beyond FILE_CONTEXTS_CACHE_MAX
+static void prune_file_contexts_cache()
+{
+    autoclose::dir dp(autoclose::opendir(FILE_CONTEXTS_CACHE_DIR));
+    if (!dp) {
+        return;
+    }
+
+    std::vector<std::pair<time_t, std::string>> entries;
+    struct dirent *ent;
+    struct stat sb;
+
+    while ((ent = readdir(dp.get()))) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+
+        std::string entry_path(FILE_CONTEXTS_CACHE_DIR "/");
+        entry_path += ent->d_name;
+
+        if (stat(entry_path.c_str(), &sb) == 0) {
+            entries.emplace_back(sb.st_mtime, std::move(entry_path));
+        }
+    }
+
+    if (entries.size() <= FILE_CONTEXTS_CACHE_MAX) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end(),
+              [](const std::pair<time_t, std::string> &a,
+                 const std::pair<time_t, std::string> &b) {
+        return a.first > b.first;
+    });
+
+    for (auto it = entries.begin() + FILE_CONTEXTS_CACHE_MAX;
+            it != entries.end(); ++it) {
+        unlink(it->second.c_str());
+    }
+}
+
+static bool load_cached_file_contexts(const std::string &cache_path,
+                                      const std::string &new_path)
+{
+    if (access(cache_path.c_str(), R_OK) < 0) {
+        return false;
+    }
+
+    if (!util::copy_contents(cache_path, new_path)) {
+        LOGW("%s: Failed to copy cached file_contexts: %s",
+             cache_path.c_str(), strerror(errno));
+        unlink(new_path.c_str());
+        return false;
+    }
+
+    // Mark as recently used
+    utimes(cache_path.c_str(), nullptr);
+
+    return true;
+}
+
+static void store_cached_file_contexts(const std::string &cache_path,
+                                       const std::string &new_path)
+{
+    std::string tmp_path(cache_path);
+    tmp_path += ".tmp";
+
+    if (!util::mkdir_recursive(FILE_CONTEXTS_CACHE_DIR, 0700)) {
+        LOGW("%s: Failed to create directory: %s",
+             FILE_CONTEXTS_CACHE_DIR, strerror(errno));
+        return;
+    }
+
+    if (!util::copy_contents(new_path, tmp_path)
+            || rename(tmp_path.c_str(), cache_path.c_str()) < 0) {
+        LOGW("%s: Failed to cache file_contexts: %s",
+             cache_path.c_str(), strerror(errno));
+        unlink(tmp_path.c_str());
+        return;
+    }
+
+    prune_file_contexts_cache();
+}
+
 static bool fix_binary_file_contexts(const char *path)
 {
+    MB_TIMELINE_SCOPE("init.fix_binary_file_contexts");
+
     std::string new_path(path);
     new_path += ".bin";
     std::string tmp_path(path);
     tmp_path += ".tmp";
 
+    // The decompile, patch, and recompile steps are skipped entirely if the
+    // same file_contexts was already converted on a previous boot
+    std::string cache_path;
+    bool have_cache_path = file_contexts_cache_path(path, cache_path);
+
+    if (have_cache_path && load_cached_file_contexts(cache_path, new_path)) {
+        LOGV("%s: Using cached file_contexts: %s", path, cache_path.c_str());
+        return replace_file(path, new_path.c_str());
+    }
+
     // Check signature
     SigVerifyResult result;
-    result = verify_signature("/sbin/file-contexts-tool",
-                              "/sbin/file-contexts-tool.sig");
+    result = verify_signature(FILE_CONTEXTS_TOOL_PATH,
+                              FILE_CONTEXTS_TOOL_SIG_PATH);
     if (result != SigVerifyResult::VALID) {
-        LOGE("%s: Invalid signature", "/sbin/file-contexts-tool");
+        LOGE("%s: Invalid signature", FILE_CONTEXTS_TOOL_PATH);
         return false;
     }
 
     const char *decompile_argv[] = {
-        "/sbin/file-contexts-tool",  "decompile", "-p", PCRE_PATH,
+        FILE_CONTEXTS_TOOL_PATH,  "decompile", "-p", PCRE_PATH,
         path, tmp_path.c_str(), nullptr
     };
     const char *compile_argv[] = {
-        "/sbin/file-contexts-tool", "compile", "-p", PCRE_PATH,
+        FILE_CONTEXTS_TOOL_PATH, "compile", "-p", PCRE_PATH,
         tmp_path.c_str(), new_path.c_str(), nullptr
     };
 
@@ -417,97 +554,94 @@ static bool fix_binary_file_contexts(const char *path)
 
     unlink(tmp_path.c_str());
 
-    return replace_file(path, new_path.c_str());
-}
-
-static bool is_completely_whitespace(const char *str)
-{
-    while (*str) {
-        if (!isspace(*str)) {
-            return false;
-        }
-        ++str;
+    if (have_cache_path) {
+        store_cached_file_contexts(cache_path, new_path);
     }
-    return true;
+
+    return replace_file(path, new_path.c_str());
 }
 
-static bool add_mbtool_services(bool enable_appsync)
+static bool write_fstab_hack(const char *fstab)
 {
-    autoclose::file fp_old(autoclose::fopen("/init.rc", "rb"));
-    if (!fp_old) {
-        if (errno == ENOENT) {
-            return true;
-        } else {
-            LOGE("Failed to open /init.rc: %s", strerror(errno));
-            return false;
-        }
-    }
+    MB_TIMELINE_SCOPE("init.write_fstab_hack");
 
-    autoclose::file fp_new(autoclose::fopen("/init.rc.new", "wb"));
-    if (!fp_new) {
-        LOGE("Failed to open /init.rc.new for writing: %s",
-             strerror(errno));
+    autoclose::file fp_fstab(autoclose::fopen(fstab, "abe"));
+    if (!fp_fstab) {
+        LOGE("%s: Failed to open for writing: %s",
+             fstab, strerror(errno));
         return false;
     }
 
-    char *line = nullptr;
-    size_t len = 0;
-    ssize_t read = 0;
-
-    auto free_line = util::finally([&]{
-        free(line);
-    });
-
-    bool has_init_multiboot_rc = false;
-    bool has_disabled_installd = false;
-    bool inside_service = false;
+    fputs(R"EOF(
+# The following is added to prevent vold in Android 7.0 from segfaulting due to
+# dereferencing a null pointer when checking if the /data fstab entry has the
+# "forcefdeorfbe" vold option. (See cryptfs_isConvertibleToFBE() in
+# system/vold/cryptfs.c.)
 
-    while ((read = getline(&line, &len, fp_old.get())) >= 0) {
-        if (strstr(line, "import /init.multiboot.rc")) {
-            has_init_multiboot_rc = true;
-        }
+/dev/null /data auto defaults voldmanaged=dummy:auto
+)EOF", fp_fstab.get());
 
-        if (enable_appsync) {
-            if (mb::starts_with(line, "service")) {
-                inside_service = strstr(line, "installd") != nullptr;
-            } else if (inside_service && is_completely_whitespace(line)) {
-                inside_service = false;
-            }
+    return true;
+}
 
-            if (inside_service && strstr(line, "disabled")) {
-                has_disabled_installd = true;
+// Load /init.multiboot.rc and disable installd if appsync will spawn it
+static void add_mbtool_services_rewrite(RcFile &file, bool enable_appsync)
+{
+    if (!file.contains("import /init.multiboot.rc")) {
+        for (size_t i = 0; i < file.lines.size(); ++i) {
+            if (file.lines[i].text[0] != '#') {
+                file.insert(i, "import /init.multiboot.rc");
+                break;
             }
         }
     }
 
-    rewind(fp_old.get());
+    if (!enable_appsync) {
+        return;
+    }
 
-    while ((read = getline(&line, &len, fp_old.get())) >= 0) {
-        // Load /init.multiboot.rc
-        if (!has_init_multiboot_rc && line[0] != '#') {
-            has_init_multiboot_rc = true;
-            fputs("import /init.multiboot.rc\n", fp_new.get());
+    for (size_t i = 0; i < file.lines.size(); ++i) {
+        auto const &tokens = file.lines[i].tokens;
+        if (tokens.size() < 2 || tokens[0] != "service"
+                || tokens[1] != "installd") {
+            continue;
         }
 
-        if (fwrite(line, 1, read, fp_new.get()) != (std::size_t) read) {
-            LOGE("Failed to write to /init.rc.new: %s", strerror(errno));
-            return false;
+        bool disabled = false;
+        size_t end = i + 1;
+
+        for (; end < file.lines.size()
+                && file.lines[end].section == static_cast<long>(i); ++end) {
+            auto const &option = file.lines[end].tokens;
+            if (!option.empty() && option[0] == "disabled") {
+                disabled = true;
+            }
         }
 
-        // Disable installd. mbtool's appsync will spawn it on demand
-        if (enable_appsync
-                && !has_disabled_installd
-                && mb::starts_with(line, "service")
-                && strstr(line, "installd")) {
-            fputs("    disabled\n", fp_new.get());
+        // mbtool's appsync will spawn installd on demand
+        if (!disabled) {
+            file.insert(i + 1, "    disabled");
         }
+        break;
     }
+}
 
-    if (!replace_file("/init.rc", "/init.rc.new")) {
-        return false;
+// Mounting is handled by mbtool
+static void strip_manual_mounts_rewrite(RcFile &file)
+{
+    for (size_t i = 0; i < file.lines.size(); ++i) {
+        auto const &tokens = file.lines[i].tokens;
+        if (tokens.size() >= 4 && tokens[0] == "mount"
+                && (tokens[3] == "/system"
+                || tokens[3] == "/cache"
+                || tokens[3] == "/data")) {
+            file.comment_out(i);
+        }
     }
+}
 
-    // Create /init.multiboot.rc
+static bool write_multiboot_rc(bool enable_appsync)
+{
     autoclose::file fp_multiboot(autoclose::fopen("/init.multiboot.rc", "wb"));
     if (!fp_multiboot) {
         LOGE("Failed to open /init.multiboot.rc for writing: %s",
@@ -539,113 +673,30 @@ static bool add_mbtool_services(bool enable_appsync)
     return true;
 }
 
-static bool write_fstab_hack(const char *fstab)
-{
-    autoclose::file fp_fstab(autoclose::fopen(fstab, "abe"));
-    if (!fp_fstab) {
-        LOGE("%s: Failed to open for writing: %s",
-             fstab, strerror(errno));
-        return false;
-    }
-
-    fputs(R"EOF(
-# The following is added to prevent vold in Android 7.0 from segfaulting due to
-# dereferencing a null pointer when checking if the /data fstab entry has the
-# "forcefdeorfbe" vold option. (See cryptfs_isConvertibleToFBE() in
-# system/vold/cryptfs.c.)
-
-/dev/null /data auto defaults voldmanaged=dummy:auto
-)EOF", fp_fstab.get());
-
-    return true;
-}
-
-static bool strip_manual_mounts()
+/*!
+ * \brief Apply all of mbtool's edits to the ramdisk's rc files
+ *
+ * Every rc file is read and written at most once regardless of how many edits
+ * apply to it.
+ */
+static bool rewrite_rc_files(bool enable_appsync)
 {
-    autoclose::dir dir(autoclose::opendir("/"));
-    if (!dir) {
-        return true;
-    }
+    MB_TIMELINE_SCOPE("init.rewrite_rc_files");
 
-    struct dirent *ent;
-    while ((ent = readdir(dir.get()))) {
-        // Look for *.rc files
-        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0
-                || !mb::ends_with(ent->d_name, ".rc")) {
-            continue;
-        }
-
-        std::string path("/");
-        path += ent->d_name;
-
-        autoclose::file fp(autoclose::fopen(path.c_str(), "r"));
-        if (!fp) {
-            LOGE("Failed to open %s for reading: %s",
-                 path.c_str(), strerror(errno));
-            continue;
-        }
-
-        char *line = nullptr;
-        size_t len = 0;
-        ssize_t read = 0;
-
-        auto free_line = util::finally([&]{
-            free(line);
-        });
-
-        std::size_t count = 0;
-        std::unordered_set<std::size_t> comment_out;
-
-        // Find out which lines need to be commented out
-        while ((read = getline(&line, &len, fp.get())) >= 0) {
-            if (strstr(line, "mount")
-                    && (strstr(line, "/system")
-                    || strstr(line, "/cache")
-                    || strstr(line, "/data"))) {
-                std::vector<std::string> tokens = util::tokenize(line, " \t\n");
-                if (tokens.size() >= 4 && tokens[0] == "mount"
-                        && (tokens[3] == "/system"
-                        || tokens[3] == "/cache"
-                        || tokens[3] == "/data")) {
-                    comment_out.insert(count);
-                }
-            }
-
-            ++count;
-        }
-
-        if (comment_out.empty()) {
-            continue;
-        }
-
-        // Go back to beginning of file for reread
-        rewind(fp.get());
-        count = 0;
-
-        std::string new_path(path);
-        new_path += ".new";
-
-        autoclose::file fp_new(autoclose::fopen(new_path.c_str(), "w"));
-        if (!fp_new) {
-            LOGE("Failed to open %s for writing: %s",
-                 new_path.c_str(), strerror(errno));
-            continue;
-        }
-
-        // Actually comment out the lines
-        while ((read = getline(&line, &len, fp.get())) >= 0) {
-            if (comment_out.find(count) != comment_out.end()) {
-                fputs("#", fp_new.get());
-            }
-            fputs(line, fp_new.get());
+    RcRewriter rewriter;
+    rewriter.add("/init.rc", [enable_appsync](RcFile &file) {
+        add_mbtool_services_rewrite(file, enable_appsync);
+    });
+    rewriter.add(&strip_manual_mounts_rewrite);
 
-            ++count;
-        }
+    bool ret = rewriter.run("/");
 
-        replace_file(path.c_str(), new_path.c_str());
+    // Only create /init.multiboot.rc if /init.rc imports it
+    if (access("/init.rc", F_OK) == 0) {
+        ret = write_multiboot_rc(enable_appsync) && ret;
     }
 
-    return true;
+    return ret;
 }
 
 static std::string encode_list(const std::vector<std::string> &list)
@@ -670,8 +721,12 @@ static std::string encode_list(const std::vector<std::string> &list)
     return result;
 }
 
-static bool add_props_to_default_prop(const Device &device)
+static bool add_props_to_default_prop(const BootEnv &env)
 {
+    const Device &device = env.device();
+
+    MB_TIMELINE_SCOPE("init.add_props_to_default_prop");
+
     autoclose::file fp(autoclose::fopen(DEFAULT_PROP_PATH, "r+b"));
     if (!fp) {
         if (errno == ENOENT) {
@@ -698,7 +753,7 @@ static bool add_props_to_default_prop(const Device &device)
     // Write version property
     fprintf(fp.get(), PROP_MULTIBOOT_VERSION "=%s\n", version());
     // Write ROM ID property
-    fprintf(fp.get(), PROP_MULTIBOOT_ROM_ID "=%s\n", get_rom_id().c_str());
+    fprintf(fp.get(), PROP_MULTIBOOT_ROM_ID "=%s\n", env.rom_id().c_str());
 
     // Block device paths (deprecated)
     fprintf(fp.get(), "ro.patcher.blockdevs.base=%s\n",
@@ -721,6 +776,8 @@ static bool add_props_to_default_prop(const Device &device)
 
 static bool symlink_base_dir(const Device &device)
 {
+    MB_TIMELINE_SCOPE("init.symlink_base_dir");
+
     struct stat sb;
     if (stat(UNIVERSAL_BY_NAME_DIR, &sb) == 0) {
         return true;
@@ -743,18 +800,18 @@ static bool symlink_base_dir(const Device &device)
     return false;
 }
 
-static std::string find_fstab()
+static std::string find_fstab(const BootEnv &env)
 {
+    MB_TIMELINE_SCOPE("init.find_fstab");
+
     struct stat sb;
 
     // Try using androidboot.hardware as the fstab suffix since most devices
     // follow this scheme.
     std::string fstab("/fstab.");
-    std::string hardware;
-    hardware = util::property_get_string("ro.hardware", "");
-    fstab += hardware;
+    fstab += env.hardware();
 
-    if (!hardware.empty() && stat(fstab.c_str(), &sb) == 0) {
+    if (stat(fstab.c_str(), &sb) == 0) {
         return fstab;
     }
 
@@ -819,11 +876,7 @@ static std::string find_fstab()
             fstab = ptr;
 
             // Replace ${ro.hardware}
-            if (fstab.find("${ro.hardware}") != std::string::npos) {
-                std::string hardware;
-                util::kernel_cmdline_get_option("androidboot.hardware", &hardware);
-                util::replace_all(&fstab, "${ro.hardware}", hardware);
-            }
+            util::replace_all(&fstab, "${ro.hardware}", env.hardware());
 
             LOGD("Found fstab during search: %s", fstab.c_str());
 
@@ -861,6 +914,8 @@ static unsigned long get_api_version()
 
 static bool create_layout_version()
 {
+    MB_TIMELINE_SCOPE("init.create_layout_version");
+
     // Prevent installd from dying because it can't unmount /data/media for
     // multi-user migration. Since <= 4.2 devices aren't supported anyway,
     // we'll bypass this.
@@ -893,13 +948,17 @@ static bool create_layout_version()
 
 static bool disable_spota()
 {
+    MB_TIMELINE_SCOPE("init.disable_spota");
+
     static const char *spota_dir = "/data/security/spota";
 
-    std::unordered_map<std::string, std::string> props;
-    util::property_file_get_all("/system/build.prop", props);
+    util::PropertyFile props;
+    props.open("/system/build.prop");
 
-    if (strcasecmp(props["ro.product.manufacturer"].c_str(), "samsung") != 0
-            && strcasecmp(props["ro.product.brand"].c_str(), "samsung") != 0) {
+    if (strcasecmp(props.get_string("ro.product.manufacturer", {}).c_str(),
+                   "samsung") != 0
+            && strcasecmp(props.get_string("ro.product.brand", {}).c_str(),
+                          "samsung") != 0) {
         // Not a Samsung device
         LOGV("Not mounting empty tmpfs over: %s", spota_dir);
         return true;
@@ -922,80 +981,22 @@ static bool disable_spota()
 
 static bool extract_zip(const char *source, const char *target)
 {
-    unzFile uf;
-    zlib_filefunc64_def zFunc;
-    ourbuffer_t iobuf;
-
-    memset(&zFunc, 0, sizeof(zFunc));
-    memset(&iobuf, 0, sizeof(iobuf));
-
-    fill_android_filefunc64(&iobuf.filefunc64);
-    fill_buffer_filefunc64(&zFunc, &iobuf);
-
-    uf = unzOpen2_64(source, &zFunc);
-    if (!uf) {
-        LOGE("%s: Failed to open zip", source);
-        return false;
-    }
-
-    auto close_zip = util::finally([&]{
-        unzClose(uf);
-    });
+    ZipIndex zip;
 
-    if (unzLocateFile(uf, "exec", nullptr) != UNZ_OK) {
-        LOGE("%s: Failed to find 'exec' in zip", source);
+    if (!zip.open(source)) {
         return false;
     }
 
-    if (unzOpenCurrentFile(uf) != UNZ_OK) {
-        LOGE("%s: Failed to open file in zip", source);
-        return false;
-    }
-
-    auto close_inner_file = util::finally([&]{
-        unzCloseCurrentFile(uf);
-    });
-
     std::string target_file(target);
     target_file += "/exec";
 
-    util::mkdir_recursive(target, 0755);
-
-    FILE *fp = fopen(target_file.c_str(), "wb");
-    if (!fp) {
-        LOGE("%s: Failed to open for writing: %s",
-             target_file.c_str(), strerror(errno));
-        return false;
-    }
-
-    char buf[8192];
-    int bytes_read;
-
-    while ((bytes_read = unzReadCurrentFile(uf, buf, sizeof(buf))) > 0) {
-        size_t bytes_written = fwrite(buf, 1, bytes_read, fp);
-        if (bytes_written == 0) {
-            bool ret = !ferror(fp);
-            fclose(fp);
-            return ret;
-        }
-    }
-    if (bytes_read != 0) {
-        LOGE("%s: Failed before reaching inner file's EOF", source);
-        fclose(fp);
-        return false;
-    }
-
-    if (fclose(fp) < 0) {
-        LOGE("%s: Error when closing file: %s",
-             target_file.c_str(), strerror(errno));
-        return false;
-    }
-
-    return true;
+    return zip.extract("exec", target_file);
 }
 
-static bool launch_boot_menu()
+static bool launch_boot_menu(const BootEnv &env)
 {
+    MB_TIMELINE_SCOPE("init.launch_boot_menu");
+
     struct stat sb;
     bool skip = false;
 
@@ -1003,13 +1004,11 @@ static bool launch_boot_menu()
         std::string skip_rom;
         util::file_first_line(BOOT_UI_SKIP_PATH, &skip_rom);
 
-        std::string rom_id = get_rom_id();
-
-        if (skip_rom == rom_id) {
+        if (skip_rom == env.rom_id()) {
             LOGV("Performing one-time skipping of Boot UI");
             skip = true;
         } else {
-            LOGW("Skip file is not for: %s", rom_id.c_str());
+            LOGW("Skip file is not for: %s", env.rom_id().c_str());
             LOGW("Not skipping boot UI");
         }
     }
@@ -1102,13 +1101,48 @@ static void run_adb()
 }
 #endif
 
-static bool critical_failure()
+/*!
+ * \brief Stop recording the boot timeline and save it
+ *
+ * The timeline is written to the kernel log and, if the data partition is
+ * mounted, to BOOT_TIMELINE_PATH. Failing to save it does not affect the boot.
+ */
+static void write_boot_timeline()
+{
+    util::timeline_stop();
+    util::timeline_dump_to_log();
+
+    std::string path = get_raw_path(BOOT_TIMELINE_PATH);
+    if (util::timeline_dump_to_file(path)) {
+        LOGV("Wrote boot timeline to %s", path.c_str());
+    }
+}
+
+/*!
+ * \brief Save the counters of init's work (uevents, mounts, etc.)
+ *
+ * The counters are added to MULTIBOOT_COUNTERS, which resets them for the new
+ * boot. Processes started later (eg. the daemon) add to the same counters.
+ */
+static void save_boot_counters()
 {
+    std::string path = get_raw_path(MULTIBOOT_COUNTERS);
+    if (util::counters_attach(path)) {
+        LOGV("Saved counters to %s", path.c_str());
+    }
+}
+
+static bool critical_failure(const BootEnv &env)
+{
+    // Keep the timeline and counters of the failed boot
+    write_boot_timeline();
+    save_boot_counters();
+
 #if RUN_ADB_BEFORE_EXEC_OR_REBOOT
     run_adb();
 #endif
 
-    return emergency_reboot();
+    return emergency_reboot(env.device_loaded() ? &env.device() : nullptr);
 }
 
 int init_main(int argc, char *argv[])
@@ -1142,6 +1176,10 @@ int init_main(int argc, char *argv[])
         }
     }
 
+    // Record how long each step takes. This is written to the log and to
+    // BOOT_TIMELINE_PATH before the real init is launched.
+    util::timeline_start();
+
     // Mount base directories
     mkdir("/dev", 0755);
     mkdir("/proc", 0755);
@@ -1173,126 +1211,197 @@ int init_main(int argc, char *argv[])
     LOGV("Booting up with version %s (%s)",
          version(), git_version());
 
-    std::vector<unsigned char> contents;
-    util::file_read_all(DEVICE_JSON_PATH, &contents);
-    contents.push_back('\0');
+    // Read the kernel command line, device definition, and ROM ID once for all
+    // of the steps below
+    BootEnv env;
+    bool env_valid = env.load();
+
+    std::string fstab;
+    std::shared_ptr<Rom> rom;
+    RomConfig config;
+
+    // Independent steps run in parallel. Each step lists the steps whose
+    // results it needs (eg. mounted partitions, a loaded policy, or files that
+    // both of them modify).
+    TaskGraph tasks;
 
     // Start probing for devices so we have somewhere to write logs for
     // critical_failure()
-    device_init(false);
+    tasks.add("device_init", {}, [&] {
+        std::string bootdevice;
+        env.cmdline_option("androidboot.bootdevice", &bootdevice);
+        device_init(false, bootdevice.c_str());
+        return true;
+    });
 
-    Device device;
-    JsonError error;
+    // Fail only after device_init has started so that critical_failure() can
+    // find somewhere to write the logs
+    tasks.add("check_device", {}, [&] {
+        return env_valid;
+    });
 
-    if (!device_from_json(
-            reinterpret_cast<char *>(contents.data()), device, error)) {
-        LOGE("%s: Failed to load device definition", DEVICE_JSON_PATH);
-        critical_failure();
-        return EXIT_FAILURE;
-    } else if (device.validate()) {
-        LOGE("%s: Device definition validation failed", DEVICE_JSON_PATH);
-        critical_failure();
-        return EXIT_FAILURE;
-    }
+    tasks.add("create_rom", {}, [&] {
+        rom = Roms::create_rom(env.rom_id());
+        if (!rom) {
+            LOGE("Unknown ROM ID: %s", env.rom_id().c_str());
+            return false;
+        }
+
+        LOGV("ROM ID is: %s", env.rom_id().c_str());
+        return true;
+    });
+
+    // Only touches the ramdisk's file_contexts
+    tasks.add("fix_file_contexts", {}, [] {
+        if (access(FILE_CONTEXTS, R_OK) == 0) {
+            fix_file_contexts(FILE_CONTEXTS);
+        }
+        return true;
+    });
 
     // Symlink by-name directory to /dev/block/by-name (ugh... ASUS)
-    symlink_base_dir(device);
+    tasks.add("symlink_base_dir", { "device_init", "check_device" }, [&] {
+        symlink_base_dir(env.device());
+        return true;
+    });
 
-    add_props_to_default_prop(device);
+    tasks.add("default_prop", { "check_device" }, [&] {
+        add_props_to_default_prop(env);
+        return true;
+    });
 
     // initialize properties
-    properties_setup();
+    tasks.add("properties", { "default_prop" }, [&] {
+        properties_setup(env);
+        return true;
+    });
 
-    std::string fstab(find_fstab());
+    tasks.add("find_fstab", {}, [&] {
+        fstab = find_fstab(env);
 
-    LOGV("fstab file: %s", fstab.c_str());
+        LOGV("fstab file: %s", fstab.c_str());
 
-    if (access(fstab.c_str(), R_OK) < 0) {
-        LOGW("%s: Failed to access file: %s", fstab.c_str(), strerror(errno));
-        LOGW("Continuing anyway...");
-        fstab = "/fstab.MBTOOL_DUMMY_DO_NOT_USE";
-        util::create_empty_file(fstab);
-    }
-
-    // Get ROM ID from /romid
-    std::string rom_id = get_rom_id();
-    std::shared_ptr<Rom> rom = Roms::create_rom(rom_id);
-    if (!rom) {
-        LOGE("Unknown ROM ID: %s", rom_id.c_str());
-        critical_failure();
-        return EXIT_FAILURE;
-    }
+        if (access(fstab.c_str(), R_OK) < 0) {
+            LOGW("%s: Failed to access file: %s",
+                 fstab.c_str(), strerror(errno));
+            LOGW("Continuing anyway...");
+            fstab = "/fstab.MBTOOL_DUMMY_DO_NOT_USE";
+            util::create_empty_file(fstab);
+        }
 
-    LOGV("ROM ID is: %s", rom_id.c_str());
+        return true;
+    });
 
     // Mount system, cache, and external SD from fstab file
-    int flags = MOUNT_FLAG_REWRITE_FSTAB
-            | MOUNT_FLAG_MOUNT_SYSTEM
-            | MOUNT_FLAG_MOUNT_CACHE
-            | MOUNT_FLAG_MOUNT_DATA
-            | MOUNT_FLAG_MOUNT_EXTERNAL_SD;
-    if (!mount_fstab(fstab.c_str(), rom, device, flags)) {
-        LOGE("Failed to mount fstab");
-        critical_failure();
-        return EXIT_FAILURE;
-    }
+    tasks.add("mount_fstab", {
+        "device_init", "symlink_base_dir", "create_rom", "find_fstab"
+    }, [&] {
+        int flags = MOUNT_FLAG_REWRITE_FSTAB
+                | MOUNT_FLAG_MOUNT_SYSTEM
+                | MOUNT_FLAG_MOUNT_CACHE
+                | MOUNT_FLAG_MOUNT_DATA
+                | MOUNT_FLAG_MOUNT_EXTERNAL_SD;
+        if (!mount_fstab(fstab.c_str(), rom, env.device(), flags)) {
+            LOGE("Failed to mount fstab");
+            return false;
+        }
 
-    LOGV("Successfully mounted fstab");
+        LOGV("Successfully mounted fstab");
+        return true;
+    });
 
-    if (!launch_boot_menu()) {
-        LOGE("Failed to run boot menu");
-        // Continue anyway since boot menu might not run on every device
-    }
+    // Must come after mount_fstab rewrites the fstab
+    tasks.add("write_fstab_hack", { "mount_fstab" }, [&] {
+        write_fstab_hack(fstab.c_str());
+        return true;
+    });
 
-    // Mount selinuxfs
-    selinux_mount();
-    // Load pre-boot policy
-    patch_sepolicy(SELINUX_DEFAULT_POLICY_FILE, SELINUX_LOAD_FILE,
-                   SELinuxPatch::PRE_BOOT);
+    tasks.add("boot_menu", { "mount_fstab" }, [&] {
+        if (!launch_boot_menu(env)) {
+            LOGE("Failed to run boot menu");
+            // Continue anyway since boot menu might not run on every device
+        }
+        return true;
+    });
+
+    tasks.add("pre_boot_policy", { "boot_menu" }, [] {
+        // Mount selinuxfs
+        selinux_mount();
+        // Load pre-boot policy
+        patch_sepolicy_cached(SELINUX_DEFAULT_POLICY_FILE, SELINUX_LOAD_FILE,
+                              SELinuxPatch::PRE_BOOT);
+        return true;
+    });
 
     // Mount ROM (bind mount directory or mount images, etc.)
-    if (!mount_rom(rom)) {
-        LOGE("Failed to mount ROM directories and images");
-        critical_failure();
-        return EXIT_FAILURE;
-    }
+    tasks.add("mount_rom", { "pre_boot_policy" }, [&] {
+        if (!mount_rom(rom)) {
+            LOGE("Failed to mount ROM directories and images");
+            return false;
+        }
+        return true;
+    });
 
-    std::string config_path(rom->config_path());
-    RomConfig config;
-    if (!config.load_file(config_path)) {
-        LOGW("%s: Failed to load config for ROM %s",
-             config_path.c_str(), rom->id.c_str());
-    }
+    tasks.add("load_config", { "mount_rom" }, [&] {
+        RomMetadata metadata;
+        rom_metadata_get(rom, metadata);
+        if (metadata.has_config) {
+            config = std::move(metadata.config);
+        } else {
+            LOGW("%s: Failed to load config for ROM %s",
+                 rom->config_path().c_str(), rom->id.c_str());
+        }
+
+        LOGD("Enable appsync: %d", config.indiv_app_sharing);
+        return true;
+    });
 
-    LOGD("Enable appsync: %d", config.indiv_app_sharing);
+    // Needs libpcre from the ROM's /system
+    tasks.add("fix_binary_file_contexts", { "mount_rom" }, [] {
+        if (access(FILE_CONTEXTS_BIN, R_OK) == 0) {
+            fix_binary_file_contexts(FILE_CONTEXTS_BIN);
+        }
+        return true;
+    });
 
-    // Make runtime ramdisk modifications
-    if (access(FILE_CONTEXTS, R_OK) == 0) {
-        fix_file_contexts(FILE_CONTEXTS);
-    }
-    if (access(FILE_CONTEXTS_BIN, R_OK) == 0) {
-        fix_binary_file_contexts(FILE_CONTEXTS_BIN);
-    }
-    write_fstab_hack(fstab.c_str());
-    add_mbtool_services(config.indiv_app_sharing);
-    strip_manual_mounts();
+    // Adds mbtool's services and strips manual mounts from the rc files
+    tasks.add("rewrite_rc_files", { "load_config" }, [&] {
+        rewrite_rc_files(config.indiv_app_sharing);
+        return true;
+    });
 
     // Data modifications
-    create_layout_version();
+    tasks.add("layout_version", { "mount_rom" }, [] {
+        create_layout_version();
+        return true;
+    });
 
     // Disable spota
-    disable_spota();
+    tasks.add("disable_spota", { "mount_rom" }, [] {
+        disable_spota();
+        return true;
+    });
 
-    // Patch SELinux policy
-    struct stat sb;
-    if (stat(SELINUX_DEFAULT_POLICY_FILE, &sb) == 0) {
-        if (!patch_sepolicy(SELINUX_DEFAULT_POLICY_FILE,
-                            SELINUX_DEFAULT_POLICY_FILE,
-                            SELinuxPatch::MAIN)) {
-            LOGW("Failed to patch " SELINUX_DEFAULT_POLICY_FILE);
-            critical_failure();
-            return EXIT_FAILURE;
+    // Patch SELinux policy. This reads the policy file after the pre-boot
+    // policy was loaded from it and checks the context of /data/media.
+    tasks.add("main_policy", { "mount_rom" }, [] {
+        struct stat sb;
+        if (stat(SELINUX_DEFAULT_POLICY_FILE, &sb) == 0) {
+            if (!patch_sepolicy_cached(SELINUX_DEFAULT_POLICY_FILE,
+                                       SELINUX_DEFAULT_POLICY_FILE,
+                                       SELinuxPatch::MAIN)) {
+                LOGW("Failed to patch " SELINUX_DEFAULT_POLICY_FILE);
+                return false;
+            }
         }
+        return true;
+    });
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (!tasks.run(std::min(cpus > 0 ? static_cast<unsigned int>(cpus) : 1u,
+                            INIT_MAX_THREADS))) {
+        critical_failure(env);
+        return EXIT_FAILURE;
     }
 
     // Kill uevent thread and close uevent socket
@@ -1301,6 +1410,9 @@ int init_main(int argc, char *argv[])
     // Kill properties service and clean up
     properties_cleanup();
 
+    write_boot_timeline();
+    save_boot_counters();
+
     // Remove mbtool init symlink and restore original binary
     unlink("/init");
     rename("/init.orig", "/init");
@@ -1322,11 +1434,13 @@ int init_main(int argc, char *argv[])
     //rmdir("/proc");
     //rmdir("/sys");
 
+    MB_TRACE_DUMP();
+
     // Start real init
     LOGD("Launching real init ...");
     execlp("/init", "/init", nullptr);
     LOGE("Failed to exec real init: %s", strerror(errno));
-    critical_failure();
+    critical_failure(env);
     return EXIT_FAILURE;
 }
 
@@ -18,6 +18,9 @@
 #include "initwrapper/cutils/uevent.h"
 
 #include <cerrno>
+#include <cstring>
+#include <vector>
+
 #include <strings.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -47,6 +50,45 @@ ssize_t uevent_kernel_multicast_uid_recv(int socket, void *buffer, size_t length
     return uevent_kernel_recv(socket, buffer, length, true, uid);
 }
 
+/**
+ * Checks that a received netlink message actually originates from the kernel.
+ * On failure, "uid" is set to the uid of the socket's peer (or -1 if it cannot
+ * be determined).
+ */
+static bool uevent_check_sender(struct msghdr *hdr, bool require_group,
+                                uid_t *uid)
+{
+    struct sockaddr_nl *addr = (struct sockaddr_nl *) hdr->msg_name;
+    struct cmsghdr *cmsg;
+    struct ucred *cred;
+
+    *uid = -1;
+
+    cmsg = CMSG_FIRSTHDR(hdr);
+    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
+        // Ignoring netlink message with no sender credentials
+        return false;
+    }
+
+    cred = (struct ucred *) CMSG_DATA(cmsg);
+    *uid = cred->uid;
+    if (cred->uid != 0) {
+        // Ignoring netlink message from non-root user
+        return false;
+    }
+
+    if (addr->nl_pid != 0) {
+        // Ignore non-kernel
+        return false;
+    }
+    if (require_group && addr->nl_groups == 0) {
+        // Ignore unicast messages when requested
+        return false;
+    }
+
+    return true;
+}
+
 ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require_group, uid_t *uid)
 {
     struct iovec iov = { buffer, length };
@@ -68,38 +110,68 @@ ssize_t uevent_kernel_recv(int socket, void *buffer, size_t length, bool require
         return n;
     }
 
-    struct cmsghdr *cmsg;
-    struct ucred *cred;
-
-    cmsg = CMSG_FIRSTHDR(&hdr);
-    if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
-        // Ignoring netlink message with no sender credentials
-        goto out;
+    if (!uevent_check_sender(&hdr, require_group, uid)) {
+        // Clear residual potentially malicious data
+        bzero(buffer, length);
+        errno = EIO;
+        return -1;
     }
 
-    cred = (struct ucred *) CMSG_DATA(cmsg);
-    *uid = cred->uid;
-    if (cred->uid != 0) {
-        // Ignoring netlink message from non-root user
-        goto out;
+    return n;
+}
+
+/**
+ * Like uevent_kernel_multicast_recv(), but receives up to "count" messages
+ * with a single recvmmsg() call. Message i is stored at buffer + i * length
+ * and its size is stored in sizes[i].
+ *
+ * Messages that do not originate from the kernel are cleared and have their
+ * size set to -1, but do not stop the remaining messages from being returned.
+ *
+ * Returns the number of messages received or -1 on error. If the socket is
+ * non-blocking and no messages are pending, -1 is returned with errno set to
+ * EAGAIN.
+ */
+int uevent_kernel_multicast_recv_batch(int socket, void *buffer, size_t length,
+                                       ssize_t *sizes, unsigned int count)
+{
+    std::vector<struct mmsghdr> msgs(count);
+    std::vector<struct iovec> iovs(count);
+    std::vector<struct sockaddr_nl> addrs(count);
+    std::vector<char> controls(count * CMSG_SPACE(sizeof(struct ucred)));
+
+    for (unsigned int i = 0; i < count; ++i) {
+        iovs[i].iov_base = static_cast<char *>(buffer) + i * length;
+        iovs[i].iov_len = length;
+
+        struct msghdr &hdr = msgs[i].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &addrs[i];
+        hdr.msg_namelen = sizeof(addrs[i]);
+        hdr.msg_iov = &iovs[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = &controls[i * CMSG_SPACE(sizeof(struct ucred))];
+        hdr.msg_controllen = CMSG_SPACE(sizeof(struct ucred));
     }
 
-    if (addr.nl_pid != 0) {
-        // Ignore non-kernel
-        goto out;
+    int n = recvmmsg(socket, msgs.data(), count, MSG_DONTWAIT, nullptr);
+    if (n <= 0) {
+        return n;
     }
-    if (require_group && addr.nl_groups == 0) {
-        // Ignore unicast messages when requested
-        goto out;
+
+    for (int i = 0; i < n; ++i) {
+        uid_t uid;
+
+        if (uevent_check_sender(&msgs[i].msg_hdr, true, &uid)) {
+            sizes[i] = msgs[i].msg_len;
+        } else {
+            // Clear residual potentially malicious data
+            bzero(iovs[i].iov_base, length);
+            sizes[i] = -1;
+        }
     }
 
     return n;
-
-out:
-    // Clear residual potentially malicious data
-    bzero(buffer, length);
-    errno = EIO;
-    return -1;
 }
 
 int uevent_open_socket(int buf_sz, bool passcred)
@@ -17,8 +17,15 @@
 
 #include "initwrapper/devices.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
 
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 
@@ -34,9 +41,12 @@
 #include "mbcommon/common.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/cmdline.h"
+#include "mbutil/blkid.h"
+#include "mbutil/counters.h"
 #include "mbutil/directory.h"
+#include "mbutil/path.h"
 #include "mbutil/string.h"
+#include "mbutil/trace.h"
 #include "mbutil/external/system_properties.h"
 
 #include "initwrapper/cutils/uevent.h"
@@ -66,15 +76,40 @@ struct uevent {
 };
 
 struct platform_node {
-    char *name;
-    char *path;
-    int path_len;
+    std::string path;
+    std::string name;
+    bool is_bootdevice;
 };
 
-static std::vector<platform_node> platform_names;
+// Platform devices keyed by their sysfs path
+static std::unordered_map<std::string, platform_node> platform_devices;
 
 static std::unordered_map<std::string, BlockDevInfo> block_dev_mappings;
+// Copy of block_dev_mappings handed out by get_block_dev_mappings(). Reset
+// whenever the mappings change and only rebuilt when it is next requested.
+static std::shared_ptr<const std::unordered_map<std::string, BlockDevInfo>>
+        block_dev_mappings_snapshot;
 static std::mutex block_dev_mappings_guard;
+// Signalled after each block device event has been handled
+static std::condition_variable block_dev_mappings_cv;
+static uint64_t block_dev_generation = 0;
+
+// Owns the message that the parsed uevent points into
+struct queued_uevent {
+    std::unique_ptr<char[]> msg;
+    struct uevent uevent;
+};
+
+static std::deque<queued_uevent> event_queue;
+static std::mutex event_queue_guard;
+static std::condition_variable event_queue_cv;
+static std::condition_variable events_handled_cv;
+static uint64_t events_queued = 0;
+static uint64_t events_handled = 0;
+static uint64_t flush_target = 0;
+static bool flush_done = false;
+static bool run_event_thread = true;
+static pthread_t handler_thread;
 
 static mode_t get_device_perm(const char *path,
                               const std::vector<std::string> &links,
@@ -122,7 +157,6 @@ static void make_device(const char *path,
 
 static void add_platform_device(const char *path)
 {
-    int path_len = strlen(path);
     const char *name = path;
 
     if (strncmp(path, "/devices/", 9) == 0) {
@@ -136,30 +170,35 @@ static void add_platform_device(const char *path)
     LOGI("Adding platform device %s (%s)", name, path);
 #endif
 
-    platform_names.emplace_back();
-    struct platform_node &bus = platform_names.back();
-    bus.path = strdup(path);
-    bus.path_len = path_len;
-    bus.name = bus.path + (name - path);
+    platform_node &bus = platform_devices[path];
+    bus.path = path;
+    bus.name = name;
+    bus.is_bootdevice = bootdevice[0] != '\0' && strstr(name, bootdevice);
 }
 
 /*
- * Given a path that may start with a platform device, find the length of the
- * platform device prefix.  If it doesn't start with a platform device, return
- * 0.
+ * Given a path that may start with platform devices, find the platform devices
+ * that it is under, starting with the closest one. This only needs one lookup
+ * per path component instead of a scan of all the platform devices.
  */
-static std::vector<struct platform_node *> find_platform_devices(const char *path)
+static std::vector<const struct platform_node *>
+find_platform_devices(const char *path)
 {
-    std::vector<struct platform_node *> nodes;
-    int path_len = strlen(path);
+    std::vector<const struct platform_node *> nodes;
+
+    if (platform_devices.empty()) {
+        return nodes;
+    }
+
+    std::string prefix(path);
 
-    for (auto it = platform_names.rbegin(); it != platform_names.rend(); ++it) {
-        struct platform_node &bus = *it;
+    for (size_t pos = prefix.rfind('/'); pos != std::string::npos && pos > 0;
+            pos = prefix.rfind('/', pos - 1)) {
+        prefix.resize(pos);
 
-        if ((bus.path_len < path_len) &&
-                (path[bus.path_len] == '/') &&
-                strncmp(path, bus.path, bus.path_len) == 0) {
-            nodes.push_back(&bus);
+        auto it = platform_devices.find(prefix);
+        if (it != platform_devices.end()) {
+            nodes.push_back(&it->second);
         }
     }
 
@@ -168,17 +207,12 @@ static std::vector<struct platform_node *> find_platform_devices(const char *pat
 
 static void remove_platform_device(const char *path)
 {
-    for (auto it = platform_names.rbegin(); it != platform_names.rend(); ++it) {
-        const struct platform_node &bus = *it;
-
-        if (strcmp(path, bus.path) == 0) {
+    auto it = platform_devices.find(path);
+    if (it != platform_devices.end()) {
 #if UEVENT_LOGGING
-            LOGI("Removing platform device %s", bus.name);
+        LOGI("Removing platform device %s", it->second.name.c_str());
 #endif
-            free(bus.path);
-            platform_names.erase((it + 1).base());
-            return;
-        }
+        platform_devices.erase(it);
     }
 }
 
@@ -332,7 +366,7 @@ static std::vector<std::string> get_character_device_symlinks(struct uevent *uev
     const char *parent;
     const char *slash;
     int width;
-    std::vector<struct platform_node *> pdevs;
+    std::vector<const struct platform_node *> pdevs;
 
     pdevs = find_platform_devices(uevent->path);
     if (pdevs.empty()) {
@@ -341,9 +375,9 @@ static std::vector<std::string> get_character_device_symlinks(struct uevent *uev
 
     std::vector<std::string> links;
 
-    for (struct platform_node *pdev : pdevs) {
+    for (const struct platform_node *pdev : pdevs) {
         // Skip "/devices/platform/<driver>"
-        parent = strchr(uevent->path + pdev->path_len, '/');
+        parent = strchr(uevent->path + pdev->path.size(), '/');
         if (!parent) {
             continue;
         }
@@ -369,8 +403,10 @@ static std::vector<std::string> get_character_device_symlinks(struct uevent *uev
             links.push_back(mb::format("/dev/usb/%s%.*s",
                                        uevent->subsystem, width, parent));
 
-            if (!dry_run) {
-                mkdir("/dev/usb", 0755);
+            static bool usb_dir_created = false;
+            if (!dry_run && !usb_dir_created) {
+                usb_dir_created = mkdir("/dev/usb", 0755) == 0
+                        || errno == EEXIST;
             }
         }
     }
@@ -381,7 +417,8 @@ static std::vector<std::string> get_character_device_symlinks(struct uevent *uev
 static std::vector<std::string> get_block_device_symlinks(struct uevent *uevent)
 {
     std::vector<std::string> devices;
-    std::vector<struct platform_node *> pdevs;
+    std::vector<bool> bootdevices;
+    std::vector<const struct platform_node *> pdevs;
     const char *slash;
     const char *type;
     char buf[256];
@@ -397,13 +434,16 @@ static std::vector<std::string> get_block_device_symlinks(struct uevent *uevent)
     if (!pdevs.empty()) {
         for (auto *pdev : pdevs) {
             devices.push_back(pdev->name);
+            bootdevices.push_back(pdev->is_bootdevice);
         }
         type = "platform";
     } else if (find_pci_device_prefix(uevent->path, buf, sizeof(buf)) == 0) {
         devices.push_back(buf);
+        bootdevices.push_back(false);
         type = "pci";
     } else if (find_mtd_device_prefix(uevent->path, buf, sizeof(buf)) == 0) {
         devices.push_back(buf);
+        bootdevices.push_back(false);
         type = "mtd";
     } else {
         return {};
@@ -417,7 +457,9 @@ static std::vector<std::string> get_block_device_symlinks(struct uevent *uevent)
     }
 #endif
 
-    for (auto const &device : devices) {
+    for (size_t i = 0; i < devices.size(); ++i) {
+        const std::string &device = devices[i];
+
         snprintf(link_path, sizeof(link_path),
                  "/dev/block/%s/%s", type, device.c_str());
 
@@ -446,14 +488,9 @@ static std::vector<std::string> get_block_device_symlinks(struct uevent *uevent)
             free(p);
         }
 
-        if (!pdevs.empty() && bootdevice[0] != '\0'
-                && strstr(device.c_str(), bootdevice)) {
-            if (!dry_run) {
-                make_link_init(link_path, "/dev/block/bootdevice");
-            }
-            is_bootdevice = true;
-        } else {
-            is_bootdevice = false;
+        is_bootdevice = bootdevices[i];
+        if (is_bootdevice && !dry_run) {
+            make_link_init(link_path, "/dev/block/bootdevice");
         }
 
         if (uevent->partition_name) {
@@ -579,6 +616,9 @@ static void handle_block_device_event(struct uevent *uevent)
     handle_device(uevent->action, devpath, uevent->path, 1,
             uevent->major, uevent->minor, links);
 
+    // Any event (add, remove, change) may mean that the medium changed
+    mb::util::blkid_invalidate(makedev(uevent->major, uevent->minor));
+
     // Add/remove block device mapping
     if (strcmp(uevent->action, "add") == 0) {
         BlockDevInfo info;
@@ -592,12 +632,23 @@ static void handle_block_device_event(struct uevent *uevent)
         }
 
         std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-        block_dev_mappings.emplace(
-                std::make_pair(uevent->path, std::move(info)));
+        if (block_dev_mappings.emplace(
+                std::make_pair(uevent->path, std::move(info))).second) {
+            block_dev_mappings_snapshot.reset();
+        }
     } else if (strcmp(uevent->action, "remove") == 0) {
         std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-        block_dev_mappings.erase(uevent->path);
+        if (block_dev_mappings.erase(uevent->path) > 0) {
+            block_dev_mappings_snapshot.reset();
+        }
     }
+
+    // Wake up anyone waiting for the device node or its symlinks
+    {
+        std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
+        ++block_dev_generation;
+    }
+    block_dev_mappings_cv.notify_all();
 }
 
 static bool assemble_devpath(char *devpath, const char *dirname,
@@ -737,29 +788,97 @@ static void handle_device_event(struct uevent *uevent)
 }
 
 #define UEVENT_MSG_LEN  2048
+#define UEVENT_BATCH_SIZE 32
+
+#define COLDBOOT_MAX_THREADS 4
+
+#define DEVICE_THREAD_STOP '\0'
+#define DEVICE_THREAD_FLUSH 'f'
+
+/*
+ * Events are received and parsed by device_thread() and handed off in order to
+ * event_thread(), which does the (comparatively slow) work of creating device
+ * nodes and symlinks. This keeps the netlink socket drained while devices are
+ * being set up, so coldboot no longer has to stop and handle every event
+ * itself to avoid overrunning the socket's buffer.
+ */
 void handle_device_fd()
 {
-    char msg[UEVENT_MSG_LEN + 2];
+    static char msgs[UEVENT_BATCH_SIZE][UEVENT_MSG_LEN];
+    ssize_t sizes[UEVENT_BATCH_SIZE];
     int n;
-    while ((n = uevent_kernel_multicast_recv(device_fd, msg, UEVENT_MSG_LEN)) > 0) {
-        if (n >= UEVENT_MSG_LEN) {
-            // overflow -- discard
-            continue;
+
+    while ((n = uevent_kernel_multicast_recv_batch(
+            device_fd, msgs, UEVENT_MSG_LEN, sizes, UEVENT_BATCH_SIZE)) > 0) {
+        std::vector<queued_uevent> batch;
+        batch.reserve(n);
+
+        for (int i = 0; i < n; ++i) {
+            if (sizes[i] < 0) {
+                // Not sent by the kernel
+                continue;
+            } else if (sizes[i] >= UEVENT_MSG_LEN) {
+                // overflow -- discard
+                continue;
+            }
+
+            queued_uevent event;
+            event.msg.reset(new char[sizes[i] + 2]);
+            memcpy(event.msg.get(), msgs[i], sizes[i]);
+            event.msg[sizes[i]] = '\0';
+            event.msg[sizes[i] + 1] = '\0';
+
+            parse_event(event.msg.get(), &event.uevent);
+
+            if (event.uevent.path && strstr(event.uevent.path, "sec-battery")) {
+                // sec-battery causes boot delays on the Galaxy S4
+                continue;
+            }
+
+            batch.push_back(std::move(event));
         }
 
-        msg[n] = '\0';
-        msg[n + 1] = '\0';
+        if (!batch.empty()) {
+            std::lock_guard<std::mutex> lock(event_queue_guard);
+            for (queued_uevent &event : batch) {
+                event_queue.push_back(std::move(event));
+            }
+            events_queued += batch.size();
+            event_queue_cv.notify_one();
+        }
+    }
+}
+
+static void * event_thread(void *)
+{
+    std::unique_lock<std::mutex> lock(event_queue_guard);
+
+    while (true) {
+        event_queue_cv.wait(lock, [] {
+            return !event_queue.empty() || !run_event_thread;
+        });
+        if (event_queue.empty()) {
+            // Asked to stop and there's nothing left to handle
+            break;
+        }
 
-        struct uevent uevent;
-        parse_event(msg, &uevent);
+        queued_uevent event = std::move(event_queue.front());
+        event_queue.pop_front();
 
-        if (uevent.path && strstr(uevent.path, "sec-battery")) {
-            // sec-battery causes boot delays on the Galaxy S4
-            continue;
+        lock.unlock();
+        {
+            mb::util::CounterTimer timer(
+                    mb::util::Counter::UeventsHandled,
+                    mb::util::Counter::UeventHandleTimeNs);
+            handle_device_event(&event.uevent);
         }
+        lock.lock();
 
-        handle_device_event(&uevent);
+        ++events_handled;
+        events_handled_cv.notify_all();
     }
+
+    return nullptr;
 }
 
 /*
@@ -767,9 +886,8 @@ void handle_device_fd()
  * to cause the kernel to regenerate device add events that happened
  * before init's device manager was started
  *
- * We drain any pending events from the netlink socket every time
- * we poke another uevent file to make sure we don't overrun the
- * socket's buffer.
+ * The events are drained from the netlink socket by the device thread while
+ * the tree is being walked.
  */
 
 static void do_coldboot(DIR *d)
@@ -783,7 +901,6 @@ static void do_coldboot(DIR *d)
     if (fd >= 0) {
         write(fd, "add\n", 4);
         close(fd);
-        handle_device_fd();
     }
 
     while ((de = readdir(d))) {
@@ -817,6 +934,105 @@ static void coldboot(const char *path)
     }
 }
 
+struct coldboot_work {
+    std::vector<std::string> paths;
+    std::atomic_size_t next{0};
+};
+
+static void * coldboot_thread(void *userdata)
+{
+    coldboot_work *work = static_cast<coldboot_work *>(userdata);
+    size_t i;
+
+    while ((i = work->next++) < work->paths.size()) {
+        coldboot(work->paths[i].c_str());
+    }
+
+    return nullptr;
+}
+
+/*
+ * Coldboot the top-level subtrees of a directory in parallel. A device's
+ * parents are always in the same subtree, so each subtree is still walked from
+ * the top down and parent devices (eg. platform devices needed for the block
+ * device symlinks) are added before their children.
+ */
+static void coldboot_parallel(const char *path)
+{
+    coldboot_work work;
+
+    DIR *d = opendir(path);
+    if (!d) {
+        return;
+    }
+
+    int dfd = dirfd(d);
+    int fd = openat(dfd, "uevent", O_WRONLY);
+    if (fd >= 0) {
+        write(fd, "add\n", 4);
+        close(fd);
+    }
+
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (de->d_type == DT_DIR && de->d_name[0] != '.') {
+            work.paths.push_back(mb::format("%s/%s", path, de->d_name));
+        }
+    }
+
+    closedir(d);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_threads = std::min<size_t>(
+            std::min<size_t>(cpus > 0 ? cpus : 1, COLDBOOT_MAX_THREADS),
+            work.paths.size());
+    std::vector<pthread_t> threads;
+
+    // The calling thread always takes part, so only start the extra threads
+    for (size_t i = 1; i < n_threads; ++i) {
+        pthread_t t;
+        if (pthread_create(&t, nullptr, &coldboot_thread, &work) == 0) {
+            threads.push_back(t);
+        }
+    }
+
+    coldboot_thread(&work);
+
+    for (pthread_t t : threads) {
+        pthread_join(t, nullptr);
+    }
+}
+
+/*
+ * Wait until every event that is currently pending on the netlink socket has
+ * been handled.
+ */
+static void wait_for_pending_events()
+{
+    std::unique_lock<std::mutex> lock(event_queue_guard);
+
+    flush_done = false;
+    char c = DEVICE_THREAD_FLUSH;
+    if (write(pipe_fd[1], &c, 1) != 1) {
+        return;
+    }
+
+    events_handled_cv.wait(lock, [] {
+        return flush_done && events_handled >= flush_target;
+    });
+}
+
+static void flush_device_fd()
+{
+    // Everything pending is now queued
+    handle_device_fd();
+
+    std::lock_guard<std::mutex> lock(event_queue_guard);
+    flush_target = events_queued;
+    flush_done = true;
+    events_handled_cv.notify_all();
+}
+
 void * device_thread(void *)
 {
     struct pollfd fds[2];
@@ -833,6 +1049,11 @@ void * device_thread(void *)
             continue;
         }
         if (fds[0].revents & POLLIN) {
+            char c;
+            if (read(pipe_fd[0], &c, 1) == 1 && c == DEVICE_THREAD_FLUSH) {
+                flush_device_fd();
+                continue;
+            }
             LOGV("Received notification to stop uevent thread");
             break;
         }
@@ -844,15 +1065,18 @@ void * device_thread(void *)
     return nullptr;
 }
 
-void device_init(bool dry_run_)
+/*
+ * bootdevice is the value of androidboot.bootdevice from the kernel command
+ * line (empty if it is not set). The caller passes it in since init already
+ * has the command line parsed.
+ */
+void device_init(bool dry_run_, const char *bootdevice_)
 {
+    MB_TIMELINE_SCOPE("init.device_init");
+
     dry_run = dry_run_;
 
-    bootdevice[0] = '\0';
-    std::string value;
-    if (mb::util::kernel_cmdline_get_option("androidboot.bootdevice", &value)) {
-        strlcpy(bootdevice, value.c_str(), sizeof(bootdevice));
-    }
+    strlcpy(bootdevice, bootdevice_, sizeof(bootdevice));
 
     // Is 256K enough? udev uses 16MB!
     device_fd = uevent_open_socket(256 * 1024, true);
@@ -862,22 +1086,47 @@ void device_init(bool dry_run_)
 
     fcntl(device_fd, F_SETFL, O_NONBLOCK);
 
-    coldboot("/sys/class");
-    coldboot("/sys/block");
-    coldboot("/sys/devices");
+    run_event_thread = true;
+    pthread_create(&handler_thread, nullptr, &event_thread, nullptr);
 
     run_thread = true;
     pipe(pipe_fd);
     pthread_create(&thread, nullptr, &device_thread, nullptr);
+
+    {
+        MB_TIMELINE_SCOPE("init.device_init.coldboot");
+
+        coldboot("/sys/class");
+        coldboot("/sys/block");
+        coldboot_parallel("/sys/devices");
+    }
+
+    {
+        // Callers expect the coldboot devices to exist when this returns
+        MB_TIMELINE_SCOPE("init.device_init.handle_events");
+        wait_for_pending_events();
+    }
 }
 
 void device_close()
 {
+    MB_TIMELINE_SCOPE("init.device_close");
+
     run_thread = false;
-    write(pipe_fd[1], "", 1);
+    char c = DEVICE_THREAD_STOP;
+    write(pipe_fd[1], &c, 1);
 
     pthread_join(thread, nullptr);
 
+    // Let the handler finish whatever it was given before stopping it
+    {
+        std::lock_guard<std::mutex> lock(event_queue_guard);
+        run_event_thread = false;
+        event_queue_cv.notify_one();
+    }
+
+    pthread_join(handler_thread, nullptr);
+
     close(device_fd);
     device_fd = -1;
     close(pipe_fd[0]);
@@ -889,8 +1138,77 @@ int get_device_fd()
     return device_fd;
 }
 
-std::unordered_map<std::string, BlockDevInfo> get_block_dev_mappings()
+/*
+ * Returns the block devices that have been added so far, keyed by their sysfs
+ * path. The returned map is shared and is only copied again after a block
+ * device is added or removed.
+ */
+std::shared_ptr<const std::unordered_map<std::string, BlockDevInfo>>
+get_block_dev_mappings()
+{
+    std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
+    if (!block_dev_mappings_snapshot) {
+        block_dev_mappings_snapshot = std::make_shared<
+                const std::unordered_map<std::string, BlockDevInfo>>(
+                        block_dev_mappings);
+    }
+    return block_dev_mappings_snapshot;
+}
+
+/*
+ * Returns a counter that is incremented every time a block device event has
+ * been handled. Pass it to wait_for_block_dev_change() to wait for the next
+ * event.
+ */
+uint64_t get_block_dev_generation()
 {
     std::lock_guard<std::mutex> lock(block_dev_mappings_guard);
-    return block_dev_mappings;
+    return block_dev_generation;
+}
+
+/*
+ * Waits up to timeout_ms for a block device event to be handled after the
+ * generation returned by get_block_dev_generation(). Returns false on timeout.
+ */
+bool wait_for_block_dev_change(uint64_t generation, unsigned int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(block_dev_mappings_guard);
+    return block_dev_mappings_cv.wait_for(
+            lock, std::chrono::milliseconds(timeout_ms), [&] {
+        return block_dev_generation != generation;
+    });
+}
+
+/*
+ * Waits up to timeout_ms for a block device node (or one of its symlinks) to
+ * appear. The path is rechecked whenever a block device event is handled
+ * instead of being polled. If the uevent listener is not running, this falls
+ * back to polling.
+ */
+bool wait_for_block_dev(const char *path, unsigned int timeout_ms)
+{
+    if (device_fd < 0) {
+        return mb::util::wait_for_path(path, timeout_ms);
+    }
+
+    auto until = std::chrono::steady_clock::now()
+            + std::chrono::milliseconds(timeout_ms);
+    struct stat sb;
+
+    while (true) {
+        // Take the generation before checking so that an event that arrives
+        // in between is not missed
+        uint64_t generation = get_block_dev_generation();
+
+        if (stat(path, &sb) == 0) {
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(block_dev_mappings_guard);
+        if (!block_dev_mappings_cv.wait_until(lock, until, [&] {
+            return block_dev_generation != generation;
+        })) {
+            return stat(path, &sb) == 0;
+        }
+    }
 }
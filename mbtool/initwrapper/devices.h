@@ -17,9 +17,12 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 #include <unordered_map>
 
+#include <cstdint>
+
 #include <sys/stat.h>
 
 struct BlockDevInfo
@@ -32,8 +35,12 @@ struct BlockDevInfo
 };
 
 void handle_device_fd();
-void device_init(bool dry_run);
+void device_init(bool dry_run, const char *bootdevice);
 void device_close();
 int get_device_fd();
 
-std::unordered_map<std::string, BlockDevInfo> get_block_dev_mappings();
+std::shared_ptr<const std::unordered_map<std::string, BlockDevInfo>>
+get_block_dev_mappings();
+uint64_t get_block_dev_generation();
+bool wait_for_block_dev_change(uint64_t generation, unsigned int timeout_ms);
+bool wait_for_block_dev(const char *path, unsigned int timeout_ms);
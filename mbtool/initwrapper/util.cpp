@@ -17,6 +17,11 @@
 
 #include "initwrapper/util.h"
 
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+#include <cerrno>
 #include <cstring>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -50,14 +55,49 @@ void sanitize(char *s)
     }
 }
 
+/*
+ * Directories that make_link_init() has already created. During coldboot,
+ * hundreds of links land in the same few directories (eg.
+ * /dev/block/platform/<device>/by-name), so remembering them avoids walking
+ * and stat()'ing every path component again for each link.
+ */
+static std::unordered_set<std::string> link_dirs;
+static std::mutex link_dirs_guard;
+
+static bool make_link_parent(const char *path, bool force)
+{
+    std::string dir = mb::util::dir_name(path);
+    std::lock_guard<std::mutex> lock(link_dirs_guard);
+
+    if (!force && link_dirs.find(dir) != link_dirs.end()) {
+        return true;
+    }
+
+    if (!mb::util::mkdir_parent(path, 0755)) {
+        link_dirs.erase(dir);
+        return false;
+    }
+
+    link_dirs.insert(dir);
+    return true;
+}
+
 void make_link_init(const char *oldpath, const char *newpath)
 {
-    if (!mb::util::mkdir_parent(newpath, 0755)) {
+    if (!make_link_parent(newpath, false)) {
         LOGE("Failed to create parent directory of %s: %s",
              newpath, strerror(errno));
     }
 
-    if (symlink(oldpath, newpath) < 0) {
+    int ret = symlink(oldpath, newpath);
+    if (ret < 0 && errno == ENOENT) {
+        // The cached directory was removed behind our back
+        if (make_link_parent(newpath, true)) {
+            ret = symlink(oldpath, newpath);
+        }
+    }
+
+    if (ret < 0) {
         LOGE("Failed to symlink %s to %s: %s",
              oldpath, newpath, strerror(errno));
     }
@@ -23,11 +23,13 @@
 #include <algorithm>
 
 // C
+#include <cstdlib>
 #include <cstring>
 
 // Linux/posix
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
@@ -63,14 +65,18 @@
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/fstab.h"
+#include "mbutil/hashing_file.h"
 #include "mbutil/loopdev.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/string.h"
 #include "mbutil/time.h"
+#include "mbutil/trace.h"
 
 // Local
+#include "block_image.h"
+#include "ext4_image.h"
 #include "image.h"
 #include "installer_util.h"
 #include "multiboot.h"
@@ -99,6 +105,9 @@
 
 #define HELPER_TOOL             "/update-binary-tool"
 
+// Maximum number of bytes read from an updater fd at a time
+#define UPDATER_READ_SIZE       65536
+
 
 using namespace mb::device;
 
@@ -116,6 +125,7 @@ Installer::Installer(std::string zip_file, std::string chroot_dir,
     , _interface(interface)
     , _output_fd(output_fd)
     , _flags(flags)
+    , _reused_chroot(false)
     , _ran(false)
 {
     _passthrough = _output_fd >= 0;
@@ -398,10 +408,60 @@ bool Installer::create_chroot()
     return true;
 }
 
-bool Installer::destroy_chroot() const
+/*!
+ * \brief Check whether a chroot left by a previous installation can be reused
+ */
+bool Installer::can_reuse_chroot() const
+{
+    struct stat sb;
+    return util::is_mounted(_chroot)
+            && stat(in_chroot("/.chroot").c_str(), &sb) == 0;
+}
+
+/*!
+ * \brief Reset the per-installation state of a chroot for the next zip
+ *
+ * The tmpfs mounts, device nodes, and copy of the recovery's /sbin are kept.
+ * Only what a single installation sets up or may have changed is undone: the
+ * /system, /cache, /data, and /mb mounts, loop devices, the contents of /tmp
+ * and /mb, and the busybox wrapper.
+ */
+bool Installer::reset_chroot()
+{
+    remove_chroot_loop_devices();
+
+    if (!log_unmount_all(in_chroot("/system"))
+            || !log_unmount_all(in_chroot("/cache"))
+            || !log_unmount_all(in_chroot("/data"))
+            || !log_unmount_all(in_chroot("/mb"))) {
+        return false;
+    }
+
+    if (!wipe_directory(in_chroot("/tmp"), {})
+            || !wipe_directory(in_chroot("/mb"), {})) {
+        LOGE("Failed to clear files from the previous installation");
+        return false;
+    }
+
+    // Undo set_up_busybox_wrapper()
+    std::string busybox_orig(in_chroot("/sbin/busybox_orig"));
+    if (access(busybox_orig.c_str(), F_OK) == 0
+            && rename(busybox_orig.c_str(),
+                      in_chroot("/sbin/busybox").c_str()) < 0) {
+        LOGE("%s: Failed to restore busybox: %s",
+             busybox_orig.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Disassociate loop devices that the ROM installer may have assigned
+ *        (grr, SuperSU...)
+ */
+void Installer::remove_chroot_loop_devices() const
 {
-    // Disassociate loop devices that the ROM installer may have assigned
-    // (grr, SuperSU...)
     std::string dev_block_path(in_chroot("/dev/block"));
     autoclose::dir dp = autoclose::opendir(dev_block_path.c_str());
     if (dp) {
@@ -415,6 +475,11 @@ bool Installer::destroy_chroot() const
         }
         dp.reset();
     }
+}
+
+bool Installer::destroy_chroot() const
+{
+    remove_chroot_loop_devices();
 
     log_umount(in_chroot("/system").c_str());
     log_umount(in_chroot("/cache").c_str());
@@ -582,11 +647,22 @@ bool Installer::extract_multiboot_files()
         });
     }
 
-    if (!util::extract_files2(_zip_file, files)) {
-        LOGE("Failed to extract all multiboot files");
+    if (!_zip.is_open() && !_zip.open(_zip_file)) {
+        LOGE("Failed to read zip file");
         return false;
     }
 
+    for (auto const &info : files) {
+        if (!_zip.extract(info.from, info.to)) {
+            LOGE("Failed to extract all multiboot files");
+            return false;
+        }
+    }
+
+    // Nothing else needs the index, so don't keep the zip open while the
+    // updater runs
+    _zip.close();
+
     std::vector<std::string> sigcheck{
         _temp + "/mbtool",
         _temp + "/bb-wrapper.sh",
@@ -659,9 +735,80 @@ bool Installer::create_image(const std::string &path, uint64_t size)
     return result == CreateImageResult::SUCCEEDED;
 }
 
+/*!
+ * \brief Clone the ext4 filesystem mounted at a directory into an image
+ *
+ * The filesystem is temporarily remounted read-only so that it does not
+ * change while its blocks are being copied.
+ *
+ * \return BlockCopyResult::UNSUPPORTED if \a dir is not the mount point of an
+ *         ext4 block device or image, or if it could not be remounted
+ *         read-only. \a image is not modified in this case.
+ */
+static BlockCopyResult block_copy_mounted_fs(const std::string &dir,
+                                             const std::string &image)
+{
+    util::MountEntry entry;
+    bool found = false;
+
+    {
+        autoclose::file fp(autoclose::fopen(PROC_MOUNTS, "re"));
+        if (!fp) {
+            LOGE("%s: Failed to read file: %s", PROC_MOUNTS, strerror(errno));
+            return BlockCopyResult::UNSUPPORTED;
+        }
+
+        // Use the last matching entry since later mounts hide earlier ones
+        util::MountEntry cur;
+        while (util::get_mount_entry(fp.get(), cur)) {
+            if (cur.dir == dir) {
+                entry = cur;
+                found = true;
+            }
+        }
+    }
+
+    struct stat sb;
+    if (!found || entry.type != "ext4" || stat(entry.fsname.c_str(), &sb) < 0
+            || !(S_ISBLK(sb.st_mode) || S_ISREG(sb.st_mode))) {
+        return BlockCopyResult::UNSUPPORTED;
+    }
+
+    bool read_only = (',' + entry.opts + ',').find(",ro,")
+            != std::string::npos;
+
+    if (!read_only && !util::mount("", dir.c_str(), "",
+                                   MS_REMOUNT | MS_RDONLY, "")) {
+        LOGW("%s: Failed to remount as read-only: %s",
+             dir.c_str(), strerror(errno));
+        return BlockCopyResult::UNSUPPORTED;
+    }
+
+    auto remount = util::finally([&] {
+        if (!read_only && !util::mount("", dir.c_str(), "", MS_REMOUNT, "")) {
+            LOGW("%s: Failed to remount as writable: %s",
+                 dir.c_str(), strerror(errno));
+        }
+    });
+
+    LOGD("Copying allocated blocks of %s (mounted at %s) to %s",
+         entry.fsname.c_str(), dir.c_str(), image.c_str());
+
+    uint64_t copied;
+    auto result = copy_ext4_allocated_blocks(entry.fsname, image, &copied);
+    if (result == BlockCopyResult::SUCCEEDED) {
+        LOGD("Copied %" PRIu64 " bytes", copied);
+    }
+    return result;
+}
+
 /*!
  * \brief Copy a /system directory to an image file
  *
+ * If \a source is the mount point of an ext4 filesystem, then the image is
+ * made a block-level clone of that filesystem, which only copies allocated
+ * blocks. Otherwise, the files are copied individually.
+ *
  * \param source Source directory
  * \param image Target image file
  * \param reverse If non-zero, then the image file is the source and the
@@ -670,6 +817,18 @@ bool Installer::create_image(const std::string &path, uint64_t size)
 bool Installer::system_image_copy(const std::string &source,
                                   const std::string &image, bool reverse)
 {
+    // Not done in reverse since that would require unmounting the partition
+    if (!reverse) {
+        switch (block_copy_mounted_fs(source, image)) {
+        case BlockCopyResult::SUCCEEDED:
+            return true;
+        case BlockCopyResult::FAILED:
+            return false;
+        case BlockCopyResult::UNSUPPORTED:
+            break;
+        }
+    }
+
     std::string temp_mnt(_temp);
     temp_mnt += "/.system.tmp";
 
@@ -749,14 +908,11 @@ bool Installer::mount_dir_or_image(const std::string &source,
             }
         }
 
-        std::string loopdev = util::loopdev_find_unused();
+        std::string loopdev = util::loopdev_set_up_unused(
+                source, 0, util::LOOPDEV_DIRECT_IO);
         if (loopdev.empty()) {
-            LOGE("Failed to find unused loop device: %s", strerror(errno));
-            return false;
-        }
-        if (!util::loopdev_set_up_device(loopdev, source, 0, false)) {
-            LOGE("Failed to attach %s to %s: %s",
-                 loopdev.c_str(), source.c_str(), strerror(errno));
+            LOGE("Failed to attach %s to a loop device: %s",
+                 source.c_str(), strerror(errno));
             return false;
         }
         if (!util::copy_file(loopdev, loop_target, 0)) {
@@ -857,69 +1013,215 @@ bool Installer::set_up_legacy_properties()
     return true;
 }
 
+/*!
+ * \brief Track overall progress from the updater's progress commands
+ *
+ * Like AOSP recovery, `progress <fraction> <seconds>` starts a new section
+ * that covers \a fraction of the total and `set_progress <fraction>` sets the
+ * progress within the current section. The time-based animation requested by
+ * \a seconds is not emulated.
+ */
+class UpdaterProgress
+{
+public:
+    UpdaterProgress() : _start(0), _size(0), _fraction(0)
+    {
+    }
+
+    void start_section(double size)
+    {
+        _start = clamp(_start + _size);
+        _size = clamp(size);
+        _fraction = 0;
+    }
+
+    void set_fraction(double fraction)
+    {
+        _fraction = clamp(fraction);
+    }
+
+    double overall() const
+    {
+        return clamp(_start + _size * _fraction);
+    }
+
+private:
+    double _start;
+    double _size;
+    double _fraction;
+
+    static double clamp(double value)
+    {
+        return value < 0 ? 0 : value > 1 ? 1 : value;
+    }
+};
+
+static bool parse_fraction(const char *str, double *value_out)
+{
+    if (!str) {
+        return false;
+    }
+
+    char *end;
+    errno = 0;
+    double value = strtod(str, &end);
+    if (errno != 0 || end == str || *end) {
+        return false;
+    }
+
+    *value_out = value;
+    return true;
+}
+
+/*!
+ * \brief Handle a line from the updater's command pipe
+ *
+ * \note The command parsing is similar to AOSP recovery's
+ */
+void Installer::updater_command(char *line, UpdaterProgress *progress)
+{
+    char *save_ptr;
+    char *cmd = strtok_r(line, " \n", &save_ptr);
+    double value;
+
+    if (!cmd) {
+        return;
+    } else if (strcmp(cmd, "progress") == 0) {
+        if (parse_fraction(strtok_r(nullptr, " \n", &save_ptr), &value)) {
+            progress->start_section(value);
+            updater_progress(progress->overall());
+        } else {
+            LOGW("Invalid updater command arguments: %s", cmd);
+        }
+    } else if (strcmp(cmd, "set_progress") == 0) {
+        if (parse_fraction(strtok_r(nullptr, " \n", &save_ptr), &value)) {
+            progress->set_fraction(value);
+            updater_progress(progress->overall());
+        } else {
+            LOGW("Invalid updater command arguments: %s", cmd);
+        }
+    } else if (strcmp(cmd, "wipe_cache") == 0
+            || strcmp(cmd, "clear_display") == 0
+            || strcmp(cmd, "enable_reboot") == 0) {
+        // Ignore
+    } else if (strcmp(cmd, "ui_print") == 0) {
+        char *str = strtok_r(nullptr, "\n", &save_ptr);
+        if (str) {
+            updater_print(str);
+        } else {
+            updater_print("\n");
+        }
+    } else {
+        LOGE("Unknown updater command: %s", cmd);
+    }
+}
+
+/*!
+ * \brief Read the updater's output and command pipes until both are closed
+ *
+ * Both fds are watched with a single epoll instance, so lines are dispatched in
+ * the order they become available. Lines passed to command_output() include
+ * the trailing newline, except for a final unterminated line.
+ */
 bool Installer::updater_fd_reader(int stdio_fd, int command_fd)
 {
-    int status;
-    pid_t pid = fork();
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        LOGE("Failed to create epoll fd: %s", strerror(errno));
+        return false;
+    }
 
-    if (pid < 0) {
-        LOGE("Failed to fork updater fd reader process");
-    } else if (pid == 0) {
-        // Don't need command_fd in the child process
-        close(command_fd);
+    auto close_epoll_fd = util::finally([&]{
+        close(epoll_fd);
+    });
 
-        // Read program output in child process (stdout, stderr)
-        char buf[1024];
+    for (int fd : { stdio_fd, command_fd }) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            LOGE("Failed to set fd to non-blocking: %s", strerror(errno));
+            return false;
+        }
 
-        autoclose::file fp(fdopen(stdio_fd, "rb"), fclose);
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
 
-        while (fgets(buf, sizeof(buf), fp.get())) {
-            command_output(buf);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            LOGE("Failed to add fd to epoll: %s", strerror(errno));
+            return false;
         }
+    }
 
-        _exit(EXIT_SUCCESS);
-    } else {
-        // Read special command fd in parent process
+    UpdaterProgress progress;
+    std::vector<char> buf(UPDATER_READ_SIZE);
+    std::string stdio_buf;
+    std::string command_buf;
+    int open_fds = 2;
+    bool ret = true;
 
-        char buf[1024];
-        char *save_ptr;
+    auto dispatch = [&](bool is_command, std::string line) {
+        if (is_command) {
+            updater_command(&line[0], &progress);
+        } else {
+            command_output(line);
+        }
+    };
 
-        // Similar parsing to AOSP recovery
-        autoclose::file fp(fdopen(command_fd, "rb"), fclose);
+    struct epoll_event events[2];
 
-        while (fgets(buf, sizeof(buf), fp.get())) {
-            char *cmd = strtok_r(buf, " \n", &save_ptr);
-            if (!cmd) {
+    while (open_fds > 0) {
+        int n = epoll_wait(epoll_fd, events, 2, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
                 continue;
-            } else if (strcmp(cmd, "progress") == 0
-                    || strcmp(cmd, "set_progress") == 0
-                    || strcmp(cmd, "wipe_cache") == 0
-                    || strcmp(cmd, "clear_display") == 0
-                    || strcmp(cmd, "enable_reboot") == 0) {
-                // Ignore
-            } else if (strcmp(cmd, "ui_print") == 0) {
-                char *str = strtok_r(nullptr, "\n", &save_ptr);
-                if (str) {
-                    updater_print(str);
-                } else {
-                    updater_print("\n");
-                }
-            } else {
-                LOGE("Unknown updater command: %s", cmd);
             }
+            LOGE("Failed to wait for updater output: %s", strerror(errno));
+            return false;
         }
 
-        do {
-            if (waitpid(pid, &status, 0) < 0) {
-                LOGE("Failed to waitpid(): %s", strerror(errno));
-                return false;
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+            bool is_command = fd == command_fd;
+            std::string &line_buf = is_command ? command_buf : stdio_buf;
+
+            ssize_t n_read = read(fd, buf.data(), buf.size());
+            if (n_read < 0) {
+                if (errno == EINTR || errno == EAGAIN
+                        || errno == EWOULDBLOCK) {
+                    continue;
+                }
+                LOGE("Failed to read updater output: %s", strerror(errno));
+                ret = false;
             }
-        } while (!WIFEXITED(status) && !WIFSIGNALED(status));
 
-        return true;
+            if (n_read > 0) {
+                line_buf.append(buf.data(), static_cast<size_t>(n_read));
+
+                size_t begin = 0;
+                size_t pos;
+
+                while ((pos = line_buf.find('\n', begin))
+                        != std::string::npos) {
+                    dispatch(is_command,
+                             line_buf.substr(begin, pos + 1 - begin));
+                    begin = pos + 1;
+                }
+
+                line_buf.erase(0, begin);
+            } else {
+                // EOF or error
+                if (!line_buf.empty()) {
+                    dispatch(is_command, std::move(line_buf));
+                    line_buf.clear();
+                }
+
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                --open_fds;
+            }
+        }
     }
 
-    return false;
+    return ret;
 }
 
 /*!
@@ -1068,7 +1370,7 @@ bool Installer::run_real_updater()
                 close(stdio_fds[1]);
 
                 if (!updater_fd_reader(stdio_fds[0], pipe_fds[0])) {
-                    LOGW("Updater fd reader process failed");
+                    LOGW("Failed to read updater output");
                 }
 
                 close(pipe_fds[0]);
@@ -1189,6 +1491,12 @@ void Installer::command_output(const std::string &line)
     printf("%s\n", line.c_str());
 }
 
+// Note: Only called if we're not passing through the output_fd
+void Installer::updater_progress(double fraction)
+{
+    (void) fraction;
+}
+
 std::unordered_map<std::string, std::string> Installer::get_properties()
 {
     return std::unordered_map<std::string, std::string>();
@@ -1252,33 +1560,51 @@ void Installer::on_cleanup(Installer::ProceedState ret)
 
 Installer::ProceedState Installer::install_stage_initialize()
 {
+    MB_TRACE_SCOPE("installer.initialize");
+
     LOGD("Installer version: %s (%s)", mb::version(), mb::git_version());
 
     LOGD("[Installer] Initialization stage");
 
-    std::vector<util::exists_info> info{
-        { "system.transfer.list", false },
-        { "system.new.dat", false },
-        { "system.img", false },
-        { "system.img.sparse", false },
+    static const char *block_image_files[] = {
+        "system.transfer.list",
+        "system.new.dat",
+        "system.img",
+        "system.img.sparse",
     };
-    if (!util::archive_exists(_zip_file, info)) {
+    if (!_zip.open(_zip_file)) {
         LOGE("Failed to read zip file");
     } else {
         _has_block_image = false;
         _copy_to_temp_image = false;
-        for (auto const &item : info) {
-            if (item.exists) {
+        for (const char *path : block_image_files) {
+            if (_zip.exists(path)) {
                 _has_block_image = true;
                 // Flashing an Odin image discards the system image anyway, so
                 // there's no point in copying the data.
                 // TODO: libmbpatcher should be setting this option in info.prop
-                if (item.path != "system.img.sparse") {
+                if (strcmp(path, "system.img.sparse") != 0) {
                     _copy_to_temp_image = true;
                 }
                 break;
             }
         }
+
+        // A transfer list that only writes new or zeroed blocks replaces the
+        // entire partition, so the existing system doesn't need to be copied
+        // into the temporary image first
+        std::vector<unsigned char> data;
+        TransferList tl;
+        if (_copy_to_temp_image && _zip.exists("system.transfer.list")
+                && _zip.read("system.transfer.list", &data)
+                && parse_transfer_list(std::string(data.begin(), data.end()),
+                                       &tl)
+                && !tl.reads_source) {
+            LOGD("Full block image update (%" PRIu64 "/%" PRIu64
+                 " blocks); skipping copy of current system",
+                 tl.new_blocks, tl.total_blocks);
+            _copy_to_temp_image = false;
+        }
     }
 
     return on_initialize();
@@ -1286,13 +1612,30 @@ Installer::ProceedState Installer::install_stage_initialize()
 
 Installer::ProceedState Installer::install_stage_create_chroot()
 {
+    MB_TRACE_SCOPE("installer.create_chroot");
+
     LOGD("[Installer] Chroot creation stage");
 
-    display_msg("Creating chroot environment");
+    _reused_chroot = false;
 
-    if (!create_chroot()) {
-        display_msg("Failed to create chroot environment");
-        return ProceedState::Fail;
+    if ((_flags & InstallerFlags::INSTALLER_REUSE_CHROOT)
+            && can_reuse_chroot()) {
+        display_msg("Reusing chroot environment");
+
+        if (reset_chroot()) {
+            _reused_chroot = true;
+        } else {
+            LOGW("Failed to reset chroot. Creating a new one");
+        }
+    }
+
+    if (!_reused_chroot) {
+        display_msg("Creating chroot environment");
+
+        if (!create_chroot()) {
+            display_msg("Failed to create chroot environment");
+            return ProceedState::Fail;
+        }
     }
 
 
@@ -1302,6 +1645,8 @@ Installer::ProceedState Installer::install_stage_create_chroot()
 
 Installer::ProceedState Installer::install_stage_set_up_environment()
 {
+    MB_TRACE_SCOPE("installer.set_up_environment");
+
     LOGD("[Installer] Environment set up stage");
 
     if (!log_delete_recursive(_temp)) {
@@ -1327,6 +1672,8 @@ Installer::ProceedState Installer::install_stage_set_up_environment()
 
 Installer::ProceedState Installer::install_stage_check_device()
 {
+    MB_TRACE_SCOPE("installer.check_device");
+
     LOGD("[Installer] Device verification stage");
 
     std::vector<unsigned char> contents;
@@ -1480,6 +1827,8 @@ Installer::ProceedState Installer::install_stage_check_device()
 
 Installer::ProceedState Installer::install_stage_get_install_type()
 {
+    MB_TRACE_SCOPE("installer.get_install_type");
+
     LOGD("[Installer] Retrieve install type stage");
 
     std::string install_type = get_install_type();
@@ -1532,6 +1881,8 @@ Installer::ProceedState Installer::install_stage_get_install_type()
 
 Installer::ProceedState Installer::install_stage_set_up_chroot()
 {
+    MB_TRACE_SCOPE("installer.set_up_chroot");
+
     LOGD("[Installer] Chroot set up stage");
 
     // Calculate SHA512 hash of the boot partition
@@ -1590,6 +1941,8 @@ Installer::ProceedState Installer::install_stage_set_up_chroot()
 
 Installer::ProceedState Installer::install_stage_mount_filesystems()
 {
+    MB_TRACE_SCOPE("installer.mount_filesystems");
+
     LOGD("[Installer] Filesystem mounting stage");
 
     if (_flags & InstallerFlags::INSTALLER_SKIP_MOUNTING_VOLUMES) {
@@ -1696,6 +2049,8 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
 
 Installer::ProceedState Installer::install_stage_installation()
 {
+    MB_TRACE_SCOPE("installer.installation");
+
     LOGD("[Installer] Installation stage");
 
     ProceedState hook_ret = on_pre_install();
@@ -1770,6 +2125,8 @@ Installer::ProceedState Installer::install_stage_installation()
 
 Installer::ProceedState Installer::install_stage_unmount_filesystems()
 {
+    MB_TRACE_SCOPE("installer.unmount_filesystems");
+
     LOGD("[Installer] Filesystem unmounting stage");
 
     // Umount filesystems from inside the chroot
@@ -1827,6 +2184,8 @@ Installer::ProceedState Installer::install_stage_unmount_filesystems()
 
 Installer::ProceedState Installer::install_stage_finish()
 {
+    MB_TRACE_SCOPE("installer.finish");
+
     LOGD("[Installer] Finalization stage");
 
     // Calculate SHA512 hash of the boot partition after installation
@@ -1862,7 +2221,7 @@ Installer::ProceedState Installer::install_stage_finish()
         rps.push_back(rp_add_device_json(_temp + "/device.json"));
 
         if (!InstallerUtil::patch_boot_image(_boot_block_dev, temp_boot_img,
-                                             rps)) {
+                                             rps, _rom->id)) {
             display_msg("Failed to patch boot image");
             return ProceedState::Fail;
         }
@@ -1885,19 +2244,13 @@ Installer::ProceedState Installer::install_stage_finish()
             display_msg("Failed to flash patched boot image");
             return ProceedState::Fail;
         }
-        if (!util::copy_contents(temp_boot_img, path)) {
-            LOGE("Failed to copy %s to %s: %s",
-                 temp_boot_img.c_str(), path.c_str(),
-                 strerror(errno));
-            display_msg("Failed to back up boot image");
-            return ProceedState::Fail;
-        }
 
-        // Update checksums
+        // Compute the checksum while copying so the image is not read again
         unsigned char digest[SHA512_DIGEST_LENGTH];
+        struct stat sb;
 
-        if (!util::sha512_hash(temp_boot_img, digest)) {
-            display_msg("Failed to compute sha512sum of new boot image");
+        if (!util::copy_and_hash(temp_boot_img, path, digest, &sb)) {
+            display_msg("Failed to back up boot image");
             return ProceedState::Fail;
         }
 
@@ -1905,7 +2258,7 @@ Installer::ProceedState Installer::install_stage_finish()
 
         std::unordered_map<std::string, std::string> props;
         checksums_read(&props);
-        checksums_update(&props, _rom->id, "boot.img", hash);
+        checksums_update(&props, _rom->id, "boot.img", hash, &sb);
         checksums_write(props);
     }
 
@@ -1916,13 +2269,24 @@ Installer::ProceedState Installer::install_stage_finish()
 
 void Installer::install_stage_cleanup(Installer::ProceedState ret)
 {
+    MB_TRACE_SCOPE("installer.cleanup");
+
     LOGD("[Installer] Cleanup stage");
 
     if (ret == ProceedState::Fail) {
         display_msg("Failed to flash zip file.");
     }
 
-    display_msg("Destroying chroot environment");
+    // Only keep the chroot if this installation fully succeeded. Otherwise, its
+    // state is unknown
+    bool keep_chroot = (_flags & InstallerFlags::INSTALLER_KEEP_CHROOT)
+            && ret == ProceedState::Continue;
+
+    if (keep_chroot) {
+        display_msg("Keeping chroot environment for the next zip");
+    } else {
+        display_msg("Destroying chroot environment");
+    }
 
     remove(_temp_image_path.c_str());
 
@@ -1932,7 +2296,7 @@ void Installer::install_stage_cleanup(Installer::ProceedState ret)
         display_msg("Failed to restore boot partition");
     }
 
-    if (!destroy_chroot()) {
+    if (!keep_chroot && !destroy_chroot()) {
         display_msg("Failed to destroy chroot environment. You should "
                     "reboot into recovery again to avoid flashing issues.");
     }
@@ -1955,6 +2319,7 @@ bool Installer::start_installation()
 
     auto when_finished = util::finally([&] {
         install_stage_cleanup(ret);
+        MB_TRACE_DUMP();
     });
 
 
@@ -28,6 +28,7 @@
 #include "mbutil/hash.h"
 
 #include "roms.h"
+#include "zip_index.h"
 
 namespace mb
 {
@@ -35,8 +36,14 @@ namespace mb
 enum InstallerFlags : int
 {
     INSTALLER_SKIP_MOUNTING_VOLUMES = 1 << 0,
+    // Leave the chroot in place after a successful installation
+    INSTALLER_KEEP_CHROOT           = 1 << 1,
+    // Reset and reuse a chroot kept by the previous installation
+    INSTALLER_REUSE_CHROOT          = 1 << 2,
 };
 
+class UpdaterProgress;
+
 class Installer
 {
 public:
@@ -61,6 +68,7 @@ protected:
     virtual void display_msg(const std::string &msg);
     virtual void updater_print(const std::string &msg);
     virtual void command_output(const std::string &line);
+    virtual void updater_progress(double fraction);
     virtual std::string get_install_type() = 0;
     virtual std::unordered_map<std::string, std::string> get_properties();
     virtual ProceedState on_initialize();
@@ -81,6 +89,7 @@ protected:
     int _output_fd;
     int _flags;
     bool _passthrough;
+    bool _reused_chroot;
 
     mb::device::Device _device;
     std::string _detected_device;
@@ -104,6 +113,8 @@ protected:
 
     std::vector<std::string> _associated_loop_devs;
 
+    ZipIndex _zip;
+
     std::string in_chroot(const std::string &path) const;
 
     static bool is_aroma(const std::string &path);
@@ -118,6 +129,9 @@ private:
                            const char * const *argv);
 
     bool create_chroot();
+    bool can_reuse_chroot() const;
+    bool reset_chroot();
+    void remove_chroot_loop_devices() const;
     bool destroy_chroot() const;
     bool mount_efs() const;
 
@@ -133,6 +147,7 @@ private:
                             uint64_t image_size);
     static bool change_root(const std::string &path);
     bool set_up_legacy_properties();
+    void updater_command(char *line, UpdaterProgress *progress);
     bool updater_fd_reader(int stdio_fd, int command_fd);
     bool run_real_updater();
     bool run_debug_shell();
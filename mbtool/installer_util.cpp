@@ -19,9 +19,13 @@
 
 #include "installer_util.h"
 
+#include <algorithm>
+#include <iterator>
 #include <memory>
 
 #include <cerrno>
+#include <cinttypes>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -32,19 +36,16 @@
 #include <archive_entry.h>
 
 #include "mbbootimg/entry.h"
+#include "mbbootimg/format/android_defs.h"
 #include "mbbootimg/header.h"
 #include "mbbootimg/reader.h"
 #include "mbbootimg/writer.h"
 
-#include "mbcommon/file.h"
-#include "mbcommon/file_util.h"
-#include "mbcommon/file/standard.h"
-#include "mbcommon/string.h"
+#include "mbcommon/buffer_pool.h"
 
 #include "mblog/logging.h"
 
-#include "mbutil/delete.h"
-#include "mbutil/finally.h"
+#include "mbutil/cpio.h"
 #include "mbutil/path.h"
 
 #include "bootimg_util.h"
@@ -255,12 +256,18 @@ bool InstallerUtil::pack_ramdisk(const std::string &input_dir,
             return false;
         }
 
-        char buf[10240];
         la_ssize_t n;
 
         if (archive_entry_size(entry.get()) > 0) {
-            while ((n = archive_read_data(ain.get(), buf, sizeof(buf))) > 0) {
-                if (archive_write_data(aout.get(), buf, n) != n) {
+            PooledBuffer buf(io_block_size());
+            if (!buf) {
+                LOGE("Failed to allocate buffer: %s", strerror(errno));
+                return false;
+            }
+
+            while ((n = archive_read_data(ain.get(), buf.data(), buf.size()))
+                    > 0) {
+                if (archive_write_data(aout.get(), buf.data(), n) != n) {
                     LOGE("Failed to write archive entry data: %s",
                          archive_error_string(aout.get()));
                     return false;
@@ -285,22 +292,91 @@ bool InstallerUtil::pack_ramdisk(const std::string &input_dir,
     return true;
 }
 
-bool InstallerUtil::patch_boot_image(const std::string &input_file,
-                                     const std::string &output_file,
-                                     std::vector<std::function<RamdiskPatcherFn>> &rps)
+/*!
+ * \brief Maximum kernel cmdline length (excluding the NULL terminator) that a
+ *        boot image format can store
+ */
+static size_t max_cmdline_length(int format_code)
+{
+    switch (format_code & MB_BI_FORMAT_BASE_MASK) {
+    case MB_BI_FORMAT_SONY_ELF:
+        // The cmdline is stored in its own segment
+        return SIZE_MAX;
+    case MB_BI_FORMAT_ANDROID:
+    case MB_BI_FORMAT_BUMP:
+    case MB_BI_FORMAT_LOKI:
+    case MB_BI_FORMAT_MTK:
+    default:
+        // The cmdline is stored in the fixed-size field of the Android header
+        return ANDROID_BOOT_ARGS_SIZE - 1;
+    }
+}
+
+/*!
+ * \brief Record the ROM ID in the kernel cmdline
+ *
+ * This lets the app identify a boot image from the header alone. The ramdisk
+ * still contains the authoritative "romid" file, so failing to add the token
+ * (eg. for formats without a cmdline or when it wouldn't fit) is not an error.
+ */
+static void set_cmdline_rom_id(MbBiHeader *header, int format_code,
+                               const std::string &rom_id)
 {
-    std::string tmpdir = format("%s.XXXXXX", output_file.c_str());
+    if (rom_id.empty() || !(mb_bi_header_supported_fields(header)
+            & MB_BI_HEADER_FIELD_KERNEL_CMDLINE)) {
+        return;
+    }
+
+    const char *cmdline = mb_bi_header_kernel_cmdline(header);
+    std::string new_cmdline(cmdline ? cmdline : "");
+
+    // Drop the token left behind by a previous patch, along with the space
+    // that separated it from the rest of the cmdline. Everything else is kept
+    // as is.
+    size_t pos = 0;
+    while ((pos = new_cmdline.find(CMDLINE_ROM_ID_PREFIX, pos))
+            != std::string::npos) {
+        if (pos > 0 && new_cmdline[pos - 1] != ' ') {
+            ++pos;
+            continue;
+        }
 
-    // std::string is guaranteed to be contiguous in C++11
-    if (!mkdtemp(&tmpdir[0])) {
-        LOGE("Failed to create temporary directory: %s", strerror(errno));
-        return false;
+        size_t end = new_cmdline.find(' ', pos);
+        if (end == std::string::npos) {
+            end = new_cmdline.size();
+        }
+
+        if (pos > 0) {
+            --pos;
+        } else if (end < new_cmdline.size()) {
+            ++end;
+        }
+
+        new_cmdline.erase(pos, end - pos);
     }
 
-    auto delete_temp_dir = util::finally([&]{
-        util::delete_recursive(tmpdir);
-    });
+    if (!new_cmdline.empty()) {
+        new_cmdline += ' ';
+    }
+    new_cmdline += CMDLINE_ROM_ID_PREFIX;
+    new_cmdline += rom_id;
+
+    if (new_cmdline.size() > max_cmdline_length(format_code)) {
+        LOGW("Kernel cmdline is too long to record ROM ID");
+        return;
+    }
+
+    if (mb_bi_header_set_kernel_cmdline(header, new_cmdline.c_str())
+            != MB_BI_OK) {
+        LOGW("Failed to record ROM ID in kernel cmdline");
+    }
+}
 
+bool InstallerUtil::patch_boot_image(const std::string &input_file,
+                                     const std::string &output_file,
+                                     std::vector<std::function<RamdiskPatcherFn>> &rps,
+                                     const std::string &rom_id)
+{
     ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
     ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
     MbBiHeader *header;
@@ -355,6 +431,7 @@ bool InstallerUtil::patch_boot_image(const std::string &input_file,
              input_file.c_str(), mb_bi_reader_error_string(bir.get()));
         return false;
     }
+    set_cmdline_rom_id(header, mb_bi_reader_format_code(bir.get()), rom_id);
     ret = mb_bi_writer_write_header(biw.get(), header);
     if (ret != MB_BI_OK) {
         LOGE("%s: Failed to write header: %s",
@@ -391,48 +468,31 @@ bool InstallerUtil::patch_boot_image(const std::string &input_file,
                 return false;
             }
 
+            // The ramdisk and kernel are patched in memory, so nothing is
+            // written to temporary files
             if (type == MB_BI_ENTRY_RAMDISK) {
-                std::string ramdisk_in(tmpdir);
-                ramdisk_in += "/ramdisk.in";
-                std::string ramdisk_out(tmpdir);
-                ramdisk_out += "/ramdisk.out";
-
-                auto delete_temp_files = util::finally([&]{
-                    unlink(ramdisk_in.c_str());
-                    unlink(ramdisk_out.c_str());
-                });
-
-                if (!bi_copy_data_to_file(bir.get(), ramdisk_in)) {
-                    return false;
-                }
-
-                if (!patch_ramdisk(ramdisk_in, ramdisk_out, 0, rps)) {
-                    return false;
-                }
-
-                if (!bi_copy_file_to_data(ramdisk_out, biw.get())) {
+                std::string data;
+                util::CpioEditor cpio;
+
+                if (!bi_copy_data_to_memory(bir.get(), data)
+                        || !cpio.load_memory(data.data(), data.size())
+                        || !patch_ramdisk_cpio(cpio, 0, rps)
+                        || !cpio.save_memory(data)
+                        || !bi_copy_memory_to_data(data.data(), data.size(),
+                                                   biw.get())) {
                     return false;
                 }
             } else if (type == MB_BI_ENTRY_KERNEL) {
-                std::string kernel_in(tmpdir);
-                kernel_in += "/kernel.in";
-                std::string kernel_out(tmpdir);
-                kernel_out += "/kernel.out";
-
-                auto delete_temp_files = util::finally([&]{
-                    unlink(kernel_in.c_str());
-                    unlink(kernel_out.c_str());
-                });
+                std::string data;
 
-                if (!bi_copy_data_to_file(bir.get(), kernel_in)) {
+                if (!bi_copy_data_to_memory(bir.get(), data)) {
                     return false;
                 }
 
-                if (!patch_kernel_rkp(kernel_in, kernel_out)) {
-                    return false;
-                }
+                patch_kernel_rkp(data);
 
-                if (!bi_copy_file_to_data(kernel_out, biw.get())) {
+                if (!bi_copy_memory_to_data(data.data(), data.size(),
+                                            biw.get())) {
                     return false;
                 }
             } else {
@@ -458,55 +518,49 @@ bool InstallerUtil::patch_ramdisk(const std::string &input_file,
                                   unsigned int depth,
                                   std::vector<std::function<RamdiskPatcherFn>> &rps)
 {
-    if (depth > 1) {
-        LOGV("Ignoring doubly-nested ramdisk");
-        return true;
-    }
+    util::CpioEditor cpio;
 
-    std::string tmpdir = format("%s.XXXXXX", output_file.c_str());
+    // The ramdisk is decompressed, patched, and recompressed in memory without
+    // extracting anything to disk
+    if (!cpio.load_file(input_file)) {
+        return false;
+    }
 
-    if (!mkdtemp(&tmpdir[0])) {
-        LOGE("Failed to create temporary directory: %s", strerror(errno));
+    if (!patch_ramdisk_cpio(cpio, depth, rps)) {
         return false;
     }
 
-    auto delete_temp_dir = util::finally([&]{
-        util::delete_recursive(tmpdir);
-    });
+    return cpio.save_file(output_file);
+}
 
-    int format;
-    std::vector<int> filters;
+bool InstallerUtil::patch_ramdisk_cpio(util::CpioEditor &cpio,
+                                       unsigned int depth,
+                                       std::vector<std::function<RamdiskPatcherFn>> &rps)
+{
+    static const char *nested_path = "sbin/ramdisk.cpio";
 
-    // Extract ramdisk
-    if (!unpack_ramdisk(input_file, tmpdir, format, filters)) {
-        return false;
+    if (depth > 1) {
+        LOGV("Ignoring doubly-nested ramdisk");
+        return true;
     }
 
-    // Patch ramdisk
-    std::string nested(tmpdir);
-    nested += "/sbin/ramdisk.cpio";
-    struct stat sb;
-    bool ret;
+    if (cpio.exists(nested_path)) {
+        util::CpioEditor nested;
+        std::string data;
 
-    if (stat(nested.c_str(), &sb) == 0) {
-        ret = patch_ramdisk(nested, nested, depth + 1, rps);
-    } else {
-        ret = patch_ramdisk_dir(tmpdir, rps);
-    }
+        if (!cpio.contents(nested_path, data)
+                || !nested.load_memory(data.data(), data.size())
+                || !patch_ramdisk_cpio(nested, depth + 1, rps)
+                || !nested.save_memory(data)) {
+            return false;
+        }
 
-    // Pack ramdisk
-    if (!pack_ramdisk(tmpdir, output_file, format, filters)) {
-        return false;
+        return cpio.set_contents(nested_path, std::move(data),
+                                 cpio.mode(nested_path) & 07777);
     }
 
-    return ret;
-}
-
-bool InstallerUtil::patch_ramdisk_dir(const std::string &ramdisk_dir,
-                                      std::vector<std::function<RamdiskPatcherFn>> &rps)
-{
     for (auto const &rp : rps) {
-        if (!rp(ramdisk_dir)) {
+        if (!rp(cpio)) {
             return false;
         }
     }
@@ -514,8 +568,7 @@ bool InstallerUtil::patch_ramdisk_dir(const std::string &ramdisk_dir,
     return true;
 }
 
-bool InstallerUtil::patch_kernel_rkp(const std::string &input_file,
-                                     const std::string &output_file)
+void InstallerUtil::patch_kernel_rkp(std::string &data)
 {
     // We'll use SuperSU's patch for negating the effects of
     // CONFIG_RKP_NS_PROT=y in newer Samsung kernels. This kernel feature
@@ -541,83 +594,16 @@ bool InstallerUtil::patch_kernel_rkp(const std::string &input_file,
         0x40, 0xB9, 0x1F, 0xA0, 0x0F, 0x71, 0x81, 0x01, 0x00, 0x54,
     };
 
-    StandardFile fin;
-    StandardFile fout;
-    // TODO: Replace with std::optional after switching to C++17
-    std::pair<bool, uint64_t> offset;
-
-    // Open input file
-    if (!fin.open(input_file, FileOpenMode::READ_ONLY)) {
-        LOGE("%s: Failed to open for reading: %s",
-             input_file.c_str(), fin.error_string().c_str());
-        return false;
-    }
-
-    // Open output file
-    if (!fout.open(output_file, FileOpenMode::WRITE_ONLY)) {
-        LOGE("%s: Failed to open for writing: %s",
-             output_file.c_str(), fout.error_string().c_str());
-        return false;
-    }
-
-    // Replace pattern
-    auto result_cb = [](File &file, void *userdata, uint64_t offset)
-            -> FileSearchAction {
-        (void) file;
-        std::pair<bool, uint64_t> *ptr =
-                static_cast<std::pair<bool, uint64_t> *>(userdata);
-        ptr->first = true;
-        ptr->second = offset;
-        return FileSearchAction::Stop;
-    };
-
-    if (!file_search(fin, -1, -1, 0, source_pattern, sizeof(source_pattern), 1,
-                     result_cb, &offset)) {
-        LOGE("%s: Error when searching for pattern: %s",
-             input_file.c_str(), fin.error_string().c_str());
-        return false;
-    }
-
-    // Copy data
-    if (!fin.seek(0, SEEK_SET, nullptr)) {
-        LOGE("%s: Failed to seek to beginning: %s",
-             input_file.c_str(), fin.error_string().c_str());
-        return false;
-    }
-
-    if (offset.first) {
-        LOGD("RKP pattern found at offset: 0x%" PRIx64, offset.second);
-
-        if (!copy_file_to_file(fin, fout, offset.second)) {
-            return false;
-        }
-
-        if (!fin.seek(sizeof(source_pattern), SEEK_CUR, nullptr)) {
-            LOGE("%s: Failed to skip pattern: %s",
-                 input_file.c_str(), fin.error_string().c_str());
-            return false;
-        }
-
-        size_t n;
-        if (!file_write_fully(fout, target_pattern, sizeof(target_pattern), n)
-                || n != sizeof(target_pattern)) {
-            LOGE("%s: Failed to write target pattern: %s",
-                 output_file.c_str(), fout.error_string().c_str());
-            return false;
-        }
-    }
-
-    if (!copy_file_to_file_eof(fin, fout)) {
-        return false;
-    }
-
-    if (!fout.close()) {
-        LOGE("%s: Failed to close file: %s",
-             output_file.c_str(), fout.error_string().c_str());
-        return false;
+    auto it = std::search(data.begin(), data.end(),
+                          std::begin(source_pattern), std::end(source_pattern),
+                          [](char a, unsigned char b) {
+        return static_cast<unsigned char>(a) == b;
+    });
+    if (it != data.end()) {
+        LOGD("RKP pattern found at offset: 0x%" PRIx64,
+             static_cast<uint64_t>(it - data.begin()));
+        std::copy(std::begin(target_pattern), std::end(target_pattern), it);
     }
-
-    return true;
 }
 
 bool InstallerUtil::replace_file(const std::string &replace,
@@ -656,52 +642,4 @@ bool InstallerUtil::replace_file(const std::string &replace,
     return true;
 }
 
-bool InstallerUtil::copy_file_to_file(File &fin, File &fout, uint64_t to_copy)
-{
-    char buf[10240];
-    size_t n;
-
-    while (to_copy > 0) {
-        size_t to_read = std::min<uint64_t>(to_copy, sizeof(buf));
-
-        if (!mb::file_read_fully(fin, buf, to_read, n) || n != to_read) {
-            LOGE("Failed to read data: %s", fin.error_string().c_str());
-            return false;
-        }
-
-        if (!mb::file_write_fully(fout, buf, to_read, n) || n != to_read) {
-            LOGE("Failed to write data: %s", fout.error_string().c_str());
-            return false;
-        }
-
-        to_copy -= to_read;
-    }
-
-    return true;
-}
-
-bool InstallerUtil::copy_file_to_file_eof(File &fin, File &fout)
-{
-    char buf[10240];
-    size_t n_read;
-    size_t n_written;
-
-    while (true) {
-        if (!mb::file_read_fully(fin, buf, sizeof(buf), n_read)) {
-            LOGE("Failed to read data: %s", fin.error_string().c_str());
-            return false;
-        } else if (n_read == 0) {
-            break;
-        }
-
-        if (!mb::file_write_fully(fout, buf, n_read, n_written)
-                || n_written != n_read) {
-            LOGE("Failed to write data: %s", fout.error_string().c_str());
-            return false;
-        }
-    }
-
-    return true;
-}
-
 }
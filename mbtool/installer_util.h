@@ -30,8 +30,6 @@ struct MbBiWriter;
 namespace mb
 {
 
-class File;
-
 class InstallerUtil
 {
 public:
@@ -46,22 +44,19 @@ public:
 
     static bool patch_boot_image(const std::string &input_file,
                                  const std::string &output_file,
-                                 std::vector<std::function<RamdiskPatcherFn>> &rps);
+                                 std::vector<std::function<RamdiskPatcherFn>> &rps,
+                                 const std::string &rom_id);
     static bool patch_ramdisk(const std::string &input_file,
                               const std::string &output_file,
                               unsigned int depth,
                               std::vector<std::function<RamdiskPatcherFn>> &rps);
-    static bool patch_ramdisk_dir(const std::string &ramdisk_dir,
-                                  std::vector<std::function<RamdiskPatcherFn>> &rps);
-    static bool patch_kernel_rkp(const std::string &input_file,
-                                 const std::string &output_file);
+    static bool patch_ramdisk_cpio(util::CpioEditor &cpio,
+                                   unsigned int depth,
+                                   std::vector<std::function<RamdiskPatcherFn>> &rps);
+    static void patch_kernel_rkp(std::string &data);
 
     static bool replace_file(const std::string &replace,
                              const std::string &with);
-
-private:
-    static bool copy_file_to_file(File &fin, File &fout, uint64_t to_copy);
-    static bool copy_file_to_file_eof(File &fin, File &fout);
 };
 
 }
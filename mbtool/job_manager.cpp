@@ -0,0 +1,989 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "job_manager.h"
+
+#include <algorithm>
+#include <deque>
+#include <memory>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/integer.h"
+#include "mbutil/process.h"
+#include "mbutil/socket.h"
+
+#include "daemon_v3.h"
+
+#include "protocol/response_generated.h"
+
+// Number of jobs that can run at the same time
+#define JOB_POOL_SIZE                   2
+// Number of finished jobs whose results are kept
+#define MAX_FINISHED_JOBS               32
+// Number of output lines kept for each job
+#define MAX_OUTPUT_LINES                256
+
+#define JOB_CMD_SUBMIT                  1
+#define JOB_CMD_STATUS                  2
+#define JOB_CMD_WAIT                    3
+#define JOB_CMD_CANCEL                  4
+
+#define JOB_STATUS_OK                   0
+#define JOB_STATUS_NOT_FOUND            1
+#define JOB_STATUS_ERROR                2
+
+namespace mb
+{
+
+namespace v3 = mbtool::daemon::v3;
+
+struct Job
+{
+    uint64_t id;
+    // Serialized v3 request
+    std::vector<uint8_t> request;
+
+    JobInfo info;
+    // Recent output lines. The first line is number
+    // (info.output_seq - output.size())
+    std::deque<std::string> output;
+
+    pid_t pid = -1;
+    // Responses sent by the job process
+    int sock_fd = -1;
+    std::unique_ptr<util::FramedSocket> socket;
+    // Progress reports from the job process and its children
+    int progress_fd = -1;
+    std::string progress_buf;
+    bool cancel_requested = false;
+};
+
+struct Waiter
+{
+    int fd;
+    uint64_t id;
+    uint64_t seq;
+    uint64_t output_seq;
+};
+
+static int registration_fd = -1;
+static int manager_fd = -1;
+
+static uint64_t next_id = 1;
+static std::deque<std::unique_ptr<Job>> jobs;
+static std::vector<int> clients;
+static std::vector<Waiter> waiters;
+
+static bool is_done(JobState state)
+{
+    return state == JobState::Finished
+            || state == JobState::Failed
+            || state == JobState::Cancelled;
+}
+
+static Job * find_job(uint64_t id)
+{
+    for (auto &job : jobs) {
+        if (job->id == id) {
+            return job.get();
+        }
+    }
+    return nullptr;
+}
+
+static bool write_info(int fd, const JobInfo &info,
+                       const std::vector<std::string> &lines)
+{
+    return util::socket_write_int32(fd, static_cast<int32_t>(info.state))
+            && util::socket_write_string(fd, info.stage)
+            && util::socket_write_uint64(fd, info.bytes_done)
+            && util::socket_write_uint64(fd, info.bytes_total)
+            && util::socket_write_uint64(fd, info.files_done)
+            && util::socket_write_uint64(fd, info.files_total)
+            && util::socket_write_uint64(fd, info.seq)
+            && util::socket_write_uint64(fd, info.output_seq)
+            && util::socket_write_string_array(fd, lines)
+            && util::socket_write_bytes(fd, info.response.data(),
+                                        info.response.size());
+}
+
+static bool read_info(int fd, JobInfo *info)
+{
+    int32_t state;
+
+    if (!util::socket_read_int32(fd, &state)
+            || !util::socket_read_string(fd, &info->stage)
+            || !util::socket_read_uint64(fd, &info->bytes_done)
+            || !util::socket_read_uint64(fd, &info->bytes_total)
+            || !util::socket_read_uint64(fd, &info->files_done)
+            || !util::socket_read_uint64(fd, &info->files_total)
+            || !util::socket_read_uint64(fd, &info->seq)
+            || !util::socket_read_uint64(fd, &info->output_seq)
+            || !util::socket_read_string_array(fd, &info->output_lines)
+            || !util::socket_read_bytes(fd, &info->response)) {
+        return false;
+    }
+
+    info->state = static_cast<JobState>(state);
+    return true;
+}
+
+static bool reply_wait(const Waiter &w, const Job &job)
+{
+    std::vector<std::string> lines;
+    uint64_t first = job.info.output_seq - job.output.size();
+
+    for (uint64_t i = std::max(w.output_seq, first);
+            i < job.info.output_seq; ++i) {
+        lines.push_back(job.output[i - first]);
+    }
+
+    return util::socket_write_int32(w.fd, JOB_STATUS_OK)
+            && write_info(w.fd, job.info, lines);
+}
+
+static void close_client(int fd)
+{
+    close(fd);
+    clients.erase(std::find(clients.begin(), clients.end(), fd));
+    waiters.erase(std::remove_if(waiters.begin(), waiters.end(),
+                                 [&](const Waiter &w) { return w.fd == fd; }),
+                  waiters.end());
+}
+
+/*!
+ * \brief Answer the clients that are waiting for an update of a job
+ */
+static void notify_waiters(Job &job)
+{
+    ++job.info.seq;
+
+    std::vector<int> failed;
+
+    for (auto it = waiters.begin(); it != waiters.end();) {
+        if (it->id == job.id) {
+            if (!reply_wait(*it, job)) {
+                failed.push_back(it->fd);
+            }
+            it = waiters.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    for (int fd : failed) {
+        close_client(fd);
+    }
+}
+
+/*!
+ * \brief Drop the oldest finished jobs once too many have accumulated
+ */
+static void prune_jobs()
+{
+    size_t finished = 0;
+    for (auto const &job : jobs) {
+        if (is_done(job->info.state)) {
+            ++finished;
+        }
+    }
+
+    for (auto it = jobs.begin();
+            finished > MAX_FINISHED_JOBS && it != jobs.end();) {
+        if (is_done((*it)->info.state)) {
+            it = jobs.erase(it);
+            --finished;
+        } else {
+            ++it;
+        }
+    }
+}
+
+/*!
+ * \brief Run a job in the forked job process
+ */
+MB_NO_RETURN
+static void job_process_main(Job &job, int sock_fd, int progress_fd)
+{
+    // The job process only needs its own sockets
+    close(registration_fd);
+    for (int fd : clients) {
+        close(fd);
+    }
+    for (auto const &other : jobs) {
+        if (other->sock_fd >= 0) {
+            close(other->sock_fd);
+        }
+        if (other->progress_fd >= 0) {
+            close(other->progress_fd);
+        }
+    }
+
+    setpgid(0, 0);
+
+    // Like connection workers, jobs mount things (eg. the tmpfs for
+    // SignedExec) that must not be visible to other jobs
+    if (unshare(CLONE_NEWNS) < 0
+            || mount("", "/", "", MS_PRIVATE | MS_REC, "") < 0) {
+        LOGW("Failed to unshare mount namespace: %s", strerror(errno));
+    }
+
+    struct sigaction sa;
+    sa.sa_handler = SIG_DFL;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGPIPE, &sa, nullptr);
+
+    util::set_process_title_v(
+            nullptr, "mbtool job %" PRIu64, job.id);
+
+    // Signed binaries inherit the progress fd
+    char fd_str[16];
+    snprintf(fd_str, sizeof(fd_str), "%d", progress_fd);
+    if (fcntl(progress_fd, F_SETFD, 0) < 0
+            || setenv(JOB_PROGRESS_FD_ENV, fd_str, 1) < 0) {
+        LOGW("Progress will not be reported: %s", strerror(errno));
+    }
+
+    bool ret = connection_version_3_run_job(
+            sock_fd, job.request.data(), job.request.size());
+    _exit(ret ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static bool launch_job(Job &job)
+{
+    int sv[2];
+    int pipe_fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        LOGE("Failed to create socket pair: %s", strerror(errno));
+        return false;
+    }
+
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        LOGE("Failed to create pipe: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOGE("Failed to fork: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return false;
+    } else if (pid == 0) {
+        close(sv[0]);
+        close(pipe_fds[0]);
+        job_process_main(job, sv[1], pipe_fds[1]);
+    }
+
+    // Also set in the child so that cancelling can't race with it
+    setpgid(pid, pid);
+
+    close(sv[1]);
+    close(pipe_fds[1]);
+
+    job.pid = pid;
+    job.sock_fd = sv[0];
+    job.socket.reset(new util::FramedSocket(sv[0]));
+    job.progress_fd = pipe_fds[0];
+    job.info.state = JobState::Running;
+
+    LOGD("Started job %" PRIu64 " in process %d", job.id, pid);
+    return true;
+}
+
+static void close_progress(Job &job)
+{
+    if (job.progress_fd >= 0) {
+        close(job.progress_fd);
+        job.progress_fd = -1;
+    }
+    job.progress_buf.clear();
+}
+
+static void finish_job(Job &job)
+{
+    job.socket.reset();
+    close(job.sock_fd);
+    job.sock_fd = -1;
+
+    // Children of the job (eg. a daemonized process) may hold on to the
+    // progress pipe forever
+    close_progress(job);
+
+    int status;
+    if (waitpid(job.pid, &status, 0) < 0) {
+        LOGW("Failed to wait for job %" PRIu64 ": %s",
+             job.id, strerror(errno));
+    }
+    job.pid = -1;
+
+    if (job.cancel_requested) {
+        job.info.state = JobState::Cancelled;
+        job.info.response.clear();
+    } else if (!job.info.response.empty()) {
+        job.info.state = JobState::Finished;
+    } else {
+        job.info.state = JobState::Failed;
+    }
+
+    LOGD("Job %" PRIu64 " exited", job.id);
+
+    notify_waiters(job);
+}
+
+static void schedule_jobs()
+{
+    size_t running = 0;
+    for (auto const &job : jobs) {
+        if (job->info.state == JobState::Running) {
+            ++running;
+        }
+    }
+
+    for (auto &job : jobs) {
+        if (running >= JOB_POOL_SIZE) {
+            break;
+        }
+        if (job->info.state != JobState::Queued) {
+            continue;
+        }
+
+        if (launch_job(*job)) {
+            ++running;
+        } else {
+            job->info.state = JobState::Failed;
+        }
+        notify_waiters(*job);
+    }
+
+    prune_jobs();
+}
+
+static void add_output_line(Job &job, const char *line, size_t size)
+{
+    job.output.emplace_back(line, size);
+    if (job.output.size() > MAX_OUTPUT_LINES) {
+        job.output.pop_front();
+    }
+    ++job.info.output_seq;
+}
+
+/*!
+ * \brief Handle the responses sent by a job process
+ *
+ * \return False if the job process has exited
+ */
+static bool process_job_output(Job &job)
+{
+    bool updated = false;
+
+    do {
+        const uint8_t *data;
+        size_t size;
+
+        if (!job.socket->read_frame(&data, &size)) {
+            if (updated) {
+                notify_waiters(job);
+            }
+            return false;
+        }
+
+        auto verifier = flatbuffers::Verifier(data, size);
+        if (!v3::VerifyResponseBuffer(verifier)) {
+            LOGW("Job %" PRIu64 " sent an invalid response", job.id);
+            continue;
+        }
+
+        auto response = v3::GetResponse(data);
+        if (response->response_type()
+                == v3::ResponseType_SignedExecOutputResponse) {
+            auto output = static_cast<const v3::SignedExecOutputResponse *>(
+                    response->response());
+            if (output->line()) {
+                add_output_line(job, output->line()->c_str(),
+                                output->line()->size());
+                updated = true;
+            }
+        } else {
+            job.info.response.assign(data, data + size);
+        }
+    } while (job.socket->has_buffered_frame());
+
+    if (updated) {
+        notify_waiters(job);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Parse a progress report line
+ *
+ * Reports are "<stage>\t<bytes done>\t<bytes total>\t<files done>\t
+ * <files total>" lines.
+ */
+static bool parse_progress(const std::string &line, JobInfo *info)
+{
+    std::vector<std::string> fields;
+    size_t begin = 0;
+
+    while (true) {
+        size_t end = line.find('\t', begin);
+        fields.push_back(line.substr(begin, end - begin));
+        if (end == std::string::npos) {
+            break;
+        }
+        begin = end + 1;
+    }
+
+    uint64_t values[4];
+
+    if (fields.size() != 5) {
+        return false;
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        if (!util::str_to_unum(fields[i + 1].c_str(), 10, &values[i])) {
+            return false;
+        }
+    }
+
+    info->stage = std::move(fields[0]);
+    info->bytes_done = values[0];
+    info->bytes_total = values[1];
+    info->files_done = values[2];
+    info->files_total = values[3];
+    return true;
+}
+
+static void process_job_progress(Job &job)
+{
+    char buf[4096];
+
+    ssize_t n = read(job.progress_fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR) {
+        return;
+    } else if (n <= 0) {
+        close_progress(job);
+        return;
+    }
+
+    job.progress_buf.append(buf, static_cast<size_t>(n));
+
+    bool updated = false;
+    size_t pos;
+
+    while ((pos = job.progress_buf.find('\n')) != std::string::npos) {
+        std::string line = job.progress_buf.substr(0, pos);
+        job.progress_buf.erase(0, pos + 1);
+
+        if (parse_progress(line, &job.info)) {
+            updated = true;
+        } else {
+            LOGW("Job %" PRIu64 " sent an invalid progress report", job.id);
+        }
+    }
+
+    // Don't let a misbehaving process make us buffer everything
+    if (job.progress_buf.size() > sizeof(buf)) {
+        job.progress_buf.clear();
+    }
+
+    if (updated) {
+        notify_waiters(job);
+    }
+}
+
+static bool serve_submit(int fd)
+{
+    auto job = std::unique_ptr<Job>(new Job());
+
+    if (!util::socket_read_bytes(fd, &job->request)) {
+        return false;
+    }
+
+    job->id = next_id++;
+    job->info = JobInfo();
+    job->info.state = JobState::Queued;
+
+    uint64_t id = job->id;
+    jobs.push_back(std::move(job));
+
+    if (!util::socket_write_int32(fd, JOB_STATUS_OK)
+            || !util::socket_write_uint64(fd, id)) {
+        return false;
+    }
+
+    schedule_jobs();
+    return true;
+}
+
+static bool serve_client(int fd)
+{
+    int32_t cmd;
+    uint64_t id;
+
+    if (!util::socket_read_int32(fd, &cmd)) {
+        return false;
+    }
+
+    if (cmd == JOB_CMD_SUBMIT) {
+        return serve_submit(fd);
+    }
+
+    if (!util::socket_read_uint64(fd, &id)) {
+        return false;
+    }
+
+    Job *job = find_job(id);
+
+    switch (cmd) {
+    case JOB_CMD_STATUS:
+        if (!job) {
+            return util::socket_write_int32(fd, JOB_STATUS_NOT_FOUND);
+        }
+        return util::socket_write_int32(fd, JOB_STATUS_OK)
+                && write_info(fd, job->info, {});
+
+    case JOB_CMD_WAIT: {
+        Waiter w;
+        w.fd = fd;
+        w.id = id;
+
+        if (!util::socket_read_uint64(fd, &w.seq)
+                || !util::socket_read_uint64(fd, &w.output_seq)) {
+            return false;
+        }
+
+        if (!job) {
+            return util::socket_write_int32(fd, JOB_STATUS_NOT_FOUND);
+        }
+
+        // Answer immediately if the client has missed an update
+        if (job->info.seq != w.seq || is_done(job->info.state)) {
+            return reply_wait(w, *job);
+        }
+
+        waiters.push_back(w);
+        return true;
+    }
+
+    case JOB_CMD_CANCEL:
+        if (!job) {
+            return util::socket_write_int32(fd, JOB_STATUS_NOT_FOUND);
+        }
+
+        if (job->info.state == JobState::Queued) {
+            job->info.state = JobState::Cancelled;
+            notify_waiters(*job);
+            prune_jobs();
+        } else if (job->info.state == JobState::Running) {
+            // The job is marked as cancelled once its process exits
+            job->cancel_requested = true;
+            if (kill(-job->pid, SIGTERM) < 0) {
+                LOGW("Failed to kill job %" PRIu64 ": %s",
+                     id, strerror(errno));
+            }
+        }
+
+        return util::socket_write_int32(fd, JOB_STATUS_OK);
+
+    default:
+        LOGE("Unknown job manager command: %d", cmd);
+        return false;
+    }
+}
+
+static bool has_running_jobs()
+{
+    for (auto const &job : jobs) {
+        if (job->info.state == JobState::Running) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool manager_main(int reg_fd)
+{
+    if (!util::set_process_title_v(nullptr, "mbtool job manager")) {
+        LOGE("Failed to set process title: %s", strerror(errno));
+        return false;
+    }
+
+    // The daemon ignores SIGCHLD, but job processes must be waited for to get
+    // their exit status
+    struct sigaction sa;
+    sa.sa_handler = SIG_DFL;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    if (sigaction(SIGCHLD, &sa, nullptr) < 0) {
+        LOGE("Failed to set default SIGCHLD handler: %s", strerror(errno));
+        return false;
+    }
+
+    registration_fd = reg_fd;
+
+    std::vector<struct pollfd> pfds;
+    // Job and field (0 = socket, 1 = progress) of each job pollfd
+    std::vector<std::pair<Job *, int>> job_pfds;
+
+    while (true) {
+        // Stop once the daemon is gone and nothing is running anymore
+        if (registration_fd < 0 && !has_running_jobs()) {
+            return true;
+        }
+
+        pfds.clear();
+        job_pfds.clear();
+
+        pfds.push_back({ registration_fd, POLLIN, 0 });
+        for (int fd : clients) {
+            pfds.push_back({ fd, POLLIN, 0 });
+        }
+        for (auto &job : jobs) {
+            if (job->sock_fd >= 0) {
+                pfds.push_back({ job->sock_fd, POLLIN, 0 });
+                job_pfds.emplace_back(job.get(), 0);
+            }
+            if (job->progress_fd >= 0) {
+                pfds.push_back({ job->progress_fd, POLLIN, 0 });
+                job_pfds.emplace_back(job.get(), 1);
+            }
+        }
+
+        if (poll(pfds.data(), pfds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Failed to poll: %s", strerror(errno));
+            return false;
+        }
+
+        size_t job_base = 1 + clients.size();
+        bool job_exited = false;
+
+        // Progress is handled before the job's responses so that the final
+        // progress is reported before the job is marked as finished
+        for (size_t i = 0; i < job_pfds.size(); ++i) {
+            Job *job = job_pfds[i].first;
+            if (pfds[job_base + i].revents && job_pfds[i].second == 1
+                    && job->progress_fd >= 0) {
+                process_job_progress(*job);
+            }
+        }
+        for (size_t i = 0; i < job_pfds.size(); ++i) {
+            Job *job = job_pfds[i].first;
+            if (pfds[job_base + i].revents && job_pfds[i].second == 0
+                    && !process_job_output(*job)) {
+                finish_job(*job);
+                job_exited = true;
+            }
+        }
+
+        std::vector<int> ready;
+        for (size_t i = 1; i < job_base; ++i) {
+            if (pfds[i].revents) {
+                ready.push_back(pfds[i].fd);
+            }
+        }
+        for (int fd : ready) {
+            // The client may have been closed while answering other waiters
+            if (std::find(clients.begin(), clients.end(), fd) != clients.end()
+                    && !serve_client(fd)) {
+                close_client(fd);
+            }
+        }
+
+        if (pfds[0].fd >= 0 && pfds[0].revents) {
+            std::vector<int> fds(1);
+
+            if (util::socket_receive_fds(registration_fd, &fds)) {
+                clients.push_back(fds[0]);
+            } else if (errno == EPIPE) {
+                // The daemon and all of its connections have exited. Running
+                // jobs are allowed to finish, but queued jobs are dropped.
+                close(registration_fd);
+                registration_fd = -1;
+                for (auto &job : jobs) {
+                    if (job->info.state == JobState::Queued) {
+                        job->info.state = JobState::Cancelled;
+                    }
+                }
+            } else {
+                LOGE("Failed to receive client socket: %s", strerror(errno));
+            }
+        }
+
+        if (job_exited && registration_fd >= 0) {
+            schedule_jobs();
+        }
+    }
+}
+
+/*!
+ * \brief Fork the job manager process
+ *
+ * The job manager runs requests submitted with job_manager_submit() in
+ * separate job processes, at most JOB_POOL_SIZE at a time, and keeps track of
+ * their progress and results. Because jobs are not tied to a connection, the
+ * client can disconnect and check on a job later.
+ *
+ * Like the connection workers, this must be called in the daemon process.
+ *
+ * \param listen_fd Daemon socket, which is closed in the manager process
+ */
+bool job_manager_start(int listen_fd)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        LOGE("Failed to create socket pair: %s", strerror(errno));
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOGE("Failed to fork: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    } else if (pid == 0) {
+        close(listen_fd);
+        close(sv[0]);
+        _exit(manager_main(sv[1]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(sv[1]);
+
+    registration_fd = sv[0];
+    return true;
+}
+
+static bool connect_manager()
+{
+    if (manager_fd >= 0) {
+        return true;
+    } else if (registration_fd < 0) {
+        errno = ENOTCONN;
+        return false;
+    }
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        return false;
+    }
+
+    bool ret = util::socket_send_fds(registration_fd, { sv[1] });
+    close(sv[1]);
+
+    if (!ret) {
+        close(sv[0]);
+        return false;
+    }
+
+    manager_fd = sv[0];
+    return true;
+}
+
+static void disconnect_manager()
+{
+    close(manager_fd);
+    manager_fd = -1;
+}
+
+static bool read_status(bool *found)
+{
+    int32_t status;
+
+    if (!util::socket_read_int32(manager_fd, &status)) {
+        return false;
+    }
+
+    *found = status != JOB_STATUS_NOT_FOUND;
+    return true;
+}
+
+/*!
+ * \brief Queue a v3 request to be run as a job
+ *
+ * \param[in] request Serialized v3 request
+ * \param[in] size Size of \p request
+ * \param[out] id Job ID
+ */
+bool job_manager_submit(const uint8_t *request, size_t size, uint64_t *id)
+{
+    int32_t status;
+
+    if (!connect_manager()) {
+        return false;
+    }
+
+    if (!util::socket_write_int32(manager_fd, JOB_CMD_SUBMIT)
+            || !util::socket_write_bytes(manager_fd, request, size)
+            || !util::socket_read_int32(manager_fd, &status)
+            || !util::socket_read_uint64(manager_fd, id)) {
+        disconnect_manager();
+        return false;
+    }
+
+    if (status != JOB_STATUS_OK) {
+        errno = EAGAIN;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Get the current progress of a job
+ *
+ * \return False if the job manager is unavailable. Otherwise, \p found is set
+ *         to whether the job exists and \p info is filled in if it does.
+ */
+bool job_manager_status(uint64_t id, bool *found, JobInfo *info)
+{
+    if (!connect_manager()) {
+        return false;
+    }
+
+    if (!util::socket_write_int32(manager_fd, JOB_CMD_STATUS)
+            || !util::socket_write_uint64(manager_fd, id)
+            || !read_status(found)
+            || (*found && !read_info(manager_fd, info))) {
+        disconnect_manager();
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Wait for the progress of a job to change
+ *
+ * This returns immediately if the job has already finished or if \p seq is
+ * not the job's current sequence number. Otherwise, it blocks until the job
+ * makes progress.
+ *
+ * \param id Job ID
+ * \param seq Sequence number from the previous JobInfo
+ * \param output_seq Number of output lines that have already been received
+ * \param found Set to whether the job exists
+ * \param info Updated progress with the output lines after \p output_seq
+ */
+bool job_manager_wait(uint64_t id, uint64_t seq, uint64_t output_seq,
+                      bool *found, JobInfo *info)
+{
+    if (!connect_manager()) {
+        return false;
+    }
+
+    if (!util::socket_write_int32(manager_fd, JOB_CMD_WAIT)
+            || !util::socket_write_uint64(manager_fd, id)
+            || !util::socket_write_uint64(manager_fd, seq)
+            || !util::socket_write_uint64(manager_fd, output_seq)
+            || !read_status(found)
+            || (*found && !read_info(manager_fd, info))) {
+        disconnect_manager();
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Cancel a job
+ *
+ * Queued jobs are cancelled immediately. Running jobs are sent SIGTERM and are
+ * marked as cancelled once they exit.
+ */
+bool job_manager_cancel(uint64_t id, bool *found)
+{
+    if (!connect_manager()) {
+        return false;
+    }
+
+    if (!util::socket_write_int32(manager_fd, JOB_CMD_CANCEL)
+            || !util::socket_write_uint64(manager_fd, id)
+            || !read_status(found)) {
+        disconnect_manager();
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Report the progress of the current job to the job manager
+ *
+ * This does nothing if the process was not started by a job.
+ */
+void job_progress_report(const char *stage,
+                         uint64_t bytes_done, uint64_t bytes_total,
+                         uint64_t files_done, uint64_t files_total)
+{
+    static int fd = -2;
+
+    if (fd == -2) {
+        const char *value = getenv(JOB_PROGRESS_FD_ENV);
+        if (!value || !util::str_to_snum(value, 10, &fd)
+                || fcntl(fd, F_GETFD) < 0) {
+            fd = -1;
+        }
+    }
+
+    if (fd < 0) {
+        return;
+    }
+
+    char buf[256];
+    int n = snprintf(buf, sizeof(buf),
+                     "%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+                     stage, bytes_done, bytes_total, files_done, files_total);
+    if (n < 0 || static_cast<size_t>(n) >= sizeof(buf)) {
+        return;
+    }
+
+    // Reports are small enough to be written atomically to the pipe
+    if (write(fd, buf, static_cast<size_t>(n)) < 0 && errno == EPIPE) {
+        fd = -1;
+    }
+}
+
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+// Environment variable holding the fd that job processes report progress to
+#define JOB_PROGRESS_FD_ENV             "MBTOOL_JOB_PROGRESS_FD"
+
+namespace mb
+{
+
+enum class JobState
+{
+    Queued,
+    Running,
+    Finished,
+    Failed,
+    Cancelled,
+};
+
+struct JobInfo
+{
+    JobState state;
+    std::string stage;
+    uint64_t bytes_done;
+    uint64_t bytes_total;
+    uint64_t files_done;
+    uint64_t files_total;
+    // Incremented whenever any of the above changes or output is produced
+    uint64_t seq;
+    // Number of output lines produced so far
+    uint64_t output_seq;
+    // Output lines after the requested output_seq (job_manager_wait() only)
+    std::vector<std::string> output_lines;
+    // Serialized v3 response (if state == JobState::Finished)
+    std::vector<uint8_t> response;
+};
+
+bool job_manager_start(int listen_fd);
+bool job_manager_submit(const uint8_t *request, size_t size, uint64_t *id);
+bool job_manager_status(uint64_t id, bool *found, JobInfo *info);
+bool job_manager_wait(uint64_t id, uint64_t seq, uint64_t output_seq,
+                      bool *found, JobInfo *info);
+bool job_manager_cancel(uint64_t id, bool *found);
+
+void job_progress_report(const char *stage,
+                         uint64_t bytes_done, uint64_t bytes_total,
+                         uint64_t files_done, uint64_t files_total);
+
+}
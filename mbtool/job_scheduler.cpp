@@ -0,0 +1,408 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "job_scheduler.h"
+
+#include <new>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+
+// Maximum number of jobs of each class that are tracked at the same time
+#define MAX_JOBS                        16
+
+// Priorities of a background job while no interactive job is running
+#define BACKGROUND_NICE                 10
+#define BACKGROUND_IOPRIO_LEVEL         7
+
+// Priorities of a background job while an interactive job is running
+#define PREEMPTED_NICE                  19
+
+// From the kernel's include/linux/ioprio.h, which is not exported to userspace
+// on older kernels
+#define IOPRIO_CLASS_SHIFT              13
+#define IOPRIO_PRIO_VALUE(cls, data)    (((cls) << IOPRIO_CLASS_SHIFT) | (data))
+
+enum
+{
+    IOPRIO_CLASS_NONE,
+    IOPRIO_CLASS_RT,
+    IOPRIO_CLASS_BE,
+    IOPRIO_CLASS_IDLE,
+};
+
+enum
+{
+    IOPRIO_WHO_PROCESS = 1,
+    IOPRIO_WHO_PGRP,
+    IOPRIO_WHO_USER,
+};
+
+namespace mb
+{
+
+/*!
+ * \brief Job queues shared by the daemon and all of its connections
+ *
+ * Each background job is identified by its process group so that the
+ * processes it spawns (eg. for SignedExec) can be demoted along with it.
+ * Interactive jobs are identified by the PID of the connection process so
+ * that stale entries left by a connection that crashed can be detected.
+ */
+struct SchedulerState
+{
+    pthread_mutex_t lock;
+    pid_t interactive[MAX_JOBS];
+    pid_t background[MAX_JOBS];
+};
+
+static SchedulerState *state = nullptr;
+
+static cpu_set_t background_cpus;
+static bool have_background_cpus = false;
+
+static int ioprio_get(int which, int who)
+{
+    return static_cast<int>(syscall(__NR_ioprio_get, which, who));
+}
+
+static int ioprio_set(int which, int who, int ioprio)
+{
+    return static_cast<int>(syscall(__NR_ioprio_set, which, who, ioprio));
+}
+
+/*!
+ * \brief Apply the priorities for a background job to its process group
+ *
+ * \return False if the process group no longer exists
+ */
+static bool apply_background_priority(pid_t pgid, bool preempted)
+{
+    int nice = preempted ? PREEMPTED_NICE : BACKGROUND_NICE;
+    int ioprio = preempted
+            ? IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)
+            : IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, BACKGROUND_IOPRIO_LEVEL);
+
+    if (setpriority(PRIO_PGRP, static_cast<id_t>(pgid), nice) < 0) {
+        if (errno == ESRCH) {
+            return false;
+        }
+        LOGW("Failed to set CPU priority of process group %d: %s",
+             pgid, strerror(errno));
+    }
+
+    if (ioprio_set(IOPRIO_WHO_PGRP, pgid, ioprio) < 0) {
+        if (errno == ESRCH) {
+            return false;
+        }
+        LOGW("Failed to set I/O priority of process group %d: %s",
+             pgid, strerror(errno));
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Remove interactive jobs whose connection process no longer exists
+ *
+ * \note The caller must hold the state lock
+ */
+static bool has_interactive_jobs_locked()
+{
+    bool ret = false;
+
+    for (pid_t &pid : state->interactive) {
+        if (pid == 0) {
+            continue;
+        }
+        if (kill(pid, 0) < 0 && errno == ESRCH) {
+            pid = 0;
+            continue;
+        }
+        ret = true;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Reapply the priorities of all background jobs
+ *
+ * \note The caller must hold the state lock
+ */
+static void update_background_jobs_locked(bool preempted)
+{
+    for (pid_t &pgid : state->background) {
+        if (pgid != 0 && !apply_background_priority(pgid, preempted)) {
+            pgid = 0;
+        }
+    }
+}
+
+static bool add_job_locked(pid_t *jobs, pid_t id)
+{
+    for (int i = 0; i < MAX_JOBS; ++i) {
+        if (jobs[i] == 0) {
+            jobs[i] = id;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void remove_job_locked(pid_t *jobs, pid_t id)
+{
+    for (int i = 0; i < MAX_JOBS; ++i) {
+        if (jobs[i] == id) {
+            jobs[i] = 0;
+            return;
+        }
+    }
+}
+
+/*!
+ * \brief Set up the job queues shared by all connections
+ *
+ * If the queues are unavailable, background jobs still run at a lower priority,
+ * but are not preempted by interactive jobs.
+ */
+bool job_scheduler_init()
+{
+    void *ptr = mmap(nullptr, sizeof(SchedulerState), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        LOGE("Failed to map job queues: %s", strerror(errno));
+        return false;
+    }
+
+    auto s = new (ptr) SchedulerState();
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    int ret = pthread_mutex_init(&s->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if (ret != 0) {
+        LOGE("Failed to initialize job queue lock: %s", strerror(ret));
+        munmap(ptr, sizeof(SchedulerState));
+        return false;
+    }
+
+    state = s;
+    return true;
+}
+
+/*!
+ * \brief Restrict background jobs to a set of CPUs
+ *
+ * \param list Comma-separated list of CPUs or CPU ranges (eg. "0-3,6")
+ *
+ * \return False if \p list is not a valid CPU list
+ */
+bool job_scheduler_set_background_cpus(const char *list)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    const char *p = list;
+    while (true) {
+        char *end;
+
+        errno = 0;
+        unsigned long first = strtoul(p, &end, 10);
+        if (errno != 0 || end == p || first >= CPU_SETSIZE) {
+            return false;
+        }
+        unsigned long last = first;
+
+        p = end;
+        if (*p == '-') {
+            ++p;
+            errno = 0;
+            last = strtoul(p, &end, 10);
+            if (errno != 0 || end == p || last >= CPU_SETSIZE
+                    || last < first) {
+                return false;
+            }
+            p = end;
+        }
+
+        for (unsigned long cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, &set);
+        }
+
+        if (*p == '\0') {
+            break;
+        } else if (*p != ',') {
+            return false;
+        }
+        ++p;
+    }
+
+    background_cpus = set;
+    have_background_cpus = true;
+    return true;
+}
+
+/*!
+ * \brief Run the rest of the current process as a background job
+ *
+ * This is meant for helper processes of the daemon that only do background
+ * work, like the directory size cache.
+ */
+bool job_scheduler_enter_background()
+{
+    // Never restored since the job lasts until the process exits
+    auto job = new (std::nothrow) JobScope(JobClass::Background);
+    return job != nullptr;
+}
+
+JobScope::JobScope(JobClass job_class)
+    : _job_class(job_class)
+    , _registered(false)
+    , _saved(false)
+    , _have_affinity(false)
+{
+    if (job_class == JobClass::Interactive) {
+        if (!state) {
+            return;
+        }
+
+        pthread_mutex_lock(&state->lock);
+        bool was_idle = !has_interactive_jobs_locked();
+        _registered = add_job_locked(state->interactive, getpid());
+        if (_registered && was_idle) {
+            update_background_jobs_locked(true);
+        }
+        pthread_mutex_unlock(&state->lock);
+        return;
+    }
+
+    // Give the connection its own process group so that the priority of the
+    // job and all of its child processes can be changed at once
+    if (getpgrp() != getpid() && setpgid(0, 0) < 0) {
+        LOGW("Failed to create process group: %s", strerror(errno));
+        return;
+    }
+
+    errno = 0;
+    _nice = getpriority(PRIO_PROCESS, 0);
+    if (_nice == -1 && errno != 0) {
+        LOGW("Failed to get CPU priority: %s", strerror(errno));
+        return;
+    }
+
+    _ioprio = ioprio_get(IOPRIO_WHO_PROCESS, 0);
+    if (_ioprio < 0) {
+        LOGW("Failed to get I/O priority: %s", strerror(errno));
+        return;
+    }
+
+    _policy = sched_getscheduler(0);
+    if (_policy < 0 || sched_getparam(0, &_param) < 0) {
+        LOGW("Failed to get scheduling policy: %s", strerror(errno));
+        return;
+    }
+
+    _saved = true;
+
+    struct sched_param param = {};
+    if (sched_setscheduler(0, SCHED_BATCH, &param) < 0) {
+        LOGW("Failed to set SCHED_BATCH policy: %s", strerror(errno));
+    }
+
+    if (have_background_cpus) {
+        if (sched_getaffinity(0, sizeof(_affinity), &_affinity) < 0) {
+            LOGW("Failed to get CPU affinity: %s", strerror(errno));
+        } else if (sched_setaffinity(0, sizeof(background_cpus),
+                                     &background_cpus) < 0) {
+            LOGW("Failed to set CPU affinity: %s", strerror(errno));
+        } else {
+            _have_affinity = true;
+        }
+    }
+
+    pid_t pgid = getpgrp();
+
+    if (state) {
+        pthread_mutex_lock(&state->lock);
+        _registered = add_job_locked(state->background, pgid);
+        apply_background_priority(pgid, has_interactive_jobs_locked());
+        pthread_mutex_unlock(&state->lock);
+    } else {
+        apply_background_priority(pgid, false);
+    }
+}
+
+JobScope::~JobScope()
+{
+    if (_job_class == JobClass::Interactive) {
+        if (!_registered) {
+            return;
+        }
+
+        pthread_mutex_lock(&state->lock);
+        remove_job_locked(state->interactive, getpid());
+        if (!has_interactive_jobs_locked()) {
+            update_background_jobs_locked(false);
+        }
+        pthread_mutex_unlock(&state->lock);
+        return;
+    }
+
+    if (!_saved) {
+        return;
+    }
+
+    pid_t pgid = getpgrp();
+
+    // Unregister first so that an interactive job can't demote us again
+    if (_registered) {
+        pthread_mutex_lock(&state->lock);
+        remove_job_locked(state->background, pgid);
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    if (setpriority(PRIO_PGRP, static_cast<id_t>(pgid), _nice) < 0) {
+        LOGW("Failed to restore CPU priority: %s", strerror(errno));
+    }
+    if (ioprio_set(IOPRIO_WHO_PGRP, pgid, _ioprio) < 0) {
+        LOGW("Failed to restore I/O priority: %s", strerror(errno));
+    }
+    if (sched_setscheduler(0, _policy, &_param) < 0) {
+        LOGW("Failed to restore scheduling policy: %s", strerror(errno));
+    }
+    if (_have_affinity
+            && sched_setaffinity(0, sizeof(_affinity), &_affinity) < 0) {
+        LOGW("Failed to restore CPU affinity: %s", strerror(errno));
+    }
+}
+
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "mbcommon/common.h"
+
+#include <sched.h>
+#include <sys/types.h>
+
+namespace mb
+{
+
+enum class JobClass
+{
+    // Latency-sensitive requests, like listing or switching ROMs
+    Interactive,
+    // Long-running work, like backups, wipes, and directory size scans
+    Background,
+};
+
+bool job_scheduler_init();
+bool job_scheduler_set_background_cpus(const char *list);
+bool job_scheduler_enter_background();
+
+/*!
+ * \brief Run the current request as an interactive or background job
+ *
+ * A background job lowers the CPU and I/O priority of the calling process
+ * group until the scope ends. While any interactive job is running in the
+ * daemon, all background jobs are further demoted to the idle I/O class.
+ */
+class JobScope
+{
+public:
+    explicit JobScope(JobClass job_class);
+    ~JobScope();
+
+    MB_DISABLE_COPY_CONSTRUCT_AND_ASSIGN(JobScope)
+
+private:
+    JobClass _job_class;
+    bool _registered;
+
+    // Scheduling parameters to restore after a background job
+    bool _saved;
+    int _nice;
+    int _ioprio;
+    int _policy;
+    struct sched_param _param;
+    bool _have_affinity;
+    cpu_set_t _affinity;
+};
+
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "logdump.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include <getopt.h>
+
+#include "mblog/binary_logger.h"
+
+#include "multiboot.h"
+#include "roms.h"
+
+namespace mb
+{
+
+static void logdump_usage(bool error)
+{
+    FILE *stream = error ? stderr : stdout;
+
+    fprintf(stream,
+            "Usage: logdump [OPTION]... [FILE]\n"
+            "\n"
+            "Options:\n"
+            "  -h, --help       Display this help message\n"
+            "\n"
+            "This tool decodes a binary log written by the daemon. If FILE is\n"
+            "omitted, " MULTIBOOT_LOG_DAEMON_BINARY " is read.\n");
+}
+
+static const char * level_string(log::LogLevel level)
+{
+    switch (level) {
+    case log::LogLevel::Error:
+        return "E";
+    case log::LogLevel::Warning:
+        return "W";
+    case log::LogLevel::Info:
+        return "I";
+    case log::LogLevel::Debug:
+        return "D";
+    case log::LogLevel::Verbose:
+        return "V";
+    default:
+        return "?";
+    }
+}
+
+static bool print_record(const log::BinaryLogRecord &record)
+{
+    time_t secs = static_cast<time_t>(record.timestamp / 1000000000u);
+    unsigned int millis = static_cast<unsigned int>(
+            record.timestamp % 1000000000u / 1000000u);
+    struct tm tm;
+    char buf[64];
+
+    localtime_r(&secs, &tm);
+    strftime(buf, sizeof(buf), "%Y/%m/%d %H:%M:%S", &tm);
+
+    if (record.type == log::BinaryLogRecordType::Session) {
+        printf("----- %s.%03u: session started by %s (pid %u) -----\n",
+               buf, millis, record.text.c_str(), record.pid);
+    } else {
+        printf("[%s.%03u] [%s] %u: %s\n",
+               buf, millis, level_string(record.level), record.pid,
+               record.text.c_str());
+    }
+
+    return true;
+}
+
+int logdump_main(int argc, char *argv[])
+{
+    int opt;
+
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "h", long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'h':
+            logdump_usage(false);
+            return EXIT_SUCCESS;
+        default:
+            logdump_usage(true);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind > 1) {
+        logdump_usage(true);
+        return EXIT_FAILURE;
+    }
+
+    std::string path = argc - optind == 1
+            ? argv[optind] : get_raw_path(MULTIBOOT_LOG_DAEMON_BINARY);
+
+    if (!log::binary_log_read(path, &print_record)) {
+        fprintf(stderr, "%s: Failed to read binary log\n", path.c_str());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+}
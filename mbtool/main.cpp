@@ -21,6 +21,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -36,10 +37,12 @@
 #include "auditd.h"
 #include "daemon.h"
 #include "init.h"
+#include "logdump.h"
 #include "miniadbd.h"
 #include "properties.h"
 #include "sepolpatch.h"
 #include "signature.h"
+#include "stats.h"
 #include "uevent_dump.h"
 #endif
 
@@ -53,6 +56,21 @@ int main_multicall(int argc, char *argv[]);
 int main_normal(int argc, char *argv[]);
 static int mbtool_main(int argc, char *argv[]);
 
+#define PROFILE_STARTUP_FLAG    "--profile-startup"
+#define PROFILE_STARTUP_ENV     "MBTOOL_PROFILE_STARTUP"
+
+// Startup timestamps (CLOCK_BOOTTIME) for --profile-startup
+static struct timespec static_init_time;
+static struct timespec main_time;
+static bool profile_startup = false;
+
+// Runs before any other static initializer in the binary
+__attribute__((constructor(101)))
+static void record_static_init_time()
+{
+    clock_gettime(CLOCK_BOOTTIME, &static_init_time);
+}
+
 
 #define TOOL(name) { #name, mb::name##_main }
 
@@ -79,10 +97,12 @@ struct tool tools[] = {
     { "auditd", mb::auditd_main },
     { "daemon", mb::daemon_main },
     { "init", mb::init_main },
+    { "logdump", mb::logdump_main },
     { "miniadbd", mb::miniadbd_main },
     { "properties", mb::properties_main },
     { "sepolpatch", mb::sepolpatch_main },
     { "sigverify", mb::sigverify_main },
+    { "stats", mb::stats_main },
     { "uevent_dump", mb::uevent_dump_main },
 #endif
     { nullptr, nullptr }
@@ -102,6 +122,9 @@ static void mbtool_usage(int error)
             "creating a symbolic link with from the tool name to mbtool.\n\n"
             "To see the usage and other help text for a tool, pass --help to\n"
             "the tool.\n\n"
+            "Pass " PROFILE_STARTUP_FLAG " before the tool name (or set\n"
+            PROFILE_STARTUP_ENV "=true, which is inherited by child\n"
+            "processes) to print startup timings to stderr.\n\n"
             "Available tools:\n",
             mb::version(),
             mb::git_version());
@@ -113,8 +136,97 @@ static void mbtool_usage(int error)
     }
 }
 
+static double ms_between(const struct timespec &a, const struct timespec &b)
+{
+    return static_cast<double>(b.tv_sec - a.tv_sec) * 1000.0
+            + static_cast<double>(b.tv_nsec - a.tv_nsec) / 1000000.0;
+}
+
+/*!
+ * \brief Get the process start time from /proc/self/stat
+ *
+ * The kernel only records it with clock tick (1/HZ) resolution.
+ */
+static bool get_process_start_time(struct timespec &ts)
+{
+    char buf[1024];
+    FILE *fp = fopen("/proc/self/stat", "re");
+    if (!fp) {
+        return false;
+    }
+
+    size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+
+    // The command name may contain spaces, so skip past it
+    char *ptr = strrchr(buf, ')');
+    if (!ptr) {
+        return false;
+    }
+
+    // starttime is field 22 and fields after the command name start at 3
+    unsigned long long start_ticks;
+    char *save_ptr;
+    char *token = strtok_r(ptr + 1, " ", &save_ptr);
+    for (int field = 3; token && field < 22; ++field) {
+        token = strtok_r(nullptr, " ", &save_ptr);
+    }
+    if (!token || sscanf(token, "%llu", &start_ticks) != 1) {
+        return false;
+    }
+
+    long hz = sysconf(_SC_CLK_TCK);
+    if (hz <= 0) {
+        return false;
+    }
+
+    ts.tv_sec = static_cast<time_t>(start_ticks / hz);
+    ts.tv_nsec = static_cast<long>(start_ticks % hz * (1000000000 / hz));
+    return true;
+}
+
+static int run_tool(struct tool *tool, int argc, char *argv[])
+{
+    // Only the innermost tool is profiled
+    if (!profile_startup || tool->func == mbtool_main) {
+        return tool->func(argc, argv);
+    }
+
+    struct timespec start_time;
+    struct timespec tool_time;
+    struct timespec end_time;
+
+    clock_gettime(CLOCK_BOOTTIME, &tool_time);
+
+    fprintf(stderr, "startup profile for %s:\n", tool->name);
+    if (get_process_start_time(start_time)) {
+        fprintf(stderr, "  exec to main:        %9.3f ms (1/HZ resolution)\n",
+                ms_between(start_time, main_time));
+    }
+    fprintf(stderr, "  static init to main: %9.3f ms\n",
+            ms_between(static_init_time, main_time));
+    fprintf(stderr, "  main to first work:  %9.3f ms\n",
+            ms_between(main_time, tool_time));
+
+    // Not reached if the tool exits or execs
+    int ret = tool->func(argc, argv);
+
+    clock_gettime(CLOCK_BOOTTIME, &end_time);
+    fprintf(stderr, "%s: ran for %.3f ms\n", tool->name,
+            ms_between(tool_time, end_time));
+
+    return ret;
+}
+
 static int mbtool_main(int argc, char *argv[])
 {
+    if (argc > 1 && strcmp(argv[1], PROFILE_STARTUP_FLAG) == 0) {
+        profile_startup = true;
+        --argc;
+        ++argv;
+    }
+
     if (argc > 1) {
         return main_multicall(argc - 1, argv + 1);
     } else {
@@ -148,7 +260,7 @@ int main_multicall(int argc, char *argv[])
 
     struct tool *tool = find_tool(name);
     if (tool) {
-        return tool->func(argc, argv);
+        return run_tool(tool, argc, argv);
     } else {
         fprintf(stderr, "%s: tool not found\n", name);
         return EXIT_FAILURE;
@@ -157,6 +269,12 @@ int main_multicall(int argc, char *argv[])
 
 int main_normal(int argc, char *argv[])
 {
+    if (argc > 1 && strcmp(argv[1], PROFILE_STARTUP_FLAG) == 0) {
+        profile_startup = true;
+        --argc;
+        ++argv;
+    }
+
     if (argc < 2) {
         mbtool_usage(1);
         return EXIT_FAILURE;
@@ -165,7 +283,7 @@ int main_normal(int argc, char *argv[])
     char *name = argv[1];
     struct tool *tool = find_tool(name);
     if (tool) {
-        return tool->func(argc - 1, argv + 1);
+        return run_tool(tool, argc - 1, argv + 1);
     } else {
         fprintf(stderr, "%s: tool not found\n", name);
         return EXIT_FAILURE;
@@ -174,6 +292,13 @@ int main_normal(int argc, char *argv[])
 
 int main(int argc, char *argv[])
 {
+    clock_gettime(CLOCK_BOOTTIME, &main_time);
+
+    char *profile_env = getenv(PROFILE_STARTUP_ENV);
+    if (profile_env && strcmp(profile_env, "true") == 0) {
+        profile_startup = true;
+    }
+
     // This works because argv is NULL-terminated
     char **argv_copy = mb::util::dup_cstring_list(argv);
     if (!argv_copy) {
@@ -17,6 +17,7 @@
 #include "sysdeps.h"
 #include "adb.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 
@@ -179,8 +180,8 @@ void send_connect(atransport *t)
     ADB_LOGD(ADB_CONN, "Calling send_connect");
     apacket *cp = get_apacket();
     cp->msg.command = A_CNXN;
-    cp->msg.arg0 = A_VERSION;
-    cp->msg.arg1 = MAX_PAYLOAD;
+    cp->msg.arg0 = t->protocol_version;
+    cp->msg.arg1 = t->max_payload;
     cp->msg.data_length = fill_connect_data((char *)cp->data,
                                             sizeof(cp->data));
     send_packet(cp, t);
@@ -257,12 +258,17 @@ void handle_packet(apacket *p, atransport *t)
         return;
 
     case A_CNXN: /* CONNECT(version, maxdata, "system-id-string") */
-            /* XXX verify version, etc */
         if (t->connection_state != CS_OFFLINE) {
             t->connection_state = CS_OFFLINE;
             handle_offline(t);
         }
 
+        /* Use the highest version and payload size both sides support. Old
+        ** hosts advertise v1 with 4K payloads, newer ones allow up to 256K
+        ** per packet and no longer need the payload checksum */
+        t->protocol_version = std::min<unsigned>(p->msg.arg0, A_VERSION);
+        t->max_payload = std::min<size_t>(p->msg.arg1, MAX_PAYLOAD);
+
         parse_banner(reinterpret_cast<const char*>(p->data), t);
 
         handle_online(t);
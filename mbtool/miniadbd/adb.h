@@ -17,9 +17,13 @@
 #ifndef __ADB_H
 #define __ADB_H
 
+#include <cstddef>
+
 #include "fdevent.h"
 
-#define MAX_PAYLOAD 4096
+#define MAX_PAYLOAD_V1 (4 * 1024)
+#define MAX_PAYLOAD_V2 (256 * 1024)
+#define MAX_PAYLOAD MAX_PAYLOAD_V2
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -29,7 +33,12 @@
 #define A_WRTE 0x45545257
 
 // ADB protocol version.
-#define A_VERSION 0x01000000
+// Version revision:
+// 0x01000000: original
+// 0x01000001: skip checksum
+#define A_VERSION_MIN 0x01000000
+#define A_VERSION_SKIP_CHECKSUM 0x01000001
+#define A_VERSION 0x01000001
 
 struct atransport;
 struct usb_handle;
@@ -195,6 +204,11 @@ struct atransport
     void *key;
     unsigned char token[TOKEN_SIZE];
 
+        /* negotiated in the CNXN exchange; start out at the v1 values until
+        ** the host tells us what it supports */
+    unsigned protocol_version;
+    size_t max_payload;
+
     const char* connection_state_name() const;
 };
 
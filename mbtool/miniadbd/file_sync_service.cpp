@@ -17,10 +17,12 @@
 #include "sysdeps.h"
 #include "file_sync_service.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <utime.h>
 
 #include "adb_io.h"
@@ -154,12 +156,137 @@ static int fail_errno(int s)
     return fail_message(s, strerror(errno));
 }
 
+/* State shared by all transfers of one sync session. Pushed file data is
+** collected in large blocks before it is written out. When the kernel
+** supports it, the DATA payloads are spliced from the sync socket into a
+** pipe and from the pipe into the file so they never get copied through
+** userspace. */
+struct sync_state {
+    char *buffer;           /* SYNC_BUFFER_SIZE bytes */
+    int pipe_fds[2];
+    size_t pipe_size;       /* 0 if splicing is not available */
+};
+
+/* Destination of a single pushed file */
+struct sync_sink {
+    int fd;
+    bool splice_out;        /* false if the filesystem cannot splice */
+    size_t pending;         /* bytes in the pipe or buffer not written yet */
+};
+
+static void sync_pipe_open(sync_state *st)
+{
+    st->pipe_size = 0;
+
+    if (pipe2(st->pipe_fds, O_CLOEXEC) < 0) {
+        st->pipe_fds[0] = -1;
+        st->pipe_fds[1] = -1;
+        return;
+    }
+
+    /* Grow the pipe so a whole block fits. This can fail if the size is
+    ** over the limit, in which case the default size is used */
+    fcntl(st->pipe_fds[1], F_SETPIPE_SZ, SYNC_BUFFER_SIZE);
+    int size = fcntl(st->pipe_fds[1], F_GETPIPE_SZ);
+    if (size >= SYNC_DATA_MAX) {
+        st->pipe_size = std::min<size_t>(size, SYNC_BUFFER_SIZE);
+    }
+}
+
+static void sync_pipe_close(sync_state *st)
+{
+    if (st->pipe_fds[0] >= 0) close(st->pipe_fds[0]);
+    if (st->pipe_fds[1] >= 0) close(st->pipe_fds[1]);
+}
+
+static bool sink_uses_pipe(sync_state *st, sync_sink *sink)
+{
+    return st->pipe_size > 0 && sink->splice_out;
+}
+
+static size_t sink_capacity(sync_state *st, sync_sink *sink)
+{
+    return sink_uses_pipe(st, sink) ? st->pipe_size : SYNC_BUFFER_SIZE;
+}
+
+/* Write all pending data to the file */
+static bool sink_flush(sync_state *st, sync_sink *sink)
+{
+    if (sink->pending == 0) return true;
+
+    if (sink_uses_pipe(st, sink)) {
+        while (sink->pending > 0) {
+            ssize_t n = splice(st->pipe_fds[0], nullptr, sink->fd, nullptr,
+                               sink->pending, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EINVAL) {
+                /* The filesystem does not support splice. Copy what is left
+                ** in the pipe through the buffer and stop splicing */
+                sink->splice_out = false;
+                if (!ReadFdExactly(st->pipe_fds[0], st->buffer,
+                                   sink->pending)) {
+                    return false;
+                }
+                break;
+            }
+            if (n <= 0) return false;
+            sink->pending -= n;
+        }
+        if (sink->pending == 0) return true;
+    }
+
+    bool ret = WriteFdExactly(sink->fd, st->buffer, sink->pending);
+    sink->pending = 0;
+    return ret;
+}
+
+/* Throw away pending data after a write to the file failed */
+static void sink_discard(sync_state *st, sync_sink *sink)
+{
+    if (sink_uses_pipe(st, sink) && sink->pending > 0) {
+        ReadFdExactly(st->pipe_fds[0], st->buffer, sink->pending);
+    }
+    sink->pending = 0;
+}
+
+/* Read a DATA payload of len bytes from the socket into the sink. The caller
+** must make sure that it fits. */
+static bool sink_receive(int s, sync_state *st, sync_sink *sink, size_t len)
+{
+    if (sink_uses_pipe(st, sink)) {
+        size_t moved = 0;
+        while (moved < len) {
+            ssize_t n = splice(s, nullptr, st->pipe_fds[1], nullptr,
+                               len - moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EINVAL && moved == 0
+                    && sink->pending == 0) {
+                /* Older kernels cannot splice from unix sockets */
+                ADB_LOGD(ADB_SERV, "sync: splice not supported");
+                st->pipe_size = 0;
+                break;
+            }
+            if (n <= 0) return false;
+            moved += n;
+        }
+        if (st->pipe_size > 0) {
+            sink->pending += len;
+            return true;
+        }
+    }
+
+    if (!ReadFdExactly(s, st->buffer + sink->pending, len)) return false;
+    sink->pending += len;
+    return true;
+}
+
 static int handle_send_file(int s, char *path, uid_t uid,
-        gid_t gid, mode_t mode, char *buffer, bool do_unlink)
+        gid_t gid, mode_t mode, sync_state *st, bool do_unlink)
 {
     syncmsg msg;
     unsigned int timestamp = 0;
     int fd;
+    sync_sink sink = { -1, true, 0 };
 
     fd = adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
     if (fd < 0 && errno == ENOENT) {
@@ -191,6 +318,7 @@ static int handle_send_file(int s, char *path, uid_t uid,
          */
         fchmod(fd, mode);
     }
+    sink.fd = fd;
 
     for (;;) {
         unsigned int len;
@@ -211,19 +339,34 @@ static int handle_send_file(int s, char *path, uid_t uid,
             fail_message(s, "oversize data message");
             goto fail;
         }
-        if (!ReadFdExactly(s, buffer, len))
-            goto fail;
 
-        if (fd < 0)
-            continue;
-        if (!WriteFdExactly(fd, buffer, len)) {
+        if (fd >= 0 && sink.pending + len > sink_capacity(st, &sink)
+                && !sink_flush(st, &sink)) {
             int saved_errno = errno;
+            sink_discard(st, &sink);
             close(fd);
             if (do_unlink) unlink(path);
             fd = -1;
             errno = saved_errno;
             if (fail_errno(s)) return -1;
         }
+
+        if (fd < 0) {
+            if (!ReadFdExactly(s, st->buffer, len))
+                goto fail;
+        } else {
+            if (!sink_receive(s, st, &sink, len))
+                goto fail;
+        }
+    }
+
+    if (fd >= 0 && !sink_flush(st, &sink)) {
+        int saved_errno = errno;
+        sink_discard(st, &sink);
+        close(fd);
+        if (do_unlink) unlink(path);
+        errno = saved_errno;
+        return fail_errno(s) ? -1 : 0;
     }
 
     if (fd >= 0) {
@@ -242,6 +385,7 @@ static int handle_send_file(int s, char *path, uid_t uid,
     return 0;
 
 fail:
+    sink_discard(st, &sink);
     if (fd >= 0)
         close(fd);
     if (do_unlink) unlink(path);
@@ -299,7 +443,7 @@ static int handle_send_link(int s, char *path, char *buffer)
     return 0;
 }
 
-static int do_send(int s, char *path, char *buffer)
+static int do_send(int s, char *path, sync_state *st)
 {
     unsigned int mode;
     bool is_link = false;
@@ -327,7 +471,7 @@ static int do_send(int s, char *path, char *buffer)
     }
 
     if (is_link) {
-        return handle_send_link(s, path, buffer);
+        return handle_send_link(s, path, st->buffer);
     }
 
     uid_t uid = -1;
@@ -341,13 +485,14 @@ static int do_send(int s, char *path, char *buffer)
     if (*tmp == '/') {
         tmp++;
     }
-    return handle_send_file(s, path, uid, gid, mode, buffer, do_unlink);
+    return handle_send_file(s, path, uid, gid, mode, st, do_unlink);
 }
 
 static int do_recv(int s, const char *path, char *buffer)
 {
     syncmsg msg;
     int fd, r;
+    bool eof = false;
 
     fd = adb_open(path, O_RDONLY | O_CLOEXEC);
     if (fd < 0) {
@@ -355,19 +500,34 @@ static int do_recv(int s, const char *path, char *buffer)
         return 0;
     }
 
-    msg.data.id = ID_DATA;
-    for (;;) {
-        r = adb_read(fd, buffer, SYNC_DATA_MAX);
-        if (r <= 0) {
-            if (r == 0) break;
-            if (errno == EINTR) continue;
-            r = fail_errno(s);
-            close(fd);
-            return r;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    /* Fill the buffer with as many DATA messages as fit and send them with a
+    ** single write so the socket sees large blocks */
+    while (!eof) {
+        size_t used = 0;
+
+        while (used + sizeof(msg.data) + SYNC_DATA_MAX <= SYNC_BUFFER_SIZE) {
+            char *payload = buffer + used + sizeof(msg.data);
+            r = adb_read(fd, payload, SYNC_DATA_MAX);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) {
+                r = fail_errno(s);
+                close(fd);
+                return r;
+            }
+            if (r == 0) {
+                eof = true;
+                break;
+            }
+
+            msg.data.id = ID_DATA;
+            msg.data.size = htoll(r);
+            memcpy(buffer + used, &msg.data, sizeof(msg.data));
+            used += sizeof(msg.data) + r;
         }
-        msg.data.size = htoll(r);
-        if (!WriteFdExactly(s, &msg.data, sizeof(msg.data))
-                || !WriteFdExactly(s, buffer, r)) {
+
+        if (used > 0 && !WriteFdExactly(s, buffer, used)) {
             close(fd);
             return -1;
         }
@@ -390,8 +550,11 @@ void file_sync_service(int fd, void *cookie)
     char name[1025];
     unsigned namelen;
 
-    char *buffer = reinterpret_cast<char*>(malloc(SYNC_DATA_MAX));
-    if (buffer == 0) goto fail;
+    sync_state st;
+    sync_pipe_open(&st);
+
+    st.buffer = reinterpret_cast<char*>(malloc(SYNC_BUFFER_SIZE));
+    if (st.buffer == 0) goto fail;
 
     for (;;) {
         ADB_LOGD(ADB_SERV, "sync: waiting for command");
@@ -422,10 +585,10 @@ void file_sync_service(int fd, void *cookie)
             if (do_list(fd, name)) goto fail;
             break;
         case ID_SEND:
-            if (do_send(fd, name, buffer)) goto fail;
+            if (do_send(fd, name, &st)) goto fail;
             break;
         case ID_RECV:
-            if (do_recv(fd, name, buffer)) goto fail;
+            if (do_recv(fd, name, st.buffer)) goto fail;
             break;
         case ID_QUIT:
             goto fail;
@@ -436,7 +599,8 @@ void file_sync_service(int fd, void *cookie)
     }
 
 fail:
-    if (buffer != 0) free(buffer);
+    if (st.buffer != 0) free(st.buffer);
+    sync_pipe_close(&st);
     ADB_LOGD(ADB_SERV, "sync: done");
     close(fd);
 }
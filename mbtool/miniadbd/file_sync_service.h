@@ -69,5 +69,8 @@ union syncmsg {
 void file_sync_service(int fd, void *cookie);
 
 #define SYNC_DATA_MAX (64*1024)
+/* File data is read from and written to disk in blocks of this size instead
+** of one SYNC_DATA_MAX message at a time */
+#define SYNC_BUFFER_SIZE (1024*1024)
 
 #endif
@@ -208,11 +208,17 @@ void send_packet(apacket *p, atransport *t)
 
     p->msg.magic = p->msg.command ^ 0xffffffff;
 
-    count = p->msg.data_length;
-    x = (unsigned char *) p->data;
+    /* v2 hosts ignore the checksum, so don't spend time computing it for
+    ** every 256K payload. CNXN is still checksummed because the host only
+    ** learns our version from it */
     sum = 0;
-    while (count-- > 0) {
-        sum += *x++;
+    if (t == NULL || p->msg.command == A_CNXN
+            || t->protocol_version < A_VERSION_SKIP_CHECKSUM) {
+        count = p->msg.data_length;
+        x = (unsigned char *) p->data;
+        while (count-- > 0) {
+            sum += *x++;
+        }
     }
     p->msg.data_check = sum;
 
@@ -16,11 +16,14 @@
 
 #include "sysdeps.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 
 #include <endian.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
 
@@ -32,9 +35,28 @@
 #define MAX_PACKET_SIZE_HS      512
 #define MAX_PACKET_SIZE_SS      1024
 
+// Writes and reads larger than this are split up. Some FunctionFS kernels
+// cannot allocate a request buffer for a full 256K v2 payload and the legacy
+// f_adb driver rejects reads larger than 4K.
+#define USB_FFS_MAX_WRITE       (16 * 1024)
+#define USB_FFS_MAX_READ        (16 * 1024)
+#define USB_ADB_MAX_READ        4096
+
+// Number of FunctionFS transfers queued at once per endpoint. This is enough
+// to cover a whole v2 payload with USB_FFS_MAX_READ sized requests.
+#define USB_FFS_NUM_BUFS        (MAX_PAYLOAD / USB_FFS_MAX_READ)
+
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
+struct aio_block
+{
+    aio_context_t ctx;
+    struct iocb iocb[USB_FFS_NUM_BUFS];
+    struct iocb *iocbs[USB_FFS_NUM_BUFS];
+    struct io_event events[USB_FFS_NUM_BUFS];
+};
+
 struct usb_handle
 {
     pthread_cond_t notify;
@@ -51,6 +73,12 @@ struct usb_handle
     int control;
     int bulk_out; /* "out" from the host's perspective => source for adbd */
     int bulk_in;  /* "in" from the host's perspective => sink for adbd */
+
+    // FunctionFS AIO. Reads and writes happen on different threads, so each
+    // direction gets its own context.
+    bool use_aio;
+    aio_block read_aiob;
+    aio_block write_aiob;
 };
 
 struct func_desc {
@@ -268,14 +296,18 @@ static int usb_adb_write(usb_handle *h, const void *data, int len)
 
 static int usb_adb_read(usb_handle *h, void *data, int len)
 {
-    int n;
-
     ADB_LOGD(ADB_USB, "about to read (fd=%d, len=%d)", h->fd, len);
-    n = adb_read(h->fd, data, len);
-    if (n != len) {
-        ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d, errno = %d (%s)",
-                 h->fd, n, errno, strerror(errno));
-        return -1;
+    uint8_t *buf = reinterpret_cast<uint8_t *>(data);
+    while (len > 0) {
+        int to_read = std::min(len, USB_ADB_MAX_READ);
+        int n = adb_read(h->fd, buf, to_read);
+        if (n != to_read) {
+            ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d, errno = %d (%s)",
+                     h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        buf += n;
+        len -= n;
     }
     ADB_LOGD(ADB_USB, "[ done fd=%d ]", h->fd);
     return 0;
@@ -326,6 +358,61 @@ static void usb_adb_init()
 }
 
 
+static int sys_io_setup(unsigned nr, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int sys_io_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static int sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int sys_io_getevents(aio_context_t ctx, long min_nr, long nr,
+                            struct io_event *events)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, nullptr);
+}
+
+static bool aio_block_init(aio_block *aiob)
+{
+    memset(aiob, 0, sizeof(*aiob));
+    for (int i = 0; i < USB_FFS_NUM_BUFS; ++i) {
+        aiob->iocbs[i] = &aiob->iocb[i];
+    }
+    return sys_io_setup(USB_FFS_NUM_BUFS, &aiob->ctx) == 0;
+}
+
+static void aio_block_destroy(aio_block *aiob)
+{
+    if (aiob->ctx != 0) {
+        sys_io_destroy(aiob->ctx);
+        aiob->ctx = 0;
+    }
+}
+
+static void init_functionfs_aio(struct usb_handle *h)
+{
+    h->use_aio = false;
+
+    if (!aio_block_init(&h->read_aiob)) {
+        ADB_LOGW(ADB_USB, "[ aio: io_setup failed: errno=%d ]", errno);
+        return;
+    }
+    if (!aio_block_init(&h->write_aiob)) {
+        ADB_LOGW(ADB_USB, "[ aio: io_setup failed: errno=%d ]", errno);
+        aio_block_destroy(&h->read_aiob);
+        return;
+    }
+
+    h->use_aio = true;
+}
+
 static void init_functionfs(struct usb_handle *h)
 {
     ssize_t ret;
@@ -390,6 +477,8 @@ static void init_functionfs(struct usb_handle *h)
         goto err;
     }
 
+    init_functionfs_aio(h);
+
     return;
 
 err:
@@ -442,7 +531,8 @@ static int bulk_write(int bulk_in, const uint8_t* buf, size_t length)
     int ret;
 
     do {
-        ret = adb_write(bulk_in, buf + count, length - count);
+        ret = adb_write(bulk_in, buf + count,
+                        std::min<size_t>(length - count, USB_FFS_MAX_WRITE));
         if (ret < 0) {
             if (errno != EINTR)
                 return ret;
@@ -455,10 +545,114 @@ static int bulk_write(int bulk_in, const uint8_t* buf, size_t length)
     return count;
 }
 
+/*
+ * Transfer len bytes with up to USB_FFS_NUM_BUFS requests queued on the
+ * endpoint at once instead of waiting for each one to complete before
+ * starting the next. This keeps the USB 3 link busy.
+ */
+static int bulk_aio(aio_block *aiob, int fd, uint8_t *buf, size_t length,
+                    bool read)
+{
+    size_t count = 0;
+
+    while (count < length) {
+        int num_bufs = 0;
+        size_t offset = 0;
+
+        while (count + offset < length && num_bufs < USB_FFS_NUM_BUFS) {
+            size_t n = std::min<size_t>(length - count - offset,
+                                        USB_FFS_MAX_READ);
+            struct iocb *cb = &aiob->iocb[num_bufs];
+            memset(cb, 0, sizeof(*cb));
+            cb->aio_data = num_bufs;
+            cb->aio_fildes = fd;
+            cb->aio_lio_opcode = read ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+            cb->aio_buf = reinterpret_cast<uintptr_t>(buf + count + offset);
+            cb->aio_nbytes = n;
+            offset += n;
+            ++num_bufs;
+        }
+
+        int submitted = TEMP_FAILURE_RETRY(
+                sys_io_submit(aiob->ctx, num_bufs, aiob->iocbs));
+        if (submitted < 0) {
+            ADB_LOGE(ADB_USB, "[ aio: submit failed fd=%d: errno=%d ]",
+                     fd, errno);
+            return -1;
+        }
+
+        // Reap everything that was queued, even on a partial submit, so
+        // that no request still points into the buffer when we return
+        int completed = 0;
+        while (completed < submitted) {
+            int ret = sys_io_getevents(aiob->ctx, submitted - completed,
+                                       submitted - completed,
+                                       aiob->events + completed);
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret < 0) {
+                ADB_LOGE(ADB_USB, "[ aio: getevents failed fd=%d: errno=%d ]",
+                         fd, errno);
+                return -1;
+            }
+            completed += ret;
+        }
+        if (submitted < num_bufs) {
+            ADB_LOGE(ADB_USB, "[ aio: submitted %d of %d requests fd=%d ]",
+                     submitted, num_bufs, fd);
+            return -1;
+        }
+
+        // Events can complete in any order
+        int64_t results[USB_FFS_NUM_BUFS];
+        for (int i = 0; i < completed; ++i) {
+            results[aiob->events[i].data] = aiob->events[i].res;
+        }
+
+        // Requests complete in the order they were queued. A short read
+        // (eg. a zero length packet) leaves a gap, so move the data of the
+        // following requests down to keep the buffer contiguous.
+        size_t moved = 0;
+        for (int i = 0; i < num_bufs; ++i) {
+            if (results[i] < 0) {
+                errno = -results[i];
+                ADB_LOGE(ADB_USB, "[ aio: %s failed fd=%d: errno=%d ]",
+                         read ? "read" : "write", fd, errno);
+                return -1;
+            }
+
+            size_t n = results[i];
+            uint8_t *src = reinterpret_cast<uint8_t *>(aiob->iocb[i].aio_buf);
+            if (!read && n != aiob->iocb[i].aio_nbytes) {
+                ADB_LOGE(ADB_USB, "[ aio: short write fd=%d: %zu < %llu ]",
+                         fd, n, static_cast<unsigned long long>(
+                                 aiob->iocb[i].aio_nbytes));
+                errno = EIO;
+                return -1;
+            }
+            if (src != buf + count + moved) {
+                memmove(buf + count + moved, src, n);
+            }
+            moved += n;
+        }
+        count += moved;
+    }
+
+    return count;
+}
+
 static int usb_ffs_write(usb_handle* h, const void* data, int len)
 {
     ADB_LOGD(ADB_USB, "about to write (fd=%d, len=%d)", h->bulk_in, len);
-    int n = bulk_write(h->bulk_in, reinterpret_cast<const uint8_t*>(data), len);
+    int n;
+    if (h->use_aio) {
+        n = bulk_aio(&h->write_aiob, h->bulk_in,
+                     const_cast<uint8_t*>(
+                             reinterpret_cast<const uint8_t*>(data)),
+                     len, false);
+    } else {
+        n = bulk_write(h->bulk_in, reinterpret_cast<const uint8_t*>(data),
+                       len);
+    }
     if (n != len) {
         ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d: %s",
                  h->bulk_in, n, strerror(errno));
@@ -474,7 +668,8 @@ static int bulk_read(int bulk_out, uint8_t* buf, size_t length)
     int ret;
 
     do {
-        ret = adb_read(bulk_out, buf + count, length - count);
+        ret = adb_read(bulk_out, buf + count,
+                       std::min<size_t>(length - count, USB_FFS_MAX_READ));
         if (ret < 0) {
             if (errno != EINTR) {
                 ADB_LOGE(ADB_USB,
@@ -493,7 +688,13 @@ static int bulk_read(int bulk_out, uint8_t* buf, size_t length)
 static int usb_ffs_read(usb_handle* h, void* data, int len)
 {
     ADB_LOGD(ADB_USB, "about to read (fd=%d, len=%d)", h->bulk_out, len);
-    int n = bulk_read(h->bulk_out, reinterpret_cast<uint8_t*>(data), len);
+    int n;
+    if (h->use_aio) {
+        n = bulk_aio(&h->read_aiob, h->bulk_out,
+                     reinterpret_cast<uint8_t*>(data), len, true);
+    } else {
+        n = bulk_read(h->bulk_out, reinterpret_cast<uint8_t*>(data), len);
+    }
     if (n != len) {
         ADB_LOGE(ADB_USB, "ERROR: fd = %d, n = %d: %s",
                  h->bulk_out, n, strerror(errno));
@@ -518,6 +719,12 @@ static void usb_ffs_kick(usb_handle *h)
                  h->bulk_out, errno);
 
     pthread_mutex_lock(&h->lock);
+    if (h->use_aio) {
+        // Cancels and waits for anything still queued
+        aio_block_destroy(&h->read_aiob);
+        aio_block_destroy(&h->write_aiob);
+        h->use_aio = false;
+    }
     close(h->control);
     close(h->bulk_out);
     close(h->bulk_in);
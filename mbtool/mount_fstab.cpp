@@ -20,6 +20,11 @@
 #include "mount_fstab.h"
 
 #include <algorithm>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #include <cerrno>
 #include <cstdio>
@@ -30,10 +35,10 @@
 #include <fnmatch.h>
 #include <getopt.h>
 #include <libgen.h>
-#include <pwd.h>
 #include <signal.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/utsname.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -42,23 +47,27 @@
 #include "mblog/logging.h"
 #include "mbutil/autoclose/file.h"
 #include "mbutil/blkid.h"
+#include "mbutil/chown.h"
 #include "mbutil/command.h"
 #include "mbutil/copy.h"
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
 #include "mbutil/fstab.h"
+#include "mbutil/loopdev.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/properties.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
+#include "mbutil/trace.h"
 
 #include "multiboot.h"
 #include "reboot.h"
 #include "roms.h"
 #include "sepolpatch.h"
 #include "signature.h"
+#include "task_graph.h"
 #include "initwrapper/devices.h"
 
 #define SYSTEM_MOUNT_POINT          "/raw/system"
@@ -67,6 +76,12 @@
 #define EXTSD_MOUNT_POINT           "/raw/extsd"
 #define IMAGES_MOUNT_POINT          "/raw/images"
 
+// Number of partitions that can be mounted at the same time
+#define MOUNT_MAX_THREADS           4
+
+#define EXFAT_FUSE_TUNED_OPTIONS \
+        "big_writes,max_read=131072,max_write=131072,max_background=64"
+
 #define EXT4_TEMP_IMAGE             "/temp.ext4"
 
 #define WRAPPED_BINARIES_DIR        "/wrapped"
@@ -88,7 +103,7 @@ namespace mb
  *
  * \return Whether some fstab entry was successfully mounted at the mount point
  */
-static bool create_dir_and_mount(const std::vector<util::fstab_rec> &recs,
+static bool create_dir_and_mount(const std::vector<util::FstabEntry> &recs,
                                  const char *mount_point, mode_t perms)
 {
     if (recs.empty()) {
@@ -110,32 +125,32 @@ static bool create_dir_and_mount(const std::vector<util::fstab_rec> &recs,
     }
 
     // Try mounting each until we find one that works
-    for (const util::fstab_rec &rec : recs) {
+    for (const util::FstabEntry &rec : recs) {
         LOGD("Attempting to mount(%s, %s, %s, %lu, %s)",
-             rec.blk_device.c_str(), mount_point, rec.fs_type.c_str(),
-             rec.flags, rec.fs_options.c_str());
+             rec.blk_device, mount_point, rec.fs_type,
+             rec.flags, rec.fs_options);
 
         // Wait for block device if requested
         if (rec.fs_mgr_flags & MF_WAIT) {
             LOGD("%s: Waiting up to 20 seconds for block device",
-                 rec.blk_device.c_str());
-            util::wait_for_path(rec.blk_device.c_str(), 20 * 1000);
+                 rec.blk_device);
+            wait_for_block_dev(rec.blk_device, 20 * 1000);
         }
 
         // Try mounting
-        bool ret = util::mount(rec.blk_device.c_str(),
+        bool ret = util::mount(rec.blk_device,
                                mount_point,
-                               rec.fs_type.c_str(),
+                               rec.fs_type,
                                rec.flags,
-                               rec.fs_options.c_str());
+                               rec.fs_options);
         if (!ret) {
             LOGE("Failed to mount %s (%s) at %s: %s",
-                 rec.blk_device.c_str(), rec.fs_type.c_str(),
+                 rec.blk_device, rec.fs_type,
                  mount_point, strerror(errno));
             continue;
         } else {
             LOGE("Successfully mounted %s (%s) at %s",
-                 rec.blk_device.c_str(), rec.fs_type.c_str(),
+                 rec.blk_device, rec.fs_type,
                  mount_point);
             return true;
         }
@@ -147,24 +162,40 @@ static bool create_dir_and_mount(const std::vector<util::fstab_rec> &recs,
     return false;
 }
 
+/*!
+ * \brief Create fstab entry for a generic partition
+ */
+static util::FstabEntry generic_fstab_entry(const char *blk_device,
+                                            const char *mount_point,
+                                            unsigned long flags)
+{
+    util::FstabEntry entry;
+    entry.blk_device = blk_device;
+    entry.mount_point = mount_point;
+    entry.fs_type = "auto";
+    entry.flags = flags;
+    entry.fs_options = "";
+    entry.fs_mgr_flags = 0;
+    entry.vold_args = "check";
+    entry.mount_args = "";
+    entry.orig_line = "";
+    return entry;
+}
+
 /*!
  * \brief Get list of generic /system fstab entries for ROMs that mount the
  *        partition manually
  */
-static std::vector<util::fstab_rec>
-generic_fstab_system_entries(const Device &device)
+static std::vector<util::FstabEntry>
+generic_fstab_system_entries(const Device &device,
+                             std::deque<std::string> *storage)
 {
-    std::vector<util::fstab_rec> result;
+    std::vector<util::FstabEntry> result;
 
     for (auto const &path : device.system_block_devs()) {
-        result.emplace_back();
-        result.back().blk_device = path;
-        result.back().mount_point = "/system";
-        result.back().fs_type = "auto";
-        result.back().flags = MS_RDONLY;
-        result.back().fs_options = "";
-        result.back().fs_mgr_flags = 0;
-        result.back().vold_args = "check";
+        storage->push_back(path);
+        result.push_back(generic_fstab_entry(
+                storage->back().c_str(), "/system", MS_RDONLY));
     }
 
     return result;
@@ -174,20 +205,16 @@ generic_fstab_system_entries(const Device &device)
  * \brief Get list of generic /cache fstab entries for ROMs that mount the
  *        partition manually
  */
-static std::vector<util::fstab_rec>
-generic_fstab_cache_entries(const Device &device)
+static std::vector<util::FstabEntry>
+generic_fstab_cache_entries(const Device &device,
+                            std::deque<std::string> *storage)
 {
-    std::vector<util::fstab_rec> result;
+    std::vector<util::FstabEntry> result;
 
     for (auto const &path : device.cache_block_devs()) {
-        result.emplace_back();
-        result.back().blk_device = path;
-        result.back().mount_point = "/cache";
-        result.back().fs_type = "auto";
-        result.back().flags = MS_NOSUID | MS_NODEV;
-        result.back().fs_options = "";
-        result.back().fs_mgr_flags = 0;
-        result.back().vold_args = "check";
+        storage->push_back(path);
+        result.push_back(generic_fstab_entry(
+                storage->back().c_str(), "/cache", MS_NOSUID | MS_NODEV));
     }
 
     return result;
@@ -197,20 +224,16 @@ generic_fstab_cache_entries(const Device &device)
  * \brief Get list of generic /data fstab entries for ROMs that mount the
  *        partition manually
  */
-static std::vector<util::fstab_rec>
-generic_fstab_data_entries(const Device &device)
+static std::vector<util::FstabEntry>
+generic_fstab_data_entries(const Device &device,
+                           std::deque<std::string> *storage)
 {
-    std::vector<util::fstab_rec> result;
+    std::vector<util::FstabEntry> result;
 
     for (auto const &path : device.data_block_devs()) {
-        result.emplace_back();
-        result.back().blk_device = path;
-        result.back().mount_point = "/data";
-        result.back().fs_type = "auto";
-        result.back().flags = MS_NOSUID | MS_NODEV;
-        result.back().fs_options = "";
-        result.back().fs_mgr_flags = 0;
-        result.back().vold_args = "check";
+        storage->push_back(path);
+        result.push_back(generic_fstab_entry(
+                storage->back().c_str(), "/data", MS_NOSUID | MS_NODEV));
     }
 
     return result;
@@ -246,18 +269,96 @@ static void dump(const char *line, bool error, void *userdata)
 
 static uid_t get_media_rw_uid()
 {
-    struct passwd *pw = getpwnam("media_rw");
-    if (!pw) {
+    uid_t uid;
+    if (!util::lookup_uid("media_rw", &uid)) {
         return 1023;
     } else {
-        return pw->pw_uid;
+        return uid;
     }
 }
 
-static bool mount_exfat_fuse(const char *source, const char *target)
+/*!
+ * \brief Check if the running kernel is at least version \p major.\p minor
+ */
+static bool kernel_version_at_least(int major, int minor)
+{
+    struct utsname uts;
+    int cur_major;
+    int cur_minor;
+
+    if (uname(&uts) < 0
+            || sscanf(uts.release, "%d.%d", &cur_major, &cur_minor) != 2) {
+        return false;
+    }
+
+    return cur_major > major || (cur_major == major && cur_minor >= minor);
+}
+
+/*!
+ * \brief Check if the kernel has a native exfat driver
+ *
+ * The result is cached since it cannot change while mbtool is running.
+ */
+static bool kernel_supports_exfat()
+{
+    static const bool supported = []{
+        autoclose::file fp(autoclose::fopen("/proc/filesystems", "re"));
+        if (!fp) {
+            return false;
+        }
+
+        char line[64];
+
+        // Each line is "[nodev]\t<fstype>\n"
+        while (fgets(line, sizeof(line), fp.get())) {
+            char *fstype = strchr(line, '\t');
+            if (fstype && strcmp(fstype + 1, "exfat\n") == 0) {
+                return true;
+            }
+        }
+
+        return false;
+    }();
+
+    return supported;
+}
+
+/*!
+ * \brief Run mount.exfat with the specified FUSE options
+ */
+static bool run_mount_exfat(const char *source, const char *target,
+                            const char *options)
 {
     uid_t uid = get_media_rw_uid();
+    std::string mount_args = mb::format(
+            "noatime,nodev,nosuid,dirsync,uid=%d,gid=%d,fmask=%o,dmask=%o,"
+            "noexec,rw%s%s", uid, uid, 0007, 0007, *options ? "," : "",
+            options);
 
+    const char *mount_argv[] = {
+        "/sbin/mount.exfat",
+        "-o", mount_args.c_str(),
+        source, target,
+        nullptr
+    };
+
+    int ret = util::run_command(mount_argv[0], mount_argv, nullptr, nullptr,
+                                &dump, nullptr);
+
+    if (ret >= 0) {
+        LOGD("mount.exfat returned: %d", WEXITSTATUS(ret));
+    }
+
+    if (ret < 0) {
+        LOGE("Failed to launch /sbin/mount.exfat: %s", strerror(errno));
+        return false;
+    }
+
+    return WEXITSTATUS(ret) == 0;
+}
+
+static bool mount_exfat_fuse(const char *source, const char *target)
+{
     // Check signatures
     SigVerifyResult result;
     result = verify_signature("/sbin/fsck.exfat", "/sbin/fsck.exfat.sig");
@@ -271,48 +372,40 @@ static bool mount_exfat_fuse(const char *source, const char *target)
         return false;
     }
 
-    char mount_args[100];
-
-    snprintf(mount_args, sizeof(mount_args),
-             "noatime,nodev,nosuid,dirsync,uid=%d,gid=%d,fmask=%o,dmask=%o,%s,%s",
-             uid, uid, 0007, 0007, "noexec", "rw");
-
     const char *fsck_argv[] = {
         "/sbin/fsck.exfat",
         source,
         nullptr
     };
-    const char *mount_argv[] = {
-        "/sbin/mount.exfat",
-        "-o", mount_args,
-        source, target,
-        nullptr
-    };
 
     // Run filesystem checks
     util::run_command(fsck_argv[0], fsck_argv, nullptr, nullptr, &dump,
                       nullptr);
 
-    // Mount exfat, matching vold options as much as possible
-    int ret = util::run_command(mount_argv[0], mount_argv, nullptr, nullptr,
-                                &dump, nullptr);
-
-    if (ret >= 0) {
-        LOGD("mount.exfat returned: %d", WEXITSTATUS(ret));
+    // Mount exfat, matching vold options as much as possible. ROMs on extsd
+    // run entirely from this mount, so ask FUSE for large requests and more
+    // outstanding background requests. Not every libfuse version that
+    // mount.exfat may be built against knows these options, so fall back to
+    // the defaults if they are rejected. writeback_cache needs kernel 3.15.
+    std::vector<std::string> option_sets;
+    if (kernel_version_at_least(3, 15)) {
+        option_sets.push_back(EXFAT_FUSE_TUNED_OPTIONS ",writeback_cache");
     }
+    option_sets.push_back(EXFAT_FUSE_TUNED_OPTIONS);
+    option_sets.push_back("");
 
-    if (ret < 0) {
-        LOGE("Failed to launch /sbin/mount.exfat: %s", strerror(errno));
-        return false;
-    } else if (WEXITSTATUS(ret) != 0) {
-        LOGE("Failed to mount %s (%s) at %s",
-             source, "fuse-exfat", target);
-        return false;
-    } else {
-        LOGE("Successfully mounted %s (%s) at %s",
-             source, "fuse-exfat", target);
-        return true;
+    for (auto const &options : option_sets) {
+        LOGD("Trying fuse-exfat options: '%s'", options.c_str());
+
+        if (run_mount_exfat(source, target, options.c_str())) {
+            LOGE("Successfully mounted %s (%s) at %s",
+                 source, "fuse-exfat", target);
+            return true;
+        }
     }
+
+    LOGE("Failed to mount %s (%s) at %s", source, "fuse-exfat", target);
+    return false;
 }
 
 static bool mount_exfat_kernel(const char *source, const char *target)
@@ -386,8 +479,10 @@ static bool try_extsd_mount(const char *block_dev, const char *mount_point)
     // filesystem. We don't link in blkid, so we'll use a trial and error
     // approach.
 
-    bool use_fuse_exfat =
-            util::file_find_one_of("/init.orig", { "EXFAT   ", "exfat" });
+    // The in-kernel driver is much faster than fuse-exfat, so only use
+    // fuse-exfat if the kernel can't mount exfat or if it is requested
+    bool use_fuse_exfat = !kernel_supports_exfat()
+            && util::file_find_one_of("/init.orig", { "EXFAT   ", "exfat" });
     std::string value = util::property_file_get_string(
             DEFAULT_PROP_PATH, PROP_USE_FUSE_EXFAT, "");
     if (!value.empty()) {
@@ -415,6 +510,12 @@ static bool try_extsd_mount(const char *block_dev, const char *mount_point)
         if (func(block_dev, mount_point)) {
             return true;
         }
+
+        // Fall back to fuse-exfat if the kernel driver is not usable
+        if (!use_fuse_exfat && value != "false"
+                && mount_exfat_fuse(block_dev, mount_point)) {
+            return true;
+        }
     } else if (strcmp(fstype, "vfat") == 0) {
         if (mount_vfat(block_dev, mount_point)) {
             return true;
@@ -465,7 +566,7 @@ static std::vector<std::string> split_patterns(const char *patterns)
  * This will *not* do anything if the system wasn't booted using initwrapper.
  * It relies an the sysfs -> block devices map created by initwrapper/devices.cpp
  */
-static bool mount_extsd_fstab_entries(const std::vector<util::fstab_rec> &extsd_recs,
+static bool mount_extsd_fstab_entries(const std::vector<util::FstabEntry> &extsd_recs,
                                       const char *mount_point, mode_t perms)
 {
     if (extsd_recs.empty()) {
@@ -490,17 +591,19 @@ static bool mount_extsd_fstab_entries(const std::vector<util::fstab_rec> &extsd_
         LOGV("[Attempt %d/%d] Finding and mounting external SD",
              i + 1, max_attempts);
 
+        uint64_t generation = get_block_dev_generation();
         auto devices_map = get_block_dev_mappings();
+        std::vector<std::string> candidates;
 
-        for (const util::fstab_rec &rec : extsd_recs) {
+        for (const util::FstabEntry &rec : extsd_recs) {
             std::vector<std::string> patterns =
-                    split_patterns(rec.blk_device.c_str());
+                    split_patterns(rec.blk_device);
 
             // Match sysfs path pattern
             for (const std::string &pattern : patterns) {
                 LOGD("Matching devices against pattern: %s", pattern.c_str());
 
-                for (auto const &pair : devices_map) {
+                for (auto const &pair : *devices_map) {
                     const BlockDevInfo &info = pair.second;
 
                     if (path_matches(pair.first.c_str(), pattern.c_str())) {
@@ -516,17 +619,26 @@ static bool mount_extsd_fstab_entries(const std::vector<util::fstab_rec> &extsd_
                             continue;
                         }
 
-                        if (try_extsd_mount(info.path.c_str(), mount_point)) {
-                            return true;
-                        }
+                        candidates.push_back(info.path);
                     }
                 }
             }
         }
 
+        // Read all of the superblocks at once instead of one at a time as
+        // each mount is attempted
+        util::blkid_probe_all(candidates);
+
+        for (const std::string &path : candidates) {
+            if (try_extsd_mount(path.c_str(), mount_point)) {
+                return true;
+            }
+        }
+
         if (i < max_attempts - 1) {
-            LOGW("No external SD patterns were matched; waiting 1 second");
-            sleep(1);
+            LOGW("No external SD patterns were matched; "
+                 "waiting up to 1 second for new block devices");
+            wait_for_block_dev_change(generation, 1000);
         }
     }
 
@@ -577,10 +689,25 @@ static bool mount_target(const char *source, const char *target, bool bind)
  */
 static bool mount_all_system_images()
 {
+    MB_TIMELINE_SCOPE("init.mount_all_system_images");
+
     Roms roms;
     roms.add_installed();
 
     bool failed = false;
+    unsigned int images = 0;
+
+    for (const std::shared_ptr<Rom> &rom : roms.roms) {
+        if (rom->system_is_image) {
+            ++images;
+        }
+    }
+
+    // Create all of the loop devices up front so that each image mount only
+    // needs to claim one. loop0 is left free for installers that hardcode it
+    if (images > 0 && !util::loopdev_preallocate(images + 1)) {
+        LOGW("Failed to preallocate loop devices: %s", strerror(errno));
+    }
 
     for (const std::shared_ptr<Rom> &rom : roms.roms) {
         if (rom->system_is_image) {
@@ -728,74 +855,132 @@ static bool wrap_extsd_binaries()
 
 struct FstabRecs
 {
+    // Parsed fstab file that the entries point into
+    std::shared_ptr<const util::Fstab> fstab;
+    // Block device paths for the generic entries
+    std::deque<std::string> generic_blk_devices;
+
     // Entries to go in newly generated fstab
-    std::vector<util::fstab_rec> gen;
+    std::vector<util::FstabEntry> gen;
     // /system entries
-    std::vector<util::fstab_rec> system;
+    std::vector<util::FstabEntry> system;
     // /cache entries
-    std::vector<util::fstab_rec> cache;
+    std::vector<util::FstabEntry> cache;
     // /data entries
-    std::vector<util::fstab_rec> data;
+    std::vector<util::FstabEntry> data;
     // External SD entries
-    std::vector<util::fstab_rec> extsd;
+    std::vector<util::FstabEntry> extsd;
+};
+
+struct CachedFstab
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    std::shared_ptr<const util::Fstab> fstab;
 };
 
+static std::mutex fstab_cache_lock;
+static std::unordered_map<std::string, CachedFstab> fstab_cache;
+
+/*!
+ * \brief Read fstab file, reusing the previous result if it did not change
+ *
+ * The parsed file is cached per path and is reparsed if its inode, size, or
+ * modification time changes.
+ *
+ * \return Parsed fstab or nullptr if the file could not be read or parsed
+ */
+static std::shared_ptr<const util::Fstab> read_fstab_cached(const char *path)
+{
+    struct stat sb;
+    if (stat(path, &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", path, strerror(errno));
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(fstab_cache_lock);
+
+    auto it = fstab_cache.find(path);
+    if (it != fstab_cache.end()
+            && it->second.dev == sb.st_dev
+            && it->second.ino == sb.st_ino
+            && it->second.size == sb.st_size
+            && it->second.mtime.tv_sec == sb.st_mtim.tv_sec
+            && it->second.mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+        return it->second.fstab;
+    }
+
+    auto fstab = std::make_shared<util::Fstab>();
+    if (!fstab->load(path)) {
+        return nullptr;
+    }
+
+    CachedFstab &entry = fstab_cache[path];
+    entry.dev = sb.st_dev;
+    entry.ino = sb.st_ino;
+    entry.size = sb.st_size;
+    entry.mtime = sb.st_mtim;
+    entry.fstab = fstab;
+
+    return fstab;
+}
+
 bool process_fstab(const char *path, const std::shared_ptr<Rom> &rom,
                    const Device &device, int flags, FstabRecs *recs)
 {
-    std::vector<util::fstab_rec> fstab;
+    MB_TIMELINE_SCOPE("init.process_fstab");
 
     recs->gen.clear();
     recs->system.clear();
     recs->cache.clear();
     recs->data.clear();
     recs->extsd.clear();
+    recs->generic_blk_devices.clear();
 
     // Read original fstab file
-    fstab = util::read_fstab(path);
-    if (fstab.empty()) {
+    recs->fstab = read_fstab_cached(path);
+    if (!recs->fstab) {
         LOGE("%s: Failed to read fstab", path);
         return false;
     }
 
     bool include_sdcard0 = !(device.flags() & DeviceFlag::FstabSkipSdcard0);
 
-    for (auto it = fstab.begin(); it != fstab.end();) {
-        LOGD("fstab: %s", it->orig_line.c_str());
+    for (const util::FstabEntry &entry : recs->fstab->entries()) {
+        LOGD("fstab: %s", entry.orig_line);
 
-        if (util::path_compare(it->mount_point, "/system") == 0
+        const char *vold_args = entry.vold_args;
+
+        if (util::path_compare(entry.mount_point, "/system") == 0
                 && (flags & MOUNT_FLAG_MOUNT_SYSTEM)) {
             LOGD("-> /system entry");
-            recs->system.push_back(std::move(*it));
-            it = fstab.erase(it);
-        } else if (util::path_compare(it->mount_point, "/cache") == 0
+            recs->system.push_back(entry);
+        } else if (util::path_compare(entry.mount_point, "/cache") == 0
                 && (flags & MOUNT_FLAG_MOUNT_CACHE)) {
             LOGD("-> /cache entry");
-            recs->cache.push_back(std::move(*it));
-            it = fstab.erase(it);
-        } else if (util::path_compare(it->mount_point, "/data") == 0
+            recs->cache.push_back(entry);
+        } else if (util::path_compare(entry.mount_point, "/data") == 0
                 && (flags & MOUNT_FLAG_MOUNT_DATA)) {
             LOGD("-> /data entry");
-            recs->data.push_back(std::move(*it));
-            it = fstab.erase(it);
-        } else if (it->vold_args.find("emmc@intsd") == std::string::npos
-                && ((include_sdcard0 && it->vold_args.find("voldmanaged=sdcard0") != std::string::npos)
-                || it->vold_args.find("voldmanaged=sdcard1") != std::string::npos
-                || it->vold_args.find("voldmanaged=sdcard") != std::string::npos
-                || it->vold_args.find("voldmanaged=extSdCard") != std::string::npos
-                || it->vold_args.find("voldmanaged=external_SD") != std::string::npos
-                || it->vold_args.find("voldmanaged=MicroSD") != std::string::npos)
+            recs->data.push_back(entry);
+        } else if (!strstr(vold_args, "emmc@intsd")
+                && ((include_sdcard0 && strstr(vold_args, "voldmanaged=sdcard0"))
+                || strstr(vold_args, "voldmanaged=sdcard1")
+                || strstr(vold_args, "voldmanaged=sdcard")
+                || strstr(vold_args, "voldmanaged=extSdCard")
+                || strstr(vold_args, "voldmanaged=external_SD")
+                || strstr(vold_args, "voldmanaged=MicroSD"))
                 && (flags & MOUNT_FLAG_MOUNT_EXTERNAL_SD)) {
             LOGD("-> External SD entry");
             // Has to be mounted by us
-            recs->extsd.push_back(*it);
+            recs->extsd.push_back(entry);
             // and also has to be processed by vold
-            recs->gen.push_back(std::move(*it));
-            it = fstab.erase(it);
+            recs->gen.push_back(entry);
         } else {
             // Let vold mount this
-            recs->gen.push_back(std::move(*it));
-            it = fstab.erase(it);
+            recs->gen.push_back(entry);
         }
     }
 
@@ -805,42 +990,39 @@ bool process_fstab(const char *path, const std::shared_ptr<Rom> &rom,
     if (!(flags & MOUNT_FLAG_NO_GENERIC_ENTRIES)) {
         if (recs->system.empty() && (flags & MOUNT_FLAG_MOUNT_SYSTEM)) {
             LOGW("No /system fstab entries found. Adding generic entries");
-            auto entries = generic_fstab_system_entries(device);
-            for (util::fstab_rec &rec : entries) {
-                recs->system.push_back(std::move(rec));
-            }
+            auto entries = generic_fstab_system_entries(
+                    device, &recs->generic_blk_devices);
+            recs->system.insert(recs->system.end(), entries.begin(), entries.end());
         }
         if (recs->cache.empty() && (flags & MOUNT_FLAG_MOUNT_CACHE)) {
             LOGW("No /cache fstab entries found. Adding generic entries");
-            auto entries = generic_fstab_cache_entries(device);
-            for (util::fstab_rec &rec : entries) {
-                recs->cache.push_back(std::move(rec));
-            }
+            auto entries = generic_fstab_cache_entries(
+                    device, &recs->generic_blk_devices);
+            recs->cache.insert(recs->cache.end(), entries.begin(), entries.end());
         }
         if (recs->data.empty() && (flags & MOUNT_FLAG_MOUNT_DATA)) {
             LOGW("No /data fstab entries found. Adding generic entries");
-            auto entries = generic_fstab_data_entries(device);
-            for (util::fstab_rec &rec : entries) {
-                recs->data.push_back(std::move(rec));
-            }
+            auto entries = generic_fstab_data_entries(
+                    device, &recs->generic_blk_devices);
+            recs->data.insert(recs->data.end(), entries.begin(), entries.end());
         }
     }
 
     // Remove nosuid flag on the partition that the system directory resides on
     if (rom && !rom->system_is_image) {
         if (rom->system_source == Rom::Source::CACHE) {
-            for (util::fstab_rec &rec : recs->cache) {
+            for (util::FstabEntry &rec : recs->cache) {
                 rec.flags &= ~MS_NOSUID;
             }
         } else if (rom->system_source == Rom::Source::DATA) {
-            for (util::fstab_rec &rec : recs->data) {
+            for (util::FstabEntry &rec : recs->data) {
                 rec.flags &= ~MS_NOSUID;
             }
         }
     }
 
     if (rom && rom->cache_source == Rom::Source::SYSTEM) {
-        for (util::fstab_rec &rec : recs->system) {
+        for (util::FstabEntry &rec : recs->system) {
             rec.flags &= ~MS_RDONLY;
         }
     }
@@ -859,6 +1041,8 @@ bool process_fstab(const char *path, const std::shared_ptr<Rom> &rom,
 bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
                  const Device &device, int flags)
 {
+    MB_TIMELINE_SCOPE("init.mount_fstab");
+
     std::vector<std::string> successful;
     FstabRecs recs;
 
@@ -872,38 +1056,6 @@ bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
         return false;
     }
 
-    bool ret = true;
-
-    // Mount system
-    if (ret && !recs.system.empty()) {
-        if (create_dir_and_mount(recs.system, SYSTEM_MOUNT_POINT, 0755)) {
-            successful.push_back(SYSTEM_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " SYSTEM_MOUNT_POINT);
-            ret = false;
-        }
-    }
-
-    // Mount cache
-    if (ret && !recs.cache.empty()) {
-        if (create_dir_and_mount(recs.cache, CACHE_MOUNT_POINT, 0755)) {
-            successful.push_back(CACHE_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " CACHE_MOUNT_POINT);
-            ret = false;
-        }
-    }
-
-    // Mount data
-    if (ret && !recs.data.empty()) {
-        if (create_dir_and_mount(recs.data, DATA_MOUNT_POINT, 0755)) {
-            successful.push_back(DATA_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " DATA_MOUNT_POINT);
-            ret = false;
-        }
-    }
-
     // Mount external SD only if ROM is installed on the external SD. This is
     // necessary because mount_extsd_fstab_entries() blocks until an SD card is
     // found or a timeout occurs.
@@ -914,15 +1066,52 @@ bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
         LOGV("Skipping extsd mount because ROM is not an extsd-slot");
     }
 
-    if (ret && !recs.extsd.empty() && require_extsd) {
-        if (mount_extsd_fstab_entries(recs.extsd, EXTSD_MOUNT_POINT, 0755)) {
-            successful.push_back(EXTSD_MOUNT_POINT);
-        } else {
-            LOGE("Failed to mount " EXTSD_MOUNT_POINT);
-            ret = false;
-        }
+    // The partitions do not depend on each other, so they are mounted in
+    // parallel. Each one waits only for its own block device, so a slow SD
+    // card does not hold up the internal partitions.
+    std::mutex successful_lock;
+    TaskGraph tasks;
+
+    auto add_mount = [&](const char *name, const char *mount_point,
+                         std::function<bool()> fn) {
+        tasks.add(name, {}, [&, name, mount_point, fn] {
+            MB_TIMELINE_SCOPE(name);
+
+            if (!fn()) {
+                LOGE("Failed to mount %s", mount_point);
+                return false;
+            }
+
+            std::lock_guard<std::mutex> lock(successful_lock);
+            successful.push_back(mount_point);
+            return true;
+        });
+    };
+
+    if (!recs.system.empty()) {
+        add_mount("init.mount_fstab.system", SYSTEM_MOUNT_POINT, [&] {
+            return create_dir_and_mount(recs.system, SYSTEM_MOUNT_POINT, 0755);
+        });
+    }
+    if (!recs.cache.empty()) {
+        add_mount("init.mount_fstab.cache", CACHE_MOUNT_POINT, [&] {
+            return create_dir_and_mount(recs.cache, CACHE_MOUNT_POINT, 0755);
+        });
+    }
+    if (!recs.data.empty()) {
+        add_mount("init.mount_fstab.data", DATA_MOUNT_POINT, [&] {
+            return create_dir_and_mount(recs.data, DATA_MOUNT_POINT, 0755);
+        });
+    }
+    if (!recs.extsd.empty() && require_extsd) {
+        add_mount("init.mount_fstab.extsd", EXTSD_MOUNT_POINT, [&] {
+            return mount_extsd_fstab_entries(
+                    recs.extsd, EXTSD_MOUNT_POINT, 0755);
+        });
     }
 
+    bool ret = tasks.run(MOUNT_MAX_THREADS);
+
     if (ret) {
         LOGI("Successfully mounted partitions");
     } else if (flags & MOUNT_FLAG_UNMOUNT_ON_FAILURE) {
@@ -939,8 +1128,8 @@ bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
             return false;
         }
 
-        for (const util::fstab_rec &rec : recs.gen) {
-            dprintf(fd, "%s\n", rec.orig_line.c_str());
+        for (const util::FstabEntry &rec : recs.gen) {
+            dprintf(fd, "%s\n", rec.orig_line);
         }
 
         close(fd);
@@ -951,6 +1140,8 @@ bool mount_fstab(const char *path, const std::shared_ptr<Rom> &rom,
 
 bool mount_rom(const std::shared_ptr<Rom> &rom)
 {
+    MB_TIMELINE_SCOPE("init.mount_rom");
+
     std::string target_system = rom->full_system_path();
     std::string target_cache = rom->full_cache_path();
     std::string target_data = rom->full_data_path();
@@ -21,15 +21,16 @@
 
 #include <cerrno>
 #include <cstring>
+
 #include <sys/stat.h>
 
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
-#include "mbutil/chmod.h"
 #include "mbutil/chown.h"
 #include "mbutil/copy.h"
 #include "mbutil/file.h"
 #include "mbutil/fts.h"
+#include "mbutil/metadata.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
 
@@ -79,7 +80,8 @@ public:
         // _target is the correct parameter here (or pathbuf and
         // COPY_EXCLUDE_TOP_LEVEL flag)
         if (!util::copy_dir(_curr->fts_accpath, _target,
-                            util::COPY_ATTRIBUTES | util::COPY_XATTRS)) {
+                            util::COPY_ATTRIBUTES | util::COPY_XATTRS
+                            | util::COPY_PARALLEL)) {
             mb::format(_error_msg, "%s: Failed to copy directory: %s",
                        _curr->fts_path, strerror(errno));
             LOGW("%s", _error_msg.c_str());
@@ -161,7 +163,8 @@ bool copy_system(const std::string &source, const std::string &target)
 /*!
  * \brief Fix permissions and label on /data/media/0/MultiBoot/
  *
- * This function will do the following on /data/media/0/MultiBoot/:
+ * This function will do the following on /data/media/0/MultiBoot/ in a
+ * single traversal:
  * 1. Recursively change ownership to media_rw:media_rw
  * 2. Recursively change mode to 0775
  * 3. Recursively change the SELinux label to the same label as /data/media/0/
@@ -172,22 +175,23 @@ bool fix_multiboot_permissions(void)
 {
     util::create_empty_file(MULTIBOOT_DIR "/.nomedia");
 
-    if (!util::chown(MULTIBOOT_DIR, "media_rw", "media_rw",
-                     util::CHOWN_RECURSIVE)) {
-        LOGE("Failed to chown %s", MULTIBOOT_DIR);
+    util::Metadata metadata;
+    metadata.mode = 0775;
+
+    if (!util::lookup_owner("media_rw", "media_rw",
+                            &metadata.uid, &metadata.gid)) {
+        LOGE("Failed to look up media_rw user or group");
         return false;
     }
 
-    if (!util::chmod(MULTIBOOT_DIR, 0775, util::CHMOD_RECURSIVE)) {
-        LOGE("Failed to chmod %s", MULTIBOOT_DIR);
-        return false;
+    // Leave the label alone if SELinux is not supported
+    if (!util::selinux_lget_context(INTERNAL_STORAGE, &metadata.context)) {
+        metadata.context.clear();
     }
 
-    std::string context;
-    if (util::selinux_lget_context(INTERNAL_STORAGE, &context)
-            && !util::selinux_lset_context_recursive(MULTIBOOT_DIR, context)) {
-        LOGE("%s: Failed to set context to %s: %s",
-             MULTIBOOT_DIR, context.c_str(), strerror(errno));
+    if (!util::apply_metadata_recursive(MULTIBOOT_DIR, metadata)) {
+        LOGE("%s: Failed to set ownership, mode, or context",
+             MULTIBOOT_DIR);
         return false;
     }
 
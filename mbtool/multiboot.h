@@ -27,6 +27,8 @@
 #define MULTIBOOT_LOG_INSTALLER         INTERNAL_STORAGE "/MultiBoot.log"
 #define MULTIBOOT_LOG_APPSYNC           MULTIBOOT_DIR "/appsync.log"
 #define MULTIBOOT_LOG_DAEMON            MULTIBOOT_DIR "/daemon.log"
+#define MULTIBOOT_LOG_DAEMON_BINARY     "/data/multiboot/daemon.log.bin"
+#define MULTIBOOT_COUNTERS              "/data/multiboot/counters.bin"
 
 #define ABOOT_PARTITION                 "/dev/block/platform/msm_sdcc.1/by-name/aboot"
 
@@ -53,6 +55,11 @@
 #define PROP_MULTIBOOT_VERSION          "ro.multiboot.version"
 #define PROP_MULTIBOOT_ROM_ID           "ro.multiboot.romid"
 
+// Kernel cmdline token recording the ROM ID of a patched boot image. The dot
+// makes the kernel treat it as an (ignored) module parameter. libmiscstuff-jni
+// reads this so it doesn't have to decompress the ramdisk.
+#define CMDLINE_ROM_ID_PREFIX           "mbtool.romid="
+
 // Boot UI
 #define BOOT_UI_SKIP_PATH               "/raw/cache/multiboot/bootui/skip"
 #define BOOT_UI_ZIP_PATH                "/raw/cache/multiboot/bootui.zip"
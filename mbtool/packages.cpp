@@ -19,13 +19,16 @@
 
 #include "packages.h"
 
-#include <algorithm>
+#include <mutex>
 
 #include <cassert>
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 
+#include <sys/stat.h>
+
 #include <pugixml.hpp>
 
 #include "mblog/logging.h"
@@ -89,12 +92,40 @@ static const char *ATTR_SAMSUNG_NATIVE_LIBRARY_ROOT_REQUIRES_ISA
 static const char *ATTR_SAMSUNG_SECONDARY_NATIVE_LIBRARY_DIR
                                              = "secondaryNativeLibraryDir";
 
-static bool parse_tag_cert(pugi::xml_node node, Packages *pkgs,
-                           std::shared_ptr<Package> pkg);
-static bool parse_tag_sigs(pugi::xml_node node, Packages *pkgs,
-                           std::shared_ptr<Package> pkg);
-static bool parse_tag_package(pugi::xml_node node, Packages *pkgs);
-static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs);
+struct PackagesIndex
+{
+    std::unordered_map<int, std::shared_ptr<Package>> by_uid;
+    std::unordered_map<std::string, std::shared_ptr<Package>> by_name;
+};
+
+struct ParseState
+{
+    // Packages are parsed into a single contiguous array that is shared by
+    // all of the Package pointers handed out to callers
+    std::vector<Package> arena;
+    std::unordered_map<std::string, std::string> sigs;
+};
+
+struct CachedPackages
+{
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    std::vector<std::shared_ptr<Package>> pkgs;
+    std::unordered_map<std::string, std::string> sigs;
+    std::shared_ptr<const PackagesIndex> index;
+};
+
+static std::mutex packages_cache_lock;
+static std::unordered_map<std::string, CachedPackages> packages_cache;
+
+static bool parse_tag_cert(pugi::xml_node node, ParseState *state,
+                           Package &pkg);
+static bool parse_tag_sigs(pugi::xml_node node, ParseState *state,
+                           Package &pkg);
+static bool parse_tag_package(pugi::xml_node node, ParseState *state);
+static bool parse_tag_packages(pugi::xml_node node, ParseState *state);
 
 
 Package::Package() :
@@ -330,10 +361,41 @@ void Package::dump()
         LOGD(fmt_string, "Installer:", installer.c_str());
 }
 
+/*!
+ * \brief Load packages from a packages.xml file
+ *
+ * The parsed result is cached per path and is only reparsed if the file's
+ * inode, size, or modification time changes. Packages loaded from an unchanged
+ * file share the same Package instances, so they must be treated as read-only.
+ *
+ * \return Whether the file was successfully loaded
+ */
 bool Packages::load_xml(const std::string &path)
 {
     pkgs.clear();
     sigs.clear();
+    _index.reset();
+
+    struct stat sb;
+    if (stat(path.c_str(), &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(packages_cache_lock);
+
+    auto it = packages_cache.find(path);
+    if (it != packages_cache.end()
+            && it->second.dev == sb.st_dev
+            && it->second.ino == sb.st_ino
+            && it->second.size == sb.st_size
+            && it->second.mtime.tv_sec == sb.st_mtim.tv_sec
+            && it->second.mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+        pkgs = it->second.pkgs;
+        sigs = it->second.sigs;
+        _index = it->second.index;
+        return true;
+    }
 
     pugi::xml_document doc;
     pugi::xml_parse_result result = doc.load_file(path.c_str());
@@ -344,6 +406,7 @@ bool Packages::load_xml(const std::string &path)
     }
 
     pugi::xml_node root = doc.root();
+    ParseState state;
 
     for (pugi::xml_node cur_node : root.children()) {
         if (cur_node.type() != pugi::xml_node_type::node_element) {
@@ -351,7 +414,7 @@ bool Packages::load_xml(const std::string &path)
         }
 
         if (strcmp(cur_node.name(), TAG_PACKAGES) == 0) {
-            if (!parse_tag_packages(cur_node, this)) {
+            if (!parse_tag_packages(cur_node, &state)) {
                 return false;
             }
         } else {
@@ -359,11 +422,41 @@ bool Packages::load_xml(const std::string &path)
         }
     }
 
+    auto arena = std::make_shared<std::vector<Package>>(
+            std::move(state.arena));
+    auto index = std::make_shared<PackagesIndex>();
+
+    pkgs.reserve(arena->size());
+    index->by_name.reserve(arena->size());
+
+    for (Package &pkg : *arena) {
+        // Aliasing constructor: each pointer keeps the whole arena alive
+        pkgs.emplace_back(arena, &pkg);
+
+        // Keep the first match to preserve the old linear search semantics
+        index->by_name.emplace(pkg.name, pkgs.back());
+        if (!pkg.is_shared_user) {
+            index->by_uid.emplace(pkg.user_id, pkgs.back());
+        }
+    }
+
+    sigs = std::move(state.sigs);
+    _index = std::move(index);
+
+    CachedPackages &entry = packages_cache[path];
+    entry.dev = sb.st_dev;
+    entry.ino = sb.st_ino;
+    entry.size = sb.st_size;
+    entry.mtime = sb.st_mtim;
+    entry.pkgs = pkgs;
+    entry.sigs = sigs;
+    entry.index = _index;
+
     return true;
 }
 
-static bool parse_tag_cert(pugi::xml_node node, Packages *pkgs,
-                           std::shared_ptr<Package> pkg)
+static bool parse_tag_cert(pugi::xml_node node, ParseState *state,
+                           Package &pkg)
 {
     assert(strcmp(node.name(), TAG_CERT) == 0);
 
@@ -386,11 +479,11 @@ static bool parse_tag_cert(pugi::xml_node node, Packages *pkgs,
     if (index.empty()) {
         LOGW("Missing or empty index in <%s>", TAG_CERT);
     } else {
-        pkg->sig_indexes.push_back(index);
+        pkg.sig_indexes.push_back(index);
     }
     if (!index.empty() && !key.empty()) {
-        auto it = pkgs->sigs.find(index);
-        if (it != pkgs->sigs.end()) {
+        auto it = state->sigs.find(index);
+        if (it != state->sigs.end()) {
             // Make sure key matches if it's already in the map
             if (it->second != key) {
                 LOGE("Error: Index \"%s\" assigned to multiple keys",
@@ -399,15 +492,16 @@ static bool parse_tag_cert(pugi::xml_node node, Packages *pkgs,
             }
         } else {
             // Otherwise, add it to the map
-            pkgs->sigs.insert(std::make_pair(std::move(index), std::move(key)));
+            state->sigs.insert(
+                    std::make_pair(std::move(index), std::move(key)));
         }
     }
 
     return true;
 }
 
-static bool parse_tag_sigs(pugi::xml_node node, Packages *pkgs,
-                           std::shared_ptr<Package> pkg)
+static bool parse_tag_sigs(pugi::xml_node node, ParseState *state,
+                           Package &pkg)
 {
     assert(strcmp(node.name(), TAG_SIGS) == 0);
 
@@ -419,7 +513,7 @@ static bool parse_tag_sigs(pugi::xml_node node, Packages *pkgs,
         if (strcmp(cur_node.name(), TAG_SIGS) == 0) {
             LOGW("Nested <%s> is not allowed", TAG_SIGS);
         } else if (strcmp(cur_node.name(), TAG_CERT) == 0) {
-            if (!parse_tag_cert(cur_node, pkgs, pkg)) {
+            if (!parse_tag_cert(cur_node, state, pkg)) {
                 return false;
             }
         } else {
@@ -430,61 +524,62 @@ static bool parse_tag_sigs(pugi::xml_node node, Packages *pkgs,
     return true;
 }
 
-static bool parse_tag_package(pugi::xml_node node, Packages *pkgs)
+static bool parse_tag_package(pugi::xml_node node, ParseState *state)
 {
     assert(strcmp(node.name(), TAG_PACKAGE) == 0);
 
-    std::shared_ptr<Package> pkg(new Package());
+    state->arena.emplace_back();
+    Package &pkg = state->arena.back();
 
     for (pugi::xml_attribute attr : node.attributes()) {
         const pugi::char_t *name = attr.name();
         const pugi::char_t *value = attr.value();
 
         if (strcmp(name, ATTR_CODE_PATH) == 0) {
-            pkg->code_path = value;
+            pkg.code_path = value;
         } else if (strcmp(name, ATTR_CPU_ABI_OVERRIDE) == 0) {
-            pkg->cpu_abi_override = value;
+            pkg.cpu_abi_override = value;
         } else if (strcmp(name, ATTR_FLAGS) == 0) {
-            pkg->pkg_flags = static_cast<Package::Flags>(
+            pkg.pkg_flags = static_cast<Package::Flags>(
                     strtoll(value, nullptr, 10));
         } else if (strcmp(name, ATTR_PUBLIC_FLAGS) == 0) {
-            pkg->pkg_public_flags = static_cast<Package::PublicFlags>(
+            pkg.pkg_public_flags = static_cast<Package::PublicFlags>(
                     strtoll(value, nullptr, 10));
         } else if (strcmp(name, ATTR_PRIVATE_FLAGS) == 0) {
-            pkg->pkg_private_flags = static_cast<Package::PrivateFlags>(
+            pkg.pkg_private_flags = static_cast<Package::PrivateFlags>(
                     strtoll(value, nullptr, 10));
         } else if (strcmp(name, ATTR_FT) == 0) {
-            pkg->timestamp = strtoull(value, nullptr, 16);
+            pkg.timestamp = strtoull(value, nullptr, 16);
         } else if (strcmp(name, ATTR_INSTALL_STATUS) == 0) {
-            pkg->install_status = value;
+            pkg.install_status = value;
         } else if (strcmp(name, ATTR_INSTALLER) == 0) {
-            pkg->installer = value;
+            pkg.installer = value;
         } else if (strcmp(name, ATTR_IT) == 0) {
-            pkg->first_install_time = strtoull(value, nullptr, 16);
+            pkg.first_install_time = strtoull(value, nullptr, 16);
         } else if (strcmp(name, ATTR_NAME) == 0) {
-            pkg->name = value;
+            pkg.name = value;
         } else if (strcmp(name, ATTR_NATIVE_LIBRARY_PATH) == 0) {
-            pkg->native_library_path = value;
+            pkg.native_library_path = value;
         } else if (strcmp(name, ATTR_PRIMARY_CPU_ABI) == 0) {
-            pkg->primary_cpu_abi = value;
+            pkg.primary_cpu_abi = value;
         } else if (strcmp(name, ATTR_REAL_NAME) == 0) {
-            pkg->real_name = value;
+            pkg.real_name = value;
         } else if (strcmp(name, ATTR_RESOURCE_PATH) == 0) {
-            pkg->resource_path = value;
+            pkg.resource_path = value;
         } else if (strcmp(name, ATTR_SECONDARY_CPU_ABI) == 0) {
-            pkg->secondary_cpu_abi = value;
+            pkg.secondary_cpu_abi = value;
         } else if (strcmp(name, ATTR_SHARED_USER_ID) == 0) {
-            pkg->shared_user_id = strtol(value, nullptr, 10);
-            pkg->is_shared_user = 1;
+            pkg.shared_user_id = strtol(value, nullptr, 10);
+            pkg.is_shared_user = 1;
         } else if (strcmp(name, ATTR_UID_ERROR) == 0) {
-            pkg->uid_error = value;
+            pkg.uid_error = value;
         } else if (strcmp(name, ATTR_USER_ID) == 0) {
-            pkg->user_id = strtol(value, nullptr, 10);
-            pkg->is_shared_user = 0;
+            pkg.user_id = strtol(value, nullptr, 10);
+            pkg.is_shared_user = 0;
         } else if (strcmp(name, ATTR_UT) == 0) {
-            pkg->last_update_time = strtoull(value, nullptr, 16);
+            pkg.last_update_time = strtoull(value, nullptr, 16);
         } else if (strcmp(name, ATTR_VERSION) == 0) {
-            pkg->version = strtol(value, nullptr, 10);
+            pkg.version = strtol(value, nullptr, 10);
         } else if (strcmp(name, ATTR_SAMSUNG_DM) == 0
                 || strcmp(name, ATTR_SAMSUNG_DT) == 0
                 || strcmp(name, ATTR_SAMSUNG_NATIVE_LIBRARY_DIR) == 0
@@ -512,7 +607,7 @@ static bool parse_tag_package(pugi::xml_node node, Packages *pkgs)
                 || strcmp(cur_node.name(), TAG_UPGRADE_KEYSET) == 0) {
             // Ignore
         } else if (strcmp(cur_node.name(), TAG_SIGS) == 0) {
-            if (!parse_tag_sigs(cur_node, pkgs, pkg)) {
+            if (!parse_tag_sigs(cur_node, state, pkg)) {
                 return false;
             }
         } else {
@@ -520,15 +615,20 @@ static bool parse_tag_package(pugi::xml_node node, Packages *pkgs)
         }
     }
 
-    pkgs->pkgs.push_back(std::move(pkg));
-
     return true;
 }
 
-static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs)
+static bool parse_tag_packages(pugi::xml_node node, ParseState *state)
 {
     assert(strcmp(node.name(), TAG_PACKAGES) == 0);
 
+    size_t count = 0;
+    for (pugi::xml_node cur_node = node.child(TAG_PACKAGE); cur_node;
+            cur_node = cur_node.next_sibling(TAG_PACKAGE)) {
+        ++count;
+    }
+    state->arena.reserve(count);
+
     for (pugi::xml_node cur_node : node.children()) {
         if (cur_node.type() != pugi::xml_node_type::node_element) {
             continue;
@@ -537,7 +637,7 @@ static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs)
         if (strcmp(cur_node.name(), TAG_PACKAGES) == 0) {
             LOGW("Nested <%s> is not allowed", TAG_PACKAGES);
         } else if (strcmp(cur_node.name(), TAG_PACKAGE) == 0) {
-            if (!parse_tag_package(cur_node, pkgs)) {
+            if (!parse_tag_package(cur_node, state)) {
                 return false;
             }
         } else if (strcmp(cur_node.name(), TAG_DATABASE_VERSION) == 0
@@ -560,20 +660,23 @@ static bool parse_tag_packages(pugi::xml_node node, Packages *pkgs)
 
 std::shared_ptr<Package> Packages::find_by_uid(uid_t uid) const
 {
-    auto it = std::find_if(pkgs.begin(), pkgs.end(),
-                           [&](const std::shared_ptr<Package> &pkg) {
-        return !pkg->is_shared_user && pkg->user_id == static_cast<int>(uid);
-    });
-    return it == pkgs.end() ? std::shared_ptr<Package>() : *it;
+    if (!_index) {
+        return {};
+    }
+
+    auto it = _index->by_uid.find(static_cast<int>(uid));
+    return it == _index->by_uid.end() ? std::shared_ptr<Package>() : it->second;
 }
 
 std::shared_ptr<Package> Packages::find_by_pkg(const std::string &pkg_id) const
 {
-    auto it = std::find_if(pkgs.begin(), pkgs.end(),
-                           [&](const std::shared_ptr<Package> &pkg) {
-        return pkg->name == pkg_id;
-    });
-    return it == pkgs.end() ? std::shared_ptr<Package>() : *it;
+    if (!_index) {
+        return {};
+    }
+
+    auto it = _index->by_name.find(pkg_id);
+    return it == _index->by_name.end()
+            ? std::shared_ptr<Package>() : it->second;
 }
 
 }
@@ -146,6 +146,8 @@ public:
     void dump();
 };
 
+struct PackagesIndex;
+
 class Packages
 {
 public:
@@ -156,6 +158,9 @@ public:
 
     std::shared_ptr<Package> find_by_uid(uid_t uid) const;
     std::shared_ptr<Package> find_by_pkg(const std::string &pkg_id) const;
+
+private:
+    std::shared_ptr<const PackagesIndex> _index;
 };
 
 }
@@ -0,0 +1,205 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_FILESTREAMREAD_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_FILESTREAMREAD_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct FileStreamReadError;
+
+struct FileStreamReadRequest;
+
+struct FileStreamReadResponse;
+
+struct FileStreamReadError FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ERRNO_VALUE = 4,
+    VT_MSG = 6
+  };
+  int32_t errno_value() const {
+    return GetField<int32_t>(VT_ERRNO_VALUE, 0);
+  }
+  const flatbuffers::String *msg() const {
+    return GetPointer<const flatbuffers::String *>(VT_MSG);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_ERRNO_VALUE) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_MSG) &&
+           verifier.Verify(msg()) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileStreamReadErrorBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_errno_value(int32_t errno_value) {
+    fbb_.AddElement<int32_t>(FileStreamReadError::VT_ERRNO_VALUE, errno_value, 0);
+  }
+  void add_msg(flatbuffers::Offset<flatbuffers::String> msg) {
+    fbb_.AddOffset(FileStreamReadError::VT_MSG, msg);
+  }
+  FileStreamReadErrorBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileStreamReadErrorBuilder &operator=(const FileStreamReadErrorBuilder &);
+  flatbuffers::Offset<FileStreamReadError> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<FileStreamReadError>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileStreamReadError> CreateFileStreamReadError(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    flatbuffers::Offset<flatbuffers::String> msg = 0) {
+  FileStreamReadErrorBuilder builder_(_fbb);
+  builder_.add_msg(msg);
+  builder_.add_errno_value(errno_value);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<FileStreamReadError> CreateFileStreamReadErrorDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    const char *msg = nullptr) {
+  return mbtool::daemon::v3::CreateFileStreamReadError(
+      _fbb,
+      errno_value,
+      msg ? _fbb.CreateString(msg) : 0);
+}
+
+struct FileStreamReadRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ID = 4,
+    VT_MAX_BYTES = 6,
+    VT_CHUNK_SIZE = 8
+  };
+  int32_t id() const {
+    return GetField<int32_t>(VT_ID, 0);
+  }
+  uint64_t max_bytes() const {
+    return GetField<uint64_t>(VT_MAX_BYTES, 0);
+  }
+  uint32_t chunk_size() const {
+    return GetField<uint32_t>(VT_CHUNK_SIZE, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_ID) &&
+           VerifyField<uint64_t>(verifier, VT_MAX_BYTES) &&
+           VerifyField<uint32_t>(verifier, VT_CHUNK_SIZE) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileStreamReadRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_id(int32_t id) {
+    fbb_.AddElement<int32_t>(FileStreamReadRequest::VT_ID, id, 0);
+  }
+  void add_max_bytes(uint64_t max_bytes) {
+    fbb_.AddElement<uint64_t>(FileStreamReadRequest::VT_MAX_BYTES, max_bytes, 0);
+  }
+  void add_chunk_size(uint32_t chunk_size) {
+    fbb_.AddElement<uint32_t>(FileStreamReadRequest::VT_CHUNK_SIZE, chunk_size, 0);
+  }
+  FileStreamReadRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileStreamReadRequestBuilder &operator=(const FileStreamReadRequestBuilder &);
+  flatbuffers::Offset<FileStreamReadRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 3);
+    auto o = flatbuffers::Offset<FileStreamReadRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileStreamReadRequest> CreateFileStreamReadRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t id = 0,
+    uint64_t max_bytes = 0,
+    uint32_t chunk_size = 0) {
+  FileStreamReadRequestBuilder builder_(_fbb);
+  builder_.add_max_bytes(max_bytes);
+  builder_.add_chunk_size(chunk_size);
+  builder_.add_id(id);
+  return builder_.Finish();
+}
+
+struct FileStreamReadResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_SUCCESS = 4,
+    VT_BYTES_READ = 6,
+    VT_ERROR = 8
+  };
+  bool success() const {
+    return GetField<uint8_t>(VT_SUCCESS, 0) != 0;
+  }
+  uint64_t bytes_read() const {
+    return GetField<uint64_t>(VT_BYTES_READ, 0);
+  }
+  const FileStreamReadError *error() const {
+    return GetPointer<const FileStreamReadError *>(VT_ERROR);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint8_t>(verifier, VT_SUCCESS) &&
+           VerifyField<uint64_t>(verifier, VT_BYTES_READ) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
+           verifier.VerifyTable(error()) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileStreamReadResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_success(bool success) {
+    fbb_.AddElement<uint8_t>(FileStreamReadResponse::VT_SUCCESS, static_cast<uint8_t>(success), 0);
+  }
+  void add_bytes_read(uint64_t bytes_read) {
+    fbb_.AddElement<uint64_t>(FileStreamReadResponse::VT_BYTES_READ, bytes_read, 0);
+  }
+  void add_error(flatbuffers::Offset<FileStreamReadError> error) {
+    fbb_.AddOffset(FileStreamReadResponse::VT_ERROR, error);
+  }
+  FileStreamReadResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileStreamReadResponseBuilder &operator=(const FileStreamReadResponseBuilder &);
+  flatbuffers::Offset<FileStreamReadResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 3);
+    auto o = flatbuffers::Offset<FileStreamReadResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileStreamReadResponse> CreateFileStreamReadResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    bool success = false,
+    uint64_t bytes_read = 0,
+    flatbuffers::Offset<FileStreamReadError> error = 0) {
+  FileStreamReadResponseBuilder builder_(_fbb);
+  builder_.add_bytes_read(bytes_read);
+  builder_.add_error(error);
+  builder_.add_success(success);
+  return builder_.Finish();
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_FILESTREAMREAD_MBTOOL_DAEMON_V3_H_
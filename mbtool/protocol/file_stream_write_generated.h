@@ -0,0 +1,185 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_FILESTREAMWRITE_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_FILESTREAMWRITE_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct FileStreamWriteError;
+
+struct FileStreamWriteRequest;
+
+struct FileStreamWriteResponse;
+
+struct FileStreamWriteError FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ERRNO_VALUE = 4,
+    VT_MSG = 6
+  };
+  int32_t errno_value() const {
+    return GetField<int32_t>(VT_ERRNO_VALUE, 0);
+  }
+  const flatbuffers::String *msg() const {
+    return GetPointer<const flatbuffers::String *>(VT_MSG);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_ERRNO_VALUE) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_MSG) &&
+           verifier.Verify(msg()) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileStreamWriteErrorBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_errno_value(int32_t errno_value) {
+    fbb_.AddElement<int32_t>(FileStreamWriteError::VT_ERRNO_VALUE, errno_value, 0);
+  }
+  void add_msg(flatbuffers::Offset<flatbuffers::String> msg) {
+    fbb_.AddOffset(FileStreamWriteError::VT_MSG, msg);
+  }
+  FileStreamWriteErrorBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileStreamWriteErrorBuilder &operator=(const FileStreamWriteErrorBuilder &);
+  flatbuffers::Offset<FileStreamWriteError> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<FileStreamWriteError>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileStreamWriteError> CreateFileStreamWriteError(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    flatbuffers::Offset<flatbuffers::String> msg = 0) {
+  FileStreamWriteErrorBuilder builder_(_fbb);
+  builder_.add_msg(msg);
+  builder_.add_errno_value(errno_value);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<FileStreamWriteError> CreateFileStreamWriteErrorDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    const char *msg = nullptr) {
+  return mbtool::daemon::v3::CreateFileStreamWriteError(
+      _fbb,
+      errno_value,
+      msg ? _fbb.CreateString(msg) : 0);
+}
+
+struct FileStreamWriteRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ID = 4
+  };
+  int32_t id() const {
+    return GetField<int32_t>(VT_ID, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_ID) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileStreamWriteRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_id(int32_t id) {
+    fbb_.AddElement<int32_t>(FileStreamWriteRequest::VT_ID, id, 0);
+  }
+  FileStreamWriteRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileStreamWriteRequestBuilder &operator=(const FileStreamWriteRequestBuilder &);
+  flatbuffers::Offset<FileStreamWriteRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<FileStreamWriteRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileStreamWriteRequest> CreateFileStreamWriteRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t id = 0) {
+  FileStreamWriteRequestBuilder builder_(_fbb);
+  builder_.add_id(id);
+  return builder_.Finish();
+}
+
+struct FileStreamWriteResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_SUCCESS = 4,
+    VT_BYTES_WRITTEN = 6,
+    VT_ERROR = 8
+  };
+  bool success() const {
+    return GetField<uint8_t>(VT_SUCCESS, 0) != 0;
+  }
+  uint64_t bytes_written() const {
+    return GetField<uint64_t>(VT_BYTES_WRITTEN, 0);
+  }
+  const FileStreamWriteError *error() const {
+    return GetPointer<const FileStreamWriteError *>(VT_ERROR);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint8_t>(verifier, VT_SUCCESS) &&
+           VerifyField<uint64_t>(verifier, VT_BYTES_WRITTEN) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
+           verifier.VerifyTable(error()) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileStreamWriteResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_success(bool success) {
+    fbb_.AddElement<uint8_t>(FileStreamWriteResponse::VT_SUCCESS, static_cast<uint8_t>(success), 0);
+  }
+  void add_bytes_written(uint64_t bytes_written) {
+    fbb_.AddElement<uint64_t>(FileStreamWriteResponse::VT_BYTES_WRITTEN, bytes_written, 0);
+  }
+  void add_error(flatbuffers::Offset<FileStreamWriteError> error) {
+    fbb_.AddOffset(FileStreamWriteResponse::VT_ERROR, error);
+  }
+  FileStreamWriteResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  FileStreamWriteResponseBuilder &operator=(const FileStreamWriteResponseBuilder &);
+  flatbuffers::Offset<FileStreamWriteResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 3);
+    auto o = flatbuffers::Offset<FileStreamWriteResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileStreamWriteResponse> CreateFileStreamWriteResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    bool success = false,
+    uint64_t bytes_written = 0,
+    flatbuffers::Offset<FileStreamWriteError> error = 0) {
+  FileStreamWriteResponseBuilder builder_(_fbb);
+  builder_.add_bytes_written(bytes_written);
+  builder_.add_error(error);
+  builder_.add_success(success);
+  return builder_.Finish();
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_FILESTREAMWRITE_MBTOOL_DAEMON_V3_H_
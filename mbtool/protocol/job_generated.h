@@ -0,0 +1,742 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_JOB_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_JOB_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct JobError;
+
+struct JobProgress;
+
+struct JobStartRequest;
+
+struct JobStartResponse;
+
+struct JobStatusRequest;
+
+struct JobStatusResponse;
+
+struct JobSubscribeRequest;
+
+struct JobEventResponse;
+
+struct JobSubscribeResponse;
+
+struct JobCancelRequest;
+
+struct JobCancelResponse;
+
+enum JobState {
+  JobState_QUEUED = 0,
+  JobState_RUNNING = 1,
+  JobState_FINISHED = 2,
+  JobState_FAILED = 3,
+  JobState_CANCELLED = 4,
+  JobState_MIN = JobState_QUEUED,
+  JobState_MAX = JobState_CANCELLED
+};
+
+inline const char **EnumNamesJobState() {
+  static const char *names[] = {
+    "QUEUED",
+    "RUNNING",
+    "FINISHED",
+    "FAILED",
+    "CANCELLED",
+    nullptr
+  };
+  return names;
+}
+
+inline const char *EnumNameJobState(JobState e) {
+  const size_t index = static_cast<int>(e);
+  return EnumNamesJobState()[index];
+}
+
+struct JobError FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_MSG = 4
+  };
+  const flatbuffers::String *msg() const {
+    return GetPointer<const flatbuffers::String *>(VT_MSG);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_MSG) &&
+           verifier.Verify(msg()) &&
+           verifier.EndTable();
+  }
+};
+
+struct JobErrorBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_msg(flatbuffers::Offset<flatbuffers::String> msg) {
+    fbb_.AddOffset(JobError::VT_MSG, msg);
+  }
+  JobErrorBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  JobErrorBuilder &operator=(const JobErrorBuilder &);
+  flatbuffers::Offset<JobError> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<JobError>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<JobError> CreateJobError(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::String> msg = 0) {
+  JobErrorBuilder builder_(_fbb);
+  builder_.add_msg(msg);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<JobError> CreateJobErrorDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const char *msg = nullptr) {
+  return mbtool::daemon::v3::CreateJobError(
+      _fbb,
+      msg ? _fbb.CreateString(msg) : 0);
+}
+
+struct JobProgress FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_STATE = 4,
+    VT_STAGE = 6,
+    VT_BYTES_DONE = 8,
+    VT_BYTES_TOTAL = 10,
+    VT_FILES_DONE = 12,
+    VT_FILES_TOTAL = 14
+  };
+  JobState state() const {
+    return static_cast<JobState>(GetField<int16_t>(VT_STATE, 0));
+  }
+  const flatbuffers::String *stage() const {
+    return GetPointer<const flatbuffers::String *>(VT_STAGE);
+  }
+  uint64_t bytes_done() const {
+    return GetField<uint64_t>(VT_BYTES_DONE, 0);
+  }
+  uint64_t bytes_total() const {
+    return GetField<uint64_t>(VT_BYTES_TOTAL, 0);
+  }
+  uint64_t files_done() const {
+    return GetField<uint64_t>(VT_FILES_DONE, 0);
+  }
+  uint64_t files_total() const {
+    return GetField<uint64_t>(VT_FILES_TOTAL, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int16_t>(verifier, VT_STATE) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_STAGE) &&
+           verifier.Verify(stage()) &&
+           VerifyField<uint64_t>(verifier, VT_BYTES_DONE) &&
+           VerifyField<uint64_t>(verifier, VT_BYTES_TOTAL) &&
+           VerifyField<uint64_t>(verifier, VT_FILES_DONE) &&
+           VerifyField<uint64_t>(verifier, VT_FILES_TOTAL) &&
+           verifier.EndTable();
+  }
+};
+
+struct JobProgressBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_state(JobState state) {
+    fbb_.AddElement<int16_t>(JobProgress::VT_STATE, static_cast<int16_t>(state), 0);
+  }
+  void add_stage(flatbuffers::Offset<flatbuffers::String> stage) {
+    fbb_.AddOffset(JobProgress::VT_STAGE, stage);
+  }
+  void add_bytes_done(uint64_t bytes_done) {
+    fbb_.AddElement<uint64_t>(JobProgress::VT_BYTES_DONE, bytes_done, 0);
+  }
+  void add_bytes_total(uint64_t bytes_total) {
+    fbb_.AddElement<uint64_t>(JobProgress::VT_BYTES_TOTAL, bytes_total, 0);
+  }
+  void add_files_done(uint64_t files_done) {
+    fbb_.AddElement<uint64_t>(JobProgress::VT_FILES_DONE, files_done, 0);
+  }
+  void add_files_total(uint64_t files_total) {
+    fbb_.AddElement<uint64_t>(JobProgress::VT_FILES_TOTAL, files_total, 0);
+  }
+  JobProgressBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  JobProgressBuilder &operator=(const JobProgressBuilder &);
+  flatbuffers::Offset<JobProgress> Finish() {
+    const auto end = fbb_.EndTable(start_, 6);
+    auto o = flatbuffers::Offset<JobProgress>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<JobProgress> CreateJobProgress(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    JobState state = JobState_QUEUED,
+    flatbuffers::Offset<flatbuffers::String> stage = 0,
+    uint64_t bytes_done = 0,
+    uint64_t bytes_total = 0,
+    uint64_t files_done = 0,
+    uint64_t files_total = 0) {
+  JobProgressBuilder builder_(_fbb);
+  builder_.add_files_total(files_total);
+  builder_.add_files_done(files_done);
+  builder_.add_bytes_total(bytes_total);
+  builder_.add_bytes_done(bytes_done);
+  builder_.add_stage(stage);
+  builder_.add_state(state);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<JobProgress> CreateJobProgressDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    JobState state = JobState_QUEUED,
+    const char *stage = nullptr,
+    uint64_t bytes_done = 0,
+    uint64_t bytes_total = 0,
+    uint64_t files_done = 0,
+    uint64_t files_total = 0) {
+  return mbtool::daemon::v3::CreateJobProgress(
+      _fbb,
+      state,
+      stage ? _fbb.CreateString(stage) : 0,
+      bytes_done,
+      bytes_total,
+      files_done,
+      files_total);
+}
+
+struct JobStartRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_REQUEST = 4
+  };
+  const flatbuffers::Vector<uint8_t> *request() const {
+    return GetPointer<const flatbuffers::Vector<uint8_t> *>(VT_REQUEST);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_REQUEST) &&
+           verifier.Verify(request()) &&
+           verifier.EndTable();
+  }
+};
+
+struct JobStartRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_request(flatbuffers::Offset<flatbuffers::Vector<uint8_t>> request) {
+    fbb_.AddOffset(JobStartRequest::VT_REQUEST, request);
+  }
+  JobStartRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  JobStartRequestBuilder &operator=(const JobStartRequestBuilder &);
+  flatbuffers::Offset<JobStartRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<JobStartRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<JobStartRequest> CreateJobStartRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<uint8_t>> request = 0) {
+  JobStartRequestBuilder builder_(_fbb);
+  builder_.add_request(request);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<JobStartRequest> CreateJobStartRequestDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<uint8_t> *request = nullptr) {
+  return mbtool::daemon::v3::CreateJobStartRequest(
+      _fbb,
+      request ? _fbb.CreateVector<uint8_t>(*request) : 0);
+}
+
+struct JobStartResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_SUCCESS = 4,
+    VT_ID = 6,
+    VT_ERROR = 8
+  };
+  bool success() const {
+    return GetField<uint8_t>(VT_SUCCESS, 0) != 0;
+  }
+  uint64_t id() const {
+    return GetField<uint64_t>(VT_ID, 0);
+  }
+  const JobError *error() const {
+    return GetPointer<const JobError *>(VT_ERROR);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint8_t>(verifier, VT_SUCCESS) &&
+           VerifyField<uint64_t>(verifier, VT_ID) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
+           verifier.VerifyTable(error()) &&
+           verifier.EndTable();
+  }
+};
+
+struct JobStartResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_success(bool success) {
+    fbb_.AddElement<uint8_t>(JobStartResponse::VT_SUCCESS, static_cast<uint8_t>(success), 0);
+  }
+  void add_id(uint64_t id) {
+    fbb_.AddElement<uint64_t>(JobStartResponse::VT_ID, id, 0);
+  }
+  void add_error(flatbuffers::Offset<JobError> error) {
+    fbb_.AddOffset(JobStartResponse::VT_ERROR, error);
+  }
+  JobStartResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  JobStartResponseBuilder &operator=(const JobStartResponseBuilder &);
+  flatbuffers::Offset<JobStartResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 3);
+    auto o = flatbuffers::Offset<JobStartResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<JobStartResponse> CreateJobStartResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    bool success = false,
+    uint64_t id = 0,
+    flatbuffers::Offset<JobError> error = 0) {
+  JobStartResponseBuilder builder_(_fbb);
+  builder_.add_id(id);
+  builder_.add_error(error);
+  builder_.add_success(success);
+  return builder_.Finish();
+}
+
+struct JobStatusRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ID = 4
+  };
+  uint64_t id() const {
+    return GetField<uint64_t>(VT_ID, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint64_t>(verifier, VT_ID) &&
+           verifier.EndTable();
+  }
+};
+
+struct JobStatusRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_id(uint64_t id) {
+    fbb_.AddElement<uint64_t>(JobStatusRequest::VT_ID, id, 0);
+  }
+  JobStatusRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  JobStatusRequestBuilder &operator=(const JobStatusRequestBuilder &);
+  flatbuffers::Offset<JobStatusRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<JobStatusRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<JobStatusRequest> CreateJobStatusRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint64_t id = 0) {
+  JobStatusRequestBuilder builder_(_fbb);
+  builder_.add_id(id);
+  return builder_.Finish();
+}
+
+struct JobStatusResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_SUCCESS = 4,
+    VT_PROGRESS = 6,
+    VT_RESPONSE = 8,
+    VT_ERROR = 10
+  };
+  bool success() const {
+    return GetField<uint8_t>(VT_SUCCESS, 0) != 0;
+  }
+  const JobProgress *progress() const {
+    return GetPointer<const JobProgress *>(VT_PROGRESS);
+  }
+  const flatbuffers::Vector<uint8_t> *response() const {
+    return GetPointer<const flatbuffers::Vector<uint8_t> *>(VT_RESPONSE);
+  }
+  const JobError *error() const {
+    return GetPointer<const JobError *>(VT_ERROR);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint8_t>(verifier, VT_SUCCESS) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_PROGRESS) &&
+           verifier.VerifyTable(progress()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_RESPONSE) &&
+           verifier.Verify(response()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
+           verifier.VerifyTable(error()) &&
+           verifier.EndTable();
+  }
+};
+
+struct JobStatusResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_success(bool success) {
+    fbb_.AddElement<uint8_t>(JobStatusResponse::VT_SUCCESS, static_cast<uint8_t>(success), 0);
+  }
+  void add_progress(flatbuffers::Offset<JobProgress> progress) {
+    fbb_.AddOffset(JobStatusResponse::VT_PROGRESS, progress);
+  }
+  void add_response(flatbuffers::Offset<flatbuffers::Vector<uint8_t>> response) {
+    fbb_.AddOffset(JobStatusResponse::VT_RESPONSE, response);
+  }
+  void add_error(flatbuffers::Offset<JobError> error) {
+    fbb_.AddOffset(JobStatusResponse::VT_ERROR, error);
+  }
+  JobStatusResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  JobStatusResponseBuilder &operator=(const JobStatusResponseBuilder &);
+  flatbuffers::Offset<JobStatusResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 4);
+    auto o = flatbuffers::Offset<JobStatusResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<JobStatusResponse> CreateJobStatusResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    bool success = false,
+    flatbuffers::Offset<JobProgress> progress = 0,
+    flatbuffers::Offset<flatbuffers::Vector<uint8_t>> response = 0,
+    flatbuffers::Offset<JobError> error = 0) {
+  JobStatusResponseBuilder builder_(_fbb);
+  builder_.add_error(error);
+  builder_.add_response(response);
+  builder_.add_progress(progress);
+  builder_.add_success(success);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<JobStatusResponse> CreateJobStatusResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    bool success = false,
+    flatbuffers::Offset<JobProgress> progress = 0,
+    const std::vector<uint8_t> *response = nullptr,
+    flatbuffers::Offset<JobError> error = 0) {
+  return mbtool::daemon::v3::CreateJobStatusResponse(
+      _fbb,
+      success,
+      progress,
+      response ? _fbb.CreateVector<uint8_t>(*response) : 0,
+      error);
+}
+
+struct JobSubscribeRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ID = 4
+  };
+  uint64_t id() const {
+    return GetField<uint64_t>(VT_ID, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint64_t>(verifier, VT_ID) &&
+           verifier.EndTable();
+  }
+};
+
+struct JobSubscribeRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_id(uint64_t id) {
+    fbb_.AddElement<uint64_t>(JobSubscribeRequest::VT_ID, id, 0);
+  }
+  JobSubscribeRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  JobSubscribeRequestBuilder &operator=(const JobSubscribeRequestBuilder &);
+  flatbuffers::Offset<JobSubscribeRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<JobSubscribeRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<JobSubscribeRequest> CreateJobSubscribeRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint64_t id = 0) {
+  JobSubscribeRequestBuilder builder_(_fbb);
+  builder_.add_id(id);
+  return builder_.Finish();
+}
+
+struct JobEventResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_PROGRESS = 4,
+    VT_OUTPUT_LINES = 6
+  };
+  const JobProgress *progress() const {
+    return GetPointer<const JobProgress *>(VT_PROGRESS);
+  }
+  const flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>> *output_lines() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>> *>(VT_OUTPUT_LINES);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_PROGRESS) &&
+           verifier.VerifyTable(progress()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_OUTPUT_LINES) &&
+           verifier.Verify(output_lines()) &&
+           verifier.VerifyVectorOfStrings(output_lines()) &&
+           verifier.EndTable();
+  }
+};
+
+struct JobEventResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_progress(flatbuffers::Offset<JobProgress> progress) {
+    fbb_.AddOffset(JobEventResponse::VT_PROGRESS, progress);
+  }
+  void add_output_lines(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>>> output_lines) {
+    fbb_.AddOffset(JobEventResponse::VT_OUTPUT_LINES, output_lines);
+  }
+  JobEventResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  JobEventResponseBuilder &operator=(const JobEventResponseBuilder &);
+  flatbuffers::Offset<JobEventResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<JobEventResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<JobEventResponse> CreateJobEventResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<JobProgress> progress = 0,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>>> output_lines = 0) {
+  JobEventResponseBuilder builder_(_fbb);
+  builder_.add_output_lines(output_lines);
+  builder_.add_progress(progress);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<JobEventResponse> CreateJobEventResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<JobProgress> progress = 0,
+    const std::vector<flatbuffers::Offset<flatbuffers::String>> *output_lines = nullptr) {
+  return mbtool::daemon::v3::CreateJobEventResponse(
+      _fbb,
+      progress,
+      output_lines ? _fbb.CreateVector<flatbuffers::Offset<flatbuffers::String>>(*output_lines) : 0);
+}
+
+struct JobSubscribeResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_SUCCESS = 4,
+    VT_PROGRESS = 6,
+    VT_RESPONSE = 8,
+    VT_ERROR = 10
+  };
+  bool success() const {
+    return GetField<uint8_t>(VT_SUCCESS, 0) != 0;
+  }
+  const JobProgress *progress() const {
+    return GetPointer<const JobProgress *>(VT_PROGRESS);
+  }
+  const flatbuffers::Vector<uint8_t> *response() const {
+    return GetPointer<const flatbuffers::Vector<uint8_t> *>(VT_RESPONSE);
+  }
+  const JobError *error() const {
+    return GetPointer<const JobError *>(VT_ERROR);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint8_t>(verifier, VT_SUCCESS) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_PROGRESS) &&
+           verifier.VerifyTable(progress()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_RESPONSE) &&
+           verifier.Verify(response()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
+           verifier.VerifyTable(error()) &&
+           verifier.EndTable();
+  }
+};
+
+struct JobSubscribeResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_success(bool success) {
+    fbb_.AddElement<uint8_t>(JobSubscribeResponse::VT_SUCCESS, static_cast<uint8_t>(success), 0);
+  }
+  void add_progress(flatbuffers::Offset<JobProgress> progress) {
+    fbb_.AddOffset(JobSubscribeResponse::VT_PROGRESS, progress);
+  }
+  void add_response(flatbuffers::Offset<flatbuffers::Vector<uint8_t>> response) {
+    fbb_.AddOffset(JobSubscribeResponse::VT_RESPONSE, response);
+  }
+  void add_error(flatbuffers::Offset<JobError> error) {
+    fbb_.AddOffset(JobSubscribeResponse::VT_ERROR, error);
+  }
+  JobSubscribeResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  JobSubscribeResponseBuilder &operator=(const JobSubscribeResponseBuilder &);
+  flatbuffers::Offset<JobSubscribeResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 4);
+    auto o = flatbuffers::Offset<JobSubscribeResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<JobSubscribeResponse> CreateJobSubscribeResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    bool success = false,
+    flatbuffers::Offset<JobProgress> progress = 0,
+    flatbuffers::Offset<flatbuffers::Vector<uint8_t>> response = 0,
+    flatbuffers::Offset<JobError> error = 0) {
+  JobSubscribeResponseBuilder builder_(_fbb);
+  builder_.add_error(error);
+  builder_.add_response(response);
+  builder_.add_progress(progress);
+  builder_.add_success(success);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<JobSubscribeResponse> CreateJobSubscribeResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    bool success = false,
+    flatbuffers::Offset<JobProgress> progress = 0,
+    const std::vector<uint8_t> *response = nullptr,
+    flatbuffers::Offset<JobError> error = 0) {
+  return mbtool::daemon::v3::CreateJobSubscribeResponse(
+      _fbb,
+      success,
+      progress,
+      response ? _fbb.CreateVector<uint8_t>(*response) : 0,
+      error);
+}
+
+struct JobCancelRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ID = 4
+  };
+  uint64_t id() const {
+    return GetField<uint64_t>(VT_ID, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint64_t>(verifier, VT_ID) &&
+           verifier.EndTable();
+  }
+};
+
+struct JobCancelRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_id(uint64_t id) {
+    fbb_.AddElement<uint64_t>(JobCancelRequest::VT_ID, id, 0);
+  }
+  JobCancelRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  JobCancelRequestBuilder &operator=(const JobCancelRequestBuilder &);
+  flatbuffers::Offset<JobCancelRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<JobCancelRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<JobCancelRequest> CreateJobCancelRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    uint64_t id = 0) {
+  JobCancelRequestBuilder builder_(_fbb);
+  builder_.add_id(id);
+  return builder_.Finish();
+}
+
+struct JobCancelResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_SUCCESS = 4,
+    VT_ERROR = 6
+  };
+  bool success() const {
+    return GetField<uint8_t>(VT_SUCCESS, 0) != 0;
+  }
+  const JobError *error() const {
+    return GetPointer<const JobError *>(VT_ERROR);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint8_t>(verifier, VT_SUCCESS) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
+           verifier.VerifyTable(error()) &&
+           verifier.EndTable();
+  }
+};
+
+struct JobCancelResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_success(bool success) {
+    fbb_.AddElement<uint8_t>(JobCancelResponse::VT_SUCCESS, static_cast<uint8_t>(success), 0);
+  }
+  void add_error(flatbuffers::Offset<JobError> error) {
+    fbb_.AddOffset(JobCancelResponse::VT_ERROR, error);
+  }
+  JobCancelResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  JobCancelResponseBuilder &operator=(const JobCancelResponseBuilder &);
+  flatbuffers::Offset<JobCancelResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<JobCancelResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<JobCancelResponse> CreateJobCancelResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    bool success = false,
+    flatbuffers::Offset<JobError> error = 0) {
+  JobCancelResponseBuilder builder_(_fbb);
+  builder_.add_error(error);
+  builder_.add_success(success);
+  return builder_.Finish();
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_JOB_MBTOOL_DAEMON_V3_H_
@@ -0,0 +1,263 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_MBGETDAEMONSTATS_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_MBGETDAEMONSTATS_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct MbRequestStats;
+
+struct MbCounter;
+
+struct MbGetDaemonStatsRequest;
+
+struct MbGetDaemonStatsResponse;
+
+struct MbRequestStats FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_NAME = 4,
+    VT_COUNT = 6,
+    VT_ERRORS = 8,
+    VT_TOTAL_TIME_NS = 10
+  };
+  const flatbuffers::String *name() const {
+    return GetPointer<const flatbuffers::String *>(VT_NAME);
+  }
+  uint64_t count() const {
+    return GetField<uint64_t>(VT_COUNT, 0);
+  }
+  uint64_t errors() const {
+    return GetField<uint64_t>(VT_ERRORS, 0);
+  }
+  uint64_t total_time_ns() const {
+    return GetField<uint64_t>(VT_TOTAL_TIME_NS, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_NAME) &&
+           verifier.Verify(name()) &&
+           VerifyField<uint64_t>(verifier, VT_COUNT) &&
+           VerifyField<uint64_t>(verifier, VT_ERRORS) &&
+           VerifyField<uint64_t>(verifier, VT_TOTAL_TIME_NS) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbRequestStatsBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_name(flatbuffers::Offset<flatbuffers::String> name) {
+    fbb_.AddOffset(MbRequestStats::VT_NAME, name);
+  }
+  void add_count(uint64_t count) {
+    fbb_.AddElement<uint64_t>(MbRequestStats::VT_COUNT, count, 0);
+  }
+  void add_errors(uint64_t errors) {
+    fbb_.AddElement<uint64_t>(MbRequestStats::VT_ERRORS, errors, 0);
+  }
+  void add_total_time_ns(uint64_t total_time_ns) {
+    fbb_.AddElement<uint64_t>(MbRequestStats::VT_TOTAL_TIME_NS, total_time_ns, 0);
+  }
+  MbRequestStatsBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbRequestStatsBuilder &operator=(const MbRequestStatsBuilder &);
+  flatbuffers::Offset<MbRequestStats> Finish() {
+    const auto end = fbb_.EndTable(start_, 4);
+    auto o = flatbuffers::Offset<MbRequestStats>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbRequestStats> CreateMbRequestStats(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::String> name = 0,
+    uint64_t count = 0,
+    uint64_t errors = 0,
+    uint64_t total_time_ns = 0) {
+  MbRequestStatsBuilder builder_(_fbb);
+  builder_.add_total_time_ns(total_time_ns);
+  builder_.add_errors(errors);
+  builder_.add_count(count);
+  builder_.add_name(name);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<MbRequestStats> CreateMbRequestStatsDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const char *name = nullptr,
+    uint64_t count = 0,
+    uint64_t errors = 0,
+    uint64_t total_time_ns = 0) {
+  return mbtool::daemon::v3::CreateMbRequestStats(
+      _fbb,
+      name ? _fbb.CreateString(name) : 0,
+      count,
+      errors,
+      total_time_ns);
+}
+
+struct MbCounter FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_NAME = 4,
+    VT_VALUE = 6
+  };
+  const flatbuffers::String *name() const {
+    return GetPointer<const flatbuffers::String *>(VT_NAME);
+  }
+  uint64_t value() const {
+    return GetField<uint64_t>(VT_VALUE, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_NAME) &&
+           verifier.Verify(name()) &&
+           VerifyField<uint64_t>(verifier, VT_VALUE) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbCounterBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_name(flatbuffers::Offset<flatbuffers::String> name) {
+    fbb_.AddOffset(MbCounter::VT_NAME, name);
+  }
+  void add_value(uint64_t value) {
+    fbb_.AddElement<uint64_t>(MbCounter::VT_VALUE, value, 0);
+  }
+  MbCounterBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbCounterBuilder &operator=(const MbCounterBuilder &);
+  flatbuffers::Offset<MbCounter> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<MbCounter>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbCounter> CreateMbCounter(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::String> name = 0,
+    uint64_t value = 0) {
+  MbCounterBuilder builder_(_fbb);
+  builder_.add_value(value);
+  builder_.add_name(name);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<MbCounter> CreateMbCounterDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const char *name = nullptr,
+    uint64_t value = 0) {
+  return mbtool::daemon::v3::CreateMbCounter(
+      _fbb,
+      name ? _fbb.CreateString(name) : 0,
+      value);
+}
+
+struct MbGetDaemonStatsRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbGetDaemonStatsRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  MbGetDaemonStatsRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbGetDaemonStatsRequestBuilder &operator=(const MbGetDaemonStatsRequestBuilder &);
+  flatbuffers::Offset<MbGetDaemonStatsRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 0);
+    auto o = flatbuffers::Offset<MbGetDaemonStatsRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbGetDaemonStatsRequest> CreateMbGetDaemonStatsRequest(
+    flatbuffers::FlatBufferBuilder &_fbb) {
+  MbGetDaemonStatsRequestBuilder builder_(_fbb);
+  return builder_.Finish();
+}
+
+struct MbGetDaemonStatsResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_STATS = 4,
+    VT_COUNTERS = 6
+  };
+  const flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>> *stats() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>> *>(VT_STATS);
+  }
+  const flatbuffers::Vector<flatbuffers::Offset<MbCounter>> *counters() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<MbCounter>> *>(VT_COUNTERS);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_STATS) &&
+           verifier.Verify(stats()) &&
+           verifier.VerifyVectorOfTables(stats()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_COUNTERS) &&
+           verifier.Verify(counters()) &&
+           verifier.VerifyVectorOfTables(counters()) &&
+           verifier.EndTable();
+  }
+};
+
+struct MbGetDaemonStatsResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_stats(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>>> stats) {
+    fbb_.AddOffset(MbGetDaemonStatsResponse::VT_STATS, stats);
+  }
+  void add_counters(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<MbCounter>>> counters) {
+    fbb_.AddOffset(MbGetDaemonStatsResponse::VT_COUNTERS, counters);
+  }
+  MbGetDaemonStatsResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  MbGetDaemonStatsResponseBuilder &operator=(const MbGetDaemonStatsResponseBuilder &);
+  flatbuffers::Offset<MbGetDaemonStatsResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<MbGetDaemonStatsResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<MbGetDaemonStatsResponse> CreateMbGetDaemonStatsResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<MbRequestStats>>> stats = 0,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<MbCounter>>> counters = 0) {
+  MbGetDaemonStatsResponseBuilder builder_(_fbb);
+  builder_.add_counters(counters);
+  builder_.add_stats(stats);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<MbGetDaemonStatsResponse> CreateMbGetDaemonStatsResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<flatbuffers::Offset<MbRequestStats>> *stats = nullptr,
+    const std::vector<flatbuffers::Offset<MbCounter>> *counters = nullptr) {
+  return mbtool::daemon::v3::CreateMbGetDaemonStatsResponse(
+      _fbb,
+      stats ? _fbb.CreateVector<flatbuffers::Offset<MbRequestStats>>(*stats) : 0,
+      counters ? _fbb.CreateVector<flatbuffers::Offset<MbCounter>>(*counters) : 0);
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_MBGETDAEMONSTATS_MBTOOL_DAEMON_V3_H_
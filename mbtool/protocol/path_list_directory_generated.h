@@ -0,0 +1,384 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+
+#ifndef FLATBUFFERS_GENERATED_PATHLISTDIRECTORY_MBTOOL_DAEMON_V3_H_
+#define FLATBUFFERS_GENERATED_PATHLISTDIRECTORY_MBTOOL_DAEMON_V3_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+#include "file_stat_generated.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v3 {
+
+struct PathListDirectoryError;
+
+struct PathListDirectoryEntry;
+
+struct PathListDirectoryRequest;
+
+struct PathListDirectoryResponse;
+
+struct PathListDirectoryError FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ERRNO_VALUE = 4,
+    VT_MSG = 6
+  };
+  int32_t errno_value() const {
+    return GetField<int32_t>(VT_ERRNO_VALUE, 0);
+  }
+  const flatbuffers::String *msg() const {
+    return GetPointer<const flatbuffers::String *>(VT_MSG);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int32_t>(verifier, VT_ERRNO_VALUE) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_MSG) &&
+           verifier.Verify(msg()) &&
+           verifier.EndTable();
+  }
+};
+
+struct PathListDirectoryErrorBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_errno_value(int32_t errno_value) {
+    fbb_.AddElement<int32_t>(PathListDirectoryError::VT_ERRNO_VALUE, errno_value, 0);
+  }
+  void add_msg(flatbuffers::Offset<flatbuffers::String> msg) {
+    fbb_.AddOffset(PathListDirectoryError::VT_MSG, msg);
+  }
+  PathListDirectoryErrorBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  PathListDirectoryErrorBuilder &operator=(const PathListDirectoryErrorBuilder &);
+  flatbuffers::Offset<PathListDirectoryError> Finish() {
+    const auto end = fbb_.EndTable(start_, 2);
+    auto o = flatbuffers::Offset<PathListDirectoryError>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<PathListDirectoryError> CreatePathListDirectoryError(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    flatbuffers::Offset<flatbuffers::String> msg = 0) {
+  PathListDirectoryErrorBuilder builder_(_fbb);
+  builder_.add_msg(msg);
+  builder_.add_errno_value(errno_value);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<PathListDirectoryError> CreatePathListDirectoryErrorDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    int32_t errno_value = 0,
+    const char *msg = nullptr) {
+  return mbtool::daemon::v3::CreatePathListDirectoryError(
+      _fbb,
+      errno_value,
+      msg ? _fbb.CreateString(msg) : 0);
+}
+
+struct PathListDirectoryEntry FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_NAME = 4,
+    VT_TYPE = 6,
+    VT_STAT = 8,
+    VT_SYMLINK_TARGET = 10,
+    VT_SELINUX_LABEL = 12
+  };
+  const flatbuffers::String *name() const {
+    return GetPointer<const flatbuffers::String *>(VT_NAME);
+  }
+  uint32_t type() const {
+    return GetField<uint32_t>(VT_TYPE, 0);
+  }
+  const mbtool::daemon::v3::StructStat *stat() const {
+    return GetPointer<const mbtool::daemon::v3::StructStat *>(VT_STAT);
+  }
+  const flatbuffers::String *symlink_target() const {
+    return GetPointer<const flatbuffers::String *>(VT_SYMLINK_TARGET);
+  }
+  const flatbuffers::String *selinux_label() const {
+    return GetPointer<const flatbuffers::String *>(VT_SELINUX_LABEL);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_NAME) &&
+           verifier.Verify(name()) &&
+           VerifyField<uint32_t>(verifier, VT_TYPE) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_STAT) &&
+           verifier.VerifyTable(stat()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_SYMLINK_TARGET) &&
+           verifier.Verify(symlink_target()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_SELINUX_LABEL) &&
+           verifier.Verify(selinux_label()) &&
+           verifier.EndTable();
+  }
+};
+
+struct PathListDirectoryEntryBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_name(flatbuffers::Offset<flatbuffers::String> name) {
+    fbb_.AddOffset(PathListDirectoryEntry::VT_NAME, name);
+  }
+  void add_type(uint32_t type) {
+    fbb_.AddElement<uint32_t>(PathListDirectoryEntry::VT_TYPE, type, 0);
+  }
+  void add_stat(flatbuffers::Offset<mbtool::daemon::v3::StructStat> stat) {
+    fbb_.AddOffset(PathListDirectoryEntry::VT_STAT, stat);
+  }
+  void add_symlink_target(flatbuffers::Offset<flatbuffers::String> symlink_target) {
+    fbb_.AddOffset(PathListDirectoryEntry::VT_SYMLINK_TARGET, symlink_target);
+  }
+  void add_selinux_label(flatbuffers::Offset<flatbuffers::String> selinux_label) {
+    fbb_.AddOffset(PathListDirectoryEntry::VT_SELINUX_LABEL, selinux_label);
+  }
+  PathListDirectoryEntryBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  PathListDirectoryEntryBuilder &operator=(const PathListDirectoryEntryBuilder &);
+  flatbuffers::Offset<PathListDirectoryEntry> Finish() {
+    const auto end = fbb_.EndTable(start_, 5);
+    auto o = flatbuffers::Offset<PathListDirectoryEntry>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<PathListDirectoryEntry> CreatePathListDirectoryEntry(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::String> name = 0,
+    uint32_t type = 0,
+    flatbuffers::Offset<mbtool::daemon::v3::StructStat> stat = 0,
+    flatbuffers::Offset<flatbuffers::String> symlink_target = 0,
+    flatbuffers::Offset<flatbuffers::String> selinux_label = 0) {
+  PathListDirectoryEntryBuilder builder_(_fbb);
+  builder_.add_selinux_label(selinux_label);
+  builder_.add_symlink_target(symlink_target);
+  builder_.add_stat(stat);
+  builder_.add_type(type);
+  builder_.add_name(name);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<PathListDirectoryEntry> CreatePathListDirectoryEntryDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const char *name = nullptr,
+    uint32_t type = 0,
+    flatbuffers::Offset<mbtool::daemon::v3::StructStat> stat = 0,
+    const char *symlink_target = nullptr,
+    const char *selinux_label = nullptr) {
+  return mbtool::daemon::v3::CreatePathListDirectoryEntry(
+      _fbb,
+      name ? _fbb.CreateString(name) : 0,
+      type,
+      stat,
+      symlink_target ? _fbb.CreateString(symlink_target) : 0,
+      selinux_label ? _fbb.CreateString(selinux_label) : 0);
+}
+
+struct PathListDirectoryRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_PATH = 4,
+    VT_STAT = 6,
+    VT_SYMLINK_TARGET = 8,
+    VT_SELINUX_LABEL = 10,
+    VT_COOKIE = 12,
+    VT_MAX_ENTRIES = 14
+  };
+  const flatbuffers::String *path() const {
+    return GetPointer<const flatbuffers::String *>(VT_PATH);
+  }
+  bool stat() const {
+    return GetField<uint8_t>(VT_STAT, 0) != 0;
+  }
+  bool symlink_target() const {
+    return GetField<uint8_t>(VT_SYMLINK_TARGET, 0) != 0;
+  }
+  bool selinux_label() const {
+    return GetField<uint8_t>(VT_SELINUX_LABEL, 0) != 0;
+  }
+  uint64_t cookie() const {
+    return GetField<uint64_t>(VT_COOKIE, 0);
+  }
+  uint32_t max_entries() const {
+    return GetField<uint32_t>(VT_MAX_ENTRIES, 0);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_PATH) &&
+           verifier.Verify(path()) &&
+           VerifyField<uint8_t>(verifier, VT_STAT) &&
+           VerifyField<uint8_t>(verifier, VT_SYMLINK_TARGET) &&
+           VerifyField<uint8_t>(verifier, VT_SELINUX_LABEL) &&
+           VerifyField<uint64_t>(verifier, VT_COOKIE) &&
+           VerifyField<uint32_t>(verifier, VT_MAX_ENTRIES) &&
+           verifier.EndTable();
+  }
+};
+
+struct PathListDirectoryRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_path(flatbuffers::Offset<flatbuffers::String> path) {
+    fbb_.AddOffset(PathListDirectoryRequest::VT_PATH, path);
+  }
+  void add_stat(bool stat) {
+    fbb_.AddElement<uint8_t>(PathListDirectoryRequest::VT_STAT, static_cast<uint8_t>(stat), 0);
+  }
+  void add_symlink_target(bool symlink_target) {
+    fbb_.AddElement<uint8_t>(PathListDirectoryRequest::VT_SYMLINK_TARGET, static_cast<uint8_t>(symlink_target), 0);
+  }
+  void add_selinux_label(bool selinux_label) {
+    fbb_.AddElement<uint8_t>(PathListDirectoryRequest::VT_SELINUX_LABEL, static_cast<uint8_t>(selinux_label), 0);
+  }
+  void add_cookie(uint64_t cookie) {
+    fbb_.AddElement<uint64_t>(PathListDirectoryRequest::VT_COOKIE, cookie, 0);
+  }
+  void add_max_entries(uint32_t max_entries) {
+    fbb_.AddElement<uint32_t>(PathListDirectoryRequest::VT_MAX_ENTRIES, max_entries, 0);
+  }
+  PathListDirectoryRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  PathListDirectoryRequestBuilder &operator=(const PathListDirectoryRequestBuilder &);
+  flatbuffers::Offset<PathListDirectoryRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 6);
+    auto o = flatbuffers::Offset<PathListDirectoryRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<PathListDirectoryRequest> CreatePathListDirectoryRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::String> path = 0,
+    bool stat = false,
+    bool symlink_target = false,
+    bool selinux_label = false,
+    uint64_t cookie = 0,
+    uint32_t max_entries = 0) {
+  PathListDirectoryRequestBuilder builder_(_fbb);
+  builder_.add_cookie(cookie);
+  builder_.add_max_entries(max_entries);
+  builder_.add_path(path);
+  builder_.add_selinux_label(selinux_label);
+  builder_.add_symlink_target(symlink_target);
+  builder_.add_stat(stat);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<PathListDirectoryRequest> CreatePathListDirectoryRequestDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const char *path = nullptr,
+    bool stat = false,
+    bool symlink_target = false,
+    bool selinux_label = false,
+    uint64_t cookie = 0,
+    uint32_t max_entries = 0) {
+  return mbtool::daemon::v3::CreatePathListDirectoryRequest(
+      _fbb,
+      path ? _fbb.CreateString(path) : 0,
+      stat,
+      symlink_target,
+      selinux_label,
+      cookie,
+      max_entries);
+}
+
+struct PathListDirectoryResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_ENTRIES = 4,
+    VT_MORE = 6,
+    VT_COOKIE = 8,
+    VT_ERROR = 10
+  };
+  const flatbuffers::Vector<flatbuffers::Offset<PathListDirectoryEntry>> *entries() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<PathListDirectoryEntry>> *>(VT_ENTRIES);
+  }
+  bool more() const {
+    return GetField<uint8_t>(VT_MORE, 0) != 0;
+  }
+  uint64_t cookie() const {
+    return GetField<uint64_t>(VT_COOKIE, 0);
+  }
+  const PathListDirectoryError *error() const {
+    return GetPointer<const PathListDirectoryError *>(VT_ERROR);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ENTRIES) &&
+           verifier.Verify(entries()) &&
+           verifier.VerifyVectorOfTables(entries()) &&
+           VerifyField<uint8_t>(verifier, VT_MORE) &&
+           VerifyField<uint64_t>(verifier, VT_COOKIE) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
+           verifier.VerifyTable(error()) &&
+           verifier.EndTable();
+  }
+};
+
+struct PathListDirectoryResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_entries(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<PathListDirectoryEntry>>> entries) {
+    fbb_.AddOffset(PathListDirectoryResponse::VT_ENTRIES, entries);
+  }
+  void add_more(bool more) {
+    fbb_.AddElement<uint8_t>(PathListDirectoryResponse::VT_MORE, static_cast<uint8_t>(more), 0);
+  }
+  void add_cookie(uint64_t cookie) {
+    fbb_.AddElement<uint64_t>(PathListDirectoryResponse::VT_COOKIE, cookie, 0);
+  }
+  void add_error(flatbuffers::Offset<PathListDirectoryError> error) {
+    fbb_.AddOffset(PathListDirectoryResponse::VT_ERROR, error);
+  }
+  PathListDirectoryResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  PathListDirectoryResponseBuilder &operator=(const PathListDirectoryResponseBuilder &);
+  flatbuffers::Offset<PathListDirectoryResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 4);
+    auto o = flatbuffers::Offset<PathListDirectoryResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<PathListDirectoryResponse> CreatePathListDirectoryResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<PathListDirectoryEntry>>> entries = 0,
+    bool more = false,
+    uint64_t cookie = 0,
+    flatbuffers::Offset<PathListDirectoryError> error = 0) {
+  PathListDirectoryResponseBuilder builder_(_fbb);
+  builder_.add_cookie(cookie);
+  builder_.add_error(error);
+  builder_.add_entries(entries);
+  builder_.add_more(more);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<PathListDirectoryResponse> CreatePathListDirectoryResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<flatbuffers::Offset<PathListDirectoryEntry>> *entries = nullptr,
+    bool more = false,
+    uint64_t cookie = 0,
+    flatbuffers::Offset<PathListDirectoryError> error = 0) {
+  return mbtool::daemon::v3::CreatePathListDirectoryResponse(
+      _fbb,
+      entries ? _fbb.CreateVector<flatbuffers::Offset<PathListDirectoryEntry>>(*entries) : 0,
+      more,
+      cookie,
+      error);
+}
+
+}  // namespace v3
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_PATHLISTDIRECTORY_MBTOOL_DAEMON_V3_H_
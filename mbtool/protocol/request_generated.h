@@ -16,8 +16,12 @@
 #include "file_selinux_get_label_generated.h"
 #include "file_selinux_set_label_generated.h"
 #include "file_stat_generated.h"
+#include "file_stream_read_generated.h"
+#include "file_stream_write_generated.h"
 #include "file_write_generated.h"
+#include "job_generated.h"
 #include "mb_get_booted_rom_id_generated.h"
+#include "mb_get_daemon_stats_generated.h"
 #include "mb_get_installed_roms_generated.h"
 #include "mb_get_packages_count_generated.h"
 #include "mb_get_version_generated.h"
@@ -28,6 +32,7 @@
 #include "path_copy_generated.h"
 #include "path_delete_generated.h"
 #include "path_get_directory_size_generated.h"
+#include "path_list_directory_generated.h"
 #include "path_mkdir_generated.h"
 #include "path_readlink_generated.h"
 #include "path_selinux_get_label_generated.h"
@@ -42,6 +47,8 @@ namespace v3 {
 
 struct Request;
 
+struct BatchRequest;
+
 enum RequestType {
   RequestType_NONE = 0,
   RequestType_FileChmodRequest = 1,
@@ -73,8 +80,17 @@ enum RequestType {
   RequestType_CryptoDecryptRequest = 27,
   RequestType_CryptoGetPwTypeRequest = 28,
   RequestType_PathReadlinkRequest = 29,
+  RequestType_BatchRequest = 30,
+  RequestType_MbGetDaemonStatsRequest = 31,
+  RequestType_FileStreamReadRequest = 32,
+  RequestType_FileStreamWriteRequest = 33,
+  RequestType_JobStartRequest = 34,
+  RequestType_JobStatusRequest = 35,
+  RequestType_JobSubscribeRequest = 36,
+  RequestType_JobCancelRequest = 37,
+  RequestType_PathListDirectoryRequest = 38,
   RequestType_MIN = RequestType_NONE,
-  RequestType_MAX = RequestType_PathReadlinkRequest
+  RequestType_MAX = RequestType_PathListDirectoryRequest
 };
 
 inline const char **EnumNamesRequestType() {
@@ -109,6 +125,15 @@ inline const char **EnumNamesRequestType() {
     "CryptoDecryptRequest",
     "CryptoGetPwTypeRequest",
     "PathReadlinkRequest",
+    "BatchRequest",
+    "MbGetDaemonStatsRequest",
+    "FileStreamReadRequest",
+    "FileStreamWriteRequest",
+    "JobStartRequest",
+    "JobStatusRequest",
+    "JobSubscribeRequest",
+    "JobCancelRequest",
+    "PathListDirectoryRequest",
     nullptr
   };
   return names;
@@ -239,6 +264,42 @@ template<> struct RequestTypeTraits<mbtool::daemon::v3::PathReadlinkRequest> {
   static const RequestType enum_value = RequestType_PathReadlinkRequest;
 };
 
+template<> struct RequestTypeTraits<BatchRequest> {
+  static const RequestType enum_value = RequestType_BatchRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::MbGetDaemonStatsRequest> {
+  static const RequestType enum_value = RequestType_MbGetDaemonStatsRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::FileStreamReadRequest> {
+  static const RequestType enum_value = RequestType_FileStreamReadRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::FileStreamWriteRequest> {
+  static const RequestType enum_value = RequestType_FileStreamWriteRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::JobStartRequest> {
+  static const RequestType enum_value = RequestType_JobStartRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::JobStatusRequest> {
+  static const RequestType enum_value = RequestType_JobStatusRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::JobSubscribeRequest> {
+  static const RequestType enum_value = RequestType_JobSubscribeRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::JobCancelRequest> {
+  static const RequestType enum_value = RequestType_JobCancelRequest;
+};
+
+template<> struct RequestTypeTraits<mbtool::daemon::v3::PathListDirectoryRequest> {
+  static const RequestType enum_value = RequestType_PathListDirectoryRequest;
+};
+
 bool VerifyRequestType(flatbuffers::Verifier &verifier, const void *obj, RequestType type);
 bool VerifyRequestTypeVector(flatbuffers::Verifier &verifier, const flatbuffers::Vector<flatbuffers::Offset<void>> *values, const flatbuffers::Vector<uint8_t> *types);
 
@@ -293,6 +354,56 @@ inline flatbuffers::Offset<Request> CreateRequest(
   return builder_.Finish();
 }
 
+struct BatchRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_REQUESTS = 4
+  };
+  const flatbuffers::Vector<flatbuffers::Offset<Request>> *requests() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<Request>> *>(VT_REQUESTS);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_REQUESTS) &&
+           verifier.Verify(requests()) &&
+           verifier.VerifyVectorOfTables(requests()) &&
+           verifier.EndTable();
+  }
+};
+
+struct BatchRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_requests(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<Request>>> requests) {
+    fbb_.AddOffset(BatchRequest::VT_REQUESTS, requests);
+  }
+  BatchRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  BatchRequestBuilder &operator=(const BatchRequestBuilder &);
+  flatbuffers::Offset<BatchRequest> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<BatchRequest>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<BatchRequest> CreateBatchRequest(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<Request>>> requests = 0) {
+  BatchRequestBuilder builder_(_fbb);
+  builder_.add_requests(requests);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<BatchRequest> CreateBatchRequestDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<flatbuffers::Offset<Request>> *requests = nullptr) {
+  return mbtool::daemon::v3::CreateBatchRequest(
+      _fbb,
+      requests ? _fbb.CreateVector<flatbuffers::Offset<Request>>(*requests) : 0);
+}
+
 inline bool VerifyRequestType(flatbuffers::Verifier &verifier, const void *obj, RequestType type) {
   switch (type) {
     case RequestType_NONE: {
@@ -414,6 +525,42 @@ inline bool VerifyRequestType(flatbuffers::Verifier &verifier, const void *obj,
       auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathReadlinkRequest *>(obj);
       return verifier.VerifyTable(ptr);
     }
+    case RequestType_BatchRequest: {
+      auto ptr = reinterpret_cast<const BatchRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_MbGetDaemonStatsRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::MbGetDaemonStatsRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_FileStreamReadRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::FileStreamReadRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_FileStreamWriteRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::FileStreamWriteRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_JobStartRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::JobStartRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_JobStatusRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::JobStatusRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_JobSubscribeRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::JobSubscribeRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_JobCancelRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::JobCancelRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case RequestType_PathListDirectoryRequest: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathListDirectoryRequest *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
     default: return false;
   }
 }
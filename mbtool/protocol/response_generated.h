@@ -16,8 +16,12 @@
 #include "file_selinux_get_label_generated.h"
 #include "file_selinux_set_label_generated.h"
 #include "file_stat_generated.h"
+#include "file_stream_read_generated.h"
+#include "file_stream_write_generated.h"
 #include "file_write_generated.h"
+#include "job_generated.h"
 #include "mb_get_booted_rom_id_generated.h"
+#include "mb_get_daemon_stats_generated.h"
 #include "mb_get_installed_roms_generated.h"
 #include "mb_get_packages_count_generated.h"
 #include "mb_get_version_generated.h"
@@ -28,6 +32,7 @@
 #include "path_copy_generated.h"
 #include "path_delete_generated.h"
 #include "path_get_directory_size_generated.h"
+#include "path_list_directory_generated.h"
 #include "path_mkdir_generated.h"
 #include "path_readlink_generated.h"
 #include "path_selinux_get_label_generated.h"
@@ -46,6 +51,10 @@ struct Unsupported;
 
 struct Response;
 
+struct BatchResponseEntry;
+
+struct BatchResponse;
+
 enum ResponseType {
   ResponseType_NONE = 0,
   ResponseType_Invalid = 1,
@@ -80,8 +89,18 @@ enum ResponseType {
   ResponseType_CryptoDecryptResponse = 30,
   ResponseType_CryptoGetPwTypeResponse = 31,
   ResponseType_PathReadlinkResponse = 32,
+  ResponseType_BatchResponse = 33,
+  ResponseType_MbGetDaemonStatsResponse = 34,
+  ResponseType_FileStreamReadResponse = 35,
+  ResponseType_FileStreamWriteResponse = 36,
+  ResponseType_JobStartResponse = 37,
+  ResponseType_JobStatusResponse = 38,
+  ResponseType_JobEventResponse = 39,
+  ResponseType_JobSubscribeResponse = 40,
+  ResponseType_JobCancelResponse = 41,
+  ResponseType_PathListDirectoryResponse = 42,
   ResponseType_MIN = ResponseType_NONE,
-  ResponseType_MAX = ResponseType_PathReadlinkResponse
+  ResponseType_MAX = ResponseType_PathListDirectoryResponse
 };
 
 inline const char **EnumNamesResponseType() {
@@ -119,6 +138,16 @@ inline const char **EnumNamesResponseType() {
     "CryptoDecryptResponse",
     "CryptoGetPwTypeResponse",
     "PathReadlinkResponse",
+    "BatchResponse",
+    "MbGetDaemonStatsResponse",
+    "FileStreamReadResponse",
+    "FileStreamWriteResponse",
+    "JobStartResponse",
+    "JobStatusResponse",
+    "JobEventResponse",
+    "JobSubscribeResponse",
+    "JobCancelResponse",
+    "PathListDirectoryResponse",
     nullptr
   };
   return names;
@@ -261,6 +290,46 @@ template<> struct ResponseTypeTraits<mbtool::daemon::v3::PathReadlinkResponse> {
   static const ResponseType enum_value = ResponseType_PathReadlinkResponse;
 };
 
+template<> struct ResponseTypeTraits<BatchResponse> {
+  static const ResponseType enum_value = ResponseType_BatchResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::MbGetDaemonStatsResponse> {
+  static const ResponseType enum_value = ResponseType_MbGetDaemonStatsResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::FileStreamReadResponse> {
+  static const ResponseType enum_value = ResponseType_FileStreamReadResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::FileStreamWriteResponse> {
+  static const ResponseType enum_value = ResponseType_FileStreamWriteResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::JobStartResponse> {
+  static const ResponseType enum_value = ResponseType_JobStartResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::JobStatusResponse> {
+  static const ResponseType enum_value = ResponseType_JobStatusResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::JobEventResponse> {
+  static const ResponseType enum_value = ResponseType_JobEventResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::JobSubscribeResponse> {
+  static const ResponseType enum_value = ResponseType_JobSubscribeResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::JobCancelResponse> {
+  static const ResponseType enum_value = ResponseType_JobCancelResponse;
+};
+
+template<> struct ResponseTypeTraits<mbtool::daemon::v3::PathListDirectoryResponse> {
+  static const ResponseType enum_value = ResponseType_PathListDirectoryResponse;
+};
+
 bool VerifyResponseType(flatbuffers::Verifier &verifier, const void *obj, ResponseType type);
 bool VerifyResponseTypeVector(flatbuffers::Verifier &verifier, const flatbuffers::Vector<flatbuffers::Offset<void>> *values, const flatbuffers::Vector<uint8_t> *types);
 
@@ -371,6 +440,109 @@ inline flatbuffers::Offset<Response> CreateResponse(
   return builder_.Finish();
 }
 
+struct BatchResponseEntry FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_RESPONSE = 4
+  };
+  const flatbuffers::Vector<uint8_t> *response() const {
+    return GetPointer<const flatbuffers::Vector<uint8_t> *>(VT_RESPONSE);
+  }
+  const mbtool::daemon::v3::Response *response_nested_root() const {
+    const uint8_t* data = response()->Data();
+    return flatbuffers::GetRoot<mbtool::daemon::v3::Response>(data);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_RESPONSE) &&
+           verifier.Verify(response()) &&
+           verifier.EndTable();
+  }
+};
+
+struct BatchResponseEntryBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_response(flatbuffers::Offset<flatbuffers::Vector<uint8_t>> response) {
+    fbb_.AddOffset(BatchResponseEntry::VT_RESPONSE, response);
+  }
+  BatchResponseEntryBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  BatchResponseEntryBuilder &operator=(const BatchResponseEntryBuilder &);
+  flatbuffers::Offset<BatchResponseEntry> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<BatchResponseEntry>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<BatchResponseEntry> CreateBatchResponseEntry(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<uint8_t>> response = 0) {
+  BatchResponseEntryBuilder builder_(_fbb);
+  builder_.add_response(response);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<BatchResponseEntry> CreateBatchResponseEntryDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<uint8_t> *response = nullptr) {
+  return mbtool::daemon::v3::CreateBatchResponseEntry(
+      _fbb,
+      response ? _fbb.CreateVector<uint8_t>(*response) : 0);
+}
+
+struct BatchResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  enum {
+    VT_RESPONSES = 4
+  };
+  const flatbuffers::Vector<flatbuffers::Offset<BatchResponseEntry>> *responses() const {
+    return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<BatchResponseEntry>> *>(VT_RESPONSES);
+  }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, VT_RESPONSES) &&
+           verifier.Verify(responses()) &&
+           verifier.VerifyVectorOfTables(responses()) &&
+           verifier.EndTable();
+  }
+};
+
+struct BatchResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_responses(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<BatchResponseEntry>>> responses) {
+    fbb_.AddOffset(BatchResponse::VT_RESPONSES, responses);
+  }
+  BatchResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb)
+        : fbb_(_fbb) {
+    start_ = fbb_.StartTable();
+  }
+  BatchResponseBuilder &operator=(const BatchResponseBuilder &);
+  flatbuffers::Offset<BatchResponse> Finish() {
+    const auto end = fbb_.EndTable(start_, 1);
+    auto o = flatbuffers::Offset<BatchResponse>(end);
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<BatchResponse> CreateBatchResponse(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<BatchResponseEntry>>> responses = 0) {
+  BatchResponseBuilder builder_(_fbb);
+  builder_.add_responses(responses);
+  return builder_.Finish();
+}
+
+inline flatbuffers::Offset<BatchResponse> CreateBatchResponseDirect(
+    flatbuffers::FlatBufferBuilder &_fbb,
+    const std::vector<flatbuffers::Offset<BatchResponseEntry>> *responses = nullptr) {
+  return mbtool::daemon::v3::CreateBatchResponse(
+      _fbb,
+      responses ? _fbb.CreateVector<flatbuffers::Offset<BatchResponseEntry>>(*responses) : 0);
+}
+
 inline bool VerifyResponseType(flatbuffers::Verifier &verifier, const void *obj, ResponseType type) {
   switch (type) {
     case ResponseType_NONE: {
@@ -504,6 +676,46 @@ inline bool VerifyResponseType(flatbuffers::Verifier &verifier, const void *obj,
       auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathReadlinkResponse *>(obj);
       return verifier.VerifyTable(ptr);
     }
+    case ResponseType_BatchResponse: {
+      auto ptr = reinterpret_cast<const BatchResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_MbGetDaemonStatsResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::MbGetDaemonStatsResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_FileStreamReadResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::FileStreamReadResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_FileStreamWriteResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::FileStreamWriteResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_JobStartResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::JobStartResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_JobStatusResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::JobStatusResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_JobEventResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::JobEventResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_JobSubscribeResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::JobSubscribeResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_JobCancelResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::JobCancelResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
+    case ResponseType_PathListDirectoryResponse: {
+      auto ptr = reinterpret_cast<const mbtool::daemon::v3::PathListDirectoryResponse *>(obj);
+      return verifier.VerifyTable(ptr);
+    }
     default: return false;
   }
 }
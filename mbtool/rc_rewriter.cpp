@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "rc_rewriter.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mbcommon/string.h"
+#include "mblog/logging.h"
+#include "mbutil/autoclose/dir.h"
+#include "mbutil/autoclose/file.h"
+#include "mbutil/finally.h"
+#include "mbutil/string.h"
+
+namespace mb
+{
+
+static bool is_section_start(const std::vector<std::string> &tokens)
+{
+    return !tokens.empty() && (tokens[0] == "on" || tokens[0] == "service"
+            || tokens[0] == "import");
+}
+
+static RcLine parse_line(std::string text, long section)
+{
+    RcLine line;
+    line.text = std::move(text);
+
+    size_t start = line.text.find_first_not_of(" \t\r\n");
+    if (start != std::string::npos && line.text[start] != '#') {
+        line.tokens = util::tokenize(line.text, " \t\r\n");
+    }
+
+    line.section = section;
+    return line;
+}
+
+static bool load_rc_file(const std::string &path, RcFile &file)
+{
+    autoclose::file fp(autoclose::fopen(path.c_str(), "rbe"));
+    if (!fp) {
+        LOGE("%s: Failed to open for reading: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    char *buf = nullptr;
+    size_t len = 0;
+    ssize_t n;
+
+    auto free_buf = util::finally([&] {
+        free(buf);
+    });
+
+    file.path = path;
+    file.lines.clear();
+    file.changed = false;
+
+    long section = -1;
+
+    while ((n = getline(&buf, &len, fp.get())) >= 0) {
+        RcLine line = parse_line(std::string(buf, static_cast<size_t>(n)),
+                                 section);
+        if (is_section_start(line.tokens)) {
+            section = static_cast<long>(file.lines.size());
+            line.section = section;
+        }
+
+        file.lines.push_back(std::move(line));
+    }
+
+    if (ferror(fp.get())) {
+        LOGE("%s: Failed to read: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool write_rc_file(const RcFile &file)
+{
+    struct stat sb;
+    if (stat(file.path.c_str(), &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", file.path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string new_path(file.path);
+    new_path += ".new";
+
+    autoclose::file fp(autoclose::fopen(new_path.c_str(), "wbe"));
+    if (!fp) {
+        LOGE("%s: Failed to open for writing: %s",
+             new_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    for (auto const &line : file.lines) {
+        if (fwrite(line.text.data(), 1, line.text.size(), fp.get())
+                != line.text.size()) {
+            LOGE("%s: Failed to write: %s", new_path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    // Keep the original ownership and permissions
+    if (fchown(fileno(fp.get()), sb.st_uid, sb.st_gid) < 0
+            || fchmod(fileno(fp.get()), sb.st_mode & 0777) < 0) {
+        LOGE("%s: Failed to set ownership or permissions: %s",
+             new_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fclose(fp.release()) != 0) {
+        LOGE("%s: Failed to close: %s", new_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (rename(new_path.c_str(), file.path.c_str()) < 0) {
+        LOGE("Failed to rename %s to %s: %s",
+             new_path.c_str(), file.path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Check whether any line contains \p str
+ */
+bool RcFile::contains(const char *str) const
+{
+    for (auto const &line : lines) {
+        if (line.text.find(str) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!
+ * \brief Insert a line before the line at \p index
+ *
+ * \param index Position of the new line (may be equal to the number of lines)
+ * \param text Contents of the new line. A newline is appended if missing.
+ */
+void RcFile::insert(size_t index, std::string text)
+{
+    if (text.empty() || text.back() != '\n') {
+        text += '\n';
+    }
+
+    // The new line continues whichever section the previous line is in
+    long section = index > 0 ? lines[index - 1].section : -1;
+    RcLine line = parse_line(std::move(text), section);
+
+    for (auto &l : lines) {
+        if (l.section >= static_cast<long>(index)) {
+            ++l.section;
+        }
+    }
+
+    if (is_section_start(line.tokens)) {
+        line.section = static_cast<long>(index);
+    }
+
+    lines.insert(lines.begin() + static_cast<long>(index), std::move(line));
+    changed = true;
+}
+
+/*!
+ * \brief Comment out the line at \p index
+ */
+void RcFile::comment_out(size_t index)
+{
+    RcLine &line = lines[index];
+
+    line.text.insert(line.text.begin(), '#');
+    line.tokens.clear();
+    changed = true;
+}
+
+/*!
+ * \brief Register a rewrite that applies to every rc file
+ */
+void RcRewriter::add(RewriteFn fn)
+{
+    _rewrites.push_back({{}, std::move(fn)});
+}
+
+/*!
+ * \brief Register a rewrite that only applies to the rc file at \p path
+ */
+void RcRewriter::add(std::string path, RewriteFn fn)
+{
+    _rewrites.push_back({std::move(path), std::move(fn)});
+}
+
+/*!
+ * \brief Apply the registered rewrites to every `*.rc` file in \p dir
+ *
+ * A file that fails to load or write is skipped and the remaining files are
+ * still processed.
+ *
+ * \return Whether every file was successfully processed
+ */
+bool RcRewriter::run(const std::string &dir)
+{
+    autoclose::dir dp(autoclose::opendir(dir.c_str()));
+    if (!dp) {
+        // Nothing to rewrite
+        return errno == ENOENT;
+    }
+
+    bool ret = true;
+    struct dirent *ent;
+    RcFile file;
+
+    while ((ent = readdir(dp.get()))) {
+        if (!mb::ends_with(ent->d_name, ".rc")) {
+            continue;
+        }
+
+        std::string path(dir);
+        if (path.empty() || path.back() != '/') {
+            path += '/';
+        }
+        path += ent->d_name;
+
+        if (!load_rc_file(path, file)) {
+            ret = false;
+            continue;
+        }
+
+        for (auto const &rewrite : _rewrites) {
+            if (rewrite.path.empty() || rewrite.path == path) {
+                rewrite.fn(file);
+            }
+        }
+
+        if (file.changed && !write_rc_file(file)) {
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+
+namespace mb
+{
+
+struct RcLine
+{
+    // Raw line, including the trailing newline if there was one
+    std::string text;
+    // Whitespace-separated words. Empty for blank lines and comments.
+    std::vector<std::string> tokens;
+    // Index of the line that starts the enclosing section ("on", "service" or
+    // "import") or -1 if the line is not inside a section
+    long section;
+};
+
+struct RcFile
+{
+    std::string path;
+    std::vector<RcLine> lines;
+    bool changed;
+
+    bool contains(const char *str) const;
+
+    void insert(size_t index, std::string text);
+    void comment_out(size_t index);
+};
+
+/*!
+ * \brief Applies a set of edits to the init rc files in a directory
+ *
+ * Each rc file is read and tokenized once. Every registered rewrite is then
+ * run against the parsed lines and only the files that any of them changed
+ * are written back.
+ */
+class RcRewriter
+{
+public:
+    typedef std::function<void(RcFile &file)> RewriteFn;
+
+    void add(RewriteFn fn);
+    void add(std::string path, RewriteFn fn);
+
+    bool run(const std::string &dir);
+
+private:
+    struct Rewrite
+    {
+        // Only apply to this file if non-empty
+        std::string path;
+        RewriteFn fn;
+    };
+
+    std::vector<Rewrite> _rewrites;
+};
+
+}
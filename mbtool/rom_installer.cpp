@@ -19,6 +19,9 @@
 
 #include "rom_installer.h"
 
+#include <cerrno>
+#include <cstring>
+
 #include <fcntl.h>
 #include <getopt.h>
 #include <signal.h>
@@ -44,8 +47,6 @@
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
 
-#include "archive_util.h"
-#include "bootimg_util.h"
 #include "installer.h"
 #include "multiboot.h"
 
@@ -53,6 +54,9 @@
 #define DEBUG_LEAVE_STDIN_OPEN 0
 #define DEBUG_ENABLE_PASSTHROUGH 0
 
+// Report updater progress in increments of this many percent
+#define PROGRESS_STEP 10
+
 
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
 
@@ -68,6 +72,7 @@ public:
     virtual void display_msg(const std::string& msg) override;
     virtual void updater_print(const std::string &msg) override;
     virtual void command_output(const std::string &line) override;
+    virtual void updater_progress(double fraction) override;
     virtual std::string get_install_type() override;
     virtual std::unordered_map<std::string, std::string> get_properties() override;
     virtual ProceedState on_checked_device() override;
@@ -78,6 +83,7 @@ public:
 private:
     std::string _rom_id;
     std::FILE *_log_fp;
+    int _last_progress;
 
     std::string _ld_library_path;
     std::string _ld_preload;
@@ -86,8 +92,9 @@ private:
 
     static bool extract_ramdisk(const std::string &boot_image_file,
                                 const std::string &output_dir, bool nested);
-    static bool extract_ramdisk_fd(int fd, const std::string &output_dir,
-                                   bool nested);
+    static bool extract_ramdisk_archive(archive *in,
+                                        const std::string &output_dir,
+                                        bool nested);
 };
 
 
@@ -101,7 +108,8 @@ RomInstaller::RomInstaller(std::string zip_file, std::string rom_id,
 #endif
              flags),
     _rom_id(std::move(rom_id)),
-    _log_fp(log_fp)
+    _log_fp(log_fp),
+    _last_progress(-1)
 {
 }
 
@@ -124,6 +132,18 @@ void RomInstaller::command_output(const std::string &line)
     fflush(_log_fp);
 }
 
+void RomInstaller::updater_progress(double fraction)
+{
+    // Only report whole steps to avoid flooding the output
+    int percent = static_cast<int>(fraction * 100);
+    int step = percent - percent % PROGRESS_STEP;
+
+    if (step != _last_progress) {
+        _last_progress = step;
+        display_msg(mb::format("Progress: %d%%", step));
+    }
+}
+
 std::string RomInstaller::get_install_type()
 {
     return _rom_id;
@@ -162,6 +182,13 @@ std::unordered_map<std::string, std::string> RomInstaller::get_properties()
 
 Installer::ProceedState RomInstaller::on_checked_device()
 {
+    // The recovery ramdisk was already extracted into a reused chroot
+    if (_reused_chroot) {
+        util::property_file_get_all(
+                in_chroot("/default.recovery.prop"), _recovery_props);
+        return ProceedState::Continue;
+    }
+
     // /sbin is not going to be populated with anything useful in a normal boot
     // image. We can almost guarantee that a recovery image is going to be
     // installed though, so we'll open the recovery partition with libmbpatcher
@@ -279,6 +306,82 @@ void RomInstaller::on_cleanup(Installer::ProceedState ret)
                 "internal storage.");
 }
 
+struct RamdiskReadCtx
+{
+    MbBiReader *bir;
+    bool view_unsupported;
+    char buf[10240];
+};
+
+// Feeds the ramdisk entry of a boot image to libarchive
+static la_ssize_t la_ramdisk_read_cb(archive *a, void *userdata,
+                                     const void **buffer)
+{
+    (void) a;
+    RamdiskReadCtx *ctx = static_cast<RamdiskReadCtx *>(userdata);
+    size_t n;
+    int ret;
+
+    // Hand the entire mapped entry to libarchive if possible
+    if (!ctx->view_unsupported) {
+        ret = mb_bi_reader_read_data_view(ctx->bir, buffer, &n);
+        if (ret == MB_BI_OK) {
+            return static_cast<la_ssize_t>(n);
+        } else if (ret == MB_BI_EOF) {
+            return 0;
+        } else if (ret != MB_BI_UNSUPPORTED) {
+            LOGE("Failed to read ramdisk: %s",
+                 mb_bi_reader_error_string(ctx->bir));
+            return -1;
+        }
+
+        ctx->view_unsupported = true;
+    }
+
+    ret = mb_bi_reader_read_data(ctx->bir, ctx->buf, sizeof(ctx->buf), &n);
+    if (ret == MB_BI_EOF) {
+        return 0;
+    } else if (ret != MB_BI_OK) {
+        LOGE("Failed to read ramdisk: %s",
+             mb_bi_reader_error_string(ctx->bir));
+        return -1;
+    }
+
+    *buffer = ctx->buf;
+    return static_cast<la_ssize_t>(n);
+}
+
+// Feeds the data of the current entry of another archive to libarchive
+static la_ssize_t la_nested_read_cb(archive *a, void *userdata,
+                                    const void **buffer)
+{
+    (void) a;
+    archive *parent = static_cast<archive *>(userdata);
+    size_t size;
+    la_int64_t offset;
+
+    // cpio entries are never sparse, so the offsets can be ignored
+    int ret = archive_read_data_block(parent, buffer, &size, &offset);
+    if (ret == ARCHIVE_EOF) {
+        return 0;
+    } else if (ret != ARCHIVE_OK) {
+        LOGE("Failed to read nested ramdisk: %s",
+             archive_error_string(parent));
+        return -1;
+    }
+
+    return static_cast<la_ssize_t>(size);
+}
+
+static void ramdisk_read_support(archive *a)
+{
+    archive_read_support_filter_gzip(a);
+    archive_read_support_filter_lz4(a);
+    archive_read_support_filter_lzma(a);
+    archive_read_support_filter_xz(a);
+    archive_read_support_format_cpio(a);
+}
+
 bool RomInstaller::extract_ramdisk(const std::string &boot_image_file,
                                    const std::string &output_dir, bool nested)
 {
@@ -325,54 +428,38 @@ bool RomInstaller::extract_ramdisk(const std::string &boot_image_file,
         return false;
     }
 
-    {
-        std::string tmpfile = mb::format("%s.XXXXXX", output_dir.c_str());
-
-        int tmpfd = mkstemp(&tmpfile[0]);
-        if (tmpfd < 0) {
-            LOGE("Failed to create temporary file: %s", strerror(errno));
-            return false;
-        }
+    // Stream the ramdisk straight from the boot image into the cpio reader
+    autoclose::archive in(archive_read_new(), archive_read_free);
+    if (!in) {
+        LOGE("Failed to allocate input archive");
+        return false;
+    }
 
-        // We don't need the path
-        unlink(tmpfile.c_str());
+    RamdiskReadCtx ctx = {};
+    ctx.bir = bir.get();
 
-        auto close_fd = util::finally([&]{
-            close(tmpfd);
-        });
+    ramdisk_read_support(in.get());
 
-        return bi_copy_data_to_fd(bir.get(), tmpfd)
-                && extract_ramdisk_fd(tmpfd, output_dir, nested);
+    if (archive_read_open(in.get(), &ctx, nullptr, &la_ramdisk_read_cb,
+                          nullptr) != ARCHIVE_OK) {
+        LOGE("%s: Failed to open ramdisk: %s",
+             boot_image_file.c_str(), archive_error_string(in.get()));
+        return false;
     }
+
+    return extract_ramdisk_archive(in.get(), output_dir, nested);
 }
 
-bool RomInstaller::extract_ramdisk_fd(int fd, const std::string &output_dir,
-                                      bool nested)
+bool RomInstaller::extract_ramdisk_archive(archive *in,
+                                           const std::string &output_dir,
+                                           bool nested)
 {
-    autoclose::archive in(archive_read_new(), archive_read_free);
     autoclose::archive out(archive_write_disk_new(), archive_write_free);
     archive_entry *entry;
     int ret;
 
-    if (!in || !out) {
-        LOGE("Failed to allocate input or output archive");
-        return false;
-    }
-
-    // Seek to beginning
-    if (lseek(fd, 0, SEEK_SET) < 0) {
-        LOGE("Failed to seek to beginning: %s", strerror(errno));
-        return false;
-    }
-
-    archive_read_support_filter_gzip(in.get());
-    archive_read_support_filter_lz4(in.get());
-    archive_read_support_filter_lzma(in.get());
-    archive_read_support_filter_xz(in.get());
-    archive_read_support_format_cpio(in.get());
-
-    if (archive_read_open_fd(in.get(), fd, 10240) != ARCHIVE_OK) {
-        LOGE("Failed to open archive: %s", archive_error_string(in.get()));
+    if (!out) {
+        LOGE("Failed to allocate output archive");
         return false;
     }
 
@@ -388,7 +475,7 @@ bool RomInstaller::extract_ramdisk_fd(int fd, const std::string &output_dir,
                                    ARCHIVE_EXTRACT_XATTR);
 
 
-    while ((ret = archive_read_next_header(in.get(), &entry)) == ARCHIVE_OK) {
+    while ((ret = archive_read_next_header(in, &entry)) == ARCHIVE_OK) {
         const char *path = archive_entry_pathname(entry);
         if (!path) {
             LOGE("Archive entry has no path");
@@ -397,25 +484,25 @@ bool RomInstaller::extract_ramdisk_fd(int fd, const std::string &output_dir,
 
         if (nested) {
             if (strcmp(path, "sbin/ramdisk.cpio") == 0) {
-                std::string tmpfile = mb::format(
-                        "%s.XXXXXX", output_dir.c_str());
-
-                int tmpfd = mkstemp(&tmpfile[0]);
-                if (tmpfd < 0) {
-                    LOGE("Failed to create temporary file: %s",
-                         strerror(errno));
+                autoclose::archive nested_in(archive_read_new(),
+                                             archive_read_free);
+                if (!nested_in) {
+                    LOGE("Failed to allocate nested input archive");
                     return false;
                 }
 
-                // We don't need the path
-                unlink(tmpfile.c_str());
+                ramdisk_read_support(nested_in.get());
 
-                auto close_fd = util::finally([&]{
-                    close(tmpfd);
-                });
+                if (archive_read_open(nested_in.get(), in, nullptr,
+                                      &la_nested_read_cb, nullptr)
+                        != ARCHIVE_OK) {
+                    LOGE("Failed to open nested ramdisk: %s",
+                         archive_error_string(nested_in.get()));
+                    return false;
+                }
 
-                return la_copy_data_to_fd(in.get(), tmpfd)
-                        && extract_ramdisk_fd(tmpfd, output_dir, false);
+                return extract_ramdisk_archive(nested_in.get(), output_dir,
+                                               false);
             }
         } else {
             if (strcmp(path, "default.prop") == 0) {
@@ -433,7 +520,7 @@ bool RomInstaller::extract_ramdisk_fd(int fd, const std::string &output_dir,
             archive_entry_set_pathname(entry, output_path.c_str());
 
             if (util::libarchive_copy_header_and_data(
-                    in.get(), out.get(), entry) != ARCHIVE_OK) {
+                    in, out.get(), entry) != ARCHIVE_OK) {
                 return false;
             }
 
@@ -442,7 +529,7 @@ bool RomInstaller::extract_ramdisk_fd(int fd, const std::string &output_dir,
     }
 
     if (ret != ARCHIVE_EOF) {
-        LOGE("Failed to read entry: %s", archive_error_string(in.get()));
+        LOGE("Failed to read entry: %s", archive_error_string(in));
         return false;
     }
 
@@ -459,7 +546,9 @@ static void rom_installer_usage(bool error)
     FILE *stream = error ? stderr : stdout;
 
     fprintf(stream,
-            "Usage: rom-installer [zip_file] [-r romid]\n\n"
+            "Usage: rom-installer [zip_file...] [-r romid]\n\n"
+            "Multiple zip files are installed in order in the same chroot\n"
+            "environment. Installation stops at the first failure.\n\n"
             "Options:\n"
             "  -r, --romid        ROM install type/ID (primary, dual, etc.)\n"
             "  -h, --help         Display this help message\n"
@@ -484,7 +573,7 @@ int rom_installer_main(int argc, char *argv[])
     setvbuf(stdout, nullptr, _IONBF, 0);
 
     std::string rom_id;
-    std::string zip_file;
+    std::vector<std::string> zip_files;
     int flags = 0;
     bool allow_overwrite = false;
 
@@ -532,21 +621,23 @@ int rom_installer_main(int argc, char *argv[])
         }
     }
 
-    if (argc - optind != 1) {
+    if (argc - optind < 1) {
         rom_installer_usage(true);
         return EXIT_FAILURE;
     }
 
-    zip_file = argv[optind];
+    zip_files.assign(argv + optind, argv + argc);
 
     if (rom_id.empty()) {
         fprintf(stderr, "-r/--romid must be specified\n");
         return EXIT_FAILURE;
     }
 
-    if (zip_file.empty()) {
-        fprintf(stderr, "Invalid zip file path\n");
-        return EXIT_FAILURE;
+    for (auto const &zip_file : zip_files) {
+        if (zip_file.empty()) {
+            fprintf(stderr, "Invalid zip file path\n");
+            return EXIT_FAILURE;
+        }
     }
 
 
@@ -614,9 +705,24 @@ int rom_installer_main(int argc, char *argv[])
     // mbtool logging
     log::log_set_logger(std::make_shared<log::StdioLogger>(fp.get(), false));
 
-    // Start installing!
-    RomInstaller ri(zip_file, rom_id, fp.get(), flags);
-    return ri.start_installation() ? EXIT_SUCCESS : EXIT_FAILURE;
+    // Start installing! All zips share one chroot, which is only created by
+    // the first installation and destroyed by the last one
+    for (size_t i = 0; i < zip_files.size(); ++i) {
+        int zip_flags = flags;
+        if (i > 0) {
+            zip_flags |= InstallerFlags::INSTALLER_REUSE_CHROOT;
+        }
+        if (i + 1 < zip_files.size()) {
+            zip_flags |= InstallerFlags::INSTALLER_KEEP_CHROOT;
+        }
+
+        RomInstaller ri(zip_files[i], rom_id, fp.get(), zip_flags);
+        if (!ri.start_installation()) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
 }
 
 }
@@ -0,0 +1,493 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rom_inventory.h"
+
+#include <atomic>
+#include <new>
+#include <unordered_set>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/path.h"
+#include "mbutil/process.h"
+#include "mbutil/time.h"
+
+#include "multiboot.h"
+#include "rom_metadata.h"
+#include "roms.h"
+#include "serialize.h"
+
+// Size of the shared snapshot, including the header
+#define INVENTORY_SIZE                  (64 * 1024)
+// Time between the first change and the rescan, so bursts are coalesced
+#define REFRESH_DELAY_MS                200
+
+#define WATCH_MASK \
+    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF \
+    | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO \
+    | IN_DONT_FOLLOW | IN_ONLYDIR)
+
+namespace mb
+{
+
+/*!
+ * \brief Header of the snapshot shared by the daemon's processes
+ *
+ * The snapshot is only written by the inventory process. `seq` is odd while it
+ * is being written, so readers retry if it changes while they copy the data.
+ */
+struct InventoryHeader
+{
+    std::atomic<uint32_t> seq;
+    // Incremented whenever the installed ROMs may have changed
+    std::atomic<uint32_t> changes;
+    // Value of `changes` when the snapshot was taken
+    std::atomic<uint32_t> snapshot_changes;
+    // Size of the serialized snapshot (0 if there is none)
+    std::atomic<uint32_t> size;
+    std::atomic<uint32_t> version;
+};
+
+#define SNAPSHOT_MAX_SIZE       (INVENTORY_SIZE - sizeof(InventoryHeader))
+
+static InventoryHeader *header = nullptr;
+// Write end of the pipe used to wake up the inventory process
+static int notify_fd = -1;
+
+// Inventory process
+static int inotify_fd = -1;
+static std::unordered_set<int> watches;
+
+static inline char * snapshot_data()
+{
+    return reinterpret_cast<char *>(header + 1);
+}
+
+static std::string serialize(const std::vector<InstalledRom> &roms)
+{
+    std::string buf;
+
+    put_u32(&buf, roms.size());
+    for (const InstalledRom &rom : roms) {
+        put_string(&buf, rom.id);
+        put_string(&buf, rom.system_path);
+        put_string(&buf, rom.cache_path);
+        put_string(&buf, rom.data_path);
+        put_u32(&buf, rom.has_version);
+        put_string(&buf, rom.version);
+        put_u32(&buf, rom.has_build);
+        put_string(&buf, rom.build);
+    }
+
+    return buf;
+}
+
+static bool deserialize(const std::string &buf, std::vector<InstalledRom> *roms)
+{
+    const char *ptr = buf.data();
+    const char *end = ptr + buf.size();
+    uint32_t count;
+    uint32_t has_version;
+    uint32_t has_build;
+
+    if (!get_u32(&ptr, end, &count)) {
+        return false;
+    }
+
+    roms->clear();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        InstalledRom rom;
+
+        if (!get_string(&ptr, end, &rom.id)
+                || !get_string(&ptr, end, &rom.system_path)
+                || !get_string(&ptr, end, &rom.cache_path)
+                || !get_string(&ptr, end, &rom.data_path)
+                || !get_u32(&ptr, end, &has_version)
+                || !get_string(&ptr, end, &rom.version)
+                || !get_u32(&ptr, end, &has_build)
+                || !get_string(&ptr, end, &rom.build)) {
+            return false;
+        }
+
+        rom.has_version = has_version;
+        rom.has_build = has_build;
+        roms->push_back(std::move(rom));
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Find the installed ROMs and get their build.prop metadata
+ *
+ * \param[out] roms Installed ROMs
+ * \param[out] watch_dirs If not null, directories whose contents determine
+ *                        whether a ROM is installed
+ */
+static void scan_roms(std::vector<InstalledRom> *roms,
+                      std::vector<std::string> *watch_dirs)
+{
+    Roms all_roms;
+    all_roms.add_all();
+
+    if (watch_dirs) {
+        watch_dirs->push_back(get_raw_path("/data/multiboot"));
+        watch_dirs->push_back(get_raw_path(MULTIBOOT_DIR));
+
+        std::string extsd = Roms::get_extsd_partition();
+        if (!extsd.empty()) {
+            watch_dirs->push_back(extsd + "/multiboot");
+        }
+    }
+
+    std::vector<std::shared_ptr<Rom>> installed;
+
+    for (auto const &r : all_roms.roms) {
+        if (watch_dirs) {
+            std::string system_path = r->full_system_path();
+
+            watch_dirs->push_back(util::dir_name(r->boot_image_path()));
+            watch_dirs->push_back(rom_build_prop_dir(r));
+            if (r->system_is_image && !system_path.empty()) {
+                watch_dirs->push_back(util::dir_name(system_path));
+            }
+        }
+
+        if (Roms::is_installed(r)) {
+            installed.push_back(r);
+        }
+    }
+
+    // build.prop files are only parsed if they changed since the last scan
+    std::vector<RomMetadata> metadata;
+    rom_metadata_get_all(installed, metadata);
+
+    for (size_t i = 0; i < installed.size(); ++i) {
+        auto const &r = installed[i];
+
+        InstalledRom rom;
+        rom.id = r->id;
+        rom.system_path = r->full_system_path();
+        rom.cache_path = r->full_cache_path();
+        rom.data_path = r->full_data_path();
+        rom.has_version = metadata[i].has_version;
+        rom.version = std::move(metadata[i].version);
+        rom.has_build = metadata[i].has_build;
+        rom.build = std::move(metadata[i].build);
+
+        roms->push_back(std::move(rom));
+    }
+}
+
+/*!
+ * \brief Watch the given directories and stop watching everything else
+ *
+ * Directories that don't exist yet are watched through their nearest existing
+ * ancestor.
+ *
+ * \return Whether any new watches were added. If so, something may have
+ *         changed before the watch existed.
+ */
+static bool update_watches(const std::vector<std::string> &dirs)
+{
+    std::unordered_set<int> new_watches;
+    bool added = false;
+
+    for (std::string dir : dirs) {
+        while (!dir.empty()) {
+            int wd = inotify_add_watch(inotify_fd, dir.c_str(), WATCH_MASK);
+            if (wd >= 0) {
+                new_watches.insert(wd);
+                added = added || watches.find(wd) == watches.end();
+                break;
+            } else if (errno != ENOENT && errno != ENOTDIR) {
+                LOGW("%s: Failed to watch directory: %s",
+                     dir.c_str(), strerror(errno));
+                break;
+            } else if (dir == "/") {
+                break;
+            }
+
+            dir = util::dir_name(dir);
+        }
+    }
+
+    for (int wd : watches) {
+        if (new_watches.find(wd) == new_watches.end()) {
+            inotify_rm_watch(inotify_fd, wd);
+        }
+    }
+
+    watches.swap(new_watches);
+    return added;
+}
+
+static void publish(const std::vector<InstalledRom> &roms, uint32_t changes)
+{
+    std::string buf = serialize(roms);
+    if (buf.size() > SNAPSHOT_MAX_SIZE) {
+        LOGW("ROM inventory is too large to share (%zu bytes)", buf.size());
+        buf.clear();
+    }
+
+    uint32_t seq = header->seq.load(std::memory_order_relaxed);
+    header->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    memcpy(snapshot_data(), buf.data(), buf.size());
+    header->size.store(buf.size(), std::memory_order_relaxed);
+    header->snapshot_changes.store(changes, std::memory_order_relaxed);
+    header->version.fetch_add(1, std::memory_order_relaxed);
+
+    header->seq.store(seq + 2, std::memory_order_release);
+}
+
+/*!
+ * \brief Rescan ROMs and publish a new snapshot
+ *
+ * \return Whether another rescan is needed
+ */
+static bool refresh()
+{
+    // Changes made during the scan will invalidate the snapshot
+    uint32_t changes = header->changes.load();
+
+    std::vector<InstalledRom> roms;
+    std::vector<std::string> dirs;
+
+    scan_roms(&roms, &dirs);
+    bool added = update_watches(dirs);
+    publish(roms, changes);
+
+    return added;
+}
+
+static bool inventory_main(int wake_fd)
+{
+    if (!util::set_process_title_v(nullptr, "mbtool rom inventory")) {
+        LOGE("Failed to set process title: %s", strerror(errno));
+        return false;
+    }
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        LOGE("Failed to initialize inotify: %s", strerror(errno));
+        return false;
+    }
+
+    // Changes to the mount table are reported as POLLPRI
+    int mounts_fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+    if (mounts_fd < 0) {
+        LOGE("/proc/self/mounts: Failed to open: %s", strerror(errno));
+        return false;
+    }
+
+    bool pending = true;
+    uint64_t deadline = 0;
+    char buf[4096];
+
+    while (true) {
+        uint64_t now = util::monotonic_time_ns() / 1000000;
+
+        if (pending && now >= deadline) {
+            pending = refresh();
+            deadline = now + REFRESH_DELAY_MS;
+            continue;
+        }
+
+        struct pollfd pfds[3] = {
+            { wake_fd, POLLIN, 0 },
+            { inotify_fd, POLLIN, 0 },
+            { mounts_fd, POLLPRI, 0 },
+        };
+
+        if (poll(pfds, 3, pending ? deadline - now : -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Failed to poll: %s", strerror(errno));
+            return false;
+        }
+
+        bool changed = false;
+
+        if (pfds[0].revents) {
+            ssize_t n = read(wake_fd, buf, sizeof(buf));
+            if (n == 0) {
+                // The daemon and all of its connections have exited
+                return true;
+            }
+            changed = n > 0;
+        }
+        if (pfds[1].revents) {
+            // The events themselves don't matter since everything is rescanned
+            while (read(inotify_fd, buf, sizeof(buf)) > 0) {
+            }
+            changed = true;
+        }
+        if (pfds[2].revents & (POLLPRI | POLLERR)) {
+            changed = true;
+        }
+
+        if (changed) {
+            header->changes.fetch_add(1);
+            if (!pending) {
+                pending = true;
+                deadline = now + REFRESH_DELAY_MS;
+            }
+        }
+    }
+}
+
+static bool read_snapshot(std::vector<InstalledRom> *roms)
+{
+    if (!header) {
+        return false;
+    }
+
+    std::string buf;
+
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        uint32_t seq = header->seq.load(std::memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+
+        uint32_t size = header->size.load(std::memory_order_relaxed);
+        bool valid = size > 0 && size <= SNAPSHOT_MAX_SIZE
+                && header->snapshot_changes.load(std::memory_order_relaxed)
+                        == header->changes.load(std::memory_order_relaxed);
+        if (valid) {
+            buf.assign(snapshot_data(), size);
+        }
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header->seq.load(std::memory_order_relaxed) != seq) {
+            continue;
+        }
+
+        return valid && deserialize(buf, roms);
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Fork the ROM inventory process
+ *
+ * The inventory process scans the installed ROMs, watches the multiboot
+ * directories, ROM directories and the mount table, and rescans shortly after
+ * any of them change. Each scan is published as a new snapshot in shared
+ * memory for rom_inventory_get().
+ *
+ * The inventory process exits once the daemon and all of its connections are
+ * gone.
+ *
+ * \param listen_fd Daemon socket, which is closed in the inventory process
+ */
+bool rom_inventory_start(int listen_fd)
+{
+    void *ptr = mmap(nullptr, INVENTORY_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        LOGE("Failed to map ROM inventory: %s", strerror(errno));
+        return false;
+    }
+
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        LOGE("Failed to create pipe: %s", strerror(errno));
+        munmap(ptr, INVENTORY_SIZE);
+        return false;
+    }
+
+    // Waking up the inventory process must never block a connection
+    if (fcntl(pipe_fds[1], F_SETFL, O_NONBLOCK) < 0) {
+        LOGE("Failed to set pipe as non-blocking: %s", strerror(errno));
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        munmap(ptr, INVENTORY_SIZE);
+        return false;
+    }
+
+    header = new (ptr) InventoryHeader();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOGE("Failed to fork: %s", strerror(errno));
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        munmap(ptr, INVENTORY_SIZE);
+        header = nullptr;
+        return false;
+    } else if (pid == 0) {
+        close(listen_fd);
+        close(pipe_fds[1]);
+        _exit(inventory_main(pipe_fds[0]) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(pipe_fds[0]);
+
+    notify_fd = pipe_fds[1];
+    return true;
+}
+
+/*!
+ * \brief Mark the current snapshot as outdated
+ *
+ * This should be called after the daemon itself changes a ROM so that the next
+ * rom_inventory_get() doesn't depend on how quickly the change is noticed.
+ */
+void rom_inventory_invalidate()
+{
+    if (header) {
+        header->changes.fetch_add(1);
+    }
+    if (notify_fd >= 0) {
+        ssize_t n = write(notify_fd, "", 1);
+        (void) n;
+    }
+}
+
+/*!
+ * \brief Get the installed ROMs
+ *
+ * The latest snapshot is used if nothing changed since it was taken.
+ * Otherwise, the ROMs are scanned directly.
+ */
+void rom_inventory_get(std::vector<InstalledRom> *roms)
+{
+    if (!read_snapshot(roms)) {
+        roms->clear();
+        scan_roms(roms, nullptr);
+    }
+}
+
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace mb
+{
+
+struct InstalledRom
+{
+    std::string id;
+    std::string system_path;
+    std::string cache_path;
+    std::string data_path;
+    bool has_version;
+    std::string version;
+    bool has_build;
+    std::string build;
+};
+
+bool rom_inventory_start(int listen_fd);
+void rom_inventory_invalidate();
+void rom_inventory_get(std::vector<InstalledRom> *roms);
+
+}
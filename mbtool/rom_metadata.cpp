@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rom_metadata.h"
+
+#include <unordered_map>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/file.h"
+#include "mbutil/properties.h"
+
+#include "serialize.h"
+
+#define ROM_METADATA_CACHE_PATH     "/data/multiboot/rom-metadata.cache"
+#define ROM_METADATA_MAGIC          0x4154454du // "META"
+#define ROM_METADATA_VERSION        1u
+
+namespace mb
+{
+
+/*!
+ * \brief Identity of a metadata source file
+ *
+ * A cache entry is only used if all of its source files still have the same
+ * stamps.
+ */
+struct FileStamp
+{
+    bool exists;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+
+    bool operator==(const FileStamp &other) const
+    {
+        return exists == other.exists
+                && ino == other.ino
+                && size == other.size
+                && mtime_sec == other.mtime_sec
+                && mtime_nsec == other.mtime_nsec;
+    }
+};
+
+struct CacheEntry
+{
+    FileStamp config;
+    FileStamp build_prop;
+    FileStamp thumbnail;
+    RomMetadata metadata;
+};
+
+struct SourcePaths
+{
+    std::string config;
+    std::string build_prop;
+    std::string thumbnail;
+};
+
+static FileStamp get_file_stamp(const std::string &path)
+{
+    FileStamp stamp = {};
+    struct stat sb;
+
+    if (stat(path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
+        stamp.exists = true;
+        stamp.ino = sb.st_ino;
+        stamp.size = static_cast<uint64_t>(sb.st_size);
+        stamp.mtime_sec = static_cast<uint64_t>(sb.st_mtim.tv_sec);
+        stamp.mtime_nsec = static_cast<uint64_t>(sb.st_mtim.tv_nsec);
+    }
+
+    return stamp;
+}
+
+static void put_file_stamp(std::string *buf, const FileStamp &stamp)
+{
+    put_u32(buf, stamp.exists);
+    put_u64(buf, stamp.ino);
+    put_u64(buf, stamp.size);
+    put_u64(buf, stamp.mtime_sec);
+    put_u64(buf, stamp.mtime_nsec);
+}
+
+static bool get_file_stamp(const char **ptr, const char *end,
+                           FileStamp *stamp)
+{
+    uint32_t exists;
+
+    if (!get_u32(ptr, end, &exists)
+            || !get_u64(ptr, end, &stamp->ino)
+            || !get_u64(ptr, end, &stamp->size)
+            || !get_u64(ptr, end, &stamp->mtime_sec)
+            || !get_u64(ptr, end, &stamp->mtime_nsec)) {
+        return false;
+    }
+
+    stamp->exists = exists;
+    return true;
+}
+
+static void put_metadata(std::string *buf, const RomMetadata &metadata)
+{
+    put_u32(buf, metadata.has_config);
+    put_string(buf, metadata.config.id);
+    put_string(buf, metadata.config.name);
+    put_u32(buf, metadata.config.indiv_app_sharing);
+    put_u32(buf, static_cast<uint32_t>(metadata.config.shared_pkgs.size()));
+    for (auto const &pkg : metadata.config.shared_pkgs) {
+        put_string(buf, pkg.pkg_id);
+        put_u32(buf, pkg.share_data);
+    }
+    put_u32(buf, metadata.has_version);
+    put_string(buf, metadata.version);
+    put_u32(buf, metadata.has_build);
+    put_string(buf, metadata.build);
+    put_u32(buf, metadata.has_thumbnail);
+}
+
+static bool get_metadata(const char **ptr, const char *end,
+                         RomMetadata *metadata)
+{
+    uint32_t has_config;
+    uint32_t indiv_app_sharing;
+    uint32_t pkgs_count;
+    uint32_t has_version;
+    uint32_t has_build;
+    uint32_t has_thumbnail;
+
+    if (!get_u32(ptr, end, &has_config)
+            || !get_string(ptr, end, &metadata->config.id)
+            || !get_string(ptr, end, &metadata->config.name)
+            || !get_u32(ptr, end, &indiv_app_sharing)
+            || !get_u32(ptr, end, &pkgs_count)) {
+        return false;
+    }
+
+    metadata->config.shared_pkgs.clear();
+
+    for (uint32_t i = 0; i < pkgs_count; ++i) {
+        SharedPackage pkg;
+        uint32_t share_data;
+
+        if (!get_string(ptr, end, &pkg.pkg_id)
+                || !get_u32(ptr, end, &share_data)) {
+            return false;
+        }
+
+        pkg.share_data = share_data;
+        metadata->config.shared_pkgs.push_back(std::move(pkg));
+    }
+
+    if (!get_u32(ptr, end, &has_version)
+            || !get_string(ptr, end, &metadata->version)
+            || !get_u32(ptr, end, &has_build)
+            || !get_string(ptr, end, &metadata->build)
+            || !get_u32(ptr, end, &has_thumbnail)) {
+        return false;
+    }
+
+    metadata->has_config = has_config;
+    metadata->config.indiv_app_sharing = indiv_app_sharing;
+    metadata->has_version = has_version;
+    metadata->has_build = has_build;
+    metadata->has_thumbnail = has_thumbnail;
+    return true;
+}
+
+static bool load_cache(const std::string &path,
+                       std::unordered_map<std::string, CacheEntry> *entries)
+{
+    std::vector<unsigned char> data;
+
+    if (!util::file_read_all(path, &data)) {
+        if (errno != ENOENT) {
+            LOGW("%s: Failed to read: %s", path.c_str(), strerror(errno));
+        }
+        return false;
+    }
+
+    const char *ptr = reinterpret_cast<const char *>(data.data());
+    const char *end = ptr + data.size();
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+
+    if (!get_u32(&ptr, end, &magic) || magic != ROM_METADATA_MAGIC
+            || !get_u32(&ptr, end, &version)
+            || version != ROM_METADATA_VERSION
+            || !get_u32(&ptr, end, &count)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string id;
+        CacheEntry entry;
+
+        if (!get_string(&ptr, end, &id)
+                || !get_file_stamp(&ptr, end, &entry.config)
+                || !get_file_stamp(&ptr, end, &entry.build_prop)
+                || !get_file_stamp(&ptr, end, &entry.thumbnail)
+                || !get_metadata(&ptr, end, &entry.metadata)) {
+            LOGW("%s: Ignoring corrupt cache", path.c_str());
+            entries->clear();
+            return false;
+        }
+
+        (*entries)[std::move(id)] = std::move(entry);
+    }
+
+    return true;
+}
+
+static bool save_cache(const std::string &path,
+                       const std::unordered_map<std::string, CacheEntry> &entries)
+{
+    std::string buf;
+
+    put_u32(&buf, ROM_METADATA_MAGIC);
+    put_u32(&buf, ROM_METADATA_VERSION);
+    put_u32(&buf, static_cast<uint32_t>(entries.size()));
+
+    for (auto const &item : entries) {
+        put_string(&buf, item.first);
+        put_file_stamp(&buf, item.second.config);
+        put_file_stamp(&buf, item.second.build_prop);
+        put_file_stamp(&buf, item.second.thumbnail);
+        put_metadata(&buf, item.second.metadata);
+    }
+
+    // Other processes may be reading the cache, so replace it atomically
+    std::string temp_path(path);
+    temp_path += ".tmp";
+
+    if (!util::file_write_data(temp_path, buf.data(), buf.size())) {
+        LOGW("%s: Failed to write: %s", temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (rename(temp_path.c_str(), path.c_str()) < 0) {
+        LOGW("%s: Failed to rename to %s: %s",
+             temp_path.c_str(), path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static void read_metadata(const SourcePaths &paths, CacheEntry *entry)
+{
+    RomMetadata *metadata = &entry->metadata;
+    *metadata = RomMetadata();
+
+    if (entry->config.exists) {
+        metadata->has_config = metadata->config.load_file(paths.config);
+        if (!metadata->has_config) {
+            metadata->config = RomConfig();
+        }
+    }
+
+    if (entry->build_prop.exists) {
+        std::unordered_map<std::string, std::string> properties;
+        util::property_file_get_all(paths.build_prop, properties);
+
+        auto it = properties.find("ro.build.version.release");
+        metadata->has_version = it != properties.end();
+        if (metadata->has_version) {
+            metadata->version = it->second;
+        }
+
+        it = properties.find("ro.build.display.id");
+        metadata->has_build = it != properties.end();
+        if (metadata->has_build) {
+            metadata->build = it->second;
+        }
+    }
+
+    metadata->has_thumbnail = entry->thumbnail.exists;
+}
+
+/*!
+ * \brief Get directory containing the build.prop file of a ROM
+ *
+ * For ROMs whose /system is an image, this is where the image is mounted.
+ */
+std::string rom_build_prop_dir(const std::shared_ptr<Rom> &rom)
+{
+    if (rom->system_is_image) {
+        std::string dir("/raw/images/");
+        dir += rom->id;
+        return dir;
+    } else {
+        return rom->full_system_path();
+    }
+}
+
+/*!
+ * \brief Get metadata of a single ROM
+ *
+ * \sa rom_metadata_get_all()
+ */
+void rom_metadata_get(const std::shared_ptr<Rom> &rom, RomMetadata &metadata)
+{
+    std::vector<RomMetadata> result;
+    rom_metadata_get_all({ rom }, result);
+    metadata = std::move(result[0]);
+}
+
+/*!
+ * \brief Get the config, version, build ID, and thumbnail presence of ROMs
+ *
+ * The metadata is read from a cache in ROM_METADATA_CACHE_PATH. ROMs whose
+ * config.json, build.prop, or thumbnail have changed since they were cached are
+ * parsed again and the cache is updated. Failing to read or write the cache is
+ * not an error.
+ *
+ * \param roms ROMs to get the metadata of
+ * \param[out] metadata Metadata of each ROM in \p roms (in the same order)
+ */
+void rom_metadata_get_all(const std::vector<std::shared_ptr<Rom>> &roms,
+                          std::vector<RomMetadata> &metadata)
+{
+    std::string cache_path = get_raw_path(ROM_METADATA_CACHE_PATH);
+    std::unordered_map<std::string, CacheEntry> entries;
+    bool dirty = false;
+
+    load_cache(cache_path, &entries);
+
+    metadata.clear();
+    metadata.reserve(roms.size());
+
+    for (auto const &rom : roms) {
+        SourcePaths paths;
+        paths.config = rom->config_path();
+        paths.build_prop = rom_build_prop_dir(rom) + "/build.prop";
+        paths.thumbnail = rom->thumbnail_path();
+
+        CacheEntry entry;
+        entry.config = get_file_stamp(paths.config);
+        entry.build_prop = get_file_stamp(paths.build_prop);
+        entry.thumbnail = get_file_stamp(paths.thumbnail);
+
+        auto it = entries.find(rom->id);
+        if (it != entries.end()
+                && it->second.config == entry.config
+                && it->second.build_prop == entry.build_prop
+                && it->second.thumbnail == entry.thumbnail) {
+            metadata.push_back(it->second.metadata);
+            continue;
+        }
+
+        read_metadata(paths, &entry);
+        metadata.push_back(entry.metadata);
+
+        if (entry.config.exists || entry.build_prop.exists
+                || entry.thumbnail.exists) {
+            entries[rom->id] = std::move(entry);
+            dirty = true;
+        } else if (it != entries.end()) {
+            // Don't keep entries for ROMs that are no longer installed
+            entries.erase(it);
+            dirty = true;
+        }
+    }
+
+    if (dirty) {
+        save_cache(cache_path, entries);
+    }
+}
+
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "romconfig.h"
+#include "roms.h"
+
+namespace mb
+{
+
+struct RomMetadata
+{
+    // config.json
+    bool has_config = false;
+    RomConfig config;
+    // ro.build.version.release
+    bool has_version = false;
+    std::string version;
+    // ro.build.display.id
+    bool has_build = false;
+    std::string build;
+    // thumbnail.webp
+    bool has_thumbnail = false;
+};
+
+std::string rom_build_prop_dir(const std::shared_ptr<Rom> &rom);
+
+void rom_metadata_get(const std::shared_ptr<Rom> &rom, RomMetadata &metadata);
+void rom_metadata_get_all(const std::vector<std::shared_ptr<Rom>> &roms,
+                          std::vector<RomMetadata> &metadata);
+
+}
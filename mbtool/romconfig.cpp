@@ -28,6 +28,8 @@
 #define CONFIG_KEY_NAME                    "name"
 #define CONFIG_KEY_APP_SHARING             "app_sharing"
 #define CONFIG_KEY_INDIVIDUAL_APP_SHARING  "individual"
+#define CONFIG_KEY_SHARED_APKS             "shared_apks"
+#define CONFIG_KEY_SHARED_OAT              "shared_oat"
 #define CONFIG_KEY_PACKAGES                "packages"
 #define CONFIG_KEY_PACKAGE_ID              "pkg_id"
 #define CONFIG_KEY_SHARE_DATA              "share_data"
@@ -41,7 +43,9 @@ namespace mb {
  *     "id": "primary",
  *     "name": "TouchWiz 5.0",
  *     "app_sharing": {
- *         "individual": true
+ *         "individual": true,
+ *         "shared_apks": true,
+ *         "shared_oat": true,
  *         "packages": [
  *             {
  *                 "pkg_id": "com.android.chrome",
@@ -113,6 +117,28 @@ bool RomConfig::load_file(const std::string &path)
             indiv_app_sharing = json_is_true(j_individual);
         }
 
+        // Shared APK store
+        json_t *j_shared_apks = json_object_get(
+                j_app_sharing, CONFIG_KEY_SHARED_APKS);
+        if (j_shared_apks) {
+            if (!json_is_boolean(j_shared_apks)) {
+                LOGE("[root]->app_sharing->shared_apks: Not a boolean");
+                return false;
+            }
+            shared_apks = json_is_true(j_shared_apks);
+        }
+
+        // Shared oat cache (requires the shared APK store)
+        json_t *j_shared_oat = json_object_get(
+                j_app_sharing, CONFIG_KEY_SHARED_OAT);
+        if (j_shared_oat) {
+            if (!json_is_boolean(j_shared_oat)) {
+                LOGE("[root]->app_sharing->shared_oat: Not a boolean");
+                return false;
+            }
+            shared_oat = json_is_true(j_shared_oat);
+        }
+
         // Shared packages
         json_t *j_pkgs = json_object_get(j_app_sharing, CONFIG_KEY_PACKAGES);
         if (j_pkgs) {
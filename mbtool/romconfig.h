@@ -36,6 +36,8 @@ struct RomConfig
     std::string id;
     std::string name;
     bool indiv_app_sharing = false;
+    bool shared_apks = false;
+    bool shared_oat = false;
     std::vector<SharedPackage> shared_pkgs;
 
     bool load_file(const std::string &path);
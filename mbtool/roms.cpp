@@ -39,7 +39,7 @@
 
 #define BUILD_PROP "build.prop"
 
-static std::vector<std::string> extsd_mount_points{
+static const char * const extsd_mount_points[] = {
     "/raw/extsd",
     "/external_sd",
     "/external_sdcard",
@@ -288,35 +288,45 @@ void Roms::add_extsd_roms()
     std::move(temp_roms.begin(), temp_roms.end(), std::back_inserter(roms));
 }
 
-void Roms::add_installed()
+/*!
+ * \brief Add all ROM slots, whether or not a ROM is installed in them
+ */
+void Roms::add_all()
 {
-    Roms all_roms;
-    all_roms.add_builtin();
-    all_roms.add_data_roms();
-    all_roms.add_extsd_roms();
+    add_builtin();
+    add_data_roms();
+    add_extsd_roms();
+}
 
+bool Roms::is_installed(const std::shared_ptr<Rom> &rom)
+{
+    std::string boot_path = get_raw_path(rom->boot_image_path());
+    std::string system_path = rom->full_system_path();
     struct stat sb;
 
-    for (auto rom : all_roms.roms) {
-        std::string boot_path = get_raw_path(rom->boot_image_path());
-        std::string system_path = rom->full_system_path();
+    if (stat(boot_path.c_str(), &sb) == 0) {
+        // If boot image exists, assume that the ROM is installed
+        return true;
+    } else if (rom->system_is_image) {
+        // If /system is on an ext4 image, check if the image exists
+        return stat(system_path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode);
+    } else {
+        // If /system is bind-mounted, check if build.prop exists
+        std::string build_prop(system_path);
+        build_prop += "/build.prop";
 
-        if (stat(boot_path.c_str(), &sb) == 0) {
-            // If boot image exists, assume that the ROM is installed
-            roms.push_back(rom);
-        } else if (rom->system_is_image) {
-            // If /system is on an ext4 image, check if the image exists
-            if (stat(system_path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
-                roms.push_back(rom);
-            }
-        } else {
-            // If /system is bind-mounted, check if build.prop exists
-            std::string build_prop(system_path);
-            build_prop += "/build.prop";
+        return stat(build_prop.c_str(), &sb) == 0 && S_ISREG(sb.st_mode);
+    }
+}
 
-            if (stat(build_prop.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
-                roms.push_back(rom);
-            }
+void Roms::add_installed()
+{
+    Roms all_roms;
+    all_roms.add_all();
+
+    for (auto rom : all_roms.roms) {
+        if (is_installed(rom)) {
+            roms.push_back(rom);
         }
     }
 }
@@ -473,8 +483,8 @@ std::string Roms::get_extsd_partition()
 {
     // Try hard-coded mount points first
     struct stat sb;
-    for (const std::string &mount_point : extsd_mount_points) {
-        if (stat(mount_point.c_str(), &sb) == 0) {
+    for (const char *mount_point : extsd_mount_points) {
+        if (stat(mount_point, &sb) == 0) {
             if (util::is_mounted(mount_point)) {
                 return mount_point;
             }
@@ -77,8 +77,11 @@ private:
     void add_data_roms();
     void add_extsd_roms();
 public:
+    void add_all();
     void add_installed();
 
+    static bool is_installed(const std::shared_ptr<Rom> &rom);
+
     std::shared_ptr<Rom> find_by_id(const std::string &id) const;
 
     static std::shared_ptr<Rom> get_current_rom();
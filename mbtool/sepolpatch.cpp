@@ -24,6 +24,7 @@
 #include <climits>
 #include <cstdio>
 
+#include <dirent.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <sys/mman.h>
@@ -39,13 +40,28 @@
 #undef bool
 
 #include "mbcommon/common.h"
+#include "mbcommon/string.h"
 #include "mblog/logging.h"
+#include "mbutil/autoclose/dir.h"
 #include "mbutil/autoclose/file.h"
+#include "mbutil/counters.h"
+#include "mbutil/directory.h"
+#include "mbutil/file.h"
 #include "mbutil/finally.h"
+#include "mbutil/hash.h"
 #include "mbutil/selinux.h"
 #include "mbutil/string.h"
+#include "mbutil/trace.h"
 
 #include "multiboot.h"
+#include "roms.h"
+
+// Patched policies are cached in this directory, keyed by the source policy
+#define SEPOLICY_CACHE_DIR          "/data/multiboot/sepolicy-cache"
+
+// Increment this whenever the patches applied by selinux_apply_patch() change
+// so that policies patched by an older version are not used
+#define SEPOLICY_CACHE_VERSION      1
 
 
 extern "C" int policydb_index_decls(policydb_t *p);
@@ -54,23 +70,23 @@ namespace mb
 {
 
 /*!
- * Add or remove rule.
+ * Add or remove permissions from an allow rule.
  *
  * \param pdb Policy DB object
  * \param source_type_val Source type for rule
  * \param target_type_val Target type for rule
  * \param class_val Class for rule
- * \param perm_val Permission for rule
- * \param remove Whether to remove the rule
+ * \param perms Bitmask of permissions for rule
+ * \param remove Whether to remove the permissions
  *
  * \return Whether a change was made
  */
-SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
-                                         uint16_t source_type_val,
-                                         uint16_t target_type_val,
-                                         uint16_t class_val,
-                                         uint32_t perm_val,
-                                         bool remove)
+SELinuxResult selinux_raw_set_allow_perms(policydb_t *pdb,
+                                          uint16_t source_type_val,
+                                          uint16_t target_type_val,
+                                          uint16_t class_val,
+                                          uint32_t perms,
+                                          bool remove)
 {
     avtab_datum_t *av;
     avtab_key_t key;
@@ -82,11 +98,11 @@ SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
     av = avtab_search(&pdb->te_avtab, &key);
 
     if (!av) {
-        if (remove) {
+        if (remove || perms == 0) {
             return SELinuxResult::UNCHANGED;
         } else {
             avtab_datum_t av_new;
-            av_new.data = (1U << (perm_val - 1));
+            av_new.data = perms;
             if (avtab_insert(&pdb->te_avtab, &key, &av_new) != 0) {
                 return SELinuxResult::ERROR;
             }
@@ -96,9 +112,9 @@ SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
         auto old_data = av->data;
 
         if (remove) {
-            av->data &= ~(1U << (perm_val - 1));
+            av->data &= ~perms;
         } else {
-            av->data |= (1U << (perm_val - 1));
+            av->data |= perms;
         }
 
         return (av->data == old_data)
@@ -107,6 +123,63 @@ SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
     }
 }
 
+/*!
+ * Add or remove rule.
+ *
+ * \param pdb Policy DB object
+ * \param source_type_val Source type for rule
+ * \param target_type_val Target type for rule
+ * \param class_val Class for rule
+ * \param perm_val Permission for rule
+ * \param remove Whether to remove the rule
+ *
+ * \return Whether a change was made
+ */
+SELinuxResult selinux_raw_set_avtab_rule(policydb_t *pdb,
+                                         uint16_t source_type_val,
+                                         uint16_t target_type_val,
+                                         uint16_t class_val,
+                                         uint32_t perm_val,
+                                         bool remove)
+{
+    return selinux_raw_set_allow_perms(pdb, source_type_val, target_type_val,
+                                       class_val, 1U << (perm_val - 1),
+                                       remove);
+}
+
+/*!
+ * Get bitmask of all permissions (including common permissions) of a class.
+ *
+ * \return Whether the class exists
+ */
+static bool get_all_perms(policydb_t *pdb, uint16_t class_val, uint32_t *perms)
+{
+    auto clazz = pdb->class_val_to_struct[class_val - 1];
+    if (!clazz) {
+        return false;
+    }
+
+    *perms = 0;
+
+    // Class-specific permissions
+    hashtab_t tables[] = { clazz->permissions.table, nullptr, nullptr };
+    if (clazz->comdatum) {
+        tables[1] = clazz->comdatum->permissions.table;
+    }
+
+    for (auto table = tables; *table; ++table) {
+        for (uint32_t bucket = 0; bucket < (*table)->size; ++bucket) {
+            for (hashtab_ptr_t cur = (*table)->htable[bucket]; cur;
+                    cur = cur->next) {
+                perm_datum_t *perm_datum = (perm_datum_t *) cur->datum;
+                *perms |= 1U << (perm_datum->s.value - 1);
+            }
+        }
+    }
+
+    return true;
+}
+
 SELinuxResult selinux_raw_set_type_trans(policydb_t *pdb,
                                          uint16_t source_type_val,
                                          uint16_t target_type_val,
@@ -145,44 +218,14 @@ SELinuxResult selinux_raw_grant_all_perms(policydb_t *pdb,
                                           uint16_t target_type_val,
                                           uint16_t class_val)
 {
-    SELinuxResult result(SELinuxResult::UNCHANGED);
-
-    auto clazz = pdb->class_val_to_struct[class_val - 1];
-    if (!clazz) {
+    uint32_t perms;
+    if (!get_all_perms(pdb, class_val, &perms)) {
         return SELinuxResult::ERROR;
     }
 
-    // Class-specific permissions
-    hashtab_t tables[] = { clazz->permissions.table, nullptr, nullptr };
-    if (clazz->comdatum) {
-        tables[1] = clazz->comdatum->permissions.table;
-    }
-
-    for (auto table = tables; *table; ++table) {
-        for (uint32_t bucket = 0; bucket < (*table)->size; ++bucket) {
-            for (hashtab_ptr_t cur = (*table)->htable[bucket]; cur;
-                    cur = cur->next) {
-                perm_datum_t *perm_datum = (perm_datum_t *) cur->datum;
-
-                SELinuxResult ret = selinux_raw_set_avtab_rule(
-                        pdb, source_type_val, target_type_val, class_val,
-                        perm_datum->s.value, false);
-
-                switch (ret) {
-                case SELinuxResult::ERROR:
-                    return ret;
-                case SELinuxResult::CHANGED:
-                    result = ret;
-                    break;
-                case SELinuxResult::UNCHANGED:
-                    // Ignore
-                    break;
-                }
-            }
-        }
-    }
-
-    return result;
+    // Set all of the permissions with a single avtab lookup
+    return selinux_raw_set_allow_perms(pdb, source_type_val, target_type_val,
+                                       class_val, perms, false);
 }
 
 SELinuxResult selinux_raw_grant_all_perms(policydb_t *pdb,
@@ -369,6 +412,8 @@ static inline role_datum_t * find_role(policydb_t *pdb, const char *name)
 
 bool selinux_mount()
 {
+    MB_TIMELINE_SCOPE("sepolicy.mount");
+
     // Try /sys/fs/selinux
     if (mount(SELINUX_FS_TYPE, SELINUX_MOUNT_POINT,
               SELINUX_FS_TYPE, 0, nullptr) < 0) {
@@ -729,6 +774,166 @@ bool selinux_add_to_role(policydb_t *pdb,
     return ret != SELinuxResult::ERROR;
 }
 
+static inline uint64_t rule_key(uint16_t source_type_val,
+                               uint16_t target_type_val,
+                               uint16_t class_val)
+{
+    return (static_cast<uint64_t>(source_type_val) << 32)
+            | (static_cast<uint64_t>(target_type_val) << 16)
+            | class_val;
+}
+
+/*!
+ * \brief Collects allow rules and adds them to a policy at once
+ *
+ * Each rule is resolved to integer values when it is queued and rules with the
+ * same (source, target, class) are merged, so apply() only has to look up each
+ * avtab key once, no matter how many permissions are added to it. Adding rules
+ * does not change any of the policy's indexes, so no reindex is needed.
+ *
+ * \param pdb Policy to add rules to. Rules are only added by apply().
+ */
+SELinuxRuleBatch::SELinuxRuleBatch(policydb_t *pdb) : _pdb(pdb)
+{
+}
+
+/*!
+ * \brief Queue an allow rule
+ *
+ * \return Whether the types, class, and permission exist
+ */
+bool SELinuxRuleBatch::add_rule(const char *source_str,
+                                const char *target_str,
+                                const char *class_str,
+                                const char *perm_str)
+{
+    return add_rules(source_str, target_str, class_str, { perm_str });
+}
+
+/*!
+ * \brief Queue an allow rule with several permissions
+ *
+ * \return Whether the types, class, and permissions exist
+ */
+bool SELinuxRuleBatch::add_rules(const char *source_str,
+                                 const char *target_str,
+                                 const char *class_str,
+                                 const std::vector<std::string> &perms)
+{
+    type_datum_t *source, *target;
+    class_datum_t *clazz;
+
+    source = find_type(_pdb, source_str);
+    if (!source) {
+        LOGE("Source type %s does not exist", source_str);
+        return false;
+    }
+
+    target = find_type(_pdb, target_str);
+    if (!target) {
+        LOGE("Target type %s does not exist", target_str);
+        return false;
+    }
+
+    clazz = find_class(_pdb, class_str);
+    if (!clazz) {
+        LOGE("Class %s does not exist", class_str);
+        return false;
+    }
+
+    uint32_t mask = 0;
+
+    for (auto const &perm_str : perms) {
+        perm_datum_t *perm = find_perm(clazz, perm_str.c_str());
+        if (!perm) {
+            LOGE("Perm %s does not exist in class %s",
+                 perm_str.c_str(), class_str);
+            return false;
+        }
+
+        mask |= 1U << (perm->s.value - 1);
+    }
+
+    add_raw_rule(source->s.value, target->s.value, clazz->s.value, mask);
+
+    return true;
+}
+
+/*!
+ * \brief Queue an allow rule by value
+ *
+ * \param perms Bitmask of permissions
+ */
+void SELinuxRuleBatch::add_raw_rule(uint16_t source_type_val,
+                                    uint16_t target_type_val,
+                                    uint16_t class_val,
+                                    uint32_t perms)
+{
+    _rules[rule_key(source_type_val, target_type_val, class_val)] |= perms;
+}
+
+/*!
+ * \brief Queue rules granting every permission of every class
+ *
+ * \return Whether the permissions of each class could be determined
+ */
+bool SELinuxRuleBatch::grant_all_perms(uint16_t source_type_val,
+                                       uint16_t target_type_val)
+{
+    if (_all_perms.empty()) {
+        _all_perms.resize(_pdb->p_classes.nprim);
+
+        for (uint32_t class_val = 1; class_val <= _pdb->p_classes.nprim;
+                ++class_val) {
+            if (!get_all_perms(_pdb, class_val, &_all_perms[class_val - 1])) {
+                _all_perms.clear();
+                return false;
+            }
+        }
+    }
+
+    for (uint32_t class_val = 1; class_val <= _all_perms.size();
+            ++class_val) {
+        add_raw_rule(source_type_val, target_type_val, class_val,
+                     _all_perms[class_val - 1]);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add all queued rules to the policy
+ *
+ * The queue is cleared, even if an error occurs.
+ *
+ * \return Whether all of the rules were added
+ */
+bool SELinuxRuleBatch::apply()
+{
+    std::map<uint64_t, uint32_t> rules;
+    rules.swap(_rules);
+
+    for (auto const &pair : rules) {
+        uint16_t source_type_val = (pair.first >> 32) & 0xffff;
+        uint16_t target_type_val = (pair.first >> 16) & 0xffff;
+        uint16_t class_val = pair.first & 0xffff;
+
+        auto ret = selinux_raw_set_allow_perms(
+                _pdb, source_type_val, target_type_val, class_val,
+                pair.second, false);
+        if (ret == SELinuxResult::ERROR) {
+            LOGE("Failed to add rule: allow %s %s:%s 0x%x;",
+                 _pdb->p_type_val_to_name[source_type_val - 1],
+                 _pdb->p_type_val_to_name[target_type_val - 1],
+                 _pdb->p_class_val_to_name[class_val - 1],
+                 pair.second);
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void selinux_strip_no_audit(policydb_t *pdb)
 {
 #if 0
@@ -789,21 +994,6 @@ void selinux_strip_no_audit(policydb_t *pdb)
         if (!(expr)) return false; \
     } while (0)
 
-static inline bool add_rules(policydb_t *pdb,
-                             const char *source,
-                             const char *target,
-                             const char *clazz,
-                             const std::vector<std::string> &perms)
-{
-    for (auto const &perm : perms) {
-        if (!selinux_add_rule(pdb, source, target, clazz, perm.c_str())) {
-            return false;
-        }
-    }
-
-    return true;
-}
-
 MB_UNUSED
 static inline bool remove_rules(policydb_t *pdb,
                                 const char *source,
@@ -839,6 +1029,8 @@ static bool apply_pre_boot_patches(policydb_t *pdb)
         return false;
     }
 
+    SELinuxRuleBatch batch(pdb);
+
     // For all attributes
     for (uint32_t type_val = 1; type_val <= pdb->p_types.nprim; ++type_val) {
         // Skip non-attributes
@@ -846,12 +1038,7 @@ static bool apply_pre_boot_patches(policydb_t *pdb)
             continue;
         }
 
-        auto ret = selinux_raw_grant_all_perms(pdb, kernel->s.value, type_val);
-        switch (ret) {
-        case SELinuxResult::CHANGED:
-        case SELinuxResult::UNCHANGED:
-            break;
-        case SELinuxResult::ERROR:
+        if (!batch.grant_all_perms(kernel->s.value, type_val)) {
             LOGE("Failed to grant all perms for: %s -> %s",
                  "kernel", pdb->p_type_val_to_name[type_val - 1]);
             return false;
@@ -859,17 +1046,15 @@ static bool apply_pre_boot_patches(policydb_t *pdb)
     }
 
     // Allow the real init to load the "secure" SELinux policy
-    ff(selinux_add_rule(pdb, "kernel", "kernel", "security", "load_policy"));
+    ff(batch.add_rule("kernel", "kernel", "security", "load_policy"));
 
-    return true;
+    return batch.apply();
 }
 
 static bool copy_avtab_rules(policydb_t *pdb,
                              const char *source_type,
                              const char *target_type)
 {
-    std::vector<std::pair<avtab_key_t, avtab_datum_t>> to_add;
-
     type_datum_t *source, *target;
 
     if (strcmp(source_type, target_type) == 0) {
@@ -889,7 +1074,9 @@ static bool copy_avtab_rules(policydb_t *pdb,
         return false;
     }
 
-    // Gather rules to copy
+    SELinuxRuleBatch batch(pdb);
+
+    // Gather rules to copy. They can't be added while iterating through avtab.
     for (uint32_t i = 0; i < pdb->te_avtab.nslot; ++i) {
         for (avtab_ptr_t cur = pdb->te_avtab.htable[i]; cur; cur = cur->next) {
             if (!(cur->key.specified & AVTAB_ALLOWED)) {
@@ -897,27 +1084,32 @@ static bool copy_avtab_rules(policydb_t *pdb,
             }
 
             if (cur->key.target_type == source->s.value) {
-                avtab_key_t copy = cur->key;
-                copy.target_type = target->s.value;
-
-                to_add.push_back(std::make_pair(std::move(copy), cur->datum));
+                batch.add_raw_rule(cur->key.source_type, target->s.value,
+                                   cur->key.target_class, cur->datum.data);
             }
         }
     }
 
-    avtab_datum_t *datum;
-    for (auto &pair : to_add) {
-        datum = avtab_search(&pdb->te_avtab, &pair.first);
+    return batch.apply();
+}
 
-        if (!datum) {
-            // Create new avtab rule if the key doesn't exist
-            if (avtab_insert(&pdb->te_avtab, &pair.first, &pair.second) != 0) {
-                LOGE("Failed to add rule to avtab");
-                return false;
-            }
-        } else {
-            // Add additional perms if the key already exists
-            datum->data |= pair.second.data;
+/*!
+ * \brief Get the SELinux label of the internal storage
+ *
+ * \param[in,out] path Path to check first. Set to the path that was used.
+ * \param[out] context Label of \a path
+ *
+ * \return Whether the label was read. If false, errno is set. ENOENT means
+ *         that /data/media does not exist.
+ */
+static bool get_data_media_context(const char **path, std::string *context)
+{
+    if (!util::selinux_lget_context(*path, context)) {
+        LOGE("%s: Failed to get context: %s", *path, strerror(errno));
+        *path = "/data/media";
+        if (!util::selinux_lget_context(*path, context)) {
+            LOGE("%s: Failed to get context: %s", *path, strerror(errno));
+            return false;
         }
     }
 
@@ -940,14 +1132,9 @@ static bool fix_data_media_rules(policydb_t *pdb)
     }
 
     std::string context;
-    if (!util::selinux_lget_context(path, &context)) {
-        LOGE("%s: Failed to get context: %s", path, strerror(errno));
-        path = "/data/media";
-        if (!util::selinux_lget_context(path, &context)) {
-            LOGE("%s: Failed to get context: %s", path, strerror(errno));
-            // Don't fail if /data/media does not exist
-            return errno == ENOENT;
-        }
+    if (!get_data_media_context(&path, &context)) {
+        // Don't fail if /data/media does not exist
+        return errno == ENOENT;
     }
 
     std::vector<std::string> pieces = util::split(context, ":");
@@ -980,58 +1167,60 @@ static bool create_mbtool_types(policydb_t *pdb)
     ff(selinux_set_attribute(pdb, "mb_exec", "mlstrustedobject"));
     ff(selinux_set_attribute(pdb, "mb_exec", "mlstrustedsubject"));
 
+    SELinuxRuleBatch batch(pdb);
+
     // Allow setting the current process context from init to mb_exec
-    ff(add_rules(pdb, "init", "mb_exec", "process", {
+    ff(batch.add_rules("init", "mb_exec", "process", {
         "noatsecure", "rlimitinh", "setcurrent", "siginh", "transition",
         //"dyntransition",
     }));
 
     // Allow installd to connect to appsync's socket
-    ff(add_rules(pdb, "installd", "mb_exec", "unix_stream_socket", {
+    ff(batch.add_rules("installd", "mb_exec", "unix_stream_socket", {
         "accept", "listen", "read", "write",
     }));
     if (find_type(pdb, "system_server")) {
-        ff(add_rules(pdb, "system_server", "mb_exec", "unix_stream_socket", {
+        ff(batch.add_rules("system_server", "mb_exec", "unix_stream_socket", {
             "connectto",
         }));
     } else {
-        ff(add_rules(pdb, "system", "mb_exec", "unix_stream_socket", {
+        ff(batch.add_rules("system", "mb_exec", "unix_stream_socket", {
             "connectto",
         }));
     }
 
     // Allow apps to connect to the daemon
-    ff(add_rules(pdb, "untrusted_app", "mb_exec", "unix_stream_socket", {
+    ff(batch.add_rules("untrusted_app", "mb_exec", "unix_stream_socket", {
         "connectto",
     }));
 
     // Allow zygote to write to our stdout pipe when rebooting
-    ff(add_rules(pdb, "zygote", "init", "fifo_file", { "write" }));
+    ff(batch.add_rules("zygote", "init", "fifo_file", { "write" }));
 
     // Allow rebooting via the android.intent.action.REBOOT intent
     if (find_type(pdb, "activity_service")) {
-        ff(add_rules(pdb, "zygote", "activity_service", "service_manager", { "find" }));
+        ff(batch.add_rules("zygote", "activity_service", "service_manager", { "find" }));
     }
     if (find_type(pdb, "system_server")) {
-        ff(add_rules(pdb, "zygote", "system_server", "binder", { "call" }));
+        ff(batch.add_rules("zygote", "system_server", "binder", { "call" }));
     }
 
-    ff(add_rules(pdb, "zygote", "init", "unix_stream_socket", { "read", "write" }));
-    ff(add_rules(pdb, "zygote", "servicemanager", "binder", { "call" }));
+    ff(batch.add_rules("zygote", "init", "unix_stream_socket", { "read", "write" }));
+    ff(batch.add_rules("zygote", "servicemanager", "binder", { "call" }));
 
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "binder", { "transfer" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "dir", { "search" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "file", { "open", "read" }));
-    ff(add_rules(pdb, "servicemanager", "mb_exec", "process", { "getattr" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "dir", { "search" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "file", { "open" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "file", { "read" }));
-    ff(add_rules(pdb, "servicemanager", "zygote", "process", { "getattr" }));
+    ff(batch.add_rules("servicemanager", "mb_exec", "binder", { "transfer" }));
+    ff(batch.add_rules("servicemanager", "mb_exec", "dir", { "search" }));
+    ff(batch.add_rules("servicemanager", "mb_exec", "file", { "open", "read" }));
+    ff(batch.add_rules("servicemanager", "mb_exec", "process", { "getattr" }));
+    ff(batch.add_rules("servicemanager", "zygote", "dir", { "search" }));
+    ff(batch.add_rules("servicemanager", "zygote", "file", { "open" }));
+    ff(batch.add_rules("servicemanager", "zygote", "file", { "read" }));
+    ff(batch.add_rules("servicemanager", "zygote", "process", { "getattr" }));
 
     // For in-app flashing
-    ff(add_rules(pdb, "rootfs", "tmpfs", "filesystem", { "associate" }));
-    ff(add_rules(pdb, "tmpfs",  "rootfs", "filesystem", { "associate" }));
-    ff(add_rules(pdb, "kernel", "mb_exec", "fd", { "use" }));
+    ff(batch.add_rules("rootfs", "tmpfs", "filesystem", { "associate" }));
+    ff(batch.add_rules("tmpfs",  "rootfs", "filesystem", { "associate" }));
+    ff(batch.add_rules("kernel", "mb_exec", "fd", { "use" }));
 
     // Give mb_exec <insert diety here> permissions
     type_datum_t *mb_exec = find_type(pdb, "mb_exec");
@@ -1048,20 +1237,14 @@ static bool create_mbtool_types(policydb_t *pdb)
             continue;
         }
 
-        auto ret2 = selinux_raw_grant_all_perms(
-                pdb, mb_exec->s.value, type_val);
-        switch (ret2) {
-        case SELinuxResult::CHANGED:
-        case SELinuxResult::UNCHANGED:
-            break;
-        case SELinuxResult::ERROR:
+        if (!batch.grant_all_perms(mb_exec->s.value, type_val)) {
             LOGE("Failed to grant all perms for: %s -> %s",
                  "mb_exec", pdb->p_type_val_to_name[type_val - 1]);
             return false;
         }
     }
 
-    return true;
+    return batch.apply();
 }
 
 static bool apply_main_patches(policydb_t *pdb)
@@ -1074,26 +1257,31 @@ static bool apply_main_patches(policydb_t *pdb)
 
 static bool apply_cwm_recovery_patches(policydb_t *pdb)
 {
-    // Debugging rules (for CWM and Philz)
-    ff(add_rules(pdb, "adbd",  "block_device",    "blk_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "graphics_device", "chr_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "graphics_device", "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "input_device",    "chr_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "input_device",    "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "dir",        { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "file",       { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "rootfs",          "lnk_file",   { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "system_file",     "file",       { "relabelto" }));
-    ff(add_rules(pdb, "adbd",  "tmpfs",           "file",       { "relabelto" }));
-
-    ff(add_rules(pdb, "rootfs", "tmpfs",          "filesystem", { "associate" }));
-    ff(add_rules(pdb, "tmpfs",  "rootfs",         "filesystem", { "associate" }));
+    SELinuxRuleBatch batch(pdb);
 
-    return true;
+    // Debugging rules (for CWM and Philz)
+    ff(batch.add_rules("adbd",  "block_device",    "blk_file",   { "relabelto" }));
+    ff(batch.add_rules("adbd",  "graphics_device", "chr_file",   { "relabelto" }));
+    ff(batch.add_rules("adbd",  "graphics_device", "dir",        { "relabelto" }));
+    ff(batch.add_rules("adbd",  "input_device",    "chr_file",   { "relabelto" }));
+    ff(batch.add_rules("adbd",  "input_device",    "dir",        { "relabelto" }));
+    ff(batch.add_rules("adbd",  "rootfs",          "dir",        { "relabelto" }));
+    ff(batch.add_rules("adbd",  "rootfs",          "file",       { "relabelto" }));
+    ff(batch.add_rules("adbd",  "rootfs",          "lnk_file",   { "relabelto" }));
+    ff(batch.add_rules("adbd",  "system_file",     "file",       { "relabelto" }));
+    ff(batch.add_rules("adbd",  "tmpfs",           "file",       { "relabelto" }));
+
+    ff(batch.add_rules("rootfs", "tmpfs",          "filesystem", { "associate" }));
+    ff(batch.add_rules("tmpfs",  "rootfs",         "filesystem", { "associate" }));
+
+    return batch.apply();
 }
 
 bool selinux_apply_patch(policydb_t *pdb, SELinuxPatch patch)
 {
+    util::CounterTimer timer(util::Counter::SepolicyPatches,
+                             util::Counter::SepolicyPatchTimeNs);
+
     bool ret = false;
 
     switch (patch) {
@@ -1121,6 +1309,8 @@ bool patch_sepolicy(const std::string &source,
                     const std::string &target,
                     SELinuxPatch patch)
 {
+    MB_TIMELINE_SCOPE("sepolicy.patch");
+
     policydb_t pdb;
 
     if (policydb_init(&pdb) < 0) {
@@ -1152,6 +1342,162 @@ bool patch_sepolicy(const std::string &source,
     return true;
 }
 
+/*!
+ * \brief Compute the cache key for a patched policy
+ *
+ * The key covers everything that the result of selinux_apply_patch() depends
+ * on: the source policy, the patch, the version of the patches, and for the
+ * main patch, the label of the internal storage.
+ */
+static bool sepolicy_cache_key(const std::string &source, SELinuxPatch patch,
+                               std::string *key)
+{
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+
+    if (!util::sha512_hash(source, digest)) {
+        LOGE("%s: Failed to hash policy", source.c_str());
+        return false;
+    }
+
+    std::string input = format("%d:%d:", SEPOLICY_CACHE_VERSION,
+                               static_cast<int>(patch));
+    input += util::hex_string(digest, sizeof(digest));
+
+    if (patch == SELinuxPatch::MAIN) {
+        const char *path = INTERNAL_STORAGE;
+        std::string context;
+
+        input += ':';
+        if (get_data_media_context(&path, &context)) {
+            input += context;
+        }
+    }
+
+    SHA512(reinterpret_cast<const unsigned char *>(input.data()),
+           input.size(), digest);
+
+    *key = format("%d-", static_cast<int>(patch));
+    *key += util::hex_string(digest, sizeof(digest));
+
+    return true;
+}
+
+/*!
+ * \brief Remove cached policies for \a patch other than \a keep
+ */
+static void remove_stale_cached_sepolicies(const std::string &dir,
+                                           SELinuxPatch patch,
+                                           const std::string &keep)
+{
+    std::string prefix = format("%d-", static_cast<int>(patch));
+
+    autoclose::dir dp(autoclose::opendir(dir.c_str()));
+    if (!dp) {
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dp.get()))) {
+        if (starts_with(ent->d_name, prefix) && ent->d_name != keep) {
+            std::string path(dir);
+            path += '/';
+            path += ent->d_name;
+            unlink(path.c_str());
+        }
+    }
+}
+
+/*!
+ * \brief Patch SELinux policy, reusing a previously patched copy if possible
+ *
+ * Behaves like patch_sepolicy(), but the patched policy is stored in
+ * SEPOLICY_CACHE_DIR, keyed by sepolicy_cache_key(). If the key matches a
+ * cached policy, it is written to \a target as is and the policy is not
+ * parsed or patched. Failing to use the cache is never fatal.
+ */
+bool patch_sepolicy_cached(const std::string &source,
+                           const std::string &target,
+                           SELinuxPatch patch)
+{
+    MB_TIMELINE_SCOPE("sepolicy.patch_cached");
+
+    std::string key;
+    if (!sepolicy_cache_key(source, patch, &key)) {
+        return patch_sepolicy(source, target, patch);
+    }
+
+    std::string dir = get_raw_path(SEPOLICY_CACHE_DIR);
+    std::string path(dir);
+    path += '/';
+    path += key;
+
+    std::vector<unsigned char> data;
+
+    if (util::file_read_all(path, &data)) {
+        if (util::selinux_write_policy_data(target, data.data(),
+                                            data.size())) {
+            LOGV("%s: Used cached patched policy", path.c_str());
+            return true;
+        }
+
+        // Don't try to use it again. The write may have failed because the
+        // cached policy is corrupt.
+        LOGW("%s: Failed to use cached policy; patching again", path.c_str());
+        unlink(path.c_str());
+    } else if (errno != ENOENT) {
+        LOGW("%s: Failed to read cached policy: %s",
+             path.c_str(), strerror(errno));
+    }
+
+    policydb_t pdb;
+
+    if (policydb_init(&pdb) < 0) {
+        LOGE("Failed to initialize policydb");
+        return false;
+    }
+
+    auto destroy_pdb = util::finally([&]{
+        policydb_destroy(&pdb);
+    });
+
+    if (!util::selinux_read_policy(source, &pdb)) {
+        LOGE("%s: Failed to load SELinux policy", source.c_str());
+        return false;
+    }
+
+    LOGD("Policy version: %u", pdb.policyvers);
+
+    if (!selinux_apply_patch(&pdb, patch)) {
+        LOGE("%s: Failed to apply policy patch", source.c_str());
+        return false;
+    }
+
+    if (!util::selinux_policy_to_data(&pdb, &data)
+            || !util::selinux_write_policy_data(target, data.data(),
+                                                data.size())) {
+        LOGE("%s: Failed to write SELinux policy", target.c_str());
+        return false;
+    }
+
+    // Write to a temporary file first so that an interrupted write never
+    // leaves a truncated policy with a valid name
+    std::string temp_path(path + ".tmp");
+
+    if (!util::mkdir_recursive(dir, 0700)
+            || !util::file_write_data(
+                    temp_path, reinterpret_cast<const char *>(data.data()),
+                    data.size())
+            || rename(temp_path.c_str(), path.c_str()) < 0) {
+        LOGW("%s: Failed to cache patched policy: %s",
+             path.c_str(), strerror(errno));
+        unlink(temp_path.c_str());
+    } else {
+        remove_stale_cached_sepolicies(dir, patch, key);
+    }
+
+    return true;
+}
+
 bool patch_loaded_sepolicy(SELinuxPatch patch)
 {
     autoclose::file fp(autoclose::fopen(SELINUX_ENFORCE_FILE, "rbe"));
@@ -19,7 +19,9 @@
 
 #pragma once
 
+#include <map>
 #include <string>
+#include <vector>
 
 #include <sepol/policydb/policydb.h>
 
@@ -33,6 +35,12 @@ enum class SELinuxResult
     ERROR,
 };
 
+SELinuxResult selinux_raw_set_allow_perms(policydb_t *pdb,
+                                          uint16_t source_type_val,
+                                          uint16_t target_type_val,
+                                          uint16_t class_val,
+                                          uint32_t perms,
+                                          bool remove);
 SELinuxResult selinux_raw_set_allow_rule(policydb_t *pdb,
                                          uint16_t source_type_val,
                                          uint16_t target_type_val,
@@ -106,6 +114,36 @@ bool selinux_add_to_role(policydb_t *pdb,
                          const char *role_name,
                          const char *type_name);
 
+class SELinuxRuleBatch
+{
+public:
+    explicit SELinuxRuleBatch(policydb_t *pdb);
+
+    bool add_rule(const char *source_str,
+                  const char *target_str,
+                  const char *class_str,
+                  const char *perm_str);
+    bool add_rules(const char *source_str,
+                   const char *target_str,
+                   const char *class_str,
+                   const std::vector<std::string> &perms);
+    void add_raw_rule(uint16_t source_type_val,
+                      uint16_t target_type_val,
+                      uint16_t class_val,
+                      uint32_t perms);
+    bool grant_all_perms(uint16_t source_type_val,
+                         uint16_t target_type_val);
+
+    bool apply();
+
+private:
+    policydb_t *_pdb;
+    // Bitmask of all permissions for each class, indexed by (class_val - 1)
+    std::vector<uint32_t> _all_perms;
+    // Permissions to add, keyed by (source type, target type, class)
+    std::map<uint64_t, uint32_t> _rules;
+};
+
 // Patching functions
 
 enum class SELinuxPatch
@@ -122,6 +160,9 @@ bool selinux_apply_patch(policydb_t *pdb, SELinuxPatch patch);
 bool patch_sepolicy(const std::string &source,
                     const std::string &target,
                     SELinuxPatch patch);
+bool patch_sepolicy_cached(const std::string &source,
+                           const std::string &target,
+                           SELinuxPatch patch);
 bool patch_loaded_sepolicy(SELinuxPatch patch);
 
 int sepolpatch_main(int argc, char *argv[]);
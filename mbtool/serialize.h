@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <cstdint>
+#include <cstring>
+
+namespace mb
+{
+
+// Helpers for the host-endian binary formats that mbtool shares between its
+// own processes (eg. the ROM inventory snapshot and the ROM metadata cache)
+
+inline void put_u32(std::string *buf, uint32_t n)
+{
+    buf->append(reinterpret_cast<const char *>(&n), sizeof(n));
+}
+
+inline void put_u64(std::string *buf, uint64_t n)
+{
+    buf->append(reinterpret_cast<const char *>(&n), sizeof(n));
+}
+
+inline void put_string(std::string *buf, const std::string &str)
+{
+    put_u32(buf, static_cast<uint32_t>(str.size()));
+    buf->append(str);
+}
+
+inline bool get_u32(const char **ptr, const char *end, uint32_t *n)
+{
+    if (static_cast<size_t>(end - *ptr) < sizeof(*n)) {
+        return false;
+    }
+    memcpy(n, *ptr, sizeof(*n));
+    *ptr += sizeof(*n);
+    return true;
+}
+
+inline bool get_u64(const char **ptr, const char *end, uint64_t *n)
+{
+    if (static_cast<size_t>(end - *ptr) < sizeof(*n)) {
+        return false;
+    }
+    memcpy(n, *ptr, sizeof(*n));
+    *ptr += sizeof(*n);
+    return true;
+}
+
+inline bool get_string(const char **ptr, const char *end, std::string *str)
+{
+    uint32_t len;
+    if (!get_u32(ptr, end, &len)
+            || static_cast<size_t>(end - *ptr) < len) {
+        return false;
+    }
+    str->assign(*ptr, len);
+    *ptr += len;
+    return true;
+}
+
+}
@@ -19,25 +19,58 @@
 
 #include "signature.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <new>
+#include <thread>
+#include <vector>
 
 #include <getopt.h>
+#include <sys/mman.h>
 
 #include <openssl/err.h>
 #include <openssl/x509.h>
 
 #include <mblog/logging.h>
 #include <mbsign/mbsign.h>
+#include <mbutil/file.h>
 #include <mbutil/finally.h>
+#include <mbutil/hash.h>
+#include <mbutil/integer.h>
 
 #include "validcerts.h"
 
 #define COMPILE_ERROR_STRINGS 0
 
+#define SIG_CACHE_ENTRIES 64
+
 namespace mb
 {
 
+struct SigCacheEntry
+{
+    // Odd while the entry is being written, 0 if the entry was never used
+    std::atomic<uint32_t> seq;
+    unsigned char data_digest[SHA512_DIGEST_LENGTH];
+    unsigned char sig_digest[SHA512_DIGEST_LENGTH];
+};
+
+struct SigCache
+{
+    std::atomic<uint32_t> next;
+    SigCacheEntry entries[SIG_CACHE_ENTRIES];
+};
+
+static std::vector<EVP_PKEY *> public_keys;
+static bool public_keys_loaded = false;
+
+// Shared between all processes forked after verify_signature_enable_cache()
+static SigCache *sig_cache = nullptr;
+
 static inline bool hex2num(char c, char *out)
 {
     if (c >= 'a' && c <= 'f') {
@@ -93,58 +126,39 @@ static void openssl_log_errors()
     ERR_print_errors_cb(&log_callback, nullptr);
 }
 
-static SigVerifyResult verify_signature_with_key(const char *path,
-                                                 const char *sig_path,
-                                                 EVP_PKEY *public_key)
+/*!
+ * \brief Load the public keys of all certificates and bare public keys in
+ *        validcerts.h
+ *
+ * The keys are only parsed once per process. Since the daemon loads them
+ * before forking its connection workers, the workers inherit the parsed keys.
+ */
+static bool load_public_keys()
 {
-    bool ret = false;
-    bool valid;
-    BIO *bio_data_in = nullptr;
-    BIO *bio_sig_in = nullptr;
-
-    bio_data_in = BIO_new_file(path, "rb");
-    if (!bio_data_in) {
-        LOGE("%s: Failed to open input file", path);
-        openssl_log_errors();
-        goto error;
+    if (public_keys_loaded) {
+        return true;
     }
-    bio_sig_in = BIO_new_file(sig_path, "rb");
-    if (!bio_sig_in) {
-        LOGE("%s: Failed to open signature file", sig_path);
-        openssl_log_errors();
-        goto error;
-    }
-
-    ret = mb::sign::verify_data(bio_data_in, bio_sig_in, public_key, &valid);
 
-    BIO_free(bio_data_in);
-    BIO_free(bio_sig_in);
-
-    return ret ? (valid ? SigVerifyResult::VALID : SigVerifyResult::INVALID)
-            : SigVerifyResult::FAILURE;
+    std::vector<EVP_PKEY *> keys;
 
-error:
-    BIO_free(bio_data_in);
-    BIO_free(bio_sig_in);
-    return SigVerifyResult::FAILURE;
-}
+    auto free_keys = mb::util::finally([&]{
+        for (EVP_PKEY *key : keys) {
+            EVP_PKEY_free(key);
+        }
+    });
 
-SigVerifyResult verify_signature(const char *path, const char *sig_path)
-{
     for (const std::string &hex_der : valid_certs) {
         std::string der;
         if (!hex2bin(hex_der, &der)) {
             LOGE("Failed to convert hex-encoded certificate to binary: %s",
                  hex_der.c_str());
-            return SigVerifyResult::FAILURE;
+            return false;
         }
 
-        EVP_PKEY *public_key = nullptr;
         X509 *cert = nullptr;
         BIO *bio_x509_cert = nullptr;
 
         auto free_openssl = mb::util::finally([&]{
-            EVP_PKEY_free(public_key);
             X509_free(cert);
             BIO_free(bio_x509_cert);
         });
@@ -156,7 +170,7 @@ SigVerifyResult verify_signature(const char *path, const char *sig_path)
             LOGE("Failed to create BIO for X509 certificate: %s",
                  hex_der.c_str());
             openssl_log_errors();
-            return SigVerifyResult::FAILURE;
+            return false;
         }
 
         // Load DER-encoded certificate
@@ -164,38 +178,340 @@ SigVerifyResult verify_signature(const char *path, const char *sig_path)
         if (!cert) {
             LOGE("Failed to load X509 certificate: %s", hex_der.c_str());
             openssl_log_errors();
-            return SigVerifyResult::FAILURE;
+            return false;
         }
 
         // Get public key from certificate
-        public_key = X509_get_pubkey(cert);
+        EVP_PKEY *public_key = X509_get_pubkey(cert);
         if (!public_key) {
             LOGE("Failed to load public key from X509 certificate: %s",
                  hex_der.c_str());
             openssl_log_errors();
-            return SigVerifyResult::FAILURE;
+            return false;
         }
 
-        SigVerifyResult result =
-                verify_signature_with_key(path, sig_path, public_key);
-        if (result == SigVerifyResult::INVALID) {
-            // Keep trying ...
+        keys.push_back(public_key);
+    }
+
+    for (const std::string &hex_der : valid_sign_keys) {
+        if (hex_der.empty()) {
             continue;
         }
 
-        return result;
+        std::string der;
+        if (!hex2bin(hex_der, &der)) {
+            LOGE("Failed to convert hex-encoded public key to binary: %s",
+                 hex_der.c_str());
+            return false;
+        }
+
+        BIO *bio_public_key = BIO_new_mem_buf((void *) der.data(), der.size());
+        if (!bio_public_key) {
+            LOGE("Failed to create BIO for public key: %s", hex_der.c_str());
+            openssl_log_errors();
+            return false;
+        }
+
+        // Load DER-encoded SubjectPublicKeyInfo
+        EVP_PKEY *public_key = d2i_PUBKEY_bio(bio_public_key, nullptr);
+        BIO_free(bio_public_key);
+        if (!public_key) {
+            LOGE("Failed to load public key: %s", hex_der.c_str());
+            openssl_log_errors();
+            return false;
+        }
+
+        keys.push_back(public_key);
+    }
+
+    public_keys.swap(keys);
+    public_keys_loaded = true;
+    return true;
+}
+
+/*!
+ * \brief Check if a verification is recorded in the shared cache
+ */
+static bool sig_cache_lookup(const unsigned char *data_digest,
+                             const unsigned char *sig_digest)
+{
+    if (!sig_cache) {
+        return false;
+    }
+
+    for (SigCacheEntry &entry : sig_cache->entries) {
+        uint32_t seq = entry.seq.load(std::memory_order_acquire);
+        if (seq == 0 || (seq & 1)) {
+            // Empty or currently being written
+            continue;
+        }
+
+        bool match = memcmp(entry.data_digest, data_digest,
+                            SHA512_DIGEST_LENGTH) == 0
+                && memcmp(entry.sig_digest, sig_digest,
+                          SHA512_DIGEST_LENGTH) == 0;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        // Only trust the comparison if the entry did not change while it was
+        // being read
+        if (match && entry.seq.load(std::memory_order_relaxed) == seq) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Record a successful verification in the shared cache
+ *
+ * Entries are replaced in round-robin order. If another process is writing
+ * the chosen entry, the verification is simply not recorded.
+ */
+static void sig_cache_insert(const unsigned char *data_digest,
+                             const unsigned char *sig_digest)
+{
+    if (!sig_cache) {
+        return;
+    }
+
+    uint32_t index = sig_cache->next.fetch_add(1) % SIG_CACHE_ENTRIES;
+    SigCacheEntry &entry = sig_cache->entries[index];
+
+    uint32_t seq = entry.seq.load(std::memory_order_relaxed);
+    if ((seq & 1) || !entry.seq.compare_exchange_strong(
+            seq, seq + 1, std::memory_order_acq_rel)) {
+        return;
+    }
+
+    memcpy(entry.data_digest, data_digest, SHA512_DIGEST_LENGTH);
+    memcpy(entry.sig_digest, sig_digest, SHA512_DIGEST_LENGTH);
+
+    entry.seq.store(seq + 2, std::memory_order_release);
+}
+
+/*!
+ * \brief Share a cache of successful verifications with forked processes
+ *
+ * This must be called before forking. Any process forked afterwards (eg. the
+ * daemon's connection workers) will see the verifications recorded by all of
+ * the others, so repeated signed_exec requests for the same file and
+ * signature skip the RSA or Ed25519 verification.
+ *
+ * The public keys are also loaded here so that they are inherited as well.
+ *
+ * \return Whether the cache was created
+ */
+bool verify_signature_enable_cache()
+{
+    if (sig_cache) {
+        return true;
+    }
+
+    if (!load_public_keys()) {
+        return false;
+    }
+
+    void *mem = mmap(nullptr, sizeof(SigCache), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOGE("Failed to map signature cache: %s", strerror(errno));
+        return false;
+    }
+
+    sig_cache = new (mem) SigCache();
+    return true;
+}
+
+/*!
+ * \brief Verify the signature of data with a known digest
+ *
+ * \param digest SHA512 digest of the data (eg. computed while copying it)
+ * \param sig_path Path to the signature file
+ */
+SigVerifyResult verify_signature_digest(
+        const unsigned char digest[SHA512_DIGEST_LENGTH], const char *sig_path)
+{
+    std::vector<unsigned char> sig;
+    unsigned char sig_digest[SHA512_DIGEST_LENGTH];
+    bool valid;
+
+    if (!util::file_read_all(sig_path, &sig)) {
+        LOGE("%s: Failed to read signature file: %s",
+             sig_path, strerror(errno));
+        return SigVerifyResult::FAILURE;
+    }
+
+    SHA512(sig.data(), sig.size(), sig_digest);
+
+    if (sig_cache_lookup(digest, sig_digest)) {
+        LOGD("%s: Signature was already verified", sig_path);
+        return SigVerifyResult::VALID;
+    }
+
+    if (!load_public_keys()) {
+        return SigVerifyResult::FAILURE;
+    }
+
+    BIO *bio_sig_in = BIO_new_mem_buf(sig.data(), sig.size());
+    if (!bio_sig_in) {
+        LOGE("%s: Failed to create BIO for signature", sig_path);
+        openssl_log_errors();
+        return SigVerifyResult::FAILURE;
+    }
+
+    bool ret = mb::sign::verify_digest(
+            digest, SHA512_DIGEST_LENGTH, bio_sig_in,
+            public_keys.data(), public_keys.size(), &valid);
+
+    BIO_free(bio_sig_in);
+
+    if (!ret) {
+        return SigVerifyResult::FAILURE;
+    } else if (!valid) {
+        return SigVerifyResult::INVALID;
+    }
+
+    sig_cache_insert(digest, sig_digest);
+    return SigVerifyResult::VALID;
+}
+
+/*!
+ * \brief Verify the signature of a file
+ *
+ * The file is read and hashed once. The digest is then checked against the
+ * keys of all valid certificates and the bare signing keys. Both RSA (version
+ * 1) and Ed25519 (version 2) signatures are accepted.
+ */
+SigVerifyResult verify_signature(const char *path, const char *sig_path)
+{
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+
+    if (!util::sha512_hash(path, digest)) {
+        LOGE("%s: Failed to hash file: %s", path, strerror(errno));
+        return SigVerifyResult::FAILURE;
+    }
+
+    return verify_signature_digest(digest, sig_path);
+}
+
+/*!
+ * \brief Verify the signatures of files in parallel
+ *
+ * Each file is checked against \<file\>.sig. All files are checked even if
+ * some of them fail.
+ *
+ * \return Worst result of all the verifications
+ */
+static SigVerifyResult verify_signatures(const std::vector<std::string> &paths,
+                                         unsigned int jobs)
+{
+    // Load the keys up front so that the threads do not race to do so
+    if (!load_public_keys()) {
+        return SigVerifyResult::FAILURE;
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> invalid(false);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+
+    auto worker = [&]{
+        size_t i;
+        while ((i = next.fetch_add(1)) < paths.size()) {
+            const std::string &path = paths[i];
+            std::string sig_path = path + ".sig";
+
+            switch (verify_signature(path.c_str(), sig_path.c_str())) {
+            case SigVerifyResult::VALID:
+                break;
+            case SigVerifyResult::INVALID:
+                fprintf(stderr, "%s: Signature is invalid\n", path.c_str());
+                invalid = true;
+                break;
+            case SigVerifyResult::FAILURE:
+            default:
+                fprintf(stderr, "%s: Failed to check signature\n",
+                        path.c_str());
+                failed = true;
+                break;
+            }
+        }
+    };
+
+    jobs = static_cast<unsigned int>(
+            std::min<size_t>(std::max(jobs, 1u), paths.size()));
+
+    for (unsigned int i = 1; i < jobs; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    if (failed) {
+        return SigVerifyResult::FAILURE;
+    } else if (invalid) {
+        return SigVerifyResult::INVALID;
+    } else {
+        return SigVerifyResult::VALID;
+    }
+}
+
+static bool read_manifest(const char *path, std::vector<std::string> &paths)
+{
+    FILE *fp = fopen(path, "rbe");
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open manifest: %s\n",
+                path, strerror(errno));
+        return false;
+    }
+
+    auto close_fp = util::finally([&]{
+        fclose(fp);
+    });
+
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t read;
+
+    auto free_line = util::finally([&]{
+        free(line);
+    });
+
+    while ((read = getline(&line, &len, fp)) >= 0) {
+        while (read > 0 && (line[read - 1] == '\n' || line[read - 1] == '\r')) {
+            line[--read] = '\0';
+        }
+        if (read > 0) {
+            paths.emplace_back(line, read);
+        }
+    }
+
+    if (ferror(fp)) {
+        fprintf(stderr, "%s: Failed to read manifest: %s\n",
+                path, strerror(errno));
+        return false;
     }
 
-    return SigVerifyResult::INVALID;
+    return true;
 }
 
 static void sigverify_usage(FILE *stream)
 {
     fprintf(stream,
-            "Usage: sigverify [option...] <input file> <signature file>\n\n"
+            "Usage: sigverify [option...] <input file> <signature file>\n"
+            "       sigverify --batch [option...] <input file|@manifest>...\n\n"
             "Options:\n"
+            "  -b, --batch      Verify each input file against <input file>.sig\n"
+            "  -j, --jobs <N>   Verify up to N files at a time in batch mode\n"
+            "                   (default: number of CPUs)\n"
             "  -h, --help       Display this help message\n"
             "\n"
+            "A manifest lists one input file per line.\n"
+            "\n"
             "Exit codes:\n"
             "  0: Signature is valid\n"
             "  1: An error occurred while checking the signature\n"
@@ -209,16 +525,31 @@ static void sigverify_usage(FILE *stream)
 int sigverify_main(int argc, char *argv[])
 {
     int opt;
+    bool batch = false;
+    unsigned int jobs = std::thread::hardware_concurrency();
 
     static struct option long_options[] = {
-        {"help",      no_argument, 0, 'h'},
+        {"batch",     no_argument,       0, 'b'},
+        {"jobs",      required_argument, 0, 'j'},
+        {"help",      no_argument,       0, 'h'},
         {0, 0, 0, 0}
     };
 
     int long_index = 0;
 
-    while ((opt = getopt_long(argc, argv, "h", long_options, &long_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "bj:h", long_options, &long_index)) != -1) {
         switch (opt) {
+        case 'b':
+            batch = true;
+            break;
+
+        case 'j':
+            if (!util::str_to_unum(optarg, 10, &jobs) || jobs == 0) {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
         case 'h':
             sigverify_usage(stdout);
             return EXIT_SUCCESS;
@@ -229,7 +560,7 @@ int sigverify_main(int argc, char *argv[])
         }
     }
 
-    if (argc - optind != 2) {
+    if (batch ? argc - optind < 1 : argc - optind != 2) {
         sigverify_usage(stderr);
         return EXIT_FAILURE;
     }
@@ -239,10 +570,28 @@ int sigverify_main(int argc, char *argv[])
     OpenSSL_add_all_algorithms();
 #endif
 
-    const char *path = argv[optind];
-    const char *sig_path = argv[optind + 1];
+    SigVerifyResult result;
+
+    if (batch) {
+        std::vector<std::string> paths;
 
-    SigVerifyResult result = verify_signature(path, sig_path);
+        for (int i = optind; i < argc; ++i) {
+            if (argv[i][0] == '@') {
+                if (!read_manifest(argv[i] + 1, paths)) {
+                    return EXIT_FAILURE;
+                }
+            } else {
+                paths.push_back(argv[i]);
+            }
+        }
+
+        result = verify_signatures(paths, jobs);
+    } else {
+        const char *path = argv[optind];
+        const char *sig_path = argv[optind + 1];
+
+        result = verify_signature(path, sig_path);
+    }
 
     switch (result) {
     case SigVerifyResult::VALID:
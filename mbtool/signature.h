@@ -19,6 +19,8 @@
 
 #pragma once
 
+#include <openssl/sha.h>
+
 namespace mb
 {
 
@@ -29,7 +31,11 @@ enum SigVerifyResult
     FAILURE
 };
 
+bool verify_signature_enable_cache();
+
 SigVerifyResult verify_signature(const char *path, const char *sig_path);
+SigVerifyResult verify_signature_digest(
+        const unsigned char digest[SHA512_DIGEST_LENGTH], const char *sig_path);
 
 int sigverify_main(int argc, char *argv[]);
 
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stats.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include "mbutil/counters.h"
+
+#include "multiboot.h"
+#include "roms.h"
+
+namespace mb
+{
+
+static void stats_usage(bool error)
+{
+    FILE *stream = error ? stderr : stdout;
+
+    fprintf(stream,
+            "Usage: stats [OPTION]... [FILE]\n"
+            "\n"
+            "Options:\n"
+            "  -h, --help       Display this help message\n"
+            "\n"
+            "This tool prints the counters shared by the mbtool processes\n"
+            "(init, appsync, and the daemon) since boot. If FILE is omitted,\n"
+            MULTIBOOT_COUNTERS " is read.\n"
+            "\n"
+            "Per-request statistics are available from the daemon's\n"
+            "MbGetDaemonStats request.\n");
+}
+
+int stats_main(int argc, char *argv[])
+{
+    int opt;
+
+    static struct option long_options[] = {
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "h", long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'h':
+            stats_usage(false);
+            return EXIT_SUCCESS;
+        default:
+            stats_usage(true);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind > 1) {
+        stats_usage(true);
+        return EXIT_FAILURE;
+    }
+
+    std::string path = argc - optind == 1
+            ? argv[optind] : get_raw_path(MULTIBOOT_COUNTERS);
+
+    std::vector<uint64_t> values;
+    if (!util::counters_read(path, &values)) {
+        if (errno == ESTALE) {
+            fprintf(stderr, "%s: No counters were saved during this boot\n",
+                    path.c_str());
+        } else {
+            fprintf(stderr, "%s: Failed to read counters: %s\n",
+                    path.c_str(), strerror(errno));
+        }
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < values.size(); ++i) {
+        printf("%s: %" PRIu64 "\n",
+               util::counter_name(static_cast<util::Counter>(i)), values[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+}
@@ -19,13 +19,19 @@
 
 #include "switcher.h"
 
+#include <algorithm>
+#include <vector>
+
 #include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <openssl/sha.h>
 
@@ -45,6 +51,11 @@
 #include "roms.h"
 
 #define CHECKSUMS_PATH "/data/multiboot/checksums.prop"
+// Suffix of the property holding the metadata of the image at the time its
+// checksum was computed
+#define CHECKSUMS_STAT_SUFFIX ".stat"
+// Size of the blocks that are compared and rewritten when flashing images
+#define FLASH_BLOCK_SIZE (1024 * 1024)
 
 namespace mb
 {
@@ -97,6 +108,23 @@ ChecksumsGetResult checksums_get(std::unordered_map<std::string, std::string> *p
     }
 }
 
+/*!
+ * \brief Format the metadata that changes whenever an image is modified
+ *
+ * The ctime cannot be set from userspace, so unlike the mtime, it cannot be
+ * restored after modifying the file.
+ */
+static std::string format_stat(const struct stat &sb)
+{
+    return format("%" PRIu64 ":%" PRIu64 ":%" PRId64 ".%09ld:%" PRId64 ".%09ld",
+                  static_cast<uint64_t>(sb.st_size),
+                  static_cast<uint64_t>(sb.st_ino),
+                  static_cast<int64_t>(sb.st_mtim.tv_sec),
+                  static_cast<long>(sb.st_mtim.tv_nsec),
+                  static_cast<int64_t>(sb.st_ctim.tv_sec),
+                  static_cast<long>(sb.st_ctim.tv_nsec));
+}
+
 /*!
  * \brief Update a checksum property
  *
@@ -104,11 +132,14 @@ ChecksumsGetResult checksums_get(std::unordered_map<std::string, std::string> *p
  * \param rom_id ROM ID
  * \param image Image filename (without directory)
  * \param sha512 SHA512 hex digest
+ * \param sb Metadata of the image that was hashed. If nullptr, then the
+ *           image will be hashed again the next time it is verified.
  */
 void checksums_update(std::unordered_map<std::string, std::string> *props,
                       const std::string &rom_id,
                       const std::string &image,
-                      const std::string &sha512)
+                      const std::string &sha512,
+                      const struct stat *sb)
 {
     std::string key(rom_id);
     key += "/";
@@ -116,6 +147,39 @@ void checksums_update(std::unordered_map<std::string, std::string> *props,
 
     (*props)[key] = "sha512:";
     (*props)[key] += sha512;
+
+    key += CHECKSUMS_STAT_SUFFIX;
+
+    if (sb) {
+        (*props)[key] = format_stat(*sb);
+    } else {
+        props->erase(key);
+    }
+}
+
+/*!
+ * \brief Check whether an image is unchanged since its checksum was computed
+ *
+ * \param props Pointer to properties map
+ * \param rom_id ROM ID
+ * \param image Image filename (without directory)
+ * \param sb Current metadata of the image
+ *
+ * \return Whether the size, inode, mtime, and ctime match the ones recorded
+ *         when the checksum was computed
+ */
+bool checksums_stat_matches(std::unordered_map<std::string, std::string> *props,
+                            const std::string &rom_id,
+                            const std::string &image,
+                            const struct stat &sb)
+{
+    std::string key(rom_id);
+    key += "/";
+    key += image;
+    key += CHECKSUMS_STAT_SUFFIX;
+
+    auto it = props->find(key);
+    return it != props->end() && it->second == format_stat(sb);
 }
 
 /*!
@@ -181,8 +245,257 @@ struct Flashable
     std::string hash;
     unsigned char *data = nullptr;
     std::size_t size = 0;
+    // Metadata of the image when it was read
+    struct stat sb;
+    // Whether the image did not change while it was being read
+    bool stable = false;
 };
 
+static bool same_stat(const struct stat &a, const struct stat &b)
+{
+    return a.st_dev == b.st_dev
+            && a.st_ino == b.st_ino
+            && a.st_size == b.st_size
+            && a.st_mtim.tv_sec == b.st_mtim.tv_sec
+            && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec
+            && a.st_ctim.tv_sec == b.st_ctim.tv_sec
+            && a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
+/*!
+ * \brief Read an image into memory and record its metadata
+ *
+ * The metadata is read from the same file descriptor before and after the
+ * data so that it describes exactly the data that was read.
+ */
+static bool read_image(Flashable &f)
+{
+    int fd = open(f.image.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = util::finally([&] {
+        close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &f.sb) < 0) {
+        return false;
+    } else if (!S_ISREG(f.sb.st_mode)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    size_t capacity = static_cast<size_t>(f.sb.st_size);
+    f.data = static_cast<unsigned char *>(malloc(capacity > 0 ? capacity : 1));
+    if (!f.data) {
+        return false;
+    }
+    f.size = 0;
+
+    while (true) {
+        if (f.size == capacity) {
+            // The file grew while it was being read
+            capacity = capacity * 2 + 4096;
+            auto *data = static_cast<unsigned char *>(
+                    realloc(f.data, capacity));
+            if (!data) {
+                return false;
+            }
+            f.data = data;
+        }
+
+        ssize_t n = read(fd, f.data + f.size, capacity - f.size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+        f.size += static_cast<size_t>(n);
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        return false;
+    }
+
+    f.stable = same_stat(f.sb, sb)
+            && f.size == static_cast<size_t>(f.sb.st_size);
+    return true;
+}
+
+/*!
+ * \brief Write an image and get the metadata of the written file
+ *
+ * The metadata is read from the file descriptor used for writing so that it
+ * describes exactly the data that was written.
+ */
+static bool write_image(const std::string &path, const unsigned char *data,
+                        size_t size, struct stat *sb)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = util::finally([&] {
+        close(fd);
+    });
+
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+
+    return fstat(fd, sb) == 0;
+}
+
+static bool read_fully_at(int fd, unsigned char *buf, size_t size,
+                          uint64_t offset, size_t *bytes_read)
+{
+    *bytes_read = 0;
+
+    while (*bytes_read < size) {
+        ssize_t n = pread64(fd, buf + *bytes_read, size - *bytes_read,
+                            static_cast<off64_t>(offset + *bytes_read));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+        *bytes_read += static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+static bool write_fully_at(int fd, const unsigned char *buf, size_t size,
+                           uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t n = pwrite64(fd, buf, size, static_cast<off64_t>(offset));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        size -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Flash an image, only rewriting the blocks that changed
+ *
+ * The target is read in large blocks and each one is compared with the
+ * image. Only the differing blocks are rewritten, so switching to a ROM whose
+ * image is already flashed does not write anything. The rewritten blocks are
+ * then dropped from the page cache, read back from the device, and compared
+ * with the image again.
+ *
+ * \param path Block device (or file) to write to
+ * \param data Image data
+ * \param size Size of image data
+ * \param[out] written Number of bytes that were rewritten
+ *
+ * \return Whether the target now contains the image
+ */
+static bool flash_image(const std::string &path, const unsigned char *data,
+                        size_t size, uint64_t *written)
+{
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = util::finally([&] {
+        if (fd >= 0) {
+            close(fd);
+        }
+    });
+
+    std::vector<unsigned char> buf(FLASH_BLOCK_SIZE);
+    std::vector<uint64_t> rewritten;
+    size_t n;
+
+    *written = 0;
+
+    for (uint64_t offset = 0; offset < size; offset += FLASH_BLOCK_SIZE) {
+        size_t len = std::min<size_t>(size - offset, FLASH_BLOCK_SIZE);
+
+        if (!read_fully_at(fd, buf.data(), len, offset, &n)) {
+            return false;
+        }
+
+        if (n == len && memcmp(buf.data(), data + offset, len) == 0) {
+            continue;
+        }
+
+        if (!write_fully_at(fd, data + offset, len, offset)) {
+            return false;
+        }
+
+        rewritten.push_back(offset);
+        *written += len;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        return false;
+    }
+
+    // Regular files should not keep data from a larger, older image
+    if (S_ISREG(sb.st_mode) && static_cast<uint64_t>(sb.st_size) > size
+            && ftruncate64(fd, static_cast<off64_t>(size)) < 0) {
+        return false;
+    }
+
+    if (!rewritten.empty()) {
+        if (fsync(fd) < 0) {
+            return false;
+        }
+
+        // Make sure the verification reads from the device
+        posix_fadvise64(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+        for (uint64_t offset : rewritten) {
+            size_t len = std::min<size_t>(size - offset, FLASH_BLOCK_SIZE);
+
+            if (!read_fully_at(fd, buf.data(), len, offset, &n)) {
+                return false;
+            } else if (n != len
+                    || memcmp(buf.data(), data + offset, len) != 0) {
+                LOGE("%s: Verification failed at offset %" PRIu64,
+                     path.c_str(), offset);
+                errno = EIO;
+                return false;
+            }
+        }
+    }
+
+    int ret = close(fd);
+    fd = -1;
+    return ret == 0;
+}
+
 /*!
  * \brief Perform non-recursive search for a block device
  *
@@ -354,30 +667,47 @@ SwitchRomResult switch_rom(const std::string &id,
     std::unordered_map<std::string, std::string> props;
     checksums_read(&props);
 
+    // Whether the metadata of any verified image needs to be recorded
+    bool update_stats = false;
+
     for (Flashable &f : flashables) {
+        const std::string image_name = util::base_name(f.image);
+
         // If memory becomes an issue, an alternative method is to create a
         // temporary directory in /data/multiboot/ that's only writable by root
         // and copy the images there.
-        if (!util::file_read_all(f.image, &f.data, &f.size)) {
+        if (!read_image(f)) {
             LOGE("%s: Failed to read image: %s",
                  f.image.c_str(), strerror(errno));
             return SwitchRomResult::FAILED;
         }
 
+        // Get expected sha512sum
+        ChecksumsGetResult ret = checksums_get(
+                &props, id, image_name, &f.expected_hash);
+        if (ret == ChecksumsGetResult::MALFORMED) {
+            return SwitchRomResult::CHECKSUM_INVALID;
+        }
+
+        if (!force_update_checksums && ret == ChecksumsGetResult::FOUND
+                && f.stable
+                && checksums_stat_matches(&props, id, image_name, f.sb)) {
+            // The image has not been modified since it was last hashed
+            LOGD("%s: Unchanged since checksum was computed", f.image.c_str());
+            f.hash = f.expected_hash;
+            continue;
+        }
+
         // Get actual sha512sum
         unsigned char digest[SHA512_DIGEST_LENGTH];
         SHA512(f.data, f.size, digest);
         f.hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
 
         if (force_update_checksums) {
-            checksums_update(&props, id, util::base_name(f.image), f.hash);
-        }
-
-        // Get expected sha512sum
-        ChecksumsGetResult ret = checksums_get(
-                &props, id, util::base_name(f.image), &f.expected_hash);
-        if (ret == ChecksumsGetResult::MALFORMED) {
-            return SwitchRomResult::CHECKSUM_INVALID;
+            checksums_update(&props, id, image_name, f.hash,
+                             f.stable ? &f.sb : nullptr);
+            f.expected_hash = f.hash;
+            continue;
         }
 
         // Verify hashes if we have an expected hash
@@ -386,6 +716,13 @@ SwitchRomResult switch_rom(const std::string &id,
                  f.image.c_str(), f.hash.c_str(), f.expected_hash.c_str());
             return SwitchRomResult::CHECKSUM_INVALID;
         }
+
+        // The image was verified, so later switches can skip hashing it as
+        // long as it is not modified (eg. after its permissions were fixed)
+        if (ret == ChecksumsGetResult::FOUND && f.stable) {
+            checksums_update(&props, id, image_name, f.hash, &f.sb);
+            update_stats = true;
+        }
     }
 
     // Fail if we're missing expected hashes. We do this last to make sure
@@ -400,16 +737,19 @@ SwitchRomResult switch_rom(const std::string &id,
 
     // Now we can flash the images
     for (Flashable &f : flashables) {
-        // Cast is okay. The data is just passed to fwrite (ie. no signed
-        // extension issues)
-        if (!util::file_write_data(f.block_dev, (char *) f.data, f.size)) {
+        uint64_t written;
+
+        if (!flash_image(f.block_dev, f.data, f.size, &written)) {
             LOGE("%s: Failed to write image: %s",
                  f.block_dev.c_str(), strerror(errno));
             return SwitchRomResult::FAILED;
         }
+
+        LOGD("%s: Rewrote %" PRIu64 " of %zu bytes",
+             f.block_dev.c_str(), written, f.size);
     }
 
-    if (force_update_checksums) {
+    if (force_update_checksums || update_stats) {
         LOGD("Updating checksums file");
         checksums_write(props);
     }
@@ -478,22 +818,21 @@ bool set_kernel(const std::string &id, const std::string &boot_blockdev)
     SHA512(data, size, digest);
     std::string hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
 
+    struct stat sb;
+    if (!write_image(bootimg_path, data, size, &sb)) {
+        LOGE("%s: Failed to write image: %s",
+             bootimg_path.c_str(), strerror(errno));
+        return false;
+    }
+
     // Add to checksums.prop
     std::unordered_map<std::string, std::string> props;
     checksums_read(&props);
-    checksums_update(&props, id, "boot.img", hash);
+    checksums_update(&props, id, "boot.img", hash, &sb);
 
     // NOTE: This function isn't responsible for updating the checksums for
     //       any extra images. We don't want to mask any malicious changes.
 
-    // Cast is okay. The data is just passed to fwrite (ie. no signed
-    // extension issues)
-    if (!util::file_write_data(bootimg_path, (char *) data, size)) {
-        LOGE("%s: Failed to write image: %s",
-             bootimg_path.c_str(), strerror(errno));
-        return false;
-    }
-
     LOGD("Updating checksums file");
     checksums_write(props);
 
@@ -23,6 +23,8 @@
 #include <unordered_map>
 #include <vector>
 
+#include <sys/stat.h>
+
 namespace mb
 {
 
@@ -40,7 +42,12 @@ ChecksumsGetResult checksums_get(std::unordered_map<std::string, std::string> *p
 void checksums_update(std::unordered_map<std::string, std::string> *props,
                       const std::string &rom_id,
                       const std::string &image,
-                      const std::string &sha512);
+                      const std::string &sha512,
+                      const struct stat *sb = nullptr);
+bool checksums_stat_matches(std::unordered_map<std::string, std::string> *props,
+                            const std::string &rom_id,
+                            const std::string &image,
+                            const struct stat &sb);
 bool checksums_read(std::unordered_map<std::string, std::string> *props);
 bool checksums_write(const std::unordered_map<std::string, std::string> &props);
 
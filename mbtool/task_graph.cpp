@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "task_graph.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "mblog/logging.h"
+
+namespace mb
+{
+
+/*!
+ * \brief Add a task
+ *
+ * \param name Unique name of the task
+ * \param requirements Names of the tasks that must succeed before this one
+ *                     starts
+ * \param fn Function to run. Returning false fails the whole graph.
+ */
+void TaskGraph::add(std::string name,
+                    std::vector<std::string> requirements, TaskFn fn)
+{
+    _tasks.emplace_back();
+    Task &task = _tasks.back();
+    task.name = std::move(name);
+    task.requirements = std::move(requirements);
+    task.fn = std::move(fn);
+    task.remaining = 0;
+}
+
+/*!
+ * \brief Link each task to the tasks that require it
+ *
+ * \return Whether all requirements refer to existing tasks and there are no
+ *         dependency cycles
+ */
+bool TaskGraph::resolve()
+{
+    std::unordered_map<std::string, size_t> indexes;
+
+    for (size_t i = 0; i < _tasks.size(); ++i) {
+        if (!indexes.emplace(_tasks[i].name, i).second) {
+            LOGE("Duplicate task: %s", _tasks[i].name.c_str());
+            return false;
+        }
+        _tasks[i].dependents.clear();
+        _tasks[i].remaining = _tasks[i].requirements.size();
+    }
+
+    for (size_t i = 0; i < _tasks.size(); ++i) {
+        for (const std::string &name : _tasks[i].requirements) {
+            auto it = indexes.find(name);
+            if (it == indexes.end()) {
+                LOGE("Task %s requires unknown task %s",
+                     _tasks[i].name.c_str(), name.c_str());
+                return false;
+            }
+            _tasks[it->second].dependents.push_back(i);
+        }
+    }
+
+    // Make sure every task can eventually run
+    std::vector<size_t> remaining(_tasks.size());
+    std::deque<size_t> ready;
+    size_t visited = 0;
+
+    for (size_t i = 0; i < _tasks.size(); ++i) {
+        remaining[i] = _tasks[i].remaining;
+        if (remaining[i] == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    while (!ready.empty()) {
+        size_t i = ready.front();
+        ready.pop_front();
+        ++visited;
+
+        for (size_t dependent : _tasks[i].dependents) {
+            if (--remaining[dependent] == 0) {
+                ready.push_back(dependent);
+            }
+        }
+    }
+
+    if (visited != _tasks.size()) {
+        LOGE("Tasks have a dependency cycle");
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Run all tasks
+ *
+ * Ready tasks are started in the order that they were added.
+ *
+ * \param max_threads Maximum number of tasks to run at the same time
+ *
+ * \return Whether every task ran and succeeded
+ */
+bool TaskGraph::run(unsigned int max_threads)
+{
+    if (!resolve()) {
+        return false;
+    }
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<size_t> ready;
+    size_t finished = 0;
+    bool failed = false;
+
+    for (size_t i = 0; i < _tasks.size(); ++i) {
+        if (_tasks[i].remaining == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    auto worker = [&] {
+        std::unique_lock<std::mutex> guard(lock);
+
+        while (true) {
+            cv.wait(guard, [&] {
+                return !ready.empty() || failed || finished == _tasks.size();
+            });
+            if (failed || ready.empty()) {
+                break;
+            }
+
+            size_t i = ready.front();
+            ready.pop_front();
+
+            guard.unlock();
+            bool ok = _tasks[i].fn();
+            guard.lock();
+
+            ++finished;
+
+            if (!ok) {
+                LOGE("Task %s failed", _tasks[i].name.c_str());
+                failed = true;
+            } else {
+                for (size_t dependent : _tasks[i].dependents) {
+                    if (--_tasks[dependent].remaining == 0) {
+                        ready.push_back(dependent);
+                    }
+                }
+            }
+
+            cv.notify_all();
+        }
+    };
+
+    size_t n_threads = std::max<size_t>(
+            1, std::min<size_t>(max_threads, _tasks.size()));
+    std::vector<std::thread> threads;
+
+    // The calling thread is one of the workers
+    for (size_t i = 1; i < n_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+
+    worker();
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    return !failed && finished == _tasks.size();
+}
+
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+
+namespace mb
+{
+
+/*!
+ * \brief Runs a set of tasks in dependency order on a pool of threads
+ *
+ * Each task names the tasks it requires. A task is started as soon as all of
+ * its requirements have succeeded, so tasks that do not depend on each other
+ * run concurrently.
+ *
+ * If a task fails, no new tasks are started. The tasks that are already
+ * running are allowed to finish before run() returns.
+ */
+class TaskGraph
+{
+public:
+    typedef std::function<bool()> TaskFn;
+
+    void add(std::string name, std::vector<std::string> requirements,
+             TaskFn fn);
+
+    bool run(unsigned int max_threads);
+
+private:
+    struct Task
+    {
+        std::string name;
+        std::vector<std::string> requirements;
+        TaskFn fn;
+        std::vector<size_t> dependents;
+        size_t remaining;
+    };
+
+    bool resolve();
+
+    std::vector<Task> _tasks;
+};
+
+}
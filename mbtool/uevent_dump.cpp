@@ -24,6 +24,7 @@
 
 #include "mbcommon/version.h"
 #include "mblog/logging.h"
+#include "mbutil/cmdline.h"
 
 #include "initwrapper/devices.h"
 
@@ -73,8 +74,11 @@ int uevent_dump_main(int argc, char *argv[])
 
     LOGV("mbtool version %s (%s)", version(), git_version());
 
+    std::string bootdevice;
+    util::kernel_cmdline_get_option("androidboot.bootdevice", &bootdevice);
+
     // Start probing for devices
-    device_init(true);
+    device_init(true, bootdevice.c_str());
     // Kill uevent thread and close uevent socket
     device_close();
 
@@ -31,8 +31,10 @@
 #include "minizip/zip.h"
 #include "minizip/ioandroid.h"
 
+#include "mbcommon/buffer_pool.h"
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
+#include "mbdevice/database.h"
 #include "mbdevice/device.h"
 #include "mbdevice/json.h"
 #include "mblog/logging.h"
@@ -46,7 +48,7 @@
 #include "mbutil/string.h"
 
 #include "multiboot.h"
-#include "romconfig.h"
+#include "rom_metadata.h"
 #include "roms.h"
 #include "switcher.h"
 #include "wipe.h"
@@ -68,6 +70,21 @@ static bool get_device(const char *path, Device &device)
     LOGD("ro.product.device = %s", prop_product_device.c_str());
     LOGD("ro.build.product = %s", prop_build_product.c_str());
 
+    // Prefer the precompiled database, which is looked up in place
+    DeviceDatabase db;
+    if (db.open_file(path)) {
+        for (auto const &codename : { prop_product_device,
+                                      prop_build_product }) {
+            if (db.find_by_codename(codename, device)
+                    && !device.validate()) {
+                return true;
+            }
+        }
+
+        LOGE("Unknown device: %s", prop_product_device.c_str());
+        return false;
+    }
+
     std::vector<unsigned char> contents;
     if (!util::file_read_all(path, &contents)) {
         LOGE("%s: Failed to read file: %s", path, strerror(errno));
@@ -212,15 +229,16 @@ static void generate_aroma_config(std::vector<unsigned char> *data)
     Roms roms;
     roms.add_installed();
 
+    std::vector<RomMetadata> metadata;
+    rom_metadata_get_all(roms.roms, metadata);
+
     for (std::size_t i = 0; i < roms.roms.size(); ++i) {
         const std::shared_ptr<Rom> &rom = roms.roms[i];
 
-        std::string config_path = rom->config_path();
         std::string name = rom->id;
 
-        RomConfig config;
-        if (config.load_file(config_path) && !config.name.empty()) {
-            name = config.name;
+        if (metadata[i].has_config && !metadata[i].config.name.empty()) {
+            name = metadata[i].config.name;
         }
 
         rom_menu_items += mb::format("\"%s\", \"\", \"@default\",\n",
@@ -414,11 +432,18 @@ private:
         }
 
         // Write data to file
-        char buf[32768];
+        PooledBuffer buf(io_block_size());
         ssize_t n;
 
-        while ((n = read(fd, buf, sizeof(buf))) > 0) {
-            ret = zipWriteInFileInZip(_zf, buf, n);
+        if (!buf) {
+            zipCloseFileInZip(_zf);
+
+            LOGE("Failed to allocate buffer: %s", strerror(errno));
+            return false;
+        }
+
+        while ((n = read(fd, buf.data(), buf.size())) > 0) {
+            ret = zipWriteInFileInZip(_zf, buf.data(), n);
             if (ret != ZIP_OK) {
                 LOGW("minizip: Failed to write data (error code: %d): %s",
                      ret, path.c_str());
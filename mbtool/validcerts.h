@@ -22,4 +22,5 @@
 #include <string>
 #include <vector>
 
-extern std::vector<std::string> valid_certs;
\ No newline at end of file
+extern std::vector<std::string> valid_certs;
+extern std::vector<std::string> valid_sign_keys;
\ No newline at end of file
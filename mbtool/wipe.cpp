@@ -20,7 +20,6 @@
 #include "wipe.h"
 
 #include <algorithm>
-
 #include <cerrno>
 #include <cstring>
 
@@ -30,78 +29,17 @@
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/delete.h"
-#include "mbutil/fts.h"
 #include "mbutil/mount.h"
 #include "mbutil/string.h"
 
 #include "multiboot.h"
+#include "task_graph.h"
+
+#define WIPE_MAX_THREADS        4u
 
 namespace mb
 {
 
-class WipeDirectory : public util::FTSWrapper {
-public:
-    WipeDirectory(std::string path, std::vector<std::string> exclusions)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _exclusions(std::move(exclusions))
-    {
-    }
-
-    virtual int on_changed_path() override
-    {
-        // Exclude first-level directories
-        if (_curr->fts_level == 1) {
-            if (std::find(_exclusions.begin(), _exclusions.end(), _curr->fts_name)
-                    != _exclusions.end()) {
-                return Action::FTS_Skip;
-            }
-        }
-
-        return Action::FTS_OK;
-    }
-
-    virtual int on_reached_directory_pre() override
-    {
-        // Do nothing. Need depth-first search, so directories are deleted
-        // in FTS_DP
-        return Action::FTS_OK;
-    }
-
-    virtual int on_reached_directory_post() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_file() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_symlink() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_special_file() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-private:
-    std::vector<std::string> _exclusions;
-
-    bool delete_path()
-    {
-        if (_curr->fts_level >= 1 && remove(_curr->fts_accpath) < 0) {
-            mb::format(_error_msg, "%s: Failed to remove: %s",
-                       _curr->fts_path, strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return false;
-        }
-        return true;
-    }
-};
-
 bool wipe_directory(const std::string &directory,
                     const std::vector<std::string> &exclusions)
 {
@@ -115,8 +53,9 @@ bool wipe_directory(const std::string &directory,
     new_exclusions.insert(new_exclusions.end(),
                           exclusions.begin(), exclusions.end());
 
-    WipeDirectory wd(directory, std::move(new_exclusions));
-    return wd.run();
+    return util::delete_recursive(
+            directory, util::DELETE_CONTENTS_ONLY | util::DELETE_PARALLEL,
+            new_exclusions);
 }
 
 /*!
@@ -196,7 +135,7 @@ static bool log_wipe_directory(const std::string &mountpoint,
 static bool log_delete_recursive(const std::string &path)
 {
     LOGV("Recursively deleting %s", path.c_str());
-    bool ret = util::delete_recursive(path);
+    bool ret = util::delete_recursive(path, util::DELETE_PARALLEL, {});
     LOGV("-> %s", ret ? "Succeeded" : "Failed");
     return ret;
 }
@@ -304,4 +243,100 @@ bool wipe_multiboot(const std::shared_ptr<Rom> &rom)
     return log_delete_recursive(multiboot_path);
 }
 
+static bool wipe_target(const std::shared_ptr<Rom> &rom, WipeTarget target)
+{
+    switch (target) {
+    case WipeTarget::System:
+        return wipe_system(rom);
+    case WipeTarget::Cache:
+        return wipe_cache(rom);
+    case WipeTarget::Data:
+        return wipe_data(rom);
+    case WipeTarget::DalvikCache:
+        return wipe_dalvik_cache(rom);
+    case WipeTarget::Multiboot:
+        return wipe_multiboot(rom);
+    }
+    return false;
+}
+
+static const char * wipe_target_name(WipeTarget target)
+{
+    switch (target) {
+    case WipeTarget::System:
+        return "system";
+    case WipeTarget::Cache:
+        return "cache";
+    case WipeTarget::Data:
+        return "data";
+    case WipeTarget::DalvikCache:
+        return "dalvik-cache";
+    case WipeTarget::Multiboot:
+        return "multiboot";
+    }
+    return "unknown";
+}
+
+/*!
+ * \brief Check whether two targets touch the same files
+ *
+ * The dalvik-cache lives inside the data or cache directory, so it must not
+ * be wiped at the same time as either of them.
+ */
+static bool wipe_targets_overlap(WipeTarget a, WipeTarget b)
+{
+    if (a == b) {
+        return true;
+    }
+    if (a == WipeTarget::DalvikCache) {
+        std::swap(a, b);
+    }
+    return b == WipeTarget::DalvikCache
+            && (a == WipeTarget::Data || a == WipeTarget::Cache);
+}
+
+/*!
+ * \brief Wipe several targets of a ROM
+ *
+ * Targets that do not overlap are wiped concurrently. Overlapping targets are
+ * wiped in the order they are listed. A failure does not stop the remaining
+ * targets from being wiped.
+ *
+ * \param rom ROM to wipe
+ * \param targets Targets to wipe
+ *
+ * \return Result for each entry in \p targets
+ */
+std::vector<bool> wipe_targets(const std::shared_ptr<Rom> &rom,
+                               const std::vector<WipeTarget> &targets)
+{
+    // std::vector<bool> is not safe to write from several threads
+    std::vector<char> results(targets.size(), false);
+    TaskGraph tasks;
+
+    for (size_t i = 0; i < targets.size(); ++i) {
+        std::vector<std::string> requirements;
+        for (size_t j = 0; j < i; ++j) {
+            if (wipe_targets_overlap(targets[i], targets[j])) {
+                requirements.push_back(format("wipe.%zu", j));
+            }
+        }
+
+        tasks.add(format("wipe.%zu", i), std::move(requirements), [&, i] {
+            WipeTarget target = targets[i];
+            results[i] = wipe_target(rom, target);
+            LOGD("%s: Wiping %s %s", rom->id.c_str(),
+                 wipe_target_name(target),
+                 results[i] ? "succeeded" : "failed");
+            // Never fail the graph so the other targets still get wiped
+            return true;
+        });
+    }
+
+    tasks.run(std::min<unsigned int>(
+            WIPE_MAX_THREADS, std::max<size_t>(targets.size(), 1)));
+
+    return std::vector<bool>(results.begin(), results.end());
+}
+
 }
@@ -32,4 +32,16 @@ bool wipe_data(const std::shared_ptr<Rom> &rom);
 bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom);
 bool wipe_multiboot(const std::shared_ptr<Rom> &rom);
 
+enum class WipeTarget
+{
+    System,
+    Cache,
+    Data,
+    DalvikCache,
+    Multiboot,
+};
+
+std::vector<bool> wipe_targets(const std::shared_ptr<Rom> &rom,
+                               const std::vector<WipeTarget> &targets);
+
 }
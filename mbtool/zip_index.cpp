@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "zip_index.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mbutil/directory.h"
+#include "mbutil/finally.h"
+#include "mbutil/path.h"
+
+#define ZIP_DEFAULT_FILE_MODE   0644
+
+#define ZIP_READ_BUF_SIZE       65536
+
+namespace mb
+{
+
+ZipIndex::ZipIndex()
+{
+}
+
+ZipIndex::~ZipIndex()
+{
+    close();
+}
+
+/*!
+ * \brief Open a zip file and index its central directory
+ *
+ * \return Whether the central directory was successfully read
+ */
+bool ZipIndex::open(const std::string &path)
+{
+    close();
+
+    if (!_zip.open(path)) {
+        LOGE("%s", _zip.error_string().c_str());
+        return false;
+    }
+
+    _path = path;
+
+    LOGD("%s: Indexed %zu zip entries", path.c_str(), _zip.entries().size());
+
+    return true;
+}
+
+void ZipIndex::close()
+{
+    _zip.close();
+    _path.clear();
+}
+
+bool ZipIndex::is_open() const
+{
+    return _zip.is_open();
+}
+
+/*!
+ * \brief Look up an entry by its full path in the archive
+ *
+ * \return Pointer to the entry or nullptr if it does not exist
+ */
+const ZipEntry * ZipIndex::find(const std::string &name) const
+{
+    return _zip.find(name);
+}
+
+bool ZipIndex::exists(const std::string &name) const
+{
+    return find(name) != nullptr;
+}
+
+bool ZipIndex::open_entry(const std::string &name, ZipEntryFile &file,
+                          const ZipEntry **entry_out)
+{
+    const ZipEntry *entry = find(name);
+    if (!entry) {
+        LOGE("%s: Entry not found in zip: %s", _path.c_str(), name.c_str());
+        return false;
+    }
+
+    if (!file.open(_zip, *entry)) {
+        LOGE("%s: Failed to open %s: %s", _path.c_str(), name.c_str(),
+             file.error_string().c_str());
+        return false;
+    }
+
+    *entry_out = entry;
+    return true;
+}
+
+/*!
+ * \brief Read the contents of an entry into memory
+ */
+bool ZipIndex::read(const std::string &name,
+                    std::vector<unsigned char> *data_out)
+{
+    const ZipEntry *entry = find(name);
+    if (!entry) {
+        LOGE("%s: Entry not found in zip: %s", _path.c_str(), name.c_str());
+        return false;
+    }
+
+    if (!_zip.read(*entry, *data_out)) {
+        LOGE("%s: Failed to read %s: %s", _path.c_str(), name.c_str(),
+             _zip.error_string().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Extract an entry to a file
+ *
+ * Parent directories of \a target are created as needed and the permissions
+ * stored in the archive are applied.
+ */
+bool ZipIndex::extract(const std::string &name, const std::string &target)
+{
+    ZipEntryFile file;
+    const ZipEntry *entry;
+    if (!open_entry(name, file, &entry)) {
+        return false;
+    }
+
+    mode_t mode = static_cast<mode_t>(
+            zip_entry_unix_mode(*entry, ZIP_DEFAULT_FILE_MODE));
+
+    std::string parent = util::dir_name(target);
+    if (!util::mkdir_recursive(parent, 0755)) {
+        LOGE("%s: Failed to create directory: %s",
+             parent.c_str(), strerror(errno));
+        return false;
+    }
+
+    int fd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    mode);
+    if (fd < 0) {
+        LOGE("%s: Failed to open for writing: %s",
+             target.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    });
+
+    unsigned char buf[ZIP_READ_BUF_SIZE];
+    size_t n;
+
+    while (true) {
+        if (!file.read(buf, sizeof(buf), n)) {
+            LOGE("%s: Failed before reaching EOF of %s: %s",
+                 _path.c_str(), name.c_str(), file.error_string().c_str());
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        unsigned char *ptr = buf;
+        size_t remaining = n;
+
+        while (remaining > 0) {
+            ssize_t written = write(fd, ptr, remaining);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOGE("%s: Failed to write: %s",
+                     target.c_str(), strerror(errno));
+                return false;
+            }
+            ptr += written;
+            remaining -= static_cast<size_t>(written);
+        }
+    }
+
+    // The mode passed to open() is subject to the umask
+    if (fchmod(fd, mode) < 0) {
+        LOGE("%s: Failed to chmod: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    int ret = ::close(fd);
+    fd = -1;
+    if (ret < 0) {
+        LOGE("%s: Failed to close: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of DualBootPatcher
+ *
+ * DualBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * DualBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "mbcommon/zip.h"
+
+namespace mb
+{
+
+/*!
+ * \brief Zip reader with constant time lookup of entries by name
+ *
+ * This is a thin wrapper around mb::ZipArchive that logs errors and extracts
+ * entries to files with the permissions stored in the archive.
+ */
+class ZipIndex
+{
+public:
+    ZipIndex();
+    ~ZipIndex();
+
+    ZipIndex(const ZipIndex &) = delete;
+    ZipIndex & operator=(const ZipIndex &) = delete;
+
+    bool open(const std::string &path);
+    void close();
+
+    bool is_open() const;
+
+    const ZipEntry * find(const std::string &name) const;
+    bool exists(const std::string &name) const;
+
+    bool read(const std::string &name, std::vector<unsigned char> *data_out);
+    bool extract(const std::string &name, const std::string &target);
+
+private:
+    std::string _path;
+    ZipArchive _zip;
+
+    bool open_entry(const std::string &name, ZipEntryFile &file,
+                    const ZipEntry **entry_out);
+};
+
+}
@@ -3,6 +3,7 @@
 #include "compile.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -41,6 +42,118 @@ out:
     return rc;
 }
 
+/* Maximum number of threads used for compiling regexes */
+#define MAX_REGCOMP_THREADS 8
+/* Don't bother with threads for small files */
+#define MIN_SPECS_PER_THREAD 256
+
+struct regcomp_ctx {
+    struct pcre_shim *shim;
+    struct saved_data *data;
+    unsigned int start;
+    unsigned int stride;
+    /* Index of the first spec that failed to compile or nspec if none */
+    unsigned int failed;
+    struct regex_error_data error_data;
+};
+
+static void *regcomp_thread(void *arg)
+{
+    struct regcomp_ctx *ctx = (struct regcomp_ctx *) arg;
+    struct saved_data *data = ctx->data;
+    unsigned int i;
+
+    ctx->failed = data->nspec;
+
+    for (i = ctx->start; i < data->nspec; i += ctx->stride) {
+        if (compile_regex(ctx->shim, data, &data->spec_arr[i],
+                          &ctx->error_data) < 0) {
+            ctx->failed = i;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Compile the regexes of all specs. PCRE compilation is the most expensive
+ * part of generating the binary file, so the specs are split between threads.
+ * The specs are distributed round-robin so that runs of complex lines are
+ * spread across all of the threads.
+ */
+static int compile_specs(struct pcre_shim *shim, struct saved_data *data,
+                         const char *filename)
+{
+    struct regcomp_ctx ctx[MAX_REGCOMP_THREADS];
+    pthread_t threads[MAX_REGCOMP_THREADS];
+    unsigned int started = 1;
+    unsigned int n_threads;
+    unsigned int failed;
+    unsigned int i;
+    long n_cpus;
+    char errbuf[256];
+
+    n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = n_cpus > 0 ? (unsigned int) n_cpus : 1;
+    if (n_threads > MAX_REGCOMP_THREADS) {
+        n_threads = MAX_REGCOMP_THREADS;
+    }
+    if (n_threads > data->nspec / MIN_SPECS_PER_THREAD) {
+        n_threads = data->nspec / MIN_SPECS_PER_THREAD;
+    }
+    if (n_threads == 0) {
+        n_threads = 1;
+    }
+
+    for (i = 0; i < n_threads; ++i) {
+        ctx[i].shim = shim;
+        ctx[i].data = data;
+        ctx[i].start = i;
+        ctx[i].stride = n_threads;
+    }
+
+    /* The first slice is compiled on this thread */
+    for (; started < n_threads; ++started) {
+        if (pthread_create(&threads[started], NULL, &regcomp_thread,
+                           &ctx[started]) != 0) {
+            break;
+        }
+    }
+
+    regcomp_thread(&ctx[0]);
+
+    /* Compile the slices of any threads that failed to start */
+    for (i = started; i < n_threads; ++i) {
+        regcomp_thread(&ctx[i]);
+    }
+
+    for (i = 1; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* Report the error for the earliest line */
+    failed = 0;
+    for (i = 1; i < n_threads; ++i) {
+        if (ctx[i].failed < ctx[failed].failed) {
+            failed = i;
+        }
+    }
+
+    if (ctx[failed].failed < data->nspec) {
+        struct spec *spec = &data->spec_arr[ctx[failed].failed];
+
+        regex_format_error(shim, &ctx[failed].error_data,
+                           errbuf, sizeof(errbuf));
+        selinux_log("%s:  line %u has invalid regex %s:  %s\n",
+                    filename, spec->lineno, spec->regex_str, errbuf);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
 /*
  * File Format
  *
@@ -276,12 +389,18 @@ int compile(struct pcre_shim *shim,
     }
 
     rec->data = data;
+    data->defer_regcomp = 1;
 
     rc = process_file(shim, rec, source_file);
     if (rc < 0) {
         goto err;
     }
 
+    rc = compile_specs(shim, data, source_file);
+    if (rc < 0) {
+        goto err;
+    }
+
     rc = sort_specs(data);
     if (rc) {
         goto err;
@@ -44,6 +44,7 @@ struct spec
     char regcomp;                   /* regex_str has been compiled to regex */
     char from_mmap;                 /* this spec is from an mmap of the data */
     size_t prefix_len;              /* length of fixed path prefix */
+    unsigned int lineno;            /* line number for diagnostic messages */
 };
 
 /* A regular expression stem */
@@ -71,6 +72,12 @@ struct saved_data
     struct stem *stem_arr;
     int num_stems;
     int alloc_stems;
+
+    /*
+     * If set, process_line() doesn't compile the regexes and the caller is
+     * responsible for calling compile_regex() on every spec.
+     */
+    char defer_regcomp;
 };
 
 static inline mode_t string_to_mode(char *mode)
@@ -422,6 +429,7 @@ static inline int process_line(struct pcre_shim *shim,
     spec_arr[nspec].mode = 0;
 
     spec_arr[nspec].lr.ctx_raw = context;
+    spec_arr[nspec].lineno = lineno;
 
     /*
      * bump data->nspecs to cause closef() to cover it in its free
@@ -429,7 +437,8 @@ static inline int process_line(struct pcre_shim *shim,
      */
     data->nspec++;
 
-    if (compile_regex(shim, data, &spec_arr[nspec], &error_data)) {
+    if (!data->defer_regcomp
+            && compile_regex(shim, data, &spec_arr[nspec], &error_data)) {
         selinux_log("%s:  line %u has invalid regex %s:  %s\n",
                     path, lineno, regex,
                     (errbuf ? errbuf : "out of memory"));
@@ -19,8 +19,17 @@
 
 #define FUSE_USE_VERSION 26
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
 #include <mutex>
 #include <new>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <cerrno>
 #include <cinttypes>
@@ -36,6 +45,7 @@
 
 // libmbcommon
 #include "mbcommon/file.h"
+#include "mbcommon/file/memory.h"
 #include "mbcommon/file/standard.h"
 
 // libmbsparse
@@ -47,100 +57,296 @@
 #define OFF_T off_t
 #endif
 
+// Decoded blocks are cached so that the kernel's small FUSE reads do not each
+// go through the sparse decoder
+#define CACHE_BLOCK_SIZE        (1024 * 1024)
+#define CACHE_MAX_BLOCKS        16
+#define READAHEAD_BLOCKS        4
+#define FUSE_MAX_READ           CACHE_BLOCK_SIZE
+
 static char source_fd_path[50];
 static uint64_t sparse_size;
+// Chunk index shared by all opened instances of the sparse file
+static void *sparse_index_data;
+static size_t sparse_index_size;
 
 struct context
 {
     mb::StandardFile source_file;
     mb::sparse::SparseFile sparse_file;
-    std::mutex mutex;
+    // End offset of the previous read for detecting sequential access
+    std::atomic<uint64_t> last_end{0};
 };
 
+typedef std::shared_ptr<const std::vector<char>> Block;
+
 /*!
- * \brief Open callback for fuse
+ * \brief LRU cache of decoded blocks shared by all opened instances
  */
-static int fuse_open(const char *path, fuse_file_info *fi)
+class BlockCache
 {
-    (void) path;
+public:
+    Block get(uint64_t index)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto it = _map.find(index);
+        if (it == _map.end()) {
+            return {};
+        }
 
-    if (fi->flags & (O_WRONLY | O_RDWR)) {
-        return -EROFS;
+        _lru.splice(_lru.begin(), _lru, it->second);
+        return it->second->second;
     }
 
-    context *ctx = new(std::nothrow) context();
-    if (!ctx) {
-        return -ENOMEM;
+    bool contains(uint64_t index)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _map.find(index) != _map.end();
     }
 
+    void put(uint64_t index, Block block)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto it = _map.find(index);
+        if (it != _map.end()) {
+            _lru.erase(it->second);
+            _map.erase(it);
+        }
+
+        _lru.emplace_front(index, std::move(block));
+        _map[index] = _lru.begin();
+
+        while (_lru.size() > CACHE_MAX_BLOCKS) {
+            _map.erase(_lru.back().first);
+            _lru.pop_back();
+        }
+    }
+
+private:
+    typedef std::list<std::pair<uint64_t, Block>> LruList;
+
+    std::mutex _mutex;
+    LruList _lru;
+    std::unordered_map<uint64_t, LruList::iterator> _map;
+};
+
+static BlockCache block_cache;
+
+// Read-ahead is done by a single thread with its own instance of the sparse
+// file
+static std::mutex readahead_mutex;
+static std::condition_variable readahead_cv;
+static std::deque<uint64_t> readahead_queue;
+static bool readahead_stop;
+static std::thread readahead_thread;
+
+static int error_to_errno(const std::error_code &error)
+{
+    return (error.category() == std::generic_category()
+            || error.category() == std::system_category())
+            ? -error.value() : -EIO;
+}
+
+/*!
+ * \brief Open the source file and sparse file for a context
+ *
+ * \return 0 on success or negative errno on failure
+ */
+static int open_context(context *ctx)
+{
     if (!ctx->source_file.open(source_fd_path, mb::FileOpenMode::READ_ONLY)) {
         fprintf(stderr, "%s: Failed to open file: %s\n",
                 source_fd_path, ctx->source_file.error_string().c_str());
-        auto error = ctx->source_file.error();
-        delete ctx;
-        return (error.category() == std::generic_category()
-                || error.category() == std::system_category())
-                ? -error.value() : -EIO;
+        return error_to_errno(ctx->source_file.error());
     }
 
     if (!ctx->sparse_file.open(&ctx->source_file)) {
         fprintf(stderr, "%s: Failed to open sparse file: %s\n",
                 source_fd_path, ctx->sparse_file.error_string().c_str());
-        auto error = ctx->sparse_file.error();
-        delete ctx;
-        return (error.category() == std::generic_category()
-                || error.category() == std::system_category())
-                ? -error.value() : -EIO;
+        return error_to_errno(ctx->sparse_file.error());
     }
 
-    fi->fh = reinterpret_cast<uint64_t>(ctx);
+    // Load the prebuilt chunk index so that random reads don't need to walk
+    // the chunk headers
+    mb::MemoryFile index_file(sparse_index_data, sparse_index_size);
+    if (!ctx->sparse_file.load_index(index_file)) {
+        fprintf(stderr, "%s: Failed to load sparse index: %s\n",
+                source_fd_path, ctx->sparse_file.error_string().c_str());
+        return -EIO;
+    }
 
     return 0;
 }
 
 /*!
- * \brief Release callback for fuse
+ * \brief Decode a block of the sparse file
+ *
+ * \return 0 on success or negative errno on failure
  */
-static int fuse_release(const char *path, fuse_file_info *fi)
+static int decode_block(mb::sparse::SparseFile &sparse_file, uint64_t index,
+                        Block &block)
 {
-    (void) path;
+    uint64_t offset = index * CACHE_BLOCK_SIZE;
+    size_t size = std::min<uint64_t>(CACHE_BLOCK_SIZE, sparse_size - offset);
 
-    context *ctx = reinterpret_cast<context *>(fi->fh);
-    delete ctx;
+    auto data = std::make_shared<std::vector<char>>(size);
+    size_t n;
+
+    if (!sparse_file.read_at(offset, data->data(), size, n)) {
+        fprintf(stderr, "%s: Failed to read block %" PRIu64 ": %s\n",
+                source_fd_path, index, sparse_file.error_string().c_str());
+        return error_to_errno(sparse_file.error());
+    }
+
+    data->resize(n);
+    block = std::move(data);
 
     return 0;
 }
 
 /*!
- * \brief Read from sparse file
+ * \brief Queue up to READAHEAD_BLOCKS blocks starting at \p first
+ */
+static void queue_readahead(uint64_t first)
+{
+    {
+        std::lock_guard<std::mutex> lock(readahead_mutex);
+
+        for (uint64_t i = first; i < first + READAHEAD_BLOCKS
+                && i * CACHE_BLOCK_SIZE < sparse_size; ++i) {
+            if (!block_cache.contains(i)
+                    && std::find(readahead_queue.begin(),
+                                 readahead_queue.end(), i)
+                            == readahead_queue.end()) {
+                readahead_queue.push_back(i);
+            }
+        }
+
+        // Stale requests from an earlier sequential stream are not useful
+        while (readahead_queue.size() > 2 * READAHEAD_BLOCKS) {
+            readahead_queue.pop_front();
+        }
+    }
+
+    readahead_cv.notify_one();
+}
+
+static void readahead_loop()
+{
+    context ctx;
+
+    if (open_context(&ctx) < 0) {
+        return;
+    }
+
+    while (true) {
+        uint64_t index;
+
+        {
+            std::unique_lock<std::mutex> lock(readahead_mutex);
+            readahead_cv.wait(lock, []{
+                return readahead_stop || !readahead_queue.empty();
+            });
+
+            if (readahead_stop) {
+                break;
+            }
+
+            index = readahead_queue.front();
+            readahead_queue.pop_front();
+        }
+
+        Block block;
+        if (!block_cache.contains(index)
+                && decode_block(ctx.sparse_file, index, block) == 0) {
+            block_cache.put(index, std::move(block));
+        }
+    }
+}
+
+/*!
+ * \brief Init callback for fuse
  *
- * \warning Bad stuff will happen if \a ctx->mutex is not locked when this
- *          function is called
+ * The read-ahead thread is started here instead of in main() because fuse
+ * forks when daemonizing.
  */
-static int fuse_read_locked(context *ctx, char *buf, size_t size,
-                            OFF_T offset)
+static void * fuse_init(fuse_conn_info *conn)
 {
-    // Seek to position
-    if (!ctx->sparse_file.seek(offset, SEEK_SET, nullptr)) {
-        auto error = ctx->sparse_file.error();
-        return (error.category() == std::generic_category()
-                || error.category() == std::system_category())
-                ? -error.value() : -EIO;
+    conn->async_read = 1;
+    conn->max_readahead = FUSE_MAX_READ;
+
+    readahead_thread = std::thread(&readahead_loop);
+
+    return nullptr;
+}
+
+/*!
+ * \brief Destroy callback for fuse
+ */
+static void fuse_destroy(void *userdata)
+{
+    (void) userdata;
+
+    {
+        std::lock_guard<std::mutex> lock(readahead_mutex);
+        readahead_stop = true;
     }
+    readahead_cv.notify_one();
 
-    size_t n;
-    if (!ctx->sparse_file.read(buf, size, n)) {
-        auto error = ctx->sparse_file.error();
-        return (error.category() == std::generic_category()
-                || error.category() == std::system_category())
-                ? -error.value() : -EIO;
+    if (readahead_thread.joinable()) {
+        readahead_thread.join();
     }
+}
+
+/*!
+ * \brief Open callback for fuse
+ */
+static int fuse_open(const char *path, fuse_file_info *fi)
+{
+    (void) path;
+
+    if (fi->flags & (O_WRONLY | O_RDWR)) {
+        return -EROFS;
+    }
+
+    context *ctx = new(std::nothrow) context();
+    if (!ctx) {
+        return -ENOMEM;
+    }
+
+    int ret = open_context(ctx);
+    if (ret < 0) {
+        delete ctx;
+        return ret;
+    }
+
+    fi->fh = reinterpret_cast<uint64_t>(ctx);
 
-    return n;
+    return 0;
+}
+
+/*!
+ * \brief Release callback for fuse
+ */
+static int fuse_release(const char *path, fuse_file_info *fi)
+{
+    (void) path;
+
+    context *ctx = reinterpret_cast<context *>(fi->fh);
+    delete ctx;
+
+    return 0;
 }
 
 /*!
  * \brief Read callback for fuse
+ *
+ * The chunk index is fully loaded in fuse_open(), so SparseFile::read_at() does
+ * not modify any shared state and concurrent reads do not need to be
+ * serialized. Reads are served from the block cache and sequential reads
+ * trigger read-ahead of the following blocks.
  */
 static int fuse_read(const char *path, char *buf, size_t size, OFF_T offset,
                      fuse_file_info *fi)
@@ -149,8 +355,47 @@ static int fuse_read(const char *path, char *buf, size_t size, OFF_T offset,
 
     context *ctx = reinterpret_cast<context *>(fi->fh);
 
-    std::lock_guard<std::mutex> lock(ctx->mutex);
-    return fuse_read_locked(ctx, buf, size, offset);
+    if (offset < 0) {
+        return -EINVAL;
+    }
+
+    uint64_t pos = static_cast<uint64_t>(offset);
+    if (pos >= sparse_size) {
+        return 0;
+    }
+    uint64_t end = std::min<uint64_t>(pos + size, sparse_size);
+
+    bool sequential = ctx->last_end.exchange(end) == pos;
+    char *out = buf;
+
+    while (pos < end) {
+        uint64_t index = pos / CACHE_BLOCK_SIZE;
+        size_t block_offset = pos % CACHE_BLOCK_SIZE;
+
+        Block block = block_cache.get(index);
+        if (!block) {
+            int ret = decode_block(ctx->sparse_file, index, block);
+            if (ret < 0) {
+                return ret;
+            }
+            block_cache.put(index, block);
+        }
+
+        if (block_offset >= block->size()) {
+            break;
+        }
+
+        size_t n = std::min<uint64_t>(end - pos, block->size() - block_offset);
+        memcpy(out, block->data() + block_offset, n);
+        out += n;
+        pos += n;
+    }
+
+    if (sequential) {
+        queue_readahead((end + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE);
+    }
+
+    return out - buf;
 }
 
 /*!
@@ -167,7 +412,8 @@ static int fuse_getattr(const char *path, struct stat *stbuf)
 }
 
 /*!
- * \brief Get size of sparse file (needed for fuse_getattr())
+ * \brief Get size of sparse file (needed for fuse_getattr()) and build the
+ *        chunk index
  */
 static int get_sparse_file_size()
 {
@@ -194,6 +440,13 @@ static int get_sparse_file_size()
 
     sparse_size = sparse_file.size();
 
+    mb::MemoryFile index_file(&sparse_index_data, &sparse_index_size);
+    if (!index_file.is_open() || !sparse_file.save_index(index_file)) {
+        fprintf(stderr, "%s: Failed to build sparse index: %s\n",
+                source_fd_path, sparse_file.error_string().c_str());
+        return -EIO;
+    }
+
     return 0;
 }
 
@@ -291,11 +544,25 @@ int main(int argc, char *argv[])
 
     fuse_operations fuse_oper;
     memset(&fuse_oper, 0, sizeof(fuse_oper));
+    fuse_oper.init    = fuse_init;
+    fuse_oper.destroy = fuse_destroy;
     fuse_oper.getattr = fuse_getattr;
     fuse_oper.open    = fuse_open;
     fuse_oper.read    = fuse_read;
     fuse_oper.release = fuse_release;
 
+    // Allow the kernel to send reads as large as a cached block
+    if (!arg_ctx.show_help) {
+        char max_read_opt[32];
+        snprintf(max_read_opt, sizeof(max_read_opt), "-omax_read=%d",
+                 FUSE_MAX_READ);
+
+        if (fuse_opt_add_arg(&args, max_read_opt) == -1) {
+            close(fd);
+            return EXIT_FAILURE;
+        }
+    }
+
     int fuse_ret = fuse_main(args.argc, args.argv, &fuse_oper, nullptr);
 
     if (!arg_ctx.show_help) {
@@ -303,6 +570,7 @@ int main(int argc, char *argv[])
     }
 
     fuse_opt_free_args(&args);
+    free(sparse_index_data);
     free(arg_ctx.source_file);
     free(arg_ctx.target_file);
 
@@ -18,7 +18,11 @@
  */
 
 #include <algorithm>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <cerrno>
@@ -28,13 +32,19 @@
 #include <cstring>
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/wait.h>
 
 // libmbcommon
-#include "mbcommon/file/callbacks.h"
-#include "mbcommon/file/standard.h"
+#include "mbcommon/buffer_pool.h"
+#include "mbcommon/file/async_io.h"
+#include "mbcommon/file/buffered.h"
+#include "mbcommon/file/fd.h"
+#include "mbcommon/zip.h"
 
 // libmbsparse
 #include "mbsparse/sparse.h"
@@ -53,6 +63,8 @@
 #include <archive.h>
 #include <archive_entry.h>
 
+#include <zlib.h>
+
 #define DEBUG_SKIP_FLASH_SYSTEM 0
 #define DEBUG_SKIP_FLASH_CSC    0
 #define DEBUG_SKIP_FLASH_BOOT   0
@@ -62,6 +74,7 @@
 #define BOOT_IMAGE_FILE         "boot.img"
 #define FUSE_SPARSE_FILE        "fuse-sparse"
 #define DEVICE_JSON_FILE        "multiboot/device.json"
+#define VERIFY_FLASH_FILE       "multiboot/verify-flash"
 
 #define TEMP_CACHE_SPARSE_FILE  "/tmp/cache.img.ext4"
 #define TEMP_CACHE_MOUNT_FILE   "/tmp/cache.img"
@@ -74,6 +87,20 @@
 #define PROP_SYSTEM_DEV         "system"
 #define PROP_BOOT_DEV           "boot"
 
+// Image writer buffers. The reading thread fills one buffer while the others
+// are being written out.
+#define WRITER_BUF_SIZE         (2 * 1024 * 1024)
+#define WRITER_BUF_COUNT        4
+#define WRITER_QUEUE_DEPTH      16
+#define WRITER_ALIGNMENT        4096
+#define WRITER_ZERO_RUN_MIN     (256 * 1024)
+#define WRITER_USE_O_DIRECT     1
+
+// Post-flash verification. Each extent's checksum is compared separately so
+// that a mismatch can be reported with its location.
+#define VERIFY_EXTENT_SIZE      (64 * 1024 * 1024)
+#define VERIFY_BUF_SIZE         (4 * 1024 * 1024)
+
 typedef std::unique_ptr<archive, decltype(archive_free) *> ScopedArchive;
 
 using namespace mb::device;
@@ -93,12 +120,34 @@ static char sales_code[10];
 static std::string system_block_dev;
 static std::string boot_block_dev;
 
+// Central directory of the zip, read once by index_zip()
+static mb::ZipArchive zip_index;
+static std::string device_json;
+
+// Partitions are flashed concurrently, so output must not be interleaved
+static std::mutex output_mutex;
+
+// Combined progress of all concurrent extractions. Each task's progress is
+// weighted by its size.
+struct ProgressTracker
+{
+    std::mutex mutex;
+    std::vector<uint64_t> weights;
+    std::vector<double> fractions;
+    uint64_t total_weight = 0;
+    double reported = 0;
+};
+
+static ProgressTracker progress;
+
 MB_PRINTF(1, 2)
 void ui_print(const char *fmt, ...)
 {
     va_list ap;
     va_list copy;
 
+    std::lock_guard<std::mutex> lock(output_mutex);
+
     va_start(ap, fmt);
 
     dprintf(output_fd, "ui_print ");
@@ -118,12 +167,14 @@ void ui_print(const char *fmt, ...)
 
 void set_progress(double frac)
 {
+    std::lock_guard<std::mutex> lock(output_mutex);
     dprintf(output_fd, "set_progress %f\n", frac);
 }
 
 MB_PRINTF(1, 2)
 void error(const char *fmt, ...)
 {
+    std::lock_guard<std::mutex> lock(output_mutex);
     va_list ap;
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
@@ -134,6 +185,7 @@ void error(const char *fmt, ...)
 MB_PRINTF(1, 2)
 void info(const char *fmt, ...)
 {
+    std::lock_guard<std::mutex> lock(output_mutex);
     va_list ap;
     va_start(ap, fmt);
     vprintf(fmt, ap);
@@ -141,6 +193,51 @@ void info(const char *fmt, ...)
     fputc('\n', stdout);
 }
 
+/*!
+ * \brief Register a task with the combined progress
+ *
+ * \param weight Weight of the task (eg. the size of the zip entry)
+ *
+ * \return ID to pass to progress_update()
+ */
+static size_t progress_add_task(uint64_t weight)
+{
+    std::lock_guard<std::mutex> lock(progress.mutex);
+    progress.weights.push_back(std::max<uint64_t>(weight, 1));
+    progress.fractions.push_back(0);
+    progress.total_weight += progress.weights.back();
+    return progress.weights.size() - 1;
+}
+
+static void progress_update(size_t task, double frac)
+{
+    std::lock_guard<std::mutex> lock(progress.mutex);
+
+    progress.fractions[task] = frac;
+
+    double combined = 0;
+    for (size_t i = 0; i < progress.weights.size(); ++i) {
+        combined += progress.fractions[i] * progress.weights[i];
+    }
+    combined /= progress.total_weight;
+
+    // Rate limit: update progress only after difference exceeds 0.1%
+    if (combined - progress.reported >= 0.001) {
+        set_progress(combined);
+        progress.reported = combined;
+    }
+}
+
+static void progress_reset()
+{
+    std::lock_guard<std::mutex> lock(progress.mutex);
+    progress.weights.clear();
+    progress.fractions.clear();
+    progress.total_weight = 0;
+    progress.reported = 0;
+    set_progress(0);
+}
+
 static bool mount_system()
 {
     // mbtool will redirect the call
@@ -175,45 +272,57 @@ static bool umount_system()
     return WIFEXITED(status) && WEXITSTATUS(status) == 0;
 }
 
-static bool la_open_zip(archive *a, const char *filename)
+/*!
+ * \brief Read the zip's central directory and load the device definition
+ *
+ * This is the only time the zip's headers are read. Entries are then opened
+ * directly at their offsets.
+ */
+static bool index_zip()
 {
-    if (archive_read_support_format_zip(a) != ARCHIVE_OK) {
-        error("libarchive: Failed to enable zip support: %s",
-              archive_error_string(a));
+    device_json.clear();
+
+    if (!zip_index.open(zip_file)) {
+        error("%s", zip_index.error_string().c_str());
         return false;
     }
 
-    if (archive_read_open_filename(a, zip_file, 10240) != ARCHIVE_OK) {
-        error("libarchive: %s: Failed to open zip: %s",
-              filename, archive_error_string(a));
+    const mb::ZipEntry *entry = zip_index.find(DEVICE_JSON_FILE);
+    if (!entry) {
+        error("Failed to find %s in zip", DEVICE_JSON_FILE);
         return false;
     }
 
-    return true;
-}
-
-static ExtractResult la_skip_to(archive *a, const char *filename,
-                                archive_entry **entry)
-{
-    int ret;
-    while ((ret = archive_read_next_header(a, entry)) == ARCHIVE_OK) {
-        const char *name = archive_entry_pathname(*entry);
-        if (!name) {
-            error("libarchive: Failed to get filename");
-            return ExtractResult::ERROR;
-        }
+    static const size_t max_size = 10240;
 
-        if (strcmp(filename, name) == 0) {
-            return ExtractResult::OK;
-        }
+    if (entry->uncompressed_size >= max_size) {
+        error("%s is too large", DEVICE_JSON_FILE);
+        return false;
     }
-    if (ret != ARCHIVE_EOF) {
-        error("libarchive: Failed to read header: %s", archive_error_string(a));
-        return ExtractResult::ERROR;
+
+    mb::ZipEntryFile reader;
+    std::vector<char> buf(max_size);
+    size_t n;
+
+    if (!reader.open(zip_index, *entry)
+            || !reader.read(buf.data(), buf.size(), n)) {
+        error("%s: Failed to read %s: %s",
+              zip_file, DEVICE_JSON_FILE, reader.error_string().c_str());
+        return false;
     }
 
-    error("libarchive: Failed to find %s in zip", filename);
-    return ExtractResult::MISSING;
+    device_json.assign(buf.data(), n);
+
+    return true;
+}
+
+/*!
+ * \brief Get the uncompressed size of a zip entry (0 if it does not exist)
+ */
+static uint64_t zip_entry_size(const char *name)
+{
+    const mb::ZipEntry *entry = zip_index.find(name);
+    return entry ? entry->uncompressed_size : 0;
 }
 
 static bool load_sales_code()
@@ -255,49 +364,10 @@ static bool load_block_devs()
 
     Device device;
 
-    {
-        archive *a = archive_read_new();
-        if (!a) {
-            error("Out of memory");
-            return false;
-        }
-
-        auto close_archive = mb::util::finally([&]{
-            archive_read_free(a);
-        });
-
-        if (!la_open_zip(a, zip_file)) {
-            return false;
-        }
-
-        archive_entry *entry;
-        if (la_skip_to(a, DEVICE_JSON_FILE, &entry) != ExtractResult::OK) {
-            return false;
-        }
-
-        static const size_t max_size = 10240;
-
-        if (archive_entry_size(entry) >= max_size) {
-            error("%s is too large", DEVICE_JSON_FILE);
-            return false;
-        }
-
-        std::vector<char> buf(max_size);
-        la_ssize_t n;
-
-        n = archive_read_data(a, buf.data(), buf.size() - 1);
-        if (n < 0) {
-            error("libarchive: %s: Failed to read %s: %s",
-                  zip_file, DEVICE_JSON_FILE, archive_error_string(a));
-            return false;
-        }
-
-        // Buffer is already NULL-terminated
-        JsonError ret;
-        if (!device_from_json(buf.data(), device, ret)) {
-            error("Failed to load %s", DEVICE_JSON_FILE);
-            return false;
-        }
+    JsonError ret;
+    if (!device_from_json(device_json, device, ret)) {
+        error("Failed to load %s", DEVICE_JSON_FILE);
+        return false;
     }
 
     auto flags = device.validate();
@@ -342,132 +412,624 @@ static bool load_block_devs()
     return true;
 }
 
-static bool cb_zip_read(mb::File &file, void *userdata,
-                        void *buf, size_t size, size_t &bytes_read)
+struct DigestExtent
+{
+    uint64_t offset;
+    uint64_t size;
+    uLong crc;
+};
+
+/*!
+ * \brief Checksums of the data written to an output file
+ *
+ * Only ranges with defined contents are recorded. "Don't care" ranges of
+ * sparse images are left out since they keep whatever was on the device.
+ */
+struct ImageDigest
+{
+    std::string path;
+    std::vector<DigestExtent> extents;
+};
+
+static void digest_update(ImageDigest *digest, uint64_t offset,
+                          const void *data, size_t size)
+{
+    if (!digest || size == 0) {
+        return;
+    }
+
+    auto &extents = digest->extents;
+
+    if (extents.empty()
+            || extents.back().offset + extents.back().size != offset
+            || extents.back().size >= VERIFY_EXTENT_SIZE) {
+        extents.push_back({ offset, 0, crc32(0, nullptr, 0) });
+    }
+
+    auto &extent = extents.back();
+    extent.crc = crc32(extent.crc, static_cast<const Bytef *>(data),
+                       static_cast<uInt>(size));
+    extent.size += size;
+}
+
+/*!
+ * \brief Pipelined writer for image data
+ *
+ * The caller decompresses into one of a small ring of large, aligned buffers
+ * while the previously filled buffers are written out by mb::AsyncIo. Writes
+ * are positional, so skipped ranges never require a seek.
+ *
+ * Block devices are written with O_DIRECT if possible, which avoids copying
+ * the data through the page cache. Long runs of zeros in the data are not
+ * written. They are zeroed with BLKZEROOUT on block devices and left as holes
+ * in regular files, which are truncated when opened.
+ */
+class ImageWriter
+{
+public:
+    ImageWriter();
+    ~ImageWriter();
+
+    ImageWriter(const ImageWriter &) = delete;
+    ImageWriter & operator=(const ImageWriter &) = delete;
+
+    bool open(const char *path);
+    bool finish(uint64_t size);
+
+    void set_digest(ImageDigest *digest);
+
+    char * get_buffer();
+    bool write(char *buf, uint64_t offset, size_t size);
+    bool zero(uint64_t offset, uint64_t size);
+
+private:
+    struct Buffer
+    {
+        ImageWriter *writer;
+        char *data;
+        unsigned int pending;
+        size_t expected;
+        size_t written;
+    };
+
+    static void write_done(void *userdata, std::error_code ec, size_t bytes);
+
+    Buffer * find_buffer(char *data);
+    bool submit(Buffer *buf, uint64_t offset, const char *data, size_t size);
+    bool pwrite_fully(uint64_t offset, const char *data, size_t size);
+    bool zero_range(uint64_t offset, uint64_t size);
+    bool wait_for_writes();
+
+    std::string _path;
+    int _fd;
+    bool _is_blkdev;
+    bool _direct;
+    unsigned int _block_size;
+    mb::FdFile _file;
+    mb::AsyncIo _aio;
+    char *_pool;
+    char *_zeros;
+    Buffer _buffers[WRITER_BUF_COUNT];
+    std::vector<Buffer *> _free;
+    ImageDigest *_digest;
+    bool _failed;
+};
+
+ImageWriter::ImageWriter()
+    : _fd(-1)
+    , _is_blkdev(false)
+    , _direct(false)
+    , _block_size(0)
+    , _pool(nullptr)
+    , _zeros(nullptr)
+    , _buffers()
+    , _digest(nullptr)
+    , _failed(false)
+{
+}
+
+ImageWriter::~ImageWriter()
+{
+    if (_aio.is_open()) {
+        _aio.close();
+    }
+    if (_file.is_open()) {
+        _file.close();
+    }
+    if (_fd >= 0) {
+        close(_fd);
+    }
+    free(_pool);
+    free(_zeros);
+}
+
+bool ImageWriter::open(const char *path)
+{
+    _path = path;
+
+    _fd = open64(path, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | O_LARGEFILE,
+                 0666);
+    if (_fd < 0) {
+        error("%s: Failed to open for writing: %s", path, strerror(errno));
+        return false;
+    }
+
+    struct stat sb;
+    _is_blkdev = fstat(_fd, &sb) == 0 && S_ISBLK(sb.st_mode);
+
+    // The async writes go through a separate O_DIRECT descriptor when the
+    // device's logical block size allows the buffers to be used as is
+    int aio_fd = -1;
+#if WRITER_USE_O_DIRECT
+    int block_size;
+    if (_is_blkdev && ioctl(_fd, BLKSSZGET, &block_size) == 0
+            && block_size > 0 && WRITER_ALIGNMENT % block_size == 0) {
+        aio_fd = open64(path, O_WRONLY | O_CLOEXEC | O_LARGEFILE | O_DIRECT);
+        if (aio_fd >= 0) {
+            _direct = true;
+            _block_size = static_cast<unsigned int>(block_size);
+        }
+    }
+#endif
+    if (aio_fd < 0) {
+        aio_fd = dup(_fd);
+        if (aio_fd < 0) {
+            error("%s: Failed to duplicate fd: %s", path, strerror(errno));
+            return false;
+        }
+    }
+
+    if (!_file.open(aio_fd, true)) {
+        close(aio_fd);
+        error("%s: Failed to open file: %s",
+              path, _file.error_string().c_str());
+        return false;
+    }
+
+    if (!_aio.open(_file, WRITER_QUEUE_DEPTH)) {
+        error("%s: Failed to set up async I/O: %s",
+              path, _aio.error_string().c_str());
+        return false;
+    }
+
+    if (posix_memalign(reinterpret_cast<void **>(&_pool), WRITER_ALIGNMENT,
+                       WRITER_BUF_SIZE * WRITER_BUF_COUNT) != 0
+            || posix_memalign(reinterpret_cast<void **>(&_zeros),
+                              WRITER_ALIGNMENT, WRITER_BUF_SIZE) != 0) {
+        error("Failed to allocate write buffers");
+        return false;
+    }
+    memset(_zeros, 0, WRITER_BUF_SIZE);
+
+    for (size_t i = 0; i < WRITER_BUF_COUNT; ++i) {
+        _buffers[i].writer = this;
+        _buffers[i].data = _pool + i * WRITER_BUF_SIZE;
+        _free.push_back(&_buffers[i]);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Wait for all writes and set the final size of regular files
+ */
+bool ImageWriter::finish(uint64_t size)
 {
-    (void) file;
+    if (!wait_for_writes()) {
+        return false;
+    }
+
+    // Skipped ranges at the end of a regular file do not extend it
+    if (!_is_blkdev && ftruncate64(_fd, size) < 0) {
+        error("%s: Failed to truncate file: %s",
+              _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!_aio.close()) {
+        error("%s: Failed to close async I/O: %s",
+              _path.c_str(), _aio.error_string().c_str());
+        return false;
+    }
+
+    if (!_file.close()) {
+        error("%s: Failed to close file: %s",
+              _path.c_str(), _file.error_string().c_str());
+        return false;
+    }
+
+    int fd = _fd;
+    _fd = -1;
+    if (close(fd) < 0) {
+        error("%s: Failed to close file: %s", _path.c_str(), strerror(errno));
+        return false;
+    }
+
+    return !_failed;
+}
 
-    archive *a = static_cast<archive *>(userdata);
-    uint64_t total = 0;
+/*!
+ * \brief Record checksums of everything written from now on in \p digest
+ */
+void ImageWriter::set_digest(ImageDigest *digest)
+{
+    _digest = digest;
+    if (_digest) {
+        _digest->path = _path;
+        _digest->extents.clear();
+    }
+}
+
+/*!
+ * \brief Get a free buffer of WRITER_BUF_SIZE bytes
+ *
+ * Blocks until a previously submitted buffer has been written out.
+ *
+ * \return Buffer or nullptr if a write failed
+ */
+char * ImageWriter::get_buffer()
+{
+    while (_free.empty() && !_failed) {
+        size_t n;
+        if (!_aio.wait(n)) {
+            error("%s: Failed to wait for writes: %s",
+                  _path.c_str(), _aio.error_string().c_str());
+            return nullptr;
+        }
+    }
+
+    if (_failed) {
+        return nullptr;
+    }
+
+    Buffer *buf = _free.back();
+    _free.pop_back();
+    return buf->data;
+}
+
+/*!
+ * \brief Queue the first \p size bytes of a buffer from get_buffer()
+ *
+ * The buffer is returned to the pool once it has been written out.
+ */
+bool ImageWriter::write(char *data, uint64_t offset, size_t size)
+{
+    Buffer *buf = find_buffer(data);
+    buf->pending = 1;
+    buf->expected = 0;
+    buf->written = 0;
+
+    digest_update(_digest, offset, data, size);
+
+    // Split out runs of zero blocks. The split points stay aligned to
+    // WRITER_ALIGNMENT bytes from the start of the buffer.
+    size_t data_begin = 0;
+    size_t pos = 0;
+    bool ret = true;
+
+    while (ret && pos < size) {
+        size_t zero_end = pos;
+        while (zero_end + WRITER_ALIGNMENT <= size
+                && memcmp(data + zero_end, _zeros, WRITER_ALIGNMENT) == 0) {
+            zero_end += WRITER_ALIGNMENT;
+        }
+
+        if (zero_end - pos >= WRITER_ZERO_RUN_MIN) {
+            ret = submit(buf, offset + data_begin, data + data_begin,
+                         pos - data_begin)
+                    && zero_range(offset + pos, zero_end - pos);
+            data_begin = zero_end;
+            pos = zero_end;
+        } else {
+            pos = zero_end + WRITER_ALIGNMENT;
+        }
+    }
+
+    if (ret) {
+        ret = submit(buf, offset + data_begin, data + data_begin,
+                     size - data_begin);
+    }
+
+    // Drop the reference held while splitting
+    write_done(buf, {}, 0);
+
+    return ret && !_failed;
+}
+
+/*!
+ * \brief Zero out a byte range in the output file
+ *
+ * Block devices are zeroed with BLKZEROOUT, which lets the storage controller
+ * zero the range (eg. with a discard) without any data being transferred. If
+ * that is not supported, zeros are written manually. Regular files are
+ * truncated when opened, so nothing needs to be done for them.
+ */
+bool ImageWriter::zero(uint64_t offset, uint64_t size)
+{
+    if (_digest) {
+        for (uint64_t pos = 0; pos < size;) {
+            size_t n = std::min<uint64_t>(size - pos, WRITER_BUF_SIZE);
+            digest_update(_digest, offset + pos, _zeros, n);
+            pos += n;
+        }
+    }
+
+    return zero_range(offset, size);
+}
+
+bool ImageWriter::zero_range(uint64_t offset, uint64_t size)
+{
+    if (!_is_blkdev || size == 0) {
+        return true;
+    }
+
+    // Let the in-flight writes land before the kernel touches the device
+    if (!wait_for_writes()) {
+        return false;
+    }
+
+    uint64_t range[2] = { offset, size };
+    if (ioctl(_fd, BLKZEROOUT, &range) == 0) {
+        return true;
+    }
 
     while (size > 0) {
-        la_ssize_t n = archive_read_data(a, buf, size);
-        if (n < 0) {
-            error("libarchive: Failed to read data: %s",
-                  archive_error_string(a));
+        size_t to_write = std::min<uint64_t>(size, WRITER_BUF_SIZE);
+        if (!pwrite_fully(offset, _zeros, to_write)) {
             return false;
-        } else if (n == 0) {
-            break;
         }
+        offset += to_write;
+        size -= to_write;
+    }
+
+    return true;
+}
+
+void ImageWriter::write_done(void *userdata, std::error_code ec, size_t bytes)
+{
+    Buffer *buf = static_cast<Buffer *>(userdata);
+    ImageWriter *writer = buf->writer;
+
+    if (ec && !writer->_failed) {
+        error("%s: Failed to write file: %s",
+              writer->_path.c_str(), ec.message().c_str());
+        writer->_failed = true;
+    }
+
+    buf->written += bytes;
 
-        total += n;
-        size -= n;
-        buf = (char *) buf + n;
+    if (--buf->pending == 0) {
+        if (buf->written != buf->expected && !writer->_failed) {
+            error("%s: Failed to write file: %s",
+                  writer->_path.c_str(), strerror(ENOSPC));
+            writer->_failed = true;
+        }
+        writer->_free.push_back(buf);
+    }
+}
+
+ImageWriter::Buffer * ImageWriter::find_buffer(char *data)
+{
+    return &_buffers[static_cast<size_t>(data - _pool) / WRITER_BUF_SIZE];
+}
+
+bool ImageWriter::submit(Buffer *buf, uint64_t offset, const char *data,
+                         size_t size)
+{
+    if (size == 0) {
+        return true;
+    }
+
+    // O_DIRECT cannot handle unaligned writes. They should not happen with
+    // sane sparse images, so just write them synchronously through the page
+    // cache once the overlapping direct writes have finished.
+    if (_direct && (offset % _block_size != 0 || size % _block_size != 0)) {
+        return wait_for_writes() && pwrite_fully(offset, data, size);
+    }
+
+    ++buf->pending;
+    buf->expected += size;
+
+    if (!_aio.submit_write(offset, data, size, &write_done, buf)) {
+        --buf->pending;
+        buf->expected -= size;
+        error("%s: Failed to queue write: %s",
+              _path.c_str(), _aio.error_string().c_str());
+        return false;
     }
 
-    bytes_read = total;
     return true;
 }
 
+bool ImageWriter::pwrite_fully(uint64_t offset, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = pwrite64(_fd, data, size, static_cast<off64_t>(offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            error("%s: Failed to write file: %s",
+                  _path.c_str(), strerror(n < 0 ? errno : ENOSPC));
+            return false;
+        }
+
+        data += n;
+        offset += static_cast<uint64_t>(n);
+        size -= static_cast<size_t>(n);
+    }
+
+    return true;
+}
+
+bool ImageWriter::wait_for_writes()
+{
+    if (!_aio.drain()) {
+        error("%s: Failed to wait for writes: %s",
+              _path.c_str(), _aio.error_string().c_str());
+        return false;
+    }
+
+    return !_failed;
+}
+
 #if DEBUG_SKIP_FLASH_SYSTEM
 MB_UNUSED
 #endif
 static ExtractResult extract_sparse_file(const char *zip_filename,
-                                         const char *out_filename)
+                                         const char *out_filename,
+                                         size_t task, ImageDigest *digest)
 {
-    ScopedArchive a{archive_read_new(), &archive_read_free};
-    mb::CallbackFile file;
+    mb::ZipEntryFile reader;
+    mb::BufferedFile buffered_file;
     mb::sparse::SparseFile sparse_file;
-    mb::StandardFile out_file;
+    ImageWriter writer;
 
-    if (!a) {
-        error("Out of memory");
-        return ExtractResult::ERROR;
+    const mb::ZipEntry *entry = zip_index.find(zip_filename);
+    if (!entry) {
+        error("Failed to find %s in zip", zip_filename);
+        return ExtractResult::MISSING;
     }
 
-    if (!la_open_zip(a.get(), zip_file)) {
+    if (!reader.open(zip_index, *entry)) {
+        error("%s", reader.error_string().c_str());
         return ExtractResult::ERROR;
     }
 
-    archive_entry *entry;
-    auto result = la_skip_to(a.get(), zip_filename, &entry);
-    if (result != ExtractResult::OK) {
-        return result;
-    }
-
-    if (!file.open(nullptr, nullptr, &cb_zip_read, nullptr, nullptr, nullptr,
-                   a.get())) {
-        error("Failed to open sparse file in zip: %s",
-              file.error_string().c_str());
+    // Avoid going through the inflate stream for every small sparse header read
+    if (!buffered_file.open(&reader)) {
+        error("Failed to open buffered file: %s",
+              buffered_file.error_string().c_str());
         return ExtractResult::ERROR;
     }
 
-    if (!sparse_file.open(&file)) {
+    if (!sparse_file.open(&buffered_file)) {
         error("Failed to open sparse file: %s",
               sparse_file.error_string().c_str());
         return ExtractResult::ERROR;
     }
 
-    if (!out_file.open(out_filename, mb::FileOpenMode::WRITE_ONLY)) {
-        error("%s: Failed to open for writing: %s",
-              out_filename, out_file.error_string().c_str());
+    // Catch corrupted images while flashing instead of in a second pass
+    sparse_file.set_crc32_verification_enabled(true);
+
+    if (!writer.open(out_filename)) {
         return ExtractResult::ERROR;
     }
+    writer.set_digest(digest);
 
-    char buf[10240];
+    char *buf = nullptr;
+    size_t buf_used = 0;
+    uint64_t buf_offset = 0;
     size_t n;
-    bool ret;
     uint64_t cur_bytes = 0;
     uint64_t max_bytes = sparse_file.size();
     uint64_t old_bytes = 0;
 
-    set_progress(0);
-
-    while ((ret = sparse_file.read(buf, sizeof(buf), n)) && n > 0) {
+    auto update_progress = [&]{
         // Rate limit: update progress only after difference exceeds 0.1%
         double old_ratio = static_cast<double>(old_bytes) / max_bytes;
         double new_ratio = static_cast<double>(cur_bytes) / max_bytes;
         if (new_ratio - old_ratio >= 0.001) {
-            set_progress(new_ratio);
+            progress_update(task, new_ratio);
             old_bytes = cur_bytes;
         }
+    };
+
+    // Hand the filled part of the current buffer off to the writer
+    auto flush_buffer = [&]{
+        bool ret = buf_used == 0 || writer.write(buf, buf_offset, buf_used);
+        if (buf_used > 0) {
+            buf = nullptr;
+            buf_used = 0;
+        }
+        return ret;
+    };
 
-        char *out_ptr = buf;
-        size_t nwritten;
+    // Only raw chunks and non-zero fill chunks need to be written. Zero fill
+    // chunks are zeroed by the kernel and "don't care" chunks are skipped
+    // entirely.
+    while (true) {
+        mb::sparse::SparseChunk chunk;
+        bool found;
 
-        while (n > 0) {
-            if (!out_file.write(buf, n, nwritten)) {
-                error("%s: Failed to write file: %s",
-                      out_filename, out_file.error_string().c_str());
+        if (!sparse_file.current_chunk(chunk, found)) {
+            error("Failed to read sparse file %s: %s",
+                  zip_filename, sparse_file.error_string().c_str());
+            return ExtractResult::ERROR;
+        } else if (!found) {
+            break;
+        }
+
+        if (chunk.type == mb::sparse::SparseChunkType::Raw
+                || (chunk.type == mb::sparse::SparseChunkType::Fill
+                        && chunk.fill_val != 0)) {
+            while (cur_bytes < chunk.end) {
+                // Writes are positional, so a buffer only holds one
+                // contiguous range
+                if (buf && buf_offset + buf_used != cur_bytes
+                        && !flush_buffer()) {
+                    return ExtractResult::ERROR;
+                }
+                if (!buf) {
+                    buf = writer.get_buffer();
+                    if (!buf) {
+                        return ExtractResult::ERROR;
+                    }
+                    buf_offset = cur_bytes;
+                }
+
+                size_t to_read = std::min<uint64_t>(
+                        WRITER_BUF_SIZE - buf_used, chunk.end - cur_bytes);
+
+                if (!sparse_file.read(buf + buf_used, to_read, n)) {
+                    error("Failed to read sparse file %s: %s",
+                          zip_filename, sparse_file.error_string().c_str());
+                    return ExtractResult::ERROR;
+                } else if (n == 0) {
+                    error("Sparse file %s ended unexpectedly", zip_filename);
+                    return ExtractResult::ERROR;
+                }
+
+                buf_used += n;
+                cur_bytes += n;
+
+                if (buf_used == WRITER_BUF_SIZE && !flush_buffer()) {
+                    return ExtractResult::ERROR;
+                }
+
+                update_progress();
+            }
+        } else {
+            if (chunk.type == mb::sparse::SparseChunkType::Fill
+                    && !writer.zero(cur_bytes, chunk.end - cur_bytes)) {
                 return ExtractResult::ERROR;
             }
 
-            n -= nwritten;
-            out_ptr += nwritten;
-            cur_bytes += nwritten;
+            if (!sparse_file.seek(chunk.end, SEEK_SET, nullptr)) {
+                error("Failed to seek sparse file %s: %s",
+                      zip_filename, sparse_file.error_string().c_str());
+                return ExtractResult::ERROR;
+            }
+
+            cur_bytes = chunk.end;
+            update_progress();
         }
     }
-    if (!ret) {
-        error("Failed to read sparse file %s: %s",
-              zip_filename, sparse_file.error_string().c_str());
-        return ExtractResult::ERROR;
-    }
 
-    if (!out_file.close()) {
-        error("%s: Failed to close file: %s",
-              out_filename, out_file.error_string().c_str());
+    if (!flush_buffer() || !writer.finish(max_bytes)) {
         return ExtractResult::ERROR;
     }
 
+    progress_update(task, 1);
     return ExtractResult::OK;
 }
 
 static ExtractResult extract_raw_file(const char *zip_filename,
-                                      const char *out_filename)
+                                      const char *out_filename,
+                                      size_t task, ImageDigest *digest)
 {
-    ScopedArchive a{archive_read_new(), &archive_read_free};
-    char buf[10240];
-    la_ssize_t n;
+    mb::ZipEntryFile reader;
+    std::vector<char> buf(1024 * 1024);
+    size_t n;
     int fd;
     uint64_t cur_bytes = 0;
     uint64_t max_bytes = 0;
@@ -475,22 +1037,18 @@ static ExtractResult extract_raw_file(const char *zip_filename,
     double old_ratio;
     double new_ratio;
 
-    if (!a) {
-        error("Out of memory");
-        return ExtractResult::ERROR;
+    const mb::ZipEntry *entry = zip_index.find(zip_filename);
+    if (!entry) {
+        error("Failed to find %s in zip", zip_filename);
+        return ExtractResult::MISSING;
     }
 
-    if (!la_open_zip(a.get(), zip_file)) {
+    if (!reader.open(zip_index, *entry)) {
+        error("%s", reader.error_string().c_str());
         return ExtractResult::ERROR;
     }
 
-    archive_entry *entry;
-    auto result = la_skip_to(a.get(), zip_filename, &entry);
-    if (result != ExtractResult::OK) {
-        return result;
-    }
-
-    max_bytes = archive_entry_size(entry);
+    max_bytes = entry->uncompressed_size;
 
     fd = open64(out_filename,
                 O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC | O_LARGEFILE, 0600);
@@ -503,22 +1061,38 @@ static ExtractResult extract_raw_file(const char *zip_filename,
         close(fd);
     });
 
-    set_progress(0);
+    if (digest) {
+        digest->path = out_filename;
+        digest->extents.clear();
+    }
+
+    while (true) {
+        if (!reader.read(buf.data(), buf.size(), n)) {
+            error("%s: Failed to read %s: %s",
+                  zip_file, zip_filename, reader.error_string().c_str());
+            return ExtractResult::ERROR;
+        } else if (n == 0) {
+            break;
+        }
+
+        digest_update(digest, cur_bytes, buf.data(), n);
 
-    while ((n = archive_read_data(a.get(), buf, sizeof(buf))) > 0) {
         // Rate limit: update progress only after difference exceeds 0.1%
         old_ratio = (double) old_bytes / max_bytes;
         new_ratio = (double) cur_bytes / max_bytes;
         if (new_ratio - old_ratio >= 0.001) {
-            set_progress(new_ratio);
+            progress_update(task, new_ratio);
             old_bytes = cur_bytes;
         }
 
-        char *out_ptr = buf;
+        const char *out_ptr = buf.data();
         ssize_t nwritten;
 
-        do {
+        while (n > 0) {
             if ((nwritten = write(fd, out_ptr, n)) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
                 error("%s: Failed to write: %s",
                       out_filename, strerror(errno));
                 return ExtractResult::ERROR;
@@ -526,17 +1100,102 @@ static ExtractResult extract_raw_file(const char *zip_filename,
 
             n -= nwritten;
             out_ptr += nwritten;
-        } while (n > 0);
-    }
-    if (n != 0) {
-        error("libarchive: %s: Failed to read %s: %s",
-              zip_file, zip_filename, archive_error_string(a.get()));
-        return ExtractResult::ERROR;
+            cur_bytes += nwritten;
+        }
     }
 
+    progress_update(task, 1);
     return ExtractResult::OK;
 }
 
+/*!
+ * \brief Re-read a flashed image and compare it against its digest
+ *
+ * The data is read with O_DIRECT if possible, so that it comes from the
+ * storage device instead of the page cache.
+ */
+static bool verify_image(const ImageDigest &digest)
+{
+    const char *path = digest.path.c_str();
+    bool direct = true;
+
+    int fd = open64(path, O_RDONLY | O_CLOEXEC | O_LARGEFILE | O_DIRECT);
+    if (fd < 0) {
+        direct = false;
+        fd = open64(path, O_RDONLY | O_CLOEXEC | O_LARGEFILE);
+    }
+    if (fd < 0) {
+        error("%s: Failed to open for reading: %s", path, strerror(errno));
+        return false;
+    }
+
+    auto close_fd = mb::util::finally([fd]{
+        close(fd);
+    });
+
+    if (!direct) {
+        // Drop cached pages so the data is read back from storage
+        struct stat sb;
+        if (fstat(fd, &sb) == 0 && S_ISBLK(sb.st_mode)) {
+            ioctl(fd, BLKFLSBUF, 0);
+        } else {
+            posix_fadvise64(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+    }
+
+    // Pooled buffers are page aligned, which satisfies WRITER_ALIGNMENT
+    mb::PooledBuffer pooled_buf(VERIFY_BUF_SIZE);
+    if (!pooled_buf) {
+        error("Failed to allocate verification buffer");
+        return false;
+    }
+
+    char *buf = static_cast<char *>(pooled_buf.data());
+
+    for (auto const &extent : digest.extents) {
+        // Direct reads must start and end on aligned offsets, so read the
+        // surrounding blocks and only checksum the extent itself
+        uint64_t end = extent.offset + extent.size;
+        uint64_t pos = extent.offset / WRITER_ALIGNMENT * WRITER_ALIGNMENT;
+        uint64_t read_end = (end + WRITER_ALIGNMENT - 1)
+                / WRITER_ALIGNMENT * WRITER_ALIGNMENT;
+        uLong crc = crc32(0, nullptr, 0);
+
+        while (pos < end) {
+            size_t to_read = std::min<uint64_t>(read_end - pos,
+                                                VERIFY_BUF_SIZE);
+            ssize_t n = pread64(fd, buf, to_read, static_cast<off64_t>(pos));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0) {
+                error("%s: Failed to read: %s", path, strerror(errno));
+                return false;
+            } else if (n == 0) {
+                error("%s: Unexpected EOF at offset %" PRIu64, path, pos);
+                return false;
+            }
+
+            uint64_t hash_begin = std::max(pos, extent.offset);
+            uint64_t hash_end = std::min(pos + n, end);
+            if (hash_end > hash_begin) {
+                crc = crc32(crc, reinterpret_cast<Bytef *>(
+                                buf + (hash_begin - pos)),
+                            static_cast<uInt>(hash_end - hash_begin));
+            }
+
+            pos += n;
+        }
+
+        if (crc != extent.crc) {
+            error("%s: Verification failed for %" PRIu64 " bytes at offset "
+                  "%" PRIu64, path, extent.size, extent.offset);
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static bool copy_dir_if_exists(const char *source_dir,
                                const char *target_dir)
 {
@@ -727,21 +1386,38 @@ static bool flash_csc_zip()
     return true;
 }
 
-static ExtractResult flash_csc()
+/*!
+ * \brief Extract the cache image and fuse-sparse to /tmp
+ *
+ * This does not depend on the system partition, so it runs while the system
+ * image is being flashed.
+ */
+static ExtractResult extract_csc_files(size_t cache_task, size_t fuse_task)
 {
-    int status;
     ExtractResult result;
 
-    result = extract_raw_file(CACHE_SPARSE_FILE, TEMP_CACHE_SPARSE_FILE);
+    result = extract_raw_file(CACHE_SPARSE_FILE, TEMP_CACHE_SPARSE_FILE,
+                              cache_task, nullptr);
     if (result != ExtractResult::OK) {
         return result;
     }
 
-    result = extract_raw_file(FUSE_SPARSE_FILE, TEMP_FUSE_SPARSE_FILE);
+    result = extract_raw_file(FUSE_SPARSE_FILE, TEMP_FUSE_SPARSE_FILE,
+                              fuse_task, nullptr);
     if (result != ExtractResult::OK) {
         return ExtractResult::ERROR;
     }
 
+    return ExtractResult::OK;
+}
+
+/*!
+ * \brief Apply the CSC from the extracted cache image to the flashed system
+ */
+static ExtractResult flash_csc()
+{
+    int status;
+
     if (chmod(TEMP_FUSE_SPARSE_FILE, 0700) < 0) {
         error("%s: Failed to chmod: %s",
               TEMP_FUSE_SPARSE_FILE, strerror(errno));
@@ -817,6 +1493,106 @@ static ExtractResult flash_csc()
     return ExtractResult::OK;
 }
 
+/*!
+ * \brief Get the disk that a block device belongs to
+ *
+ * Partitions of the same disk (eg. mmcblk0p*) map to the same disk, while
+ * partitions on different UFS LUNs do not.
+ *
+ * \return sysfs path of the disk or an empty string if it cannot be determined
+ */
+static std::string get_backing_disk(const std::string &path)
+{
+    struct stat sb;
+    if (stat(path.c_str(), &sb) < 0 || !S_ISBLK(sb.st_mode)) {
+        return {};
+    }
+
+    char sysfs_path[64];
+    snprintf(sysfs_path, sizeof(sysfs_path), "/sys/dev/block/%u:%u",
+             static_cast<unsigned int>(major(sb.st_rdev)),
+             static_cast<unsigned int>(minor(sb.st_rdev)));
+
+    char *resolved = realpath(sysfs_path, nullptr);
+    if (!resolved) {
+        return {};
+    }
+
+    std::string disk(resolved);
+    free(resolved);
+
+    // Partitions have a "partition" attribute and are children of their disk
+    if (access((disk + "/partition").c_str(), F_OK) == 0) {
+        disk.resize(disk.rfind('/'));
+    }
+
+    return disk;
+}
+
+struct FlashTask
+{
+    std::function<void()> func;
+    // Disk the task writes to. Tasks with the same disk run one after
+    // another.
+    std::string disk;
+};
+
+/*!
+ * \brief Run flashing tasks concurrently
+ *
+ * There is one thread per disk. Tasks that write to the same disk (or to
+ * unknown disks) run sequentially since they would just compete for the same
+ * storage.
+ */
+static void run_flash_tasks(const std::vector<FlashTask> &tasks)
+{
+    std::map<std::string, std::vector<const FlashTask *>> groups;
+    std::vector<std::thread> threads;
+
+    for (auto const &task : tasks) {
+        groups[task.disk].push_back(&task);
+    }
+
+    for (auto const &group : groups) {
+        const std::vector<const FlashTask *> *group_tasks = &group.second;
+
+        threads.emplace_back([group_tasks]{
+            for (const FlashTask *task : *group_tasks) {
+                task->func();
+            }
+        });
+    }
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+/*!
+ * \brief Verify flashed images concurrently
+ *
+ * Unlike flashing, each image is read back on its own thread, even if several
+ * images are on the same disk.
+ */
+static bool verify_images(const std::vector<const ImageDigest *> &digests)
+{
+    std::vector<FlashTask> tasks;
+    std::vector<char> results(digests.size());
+
+    for (size_t i = 0; i < digests.size(); ++i) {
+        const ImageDigest *digest = digests[i];
+        char *result = &results[i];
+        tasks.push_back({[digest, result]{
+            *result = verify_image(*digest);
+        }, digest->path});
+    }
+
+    run_flash_tasks(tasks);
+
+    return std::all_of(results.begin(), results.end(),
+                       [](char result) { return result; });
+}
+
 static bool flash_zip()
 {
     struct stat sb;
@@ -837,6 +1613,11 @@ static bool flash_zip()
         return false;
     }
 
+    // Find all entries in the zip in one pass
+    if (!index_zip()) {
+        return false;
+    }
+
     // Load block device info
     if (!load_block_devs()) {
         return false;
@@ -848,17 +1629,77 @@ static bool flash_zip()
         return false;
     }
 
-#if !DEBUG_SKIP_FLASH_SYSTEM || !DEBUG_SKIP_FLASH_CSC || !DEBUG_SKIP_FLASH_BOOT
-    ExtractResult result;
+    // The system image, the cache image (extracted to /tmp) and the boot image
+    // are written concurrently if they are on different disks. The CSC is
+    // applied afterwards since it is copied into the flashed system partition.
+    std::vector<FlashTask> tasks;
+#if !DEBUG_SKIP_FLASH_SYSTEM
+    ExtractResult system_result;
 #endif
+#if !DEBUG_SKIP_FLASH_CSC
+    ExtractResult csc_result;
+#endif
+#if !DEBUG_SKIP_FLASH_BOOT
+    ExtractResult boot_result;
+#endif
+
+    // Zips can opt into reading back the flashed partitions. The checksums
+    // are computed while writing, so this only costs one read pass.
+    bool verify = zip_index.find(VERIFY_FLASH_FILE) != nullptr;
+    ImageDigest system_digest;
+    ImageDigest boot_digest;
+    std::vector<const ImageDigest *> digests;
+
+    progress_reset();
 
-    // Flash system.img.ext4
 #if DEBUG_SKIP_FLASH_SYSTEM
     ui_print("[DEBUG] Skipping flashing of system image");
 #else
     ui_print("Flashing system image");
-    result = extract_sparse_file(SYSTEM_SPARSE_FILE, system_block_dev.c_str());
-    switch (result) {
+    {
+        size_t task = progress_add_task(zip_entry_size(SYSTEM_SPARSE_FILE));
+        ImageDigest *digest = verify ? &system_digest : nullptr;
+        tasks.push_back({[task, digest, &system_result]{
+            system_result = extract_sparse_file(
+                    SYSTEM_SPARSE_FILE, system_block_dev.c_str(), task,
+                    digest);
+        }, get_backing_disk(system_block_dev)});
+    }
+#endif
+
+#if DEBUG_SKIP_FLASH_CSC
+    ui_print("[DEBUG] Skipping flashing of CSC");
+#else
+    ui_print("Flashing CSC from cache image");
+    {
+        size_t cache_task = progress_add_task(
+                zip_entry_size(CACHE_SPARSE_FILE));
+        size_t fuse_task = progress_add_task(
+                zip_entry_size(FUSE_SPARSE_FILE));
+        tasks.push_back({[cache_task, fuse_task, &csc_result]{
+            csc_result = extract_csc_files(cache_task, fuse_task);
+        }, "/tmp"});
+    }
+#endif
+
+#if DEBUG_SKIP_FLASH_BOOT
+    ui_print("[DEBUG] Skipping flashing of boot image");
+#else
+    ui_print("Flashing boot image");
+    {
+        size_t task = progress_add_task(zip_entry_size(BOOT_IMAGE_FILE));
+        ImageDigest *digest = verify ? &boot_digest : nullptr;
+        tasks.push_back({[task, digest, &boot_result]{
+            boot_result = extract_raw_file(
+                    BOOT_IMAGE_FILE, boot_block_dev.c_str(), task, digest);
+        }, get_backing_disk(boot_block_dev)});
+    }
+#endif
+
+    run_flash_tasks(tasks);
+
+#if !DEBUG_SKIP_FLASH_SYSTEM
+    switch (system_result) {
     case ExtractResult::ERROR:
         ui_print("Failed to flash system image");
         return false;
@@ -867,17 +1708,39 @@ static bool flash_zip()
         break;
     case ExtractResult::OK:
         ui_print("Successfully flashed system image");
+        if (verify) {
+            digests.push_back(&system_digest);
+        }
         break;
     }
 #endif
 
-    // Flash CSC from cache.img.ext4
-#if DEBUG_SKIP_FLASH_CSC
-    ui_print("[DEBUG] Skipping flashing of CSC");
-#else
-    ui_print("Flashing CSC from cache image");
-    result = flash_csc();
-    switch (result) {
+#if !DEBUG_SKIP_FLASH_BOOT
+    if (boot_result != ExtractResult::OK) {
+        ui_print("Failed to flash boot image");
+        return false;
+    }
+    ui_print("Successfully flashed boot image");
+    if (verify) {
+        digests.push_back(&boot_digest);
+    }
+#endif
+
+    // The CSC modifies the system partition, so verify before applying it
+    if (!digests.empty()) {
+        ui_print("Verifying flashed images");
+        if (!verify_images(digests)) {
+            ui_print("Failed to verify flashed images");
+            return false;
+        }
+        ui_print("Successfully verified flashed images");
+    }
+
+#if !DEBUG_SKIP_FLASH_CSC
+    if (csc_result == ExtractResult::OK) {
+        csc_result = flash_csc();
+    }
+    switch (csc_result) {
     case ExtractResult::ERROR:
         ui_print("Failed to flash CSC");
         return false;
@@ -890,19 +1753,6 @@ static bool flash_zip()
     }
 #endif
 
-    // Flash boot.img
-#if DEBUG_SKIP_FLASH_BOOT
-    ui_print("[DEBUG] Skipping flashing of boot image");
-#else
-    ui_print("Flashing boot image");
-    result = extract_raw_file(BOOT_IMAGE_FILE, boot_block_dev.c_str());
-    if (result != ExtractResult::OK) {
-        ui_print("Failed to flash boot image");
-        return false;
-    }
-    ui_print("Successfully flashed boot image");
-#endif
-
     ui_print("---");
     ui_print("Flashing completed. The bootloader");
     ui_print("and non-system partitions were left");
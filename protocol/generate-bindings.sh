@@ -13,8 +13,12 @@ files=(
     v3/file_selinux_get_label.fbs
     v3/file_selinux_set_label.fbs
     v3/file_stat.fbs
+    v3/file_stream_read.fbs
+    v3/file_stream_write.fbs
     v3/file_write.fbs
+    v3/job.fbs
     v3/mb_get_booted_rom_id.fbs
+    v3/mb_get_daemon_stats.fbs
     v3/mb_get_installed_roms.fbs
     v3/mb_get_packages_count.fbs
     v3/mb_get_version.fbs
@@ -25,6 +29,7 @@ files=(
     v3/path_copy.fbs
     v3/path_delete.fbs
     v3/path_get_directory_size.fbs
+    v3/path_list_directory.fbs
     v3/path_mkdir.fbs
     v3/path_readlink.fbs
     v3/path_selinux_get_label.fbs
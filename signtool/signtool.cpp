@@ -17,81 +17,98 @@
  * along with DualBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include <openssl/crypto.h>
 #include <openssl/err.h>
 
 // libmbsign
 #include "mbsign/mbsign.h"
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L && !defined(OPENSSL_IS_BORINGSSL)
+#  define NEED_OPENSSL_LOCKS 1
+#endif
+
 static void openssl_log_errors()
 {
     ERR_print_errors_fp(stderr);
 }
 
+#ifdef NEED_OPENSSL_LOCKS
+static std::vector<std::mutex> *openssl_locks;
+
+static void openssl_locking_cb(int mode, int n, const char *file, int line)
+{
+    (void) file;
+    (void) line;
+
+    if (mode & CRYPTO_LOCK) {
+        (*openssl_locks)[n].lock();
+    } else {
+        (*openssl_locks)[n].unlock();
+    }
+}
+
+/*!
+ * \brief Let OpenSSL <1.1.0 (which has no internal locking) use the private
+ *        key from multiple threads
+ */
+static void openssl_init_locks()
+{
+    openssl_locks = new std::vector<std::mutex>(CRYPTO_num_locks());
+    CRYPTO_set_locking_callback(&openssl_locking_cb);
+}
+#endif
+
 static void usage(FILE *stream)
 {
     fprintf(stream,
-            "Usage: signtool <PKCS12 file> <input file> <output signature file>\n\n"
+            "Usage: signtool [--pem] <key file> <input file> <output signature file>\n"
+            "       signtool [--pem] --batch [-j <jobs>] <key file> <input file|@manifest>...\n\n"
+            "The key file is a PKCS12 keystore or, with --pem, a PEM private key.\n"
+            "The signature format is chosen based on the key type. Ed25519 keys\n"
+            "produce signatures that are much faster to verify than RSA ones.\n\n"
+            "In batch mode, the private key is loaded once and each input file\n"
+            "is signed to <input file>.sig using <jobs> threads (defaults to the\n"
+            "number of CPUs). A manifest lists one input file per line.\n\n"
+            "The key passphrase is read from the MBSIGN_PASSPHRASE environment\n"
+            "variable. It is optional for unencrypted PEM keys.\n\n"
             "NOTE: This is not a general purpose tool for signing files!\n"
             "It is only meant for use with mbtool.\n");
 }
 
-int main(int argc, char *argv[])
+static bool sign_file(EVP_PKEY *private_key, const char *file_input,
+                      const char *file_output)
 {
-    const char *file_pkcs12;
-    const char *file_input;
-    const char *file_output;
-    EVP_PKEY *private_key = nullptr;
-    const char *pass;
-    BIO *bio_data_in = nullptr;
-    BIO *bio_sig_out = nullptr;
+    BIO *bio_data_in;
+    BIO *bio_sig_out;
     bool ret;
 
-    ERR_load_crypto_strings();
-    OpenSSL_add_all_algorithms();
-
-    if (argc != 4) {
-        usage(stderr);
-        return EXIT_FAILURE;
-    }
-
-    file_pkcs12 = argv[1];
-    file_input = argv[2];
-    file_output = argv[3];
-
-    pass = getenv("MBSIGN_PASSPHRASE");
-    if (!pass) {
-        fprintf(stderr,
-                "The MBSIGN_PASSPHRASE environment variable is not set\n");
-        goto error;
-    }
-
-    private_key = mb::sign::load_private_key_from_file(
-            file_pkcs12, mb::sign::KEY_FORMAT_PKCS12, pass);
-    if (!private_key) {
-        goto error;
-    }
-
     bio_data_in = BIO_new_file(file_input, "rb");
     if (!bio_data_in) {
         fprintf(stderr, "%s: Failed to open input file\n", file_input);
         openssl_log_errors();
-        goto error;
+        return false;
     }
     bio_sig_out = BIO_new_file(file_output, "wb");
     if (!bio_sig_out) {
         fprintf(stderr, "%s: Failed to open output file\n", file_output);
         openssl_log_errors();
-        goto error;
+        BIO_free(bio_data_in);
+        return false;
     }
 
     ret = mb::sign::sign_data(bio_data_in, bio_sig_out, private_key);
 
-    EVP_PKEY_free(private_key);
-
     if (!BIO_free(bio_data_in)) {
         fprintf(stderr, "%s: Failed to close input file\n", file_input);
         openssl_log_errors();
@@ -103,11 +120,156 @@ int main(int argc, char *argv[])
         ret = false;
     }
 
-    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+    return ret;
+}
+
+static bool read_manifest(const char *path, std::vector<std::string> &files)
+{
+    std::ifstream stream(path);
+    if (!stream) {
+        fprintf(stderr, "%s: Failed to open manifest\n", path);
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(stream, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            files.push_back(std::move(line));
+        }
+    }
+
+    if (stream.bad()) {
+        fprintf(stderr, "%s: Failed to read manifest\n", path);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Sign files in parallel with a single private key
+ *
+ * Each thread takes the next unsigned file from the list until none are left.
+ * All files are attempted even if some of them fail.
+ */
+static bool sign_files(EVP_PKEY *private_key,
+                       const std::vector<std::string> &files,
+                       unsigned int jobs)
+{
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::vector<std::thread> threads;
+
+    auto worker = [&]{
+        size_t i;
+        while ((i = next.fetch_add(1)) < files.size()) {
+            std::string output = files[i] + ".sig";
+            if (!sign_file(private_key, files[i].c_str(), output.c_str())) {
+                fprintf(stderr, "%s: Failed to sign file\n", files[i].c_str());
+                failed = true;
+            }
+        }
+    };
+
+    jobs = static_cast<unsigned int>(
+            std::min<size_t>(std::max(jobs, 1u), files.size()));
+
+    for (unsigned int i = 1; i < jobs; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : threads) {
+        t.join();
+    }
+
+    return !failed;
+}
+
+int main(int argc, char *argv[])
+{
+    bool batch = false;
+    unsigned int jobs = std::thread::hardware_concurrency();
+    std::vector<std::string> files;
+    int key_format = mb::sign::KEY_FORMAT_PKCS12;
+    const char *file_key;
+    EVP_PKEY *private_key;
+    const char *pass;
+    int i = 1;
+    bool ret;
+
+    ERR_load_crypto_strings();
+    OpenSSL_add_all_algorithms();
+
+    if (i < argc && strcmp(argv[i], "--pem") == 0) {
+        key_format = mb::sign::KEY_FORMAT_PEM;
+        ++i;
+    }
+
+    if (i < argc && strcmp(argv[i], "--batch") == 0) {
+        batch = true;
+        ++i;
+
+        if (i + 1 < argc && strcmp(argv[i], "-j") == 0) {
+            char *end;
+            unsigned long value = strtoul(argv[i + 1], &end, 10);
+            if (*argv[i + 1] == '\0' || *end != '\0' || value == 0
+                    || value > 256) {
+                fprintf(stderr, "Invalid number of jobs: %s\n", argv[i + 1]);
+                return EXIT_FAILURE;
+            }
+            jobs = static_cast<unsigned int>(value);
+            i += 2;
+        }
+
+        if (argc - i < 2) {
+            usage(stderr);
+            return EXIT_FAILURE;
+        }
+    } else if (argc - i != 3) {
+        usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    file_key = argv[i++];
+
+    if (batch) {
+        for (; i < argc; ++i) {
+            if (argv[i][0] == '@') {
+                if (!read_manifest(argv[i] + 1, files)) {
+                    return EXIT_FAILURE;
+                }
+            } else {
+                files.push_back(argv[i]);
+            }
+        }
+    }
+
+    pass = getenv("MBSIGN_PASSPHRASE");
+    if (!pass && key_format == mb::sign::KEY_FORMAT_PKCS12) {
+        fprintf(stderr,
+                "The MBSIGN_PASSPHRASE environment variable is not set\n");
+        return EXIT_FAILURE;
+    }
+
+    private_key = mb::sign::load_private_key_from_file(
+            file_key, key_format, pass);
+    if (!private_key) {
+        return EXIT_FAILURE;
+    }
+
+    if (batch) {
+#ifdef NEED_OPENSSL_LOCKS
+        openssl_init_locks();
+#endif
+        ret = sign_files(private_key, files, jobs);
+    } else {
+        ret = sign_file(private_key, argv[i], argv[i + 1]);
+    }
 
-error:
     EVP_PKEY_free(private_key);
-    BIO_free(bio_data_in);
-    BIO_free(bio_sig_out);
-    return EXIT_FAILURE;
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }